@@ -16,6 +16,8 @@
 
 #include <keymaster/android_keymaster.h>
 
+#include <algorithm>
+#include <atomic>
 #include <utility>
 #include <vector>
 
@@ -30,28 +32,35 @@
 #include <keymaster/UniquePtr.h>
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/attestation_context.h>
+#include <keymaster/confirmation_verifier.h>
 #include <keymaster/cppcose/cppcose.h>
 #include <keymaster/key.h>
 #include <keymaster/key_blob_utils/ae.h>
 #include <keymaster/key_factory.h>
+#include <keymaster/key_usage_stats.h>
 #include <keymaster/keymaster_context.h>
 #include <keymaster/km_date.h>
+#include <keymaster/km_openssl/attestation_record.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/logger.h>
 #include <keymaster/operation.h>
+#include <keymaster/operation_metrics.h>
 #include <keymaster/operation_table.h>
 #include <keymaster/remote_provisioning_utils.h>
+#include <keymaster/request_recorder.h>
 #include <keymaster/secure_deletion_secret_storage.h>
+#include <keymaster/trace.h>
 
 namespace keymaster {
 
 namespace {
 
-using cppcose::constructCoseEncrypt;
 using cppcose::constructCoseMac0;
+using cppcose::coseEncryptEncodedSize;
 using cppcose::CoseKey;
 using cppcose::EC2;
+using cppcose::encodeCoseEncrypt;
 using cppcose::ES256;
 using cppcose::generateCoseMac0Mac;
 using cppcose::kAesGcmNonceLength;
@@ -104,6 +113,28 @@ keymaster_error_t CheckVersionInfo(const AuthorizationSet& tee_enforced,
     return KM_ERROR_OK;
 }
 
+// Presents a key blob owned by a request as a KeymasterKeyBlob, without copying it, for the
+// context methods that only read their blob argument.  The request must outlive it.
+class BorrowedKeyBlob {
+  public:
+    explicit BorrowedKeyBlob(const keymaster_key_blob_t& blob) {
+        blob_.key_material = blob.key_material;
+        blob_.key_material_size = blob.key_material_size;
+    }
+    ~BorrowedKeyBlob() {
+        // Detach, so that the blob doesn't wipe and free memory it doesn't own.
+        blob_.key_material = nullptr;
+        blob_.key_material_size = 0;
+    }
+    BorrowedKeyBlob(const BorrowedKeyBlob&) = delete;
+    void operator=(const BorrowedKeyBlob&) = delete;
+
+    operator const KeymasterKeyBlob&() const { return blob_; }
+
+  private:
+    KeymasterKeyBlob blob_;
+};
+
 const keymaster_key_param_t kKeyMintEcdsaP256Params[] = {
     Authorization(TAG_PURPOSE, KM_PURPOSE_ATTEST_KEY),
     Authorization(TAG_ALGORITHM, KM_ALGORITHM_EC), Authorization(TAG_KEY_SIZE, 256),
@@ -112,12 +143,22 @@ const keymaster_key_param_t kKeyMintEcdsaP256Params[] = {
     // The certificate generated by KM will be discarded, these values don't matter.
     Authorization(TAG_CERTIFICATE_NOT_BEFORE, 0), Authorization(TAG_CERTIFICATE_NOT_AFTER, 0)};
 
+// The all-zero key that test mode MACs public keys with, keyed once.  Null if keying failed.
+const cppcose::HmacSha256Key* testModeMacKey() {
+    static const cppcose::HmacSha256Key* key = [] {
+        auto created = cppcose::HmacSha256Key::create(cppcose::bytevec(32));
+        return created ? new (std::nothrow) cppcose::HmacSha256Key(created.moveValue()) : nullptr;
+    }();
+    return key;
+}
+
 cppcose::HmacSha256Function getMacFunction(bool test_mode,
                                            RemoteProvisioningContext* rem_prov_ctx) {
     if (test_mode) {
-        return [](const cppcose::bytevec& input) {
-            const cppcose::bytevec macKey(32);
-            return cppcose::generateHmacSha256(macKey, input);
+        return [](const cppcose::bytevec& input) -> cppcose::ErrMsgOr<cppcose::HmacSha256> {
+            auto macKey = testModeMacKey();
+            if (!macKey) return "Failed to key test mode MAC.";
+            return macKey->mac(input);
         };
     }
 
@@ -130,26 +171,294 @@ cppcose::HmacSha256Function getMacFunction(bool test_mode,
     };
 }
 
-std::pair<const uint8_t*, size_t> blob2Pair(const keymaster_blob_t& blob) {
-    return {blob.data, blob.data_length};
-}
-
 constexpr int kMaxChallengeSizeV2 = 64;
 constexpr int kP256AffinePointSize = 32;
-constexpr int kRoTVersion1 = 40001;
+
+// Holds an operation checked out of the table for the duration of one call.
+class CheckedOutOperation {
+  public:
+    CheckedOutOperation(OperationTable* table, keymaster_operation_handle_t op_handle)
+        : table_(table), operation_(table->Checkout(op_handle, &lease_)) {}
+    ~CheckedOutOperation() { table_->Checkin(&lease_); }
+
+    Operation* get() const { return operation_; }
+
+  private:
+    OperationTable* table_;
+    OperationTable::Lease lease_;
+    Operation* operation_;
+};
+
+// Holds any number of operations checked out of the table until it goes out of scope.
+class CheckedOutOperations {
+  public:
+    explicit CheckedOutOperations(OperationTable* table) : table_(table) {}
+    ~CheckedOutOperations() {
+        for (OperationTable::Lease& lease : leases_) table_->Checkin(&lease);
+    }
+
+    // Checks out |op_handle| without waiting.  Returns null, setting |*busy| if another call has
+    // it checked out, if the operation can't be checked out.
+    Operation* TryCheckout(keymaster_operation_handle_t op_handle, bool* busy) {
+        leases_.emplace_back();
+        return table_->TryCheckout(op_handle, &leases_.back(), busy);
+    }
+
+  private:
+    OperationTable* table_;
+    std::vector<OperationTable::Lease> leases_;
+};
+
+// Buffers the confirmed message for KeymasterContext::CheckConfirmationToken(), for contexts that
+// don't create their own verifiers.
+class BufferedConfirmationVerifier : public ConfirmationVerifier {
+  public:
+    explicit BufferedConfirmationVerifier(const KeymasterContext* context)
+        : context_(context),
+          message_(kConfirmationTokenMessageTag, kConfirmationTokenMessageTagSize) {}
+
+    bool initialized() const { return message_.available_read() != 0; }
+
+    keymaster_error_t Verify(const uint8_t confirmation_token[kConfirmationTokenSize]) override {
+        return context_->CheckConfirmationToken(message_.begin(), message_.available_read(),
+                                                confirmation_token);
+    }
+
+    size_t MemoryFootprint() const override { return message_.buffer_size(); }
+
+  protected:
+    keymaster_error_t Update(const uint8_t* data, size_t data_length) override {
+        if (!message_.reserve(data_length)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        message_.write(data, data_length);
+        return KM_ERROR_OK;
+    }
+
+  private:
+    const KeymasterContext* context_;
+    Buffer message_;
+};
+
+keymaster_error_t CreateConfirmationVerifier(const KeymasterContext* context,
+                                             UniquePtr<ConfirmationVerifier>* verifier) {
+    keymaster_error_t error = context->CreateConfirmationVerifier(verifier);
+    if (error != KM_ERROR_UNIMPLEMENTED) return error;
+
+    UniquePtr<BufferedConfirmationVerifier> buffered(new (std::nothrow)
+                                                         BufferedConfirmationVerifier(context));
+    if (!buffered || !buffered->initialized()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    verifier->reset(buffered.release());
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AppendConfirmationInput(ConfirmationVerifier* verifier, const Buffer& input) {
+    return verifier->Append(input.peek_read(), input.available_read());
+}
 
 }  // anonymous namespace
 
+namespace {
+
+#ifndef KEYMASTER_DISABLE_OPERATION_METRICS
+constexpr bool kOperationMetricsEnabled = true;
+#else
+constexpr bool kOperationMetricsEnabled = false;
+#endif
+
+// Times consecutive phases of one operation, counting them in |counters| and reporting them to the
+// context's metrics sink, if it has one.
+class PhaseTimer {
+  public:
+    PhaseTimer(OperationMetricsSink* sink, KeymasterCounters* counters, keymaster_purpose_t purpose,
+               int32_t message_version)
+        : sink_(kOperationMetricsEnabled ? sink : nullptr), counters_(counters), purpose_(purpose),
+          message_version_(message_version), start_ns_(sink_ ? sink_->now_ns() : 0),
+          counted_start_ns_(KeymasterCounters::now_ns()) {}
+
+    PhaseTimer(OperationMetricsSink* sink, KeymasterCounters* counters, const Operation& operation,
+               int32_t message_version)
+        : PhaseTimer(sink, counters, operation.purpose(), message_version) {
+        if (sink_) operation.authorizations().GetTagValue(TAG_ALGORITHM, &algorithm_);
+    }
+
+    void set_algorithm(keymaster_algorithm_t algorithm) { algorithm_ = algorithm; }
+
+    // Records the time since construction or the previous End() as |phase|.
+    void End(OperationPhase phase, keymaster_error_t error, size_t input_length = 0) {
+        uint64_t counted_now_ns = KeymasterCounters::now_ns();
+        counters_->RecordPhase(phase, error, counted_now_ns - counted_start_ns_);
+        counted_start_ns_ = counted_now_ns;
+
+        if (!sink_) return;
+        uint64_t now_ns = sink_->now_ns();
+        sink_->Record({phase, algorithm_, purpose_, message_version_, error, now_ns - start_ns_,
+                       input_length});
+        start_ns_ = now_ns;
+    }
+
+  private:
+    OperationMetricsSink* sink_;
+    KeymasterCounters* counters_;
+    keymaster_algorithm_t algorithm_ = static_cast<keymaster_algorithm_t>(0);
+    keymaster_purpose_t purpose_;
+    int32_t message_version_;
+    // The sink's clock may not be the counters' one.
+    uint64_t start_ns_;
+    uint64_t counted_start_ns_;
+};
+
+#ifndef KEYMASTER_DISABLE_REQUEST_RECORDING
+constexpr bool kRequestRecordingEnabled = true;
+#else
+constexpr bool kRequestRecordingEnabled = false;
+#endif
+
+// Times one call of |command| and counts it in |counters| when it goes out of scope.
+class CountedCall {
+  public:
+    CountedCall(KeymasterCounters* counters, AndroidKeymasterCommand command,
+                const keymaster_error_t* error)
+        : counters_(counters), command_(command), error_(error),
+          start_ns_(KeymasterCounters::now_ns()) {}
+    ~CountedCall() {
+        counters_->RecordCommand(command_, *error_, KeymasterCounters::now_ns() - start_ns_);
+    }
+
+    CountedCall(const CountedCall&) = delete;
+    void operator=(const CountedCall&) = delete;
+
+  private:
+    KeymasterCounters* counters_;
+    AndroidKeymasterCommand command_;
+    const keymaster_error_t* error_;
+    uint64_t start_ns_;
+};
+
+// Times one request, counts it as CountedCall does and hands what was set on it to the recorder,
+// if there is one, when it goes out of scope.  Declare it after any ContextLock, so that it records
+// before the lock is released.
+class RecordedCall {
+  public:
+    RecordedCall(RequestRecorder* recorder, KeymasterCounters* counters,
+                 AndroidKeymasterCommand command, int32_t message_version,
+                 const keymaster_error_t* error)
+        : counted_(counters, command, error),
+          recorder_(kRequestRecordingEnabled ? recorder : nullptr), error_(error) {
+        if (!recorder_) return;
+        request_.command = command;
+        request_.message_version = message_version;
+        request_.arrival_ns = recorder_->now_ns();
+    }
+    ~RecordedCall() {
+        if (!recorder_) return;
+        request_.duration_ns = recorder_->now_ns() - request_.arrival_ns;
+        request_.error = *error_;
+        if (op_handle_) request_.op_handle = *op_handle_;
+        recorder_->Record(request_);
+    }
+
+    RecordedCall(const RecordedCall&) = delete;
+    void operator=(const RecordedCall&) = delete;
+
+    void set_key(const keymaster_key_blob_t& key_blob) { request_.key_blob = &key_blob; }
+    // Copied, since the key is usually gone by the time the call is recorded.
+    void set_key_characteristics(const AuthorizationSet& hw_enforced,
+                                 const AuthorizationSet& sw_enforced) {
+        if (!recorder_) return;
+        key_hw_enforced_.Reinitialize(hw_enforced);
+        key_sw_enforced_.Reinitialize(sw_enforced);
+        request_.key_hw_enforced = &key_hw_enforced_;
+        request_.key_sw_enforced = &key_sw_enforced_;
+    }
+    // |key_blob| is read when the call is recorded, so it may be filled in later.
+    void set_created_key(const keymaster_key_blob_t& key_blob) {
+        request_.created_key_blob = &key_blob;
+    }
+    // Likewise |op_handle|.
+    void set_operation(const keymaster_operation_handle_t& op_handle) { op_handle_ = &op_handle; }
+    void set_purpose(keymaster_purpose_t purpose) { request_.purpose = purpose; }
+    void set_key_format(keymaster_key_format_t format) { request_.key_format = format; }
+    void set_params(const AuthorizationSet& params) { request_.params = &params; }
+    void set_input_length(size_t length) { request_.input_length = length; }
+
+  private:
+    CountedCall counted_;
+    RequestRecorder* recorder_;
+    const keymaster_error_t* error_;
+    const keymaster_operation_handle_t* op_handle_ = nullptr;
+    RecordedRequest request_{};
+    AuthorizationSet key_hw_enforced_;
+    AuthorizationSet key_sw_enforced_;
+};
+
+// Times one operation call and counts it against the operation's key in |stats|, if there is one
+// and it samples the call, when it goes out of scope.  Calls whose key is never identified aren't
+// counted.
+class KeyUsageCall {
+  public:
+    KeyUsageCall(KeyUsageStats* stats, bool is_begin, const keymaster_error_t* error)
+        : stats_(stats && stats->ShouldSample() ? stats : nullptr), is_begin_(is_begin),
+          error_(error), start_ns_(stats_ ? stats_->now_ns() : 0) {}
+    ~KeyUsageCall() {
+        if (stats_ && key_id_) {
+            stats_->Record(key_id_, is_begin_, *error_, stats_->now_ns() - start_ns_);
+        }
+    }
+
+    KeyUsageCall(const KeyUsageCall&) = delete;
+    void operator=(const KeyUsageCall&) = delete;
+
+    // Zero, the ID of operations whose key was never identified, leaves the call uncounted.
+    void set_key_id(km_id_t key_id) { key_id_ = key_id; }
+
+  private:
+    KeyUsageStats* stats_;
+    bool is_begin_;
+    const keymaster_error_t* error_;
+    uint64_t start_ns_;
+    km_id_t key_id_ = 0;
+};
+
+}  // namespace
+
+class AndroidKeymaster::ContextLock {
+  public:
+    explicit ContextLock(AndroidKeymaster* keymaster) : keymaster_(keymaster) {
+        keymaster_->LockContext();
+    }
+    ~ContextLock() { keymaster_->UnlockContext(); }
+
+  private:
+    AndroidKeymaster* keymaster_;
+};
+
 AndroidKeymaster::AndroidKeymaster(KeymasterContext* context, size_t operation_table_size,
                                    int32_t message_version)
     : context_(context), operation_table_(new(std::nothrow) OperationTable(operation_table_size)),
       message_version_(message_version) {}
 
+AndroidKeymaster::AndroidKeymaster(KeymasterContext* context,
+                                   UniquePtr<OperationTable> operation_table,
+                                   int32_t message_version)
+    : context_(context), operation_table_(std::move(operation_table)),
+      message_version_(message_version) {}
+
 AndroidKeymaster::~AndroidKeymaster() {}
 
 AndroidKeymaster::AndroidKeymaster(AndroidKeymaster&& other)
     : context_(std::move(other.context_)), operation_table_(std::move(other.operation_table_)),
-      message_version_(other.message_version_) {}
+      operation_idle_timeout_ms_(other.operation_idle_timeout_ms_),
+      operation_handoff_(other.operation_handoff_), request_recorder_(other.request_recorder_),
+      key_usage_stats_(other.key_usage_stats_),
+      next_shared_memory_id_(other.next_shared_memory_id_),
+      message_version_(other.message_version_) {
+    for (size_t i = 0; i < kMaxSharedMemoryRegions; ++i) {
+        shared_memory_[i] = other.shared_memory_[i];
+    }
+}
+
+WorkerPool* AndroidKeymaster::worker_pool() const {
+    return context_ ? context_->worker_pool() : nullptr;
+}
 
 // TODO(swillden): Unify support analysis.  Right now, we have per-keytype methods that determine if
 // specific modes, padding, etc. are supported for that key type, and AndroidKeymaster also has
@@ -157,14 +466,14 @@ AndroidKeymaster::AndroidKeymaster(AndroidKeymaster&& other)
 // the keytypes and provide some mechanism for AndroidKeymaster to query the keytypes for the
 // information.
 
+// Returns the key factory for |algorithm|, or sets KM_ERROR_UNSUPPORTED_ALGORITHM and returns
+// nullptr.  Capability queries answer from the returned factory instead of looking it up again.
 template <typename T>
-bool check_supported(const KeymasterContext& context, keymaster_algorithm_t algorithm,
-                     SupportedResponse<T>* response) {
-    if (context.GetKeyFactory(algorithm) == nullptr) {
-        response->error = KM_ERROR_UNSUPPORTED_ALGORITHM;
-        return false;
-    }
-    return true;
+const KeyFactory* check_supported(const KeymasterContext& context, keymaster_algorithm_t algorithm,
+                                  SupportedResponse<T>* response) {
+    const KeyFactory* factory = context.GetKeyFactory(algorithm);
+    if (factory == nullptr) response->error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+    return factory;
 }
 
 void AndroidKeymaster::GetVersion(const GetVersionRequest&, GetVersionResponse* rsp) {
@@ -177,6 +486,7 @@ void AndroidKeymaster::GetVersion(const GetVersionRequest&, GetVersionResponse*
 }
 
 GetVersion2Response AndroidKeymaster::GetVersion2(const GetVersion2Request& req) {
+    ContextLock lock(this);
     GetVersion2Response rsp;
     rsp.km_version = context_->GetKmVersion();
     rsp.km_date = kKmDate;
@@ -191,6 +501,34 @@ GetVersion2Response AndroidKeymaster::GetVersion2(const GetVersion2Request& req)
     return rsp;
 }
 
+GetDebugCountersResponse AndroidKeymaster::GetDebugCounters(const GetDebugCountersRequest&) {
+    ContextLock lock(this);
+    GetDebugCountersResponse rsp(message_version_);
+    CountedCall counted(&counters_, GET_DEBUG_COUNTERS, &rsp.error);
+
+    for (uint32_t command = 0; command < KeymasterCounters::kCommandCount; ++command) {
+        KeymasterCounters::Totals totals = counters_.command(command);
+        if (totals.calls) {
+            rsp.commands.push_back({command, totals.calls, totals.errors, totals.total_ns});
+        }
+    }
+    for (uint32_t phase = 0; phase < kOperationPhaseCount; ++phase) {
+        KeymasterCounters::Totals totals = counters_.phase(static_cast<OperationPhase>(phase));
+        if (totals.calls) {
+            rsp.phases.push_back({phase, totals.calls, totals.errors, totals.total_ns});
+        }
+    }
+    for (uint32_t cache = 0; cache < kKeymasterCacheCount; ++cache) {
+        uint64_t hits;
+        uint64_t misses;
+        if (context_->GetCacheCounters(static_cast<KeymasterCache>(cache), &hits, &misses)) {
+            rsp.caches.push_back({cache, hits, misses});
+        }
+    }
+    rsp.error = KM_ERROR_OK;
+    return rsp;
+}
+
 void AndroidKeymaster::SupportedAlgorithms(const SupportedAlgorithmsRequest& /* request */,
                                            SupportedAlgorithmsResponse* response) {
     if (response == nullptr) return;
@@ -210,9 +548,11 @@ void GetSupported(const KeymasterContext& context, keymaster_algorithm_t algorit
                   keymaster_purpose_t purpose,
                   const T* (OperationFactory::*get_supported_method)(size_t* count) const,
                   SupportedResponse<T>* response) {
-    if (response == nullptr || !check_supported(context, algorithm, response)) return;
+    if (response == nullptr) return;
+    const KeyFactory* key_factory = check_supported(context, algorithm, response);
+    if (!key_factory) return;
 
-    const OperationFactory* factory = context.GetOperationFactory(algorithm, purpose);
+    const OperationFactory* factory = key_factory->GetOperationFactory(purpose);
     if (!factory) {
         response->error = KM_ERROR_UNSUPPORTED_PURPOSE;
         return;
@@ -243,25 +583,28 @@ void AndroidKeymaster::SupportedDigests(const SupportedDigestsRequest& request,
 
 void AndroidKeymaster::SupportedImportFormats(const SupportedImportFormatsRequest& request,
                                               SupportedImportFormatsResponse* response) {
-    if (response == nullptr || !check_supported(*context_, request.algorithm, response)) return;
+    if (response == nullptr) return;
+    const KeyFactory* factory = check_supported(*context_, request.algorithm, response);
+    if (!factory) return;
 
     size_t count;
-    const keymaster_key_format_t* formats =
-        context_->GetKeyFactory(request.algorithm)->SupportedImportFormats(&count);
+    const keymaster_key_format_t* formats = factory->SupportedImportFormats(&count);
     response->SetResults(formats, count);
 }
 
 void AndroidKeymaster::SupportedExportFormats(const SupportedExportFormatsRequest& request,
                                               SupportedExportFormatsResponse* response) {
-    if (response == nullptr || !check_supported(*context_, request.algorithm, response)) return;
+    if (response == nullptr) return;
+    const KeyFactory* factory = check_supported(*context_, request.algorithm, response);
+    if (!factory) return;
 
     size_t count;
-    const keymaster_key_format_t* formats =
-        context_->GetKeyFactory(request.algorithm)->SupportedExportFormats(&count);
+    const keymaster_key_format_t* formats = factory->SupportedExportFormats(&count);
     response->SetResults(formats, count);
 }
 
 GetHmacSharingParametersResponse AndroidKeymaster::GetHmacSharingParameters() {
+    ContextLock lock(this);
     GetHmacSharingParametersResponse response(message_version());
     KeymasterEnforcement* policy = context_->enforcement_policy();
     if (!policy) {
@@ -275,6 +618,7 @@ GetHmacSharingParametersResponse AndroidKeymaster::GetHmacSharingParameters() {
 
 ComputeSharedHmacResponse
 AndroidKeymaster::ComputeSharedHmac(const ComputeSharedHmacRequest& request) {
+    ContextLock lock(this);
     ComputeSharedHmacResponse response(message_version());
     KeymasterEnforcement* policy = context_->enforcement_policy();
     if (!policy) {
@@ -288,6 +632,7 @@ AndroidKeymaster::ComputeSharedHmac(const ComputeSharedHmacRequest& request) {
 
 VerifyAuthorizationResponse
 AndroidKeymaster::VerifyAuthorization(const VerifyAuthorizationRequest& request) {
+    ContextLock lock(this);
     KeymasterEnforcement* policy = context_->enforcement_policy();
     if (!policy) {
         VerifyAuthorizationResponse response(message_version());
@@ -300,6 +645,7 @@ AndroidKeymaster::VerifyAuthorization(const VerifyAuthorizationRequest& request)
 
 void AndroidKeymaster::GenerateTimestampToken(GenerateTimestampTokenRequest& request,
                                               GenerateTimestampTokenResponse* response) {
+    ContextLock lock(this);
     KeymasterEnforcement* policy = context_->enforcement_policy();
     if (!policy) {
         response->error = KM_ERROR_UNIMPLEMENTED;
@@ -309,8 +655,17 @@ void AndroidKeymaster::GenerateTimestampToken(GenerateTimestampTokenRequest& req
     }
 }
 
+keymaster_error_t AndroidKeymaster::GenerateTimestampToken(uint64_t challenge, uint64_t* timestamp,
+                                                           uint8_t* mac) {
+    ContextLock lock(this);
+    KeymasterEnforcement* policy = context_->enforcement_policy();
+    if (!policy) return KM_ERROR_UNIMPLEMENTED;
+    return policy->GenerateTimestampToken(challenge, timestamp, mac);
+}
+
 void AndroidKeymaster::AddRngEntropy(const AddEntropyRequest& request,
                                      AddEntropyResponse* response) {
+    ContextLock lock(this);
     response->error = context_->AddRngEntropy(request.random_data.peek_read(),
                                               request.random_data.available_read());
 }
@@ -329,7 +684,12 @@ const KeyFactory* get_key_factory(const AuthorizationSet& key_description,
 
 void AndroidKeymaster::GenerateKey(const GenerateKeyRequest& request,
                                    GenerateKeyResponse* response) {
+    ContextLock lock(this);
     if (response == nullptr) return;
+    RecordedCall recorded(request_recorder_, &counters_, GENERATE_KEY, message_version_,
+                          &response->error);
+    recorded.set_params(request.key_description);
+    recorded.set_created_key(response->key_blob);
 
     const KeyFactory* factory =
         get_key_factory(request.key_description, *context_, &response->error);
@@ -360,10 +720,139 @@ void AndroidKeymaster::GenerateKey(const GenerateKeyRequest& request,
                                            &response->certificate_chain);
 }
 
+void AndroidKeymaster::GenerateKeys(const GenerateKeysRequest& request,
+                                    GenerateKeysResponse* response) {
+    ContextLock lock(this);
+    if (!response) return;
+    CountedCall counted(&counters_, GENERATE_KEYS, &response->error);
+
+    if (request.key_count == 0 || request.key_count > GenerateKeysRequest::kMaxKeys) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    if (!response->SetKeyCount(request.key_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    // The response has no room for certificate chains, so asymmetric keys, which would get one,
+    // have to be generated one at a time.
+    std::vector<keymaster_algorithm_t> algorithms(request.key_count, KM_ALGORITHM_AES);
+    for (size_t i = 0; i < request.key_count; ++i) {
+        if (!request.key_descriptions[i].GetTagValue(TAG_ALGORITHM, &algorithms[i])) {
+            response->key_errors[i] = KM_ERROR_UNSUPPORTED_ALGORITHM;
+        } else if (algorithms[i] != KM_ALGORITHM_AES &&
+                   algorithms[i] != KM_ALGORITHM_TRIPLE_DES &&
+                   algorithms[i] != KM_ALGORITHM_HMAC) {
+            response->key_errors[i] = KM_ERROR_UNSUPPORTED_ALGORITHM;
+        }
+    }
+
+    // Each factory gets all the keys of its algorithm in one call, so that it can draw their key
+    // material together.
+    for (keymaster_algorithm_t algorithm :
+         {KM_ALGORITHM_AES, KM_ALGORITHM_TRIPLE_DES, KM_ALGORITHM_HMAC}) {
+        std::vector<size_t> indices;
+        for (size_t i = 0; i < request.key_count; ++i) {
+            if (response->key_errors[i] == KM_ERROR_OK && algorithms[i] == algorithm) {
+                indices.push_back(i);
+            }
+        }
+        if (indices.empty()) continue;
+
+        const KeyFactory* factory = context_->GetKeyFactory(algorithm);
+        size_t count = indices.size();
+        UniquePtr<AuthorizationSet[]> key_descriptions(new (std::nothrow) AuthorizationSet[count]);
+        UniquePtr<KeymasterKeyBlob[]> key_blobs(new (std::nothrow) KeymasterKeyBlob[count]);
+        UniquePtr<AuthorizationSet[]> enforced(new (std::nothrow) AuthorizationSet[count]);
+        UniquePtr<AuthorizationSet[]> unenforced(new (std::nothrow) AuthorizationSet[count]);
+        UniquePtr<keymaster_error_t[]> errors(new (std::nothrow) keymaster_error_t[count]);
+        if (!factory || !key_descriptions || !key_blobs || !enforced || !unenforced || !errors) {
+            for (size_t i : indices) {
+                response->key_errors[i] =
+                    factory ? KM_ERROR_MEMORY_ALLOCATION_FAILED : KM_ERROR_UNSUPPORTED_ALGORITHM;
+            }
+            continue;
+        }
+
+        for (size_t j = 0; j < count; ++j) {
+            key_descriptions[j] = request.key_descriptions[indices[j]];
+        }
+        factory->GenerateKeys(key_descriptions.get(), count, key_blobs.get(), enforced.get(),
+                              unenforced.get(), errors.get());
+        for (size_t j = 0; j < count; ++j) {
+            size_t i = indices[j];
+            response->key_errors[i] = errors[j];
+            if (errors[j] != KM_ERROR_OK) continue;
+            response->key_blobs[i] = std::move(key_blobs[j]);
+            response->enforced[i] = std::move(enforced[j]);
+            response->unenforced[i] = std::move(unenforced[j]);
+        }
+    }
+    response->error = KM_ERROR_OK;
+}
+
 constexpr int kRkpVersionWithoutSuperencryption = 3;
 
+namespace {
+
+// Generates one RKP key through |keymaster|, returning its blob and the single unsigned certificate
+// that carries its public key.
+keymaster_error_t GenerateRkpKeyPair(AndroidKeymaster* keymaster, KeymasterKeyBlob* key_blob,
+                                     CertificateChain* certificate) {
+    // Generate the keypair that will become the attestation key.
+    GenerateKeyRequest gen_key_request(keymaster->message_version());
+    gen_key_request.key_description.Reinitialize(kKeyMintEcdsaP256Params,
+                                                 array_length(kKeyMintEcdsaP256Params));
+    GenerateKeyResponse gen_key_response(keymaster->message_version());
+    keymaster->GenerateKey(gen_key_request, &gen_key_response);
+    if (gen_key_response.error != KM_ERROR_OK) return kStatusFailed;
+
+    if (gen_key_response.certificate_chain.entry_count != 1) {
+        // Error: Need the single non-signed certificate with the public key in it.
+        return kStatusFailed;
+    }
+    *key_blob = std::move(gen_key_response.key_blob);
+    *certificate = std::move(gen_key_response.certificate_chain);
+    return KM_ERROR_OK;
+}
+
+// Builds the COSE_Key for the public key in |certificate| and MACs it with |mac_function|.  Touches
+// nothing but its arguments, so several keys may be MACed at once if |mac_function| allows it.
+keymaster_error_t MacRkpPublicKey(const CertificateChain& certificate, bool test_mode,
+                                  const cppcose::HmacSha256Function& mac_function,
+                                  KeymasterBlob* maced_public_key) {
+    std::vector<uint8_t> x_coord(kP256AffinePointSize);
+    std::vector<uint8_t> y_coord(kP256AffinePointSize);
+    keymaster_error_t error =
+        GetEcdsa256KeyFromCert(certificate.begin(), x_coord.data(), x_coord.size(),
+                               y_coord.data(), y_coord.size());
+    if (error != KM_ERROR_OK) return kStatusFailed;
+
+    cppbor::Map cose_public_key_map = cppbor::Map()
+                                          .add(CoseKey::KEY_TYPE, EC2)
+                                          .add(CoseKey::ALGORITHM, ES256)
+                                          .add(CoseKey::CURVE, P256)
+                                          .add(CoseKey::PUBKEY_X, x_coord)
+                                          .add(CoseKey::PUBKEY_Y, y_coord);
+    if (test_mode) {
+        cose_public_key_map.add(CoseKey::TEST_KEY, cppbor::Null());
+    }
+
+    std::vector<uint8_t> cosePublicKey = cose_public_key_map.canonicalize().encode();
+
+    auto macedKey = constructCoseMac0(mac_function, {} /* externalAad */, cosePublicKey);
+    if (!macedKey) return kStatusFailed;
+    std::vector<uint8_t> enc = macedKey->encode();
+    *maced_public_key = KeymasterBlob(enc.data(), enc.size());
+    return KM_ERROR_OK;
+}
+
+}  // anonymous namespace
+
 void AndroidKeymaster::GenerateRkpKey(const GenerateRkpKeyRequest& request,
                                       GenerateRkpKeyResponse* response) {
+    ContextLock lock(this);
     if (response == nullptr) return;
 
     auto rem_prov_ctx = context_->GetRemoteProvisioningContext();
@@ -379,59 +868,80 @@ void AndroidKeymaster::GenerateRkpKey(const GenerateRkpKeyRequest& request,
         return;
     }
 
-    // Generate the keypair that will become the attestation key.
-    GenerateKeyRequest gen_key_request(message_version_);
-    gen_key_request.key_description.Reinitialize(kKeyMintEcdsaP256Params,
-                                                 array_length(kKeyMintEcdsaP256Params));
-    GenerateKeyResponse gen_key_response(message_version_);
-    GenerateKey(gen_key_request, &gen_key_response);
-    if (gen_key_response.error != KM_ERROR_OK) {
+    CertificateChain certificate;
+    response->error = GenerateRkpKeyPair(this, &response->key_blob, &certificate);
+    if (response->error != KM_ERROR_OK) return;
+    auto macFunction = getMacFunction(request.test_mode, rem_prov_ctx);
+    response->error = MacRkpPublicKey(certificate, request.test_mode, macFunction,
+                                      &response->maced_public_key);
+}
+
+void AndroidKeymaster::GenerateRkpKeyBatch(const GenerateRkpKeyBatchRequest& request,
+                                           GenerateRkpKeyBatchResponse* response) {
+    ContextLock lock(this);
+    if (response == nullptr) return;
+
+    if (request.key_count == 0 || request.key_count > GenerateRkpKeyBatchRequest::kMaxKeys) {
         response->error = static_cast<keymaster_error_t>(kStatusFailed);
         return;
     }
 
-    // Retrieve the certificate and parse it to build a COSE_Key
-    if (gen_key_response.certificate_chain.entry_count != 1) {
-        // Error: Need the single non-signed certificate with the public key in it.
+    auto rem_prov_ctx = context_->GetRemoteProvisioningContext();
+    if (!rem_prov_ctx) {
         response->error = static_cast<keymaster_error_t>(kStatusFailed);
         return;
     }
-    std::vector<uint8_t> x_coord(kP256AffinePointSize);
-    std::vector<uint8_t> y_coord(kP256AffinePointSize);
-    response->error =
-        GetEcdsa256KeyFromCert(gen_key_response.certificate_chain.begin(), x_coord.data(),
-                               x_coord.size(), y_coord.data(), y_coord.size());
-    if (response->error != KM_ERROR_OK) {
-        response->error = static_cast<keymaster_error_t>(kStatusFailed);
+
+    GetHwInfoResponse hwInfo(message_version());
+    rem_prov_ctx->GetHwInfo(&hwInfo);
+    if (hwInfo.version >= kRkpVersionWithoutSuperencryption && request.test_mode) {
+        response->error = static_cast<keymaster_error_t>(kStatusRemoved);
         return;
     }
 
-    cppbor::Map cose_public_key_map = cppbor::Map()
-                                          .add(CoseKey::KEY_TYPE, EC2)
-                                          .add(CoseKey::ALGORITHM, ES256)
-                                          .add(CoseKey::CURVE, P256)
-                                          .add(CoseKey::PUBKEY_X, x_coord)
-                                          .add(CoseKey::PUBKEY_Y, y_coord);
-    if (request.test_mode) {
-        cose_public_key_map.add(CoseKey::TEST_KEY, cppbor::Null());
+    if (!response->SetKeyCount(request.key_count)) {
+        response->error = static_cast<keymaster_error_t>(kStatusFailed);
+        return;
     }
 
-    std::vector<uint8_t> cosePublicKey = cose_public_key_map.canonicalize().encode();
+    // Key generation goes through the context, which isn't required to be thread-safe, so the keys
+    // are generated one after another.  Parsing their certificates, encoding their COSE_Keys and
+    // MACing them needs only the MAC function, which validating a CSR's keys already calls from
+    // several threads, so that part of the batch is spread across the workers.
+    std::vector<CertificateChain> certificates(request.key_count);
+    for (size_t i = 0; i < request.key_count; ++i) {
+        response->error = GenerateRkpKeyPair(this, &response->key_blobs[i], &certificates[i]);
+        if (response->error != KM_ERROR_OK) {
+            response->SetKeyCount(0);
+            return;
+        }
+    }
 
     auto macFunction = getMacFunction(request.test_mode, rem_prov_ctx);
-    auto macedKey = constructCoseMac0(macFunction, {} /* externalAad */, cosePublicKey);
-    if (!macedKey) {
-        response->error = static_cast<keymaster_error_t>(kStatusFailed);
-        return;
+    std::vector<keymaster_error_t> errors(request.key_count, KM_ERROR_OK);
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < request.key_count;) {
+            errors[i] = MacRkpPublicKey(certificates[i], request.test_mode, macFunction,
+                                        &response->maced_public_keys[i]);
+        }
+    };
+    size_t thread_count = std::min<size_t>(ParallelWorkerCount(), request.key_count);
+    RunInParallel(worker_pool(), thread_count, worker);
+
+    for (keymaster_error_t error : errors) {
+        if (error != KM_ERROR_OK) {
+            response->error = error;
+            response->SetKeyCount(0);
+            return;
+        }
     }
-    std::vector<uint8_t> enc = macedKey->encode();
-    response->maced_public_key = KeymasterBlob(enc.data(), enc.size());
-    response->key_blob = std::move(gen_key_response.key_blob);
     response->error = KM_ERROR_OK;
 }
 
 void AndroidKeymaster::GenerateCsr(const GenerateCsrRequest& request,
                                    GenerateCsrResponse* response) {
+    ContextLock lock(this);
     if (response == nullptr) return;
 
     auto rem_prov_ctx = context_->GetRemoteProvisioningContext();
@@ -449,8 +959,9 @@ void AndroidKeymaster::GenerateCsr(const GenerateCsrRequest& request,
     }
 
     auto macFunction = getMacFunction(request.test_mode, rem_prov_ctx);
-    auto pubKeysToSign = validateAndExtractPubkeys(request.test_mode, request.num_keys,
-                                                   request.keys_to_sign_array, macFunction);
+    auto pubKeysToSign =
+        validateAndExtractPubkeys(request.test_mode, request.num_keys, request.keys_to_sign_array,
+                                  macFunction, ParallelWorkerCount(), worker_pool());
     if (!pubKeysToSign.isOk()) {
         LOG_E("Failed to validate and extract the public keys for the CSR", 0);
         response->error = static_cast<keymaster_error_t>(pubKeysToSign.moveError());
@@ -479,7 +990,7 @@ void AndroidKeymaster::GenerateCsr(const GenerateCsrRequest& request,
 
     std::unique_ptr<cppbor::Map> device_info_map =
         rem_prov_ctx->CreateDeviceInfo(2 /* csrVersion */);
-    std::vector<uint8_t> device_info = device_info_map->encode();
+    std::vector<uint8_t> device_info = rem_prov_ctx->CreateEncodedDeviceInfo(2 /* csrVersion */);
     response->device_info_blob = KeymasterBlob(device_info.data(), device_info.size());
     auto protectedDataPayload = rem_prov_ctx->BuildProtectedDataPayload(
         request.test_mode,  //
@@ -521,25 +1032,32 @@ void AndroidKeymaster::GenerateCsr(const GenerateCsrRequest& request,
         response->error = static_cast<keymaster_error_t>(kStatusFailed);
         return;
     }
-    auto coseEncrypted = constructCoseEncrypt(*sessionKey,                       //
-                                              nonce,                             //
-                                              protectedDataPayload.moveValue(),  //
-                                              {},                                // aad
-                                              buildCertReqRecipients(ephemeralPubKey, eek->second));
-
+    // Encrypt the payload straight into the response.
+    auto recipients = buildCertReqRecipients(ephemeralPubKey, eek->second);
+    size_t protectedDataSize = coseEncryptEncodedSize(protectedDataPayload->size(), recipients);
+    if (!response->protected_data_blob.Reset(protectedDataSize)) {
+        response->error = static_cast<keymaster_error_t>(kStatusFailed);
+        return;
+    }
+    auto coseEncrypted = encodeCoseEncrypt(*sessionKey,            //
+                                           nonce,                  //
+                                           *protectedDataPayload,  //
+                                           {},                     // aad
+                                           recipients,             //
+                                           response->protected_data_blob.writable_data(),
+                                           response->protected_data_blob.size());
     if (!coseEncrypted) {
         LOG_E("Failed to construct a COSE_Encrypt ProtectedData structure", 0);
+        response->protected_data_blob.Clear();
         response->error = static_cast<keymaster_error_t>(kStatusFailed);
         return;
     }
-    std::vector<uint8_t> payload = coseEncrypted->encode();
-    response->protected_data_blob = KeymasterBlob(payload.data(), payload.size());
     response->error = KM_ERROR_OK;
 }
 
 void AndroidKeymaster::GenerateCsrV2(const GenerateCsrV2Request& request,
                                      GenerateCsrV2Response* response) {
-
+    ContextLock lock(this);
     if (response == nullptr) return;
 
     if (request.challenge.size() > kMaxChallengeSizeV2) {
@@ -559,7 +1077,8 @@ void AndroidKeymaster::GenerateCsrV2(const GenerateCsrV2Request& request,
 
     auto macFunction = getMacFunction(false /* test_mode */, rem_prov_ctx);
     auto pubKeys = validateAndExtractPubkeys(false /* test_mode */, request.num_keys,
-                                             request.keys_to_sign_array, macFunction);
+                                             request.keys_to_sign_array, macFunction,
+                                             ParallelWorkerCount(), worker_pool());
     if (!pubKeys.isOk()) {
         LOG_E("Failed to validate and extract the public keys for the CSR", 0);
         response->error = static_cast<keymaster_error_t>(pubKeys.moveError());
@@ -581,96 +1100,244 @@ void AndroidKeymaster::GenerateCsrV2(const GenerateCsrV2Request& request,
 
 void AndroidKeymaster::GetKeyCharacteristics(const GetKeyCharacteristicsRequest& request,
                                              GetKeyCharacteristicsResponse* response) {
+    ContextLock lock(this);
     if (response == nullptr) return;
-
-    UniquePtr<Key> key;
-    response->error =
-        context_->ParseKeyBlob(KeymasterKeyBlob(request.key_blob), request.additional_params, &key);
+    RecordedCall recorded(request_recorder_, &counters_, GET_KEY_CHARACTERISTICS, message_version_,
+                          &response->error);
+    recorded.set_key(request.key_blob);
+    recorded.set_params(request.additional_params);
+
+    response->error = context_->ParseKeyCharacteristics(BorrowedKeyBlob(request.key_blob),
+                                                        request.additional_params,
+                                                        &response->enforced, &response->unenforced);
     if (response->error != KM_ERROR_OK) return;
-
-    // scavenge the key object for the auth lists
-    response->enforced = std::move(key->hw_enforced());
-    response->unenforced = std::move(key->sw_enforced());
+    recorded.set_key_characteristics(response->enforced, response->unenforced);
 
     response->error = CheckVersionInfo(response->enforced, response->unenforced, *context_);
 }
 
-void AndroidKeymaster::BeginOperation(const BeginOperationRequest& request,
-                                      BeginOperationResponse* response) {
-    if (response == nullptr) return;
-    response->op_handle = 0;
+void AndroidKeymaster::GetKeysCharacteristics(const GetKeysCharacteristicsRequest& request,
+                                              GetKeysCharacteristicsResponse* response) {
+    ContextLock lock(this);
+    if (!response) return;
+    CountedCall counted(&counters_, GET_KEYS_CHARACTERISTICS, &response->error);
 
-    UniquePtr<Key> key = LoadKey(request.key_blob, request.additional_params, &response->error);
-    if (!key) return;
+    if (request.key_count == 0 || request.key_count > GetKeysCharacteristicsRequest::kMaxKeys) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    if (!response->SetKeyCount(request.key_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    context_->ParseKeysCharacteristics(request.key_blobs.get(), request.additional_params.get(),
+                                       request.key_count, response->enforced.get(),
+                                       response->unenforced.get(), response->key_errors.get(),
+                                       ParallelWorkerCount());
+    for (size_t i = 0; i < response->key_count; ++i) {
+        if (response->key_errors[i] == KM_ERROR_OK) {
+            response->key_errors[i] =
+                CheckVersionInfo(response->enforced[i], response->unenforced[i], *context_);
+        }
+        if (response->key_errors[i] != KM_ERROR_OK) {
+            response->enforced[i].Clear();
+            response->unenforced[i].Clear();
+        }
+    }
+    response->error = KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::PreCheckOperation(const keymaster_key_blob_t& key_blob,
+                                                     keymaster_purpose_t purpose,
+                                                     const AuthorizationSet& additional_params) {
+    if (!context_->has_cheap_key_characteristics()) return KM_ERROR_OK;
+
+    // Parse failures are left for LoadKey() to report, so the errors are the same either way.
+    AuthorizationSet hw_enforced;
+    AuthorizationSet sw_enforced;
+    keymaster_error_t error = context_->ParseKeyCharacteristics(
+        BorrowedKeyBlob(key_blob), additional_params, &hw_enforced, &sw_enforced);
+    if (error != KM_ERROR_OK) return KM_ERROR_OK;
+
+    error = CheckVersionInfo(hw_enforced, sw_enforced, *context_);
+    if (error != KM_ERROR_OK) return error;
+
+    keymaster_algorithm_t algorithm;
+    if (!hw_enforced.GetTagValue(TAG_ALGORITHM, &algorithm) &&
+        !sw_enforced.GetTagValue(TAG_ALGORITHM, &algorithm)) {
+        return KM_ERROR_OK;
+    }
+    const KeyFactory* key_factory = context_->GetKeyFactory(algorithm);
+    if (!key_factory || !key_factory->GetOperationFactory(purpose)) {
+        return KM_ERROR_UNSUPPORTED_PURPOSE;
+    }
+
+    if (!context_->enforcement_policy()) return KM_ERROR_OK;
+    return context_->enforcement_policy()->PreAuthorizeBegin(
+        purpose, AuthProxy(hw_enforced, sw_enforced), additional_params);
+}
+
+keymaster_error_t AndroidKeymaster::StartOperation(const keymaster_key_blob_t& key_blob,
+                                                  keymaster_purpose_t purpose,
+                                                  const AuthorizationSet& additional_params,
+                                                  AuthorizationSet* output_params,
+                                                  OperationPtr* operation) {
+    PhaseTimer timer(context_->operation_metrics(), &counters_, purpose, message_version_);
+    keymaster_error_t error = PreCheckOperation(key_blob, purpose, additional_params);
+    if (error != KM_ERROR_OK) {
+        timer.End(OperationPhase::LOAD_KEY, error);
+        return error;
+    }
+
+    UniquePtr<Key> key = LoadKey(key_blob, additional_params, &error);
+    if (!key) {
+        timer.End(OperationPhase::LOAD_KEY, error);
+        return error;
+    }
 
-    response->error = KM_ERROR_UNKNOWN_ERROR;
     keymaster_algorithm_t key_algorithm;
-    if (!key->authorizations().GetTagValue(TAG_ALGORITHM, &key_algorithm)) return;
+    if (!key->authorizations().GetTagValue(TAG_ALGORITHM, &key_algorithm)) {
+        timer.End(OperationPhase::LOAD_KEY, KM_ERROR_UNKNOWN_ERROR);
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    timer.set_algorithm(key_algorithm);
+    timer.End(OperationPhase::LOAD_KEY, KM_ERROR_OK);
 
-    response->error = KM_ERROR_UNSUPPORTED_PURPOSE;
-    OperationFactory* factory = key->key_factory()->GetOperationFactory(request.purpose);
-    if (!factory) return;
+    OperationFactory* factory = key->key_factory()->GetOperationFactory(purpose);
+    if (!factory) return KM_ERROR_UNSUPPORTED_PURPOSE;
 
     uint32_t sd_slot = key->secure_deletion_slot();
+    KeyPolicy policy = key->policy();
+    km_id_t key_id;
+    bool have_key_id = key->key_id(&key_id);
 
-    OperationPtr operation(
-        factory->CreateOperation(std::move(*key), request.additional_params, &response->error));
-    if (operation.get() == nullptr) return;
-
-    operation->set_secure_deletion_slot(sd_slot);
+    {
+        KEYMASTER_TRACE("CreateOperation");
+        *operation = factory->CreateOperation(std::move(*key), additional_params, &error);
+    }
+    timer.End(OperationPhase::CREATE_OPERATION, operation->get() ? KM_ERROR_OK : error);
+    if (operation->get() == nullptr) return error;
+
+    // Operations that don't go into the table still need a handle for auth token checks.
+    operation_table_->AssignHandleHighHalf(operation->get());
+    (*operation)->set_secure_deletion_slot(sd_slot);
+
+    if ((*operation)->authorizations().Contains(TAG_TRUSTED_CONFIRMATION_REQUIRED)) {
+        UniquePtr<ConfirmationVerifier> verifier;
+        error = CreateConfirmationVerifier(context_.get(), &verifier);
+        if (error != KM_ERROR_OK) return error;
+        (*operation)->set_confirmation_verifier(std::move(verifier));
+    }
 
-    if (operation->authorizations().Contains(TAG_TRUSTED_CONFIRMATION_REQUIRED)) {
-        if (!operation->create_confirmation_verifier_buffer()) {
-            response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-            return;
+    if (context_->enforcement_policy()) {
+        if (!have_key_id && !context_->enforcement_policy()->CreateKeyId(key_blob, &key_id)) {
+            return KM_ERROR_UNKNOWN_ERROR;
         }
+        (*operation)->set_key_id(key_id);
+        error = context_->enforcement_policy()->AuthorizeOperation(
+            purpose, key_id, (*operation)->authorizations(), additional_params, 0 /* op_handle */,
+            true /* is_begin_operation */, &policy);
+        timer.End(OperationPhase::AUTHORIZE, error);
+        if (error != KM_ERROR_OK) return error;
     }
 
-    if (context_->enforcement_policy()) {
-        km_id_t key_id;
-        response->error = KM_ERROR_UNKNOWN_ERROR;
-        if (!context_->enforcement_policy()->CreateKeyId(request.key_blob, &key_id)) return;
-        operation->set_key_id(key_id);
-        response->error = context_->enforcement_policy()->AuthorizeOperation(
-            request.purpose, key_id, operation->authorizations(), request.additional_params,
-            0 /* op_handle */, true /* is_begin_operation */);
-        if (response->error != KM_ERROR_OK) return;
+    output_params->Clear();
+    {
+        KEYMASTER_TRACE("Operation::Begin");
+        error = (*operation)->Begin(additional_params, output_params);
     }
+    timer.End(OperationPhase::BEGIN, error);
+    return error;
+}
 
-    response->output_params.Clear();
-    response->error = operation->Begin(request.additional_params, &response->output_params);
+void AndroidKeymaster::PrepareKey(const PrepareKeyRequest& request, PrepareKeyResponse* response) {
+    ContextLock lock(this);
+    if (!response) return;
+    CountedCall counted(&counters_, PREPARE_KEY, &response->error);
+
+    // Contexts that cache parsed blobs keep the decrypted key and its compiled policy, so the
+    // begin that follows skips straight to checking them.  The key itself isn't kept.
+    LoadKey(request.key_blob, request.additional_params, &response->error);
+}
+
+void AndroidKeymaster::BeginOperation(const BeginOperationRequest& request,
+                                      BeginOperationResponse* response, uint32_t caller_id) {
+    ContextLock lock(this);
+    if (response == nullptr) return;
+    response->op_handle = 0;
+    RecordedCall recorded(request_recorder_, &counters_, BEGIN_OPERATION, message_version_,
+                          &response->error);
+    recorded.set_key(request.key_blob);
+    recorded.set_purpose(request.purpose);
+    recorded.set_params(request.additional_params);
+    recorded.set_operation(response->op_handle);
+    KeyUsageCall key_usage(key_usage_stats_, true /* is_begin */, &response->error);
+
+    OperationPtr operation;
+    response->error = StartOperation(request.key_blob, request.purpose, request.additional_params,
+                                     &response->output_params, &operation);
+    if (operation) key_usage.set_key_id(operation->key_id());
     if (response->error != KM_ERROR_OK) return;
 
-    response->op_handle = operation->operation_handle();
-    response->error = operation_table_->Add(std::move(operation));
+    operation->set_owner(caller_id);
+    if (request.signature.available_read() > 0) {
+        // Only a hint; operations that can't use it verify the signature in Finish() as usual.
+        keymaster_error_t error = operation->SetEarlySignature(request.signature, worker_pool());
+        if (error != KM_ERROR_OK && error != KM_ERROR_UNIMPLEMENTED) {
+            response->error = error;
+            return;
+        }
+    }
+    if (operation_handoff_) {
+        UniquePtr<Operation::Origin> origin(new (std::nothrow) Operation::Origin{
+            KeymasterKeyBlob(request.key_blob), AuthorizationSet(request.additional_params)});
+        // Without its origin the operation just can't be handed off.
+        if (origin && origin->key_blob.size() == request.key_blob.key_material_size &&
+            origin->begin_params.is_valid() == AuthorizationSet::OK) {
+            operation->set_origin(std::move(origin));
+        }
+    }
+    recorded.set_key_characteristics(operation->hw_enforced(), operation->sw_enforced());
+    ReapIdleOperations();
+    // The table may re-tag the handle, so it must be read back after the operation is added.
+    Operation* added = operation.get();
+    size_t max_chunk_size = std::min(added->MaxChunkSize(), context_->max_update_chunk_size());
+    response->recommended_chunk_size =
+        static_cast<uint32_t>(std::min(added->RecommendedChunkSize(), max_chunk_size));
+    response->max_chunk_size = static_cast<uint32_t>(max_chunk_size);
+    response->error = operation_table_->Add(std::move(operation), current_time_ms());
+    if (response->error != KM_ERROR_OK) return;
+    response->op_handle = added->operation_handle();
 }
 
 void AndroidKeymaster::UpdateOperation(const UpdateOperationRequest& request,
                                        UpdateOperationResponse* response) {
     if (response == nullptr) return;
+    RecordedCall recorded(request_recorder_, &counters_, UPDATE_OPERATION, message_version_,
+                          &response->error);
+    recorded.set_operation(request.op_handle);
+    recorded.set_params(request.additional_params);
+    recorded.set_input_length(request.input.available_read());
+    KeyUsageCall key_usage(key_usage_stats_, false /* is_begin */, &response->error);
 
     response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
-    Operation* operation = operation_table_->Find(request.op_handle);
+    CheckedOutOperation checked_out(operation_table_.get(), request.op_handle);
+    Operation* operation = checked_out.get();
     if (operation == nullptr) return;
+    key_usage.set_key_id(operation->key_id());
 
-    Buffer* confirmation_verifier_buffer = operation->get_confirmation_verifier_buffer();
-    if (confirmation_verifier_buffer != nullptr) {
-        size_t input_num_bytes = request.input.available_read();
-        if (input_num_bytes + confirmation_verifier_buffer->available_read() >
-            kConfirmationMessageMaxSize + kConfirmationTokenMessageTagSize) {
-            response->error = KM_ERROR_INVALID_ARGUMENT;
-            operation_table_->Delete(request.op_handle);
-            return;
-        }
-        if (!confirmation_verifier_buffer->reserve(input_num_bytes)) {
-            response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    ConfirmationVerifier* confirmation_verifier = operation->confirmation_verifier();
+    if (confirmation_verifier != nullptr) {
+        response->error = AppendConfirmationInput(confirmation_verifier, request.input);
+        if (response->error != KM_ERROR_OK) {
             operation_table_->Delete(request.op_handle);
             return;
         }
-        confirmation_verifier_buffer->write(request.input.peek_read(), input_num_bytes);
     }
 
     if (context_->enforcement_policy()) {
+        ContextLock lock(this);
         response->error = context_->enforcement_policy()->AuthorizeOperation(
             operation->purpose(), operation->key_id(), operation->authorizations(),
             request.additional_params, request.op_handle, false /* is_begin_operation */);
@@ -680,41 +1347,57 @@ void AndroidKeymaster::UpdateOperation(const UpdateOperationRequest& request,
         }
     }
 
-    response->error =
-        operation->Update(request.additional_params, request.input, &response->output_params,
-                          &response->output, &response->input_consumed);
+    PhaseTimer timer(context_->operation_metrics(), &counters_, *operation, message_version_);
+    {
+        KEYMASTER_TRACE("Operation::Update");
+        response->error =
+            operation->Update(request.additional_params, request.input, &response->output_params,
+                              &response->output, &response->input_consumed);
+    }
+    timer.End(OperationPhase::UPDATE, response->error, request.input.available_read());
     if (response->error != KM_ERROR_OK) {
         // Any error invalidates the operation.
         operation_table_->Delete(request.op_handle);
+        return;
+    }
+    operation_table_->Touch(request.op_handle, current_time_ms());
+    if (!operation_table_->UpdateFootprint(request.op_handle)) {
+        // The data the operation has buffered took the table over its memory budget.
+        operation_table_->Delete(request.op_handle);
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
 }
 
-void AndroidKeymaster::FinishOperation(const FinishOperationRequest& request,
-                                       FinishOperationResponse* response) {
+void AndroidKeymaster::BatchUpdateOperation(const BatchUpdateOperationRequest& request,
+                                            BatchUpdateOperationResponse* response) {
     if (response == nullptr) return;
+    CountedCall counted(&counters_, BATCH_UPDATE_OPERATION, &response->error);
 
     response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
-    Operation* operation = operation_table_->Find(request.op_handle);
+    CheckedOutOperation checked_out(operation_table_.get(), request.op_handle);
+    Operation* operation = checked_out.get();
     if (operation == nullptr) return;
 
-    Buffer* confirmation_verifier_buffer = operation->get_confirmation_verifier_buffer();
-    if (confirmation_verifier_buffer != nullptr) {
-        size_t input_num_bytes = request.input.available_read();
-        if (input_num_bytes + confirmation_verifier_buffer->available_read() >
-            kConfirmationMessageMaxSize + kConfirmationTokenMessageTagSize) {
-            response->error = KM_ERROR_INVALID_ARGUMENT;
-            operation_table_->Delete(request.op_handle);
-            return;
-        }
-        if (!confirmation_verifier_buffer->reserve(input_num_bytes)) {
-            response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-            operation_table_->Delete(request.op_handle);
-            return;
+    if (!response->SetOutputCount(request.input_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        operation_table_->Delete(request.op_handle);
+        return;
+    }
+
+    ConfirmationVerifier* confirmation_verifier = operation->confirmation_verifier();
+    if (confirmation_verifier != nullptr) {
+        for (size_t i = 0; i < request.input_count; ++i) {
+            response->error = AppendConfirmationInput(confirmation_verifier, request.inputs[i]);
+            if (response->error != KM_ERROR_OK) {
+                operation_table_->Delete(request.op_handle);
+                return;
+            }
         }
-        confirmation_verifier_buffer->write(request.input.peek_read(), input_num_bytes);
     }
 
+    // One authorization covers the whole batch.
     if (context_->enforcement_policy()) {
+        ContextLock lock(this);
         response->error = context_->enforcement_policy()->AuthorizeOperation(
             operation->purpose(), operation->key_id(), operation->authorizations(),
             request.additional_params, request.op_handle, false /* is_begin_operation */);
@@ -724,73 +1407,723 @@ void AndroidKeymaster::FinishOperation(const FinishOperationRequest& request,
         }
     }
 
-    response->error = operation->Finish(request.additional_params, request.input, request.signature,
-                                        &response->output_params, &response->output);
-    if (response->error != KM_ERROR_OK) {
+    AuthorizationSet empty_params;
+    response->error = KM_ERROR_OK;
+    for (size_t i = 0; i < request.input_count; ++i) {
+        const Buffer& input = request.inputs[i];
+        size_t input_consumed = 0;
+        PhaseTimer timer(context_->operation_metrics(), &counters_, *operation, message_version_);
+        response->error = operation->Update(i == 0 ? request.additional_params : empty_params,
+                                            input, &response->output_params,
+                                            &response->outputs[i], &input_consumed);
+        timer.End(OperationPhase::UPDATE, response->error, input.available_read());
+        if (response->error == KM_ERROR_OK && input_consumed != input.available_read()) {
+            response->error = KM_ERROR_INVALID_INPUT_LENGTH;
+        }
+        if (response->error != KM_ERROR_OK) {
+            // Any error invalidates the operation.
+            operation_table_->Delete(request.op_handle);
+            return;
+        }
+    }
+    operation_table_->Touch(request.op_handle, current_time_ms());
+    if (!operation_table_->UpdateFootprint(request.op_handle)) {
+        // The data the operation has buffered took the table over its memory budget.
         operation_table_->Delete(request.op_handle);
-        return;
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
+}
 
-    // Invalidate the single use key from secure storage after finish.
-    if (operation->hw_enforced().Contains(TAG_USAGE_COUNT_LIMIT, 1)) {
-        if (context_->secure_deletion_secret_storage() != nullptr) {
-            context_->secure_deletion_secret_storage()->DeleteKey(
-                operation->secure_deletion_slot());
-        } else if (context_->secure_key_storage() != nullptr) {
-            context_->secure_key_storage()->DeleteKey(operation->key_id());
+void AndroidKeymaster::DeleteSingleUseKey(const Operation& operation) {
+    if (!operation.hw_enforced().Contains(TAG_USAGE_COUNT_LIMIT, 1)) return;
+
+    // Thread-safe storage is called without the context lock, so that the deletions of concurrent
+    // finishes can share a storage write.
+    SecureDeletionSecretStorage* secret_storage = nullptr;
+    SecureKeyStorage* key_storage = nullptr;
+    {
+        ContextLock lock(this);
+        secret_storage = context_->secure_deletion_secret_storage();
+        key_storage = secret_storage ? nullptr : context_->secure_key_storage();
+        if (secret_storage && !secret_storage->is_thread_safe()) {
+            secret_storage->DeleteKey(operation.secure_deletion_slot());
+            return;
+        }
+        if (key_storage && !key_storage->is_thread_safe()) {
+            key_storage->DeleteKey(operation.key_id());
+            return;
         }
     }
+    if (secret_storage) {
+        secret_storage->DeleteKey(operation.secure_deletion_slot());
+    } else if (key_storage) {
+        key_storage->DeleteKey(operation.key_id());
+    }
+}
+
+keymaster_error_t AndroidKeymaster::FinishStartedOperation(
+    Operation* operation, keymaster_operation_handle_t op_handle,
+    const AuthorizationSet& additional_params, const Buffer& input, const Buffer& signature,
+    AuthorizationSet* output_params, Buffer* output) {
+    ConfirmationVerifier* confirmation_verifier = operation->confirmation_verifier();
+    if (confirmation_verifier != nullptr) {
+        keymaster_error_t error = AppendConfirmationInput(confirmation_verifier, input);
+        if (error != KM_ERROR_OK) return error;
+    }
+
+    if (context_->enforcement_policy()) {
+        ContextLock lock(this);
+        keymaster_error_t error = context_->enforcement_policy()->AuthorizeOperation(
+            operation->purpose(), operation->key_id(), operation->authorizations(),
+            additional_params, op_handle, false /* is_begin_operation */);
+        if (error != KM_ERROR_OK) return error;
+    }
+
+    PhaseTimer timer(context_->operation_metrics(), &counters_, *operation, message_version_);
+    keymaster_error_t error;
+    {
+        KEYMASTER_TRACE("Operation::Finish");
+        error = operation->Finish(additional_params, input, signature, output_params, output);
+    }
+    timer.End(OperationPhase::FINISH, error, input.available_read());
+    if (error != KM_ERROR_OK) return error;
+
+    // Invalidate the single use key from secure storage after finish.
+    DeleteSingleUseKey(*operation);
 
     // If the operation succeeded and TAG_TRUSTED_CONFIRMATION_REQUIRED was
     // set, the input must be checked against the confirmation token.
-    if (response->error == KM_ERROR_OK && confirmation_verifier_buffer != nullptr) {
+    if (confirmation_verifier != nullptr) {
         keymaster_blob_t confirmation_token_blob;
-        if (!request.additional_params.GetTagValue(TAG_CONFIRMATION_TOKEN,
-                                                   &confirmation_token_blob)) {
-            response->error = KM_ERROR_NO_USER_CONFIRMATION;
-            response->output.Clear();
+        if (!additional_params.GetTagValue(TAG_CONFIRMATION_TOKEN, &confirmation_token_blob)) {
+            error = KM_ERROR_NO_USER_CONFIRMATION;
+        } else if (confirmation_token_blob.data_length != kConfirmationTokenSize) {
+            LOG_E("TAG_CONFIRMATION_TOKEN wrong size, was %zd expected %zd",
+                  confirmation_token_blob.data_length, kConfirmationTokenSize);
+            error = KM_ERROR_INVALID_ARGUMENT;
         } else {
-            if (confirmation_token_blob.data_length != kConfirmationTokenSize) {
-                LOG_E("TAG_CONFIRMATION_TOKEN wrong size, was %zd expected %zd",
-                      confirmation_token_blob.data_length, kConfirmationTokenSize);
-                response->error = KM_ERROR_INVALID_ARGUMENT;
-                response->output.Clear();
+            ContextLock lock(this);
+            error = confirmation_verifier->Verify(confirmation_token_blob.data);
+        }
+        if (error != KM_ERROR_OK) output->Clear();
+    }
+    return error;
+}
+
+void AndroidKeymaster::FinishOperation(const FinishOperationRequest& request,
+                                       FinishOperationResponse* response) {
+    if (response == nullptr) return;
+    RecordedCall recorded(request_recorder_, &counters_, FINISH_OPERATION, message_version_,
+                          &response->error);
+    recorded.set_operation(request.op_handle);
+    recorded.set_params(request.additional_params);
+    recorded.set_input_length(request.input.available_read());
+    KeyUsageCall key_usage(key_usage_stats_, false /* is_begin */, &response->error);
+
+    response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
+    CheckedOutOperation checked_out(operation_table_.get(), request.op_handle);
+    Operation* operation = checked_out.get();
+    if (operation == nullptr) return;
+    key_usage.set_key_id(operation->key_id());
+
+    response->error = FinishStartedOperation(operation, request.op_handle,
+                                             request.additional_params, request.input,
+                                             request.signature, &response->output_params,
+                                             &response->output);
+    operation_table_->Delete(request.op_handle);
+}
+
+void AndroidKeymaster::OneShotOperation(const OneShotOperationRequest& request,
+                                        OneShotOperationResponse* response) {
+    if (response == nullptr) return;
+    CountedCall counted(&counters_, ONE_SHOT_OPERATION, &response->error);
+
+    OperationPtr operation;
+    {
+        ContextLock lock(this);
+        response->error =
+            StartOperation(request.key_blob, request.purpose, request.additional_params,
+                           &response->output_params, &operation);
+    }
+    if (response->error != KM_ERROR_OK) return;
+
+    // The operation never enters the table, so no other call can see it and it's simply destroyed
+    // when this one returns.
+    response->error = FinishStartedOperation(operation.get(), operation->operation_handle(),
+                                             request.additional_params, request.input,
+                                             request.signature, &response->output_params,
+                                             &response->output);
+}
+
+keymaster_error_t AndroidKeymaster::AuthorizeBatch(const Operation& operation, size_t count,
+                                                   const AuthorizationSet& additional_params) {
+    // Enforcement runs once for the whole batch, so keys whose limits are counted per operation
+    // may only be used for one item at a time.  Confirmation covers a single message by
+    // definition.
+    AuthProxy auths = operation.authorizations();
+    if (auths.Contains(TAG_TRUSTED_CONFIRMATION_REQUIRED)) return KM_ERROR_NO_USER_CONFIRMATION;
+    if (count > 1) {
+        if (auths.Contains(TAG_USAGE_COUNT_LIMIT) || auths.Contains(TAG_MAX_USES_PER_BOOT)) {
+            return KM_ERROR_KEY_MAX_OPS_EXCEEDED;
+        }
+        if (auths.Contains(TAG_MIN_SECONDS_BETWEEN_OPS)) return KM_ERROR_KEY_RATE_LIMIT_EXCEEDED;
+    }
+
+    if (!context_->enforcement_policy()) return KM_ERROR_OK;
+    ContextLock lock(this);
+    return context_->enforcement_policy()->AuthorizeOperation(
+        operation.purpose(), operation.key_id(), auths, additional_params,
+        operation.operation_handle(), false /* is_begin_operation */);
+}
+
+void AndroidKeymaster::BatchSign(const BatchSignRequest& request, BatchSignResponse* response) {
+    if (response == nullptr) return;
+    CountedCall counted(&counters_, BATCH_SIGN, &response->error);
+
+    if (request.message_count == 0) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+
+    OperationPtr operation;
+    AuthorizationSet output_params;
+    {
+        ContextLock lock(this);
+        response->error = StartOperation(request.key_blob, KM_PURPOSE_SIGN,
+                                         request.additional_params, &output_params, &operation);
+    }
+    if (response->error != KM_ERROR_OK) return;
+
+    response->error = AuthorizeBatch(*operation, request.message_count, request.additional_params);
+    if (response->error != KM_ERROR_OK) return;
+
+    if (!response->SetSignatureCount(request.message_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    response->error = operation->SignBatch(request.messages.get(), request.message_count,
+                                           response->signatures.get());
+    if (response->error == KM_ERROR_UNIMPLEMENTED) {
+        // Algorithms without a batch path, such as RSA, sign one operation per message.
+        Buffer no_signature;
+        for (size_t i = 0; i < request.message_count; ++i) {
+            if (i > 0) {
+                ContextLock lock(this);
+                response->error = StartOperation(request.key_blob, KM_PURPOSE_SIGN,
+                                                 request.additional_params, &output_params,
+                                                 &operation);
+                if (response->error != KM_ERROR_OK) break;
+            }
+            response->error = operation->Finish(request.additional_params, request.messages[i],
+                                                no_signature, &output_params,
+                                                &response->signatures[i]);
+            if (response->error != KM_ERROR_OK) break;
+        }
+    }
+    if (response->error != KM_ERROR_OK) {
+        response->SetSignatureCount(0);
+        return;
+    }
+
+    DeleteSingleUseKey(*operation);
+}
+
+void AndroidKeymaster::BatchAgreeKey(const BatchAgreeKeyRequest& request,
+                                     BatchAgreeKeyResponse* response) {
+    if (response == nullptr) return;
+    CountedCall counted(&counters_, BATCH_AGREE_KEY, &response->error);
+
+    if (request.peer_key_count == 0) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+
+    OperationPtr operation;
+    AuthorizationSet output_params;
+    {
+        ContextLock lock(this);
+        response->error = StartOperation(request.key_blob, KM_PURPOSE_AGREE_KEY,
+                                         request.additional_params, &output_params, &operation);
+    }
+    if (response->error != KM_ERROR_OK) return;
+
+    response->error =
+        AuthorizeBatch(*operation, request.peer_key_count, request.additional_params);
+    if (response->error != KM_ERROR_OK) return;
+
+    if (!response->SetSharedSecretCount(request.peer_key_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    response->error = operation->AgreeBatch(request.peer_keys.get(), request.peer_key_count,
+                                            response->shared_secrets.get());
+    if (response->error == KM_ERROR_UNIMPLEMENTED) {
+        // Operations without a batch path agree one operation per peer key.
+        Buffer no_signature;
+        for (size_t i = 0; i < request.peer_key_count; ++i) {
+            if (i > 0) {
+                ContextLock lock(this);
+                response->error = StartOperation(request.key_blob, KM_PURPOSE_AGREE_KEY,
+                                                 request.additional_params, &output_params,
+                                                 &operation);
+                if (response->error != KM_ERROR_OK) break;
+            }
+            response->error = operation->Finish(request.additional_params, request.peer_keys[i],
+                                                no_signature, &output_params,
+                                                &response->shared_secrets[i]);
+            if (response->error != KM_ERROR_OK) break;
+        }
+    }
+    if (response->error != KM_ERROR_OK) {
+        response->SetSharedSecretCount(0);
+        return;
+    }
+
+    DeleteSingleUseKey(*operation);
+}
+
+void AndroidKeymaster::BatchVerify(const BatchVerifyRequest& request,
+                                   BatchVerifyResponse* response) {
+    if (response == nullptr) return;
+    CountedCall counted(&counters_, BATCH_VERIFY, &response->error);
+
+    if (request.message_count == 0) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+
+    OperationPtr operation;
+    AuthorizationSet output_params;
+    {
+        ContextLock lock(this);
+        response->error = StartOperation(request.key_blob, KM_PURPOSE_VERIFY,
+                                         request.additional_params, &output_params, &operation);
+    }
+    if (response->error != KM_ERROR_OK) return;
+
+    response->error = AuthorizeBatch(*operation, request.message_count, request.additional_params);
+    if (response->error != KM_ERROR_OK) return;
+
+    const size_t verified_length = (request.message_count + 7) / 8;
+    UniquePtr<uint8_t[]> verified(new (std::nothrow) uint8_t[verified_length]());
+    if (!verified) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    response->error = operation->VerifyBatch(request.messages.get(), request.signatures.get(),
+                                             request.message_count, worker_pool(), verified.get());
+    if (response->error == KM_ERROR_UNIMPLEMENTED) {
+        // Operations without a batch path verify one operation per message.
+        Buffer no_output;
+        for (size_t i = 0; i < request.message_count; ++i) {
+            if (i > 0) {
+                ContextLock lock(this);
+                response->error = StartOperation(request.key_blob, KM_PURPOSE_VERIFY,
+                                                 request.additional_params, &output_params,
+                                                 &operation);
+                if (response->error != KM_ERROR_OK) break;
+            }
+            response->error = operation->Finish(request.additional_params, request.messages[i],
+                                                request.signatures[i], &output_params, &no_output);
+            if (response->error == KM_ERROR_OK) {
+                verified[i / 8] |= 1 << (i % 8);
+            } else if (response->error == KM_ERROR_VERIFICATION_FAILED) {
+                response->error = KM_ERROR_OK;
             } else {
-                keymaster_error_t verification_result = context_->CheckConfirmationToken(
-                    confirmation_verifier_buffer->begin(),
-                    confirmation_verifier_buffer->available_read(), confirmation_token_blob.data);
-                if (verification_result != KM_ERROR_OK) {
-                    response->error = verification_result;
-                    response->output.Clear();
-                }
+                break;
             }
         }
     }
+    if (response->error != KM_ERROR_OK) return;
+    if (!response->verified.Reinitialize(verified.get(), verified_length)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
 
-    operation_table_->Delete(request.op_handle);
+    DeleteSingleUseKey(*operation);
 }
 
 void AndroidKeymaster::AbortOperation(const AbortOperationRequest& request,
                                       AbortOperationResponse* response) {
     if (!response) return;
+    RecordedCall recorded(request_recorder_, &counters_, ABORT_OPERATION, message_version_,
+                          &response->error);
+    recorded.set_operation(request.op_handle);
+    KeyUsageCall key_usage(key_usage_stats_, false /* is_begin */, &response->error);
 
-    Operation* operation = operation_table_->Find(request.op_handle);
+    CheckedOutOperation checked_out(operation_table_.get(), request.op_handle);
+    Operation* operation = checked_out.get();
     if (!operation) {
         response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
         return;
     }
+    key_usage.set_key_id(operation->key_id());
 
     response->error = operation->Abort();
     operation_table_->Delete(request.op_handle);
 }
 
+void AndroidKeymaster::ForkOperation(const ForkOperationRequest& request,
+                                     ForkOperationResponse* response, uint32_t caller_id) {
+    if (!response) return;
+    CountedCall counted(&counters_, FORK_OPERATION, &response->error);
+    response->op_handle = 0;
+    KeyUsageCall key_usage(key_usage_stats_, true /* is_begin */, &response->error);
+
+    response->error = KM_ERROR_INVALID_OPERATION_HANDLE;
+    CheckedOutOperation checked_out(operation_table_.get(), request.op_handle);
+    Operation* operation = checked_out.get();
+    if (!operation) return;
+    key_usage.set_key_id(operation->key_id());
+
+    // A confirmation token covers exactly one message, and the count of a usage-limited key is
+    // only charged when an operation finishes, so neither kind of key can be forked.  Keys that
+    // need an auth token per operation can't either: the token is bound to the original handle.
+    AuthProxy auths = operation->authorizations();
+    if (auths.Contains(TAG_TRUSTED_CONFIRMATION_REQUIRED)) {
+        response->error = KM_ERROR_NO_USER_CONFIRMATION;
+        return;
+    }
+    if (auths.Contains(TAG_USAGE_COUNT_LIMIT)) {
+        response->error = KM_ERROR_KEY_MAX_OPS_EXCEEDED;
+        return;
+    }
+    if (auths.Contains(TAG_USER_SECURE_ID) && !auths.Contains(TAG_AUTH_TIMEOUT)) {
+        response->error = KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
+        return;
+    }
+
+    OperationPtr fork;
+    {
+        KEYMASTER_TRACE("Operation::Fork");
+        fork = operation->Fork(&response->error);
+    }
+    if (!fork) return;
+    fork->set_key_id(operation->key_id());
+    fork->set_secure_deletion_slot(operation->secure_deletion_slot());
+    fork->set_owner(caller_id);
+
+    // The fork is a use of the key like any begin, so it counts towards MAX_USES_PER_BOOT and
+    // MIN_SECONDS_BETWEEN_OPS.
+    ContextLock lock(this);
+    if (context_->enforcement_policy()) {
+        response->error = context_->enforcement_policy()->AuthorizeOperation(
+            fork->purpose(), fork->key_id(), fork->authorizations(), request.additional_params,
+            0 /* op_handle */, true /* is_begin_operation */);
+        if (response->error != KM_ERROR_OK) return;
+    }
+
+    ReapIdleOperations();
+    Operation* added = fork.get();
+    response->error = operation_table_->Add(std::move(fork), current_time_ms());
+    if (response->error != KM_ERROR_OK) return;
+    response->op_handle = added->operation_handle();
+}
+
+namespace {
+
+// Serializes |message| into |out|, replacing its contents.
+bool SerializeInto(const Serializable& message, Buffer* out) {
+    size_t size = message.SerializedSize();
+    if (!out->Reinitialize(size)) return false;
+    uint8_t* begin = out->peek_write();
+    return message.Serialize(begin, begin + size) == begin + size && out->advance_write(size);
+}
+
+// Runs one batch entry: deserializes its request, which must fill |serialized| exactly, hands it
+// to |handler| and serializes the response into |out|.
+template <typename Request, typename Response, typename Handler>
+keymaster_error_t RunBatchEntry(int32_t message_version, const Buffer& serialized,
+                                Handler handler, Buffer* out) {
+    Request request(message_version);
+    const uint8_t* p = serialized.peek_read();
+    const uint8_t* end = p + serialized.available_read();
+    if (!request.Deserialize(&p, end) || p != end) return KM_ERROR_INVALID_ARGUMENT;
+
+    Response response(message_version);
+    handler(request, &response);
+    return SerializeInto(response, out) ? KM_ERROR_OK : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+}
+
+}  // namespace
+
+void AndroidKeymaster::ExecuteBatch(const ExecuteBatchRequest& request,
+                                    ExecuteBatchResponse* response, uint32_t caller_id) {
+    if (!response) return;
+    CountedCall counted(&counters_, EXECUTE_BATCH, &response->error);
+
+    if (request.entry_count == 0 || request.entry_count > ExecuteBatchRequest::kMaxEntries) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    if (!response->SetEntryCount(request.entry_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    // Each entry takes the context lock itself, as a separate call would, so a long batch doesn't
+    // hold off other callers between entries.
+    const int32_t ver = message_version_;
+    for (size_t i = 0; i < request.entry_count; ++i) {
+        const Buffer& in = request.requests[i];
+        Buffer* out = &response->responses[i];
+        keymaster_error_t error;
+        switch (request.commands[i]) {
+        case GENERATE_KEY:
+            error = RunBatchEntry<GenerateKeyRequest, GenerateKeyResponse>(
+                ver, in, [this](auto& req, auto* rsp) { GenerateKey(req, rsp); }, out);
+            break;
+        case IMPORT_KEY:
+            error = RunBatchEntry<ImportKeyRequest, ImportKeyResponse>(
+                ver, in, [this](auto& req, auto* rsp) { ImportKey(req, rsp); }, out);
+            break;
+        case EXPORT_KEY:
+            error = RunBatchEntry<ExportKeyRequest, ExportKeyResponse>(
+                ver, in, [this](auto& req, auto* rsp) { ExportKey(req, rsp); }, out);
+            break;
+        case GET_KEY_CHARACTERISTICS:
+            error = RunBatchEntry<GetKeyCharacteristicsRequest, GetKeyCharacteristicsResponse>(
+                ver, in, [this](auto& req, auto* rsp) { GetKeyCharacteristics(req, rsp); }, out);
+            break;
+        case ATTEST_KEY:
+            error = RunBatchEntry<AttestKeyRequest, AttestKeyResponse>(
+                ver, in, [this](auto& req, auto* rsp) { AttestKey(req, rsp); }, out);
+            break;
+        case UPGRADE_KEY:
+            error = RunBatchEntry<UpgradeKeyRequest, UpgradeKeyResponse>(
+                ver, in, [this](auto& req, auto* rsp) { UpgradeKey(req, rsp); }, out);
+            break;
+        case DELETE_KEY:
+            error = RunBatchEntry<DeleteKeyRequest, DeleteKeyResponse>(
+                ver, in, [this](auto& req, auto* rsp) { DeleteKey(req, rsp); }, out);
+            break;
+        case BEGIN_OPERATION:
+            error = RunBatchEntry<BeginOperationRequest, BeginOperationResponse>(
+                ver, in,
+                [this, caller_id](auto& req, auto* rsp) { BeginOperation(req, rsp, caller_id); },
+                out);
+            break;
+        case UPDATE_OPERATION:
+            error = RunBatchEntry<UpdateOperationRequest, UpdateOperationResponse>(
+                ver, in, [this](auto& req, auto* rsp) { UpdateOperation(req, rsp); }, out);
+            break;
+        case FINISH_OPERATION:
+            error = RunBatchEntry<FinishOperationRequest, FinishOperationResponse>(
+                ver, in, [this](auto& req, auto* rsp) { FinishOperation(req, rsp); }, out);
+            break;
+        case ABORT_OPERATION:
+            error = RunBatchEntry<AbortOperationRequest, AbortOperationResponse>(
+                ver, in, [this](auto& req, auto* rsp) { AbortOperation(req, rsp); }, out);
+            break;
+        case ONE_SHOT_OPERATION:
+            error = RunBatchEntry<OneShotOperationRequest, OneShotOperationResponse>(
+                ver, in, [this](auto& req, auto* rsp) { OneShotOperation(req, rsp); }, out);
+            break;
+        case BATCH_SIGN:
+            error = RunBatchEntry<BatchSignRequest, BatchSignResponse>(
+                ver, in, [this](auto& req, auto* rsp) { BatchSign(req, rsp); }, out);
+            break;
+        case BATCH_VERIFY:
+            error = RunBatchEntry<BatchVerifyRequest, BatchVerifyResponse>(
+                ver, in, [this](auto& req, auto* rsp) { BatchVerify(req, rsp); }, out);
+            break;
+        case PREPARE_KEY:
+            error = RunBatchEntry<PrepareKeyRequest, PrepareKeyResponse>(
+                ver, in, [this](auto& req, auto* rsp) { PrepareKey(req, rsp); }, out);
+            break;
+        case FORK_OPERATION:
+            error = RunBatchEntry<ForkOperationRequest, ForkOperationResponse>(
+                ver, in,
+                [this, caller_id](auto& req, auto* rsp) { ForkOperation(req, rsp, caller_id); },
+                out);
+            break;
+        default:
+            // Includes EXECUTE_BATCH; batches don't nest.
+            error = KM_ERROR_UNIMPLEMENTED;
+            break;
+        }
+
+        if (error != KM_ERROR_OK) {
+            // The entry gets an error-only response, which any response type deserializes.
+            EmptyKeymasterResponse entry_response(ver);
+            entry_response.error = error;
+            if (!SerializeInto(entry_response, out)) {
+                response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+                response->SetEntryCount(0);
+                return;
+            }
+        }
+    }
+    response->error = KM_ERROR_OK;
+}
+
+namespace {
+
+// Moves the output an operation wrote into |span| to its start and records its length.  Output
+// that outgrew the span moved to storage of its own, and can't be returned.
+keymaster_error_t CollectSharedMemoryOutput(const Buffer& output, uint8_t* span,
+                                            uint32_t* output_length) {
+    if (!output.uses_external_storage()) return KM_ERROR_INSUFFICIENT_BUFFER_SPACE;
+    *output_length = output.available_read();
+    if (output.peek_read() != span) memmove(span, output.peek_read(), *output_length);
+    return KM_ERROR_OK;
+}
+
+}  // namespace
+
+// Keeps a shared memory region registered, and so mapped, for the duration of one call.
+class AndroidKeymaster::SharedMemoryPin {
+  public:
+    SharedMemoryPin(AndroidKeymaster* keymaster, uint32_t region_id) : keymaster_(keymaster) {
+        std::lock_guard<std::mutex> lock(keymaster_->shared_memory_mutex_);
+        for (auto& region : keymaster_->shared_memory_) {
+            if (!region.base || region.closing || region.id != region_id) continue;
+            ++region.users;
+            region_ = &region;
+            break;
+        }
+    }
+    ~SharedMemoryPin() {
+        if (!region_) return;
+        {
+            std::lock_guard<std::mutex> lock(keymaster_->shared_memory_mutex_);
+            if (--region_->users != 0 || !region_->closing) return;
+        }
+        keymaster_->shared_memory_released_.notify_all();
+    }
+
+    SharedMemoryPin(const SharedMemoryPin&) = delete;
+    void operator=(const SharedMemoryPin&) = delete;
+
+    // Returns where |span| starts, or nullptr if the region isn't registered or doesn't contain
+    // the span.
+    uint8_t* Find(const SharedMemorySpan& span) const {
+        if (!region_) return nullptr;
+        // A pinned region's base and size don't change.
+        if (span.offset > region_->size || span.length > region_->size - span.offset) {
+            return nullptr;
+        }
+        return region_->base + span.offset;
+    }
+
+  private:
+    AndroidKeymaster* keymaster_;
+    SharedMemoryRegion* region_ = nullptr;
+};
+
+keymaster_error_t AndroidKeymaster::RegisterSharedMemory(uint8_t* base, size_t size,
+                                                         uint32_t* region_id) {
+    if (!base || !region_id) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    if (!size) return KM_ERROR_INVALID_ARGUMENT;
+
+    std::lock_guard<std::mutex> lock(shared_memory_mutex_);
+    for (auto& region : shared_memory_) {
+        if (region.base) continue;
+        if (!next_shared_memory_id_) ++next_shared_memory_id_;  // Zero is never an ID.
+        region.id = next_shared_memory_id_++;
+        region.base = base;
+        region.size = size;
+        *region_id = region.id;
+        return KM_ERROR_OK;
+    }
+    return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+}
+
+keymaster_error_t AndroidKeymaster::UnregisterSharedMemory(uint32_t region_id) {
+    std::unique_lock<std::mutex> lock(shared_memory_mutex_);
+    for (auto& region : shared_memory_) {
+        if (!region.base || region.closing || region.id != region_id) continue;
+        // The caller unmaps the region once this returns, so calls still using it must finish.
+        region.closing = true;
+        shared_memory_released_.wait(lock, [&] { return region.users == 0; });
+        region = {};
+        return KM_ERROR_OK;
+    }
+    return KM_ERROR_INVALID_ARGUMENT;
+}
+
+void AndroidKeymaster::SharedMemoryOperation(const SharedMemoryOperationRequest& request,
+                                             SharedMemoryOperationResponse* response) {
+    if (!response) return;
+    CountedCall counted(&counters_, SHARED_MEMORY_OPERATION, &response->error);
+
+    // The region stays mapped until the pin goes, after the last access to it below.
+    SharedMemoryPin pin(this, request.region_id);
+    uint8_t* input = pin.Find(request.input);
+    uint8_t* output = pin.Find(request.output);
+    if (!input || !output ||
+        (input < output + request.output.length && output < input + request.input.length)) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    // Buffer positions are ints.
+    if (request.input.length > INT32_MAX || request.output.length > INT32_MAX) {
+        response->error = KM_ERROR_INVALID_INPUT_LENGTH;
+        return;
+    }
+
+    // The messages' buffers work in place on the shared memory, so the data is never copied.
+    if (request.finish) {
+        FinishOperationRequest finish_request(message_version());
+        finish_request.op_handle = request.op_handle;
+        finish_request.input.UseExternalStorage(input, request.input.length);
+        finish_request.input.advance_write(static_cast<int>(request.input.length));
+        finish_request.signature.Reinitialize(request.signature);
+        finish_request.additional_params.Reinitialize(request.additional_params);
+        FinishOperationResponse finish_response(message_version());
+        finish_response.output.UseExternalStorage(output, request.output.length);
+        FinishOperation(finish_request, &finish_response);
+        response->error = finish_response.error;
+        if (response->error != KM_ERROR_OK) return;
+
+        response->input_consumed = request.input.length;
+        response->output_params = std::move(finish_response.output_params);
+        response->error =
+            CollectSharedMemoryOutput(finish_response.output, output, &response->output_length);
+        return;
+    }
+
+    UpdateOperationRequest update_request(message_version());
+    update_request.op_handle = request.op_handle;
+    update_request.input.UseExternalStorage(input, request.input.length);
+    update_request.input.advance_write(static_cast<int>(request.input.length));
+    update_request.additional_params.Reinitialize(request.additional_params);
+    UpdateOperationResponse update_response(message_version());
+    update_response.output.UseExternalStorage(output, request.output.length);
+    UpdateOperation(update_request, &update_response);
+    response->error = update_response.error;
+    if (response->error != KM_ERROR_OK) return;
+
+    response->input_consumed = update_response.input_consumed;
+    response->output_params = std::move(update_response.output_params);
+    response->error =
+        CollectSharedMemoryOutput(update_response.output, output, &response->output_length);
+    if (response->error != KM_ERROR_OK) {
+        // The output is lost, so the operation can't meaningfully continue.
+        AbortOperationRequest abort_request(message_version());
+        abort_request.op_handle = request.op_handle;
+        AbortOperationResponse abort_response(message_version());
+        AbortOperation(abort_request, &abort_response);
+    }
+}
+
 void AndroidKeymaster::ExportKey(const ExportKeyRequest& request, ExportKeyResponse* response) {
+    ContextLock lock(this);
     if (response == nullptr) return;
+    RecordedCall recorded(request_recorder_, &counters_, EXPORT_KEY, message_version_,
+                          &response->error);
+    recorded.set_key(request.key_blob);
+    recorded.set_key_format(request.key_format);
+    recorded.set_params(request.additional_params);
 
     UniquePtr<Key> key;
     response->error =
-        context_->ParseKeyBlob(KeymasterKeyBlob(request.key_blob), request.additional_params, &key);
+        context_->ParseKeyBlob(BorrowedKeyBlob(request.key_blob), request.additional_params, &key);
     if (response->error != KM_ERROR_OK) return;
+    recorded.set_key_characteristics(key->hw_enforced(), key->sw_enforced());
 
     UniquePtr<uint8_t[]> out_key;
     size_t size;
@@ -802,10 +2135,16 @@ void AndroidKeymaster::ExportKey(const ExportKeyRequest& request, ExportKeyRespo
 }
 
 void AndroidKeymaster::AttestKey(const AttestKeyRequest& request, AttestKeyResponse* response) {
+    ContextLock lock(this);
     if (!response) return;
+    RecordedCall recorded(request_recorder_, &counters_, ATTEST_KEY, message_version_,
+                          &response->error);
+    recorded.set_key(request.key_blob);
+    recorded.set_params(request.attest_params);
 
     UniquePtr<Key> key = LoadKey(request.key_blob, request.attest_params, &response->error);
     if (!key) return;
+    recorded.set_key_characteristics(key->hw_enforced(), key->sw_enforced());
 
     keymaster_blob_t attestation_application_id;
     if (request.attest_params.GetTagValue(TAG_ATTESTATION_APPLICATION_ID,
@@ -819,17 +2158,54 @@ void AndroidKeymaster::AttestKey(const AttestKeyRequest& request, AttestKeyRespo
 }
 
 void AndroidKeymaster::UpgradeKey(const UpgradeKeyRequest& request, UpgradeKeyResponse* response) {
+    ContextLock lock(this);
     if (!response) return;
+    RecordedCall recorded(request_recorder_, &counters_, UPGRADE_KEY, message_version_,
+                          &response->error);
+    recorded.set_key(request.key_blob);
+    recorded.set_params(request.upgrade_params);
+    recorded.set_created_key(response->upgraded_key);
 
     KeymasterKeyBlob upgraded_key;
-    response->error = context_->UpgradeKeyBlob(KeymasterKeyBlob(request.key_blob),
+    response->error = context_->UpgradeKeyBlob(BorrowedKeyBlob(request.key_blob),
                                                request.upgrade_params, &upgraded_key);
     if (response->error != KM_ERROR_OK) return;
     response->upgraded_key = upgraded_key.release();
 }
 
+void AndroidKeymaster::UpgradeKeys(const UpgradeKeysRequest& request,
+                                   UpgradeKeysResponse* response) {
+    ContextLock lock(this);
+    if (!response) return;
+    CountedCall counted(&counters_, UPGRADE_KEYS, &response->error);
+
+    if (request.key_count == 0 || request.key_count > UpgradeKeysRequest::kMaxKeys) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    if (!response->SetKeyCount(request.key_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    context_->UpgradeKeyBlobs(request.key_blobs.get(), request.key_count, request.upgrade_params,
+                              response->upgraded_keys.get(), response->key_errors.get(),
+                              ParallelWorkerCount());
+    for (size_t i = 0; i < response->key_count; ++i) {
+        if (response->key_errors[i] != KM_ERROR_OK) response->upgraded_keys[i].Clear();
+    }
+    response->error = KM_ERROR_OK;
+}
+
 void AndroidKeymaster::ImportKey(const ImportKeyRequest& request, ImportKeyResponse* response) {
+    ContextLock lock(this);
     if (response == nullptr) return;
+    RecordedCall recorded(request_recorder_, &counters_, IMPORT_KEY, message_version_,
+                          &response->error);
+    recorded.set_params(request.key_description);
+    recorded.set_key_format(request.key_format);
+    recorded.set_input_length(request.key_data.key_material_size);
+    recorded.set_created_key(response->key_blob);
 
     const KeyFactory* factory =
         get_key_factory(request.key_description, *context_, &response->error);
@@ -868,23 +2244,101 @@ void AndroidKeymaster::ImportKey(const ImportKeyRequest& request, ImportKeyRespo
                                          &response->certificate_chain);
 }
 
+void AndroidKeymaster::ImportKeys(const ImportKeysRequest& request, ImportKeysResponse* response) {
+    ContextLock lock(this);
+    if (!response) return;
+    CountedCall counted(&counters_, IMPORT_KEYS, &response->error);
+
+    if (request.key_count == 0 || request.key_count > ImportKeysRequest::kMaxKeys) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    if (!response->SetKeyCount(request.key_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    bool early_boot_ended =
+        context_->enforcement_policy() && !context_->enforcement_policy()->in_early_boot();
+    for (size_t i = 0; i < request.key_count; ++i) {
+        const AuthorizationSet& key_description = request.key_descriptions[i];
+        keymaster_error_t* error = &response->key_errors[i];
+
+        const KeyFactory* factory = get_key_factory(key_description, *context_, error);
+        if (!factory) continue;
+
+        // The response has no room for certificate chains, so asymmetric keys, which would get
+        // one, have to be imported one at a time.
+        keymaster_algorithm_t algorithm = KM_ALGORITHM_AES;
+        key_description.GetTagValue(TAG_ALGORITHM, &algorithm);
+        if (algorithm != KM_ALGORITHM_AES && algorithm != KM_ALGORITHM_TRIPLE_DES &&
+            algorithm != KM_ALGORITHM_HMAC) {
+            *error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+            continue;
+        }
+
+        if (early_boot_ended && key_description.GetTagValue(TAG_EARLY_BOOT_ONLY)) {
+            *error = KM_ERROR_EARLY_BOOT_ENDED;
+            continue;
+        }
+
+        CertificateChain certificate_chain;
+        *error = factory->ImportKey(key_description,           //
+                                    request.key_formats[i],    //
+                                    request.key_data[i],       //
+                                    {} /* attest_key */,       //
+                                    {} /* issuer_subject */,   //
+                                    &response->key_blobs[i],   //
+                                    &response->enforced[i],    //
+                                    &response->unenforced[i],  //
+                                    &certificate_chain);
+    }
+    response->error = KM_ERROR_OK;
+}
+
 void AndroidKeymaster::DeleteKey(const DeleteKeyRequest& request, DeleteKeyResponse* response) {
+    ContextLock lock(this);
     if (!response) return;
-    response->error = context_->DeleteKey(KeymasterKeyBlob(request.key_blob));
+    RecordedCall recorded(request_recorder_, &counters_, DELETE_KEY, message_version_,
+                          &response->error);
+    recorded.set_key(request.key_blob);
+    response->error = context_->DeleteKey(BorrowedKeyBlob(request.key_blob));
+}
+
+void AndroidKeymaster::DeleteKeys(const DeleteKeysRequest& request, DeleteKeysResponse* response) {
+    ContextLock lock(this);
+    if (!response) return;
+    CountedCall counted(&counters_, DELETE_KEYS, &response->error);
+
+    if (request.key_count == 0 || request.key_count > DeleteKeysRequest::kMaxKeys) {
+        response->error = KM_ERROR_INVALID_ARGUMENT;
+        return;
+    }
+    if (!response->SetKeyCount(request.key_count)) {
+        response->error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+
+    context_->DeleteKeys(request.key_blobs.get(), request.key_count, response->key_errors.get());
+    response->error = KM_ERROR_OK;
 }
 
 void AndroidKeymaster::DeleteAllKeys(const DeleteAllKeysRequest&, DeleteAllKeysResponse* response) {
+    ContextLock lock(this);
     if (!response) return;
+    CountedCall counted(&counters_, DELETE_ALL_KEYS, &response->error);
     response->error = context_->DeleteAllKeys();
 }
 
 void AndroidKeymaster::Configure(const ConfigureRequest& request, ConfigureResponse* response) {
+    ContextLock lock(this);
     if (!response) return;
     response->error = context_->SetSystemVersion(request.os_version, request.os_patchlevel);
 }
 
 ConfigureVendorPatchlevelResponse
 AndroidKeymaster::ConfigureVendorPatchlevel(const ConfigureVendorPatchlevelRequest& request) {
+    ContextLock lock(this);
     ConfigureVendorPatchlevelResponse rsp(message_version());
     rsp.error = context_->SetVendorPatchlevel(request.vendor_patchlevel);
     return rsp;
@@ -892,6 +2346,7 @@ AndroidKeymaster::ConfigureVendorPatchlevel(const ConfigureVendorPatchlevelReque
 
 ConfigureBootPatchlevelResponse
 AndroidKeymaster::ConfigureBootPatchlevel(const ConfigureBootPatchlevelRequest& request) {
+    ContextLock lock(this);
     ConfigureBootPatchlevelResponse rsp(message_version());
     rsp.error = context_->SetBootPatchlevel(request.boot_patchlevel);
     return rsp;
@@ -899,6 +2354,7 @@ AndroidKeymaster::ConfigureBootPatchlevel(const ConfigureBootPatchlevelRequest&
 
 ConfigureVerifiedBootInfoResponse
 AndroidKeymaster::ConfigureVerifiedBootInfo(const ConfigureVerifiedBootInfoRequest& request) {
+    ContextLock lock(this);
     ConfigureVerifiedBootInfoResponse rsp(message_version());
     rsp.error = context_->SetVerifiedBootInfo(request.boot_state, request.bootloader_state,
                                               request.vbmeta_digest);
@@ -909,14 +2365,225 @@ bool AndroidKeymaster::has_operation(keymaster_operation_handle_t op_handle) con
     return operation_table_->Find(op_handle) != nullptr;
 }
 
+void AndroidKeymaster::set_evict_lru_operations(bool evict_lru) {
+    operation_table_->set_evict_lru(evict_lru);
+}
+
+size_t AndroidKeymaster::ReapIdleOperations() {
+    if (operation_idle_timeout_ms_ == 0) return 0;
+    return operation_table_->ReapIdle(current_time_ms(), operation_idle_timeout_ms_);
+}
+
+void AndroidKeymaster::set_operation_quotas(size_t soft_quota, size_t hard_quota) {
+    operation_table_->set_quotas(soft_quota, hard_quota);
+}
+
+void AndroidKeymaster::set_operation_memory_budget(size_t bytes) {
+    operation_table_->set_memory_budget(bytes);
+}
+
+keymaster_error_t AndroidKeymaster::set_operation_table_sizing(size_t min_size, size_t max_size,
+                                                               size_t segment_size,
+                                                               uint64_t window_ms) {
+    return operation_table_->set_adaptive_size(min_size, max_size, segment_size, window_ms);
+}
+
+const OperationTable& AndroidKeymaster::operation_table() const {
+    return *operation_table_;
+}
+
+namespace {
+
+// Handoff snapshot layout, before sealing: magic, version, operation count, then for each
+// operation its handle, purpose, owner, size-prefixed key blob, begin parameters and
+// size-prefixed saved state.
+constexpr uint32_t kHandoffMagic = 0x4f484b4b;  // "KKHO", little-endian.
+constexpr uint32_t kHandoffVersion = 1;
+
+}  // namespace
+
+keymaster_error_t AndroidKeymaster::SnapshotOperations(std::vector<uint8_t>* snapshot,
+                                                       size_t* handed_off) {
+    ContextLock lock(this);
+    *handed_off = 0;
+
+    struct Saved {
+        keymaster_operation_handle_t op_handle;
+        const Operation* operation;
+        Buffer state;
+    };
+    std::vector<keymaster_operation_handle_t> handles;
+    operation_table_->GetHandles(&handles);
+    std::vector<Saved> saved;
+    saved.reserve(handles.size());
+    size_t size = 3 * sizeof(uint32_t);
+    // The operations stay checked out until they're deleted, so no update or finish can change
+    // one after its state is saved.  Waiting for a busy operation could deadlock with a call that
+    // takes the context lock while holding it, so the snapshot fails instead.
+    CheckedOutOperations checked_out(operation_table_.get());
+    for (keymaster_operation_handle_t op_handle : handles) {
+        bool busy;
+        Operation* operation = checked_out.TryCheckout(op_handle, &busy);
+        if (busy) return KM_ERROR_CONCURRENT_ACCESS_CONFLICT;
+        if (!operation || !operation->origin() || operation->confirmation_verifier() ||
+            operation->authorizations().Contains(TAG_USER_SECURE_ID)) {
+            continue;
+        }
+        Buffer state;
+        keymaster_error_t error = operation->SaveState(&state);
+        if (error == KM_ERROR_UNIMPLEMENTED) continue;
+        if (error != KM_ERROR_OK) return error;
+        const Operation::Origin& origin = *operation->origin();
+        size += sizeof(uint64_t) + 2 * sizeof(uint32_t) + origin.key_blob.SerializedSize() +
+                origin.begin_params.SerializedSize() + sizeof(uint32_t) + state.available_read();
+        saved.push_back({op_handle, operation, std::move(state)});
+    }
+
+    // The saved state can hold intermediate secrets, so it's assembled where it will be zeroed.
+    KeymasterKeyBlob plaintext(size);
+    if (!plaintext.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint8_t* buf = plaintext.writable_data();
+    const uint8_t* end = plaintext.end();
+    buf = append_uint32_to_buf(buf, end, kHandoffMagic);
+    buf = append_uint32_to_buf(buf, end, kHandoffVersion);
+    buf = append_uint32_to_buf(buf, end, saved.size());
+    for (const Saved& entry : saved) {
+        const Operation::Origin& origin = *entry.operation->origin();
+        buf = append_uint64_to_buf(buf, end, entry.op_handle);
+        buf = append_uint32_to_buf(buf, end, entry.operation->purpose());
+        buf = append_uint32_to_buf(buf, end, entry.operation->owner());
+        buf = origin.key_blob.Serialize(buf, end);
+        buf = origin.begin_params.Serialize(buf, end);
+        buf = append_size_and_data_to_buf(buf, end, entry.state.peek_read(),
+                                          entry.state.available_read());
+    }
+    if (buf != end) return KM_ERROR_UNKNOWN_ERROR;
+
+    keymaster_error_t error = context_->SealHandoffState(plaintext, snapshot);
+    if (error != KM_ERROR_OK) return error;
+
+    // The operations now continue wherever the snapshot is restored.
+    for (const Saved& entry : saved) {
+        operation_table_->Delete(entry.op_handle);
+    }
+    *handed_off = saved.size();
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::RestoreOperations(
+    const uint8_t* snapshot, size_t size,
+    std::vector<std::pair<keymaster_operation_handle_t, keymaster_operation_handle_t>>* handles) {
+    ContextLock lock(this);
+    KeymasterKeyBlob plaintext;
+    keymaster_error_t error = context_->OpenHandoffState(snapshot, size, &plaintext);
+    if (error != KM_ERROR_OK) return error;
+
+    struct Record {
+        keymaster_operation_handle_t op_handle;
+        uint32_t purpose;
+        uint32_t owner;
+        KeymasterKeyBlob key_blob;
+        AuthorizationSet begin_params;
+        Buffer state;
+    };
+    const uint8_t* pos = plaintext.begin();
+    const uint8_t* end = plaintext.end();
+    uint32_t magic, version, count;
+    if (!copy_uint32_from_buf(&pos, end, &magic) || !copy_uint32_from_buf(&pos, end, &version) ||
+        !copy_uint32_from_buf(&pos, end, &count) || magic != kHandoffMagic ||
+        version != kHandoffVersion || count > operation_table_->max_table_size()) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    // Everything is parsed before anything is restored, so a malformed snapshot restores nothing.
+    std::vector<Record> records(count);
+    for (Record& record : records) {
+        if (!copy_uint64_from_buf(&pos, end, &record.op_handle) ||
+            !copy_uint32_from_buf(&pos, end, &record.purpose) ||
+            !copy_uint32_from_buf(&pos, end, &record.owner) ||
+            !record.key_blob.Deserialize(&pos, end) ||
+            !record.begin_params.Deserialize(&pos, end) ||
+            !record.state.Deserialize(&pos, end)) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+    }
+    if (pos != end) return KM_ERROR_INVALID_ARGUMENT;
+
+    for (const Record& record : records) {
+        keymaster_operation_handle_t op_handle;
+        error = RestoreOperation(record.key_blob, static_cast<keymaster_purpose_t>(record.purpose),
+                                 record.begin_params, record.owner, record.state, &op_handle);
+        if (error != KM_ERROR_OK) {
+            LOG_E("Couldn't restore handed-off operation: %d", error);
+            continue;
+        }
+        handles->emplace_back(record.op_handle, op_handle);
+    }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AndroidKeymaster::RestoreOperation(const KeymasterKeyBlob& key_blob,
+                                                     keymaster_purpose_t purpose,
+                                                     const AuthorizationSet& begin_params,
+                                                     uint32_t owner, const Buffer& state,
+                                                     keymaster_operation_handle_t* op_handle) {
+    keymaster_error_t error;
+    UniquePtr<Key> key = LoadKey(key_blob, begin_params, &error);
+    if (!key) return error;
+    OperationFactory* factory = key->key_factory()->GetOperationFactory(purpose);
+    if (!factory) return KM_ERROR_UNSUPPORTED_PURPOSE;
+
+    uint32_t sd_slot = key->secure_deletion_slot();
+    km_id_t key_id;
+    bool have_key_id = key->key_id(&key_id);
+    OperationPtr operation = factory->CreateOperation(std::move(*key), begin_params, &error);
+    if (!operation) return error;
+    operation->set_secure_deletion_slot(sd_slot);
+    operation->set_owner(owner);
+    if (context_->enforcement_policy()) {
+        if (!have_key_id && !context_->enforcement_policy()->CreateKeyId(key_blob, &key_id)) {
+            return KM_ERROR_UNKNOWN_ERROR;
+        }
+        operation->set_key_id(key_id);
+        // The key may have expired, or need an unlocked device, since the operation was begun,
+        // so the begin-time checks are run again.
+        error = context_->enforcement_policy()->AuthorizeOperation(
+            purpose, key_id, operation->authorizations(), begin_params, 0 /* op_handle */,
+            true /* is_begin_operation */);
+        if (error != KM_ERROR_OK) return error;
+    }
+
+    error = operation->RestoreState(state);
+    if (error != KM_ERROR_OK) return error;
+    if (operation_handoff_) {
+        UniquePtr<Operation::Origin> origin(
+            new (std::nothrow) Operation::Origin{key_blob, begin_params});
+        if (origin && origin->key_blob.size() == key_blob.size() &&
+            origin->begin_params.is_valid() == AuthorizationSet::OK) {
+            operation->set_origin(std::move(origin));
+        }
+    }
+
+    Operation* added = operation.get();
+    error = operation_table_->Add(std::move(operation), current_time_ms());
+    if (error != KM_ERROR_OK) return error;
+    *op_handle = added->operation_handle();
+    return KM_ERROR_OK;
+}
+
+uint64_t AndroidKeymaster::current_time_ms() const {
+    KeymasterEnforcement* policy = context_->enforcement_policy();
+    return policy ? policy->get_current_time_ms() : 0;
+}
+
 UniquePtr<Key> AndroidKeymaster::LoadKey(const keymaster_key_blob_t& key_blob,
                                          const AuthorizationSet& additional_params,
                                          keymaster_error_t* error) {
+    KEYMASTER_TRACE("LoadKey");
     if (!error) return {};
 
     UniquePtr<Key> key;
     KeymasterKeyBlob key_material;
-    *error = context_->ParseKeyBlob(KeymasterKeyBlob(key_blob), additional_params, &key);
+    *error = context_->ParseKeyBlob(BorrowedKeyBlob(key_blob), additional_params, &key);
     if (*error != KM_ERROR_OK) return {};
 
     *error = CheckVersionInfo(key->hw_enforced(), key->sw_enforced(), *context_);
@@ -927,7 +2594,9 @@ UniquePtr<Key> AndroidKeymaster::LoadKey(const keymaster_key_blob_t& key_blob,
 
 void AndroidKeymaster::ImportWrappedKey(const ImportWrappedKeyRequest& request,
                                         ImportWrappedKeyResponse* response) {
+    ContextLock lock(this);
     if (!response) return;
+    CountedCall counted(&counters_, IMPORT_WRAPPED_KEY, &response->error);
 
     KeymasterKeyBlob secret_key;
     AuthorizationSet key_description;
@@ -976,6 +2645,7 @@ void AndroidKeymaster::ImportWrappedKey(const ImportWrappedKeyRequest& request,
 }
 
 EarlyBootEndedResponse AndroidKeymaster::EarlyBootEnded() {
+    // The enforcement state is atomic, so this needn't wait for calls holding the context lock.
     EarlyBootEndedResponse response(message_version());
     response.error = KM_ERROR_UNIMPLEMENTED;
 
@@ -988,6 +2658,7 @@ EarlyBootEndedResponse AndroidKeymaster::EarlyBootEnded() {
 }
 
 DeviceLockedResponse AndroidKeymaster::DeviceLocked(const DeviceLockedRequest& request) {
+    // As for EarlyBootEnded(), no context lock is needed.
     DeviceLockedResponse response(message_version());
     response.error = KM_ERROR_UNIMPLEMENTED;
 
@@ -1000,6 +2671,7 @@ DeviceLockedResponse AndroidKeymaster::DeviceLocked(const DeviceLockedRequest& r
 }
 
 GetRootOfTrustResponse AndroidKeymaster::GetRootOfTrust(const GetRootOfTrustRequest& request) {
+    ContextLock lock(this);
     GetRootOfTrustResponse response(message_version());
 
     if (!context_->attestation_context()) {
@@ -1035,16 +2707,18 @@ GetRootOfTrustResponse AndroidKeymaster::GetRootOfTrust(const GetRootOfTrustRequ
         return *std::move(mac);
     };
 
-    auto maced_root_of_trust = cppcose::constructCoseMac0(
-        macFunction,  //
-        request.challenge,
-        cppbor::SemanticTag(kRoTVersion1, cppbor::Array(                                //
-                                              blob2Pair(vbParams->verified_boot_key),   //
-                                              vbParams->device_locked,                  //
-                                              vbParams->verified_boot_state,            //
-                                              blob2Pair(vbParams->verified_boot_hash),  //
-                                              *boot_patch_level))
-            .encode());
+    // The encoded root of trust only changes when the boot info is configured, so use the
+    // context's copy if it keeps one.
+    auto root_of_trust = context_->attestation_context()->GetRootOfTrustEncodings();
+    const std::vector<uint8_t>* payload = root_of_trust ? &root_of_trust->cbor : nullptr;
+    std::vector<uint8_t> encoded_root_of_trust;
+    if (!payload || payload->empty()) {
+        encoded_root_of_trust = encode_root_of_trust_cbor(*vbParams, *boot_patch_level);
+        payload = &encoded_root_of_trust;
+    }
+
+    auto maced_root_of_trust =
+        cppcose::constructCoseMac0(macFunction, request.challenge, *payload);
 
     if (!maced_root_of_trust) {
         LOG_E("Error MACing RoT: %s", maced_root_of_trust.message().c_str());
@@ -1060,6 +2734,7 @@ GetRootOfTrustResponse AndroidKeymaster::GetRootOfTrust(const GetRootOfTrustRequ
 }
 
 GetHwInfoResponse AndroidKeymaster::GetHwInfo() {
+    ContextLock lock(this);
     GetHwInfoResponse response(message_version());
 
     auto rem_prov_ctx = context_->GetRemoteProvisioningContext();
@@ -1076,6 +2751,7 @@ GetHwInfoResponse AndroidKeymaster::GetHwInfo() {
 
 SetAttestationIdsResponse
 AndroidKeymaster::SetAttestationIds(const SetAttestationIdsRequest& request) {
+    ContextLock lock(this);
     SetAttestationIdsResponse response(message_version());
     response.error = context_->SetAttestationIds(request);
     return response;
@@ -1083,6 +2759,7 @@ AndroidKeymaster::SetAttestationIds(const SetAttestationIdsRequest& request) {
 
 SetAttestationIdsKM3Response
 AndroidKeymaster::SetAttestationIdsKM3(const SetAttestationIdsKM3Request& request) {
+    ContextLock lock(this);
     SetAttestationIdsKM3Response response(message_version());
     response.error = context_->SetAttestationIdsKM3(request);
     return response;
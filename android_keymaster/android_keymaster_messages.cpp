@@ -40,6 +40,10 @@ uint8_t* serialize_key_blob(const keymaster_key_blob_t& key_blob, uint8_t* buf,
     return append_size_and_data_to_buf(buf, end, key_blob.key_material, key_blob.key_material_size);
 }
 
+bool serialize_key_blob_to(const keymaster_key_blob_t& key_blob, SerializationSink* sink) {
+    return sink->WriteSizeAndData(key_blob.key_material, key_blob.key_material_size);
+}
+
 bool deserialize_key_blob(keymaster_key_blob_t* key_blob, const uint8_t** buf_ptr,
                           const uint8_t* end) {
     delete[] key_blob->key_material;
@@ -102,6 +106,17 @@ uint8_t* serialize_chain(const keymaster_cert_chain_t& certificate_chain, uint8_
     return buf;
 }
 
+bool serialize_chain_to(const keymaster_cert_chain_t& certificate_chain, SerializationSink* sink) {
+    if (!sink->WriteUint32(certificate_chain.entry_count)) return false;
+    for (size_t i = 0; i < certificate_chain.entry_count; ++i) {
+        if (!sink->WriteSizeAndData(certificate_chain.entries[i].data,
+                                    certificate_chain.entries[i].data_length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 CertificateChain deserialize_chain(const uint8_t** buf_ptr, const uint8_t* end) {
     size_t entry_count;
     if (!copy_uint32_from_buf(buf_ptr, end, &entry_count) || entry_count > kMaxChainEntryCount) {
@@ -122,6 +137,39 @@ CertificateChain deserialize_chain(const uint8_t** buf_ptr, const uint8_t* end)
     return certificate_chain;
 }
 
+/*
+ * From message version 5, UpdateOperation messages lead with a presence byte and omit the data
+ * buffer and parameter set it marks absent, so the common update with no parameters costs no
+ * bytes for them.
+ */
+
+constexpr int32_t kCompactUpdateMessageVersion = 5;
+
+// From message version 5, BeginOperationResponse also carries the operation's chunk sizes.
+constexpr int32_t kChunkSizeMessageVersion = 5;
+
+// From message version 5, BeginOperationRequest also carries an optional early signature.
+constexpr int32_t kEarlySignatureMessageVersion = 5;
+
+enum UpdatePresence : uint8_t {
+    kUpdateHasData = 1 << 0,
+    kUpdateHasParams = 1 << 1,
+};
+
+uint8_t update_presence(const Buffer& data, const AuthorizationSet& params) {
+    return (data.available_read() ? kUpdateHasData : 0) | (params.size() ? kUpdateHasParams : 0);
+}
+
+size_t compact_update_size(uint8_t presence, const Buffer& data, const AuthorizationSet& params) {
+    return sizeof(presence) + (presence & kUpdateHasData ? data.SerializedSize() : 0) +
+           (presence & kUpdateHasParams ? params.SerializedSize() : 0);
+}
+
+bool copy_presence_from_buf(const uint8_t** buf_ptr, const uint8_t* end, uint8_t* presence) {
+    return copy_from_buf(buf_ptr, end, presence, sizeof(*presence)) &&
+           !(*presence & ~(kUpdateHasData | kUpdateHasParams));
+}
+
 }  // namespace
 
 int32_t NegotiateMessageVersion(const GetVersionResponse& response, keymaster_error_t* error) {
@@ -178,6 +226,20 @@ bool KeymasterResponse::Deserialize(const uint8_t** buf_ptr, const uint8_t* end)
     return NonErrorDeserialize(buf_ptr, end);
 }
 
+bool KeymasterResponse::SerializeTo(SerializationSink* sink) const {
+    if (!sink->WriteUint32(error)) return false;
+    if (error != KM_ERROR_OK) return true;
+    return NonErrorSerializeTo(sink);
+}
+
+bool KeymasterResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    size_t size = NonErrorSerializedSize();
+    if (size == 0) return sink->ok();
+    uint8_t* buf = sink->Reserve(size);
+    if (!buf) return false;
+    return NonErrorSerialize(buf, buf + size) == buf + size;
+}
+
 size_t GenerateKeyRequest::SerializedSize() const {
     size_t size = key_description.SerializedSize();
     if (message_version < 4) return size;
@@ -218,6 +280,15 @@ uint8_t* GenerateKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end
     return serialize_chain(certificate_chain, buf, end);
 }
 
+bool GenerateKeyResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (!serialize_key_blob_to(key_blob, sink) || !enforced.SerializeTo(sink) ||
+        !unenforced.SerializeTo(sink)) {
+        return false;
+    }
+    if (message_version < 4) return true;
+    return serialize_chain_to(certificate_chain, sink);
+}
+
 bool GenerateKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||  //
         !enforced.Deserialize(buf_ptr, end) ||             //
@@ -243,6 +314,52 @@ bool GenerateRkpKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const
            deserialize_blob(&maced_public_key, buf_ptr, end);
 }
 
+size_t GenerateRkpKeyBatchResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += key_blob_size(key_blobs[i]) + blob_size(maced_public_keys[i]);
+    }
+    return size;
+}
+
+uint8_t* GenerateRkpKeyBatchResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = serialize_key_blob(key_blobs[i], buf, end);
+        buf = serialize_blob(maced_public_keys[i], buf, end);
+    }
+    return buf;
+}
+
+bool GenerateRkpKeyBatchResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
+                                                      const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) ||
+        count > GenerateRkpKeyBatchRequest::kMaxKeys || !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!deserialize_key_blob(&key_blobs[i], buf_ptr, end) ||
+            !deserialize_blob(&maced_public_keys[i], buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GenerateRkpKeyBatchResponse::SetKeyCount(size_t count) {
+    key_blobs.reset(count ? new (std::nothrow) KeymasterKeyBlob[count] : nullptr);
+    maced_public_keys.reset(count ? new (std::nothrow) KeymasterBlob[count] : nullptr);
+    if (count && (!key_blobs || !maced_public_keys)) {
+        key_blobs.reset();
+        maced_public_keys.reset();
+        key_count = 0;
+        return false;
+    }
+    key_count = count;
+    return true;
+}
+
 size_t GenerateCsrRequest::SerializedSize() const {
     size_t size = sizeof(uint8_t); /* test_mode */
     size += sizeof(uint32_t);      /* num_keys */
@@ -406,47 +523,92 @@ bool GetKeyCharacteristicsResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
     return enforced.Deserialize(buf_ptr, end) && unenforced.Deserialize(buf_ptr, end);
 }
 
+PrepareKeyRequest::~PrepareKeyRequest() {
+    delete[] key_blob.key_material;
+}
+
+void PrepareKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t PrepareKeyRequest::SerializedSize() const {
+    return key_blob_size(key_blob) + additional_params.SerializedSize();
+}
+
+uint8_t* PrepareKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end);
+    return additional_params.Serialize(buf, end);
+}
+
+bool PrepareKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return deserialize_key_blob(&key_blob, buf_ptr, end) &&
+           additional_params.Deserialize(buf_ptr, end);
+}
+
 void BeginOperationRequest::SetKeyMaterial(const void* key_material, size_t length) {
     set_key_blob(&key_blob, key_material, length);
 }
 
 size_t BeginOperationRequest::SerializedSize() const {
-    return sizeof(uint32_t) /* purpose */ + key_blob_size(key_blob) +
-           additional_params.SerializedSize();
+    size_t size = sizeof(uint32_t) /* purpose */ + key_blob_size(key_blob) +
+                  additional_params.SerializedSize();
+    if (message_version >= kEarlySignatureMessageVersion) size += signature.SerializedSize();
+    return size;
 }
 
 uint8_t* BeginOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
     buf = append_uint32_to_buf(buf, end, purpose);
     buf = serialize_key_blob(key_blob, buf, end);
-    return additional_params.Serialize(buf, end);
+    buf = additional_params.Serialize(buf, end);
+    if (message_version >= kEarlySignatureMessageVersion) buf = signature.Serialize(buf, end);
+    return buf;
 }
 
 bool BeginOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return copy_uint32_from_buf(buf_ptr, end, &purpose) &&
-           deserialize_key_blob(&key_blob, buf_ptr, end) &&
-           additional_params.Deserialize(buf_ptr, end);
+    bool retval = copy_uint32_from_buf(buf_ptr, end, &purpose) &&
+                  deserialize_key_blob(&key_blob, buf_ptr, end) &&
+                  additional_params.Deserialize(buf_ptr, end);
+    if (retval && message_version >= kEarlySignatureMessageVersion) {
+        retval = signature.Deserialize(buf_ptr, end);
+    }
+    return retval;
 }
 
 size_t BeginOperationResponse::NonErrorSerializedSize() const {
-    if (message_version == 0)
-        return sizeof(op_handle);
-    else
-        return sizeof(op_handle) + output_params.SerializedSize();
+    if (message_version == 0) return sizeof(op_handle);
+    size_t size = sizeof(op_handle) + output_params.SerializedSize();
+    if (message_version >= kChunkSizeMessageVersion) {
+        size += sizeof(recommended_chunk_size) + sizeof(max_chunk_size);
+    }
+    return size;
 }
 
 uint8_t* BeginOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
     buf = append_uint64_to_buf(buf, end, op_handle);
     if (message_version > 0) buf = output_params.Serialize(buf, end);
+    if (message_version >= kChunkSizeMessageVersion) {
+        buf = append_uint32_to_buf(buf, end, recommended_chunk_size);
+        buf = append_uint32_to_buf(buf, end, max_chunk_size);
+    }
     return buf;
 }
 
 bool BeginOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     bool retval = copy_uint64_from_buf(buf_ptr, end, &op_handle);
     if (retval && message_version > 0) retval = output_params.Deserialize(buf_ptr, end);
+    if (retval && message_version >= kChunkSizeMessageVersion) {
+        retval = copy_uint32_from_buf(buf_ptr, end, &recommended_chunk_size) &&
+                 copy_uint32_from_buf(buf_ptr, end, &max_chunk_size);
+    }
     return retval;
 }
 
 size_t UpdateOperationRequest::SerializedSize() const {
+    if (message_version >= kCompactUpdateMessageVersion) {
+        return sizeof(op_handle) +
+               compact_update_size(update_presence(input, additional_params), input,
+                                   additional_params);
+    }
     if (message_version == 0)
         return sizeof(op_handle) + input.SerializedSize();
     else
@@ -455,12 +617,30 @@ size_t UpdateOperationRequest::SerializedSize() const {
 
 uint8_t* UpdateOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
     buf = append_uint64_to_buf(buf, end, op_handle);
+    if (message_version >= kCompactUpdateMessageVersion) {
+        uint8_t presence = update_presence(input, additional_params);
+        buf = append_to_buf(buf, end, &presence, sizeof(presence));
+        if (presence & kUpdateHasData) buf = input.Serialize(buf, end);
+        if (presence & kUpdateHasParams) buf = additional_params.Serialize(buf, end);
+        return buf;
+    }
     buf = input.Serialize(buf, end);
     if (message_version > 0) buf = additional_params.Serialize(buf, end);
     return buf;
 }
 
 bool UpdateOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    if (message_version >= kCompactUpdateMessageVersion) {
+        uint8_t presence;
+        if (!copy_uint64_from_buf(buf_ptr, end, &op_handle) ||
+            !copy_presence_from_buf(buf_ptr, end, &presence)) {
+            return false;
+        }
+        input.Clear();
+        additional_params.Clear();
+        return (!(presence & kUpdateHasData) || input.Deserialize(buf_ptr, end)) &&
+               (!(presence & kUpdateHasParams) || additional_params.Deserialize(buf_ptr, end));
+    }
     bool retval = copy_uint64_from_buf(buf_ptr, end, &op_handle) && input.Deserialize(buf_ptr, end);
     if (retval && message_version > 0) retval = additional_params.Deserialize(buf_ptr, end);
     return retval;
@@ -469,6 +649,9 @@ bool UpdateOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t*
 size_t UpdateOperationResponse::NonErrorSerializedSize() const {
     size_t size = 0;
     switch (message_version) {
+    case kCompactUpdateMessageVersion:
+        return compact_update_size(update_presence(output, output_params), output, output_params) +
+               varint_size(input_consumed);
     case 4:
     case 3:
     case 2:
@@ -489,22 +672,145 @@ size_t UpdateOperationResponse::NonErrorSerializedSize() const {
 }
 
 uint8_t* UpdateOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    if (message_version >= kCompactUpdateMessageVersion) {
+        uint8_t presence = update_presence(output, output_params);
+        buf = append_to_buf(buf, end, &presence, sizeof(presence));
+        if (presence & kUpdateHasData) buf = output.Serialize(buf, end);
+        buf = append_varint_to_buf(buf, end, input_consumed);
+        if (presence & kUpdateHasParams) buf = output_params.Serialize(buf, end);
+        return buf;
+    }
     buf = output.Serialize(buf, end);
     if (message_version > 0) buf = append_uint32_to_buf(buf, end, input_consumed);
     if (message_version > 1) buf = output_params.Serialize(buf, end);
     return buf;
 }
 
+bool UpdateOperationResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (message_version >= kCompactUpdateMessageVersion) {
+        uint8_t presence = update_presence(output, output_params);
+        uint8_t varint[10];
+        uint8_t* varint_end = append_varint_to_buf(varint, varint + sizeof(varint), input_consumed);
+        if (!sink->Write(&presence, sizeof(presence))) return false;
+        if ((presence & kUpdateHasData) && !output.SerializeTo(sink)) return false;
+        if (!sink->Write(varint, varint_end - varint)) return false;
+        return !(presence & kUpdateHasParams) || output_params.SerializeTo(sink);
+    }
+    if (!output.SerializeTo(sink)) return false;
+    if (message_version > 0 && !sink->WriteUint32(input_consumed)) return false;
+    if (message_version > 1) return output_params.SerializeTo(sink);
+    return true;
+}
+
 bool UpdateOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    if (message_version >= kCompactUpdateMessageVersion) {
+        uint8_t presence;
+        uint64_t consumed;
+        if (!copy_presence_from_buf(buf_ptr, end, &presence)) return false;
+        output.Clear();
+        output_params.Clear();
+        if ((presence & kUpdateHasData) && !output.Deserialize(buf_ptr, end)) return false;
+        if (!copy_varint_from_buf(buf_ptr, end, &consumed) || consumed > SIZE_MAX) return false;
+        input_consumed = consumed;
+        return !(presence & kUpdateHasParams) || output_params.Deserialize(buf_ptr, end);
+    }
     bool retval = output.Deserialize(buf_ptr, end);
     if (retval && message_version > 0) retval = copy_uint32_from_buf(buf_ptr, end, &input_consumed);
     if (retval && message_version > 1) retval = output_params.Deserialize(buf_ptr, end);
     return retval;
 }
 
+size_t BatchUpdateOperationRequest::SerializedSize() const {
+    size_t size = sizeof(op_handle) + sizeof(uint32_t) /* input_count */;
+    for (size_t i = 0; i < input_count; ++i) {
+        size += inputs[i].SerializedSize();
+    }
+    return size + additional_params.SerializedSize();
+}
+
+uint8_t* BatchUpdateOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint64_to_buf(buf, end, op_handle);
+    buf = append_uint32_to_buf(buf, end, input_count);
+    for (size_t i = 0; i < input_count; ++i) {
+        buf = inputs[i].Serialize(buf, end);
+    }
+    return additional_params.Serialize(buf, end);
+}
+
+bool BatchUpdateOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint64_from_buf(buf_ptr, end, &op_handle) ||
+        !copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxInputs ||
+        !SetInputCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < input_count; ++i) {
+        if (!inputs[i].Deserialize(buf_ptr, end)) return false;
+    }
+    return additional_params.Deserialize(buf_ptr, end);
+}
+
+bool BatchUpdateOperationRequest::SetInputCount(size_t count) {
+    inputs.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && !inputs) {
+        input_count = 0;
+        return false;
+    }
+    input_count = count;
+    return true;
+}
+
+size_t BatchUpdateOperationResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* output_count */;
+    for (size_t i = 0; i < output_count; ++i) {
+        size += outputs[i].SerializedSize();
+    }
+    return size + output_params.SerializedSize();
+}
+
+uint8_t* BatchUpdateOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, output_count);
+    for (size_t i = 0; i < output_count; ++i) {
+        buf = outputs[i].Serialize(buf, end);
+    }
+    return output_params.Serialize(buf, end);
+}
+
+bool BatchUpdateOperationResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (!sink->WriteUint32(output_count)) return false;
+    for (size_t i = 0; i < output_count; ++i) {
+        if (!outputs[i].SerializeTo(sink)) return false;
+    }
+    return output_params.SerializeTo(sink);
+}
+
+bool BatchUpdateOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
+                                                       const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) ||
+        count > BatchUpdateOperationRequest::kMaxInputs || !SetOutputCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < output_count; ++i) {
+        if (!outputs[i].Deserialize(buf_ptr, end)) return false;
+    }
+    return output_params.Deserialize(buf_ptr, end);
+}
+
+bool BatchUpdateOperationResponse::SetOutputCount(size_t count) {
+    outputs.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && !outputs) {
+        output_count = 0;
+        return false;
+    }
+    output_count = count;
+    return true;
+}
+
 size_t FinishOperationRequest::SerializedSize() const {
     size_t size = 0;
     switch (message_version) {
+    case 5:
     case 4:
     case 3:
         size += input.SerializedSize();
@@ -553,147 +859,600 @@ uint8_t* FinishOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t*
     return buf;
 }
 
+bool FinishOperationResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (!output.SerializeTo(sink)) return false;
+    if (message_version > 1) return output_params.SerializeTo(sink);
+    return true;
+}
+
 bool FinishOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     bool retval = output.Deserialize(buf_ptr, end);
     if (retval && message_version > 1) retval = output_params.Deserialize(buf_ptr, end);
     return retval;
 }
 
-size_t AddEntropyRequest::SerializedSize() const {
-    return random_data.SerializedSize();
+void OneShotOperationRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
 }
 
-uint8_t* AddEntropyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    return random_data.Serialize(buf, end);
+size_t OneShotOperationRequest::SerializedSize() const {
+    return sizeof(uint32_t) /* purpose */ + key_blob_size(key_blob) +
+           additional_params.SerializedSize() + input.SerializedSize() +
+           signature.SerializedSize();
 }
 
-bool AddEntropyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return random_data.Deserialize(buf_ptr, end);
+uint8_t* OneShotOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, purpose);
+    buf = serialize_key_blob(key_blob, buf, end);
+    buf = additional_params.Serialize(buf, end);
+    buf = input.Serialize(buf, end);
+    return signature.Serialize(buf, end);
 }
 
-size_t ImportKeyRequest::SerializedSize() const {
-    size_t size = key_description.SerializedSize()     //
-                  + sizeof(uint32_t) /* key_format */  //
-                  + key_blob_size(key_data);
-    if (message_version < 4) return size;
-    return size                                           //
-           + key_blob_size(attestation_signing_key_blob)  //
-           + attest_key_params.SerializedSize()           //
-           + blob_size(issuer_subject);
+bool OneShotOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return copy_uint32_from_buf(buf_ptr, end, &purpose) &&
+           deserialize_key_blob(&key_blob, buf_ptr, end) &&
+           additional_params.Deserialize(buf_ptr, end) && input.Deserialize(buf_ptr, end) &&
+           signature.Deserialize(buf_ptr, end);
 }
 
-uint8_t* ImportKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = key_description.Serialize(buf, end);
-    buf = append_uint32_to_buf(buf, end, key_format);
-    buf = serialize_key_blob(key_data, buf, end);
-    if (message_version < 4) return buf;
-    buf = serialize_key_blob(attestation_signing_key_blob, buf, end);
-    buf = attest_key_params.Serialize(buf, end);
-    return serialize_blob(issuer_subject, buf, end);
+size_t OneShotOperationResponse::NonErrorSerializedSize() const {
+    return output_params.SerializedSize() + output.SerializedSize();
 }
 
-bool ImportKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    if (!(key_description.Deserialize(buf_ptr, end) &&
-          copy_uint32_from_buf(buf_ptr, end, &key_format) &&
-          deserialize_key_blob(&key_data, buf_ptr, end))) {
-        return false;
-    }
-    if (message_version < 4) return true;
-
-    return deserialize_key_blob(&attestation_signing_key_blob, buf_ptr, end)  //
-           && attest_key_params.Deserialize(buf_ptr, end)                     //
-           && deserialize_blob(&issuer_subject, buf_ptr, end);
+uint8_t* OneShotOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = output_params.Serialize(buf, end);
+    return output.Serialize(buf, end);
 }
 
-void ImportKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
-    key_data = KeymasterKeyBlob(static_cast<const uint8_t*>(key_material), length);
+bool OneShotOperationResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    return output_params.SerializeTo(sink) && output.SerializeTo(sink);
 }
 
-void ImportKeyResponse::SetKeyMaterial(const void* key_material, size_t length) {
-    set_key_blob(&key_blob, key_material, length);
+bool OneShotOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return output_params.Deserialize(buf_ptr, end) && output.Deserialize(buf_ptr, end);
 }
 
-size_t ImportKeyResponse::NonErrorSerializedSize() const {
-    size_t result =
-        key_blob_size(key_blob) + enforced.SerializedSize() + unenforced.SerializedSize();
-    if (message_version < 4) return result;
-    return result + chain_size(certificate_chain);
+size_t SharedMemoryOperationRequest::SerializedSize() const {
+    return sizeof(op_handle) + sizeof(uint32_t) /* finish */ + sizeof(region_id) +
+           2 * SharedMemorySpan::kSerializedSize + signature.SerializedSize() +
+           additional_params.SerializedSize();
 }
 
-uint8_t* ImportKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    buf = serialize_key_blob(key_blob, buf, end);
-    buf = enforced.Serialize(buf, end);
-    buf = unenforced.Serialize(buf, end);
-    if (message_version < 4) return buf;
-    return serialize_chain(certificate_chain, buf, end);
+uint8_t* SharedMemoryOperationRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint64_to_buf(buf, end, op_handle);
+    buf = append_uint32_to_buf(buf, end, static_cast<uint32_t>(finish));
+    buf = append_uint32_to_buf(buf, end, region_id);
+    buf = input.Serialize(buf, end);
+    buf = output.Serialize(buf, end);
+    buf = signature.Serialize(buf, end);
+    return additional_params.Serialize(buf, end);
 }
 
-bool ImportKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||  //
-        !enforced.Deserialize(buf_ptr, end) ||             //
-        !unenforced.Deserialize(buf_ptr, end)) {
+bool SharedMemoryOperationRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t finish_flag;
+    if (!copy_uint64_from_buf(buf_ptr, end, &op_handle) ||
+        !copy_uint32_from_buf(buf_ptr, end, &finish_flag) || finish_flag > 1) {
         return false;
     }
-    if (message_version < 4) return true;
-    certificate_chain = deserialize_chain(buf_ptr, end);
-    return !!certificate_chain.entries;
+    finish = finish_flag;
+    return copy_uint32_from_buf(buf_ptr, end, &region_id) && input.Deserialize(buf_ptr, end) &&
+           output.Deserialize(buf_ptr, end) && signature.Deserialize(buf_ptr, end) &&
+           additional_params.Deserialize(buf_ptr, end);
 }
 
-void ExportKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
-    set_key_blob(&key_blob, key_material, length);
+size_t SharedMemoryOperationResponse::NonErrorSerializedSize() const {
+    return Prefix::kSize + output_params.SerializedSize();
 }
 
-size_t ExportKeyRequest::SerializedSize() const {
-    return additional_params.SerializedSize() + sizeof(uint32_t) /* key_format */ +
-           key_blob_size(key_blob);
+uint8_t* SharedMemoryOperationResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = Prefix::Append(buf, end, *this);
+    return output_params.Serialize(buf, end);
 }
 
-uint8_t* ExportKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = additional_params.Serialize(buf, end);
-    buf = append_uint32_to_buf(buf, end, key_format);
-    return serialize_key_blob(key_blob, buf, end);
+bool SharedMemoryOperationResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
+                                                        const uint8_t* end) {
+    return Prefix::Copy(buf_ptr, end, this) && output_params.Deserialize(buf_ptr, end);
 }
 
-bool ExportKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return additional_params.Deserialize(buf_ptr, end) &&
-           copy_uint32_from_buf(buf_ptr, end, &key_format) &&
-           deserialize_key_blob(&key_blob, buf_ptr, end);
+void BatchSignRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
 }
 
-void ExportKeyResponse::SetKeyMaterial(const void* key_material, size_t length) {
-    delete[] key_data;
-    key_data = dup_buffer(key_material, length);
-    key_data_length = length;
+size_t BatchSignRequest::SerializedSize() const {
+    size_t size = key_blob_size(key_blob) + additional_params.SerializedSize() +
+                  sizeof(uint32_t) /* message_count */;
+    for (size_t i = 0; i < message_count; ++i) {
+        size += messages[i].SerializedSize();
+    }
+    return size;
 }
 
-size_t ExportKeyResponse::NonErrorSerializedSize() const {
-    return sizeof(uint32_t) /* key_data_length */ + key_data_length;
+uint8_t* BatchSignRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end);
+    buf = additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, message_count);
+    for (size_t i = 0; i < message_count; ++i) {
+        buf = messages[i].Serialize(buf, end);
+    }
+    return buf;
 }
 
-uint8_t* ExportKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    return append_size_and_data_to_buf(buf, end, key_data, key_data_length);
+bool BatchSignRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||
+        !additional_params.Deserialize(buf_ptr, end) ||
+        !copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxMessages ||
+        !SetMessageCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < message_count; ++i) {
+        if (!messages[i].Deserialize(buf_ptr, end)) return false;
+    }
+    return true;
 }
 
-bool ExportKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    delete[] key_data;
-    key_data = nullptr;
-    UniquePtr<uint8_t[]> deserialized_key_material;
-    if (!copy_size_and_data_from_buf(buf_ptr, end, &key_data_length, &deserialized_key_material))
+bool BatchSignRequest::SetMessageCount(size_t count) {
+    messages.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && !messages) {
+        message_count = 0;
         return false;
-    key_data = deserialized_key_material.release();
+    }
+    message_count = count;
     return true;
 }
 
-void DeleteKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
-    set_key_blob(&key_blob, key_material, length);
+size_t BatchSignResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* signature_count */;
+    for (size_t i = 0; i < signature_count; ++i) {
+        size += signatures[i].SerializedSize();
+    }
+    return size;
 }
 
-size_t DeleteKeyRequest::SerializedSize() const {
-    return key_blob_size(key_blob);
+uint8_t* BatchSignResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, signature_count);
+    for (size_t i = 0; i < signature_count; ++i) {
+        buf = signatures[i].Serialize(buf, end);
+    }
+    return buf;
 }
 
-uint8_t* DeleteKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
-    return serialize_key_blob(key_blob, buf, end);
+bool BatchSignResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (!sink->WriteUint32(signature_count)) return false;
+    for (size_t i = 0; i < signature_count; ++i) {
+        if (!signatures[i].SerializeTo(sink)) return false;
+    }
+    return true;
+}
+
+bool BatchSignResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > BatchSignRequest::kMaxMessages ||
+        !SetSignatureCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < signature_count; ++i) {
+        if (!signatures[i].Deserialize(buf_ptr, end)) return false;
+    }
+    return true;
+}
+
+bool BatchSignResponse::SetSignatureCount(size_t count) {
+    signatures.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && !signatures) {
+        signature_count = 0;
+        return false;
+    }
+    signature_count = count;
+    return true;
+}
+
+void BatchAgreeKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t BatchAgreeKeyRequest::SerializedSize() const {
+    size_t size = key_blob_size(key_blob) + additional_params.SerializedSize() +
+                  sizeof(uint32_t) /* peer_key_count */;
+    for (size_t i = 0; i < peer_key_count; ++i) {
+        size += peer_keys[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* BatchAgreeKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end);
+    buf = additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, peer_key_count);
+    for (size_t i = 0; i < peer_key_count; ++i) {
+        buf = peer_keys[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool BatchAgreeKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||
+        !additional_params.Deserialize(buf_ptr, end) ||
+        !copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxPeerKeys ||
+        !SetPeerKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < peer_key_count; ++i) {
+        if (!peer_keys[i].Deserialize(buf_ptr, end)) return false;
+    }
+    return true;
+}
+
+bool BatchAgreeKeyRequest::SetPeerKeyCount(size_t count) {
+    peer_keys.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && !peer_keys) {
+        peer_key_count = 0;
+        return false;
+    }
+    peer_key_count = count;
+    return true;
+}
+
+size_t BatchAgreeKeyResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* shared_secret_count */;
+    for (size_t i = 0; i < shared_secret_count; ++i) {
+        size += shared_secrets[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* BatchAgreeKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, shared_secret_count);
+    for (size_t i = 0; i < shared_secret_count; ++i) {
+        buf = shared_secrets[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool BatchAgreeKeyResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (!sink->WriteUint32(shared_secret_count)) return false;
+    for (size_t i = 0; i < shared_secret_count; ++i) {
+        if (!shared_secrets[i].SerializeTo(sink)) return false;
+    }
+    return true;
+}
+
+bool BatchAgreeKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) ||
+        count > BatchAgreeKeyRequest::kMaxPeerKeys || !SetSharedSecretCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < shared_secret_count; ++i) {
+        if (!shared_secrets[i].Deserialize(buf_ptr, end)) return false;
+    }
+    return true;
+}
+
+bool BatchAgreeKeyResponse::SetSharedSecretCount(size_t count) {
+    shared_secrets.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && !shared_secrets) {
+        shared_secret_count = 0;
+        return false;
+    }
+    shared_secret_count = count;
+    return true;
+}
+
+void BatchVerifyRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t BatchVerifyRequest::SerializedSize() const {
+    size_t size = key_blob_size(key_blob) + additional_params.SerializedSize() +
+                  sizeof(uint32_t) /* message_count */;
+    for (size_t i = 0; i < message_count; ++i) {
+        size += messages[i].SerializedSize() + signatures[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* BatchVerifyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end);
+    buf = additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, message_count);
+    for (size_t i = 0; i < message_count; ++i) {
+        buf = messages[i].Serialize(buf, end);
+        buf = signatures[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool BatchVerifyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||
+        !additional_params.Deserialize(buf_ptr, end) ||
+        !copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxMessages ||
+        !SetMessageCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < message_count; ++i) {
+        if (!messages[i].Deserialize(buf_ptr, end) || !signatures[i].Deserialize(buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BatchVerifyRequest::SetMessageCount(size_t count) {
+    messages.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    signatures.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && (!messages || !signatures)) {
+        messages.reset();
+        signatures.reset();
+        message_count = 0;
+        return false;
+    }
+    message_count = count;
+    return true;
+}
+
+size_t ExecuteBatchRequest::SerializedSize() const {
+    size_t size = sizeof(uint32_t) /* entry_count */;
+    for (size_t i = 0; i < entry_count; ++i) {
+        size += sizeof(uint32_t) /* command */ + requests[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* ExecuteBatchRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, entry_count);
+    for (size_t i = 0; i < entry_count; ++i) {
+        buf = append_uint32_to_buf(buf, end, commands[i]);
+        buf = requests[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool ExecuteBatchRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxEntries ||
+        !SetEntryCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < entry_count; ++i) {
+        if (!copy_uint32_from_buf(buf_ptr, end, &commands[i]) ||
+            !requests[i].Deserialize(buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ExecuteBatchRequest::SetEntryCount(size_t count) {
+    commands.reset(count ? new (std::nothrow) uint32_t[count]() : nullptr);
+    requests.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && (!commands || !requests)) {
+        commands.reset();
+        requests.reset();
+        entry_count = 0;
+        return false;
+    }
+    entry_count = count;
+    return true;
+}
+
+bool ExecuteBatchRequest::SetEntry(size_t i, AndroidKeymasterCommand command,
+                                   const Serializable& request) {
+    if (i >= entry_count) return false;
+    size_t size = request.SerializedSize();
+    if (!requests[i].Reinitialize(size)) return false;
+    uint8_t* begin = requests[i].peek_write();
+    if (request.Serialize(begin, begin + size) != begin + size ||
+        !requests[i].advance_write(size)) {
+        return false;
+    }
+    commands[i] = command;
+    return true;
+}
+
+size_t ExecuteBatchResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* entry_count */;
+    for (size_t i = 0; i < entry_count; ++i) {
+        size += responses[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* ExecuteBatchResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, entry_count);
+    for (size_t i = 0; i < entry_count; ++i) {
+        buf = responses[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool ExecuteBatchResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (!sink->WriteUint32(entry_count)) return false;
+    for (size_t i = 0; i < entry_count; ++i) {
+        if (!responses[i].SerializeTo(sink)) return false;
+    }
+    return true;
+}
+
+bool ExecuteBatchResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) ||
+        count > ExecuteBatchRequest::kMaxEntries || !SetEntryCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < entry_count; ++i) {
+        if (!responses[i].Deserialize(buf_ptr, end)) return false;
+    }
+    return true;
+}
+
+bool ExecuteBatchResponse::SetEntryCount(size_t count) {
+    responses.reset(count ? new (std::nothrow) Buffer[count] : nullptr);
+    if (count && !responses) {
+        entry_count = 0;
+        return false;
+    }
+    entry_count = count;
+    return true;
+}
+
+bool ExecuteBatchResponse::GetEntry(size_t i, KeymasterResponse* response) const {
+    if (i >= entry_count) return false;
+    const uint8_t* p = responses[i].peek_read();
+    return response->Deserialize(&p, p + responses[i].available_read());
+}
+
+size_t AddEntropyRequest::SerializedSize() const {
+    return random_data.SerializedSize();
+}
+
+uint8_t* AddEntropyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    return random_data.Serialize(buf, end);
+}
+
+bool AddEntropyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return random_data.Deserialize(buf_ptr, end);
+}
+
+size_t ImportKeyRequest::SerializedSize() const {
+    size_t size = key_description.SerializedSize()     //
+                  + sizeof(uint32_t) /* key_format */  //
+                  + key_blob_size(key_data);
+    if (message_version < 4) return size;
+    return size                                           //
+           + key_blob_size(attestation_signing_key_blob)  //
+           + attest_key_params.SerializedSize()           //
+           + blob_size(issuer_subject);
+}
+
+uint8_t* ImportKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = key_description.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, key_format);
+    buf = serialize_key_blob(key_data, buf, end);
+    if (message_version < 4) return buf;
+    buf = serialize_key_blob(attestation_signing_key_blob, buf, end);
+    buf = attest_key_params.Serialize(buf, end);
+    return serialize_blob(issuer_subject, buf, end);
+}
+
+bool ImportKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    if (!(key_description.Deserialize(buf_ptr, end) &&
+          copy_uint32_from_buf(buf_ptr, end, &key_format) &&
+          deserialize_key_blob(&key_data, buf_ptr, end))) {
+        return false;
+    }
+    if (message_version < 4) return true;
+
+    return deserialize_key_blob(&attestation_signing_key_blob, buf_ptr, end)  //
+           && attest_key_params.Deserialize(buf_ptr, end)                     //
+           && deserialize_blob(&issuer_subject, buf_ptr, end);
+}
+
+void ImportKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    key_data = KeymasterKeyBlob(static_cast<const uint8_t*>(key_material), length);
+}
+
+void ImportKeyResponse::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t ImportKeyResponse::NonErrorSerializedSize() const {
+    size_t result =
+        key_blob_size(key_blob) + enforced.SerializedSize() + unenforced.SerializedSize();
+    if (message_version < 4) return result;
+    return result + chain_size(certificate_chain);
+}
+
+uint8_t* ImportKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = serialize_key_blob(key_blob, buf, end);
+    buf = enforced.Serialize(buf, end);
+    buf = unenforced.Serialize(buf, end);
+    if (message_version < 4) return buf;
+    return serialize_chain(certificate_chain, buf, end);
+}
+
+bool ImportKeyResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (!serialize_key_blob_to(key_blob, sink) || !enforced.SerializeTo(sink) ||
+        !unenforced.SerializeTo(sink)) {
+        return false;
+    }
+    if (message_version < 4) return true;
+    return serialize_chain_to(certificate_chain, sink);
+}
+
+bool ImportKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||  //
+        !enforced.Deserialize(buf_ptr, end) ||             //
+        !unenforced.Deserialize(buf_ptr, end)) {
+        return false;
+    }
+    if (message_version < 4) return true;
+    certificate_chain = deserialize_chain(buf_ptr, end);
+    return !!certificate_chain.entries;
+}
+
+void ExportKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t ExportKeyRequest::SerializedSize() const {
+    return additional_params.SerializedSize() + sizeof(uint32_t) /* key_format */ +
+           key_blob_size(key_blob);
+}
+
+uint8_t* ExportKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = additional_params.Serialize(buf, end);
+    buf = append_uint32_to_buf(buf, end, key_format);
+    return serialize_key_blob(key_blob, buf, end);
+}
+
+bool ExportKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return additional_params.Deserialize(buf_ptr, end) &&
+           copy_uint32_from_buf(buf_ptr, end, &key_format) &&
+           deserialize_key_blob(&key_blob, buf_ptr, end);
+}
+
+void ExportKeyResponse::SetKeyMaterial(const void* key_material, size_t length) {
+    delete[] key_data;
+    key_data = dup_buffer(key_material, length);
+    key_data_length = length;
+}
+
+size_t ExportKeyResponse::NonErrorSerializedSize() const {
+    return sizeof(uint32_t) /* key_data_length */ + key_data_length;
+}
+
+uint8_t* ExportKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    return append_size_and_data_to_buf(buf, end, key_data, key_data_length);
+}
+
+bool ExportKeyResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    return sink->WriteSizeAndData(key_data, key_data_length);
+}
+
+bool ExportKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    delete[] key_data;
+    key_data = nullptr;
+    UniquePtr<uint8_t[]> deserialized_key_material;
+    if (!copy_size_and_data_from_buf(buf_ptr, end, &key_data_length, &deserialized_key_material))
+        return false;
+    key_data = deserialized_key_material.release();
+    return true;
+}
+
+void DeleteKeyRequest::SetKeyMaterial(const void* key_material, size_t length) {
+    set_key_blob(&key_blob, key_material, length);
+}
+
+size_t DeleteKeyRequest::SerializedSize() const {
+    return key_blob_size(key_blob);
+}
+
+uint8_t* DeleteKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    return serialize_key_blob(key_blob, buf, end);
 }
 
 bool DeleteKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
@@ -701,28 +1460,15 @@ bool DeleteKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end)
 }
 
 size_t GetVersionResponse::NonErrorSerializedSize() const {
-    return sizeof(major_ver) + sizeof(minor_ver) + sizeof(subminor_ver);
+    return Fields::kSize;
 }
 
 uint8_t* GetVersionResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    if (buf + NonErrorSerializedSize() <= end) {
-        *buf++ = major_ver;
-        *buf++ = minor_ver;
-        *buf++ = subminor_ver;
-    } else {
-        buf += NonErrorSerializedSize();
-    }
-    return buf;
+    return Fields::Append(buf, end, *this);
 }
 
 bool GetVersionResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    if (*buf_ptr + NonErrorSerializedSize() > end) return false;
-    const uint8_t* tmp = *buf_ptr;
-    major_ver = *tmp++;
-    minor_ver = *tmp++;
-    subminor_ver = *tmp++;
-    *buf_ptr = tmp;
-    return true;
+    return Fields::Copy(buf_ptr, end, this);
 }
 
 AttestKeyRequest::~AttestKeyRequest() {
@@ -754,6 +1500,10 @@ uint8_t* AttestKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end)
     return serialize_chain(certificate_chain, buf, end);
 }
 
+bool AttestKeyResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    return serialize_chain_to(certificate_chain, sink);
+}
+
 bool AttestKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     certificate_chain = deserialize_chain(buf_ptr, end);
     return !!certificate_chain.entries;
@@ -793,10 +1543,471 @@ uint8_t* UpgradeKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end)
     return serialize_key_blob(upgraded_key, buf, end);
 }
 
+bool UpgradeKeyResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    return serialize_key_blob_to(upgraded_key, sink);
+}
+
 bool UpgradeKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     return deserialize_key_blob(&upgraded_key, buf_ptr, end);
 }
 
+size_t UpgradeKeysRequest::SerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += key_blob_size(key_blobs[i]);
+    }
+    return size + upgrade_params.SerializedSize();
+}
+
+uint8_t* UpgradeKeysRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = serialize_key_blob(key_blobs[i], buf, end);
+    }
+    return upgrade_params.Serialize(buf, end);
+}
+
+bool UpgradeKeysRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxKeys || !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!deserialize_key_blob(&key_blobs[i], buf_ptr, end)) return false;
+    }
+    return upgrade_params.Deserialize(buf_ptr, end);
+}
+
+bool UpgradeKeysRequest::SetKeyCount(size_t count) {
+    key_blobs.reset(count ? new (std::nothrow) KeymasterKeyBlob[count] : nullptr);
+    if (count && !key_blobs) {
+        key_count = 0;
+        return false;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t UpgradeKeysResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += sizeof(uint32_t) + key_blob_size(upgraded_keys[i]);
+    }
+    return size;
+}
+
+uint8_t* UpgradeKeysResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = append_uint32_to_buf(buf, end, key_errors[i]);
+        buf = serialize_key_blob(upgraded_keys[i], buf, end);
+    }
+    return buf;
+}
+
+bool UpgradeKeysResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > UpgradeKeysRequest::kMaxKeys ||
+        !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!copy_uint32_from_buf(buf_ptr, end, &key_errors[i]) ||
+            !deserialize_key_blob(&upgraded_keys[i], buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool UpgradeKeysResponse::SetKeyCount(size_t count) {
+    key_errors.reset(count ? new (std::nothrow) keymaster_error_t[count] : nullptr);
+    upgraded_keys.reset(count ? new (std::nothrow) KeymasterKeyBlob[count] : nullptr);
+    if (count && (!key_errors || !upgraded_keys)) {
+        key_errors.reset();
+        upgraded_keys.reset();
+        key_count = 0;
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        key_errors[i] = KM_ERROR_OK;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t GenerateKeysRequest::SerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += key_descriptions[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* GenerateKeysRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = key_descriptions[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool GenerateKeysRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxKeys || !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!key_descriptions[i].Deserialize(buf_ptr, end)) return false;
+    }
+    return true;
+}
+
+bool GenerateKeysRequest::SetKeyCount(size_t count) {
+    key_descriptions.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    if (count && !key_descriptions) {
+        key_count = 0;
+        return false;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t GenerateKeysResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += sizeof(uint32_t) + key_blob_size(key_blobs[i]) + enforced[i].SerializedSize() +
+                unenforced[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* GenerateKeysResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = append_uint32_to_buf(buf, end, key_errors[i]);
+        buf = serialize_key_blob(key_blobs[i], buf, end);
+        buf = enforced[i].Serialize(buf, end);
+        buf = unenforced[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool GenerateKeysResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > GenerateKeysRequest::kMaxKeys ||
+        !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!copy_uint32_from_buf(buf_ptr, end, &key_errors[i]) ||
+            !deserialize_key_blob(&key_blobs[i], buf_ptr, end) ||
+            !enforced[i].Deserialize(buf_ptr, end) || !unenforced[i].Deserialize(buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GenerateKeysResponse::SetKeyCount(size_t count) {
+    key_errors.reset(count ? new (std::nothrow) keymaster_error_t[count] : nullptr);
+    key_blobs.reset(count ? new (std::nothrow) KeymasterKeyBlob[count] : nullptr);
+    enforced.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    unenforced.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    if (count && (!key_errors || !key_blobs || !enforced || !unenforced)) {
+        key_errors.reset();
+        key_blobs.reset();
+        enforced.reset();
+        unenforced.reset();
+        key_count = 0;
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        key_errors[i] = KM_ERROR_OK;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t ImportKeysRequest::SerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += key_descriptions[i].SerializedSize() + sizeof(uint32_t) /* key_format */ +
+                key_blob_size(key_data[i]);
+    }
+    return size;
+}
+
+uint8_t* ImportKeysRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = key_descriptions[i].Serialize(buf, end);
+        buf = append_uint32_to_buf(buf, end, key_formats[i]);
+        buf = serialize_key_blob(key_data[i], buf, end);
+    }
+    return buf;
+}
+
+bool ImportKeysRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxKeys || !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!key_descriptions[i].Deserialize(buf_ptr, end) ||
+            !copy_uint32_from_buf(buf_ptr, end, &key_formats[i]) ||
+            !deserialize_key_blob(&key_data[i], buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ImportKeysRequest::SetKeyCount(size_t count) {
+    key_descriptions.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    key_formats.reset(count ? new (std::nothrow) keymaster_key_format_t[count] : nullptr);
+    key_data.reset(count ? new (std::nothrow) KeymasterKeyBlob[count] : nullptr);
+    if (count && (!key_descriptions || !key_formats || !key_data)) {
+        key_descriptions.reset();
+        key_formats.reset();
+        key_data.reset();
+        key_count = 0;
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        key_formats[i] = KM_KEY_FORMAT_RAW;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t ImportKeysResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += sizeof(uint32_t) + key_blob_size(key_blobs[i]) + enforced[i].SerializedSize() +
+                unenforced[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* ImportKeysResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = append_uint32_to_buf(buf, end, key_errors[i]);
+        buf = serialize_key_blob(key_blobs[i], buf, end);
+        buf = enforced[i].Serialize(buf, end);
+        buf = unenforced[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool ImportKeysResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > ImportKeysRequest::kMaxKeys ||
+        !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!copy_uint32_from_buf(buf_ptr, end, &key_errors[i]) ||
+            !deserialize_key_blob(&key_blobs[i], buf_ptr, end) ||
+            !enforced[i].Deserialize(buf_ptr, end) || !unenforced[i].Deserialize(buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ImportKeysResponse::SetKeyCount(size_t count) {
+    key_errors.reset(count ? new (std::nothrow) keymaster_error_t[count] : nullptr);
+    key_blobs.reset(count ? new (std::nothrow) KeymasterKeyBlob[count] : nullptr);
+    enforced.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    unenforced.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    if (count && (!key_errors || !key_blobs || !enforced || !unenforced)) {
+        key_errors.reset();
+        key_blobs.reset();
+        enforced.reset();
+        unenforced.reset();
+        key_count = 0;
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        key_errors[i] = KM_ERROR_OK;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t DeleteKeysRequest::SerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += key_blob_size(key_blobs[i]);
+    }
+    return size;
+}
+
+uint8_t* DeleteKeysRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = serialize_key_blob(key_blobs[i], buf, end);
+    }
+    return buf;
+}
+
+bool DeleteKeysRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxKeys || !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!deserialize_key_blob(&key_blobs[i], buf_ptr, end)) return false;
+    }
+    return true;
+}
+
+bool DeleteKeysRequest::SetKeyCount(size_t count) {
+    key_blobs.reset(count ? new (std::nothrow) KeymasterKeyBlob[count] : nullptr);
+    if (count && !key_blobs) {
+        key_count = 0;
+        return false;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t DeleteKeysResponse::NonErrorSerializedSize() const {
+    return sizeof(uint32_t) /* key_count */ + key_count * sizeof(uint32_t);
+}
+
+uint8_t* DeleteKeysResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = append_uint32_to_buf(buf, end, key_errors[i]);
+    }
+    return buf;
+}
+
+bool DeleteKeysResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > DeleteKeysRequest::kMaxKeys ||
+        !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!copy_uint32_from_buf(buf_ptr, end, &key_errors[i])) return false;
+    }
+    return true;
+}
+
+bool DeleteKeysResponse::SetKeyCount(size_t count) {
+    key_errors.reset(count ? new (std::nothrow) keymaster_error_t[count] : nullptr);
+    if (count && !key_errors) {
+        key_count = 0;
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        key_errors[i] = KM_ERROR_OK;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t GetKeysCharacteristicsRequest::SerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += key_blob_size(key_blobs[i]) + additional_params[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* GetKeysCharacteristicsRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = serialize_key_blob(key_blobs[i], buf, end);
+        buf = additional_params[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool GetKeysCharacteristicsRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) || count > kMaxKeys || !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!deserialize_key_blob(&key_blobs[i], buf_ptr, end) ||
+            !additional_params[i].Deserialize(buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GetKeysCharacteristicsRequest::SetKeyCount(size_t count) {
+    key_blobs.reset(count ? new (std::nothrow) KeymasterKeyBlob[count] : nullptr);
+    additional_params.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    if (count && (!key_blobs || !additional_params)) {
+        key_blobs.reset();
+        additional_params.reset();
+        key_count = 0;
+        return false;
+    }
+    key_count = count;
+    return true;
+}
+
+size_t GetKeysCharacteristicsResponse::NonErrorSerializedSize() const {
+    size_t size = sizeof(uint32_t) /* key_count */;
+    for (size_t i = 0; i < key_count; ++i) {
+        size += sizeof(uint32_t) + enforced[i].SerializedSize() + unenforced[i].SerializedSize();
+    }
+    return size;
+}
+
+uint8_t* GetKeysCharacteristicsResponse::NonErrorSerialize(uint8_t* buf,
+                                                           const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, key_count);
+    for (size_t i = 0; i < key_count; ++i) {
+        buf = append_uint32_to_buf(buf, end, key_errors[i]);
+        buf = enforced[i].Serialize(buf, end);
+        buf = unenforced[i].Serialize(buf, end);
+    }
+    return buf;
+}
+
+bool GetKeysCharacteristicsResponse::NonErrorDeserialize(const uint8_t** buf_ptr,
+                                                         const uint8_t* end) {
+    size_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) ||
+        count > GetKeysCharacteristicsRequest::kMaxKeys || !SetKeyCount(count)) {
+        return false;
+    }
+    for (size_t i = 0; i < key_count; ++i) {
+        if (!copy_uint32_from_buf(buf_ptr, end, &key_errors[i]) ||
+            !enforced[i].Deserialize(buf_ptr, end) || !unenforced[i].Deserialize(buf_ptr, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool GetKeysCharacteristicsResponse::SetKeyCount(size_t count) {
+    key_errors.reset(count ? new (std::nothrow) keymaster_error_t[count] : nullptr);
+    enforced.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    unenforced.reset(count ? new (std::nothrow) AuthorizationSet[count] : nullptr);
+    if (count && (!key_errors || !enforced || !unenforced)) {
+        key_errors.reset();
+        enforced.reset();
+        unenforced.reset();
+        key_count = 0;
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        key_errors[i] = KM_ERROR_OK;
+    }
+    key_count = count;
+    return true;
+}
+
 size_t HmacSharingParameters::SerializedSize() const {
     return blob_size(seed) + sizeof(nonce);
 }
@@ -851,8 +2062,7 @@ bool ComputeSharedHmacResponse::NonErrorDeserialize(const uint8_t** buf_ptr, con
 
 size_t ImportWrappedKeyRequest::SerializedSize() const {
     return key_blob_size(wrapped_key) + key_blob_size(wrapping_key) + key_blob_size(masking_key) +
-           additional_params.SerializedSize() + sizeof(uint64_t)  // password_sid
-           + sizeof(uint64_t);                                    // biometric_sid
+           additional_params.SerializedSize() + Sids::kSize;
 }
 
 uint8_t* ImportWrappedKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) const {
@@ -860,17 +2070,14 @@ uint8_t* ImportWrappedKeyRequest::Serialize(uint8_t* buf, const uint8_t* end) co
     buf = serialize_key_blob(wrapping_key, buf, end);
     buf = serialize_key_blob(masking_key, buf, end);
     buf = additional_params.Serialize(buf, end);
-    buf = append_uint64_to_buf(buf, end, password_sid);
-    return append_uint64_to_buf(buf, end, biometric_sid);
+    return Sids::Append(buf, end, *this);
 }
 
 bool ImportWrappedKeyRequest::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     return deserialize_key_blob(&wrapped_key, buf_ptr, end) &&
            deserialize_key_blob(&wrapping_key, buf_ptr, end) &&
            deserialize_key_blob(&masking_key, buf_ptr, end) &&
-           additional_params.Deserialize(buf_ptr, end) &&
-           copy_uint64_from_buf(buf_ptr, end, &password_sid) &&
-           copy_uint64_from_buf(buf_ptr, end, &biometric_sid);
+           additional_params.Deserialize(buf_ptr, end) && Sids::Copy(buf_ptr, end, this);
 }
 
 void ImportWrappedKeyRequest::SetWrappedMaterial(const void* key_material, size_t length) {
@@ -904,6 +2111,15 @@ uint8_t* ImportWrappedKeyResponse::NonErrorSerialize(uint8_t* buf, const uint8_t
     return serialize_chain(certificate_chain, buf, end);
 }
 
+bool ImportWrappedKeyResponse::NonErrorSerializeTo(SerializationSink* sink) const {
+    if (!serialize_key_blob_to(key_blob, sink) || !enforced.SerializeTo(sink) ||
+        !unenforced.SerializeTo(sink)) {
+        return false;
+    }
+    if (message_version < 4) return true;
+    return serialize_chain_to(certificate_chain, sink);
+}
+
 bool ImportWrappedKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     if (!deserialize_key_blob(&key_blob, buf_ptr, end) ||  //
         !enforced.Deserialize(buf_ptr, end) ||             //
@@ -916,65 +2132,93 @@ bool ImportWrappedKeyResponse::NonErrorDeserialize(const uint8_t** buf_ptr, cons
 }
 
 size_t HardwareAuthToken::SerializedSize() const {
-    return sizeof(challenge) + sizeof(user_id) + sizeof(authenticator_id) +
-           sizeof(authenticator_type) + sizeof(timestamp) + blob_size(mac);
+    return Prefix::kSize + blob_size(mac);
 }
 
 uint8_t* HardwareAuthToken::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = append_uint64_to_buf(buf, end, challenge);
-    buf = append_uint64_to_buf(buf, end, user_id);
-    buf = append_uint64_to_buf(buf, end, authenticator_id);
-    buf = append_uint32_to_buf(buf, end, authenticator_type);
-    buf = append_uint64_to_buf(buf, end, timestamp);
+    buf = Prefix::Append(buf, end, *this);
     return serialize_blob(mac, buf, end);
 }
 
 bool HardwareAuthToken::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return copy_uint64_from_buf(buf_ptr, end, &challenge) &&
-           copy_uint64_from_buf(buf_ptr, end, &user_id) &&
-           copy_uint64_from_buf(buf_ptr, end, &authenticator_id) &&
-           copy_uint32_from_buf(buf_ptr, end, &authenticator_type) &&
-           copy_uint64_from_buf(buf_ptr, end, &timestamp) &&  //
-           deserialize_blob(&mac, buf_ptr, end);
+    return Prefix::Copy(buf_ptr, end, this) && deserialize_blob(&mac, buf_ptr, end);
 }
 
 size_t VerificationToken::SerializedSize() const {
-    return sizeof(challenge) + sizeof(timestamp) + parameters_verified.SerializedSize() +
-           sizeof(security_level) + blob_size(mac);
+    return Prefix::kSize + parameters_verified.SerializedSize() + sizeof(security_level) +
+           blob_size(mac);
 }
 
 uint8_t* VerificationToken::Serialize(uint8_t* buf, const uint8_t* end) const {
-    buf = append_uint64_to_buf(buf, end, challenge);
-    buf = append_uint64_to_buf(buf, end, timestamp);
+    buf = Prefix::Append(buf, end, *this);
     buf = parameters_verified.Serialize(buf, end);
     buf = append_uint32_to_buf(buf, end, security_level);
     return serialize_blob(mac, buf, end);
 }
 
 bool VerificationToken::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return copy_uint64_from_buf(buf_ptr, end, &challenge) &&
-           copy_uint64_from_buf(buf_ptr, end, &timestamp) &&
-           parameters_verified.Deserialize(buf_ptr, end) &&
+    return Prefix::Copy(buf_ptr, end, this) && parameters_verified.Deserialize(buf_ptr, end) &&
            copy_uint32_from_buf(buf_ptr, end, &security_level) &&
            deserialize_blob(&mac, buf_ptr, end);
 }
 
 size_t GetVersion2Response::NonErrorSerializedSize() const {
-    return sizeof(max_message_version) +  //
-           sizeof(km_version) +           //
-           sizeof(km_date);
+    return Fields::kSize;
 }
 
 uint8_t* GetVersion2Response::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
-    buf = append_uint32_to_buf(buf, end, max_message_version);
-    buf = append_uint32_to_buf(buf, end, km_version);
-    return append_uint32_to_buf(buf, end, km_date);
+    return Fields::Append(buf, end, *this);
 }
 
 bool GetVersion2Response::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
-    return copy_uint32_from_buf(buf_ptr, end, &max_message_version) &&
-           copy_uint32_from_buf(buf_ptr, end, &km_version) &&
-           copy_uint32_from_buf(buf_ptr, end, &km_date);
+    return Fields::Copy(buf_ptr, end, this);
+}
+
+namespace {
+
+// A count followed by that many fixed-size entries.
+template <typename Entry> size_t EntriesSize(const std::vector<Entry>& entries) {
+    return sizeof(uint32_t) + entries.size() * Entry::Fields::kSize;
+}
+
+template <typename Entry>
+uint8_t* AppendEntries(uint8_t* buf, const uint8_t* end, const std::vector<Entry>& entries) {
+    buf = append_uint32_to_buf(buf, end, entries.size());
+    for (const auto& entry : entries) {
+        buf = Entry::Fields::Append(buf, end, entry);
+    }
+    return buf;
+}
+
+template <typename Entry>
+bool CopyEntries(const uint8_t** buf_ptr, const uint8_t* end, std::vector<Entry>* entries) {
+    uint32_t count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &count) ||
+        count > GetDebugCountersResponse::kMaxCounters) {
+        return false;
+    }
+    entries->resize(count);
+    for (auto& entry : *entries) {
+        if (!Entry::Fields::Copy(buf_ptr, end, &entry)) return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+size_t GetDebugCountersResponse::NonErrorSerializedSize() const {
+    return EntriesSize(commands) + EntriesSize(phases) + EntriesSize(caches);
+}
+
+uint8_t* GetDebugCountersResponse::NonErrorSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = AppendEntries(buf, end, commands);
+    buf = AppendEntries(buf, end, phases);
+    return AppendEntries(buf, end, caches);
+}
+
+bool GetDebugCountersResponse::NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return CopyEntries(buf_ptr, end, &commands) && CopyEntries(buf_ptr, end, &phases) &&
+           CopyEntries(buf_ptr, end, &caches);
 }
 
 }  // namespace keymaster
@@ -17,6 +17,7 @@
 #include <new>
 
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/constant_time.h>
 
 namespace keymaster {
 
@@ -32,12 +33,7 @@ uint8_t* dup_buffer(const void* buf, size_t size) {
 }
 
 int memcmp_s(const void* p1, const void* p2, size_t length) {
-    const uint8_t* s1 = static_cast<const uint8_t*>(p1);
-    const uint8_t* s2 = static_cast<const uint8_t*>(p2);
-    uint8_t result = 0;
-    for (; length > 0; length--)
-        result |= *s1++ ^ *s2++;
-    return result == 0 ? 0 : 1;
+    return ConstantTimeEquals(p1, p2, length) ? 0 : 1;
 }
 
 keymaster_error_t EllipticKeySizeToCurve(uint32_t key_size_bits, keymaster_ec_curve_t* curve) {
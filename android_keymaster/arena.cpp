@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/arena.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+namespace {
+
+constexpr size_t kAlignment = alignof(max_align_t);
+
+size_t RoundUp(size_t size) {
+    return (size + kAlignment - 1) & ~(kAlignment - 1);
+}
+
+}  // namespace
+
+Arena::~Arena() {
+    while (chunks_) {
+        Chunk* next = chunks_->next;
+        FreeChunk(chunks_);
+        chunks_ = next;
+    }
+}
+
+Arena::Chunk* Arena::NewChunk(size_t min_size) {
+    size_t size = min_size > chunk_size_ ? min_size : chunk_size_;
+    if (size > SIZE_MAX - sizeof(Chunk)) return nullptr;
+    // From static_block_pool() in static-heap builds, like any other array without an arena.
+    uint8_t* raw = NewArray<uint8_t>(nullptr /* arena */, sizeof(Chunk) + size);
+    if (!raw) return nullptr;
+    Chunk* chunk = new (raw) Chunk;
+    chunk->next = nullptr;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+void Arena::FreeChunk(Chunk* chunk) {
+    memset_s(chunk->data(), 0, chunk->used);
+    DeleteArray<uint8_t>(nullptr /* arena */, reinterpret_cast<uint8_t*>(chunk));
+}
+
+void* Arena::Allocate(size_t size) {
+    if (size > SIZE_MAX - kAlignment) return nullptr;
+    size = RoundUp(size ? size : 1);
+
+    if (!chunks_ || chunks_->size - chunks_->used < size) {
+        Chunk* chunk = NewChunk(size);
+        if (!chunk) return nullptr;
+        if (chunks_ && size > chunk_size_) {
+            // Oversized allocations get a chunk of their own, behind the one being filled, so the
+            // space left in that one isn't wasted.
+            chunk->next = chunks_->next;
+            chunks_->next = chunk;
+        } else {
+            chunk->next = chunks_;
+            chunks_ = chunk;
+        }
+        chunk->used = size;
+        bytes_allocated_ += size;
+        return chunk->data();
+    }
+
+    void* result = chunks_->data() + chunks_->used;
+    chunks_->used += size;
+    bytes_allocated_ += size;
+    return result;
+}
+
+bool Arena::Owns(const void* ptr) const {
+    if (!ptr) return false;
+    const uint8_t* p = static_cast<const uint8_t*>(ptr);
+    for (const Chunk* chunk = chunks_; chunk; chunk = chunk->next) {
+        if (p >= chunk->data() && p < chunk->data() + chunk->size) return true;
+    }
+    return false;
+}
+
+void Arena::Reset() {
+    if (!chunks_) return;
+
+    // Keep the oldest chunk, which has the default size unless the very first allocation was
+    // oversized.
+    Chunk* keep = chunks_;
+    while (keep->next) {
+        Chunk* next = keep->next;
+        FreeChunk(keep);
+        keep = next;
+    }
+    if (keep->size != chunk_size_) {
+        FreeChunk(keep);
+        keep = nullptr;
+    } else {
+        memset_s(keep->data(), 0, keep->used);
+        keep->used = 0;
+    }
+    chunks_ = keep;
+    bytes_allocated_ = 0;
+}
+
+}  // namespace keymaster
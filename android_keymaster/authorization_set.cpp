@@ -21,18 +21,213 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <random>
+
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/logger.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
 namespace keymaster {
 
 static inline bool is_blob_tag(keymaster_tag_t tag) {
     return (keymaster_tag_get_type(tag) == KM_BYTES || keymaster_tag_get_type(tag) == KM_BIGNUM);
 }
 
+template <typename T> static inline int CompareValues(T a, T b) {
+    return a < b ? -1 : (a == b ? 0 : 1);
+}
+
+// Orders params by tag, then by value, for sorting and merging.  Params compare equal exactly when
+// keymaster_param_compare() says they do, but this one can be inlined into std::sort.
+static inline int CompareParams(const keymaster_key_param_t& a, const keymaster_key_param_t& b) {
+    if (a.tag != b.tag) return a.tag < b.tag ? -1 : 1;
+    switch (keymaster_tag_get_type(a.tag)) {
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        return CompareValues(a.enumerated, b.enumerated);
+    case KM_UINT:
+    case KM_UINT_REP:
+        return CompareValues(a.integer, b.integer);
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        return CompareValues(a.long_integer, b.long_integer);
+    case KM_DATE:
+        return CompareValues(a.date_time, b.date_time);
+    case KM_BIGNUM:
+    case KM_BYTES: {
+        size_t common = std::min(a.blob.data_length, b.blob.data_length);
+        int result = common ? memcmp(a.blob.data, b.blob.data, common) : 0;
+        return result ? result : CompareValues(a.blob.data_length, b.blob.data_length);
+    }
+    case KM_INVALID:
+    case KM_BOOL:
+        break;
+    }
+    return 0;
+}
+
+static inline bool ParamLess(const keymaster_key_param_t& a, const keymaster_key_param_t& b) {
+    return CompareParams(a, b) < 0;
+}
+
+static inline uint64_t RotateLeft64(uint64_t x, unsigned bits) {
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static inline void SipRound(uint64_t v[4]) {
+    v[0] += v[1];
+    v[1] = RotateLeft64(v[1], 13) ^ v[0];
+    v[0] = RotateLeft64(v[0], 32);
+    v[2] += v[3];
+    v[3] = RotateLeft64(v[3], 16) ^ v[2];
+    v[0] += v[3];
+    v[3] = RotateLeft64(v[3], 21) ^ v[0];
+    v[2] += v[1];
+    v[1] = RotateLeft64(v[1], 17) ^ v[2];
+    v[2] = RotateLeft64(v[2], 32);
+}
+
+// SipHash-2-4 of \p data under the 128-bit key \p key.
+static uint64_t SipHash(const uint64_t key[2], const uint8_t* data, size_t length) {
+    uint64_t v[4] = {key[0] ^ 0x736f6d6570736575ULL, key[1] ^ 0x646f72616e646f6dULL,
+                     key[0] ^ 0x6c7967656e657261ULL, key[1] ^ 0x7465646279746573ULL};
+    uint64_t last = static_cast<uint64_t>(length) << 56;
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t m = 0;
+        for (size_t i = 0; i < 8; ++i) m |= static_cast<uint64_t>(data[i]) << (8 * i);
+        v[3] ^= m;
+        SipRound(v);
+        SipRound(v);
+        v[0] ^= m;
+    }
+    for (size_t i = 0; i < length; ++i) last |= static_cast<uint64_t>(data[i]) << (8 * i);
+    v[3] ^= last;
+    SipRound(v);
+    SipRound(v);
+    v[0] ^= last;
+    v[2] ^= 0xff;
+    for (size_t i = 0; i < 4; ++i) SipRound(v);
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+static const uint64_t* ContentHashKey() {
+    static const struct Key {
+        Key() {
+            std::random_device random;
+            for (uint64_t& word : words) {
+                word = (static_cast<uint64_t>(random()) << 32) | random();
+            }
+        }
+        uint64_t words[2];
+    } key;
+    return key.words;
+}
+
+// Hashes exactly what CompareParams() compares, so params that compare equal hash equal.  Blob
+// contents are hashed first, so every param hashes as one fixed-size block.
+static uint64_t HashParam(const keymaster_key_param_t& param) {
+    const uint64_t* key = ContentHashKey();
+    uint64_t value = 0;
+    switch (keymaster_tag_get_type(param.tag)) {
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        value = param.enumerated;
+        break;
+    case KM_UINT:
+    case KM_UINT_REP:
+        value = param.integer;
+        break;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        value = param.long_integer;
+        break;
+    case KM_DATE:
+        value = param.date_time;
+        break;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        value = SipHash(key, param.blob.data, param.blob.data_length);
+        break;
+    case KM_INVALID:
+    case KM_BOOL:
+        break;
+    }
+    uint8_t block[sizeof(uint32_t) + sizeof(uint64_t)];
+    uint32_t tag = param.tag;
+    memcpy(block, &tag, sizeof(tag));
+    memcpy(block + sizeof(tag), &value, sizeof(value));
+    return SipHash(key, block, sizeof(block));
+}
+
 const size_t STARTING_ELEMS_CAPACITY = 8;
 
+// Sets smaller than this are scanned faster than they are indexed.
+const size_t MIN_INDEXED_SIZE = 8;
+const uint32_t kNoNextTag = UINT32_MAX;
+
+// Returns the position of the first of \p tags[begin, end) that equals \p tag, or \p end.  The
+// tags are dense, so four are compared at a time where there are vector instructions.
+static size_t ScanTags(const uint32_t* tags, size_t begin, size_t end, keymaster_tag_t tag) {
+    uint32_t wanted = static_cast<uint32_t>(tag);
+    size_t i = begin;
+#if defined(__SSE2__)
+    __m128i vwanted = _mm_set1_epi32(static_cast<int>(wanted));
+    for (; i + 4 <= end; i += 4) {
+        __m128i vtags = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(vtags, vwanted));
+        if (mask) return i + __builtin_ctz(mask) / 4;
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint32x4_t vwanted = vdupq_n_u32(wanted);
+    for (; i + 4 <= end; i += 4) {
+        // Narrowing the lane masks to 16 bits each packs all four into one 64-bit word.
+        uint16x4_t matches = vmovn_u32(vceqq_u32(vld1q_u32(tags + i), vwanted));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u16(matches), 0);
+        if (mask) return i + __builtin_ctzll(mask) / 16;
+    }
+#endif
+    for (; i < end; ++i) {
+        if (tags[i] == wanted) return i;
+    }
+    return end;
+}
+
+// Returns the position of the first of \p elems[begin, end) whose tag is \p tag, or \p end.  The
+// tags are an element apart, and gathering them into vectors costs more than comparing them one
+// by one, so instead four are compared per branch.
+static size_t ScanElementTags(const keymaster_key_param_t* elems, size_t begin, size_t end,
+                              keymaster_tag_t tag) {
+    size_t i = begin;
+    for (; i + 4 <= end; i += 4) {
+        if ((elems[i].tag == tag) | (elems[i + 1].tag == tag) | (elems[i + 2].tag == tag) |
+            (elems[i + 3].tag == tag)) {
+            break;
+        }
+    }
+    for (; i < end; ++i) {
+        if (elems[i].tag == tag) return i;
+    }
+    return end;
+}
+
+struct AuthorizationSet::SharedData {
+    std::atomic<uint32_t> refs{0};
+    // Never modified once shared.
+    AuthorizationSet set;
+};
+
 AuthorizationSet::AuthorizationSet(AuthorizationSetBuilder& builder) {
+    // The builder's storage is taken over below, so it must be the builder's own.
+    builder.set.Unshare();
+
     elems_ = builder.set.elems_;
     builder.set.elems_ = nullptr;
 
@@ -53,6 +248,10 @@ AuthorizationSet::AuthorizationSet(AuthorizationSetBuilder& builder) {
 
     error_ = builder.set.error_;
     builder.set.error_ = OK;
+
+    content_hash_ = builder.set.content_hash_;
+    content_hash_known_ = builder.set.content_hash_known_;
+    builder.set.content_hash_known_ = false;
 }
 
 AuthorizationSet::~AuthorizationSet() {
@@ -60,16 +259,16 @@ AuthorizationSet::~AuthorizationSet() {
 }
 
 bool AuthorizationSet::reserve_elems(size_t count) {
-    if (is_valid() != OK) return false;
+    if (is_valid() != OK || !Unshare()) return false;
 
     if (count > elems_capacity_) {
-        keymaster_key_param_t* new_elems = new (std::nothrow) keymaster_key_param_t[count];
+        keymaster_key_param_t* new_elems = NewArray<keymaster_key_param_t>(arena_, count);
         if (new_elems == nullptr) {
             set_invalid(ALLOCATION_FAILURE);
             return false;
         }
         memcpy(new_elems, elems_, sizeof(*elems_) * elems_size_);
-        delete[] elems_;
+        DeleteArray(arena_, elems_);
         elems_ = new_elems;
         elems_capacity_ = count;
     }
@@ -77,10 +276,10 @@ bool AuthorizationSet::reserve_elems(size_t count) {
 }
 
 bool AuthorizationSet::reserve_indirect(size_t length) {
-    if (is_valid() != OK) return false;
+    if (is_valid() != OK || !Unshare()) return false;
 
     if (length > indirect_data_capacity_) {
-        uint8_t* new_data = new (std::nothrow) uint8_t[length];
+        uint8_t* new_data = NewArray<uint8_t>(arena_, length);
         if (new_data == nullptr) {
             set_invalid(ALLOCATION_FAILURE);
             return false;
@@ -92,14 +291,57 @@ bool AuthorizationSet::reserve_indirect(size_t length) {
             if (is_blob_tag(elems_[i].tag))
                 elems_[i].blob.data = new_data + (elems_[i].blob.data - indirect_data_);
         }
-        delete[] indirect_data_;
+        if (!indirect_data_borrowed_) DeleteArray(arena_, indirect_data_);
+        indirect_data_borrowed_ = false;
         indirect_data_ = new_data;
         indirect_data_capacity_ = length;
     }
     return true;
 }
 
+bool AuthorizationSet::grow_elems(size_t count) {
+    if (count > elems_capacity_) {
+        count = std::max(count, std::max(2 * elems_capacity_, STARTING_ELEMS_CAPACITY));
+    }
+    return reserve_elems(count);
+}
+
+bool AuthorizationSet::grow_indirect(size_t length) {
+    return reserve_indirect(std::max(length, 2 * indirect_data_capacity_));
+}
+
+bool AuthorizationSet::Reserve(size_t more_elems, size_t more_indirect_bytes) {
+    if (!reserve_elems(elems_size_ + more_elems)) return false;
+    // A view's indirect data has no capacity, so this materializes it.
+    return more_indirect_bytes == 0 || reserve_indirect(indirect_data_size_ + more_indirect_bytes);
+}
+
 void AuthorizationSet::MoveFrom(AuthorizationSet& set) {
+    if (set.shared_) {
+        // Shared storage never comes from an arena, so it can simply change hands.
+        AttachShared(set.shared_);
+        set.FreeData();
+        return;
+    }
+    if (set.arena_ && set.arena_ != arena_) {
+        // Arena storage must not outlive the call it belongs to, so take a copy instead.
+        elems_ = nullptr;
+        elems_size_ = 0;
+        elems_capacity_ = 0;
+        indirect_data_ = nullptr;
+        indirect_data_size_ = 0;
+        indirect_data_capacity_ = 0;
+        indirect_data_borrowed_ = false;
+        error_ = OK;
+        if (set.error_ == OK) {
+            Reinitialize(set.elems_, set.elems_size_);
+        } else {
+            error_ = set.error_;
+        }
+        set.FreeData();
+        return;
+    }
+
     elems_ = set.elems_;
     elems_size_ = set.elems_size_;
     elems_capacity_ = set.elems_capacity_;
@@ -107,6 +349,7 @@ void AuthorizationSet::MoveFrom(AuthorizationSet& set) {
     indirect_data_size_ = set.indirect_data_size_;
     indirect_data_capacity_ = set.indirect_data_capacity_;
     error_ = set.error_;
+    indirect_data_borrowed_ = set.indirect_data_borrowed_;
     set.elems_ = nullptr;
     set.elems_size_ = 0;
     set.elems_capacity_ = 0;
@@ -114,6 +357,17 @@ void AuthorizationSet::MoveFrom(AuthorizationSet& set) {
     set.indirect_data_size_ = 0;
     set.indirect_data_capacity_ = 0;
     set.error_ = OK;
+    set.indirect_data_borrowed_ = false;
+    tag_index_ = std::move(set.tag_index_);
+    tag_index_size_ = set.tag_index_size_;
+    next_same_tag_ = std::move(set.next_same_tag_);
+    dense_tags_ = std::move(set.dense_tags_);
+    set.tag_index_size_ = 0;
+    serialized_elements_size_ = set.serialized_elements_size_;
+    set.serialized_elements_size_ = kUnknownSize;
+    content_hash_ = set.content_hash_;
+    content_hash_known_ = set.content_hash_known_;
+    set.content_hash_known_ = false;
 }
 
 bool AuthorizationSet::Reinitialize(const keymaster_key_param_t* elems, const size_t count) {
@@ -141,51 +395,75 @@ void AuthorizationSet::set_invalid(Error error) {
 }
 
 void AuthorizationSet::Sort() {
-    qsort(elems_, elems_size_, sizeof(*elems_),
-          reinterpret_cast<int (*)(const void*, const void*)>(keymaster_param_compare));
+    if (!Unshare()) return;
+    // Order doesn't change the hash.
+    bool hash_known = content_hash_known_;
+    InvalidateCaches();
+    content_hash_known_ = hash_known;
+    std::sort(elems_, elems_ + elems_size_, ParamLess);
 }
 
 void AuthorizationSet::Deduplicate() {
     Sort();
 
-    size_t invalid_count = 0;
-    for (size_t i = 1; i < size(); ++i) {
-        if (elems_[i - 1].tag == KM_TAG_INVALID)
-            ++invalid_count;
-        else if (keymaster_param_compare(elems_ + i - 1, elems_ + i) == 0) {
-            // Mark dups as invalid.  Note that this "leaks" the data referenced by KM_BYTES and
-            // KM_BIGNUM entries, but those are just pointers into indirect_data_, so it will all
-            // get cleaned up.
-            elems_[i - 1].tag = KM_TAG_INVALID;
-            ++invalid_count;
+    // Keep the first of each run of equal params, and no invalid ones.  Dropping a KM_BYTES or
+    // KM_BIGNUM param "leaks" its data, but that is just a pointer into indirect_data_, so it all
+    // gets cleaned up with the set.
+    size_t kept = 0;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        if (elems_[i].tag == KM_TAG_INVALID ||
+            (kept > 0 && CompareParams(elems_[kept - 1], elems_[i]) == 0)) {
+            if (content_hash_known_) content_hash_ -= HashParam(elems_[i]);
+            continue;
         }
+        elems_[kept++] = elems_[i];
     }
-    if (size() > 0 && elems_[size() - 1].tag == KM_TAG_INVALID) ++invalid_count;
-
-    if (invalid_count == 0) return;
+    elems_size_ = kept;
+}
 
-    Sort();
+bool AuthorizationSet::MergeSorted(const keymaster_key_param_set_t& set, bool keep_matches) {
+    // Merging against a sorted copy of |set| takes one pass over each, where searching for and
+    // erasing each of its params would take one pass over this set per param.
+    UniquePtr<keymaster_key_param_t[], ArenaArrayDelete<keymaster_key_param_t>> other(
+        NewArray<keymaster_key_param_t>(nullptr /* arena */, set.length));
+    if (!other.get()) {
+        set_invalid(ALLOCATION_FAILURE);
+        return false;
+    }
+    std::copy(set.params, set.params + set.length, other.get());
+    std::sort(other.get(), other.get() + set.length, ParamLess);
 
-    // Since KM_TAG_INVALID == 0, all of the invalid entries are first.
-    elems_size_ -= invalid_count;
-    memmove(elems_, elems_ + invalid_count, size() * sizeof(*elems_));
+    size_t kept = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        while (j < set.length && ParamLess(other[j], elems_[i])) ++j;
+        bool matched = j < set.length && CompareParams(other[j], elems_[i]) == 0;
+        if (matched == keep_matches) {
+            elems_[kept++] = elems_[i];
+        } else if (content_hash_known_) {
+            content_hash_ -= HashParam(elems_[i]);
+        }
+    }
+    elems_size_ = kept;
+    return true;
 }
 
 void AuthorizationSet::Difference(const keymaster_key_param_set_t& set) {
     if (set.length == 0) return;
 
     Deduplicate();
+    MergeSorted(set, false /* keep_matches */);
+}
 
-    for (size_t i = 0; i < set.length; i++) {
-        int index = -1;
-        do {
-            index = find(set.params[i].tag, index);
-            if (index != -1 && keymaster_param_compare(&elems_[index], &set.params[i]) == 0) {
-                erase(index);
-                break;
-            }
-        } while (index != -1);
-    }
+bool AuthorizationSet::Intersection(const keymaster_key_param_set_t& set) {
+    Deduplicate();
+    return MergeSorted(set, true /* keep_matches */);
+}
+
+bool AuthorizationSet::Union(const keymaster_key_param_set_t& set) {
+    if (!push_back(set)) return false;
+    Deduplicate();
+    return is_valid() == OK;
 }
 
 void AuthorizationSet::CopyToParamSet(keymaster_key_param_set_t* set) const {
@@ -210,19 +488,123 @@ void AuthorizationSet::CopyToParamSet(keymaster_key_param_set_t* set) const {
 }
 
 int AuthorizationSet::find(keymaster_tag_t tag, int begin) const {
+    // The shared block holds the same elements in the same order, along with their index.
+    if (shared_) return shared_->set.find(tag, begin);
     if (is_valid() != OK) return -1;
+    if (tag_index_) return IndexedFind(tag, begin);
 
-    int i = ++begin;
-    while (i < (int)elems_size_ && elems_[i].tag != tag)
-        ++i;
-    if (i == (int)elems_size_)
-        return -1;
-    else
-        return i;
+    if (++begin >= static_cast<int>(elems_size_)) return -1;
+    size_t i = ScanElementTags(elems_, begin, elems_size_, tag);
+    return i == elems_size_ ? -1 : static_cast<int>(i);
+}
+
+int AuthorizationSet::IndexedFind(keymaster_tag_t tag, int begin) const {
+    if (begin >= 0) {
+        if (begin >= static_cast<int>(elems_size_)) return -1;
+        if (elems_[begin].tag == tag) {
+            uint32_t next = next_same_tag_[begin];
+            return next == kNoNextTag ? -1 : static_cast<int>(next);
+        }
+        // Starting from an element with a different tag; find the first match after it.
+        size_t i = ScanTags(dense_tags_.get(), begin + 1, elems_size_, tag);
+        return i == elems_size_ ? -1 : static_cast<int>(i);
+    }
+
+    size_t lo = 0;
+    size_t hi = tag_index_size_;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        // Compare unsigned, as the index is sorted; KM_BYTES tags have the top bit set.
+        if (static_cast<uint32_t>(tag_index_[mid].tag) < static_cast<uint32_t>(tag)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == tag_index_size_ || tag_index_[lo].tag != tag) return -1;
+    return static_cast<int>(tag_index_[lo].first);
+}
+
+static int tag_index_entry_compare(const void* a, const void* b) {
+    // Entries are (tag, position) pairs; ordering by both keeps equal tags in element order.
+    const uint32_t* lhs = reinterpret_cast<const uint32_t*>(a);
+    const uint32_t* rhs = reinterpret_cast<const uint32_t*>(b);
+    if (lhs[0] != rhs[0]) return lhs[0] < rhs[0] ? -1 : 1;
+    if (lhs[1] != rhs[1]) return lhs[1] < rhs[1] ? -1 : 1;
+    return 0;
+}
+
+bool AuthorizationSet::BuildIndex() {
+    if (shared_) return shared_->set.has_index();
+    // The elements don't change, so only the old index is dropped.
+    tag_index_.reset();
+    tag_index_size_ = 0;
+    next_same_tag_.reset();
+    dense_tags_.reset();
+    if (is_valid() != OK || elems_size_ < MIN_INDEXED_SIZE || elems_size_ >= kNoNextTag) {
+        return false;
+    }
+
+    UniquePtr<uint32_t[], ArenaArrayDelete<uint32_t>> pairs(
+        NewArray<uint32_t>(nullptr /* arena */, 2 * elems_size_));
+    UniquePtr<TagIndexEntry[], ArenaArrayDelete<TagIndexEntry>> index(
+        NewArray<TagIndexEntry>(nullptr /* arena */, elems_size_));
+    UniquePtr<uint32_t[], ArenaArrayDelete<uint32_t>> next(
+        NewArray<uint32_t>(nullptr /* arena */, elems_size_));
+    UniquePtr<uint32_t[], ArenaArrayDelete<uint32_t>> dense_tags(
+        NewArray<uint32_t>(nullptr /* arena */, elems_size_));
+    if (!pairs || !index || !next || !dense_tags) return false;
+
+    for (size_t i = 0; i < elems_size_; ++i) {
+        dense_tags[i] = static_cast<uint32_t>(elems_[i].tag);
+        pairs[2 * i] = dense_tags[i];
+        pairs[2 * i + 1] = static_cast<uint32_t>(i);
+    }
+    qsort(pairs.get(), elems_size_, 2 * sizeof(uint32_t), tag_index_entry_compare);
+
+    size_t index_size = 0;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        uint32_t tag = pairs[2 * i];
+        uint32_t pos = pairs[2 * i + 1];
+        if (i == 0 || pairs[2 * (i - 1)] != tag) {
+            index[index_size].tag = static_cast<keymaster_tag_t>(tag);
+            index[index_size].first = pos;
+            ++index_size;
+        }
+        bool last = i + 1 == elems_size_ || pairs[2 * (i + 1)] != tag;
+        next[pos] = last ? kNoNextTag : pairs[2 * (i + 1) + 1];
+    }
+
+    tag_index_ = std::move(index);
+    tag_index_size_ = index_size;
+    next_same_tag_ = std::move(next);
+    dense_tags_ = std::move(dense_tags);
+    return true;
+}
+
+bool AuthorizationSet::has_index() const {
+    if (shared_) return shared_->set.has_index();
+    return tag_index_.get() != nullptr;
+}
+
+void AuthorizationSet::InvalidateCaches() {
+    serialized_elements_size_ = kUnknownSize;
+    content_hash_known_ = false;
+    tag_index_.reset();
+    tag_index_size_ = 0;
+    next_same_tag_.reset();
+    dense_tags_.reset();
 }
 
 bool AuthorizationSet::erase(int index) {
     if (index < 0 || index >= static_cast<int>(size())) return false;
+    if (!Unshare()) return false;
+    bool hash_known = content_hash_known_;
+    InvalidateCaches();
+    if (hash_known) {
+        content_hash_ -= HashParam(elems_[index]);
+        content_hash_known_ = true;
+    }
 
     --elems_size_;
     for (size_t i = index; i < elems_size_; ++i)
@@ -232,6 +614,9 @@ bool AuthorizationSet::erase(int index) {
 
 keymaster_key_param_t empty_param = {KM_TAG_INVALID, {}};
 keymaster_key_param_t& AuthorizationSet::operator[](int at) {
+    // The caller may change the tag.
+    Unshare();
+    InvalidateCaches();
     if (is_valid() == OK && at < (int)elems_size_) {
         return elems_[at];
     }
@@ -248,30 +633,49 @@ const keymaster_key_param_t& AuthorizationSet::operator[](int at) const {
 }
 
 bool AuthorizationSet::push_back(const keymaster_key_param_set_t& set) {
-    if (is_valid() != OK) return false;
-
-    if (!reserve_elems(elems_size_ + set.length)) return false;
+    return push_back(set.params, set.length);
+}
 
-    if (!reserve_indirect(indirect_data_size_ + ComputeIndirectDataSize(set.params, set.length)))
+bool AuthorizationSet::push_back(const keymaster_key_param_t* params, size_t count) {
+    if (is_valid() != OK || !Unshare()) return false;
+    bool hash_known = content_hash_known_;
+    InvalidateCaches();
+
+    // Everything is sized up front, so the set grows at most once for each array.
+    if (!grow_elems(elems_size_ + count)) return false;
+    size_t indirect_length = ComputeIndirectDataSize(params, count);
+    size_t indirect_room = indirect_data_capacity_ - indirect_data_size_;
+    if (indirect_length > 0 && (indirect_data_borrowed_ || indirect_room < indirect_length) &&
+        !grow_indirect(indirect_data_size_ + indirect_length)) {
         return false;
+    }
 
-    for (size_t i = 0; i < set.length; ++i)
-        if (!push_back(set.params[i])) return false;
-
+    for (size_t i = 0; i < count; ++i) {
+        keymaster_key_param_t& elem = elems_[elems_size_++];
+        elem = params[i];
+        if (is_blob_tag(elem.tag)) {
+            memcpy(indirect_data_ + indirect_data_size_, elem.blob.data, elem.blob.data_length);
+            elem.blob.data = indirect_data_ + indirect_data_size_;
+            indirect_data_size_ += elem.blob.data_length;
+        }
+        if (hash_known) content_hash_ += HashParam(elem);
+    }
+    content_hash_known_ = hash_known;
     return true;
 }
 
 bool AuthorizationSet::push_back(keymaster_key_param_t elem) {
-    if (is_valid() != OK) return false;
+    if (is_valid() != OK || !Unshare()) return false;
+    bool hash_known = content_hash_known_;
+    InvalidateCaches();
 
-    if (elems_size_ >= elems_capacity_)
-        if (!reserve_elems(elems_capacity_ ? elems_capacity_ * 2 : STARTING_ELEMS_CAPACITY))
-            return false;
+    if (elems_size_ >= elems_capacity_ && !grow_elems(elems_size_ + 1)) return false;
 
     if (is_blob_tag(elem.tag)) {
-        if (indirect_data_capacity_ - indirect_data_size_ < elem.blob.data_length)
-            if (!reserve_indirect(2 * (indirect_data_capacity_ + elem.blob.data_length)))
-                return false;
+        // A view has no capacity of its own, so any blob forces it to materialize.
+        if (indirect_data_borrowed_ ||
+            indirect_data_capacity_ - indirect_data_size_ < elem.blob.data_length)
+            if (!grow_indirect(indirect_data_size_ + elem.blob.data_length)) return false;
 
         memcpy(indirect_data_ + indirect_data_size_, elem.blob.data, elem.blob.data_length);
         elem.blob.data = indirect_data_ + indirect_data_size_;
@@ -279,6 +683,10 @@ bool AuthorizationSet::push_back(keymaster_key_param_t elem) {
     }
 
     elems_[elems_size_++] = elem;
+    if (hash_known) {
+        content_hash_ += HashParam(elem);
+        content_hash_known_ = true;
+    }
     return true;
 }
 
@@ -305,78 +713,85 @@ static size_t serialized_size(const keymaster_key_param_t& param) {
     return sizeof(uint32_t);
 }
 
-static uint8_t* serialize(const keymaster_key_param_t& param, uint8_t* buf, const uint8_t* end,
-                          const uint8_t* indirect_base) {
-    buf = append_uint32_to_buf(buf, end, param.tag);
+// The caller has already required serialized_size(param) bytes of \p writer.
+static void serialize(const keymaster_key_param_t& param, ByteWriter* writer,
+                      const uint8_t* indirect_base) {
+    writer->WriteUint32Unchecked(param.tag);
     switch (keymaster_tag_get_type(param.tag)) {
     case KM_INVALID:
         break;
     case KM_ENUM:
     case KM_ENUM_REP:
-        buf = append_uint32_to_buf(buf, end, param.enumerated);
+        writer->WriteUint32Unchecked(param.enumerated);
         break;
     case KM_UINT:
     case KM_UINT_REP:
-        buf = append_uint32_to_buf(buf, end, param.integer);
+        writer->WriteUint32Unchecked(param.integer);
         break;
     case KM_ULONG:
     case KM_ULONG_REP:
-        buf = append_uint64_to_buf(buf, end, param.long_integer);
+        writer->WriteUint64Unchecked(param.long_integer);
         break;
     case KM_DATE:
-        buf = append_uint64_to_buf(buf, end, param.date_time);
+        writer->WriteUint64Unchecked(param.date_time);
         break;
     case KM_BOOL:
-        if (buf < end) *buf = static_cast<uint8_t>(param.boolean);
-        buf++;
+        writer->WriteUint8Unchecked(static_cast<uint8_t>(param.boolean));
         break;
     case KM_BIGNUM:
     case KM_BYTES:
-        buf = append_uint32_to_buf(buf, end, param.blob.data_length);
-        buf = append_uint32_to_buf(buf, end, param.blob.data - indirect_base);
+        writer->WriteUint32Unchecked(param.blob.data_length);
+        writer->WriteUint32Unchecked(param.blob.data - indirect_base);
         break;
     }
-    return buf;
 }
 
-static bool deserialize(keymaster_key_param_t* param, const uint8_t** buf_ptr, const uint8_t* end,
+// Serializes \p count elements into \p writer, which must have room for all of them: the whole
+// region is checked once and then written without per-field checks.
+static bool serialize_elements(const keymaster_key_param_t* elems, size_t count,
+                               size_t elements_size, ByteWriter* writer,
+                               const uint8_t* indirect_base) {
+    if (!writer->Require(elements_size)) return false;
+    for (size_t i = 0; i < count; ++i) {
+        serialize(elems[i], writer, indirect_base);
+    }
+    return true;
+}
+
+static bool deserialize(keymaster_key_param_t* param, ByteReader* reader,
                         const uint8_t* indirect_base, const uint8_t* indirect_end) {
-    if (!copy_uint32_from_buf(buf_ptr, end, &param->tag)) return false;
+    if (!reader->ReadUint32(&param->tag)) return false;
 
+    // Once the tag is known the rest of the element has a fixed size, checked in one go.
     switch (keymaster_tag_get_type(param->tag)) {
     case KM_INVALID:
         return false;
     case KM_ENUM:
     case KM_ENUM_REP:
-        return copy_uint32_from_buf(buf_ptr, end, &param->enumerated);
+        return reader->ReadUint32(&param->enumerated);
     case KM_UINT:
     case KM_UINT_REP:
-        return copy_uint32_from_buf(buf_ptr, end, &param->integer);
+        return reader->ReadUint32(&param->integer);
     case KM_ULONG:
     case KM_ULONG_REP:
-        return copy_uint64_from_buf(buf_ptr, end, &param->long_integer);
+        return reader->ReadUint64(&param->long_integer);
     case KM_DATE:
-        return copy_uint64_from_buf(buf_ptr, end, &param->date_time);
-        break;
-    case KM_BOOL:
-        if (*buf_ptr < end) {
-            uint8_t temp = **buf_ptr;
-            // Bools are converted to 0 or 1 when serialized so only accept
-            // one of these values when deserializing.
-            if (temp <= 1) {
-                param->boolean = static_cast<bool>(temp);
-                (*buf_ptr)++;
-                return true;
-            }
-        }
-        return false;
+        return reader->ReadUint64(&param->date_time);
+    case KM_BOOL: {
+        if (!reader->Require(1)) return false;
+        // Bools are converted to 0 or 1 when serialized so only accept
+        // one of these values when deserializing.
+        uint8_t temp = reader->ReadUint8Unchecked();
+        if (temp > 1) return false;
+        param->boolean = static_cast<bool>(temp);
+        return true;
+    }
 
     case KM_BIGNUM:
     case KM_BYTES: {
-        uint32_t offset;
-        if (!copy_uint32_from_buf(buf_ptr, end, &param->blob.data_length) ||
-            !copy_uint32_from_buf(buf_ptr, end, &offset))
-            return false;
+        if (!reader->Require(2 * sizeof(uint32_t))) return false;
+        param->blob.data_length = reader->ReadUint32Unchecked();
+        uint32_t offset = reader->ReadUint32Unchecked();
         if (param->blob.data_length + offset < param->blob.data_length ||  // Overflow check
             static_cast<ptrdiff_t>(offset) > indirect_end - indirect_base ||
             static_cast<ptrdiff_t>(offset + param->blob.data_length) > indirect_end - indirect_base)
@@ -390,13 +805,26 @@ static bool deserialize(keymaster_key_param_t* param, const uint8_t** buf_ptr, c
 }
 
 size_t AuthorizationSet::SerializedSizeOfElements() const {
+    if (serialized_elements_size_ != kUnknownSize) return serialized_elements_size_;
     size_t size = 0;
     for (size_t i = 0; i < elems_size_; ++i) {
         size += serialized_size(elems_[i]);
     }
+    serialized_elements_size_ = size;
     return size;
 }
 
+uint64_t AuthorizationSet::ContentHash() const {
+    if (content_hash_known_) return content_hash_;
+    uint64_t hash = 0;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        hash += HashParam(elems_[i]);
+    }
+    content_hash_ = hash;
+    content_hash_known_ = true;
+    return hash;
+}
+
 size_t AuthorizationSet::SerializedSize() const {
     return sizeof(uint32_t) +           // Size of indirect_data_
            indirect_data_size_ +        // indirect_data_
@@ -408,14 +836,66 @@ size_t AuthorizationSet::SerializedSize() const {
 uint8_t* AuthorizationSet::Serialize(uint8_t* buf, const uint8_t* end) const {
     buf = append_size_and_data_to_buf(buf, end, indirect_data_, indirect_data_size_);
     buf = append_uint32_to_buf(buf, end, elems_size_);
-    buf = append_uint32_to_buf(buf, end, SerializedSizeOfElements());
-    for (size_t i = 0; i < elems_size_; ++i) {
-        buf = serialize(elems_[i], buf, end, indirect_data_);
+    size_t elements_size = SerializedSizeOfElements();
+    buf = append_uint32_to_buf(buf, end, elements_size);
+    ByteWriter writer(buf, end);
+    if (!serialize_elements(elems_, elems_size_, elements_size, &writer, indirect_data_)) {
+        return buf;
     }
-    return buf;
+    return writer.position();
 }
 
-bool AuthorizationSet::DeserializeIndirectData(const uint8_t** buf_ptr, const uint8_t* end) {
+bool AuthorizationSet::SerializeTo(SerializationSink* sink) const {
+    // The indirect data holds the blobs; the elements are small and fixed-format, so they are
+    // serialized straight into scratch storage.
+    size_t elements_size = SerializedSizeOfElements();
+    if (!sink->WriteSizeAndData(indirect_data_, indirect_data_size_) ||
+        !sink->WriteUint32(elems_size_) || !sink->WriteUint32(elements_size)) {
+        return false;
+    }
+    if (elements_size == 0) return true;
+
+    uint8_t* buf = sink->Reserve(elements_size);
+    if (!buf) return false;
+    ByteWriter writer(buf, buf + elements_size);
+    return serialize_elements(elems_, elems_size_, elements_size, &writer, indirect_data_);
+}
+
+bool AuthorizationSet::DeserializeIndirectData(const uint8_t** buf_ptr, const uint8_t* end,
+                                               bool borrow) {
+    if (borrow) {
+        if (!copy_uint32_from_buf(buf_ptr, end, &indirect_data_size_) ||
+            !__buffer_bound_check(*buf_ptr, end, indirect_data_size_)) {
+            LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+            set_invalid(MALFORMED_DATA);
+            return false;
+        }
+        // Nothing is ever written through indirect_data_ while it's borrowed.
+        indirect_data_ = indirect_data_size_ ? const_cast<uint8_t*>(*buf_ptr) : nullptr;
+        indirect_data_borrowed_ = indirect_data_ != nullptr;
+        *buf_ptr += indirect_data_size_;
+        return true;
+    }
+
+    if (arena_) {
+        if (!copy_uint32_from_buf(buf_ptr, end, &indirect_data_size_) ||
+            !__buffer_bound_check(*buf_ptr, end, indirect_data_size_)) {
+            LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+            set_invalid(MALFORMED_DATA);
+            return false;
+        }
+        if (indirect_data_size_) {
+            indirect_data_ = NewArray<uint8_t>(arena_, indirect_data_size_);
+            if (!indirect_data_) {
+                set_invalid(ALLOCATION_FAILURE);
+                return false;
+            }
+            copy_from_buf(buf_ptr, end, indirect_data_, indirect_data_size_);
+        }
+        indirect_data_capacity_ = indirect_data_size_;
+        return true;
+    }
+
     UniquePtr<uint8_t[]> indirect_buf;
     if (!copy_size_and_data_from_buf(buf_ptr, end, &indirect_data_size_, &indirect_buf)) {
         LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
@@ -423,6 +903,7 @@ bool AuthorizationSet::DeserializeIndirectData(const uint8_t** buf_ptr, const ui
         return false;
     }
     indirect_data_ = indirect_buf.release();
+    indirect_data_capacity_ = indirect_data_size_;
     return true;
 }
 
@@ -461,13 +942,15 @@ bool AuthorizationSet::DeserializeElementsData(const uint8_t** buf_ptr, const ui
 
     uint8_t* indirect_end = indirect_data_ + indirect_data_size_;
     const uint8_t* elements_end = *buf_ptr + elements_size;
+    ByteReader reader(*buf_ptr, elements_end);
     for (size_t i = 0; i < elements_count; ++i) {
-        if (!deserialize(elems_ + i, buf_ptr, elements_end, indirect_data_, indirect_end)) {
+        if (!deserialize(elems_ + i, &reader, indirect_data_, indirect_end)) {
             LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
             set_invalid(MALFORMED_DATA);
             return false;
         }
     }
+    *buf_ptr = reader.position();
 
     // Check if all the elements were consumed. If not, something was malformed as the
     // retrieved elements_count and elements_size are not consistent with each other.
@@ -478,13 +961,28 @@ bool AuthorizationSet::DeserializeElementsData(const uint8_t** buf_ptr, const ui
     }
 
     elems_size_ = elements_count;
+    serialized_elements_size_ = elements_size;
     return true;
 }
 
 bool AuthorizationSet::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    return DeserializeImpl(buf_ptr, end, false /* borrow */);
+}
+
+bool AuthorizationSet::DeserializeView(const uint8_t** buf_ptr, const uint8_t* end) {
+    return DeserializeImpl(buf_ptr, end, true /* borrow */);
+}
+
+bool AuthorizationSet::Materialize() {
+    if (is_valid() != OK) return false;
+    if (!indirect_data_borrowed_) return true;
+    return reserve_indirect(indirect_data_size_);
+}
+
+bool AuthorizationSet::DeserializeImpl(const uint8_t** buf_ptr, const uint8_t* end, bool borrow) {
     FreeData();
 
-    if (!DeserializeIndirectData(buf_ptr, end) || !DeserializeElementsData(buf_ptr, end))
+    if (!DeserializeIndirectData(buf_ptr, end, borrow) || !DeserializeElementsData(buf_ptr, end))
         return false;
 
     if (indirect_data_size_ != ComputeIndirectDataSize(elems_, elems_size_)) {
@@ -492,12 +990,414 @@ bool AuthorizationSet::Deserialize(const uint8_t** buf_ptr, const uint8_t* end)
         set_invalid(MALFORMED_DATA);
         return false;
     }
+    BuildIndex();
+    return true;
+}
+
+// Tags of neighbouring elements are usually close, so each is stored as a zigzag-encoded
+// difference from the one before.
+static uint64_t compact_tag_delta(keymaster_tag_t tag, keymaster_tag_t prev_tag) {
+    int64_t delta = static_cast<int64_t>(static_cast<uint32_t>(tag)) -
+                    static_cast<int64_t>(static_cast<uint32_t>(prev_tag));
+    return (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63);
+}
+
+static bool compact_tag_from_delta(uint64_t zigzag, keymaster_tag_t prev_tag,
+                                   keymaster_tag_t* tag) {
+    int64_t delta = static_cast<int64_t>(zigzag >> 1) ^ -static_cast<int64_t>(zigzag & 1);
+    int64_t value = static_cast<int64_t>(static_cast<uint32_t>(prev_tag)) + delta;
+    if (value < 0 || value > UINT32_MAX) return false;
+    *tag = static_cast<keymaster_tag_t>(value);
+    return true;
+}
+
+static size_t compact_serialized_size(const keymaster_key_param_t& param,
+                                      keymaster_tag_t prev_tag) {
+    size_t size = varint_size(compact_tag_delta(param.tag, prev_tag));
+    switch (keymaster_tag_get_type(param.tag)) {
+    case KM_INVALID:
+        break;
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        size += varint_size(param.enumerated);
+        break;
+    case KM_UINT:
+    case KM_UINT_REP:
+        size += varint_size(param.integer);
+        break;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        size += varint_size(param.long_integer);
+        break;
+    case KM_DATE:
+        size += varint_size(param.date_time);
+        break;
+    case KM_BOOL:
+        size += 1;
+        break;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        size += varint_size(param.blob.data_length) + param.blob.data_length;
+        break;
+    }
+    return size;
+}
+
+static uint8_t* compact_serialize(const keymaster_key_param_t& param, keymaster_tag_t prev_tag,
+                                  uint8_t* buf, const uint8_t* end) {
+    buf = append_varint_to_buf(buf, end, compact_tag_delta(param.tag, prev_tag));
+    switch (keymaster_tag_get_type(param.tag)) {
+    case KM_INVALID:
+        break;
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        buf = append_varint_to_buf(buf, end, param.enumerated);
+        break;
+    case KM_UINT:
+    case KM_UINT_REP:
+        buf = append_varint_to_buf(buf, end, param.integer);
+        break;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        buf = append_varint_to_buf(buf, end, param.long_integer);
+        break;
+    case KM_DATE:
+        buf = append_varint_to_buf(buf, end, param.date_time);
+        break;
+    case KM_BOOL:
+        if (buf < end) *buf = static_cast<uint8_t>(param.boolean);
+        buf++;
+        break;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        buf = append_varint_to_buf(buf, end, param.blob.data_length);
+        buf = append_to_buf(buf, end, param.blob.data, param.blob.data_length);
+        break;
+    }
+    return buf;
+}
+
+// Leaves KM_BYTES and KM_BIGNUM entries pointing into the buffer.
+static bool compact_deserialize(keymaster_key_param_t* param, keymaster_tag_t prev_tag,
+                                const uint8_t** buf_ptr, const uint8_t* end) {
+    uint64_t value;
+    if (!copy_varint_from_buf(buf_ptr, end, &value) ||
+        !compact_tag_from_delta(value, prev_tag, &param->tag)) {
+        return false;
+    }
+
+    switch (keymaster_tag_get_type(param->tag)) {
+    case KM_INVALID:
+        return false;
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        if (!copy_varint_from_buf(buf_ptr, end, &value) || value > UINT32_MAX) return false;
+        param->enumerated = static_cast<uint32_t>(value);
+        return true;
+    case KM_UINT:
+    case KM_UINT_REP:
+        if (!copy_varint_from_buf(buf_ptr, end, &value) || value > UINT32_MAX) return false;
+        param->integer = static_cast<uint32_t>(value);
+        return true;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        return copy_varint_from_buf(buf_ptr, end, &param->long_integer);
+    case KM_DATE:
+        return copy_varint_from_buf(buf_ptr, end, &param->date_time);
+    case KM_BOOL:
+        // Only 0 and 1 are written, so only they are accepted.
+        if (!__buffer_bound_check(*buf_ptr, end, 1) || **buf_ptr > 1) return false;
+        param->boolean = static_cast<bool>(*(*buf_ptr)++);
+        return true;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        if (!copy_varint_from_buf(buf_ptr, end, &value) ||
+            !__buffer_bound_check(*buf_ptr, end, value)) {
+            return false;
+        }
+        param->blob.data = *buf_ptr;
+        param->blob.data_length = static_cast<size_t>(value);
+        *buf_ptr += value;
+        return true;
+    }
+
+    return false;
+}
+
+size_t AuthorizationSet::CompactSerializedSize() const {
+    size_t size = varint_size(elems_size_);
+    keymaster_tag_t prev_tag = KM_TAG_INVALID;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        size += compact_serialized_size(elems_[i], prev_tag);
+        prev_tag = elems_[i].tag;
+    }
+    return size;
+}
+
+uint8_t* AuthorizationSet::CompactSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_varint_to_buf(buf, end, elems_size_);
+    keymaster_tag_t prev_tag = KM_TAG_INVALID;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        buf = compact_serialize(elems_[i], prev_tag, buf, end);
+        prev_tag = elems_[i].tag;
+    }
+    return buf;
+}
+
+bool AuthorizationSet::CompactDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    FreeData();
+
+    // Every element takes at least two bytes, which bounds the allocation a bad count can cause.
+    uint64_t elements_count;
+    if (!copy_varint_from_buf(buf_ptr, end, &elements_count) ||
+        elements_count > static_cast<uint64_t>(end - *buf_ptr) / 2) {
+        LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+        set_invalid(MALFORMED_DATA);
+        return false;
+    }
+    if (!reserve_elems(elements_count)) return false;
+
+    keymaster_tag_t prev_tag = KM_TAG_INVALID;
+    for (uint64_t i = 0; i < elements_count; ++i) {
+        keymaster_key_param_t param;
+        if (!compact_deserialize(&param, prev_tag, buf_ptr, end)) {
+            LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+            set_invalid(MALFORMED_DATA);
+            return false;
+        }
+        if (!push_back(param)) return false;
+        prev_tag = param.tag;
+    }
+
+    BuildIndex();
     return true;
 }
 
+static bool is_blob_param(const keymaster_key_param_t& param) {
+    keymaster_tag_type_t type = keymaster_tag_get_type(param.tag);
+    return type == KM_BYTES || type == KM_BIGNUM;
+}
+
+static uint64_t columnar_value(const keymaster_key_param_t& param, uint32_t arena_offset) {
+    switch (keymaster_tag_get_type(param.tag)) {
+    case KM_INVALID:
+        return 0;
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        return param.enumerated;
+    case KM_UINT:
+    case KM_UINT_REP:
+        return param.integer;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        return param.long_integer;
+    case KM_DATE:
+        return param.date_time;
+    case KM_BOOL:
+        return param.boolean ? 1 : 0;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        return (static_cast<uint64_t>(arena_offset) << 32) | param.blob.data_length;
+    }
+    return 0;
+}
+
+// Leaves KM_BYTES and KM_BIGNUM entries pointing into |arena|.
+static bool columnar_param(keymaster_tag_t tag, uint64_t value, const uint8_t* arena,
+                           uint32_t arena_size, keymaster_key_param_t* param) {
+    param->tag = tag;
+    switch (keymaster_tag_get_type(tag)) {
+    case KM_INVALID:
+        return false;
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        if (value > UINT32_MAX) return false;
+        param->enumerated = static_cast<uint32_t>(value);
+        return true;
+    case KM_UINT:
+    case KM_UINT_REP:
+        if (value > UINT32_MAX) return false;
+        param->integer = static_cast<uint32_t>(value);
+        return true;
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        param->long_integer = value;
+        return true;
+    case KM_DATE:
+        param->date_time = value;
+        return true;
+    case KM_BOOL:
+        if (value > 1) return false;
+        param->boolean = value != 0;
+        return true;
+    case KM_BIGNUM:
+    case KM_BYTES: {
+        uint64_t offset = value >> 32;
+        uint64_t length = value & UINT32_MAX;
+        if (offset > arena_size || length > arena_size - offset) return false;
+        param->blob.data = arena + offset;
+        param->blob.data_length = static_cast<size_t>(length);
+        return true;
+    }
+    }
+    return false;
+}
+
+size_t AuthorizationSet::ColumnarSerializedSize() const {
+    size_t size = sizeof(uint32_t) + elems_size_ * (sizeof(uint32_t) + sizeof(uint64_t)) +
+                  sizeof(uint32_t);
+    for (size_t i = 0; i < elems_size_; ++i) {
+        if (is_blob_param(elems_[i])) size += elems_[i].blob.data_length;
+    }
+    return size;
+}
+
+uint8_t* AuthorizationSet::ColumnarSerialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_uint32_to_buf(buf, end, elems_size_);
+    for (size_t i = 0; i < elems_size_; ++i) {
+        buf = append_uint32_to_buf(buf, end, elems_[i].tag);
+    }
+    uint32_t arena_size = 0;
+    for (size_t i = 0; i < elems_size_; ++i) {
+        buf = append_uint64_to_buf(buf, end, columnar_value(elems_[i], arena_size));
+        if (is_blob_param(elems_[i])) arena_size += elems_[i].blob.data_length;
+    }
+    buf = append_uint32_to_buf(buf, end, arena_size);
+    for (size_t i = 0; i < elems_size_; ++i) {
+        if (is_blob_param(elems_[i])) {
+            buf = append_to_buf(buf, end, elems_[i].blob.data, elems_[i].blob.data_length);
+        }
+    }
+    return buf;
+}
+
+bool AuthorizationSet::ColumnarDeserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    FreeData();
+
+    // Both columns must fit in what's left, which bounds the allocation a bad count can cause.
+    constexpr size_t kColumnsSize = sizeof(uint32_t) + sizeof(uint64_t);
+    uint32_t elements_count;
+    if (!copy_uint32_from_buf(buf_ptr, end, &elements_count) ||
+        elements_count > static_cast<size_t>(end - *buf_ptr) / kColumnsSize) {
+        LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+        set_invalid(MALFORMED_DATA);
+        return false;
+    }
+    const uint8_t* tags = *buf_ptr;
+    const uint8_t* values = tags + elements_count * sizeof(uint32_t);
+    *buf_ptr = values + elements_count * sizeof(uint64_t);
+
+    uint32_t arena_size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &arena_size) ||
+        !__buffer_bound_check(*buf_ptr, end, arena_size)) {
+        LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+        set_invalid(MALFORMED_DATA);
+        return false;
+    }
+    const uint8_t* arena = *buf_ptr;
+    *buf_ptr += arena_size;
+
+    if (!reserve_elems(elements_count)) return false;
+    for (uint32_t i = 0; i < elements_count; ++i) {
+        uint32_t tag;
+        uint64_t value;
+        memcpy(&tag, tags + i * sizeof(tag), sizeof(tag));
+        memcpy(&value, values + i * sizeof(value), sizeof(value));
+        keymaster_key_param_t param;
+        if (!columnar_param(static_cast<keymaster_tag_t>(tag), value, arena, arena_size,
+                            &param)) {
+            LOG_E("Malformed data found in AuthorizationSet deserialization", 0);
+            set_invalid(MALFORMED_DATA);
+            return false;
+        }
+        if (!push_back(param)) return false;
+    }
+
+    BuildIndex();
+    return true;
+}
+
+void AuthorizationSet::set_arena(Arena* arena) {
+    if (arena == arena_) return;
+    // Storage allocated from the old arena (or the heap) can only be freed by it, so start over.
+    FreeData();
+    arena_ = arena;
+}
+
+bool AuthorizationSet::Share() {
+    if (shared_) return true;
+    if (is_valid() != OK) return false;
+
+    SharedData* shared = new (std::nothrow) SharedData;
+    if (!shared) return false;
+    if (arena_ || indirect_data_borrowed_) {
+        // The block must own heap storage, so arena-bound sets and views are copied into it.
+        if (!shared->set.Reinitialize(*this)) {
+            delete shared;
+            return false;
+        }
+    } else {
+        shared->set.MoveFrom(*this);
+    }
+    // Shared sets are read many times, which is what indexing pays off for.
+    if (!shared->set.has_index()) shared->set.BuildIndex();
+    shared->set.SerializedSizeOfElements();
+    shared->set.ContentHash();
+
+    FreeData();
+    AttachShared(shared);
+    return true;
+}
+
+void AuthorizationSet::AttachShared(SharedData* shared) {
+    shared->refs.fetch_add(1, std::memory_order_relaxed);
+    InvalidateCaches();
+    shared_ = shared;
+    elems_ = shared->set.elems_;
+    elems_size_ = shared->set.elems_size_;
+    elems_capacity_ = 0;
+    indirect_data_ = shared->set.indirect_data_;
+    indirect_data_size_ = shared->set.indirect_data_size_;
+    indirect_data_capacity_ = 0;
+    indirect_data_borrowed_ = false;
+    error_ = OK;
+    serialized_elements_size_ = shared->set.serialized_elements_size_;
+    content_hash_ = shared->set.content_hash_;
+    content_hash_known_ = shared->set.content_hash_known_;
+}
+
+AuthorizationSet::SharedData* AuthorizationSet::DetachShared() {
+    SharedData* shared = shared_;
+    shared_ = nullptr;
+    elems_ = nullptr;
+    elems_size_ = 0;
+    indirect_data_ = nullptr;
+    indirect_data_size_ = 0;
+    return shared;
+}
+
+/* static */
+void AuthorizationSet::Unref(SharedData* shared) {
+    if (shared->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) delete shared;
+}
+
+bool AuthorizationSet::Unshare() {
+    if (!shared_) return true;
+    SharedData* shared = DetachShared();
+    bool copied = Reinitialize(shared->set);
+    if (copied) {
+        content_hash_ = shared->set.content_hash_;
+        content_hash_known_ = shared->set.content_hash_known_;
+    }
+    Unref(shared);
+    return copied;
+}
+
 void AuthorizationSet::Clear() {
+    InvalidateCaches();
+    if (shared_) Unref(DetachShared());
     memset_s(elems_, 0, elems_capacity_ * sizeof(keymaster_key_param_t));
-    memset_s(indirect_data_, 0, indirect_data_capacity_);
+    if (!indirect_data_borrowed_) memset_s(indirect_data_, 0, indirect_data_capacity_);
     elems_size_ = 0;
     indirect_data_size_ = 0;
     error_ = OK;
@@ -506,11 +1406,12 @@ void AuthorizationSet::Clear() {
 void AuthorizationSet::FreeData() {
     Clear();
 
-    delete[] elems_;
-    delete[] indirect_data_;
+    DeleteArray(arena_, elems_);
+    if (!indirect_data_borrowed_) DeleteArray(arena_, indirect_data_);
 
     elems_ = nullptr;
     indirect_data_ = nullptr;
+    indirect_data_borrowed_ = false;
     elems_capacity_ = 0;
     indirect_data_capacity_ = 0;
     error_ = OK;
@@ -649,15 +1550,17 @@ bool AuthorizationSet::GetTagValueBool(keymaster_tag_t tag) const {
     return elems_[pos].boolean;
 }
 
+// Both walk only the elements with the tag, which in an indexed set are chained together, rather
+// than every element.
 bool AuthorizationSet::ContainsEnumValue(keymaster_tag_t tag, uint32_t value) const {
-    for (auto& entry : *this)
-        if (entry.tag == tag && entry.enumerated == value) return true;
+    for (int pos = -1; (pos = find(tag, pos)) != -1;)
+        if (elems_[pos].enumerated == value) return true;
     return false;
 }
 
 bool AuthorizationSet::ContainsIntValue(keymaster_tag_t tag, uint32_t value) const {
-    for (auto& entry : *this)
-        if (entry.tag == tag && entry.integer == value) return true;
+    for (int pos = -1; (pos = find(tag, pos)) != -1;)
+        if (elems_[pos].integer == value) return true;
     return false;
 }
 
@@ -0,0 +1,258 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/coalescing_secure_deletion_secret_storage.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <keymaster/logger.h>
+#include <keymaster/random_source.h>
+
+namespace keymaster {
+
+namespace {
+
+bool GenerateSecret(const RandomSource& random, size_t size, Buffer* secret) {
+    if (!secret->Reinitialize(size)) return false;
+    if (random.GenerateRandom(secret->peek_write(), size) != KM_ERROR_OK) return false;
+    return secret->advance_write(size);
+}
+
+}  // namespace
+
+CoalescingSecureDeletionSecretStorage::CoalescingSecureDeletionSecretStorage(
+    const RandomSource& random, SecureDeletionSlotStore& store)
+    : SecureDeletionSecretStorage(random), store_(store) {
+    thread_ = std::thread(&CoalescingSecureDeletionSecretStorage::Run, this);
+}
+
+CoalescingSecureDeletionSecretStorage::~CoalescingSecureDeletionSecretStorage() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+void CoalescingSecureDeletionSecretStorage::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wake_.wait(lock, [this] { return stopping_ || !queued_.empty(); });
+        if (queued_.empty()) return;
+
+        // Everything queued while the last commit was in progress goes into this one.
+        std::vector<std::shared_ptr<PendingWrite>> batch;
+        batch.swap(queued_);
+        uint64_t batch_number = next_batch_++;
+        committing_ = true;
+        std::vector<SecureDeletionSlotStore::SlotWrite> writes;
+        writes.reserve(batch.size());
+        for (const auto& write : batch) writes.push_back({write->key_slot, &write->secret});
+
+        lock.unlock();
+        bool committed = store_.Commit(nullptr /* factory_reset_secret */, writes.data(),
+                                       writes.size());
+        lock.lock();
+
+        if (!committed) LOG_E("Failed to commit %zu secure deletion slot writes", batch.size());
+        for (const auto& write : batch) {
+            bool erase = write->secret.available_read() == 0;
+            SlotState& state = slots_[write->key_slot - 1];
+            if (committed) {
+                state = erase ? SLOT_FREE : SLOT_IN_USE;
+            } else {
+                state = erase ? SLOT_IN_USE : SLOT_FREE;
+            }
+            write->committed = committed;
+            write->done = true;
+        }
+        committed_batch_ = batch_number;
+        committing_ = false;
+        committed_.notify_all();
+    }
+}
+
+bool CoalescingSecureDeletionSecretStorage::EnsureLoaded() const {
+    if (loaded_) return true;
+
+    Buffer factory_reset_secret;
+    std::vector<bool> occupied;
+    if (!store_.Load(&factory_reset_secret, &occupied)) return false;
+    if (factory_reset_secret.available_read() == 0) {
+        if (!GenerateSecret(random_, kFactoryResetSecretSize, &factory_reset_secret) ||
+            !store_.Commit(&factory_reset_secret, nullptr /* writes */, 0)) {
+            LOG_E("Failed to create the factory reset secret", 0);
+            return false;
+        }
+    }
+
+    uint32_t slot_count = store_.slot_count();
+    slots_.assign(slot_count, SLOT_FREE);
+    for (uint32_t i = 0; i < slot_count && i < occupied.size(); ++i) {
+        if (occupied[i]) slots_[i] = SLOT_IN_USE;
+    }
+    factory_reset_secret_ = std::move(factory_reset_secret);
+    next_slot_hint_ = 0;
+    loaded_ = true;
+    return true;
+}
+
+uint32_t CoalescingSecureDeletionSecretStorage::AllocateSlot(bool is_upgrade) const {
+    uint32_t slot_count = static_cast<uint32_t>(slots_.size());
+    uint32_t normal_count = slot_count - std::min(store_.upgrade_only_slot_count(), slot_count);
+
+    // Searching on from the last allocation avoids rescanning the slots filled before it.
+    for (uint32_t i = 0; i < normal_count; ++i) {
+        uint32_t index = (next_slot_hint_ + i) % normal_count;
+        if (slots_[index] != SLOT_FREE) continue;
+        slots_[index] = SLOT_WRITING;
+        next_slot_hint_ = index + 1;
+        return index + 1;
+    }
+
+    if (!is_upgrade) return 0;
+    for (uint32_t index = normal_count; index < slot_count; ++index) {
+        if (slots_[index] != SLOT_FREE) continue;
+        slots_[index] = SLOT_WRITING;
+        return index + 1;
+    }
+    return 0;
+}
+
+std::shared_ptr<CoalescingSecureDeletionSecretStorage::PendingWrite>
+CoalescingSecureDeletionSecretStorage::QueueWrite(uint32_t key_slot, Buffer secret) const {
+    std::shared_ptr<PendingWrite> write(new (std::nothrow) PendingWrite);
+    if (!write) return write;
+    write->key_slot = key_slot;
+    write->secret = std::move(secret);
+    queued_.push_back(write);
+    wake_.notify_one();
+    return write;
+}
+
+std::shared_ptr<CoalescingSecureDeletionSecretStorage::PendingWrite>
+CoalescingSecureDeletionSecretStorage::QueueErase(uint32_t key_slot) const {
+    if (key_slot == 0 || !EnsureLoaded() || key_slot > slots_.size()) return nullptr;
+    SlotState& state = slots_[key_slot - 1];
+    if (state != SLOT_IN_USE) return nullptr;
+
+    auto write = QueueWrite(key_slot, Buffer());
+    if (write) state = SLOT_ERASING;
+    return write;
+}
+
+std::optional<SecureDeletionData>
+CoalescingSecureDeletionSecretStorage::CreateDataForNewKey(bool secure_deletion,
+                                                           bool is_upgrade) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!EnsureLoaded()) return std::nullopt;
+
+    SecureDeletionData data;
+    if (!data.factory_reset_secret.Reinitialize(factory_reset_secret_)) return std::nullopt;
+    if (!secure_deletion) return data;
+
+    uint32_t key_slot = AllocateSlot(is_upgrade);
+    if (key_slot == 0) {
+        LOG_W("No secure deletion slots left", 0);
+        return data;
+    }
+
+    Buffer secret;
+    std::shared_ptr<PendingWrite> write;
+    if (!GenerateSecret(random_, kSecureDeletionSecretSize, &secret) ||
+        !data.secure_deletion_secret.Reinitialize(secret) ||
+        !(write = QueueWrite(key_slot, std::move(secret)))) {
+        slots_[key_slot - 1] = SLOT_FREE;
+        data.secure_deletion_secret.Clear();
+        return data;
+    }
+
+    // The key must not be returned before its secret is durable, or losing power could leave a
+    // key blob that can never be decrypted.
+    committed_.wait(lock, [&write] { return write->done; });
+    if (!write->committed) {
+        data.secure_deletion_secret.Clear();
+        return data;
+    }
+    data.key_slot = key_slot;
+    return data;
+}
+
+SecureDeletionData CoalescingSecureDeletionSecretStorage::GetDataForKey(uint32_t key_slot) const {
+    SecureDeletionData data;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!EnsureLoaded()) return data;
+
+    data.factory_reset_secret.Reinitialize(factory_reset_secret_);
+    if (key_slot == 0 || key_slot > slots_.size()) return data;
+    if (!store_.ReadSlot(key_slot, &data.secure_deletion_secret)) {
+        LOG_E("Failed to read secure deletion slot %u", key_slot);
+        data.secure_deletion_secret.Clear();
+        return data;
+    }
+    data.key_slot = key_slot;
+    return data;
+}
+
+void CoalescingSecureDeletionSecretStorage::DeleteKey(uint32_t key_slot) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto write = QueueErase(key_slot);
+    if (write) committed_.wait(lock, [&write] { return write->done; });
+}
+
+void CoalescingSecureDeletionSecretStorage::DeleteKeys(const uint32_t* key_slots,
+                                                       size_t count) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<std::shared_ptr<PendingWrite>> writes;
+    writes.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        auto write = QueueErase(key_slots[i]);
+        if (write) writes.push_back(std::move(write));
+    }
+    for (const auto& write : writes) {
+        committed_.wait(lock, [&write] { return write->done; });
+    }
+}
+
+void CoalescingSecureDeletionSecretStorage::DeleteKeyAsync(uint32_t key_slot) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    QueueErase(key_slot);
+}
+
+void CoalescingSecureDeletionSecretStorage::DeleteAllKeys() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    committed_.wait(lock, [this] { return queued_.empty() && !committing_; });
+    store_.Erase();
+    factory_reset_secret_.Clear();
+    slots_.clear();
+    loaded_ = false;
+}
+
+void CoalescingSecureDeletionSecretStorage::Flush() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // With nothing queued, only the commit in progress, if any, has to finish.
+    uint64_t batch = queued_.empty() ? next_batch_ - 1 : next_batch_;
+    committed_.wait(lock, [this, batch] { return committed_batch_ >= batch; });
+}
+
+size_t CoalescingSecureDeletionSecretStorage::queued_writes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_.size();
+}
+
+}  // namespace keymaster
@@ -0,0 +1,173 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/coalescing_secure_key_storage.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+CoalescingSecureKeyStorage::CoalescingSecureKeyStorage(SecureKeyStorage& store, size_t max_batch)
+    : store_(store), max_batch_(std::max<size_t>(max_batch, 1)) {
+    thread_ = std::thread(&CoalescingSecureKeyStorage::Run, this);
+}
+
+CoalescingSecureKeyStorage::~CoalescingSecureKeyStorage() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+void CoalescingSecureKeyStorage::Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wake_.wait(lock, [this] { return stopping_ || !queued_.empty(); });
+        if (queued_.empty()) return;
+
+        // Everything queued while the last commit was in progress goes into this one, up to
+        // max_batch_ deletions.
+        size_t batch_size = std::min(queued_.size(), max_batch_);
+        std::vector<std::shared_ptr<PendingDelete>> batch(queued_.begin(),
+                                                          queued_.begin() + batch_size);
+        queued_.erase(queued_.begin(), queued_.begin() + batch_size);
+        committing_ = true;
+        std::vector<km_id_t> keyids;
+        keyids.reserve(batch.size());
+        for (const auto& pending : batch) keyids.push_back(pending->keyid);
+
+        lock.unlock();
+        keymaster_error_t error;
+        {
+            std::lock_guard<std::mutex> store_lock(store_mutex_);
+            error = store_.DeleteKeys(keyids.data(), keyids.size());
+        }
+        lock.lock();
+
+        if (error != KM_ERROR_OK) {
+            LOG_E("Failed to delete %zu keys from secure key storage: %d", batch.size(), error);
+        }
+        for (const auto& pending : batch) {
+            // A key that may still be in storage stays retired, so it can't be used again.
+            if (error == KM_ERROR_OK) retired_.erase(pending->keyid);
+            pending->error = error;
+            pending->done = true;
+        }
+        committing_ = false;
+        committed_.notify_all();
+    }
+}
+
+std::shared_ptr<CoalescingSecureKeyStorage::PendingDelete>
+CoalescingSecureKeyStorage::QueueDelete(km_id_t keyid) {
+    std::shared_ptr<PendingDelete> pending(new (std::nothrow) PendingDelete);
+    if (!pending) return pending;
+    pending->keyid = keyid;
+    queued_.push_back(pending);
+    retired_.insert(keyid);
+    wake_.notify_one();
+    return pending;
+}
+
+keymaster_error_t CoalescingSecureKeyStorage::WriteKey(const km_id_t keyid,
+                                                       const KeymasterKeyBlob& blob) {
+    // A deletion queued before the write mustn't be applied after it.
+    Flush();
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::lock_guard<std::mutex> store_lock(store_mutex_);
+    keymaster_error_t error = store_.WriteKey(keyid, blob);
+    if (error == KM_ERROR_OK) retired_.erase(keyid);
+    return error;
+}
+
+keymaster_error_t CoalescingSecureKeyStorage::KeyExists(const km_id_t keyid, bool* exists) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (retired_.count(keyid)) {
+            *exists = false;
+            return KM_ERROR_OK;
+        }
+    }
+    // A deletion queued now only makes the answer stale the way a later DeleteKey() would.
+    std::lock_guard<std::mutex> store_lock(store_mutex_);
+    return store_.KeyExists(keyid, exists);
+}
+
+keymaster_error_t CoalescingSecureKeyStorage::DeleteKey(const km_id_t keyid) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto pending = QueueDelete(keyid);
+    if (!pending) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    committed_.wait(lock, [&pending] { return pending->done; });
+    return pending->error;
+}
+
+keymaster_error_t CoalescingSecureKeyStorage::DeleteKeys(const km_id_t* keyids, size_t count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    std::vector<std::shared_ptr<PendingDelete>> pending;
+    pending.reserve(count);
+    keymaster_error_t first_error = KM_ERROR_OK;
+    for (size_t i = 0; i < count; ++i) {
+        auto queued = QueueDelete(keyids[i]);
+        if (queued) {
+            pending.push_back(std::move(queued));
+        } else if (first_error == KM_ERROR_OK) {
+            first_error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+    }
+    for (const auto& queued : pending) {
+        committed_.wait(lock, [&queued] { return queued->done; });
+        if (first_error == KM_ERROR_OK) first_error = queued->error;
+    }
+    return first_error;
+}
+
+keymaster_error_t CoalescingSecureKeyStorage::DeleteKeyAsync(km_id_t keyid) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return QueueDelete(keyid) ? KM_ERROR_OK : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+}
+
+keymaster_error_t CoalescingSecureKeyStorage::DeleteAllKeys() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    committed_.wait(lock, [this] { return queued_.empty() && !committing_; });
+    std::lock_guard<std::mutex> store_lock(store_mutex_);
+    keymaster_error_t error = store_.DeleteAllKeys();
+    if (error == KM_ERROR_OK) retired_.clear();
+    return error;
+}
+
+keymaster_error_t CoalescingSecureKeyStorage::HasSlot(bool* has_slot) {
+    // Slots held by queued deletions only count as free once the deletions are committed.
+    std::lock_guard<std::mutex> store_lock(store_mutex_);
+    return store_.HasSlot(has_slot);
+}
+
+void CoalescingSecureKeyStorage::Flush() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    committed_.wait(lock, [this] { return queued_.empty() && !committing_; });
+}
+
+size_t CoalescingSecureKeyStorage::queued_deletes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_.size();
+}
+
+}  // namespace keymaster
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/concurrent_android_keymaster.h>
+
+#include <thread>
+#include <utility>
+
+#include <keymaster/sharded_operation_table.h>
+#include <keymaster/worker_pool.h>
+
+namespace keymaster {
+
+namespace {
+
+size_t ShardCount() {
+    size_t cores = std::thread::hardware_concurrency();
+    return cores ? cores : 1;
+}
+
+}  // namespace
+
+ConcurrentAndroidKeymaster::ConcurrentAndroidKeymaster(KeymasterContext* context,
+                                                       size_t operation_table_size,
+                                                       int32_t message_version,
+                                                       size_t async_workers)
+    : AndroidKeymaster(context,
+                       UniquePtr<OperationTable>(new (std::nothrow) ShardedOperationTable(
+                           operation_table_size, ShardCount())),
+                       message_version),
+      async_worker_count_(async_workers ? async_workers : 1) {}
+
+size_t ConcurrentAndroidKeymaster::ParallelWorkerCount() const {
+    return ShardCount();
+}
+
+ConcurrentAndroidKeymaster::~ConcurrentAndroidKeymaster() {
+    {
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        stopping_ = true;
+    }
+    async_wake_.notify_all();
+    for (auto& worker : async_workers_) worker.join();
+
+    // The context, which owns the pool, is destroyed by the base class destructor, after this.
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    async_idle_.wait(lock, [this] { return async_drainers_ == 0; });
+}
+
+ConcurrentAndroidKeymaster::AsyncTicket
+ConcurrentAndroidKeymaster::GenerateKeyAsync(std::unique_ptr<GenerateKeyRequest> request,
+                                             AsyncCallback<GenerateKeyResponse> callback) {
+    return SubmitAsync(std::move(request), &AndroidKeymaster::GenerateKey, std::move(callback),
+                       &generate_key_results_);
+}
+
+ConcurrentAndroidKeymaster::AsyncTicket
+ConcurrentAndroidKeymaster::ImportKeyAsync(std::unique_ptr<ImportKeyRequest> request,
+                                           AsyncCallback<ImportKeyResponse> callback) {
+    return SubmitAsync(std::move(request), &AndroidKeymaster::ImportKey, std::move(callback),
+                       &import_key_results_);
+}
+
+ConcurrentAndroidKeymaster::AsyncTicket
+ConcurrentAndroidKeymaster::UpgradeKeysAsync(std::unique_ptr<UpgradeKeysRequest> request,
+                                             AsyncCallback<UpgradeKeysResponse> callback) {
+    return SubmitAsync(std::move(request), &AndroidKeymaster::UpgradeKeys, std::move(callback),
+                       &upgrade_keys_results_);
+}
+
+ConcurrentAndroidKeymaster::AsyncTicket
+ConcurrentAndroidKeymaster::PrepareKeyAsync(std::unique_ptr<PrepareKeyRequest> request,
+                                            AsyncCallback<PrepareKeyResponse> callback) {
+    if (!callback) callback = [](AsyncTicket, std::unique_ptr<PrepareKeyResponse>) {};
+    // With a callback the results map is never touched.
+    return SubmitAsync(std::move(request), &AndroidKeymaster::PrepareKey, std::move(callback),
+                       static_cast<AsyncResults<PrepareKeyResponse>*>(nullptr));
+}
+
+ConcurrentAndroidKeymaster::AsyncStatus
+ConcurrentAndroidKeymaster::PollGenerateKey(AsyncTicket ticket,
+                                            std::unique_ptr<GenerateKeyResponse>* response) {
+    return PollAsync(ticket, &generate_key_results_, response);
+}
+
+ConcurrentAndroidKeymaster::AsyncStatus
+ConcurrentAndroidKeymaster::PollImportKey(AsyncTicket ticket,
+                                          std::unique_ptr<ImportKeyResponse>* response) {
+    return PollAsync(ticket, &import_key_results_, response);
+}
+
+ConcurrentAndroidKeymaster::AsyncStatus
+ConcurrentAndroidKeymaster::PollUpgradeKeys(AsyncTicket ticket,
+                                            std::unique_ptr<UpgradeKeysResponse>* response) {
+    return PollAsync(ticket, &upgrade_keys_results_, response);
+}
+
+template <typename Request, typename Response>
+ConcurrentAndroidKeymaster::AsyncTicket ConcurrentAndroidKeymaster::SubmitAsync(
+    std::unique_ptr<Request> request, void (AndroidKeymaster::*method)(const Request&, Response*),
+    AsyncCallback<Response> callback, AsyncResults<Response>* results) {
+    if (!request) return 0;
+
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    AsyncTicket ticket = next_ticket_++;
+    if (!callback) results->emplace(ticket, nullptr);
+
+    // std::function must be copyable, so the request is held by a shared_ptr.
+    std::shared_ptr<Request> shared_request(std::move(request));
+    async_jobs_.push_back([this, ticket, shared_request, method, callback, results]() {
+        auto response = std::make_unique<Response>(message_version());
+        (this->*method)(*shared_request, response.get());
+        if (callback) {
+            callback(ticket, std::move(response));
+            return;
+        }
+        std::lock_guard<std::mutex> lock(async_mutex_);
+        (*results)[ticket] = std::move(response);
+    });
+
+    WorkerPool* pool = worker_pool();
+    if (pool && async_workers_.empty() && async_drainers_ < async_worker_count_) {
+        ++async_drainers_;
+        if (!pool->Submit([this] { DrainAsyncJobs(); })) --async_drainers_;
+    }
+    if (async_workers_.empty() && async_drainers_ == 0) {
+        for (size_t i = 0; i < async_worker_count_; ++i) {
+            async_workers_.emplace_back(&ConcurrentAndroidKeymaster::RunAsyncWorker, this);
+        }
+    }
+    lock.unlock();
+    async_wake_.notify_one();
+    return ticket;
+}
+
+template <typename Response>
+ConcurrentAndroidKeymaster::AsyncStatus
+ConcurrentAndroidKeymaster::PollAsync(AsyncTicket ticket, AsyncResults<Response>* results,
+                                      std::unique_ptr<Response>* response) {
+    std::lock_guard<std::mutex> lock(async_mutex_);
+    auto entry = results->find(ticket);
+    if (entry == results->end()) return AsyncStatus::UNKNOWN;
+    if (!entry->second) return AsyncStatus::PENDING;
+    *response = std::move(entry->second);
+    results->erase(entry);
+    return AsyncStatus::COMPLETE;
+}
+
+void ConcurrentAndroidKeymaster::DrainAsyncJobs() {
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    while (!async_jobs_.empty()) {
+        std::function<void()> job = std::move(async_jobs_.front());
+        async_jobs_.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+    if (--async_drainers_ == 0) async_idle_.notify_all();
+}
+
+void ConcurrentAndroidKeymaster::RunAsyncWorker() {
+    std::unique_lock<std::mutex> lock(async_mutex_);
+    while (true) {
+        async_wake_.wait(lock, [this] { return stopping_ || !async_jobs_.empty(); });
+        // Queued calls are completed even when stopping, so every callback runs.
+        if (async_jobs_.empty()) return;
+        std::function<void()> job = std::move(async_jobs_.front());
+        async_jobs_.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+}  // namespace keymaster
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/constant_time.h>
+
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+namespace keymaster {
+
+namespace {
+
+// Hides |value| from the optimizer, so it can't turn the accumulation below back into a loop that
+// stops at the first difference.
+inline uint64_t ValueBarrier(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    __asm__("" : "+r"(value));
+#endif
+    return value;
+}
+
+inline uint64_t LoadWord(const uint8_t* p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+}  // namespace
+
+bool ConstantTimeEquals(const void* a, const void* b, size_t length) {
+    const uint8_t* pa = static_cast<const uint8_t*>(a);
+    const uint8_t* pb = static_cast<const uint8_t*>(b);
+    uint64_t diff = 0;
+
+#if defined(__SSE2__)
+    __m128i vdiff = _mm_setzero_si128();
+    for (; length >= 16; length -= 16, pa += 16, pb += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pa));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb));
+        vdiff = _mm_or_si128(vdiff, _mm_xor_si128(va, vb));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), vdiff);
+    diff = lanes[0] | lanes[1];
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x16_t vdiff = vdupq_n_u8(0);
+    for (; length >= 16; length -= 16, pa += 16, pb += 16) {
+        vdiff = vorrq_u8(vdiff, veorq_u8(vld1q_u8(pa), vld1q_u8(pb)));
+    }
+    uint64x2_t lanes = vreinterpretq_u64_u8(vdiff);
+    diff = vgetq_lane_u64(lanes, 0) | vgetq_lane_u64(lanes, 1);
+#endif
+
+    for (; length >= sizeof(uint64_t);
+         length -= sizeof(uint64_t), pa += sizeof(uint64_t), pb += sizeof(uint64_t)) {
+        diff |= LoadWord(pa) ^ LoadWord(pb);
+    }
+    for (; length > 0; --length) {
+        diff |= *pa++ ^ *pb++;
+    }
+    return ValueBarrier(diff) == 0;
+}
+
+const char* ConstantTimeEqualsKernel() {
+#if defined(__SSE2__)
+    return "sse2";
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return "neon";
+#else
+    return "generic";
+#endif
+}
+
+}  // namespace keymaster
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/key_usage_stats.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+KeyUsageStats::KeyUsageStats(size_t capacity, uint32_t sample_interval)
+    : capacity_(capacity ? capacity : 1), sample_interval_(sample_interval ? sample_interval : 1) {
+    keys_.reserve(capacity_);
+}
+
+uint64_t KeyUsageStats::now_ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void KeyUsageStats::Record(km_id_t key_id, bool is_begin, keymaster_error_t error,
+                           uint64_t duration_ns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto usage = std::find_if(keys_.begin(), keys_.end(),
+                              [&](const KeyUsage& usage) { return usage.key_id == key_id; });
+    if (usage == keys_.end()) {
+        if (keys_.size() < capacity_) {
+            keys_.push_back({key_id, 0, 0, 0, 0, 0});
+            usage = keys_.end() - 1;
+        } else {
+            usage = std::min_element(
+                keys_.begin(), keys_.end(),
+                [](const KeyUsage& a, const KeyUsage& b) { return a.calls < b.calls; });
+            *usage = {key_id, 0, usage->calls, 0, 0, usage->calls};
+        }
+    }
+    if (is_begin) ++usage->begins;
+    ++usage->calls;
+    if (error != KM_ERROR_OK) ++usage->errors;
+    usage->total_ns += duration_ns;
+}
+
+void KeyUsageStats::GetHotKeys(size_t max_keys, std::vector<KeyUsage>* keys) const {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        *keys = keys_;
+    }
+    std::sort(keys->begin(), keys->end(),
+              [](const KeyUsage& a, const KeyUsage& b) { return a.calls > b.calls; });
+    if (keys->size() > max_keys) keys->resize(max_keys);
+    for (auto& usage : *keys) {
+        usage.begins *= sample_interval_;
+        usage.calls *= sample_interval_;
+        usage.errors *= sample_interval_;
+        usage.total_ns *= sample_interval_;
+        usage.overcount *= sample_interval_;
+    }
+}
+
+void KeyUsageStats::LogSummary(size_t max_keys) const {
+    std::vector<KeyUsage> keys;
+    GetHotKeys(max_keys, &keys);
+    for (const auto& usage : keys) {
+        // Inherited calls weren't timed.
+        uint64_t timed_calls = usage.calls - usage.overcount;
+        Logger::Info("key %016llx: begins %llu calls %llu (%llu inherited) errors %llu mean %lluns",
+                     static_cast<unsigned long long>(usage.key_id),
+                     static_cast<unsigned long long>(usage.begins),
+                     static_cast<unsigned long long>(usage.calls),
+                     static_cast<unsigned long long>(usage.overcount),
+                     static_cast<unsigned long long>(usage.errors),
+                     static_cast<unsigned long long>(timed_calls ? usage.total_ns / timed_calls
+                                                                 : 0));
+    }
+}
+
+void KeyUsageStats::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    keys_.clear();
+}
+
+}  // namespace keymaster
@@ -16,10 +16,11 @@
 
 #include <keymaster/keymaster_configuration.h>
 
-#include <regex>
+#include <array>
+#include <chrono>
+#include <future>
 #include <string>
-
-#include <regex.h>
+#include <string_view>
 
 #define LOG_TAG "keymaster"
 
@@ -34,82 +35,149 @@ namespace keymaster {
 namespace {
 
 constexpr char kPlatformVersionProp[] = "ro.build.version.release";
-constexpr char kPlatformVersionRegex[] = "^([0-9]{1,2})(\\.([0-9]{1,2}))?(\\.([0-9]{1,2}))?";
-constexpr size_t kMajorVersionMatch = 1;
-constexpr size_t kMinorVersionMatch = 3;
-constexpr size_t kSubminorVersionMatch = 5;
-constexpr size_t kPlatformVersionMatchCount = kSubminorVersionMatch + 1;
-
 constexpr char kPlatformPatchlevelProp[] = "ro.build.version.security_patch";
 constexpr char kVendorPatchlevelProp[] = "ro.vendor.build.security_patch";
-constexpr char kPatchlevelRegex[] = "^([0-9]{4})-([0-9]{2})-([0-9]{2})$";
 constexpr char kVerifiedBootStateProp[] = "ro.boot.verifiedbootstate";
 constexpr char kVbmetaDeviceStateProp[] = "ro.boot.vbmeta.device_state";
 constexpr char kVbmetaDigestProp[] = "ro.boot.vbmeta.digest";
-constexpr size_t kYearMatch = 1;
-constexpr size_t kMonthMatch = 2;
-constexpr size_t kDayMatch = 3;
-constexpr size_t kPatchlevelMatchCount = kDayMatch + 1;
 
-uint32_t match_to_uint32(const char* expression, const regmatch_t& match) {
-    if (match.rm_so == -1) return 0;
+#ifndef KEYMASTER_UNIT_TEST_BUILD
+// How long to wait for build properties before complaining, and then between complaints.
+constexpr std::chrono::milliseconds kPropertyWaitLogInterval(15000);
+#endif
 
-    size_t len = match.rm_eo - match.rm_so;
-    std::string s(expression + match.rm_so, len);
-    return std::stoul(s);
+// Parses between |min_digits| and |max_digits| decimal digits starting at |*pos|, advancing |*pos|
+// past them.  Stops early at the first non-digit.
+constexpr std::optional<uint32_t> parse_digits(std::string_view str, size_t* pos,
+                                               size_t min_digits, size_t max_digits) {
+    uint32_t value = 0;
+    size_t count = 0;
+    while (count < max_digits && *pos + count < str.size() && str[*pos + count] >= '0' &&
+           str[*pos + count] <= '9') {
+        value = value * 10 + (str[*pos + count] - '0');
+        ++count;
+    }
+    if (count < min_digits) return std::nullopt;
+    *pos += count;
+    return value;
 }
 
-std::string wait_and_get_property(const char* prop) {
-    std::string prop_value;
+// Accepts what "^([0-9]{1,2})(\.([0-9]{1,2}))?(\.([0-9]{1,2}))?" matches, ignoring the rest.
+constexpr std::optional<uint32_t> parse_os_version(std::string_view str) {
+    size_t pos = 0;
+    std::optional<uint32_t> major = parse_digits(str, &pos, 1, 2);
+    if (!major) return std::nullopt;
+
+    uint32_t minor_parts[2] = {0, 0};
+    for (uint32_t& part : minor_parts) {
+        if (pos >= str.size() || str[pos] != '.') break;
+        size_t digits_pos = pos + 1;
+        std::optional<uint32_t> value = parse_digits(str, &digits_pos, 1, 2);
+        if (!value) break;
+        part = *value;
+        pos = digits_pos;
+    }
+    return (*major * 100 + minor_parts[0]) * 100 + minor_parts[1];
+}
+
+struct PatchlevelDate {
+    uint32_t year;
+    uint32_t month;
+    uint32_t day;
+};
+
+// Accepts exactly what "^([0-9]{4})-([0-9]{2})-([0-9]{2})$" matches.
+constexpr std::optional<PatchlevelDate> parse_patchlevel(std::string_view str) {
+    if (str.size() != 10 || str[4] != '-' || str[7] != '-') return std::nullopt;
+    size_t year_pos = 0, month_pos = 5, day_pos = 8;
+    std::optional<uint32_t> year = parse_digits(str, &year_pos, 4, 4);
+    std::optional<uint32_t> month = parse_digits(str, &month_pos, 2, 2);
+    std::optional<uint32_t> day = parse_digits(str, &day_pos, 2, 2);
+    if (!year || !month || !day) return std::nullopt;
+    return PatchlevelDate{*year, *month, *day};
+}
+
+static_assert(*parse_os_version("6.1.2-extrajunk") == 60102);
+static_assert(*parse_os_version("681.23") == 680000);
+static_assert(!parse_os_version("extra6.1.2"));
+static_assert(parse_patchlevel("2016-03-25")->month == 3);
+static_assert(!parse_patchlevel("2016-03-25r"));
+
+// Waits for all of |props| to be created, then returns their values in the same order.  The
+// waits run concurrently against one deadline, so the total wait is that of the slowest property.
+template <size_t N> std::array<std::string, N> wait_and_get_properties(const char* (&props)[N]) {
+    std::array<std::string, N> values;
 #ifndef KEYMASTER_UNIT_TEST_BUILD
-    while (!android::base::WaitForPropertyCreation(prop)) {
-        SLOGE("waited 15s for %s, still waiting...", prop);
+    auto wait_for = [](const char* prop, std::chrono::steady_clock::time_point deadline) {
+        for (;;) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (remaining.count() < 0) remaining = std::chrono::milliseconds(0);
+            if (android::base::WaitForPropertyCreation(prop, remaining)) break;
+            SLOGE("waited for %s past its deadline, still waiting...", prop);
+            deadline = std::chrono::steady_clock::now() + kPropertyWaitLogInterval;
+        }
+        return android::base::GetProperty(prop, "" /* default */);
+    };
+
+    auto deadline = std::chrono::steady_clock::now() + kPropertyWaitLogInterval;
+    std::future<std::string> pending[N];
+    for (size_t i = 1; i < N; ++i) {
+        pending[i] = std::async(std::launch::async, wait_for, props[i], deadline);
     }
-    prop_value = android::base::GetProperty(prop, "" /* default */);
+    values[0] = wait_for(props[0], deadline);
+    for (size_t i = 1; i < N; ++i) values[i] = pending[i].get();
+#else
+    (void)props;
 #endif
-    return prop_value;
+    return values;
 }
 
 enum class PatchlevelOutput { kYearMonthDay, kYearMonth };
 
 uint32_t GetPatchlevel(const char* patchlevel_str, PatchlevelOutput detail) {
-    regex_t regex;
-    if (regcomp(&regex, kPatchlevelRegex, REG_EXTENDED) != 0) {
-        ALOGE("Failed to compile platform patchlevel regex! (%s)", kPatchlevelRegex);
-        return 0;
-    }
-
-    regmatch_t matches[kPatchlevelMatchCount];
-    int not_match = regexec(&regex, patchlevel_str, kPatchlevelMatchCount, matches, 0 /* flags */);
-    regfree(&regex);
-    if (not_match) {
+    std::optional<PatchlevelDate> date = parse_patchlevel(patchlevel_str);
+    if (!date) {
         ALOGI(" patchlevel string does not match expected format.  Using patchlevel 0");
         return 0;
     }
 
-    uint32_t year = match_to_uint32(patchlevel_str, matches[kYearMatch]);
-    uint32_t month = match_to_uint32(patchlevel_str, matches[kMonthMatch]);
-
-    if (month < 1 || month > 12) {
-        ALOGE("Invalid patch month %d", month);
+    if (date->month < 1 || date->month > 12) {
+        ALOGE("Invalid patch month %d", date->month);
         return 0;
     }
 
     switch (detail) {
-    case PatchlevelOutput::kYearMonthDay: {
-        uint32_t day = match_to_uint32(patchlevel_str, matches[kDayMatch]);
-        if (day < 1 || day > 31) {
-            ALOGE("Invalid patch day %d", day);
+    case PatchlevelOutput::kYearMonthDay:
+        if (date->day < 1 || date->day > 31) {
+            ALOGE("Invalid patch day %d", date->day);
             return 0;
         }
-        return year * 10000 + month * 100 + day;
-    }
+        return date->year * 10000 + date->month * 100 + date->day;
     case PatchlevelOutput::kYearMonth:
-        return year * 100 + month;
+        return date->year * 100 + date->month;
     }
     return 0;
 }
 
+// The build properties can't change while the process runs, so they're read and parsed once.  The
+// OS version and patchlevel are always wanted together and are fetched together; the vendor
+// patchlevel may need an SELinux permission that not every caller has, so it's fetched on its own.
+struct PlatformVersion {
+    uint32_t os_version;
+    uint32_t os_patchlevel;
+};
+
+const PlatformVersion& platform_version() {
+    static const PlatformVersion version = [] {
+        const char* props[] = {kPlatformVersionProp, kPlatformPatchlevelProp};
+        std::array<std::string, 2> values = wait_and_get_properties(props);
+        return PlatformVersion{GetOsVersion(values[0].c_str()),
+                               GetOsPatchlevel(values[1].c_str())};
+    }();
+    return version;
+}
+
 }  // anonymous namespace
 
 keymaster_error_t ConfigureDevice(keymaster2_device_t* dev, uint32_t os_version,
@@ -125,32 +193,17 @@ keymaster_error_t ConfigureDevice(keymaster2_device_t* dev) {
 }
 
 uint32_t GetOsVersion(const char* version_str) {
-    regex_t regex;
-    if (regcomp(&regex, kPlatformVersionRegex, REG_EXTENDED)) {
-        ALOGE("Failed to compile version regex! (%s)", kPlatformVersionRegex);
-        return 0;
-    }
-
-    regmatch_t matches[kPlatformVersionMatchCount];
-    int not_match =
-        regexec(&regex, version_str, kPlatformVersionMatchCount, matches, 0 /* flags */);
-    regfree(&regex);
-    if (not_match) {
+    std::optional<uint32_t> version = parse_os_version(version_str);
+    if (!version) {
         ALOGI("Platform version string \"%s\" does not match expected format.  Using version 0.",
               version_str);
         return 0;
     }
-
-    uint32_t major = match_to_uint32(version_str, matches[kMajorVersionMatch]);
-    uint32_t minor = match_to_uint32(version_str, matches[kMinorVersionMatch]);
-    uint32_t subminor = match_to_uint32(version_str, matches[kSubminorVersionMatch]);
-
-    return (major * 100 + minor) * 100 + subminor;
+    return *version;
 }
 
 uint32_t GetOsVersion() {
-    std::string version = wait_and_get_property(kPlatformVersionProp);
-    return GetOsVersion(version.c_str());
+    return platform_version().os_version;
 }
 
 uint32_t GetOsPatchlevel(const char* patchlevel_str) {
@@ -158,13 +211,16 @@ uint32_t GetOsPatchlevel(const char* patchlevel_str) {
 }
 
 uint32_t GetOsPatchlevel() {
-    std::string patchlevel = wait_and_get_property(kPlatformPatchlevelProp);
-    return GetOsPatchlevel(patchlevel.c_str());
+    return platform_version().os_patchlevel;
 }
 
 uint32_t GetVendorPatchlevel() {
-    std::string patchlevel = wait_and_get_property(kVendorPatchlevelProp);
-    return GetPatchlevel(patchlevel.c_str(), PatchlevelOutput::kYearMonthDay);
+    static const uint32_t vendor_patchlevel = [] {
+        const char* props[] = {kVendorPatchlevelProp};
+        std::array<std::string, 1> values = wait_and_get_properties(props);
+        return GetPatchlevel(values[0].c_str(), PatchlevelOutput::kYearMonthDay);
+    }();
+    return vendor_patchlevel;
 }
 
 std::string GetVerifiedBootState() {
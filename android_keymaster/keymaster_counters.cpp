@@ -0,0 +1,58 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/keymaster_counters.h>
+
+#include <chrono>
+
+namespace keymaster {
+
+/* static */
+uint64_t KeymasterCounters::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+KeymasterCounters::Totals KeymasterCounters::command(uint32_t command) const {
+    return command < kCommandCount ? commands_[command].Read() : Totals();
+}
+
+KeymasterCounters::Totals KeymasterCounters::phase(OperationPhase phase) const {
+    size_t index = static_cast<size_t>(phase);
+    return index < kOperationPhaseCount ? phases_[index].Read() : Totals();
+}
+
+void KeymasterCounters::Reset() {
+    for (auto& counter : commands_) counter.Reset();
+    for (auto& counter : phases_) counter.Reset();
+}
+
+KeymasterCounters::Totals KeymasterCounters::Counter::Read() const {
+    Totals totals;
+    totals.calls = calls.load(std::memory_order_relaxed);
+    totals.errors = errors.load(std::memory_order_relaxed);
+    totals.total_ns = total_ns.load(std::memory_order_relaxed);
+    return totals;
+}
+
+void KeymasterCounters::Counter::Reset() {
+    calls.store(0, std::memory_order_relaxed);
+    errors.store(0, std::memory_order_relaxed);
+    total_ns.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace keymaster
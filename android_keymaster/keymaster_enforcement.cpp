@@ -23,15 +23,122 @@
 #include <openssl/evp.h>
 
 #include <hardware/hw_auth_token.h>
-#include <keymaster/List.h>
+#include <keymaster/UniquePtr.h>
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/key_policy.h>
 #include <keymaster/logger.h>
+#include <keymaster/trace.h>
 
 namespace keymaster {
 
+namespace {
+
+/**
+ * Fixed-capacity hash map from key IDs to |Value|s, using linear probing with backward-shift
+ * deletion.  The slots are allocated once, in the constructor, with room for twice the maximum
+ * number of entries so that probe sequences stay short.
+ */
+template <typename Value> class KeyIdMap {
+  public:
+    explicit KeyIdMap(uint32_t max_size) : max_size_(max_size) {
+        size_t capacity = 2;
+        while (capacity < 2 * static_cast<size_t>(max_size)) capacity *= 2;
+        slots_.reset(new (std::nothrow) Slot[capacity]);
+        if (slots_) mask_ = capacity - 1;
+    }
+
+    bool is_valid() const { return slots_.get() != nullptr; }
+    size_t size() const { return size_; }
+    size_t capacity() const { return slots_ ? mask_ + 1 : 0; }
+
+    Value* Find(km_id_t keyid) const {
+        for (size_t i = Home(keyid);; i = (i + 1) & mask_) {
+            Slot& slot = slots_[i];
+            if (!slot.used) return nullptr;
+            if (slot.keyid == keyid) return &slot.value;
+        }
+    }
+
+    // Adds a default-constructed value for |keyid|, which must not be present.  Returns null if the
+    // map holds its maximum number of entries.
+    Value* Insert(km_id_t keyid) {
+        if (size_ >= max_size_) return nullptr;
+        size_t i = Home(keyid);
+        while (slots_[i].used) i = (i + 1) & mask_;
+        slots_[i].used = true;
+        slots_[i].keyid = keyid;
+        slots_[i].value = Value();
+        ++size_;
+        return &slots_[i].value;
+    }
+
+    // Erases the entries in up to |count| slots, starting where the previous call stopped, for
+    // which |expired| returns true.
+    template <typename Predicate> void Sweep(size_t count, Predicate expired) {
+        if (count > capacity()) count = capacity();
+        for (size_t n = 0; n < count && size_; ++n) {
+            size_t i = sweep_cursor_;
+            // Erasing shifts a later entry into slot i, so only move on once it's been kept.
+            if (slots_[i].used && expired(slots_[i].value)) {
+                Erase(i);
+            } else {
+                sweep_cursor_ = (i + 1) & mask_;
+            }
+        }
+    }
+
+    template <typename Predicate> void SweepAll(Predicate expired) {
+        for (size_t i = 0; i <= mask_ && size_;) {
+            if (slots_[i].used && expired(slots_[i].value)) {
+                Erase(i);
+            } else {
+                ++i;
+            }
+        }
+    }
+
+  private:
+    struct Slot {
+        km_id_t keyid = 0;
+        Value value = {};
+        bool used = false;
+    };
+
+    size_t Home(km_id_t keyid) const {
+        return static_cast<size_t>((keyid * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+    }
+
+    void Erase(size_t hole) {
+        slots_[hole].used = false;
+        --size_;
+        // Pull back any following entry whose probe sequence passes through the hole.
+        for (size_t i = (hole + 1) & mask_; slots_[i].used; i = (i + 1) & mask_) {
+            size_t home = Home(slots_[i].keyid);
+            if (((i - home) & mask_) >= ((i - hole) & mask_)) {
+                slots_[hole] = slots_[i];
+                slots_[i].used = false;
+                hole = i;
+            }
+        }
+    }
+
+    UniquePtr<Slot[]> slots_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+    size_t sweep_cursor_ = 0;
+    const uint32_t max_size_;
+};
+
+// Number of slots examined for expired entries each time a new rate-limited key is recorded.
+constexpr size_t kAccessTimeSweepSlots = 4;
+
+}  // namespace
+
 class AccessTimeMap {
   public:
-    explicit AccessTimeMap(uint32_t max_size) : max_size_(max_size) {}
+    explicit AccessTimeMap(uint32_t max_size) : map_(max_size) {}
+
+    bool is_valid() const { return map_.is_valid(); }
 
     /* If the key is found, returns true and fills \p last_access_time.  If not found returns
      * false. */
@@ -43,17 +150,17 @@ class AccessTimeMap {
 
   private:
     struct AccessTime {
-        km_id_t keyid;
         uint32_t access_time;
         uint32_t timeout;
     };
-    List<AccessTime> last_access_list_;
-    const uint32_t max_size_;
+    KeyIdMap<AccessTime> map_;
 };
 
 class AccessCountMap {
   public:
-    explicit AccessCountMap(uint32_t max_size) : max_size_(max_size) {}
+    explicit AccessCountMap(uint32_t max_size) : map_(max_size) {}
+
+    bool is_valid() const { return map_.is_valid(); }
 
     /* If the key is found, returns true and fills \p count.  If not found returns
      * false. */
@@ -65,11 +172,9 @@ class AccessCountMap {
 
   private:
     struct AccessCount {
-        km_id_t keyid;
         uint64_t access_count;
     };
-    List<AccessCount> access_count_list_;
-    const uint32_t max_size_;
+    KeyIdMap<AccessCount> map_;
 };
 
 bool is_public_key_algorithm(const AuthProxy& auth_set) {
@@ -106,7 +211,17 @@ inline bool is_usage_purpose(keymaster_purpose_t purpose) {
 KeymasterEnforcement::KeymasterEnforcement(uint32_t max_access_time_map_size,
                                            uint32_t max_access_count_map_size)
     : access_time_map_(new (std::nothrow) AccessTimeMap(max_access_time_map_size)),
-      access_count_map_(new (std::nothrow) AccessCountMap(max_access_count_map_size)) {}
+      access_count_map_(new (std::nothrow) AccessCountMap(max_access_count_map_size)) {
+    // The maps allocate their slots up front; treat a failure like failing to allocate the map.
+    if (access_time_map_ && !access_time_map_->is_valid()) {
+        delete access_time_map_;
+        access_time_map_ = nullptr;
+    }
+    if (access_count_map_ && !access_count_map_->is_valid()) {
+        delete access_count_map_;
+        access_count_map_ = nullptr;
+    }
+}
 
 KeymasterEnforcement::~KeymasterEnforcement() {
     delete access_time_map_;
@@ -118,8 +233,13 @@ keymaster_error_t KeymasterEnforcement::AuthorizeOperation(const keymaster_purpo
                                                            const AuthProxy& auth_set,
                                                            const AuthorizationSet& operation_params,
                                                            keymaster_operation_handle_t op_handle,
-                                                           bool is_begin_operation) {
-    if (is_public_key_algorithm(auth_set)) {
+                                                           bool is_begin_operation,
+                                                           const KeyPolicy* policy) {
+    KEYMASTER_TRACE("AuthorizeOperation");
+    bool public_key = (policy && policy->compiled && policy->auth_set_size == auth_set.size())
+                          ? policy->has(KeyPolicy::PUBLIC_KEY_ALGORITHM)
+                          : is_public_key_algorithm(auth_set);
+    if (public_key) {
         switch (purpose) {
         case KM_PURPOSE_ENCRYPT:
         case KM_PURPOSE_VERIFY:
@@ -136,7 +256,9 @@ keymaster_error_t KeymasterEnforcement::AuthorizeOperation(const keymaster_purpo
         };
     };
 
-    if (is_begin_operation)
+    if (is_begin_operation && policy)
+        return AuthorizeBegin(purpose, keyid, *policy, auth_set, operation_params);
+    else if (is_begin_operation)
         return AuthorizeBegin(purpose, keyid, auth_set, operation_params);
     else
         return AuthorizeUpdateOrFinish(auth_set, operation_params, op_handle);
@@ -197,6 +319,57 @@ KeymasterEnforcement::AuthorizeUpdateOrFinish(const AuthProxy& auth_set,
     return KM_ERROR_OK;
 }
 
+keymaster_error_t
+KeymasterEnforcement::PreAuthorizeBegin(const keymaster_purpose_t purpose,
+                                        const AuthProxy& auth_set,
+                                        const AuthorizationSet& operation_params) const {
+    if (is_public_key_algorithm(auth_set) &&
+        (purpose == KM_PURPOSE_ENCRYPT || purpose == KM_PURPOSE_VERIFY)) {
+        return KM_ERROR_OK;
+    }
+
+    keymaster_error_t error = authorized_purpose(purpose, auth_set);
+    if (error != KM_ERROR_OK) return error;
+
+    bool has_secure_id = false;
+    bool has_auth_timeout = false;
+    bool no_auth_required = false;
+    for (auto& param : auth_set) {
+        switch (param.tag) {
+        case KM_TAG_ACTIVE_DATETIME:
+            if (!activation_date_valid(param.date_time)) return KM_ERROR_KEY_NOT_YET_VALID;
+            break;
+        case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
+            if (is_origination_purpose(purpose) && expiration_date_passed(param.date_time))
+                return KM_ERROR_KEY_EXPIRED;
+            break;
+        case KM_TAG_USAGE_EXPIRE_DATETIME:
+            if (is_usage_purpose(purpose) && expiration_date_passed(param.date_time))
+                return KM_ERROR_KEY_EXPIRED;
+            break;
+        case KM_TAG_USER_SECURE_ID:
+            has_secure_id = true;
+            break;
+        case KM_TAG_AUTH_TIMEOUT:
+            has_auth_timeout = true;
+            break;
+        case KM_TAG_NO_AUTH_REQUIRED:
+            no_auth_required = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Whether a token that is present matches is left to AuthorizeOperation(); checking it here
+    // would mean verifying its MAC twice.
+    if (has_secure_id && has_auth_timeout && !no_auth_required &&
+        operation_params.find(KM_TAG_AUTH_TOKEN) == -1) {
+        return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
+    }
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t purpose,
                                                        const km_id_t keyid,
                                                        const AuthProxy& auth_set,
@@ -282,19 +455,7 @@ keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t
             break;
 
         case KM_TAG_UNLOCKED_DEVICE_REQUIRED:
-            if (device_locked_at_ > 0) {
-                const hw_auth_token_t* auth_token;
-                uint32_t token_auth_type;
-                if (!GetAndValidateAuthToken(operation_params, &auth_token, &token_auth_type)) {
-                    return KM_ERROR_DEVICE_LOCKED;
-                }
-
-                uint64_t token_timestamp_millis = ntoh(auth_token->timestamp);
-                if (token_timestamp_millis <= device_locked_at_ ||
-                    (password_unlock_only_ && !(token_auth_type & HW_AUTH_PASSWORD))) {
-                    return KM_ERROR_DEVICE_LOCKED;
-                }
-            }
+            if (!DeviceUnlockedFor(operation_params)) return KM_ERROR_DEVICE_LOCKED;
             break;
 
         case KM_TAG_CALLER_NONCE:
@@ -404,6 +565,89 @@ keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t
         operation_params.find(KM_TAG_NONCE) != -1)
         return KM_ERROR_CALLER_NONCE_PROHIBITED;
 
+    return RecordKeyAccess(keyid, min_ops_timeout, update_access_count);
+}
+
+keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t purpose,
+                                                       const km_id_t keyid,
+                                                       const KeyPolicy& policy,
+                                                       const AuthProxy& auth_set,
+                                                       const AuthorizationSet& operation_params) {
+    if (!policy.compiled || policy.auth_set_size != auth_set.size()) {
+        return AuthorizeBegin(purpose, keyid, auth_set, operation_params);
+    }
+
+    switch (purpose) {
+    case KM_PURPOSE_VERIFY:
+    case KM_PURPOSE_ENCRYPT:
+    case KM_PURPOSE_SIGN:
+    case KM_PURPOSE_DECRYPT:
+    case KM_PURPOSE_WRAP:
+    case KM_PURPOSE_AGREE_KEY:
+        if (!policy.has_purpose(purpose)) return KM_ERROR_INCOMPATIBLE_PURPOSE;
+        break;
+    default:
+        return KM_ERROR_UNSUPPORTED_PURPOSE;
+    }
+
+    if (policy.has(KeyPolicy::ACTIVE_DATETIME) && !activation_date_valid(policy.active_datetime)) {
+        return KM_ERROR_KEY_NOT_YET_VALID;
+    }
+    if (policy.has(KeyPolicy::ORIGINATION_EXPIRE_DATETIME) && is_origination_purpose(purpose) &&
+        expiration_date_passed(policy.origination_expire_datetime)) {
+        return KM_ERROR_KEY_EXPIRED;
+    }
+    if (policy.has(KeyPolicy::USAGE_EXPIRE_DATETIME) && is_usage_purpose(purpose) &&
+        expiration_date_passed(policy.usage_expire_datetime)) {
+        return KM_ERROR_KEY_EXPIRED;
+    }
+
+    uint32_t min_ops_timeout = UINT32_MAX;
+    if (policy.has(KeyPolicy::MIN_SECONDS_BETWEEN_OPS)) {
+        min_ops_timeout = policy.min_seconds_between_ops;
+        if (!MinTimeBetweenOpsPassed(min_ops_timeout, keyid)) {
+            return KM_ERROR_KEY_RATE_LIMIT_EXCEEDED;
+        }
+    }
+    bool update_access_count = policy.has(KeyPolicy::MAX_USES_PER_BOOT);
+    if (update_access_count && !MaxUsesPerBootNotExceeded(keyid, policy.max_uses_per_boot)) {
+        return KM_ERROR_KEY_MAX_OPS_EXCEEDED;
+    }
+
+    if (policy.has(KeyPolicy::UNLOCKED_DEVICE_REQUIRED) && !DeviceUnlockedFor(operation_params)) {
+        return KM_ERROR_DEVICE_LOCKED;
+    }
+    if (policy.has(KeyPolicy::EARLY_BOOT_ONLY) && !in_early_boot()) {
+        return KM_ERROR_EARLY_BOOT_ENDED;
+    }
+
+    if (policy.has(KeyPolicy::TIMED_USER_AUTH)) {
+        bool auth_token_matched = false;
+        for (auto& param : auth_set) {
+            if (param.tag == KM_TAG_USER_SECURE_ID &&
+                AuthTokenMatches(auth_set, operation_params, param.long_integer,
+                                 policy.auth_type_index, policy.auth_timeout_index,
+                                 0 /* op_handle */, true /* is_begin_operation */)) {
+                auth_token_matched = true;
+                break;
+            }
+        }
+        if (!auth_token_matched) {
+            LOG_E("Auth required but no matching auth token found", 0);
+            return KM_ERROR_KEY_USER_NOT_AUTHENTICATED;
+        }
+    }
+
+    if (!policy.has(KeyPolicy::CALLER_NONCE) && is_origination_purpose(purpose) &&
+        operation_params.find(KM_TAG_NONCE) != -1)
+        return KM_ERROR_CALLER_NONCE_PROHIBITED;
+
+    return RecordKeyAccess(keyid, min_ops_timeout, update_access_count);
+}
+
+keymaster_error_t KeymasterEnforcement::RecordKeyAccess(const km_id_t keyid,
+                                                        uint32_t min_ops_timeout,
+                                                        bool update_access_count) {
     if (min_ops_timeout != UINT32_MAX) {
         if (!access_time_map_) {
             LOG_S("Rate-limited keys table not allocated.  Rate-limited keys disabled", 0);
@@ -431,6 +675,140 @@ keymaster_error_t KeymasterEnforcement::AuthorizeBegin(const keymaster_purpose_t
     return KM_ERROR_OK;
 }
 
+bool KeymasterEnforcement::DeviceUnlockedFor(const AuthorizationSet& operation_params) const {
+    uint64_t lock_state = device_lock_state_.load(std::memory_order_acquire);
+    if (lock_state == 0) return true;
+    uint64_t device_locked_at = lock_state >> 1;
+    bool password_unlock_only = lock_state & 1;
+
+    const hw_auth_token_t* auth_token;
+    uint32_t token_auth_type;
+    if (!GetAndValidateAuthToken(operation_params, &auth_token, &token_auth_type)) return false;
+
+    uint64_t token_timestamp_millis = ntoh(auth_token->timestamp);
+    return token_timestamp_millis > device_locked_at &&
+           (!password_unlock_only || (token_auth_type & HW_AUTH_PASSWORD));
+}
+
+void CompileKeyPolicy(const AuthProxy& auth_set, KeyPolicy* policy) {
+    *policy = KeyPolicy();
+    policy->auth_set_size = auth_set.size();
+    if (is_public_key_algorithm(auth_set)) policy->flags |= KeyPolicy::PUBLIC_KEY_ALGORITHM;
+
+    // Tags that carry a value must appear at most once; a repeat leaves the policy uncompiled.
+    auto set_once = [policy](KeyPolicy::Flags flag) {
+        if (policy->has(flag)) return false;
+        policy->flags |= flag;
+        return true;
+    };
+
+    bool user_secure_id = false;
+    bool no_auth_required = false;
+    for (size_t pos = 0; pos < auth_set.size(); ++pos) {
+        keymaster_key_param_t param = auth_set[pos];
+        // KM_TAG_PADDING_OLD isn't a member of the enum, so it can't be a case below, but
+        // GetAndValidatePadding() accepts it like KM_TAG_PADDING.
+        if (param.tag == KM_TAG_PADDING_OLD) param.tag = KM_TAG_PADDING;
+        switch (param.tag) {
+        case KM_TAG_PURPOSE:
+            if (param.enumerated >= 32) return;
+            policy->purposes |= 1u << param.enumerated;
+            break;
+        case KM_TAG_ACTIVE_DATETIME:
+            if (!set_once(KeyPolicy::ACTIVE_DATETIME)) return;
+            policy->active_datetime = param.date_time;
+            break;
+        case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
+            if (!set_once(KeyPolicy::ORIGINATION_EXPIRE_DATETIME)) return;
+            policy->origination_expire_datetime = param.date_time;
+            break;
+        case KM_TAG_USAGE_EXPIRE_DATETIME:
+            if (!set_once(KeyPolicy::USAGE_EXPIRE_DATETIME)) return;
+            policy->usage_expire_datetime = param.date_time;
+            break;
+        case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
+            if (!set_once(KeyPolicy::MIN_SECONDS_BETWEEN_OPS)) return;
+            policy->min_seconds_between_ops = param.integer;
+            break;
+        case KM_TAG_MAX_USES_PER_BOOT:
+            if (!set_once(KeyPolicy::MAX_USES_PER_BOOT)) return;
+            policy->max_uses_per_boot = param.integer;
+            break;
+        case KM_TAG_AUTH_TIMEOUT:
+            if (policy->auth_timeout_index != -1) return;
+            policy->auth_timeout_index = pos;
+            break;
+        case KM_TAG_USER_AUTH_TYPE:
+            if (policy->auth_type_index != -1) return;
+            policy->auth_type_index = pos;
+            break;
+        case KM_TAG_NO_AUTH_REQUIRED:
+            no_auth_required = true;
+            break;
+        case KM_TAG_USER_SECURE_ID:
+            user_secure_id = true;
+            break;
+        case KM_TAG_UNLOCKED_DEVICE_REQUIRED:
+            policy->flags |= KeyPolicy::UNLOCKED_DEVICE_REQUIRED;
+            break;
+        case KM_TAG_CALLER_NONCE:
+            policy->flags |= KeyPolicy::CALLER_NONCE;
+            break;
+        case KM_TAG_EARLY_BOOT_ONLY:
+            policy->flags |= KeyPolicy::EARLY_BOOT_ONLY;
+            break;
+        case KM_TAG_BLOCK_MODE:
+            if (param.enumerated >= 64) return;
+            policy->block_modes |= uint64_t(1) << param.enumerated;
+            break;
+        case KM_TAG_PADDING: {
+            int bit = KeyPolicy::padding_bit(static_cast<keymaster_padding_t>(param.enumerated));
+            if (bit < 0) return;
+            policy->paddings |= uint64_t(1) << bit;
+            break;
+        }
+        case KM_TAG_MIN_MAC_LENGTH:
+            if (!set_once(KeyPolicy::MIN_MAC_LENGTH)) return;
+            policy->min_mac_length = param.integer;
+            break;
+
+        /* Tags AuthorizeBegin() rejects; leave those keys to the slow path. */
+        case KM_TAG_INVALID:
+        case KM_TAG_AUTH_TOKEN:
+        case KM_TAG_ROOT_OF_TRUST:
+        case KM_TAG_APPLICATION_DATA:
+        case KM_TAG_ATTESTATION_CHALLENGE:
+        case KM_TAG_ATTESTATION_APPLICATION_ID:
+        case KM_TAG_ATTESTATION_ID_BRAND:
+        case KM_TAG_ATTESTATION_ID_DEVICE:
+        case KM_TAG_ATTESTATION_ID_PRODUCT:
+        case KM_TAG_ATTESTATION_ID_SERIAL:
+        case KM_TAG_ATTESTATION_ID_IMEI:
+        case KM_TAG_ATTESTATION_ID_SECOND_IMEI:
+        case KM_TAG_ATTESTATION_ID_MEID:
+        case KM_TAG_ATTESTATION_ID_MANUFACTURER:
+        case KM_TAG_ATTESTATION_ID_MODEL:
+        case KM_TAG_DEVICE_UNIQUE_ATTESTATION:
+        case KM_TAG_CERTIFICATE_SUBJECT:
+        case KM_TAG_CERTIFICATE_SERIAL:
+        case KM_TAG_CERTIFICATE_NOT_AFTER:
+        case KM_TAG_CERTIFICATE_NOT_BEFORE:
+        case KM_TAG_IDENTITY_CREDENTIAL_KEY:
+        case KM_TAG_BOOTLOADER_ONLY:
+            return;
+
+        default:
+            break;
+        }
+    }
+
+    if (user_secure_id && no_auth_required) return;
+    if (user_secure_id && policy->auth_timeout_index != -1) {
+        policy->flags |= KeyPolicy::TIMED_USER_AUTH;
+    }
+    policy->compiled = true;
+}
+
 bool KeymasterEnforcement::MinTimeBetweenOpsPassed(uint32_t min_time_between, const km_id_t keyid) {
     if (!access_time_map_) return false;
 
@@ -469,7 +847,7 @@ bool KeymasterEnforcement::GetAndValidateAuthToken(const AuthorizationSet& opera
         return false;
     }
 
-    if (!ValidateTokenSignature(**auth_token)) {
+    if (!TokenSignatureValid(**auth_token)) {
         LOG_E("Auth token signature invalid", 0);
         return false;
     }
@@ -479,6 +857,26 @@ bool KeymasterEnforcement::GetAndValidateAuthToken(const AuthorizationSet& opera
     return true;
 }
 
+bool KeymasterEnforcement::TokenSignatureValid(const hw_auth_token_t& token) const {
+    // Look up by challenge, user ID and timestamp, then require the whole token, MAC included, to
+    // be byte-identical before trusting the earlier verification.
+    for (const auto& entry : validated_auth_tokens_) {
+        if (entry.valid && entry.token.challenge == token.challenge &&
+            entry.token.user_id == token.user_id && entry.token.timestamp == token.timestamp &&
+            memcmp_s(&entry.token, &token, sizeof(token)) == 0) {
+            return true;
+        }
+    }
+
+    if (!ValidateTokenSignature(token)) return false;
+
+    ValidatedAuthToken& slot = validated_auth_tokens_[next_validated_auth_token_];
+    next_validated_auth_token_ = (next_validated_auth_token_ + 1) % kValidatedAuthTokenCacheSize;
+    slot.valid = true;
+    memcpy(&slot.token, &token, sizeof(slot.token));
+    return true;
+}
+
 bool KeymasterEnforcement::AuthTokenMatches(const AuthProxy& auth_set,
                                             const AuthorizationSet& operation_params,
                                             const uint64_t user_secure_id,
@@ -536,68 +934,73 @@ keymaster_error_t KeymasterEnforcement::GenerateTimestampToken(TimestampToken* /
     return KM_ERROR_UNIMPLEMENTED;
 }
 
+keymaster_error_t KeymasterEnforcement::GenerateTimestampToken(uint64_t challenge,
+                                                               uint64_t* timestamp, uint8_t* mac) {
+    TimestampToken token;
+    token.challenge = challenge;
+    keymaster_error_t error = GenerateTimestampToken(&token);
+    if (error != KM_ERROR_OK) return error;
+    if (token.mac.data_length != kTimestampTokenMacSize) return KM_ERROR_UNKNOWN_ERROR;
+    *timestamp = token.timestamp;
+    memcpy(mac, token.mac.data, kTimestampTokenMacSize);
+    return KM_ERROR_OK;
+}
+
 bool AccessTimeMap::LastKeyAccessTime(km_id_t keyid, uint32_t* last_access_time) const {
-    for (auto& entry : last_access_list_)
-        if (entry.keyid == keyid) {
-            *last_access_time = entry.access_time;
-            return true;
-        }
-    return false;
+    const AccessTime* entry = map_.Find(keyid);
+    if (!entry) return false;
+    *last_access_time = entry->access_time;
+    return true;
 }
 
 bool AccessTimeMap::UpdateKeyAccessTime(km_id_t keyid, uint32_t current_time, uint32_t timeout) {
-    List<AccessTime>::iterator iter;
-    for (iter = last_access_list_.begin(); iter != last_access_list_.end();) {
-        if (iter->keyid == keyid) {
-            iter->access_time = current_time;
-            return true;
-        }
-
-        // Expire entry if possible.
-        assert(current_time >= iter->access_time);
-        if (current_time - iter->access_time >= iter->timeout)
-            iter = last_access_list_.erase(iter);
-        else
-            ++iter;
+    AccessTime* entry = map_.Find(keyid);
+    if (entry) {
+        entry->access_time = current_time;
+        return true;
     }
 
-    if (last_access_list_.size() >= max_size_) return false;
+    auto expired = [current_time](const AccessTime& access) {
+        assert(current_time >= access.access_time);
+        return current_time - access.access_time >= access.timeout;
+    };
+    // Expire a few entries on every insertion, and everything that can be expired before
+    // declaring the map full.
+    map_.Sweep(kAccessTimeSweepSlots, expired);
+    entry = map_.Insert(keyid);
+    if (!entry) {
+        map_.SweepAll(expired);
+        entry = map_.Insert(keyid);
+    }
+    if (!entry) return false;
 
-    AccessTime new_entry;
-    new_entry.keyid = keyid;
-    new_entry.access_time = current_time;
-    new_entry.timeout = timeout;
-    last_access_list_.push_front(new_entry);
+    entry->access_time = current_time;
+    entry->timeout = timeout;
     return true;
 }
 
 bool AccessCountMap::KeyAccessCount(km_id_t keyid, uint32_t* count) const {
-    for (auto& entry : access_count_list_)
-        if (entry.keyid == keyid) {
-            *count = entry.access_count;
-            return true;
-        }
-    return false;
+    const AccessCount* entry = map_.Find(keyid);
+    if (!entry) return false;
+    *count = entry->access_count;
+    return true;
 }
 
 bool AccessCountMap::IncrementKeyAccessCount(km_id_t keyid) {
-    for (auto& entry : access_count_list_)
-        if (entry.keyid == keyid) {
-            // Note that the 'if' below will always be true because KM_TAG_MAX_USES_PER_BOOT is a
-            // uint32_t, and as soon as entry.access_count reaches the specified maximum value
-            // operation requests will be rejected and access_count won't be incremented any more.
-            // And, besides, UINT64_MAX is huge.  But we ensure that it doesn't wrap anyway, out of
-            // an abundance of caution.
-            if (entry.access_count < UINT64_MAX) ++entry.access_count;
-            return true;
-        }
-
-    if (access_count_list_.size() >= max_size_) return false;
+    AccessCount* entry = map_.Find(keyid);
+    if (entry) {
+        // Note that the 'if' below will always be true because KM_TAG_MAX_USES_PER_BOOT is a
+        // uint32_t, and as soon as entry.access_count reaches the specified maximum value
+        // operation requests will be rejected and access_count won't be incremented any more.
+        // And, besides, UINT64_MAX is huge.  But we ensure that it doesn't wrap anyway, out of
+        // an abundance of caution.
+        if (entry->access_count < UINT64_MAX) ++entry->access_count;
+        return true;
+    }
 
-    AccessCount new_entry;
-    new_entry.keyid = keyid;
-    new_entry.access_count = 1;
-    access_count_list_.push_front(new_entry);
+    entry = map_.Insert(keyid);
+    if (!entry) return false;
+    entry->access_count = 1;
     return true;
 }
 }; /* namespace keymaster */
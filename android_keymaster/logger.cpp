@@ -20,6 +20,11 @@ namespace keymaster {
 
 Logger* Logger::instance_ = nullptr;
 
+/* static */
+bool Logger::IsLoggable(LogLevel level) {
+    return instance_ && instance_->is_loggable(level);
+}
+
 /* static */
 // NOLINTNEXTLINE(cert-dcl50-cpp)
 int Logger::Log(LogLevel level, const char* fmt, va_list args) {
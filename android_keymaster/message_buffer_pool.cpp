@@ -0,0 +1,82 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/message_buffer_pool.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+MessageBufferPool::~MessageBufferPool() {
+    for (size_t i = 0; i < slot_count_; ++i) {
+        memset_s(slots_[i].buffer.get(), 0, slots_[i].used);
+    }
+}
+
+const MessageBufferPool::Slot* MessageBufferPool::Find(AndroidKeymasterCommand command) const {
+    for (size_t i = 0; i < slot_count_; ++i) {
+        if (slots_[i].command == command) return &slots_[i];
+    }
+    return nullptr;
+}
+
+MessageBufferPool::Slot* MessageBufferPool::Reserve(AndroidKeymasterCommand command, size_t size) {
+    Slot* slot = const_cast<Slot*>(Find(command));
+    if (!slot) {
+        slot = &slots_[slot_count_ < kMaxSlots ? slot_count_++ : kMaxSlots - 1];
+        slot->command = command;
+    }
+
+    memset_s(slot->buffer.get(), 0, slot->used);
+    slot->used = 0;
+    if (size > slot->capacity || !slot->buffer) {
+        size_t capacity = size ? size : 1;
+        slot->buffer.reset(new (std::nothrow) uint8_t[capacity]);
+        slot->capacity = slot->buffer ? capacity : 0;
+        if (!slot->buffer) return nullptr;
+        ++allocations_;
+    }
+    slot->used = size;
+    return slot;
+}
+
+keymaster_error_t MessageBufferPool::Serialize(AndroidKeymasterCommand command,
+                                               const Serializable& message, const uint8_t** data,
+                                               size_t* size) {
+    size_t message_size = message.SerializedSize();
+    Slot* slot = Reserve(command, message_size);
+    if (!slot) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    uint8_t* end = message.Serialize(slot->buffer.get(), slot->buffer.get() + message_size);
+    if (end != slot->buffer.get() + message_size) return KM_ERROR_UNKNOWN_ERROR;
+    *data = slot->buffer.get();
+    *size = message_size;
+    return KM_ERROR_OK;
+}
+
+uint8_t* MessageBufferPool::Acquire(AndroidKeymasterCommand command, size_t size) {
+    Slot* slot = Reserve(command, size);
+    if (!slot) return nullptr;
+    memset(slot->buffer.get(), 0, size);  // Fresh buffers come uninitialized.
+    return slot->buffer.get();
+}
+
+size_t MessageBufferPool::high_water_mark(AndroidKeymasterCommand command) const {
+    const Slot* slot = Find(command);
+    return slot ? slot->capacity : 0;
+}
+
+}  // namespace keymaster
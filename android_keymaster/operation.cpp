@@ -83,6 +83,13 @@ bool OperationFactory::is_public_key_operation() const {
     return false;
 }
 
+// Checks the key's compiled policy where it has one, rather than walking its authorizations.
+static bool KeyAuthorizesPadding(const Key& key, keymaster_padding_t padding) {
+    if (const KeyPolicy* policy = key.compiled_policy()) return policy->has_padding(padding);
+    return key.authorizations().Contains(TAG_PADDING, padding) ||
+           key.authorizations().Contains(TAG_PADDING_OLD, padding);
+}
+
 bool OperationFactory::GetAndValidatePadding(const AuthorizationSet& begin_params, const Key& key,
                                              keymaster_padding_t* padding,
                                              keymaster_error_t* error) const {
@@ -97,8 +104,7 @@ bool OperationFactory::GetAndValidatePadding(const AuthorizationSet& begin_param
         // If it's a public key operation, all padding modes are authorized.
         !is_public_key_operation() &&
         // Otherwise the key needs to authorize the specific mode.
-        !key.authorizations().Contains(TAG_PADDING, *padding) &&
-        !key.authorizations().Contains(TAG_PADDING_OLD, *padding)) {
+        !KeyAuthorizesPadding(key, *padding)) {
         LOG_E("Padding mode %d was specified, but not authorized by key", *padding);
         *error = KM_ERROR_INCOMPATIBLE_PADDING_MODE;
         return false;
@@ -163,4 +169,9 @@ keymaster_error_t Operation::UpdateForFinish(const AuthorizationSet& input_param
     return KM_ERROR_OK;
 }
 
+bool Operation::CopyAuthorizations(AuthorizationSet* hw_enforced,
+                                   AuthorizationSet* sw_enforced) const {
+    return hw_enforced->Reinitialize(hw_enforced_) && sw_enforced->Reinitialize(sw_enforced_);
+}
+
 }  // namespace keymaster
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/operation_metrics.h>
+
+#include <chrono>
+
+#include <keymaster/km_openssl/crypto_dispatch.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+const char* AlgorithmName(size_t index) {
+    static const char* const kNames[] = {"unknown", "RSA", "EC", "AES", "3DES", "HMAC"};
+    return kNames[index];
+}
+
+const char* PurposeName(size_t purpose) {
+    static const char* const kNames[] = {"encrypt", "decrypt",  "sign",      "verify",
+                                         "derive",  "wrap",     "agree_key", "attest_key"};
+    return kNames[purpose];
+}
+
+}  // namespace
+
+const char* OperationPhaseName(OperationPhase phase) {
+    switch (phase) {
+    case OperationPhase::LOAD_KEY:
+        return "load_key";
+    case OperationPhase::CREATE_OPERATION:
+        return "create_operation";
+    case OperationPhase::AUTHORIZE:
+        return "authorize";
+    case OperationPhase::BEGIN:
+        return "begin";
+    case OperationPhase::UPDATE:
+        return "update";
+    case OperationPhase::FINISH:
+        return "finish";
+    }
+    return "unknown";
+}
+
+/* static */
+size_t LatencyHistogram::BucketFor(uint64_t duration_ns) {
+    size_t bucket = 0;
+    while (duration_ns > 1 && bucket < kBucketCount - 1) {
+        duration_ns >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+void LatencyHistogram::Record(uint64_t duration_ns, size_t bytes) {
+    buckets_[BucketFor(duration_ns)].fetch_add(1, std::memory_order_relaxed);
+    total_ns_.fetch_add(duration_ns, std::memory_order_relaxed);
+    total_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Read(Snapshot* snapshot) const {
+    snapshot->count = 0;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+        snapshot->buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        snapshot->count += snapshot->buckets[i];
+    }
+    snapshot->total_ns = total_ns_.load(std::memory_order_relaxed);
+    snapshot->total_bytes = total_bytes_.load(std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Reset() {
+    for (auto& bucket : buckets_) bucket.store(0, std::memory_order_relaxed);
+    total_ns_.store(0, std::memory_order_relaxed);
+    total_bytes_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Snapshot::PercentileNs(unsigned percentile) const {
+    if (count == 0) return 0;
+    if (percentile > 100) percentile = 100;
+    // The rank of the wanted duration, counting from one.
+    uint64_t rank = (count * percentile + 99) / 100;
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) return i == kBucketCount - 1 ? UINT64_MAX : (uint64_t(2) << i) - 1;
+    }
+    return UINT64_MAX;
+}
+
+uint64_t HistogramMetricsSink::now_ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+/* static */
+size_t HistogramMetricsSink::AlgorithmIndex(keymaster_algorithm_t algorithm) {
+    switch (algorithm) {
+    case KM_ALGORITHM_RSA:
+        return 1;
+    case KM_ALGORITHM_EC:
+        return 2;
+    case KM_ALGORITHM_AES:
+        return 3;
+    case KM_ALGORITHM_TRIPLE_DES:
+        return 4;
+    case KM_ALGORITHM_HMAC:
+        return 5;
+    }
+    return 0;
+}
+
+void HistogramMetricsSink::Record(const OperationSpan& span) {
+    size_t phase = static_cast<size_t>(span.phase);
+    size_t purpose = static_cast<size_t>(span.purpose);
+    if (phase >= kOperationPhaseCount || purpose >= kPurposeCount) return;
+    histograms_[phase][AlgorithmIndex(span.algorithm)][purpose].Record(span.duration_ns,
+                                                                       span.input_length);
+
+    if (span.algorithm == KM_ALGORITHM_TRIPLE_DES && span.input_length >= triple_des_bulk_bytes_) {
+        uint64_t count = triple_des_bulk_calls_.fetch_add(1, std::memory_order_relaxed) + 1;
+        if ((count & (count - 1)) == 0) {
+            LOG_W("%llu bulk 3DES calls so far (latest %zu bytes); clients should move to AES",
+                  static_cast<unsigned long long>(count), span.input_length);
+        }
+    }
+}
+
+bool HistogramMetricsSink::GetHistogram(OperationPhase phase, keymaster_algorithm_t algorithm,
+                                        keymaster_purpose_t purpose,
+                                        LatencyHistogram::Snapshot* snapshot) const {
+    size_t phase_index = static_cast<size_t>(phase);
+    size_t purpose_index = static_cast<size_t>(purpose);
+    size_t algorithm_index = AlgorithmIndex(algorithm);
+    if (phase_index >= kOperationPhaseCount || purpose_index >= kPurposeCount) return false;
+    if (algorithm_index == 0 && algorithm != 0) return false;
+    histograms_[phase_index][algorithm_index][purpose_index].Read(snapshot);
+    return true;
+}
+
+void HistogramMetricsSink::LogSummary() const {
+    LogCryptoDispatch(GetCryptoDispatch());
+    LatencyHistogram::Snapshot snapshot;
+    for (size_t phase = 0; phase < kOperationPhaseCount; ++phase) {
+        for (size_t algorithm = 0; algorithm < kAlgorithmCount; ++algorithm) {
+            for (size_t purpose = 0; purpose < kPurposeCount; ++purpose) {
+                histograms_[phase][algorithm][purpose].Read(&snapshot);
+                if (snapshot.count == 0) continue;
+                Logger::Info("%s %s %s: count %llu mean %lluns p50 <=%lluns p99 <=%lluns "
+                             "bytes %llu",
+                             OperationPhaseName(static_cast<OperationPhase>(phase)),
+                             AlgorithmName(algorithm), PurposeName(purpose),
+                             static_cast<unsigned long long>(snapshot.count),
+                             static_cast<unsigned long long>(snapshot.MeanNs()),
+                             static_cast<unsigned long long>(snapshot.PercentileNs(50)),
+                             static_cast<unsigned long long>(snapshot.PercentileNs(99)),
+                             static_cast<unsigned long long>(snapshot.total_bytes));
+            }
+        }
+    }
+}
+
+void HistogramMetricsSink::Reset() {
+    for (auto& by_algorithm : histograms_) {
+        for (auto& by_purpose : by_algorithm) {
+            for (auto& histogram : by_purpose) histogram.Reset();
+        }
+    }
+    triple_des_bulk_calls_.store(0, std::memory_order_relaxed);
+}
+
+}  // namespace keymaster
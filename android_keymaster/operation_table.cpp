@@ -14,49 +14,389 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <utility>
 
+#include <openssl/rand.h>
+
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/logger.h>
 #include <keymaster/operation.h>
 #include <keymaster/operation_table.h>
 
 namespace keymaster {
 
-keymaster_error_t OperationTable::Add(OperationPtr&& operation) {
-    if (!table_) {
-        table_.reset(new (std::nothrow) OperationPtr[table_size_]);
-        if (!table_) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+namespace {
+
+// Layout of the low 32 bits of a tagged operation handle.  The high 32 bits are left as generated
+// by the operation.
+constexpr unsigned kSlotBits = 16;
+constexpr uint64_t kSlotMask = (1ULL << kSlotBits) - 1;
+constexpr uint64_t kTagMask = 0xFFFFFFFFULL;
+constexpr size_t kMaxTableSize = kSlotMask + 1;
+constexpr size_t kNoSlot = static_cast<size_t>(-1);
+
+uint16_t RotateRight16(uint16_t value, unsigned bits) {
+    return static_cast<uint16_t>((value >> bits) | (value << (16 - bits)));
+}
+
+uint16_t RotateLeft16(uint16_t value, unsigned bits) {
+    return static_cast<uint16_t>((value << bits) | (value >> (16 - bits)));
+}
+
+keymaster_operation_handle_t TagHandle(keymaster_operation_handle_t op_handle, size_t slot,
+                                       uint16_t generation) {
+    return (op_handle & ~kTagMask) | (static_cast<uint64_t>(generation) << kSlotBits) | slot;
+}
+
+}  // namespace
+
+OperationHandleSequence::OperationHandleSequence() {
+    // Speck32/64 key schedule.  The handles only need to be unguessable by other clients, so
+    // RAND_bytes, which aborts rather than fail, is a sufficient key source.
+    uint16_t key[4];
+    RAND_bytes(reinterpret_cast<uint8_t*>(key), sizeof(key));
+    uint16_t l[kRounds + 2] = {key[1], key[2], key[3]};
+    round_keys_[0] = key[0];
+    for (size_t i = 0; i + 1 < kRounds; ++i) {
+        l[i + 3] = static_cast<uint16_t>((round_keys_[i] + RotateRight16(l[i], 7)) ^ i);
+        round_keys_[i + 1] = RotateLeft16(round_keys_[i], 2) ^ l[i + 3];
+    }
+    memset_s(key, 0, sizeof(key));
+    memset_s(l, 0, sizeof(l));
+}
+
+uint32_t OperationHandleSequence::Permute(uint32_t value) const {
+    uint16_t x = static_cast<uint16_t>(value >> 16);
+    uint16_t y = static_cast<uint16_t>(value);
+    for (size_t i = 0; i < kRounds; ++i) {
+        x = static_cast<uint16_t>((RotateRight16(x, 7) + y) ^ round_keys_[i]);
+        y = RotateLeft16(y, 2) ^ x;
+    }
+    return (static_cast<uint32_t>(x) << 16) | y;
+}
+
+uint32_t OperationHandleSequence::Next() {
+    // Exactly one counter value maps to zero; skip it.
+    uint32_t value;
+    do {
+        value = Permute(counter_.fetch_add(1, std::memory_order_relaxed));
+    } while (value == 0);
+    return value;
+}
+
+OperationTable::OperationTable(size_t table_size)
+    : table_size_(table_size < kMaxTableSize ? table_size : kMaxTableSize) {}
+
+OperationTable::~OperationTable() {}
+
+bool OperationTable::Initialize() {
+    return Resize(table_size_);
+}
+
+bool OperationTable::Resize(size_t new_size) {
+    UniquePtr<Slot[]> table(new (std::nothrow) Slot[new_size]);
+    UniquePtr<uint16_t[]> free_slots(new (std::nothrow) uint16_t[new_size]);
+    if (!table || !free_slots) return false;
+
+    size_t old_size = table_ ? table_size_ : 0;
+    for (size_t i = 0; i < std::min(old_size, new_size); ++i) table[i] = std::move(table_[i]);
+
+    // The free list is a stack.  Added slots go beneath the slots already free, and low slots are
+    // handed out first, which keeps the linear fallback scan short and the last segment empty.
+    size_t free_count = 0;
+    for (size_t slot = new_size; slot > old_size; --slot) {
+        free_slots[free_count++] = static_cast<uint16_t>(slot - 1);
+    }
+    for (size_t i = 0; i < free_count_; ++i) {
+        if (free_slots_[i] < new_size) free_slots[free_count++] = free_slots_[i];
+    }
+
+    table_ = std::move(table);
+    free_slots_ = std::move(free_slots);
+    free_count_ = free_count;
+    table_size_ = new_size;
+    return true;
+}
+
+keymaster_error_t OperationTable::set_adaptive_size(size_t min_size, size_t max_size,
+                                                    size_t segment_size, uint64_t window_ms) {
+    // A zero segment would count grows that add nothing, and a zero window would shrink the
+    // table on every Add().
+    if (segment_size == 0 || window_ms == 0 || min_size == 0 || max_size < min_size) {
+        return KM_ERROR_INVALID_ARGUMENT;
     }
+    max_size_ = std::min(max_size, kMaxTableSize);
+    min_size_ = std::min(min_size, max_size_);
+    segment_size_ = segment_size;
+    window_ms_ = window_ms;
+    window_started_ = false;
+    if (!table_ && adaptive_size()) table_size_ = min_size_;
+    return KM_ERROR_OK;
+}
+
+bool OperationTable::Grow() {
+    if (!adaptive_size() || table_size_ >= max_size_) return false;
+    size_t new_size = std::min(table_size_ + segment_size_, max_size_);
+    if (!Resize(new_size)) return false;
+    ++sizing_stats_.grow_count;
+    LOG_I("Grew the operation table to %zu slots", new_size);
+    return true;
+}
+
+void OperationTable::MaybeShrink(uint64_t now_ms) {
+    if (!window_started_) {
+        window_started_ = true;
+        window_start_ms_ = now_ms;
+        return;
+    }
+    if (now_ms >= window_start_ms_ && now_ms - window_start_ms_ < window_ms_) return;
+
+    bool spare_segment = window_high_water_ + segment_size_ < table_size_;
+    window_start_ms_ = now_ms;
+    window_high_water_ = table_size_ - free_count_;
+    if (!spare_segment || table_size_ <= min_size_) return;
+
+    size_t new_size = table_size_ - min_size_ > segment_size_ ? table_size_ - segment_size_
+                                                              : min_size_;
+    // Handles encode their slot, so occupied slots can't move.  The next window tries again.
+    for (size_t slot = new_size; slot < table_size_; ++slot) {
+        if (table_[slot].operation) return;
+    }
+    if (!Resize(new_size)) return;
+    ++sizing_stats_.shrink_count;
+    LOG_I("Shrank the operation table to %zu slots", new_size);
+}
+
+keymaster_error_t OperationTable::Add(OperationPtr&& operation, uint64_t now_ms) {
+    if (!operation) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    if (!table_ && !Initialize()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint32_t owner = operation->owner();
+    if (hard_quota_ && owner_count(owner) >= hard_quota_) {
+        CountQuotaRejected();
+        return KM_ERROR_TOO_MANY_OPERATIONS;
+    }
+    if (over_budget()) {
+        CountOverBudget();
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    if (adaptive_size()) MaybeShrink(now_ms);
+    if (free_count_ == 0 && !Grow()) MakeRoom(now_ms);
+    if (free_count_ == 0) return KM_ERROR_TOO_MANY_OPERATIONS;
+
+    size_t slot = free_slots_[--free_count_];
+    Slot& entry = table_[slot];
+
+    AssignHandleHighHalf(operation.get());
+
+    // Generation zero is never used, so a tagged handle is never zero.
+    if (++entry.generation == 0) entry.generation = 1;
+    keymaster_operation_handle_t tagged =
+        TagHandle(operation->operation_handle(), slot, entry.generation);
+    entry.tagged =
+        operation->set_operation_handle(tagged) && operation->operation_handle() == tagged;
+    if (!entry.tagged) ++untagged_count_;
+
+    entry.operation = std::move(operation);
+    entry.last_used_ms = now_ms;
+    entry.owner = owner;
+    ++owner_counts_[owner];
+    entry.footprint = entry.operation->MemoryFootprint();
+    AdjustFootprint(0, entry.footprint);
+    LinkMostRecent(slot);
+
+    size_t in_use = table_size_ - free_count_;
+    window_high_water_ = std::max(window_high_water_, in_use);
+    sizing_stats_.high_water = std::max(sizing_stats_.high_water, in_use);
+    return KM_ERROR_OK;
+}
+
+void OperationTable::AssignHandleHighHalf(Operation* operation) {
+    if (operation->operation_handle() & ~kTagMask) return;
+    // Operations whose handles belong to a device refuse the new handle and keep their own.
+    operation->set_operation_handle(static_cast<uint64_t>(handle_sequence_.Next()) << 32);
+}
+
+size_t OperationTable::FindSlot(keymaster_operation_handle_t op_handle) const {
+    if (op_handle == 0 || !table_) return kNoSlot;
+
+    size_t slot = op_handle & kSlotMask;
+    if (slot < table_size_) {
+        const Slot& entry = table_[slot];
+        if (entry.tagged && entry.operation->operation_handle() == op_handle) return slot;
+    }
+
+    if (untagged_count_ == 0) return kNoSlot;
     for (size_t i = 0; i < table_size_; ++i) {
-        if (!table_[i]) {
-            table_[i] = std::move(operation);
-            return KM_ERROR_OK;
+        const Slot& entry = table_[i];
+        if (entry.operation && !entry.tagged && entry.operation->operation_handle() == op_handle) {
+            return i;
         }
     }
-    return KM_ERROR_TOO_MANY_OPERATIONS;
+    return kNoSlot;
+}
+
+void OperationTable::Release(size_t slot) {
+    Slot& entry = table_[slot];
+    Unlink(slot);
+    if (!entry.tagged) --untagged_count_;
+    auto count = owner_counts_.find(entry.owner);
+    if (count != owner_counts_.end() && --count->second == 0) owner_counts_.erase(count);
+    AdjustFootprint(entry.footprint, 0);
+    entry.footprint = 0;
+    entry.operation.reset();
+    entry.tagged = false;
+    free_slots_[free_count_++] = static_cast<uint16_t>(slot);
 }
 
 Operation* OperationTable::Find(keymaster_operation_handle_t op_handle) {
-    if (op_handle == 0) return nullptr;
+    size_t slot = FindSlot(op_handle);
+    if (slot == kNoSlot) return nullptr;
+    return table_[slot].operation.get();
+}
 
-    if (!table_.get()) return nullptr;
+bool OperationTable::Delete(keymaster_operation_handle_t op_handle) {
+    size_t slot = FindSlot(op_handle);
+    if (slot == kNoSlot) return false;
+    Release(slot);
+    return true;
+}
 
-    for (size_t i = 0; i < table_size_; ++i) {
-        if (table_[i] && table_[i]->operation_handle() == op_handle) return table_[i].get();
+bool OperationTable::Touch(keymaster_operation_handle_t op_handle, uint64_t now_ms) {
+    size_t slot = FindSlot(op_handle);
+    if (slot == kNoSlot) return false;
+    table_[slot].last_used_ms = now_ms;
+    Unlink(slot);
+    LinkMostRecent(slot);
+    return true;
+}
+
+void OperationTable::GetHandles(std::vector<keymaster_operation_handle_t>* handles) const {
+    for (size_t slot = 0; table_ && slot < table_size_; ++slot) {
+        if (table_[slot].operation) handles->push_back(table_[slot].operation->operation_handle());
     }
-    return nullptr;
 }
 
-bool OperationTable::Delete(keymaster_operation_handle_t op_handle) {
-    if (!table_.get()) return false;
+bool OperationTable::LastUsed(keymaster_operation_handle_t op_handle,
+                              uint64_t* last_used_ms) const {
+    size_t slot = FindSlot(op_handle);
+    if (slot == kNoSlot) return false;
+    *last_used_ms = table_[slot].last_used_ms;
+    return true;
+}
 
-    for (size_t i = 0; i < table_size_; ++i) {
-        if (table_[i] && table_[i]->operation_handle() == op_handle) {
-            table_[i].reset();
-            return true;
+bool OperationTable::UpdateFootprint(keymaster_operation_handle_t op_handle) {
+    size_t slot = FindSlot(op_handle);
+    if (slot == kNoSlot) return true;
+    Slot& entry = table_[slot];
+    size_t footprint = entry.operation->MemoryFootprint();
+    AdjustFootprint(entry.footprint, footprint);
+    entry.footprint = footprint;
+    if (!over_budget()) return true;
+    CountOverBudget();
+    return false;
+}
+
+void OperationTable::AdjustFootprint(size_t removed, size_t added) {
+    // Unsigned wraparound turns the addition into a subtraction when |removed| is larger.
+    size_t footprint = footprint_ += added - removed;
+    size_t peak = peak_footprint_;
+    while (footprint > peak && !peak_footprint_.compare_exchange_weak(peak, footprint)) {
+    }
+}
+
+OperationTable::MemoryStats OperationTable::memory_stats() const {
+    MemoryStats stats;
+    stats.footprint = footprint_;
+    stats.peak_footprint = peak_footprint_;
+    stats.over_budget_count = over_budget_count_;
+    return stats;
+}
+
+size_t OperationTable::ReapIdle(uint64_t now_ms, uint64_t max_idle_ms) {
+    size_t reaped = 0;
+    // The recency list is in last-use order, so the idle operations are all at its head.
+    while (lru_head_ != kNil) {
+        size_t slot = lru_head_;
+        Slot& entry = table_[slot];
+        if (now_ms <= entry.last_used_ms || now_ms - entry.last_used_ms <= max_idle_ms) break;
+        entry.operation->Abort();
+        Release(slot);
+        ++reaped;
+    }
+    if (reaped) {
+        LOG_I("Reaped %zu operations idle for more than %llu ms", reaped,
+              static_cast<unsigned long long>(max_idle_ms));
+        CountReaped(reaped);
+    }
+    return reaped;
+}
+
+size_t OperationTable::owner_count(uint32_t owner) const {
+    auto count = owner_counts_.find(owner);
+    return count == owner_counts_.end() ? 0 : count->second;
+}
+
+void OperationTable::MakeRoom(uint64_t now_ms) {
+    if (soft_quota_) {
+        uint32_t heaviest = 0;
+        size_t heaviest_count = 0;
+        for (const auto& count : owner_counts_) {
+            if (count.second > heaviest_count) {
+                heaviest = count.first;
+                heaviest_count = count.second;
+            }
+        }
+        if (heaviest_count > soft_quota_) {
+            for (uint32_t slot = lru_head_; slot != kNil; slot = table_[slot].next) {
+                if (table_[slot].owner != heaviest) continue;
+                Evict(slot, now_ms);
+                return;
+            }
         }
     }
-    return false;
+    if (evict_lru_ && lru_head_ != kNil) Evict(lru_head_, now_ms);
+}
+
+void OperationTable::Evict(size_t slot, uint64_t now_ms) {
+    Slot& entry = table_[slot];
+    uint64_t age = now_ms > entry.last_used_ms ? now_ms - entry.last_used_ms : 0;
+    LOG_I("Evicting operation of caller %u, idle for %llu ms", entry.owner,
+          static_cast<unsigned long long>(age));
+
+    entry.operation->Abort();
+    Release(slot);
+
+    ++eviction_stats_.evicted_count;
+    eviction_stats_.total_evicted_age_ms += age;
+    if (age > eviction_stats_.max_evicted_age_ms) eviction_stats_.max_evicted_age_ms = age;
+}
+
+void OperationTable::LinkMostRecent(size_t slot) {
+    Slot& entry = table_[slot];
+    entry.prev = lru_tail_;
+    entry.next = kNil;
+    if (lru_tail_ != kNil) {
+        table_[lru_tail_].next = static_cast<uint32_t>(slot);
+    } else {
+        lru_head_ = static_cast<uint32_t>(slot);
+    }
+    lru_tail_ = static_cast<uint32_t>(slot);
+}
+
+void OperationTable::Unlink(size_t slot) {
+    Slot& entry = table_[slot];
+    if (entry.prev != kNil) {
+        table_[entry.prev].next = entry.next;
+    } else {
+        lru_head_ = entry.next;
+    }
+    if (entry.next != kNil) {
+        table_[entry.next].prev = entry.prev;
+    } else {
+        lru_tail_ = entry.prev;
+    }
+    entry.prev = entry.next = kNil;
 }
 
 }  // namespace keymaster
@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/parsed_key_cache.h>
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include <openssl/aead.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+namespace keymaster {
+
+namespace {
+
+constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+constexpr uint64_t kFnvPrime = 0x100000001b3ULL;
+constexpr size_t kFingerprintEndBytes = 32;
+
+constexpr size_t kSealingKeyLength = 32;
+constexpr size_t kSealingNonceLength = 12;
+constexpr size_t kSealingTagLength = 16;
+
+uint64_t HashBytes(uint64_t hash, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= kFnvPrime;
+    }
+    return hash;
+}
+
+KeymasterBlob SerializeHidden(const AuthorizationSet& hidden) {
+    KeymasterBlob serialized;
+    size_t size = hidden.SerializedSize();
+    if (!serialized.Reset(size)) return {};
+    hidden.Serialize(serialized.writable_data(), serialized.writable_data() + size);
+    return serialized;
+}
+
+bool BlobsEqual(const uint8_t* a, size_t a_size, const uint8_t* b, size_t b_size) {
+    return a_size == b_size && memcmp_s(a, b, a_size) == 0;
+}
+
+// Keys |ctx| with |key| and fills in the nonce for |counter|.  The blob digest is the additional
+// data, so sealed material only opens for the blob it was sealed for.
+bool InitSealing(const KeymasterKeyBlob& key, uint64_t counter, EVP_AEAD_CTX* ctx,
+                 uint8_t (&nonce)[kSealingNonceLength]) {
+    memset(nonce, 0, sizeof(nonce));
+    memcpy(nonce, &counter, sizeof(counter));
+    return EVP_AEAD_CTX_init(ctx, EVP_aead_aes_256_gcm(), key.begin(), key.size(),
+                             kSealingTagLength, nullptr /* engine */);
+}
+
+}  // namespace
+
+bool ParsedKeyCache::Find(km_id_t key_id, const KeymasterKeyBlob& blob,
+                          const AuthorizationSet& hidden, KeymasterKeyBlob* key_material,
+                          AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced,
+                          KeyPolicy* policy, std::shared_ptr<DerivedKeyData>* derived_data) {
+    if (index_.find(key_id) == index_.end() && sealed_index_.find(key_id) == sealed_index_.end()) {
+        ++misses_;
+        return false;
+    }
+    return Find(key_id, blob, SerializeHidden(hidden), key_material, hw_enforced, sw_enforced,
+                policy, derived_data);
+}
+
+bool ParsedKeyCache::Find(km_id_t key_id, const KeymasterKeyBlob& blob,
+                          const KeymasterBlob& serialized_hidden, KeymasterKeyBlob* key_material,
+                          AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced,
+                          KeyPolicy* policy, std::shared_ptr<DerivedKeyData>* derived_data) {
+    bool found = FindEntry(key_id, blob, serialized_hidden, key_material, hw_enforced, sw_enforced,
+                           policy, derived_data);
+    ++(found ? hits_ : misses_);
+    return found;
+}
+
+bool ParsedKeyCache::FindEntry(km_id_t key_id, const KeymasterKeyBlob& blob,
+                               const KeymasterBlob& serialized_hidden,
+                               KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced,
+                               AuthorizationSet* sw_enforced, KeyPolicy* policy,
+                               std::shared_ptr<DerivedKeyData>* derived_data) {
+    auto found = index_.find(key_id);
+    if (found == index_.end()) {
+        if (!Unseal(key_id, blob, serialized_hidden)) return false;
+        found = index_.find(key_id);
+        if (found == index_.end()) return false;
+    }
+
+    Entry& entry = *found->second;
+    if (!BlobsEqual(entry.blob.begin(), entry.blob.size(), blob.begin(), blob.size())) {
+        return false;
+    }
+    if (!BlobsEqual(entry.hidden.begin(), entry.hidden.size(), serialized_hidden.begin(),
+                    serialized_hidden.size())) {
+        return false;
+    }
+
+    *key_material = entry.key_material;
+    if (entry.key_material.size() && !key_material->key_material) return false;
+    // The cached sets are shared, so this only takes references to them, index included.
+    *hw_enforced = entry.hw_enforced;
+    *sw_enforced = entry.sw_enforced;
+    if (hw_enforced->is_valid() != AuthorizationSet::OK ||
+        sw_enforced->is_valid() != AuthorizationSet::OK) {
+        return false;
+    }
+    if (policy) *policy = entry.policy;
+    if (derived_data) *derived_data = entry.derived_data;
+
+    entries_.splice(entries_.begin(), entries_, found->second);
+    return true;
+}
+
+bool ParsedKeyCache::FindKeyId(const KeymasterKeyBlob& blob, km_id_t* key_id) const {
+    uint64_t fingerprint = Fingerprint(blob);
+    auto found = fingerprint_index_.find(fingerprint);
+    if (found != fingerprint_index_.end()) {
+        const Entry& entry = *found->second;
+        if (BlobsEqual(entry.blob.begin(), entry.blob.size(), blob.begin(), blob.size())) {
+            *key_id = entry.key_id;
+            return true;
+        }
+    }
+
+    auto sealed = sealed_fingerprint_index_.find(fingerprint);
+    if (sealed == sealed_fingerprint_index_.end()) return false;
+    BlobDigest digest;
+    SHA256(blob.begin(), blob.size(), digest);
+    if (memcmp_s(digest, sealed->second->blob_digest, sizeof(digest)) != 0) return false;
+    *key_id = sealed->second->key_id;
+    return true;
+}
+
+void ParsedKeyCache::Insert(km_id_t key_id, const KeymasterKeyBlob& blob,
+                            const AuthorizationSet& hidden, const KeymasterKeyBlob& key_material,
+                            const AuthorizationSet& hw_enforced,
+                            const AuthorizationSet& sw_enforced,
+                            std::shared_ptr<DerivedKeyData>* derived_data) {
+    KeymasterBlob serialized_hidden = SerializeHidden(hidden);
+    if (serialized_hidden.size() != hidden.SerializedSize()) {
+        if (derived_data) derived_data->reset();
+        return;
+    }
+    Insert(key_id, blob, serialized_hidden, key_material, hw_enforced, sw_enforced, derived_data);
+}
+
+void ParsedKeyCache::Insert(km_id_t key_id, const KeymasterKeyBlob& blob,
+                            const KeymasterBlob& serialized_hidden,
+                            const KeymasterKeyBlob& key_material,
+                            const AuthorizationSet& hw_enforced,
+                            const AuthorizationSet& sw_enforced,
+                            std::shared_ptr<DerivedKeyData>* derived_data) {
+    if (derived_data) derived_data->reset();
+    if (max_entries_ == 0) return;
+    Invalidate(key_id);
+
+    Entry entry{key_id,      blob,        serialized_hidden, key_material,
+                hw_enforced, sw_enforced, KeyPolicy(),       0,
+                nullptr,     Fingerprint(blob)};
+    if ((blob.size() && !entry.blob.key_material) ||
+        (key_material.size() && !entry.key_material.key_material) ||
+        entry.hidden.size() != serialized_hidden.size() ||
+        entry.hw_enforced.is_valid() != AuthorizationSet::OK ||
+        entry.sw_enforced.is_valid() != AuthorizationSet::OK || !entry.hw_enforced.Share() ||
+        !entry.sw_enforced.Share()) {
+        return;
+    }
+    entry.bytes = EntryBytes(entry);
+    if (entry.bytes > max_bytes_) return;
+    CompileKeyPolicy(AuthProxy(entry.hw_enforced, entry.sw_enforced), &entry.policy);
+    entry.derived_data.reset(new (std::nothrow) DerivedKeyData);
+    if (!entry.derived_data) return;
+    if (derived_data) *derived_data = entry.derived_data;
+
+    Admit(std::move(entry));
+}
+
+void ParsedKeyCache::Invalidate(km_id_t key_id) {
+    auto found = index_.find(key_id);
+    if (found != index_.end()) Erase(found->second);
+    auto sealed = sealed_index_.find(key_id);
+    if (sealed != sealed_index_.end()) EraseSealed(sealed->second);
+}
+
+void ParsedKeyCache::Clear() {
+    // Entry destructors zero the key material and authorization sets.
+    entries_.clear();
+    index_.clear();
+    fingerprint_index_.clear();
+    bytes_ = 0;
+    sealed_entries_.clear();
+    sealed_index_.clear();
+    sealed_fingerprint_index_.clear();
+    sealed_bytes_ = 0;
+}
+
+/* static */
+size_t ParsedKeyCache::EntryBytes(const Entry& entry) {
+    return entry.blob.size() + entry.hidden.size() + entry.key_material.size() +
+           entry.hw_enforced.SerializedSize() + entry.sw_enforced.SerializedSize();
+}
+
+void ParsedKeyCache::Admit(Entry&& entry) {
+    while (!entries_.empty() &&
+           (index_.size() >= max_entries_ || bytes_ + entry.bytes > max_bytes_)) {
+        Seal(std::prev(entries_.end()));
+    }
+
+    bytes_ += entry.bytes;
+    km_id_t key_id = entry.key_id;
+    entries_.push_front(std::move(entry));
+    index_[key_id] = entries_.begin();
+    fingerprint_index_[entries_.begin()->fingerprint] = entries_.begin();
+}
+
+bool ParsedKeyCache::InitSealingKey() {
+    if (sealing_key_.size()) return true;
+    if (!sealing_key_.Reset(kSealingKeyLength)) return false;
+    if (!RAND_bytes(sealing_key_.writable_data(), sealing_key_.size())) {
+        sealing_key_.Clear();
+        return false;
+    }
+    return true;
+}
+
+void ParsedKeyCache::Seal(EntryList::iterator entry) {
+    static_assert(SHA256_DIGEST_LENGTH == kBlobDigestLength, "blob digests are SHA-256");
+    if (max_sealed_entries_ == 0 || !InitSealingKey()) {
+        Erase(entry);
+        return;
+    }
+
+    SealedEntry sealed{entry->key_id,
+                       {},
+                       std::move(entry->hidden),
+                       KeymasterBlob(entry->key_material.size() + kSealingTagLength),
+                       next_nonce_++,
+                       std::move(entry->hw_enforced),
+                       std::move(entry->sw_enforced),
+                       entry->policy,
+                       0,
+                       std::move(entry->derived_data),
+                       entry->fingerprint};
+    SHA256(entry->blob.begin(), entry->blob.size(), sealed.blob_digest);
+
+    bssl::ScopedEVP_AEAD_CTX ctx;
+    uint8_t nonce[kSealingNonceLength];
+    size_t sealed_length;
+    bool ok = sealed.sealed_material.begin() &&
+              InitSealing(sealing_key_, sealed.nonce, ctx.get(), nonce) &&
+              EVP_AEAD_CTX_seal(ctx.get(), sealed.sealed_material.writable_data(), &sealed_length,
+                                sealed.sealed_material.size(), nonce, sizeof(nonce),
+                                entry->key_material.begin(), entry->key_material.size(),
+                                sealed.blob_digest, sizeof(sealed.blob_digest));
+    Erase(entry);
+    if (!ok) return;
+    sealed.bytes = sizeof(sealed.blob_digest) + sealed.hidden.size() +
+                   sealed.sealed_material.size() + sealed.hw_enforced.SerializedSize() +
+                   sealed.sw_enforced.SerializedSize();
+    if (sealed.bytes > max_sealed_bytes_) return;
+
+    while (!sealed_entries_.empty() && (sealed_index_.size() >= max_sealed_entries_ ||
+                                        sealed_bytes_ + sealed.bytes > max_sealed_bytes_)) {
+        EraseSealed(std::prev(sealed_entries_.end()));
+    }
+
+    sealed_bytes_ += sealed.bytes;
+    km_id_t key_id = sealed.key_id;
+    sealed_entries_.push_front(std::move(sealed));
+    sealed_index_[key_id] = sealed_entries_.begin();
+    sealed_fingerprint_index_[sealed_entries_.begin()->fingerprint] = sealed_entries_.begin();
+}
+
+bool ParsedKeyCache::Unseal(km_id_t key_id, const KeymasterKeyBlob& blob,
+                            const KeymasterBlob& serialized_hidden) {
+    auto found = sealed_index_.find(key_id);
+    if (found == sealed_index_.end()) return false;
+
+    SealedEntry& sealed = *found->second;
+    BlobDigest digest;
+    SHA256(blob.begin(), blob.size(), digest);
+    if (memcmp_s(digest, sealed.blob_digest, sizeof(digest)) != 0 ||
+        !BlobsEqual(sealed.hidden.begin(), sealed.hidden.size(), serialized_hidden.begin(),
+                    serialized_hidden.size())) {
+        return false;
+    }
+
+    KeymasterKeyBlob key_material(sealed.sealed_material.size() - kSealingTagLength);
+    bssl::ScopedEVP_AEAD_CTX ctx;
+    uint8_t nonce[kSealingNonceLength];
+    size_t key_material_length;
+    bool opened = (key_material.key_material || !key_material.size()) &&
+                  InitSealing(sealing_key_, sealed.nonce, ctx.get(), nonce) &&
+                  EVP_AEAD_CTX_open(ctx.get(), key_material.writable_data(), &key_material_length,
+                                    key_material.size(), nonce, sizeof(nonce),
+                                    sealed.sealed_material.begin(), sealed.sealed_material.size(),
+                                    sealed.blob_digest, sizeof(sealed.blob_digest));
+    Entry entry{key_id,
+                blob,
+                std::move(sealed.hidden),
+                std::move(key_material),
+                std::move(sealed.hw_enforced),
+                std::move(sealed.sw_enforced),
+                sealed.policy,
+                0,
+                std::move(sealed.derived_data),
+                sealed.fingerprint};
+    EraseSealed(found->second);
+    if (!opened || (blob.size() && !entry.blob.key_material)) return false;
+
+    entry.bytes = EntryBytes(entry);
+    Admit(std::move(entry));
+    ++sealed_hits_;
+    return true;
+}
+
+/* static */
+uint64_t ParsedKeyCache::Fingerprint(const KeymasterKeyBlob& blob) {
+    uint64_t size = blob.size();
+    uint64_t hash = HashBytes(kFnvOffsetBasis, reinterpret_cast<const uint8_t*>(&size),
+                              sizeof(size));
+    size_t end_bytes = std::min(blob.size(), kFingerprintEndBytes);
+    hash = HashBytes(hash, blob.begin(), end_bytes);
+    return HashBytes(hash, blob.end() - end_bytes, end_bytes);
+}
+
+void ParsedKeyCache::Erase(EntryList::iterator entry) {
+    bytes_ -= entry->bytes;
+    index_.erase(entry->key_id);
+    auto fingerprint = fingerprint_index_.find(entry->fingerprint);
+    if (fingerprint != fingerprint_index_.end() && fingerprint->second == entry) {
+        fingerprint_index_.erase(fingerprint);
+    }
+    entries_.erase(entry);
+}
+
+void ParsedKeyCache::EraseSealed(SealedEntryList::iterator entry) {
+    sealed_bytes_ -= entry->bytes;
+    sealed_index_.erase(entry->key_id);
+    auto fingerprint = sealed_fingerprint_index_.find(entry->fingerprint);
+    if (fingerprint != sealed_fingerprint_index_.end() && fingerprint->second == entry) {
+        sealed_fingerprint_index_.erase(fingerprint);
+    }
+    sealed_entries_.erase(entry);
+}
+
+}  // namespace keymaster
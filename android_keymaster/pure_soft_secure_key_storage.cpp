@@ -16,12 +16,24 @@
 
 #include <keymaster/pure_soft_secure_key_storage.h>
 
+#include <algorithm>
+#include <unordered_set>
 #include <vector>
 
 #include <keymaster/logger.h>
+#include <keymaster/serializable.h>
 
 namespace keymaster {
 
+namespace {
+
+// Snapshot layout: magic, version, key ID count, then the key IDs in ascending order.
+constexpr uint32_t kSnapshotMagic = 0x53534B50;  // "PKSS", little-endian.
+constexpr uint32_t kSnapshotVersion = 1;
+constexpr size_t kSnapshotHeaderSize = 3 * sizeof(uint32_t);
+
+}  // namespace
+
 class PureSoftSecureStorageMap {
   public:
     explicit PureSoftSecureStorageMap(uint32_t max_size) : max_size_(max_size) {}
@@ -42,39 +54,77 @@ class PureSoftSecureStorageMap {
     /* Checks if there is still available slot to write key. */
     bool HasSlot() const;
 
+    /* Serializes the key ids into |snapshot|. */
+    bool Snapshot(std::vector<uint8_t>* snapshot) const;
+
+    /* Replaces the key ids with those in |snapshot|.  Leaves the map unchanged on failure. */
+    keymaster_error_t LoadSnapshot(const uint8_t* snapshot, size_t size);
+
   private:
-    std::vector<km_id_t> keyid_list_;
+    std::unordered_set<km_id_t> keyids_;
     const uint32_t max_size_;
 };
 
 bool PureSoftSecureStorageMap::WriteKey(km_id_t keyid) {
-    if (keyid_list_.size() >= max_size_) return false;
-    keyid_list_.push_back(keyid);
+    if (keyids_.count(keyid)) return true;
+    if (keyids_.size() >= max_size_) return false;
+    keyids_.insert(keyid);
     return true;
 }
 
 bool PureSoftSecureStorageMap::KeyExists(km_id_t keyid) const {
-    for (km_id_t key_id : keyid_list_)
-        if (key_id == keyid) return true;
-    return false;
+    return keyids_.count(keyid) != 0;
 }
 
 void PureSoftSecureStorageMap::DeleteKey(km_id_t keyid) {
-    std::vector<km_id_t>::iterator iter;
-    for (iter = keyid_list_.begin(); iter != keyid_list_.end();) {
-        if (*iter == keyid)
-            iter = keyid_list_.erase(iter);
-        else
-            ++iter;
-    }
+    keyids_.erase(keyid);
 }
 
 void PureSoftSecureStorageMap::DeleteAllKeys() {
-    keyid_list_.clear();
+    keyids_.clear();
 }
 
 bool PureSoftSecureStorageMap::HasSlot() const {
-    return keyid_list_.size() < max_size_;
+    return keyids_.size() < max_size_;
+}
+
+bool PureSoftSecureStorageMap::Snapshot(std::vector<uint8_t>* snapshot) const {
+    std::vector<km_id_t> sorted(keyids_.begin(), keyids_.end());
+    std::sort(sorted.begin(), sorted.end());
+
+    snapshot->resize(kSnapshotHeaderSize + sorted.size() * sizeof(km_id_t));
+    uint8_t* buf = snapshot->data();
+    const uint8_t* end = buf + snapshot->size();
+    buf = append_uint32_to_buf(buf, end, kSnapshotMagic);
+    buf = append_uint32_to_buf(buf, end, kSnapshotVersion);
+    buf = append_uint32_to_buf(buf, end, static_cast<uint32_t>(sorted.size()));
+    for (km_id_t keyid : sorted) buf = append_uint64_to_buf(buf, end, keyid);
+    return buf == end;
+}
+
+keymaster_error_t PureSoftSecureStorageMap::LoadSnapshot(const uint8_t* snapshot, size_t size) {
+    const uint8_t* end = snapshot + size;
+    uint32_t magic, version, count;
+    if (!copy_uint32_from_buf(&snapshot, end, &magic) ||
+        !copy_uint32_from_buf(&snapshot, end, &version) ||
+        !copy_uint32_from_buf(&snapshot, end, &count) || magic != kSnapshotMagic ||
+        version != kSnapshotVersion) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    if (count > max_size_) return KM_ERROR_INVALID_ARGUMENT;
+    if (static_cast<size_t>(end - snapshot) != count * sizeof(km_id_t)) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    std::unordered_set<km_id_t> keyids;
+    keyids.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        km_id_t keyid;
+        if (!copy_uint64_from_buf(&snapshot, end, &keyid)) return KM_ERROR_INVALID_ARGUMENT;
+        keyids.insert(keyid);
+    }
+    keyids_ = std::move(keyids);
+    return KM_ERROR_OK;
 }
 
 PureSoftSecureKeyStorage::PureSoftSecureKeyStorage(uint32_t max_slot)
@@ -119,6 +169,18 @@ keymaster_error_t PureSoftSecureKeyStorage::DeleteKey(const km_id_t keyid) {
     return KM_ERROR_OK;
 }
 
+keymaster_error_t PureSoftSecureKeyStorage::DeleteKeys(const km_id_t* keyids, size_t count) {
+    if (!pure_soft_secure_storage_map_) {
+        LOG_S("Pure software secure key storage table not allocated.", 0);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        pure_soft_secure_storage_map_->DeleteKey(keyids[i]);
+    }
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t PureSoftSecureKeyStorage::DeleteAllKeys() {
     if (!pure_soft_secure_storage_map_) {
         LOG_S("Pure software secure key storage table not allocated.", 0);
@@ -139,4 +201,23 @@ keymaster_error_t PureSoftSecureKeyStorage::HasSlot(bool* has_slot) {
     return KM_ERROR_OK;
 }
 
+keymaster_error_t PureSoftSecureKeyStorage::Snapshot(std::vector<uint8_t>* snapshot) const {
+    if (!pure_soft_secure_storage_map_) {
+        LOG_S("Pure software secure key storage table not allocated.", 0);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    if (!pure_soft_secure_storage_map_->Snapshot(snapshot)) return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t PureSoftSecureKeyStorage::LoadSnapshot(const uint8_t* snapshot, size_t size) {
+    if (!pure_soft_secure_storage_map_) {
+        LOG_S("Pure software secure key storage table not allocated.", 0);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    return pure_soft_secure_storage_map_->LoadSnapshot(snapshot, size);
+}
+
 }  // namespace keymaster
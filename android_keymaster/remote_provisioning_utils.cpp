@@ -15,9 +15,14 @@
  */
 
 #include "keymaster/cppcose/cppcose.h"
+#include <keymaster/constant_time.h>
 #include <keymaster/logger.h>
 #include <keymaster/remote_provisioning_utils.h>
+#include <algorithm>
+#include <atomic>
+#include <optional>
 #include <string_view>
+#include <vector>
 
 namespace keymaster {
 
@@ -124,66 +129,102 @@ validateAndExtractEekPubAndId(bool testMode, const KeymasterBlob& endpointEncryp
                           eek->getBstrValue(CoseKey::KEY_ID).value());
 }
 
-StatusOr<cppbor::Array /* pubkeys */>
-validateAndExtractPubkeys(bool testMode, uint32_t numKeys, KeymasterBlob* keysToSign,
-                          const cppcose::HmacSha256Function& macFunction) {
-    auto pubKeysToMac = cppbor::Array();
-    for (size_t i = 0; i < numKeys; i++) {
-        auto [macedKeyItem, _, coseMacErrMsg] =
-            cppbor::parse(keysToSign[i].begin(), keysToSign[i].end());
-        if (!macedKeyItem || !macedKeyItem->asArray() ||
-            macedKeyItem->asArray()->size() != kCoseMac0EntryCount) {
-            LOG_E("Invalid COSE_Mac0 structure", 0);
-            return kStatusFailed;
-        }
+namespace {
 
-        auto protectedParms = macedKeyItem->asArray()->get(kCoseMac0ProtectedParams)->asBstr();
-        auto unprotectedParms = macedKeyItem->asArray()->get(kCoseMac0UnprotectedParams)->asMap();
-        auto payload = macedKeyItem->asArray()->get(kCoseMac0Payload)->asBstr();
-        auto tag = macedKeyItem->asArray()->get(kCoseMac0Tag)->asBstr();
-        if (!protectedParms || !unprotectedParms || !payload || !tag) {
-            LOG_E("Invalid COSE_Mac0 contents", 0);
-            return kStatusFailed;
-        }
+// Keys are cheap to check, so fewer than this per thread isn't worth starting a thread for.
+constexpr size_t kMinKeysPerThread = 8;
 
-        auto [protectedMap, __, errMsg] = cppbor::parse(protectedParms);
-        if (!protectedMap || !protectedMap->asMap()) {
-            LOG_E("Invalid Mac0 protected: %s", errMsg.c_str());
-            return kStatusFailed;
-        }
-        auto& algo = protectedMap->asMap()->get(ALGORITHM);
-        if (!algo || !algo->asInt() || algo->asInt()->value() != HMAC_256) {
-            LOG_E("Unsupported Mac0 algorithm", 0);
-            return kStatusFailed;
-        }
+keymaster_error_t validateAndExtractPubkey(bool testMode, const KeymasterBlob& keyToSign,
+                                           const cppcose::HmacSha256Function& macFunction,
+                                           std::optional<cppbor::Map>* pubKeyMap) {
+    auto [macedKeyItem, _, coseMacErrMsg] = cppbor::parse(keyToSign.begin(), keyToSign.end());
+    if (!macedKeyItem || !macedKeyItem->asArray() ||
+        macedKeyItem->asArray()->size() != kCoseMac0EntryCount) {
+        LOG_E("Invalid COSE_Mac0 structure", 0);
+        return kStatusFailed;
+    }
 
-        auto pubKey = CoseKey::parse(payload->value(), EC2, ES256, P256);
-        if (!pubKey) {
-            LOG_E("%s", pubKey.moveMessage().c_str());
-            return kStatusFailed;
-        }
+    auto protectedParms = macedKeyItem->asArray()->get(kCoseMac0ProtectedParams)->asBstr();
+    auto unprotectedParms = macedKeyItem->asArray()->get(kCoseMac0UnprotectedParams)->asMap();
+    auto payload = macedKeyItem->asArray()->get(kCoseMac0Payload)->asBstr();
+    auto tag = macedKeyItem->asArray()->get(kCoseMac0Tag)->asBstr();
+    if (!protectedParms || !unprotectedParms || !payload || !tag) {
+        LOG_E("Invalid COSE_Mac0 contents", 0);
+        return kStatusFailed;
+    }
 
-        bool testKey = static_cast<bool>(pubKey->getMap().get(CoseKey::TEST_KEY));
-        if (testMode && !testKey) {
-            LOG_E("Production key in test request", 0);
-            return kStatusProductionKeyInTestRequest;
-        } else if (!testMode && testKey) {
-            LOG_E("Test key in production request", 0);
-            return kStatusTestKeyInProductionRequest;
-        }
+    auto [protectedMap, __, errMsg] = cppbor::parse(protectedParms);
+    if (!protectedMap || !protectedMap->asMap()) {
+        LOG_E("Invalid Mac0 protected: %s", errMsg.c_str());
+        return kStatusFailed;
+    }
+    auto& algo = protectedMap->asMap()->get(ALGORITHM);
+    if (!algo || !algo->asInt() || algo->asInt()->value() != HMAC_256) {
+        LOG_E("Unsupported Mac0 algorithm", 0);
+        return kStatusFailed;
+    }
 
-        auto macTag = generateCoseMac0Mac(macFunction, {} /* external_aad */, payload->value());
-        if (!macTag) {
-            LOG_E("%s", macTag.moveMessage().c_str());
-            return kStatusInvalidMac;
-        }
-        if (macTag->size() != tag->value().size() ||
-            CRYPTO_memcmp(macTag->data(), tag->value().data(), macTag->size()) != 0) {
-            LOG_E("MAC tag mismatch", 0);
-            return kStatusInvalidMac;
+    auto pubKey = CoseKey::parse(payload->value(), EC2, ES256, P256);
+    if (!pubKey) {
+        LOG_E("%s", pubKey.moveMessage().c_str());
+        return kStatusFailed;
+    }
+
+    bool testKey = static_cast<bool>(pubKey->getMap().get(CoseKey::TEST_KEY));
+    if (testMode && !testKey) {
+        LOG_E("Production key in test request", 0);
+        return kStatusProductionKeyInTestRequest;
+    } else if (!testMode && testKey) {
+        LOG_E("Test key in production request", 0);
+        return kStatusTestKeyInProductionRequest;
+    }
+
+    auto macTag = generateCoseMac0Mac(macFunction, {} /* external_aad */, payload->value());
+    if (!macTag) {
+        LOG_E("%s", macTag.moveMessage().c_str());
+        return kStatusInvalidMac;
+    }
+    if (macTag->size() != tag->value().size() ||
+        !ConstantTimeEquals(macTag->data(), tag->value().data(), macTag->size())) {
+        LOG_E("MAC tag mismatch", 0);
+        return kStatusInvalidMac;
+    }
+
+    *pubKeyMap = pubKey->moveMap();
+    return KM_ERROR_OK;
+}
+
+}  // namespace
+
+StatusOr<cppbor::Array /* pubkeys */>
+validateAndExtractPubkeys(bool testMode, uint32_t numKeys, KeymasterBlob* keysToSign,
+                          const cppcose::HmacSha256Function& macFunction, size_t threadCount,
+                          WorkerPool* pool) {
+    std::vector<std::optional<cppbor::Map>> pubKeyMaps(numKeys);
+    std::vector<keymaster_error_t> errors(numKeys, KM_ERROR_OK);
+    std::atomic<size_t> next(0);
+    // Lowest index of a bad key found so far.  Keys after it needn't be checked.
+    std::atomic<size_t> firstError(numKeys);
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < numKeys && i < firstError.load();) {
+            errors[i] =
+                validateAndExtractPubkey(testMode, keysToSign[i], macFunction, &pubKeyMaps[i]);
+            if (errors[i] == KM_ERROR_OK) continue;
+            size_t current = firstError.load();
+            while (i < current && !firstError.compare_exchange_weak(current, i)) {
+            }
         }
+    };
 
-        pubKeysToMac.add(pubKey->moveMap());
+    size_t maxThreads = numKeys / kMinKeysPerThread;
+    RunInParallel(pool, std::min(threadCount, maxThreads ? maxThreads : 1), worker);
+
+    // Report the first bad key, whichever thread found it, so the result doesn't depend on timing.
+    if (firstError.load() < numKeys) return errors[firstError.load()];
+
+    auto pubKeysToMac = cppbor::Array();
+    for (size_t i = 0; i < numKeys; i++) {
+        pubKeysToMac.add(std::move(*pubKeyMaps[i]));
     }
 
     return pubKeysToMac;
@@ -0,0 +1,217 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/request_trace.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include <openssl/sha.h>
+
+namespace keymaster {
+
+namespace {
+
+uint64_t TimeUs(uint64_t ns) {
+    return ns / 1000;
+}
+
+bool IsRedacted(keymaster_tag_t tag) {
+    switch (keymaster_tag_get_type(tag)) {
+    case KM_BYTES:
+    case KM_BIGNUM:
+        return tag != KM_TAG_CERTIFICATE_SUBJECT && tag != KM_TAG_CERTIFICATE_SERIAL;
+    default:
+        return false;
+    }
+}
+
+// Copies |params| into |redacted| with the value of every redacted tag zeroed.
+void Redact(const AuthorizationSet& params, AuthorizationSet* redacted) {
+    size_t longest = 0;
+    for (const auto& param : params) {
+        if (IsRedacted(param.tag)) longest = std::max(longest, param.blob.data_length);
+    }
+    std::vector<uint8_t> zeros(longest);
+    for (keymaster_key_param_t param : params) {
+        if (IsRedacted(param.tag)) param.blob.data = zeros.data();
+        redacted->push_back(param);
+    }
+}
+
+}  // namespace
+
+size_t TraceRecord::SerializedSize() const {
+    return varint_size(command) + varint_size(static_cast<uint32_t>(message_version)) +
+           varint_size(arrival_us) + varint_size(duration_us) +
+           varint_size(static_cast<uint32_t>(error)) + varint_size(key_id) +
+           varint_size(created_key_id) + varint_size(op_id) + varint_size(purpose) +
+           varint_size(key_format) + varint_size(input_length) + params.SerializedSize() +
+           key_characteristics.SerializedSize();
+}
+
+uint8_t* TraceRecord::Serialize(uint8_t* buf, const uint8_t* end) const {
+    buf = append_varint_to_buf(buf, end, command);
+    buf = append_varint_to_buf(buf, end, static_cast<uint32_t>(message_version));
+    buf = append_varint_to_buf(buf, end, arrival_us);
+    buf = append_varint_to_buf(buf, end, duration_us);
+    buf = append_varint_to_buf(buf, end, static_cast<uint32_t>(error));
+    buf = append_varint_to_buf(buf, end, key_id);
+    buf = append_varint_to_buf(buf, end, created_key_id);
+    buf = append_varint_to_buf(buf, end, op_id);
+    buf = append_varint_to_buf(buf, end, purpose);
+    buf = append_varint_to_buf(buf, end, key_format);
+    buf = append_varint_to_buf(buf, end, input_length);
+    buf = params.Serialize(buf, end);
+    return key_characteristics.Serialize(buf, end);
+}
+
+bool TraceRecord::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint64_t values[11];
+    for (auto& value : values) {
+        if (!copy_varint_from_buf(buf_ptr, end, &value)) return false;
+    }
+    for (size_t i = 0; i < 11; ++i) {
+        // Only the times and the input length are wider than 32 bits.
+        if (i != 2 && i != 3 && i != 10 && values[i] > UINT32_MAX) return false;
+    }
+    command = static_cast<AndroidKeymasterCommand>(values[0]);
+    message_version = static_cast<int32_t>(values[1]);
+    arrival_us = values[2];
+    duration_us = values[3];
+    error = static_cast<keymaster_error_t>(static_cast<int32_t>(values[4]));
+    key_id = values[5];
+    created_key_id = values[6];
+    op_id = values[7];
+    purpose = static_cast<keymaster_purpose_t>(values[8]);
+    key_format = static_cast<keymaster_key_format_t>(values[9]);
+    input_length = values[10];
+    return params.Deserialize(buf_ptr, end) && key_characteristics.Deserialize(buf_ptr, end);
+}
+
+RequestTraceWriter::RequestTraceWriter(FILE* file) : file_(file), start_ns_(now_ns()) {}
+
+uint64_t RequestTraceWriter::now_ns() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+size_t RequestTraceWriter::dropped() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return dropped_;
+}
+
+uint32_t RequestTraceWriter::KeyId(const keymaster_key_blob_t& key_blob) {
+    uint8_t digest[SHA256_DIGEST_LENGTH];
+    SHA256(key_blob.key_material, key_blob.key_material_size, digest);
+    auto inserted = key_ids_.emplace(std::string(reinterpret_cast<char*>(digest), sizeof(digest)),
+                                     key_described_.size() + 1);
+    if (inserted.second) key_described_.push_back(false);
+    return inserted.first->second;
+}
+
+void RequestTraceWriter::Record(const RecordedRequest& request) {
+    TraceRecord record;
+    record.command = request.command;
+    record.message_version = request.message_version;
+    record.arrival_us = TimeUs(request.arrival_ns > start_ns_ ? request.arrival_ns - start_ns_ : 0);
+    record.duration_us = TimeUs(request.duration_ns);
+    record.error = request.error;
+    record.purpose = request.purpose;
+    record.key_format = request.key_format;
+    record.input_length = request.input_length;
+    if (request.params) Redact(*request.params, &record.params);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (request.key_blob && request.key_blob->key_material_size) {
+        record.key_id = KeyId(*request.key_blob);
+        if (!key_described_[record.key_id - 1] && request.key_hw_enforced &&
+            request.key_sw_enforced) {
+            Redact(*request.key_hw_enforced, &record.key_characteristics);
+            Redact(*request.key_sw_enforced, &record.key_characteristics);
+            key_described_[record.key_id - 1] = true;
+        }
+    }
+    if (request.created_key_blob && request.created_key_blob->key_material_size) {
+        record.created_key_id = KeyId(*request.created_key_blob);
+        key_described_[record.created_key_id - 1] = true;
+    }
+
+    if (request.command == BEGIN_OPERATION) {
+        if (request.error == KM_ERROR_OK) {
+            record.op_id = next_op_id_++;
+            op_ids_[request.op_handle] = record.op_id;
+        }
+    } else if (request.op_handle) {
+        auto found = op_ids_.find(request.op_handle);
+        if (found != op_ids_.end()) {
+            record.op_id = found->second;
+            // Finish, abort and any error end the operation.
+            if (request.command != UPDATE_OPERATION || request.error != KM_ERROR_OK) {
+                op_ids_.erase(found);
+            }
+        }
+    }
+
+    if (!header_written_) {
+        uint8_t header[kRequestTraceHeaderSize];
+        uint8_t* p = append_uint32_to_buf(header, header + sizeof(header), kRequestTraceMagic);
+        append_uint32_to_buf(p, header + sizeof(header), kRequestTraceVersion);
+        header_written_ = fwrite(header, sizeof(header), 1, file_) == 1;
+        if (!header_written_) {
+            ++dropped_;
+            return;
+        }
+    }
+
+    size_t size = record.SerializedSize();
+    std::vector<uint8_t> buf(varint_size(size) + size);
+    uint8_t* p = append_varint_to_buf(buf.data(), buf.data() + buf.size(), size);
+    if (record.Serialize(p, buf.data() + buf.size()) != buf.data() + buf.size() ||
+        fwrite(buf.data(), buf.size(), 1, file_) != 1) {
+        ++dropped_;
+    }
+}
+
+bool ReadRequestTrace(const uint8_t* data, size_t size, std::vector<TraceRecord>* records) {
+    const uint8_t* end = data + size;
+    uint32_t magic, version;
+    if (!copy_uint32_from_buf(&data, end, &magic) || magic != kRequestTraceMagic ||
+        !copy_uint32_from_buf(&data, end, &version) || version != kRequestTraceVersion) {
+        return false;
+    }
+
+    bool ok = true;
+    while (data < end) {
+        uint64_t length;
+        if (!copy_varint_from_buf(&data, end, &length) || length > size_t(end - data)) break;
+        const uint8_t* record_end = data + length;
+        TraceRecord record;
+        if (!record.Deserialize(&data, record_end) || data != record_end) {
+            ok = false;
+            break;
+        }
+        records->push_back(std::move(record));
+    }
+    std::stable_sort(records->begin(), records->end(),
+                     [](const TraceRecord& a, const TraceRecord& b) {
+                         return a.arrival_us < b.arrival_us;
+                     });
+    return ok;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,190 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/secret_arena.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <new>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+namespace {
+
+// Returns the index of the smallest size class that holds |size| bytes.
+size_t SizeClass(size_t size) {
+    size_t size_class = 0;
+    while ((SecretArena::kMinAllocation << size_class) < size)
+        ++size_class;
+    return size_class;
+}
+
+#ifdef __linux__
+
+size_t PageSize() {
+    static const size_t page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+// Maps |size| bytes between two guard pages, returning the first usable byte.
+uint8_t* MapGuarded(size_t size) {
+    size_t page_size = PageSize();
+    void* mapping =
+        mmap(nullptr, size + 2 * page_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return nullptr;
+    uint8_t* data = static_cast<uint8_t*>(mapping) + page_size;
+    if (mprotect(data, size, PROT_READ | PROT_WRITE) != 0) {
+        munmap(mapping, size + 2 * page_size);
+        return nullptr;
+    }
+    madvise(data, size, MADV_DONTDUMP);
+    return data;
+}
+
+void UnmapGuarded(uint8_t* data, size_t size) {
+    size_t page_size = PageSize();
+    munmap(data - page_size, size + 2 * page_size);
+}
+
+#endif  // __linux__
+
+}  // namespace
+
+SecretArena::~SecretArena() {
+#ifdef __linux__
+    for (size_t i = 0; i < chunk_count_; ++i) {
+        memset_s(chunks_[i].data, 0, kChunkSize);
+        if (chunks_[i].locked) munlock(chunks_[i].data, kChunkSize);
+        UnmapGuarded(chunks_[i].data, kChunkSize);
+    }
+#endif  // __linux__
+}
+
+bool SecretArena::AddChunk(size_t size_class) {
+#ifdef __linux__
+    size_t index = chunk_count_.load(std::memory_order_relaxed);
+    if (index == kMaxChunks) return false;
+
+    Chunk& chunk = chunks_[index];
+    chunk.data = MapGuarded(kChunkSize);
+    if (!chunk.data) return false;
+    chunk.slot_size = kMinAllocation << size_class;
+    // Locking can fail under a small RLIMIT_MEMLOCK; the chunk is still worth having for its guard
+    // pages and its exclusion from core dumps.
+    chunk.locked = mlock(chunk.data, kChunkSize) == 0;
+
+    for (size_t offset = kChunkSize; offset >= chunk.slot_size;) {
+        offset -= chunk.slot_size;
+        FreeSlot* slot = reinterpret_cast<FreeSlot*>(chunk.data + offset);
+        slot->next = free_slots_[size_class];
+        free_slots_[size_class] = slot;
+    }
+
+    ++stats_.chunks;
+    if (chunk.locked) ++stats_.locked_chunks;
+    chunk_count_.store(index + 1, std::memory_order_release);
+    return true;
+#else   // __linux__
+    (void)size_class;
+    return false;
+#endif  // __linux__
+}
+
+void* SecretArena::Allocate(size_t size) {
+    if (size > kMaxAllocation) return nullptr;
+    size_t size_class = SizeClass(size);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_slots_[size_class] && !AddChunk(size_class)) return nullptr;
+
+    FreeSlot* slot = free_slots_[size_class];
+    free_slots_[size_class] = slot->next;
+    slot->next = nullptr;
+
+    stats_.bytes_in_use += kMinAllocation << size_class;
+    if (stats_.bytes_in_use > stats_.high_water_mark) {
+        stats_.high_water_mark = stats_.bytes_in_use;
+    }
+    return slot;
+}
+
+void SecretArena::Free(void* ptr, size_t size) {
+    const Chunk* chunk = FindChunk(ptr);
+    if (!chunk) return;
+    memset_s(ptr, 0, size < chunk->slot_size ? size : chunk->slot_size);
+
+    size_t size_class = SizeClass(chunk->slot_size);
+    std::lock_guard<std::mutex> lock(mutex_);
+    FreeSlot* slot = static_cast<FreeSlot*>(ptr);
+    slot->next = free_slots_[size_class];
+    free_slots_[size_class] = slot;
+    stats_.bytes_in_use -= chunk->slot_size;
+}
+
+const SecretArena::Chunk* SecretArena::FindChunk(const void* ptr) const {
+    if (!ptr) return nullptr;
+    const uint8_t* p = static_cast<const uint8_t*>(ptr);
+    size_t count = chunk_count_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; ++i) {
+        if (p >= chunks_[i].data && p < chunks_[i].data + kChunkSize) return &chunks_[i];
+    }
+    return nullptr;
+}
+
+bool SecretArena::Owns(const void* ptr) const {
+    return FindChunk(ptr) != nullptr;
+}
+
+SecretArena::Stats SecretArena::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+SecretArena* DefaultSecretArena() {
+#ifdef __linux__
+    // Leaked deliberately, so that blobs destroyed during static destruction can still be freed.
+    static SecretArena* arena = new (std::nothrow) SecretArena();
+    return arena;
+#else   // __linux__
+    return nullptr;
+#endif  // __linux__
+}
+
+uint8_t* NewSecretArray(size_t size) {
+    SecretArena* arena = DefaultSecretArena();
+    void* data = arena ? arena->Allocate(size) : nullptr;
+    if (data) return static_cast<uint8_t*>(data);
+    return new (std::nothrow) uint8_t[size];
+}
+
+void DeleteSecretArray(uint8_t* ptr, size_t size) {
+    SecretArena* arena = DefaultSecretArena();
+    if (arena && arena->Owns(ptr)) return arena->Free(ptr, size);
+    memset_s(ptr, 0, size);
+    delete[] ptr;
+}
+
+bool IsSecretArray(const void* ptr) {
+    SecretArena* arena = DefaultSecretArena();
+    return arena && arena->Owns(ptr);
+}
+
+}  // namespace keymaster
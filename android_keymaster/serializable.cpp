@@ -22,12 +22,6 @@
 
 namespace keymaster {
 
-bool __buffer_bound_check(const uint8_t* buf, const uint8_t* end, size_t len) {
-    uintptr_t buf_next;
-    bool overflow_occurred = __builtin_add_overflow(__pval(buf), len, &buf_next);
-    return (!overflow_occurred) && (buf_next <= __pval(end));
-}
-
 uint8_t* append_to_buf(uint8_t* buf, const uint8_t* end, const void* data, size_t data_len) {
     if (__buffer_bound_check(buf, end, data_len)) {
         memcpy(buf, data, data_len);
@@ -37,6 +31,98 @@ uint8_t* append_to_buf(uint8_t* buf, const uint8_t* end, const void* data, size_
     }
 }
 
+size_t varint_size(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+uint8_t* append_varint_to_buf(uint8_t* buf, const uint8_t* end, uint64_t value) {
+    if (!__buffer_bound_check(buf, end, varint_size(value))) return buf;
+    while (value >= 0x80) {
+        *buf++ = static_cast<uint8_t>(value | 0x80);
+        value >>= 7;
+    }
+    *buf++ = static_cast<uint8_t>(value);
+    return buf;
+}
+
+bool Serializable::SerializeTo(SerializationSink* sink) const {
+    size_t size = SerializedSize();
+    if (size == 0) return sink->ok();
+    uint8_t* buf = sink->Reserve(size);
+    if (!buf) return false;
+    return Serialize(buf, buf + size) == buf + size;
+}
+
+bool SerializationSink::Write(const void* data, size_t data_len) {
+    if (data_len == 0) return ok_;
+    uint8_t* dest = Reserve(data_len);
+    if (!dest) return false;
+    memcpy(dest, data, data_len);
+    return true;
+}
+
+bool SerializationSink::WriteReference(const void* data, size_t data_len) {
+    if (data_len < reference_threshold_) return Write(data, data_len);
+    if (!ok_ || !AddSegment(static_cast<const uint8_t*>(data), data_len)) return false;
+    size_ += data_len;
+    return true;
+}
+
+uint8_t* SerializationSink::Reserve(size_t len) {
+    if (!ok_ || len == 0) return nullptr;
+    if (scratch_capacity_ - scratch_used_ < len) {
+        size_t size = len > kScratchChunkSize ? len : kScratchChunkSize;
+        scratch_ = arena_->AllocateArray<uint8_t>(size);
+        if (!scratch_) {
+            ok_ = false;
+            return nullptr;
+        }
+        scratch_used_ = 0;
+        scratch_capacity_ = size;
+    }
+
+    uint8_t* dest = scratch_ + scratch_used_;
+    scratch_used_ += len;
+    Segment* last = segment_count_ ? &segments_[segment_count_ - 1] : nullptr;
+    if (last && last->data + last->length == dest) {
+        last->length += len;
+    } else if (!AddSegment(dest, len)) {
+        return nullptr;
+    }
+    size_ += len;
+    return dest;
+}
+
+bool SerializationSink::AddSegment(const uint8_t* data, size_t length) {
+    if (segment_count_ == segment_capacity_) {
+        size_t new_capacity = segment_capacity_ ? segment_capacity_ * 2 : 8;
+        Segment* new_segments = arena_->AllocateArray<Segment>(new_capacity);
+        if (!new_segments) {
+            ok_ = false;
+            return false;
+        }
+        if (segment_count_) memcpy(new_segments, segments_, segment_count_ * sizeof(Segment));
+        segments_ = new_segments;
+        segment_capacity_ = new_capacity;
+    }
+    segments_[segment_count_++] = {data, length};
+    return true;
+}
+
+uint8_t* SerializationSink::Flatten(uint8_t* buf, const uint8_t* end) const {
+    if (!__buffer_bound_check(buf, end, size_)) return buf;
+    for (size_t i = 0; i < segment_count_; ++i) {
+        memcpy(buf, segments_[i].data, segments_[i].length);
+        buf += segments_[i].length;
+    }
+    return buf;
+}
+
 bool copy_from_buf(const uint8_t** buf_ptr, const uint8_t* end, void* dest, size_t size) {
     if (__buffer_bound_check(*buf_ptr, end, size)) {
         memcpy(dest, *buf_ptr, size);
@@ -47,6 +133,23 @@ bool copy_from_buf(const uint8_t** buf_ptr, const uint8_t* end, void* dest, size
     }
 }
 
+bool copy_varint_from_buf(const uint8_t** buf_ptr, const uint8_t* end, uint64_t* value) {
+    const uint8_t* p = *buf_ptr;
+    uint64_t result = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (!__buffer_bound_check(p, end, 1)) return false;
+        uint8_t byte = *p++;
+        if (shift == 63 && byte > 1) return false;
+        result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (byte & 0x80) continue;
+        if (byte == 0 && shift > 0) return false;
+        *value = result;
+        *buf_ptr = p;
+        return true;
+    }
+    return false;
+}
+
 bool copy_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size,
                                  UniquePtr<uint8_t[]>* dest) {
     if (!copy_uint32_from_buf(buf_ptr, end, size)) return false;
@@ -67,17 +170,47 @@ bool copy_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end, si
     }
 }
 
+bool view_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end,
+                                 const uint8_t** data, size_t* size) {
+    if (!copy_uint32_from_buf(buf_ptr, end, size)) return false;
+    if (!__buffer_bound_check(*buf_ptr, end, *size)) return false;
+    *data = *buf_ptr;
+    *buf_ptr += *size;
+    return true;
+}
+
+namespace {
+
+// Growth of a buffer that already holds data is geometric, so that streaming many small chunks
+// into it copies a linear amount of data in total, but never adds more than this at a time.
+constexpr size_t kMaxBufferGrowth = 64 * 1024;
+
+}  // namespace
+
 bool Buffer::reserve(size_t size) {
     if (available_write() < size) {
         if (!valid_buffer_state()) {
             return false;
         }
 
-        size_t new_size = buffer_size_ + size - available_write();
-        uint8_t* new_buffer = new (std::nothrow) uint8_t[new_size];
+        size_t new_size = available_read() + size;
+        if (new_size < size) return false;  // Overflow check
+        if (size_hint_ > new_size) {
+            new_size = size_hint_;
+        } else if (available_read() > 0) {
+            size_t growth = (buffer_size_ < kMaxBufferGrowth) ? buffer_size_ : kMaxBufferGrowth;
+            if (buffer_size_ + growth > new_size) new_size = buffer_size_ + growth;
+        }
+
+        uint8_t* new_buffer = NewArray<uint8_t>(arena(), new_size);
         if (!new_buffer) return false;
         memcpy(new_buffer, buffer_.get() + read_position_, available_read());
-        memset_s(buffer_.get(), 0, buffer_size_);
+        if (external_) {
+            buffer_.release();
+            external_ = false;
+        } else {
+            memset_s(buffer_.get(), 0, buffer_size_);
+        }
         buffer_.reset(new_buffer);
         buffer_size_ = new_size;
         write_position_ -= read_position_;
@@ -88,7 +221,7 @@ bool Buffer::reserve(size_t size) {
 
 bool Buffer::Reinitialize(size_t size) {
     Clear();
-    buffer_.reset(new (std::nothrow) uint8_t[size]);
+    buffer_.reset(NewArray<uint8_t>(arena(), size));
     if (!buffer_.get()) return false;
     buffer_size_ = size;
     read_position_ = 0;
@@ -100,7 +233,7 @@ bool Buffer::Reinitialize(const void* data, size_t data_len) {
     Clear();
     if (__pval(data) + data_len < __pval(data))  // Pointer wrap check
         return false;
-    buffer_.reset(new (std::nothrow) uint8_t[data_len]);
+    buffer_.reset(NewArray<uint8_t>(arena(), data_len));
     if (!buffer_.get()) return false;
     buffer_size_ = data_len;
     memcpy(buffer_.get(), data, data_len);
@@ -164,20 +297,49 @@ uint8_t* Buffer::Serialize(uint8_t* buf, const uint8_t* end) const {
     return append_size_and_data_to_buf(buf, end, peek_read(), available_read());
 }
 
+bool Buffer::SerializeTo(SerializationSink* sink) const {
+    return sink->WriteSizeAndData(peek_read(), available_read());
+}
+
 bool Buffer::Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
     Clear();
-    if (!copy_size_and_data_from_buf(buf_ptr, end, &buffer_size_, &buffer_)) {
+    size_t size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &size)) return false;
+    if (size == 0) return true;
+    if (!__buffer_bound_check(*buf_ptr, end, size)) return false;
+
+    buffer_.reset(NewArray<uint8_t>(arena(), size));
+    if (!buffer_.get() || !copy_from_buf(buf_ptr, end, buffer_.get(), size)) {
         buffer_.reset();
-        buffer_size_ = 0;
         return false;
     }
+    buffer_size_ = size;
     write_position_ = buffer_size_;
     return true;
 }
 
+void Buffer::set_arena(Arena* arena) {
+    if (arena == this->arena()) return;
+    Clear();
+    buffer_.get_deleter().arena = arena;
+}
+
+void Buffer::UseExternalStorage(uint8_t* storage, size_t size) {
+    Clear();
+    buffer_.reset(storage);
+    buffer_size_ = size;
+    external_ = true;
+}
+
 void Buffer::Clear() {
-    memset_s(buffer_.get(), 0, buffer_size_);
-    buffer_.reset();
+    if (external_) {
+        // The storage belongs to the caller, who decides what happens to its contents.
+        buffer_.release();
+        external_ = false;
+    } else {
+        memset_s(buffer_.get(), 0, buffer_size_);
+        buffer_.reset();
+    }
     read_position_ = 0;
     write_position_ = 0;
     buffer_size_ = 0;
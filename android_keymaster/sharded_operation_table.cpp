@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/sharded_operation_table.h>
+
+#include <utility>
+
+#include <keymaster/operation.h>
+
+namespace keymaster {
+
+ShardedOperationTable::ShardedOperationTable(size_t table_size, size_t shard_count)
+    : OperationTable(table_size), shard_count_(shard_count ? shard_count : 1) {
+    shards_.reserve(shard_count_);
+    for (size_t i = 0; i < shard_count_; ++i) {
+        shards_.emplace_back(new (std::nothrow) Shard(table_size));
+    }
+}
+
+ShardedOperationTable::~ShardedOperationTable() {
+    for (auto& shard : shards_) {
+        if (!shard) continue;
+        for (auto& entry : shard->locks) delete entry.second;
+    }
+}
+
+ShardedOperationTable::Shard*
+ShardedOperationTable::ShardFor(keymaster_operation_handle_t op_handle) {
+    // The high half of the handle is pseudorandom and survives tagging by the per-shard tables.
+    uint64_t mixed = (op_handle >> 32) * 0x9E3779B97F4A7C15ULL;
+    return shards_[(mixed >> 32) % shard_count_].get();
+}
+
+void ShardedOperationTable::Unref(OperationLock* lock) {
+    if (--lock->users == 0 && !lock->live) delete lock;
+}
+
+bool ShardedOperationTable::AddOwnerOperation(uint32_t owner) {
+    std::lock_guard<std::mutex> guard(owners_mutex_);
+    size_t& count = owner_operations_[owner];
+    if (hard_quota() && count >= hard_quota()) {
+        if (count == 0) owner_operations_.erase(owner);
+        CountQuotaRejected();
+        return false;
+    }
+    ++count;
+    return true;
+}
+
+void ShardedOperationTable::RemoveOwnerOperation(uint32_t owner) {
+    std::lock_guard<std::mutex> guard(owners_mutex_);
+    auto count = owner_operations_.find(owner);
+    if (count != owner_operations_.end() && --count->second == 0) owner_operations_.erase(count);
+}
+
+size_t ShardedOperationTable::owner_count(uint32_t owner) const {
+    std::lock_guard<std::mutex> guard(owners_mutex_);
+    auto count = owner_operations_.find(owner);
+    return count == owner_operations_.end() ? 0 : count->second;
+}
+
+keymaster_error_t ShardedOperationTable::Add(OperationPtr&& operation, uint64_t now_ms) {
+    if (!operation) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    // The high half selects the shard, so it's assigned here; the shard's table keeps it.
+    AssignHandleHighHalf(operation.get());
+    Shard* shard = ShardFor(operation->operation_handle());
+    if (!shard) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    if (over_budget()) {
+        CountOverBudget();
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    uint32_t owner = operation->owner();
+    if (!AddOwnerOperation(owner)) return KM_ERROR_TOO_MANY_OPERATIONS;
+    if (in_use_.fetch_add(1) >= table_size()) {
+        --in_use_;
+        RemoveOwnerOperation(owner);
+        return KM_ERROR_TOO_MANY_OPERATIONS;
+    }
+
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    Operation* added = operation.get();
+    size_t footprint = shard->table.memory_stats().footprint;
+    keymaster_error_t error = shard->table.Add(std::move(operation), now_ms);
+    AdjustFootprint(footprint, shard->table.memory_stats().footprint);
+    if (error != KM_ERROR_OK) {
+        --in_use_;
+        RemoveOwnerOperation(owner);
+        return error;
+    }
+
+    keymaster_operation_handle_t op_handle = added->operation_handle();
+    OperationLock* lock = new (std::nothrow) OperationLock(shard);
+    if (!lock) {
+        footprint = shard->table.memory_stats().footprint;
+        shard->table.Delete(op_handle);
+        AdjustFootprint(footprint, shard->table.memory_stats().footprint);
+        --in_use_;
+        RemoveOwnerOperation(owner);
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    shard->locks[op_handle] = lock;
+    return KM_ERROR_OK;
+}
+
+Operation* ShardedOperationTable::Find(keymaster_operation_handle_t op_handle) {
+    Shard* shard = ShardFor(op_handle);
+    if (!shard) return nullptr;
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    return shard->table.Find(op_handle);
+}
+
+bool ShardedOperationTable::Delete(keymaster_operation_handle_t op_handle) {
+    Shard* shard = ShardFor(op_handle);
+    if (!shard) return false;
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    Operation* operation = shard->table.Find(op_handle);
+    if (!operation) return false;
+    uint32_t owner = operation->owner();
+    size_t footprint = shard->table.memory_stats().footprint;
+    if (!shard->table.Delete(op_handle)) return false;
+    AdjustFootprint(footprint, shard->table.memory_stats().footprint);
+    --in_use_;
+    RemoveOwnerOperation(owner);
+
+    auto entry = shard->locks.find(op_handle);
+    if (entry != shard->locks.end()) {
+        OperationLock* lock = entry->second;
+        shard->locks.erase(entry);
+        lock->live = false;
+        // A caller that has the operation checked out frees the lock in Checkin().
+        if (lock->users == 0) delete lock;
+    }
+    return true;
+}
+
+bool ShardedOperationTable::Touch(keymaster_operation_handle_t op_handle, uint64_t now_ms) {
+    Shard* shard = ShardFor(op_handle);
+    if (!shard) return false;
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    return shard->table.Touch(op_handle, now_ms);
+}
+
+bool ShardedOperationTable::UpdateFootprint(keymaster_operation_handle_t op_handle) {
+    Shard* shard = ShardFor(op_handle);
+    if (!shard) return true;
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    size_t footprint = shard->table.memory_stats().footprint;
+    shard->table.UpdateFootprint(op_handle);
+    AdjustFootprint(footprint, shard->table.memory_stats().footprint);
+    if (!over_budget()) return true;
+    CountOverBudget();
+    return false;
+}
+
+void ShardedOperationTable::GetHandles(std::vector<keymaster_operation_handle_t>* handles) const {
+    for (const auto& shard : shards_) {
+        if (!shard) continue;
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        for (const auto& entry : shard->locks) {
+            handles->push_back(entry.first);
+        }
+    }
+}
+
+size_t ShardedOperationTable::ReapIdle(uint64_t now_ms, uint64_t max_idle_ms) {
+    size_t reaped = 0;
+    for (auto& shard : shards_) {
+        if (!shard) continue;
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        size_t footprint = shard->table.memory_stats().footprint;
+        for (auto entry = shard->locks.begin(); entry != shard->locks.end();) {
+            keymaster_operation_handle_t op_handle = entry->first;
+            OperationLock* lock = entry->second;
+            uint64_t last_used_ms;
+            // Checkout() counts itself as a user before it takes the operation's mutex, so an
+            // operation without users can't be in use by anyone.
+            if (lock->users != 0 || !shard->table.LastUsed(op_handle, &last_used_ms) ||
+                now_ms <= last_used_ms || now_ms - last_used_ms <= max_idle_ms) {
+                ++entry;
+                continue;
+            }
+            Operation* operation = shard->table.Find(op_handle);
+            operation->Abort();
+            RemoveOwnerOperation(operation->owner());
+            shard->table.Delete(op_handle);
+            --in_use_;
+            entry = shard->locks.erase(entry);
+            delete lock;
+            ++reaped;
+        }
+        AdjustFootprint(footprint, shard->table.memory_stats().footprint);
+    }
+    if (reaped) CountReaped(reaped);
+    return reaped;
+}
+
+Operation* ShardedOperationTable::Checkout(keymaster_operation_handle_t op_handle, Lease* lease) {
+    lease->token = nullptr;
+    Shard* shard = ShardFor(op_handle);
+    if (!shard) return nullptr;
+
+    OperationLock* lock;
+    {
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        auto entry = shard->locks.find(op_handle);
+        if (entry == shard->locks.end()) return nullptr;
+        lock = entry->second;
+        ++lock->users;
+    }
+
+    // Wait for any other call on this operation to finish, without holding the shard's mutex.
+    lock->mutex.lock();
+
+    Operation* operation = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        // The previous holder may have deleted the operation.
+        if (lock->live) operation = shard->table.Find(op_handle);
+    }
+    if (!operation) {
+        lock->mutex.unlock();
+        std::lock_guard<std::mutex> guard(shard->mutex);
+        Unref(lock);
+        return nullptr;
+    }
+
+    lease->token = lock;
+    return operation;
+}
+
+Operation* ShardedOperationTable::TryCheckout(keymaster_operation_handle_t op_handle,
+                                              Lease* lease, bool* busy) {
+    lease->token = nullptr;
+    *busy = false;
+    Shard* shard = ShardFor(op_handle);
+    if (!shard) return nullptr;
+
+    // The shard mutex is held throughout: try_lock() never waits, so nothing can stall it.
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    auto entry = shard->locks.find(op_handle);
+    if (entry == shard->locks.end()) return nullptr;
+    OperationLock* lock = entry->second;
+    if (lock->users != 0 || !lock->mutex.try_lock()) {
+        *busy = true;
+        return nullptr;
+    }
+    ++lock->users;
+    lease->token = lock;
+    return shard->table.Find(op_handle);
+}
+
+void ShardedOperationTable::Checkin(Lease* lease) {
+    OperationLock* lock = static_cast<OperationLock*>(lease->token);
+    if (!lock) return;
+    lease->token = nullptr;
+
+    Shard* shard = lock->shard;
+    lock->mutex.unlock();
+    std::lock_guard<std::mutex> guard(shard->mutex);
+    Unref(lock);
+}
+
+}  // namespace keymaster
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/static_block_pool.h>
+
+#include <string.h>
+
+#include <keymaster/mem.h>
+
+namespace keymaster {
+
+StaticBlockPool::StaticBlockPool(const SizeClass* classes, size_t class_count) {
+    for (size_t i = 0; i < class_count && class_count_ < kMaxSizeClasses; ++i) {
+        const SizeClass& config = classes[i];
+        if (!config.storage || config.block_size < sizeof(FreeBlock) ||
+            config.block_size % alignof(max_align_t) ||
+            reinterpret_cast<uintptr_t>(config.storage) % alignof(max_align_t)) {
+            continue;
+        }
+
+        Class& added = classes_[class_count_++];
+        added.config = config;
+        added.free_list = nullptr;
+        added.in_use = 0;
+        added.high_water_mark = 0;
+        // Threaded back to front, so blocks are handed out in address order.
+        for (size_t j = config.block_count; j > 0; --j) {
+            auto block = reinterpret_cast<FreeBlock*>(config.storage + (j - 1) * config.block_size);
+            block->next = added.free_list;
+            added.free_list = block;
+        }
+    }
+}
+
+void* StaticBlockPool::Allocate(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < class_count_; ++i) {
+        Class& c = classes_[i];
+        if (c.config.block_size < size || !c.free_list) continue;
+        FreeBlock* block = c.free_list;
+        c.free_list = block->next;
+        block->next = nullptr;
+        if (++c.in_use > c.high_water_mark) c.high_water_mark = c.in_use;
+        return block;
+    }
+    ++failures_;
+    return nullptr;
+}
+
+void StaticBlockPool::Free(void* ptr) {
+    if (!ptr) return;
+    // ClassOf() reads only the configuration, which never changes.
+    Class* c = const_cast<Class*>(ClassOf(ptr));
+    if (!c) return;
+    memset_s(ptr, 0, c->config.block_size);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    FreeBlock* block = static_cast<FreeBlock*>(ptr);
+    block->next = c->free_list;
+    c->free_list = block;
+    --c->in_use;
+}
+
+const StaticBlockPool::Class* StaticBlockPool::ClassOf(const void* ptr) const {
+    const uint8_t* p = static_cast<const uint8_t*>(ptr);
+    for (size_t i = 0; i < class_count_; ++i) {
+        const SizeClass& config = classes_[i].config;
+        if (p >= config.storage && p < config.storage + config.block_size * config.block_count) {
+            return &classes_[i];
+        }
+    }
+    return nullptr;
+}
+
+bool StaticBlockPool::Owns(const void* ptr) const {
+    return ptr && ClassOf(ptr);
+}
+
+size_t StaticBlockPool::max_allocation() const {
+    return class_count_ ? classes_[class_count_ - 1].config.block_size : 0;
+}
+
+void StaticBlockPool::GetStats(Stats* stats) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    *stats = Stats();
+    for (size_t i = 0; i < class_count_; ++i) {
+        stats->in_use[i] = classes_[i].in_use;
+        stats->high_water_mark[i] = classes_[i].high_water_mark;
+    }
+    stats->failures = failures_;
+}
+
+}  // namespace keymaster
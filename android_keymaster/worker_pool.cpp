@@ -0,0 +1,149 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/worker_pool.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/resource.h>
+#endif
+
+#include <memory>
+#include <new>
+#include <utility>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+// Shared by RunInParallel() and the copies it queues, which may outlive the call if skipped.
+struct ParallelRun {
+    explicit ParallelRun(const std::function<void()>& work) : work(work) {}
+
+    const std::function<void()>& work;
+    std::mutex mutex;
+    std::condition_variable done;
+    size_t running = 0;
+    bool closed = false;
+};
+
+size_t CoreCount() {
+    size_t cores = std::thread::hardware_concurrency();
+    return cores ? cores : 1;
+}
+
+void ConfigureThread(const ThreadWorkerPool::Config& config) {
+#ifdef __linux__
+    if (config.cpu_mask != 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (size_t cpu = 0; cpu < 64; ++cpu) {
+            if (config.cpu_mask & (uint64_t(1) << cpu)) CPU_SET(cpu, &cpus);
+        }
+        if (sched_setaffinity(0 /* this thread */, sizeof(cpus), &cpus) != 0) {
+            LOG_W("Failed to set worker thread affinity", 0);
+        }
+    }
+    if (config.nice != 0 && setpriority(PRIO_PROCESS, 0 /* this thread */, config.nice) != 0) {
+        LOG_W("Failed to set worker thread priority", 0);
+    }
+#else
+    (void)config;
+#endif
+}
+
+}  // namespace
+
+void RunInParallel(WorkerPool* pool, size_t copies, const std::function<void()>& work) {
+    if (pool && copies > pool->thread_count() + 1) copies = pool->thread_count() + 1;
+    if (!pool || copies < 2) {
+        work();
+        return;
+    }
+
+    auto run = std::make_shared<ParallelRun>(work);
+    for (size_t i = 0; i < copies - 1; ++i) {
+        bool queued = pool->Submit([run]() {
+            {
+                std::lock_guard<std::mutex> lock(run->mutex);
+                if (run->closed) return;
+                ++run->running;
+            }
+            run->work();
+            std::lock_guard<std::mutex> lock(run->mutex);
+            if (--run->running == 0) run->done.notify_all();
+        });
+        if (!queued) break;
+    }
+
+    // The calling thread takes a share of the work too.
+    work();
+    std::unique_lock<std::mutex> lock(run->mutex);
+    run->closed = true;
+    run->done.wait(lock, [&run] { return run->running == 0; });
+}
+
+ThreadWorkerPool::ThreadWorkerPool(const Config& config)
+    : config_(config), thread_count_(config.thread_count ? config.thread_count : CoreCount()) {}
+
+ThreadWorkerPool::~ThreadWorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& thread : threads_) thread.join();
+}
+
+bool ThreadWorkerPool::Submit(std::function<void()> task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stopping_) return false;
+    tasks_.push_back(std::move(task));
+    if (threads_.empty()) {
+        threads_.reserve(thread_count_);
+        for (size_t i = 0; i < thread_count_; ++i) {
+            threads_.emplace_back(&ThreadWorkerPool::Run, this);
+        }
+    }
+    lock.unlock();
+    wake_.notify_one();
+    return true;
+}
+
+void ThreadWorkerPool::Run() {
+    ConfigureThread(config_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        wake_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+        // Queued tasks are run even when stopping, so that their owners aren't left waiting.
+        if (tasks_.empty()) return;
+        std::function<void()> task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+WorkerPool* DefaultWorkerPool() {
+    // Leaked, so that it is never destroyed while a static's destructor might still use it.
+    static WorkerPool* pool = new (std::nothrow) ThreadWorkerPool();
+    return pool;
+}
+
+}  // namespace keymaster
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/contexts/async_logger.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <new>
+
+namespace keymaster {
+
+namespace {
+
+uint64_t NowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value) result <<= 1;
+    return result;
+}
+
+// NOLINTNEXTLINE(cert-dcl50-cpp)
+int LogTo(const Logger* sink, Logger::LogLevel level, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int result = sink->log_msg(level, fmt, args);
+    va_end(args);
+    return result;
+}
+
+}  // namespace
+
+AsyncLogger::AsyncLogger(Logger* sink, const AsyncLoggerOptions& options)
+    : sink_(sink), options_(options), previous_instance_(instance()) {
+    size_t capacity = RoundUpToPowerOfTwo(options_.capacity > 1 ? options_.capacity : 2);
+    records_ = new (std::nothrow) Record[capacity];
+    if (records_) {
+        mask_ = capacity - 1;
+        for (size_t i = 0; i < capacity; ++i) records_[i].sequence.store(i);
+        thread_ = std::thread(&AsyncLogger::Run, this);
+    }
+    set_instance(this);
+}
+
+AsyncLogger::~AsyncLogger() {
+    if (instance() == this) set_instance(previous_instance_);
+    if (thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+    }
+    Flush();
+    delete[] records_;
+}
+
+int AsyncLogger::log_msg(LogLevel level, const char* fmt, va_list args) const {
+    uint32_t suppressed = 0;
+    if (!Admit(fmt, &suppressed)) return 0;
+
+    // Without a ring, log synchronously.
+    if (!records_) return sink_->log_msg(level, fmt, args);
+
+    if (suppressed) Push(level, "(%u similar messages suppressed)", suppressed);
+    if (!PushV(level, fmt, args)) {
+        ++dropped_count_;
+        return 0;
+    }
+    return 1;
+}
+
+void AsyncLogger::Flush() {
+    std::lock_guard<std::mutex> lock(drain_mutex_);
+    Drain();
+}
+
+bool AsyncLogger::Admit(const char* fmt, uint32_t* suppressed) const {
+    if (options_.max_repeats == 0) return true;
+
+    RateSlot& slot = rate_slots_[(reinterpret_cast<uintptr_t>(fmt) >> 3) % kRateSlots];
+    uint64_t now_ms = NowMs();
+    if (slot.fmt.load(std::memory_order_relaxed) != fmt) {
+        // Empty, or another format hashed here.  Counts are approximate under races, which only
+        // makes the limit a little loose.
+        slot.fmt.store(fmt, std::memory_order_relaxed);
+        slot.window_start_ms.store(now_ms, std::memory_order_relaxed);
+        slot.count.store(1, std::memory_order_relaxed);
+        *suppressed = slot.suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (now_ms - slot.window_start_ms.load(std::memory_order_relaxed) >= options_.rate_window_ms) {
+        slot.window_start_ms.store(now_ms, std::memory_order_relaxed);
+        slot.count.store(1, std::memory_order_relaxed);
+        *suppressed = slot.suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    if (slot.count.fetch_add(1, std::memory_order_relaxed) < options_.max_repeats) return true;
+    slot.suppressed.fetch_add(1, std::memory_order_relaxed);
+    ++suppressed_count_;
+    return false;
+}
+
+// NOLINTNEXTLINE(cert-dcl50-cpp)
+bool AsyncLogger::Push(LogLevel level, const char* fmt, ...) const {
+    va_list args;
+    va_start(args, fmt);
+    bool result = PushV(level, fmt, args);
+    va_end(args);
+    return result;
+}
+
+bool AsyncLogger::PushV(LogLevel level, const char* fmt, va_list args) const {
+    // Bounded multi-producer queue: each record's sequence says whether it is free for position
+    // |pos| (sequence == pos) or holds the message written there (sequence == pos + 1).
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    Record* record;
+    for (;;) {
+        record = &records_[pos & mask_];
+        size_t sequence = record->sequence.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            return false;  // Full
+        } else {
+            pos = enqueue_pos_.load(std::memory_order_relaxed);
+        }
+    }
+
+    record->level = level;
+    vsnprintf(record->text, sizeof(record->text), fmt, args);
+    record->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+void AsyncLogger::Drain() {
+    if (!records_) return;
+
+    uint64_t dropped = dropped_count_.load(std::memory_order_relaxed);
+    if (dropped != reported_dropped_) {
+        LogTo(sink_, WARNING_LVL, "(%llu log messages dropped)",
+              static_cast<unsigned long long>(dropped - reported_dropped_));
+        reported_dropped_ = dropped;
+    }
+
+    for (;;) {
+        Record& record = records_[dequeue_pos_ & mask_];
+        if (record.sequence.load(std::memory_order_acquire) != dequeue_pos_ + 1) return;
+        LogTo(sink_, record.level, "%s", record.text);
+        record.sequence.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+        ++dequeue_pos_;
+    }
+}
+
+void AsyncLogger::Run() {
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    while (!stopping_) {
+        wake_.wait_for(lock, std::chrono::milliseconds(options_.drain_interval_ms));
+        if (stopping_) break;
+        lock.unlock();
+        Flush();
+        lock.lock();
+    }
+}
+
+}  // namespace keymaster
@@ -0,0 +1,125 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/contexts/background_ec_key_pool.h>
+
+#include <sys/resource.h>
+
+#include <utility>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+// Nice value of the generation thread, so that it only uses otherwise idle CPU.
+constexpr int kBackgroundPriority = 19;
+
+}  // namespace
+
+/* static */
+std::vector<keymaster_ec_curve_t> BackgroundEcKeyPool::DefaultCurves() {
+    return {KM_EC_CURVE_P_256, KM_EC_CURVE_P_384};
+}
+
+BackgroundEcKeyPool::BackgroundEcKeyPool(size_t depth, std::vector<keymaster_ec_curve_t> curves)
+    : depth_(depth) {
+    for (keymaster_ec_curve_t curve : curves) {
+        slots_.push_back(Slot{curve, {}});
+        slots_.back().keys.reserve(depth_);
+    }
+    if (depth_ > 0 && !slots_.empty()) thread_ = std::thread(&BackgroundEcKeyPool::Run, this);
+}
+
+BackgroundEcKeyPool::~BackgroundEcKeyPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+EC_KEY_Ptr BackgroundEcKeyPool::TakeKey(keymaster_ec_curve_t curve) {
+    EC_KEY_Ptr key;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t index = FindSlot(curve);
+        if (index == slots_.size() || slots_[index].keys.empty()) return key;
+        key = std::move(slots_[index].keys.back());
+        slots_[index].keys.pop_back();
+    }
+    wake_.notify_one();
+    return key;
+}
+
+size_t BackgroundEcKeyPool::available(keymaster_ec_curve_t curve) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t index = FindSlot(curve);
+    return index == slots_.size() ? 0 : slots_[index].keys.size();
+}
+
+size_t BackgroundEcKeyPool::FindSlot(keymaster_ec_curve_t curve) const {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        if (slots_[i].curve == curve) return i;
+    }
+    return slots_.size();
+}
+
+BackgroundEcKeyPool::Slot* BackgroundEcKeyPool::NextSlotToFill() {
+    Slot* next = nullptr;
+    for (Slot& slot : slots_) {
+        if (slot.keys.size() < depth_ && (!next || slot.keys.size() < next->keys.size())) {
+            next = &slot;
+        }
+    }
+    return next;
+}
+
+void BackgroundEcKeyPool::Run() {
+    // On Linux a nice value set with a zero ID applies to the calling thread only.
+    if (setpriority(PRIO_PROCESS, 0 /* this thread */, kBackgroundPriority) != 0) {
+        LOG_W("Unable to lower the priority of the EC key pool thread", 0);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        Slot* slot = NextSlotToFill();
+        if (!slot) {
+            wake_.wait(lock);
+            continue;
+        }
+
+        // Slots are never added or removed after construction, so the curve stays valid while the
+        // lock is released for the slow part.
+        keymaster_ec_curve_t curve = slot->curve;
+        lock.unlock();
+        EC_KEY_Ptr key;
+        keymaster_error_t error = NistCurveKeyExchange::GenerateKey(curve, &key);
+        lock.lock();
+
+        if (error != KM_ERROR_OK) {
+            LOG_E("Background EC key generation failed: %d", error);
+            // Don't spin on a persistent failure; try again when a key is next taken.
+            wake_.wait(lock);
+            continue;
+        }
+        if (slot->keys.size() < depth_) slot->keys.push_back(std::move(key));
+    }
+}
+
+}  // namespace keymaster
@@ -0,0 +1,134 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/contexts/background_rsa_key_pool.h>
+
+#include <sys/resource.h>
+
+#include <utility>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+constexpr uint64_t kF4 = 65537;
+
+// Nice value of the generation thread, so that it only uses otherwise idle CPU.
+constexpr int kBackgroundPriority = 19;
+
+}  // namespace
+
+/* static */
+std::vector<BackgroundRsaKeyPool::KeySpec> BackgroundRsaKeyPool::DefaultKeySpecs() {
+    return {{2048, kF4}, {3072, kF4}, {4096, kF4}};
+}
+
+BackgroundRsaKeyPool::BackgroundRsaKeyPool(size_t depth, std::vector<KeySpec> specs)
+    : depth_(depth) {
+    for (const KeySpec& spec : specs) {
+        slots_.push_back(Slot{spec, {}});
+        slots_.back().keys.reserve(depth_);
+    }
+    if (depth_ > 0 && !slots_.empty()) thread_ = std::thread(&BackgroundRsaKeyPool::Run, this);
+}
+
+BackgroundRsaKeyPool::~BackgroundRsaKeyPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+RSA_Ptr BackgroundRsaKeyPool::TakeKey(uint32_t key_size, uint64_t public_exponent) {
+    RSA_Ptr key;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t index = FindSlot(key_size, public_exponent);
+        if (index == slots_.size() || slots_[index].keys.empty()) return key;
+        key = std::move(slots_[index].keys.back());
+        slots_[index].keys.pop_back();
+    }
+    wake_.notify_one();
+    return key;
+}
+
+size_t BackgroundRsaKeyPool::available(uint32_t key_size, uint64_t public_exponent) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t index = FindSlot(key_size, public_exponent);
+    return index == slots_.size() ? 0 : slots_[index].keys.size();
+}
+
+size_t BackgroundRsaKeyPool::FindSlot(uint32_t key_size, uint64_t public_exponent) const {
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        const KeySpec& spec = slots_[i].spec;
+        if (spec.key_size == key_size && spec.public_exponent == public_exponent) return i;
+    }
+    return slots_.size();
+}
+
+BackgroundRsaKeyPool::Slot* BackgroundRsaKeyPool::NextSlotToFill() {
+    Slot* next = nullptr;
+    for (Slot& slot : slots_) {
+        if (slot.keys.size() < depth_ && (!next || slot.keys.size() < next->keys.size())) {
+            next = &slot;
+        }
+    }
+    return next;
+}
+
+void BackgroundRsaKeyPool::Run() {
+    // On Linux a nice value set with a zero ID applies to the calling thread only.
+    if (setpriority(PRIO_PROCESS, 0 /* this thread */, kBackgroundPriority) != 0) {
+        LOG_W("Unable to lower the priority of the RSA key pool thread", 0);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        Slot* slot = NextSlotToFill();
+        if (!slot) {
+            wake_.wait(lock);
+            continue;
+        }
+
+        // Slots are never added or removed after construction, so the spec stays valid while the
+        // lock is released for the slow part.
+        KeySpec spec = slot->spec;
+        lock.unlock();
+        RSA_Ptr key;
+#ifndef KEYMASTER_DISABLE_RSA
+        keymaster_error_t error =
+            RsaKeyFactory::GenerateRsaKey(spec.key_size, spec.public_exponent, &key);
+#else
+        // Not reached: PureSoftKeymasterContext creates no pool when RSA is left out.
+        keymaster_error_t error = KM_ERROR_UNSUPPORTED_ALGORITHM;
+#endif
+        lock.lock();
+
+        if (error != KM_ERROR_OK) {
+            LOG_E("Background RSA key generation failed: %d", error);
+            // Don't spin on a persistent failure; try again when a key is next taken.
+            wake_.wait(lock);
+            continue;
+        }
+        if (slot->keys.size() < depth_) slot->keys.push_back(std::move(key));
+    }
+}
+
+}  // namespace keymaster
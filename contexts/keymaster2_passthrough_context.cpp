@@ -28,6 +28,13 @@ Keymaster2PassthroughContext::Keymaster2PassthroughContext(KmVersion version,
                                                            keymaster2_device_t* dev)
     : device_(dev), engine_(KeymasterPassthroughEngine::createInstance(dev)), version_(version) {}
 
+Keymaster2PassthroughContext::Keymaster2PassthroughContext(KmVersion version,
+                                                           keymaster2_device_t* const* sessions,
+                                                           size_t session_count)
+    : device_(sessions[0]),
+      engine_(KeymasterPassthroughEngine::createInstance(sessions, session_count)),
+      version_(version) {}
+
 keymaster_error_t Keymaster2PassthroughContext::SetSystemVersion(uint32_t os_version,
                                                                  uint32_t os_patchlevel) {
     os_version_ = os_version;
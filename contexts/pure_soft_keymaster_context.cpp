@@ -17,32 +17,45 @@
 #include <keymaster/contexts/pure_soft_keymaster_context.h>
 
 #include <assert.h>
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <utility>
+#include <vector>
 
 #include <openssl/aes.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
-#include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <openssl/x509v3.h>
 
+#include <keymaster/algorithm_subset.h>
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/contexts/background_rsa_key_pool.h>
 #include <keymaster/key_blob_utils/auth_encrypted_key_blob.h>
 #include <keymaster/key_blob_utils/integrity_assured_key_blob.h>
+#include <keymaster/key_blob_utils/legacy_keyblobs.h>
 #include <keymaster/key_blob_utils/ocb_utils.h>
 #include <keymaster/key_blob_utils/software_keyblobs.h>
 #include <keymaster/km_openssl/aes_key.h>
 #include <keymaster/km_openssl/asymmetric_key.h>
 #include <keymaster/km_openssl/attestation_utils.h>
 #include <keymaster/km_openssl/certificate_utils.h>
-#include <keymaster/km_openssl/ec_key_factory.h>
+#include <keymaster/km_openssl/crypto_dispatch.h>
 #include <keymaster/km_openssl/hmac_key.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
-#include <keymaster/km_openssl/rsa_key_factory.h>
 #include <keymaster/km_openssl/soft_keymaster_enforcement.h>
+#ifndef KEYMASTER_DISABLE_EC
+#include <keymaster/km_openssl/ec_key_factory.h>
+#endif
+#ifndef KEYMASTER_DISABLE_RSA
+#include <keymaster/km_openssl/rsa_key_factory.h>
+#endif
+#ifndef KEYMASTER_DISABLE_TRIPLE_DES
 #include <keymaster/km_openssl/triple_des_key.h>
+#endif
 #include <keymaster/logger.h>
 #include <keymaster/operation.h>
 #include <keymaster/wrapped_key.h>
@@ -51,37 +64,87 @@
 
 namespace keymaster {
 
+namespace {
+
+constexpr size_t kParsedKeyCacheEntries = 32;
+constexpr size_t kParsedKeyCacheBytes = 64 * 1024;
+// Sealed entries hold no plaintext key material, so far more of them can be kept.
+constexpr size_t kSealedKeyCacheEntries = 1024;
+constexpr size_t kSealedKeyCacheBytes = 1024 * 1024;
+
+// Warm state layout, before encryption: magic, version, then the size-prefixed shared HMAC state
+// and secure key storage snapshot, either of which may be empty.
+constexpr uint32_t kWarmStateMagic = 0x534d574b;  // "KWMS", little-endian.
+constexpr uint32_t kWarmStateVersion = 1;
+
+// Like the software key blob master key, this only keeps the snapshot from being read or altered
+// by someone who doesn't have the source.  A context with a hardware-bound key would derive the
+// snapshot key from that instead.
+constexpr uint8_t kWarmStateKey[16] = {'W', 'a', 'r', 'm', 'S', 't', 'a', 't',
+                                       'e', 'S', 'n', 'a', 'p', 's', 'h', 't'};
+constexpr char kWarmStateLabel[] = "keymaster warm state";
+
+// Binds the encryption to one kind of snapshot, so that a key blob or another kind of snapshot
+// can't be passed off as one.
+template <size_t N> AuthorizationSet SnapshotHidden(const char (&label)[N]) {
+    return AuthorizationSet(
+        AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID, label, N - 1));
+}
+
+}  // namespace
+
 PureSoftKeymasterContext::PureSoftKeymasterContext(KmVersion version,
-                                                   keymaster_security_level_t security_level)
+                                                   keymaster_security_level_t security_level,
+                                                   const PureSoftKeymasterContextConfig& config)
 
     : SoftAttestationContext(version),
-      rsa_factory_(new (std::nothrow) RsaKeyFactory(*this /* blob_maker */, *this /* context */)),
-      ec_factory_(new (std::nothrow) EcKeyFactory(*this /* blob_maker */, *this /* context */)),
-      aes_factory_(new (std::nothrow)
-                       AesKeyFactory(*this /* blob_maker */, *this /* random_source */)),
-      tdes_factory_(new (std::nothrow)
-                        TripleDesKeyFactory(*this /* blob_maker */, *this /* random_source */)),
-      hmac_factory_(new (std::nothrow)
-                        HmacKeyFactory(*this /* blob_maker */, *this /* random_source */)),
-      os_version_(0), os_patchlevel_(0), soft_keymaster_enforcement_(64, 64),
-      security_level_(security_level) {
+      worker_pool_(DefaultWorkerPool()), os_version_(0), os_patchlevel_(0), config_(config),
+      soft_keymaster_enforcement_(config.max_access_time_entries,
+                                  config.max_access_count_entries),
+      security_level_(security_level),
+      parsed_key_cache_(kParsedKeyCacheEntries, kParsedKeyCacheBytes, kSealedKeyCacheEntries,
+                        kSealedKeyCacheBytes),
+      // The default implementation fakes the hardware bound key with an arbitrary 128-bit value.
+      // Any real implementation must follow the guidance from the interface definition
+      // hardware/interfaces/security/keymint/aidl/android/hardware/security/keymint/Tag.aidl:
+      // "..a unique hardware-bound secret known to the secure environment and never revealed by
+      // it. The secret must contain at least 128 bits of entropy and be unique to the individual
+      // device"
+      unique_id_generator_({'M', 'u', 's', 't', 'B', 'e', 'R', 'a', 'n', 'd', 'o', 'm', 'B', 'i',
+                            't', 's'}) {
     // We're pretending to be some sort of secure hardware which supports secure key storage,
     // this must only be used for testing.
     if (security_level != KM_SECURITY_LEVEL_SOFTWARE) {
-        pure_soft_secure_key_storage_ = std::make_unique<PureSoftSecureKeyStorage>(64);
-    }
-    if (version >= KmVersion::KEYMINT_1) {
-        pure_soft_remote_provisioning_context_ =
-            std::make_unique<PureSoftRemoteProvisioningContext>(security_level_);
+        pure_soft_secure_key_storage_ =
+            std::make_unique<PureSoftSecureKeyStorage>(config.max_secure_storage_keys);
     }
+    LogCryptoDispatchOnce();
 }
 
 PureSoftKeymasterContext::~PureSoftKeymasterContext() {}
 
+void PureSoftKeymasterContext::SetRsaKeyPoolDepth(size_t depth) {
+#ifndef KEYMASTER_DISABLE_RSA
+    auto rsa_factory = static_cast<RsaKeyFactory*>(GetKeyFactory(KM_ALGORITHM_RSA));
+    if (!rsa_factory) return;
+
+    rsa_factory->set_key_pool(nullptr);
+    rsa_key_pool_.reset();
+    if (depth == 0) return;
+
+    rsa_key_pool_ = std::make_unique<BackgroundRsaKeyPool>(depth);
+    rsa_factory->set_key_pool(rsa_key_pool_.get());
+#else
+    (void)depth;
+#endif
+}
+
 keymaster_error_t PureSoftKeymasterContext::SetSystemVersion(uint32_t os_version,
                                                              uint32_t os_patchlevel) {
+    std::lock_guard<std::mutex> lock(rkp_mutex_);
     os_version_ = os_version;
     os_patchlevel_ = os_patchlevel;
+    system_version_set_ = true;
     if (pure_soft_remote_provisioning_context_ != nullptr) {
         pure_soft_remote_provisioning_context_->SetSystemVersion(os_version, os_patchlevel);
     }
@@ -98,6 +161,7 @@ keymaster_error_t
 PureSoftKeymasterContext::SetVerifiedBootInfo(std::string_view boot_state,
                                               std::string_view bootloader_state,
                                               const std::vector<uint8_t>& vbmeta_digest) {
+    std::lock_guard<std::mutex> lock(rkp_mutex_);
     if (verified_boot_state_.has_value() && boot_state != verified_boot_state_.value()) {
         return KM_ERROR_INVALID_ARGUMENT;
     }
@@ -110,6 +174,7 @@ PureSoftKeymasterContext::SetVerifiedBootInfo(std::string_view boot_state,
     verified_boot_state_ = boot_state;
     bootloader_state_ = bootloader_state;
     vbmeta_digest_ = vbmeta_digest;
+    root_of_trust_cache_.Invalidate();
     if (pure_soft_remote_provisioning_context_ != nullptr) {
         pure_soft_remote_provisioning_context_->SetVerifiedBootInfo(boot_state, bootloader_state,
                                                                     vbmeta_digest);
@@ -118,6 +183,7 @@ PureSoftKeymasterContext::SetVerifiedBootInfo(std::string_view boot_state,
 }
 
 keymaster_error_t PureSoftKeymasterContext::SetVendorPatchlevel(uint32_t vendor_patchlevel) {
+    std::lock_guard<std::mutex> lock(rkp_mutex_);
     if (vendor_patchlevel_.has_value() && vendor_patchlevel != vendor_patchlevel_.value()) {
         // Can't set patchlevel to a different value.
         return KM_ERROR_INVALID_ARGUMENT;
@@ -130,36 +196,94 @@ keymaster_error_t PureSoftKeymasterContext::SetVendorPatchlevel(uint32_t vendor_
 }
 
 keymaster_error_t PureSoftKeymasterContext::SetBootPatchlevel(uint32_t boot_patchlevel) {
+    std::lock_guard<std::mutex> lock(rkp_mutex_);
     if (boot_patchlevel_.has_value() && boot_patchlevel != boot_patchlevel_.value()) {
         // Can't set patchlevel to a different value.
         return KM_ERROR_INVALID_ARGUMENT;
     }
     boot_patchlevel_ = boot_patchlevel;
+    root_of_trust_cache_.Invalidate();
     if (pure_soft_remote_provisioning_context_ != nullptr) {
         pure_soft_remote_provisioning_context_->SetBootPatchlevel(boot_patchlevel);
     }
     return KM_ERROR_OK;
 }
 
+RemoteProvisioningContext* PureSoftKeymasterContext::GetRemoteProvisioningContext() const {
+    if (GetKmVersion() < KmVersion::KEYMINT_1) return nullptr;
+
+    std::lock_guard<std::mutex> lock(rkp_mutex_);
+    if (!pure_soft_remote_provisioning_context_) {
+        // Bring the new context up to date with everything set on this one so far.
+        auto context = std::make_unique<PureSoftRemoteProvisioningContext>(security_level_);
+        if (system_version_set_) context->SetSystemVersion(os_version_, os_patchlevel_);
+        if (verified_boot_state_.has_value()) {
+            context->SetVerifiedBootInfo(*verified_boot_state_, *bootloader_state_,
+                                         *vbmeta_digest_);
+        }
+        if (vendor_patchlevel_.has_value()) context->SetVendorPatchlevel(*vendor_patchlevel_);
+        if (boot_patchlevel_.has_value()) context->SetBootPatchlevel(*boot_patchlevel_);
+        pure_soft_remote_provisioning_context_ = std::move(context);
+    }
+    return pure_soft_remote_provisioning_context_.get();
+}
+
+namespace {
+
+template <typename Factory, typename... Args>
+KeyFactory* GetOrCreateFactory(std::once_flag* once, std::unique_ptr<KeyFactory>* factory,
+                               const Args&... args) {
+    std::call_once(*once, [&] { factory->reset(new (std::nothrow) Factory(args...)); });
+    return factory->get();
+}
+
+}  // namespace
+
 KeyFactory* PureSoftKeymasterContext::GetKeyFactory(keymaster_algorithm_t algorithm) const {
+    // Non-public bases, so converted here rather than in GetOrCreateFactory().
+    const SoftwareKeyBlobMaker& blob_maker = *this;
+    const RandomSource& random_source = *this;
+    const KeymasterContext& context = *this;
+
+    // Algorithms left out of the build (see algorithm_subset.h) have no case, so their factories
+    // aren't linked in.
     switch (algorithm) {
+#ifndef KEYMASTER_DISABLE_RSA
     case KM_ALGORITHM_RSA:
-        return rsa_factory_.get();
+        return GetOrCreateFactory<RsaKeyFactory>(&rsa_factory_once_, &rsa_factory_, blob_maker,
+                                                 context);
+#endif
+#ifndef KEYMASTER_DISABLE_EC
     case KM_ALGORITHM_EC:
-        return ec_factory_.get();
+        return GetOrCreateFactory<EcKeyFactory>(&ec_factory_once_, &ec_factory_, blob_maker,
+                                                context);
+#endif
     case KM_ALGORITHM_AES:
-        return aes_factory_.get();
+        return GetOrCreateFactory<AesKeyFactory>(&aes_factory_once_, &aes_factory_, blob_maker,
+                                                 random_source);
+#ifndef KEYMASTER_DISABLE_TRIPLE_DES
     case KM_ALGORITHM_TRIPLE_DES:
-        return tdes_factory_.get();
+        return GetOrCreateFactory<TripleDesKeyFactory>(&tdes_factory_once_, &tdes_factory_,
+                                                       blob_maker, random_source);
+#endif
     case KM_ALGORITHM_HMAC:
-        return hmac_factory_.get();
+        return GetOrCreateFactory<HmacKeyFactory>(&hmac_factory_once_, &hmac_factory_, blob_maker,
+                                                  random_source);
     default:
         return nullptr;
     }
 }
 
-static keymaster_algorithm_t supported_algorithms[] = {KM_ALGORITHM_RSA, KM_ALGORITHM_EC,
-                                                       KM_ALGORITHM_AES, KM_ALGORITHM_HMAC};
+static keymaster_algorithm_t supported_algorithms[] = {
+#ifndef KEYMASTER_DISABLE_RSA
+    KM_ALGORITHM_RSA,
+#endif
+#ifndef KEYMASTER_DISABLE_EC
+    KM_ALGORITHM_EC,
+#endif
+    KM_ALGORITHM_AES,
+    KM_ALGORITHM_HMAC,
+};
 
 keymaster_algorithm_t*
 PureSoftKeymasterContext::GetSupportedAlgorithms(size_t* algorithms_count) const {
@@ -247,10 +371,13 @@ keymaster_error_t PureSoftKeymasterContext::CreateKeyBlob(const AuthorizationSet
     if (error != KM_ERROR_OK) return error;
 
     AuthorizationSet hidden;
-    error = BuildHiddenAuthorizations(key_description, &hidden, softwareRootOfTrust);
+    std::shared_ptr<const KeymasterBlob> serialized_hidden;
+    error = hidden_authorizations_cache_.Get(key_description, softwareRootOfTrust, &hidden,
+                                             &serialized_hidden);
     if (error != KM_ERROR_OK) return error;
 
-    error = SerializeIntegrityAssuredBlob(key_material, hidden, *hw_enforced, *sw_enforced, blob);
+    error = SerializeIntegrityAssuredBlob(key_material, *serialized_hidden, *hw_enforced,
+                                          *sw_enforced, blob);
     if (error != KM_ERROR_OK) return error;
 
     // Pretend to be some sort of secure hardware that can securely store the key blob.
@@ -268,13 +395,54 @@ keymaster_error_t PureSoftKeymasterContext::UpgradeKeyBlob(const KeymasterKeyBlo
     keymaster_error_t error = ParseKeyBlob(key_to_upgrade, upgrade_params, &key);
     if (error != KM_ERROR_OK) return error;
 
-    return FullUpgradeSoftKeyBlob(key, os_version_, os_patchlevel_, vendor_patchlevel_,
-                                  boot_patchlevel_, upgrade_params, upgraded_key);
+    error = FullUpgradeSoftKeyBlob(key, os_version_, os_patchlevel_, vendor_patchlevel_,
+                                   boot_patchlevel_, upgrade_params, upgraded_key);
+    km_id_t keyid;
+    if (error == KM_ERROR_OK && soft_keymaster_enforcement_.CreateKeyId(key_to_upgrade, &keyid)) {
+        parsed_key_cache_.Invalidate(keyid);
+    }
+    return error;
+}
+
+void PureSoftKeymasterContext::UpgradeKeyBlobs(const KeymasterKeyBlob* keys_to_upgrade,
+                                               size_t count, const AuthorizationSet& upgrade_params,
+                                               KeymasterKeyBlob* upgraded_keys,
+                                               keymaster_error_t* errors,
+                                               size_t thread_count) const {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < count;) {
+            UniquePtr<Key> key;
+            errors[i] = ParseKeyBlob(keys_to_upgrade[i], upgrade_params, &key,
+                                     false /* use_cache */);
+            if (errors[i] != KM_ERROR_OK) continue;
+            errors[i] = FullUpgradeSoftKeyBlob(key, os_version_, os_patchlevel_, vendor_patchlevel_,
+                                               boot_patchlevel_, upgrade_params, &upgraded_keys[i]);
+        }
+    };
+
+    RunInParallel(worker_pool_, std::min(thread_count, count), worker);
+
+    // The cache isn't thread-safe, so the replaced blobs are evicted once the workers are done.
+    for (size_t i = 0; i < count; ++i) {
+        km_id_t keyid;
+        if (errors[i] == KM_ERROR_OK && upgraded_keys[i].key_material_size > 0 &&
+            soft_keymaster_enforcement_.CreateKeyId(keys_to_upgrade[i], &keyid)) {
+            parsed_key_cache_.Invalidate(keyid);
+        }
+    }
 }
 
 keymaster_error_t PureSoftKeymasterContext::ParseKeyBlob(const KeymasterKeyBlob& blob,
                                                          const AuthorizationSet& additional_params,
                                                          UniquePtr<Key>* key) const {
+    return ParseKeyBlob(blob, additional_params, key, true /* use_cache */);
+}
+
+keymaster_error_t PureSoftKeymasterContext::ParseKeyBlob(const KeymasterKeyBlob& blob,
+                                                         const AuthorizationSet& additional_params,
+                                                         UniquePtr<Key>* key,
+                                                         bool use_cache) const {
     // This is a little bit complicated.
     //
     // The SoftKeymasterContext has to handle a lot of different kinds of key blobs.
@@ -303,55 +471,203 @@ keymaster_error_t PureSoftKeymasterContext::ParseKeyBlob(const KeymasterKeyBlob&
     keymaster_error_t error;
 
     auto constructKey = [&, this]() mutable -> keymaster_error_t {
-        // GetKeyFactory
         if (error != KM_ERROR_OK) return error;
         keymaster_algorithm_t algorithm;
-        if (!hw_enforced.GetTagValue(TAG_ALGORITHM, &algorithm) &&
-            !sw_enforced.GetTagValue(TAG_ALGORITHM, &algorithm)) {
-            return KM_ERROR_INVALID_ARGUMENT;
-        }
-
-        // Pretend to be some sort of secure hardware that can securely store
-        // the key blob. Check the key blob is still securely stored now.
-        if (hw_enforced.Contains(KM_TAG_ROLLBACK_RESISTANCE) ||
-            hw_enforced.Contains(KM_TAG_USAGE_COUNT_LIMIT)) {
-            if (pure_soft_secure_key_storage_ == nullptr) return KM_ERROR_INVALID_KEY_BLOB;
-            km_id_t keyid;
-            bool exists;
-            if (!soft_keymaster_enforcement_.CreateKeyId(blob, &keyid))
-                return KM_ERROR_INVALID_KEY_BLOB;
-            error = pure_soft_secure_key_storage_->KeyExists(keyid, &exists);
-            if (error != KM_ERROR_OK || !exists) return KM_ERROR_INVALID_KEY_BLOB;
-        }
+        error = CheckParsedKeyBlob(blob, hw_enforced, sw_enforced, &algorithm);
+        if (error != KM_ERROR_OK) return error;
 
+        // Only material the blob authenticates may skip the key consistency checks.
         auto factory = GetKeyFactory(algorithm);
+        if (IsAuthenticatedKeyBlobFormat(ClassifyKeyBlob(blob))) {
+            return factory->LoadAuthenticatedKey(std::move(key_material), additional_params,
+                                                 std::move(hw_enforced), std::move(sw_enforced),
+                                                 key);
+        }
         return factory->LoadKey(std::move(key_material), additional_params, std::move(hw_enforced),
                                 std::move(sw_enforced), key);
     };
 
     AuthorizationSet hidden;
-    error = BuildHiddenAuthorizations(additional_params, &hidden, softwareRootOfTrust);
+    std::shared_ptr<const KeymasterBlob> serialized_hidden;
+    error = hidden_authorizations_cache_.Get(additional_params, softwareRootOfTrust, &hidden,
+                                             &serialized_hidden);
     if (error != KM_ERROR_OK) return error;
 
-    // Assume it's an integrity-assured blob (new software-only blob, or new keymaster0-backed
-    // blob).
-    error =
-        DeserializeIntegrityAssuredBlob(blob, hidden, &key_material, &hw_enforced, &sw_enforced);
-    if (error != KM_ERROR_INVALID_KEY_BLOB) return constructKey();
+    // The cache only skips decryption and deserialization; the checks in constructKey() still run
+    // on every load.
+    km_id_t cache_id;
+    bool cacheable = use_cache && (parsed_key_cache_.FindKeyId(blob, &cache_id) ||
+                                   soft_keymaster_enforcement_.CreateKeyId(blob, &cache_id));
+    KeyPolicy policy;
+    std::shared_ptr<DerivedKeyData> derived_data;
+    if (cacheable && parsed_key_cache_.Find(cache_id, blob, *serialized_hidden, &key_material,
+                                            &hw_enforced, &sw_enforced, &policy, &derived_data)) {
+        error = constructKey();
+        if (error == KM_ERROR_OK) {
+            (*key)->set_policy(policy);
+            (*key)->set_derived_data(std::move(derived_data));
+            (*key)->set_key_id(cache_id);
+        }
+        return error;
+    }
+
+    error = ParseUncachedKeyBlob(blob, hidden, *serialized_hidden, &key_material, &hw_enforced,
+                                 &sw_enforced);
+    if (error == KM_ERROR_OK && cacheable) {
+        parsed_key_cache_.Insert(cache_id, blob, *serialized_hidden, key_material, hw_enforced,
+                                 sw_enforced, &derived_data);
+    }
+    error = constructKey();
+    if (error == KM_ERROR_OK) {
+        (*key)->set_derived_data(std::move(derived_data));
+        if (cacheable) (*key)->set_key_id(cache_id);
+    }
+    return error;
+}
+
+keymaster_error_t
+PureSoftKeymasterContext::ParseKeyCharacteristics(const KeymasterKeyBlob& blob,
+                                                  const AuthorizationSet& additional_params,
+                                                  AuthorizationSet* hw_enforced,
+                                                  AuthorizationSet* sw_enforced) const {
+    AuthorizationSet hidden;
+    std::shared_ptr<const KeymasterBlob> serialized_hidden;
+    keymaster_error_t error = hidden_authorizations_cache_.Get(
+        additional_params, softwareRootOfTrust, &hidden, &serialized_hidden);
+    if (error != KM_ERROR_OK) return error;
+
+    // Same verification as ParseKeyBlob(), without building the key.  Integrity-assured blobs,
+    // which are all this context makes, are only HMACed; older encrypted blobs still have to be
+    // decrypted to authenticate their authorization lists.
+    KeymasterKeyBlob key_material;
+    km_id_t cache_id;
+    bool cacheable = parsed_key_cache_.FindKeyId(blob, &cache_id) ||
+                     soft_keymaster_enforcement_.CreateKeyId(blob, &cache_id);
+    KeyPolicy policy;
+    std::shared_ptr<DerivedKeyData> derived_data;
+    if (!cacheable ||
+        !parsed_key_cache_.Find(cache_id, blob, *serialized_hidden, &key_material, hw_enforced,
+                                sw_enforced, &policy, &derived_data)) {
+        error = ParseUncachedKeyBlob(blob, hidden, *serialized_hidden, &key_material, hw_enforced,
+                                     sw_enforced);
+        if (error != KM_ERROR_OK) return error;
+        if (cacheable) {
+            parsed_key_cache_.Insert(cache_id, blob, *serialized_hidden, key_material,
+                                     *hw_enforced, *sw_enforced, &derived_data);
+        }
+    }
+
+    keymaster_algorithm_t algorithm;
+    return CheckParsedKeyBlob(blob, *hw_enforced, *sw_enforced, &algorithm);
+}
+
+void PureSoftKeymasterContext::ParseKeysCharacteristics(
+    const KeymasterKeyBlob* blobs, const AuthorizationSet* additional_params, size_t count,
+    AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced, keymaster_error_t* errors,
+    size_t thread_count) const {
+    // The cache isn't thread-safe, so hits are served here first and only the misses are spread
+    // across the workers.  Misses aren't added to the cache: a listing touches each key once, and
+    // caching them all would evict the keys in active use.
+    std::vector<size_t> misses;
+    misses.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        AuthorizationSet hidden;
+        std::shared_ptr<const KeymasterBlob> serialized_hidden;
+        errors[i] = hidden_authorizations_cache_.Get(additional_params[i], softwareRootOfTrust,
+                                                     &hidden, &serialized_hidden);
+        if (errors[i] != KM_ERROR_OK) continue;
+
+        km_id_t cache_id;
+        KeymasterKeyBlob key_material;
+        KeyPolicy policy;
+        std::shared_ptr<DerivedKeyData> derived_data;
+        if (parsed_key_cache_.FindKeyId(blobs[i], &cache_id) &&
+            parsed_key_cache_.Find(cache_id, blobs[i], *serialized_hidden, &key_material,
+                                   &hw_enforced[i], &sw_enforced[i], &policy, &derived_data)) {
+            keymaster_algorithm_t algorithm;
+            errors[i] = CheckParsedKeyBlob(blobs[i], hw_enforced[i], sw_enforced[i], &algorithm);
+        } else {
+            misses.push_back(i);
+        }
+    }
 
-    // Wasn't an integrity-assured blob.  Maybe it's an auth-encrypted blob.
-    error = ParseAuthEncryptedBlob(blob, hidden, &key_material, &hw_enforced, &sw_enforced);
-    if (error == KM_ERROR_OK) LOG_D("Parsed an old keymaster1 software key", 0);
-    if (error != KM_ERROR_INVALID_KEY_BLOB) return constructKey();
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t n; (n = next.fetch_add(1)) < misses.size();) {
+            size_t i = misses[n];
+            AuthorizationSet hidden;
+            std::shared_ptr<const KeymasterBlob> serialized_hidden;
+            errors[i] = hidden_authorizations_cache_.Get(additional_params[i], softwareRootOfTrust,
+                                                         &hidden, &serialized_hidden);
+            if (errors[i] != KM_ERROR_OK) continue;
+            KeymasterKeyBlob key_material;
+            errors[i] = ParseUncachedKeyBlob(blobs[i], hidden, *serialized_hidden, &key_material,
+                                             &hw_enforced[i], &sw_enforced[i]);
+            if (errors[i] != KM_ERROR_OK) continue;
+            keymaster_algorithm_t algorithm;
+            errors[i] = CheckParsedKeyBlob(blobs[i], hw_enforced[i], sw_enforced[i], &algorithm);
+        }
+    };
 
-    // Wasn't an auth-encrypted blob.  Maybe it's an old softkeymaster blob.
-    error = ParseOldSoftkeymasterBlob(blob, &key_material, &hw_enforced, &sw_enforced);
-    if (error == KM_ERROR_OK) LOG_D("Parsed an old sofkeymaster key", 0);
+    RunInParallel(worker_pool_, std::min(thread_count, misses.size()), worker);
+}
 
-    return constructKey();
+keymaster_error_t PureSoftKeymasterContext::ParseUncachedKeyBlob(
+    const KeymasterKeyBlob& blob, const AuthorizationSet& hidden,
+    const KeymasterBlob& serialized_hidden, KeymasterKeyBlob* key_material,
+    AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced) const {
+    // The format is recognizable from the blob's header and layout, so only one parser, and at
+    // most one HMAC or decryption, is tried.
+    keymaster_error_t error = KM_ERROR_INVALID_KEY_BLOB;
+    SoftwareKeyBlobFormat format = ClassifyKeyBlob(blob);
+    key_blob_formats_.Count(format);
+    switch (format) {
+    case KEY_BLOB_INTEGRITY_ASSURED:
+        error = DeserializeIntegrityAssuredBlob(blob, serialized_hidden, key_material,
+                                                hw_enforced, sw_enforced);
+        break;
+    case KEY_BLOB_AUTH_ENCRYPTED_OCB:
+    case KEY_BLOB_AUTH_ENCRYPTED_GCM:
+    case KEY_BLOB_OLD_SOFTKEYMASTER:
+        error = ParseLegacyKeyBlob(blob, format, hidden, key_material, hw_enforced, sw_enforced);
+        if (error == KM_ERROR_OK) LOG_D("Parsed a legacy software key, format %d", format);
+        break;
+    case KEY_BLOB_UNKNOWN:
+        break;
+    }
+    return error;
+}
+
+keymaster_error_t PureSoftKeymasterContext::CheckParsedKeyBlob(
+    const KeymasterKeyBlob& blob, const AuthorizationSet& hw_enforced,
+    const AuthorizationSet& sw_enforced, keymaster_algorithm_t* algorithm) const {
+    if (!hw_enforced.GetTagValue(TAG_ALGORITHM, algorithm) &&
+        !sw_enforced.GetTagValue(TAG_ALGORITHM, algorithm)) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    // Pretend to be some sort of secure hardware that can securely store
+    // the key blob. Check the key blob is still securely stored now.
+    if (hw_enforced.Contains(KM_TAG_ROLLBACK_RESISTANCE) ||
+        hw_enforced.Contains(KM_TAG_USAGE_COUNT_LIMIT)) {
+        if (pure_soft_secure_key_storage_ == nullptr) return KM_ERROR_INVALID_KEY_BLOB;
+        km_id_t keyid;
+        bool exists;
+        if (!soft_keymaster_enforcement_.CreateKeyId(blob, &keyid)) {
+            return KM_ERROR_INVALID_KEY_BLOB;
+        }
+        keymaster_error_t error = pure_soft_secure_key_storage_->KeyExists(keyid, &exists);
+        if (error != KM_ERROR_OK || !exists) return KM_ERROR_INVALID_KEY_BLOB;
+    }
+    return KM_ERROR_OK;
 }
 
 keymaster_error_t PureSoftKeymasterContext::DeleteKey(const KeymasterKeyBlob& blob) const {
+    km_id_t cache_id;
+    if (soft_keymaster_enforcement_.CreateKeyId(blob, &cache_id)) {
+        parsed_key_cache_.Invalidate(cache_id);
+    }
+
     // Pretend to be some secure hardware with secure storage.
     if (GetSecurityLevel() != KM_SECURITY_LEVEL_SOFTWARE &&
         pure_soft_secure_key_storage_ != nullptr) {
@@ -364,7 +680,146 @@ keymaster_error_t PureSoftKeymasterContext::DeleteKey(const KeymasterKeyBlob& bl
     return KM_ERROR_OK;
 }
 
+void PureSoftKeymasterContext::DeleteKeys(const KeymasterKeyBlob* blobs, size_t count,
+                                          keymaster_error_t* errors) const {
+    bool secure_storage = GetSecurityLevel() != KM_SECURITY_LEVEL_SOFTWARE &&
+                          pure_soft_secure_key_storage_ != nullptr;
+    std::vector<km_id_t> keyids;
+    std::vector<size_t> stored;
+    if (secure_storage) {
+        keyids.reserve(count);
+        stored.reserve(count);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        errors[i] = KM_ERROR_OK;
+        km_id_t keyid;
+        if (!soft_keymaster_enforcement_.CreateKeyId(blobs[i], &keyid)) {
+            if (secure_storage) errors[i] = KM_ERROR_UNKNOWN_ERROR;
+            continue;
+        }
+        parsed_key_cache_.Invalidate(keyid);
+        if (secure_storage) {
+            keyids.push_back(keyid);
+            stored.push_back(i);
+        }
+    }
+
+    // One storage update for the whole batch, rather than one per key.
+    if (keyids.empty()) return;
+    keymaster_error_t error =
+        pure_soft_secure_key_storage_->DeleteKeys(keyids.data(), keyids.size());
+    if (error == KM_ERROR_OK) return;
+    for (size_t index : stored) {
+        errors[index] = error;
+    }
+}
+
+keymaster_error_t
+PureSoftKeymasterContext::SnapshotWarmState(std::vector<uint8_t>* snapshot) const {
+    keymaster_error_t error;
+    std::vector<uint8_t> hmac_state;
+    if (config_.snapshot_shared_hmac_key) {
+        error = soft_keymaster_enforcement_.SerializeSharedHmacState(&hmac_state);
+        if (error != KM_ERROR_OK) return error;
+    }
+    std::vector<uint8_t> storage_state;
+    if (pure_soft_secure_key_storage_) {
+        // Only ever a PureSoftSecureKeyStorage; see the constructor.
+        error = static_cast<const PureSoftSecureKeyStorage*>(pure_soft_secure_key_storage_.get())
+                    ->Snapshot(&storage_state);
+        if (error != KM_ERROR_OK) return error;
+    }
+
+    KeymasterKeyBlob plaintext(4 * sizeof(uint32_t) + hmac_state.size() + storage_state.size());
+    if (!plaintext.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    uint8_t* buf = plaintext.writable_data();
+    const uint8_t* end = plaintext.end();
+    buf = append_uint32_to_buf(buf, end, kWarmStateMagic);
+    buf = append_uint32_to_buf(buf, end, kWarmStateVersion);
+    buf = append_size_and_data_to_buf(buf, end, hmac_state.data(), hmac_state.size());
+    buf = append_size_and_data_to_buf(buf, end, storage_state.data(), storage_state.size());
+    if (buf != end) return KM_ERROR_UNKNOWN_ERROR;
+
+    return SealSnapshot(plaintext, SnapshotHidden(kWarmStateLabel), snapshot);
+}
+
+keymaster_error_t PureSoftKeymasterContext::RestoreWarmState(const uint8_t* snapshot,
+                                                             size_t size) {
+    KeymasterKeyBlob plaintext;
+    keymaster_error_t error =
+        OpenSnapshot(snapshot, size, SnapshotHidden(kWarmStateLabel), &plaintext);
+    if (error != KM_ERROR_OK) return error;
+
+    const uint8_t* pos = plaintext.begin();
+    const uint8_t* end = plaintext.end();
+    uint32_t magic, version;
+    const uint8_t *hmac_state, *storage_state;
+    size_t hmac_state_size, storage_state_size;
+    if (!copy_uint32_from_buf(&pos, end, &magic) || !copy_uint32_from_buf(&pos, end, &version) ||
+        magic != kWarmStateMagic || version != kWarmStateVersion ||
+        !view_size_and_data_from_buf(&pos, end, &hmac_state, &hmac_state_size) ||
+        !view_size_and_data_from_buf(&pos, end, &storage_state, &storage_state_size) ||
+        pos != end) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    // The storage snapshot is the only part that can be rejected once the snapshot has been
+    // authenticated (if this context has fewer slots), so load it first: on failure, nothing has
+    // changed.
+    if (storage_state_size) {
+        if (!pure_soft_secure_key_storage_) return KM_ERROR_INVALID_ARGUMENT;
+        error = static_cast<PureSoftSecureKeyStorage*>(pure_soft_secure_key_storage_.get())
+                    ->LoadSnapshot(storage_state, storage_state_size);
+        if (error != KM_ERROR_OK) return error;
+    }
+    if (hmac_state_size && config_.snapshot_shared_hmac_key) {
+        error = soft_keymaster_enforcement_.RestoreSharedHmacState(hmac_state, hmac_state_size);
+        if (error != KM_ERROR_OK) return error;
+    }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t PureSoftKeymasterContext::SealSnapshot(const KeymasterKeyBlob& plaintext,
+                                                         const AuthorizationSet& hidden,
+                                                         std::vector<uint8_t>* sealed) const {
+    MasterKeyContext master_key;
+    keymaster_error_t error = master_key.Initialize(KeymasterKeyBlob(kWarmStateKey));
+    if (error != KM_ERROR_OK) return error;
+    const RandomSource& random = *this;
+    AuthorizationSet no_auths;
+    auto encrypted = EncryptKey(plaintext, AES_GCM_WITH_SW_ENFORCED, no_auths, no_auths, hidden,
+                                SecureDeletionData(), master_key, random);
+    if (!encrypted) return encrypted.error();
+    auto blob = SerializeAuthEncryptedBlob(*encrypted, no_auths, no_auths, 0 /* key_slot */);
+    if (!blob) return blob.error();
+
+    sealed->assign(blob->begin(), blob->end());
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t PureSoftKeymasterContext::OpenSnapshot(const uint8_t* sealed, size_t size,
+                                                         const AuthorizationSet& hidden,
+                                                         KeymasterKeyBlob* plaintext) const {
+    KeymasterKeyBlob blob(sealed, size);
+    if (size && !blob.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    auto deserialized = DeserializeAuthEncryptedBlob(blob);
+    if (!deserialized || deserialized->encrypted_key.format != AES_GCM_WITH_SW_ENFORCED) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    MasterKeyContext master_key;
+    keymaster_error_t error = master_key.Initialize(KeymasterKeyBlob(kWarmStateKey));
+    if (error != KM_ERROR_OK) return error;
+    auto decrypted = DecryptKey(*deserialized, hidden, SecureDeletionData(), master_key);
+    if (!decrypted) return KM_ERROR_INVALID_ARGUMENT;
+    *plaintext = std::move(*decrypted);
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t PureSoftKeymasterContext::DeleteAllKeys() const {
+    parsed_key_cache_.Clear();
+
     // Pretend to be some secure hardware with secure storage.
     if (GetSecurityLevel() != KM_SECURITY_LEVEL_SOFTWARE &&
         pure_soft_secure_key_storage_ != nullptr) {
@@ -380,10 +835,15 @@ keymaster_error_t PureSoftKeymasterContext::AddRngEntropy(const uint8_t* buf, si
         // At most 2KiB is allowed to be added at once.
         return KM_ERROR_INVALID_INPUT_LENGTH;
     }
-    // XXX TODO according to boringssl openssl/rand.h RAND_add is deprecated and does
-    // nothing
-    RAND_add(buf, length, 0 /* Don't assume any entropy is added to the pool. */);
-    return KM_ERROR_OK;
+    return AddEntropy(buf, length);
+}
+
+bool PureSoftKeymasterContext::GetCacheCounters(KeymasterCache cache, uint64_t* hits,
+                                                uint64_t* misses) const {
+    if (cache != KeymasterCache::PARSED_KEY) return false;
+    *hits = parsed_key_cache_.hits();
+    *misses = parsed_key_cache_.misses();
+    return true;
 }
 
 CertificateChain
@@ -446,29 +906,87 @@ keymaster::Buffer PureSoftKeymasterContext::GenerateUniqueId(uint64_t creation_d
                                                              const keymaster_blob_t& application_id,
                                                              bool reset_since_rotation,
                                                              keymaster_error_t* error) const {
-    *error = KM_ERROR_OK;
-    // The default implementation fakes the hardware bound key with an arbitrary 128-bit value.
-    // Any real implementation must follow the guidance from the interface definition
-    // hardware/interfaces/security/keymint/aidl/android/hardware/security/keymint/Tag.aidl:
-    // "..a unique hardware-bound secret known to the secure environment and never revealed by it.
-    // The secret must contain at least 128 bits of entropy and be unique to the individual device"
-    const std::vector<uint8_t> fake_hbk = {'M', 'u', 's', 't', 'B', 'e', 'R', 'a',
-                                           'n', 'd', 'o', 'm', 'B', 'i', 't', 's'};
     Buffer unique_id;
-    *error = keymaster::generate_unique_id(fake_hbk, creation_date_time, application_id,
-                                           reset_since_rotation, &unique_id);
+    *error = unique_id_generator_.Generate(creation_date_time, application_id, reset_since_rotation,
+                                           &unique_id);
     return unique_id;
 }
 
-static keymaster_error_t TranslateAuthorizationSetError(AuthorizationSet::Error err) {
-    switch (err) {
-    case AuthorizationSet::OK:
-        return KM_ERROR_OK;
-    case AuthorizationSet::ALLOCATION_FAILURE:
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    case AuthorizationSet::MALFORMED_DATA:
+// Expected nonce and tag lengths of the AES-GCM encryption of a wrapped key.
+constexpr size_t kWrappedKeyNonceLength = 12;
+constexpr size_t kWrappedKeyTagLength = 16;
+
+// Decrypts the secure key of a wrapped key directly into |plaintext|, authenticating |aad|.  As
+// with an AES-GCM decrypt operation fed |secure_key| followed by |tag|, the last
+// kWrappedKeyTagLength bytes of that concatenation are the GCM tag, wherever the fields split.
+static keymaster_error_t DecryptWrappedKeyMaterial(const KeymasterKeyBlob& transit_key,
+                                                   const keymaster_blob_t& iv,
+                                                   const keymaster_blob_t& secure_key,
+                                                   const keymaster_blob_t& tag,
+                                                   const keymaster_blob_t& aad,
+                                                   KeymasterKeyBlob* plaintext) {
+    const EVP_CIPHER* cipher;
+    switch (transit_key.key_material_size) {
+    case 16:
+        cipher = EVP_aes_128_gcm();
+        break;
+    case 24:
+        cipher = EVP_aes_192_gcm();
+        break;
+    case 32:
+        cipher = EVP_aes_256_gcm();
+        break;
+    default:
+        return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+    }
+    if (iv.data_length != kWrappedKeyNonceLength) return KM_ERROR_INVALID_NONCE;
+
+    size_t total_length = secure_key.data_length + tag.data_length;
+    if (total_length < kWrappedKeyTagLength) return KM_ERROR_INVALID_INPUT_LENGTH;
+    size_t ciphertext_length = total_length - kWrappedKeyTagLength;
+    size_t head_length = std::min(ciphertext_length, secure_key.data_length);
+    size_t tail_length = ciphertext_length - head_length;
+
+    uint8_t gcm_tag[kWrappedKeyTagLength];
+    for (size_t i = 0; i < kWrappedKeyTagLength; ++i) {
+        size_t pos = ciphertext_length + i;
+        gcm_tag[i] = pos < secure_key.data_length
+                         ? secure_key.data[pos]
+                         : tag.data[pos - secure_key.data_length];
+    }
+
+    KeymasterKeyBlob result(ciphertext_length);
+    if (ciphertext_length && !result.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    bssl::UniquePtr<EVP_CIPHER_CTX> ctx(EVP_CIPHER_CTX_new());
+    if (!ctx) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    // GCM treats a null input as the end of the message, so empty pieces are skipped.
+    int aad_written = 0;
+    int head_written = 0;
+    int tail_written = 0;
+    if (!EVP_DecryptInit_ex(ctx.get(), cipher, nullptr /* engine */, transit_key.key_material,
+                            iv.data) ||
+        (aad.data_length && !EVP_DecryptUpdate(ctx.get(), nullptr /* out */, &aad_written,
+                                               aad.data, aad.data_length)) ||
+        (head_length && !EVP_DecryptUpdate(ctx.get(), result.writable_data(), &head_written,
+                                           secure_key.data, head_length)) ||
+        (tail_length && !EVP_DecryptUpdate(ctx.get(), result.writable_data() + head_written,
+                                           &tail_written, tag.data, tail_length)) ||
+        !EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, kWrappedKeyTagLength, gcm_tag)) {
+        return TranslateLastOpenSslError();
+    }
+
+    int final_written = 0;
+    if (!EVP_DecryptFinal_ex(ctx.get(), nullptr /* not written to */, &final_written)) {
+        return KM_ERROR_VERIFICATION_FAILED;
+    }
+    if (static_cast<size_t>(head_written + tail_written) != ciphertext_length ||
+        final_written != 0) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
+
+    *plaintext = std::move(result);
     return KM_ERROR_OK;
 }
 
@@ -480,16 +998,16 @@ keymaster_error_t PureSoftKeymasterContext::UnwrapKey(
     keymaster_error_t error = KM_ERROR_OK;
 
     if (!wrapped_key_material) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    // Wrapping keys are RSA keys.
+    if (!kRsaIncluded) return KM_ERROR_UNSUPPORTED_ALGORITHM;
 
-    // Parse wrapped key data
-    KeymasterBlob iv;
-    KeymasterKeyBlob transit_key;
-    KeymasterKeyBlob secure_key;
-    KeymasterBlob tag;
-    KeymasterBlob wrapped_key_description;
-    error = parse_wrapped_key(wrapped_key_blob, &iv, &transit_key, &secure_key, &tag,
-                              wrapped_key_params, wrapped_key_format, &wrapped_key_description);
+    // Parse wrapped key data.  The fields are views into |wrapped_key_blob|.
+    WrappedKeyView wrapped;
+    error = parse_wrapped_key(wrapped_key_blob, &wrapped);
+    if (error != KM_ERROR_OK) return error;
+    error = parse_wrapped_key_auth_list(wrapped, wrapped_key_params);
     if (error != KM_ERROR_OK) return error;
+    *wrapped_key_format = wrapped.key_format;
 
     UniquePtr<Key> key;
     auto wrapping_key_params = AuthorizationSetBuilder()
@@ -520,7 +1038,7 @@ keymaster_error_t PureSoftKeymasterContext::UnwrapKey(
 
     Buffer input;
     Buffer output;
-    if (!input.Reinitialize(transit_key.key_material, transit_key.key_material_size)) {
+    if (!input.Reinitialize(wrapped.transit_key.data, wrapped.transit_key.data_length)) {
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
 
@@ -528,96 +1046,21 @@ keymaster_error_t PureSoftKeymasterContext::UnwrapKey(
                               &output);
     if (error != KM_ERROR_OK) return error;
 
-    // decrypt the encrypted key material with the transit key
-    KeymasterKeyBlob key_material = {output.peek_read(), output.available_read()};
-
     // XOR the transit key with the masking key
-    if (key_material.key_material_size != masking_key.key_material_size) {
+    if (output.available_read() != masking_key.key_material_size) {
         return KM_ERROR_INVALID_ARGUMENT;
     }
-    for (size_t i = 0; i < key_material.key_material_size; i++) {
-        key_material.writable_data()[i] ^= masking_key.key_material[i];
-    }
-
-    auto transit_key_authorizations = AuthorizationSetBuilder()
-                                          .AesEncryptionKey(256)
-                                          .Padding(KM_PAD_NONE)
-                                          .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
-                                          .Authorization(TAG_NONCE, iv)
-                                          .Authorization(TAG_MIN_MAC_LENGTH, 128)
-                                          .build();
-    if (transit_key_authorizations.is_valid() != AuthorizationSet::Error::OK) {
-        return TranslateAuthorizationSetError(transit_key_authorizations.is_valid());
-    }
-    auto gcm_params = AuthorizationSetBuilder()
-                          .Padding(KM_PAD_NONE)
-                          .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
-                          .Authorization(TAG_NONCE, iv)
-                          .Authorization(TAG_MAC_LENGTH, 128)
-                          .build();
-    if (gcm_params.is_valid() != AuthorizationSet::Error::OK) {
-        return TranslateAuthorizationSetError(transit_key_authorizations.is_valid());
-    }
-
-    auto aes_factory = GetKeyFactory(KM_ALGORITHM_AES);
-    if (!aes_factory) return KM_ERROR_UNKNOWN_ERROR;
-
-    UniquePtr<Key> aes_key;
-    error = aes_factory->LoadKey(std::move(key_material), gcm_params,
-                                 std::move(transit_key_authorizations), AuthorizationSet(),
-                                 &aes_key);
-    if (error != KM_ERROR_OK) return error;
-
-    auto aes_operation_factory = GetOperationFactory(KM_ALGORITHM_AES, KM_PURPOSE_DECRYPT);
-    if (!aes_operation_factory) return KM_ERROR_UNKNOWN_ERROR;
-
-    OperationPtr aes_operation(
-        aes_operation_factory->CreateOperation(std::move(*aes_key), gcm_params, &error));
-    if (!aes_operation.get()) return error;
-
-    error = aes_operation->Begin(gcm_params, &out_params);
-    if (error != KM_ERROR_OK) return error;
-
-    size_t consumed = 0;
-    Buffer encrypted_key, plaintext;
-    if (!plaintext.Reinitialize(secure_key.key_material_size + tag.data_length)) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-    if (!encrypted_key.Reinitialize(secure_key.key_material_size + tag.data_length)) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-    if (!encrypted_key.write(secure_key.key_material, secure_key.key_material_size)) {
-        return KM_ERROR_UNKNOWN_ERROR;
+    KeymasterKeyBlob transit_key_material(output.available_read());
+    if (!transit_key_material.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    for (size_t i = 0; i < transit_key_material.key_material_size; i++) {
+        transit_key_material.writable_data()[i] =
+            output.peek_read()[i] ^ masking_key.key_material[i];
     }
-    if (!encrypted_key.write(tag.data, tag.data_length)) {
-        return KM_ERROR_UNKNOWN_ERROR;
-    }
-
-    AuthorizationSet update_outparams;
-    auto update_params = AuthorizationSetBuilder()
-                             .Authorization(TAG_ASSOCIATED_DATA, wrapped_key_description.data,
-                                            wrapped_key_description.data_length)
-                             .build();
-    if (update_params.is_valid() != AuthorizationSet::Error::OK) {
-        return TranslateAuthorizationSetError(update_params.is_valid());
-    }
-
-    error = aes_operation->Update(update_params, encrypted_key, &update_outparams, &plaintext,
-                                  &consumed);
-    if (error != KM_ERROR_OK) return error;
 
-    AuthorizationSet finish_params, finish_out_params;
-    Buffer finish_input;
-    error = aes_operation->Finish(finish_params, finish_input, Buffer() /* signature */,
-                                  &finish_out_params, &plaintext);
-    if (error != KM_ERROR_OK) return error;
-
-    *wrapped_key_material = {plaintext.peek_read(), plaintext.available_read()};
-    if (!wrapped_key_material->key_material && plaintext.peek_read()) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
-    return error;
+    // decrypt the encrypted key material with the transit key
+    return DecryptWrappedKeyMaterial(transit_key_material, wrapped.iv, wrapped.secure_key,
+                                     wrapped.tag, wrapped.wrapped_key_description,
+                                     wrapped_key_material);
 }
 
 const AttestationContext::VerifiedBootParams*
@@ -633,4 +1076,12 @@ PureSoftKeymasterContext::GetVerifiedBootParams(keymaster_error_t* error) const
     return &params;
 }
 
+std::shared_ptr<const AttestationContext::RootOfTrustEncodings>
+PureSoftKeymasterContext::GetRootOfTrustEncodings() const {
+    keymaster_error_t error;
+    const VerifiedBootParams* params = GetVerifiedBootParams(&error);
+    if (error != KM_ERROR_OK) return nullptr;
+    return root_of_trust_cache_.Get(*params, boot_patchlevel_);
+}
+
 }  // namespace keymaster
@@ -58,6 +58,14 @@ std::vector<uint8_t>
 PureSoftRemoteProvisioningContext::DeriveBytesFromHbk(const std::string& context,
                                                       size_t num_bytes) const {
     static const std::array<uint8_t, 32> fakeHbk = GetRandomBytes();
+
+    std::lock_guard<std::mutex> lock(hbkDerivationMutex_);
+    for (const auto& derivation : hbkDerivations_) {
+        if (derivation.context == context && derivation.bytes.size() == num_bytes) {
+            return std::vector<uint8_t>(derivation.bytes.begin(), derivation.bytes.end());
+        }
+    }
+
     std::vector<uint8_t> result(num_bytes);
 
     // TODO: Figure out if HKDF can fail.  It doesn't seem like it should be able to,
@@ -68,11 +76,39 @@ PureSoftRemoteProvisioningContext::DeriveBytesFromHbk(const std::string& context
          nullptr /* salt */, 0 /* salt len */,  //
          reinterpret_cast<const uint8_t*>(context.data()), context.size());
 
+    if (hbkDerivations_.size() < kMaxHbkDerivations) {
+        KeymasterKeyBlob bytes(result.data(), result.size());
+        if (bytes.key_material) hbkDerivations_.push_back({context, std::move(bytes)});
+    }
     return result;
 }
 
 std::unique_ptr<cppbor::Map>
 PureSoftRemoteProvisioningContext::CreateDeviceInfo(uint32_t csrVersion) const {
+    std::lock_guard<std::mutex> lock(deviceInfoMutex_);
+    auto clone = GetCachedDeviceInfo(csrVersion).map->clone();
+    return std::make_unique<cppbor::Map>(std::move(*clone->asMap()));
+}
+
+std::vector<uint8_t>
+PureSoftRemoteProvisioningContext::CreateEncodedDeviceInfo(uint32_t csrVersion) const {
+    std::lock_guard<std::mutex> lock(deviceInfoMutex_);
+    return GetCachedDeviceInfo(csrVersion).encoded;
+}
+
+const PureSoftRemoteProvisioningContext::CachedDeviceInfo&
+PureSoftRemoteProvisioningContext::GetCachedDeviceInfo(uint32_t csrVersion) const {
+    for (const auto& entry : deviceInfoCache_) {
+        if (entry.csrVersion == csrVersion) return entry;
+    }
+    auto map = BuildDeviceInfo(csrVersion);
+    auto encoded = map->encode();
+    deviceInfoCache_.push_back({csrVersion, std::move(map), std::move(encoded)});
+    return deviceInfoCache_.back();
+}
+
+std::unique_ptr<cppbor::Map>
+PureSoftRemoteProvisioningContext::BuildDeviceInfo(uint32_t csrVersion) const {
     auto result = std::make_unique<cppbor::Map>(cppbor::Map());
 
     // The following placeholders show how the DeviceInfo map would be populated.
@@ -118,9 +154,28 @@ PureSoftRemoteProvisioningContext::CreateDeviceInfo(uint32_t csrVersion) const {
     return result;
 }
 
+std::shared_ptr<const PureSoftRemoteProvisioningContext::ProdBcc>
+PureSoftRemoteProvisioningContext::AttachProdBcc() const {
+    static std::mutex mutex;
+    static std::weak_ptr<const ProdBcc> shared;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (auto prodBcc = shared.lock()) return prodBcc;
+
+    auto prodBcc = std::make_shared<ProdBcc>();
+    std::tie(prodBcc->devicePrivKey, prodBcc->bcc) = GenerateBcc(/*testMode=*/false);
+    shared = prodBcc;
+    return prodBcc;
+}
+
 void PureSoftRemoteProvisioningContext::LazyInitProdBcc() const {
-    std::call_once(bccInitFlag_,
-                   [this]() { std::tie(devicePrivKey_, bcc_) = GenerateBcc(/*testMode=*/false); });
+    std::call_once(bccInitFlag_, [this]() { prodBcc_ = AttachProdBcc(); });
+}
+
+void PureSoftRemoteProvisioningContext::LazyInitTestBcc() const {
+    std::call_once(testBccInitFlag_, [this]() {
+        std::tie(testDevicePrivKey_, testBcc_) = GenerateBcc(/*testMode=*/true);
+    });
 }
 
 std::pair<std::vector<uint8_t> /* privKey */, cppbor::Array /* BCC */>
@@ -163,19 +218,18 @@ ErrMsgOr<std::vector<uint8_t>> PureSoftRemoteProvisioningContext::BuildProtected
     bool isTestMode,                     //
     const std::vector<uint8_t>& macKey,  //
     const std::vector<uint8_t>& aad) const {
-    std::vector<uint8_t> devicePrivKey;
-    cppbor::Array bcc;
     if (isTestMode) {
-        std::tie(devicePrivKey, bcc) = GenerateBcc(/*testMode=*/true);
+        LazyInitTestBcc();
     } else {
         LazyInitProdBcc();
-        devicePrivKey = devicePrivKey_;
-        auto clone = bcc_.clone();
-        if (!clone->asArray()) {
-            return "The BCC is not an array";
-        }
-        bcc = std::move(*clone->asArray());
     }
+    const std::vector<uint8_t>& devicePrivKey =
+        isTestMode ? testDevicePrivKey_ : prodBcc_->devicePrivKey;
+    auto clone = (isTestMode ? testBcc_ : prodBcc_->bcc).clone();
+    if (!clone->asArray()) {
+        return "The BCC is not an array";
+    }
+    cppbor::Array bcc = std::move(*clone->asArray());
     auto sign1 = constructCoseSign1(devicePrivKey, macKey, aad);
     if (!sign1) {
         return sign1.moveMessage();
@@ -185,10 +239,19 @@ ErrMsgOr<std::vector<uint8_t>> PureSoftRemoteProvisioningContext::BuildProtected
 
 std::optional<cppcose::HmacSha256>
 PureSoftRemoteProvisioningContext::GenerateHmacSha256(const cppcose::bytevec& input) const {
-    // Fix the key for now, else HMACs will fail to verify after reboot.
-    static const uint8_t kHmacKey[] = "Key to MAC public keys";
-    std::vector<uint8_t> key(std::begin(kHmacKey), std::end(kHmacKey));
-    auto result = cppcose::generateHmacSha256(key, input);
+    // Fix the key for now, else HMACs will fail to verify after reboot.  It is keyed once, and
+    // each MAC starts from a copy of the keyed state.
+    static const cppcose::HmacSha256Key* macKey = [] {
+        static const uint8_t kHmacKey[] = "Key to MAC public keys";
+        auto key = cppcose::HmacSha256Key::create(
+            std::vector<uint8_t>(std::begin(kHmacKey), std::end(kHmacKey)));
+        return key ? new (std::nothrow) cppcose::HmacSha256Key(key.moveValue()) : nullptr;
+    }();
+    if (!macKey) {
+        LOG_E("Error signing MAC: failed to key HMAC", 0);
+        return std::nullopt;
+    }
+    auto result = macKey->mac(input);
     if (!result) {
         LOG_E("Error signing MAC: %s", result.message().c_str());
         return std::nullopt;
@@ -216,35 +279,44 @@ PureSoftRemoteProvisioningContext::BuildCsr(const std::vector<uint8_t>& challeng
                           .add(std::move(deviceInfo))
                           .add(std::move(keysToSign));
     auto signedDataPayload = cppbor::Array().add(challenge).add(cppbor::Bstr(csrPayload.encode()));
-    auto signedData = constructCoseSign1(devicePrivKey_, signedDataPayload.encode(), {} /* aad */);
+    auto signedData =
+        constructCoseSign1(prodBcc_->devicePrivKey, signedDataPayload.encode(), {} /* aad */);
 
     return cppbor::Array()
         .add(1 /* version */)
         .add(cppbor::Map() /* UdsCerts */)
-        .add(std::move(*bcc_.clone()->asArray()) /* DiceCertChain */)
+        .add(std::move(*prodBcc_->bcc.clone()->asArray()) /* DiceCertChain */)
         .add(std::move(*signedData) /* SignedData */);
 }
 
 void PureSoftRemoteProvisioningContext::SetSystemVersion(uint32_t os_version,
                                                          uint32_t os_patchlevel) {
+    std::lock_guard<std::mutex> lock(deviceInfoMutex_);
     os_version_ = os_version;
     os_patchlevel_ = os_patchlevel;
+    deviceInfoCache_.clear();
 }
 
 void PureSoftRemoteProvisioningContext::SetVendorPatchlevel(uint32_t vendor_patchlevel) {
+    std::lock_guard<std::mutex> lock(deviceInfoMutex_);
     vendor_patchlevel_ = vendor_patchlevel;
+    deviceInfoCache_.clear();
 }
 
 void PureSoftRemoteProvisioningContext::SetBootPatchlevel(uint32_t boot_patchlevel) {
+    std::lock_guard<std::mutex> lock(deviceInfoMutex_);
     boot_patchlevel_ = boot_patchlevel;
+    deviceInfoCache_.clear();
 }
 
 void PureSoftRemoteProvisioningContext::SetVerifiedBootInfo(
     std::string_view boot_state, std::string_view bootloader_state,
     const std::vector<uint8_t>& vbmeta_digest) {
+    std::lock_guard<std::mutex> lock(deviceInfoMutex_);
     verified_boot_state_ = boot_state;
     bootloader_state_ = bootloader_state;
     vbmeta_digest_ = vbmeta_digest;
+    deviceInfoCache_.clear();
 }
 
 }  // namespace keymaster
@@ -318,4 +318,15 @@ CertificateChain getAttestationChain(keymaster_algorithm_t algorithm, keymaster_
     return retval;
 }
 
+const keymaster_cert_chain_t* getAttestationChainRef(keymaster_algorithm_t algorithm) {
+    switch (algorithm) {
+    case KM_ALGORITHM_RSA:
+        return &kRsaAttestChain;
+    case KM_ALGORITHM_EC:
+        return &kEcAttestChain;
+    default:
+        return nullptr;
+    }
+}
+
 }  // namespace keymaster
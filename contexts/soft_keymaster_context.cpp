@@ -18,17 +18,17 @@
 
 #include <memory>
 
-#include <openssl/rand.h>
-
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/key_blob_utils/auth_encrypted_key_blob.h>
 #include <keymaster/key_blob_utils/integrity_assured_key_blob.h>
+#include <keymaster/key_blob_utils/legacy_keyblobs.h>
 #include <keymaster/key_blob_utils/ocb_utils.h>
 #include <keymaster/key_blob_utils/software_keyblobs.h>
 #include <keymaster/km_openssl/aes_key.h>
 #include <keymaster/km_openssl/asymmetric_key.h>
 #include <keymaster/km_openssl/attestation_utils.h>
 #include <keymaster/km_openssl/certificate_utils.h>
+#include <keymaster/km_openssl/crypto_dispatch.h>
 #include <keymaster/km_openssl/hmac_key.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/triple_des_key.h>
@@ -61,7 +61,9 @@ SoftKeymasterContext::SoftKeymasterContext(KmVersion version, const std::string&
       hmac_factory_(new (std::nothrow)
                         HmacKeyFactory(*this /* blob_maker */, *this /* random_source */)),
       km1_dev_(nullptr), root_of_trust_(string2Blob(root_of_trust)), os_version_(0),
-      os_patchlevel_(0) {}
+      os_patchlevel_(0) {
+    LogCryptoDispatchOnce();
+}
 
 SoftKeymasterContext::~SoftKeymasterContext() {}
 
@@ -280,20 +282,27 @@ keymaster_error_t SoftKeymasterContext::ParseKeyBlob(const KeymasterKeyBlob& blo
     error = BuildHiddenAuthorizations(additional_params, &hidden, root_of_trust_);
     if (error != KM_ERROR_OK) return error;
 
-    // Assume it's an integrity-assured blob (new software-only blob, or new keymaster0-backed
-    // blob).
-    error =
-        DeserializeIntegrityAssuredBlob(blob, hidden, &key_material, &hw_enforced, &sw_enforced);
-    if (error != KM_ERROR_INVALID_KEY_BLOB) return constructKey();
-
-    // Wasn't an integrity-assured blob.  Maybe it's an Auth-encrypted blob.
-    error = ParseAuthEncryptedBlob(blob, hidden, &key_material, &hw_enforced, &sw_enforced);
-    if (error == KM_ERROR_OK) LOG_D("Parsed an old keymaster1 software key", 0);
-    if (error != KM_ERROR_INVALID_KEY_BLOB) return constructKey();
-
-    // Wasn't an OCB-encrypted blob.  Maybe it's an old softkeymaster blob.
-    error = ParseOldSoftkeymasterBlob(blob, &key_material, &hw_enforced, &sw_enforced);
-    if (error == KM_ERROR_OK) LOG_D("Parsed an old sofkeymaster key", 0);
+    // Dispatch on the blob's header and layout instead of trying each software parser in turn.
+    // Hardware blobs can look like anything, so whatever a software parser rejects still goes to
+    // the keymaster1 device.
+    SoftwareKeyBlobFormat format = ClassifyKeyBlob(blob);
+    key_blob_formats_.Count(format);
+    switch (format) {
+    case KEY_BLOB_INTEGRITY_ASSURED:
+        error = DeserializeIntegrityAssuredBlob(blob, hidden, &key_material, &hw_enforced,
+                                                &sw_enforced);
+        break;
+    case KEY_BLOB_AUTH_ENCRYPTED_OCB:
+    case KEY_BLOB_AUTH_ENCRYPTED_GCM:
+    case KEY_BLOB_OLD_SOFTKEYMASTER:
+        error = ParseLegacyKeyBlob(blob, format, hidden, &key_material, &hw_enforced,
+                                   &sw_enforced);
+        if (error == KM_ERROR_OK) LOG_D("Parsed a legacy software key, format %d", format);
+        break;
+    case KEY_BLOB_UNKNOWN:
+        error = KM_ERROR_INVALID_KEY_BLOB;
+        break;
+    }
     if (error != KM_ERROR_INVALID_KEY_BLOB) return constructKey();
 
     if (km1_dev_) {
@@ -331,8 +340,7 @@ keymaster_error_t SoftKeymasterContext::DeleteAllKeys() const {
 }
 
 keymaster_error_t SoftKeymasterContext::AddRngEntropy(const uint8_t* buf, size_t length) const {
-    RAND_add(buf, length, 0 /* Don't assume any entropy is added to the pool. */);
-    return KM_ERROR_OK;
+    return AddEntropy(buf, length);
 }
 
 keymaster_error_t SoftKeymasterContext::ParseKeymaster1HwBlob(
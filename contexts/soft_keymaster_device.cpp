@@ -157,6 +157,29 @@ static keymaster_error_t map_digests(keymaster1_device_t* dev, SoftKeymasterDevi
     return KM_ERROR_OK;
 }
 
+namespace {
+
+template <typename T>
+keymaster_error_t CopySupportedList(const std::vector<T>& list, T** results,
+                                    size_t* results_length) {
+    *results_length = list.size();
+    *results = reinterpret_cast<T*>(malloc(*results_length * sizeof(**results)));
+    if (!*results) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    std::copy(list.begin(), list.end(), *results);
+    return KM_ERROR_OK;
+}
+
+template <typename Map, typename Key, typename T>
+bool FindSupportedList(const Map& map, const Key& key, T** results, size_t* results_length,
+                       keymaster_error_t* error) {
+    auto entry = map.find(key);
+    if (entry == map.end()) return false;
+    *error = CopySupportedList(entry->second, results, results_length);
+    return true;
+}
+
+}  // namespace
+
 SoftKeymasterDevice::SoftKeymasterDevice(KmVersion version)
     : wrapped_km1_device_(nullptr), context_(new (std::nothrow) SoftKeymasterContext(version)),
       impl_(new (std::nothrow) AndroidKeymaster(context_, kOperationTableSize)),
@@ -166,6 +189,7 @@ SoftKeymasterDevice::SoftKeymasterDevice(KmVersion version)
 
     initialize_device_struct(KEYMASTER_SOFTWARE_ONLY | KEYMASTER_BLOBS_ARE_STANDALONE |
                              KEYMASTER_SUPPORTS_EC);
+    collect_supported_capabilities();
 }
 
 SoftKeymasterDevice::SoftKeymasterDevice(SoftKeymasterContext* context)
@@ -177,6 +201,7 @@ SoftKeymasterDevice::SoftKeymasterDevice(SoftKeymasterContext* context)
 
     initialize_device_struct(KEYMASTER_SOFTWARE_ONLY | KEYMASTER_BLOBS_ARE_STANDALONE |
                              KEYMASTER_SUPPORTS_EC);
+    collect_supported_capabilities();
 }
 
 keymaster_error_t SoftKeymasterDevice::SetHardwareDevice(keymaster1_device_t* keymaster1_device) {
@@ -229,6 +254,80 @@ bool SoftKeymasterDevice::Keymaster1DeviceIsGood() {
     return true;
 }
 
+void SoftKeymasterDevice::collect_supported_capabilities() {
+    if (!impl_) return;
+
+    SupportedAlgorithmsRequest algorithms_request(impl_->message_version());
+    SupportedAlgorithmsResponse algorithms_response(impl_->message_version());
+    impl_->SupportedAlgorithms(algorithms_request, &algorithms_response);
+    if (algorithms_response.error != KM_ERROR_OK) return;
+    capabilities_.algorithms.assign(
+        algorithms_response.results,
+        algorithms_response.results + algorithms_response.results_length);
+    capabilities_.algorithms_valid = true;
+
+    static const keymaster_purpose_t kPurposes[] = {
+        KM_PURPOSE_ENCRYPT, KM_PURPOSE_DECRYPT,   KM_PURPOSE_SIGN,       KM_PURPOSE_VERIFY,
+        KM_PURPOSE_WRAP,    KM_PURPOSE_AGREE_KEY, KM_PURPOSE_ATTEST_KEY,
+    };
+
+    for (keymaster_algorithm_t algorithm : capabilities_.algorithms) {
+        for (keymaster_purpose_t purpose : kPurposes) {
+            AlgPurposePair key(algorithm, purpose);
+
+            SupportedBlockModesRequest modes_request(impl_->message_version());
+            modes_request.algorithm = algorithm;
+            modes_request.purpose = purpose;
+            SupportedBlockModesResponse modes_response(impl_->message_version());
+            impl_->SupportedBlockModes(modes_request, &modes_response);
+            if (modes_response.error == KM_ERROR_OK) {
+                capabilities_.block_modes[key].assign(
+                    modes_response.results, modes_response.results + modes_response.results_length);
+            }
+
+            SupportedPaddingModesRequest padding_request(impl_->message_version());
+            padding_request.algorithm = algorithm;
+            padding_request.purpose = purpose;
+            SupportedPaddingModesResponse padding_response(impl_->message_version());
+            impl_->SupportedPaddingModes(padding_request, &padding_response);
+            if (padding_response.error == KM_ERROR_OK) {
+                capabilities_.padding_modes[key].assign(
+                    padding_response.results,
+                    padding_response.results + padding_response.results_length);
+            }
+
+            SupportedDigestsRequest digests_request(impl_->message_version());
+            digests_request.algorithm = algorithm;
+            digests_request.purpose = purpose;
+            SupportedDigestsResponse digests_response(impl_->message_version());
+            impl_->SupportedDigests(digests_request, &digests_response);
+            if (digests_response.error == KM_ERROR_OK) {
+                capabilities_.digests[key].assign(
+                    digests_response.results,
+                    digests_response.results + digests_response.results_length);
+            }
+        }
+
+        SupportedImportFormatsRequest import_request(impl_->message_version());
+        import_request.algorithm = algorithm;
+        SupportedImportFormatsResponse import_response(impl_->message_version());
+        impl_->SupportedImportFormats(import_request, &import_response);
+        if (import_response.error == KM_ERROR_OK) {
+            capabilities_.import_formats[algorithm].assign(
+                import_response.results, import_response.results + import_response.results_length);
+        }
+
+        SupportedExportFormatsRequest export_request(impl_->message_version());
+        export_request.algorithm = algorithm;
+        SupportedExportFormatsResponse export_response(impl_->message_version());
+        impl_->SupportedExportFormats(export_request, &export_response);
+        if (export_response.error == KM_ERROR_OK) {
+            capabilities_.export_formats[algorithm].assign(
+                export_response.results, export_response.results + export_response.results_length);
+        }
+    }
+}
+
 void SoftKeymasterDevice::initialize_device_struct(uint32_t flags) {
     memset(&km1_device_, 0, sizeof(km1_device_));
 
@@ -381,6 +480,10 @@ keymaster_error_t SoftKeymasterDevice::get_supported_algorithms(const keymaster1
     const keymaster1_device_t* km1_dev = convert_device(dev)->wrapped_km1_device_;
     if (km1_dev) return km1_dev->get_supported_algorithms(km1_dev, algorithms, algorithms_length);
 
+    const SupportedCapabilities& capabilities = convert_device(dev)->capabilities_;
+    if (capabilities.algorithms_valid)
+        return CopySupportedList(capabilities.algorithms, algorithms, algorithms_length);
+
     auto& impl_ = convert_device(dev)->impl_;
     SupportedAlgorithmsRequest request(impl_->message_version());
     SupportedAlgorithmsResponse response(impl_->message_version());
@@ -413,6 +516,11 @@ keymaster_error_t SoftKeymasterDevice::get_supported_block_modes(const keymaster
     if (km1_dev)
         return km1_dev->get_supported_block_modes(km1_dev, algorithm, purpose, modes, modes_length);
 
+    keymaster_error_t error;
+    if (FindSupportedList(convert_device(dev)->capabilities_.block_modes,
+                          AlgPurposePair(algorithm, purpose), modes, modes_length, &error))
+        return error;
+
     auto& impl_ = convert_device(dev)->impl_;
     SupportedBlockModesRequest request(impl_->message_version());
     request.algorithm = algorithm;
@@ -448,6 +556,11 @@ keymaster_error_t SoftKeymasterDevice::get_supported_padding_modes(const keymast
         return km1_dev->get_supported_padding_modes(km1_dev, algorithm, purpose, modes,
                                                     modes_length);
 
+    keymaster_error_t error;
+    if (FindSupportedList(convert_device(dev)->capabilities_.padding_modes,
+                          AlgPurposePair(algorithm, purpose), modes, modes_length, &error))
+        return error;
+
     auto& impl_ = convert_device(dev)->impl_;
     SupportedPaddingModesRequest request(impl_->message_version());
     request.algorithm = algorithm;
@@ -481,6 +594,11 @@ keymaster_error_t SoftKeymasterDevice::get_supported_digests(const keymaster1_de
     if (km1_dev)
         return km1_dev->get_supported_digests(km1_dev, algorithm, purpose, digests, digests_length);
 
+    keymaster_error_t error;
+    if (FindSupportedList(convert_device(dev)->capabilities_.digests,
+                          AlgPurposePair(algorithm, purpose), digests, digests_length, &error))
+        return error;
+
     auto& impl_ = convert_device(dev)->impl_;
     SupportedDigestsRequest request(impl_->message_version());
     request.algorithm = algorithm;
@@ -512,6 +630,11 @@ keymaster_error_t SoftKeymasterDevice::get_supported_import_formats(
     if (km1_dev)
         return km1_dev->get_supported_import_formats(km1_dev, algorithm, formats, formats_length);
 
+    keymaster_error_t error;
+    if (FindSupportedList(convert_device(dev)->capabilities_.import_formats, algorithm, formats,
+                          formats_length, &error))
+        return error;
+
     auto& impl_ = convert_device(dev)->impl_;
     SupportedImportFormatsRequest request(impl_->message_version());
     request.algorithm = algorithm;
@@ -543,6 +666,11 @@ keymaster_error_t SoftKeymasterDevice::get_supported_export_formats(
     if (km1_dev)
         return km1_dev->get_supported_export_formats(km1_dev, algorithm, formats, formats_length);
 
+    keymaster_error_t error;
+    if (FindSupportedList(convert_device(dev)->capabilities_.export_formats, algorithm, formats,
+                          formats_length, &error))
+        return error;
+
     auto& impl_ = convert_device(dev)->impl_;
     SupportedExportFormatsRequest request(impl_->message_version());
     request.algorithm = algorithm;
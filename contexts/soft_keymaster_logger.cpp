@@ -27,28 +27,35 @@
 
 namespace keymaster {
 
-int SoftKeymasterLogger::log_msg(LogLevel level, const char* fmt, va_list args) const {
-
+static int AndroidLogLevel(Logger::LogLevel level) {
     int android_log_level = ANDROID_LOG_ERROR;
     switch (level) {
-    case DEBUG_LVL:
+    case Logger::DEBUG_LVL:
         android_log_level = ANDROID_LOG_DEBUG;
         break;
-    case INFO_LVL:
+    case Logger::INFO_LVL:
         android_log_level = ANDROID_LOG_INFO;
         break;
-    case WARNING_LVL:
+    case Logger::WARNING_LVL:
         android_log_level = ANDROID_LOG_WARN;
         break;
-    case ERROR_LVL:
+    case Logger::ERROR_LVL:
         android_log_level = ANDROID_LOG_ERROR;
         break;
-    case SEVERE_LVL:
+    case Logger::SEVERE_LVL:
         android_log_level = ANDROID_LOG_ERROR;
         break;
     }
+    return android_log_level;
+}
+
+int SoftKeymasterLogger::log_msg(LogLevel level, const char* fmt, va_list args) const {
+    return LOG_PRI_VA(AndroidLogLevel(level), LOG_TAG, fmt, args);
+}
 
-    return LOG_PRI_VA(android_log_level, LOG_TAG, fmt, args);
+bool SoftKeymasterLogger::is_loggable(LogLevel level) const {
+    // The same test liblog applies before writing a message.
+    return __android_log_is_loggable(AndroidLogLevel(level), LOG_TAG, ANDROID_LOG_VERBOSE);
 }
 
 }  // namespace keymaster
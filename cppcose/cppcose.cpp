@@ -16,11 +16,14 @@
 
 #include <keymaster/cppcose/cppcose.h>
 
+#include <algorithm>
 #include <iostream>
 #include <stdio.h>
+#include <string.h>
 
 #include <cppbor.h>
 #include <cppbor_parse.h>
+#include <openssl/bytestring.h>
 #include <openssl/ecdsa.h>
 
 #include <openssl/err.h>
@@ -28,6 +31,8 @@
 namespace cppcose {
 constexpr int kP256AffinePointSize = 32;
 constexpr int kP384AffinePointSize = 48;
+// A SEQUENCE of two INTEGERs of up to 33 bytes, with two-byte headers throughout.
+constexpr size_t kMaxP256DerSignatureSize = 72;
 
 using EVP_PKEY_Ptr = bssl::UniquePtr<EVP_PKEY>;
 using EVP_PKEY_CTX_Ptr = bssl::UniquePtr<EVP_PKEY_CTX>;
@@ -36,11 +41,10 @@ using EC_KEY_Ptr = bssl::UniquePtr<EC_KEY>;
 
 namespace {
 
-ErrMsgOr<bssl::UniquePtr<EVP_CIPHER_CTX>> aesGcmInitAndProcessAad(const bytevec& key,
-                                                                  const bytevec& nonce,
-                                                                  const bytevec& aad,
-                                                                  bool encrypt) {
+ErrMsgOr<bssl::UniquePtr<EVP_CIPHER_CTX>> aesGcmInitAndProcessAad(bytespan key, bytespan nonce,
+                                                                  bytespan aad, bool encrypt) {
     if (key.size() != kAesGcmKeySize) return "Invalid key size";
+    if (nonce.size() != kAesGcmNonceLength) return "Invalid nonce size";
 
     bssl::UniquePtr<EVP_CIPHER_CTX> ctx(EVP_CIPHER_CTX_new());
     if (!ctx) return "Failed to allocate cipher context";
@@ -59,28 +63,6 @@ ErrMsgOr<bssl::UniquePtr<EVP_CIPHER_CTX>> aesGcmInitAndProcessAad(const bytevec&
     return std::move(ctx);
 }
 
-ErrMsgOr<bytevec> signP256Digest(const bytevec& key, const bytevec& data) {
-    auto bn = BIGNUM_Ptr(BN_bin2bn(key.data(), key.size(), nullptr));
-    if (bn.get() == nullptr) {
-        return "Error creating BIGNUM";
-    }
-
-    auto ec_key = EC_KEY_Ptr(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
-    if (EC_KEY_set_private_key(ec_key.get(), bn.get()) != 1) {
-        return "Error setting private key from BIGNUM";
-    }
-
-    auto sig = ECDSA_SIG_Ptr(ECDSA_do_sign(data.data(), data.size(), ec_key.get()));
-    if (sig == nullptr) {
-        return "Error signing digest";
-    }
-    size_t len = i2d_ECDSA_SIG(sig.get(), nullptr);
-    bytevec signature(len);
-    unsigned char* p = (unsigned char*)signature.data();
-    i2d_ECDSA_SIG(sig.get(), &p);
-    return signature;
-}
-
 ErrMsgOr<bytevec> ecdh(const bytevec& publicKey, const bytevec& privateKey) {
     auto group = EC_GROUP_Ptr(EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1));
     auto point = EC_POINT_Ptr(EC_POINT_new(group.get()));
@@ -168,23 +150,30 @@ ErrMsgOr<bytevec> ecdsaCoseSignatureToDer(int point_size, const bytevec& ecdsaCo
     return derSignature;
 }
 
-ErrMsgOr<bytevec> ecdsaDerSignatureToCose(int point_size, const bytevec& ecdsaSignature) {
-    const unsigned char* p = ecdsaSignature.data();
-    auto sig = ECDSA_SIG_Ptr(d2i_ECDSA_SIG(nullptr, &p, ecdsaSignature.size()));
-    if (sig == nullptr) {
-        return "Error decoding DER signature";
+// Copies the DER INTEGER at the front of |der|, which must be non-negative and fit in |size| bytes,
+// into |out|, left-padded with zeros.
+bool copyDerInteger(CBS* der, uint8_t* out, size_t size) {
+    CBS integer;
+    if (!CBS_get_asn1(der, &integer, CBS_ASN1_INTEGER) || !CBS_is_unsigned_asn1_integer(&integer)) {
+        return false;
     }
+    // A leading zero byte only keeps the sign bit clear.
+    if (CBS_len(&integer) > 1 && CBS_data(&integer)[0] == 0) CBS_skip(&integer, 1);
+    if (CBS_len(&integer) > size) return false;
+    size_t padding = size - CBS_len(&integer);
+    memset(out, 0, padding);
+    memcpy(out + padding, CBS_data(&integer), CBS_len(&integer));
+    return true;
+}
 
-    bytevec ecdsaCoseSignature(point_size * 2, 0);
-    if (BN_bn2binpad(ECDSA_SIG_get0_r(sig.get()), ecdsaCoseSignature.data(), point_size) !=
-        point_size) {
-        return "Error encoding r";
-    }
-    if (BN_bn2binpad(ECDSA_SIG_get0_s(sig.get()), ecdsaCoseSignature.data() + point_size,
-                     point_size) != point_size) {
-        return "Error encoding s";
-    }
-    return ecdsaCoseSignature;
+// Writes the r and s of the DER ECDSA-Sig-Value |ecdsaSignature| into the |point_size| * 2 bytes
+// at |out|, the COSE encoding.  The DER is read in place, so nothing is allocated.
+bool ecdsaDerSignatureToCose(int point_size, bytespan ecdsaSignature, uint8_t* out) {
+    CBS der, sequence;
+    CBS_init(&der, ecdsaSignature.data(), ecdsaSignature.size());
+    return CBS_get_asn1(&der, &sequence, CBS_ASN1_SEQUENCE) && CBS_len(&der) == 0 &&
+           copyDerInteger(&sequence, out, point_size) &&
+           copyDerInteger(&sequence, out + point_size, point_size) && CBS_len(&sequence) == 0;
 }
 
 bool verifyEcdsaDigest(int curve_nid, const bytevec& key, const bytevec& digest,
@@ -218,6 +207,83 @@ bool verifyEcdsaDigest(int curve_nid, const bytevec& key, const bytevec& digest,
     return true;
 }
 
+// The protected header of every COSE_Mac0 built here, {1 (alg): 5 (HMAC 256/256)}, canonically
+// encoded.
+constexpr uint8_t kMac0ProtectedHeader[] = {0xA1, 0x01, 0x05};
+constexpr uint8_t kCborMajorTypeTstr = 3;
+constexpr uint8_t kCborMajorTypeBstr = 2;
+constexpr uint8_t kCborMajorTypeArray = 4;
+
+// Encodes the head of a CBOR data item with the given major type and argument into |out|, which
+// must hold at least 9 bytes, and returns its length.
+size_t encodeCborHead(uint8_t majorType, uint64_t value, uint8_t* out) {
+    majorType <<= 5;
+    if (value < 24) {
+        out[0] = majorType | static_cast<uint8_t>(value);
+        return 1;
+    }
+    size_t size = value <= 0xFF ? 1 : value <= 0xFFFF ? 2 : value <= 0xFFFFFFFF ? 4 : 8;
+    out[0] = majorType | (size == 1 ? 24 : size == 2 ? 25 : size == 4 ? 26 : 27);
+    for (size_t i = size; i > 0; --i) {
+        out[i] = value & 0xFF;
+        value >>= 8;
+    }
+    return size + 1;
+}
+
+// Feeds the encoded COSE_Mac0 MAC_structure, ["MAC0", protected, external_aad, payload], to
+// |write| piece by piece.  The encoding is the one cppbor::Array::encode() produces.
+template <typename Writer>
+bool writeCoseMac0Structure(const bytevec& externalAad, const uint8_t* payload,
+                            size_t payloadSize, Writer&& write) {
+    static constexpr char kContext[] = "MAC0";
+    uint8_t head[9];
+    size_t headSize;
+    headSize = encodeCborHead(kCborMajorTypeArray, 4, head);
+    if (!write(head, headSize)) return false;
+    headSize = encodeCborHead(kCborMajorTypeTstr, sizeof(kContext) - 1, head);
+    if (!write(head, headSize) ||
+        !write(reinterpret_cast<const uint8_t*>(kContext), sizeof(kContext) - 1)) {
+        return false;
+    }
+    headSize = encodeCborHead(kCborMajorTypeBstr, sizeof(kMac0ProtectedHeader), head);
+    if (!write(head, headSize) || !write(kMac0ProtectedHeader, sizeof(kMac0ProtectedHeader))) {
+        return false;
+    }
+    headSize = encodeCborHead(kCborMajorTypeBstr, externalAad.size(), head);
+    if (!write(head, headSize) || !write(externalAad.data(), externalAad.size())) return false;
+    headSize = encodeCborHead(kCborMajorTypeBstr, payloadSize, head);
+    return write(head, headSize) && write(payload, payloadSize);
+}
+
+// The protected header of every COSE_Encrypt built here, {1 (alg): 3 (A256GCM)}, canonically
+// encoded.
+constexpr uint8_t kEncryptProtectedHeader[] = {0xA1, 0x01, 0x03};
+constexpr uint8_t kCborMajorTypeMap = 5;
+
+// Encodes the COSE Enc_structure, ["Encrypt", protected, external_aad], which is the AAD of the
+// AES-GCM encryption in a COSE_Encrypt.  The encoding is the one cppbor::Array::encode() produces.
+bytevec encodeEncStructure(bytespan protectedParams, bytespan externalAad) {
+    static constexpr char kContext[] = "Encrypt";
+    bytevec encStructure(3 * 9 + sizeof(kContext) - 1 + protectedParams.size() +
+                         externalAad.size());
+    uint8_t* pos = encStructure.data();
+    pos += encodeCborHead(kCborMajorTypeArray, 3, pos);
+    pos += encodeCborHead(kCborMajorTypeTstr, sizeof(kContext) - 1, pos);
+    pos = std::copy(kContext, kContext + sizeof(kContext) - 1, pos);
+    pos += encodeCborHead(kCborMajorTypeBstr, protectedParams.size(), pos);
+    pos = std::copy(protectedParams.begin(), protectedParams.end(), pos);
+    pos += encodeCborHead(kCborMajorTypeBstr, externalAad.size(), pos);
+    pos = std::copy(externalAad.begin(), externalAad.end(), pos);
+    encStructure.resize(pos - encStructure.data());
+    return encStructure;
+}
+
+size_t cborHeadSize(uint64_t value) {
+    uint8_t head[9];
+    return encodeCborHead(0, value, head);
+}
+
 }  // namespace
 
 ErrMsgOr<HmacSha256> generateHmacSha256(const bytevec& key, const bytevec& data) {
@@ -234,14 +300,57 @@ ErrMsgOr<HmacSha256> generateHmacSha256(const bytevec& key, const bytevec& data)
     return digest;
 }
 
+ErrMsgOr<HmacSha256Key> HmacSha256Key::create(const bytevec& key) {
+    bssl::UniquePtr<HMAC_CTX> keyed(HMAC_CTX_new());
+    if (!keyed) return "Failed to allocate HMAC context";
+    if (!HMAC_Init_ex(keyed.get(), key.data(), key.size(), EVP_sha256(), nullptr /* engine */)) {
+        return "Failed to initialize HMAC key";
+    }
+    return HmacSha256Key(std::move(keyed));
+}
+
+ErrMsgOr<HmacSha256> HmacSha256Key::mac(const uint8_t* data, size_t dataSize) const {
+    bssl::ScopedHMAC_CTX ctx;
+    HmacSha256 digest;
+    unsigned int outLen;
+    if (!HMAC_CTX_copy_ex(ctx.get(), keyed_.get()) ||
+        !HMAC_Update(ctx.get(), data, dataSize) ||  //
+        !HMAC_Final(ctx.get(), digest.data(), &outLen) || outLen != digest.size()) {
+        return "Error generating HMAC";
+    }
+    return digest;
+}
+
+ErrMsgOr<HmacSha256> HmacSha256Key::coseMac0Mac(const bytevec& externalAad,
+                                                const uint8_t* payload, size_t payloadSize) const {
+    bssl::ScopedHMAC_CTX ctx;
+    if (!HMAC_CTX_copy_ex(ctx.get(), keyed_.get())) return "Error generating HMAC";
+
+    bool written = writeCoseMac0Structure(externalAad, payload, payloadSize,
+                                          [&ctx](const uint8_t* data, size_t size) {
+                                              return HMAC_Update(ctx.get(), data, size) == 1;
+                                          });
+    HmacSha256 digest;
+    unsigned int outLen;
+    if (!written || !HMAC_Final(ctx.get(), digest.data(), &outLen) || outLen != digest.size()) {
+        return "Error generating HMAC";
+    }
+    return digest;
+}
+
+HmacSha256Function HmacSha256Key::macFunction() const {
+    return [this](const bytevec& input) { return mac(input); };
+}
+
 ErrMsgOr<HmacSha256> generateCoseMac0Mac(HmacSha256Function macFunction, const bytevec& externalAad,
                                          const bytevec& payload) {
-    auto macStructure = cppbor::Array()
-                            .add("MAC0")
-                            .add(cppbor::Map().add(ALGORITHM, HMAC_256).canonicalize().encode())
-                            .add(externalAad)
-                            .add(payload)
-                            .encode();
+    bytevec macStructure;
+    macStructure.reserve(32 + externalAad.size() + payload.size());
+    writeCoseMac0Structure(externalAad, payload.data(), payload.size(),
+                           [&macStructure](const uint8_t* data, size_t size) {
+                               macStructure.insert(macStructure.end(), data, data + size);
+                               return true;
+                           });
 
     auto macTag = macFunction(macStructure);
     if (!macTag) {
@@ -265,6 +374,13 @@ ErrMsgOr<cppbor::Array> constructCoseMac0(HmacSha256Function macFunction,
 
 ErrMsgOr<bytevec /* payload */> verifyAndParseCoseMac0(const cppbor::Item* macItem,
                                                        const bytevec& macKey) {
+    auto key = HmacSha256Key::create(macKey);
+    if (!key) return key.moveMessage();
+    return verifyAndParseCoseMac0(macItem, *key);
+}
+
+ErrMsgOr<bytevec /* payload */> verifyAndParseCoseMac0(const cppbor::Item* macItem,
+                                                       const HmacSha256Key& macKey) {
     auto mac = macItem ? macItem->asArray() : nullptr;
     if (!mac || mac->size() != kCoseMac0EntryCount) {
         return "Invalid COSE_Mac0";
@@ -287,10 +403,8 @@ ErrMsgOr<bytevec /* payload */> verifyAndParseCoseMac0(const cppbor::Item* macIt
         return "Unsupported Mac0 algorithm";
     }
 
-    auto macFunction = [&macKey](const bytevec& input) {
-        return generateHmacSha256(macKey, input);
-    };
-    auto macTag = generateCoseMac0Mac(macFunction, {} /* external_aad */, payload->value());
+    auto macTag = macKey.coseMac0Mac({} /* external_aad */, payload->value().data(),
+                                     payload->value().size());
     if (!macTag) return macTag.moveMessage();
 
     if (macTag->size() != tag->value().size() ||
@@ -301,7 +415,50 @@ ErrMsgOr<bytevec /* payload */> verifyAndParseCoseMac0(const cppbor::Item* macIt
     return payload->value();
 }
 
-ErrMsgOr<bytevec> createECDSACoseSign1Signature(const bytevec& key, const bytevec& protectedParams,
+ErrMsgOr<EcdsaP256Key> EcdsaP256Key::create(const bytevec& privateKey) {
+    auto bn = BIGNUM_Ptr(BN_bin2bn(privateKey.data(), privateKey.size(), nullptr));
+    if (bn.get() == nullptr) {
+        return "Error creating BIGNUM";
+    }
+
+    auto ecKey = EC_KEY_Ptr(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    if (!ecKey || EC_KEY_set_private_key(ecKey.get(), bn.get()) != 1) {
+        return "Error setting private key from BIGNUM";
+    }
+
+    // With the public key set as well, EC_KEY_check_key() can confirm that the pair is consistent.
+    const EC_GROUP* group = EC_KEY_get0_group(ecKey.get());
+    auto publicKey = EC_POINT_Ptr(EC_POINT_new(group));
+    if (!publicKey ||
+        EC_POINT_mul(group, publicKey.get(), bn.get(), nullptr, nullptr, nullptr) != 1 ||
+        EC_KEY_set_public_key(ecKey.get(), publicKey.get()) != 1) {
+        return "Error computing public key";
+    }
+    if (EC_KEY_check_key(ecKey.get()) != 1) {
+        return "Invalid P-256 private key";
+    }
+    return EcdsaP256Key(std::move(ecKey));
+}
+
+ErrMsgOr<bytevec> EcdsaP256Key::signDigest(const bytevec& digest) const {
+    uint8_t derSignature[kMaxP256DerSignatureSize];
+    unsigned int derSize = 0;
+    if (ECDSA_size(key_.get()) > sizeof(derSignature) ||
+        ECDSA_sign(0 /* type */, digest.data(), digest.size(), derSignature, &derSize,
+                   key_.get()) != 1) {
+        return "Error signing digest";
+    }
+
+    bytevec signature(kP256AffinePointSize * 2);
+    if (!ecdsaDerSignatureToCose(kP256AffinePointSize, bytespan(derSignature, derSize),
+                                 signature.data())) {
+        return "Error decoding DER signature";
+    }
+    return signature;
+}
+
+ErrMsgOr<bytevec> createECDSACoseSign1Signature(const EcdsaP256Key& key,
+                                                const bytevec& protectedParams,
                                                 const bytevec& payload, const bytevec& aad) {
     bytevec signatureInput = cppbor::Array()
                                  .add("Signature1")  //
@@ -309,10 +466,7 @@ ErrMsgOr<bytevec> createECDSACoseSign1Signature(const bytevec& key, const byteve
                                  .add(aad)
                                  .add(payload)
                                  .encode();
-    auto ecdsaSignature = signP256Digest(key, sha256(signatureInput));
-    if (!ecdsaSignature) return ecdsaSignature.moveMessage();
-
-    return ecdsaDerSignatureToCose(kP256AffinePointSize, *ecdsaSignature);
+    return key.signDigest(sha256(signatureInput));
 }
 
 ErrMsgOr<bytevec> createCoseSign1Signature(const bytevec& key, const bytevec& protectedParams,
@@ -335,6 +489,14 @@ ErrMsgOr<bytevec> createCoseSign1Signature(const bytevec& key, const bytevec& pr
 
 ErrMsgOr<cppbor::Array> constructECDSACoseSign1(const bytevec& key, cppbor::Map protectedParams,
                                                 const bytevec& payload, const bytevec& aad) {
+    auto signingKey = EcdsaP256Key::create(key);
+    if (!signingKey) return signingKey.moveMessage();
+    return constructECDSACoseSign1(*signingKey, std::move(protectedParams), payload, aad);
+}
+
+ErrMsgOr<cppbor::Array> constructECDSACoseSign1(const EcdsaP256Key& key,
+                                                cppbor::Map protectedParams,
+                                                const bytevec& payload, const bytevec& aad) {
     bytevec protParms = protectedParams.add(ALGORITHM, ES256).canonicalize().encode();
     auto signature = createECDSACoseSign1Signature(key, protParms, payload, aad);
     if (!signature) return signature.moveMessage();
@@ -457,25 +619,14 @@ ErrMsgOr<bytevec> verifyAndParseCoseSign1(const cppbor::Array* coseSign1,
 ErrMsgOr<bytevec> createCoseEncryptCiphertext(const bytevec& key, const bytevec& nonce,
                                               const bytevec& protectedParams,
                                               const bytevec& plaintextPayload, const bytevec& aad) {
-    auto ciphertext = aesGcmEncrypt(key, nonce,
-                                    cppbor::Array()            // Enc strucure as AAD
-                                        .add("Encrypt")        // Context
-                                        .add(protectedParams)  // Protected
-                                        .add(aad)              // External AAD
-                                        .encode(),
-                                    plaintextPayload);
-
-    if (!ciphertext) return ciphertext.moveMessage();
-    return ciphertext.moveValue();
+    return aesGcmEncrypt(key, nonce, encodeEncStructure(protectedParams, aad), plaintextPayload);
 }
 
 ErrMsgOr<cppbor::Array> constructCoseEncrypt(const bytevec& key, const bytevec& nonce,
                                              const bytevec& plaintextPayload, const bytevec& aad,
                                              cppbor::Array recipients) {
-    auto encryptProtectedHeader = cppbor::Map()  //
-                                      .add(ALGORITHM, AES_GCM_256)
-                                      .canonicalize()
-                                      .encode();
+    bytevec encryptProtectedHeader(std::begin(kEncryptProtectedHeader),
+                                   std::end(kEncryptProtectedHeader));
 
     auto ciphertext =
         createCoseEncryptCiphertext(key, nonce, encryptProtectedHeader, plaintextPayload, aad);
@@ -484,10 +635,50 @@ ErrMsgOr<cppbor::Array> constructCoseEncrypt(const bytevec& key, const bytevec&
     return cppbor::Array()
         .add(encryptProtectedHeader)                       // Protected
         .add(cppbor::Map().add(IV, nonce).canonicalize())  // Unprotected
-        .add(*ciphertext)                                  // Payload
+        .add(ciphertext.moveValue())                       // Payload
         .add(std::move(recipients));
 }
 
+size_t coseEncryptEncodedSize(size_t plaintextSize, const cppbor::Array& recipients) {
+    size_t ciphertextSize = plaintextSize + kAesGcmTagSize;
+    return 1 /* array head */ + 1 + sizeof(kEncryptProtectedHeader) +  //
+           1 /* map head */ + 1 /* IV label */ + 1 + kAesGcmNonceLength +  //
+           cborHeadSize(ciphertextSize) + ciphertextSize + recipients.encodedSize();
+}
+
+ErrMsgOr<size_t> encodeCoseEncrypt(bytespan key, bytespan nonce, bytespan plaintextPayload,
+                                   bytespan aad, const cppbor::Array& recipients, uint8_t* out,
+                                   size_t outSize) {
+    size_t encodedSize = coseEncryptEncodedSize(plaintextPayload.size(), recipients);
+    if (outSize < encodedSize) return "Output buffer too small";
+    if (nonce.size() != kAesGcmNonceLength) return "Invalid nonce size";
+
+    uint8_t* pos = out;
+    const uint8_t* end = out + encodedSize;
+    pos += encodeCborHead(kCborMajorTypeArray, kCoseEncryptEntryCount, pos);
+    // Protected
+    pos += encodeCborHead(kCborMajorTypeBstr, sizeof(kEncryptProtectedHeader), pos);
+    pos = std::copy(std::begin(kEncryptProtectedHeader), std::end(kEncryptProtectedHeader), pos);
+    // Unprotected
+    pos += encodeCborHead(kCborMajorTypeMap, 1, pos);
+    pos += encodeCborHead(0 /* unsigned int */, IV, pos);
+    pos += encodeCborHead(kCborMajorTypeBstr, nonce.size(), pos);
+    pos = std::copy(nonce.begin(), nonce.end(), pos);
+    // Payload, encrypted in place.
+    size_t ciphertextSize = plaintextPayload.size() + kAesGcmTagSize;
+    pos += encodeCborHead(kCborMajorTypeBstr, ciphertextSize, pos);
+    bytevec encStructure = encodeEncStructure(
+        bytespan(kEncryptProtectedHeader, sizeof(kEncryptProtectedHeader)), aad);
+    auto written = aesGcmEncrypt(key, nonce, encStructure, plaintextPayload, pos);
+    if (!written) return written.moveMessage();
+    pos += *written;
+    // Recipients
+    pos = recipients.encode(pos, end);
+    if (pos != end) return "Failed to encode COSE_Encrypt recipients";
+
+    return encodedSize;
+}
+
 ErrMsgOr<std::pair<bytevec /* pubkey */, bytevec /* key ID */>>
 getSenderPubKeyFromCoseEncrypt(const cppbor::Item* coseEncrypt) {
     if (!coseEncrypt || !coseEncrypt->asArray() ||
@@ -612,12 +803,7 @@ ErrMsgOr<bytevec> decryptCoseEncrypt(const bytevec& key, const cppbor::Item* cos
 
     if (!ciphertext->asBstr()) return "Invalid ciphertext";
 
-    auto aad = cppbor::Array()                         // Enc strucure as AAD
-                   .add("Encrypt")                     // Context
-                   .add(protParms->asBstr()->value())  // Protected
-                   .add(external_aad)                  // External AAD
-                   .encode();
-
+    auto aad = encodeEncStructure(protParms->asBstr()->value(), external_aad);
     return aesGcmDecrypt(key, nonce->asBstr()->value(), aad, ciphertext->asBstr()->value());
 }
 
@@ -700,49 +886,57 @@ ErrMsgOr<bytevec> x25519_HKDF_DeriveKey(const bytevec& pubKeyA, const bytevec& p
     return retval;
 }
 
-ErrMsgOr<bytevec> aesGcmEncrypt(const bytevec& key, const bytevec& nonce, const bytevec& aad,
-                                const bytevec& plaintext) {
+ErrMsgOr<size_t> aesGcmEncrypt(bytespan key, bytespan nonce, bytespan aad, bytespan plaintext,
+                               uint8_t* ciphertextWithTag) {
     auto ctx = aesGcmInitAndProcessAad(key, nonce, aad, true /* encrypt */);
     if (!ctx) return ctx.moveMessage();
 
-    bytevec ciphertext(plaintext.size() + kAesGcmTagSize);
     int outlen;
-    if (!EVP_CipherUpdate(ctx->get(), ciphertext.data(), &outlen, plaintext.data(),
+    if (!EVP_CipherUpdate(ctx->get(), ciphertextWithTag, &outlen, plaintext.data(),
                           plaintext.size())) {
         return "Failed to encrypt plaintext";
     }
     assert(plaintext.size() == static_cast<uint64_t>(outlen));
 
-    if (!EVP_CipherFinal_ex(ctx->get(), ciphertext.data() + outlen, &outlen)) {
+    if (!EVP_CipherFinal_ex(ctx->get(), ciphertextWithTag + outlen, &outlen)) {
         return "Failed to finalize encryption";
     }
     assert(outlen == 0);
 
     if (!EVP_CIPHER_CTX_ctrl(ctx->get(), EVP_CTRL_GCM_GET_TAG, kAesGcmTagSize,
-                             ciphertext.data() + plaintext.size())) {
+                             ciphertextWithTag + plaintext.size())) {
         return "Failed to retrieve tag";
     }
 
+    return plaintext.size() + kAesGcmTagSize;
+}
+
+ErrMsgOr<bytevec> aesGcmEncrypt(const bytevec& key, const bytevec& nonce, const bytevec& aad,
+                                const bytevec& plaintext) {
+    bytevec ciphertext(plaintext.size() + kAesGcmTagSize);
+    auto written = aesGcmEncrypt(key, nonce, aad, plaintext, ciphertext.data());
+    if (!written) return written.moveMessage();
     return ciphertext;
 }
 
-ErrMsgOr<bytevec> aesGcmDecrypt(const bytevec& key, const bytevec& nonce, const bytevec& aad,
-                                const bytevec& ciphertextWithTag) {
+ErrMsgOr<size_t> aesGcmDecrypt(bytespan key, bytespan nonce, bytespan aad,
+                               bytespan ciphertextWithTag, uint8_t* plaintext) {
     auto ctx = aesGcmInitAndProcessAad(key, nonce, aad, false /* encrypt */);
     if (!ctx) return ctx.moveMessage();
 
     if (ciphertextWithTag.size() < kAesGcmTagSize) return "Missing tag";
 
-    bytevec plaintext(ciphertextWithTag.size() - kAesGcmTagSize);
+    size_t plaintextSize = ciphertextWithTag.size() - kAesGcmTagSize;
     int outlen;
-    if (!EVP_CipherUpdate(ctx->get(), plaintext.data(), &outlen, ciphertextWithTag.data(),
-                          ciphertextWithTag.size() - kAesGcmTagSize)) {
+    if (!EVP_CipherUpdate(ctx->get(), plaintext, &outlen, ciphertextWithTag.data(),
+                          plaintextSize)) {
         return "Failed to decrypt plaintext";
     }
-    assert(plaintext.size() == static_cast<uint64_t>(outlen));
+    assert(plaintextSize == static_cast<uint64_t>(outlen));
 
-    bytevec tag(ciphertextWithTag.end() - kAesGcmTagSize, ciphertextWithTag.end());
-    if (!EVP_CIPHER_CTX_ctrl(ctx->get(), EVP_CTRL_GCM_SET_TAG, kAesGcmTagSize, tag.data())) {
+    // The tag is only read, whatever the prototype says.
+    if (!EVP_CIPHER_CTX_ctrl(ctx->get(), EVP_CTRL_GCM_SET_TAG, kAesGcmTagSize,
+                             const_cast<uint8_t*>(ciphertextWithTag.data() + plaintextSize))) {
         return "Failed to set tag: " + std::to_string(ERR_peek_last_error());
     }
 
@@ -751,6 +945,16 @@ ErrMsgOr<bytevec> aesGcmDecrypt(const bytevec& key, const bytevec& nonce, const
     }
     assert(outlen == 0);
 
+    return plaintextSize;
+}
+
+ErrMsgOr<bytevec> aesGcmDecrypt(const bytevec& key, const bytevec& nonce, const bytevec& aad,
+                                const bytevec& ciphertextWithTag) {
+    if (ciphertextWithTag.size() < kAesGcmTagSize) return "Missing tag";
+
+    bytevec plaintext(ciphertextWithTag.size() - kAesGcmTagSize);
+    auto written = aesGcmDecrypt(key, nonce, aad, ciphertextWithTag, plaintext.data());
+    if (!written) return written.moveMessage();
     return plaintext;
 }
 
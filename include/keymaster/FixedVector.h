@@ -0,0 +1,121 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <keymaster/arena.h>
+
+namespace keymaster {
+
+/**
+ * FixedVector is a contiguous array with a capacity fixed at construction, for code that can't use
+ * STL containers.  Unlike List, it makes a single allocation up front, from the heap or from an
+ * Arena, and never again, so adding an element can't fail for lack of memory; it fails only once
+ * the vector is full.  Iterators are plain pointers, so it works with range-based for and with
+ * anything else that takes a pointer range.
+ *
+ * Erasing shifts later elements down, preserving order, and invalidates pointers to them.
+ */
+template <typename T> class FixedVector {
+  public:
+    typedef T* iterator;
+    typedef const T* const_iterator;
+
+    explicit FixedVector(size_t capacity) {
+        if (capacity > SIZE_MAX / sizeof(T)) return;
+        elements_ = static_cast<T*>(::operator new(capacity * sizeof(T), std::nothrow));
+        if (elements_) capacity_ = capacity;
+    }
+
+    // Takes the storage from |arena|, which must outlive the vector.
+    FixedVector(size_t capacity, Arena* arena) : arena_(arena) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "Arena memory is never destroyed element by element");
+        elements_ = arena->AllocateArray<T>(capacity);
+        if (elements_) capacity_ = capacity;
+    }
+
+    ~FixedVector() {
+        clear();
+        if (!arena_) ::operator delete(elements_);
+    }
+
+    FixedVector(const FixedVector&) = delete;
+    void operator=(const FixedVector&) = delete;
+
+    // False if the storage couldn't be allocated, in which case the capacity is zero.
+    bool is_valid() const { return elements_ != nullptr; }
+
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    bool empty() const { return size_ == 0; }
+    bool full() const { return size_ == capacity_; }
+
+    T* data() { return elements_; }
+    const T* data() const { return elements_; }
+
+    iterator begin() { return elements_; }
+    const_iterator begin() const { return elements_; }
+    iterator end() { return elements_ + size_; }
+    const_iterator end() const { return elements_ + size_; }
+
+    T& operator[](size_t i) { return elements_[i]; }
+    const T& operator[](size_t i) const { return elements_[i]; }
+    T& front() { return elements_[0]; }
+    const T& front() const { return elements_[0]; }
+    T& back() { return elements_[size_ - 1]; }
+    const T& back() const { return elements_[size_ - 1]; }
+
+    // Returns false, leaving the vector unchanged, if it's full.
+    bool push_back(const T& value) { return emplace_back(value) != nullptr; }
+
+    // Constructs an element at the end from |args|.  Returns null if the vector is full.
+    template <typename... Args> T* emplace_back(Args&&... args) {
+        if (full()) return nullptr;
+        T* element = new (elements_ + size_) T(std::forward<Args>(args)...);
+        ++size_;
+        return element;
+    }
+
+    void pop_back() { elements_[--size_].~T(); }
+
+    // Removes the element at |posn|, returning an iterator to the one that followed it.
+    iterator erase(iterator posn) {
+        for (iterator next = posn + 1; next != end(); ++next)
+            *(next - 1) = std::move(*next);
+        pop_back();
+        return posn;
+    }
+
+    void clear() {
+        while (size_) pop_back();
+    }
+
+  private:
+    T* elements_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    Arena* arena_ = nullptr;
+};
+
+}  // namespace keymaster
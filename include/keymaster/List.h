@@ -24,6 +24,10 @@
 //
 // The only class you want to use from here is "List".
 //
+// List allocates every node separately.  Where the number of elements is
+// bounded, FixedVector (FixedVector.h) keeps them contiguous in a single
+// allocation instead.
+//
 
 #pragma once
 
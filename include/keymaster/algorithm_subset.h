@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+/**
+ * The algorithms a build includes.  Builds that only need symmetric keys define
+ * KEYMASTER_DISABLE_RSA, KEYMASTER_DISABLE_EC and KEYMASTER_DISABLE_TRIPLE_DES (see
+ * keymaster_symmetric_only_defaults in Android.bp).  PureSoftKeymasterContext then neither
+ * creates nor references the key factories of the left-out algorithms, nor lists them as
+ * supported, so a static link drops their key and operation code.  AES and HMAC are always
+ * included: key blob encryption and shared HMAC negotiation depend on them.
+ */
+#ifndef KEYMASTER_DISABLE_RSA
+constexpr bool kRsaIncluded = true;
+#else
+constexpr bool kRsaIncluded = false;
+#endif
+
+#ifndef KEYMASTER_DISABLE_EC
+constexpr bool kEcIncluded = true;
+#else
+constexpr bool kEcIncluded = false;
+#endif
+
+#ifndef KEYMASTER_DISABLE_TRIPLE_DES
+constexpr bool kTripleDesIncluded = true;
+#else
+constexpr bool kTripleDesIncluded = false;
+#endif
+
+constexpr bool AlgorithmIncluded(keymaster_algorithm_t algorithm) {
+    switch (algorithm) {
+    case KM_ALGORITHM_RSA:
+        return kRsaIncluded;
+    case KM_ALGORITHM_EC:
+        return kEcIncluded;
+    case KM_ALGORITHM_TRIPLE_DES:
+        return kTripleDesIncluded;
+    case KM_ALGORITHM_AES:
+    case KM_ALGORITHM_HMAC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+}  // namespace keymaster
@@ -16,16 +16,26 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+#include <vector>
+
 #include "android_keymaster_messages.h"
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/keymaster_counters.h>
 
 namespace keymaster {
 
 class Key;
 class KeyFactory;
+class KeyUsageStats;
 class KeymasterContext;
+class Operation;
 class OperationTable;
+class RequestRecorder;
+class WorkerPool;
 
 /**
  * This is the reference implementation of Keymaster.  In addition to acting as a reference for
@@ -71,30 +81,79 @@ class AndroidKeymaster {
     VerifyAuthorizationResponse VerifyAuthorization(const VerifyAuthorizationRequest& request);
     void GenerateTimestampToken(GenerateTimestampTokenRequest& request,
                                 GenerateTimestampTokenResponse* response);
+    // As above, without request and response messages.  |mac| receives kTimestampTokenMacSize
+    // bytes.  For ISecureClock, which asks for a token per auth-bound operation.
+    keymaster_error_t GenerateTimestampToken(uint64_t challenge, uint64_t* timestamp, uint8_t* mac);
     void AddRngEntropy(const AddEntropyRequest& request, AddEntropyResponse* response);
     void Configure(const ConfigureRequest& request, ConfigureResponse* response);
     void GenerateKey(const GenerateKeyRequest& request, GenerateKeyResponse* response);
+    // Generates a batch of symmetric keys, such as an app's first-run keys, with per-key results.
+    void GenerateKeys(const GenerateKeysRequest& request, GenerateKeysResponse* response);
     void GenerateRkpKey(const GenerateRkpKeyRequest& request, GenerateRkpKeyResponse* response);
+    void GenerateRkpKeyBatch(const GenerateRkpKeyBatchRequest& request,
+                             GenerateRkpKeyBatchResponse* response);
     void GenerateCsr(const GenerateCsrRequest& request, GenerateCsrResponse* response);
     void GenerateCsrV2(const GenerateCsrV2Request& request, GenerateCsrV2Response* response);
     void GetKeyCharacteristics(const GetKeyCharacteristicsRequest& request,
                                GetKeyCharacteristicsResponse* response);
+    // Gets the characteristics of a batch of keys, such as those listed from a keystore namespace,
+    // with per-key results.
+    void GetKeysCharacteristics(const GetKeysCharacteristicsRequest& request,
+                                GetKeysCharacteristicsResponse* response);
     void ImportKey(const ImportKeyRequest& request, ImportKeyResponse* response);
+    // Imports a batch of symmetric keys, such as during factory provisioning, with per-key results.
+    void ImportKeys(const ImportKeysRequest& request, ImportKeysResponse* response);
     void ImportWrappedKey(const ImportWrappedKeyRequest& request,
                           ImportWrappedKeyResponse* response);
     void ExportKey(const ExportKeyRequest& request, ExportKeyResponse* response);
     void AttestKey(const AttestKeyRequest& request, AttestKeyResponse* response);
     void UpgradeKey(const UpgradeKeyRequest& request, UpgradeKeyResponse* response);
+    // Upgrades a batch of keys, such as every key stored after an OTA, with per-key results.
+    void UpgradeKeys(const UpgradeKeysRequest& request, UpgradeKeysResponse* response);
     void DeleteKey(const DeleteKeyRequest& request, DeleteKeyResponse* response);
+    // Deletes a batch of keys, such as those of an uninstalled app, with per-key results.
+    void DeleteKeys(const DeleteKeysRequest& request, DeleteKeysResponse* response);
     void DeleteAllKeys(const DeleteAllKeysRequest& request, DeleteAllKeysResponse* response);
-    void BeginOperation(const BeginOperationRequest& request, BeginOperationResponse* response);
+    // Loads a key that a begin is about to use, leaving it in the context's parsed key cache.
+    void PrepareKey(const PrepareKeyRequest& request, PrepareKeyResponse* response);
+    // |caller_id| identifies the client for per-caller operation quotas.  Callers that can't tell
+    // their clients apart leave it zero, which makes all of them one caller.
+    void BeginOperation(const BeginOperationRequest& request, BeginOperationResponse* response,
+                        uint32_t caller_id = 0);
     void UpdateOperation(const UpdateOperationRequest& request, UpdateOperationResponse* response);
+    void BatchUpdateOperation(const BatchUpdateOperationRequest& request,
+                              BatchUpdateOperationResponse* response);
     void FinishOperation(const FinishOperationRequest& request, FinishOperationResponse* response);
+    void OneShotOperation(const OneShotOperationRequest& request,
+                          OneShotOperationResponse* response);
+    void BatchSign(const BatchSignRequest& request, BatchSignResponse* response);
+    void BatchAgreeKey(const BatchAgreeKeyRequest& request, BatchAgreeKeyResponse* response);
+    void BatchVerify(const BatchVerifyRequest& request, BatchVerifyResponse* response);
     void AbortOperation(const AbortOperationRequest& request, AbortOperationResponse* response);
+    // Begins a copy of an operation in its current state, for |caller_id| as in BeginOperation().
+    void ForkOperation(const ForkOperationRequest& request, ForkOperationResponse* response,
+                       uint32_t caller_id = 0);
+    // Runs each entry of |request| as if by a separate call, and returns every entry's response.
+    // An entry that fails, even before it runs, doesn't stop the others.
+    void ExecuteBatch(const ExecuteBatchRequest& request, ExecuteBatchResponse* response,
+                      uint32_t caller_id = 0);
+
+    // Registers |size| bytes at |base| for SharedMemoryOperation() to read input from and write
+    // output to.  The environment maps the region, from ashmem or a dmabuf for instance, and must
+    // keep it mapped until UnregisterSharedMemory() returns.  UnregisterSharedMemory() waits for
+    // SharedMemoryOperation() calls already using the region to finish, and fails any that start
+    // after it with KM_ERROR_INVALID_ARGUMENT.
+    keymaster_error_t RegisterSharedMemory(uint8_t* base, size_t size, uint32_t* region_id);
+    keymaster_error_t UnregisterSharedMemory(uint32_t region_id);
+    void SharedMemoryOperation(const SharedMemoryOperationRequest& request,
+                               SharedMemoryOperationResponse* response);
 
     EarlyBootEndedResponse EarlyBootEnded();
     DeviceLockedResponse DeviceLocked(const DeviceLockedRequest& request);
     GetVersion2Response GetVersion2(const GetVersion2Request& request);
+    // Returns the counters of every command and phase called so far, and the context's cache hit
+    // counts.
+    GetDebugCountersResponse GetDebugCounters(const GetDebugCountersRequest& request);
     ConfigureVendorPatchlevelResponse
     ConfigureVendorPatchlevel(const ConfigureVendorPatchlevelRequest& request);
     ConfigureBootPatchlevelResponse
@@ -108,20 +167,177 @@ class AndroidKeymaster {
 
     bool has_operation(keymaster_operation_handle_t op_handle) const;
 
+    // When enabled, BeginOperation aborts the least recently updated operation instead of failing
+    // with KM_ERROR_TOO_MANY_OPERATIONS when the operation table is full.
+    void set_evict_lru_operations(bool evict_lru);
+    // Per-caller operation table quotas; see OperationTable::set_quotas().  A sharded table, as
+    // ConcurrentAndroidKeymaster uses, only enforces the hard quota.
+    void set_operation_quotas(size_t soft_quota, size_t hard_quota);
+    // Limit on the memory buffered by all in-flight operations; see
+    // OperationTable::set_memory_budget().  Operations whose updates take the table over it are
+    // aborted with KM_ERROR_MEMORY_ALLOCATION_FAILED.
+    void set_operation_memory_budget(size_t bytes);
+    // Lets the operation table grow and shrink with the number of concurrent operations, between
+    // |min_size| and |max_size| slots; see OperationTable::set_adaptive_size().  Called before the
+    // first BeginOperation, it replaces the size passed to the constructor.  Resizes are counted
+    // in operation_table().sizing_stats().  The sharded table of ConcurrentAndroidKeymaster keeps
+    // its size, and this returns KM_ERROR_UNIMPLEMENTED for it.
+    keymaster_error_t set_operation_table_sizing(size_t min_size, size_t max_size,
+                                                 size_t segment_size, uint64_t window_ms);
+
+    // Operations not updated for longer than |timeout_ms| are aborted and removed the next time
+    // BeginOperation or ReapIdleOperations is called, and counted in
+    // operation_table().reaped_count().  Zero, the default, keeps them until they are finished or
+    // aborted.
+    void set_operation_idle_timeout_ms(uint64_t timeout_ms) {
+        operation_idle_timeout_ms_ = timeout_ms;
+    }
+    // Reaps idle operations now, for HALs that want to do it from a timer.  Subject to the same
+    // threading rules as the other operation calls.  Returns the number reaped.
+    size_t ReapIdleOperations();
+    const OperationTable& operation_table() const;
+
+    // When enabled, operations begun from then on keep their key blob and begin parameters, so
+    // that SnapshotOperations() can hand them off.  Off by default, which saves the copies.
+    void set_operation_handoff(bool enabled) { operation_handoff_ = enabled; }
+
+    // Writes the state of every in-flight operation that can be handed off to another process into
+    // |snapshot|, sealed by the context (see KeymasterContext::SealHandoffState()), and removes
+    // those operations from this instance.  Operations begun before handoff was enabled, bound to
+    // user authentication or confirmation, or whose state can't be saved (see
+    // Operation::SaveState()) stay here.  |*handed_off| receives the number written.  Fails with
+    // KM_ERROR_CONCURRENT_ACCESS_CONFLICT, handing off nothing, if another call is using one of
+    // the operations, and with KM_ERROR_UNIMPLEMENTED if the context can't seal handoff state, as
+    // a PureSoftKeymasterContext can't.
+    keymaster_error_t SnapshotOperations(std::vector<uint8_t>* snapshot, size_t* handed_off);
+
+    // Restores the operations in a snapshot written by SnapshotOperations(), and appends an
+    // (old handle, new handle) pair to |handles| for each, for the caller to translate its clients'
+    // handles with.  An operation that can't be restored, because its key no longer loads or the
+    // begin-time checks now refuse it for instance, is skipped.  Fails with
+    // KM_ERROR_INVALID_ARGUMENT, restoring nothing, if the snapshot is malformed, was altered or
+    // was already opened (see KeymasterContext::OpenHandoffState()): two copies of a stream
+    // cipher operation would reuse its keystream.
+    keymaster_error_t RestoreOperations(
+        const uint8_t* snapshot, size_t size,
+        std::vector<std::pair<keymaster_operation_handle_t, keymaster_operation_handle_t>>*
+            handles);
+
+    // Hands every key and operation request to |recorder|, which must outlive this object, once it
+    // has been handled.  Null, the default, records nothing.  Set it before any other thread calls
+    // in.
+    void set_request_recorder(RequestRecorder* recorder) { request_recorder_ = recorder; }
+
+    // Counts begins, updates, finishes and aborts against the key they use in |stats|, which must
+    // outlive this object, for finding hot keys.  Null, the default, counts nothing.  Set it
+    // before any other thread calls in.
+    void set_key_usage_stats(KeyUsageStats* stats) { key_usage_stats_ = stats; }
+    const KeyUsageStats* key_usage_stats() const { return key_usage_stats_; }
+
+    // The always-on call and phase counters.  A moved-to object starts counting afresh.
+    const KeymasterCounters& counters() const { return counters_; }
+
     // Returns the message version negotiated in GetVersion2.  All response messages should have
     // this passed to their constructors.  This is done automatically for the methods that return a
     // response by value.  The caller must do it for the methods that take a response pointer.
     int32_t message_version() const { return message_version_; }
 
+  protected:
+    AndroidKeymaster(KeymasterContext* context, UniquePtr<OperationTable> operation_table,
+                     int32_t message_version);
+
+    // Serialize access to the context (key factories, enforcement policy, secure storage).  Every
+    // entry point holds the context lock except Update, Finish and Abort, which take it only
+    // around enforcement and storage calls so that the crypto work of independent operations can
+    // overlap.  This class is single-threaded and the hooks do nothing.
+    virtual void LockContext() {}
+    virtual void UnlockContext() {}
+
+    // Number of threads that work which doesn't touch the context, such as checking the MACed
+    // keys of a CSR, may be spread across.  Also passed to the context as the thread budget for
+    // bulk work it can parallelize itself, such as UpgradeKeyBlobs().
+    virtual size_t ParallelWorkerCount() const { return 1; }
+
+    // The context's worker pool, or null if there is no context or it has no pool.
+    WorkerPool* worker_pool() const;
+
   private:
+    class ContextLock;
+    class SharedMemoryPin;
+
     // Loads the KM key from `key_blob`, getting app ID and app data from `additional_params`, if
     // needed.  If loading the key fails for any reason (including failure of the version binding
     // check), the returned UniquePtr is null and `*error` is set (`error` must not be null).
     UniquePtr<Key> LoadKey(const keymaster_key_blob_t& key_blob,
                            const AuthorizationSet& additional_params, keymaster_error_t* error);
 
+    // Checks a begin request against the key's characteristics alone, if the context can read them
+    // cheaply, so that requests bound to fail are refused without loading the key.
+    keymaster_error_t PreCheckOperation(const keymaster_key_blob_t& key_blob,
+                                        keymaster_purpose_t purpose,
+                                        const AuthorizationSet& additional_params);
+
+    // Loads the key and creates and begins an operation with it, running the begin-time
+    // enforcement checks.  The caller must hold the context lock.
+    keymaster_error_t StartOperation(const keymaster_key_blob_t& key_blob,
+                                     keymaster_purpose_t purpose,
+                                     const AuthorizationSet& additional_params,
+                                     AuthorizationSet* output_params,
+                                     UniquePtr<Operation>* operation);
+
+    // Runs the finish-time enforcement checks, finishes |operation| and verifies the confirmation
+    // token if one is required.  The caller is responsible for disposing of the operation,
+    // whatever the result.
+    keymaster_error_t FinishStartedOperation(Operation* operation,
+                                             keymaster_operation_handle_t op_handle,
+                                             const AuthorizationSet& additional_params,
+                                             const Buffer& input, const Buffer& signature,
+                                             AuthorizationSet* output_params, Buffer* output);
+
+    // Runs the finish-time checks once for a batch of |count| items processed by |operation|,
+    // rejecting keys whose per-operation limits the batch would get around.
+    keymaster_error_t AuthorizeBatch(const Operation& operation, size_t count,
+                                     const AuthorizationSet& additional_params);
+
+    // Recreates one operation handed off by SnapshotOperations() and adds it to the table.  The
+    // caller must hold the context lock.
+    keymaster_error_t RestoreOperation(const KeymasterKeyBlob& key_blob,
+                                       keymaster_purpose_t purpose,
+                                       const AuthorizationSet& begin_params, uint32_t owner,
+                                       const Buffer& state,
+                                       keymaster_operation_handle_t* op_handle);
+
+    // Deletes the key |operation| was started with from secure storage if it is single-use.
+    void DeleteSingleUseKey(const Operation& operation);
+
+    // Current time according to the enforcement policy, or zero if there is none.  Only used for
+    // operation table bookkeeping.
+    uint64_t current_time_ms() const;
+
+    static constexpr size_t kMaxSharedMemoryRegions = 4;
+    struct SharedMemoryRegion {
+        uint32_t id = 0;
+        uint8_t* base = nullptr;
+        size_t size = 0;
+        // SharedMemoryOperation() calls using the region.
+        size_t users = 0;
+        // Set while UnregisterSharedMemory() waits for the users to finish.
+        bool closing = false;
+    };
+
     UniquePtr<KeymasterContext> context_;
     UniquePtr<OperationTable> operation_table_;
+    uint64_t operation_idle_timeout_ms_ = 0;
+    bool operation_handoff_ = false;
+    RequestRecorder* request_recorder_ = nullptr;
+    KeyUsageStats* key_usage_stats_ = nullptr;
+    KeymasterCounters counters_;
+    // The regions are guarded by their own mutex rather than the context lock, so that
+    // UnregisterSharedMemory() can wait on it while the operations using a region finish.
+    std::mutex shared_memory_mutex_;
+    std::condition_variable shared_memory_released_;
+    SharedMemoryRegion shared_memory_[kMaxSharedMemoryRegions];
+    uint32_t next_shared_memory_id_ = 1;
 
     // If the caller doesn't bother to use GetVersion2 or GetVersion to configure the message
     // version, assume kDefaultVersion, i.e. assume the client and server always support the
@@ -74,6 +74,22 @@ enum AndroidKeymasterCommand : uint32_t {
     GENERATE_CSR_V2 = 37,
     SET_ATTESTATION_IDS = 38,
     SET_ATTESTATION_IDS_KM3 = 39,
+    BATCH_UPDATE_OPERATION = 40,
+    ONE_SHOT_OPERATION = 41,
+    BATCH_SIGN = 42,
+    GENERATE_RKP_KEY_BATCH = 43,
+    UPGRADE_KEYS = 44,
+    DELETE_KEYS = 45,
+    BATCH_AGREE_KEY = 46,
+    IMPORT_KEYS = 47,
+    GET_KEYS_CHARACTERISTICS = 48,
+    GENERATE_KEYS = 49,
+    SHARED_MEMORY_OPERATION = 50,
+    BATCH_VERIFY = 51,
+    EXECUTE_BATCH = 52,
+    FORK_OPERATION = 53,
+    PREPARE_KEY = 54,
+    GET_DEBUG_COUNTERS = 55,
 };
 
 /**
@@ -115,7 +131,7 @@ enum AndroidKeymasterCommand : uint32_t {
  * GetVersion2 and reply that it is version 2.0.0 and use the corresponding message version (3).
  */
 constexpr int32_t kInvalidMessageVersion = -1;
-constexpr int32_t kMaxMessageVersion = 4;
+constexpr int32_t kMaxMessageVersion = 5;
 constexpr int32_t kDefaultMessageVersion = 3;
 
 /**
@@ -136,8 +152,9 @@ inline int32_t MessageVersion(KmVersion version, uint32_t /* km_date */ = 0) {
         return 3;
     case KmVersion::KEYMINT_1:
     case KmVersion::KEYMINT_2:
-    case KmVersion::KEYMINT_3:
         return 4;
+    case KmVersion::KEYMINT_3:
+        return 5;  // Compact UpdateOperation encoding, chunk sizes and early signatures.
     }
     return kInvalidMessageVersion;
 }
@@ -180,10 +197,13 @@ struct KeymasterResponse : public KeymasterMessage {
     size_t SerializedSize() const override;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool SerializeTo(SerializationSink* sink) const override;
 
     virtual size_t NonErrorSerializedSize() const = 0;
     virtual uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const = 0;
     virtual bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) = 0;
+    // Defaults to copying the output of NonErrorSerialize().
+    virtual bool NonErrorSerializeTo(SerializationSink* sink) const;
 
     keymaster_error_t error;
 };
@@ -246,18 +266,19 @@ struct SupportedExportFormatsRequest : public SupportedByAlgorithmRequest {
 struct SupportedByAlgorithmAndPurposeRequest : public KeymasterMessage {
     explicit SupportedByAlgorithmAndPurposeRequest(int32_t ver) : KeymasterMessage(ver) {}
 
-    size_t SerializedSize() const override { return sizeof(uint32_t) * 2; };
+    size_t SerializedSize() const override { return Fields::kSize; };
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
-        buf = append_uint32_to_buf(buf, end, algorithm);
-        return append_uint32_to_buf(buf, end, purpose);
+        return Fields::Append(buf, end, *this);
     }
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
-        return copy_uint32_from_buf(buf_ptr, end, &algorithm) &&
-               copy_uint32_from_buf(buf_ptr, end, &purpose);
+        return Fields::Copy(buf_ptr, end, this);
     }
 
     keymaster_algorithm_t algorithm;
     keymaster_purpose_t purpose;
+
+    using Fields = FieldList<Field<uint32_t, &SupportedByAlgorithmAndPurposeRequest::algorithm>,
+                             Field<uint32_t, &SupportedByAlgorithmAndPurposeRequest::purpose>>;
 };
 
 // TODO(swillden): Remove when Keymaster1 is deleted
@@ -370,6 +391,7 @@ struct GenerateKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
 
     KeymasterKeyBlob key_blob;
     AuthorizationSet enforced;
@@ -402,6 +424,45 @@ struct GenerateRkpKeyResponse : public KeymasterResponse {
     KeymasterBlob maced_public_key;
 };
 
+/**
+ * Generates \p key_count RKP keys in one call, as if by that many GenerateRkpKey calls.
+ */
+struct GenerateRkpKeyBatchRequest : KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxKeys = 256;
+
+    explicit GenerateRkpKeyBatchRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override { return sizeof(uint8_t) + sizeof(uint32_t); }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = append_to_buf(buf, end, &test_mode, sizeof(uint8_t));
+        return append_uint32_to_buf(buf, end, key_count);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_from_buf(buf_ptr, end, &test_mode, sizeof(uint8_t)) &&
+               copy_uint32_from_buf(buf_ptr, end, &key_count);
+    }
+
+    bool test_mode = false;
+    uint32_t key_count = 0;
+};
+
+struct GenerateRkpKeyBatchResponse : public KeymasterResponse {
+    explicit GenerateRkpKeyBatchResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the keys with |count| empty ones.  Returns false on allocation failure.
+    bool SetKeyCount(size_t count);
+
+    // Key blob and MACed public key of each key, in the same order.
+    size_t key_count = 0;
+    UniquePtr<KeymasterKeyBlob[]> key_blobs;
+    UniquePtr<KeymasterBlob[]> maced_public_keys;
+};
+
 struct GenerateCsrRequest : public KeymasterMessage {
     explicit GenerateCsrRequest(int32_t ver) : KeymasterMessage(ver) {}
 
@@ -491,6 +552,33 @@ struct GetKeyCharacteristicsResponse : public KeymasterResponse {
     AuthorizationSet unenforced;
 };
 
+/**
+ * Hints that \p key_blob is about to be used, so that it can be parsed, decrypted and cached ahead
+ * of the BeginOperation that uses it.  \p additional_params must carry the APPLICATION_ID and
+ * APPLICATION_DATA the begin will.  Errors are those loading the key for a begin would report.
+ */
+struct PrepareKeyRequest : public KeymasterMessage {
+    explicit PrepareKeyRequest(int32_t ver) : KeymasterMessage(ver) {
+        key_blob.key_material = nullptr;
+        key_blob.key_material_size = 0;
+    }
+    ~PrepareKeyRequest();
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+};
+
+using PrepareKeyResponse = EmptyKeymasterResponse;
+
 struct BeginOperationRequest : public KeymasterMessage {
     explicit BeginOperationRequest(int32_t ver) : KeymasterMessage(ver) {
         key_blob.key_material = nullptr;
@@ -510,6 +598,9 @@ struct BeginOperationRequest : public KeymasterMessage {
     keymaster_purpose_t purpose;
     keymaster_key_blob_t key_blob;
     AuthorizationSet additional_params;
+    // From message version 5, optionally the signature a verify operation's FinishOperation will
+    // carry, which lets the operation start checking it while the message is still streaming.
+    Buffer signature;
 };
 
 struct BeginOperationResponse : public KeymasterResponse {
@@ -521,6 +612,11 @@ struct BeginOperationResponse : public KeymasterResponse {
 
     keymaster_operation_handle_t op_handle;
     AuthorizationSet output_params;
+    // From message version 5, the UpdateOperation input length the operation handles best, which
+    // every Update consumes whole, and the most the server accepts in one UpdateOperation.  Zero
+    // from older servers, which advertise nothing.
+    uint32_t recommended_chunk_size = 0;
+    uint32_t max_chunk_size = 0;
 };
 
 struct UpdateOperationRequest : public KeymasterMessage {
@@ -541,12 +637,55 @@ struct UpdateOperationResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
 
     Buffer output;
     size_t input_consumed;
     AuthorizationSet output_params;
 };
 
+/**
+ * Carries several consecutive update inputs for one operation, so that the operation is looked up
+ * and authorized once rather than once per input.  \p additional_params apply to the batch as a
+ * whole and are passed to the operation with the first input.  Every input must be consumed in
+ * full.
+ */
+struct BatchUpdateOperationRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxInputs = 256;
+
+    explicit BatchUpdateOperationRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the inputs with |count| empty buffers.  Returns false on allocation failure.
+    bool SetInputCount(size_t count);
+
+    keymaster_operation_handle_t op_handle = 0;
+    size_t input_count = 0;
+    UniquePtr<Buffer[]> inputs;
+    AuthorizationSet additional_params;
+};
+
+struct BatchUpdateOperationResponse : public KeymasterResponse {
+    explicit BatchUpdateOperationResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
+
+    // Replaces the outputs with |count| empty buffers.  Returns false on allocation failure.
+    bool SetOutputCount(size_t count);
+
+    // One output per request input, in the same order.
+    size_t output_count = 0;
+    UniquePtr<Buffer[]> outputs;
+    AuthorizationSet output_params;
+};
+
 struct FinishOperationRequest : public KeymasterMessage {
     explicit FinishOperationRequest(int32_t ver) : KeymasterMessage(ver) {}
 
@@ -566,11 +705,321 @@ struct FinishOperationResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
 
     Buffer output;
     AuthorizationSet output_params;
 };
 
+/**
+ * Begins, finishes and discards an operation in a single call, without ever adding it to the
+ * operation table.  \p additional_params are used for both begin and finish.  Keys that require
+ * authentication for every operation can't be used, because there is no operation handle for an
+ * auth token to be bound to before the call.
+ */
+struct OneShotOperationRequest : public KeymasterMessage {
+    explicit OneShotOperationRequest(int32_t ver) : KeymasterMessage(ver) {
+        key_blob.key_material = nullptr;
+        key_blob.key_material_size = 0;
+    }
+    ~OneShotOperationRequest() { delete[] key_blob.key_material; }
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_purpose_t purpose;
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+    Buffer input;
+    Buffer signature;
+};
+
+struct OneShotOperationResponse : public KeymasterResponse {
+    explicit OneShotOperationResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
+
+    // The output parameters of both begin and finish.
+    AuthorizationSet output_params;
+    Buffer output;
+};
+
+/**
+ * Locates operation input or output within a shared-memory region registered with
+ * AndroidKeymaster::RegisterSharedMemory().
+ */
+struct SharedMemorySpan {
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const {
+        return Fields::Append(buf, end, *this);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
+        return Fields::Copy(buf_ptr, end, this);
+    }
+
+    uint64_t offset = 0;
+    uint32_t length = 0;
+
+    using Fields = FieldList<Field<uint64_t, &SharedMemorySpan::offset>,
+                             Field<uint32_t, &SharedMemorySpan::length>>;
+    static constexpr size_t kSerializedSize = Fields::kSize;
+};
+
+/**
+ * Updates, or if \p finish is set finishes, an operation whose input is read from and whose output
+ * is written to a shared-memory region instead of being carried in the messages, so that bulk data
+ * such as file contents isn't copied through the transport.  The spans must not overlap.  Output
+ * that doesn't fit the output span fails the call with KM_ERROR_INSUFFICIENT_BUFFER_SPACE and
+ * aborts the operation.
+ */
+struct SharedMemoryOperationRequest : public KeymasterMessage {
+    explicit SharedMemoryOperationRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    keymaster_operation_handle_t op_handle = 0;
+    bool finish = false;
+    uint32_t region_id = 0;
+    SharedMemorySpan input;
+    SharedMemorySpan output;
+    Buffer signature;  // Finish only.
+    AuthorizationSet additional_params;
+};
+
+struct SharedMemoryOperationResponse : public KeymasterResponse {
+    explicit SharedMemoryOperationResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    uint32_t input_consumed = 0;
+    uint32_t output_length = 0;  // Written at the start of the output span.
+    AuthorizationSet output_params;
+
+    using Prefix = FieldList<Field<uint32_t, &SharedMemoryOperationResponse::input_consumed>,
+                             Field<uint32_t, &SharedMemoryOperationResponse::output_length>>;
+};
+
+/**
+ * Signs each of \p messages independently with one key, as if by a separate begin and finish for
+ * each, but with one key parse and one authorization check for the whole batch.  Keys that require
+ * authentication or confirmation for every operation can't be used, and keys with usage or rate
+ * limits, which are counted per operation, can only sign one message per batch.
+ */
+struct BatchSignRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxMessages = 256;
+
+    explicit BatchSignRequest(int32_t ver) : KeymasterMessage(ver) {
+        key_blob.key_material = nullptr;
+        key_blob.key_material_size = 0;
+    }
+    ~BatchSignRequest() { delete[] key_blob.key_material; }
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the messages with |count| empty buffers.  Returns false on allocation failure.
+    bool SetMessageCount(size_t count);
+
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+    size_t message_count = 0;
+    UniquePtr<Buffer[]> messages;
+};
+
+struct BatchSignResponse : public KeymasterResponse {
+    explicit BatchSignResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
+
+    // Replaces the signatures with |count| empty buffers.  Returns false on allocation failure.
+    bool SetSignatureCount(size_t count);
+
+    // One signature per request message, in the same order.
+    size_t signature_count = 0;
+    UniquePtr<Buffer[]> signatures;
+};
+
+/**
+ * Agrees a shared secret with each of \p peer_keys, DER-encoded SubjectPublicKeyInfo structures, as
+ * if by a separate begin and finish for each, but with one key parse and one authorization check
+ * for the whole batch.  The same restrictions as for BatchSignRequest apply.
+ */
+struct BatchAgreeKeyRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxPeerKeys = 256;
+
+    explicit BatchAgreeKeyRequest(int32_t ver) : KeymasterMessage(ver) {
+        key_blob.key_material = nullptr;
+        key_blob.key_material_size = 0;
+    }
+    ~BatchAgreeKeyRequest() { delete[] key_blob.key_material; }
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the peer keys with |count| empty buffers.  Returns false on allocation failure.
+    bool SetPeerKeyCount(size_t count);
+
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+    size_t peer_key_count = 0;
+    UniquePtr<Buffer[]> peer_keys;
+};
+
+struct BatchAgreeKeyResponse : public KeymasterResponse {
+    explicit BatchAgreeKeyResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
+
+    // Replaces the shared secrets with |count| empty buffers.  Returns false on allocation failure.
+    bool SetSharedSecretCount(size_t count);
+
+    // One shared secret per request peer key, in the same order.
+    size_t shared_secret_count = 0;
+    UniquePtr<Buffer[]> shared_secrets;
+};
+
+/**
+ * Verifies each of \p signatures over the corresponding entry of \p messages with one public key,
+ * as if by a separate begin and finish for each, but with one key parse and one authorization
+ * check for the whole batch.  The same restrictions as for BatchSignRequest apply.
+ */
+struct BatchVerifyRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxMessages = 256;
+
+    explicit BatchVerifyRequest(int32_t ver) : KeymasterMessage(ver) {
+        key_blob.key_material = nullptr;
+        key_blob.key_material_size = 0;
+    }
+    ~BatchVerifyRequest() { delete[] key_blob.key_material; }
+
+    void SetKeyMaterial(const void* key_material, size_t length);
+    void SetKeyMaterial(const keymaster_key_blob_t& blob) {
+        SetKeyMaterial(blob.key_material, blob.key_material_size);
+    }
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the messages and signatures with |count| empty buffers each.  Returns false on
+    // allocation failure.
+    bool SetMessageCount(size_t count);
+
+    keymaster_key_blob_t key_blob;
+    AuthorizationSet additional_params;
+    size_t message_count = 0;
+    UniquePtr<Buffer[]> messages;
+    // One signature per message, in the same order.
+    UniquePtr<Buffer[]> signatures;
+};
+
+struct BatchVerifyResponse : public KeymasterResponse {
+    explicit BatchVerifyResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override { return verified.SerializedSize(); }
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override {
+        return verified.Serialize(buf, end);
+    }
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return verified.Deserialize(buf_ptr, end);
+    }
+    bool NonErrorSerializeTo(SerializationSink* sink) const override {
+        return verified.SerializeTo(sink);
+    }
+
+    // Returns true if the signature over request message |i| verified.
+    bool IsVerified(size_t i) const {
+        return i / 8 < verified.available_read() && (verified.peek_read()[i / 8] >> (i % 8)) & 1;
+    }
+
+    // Bit i % 8 of byte i / 8 is set if the signature over request message i verified.
+    Buffer verified;
+};
+
+/**
+ * Carries several independent requests to be executed in one call, so that a TA deployment pays
+ * for one world switch rather than one per request.  Each entry is a command and its serialized
+ * request, at the message version of the batch.  Entries run in order and one entry's failure
+ * doesn't affect the others, so an entry may depend on an earlier one only through state the
+ * caller knows in advance, such as the key blob of an entry that finishes an operation begun in a
+ * previous batch.  Batches don't nest.
+ */
+struct ExecuteBatchRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxEntries = 64;
+
+    explicit ExecuteBatchRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the entries with |count| empty ones.  Returns false on allocation failure.
+    bool SetEntryCount(size_t count);
+
+    // Makes entry |i| run |command| with |request|.  Returns false on allocation failure.
+    bool SetEntry(size_t i, AndroidKeymasterCommand command, const Serializable& request);
+
+    size_t entry_count = 0;
+    UniquePtr<uint32_t[]> commands;
+    // The serialized request for each command, in the same order.
+    UniquePtr<Buffer[]> requests;
+};
+
+struct ExecuteBatchResponse : public KeymasterResponse {
+    explicit ExecuteBatchResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
+
+    // Replaces the responses with |count| empty buffers.  Returns false on allocation failure.
+    bool SetEntryCount(size_t count);
+
+    // Deserializes the response to request entry |i| into |response|, which must be the response
+    // type of that entry's command.  Returns false if the entry is missing or malformed.
+    bool GetEntry(size_t i, KeymasterResponse* response) const;
+
+    // The serialized response to each request entry, in the same order.  An entry whose command
+    // couldn't run holds only its error, which deserializes into any response type.
+    size_t entry_count = 0;
+    UniquePtr<Buffer[]> responses;
+};
+
 struct AbortOperationRequest : public KeymasterMessage {
     explicit AbortOperationRequest(int32_t ver) : KeymasterMessage(ver) {}
 
@@ -587,6 +1036,46 @@ struct AbortOperationRequest : public KeymasterMessage {
 
 using AbortOperationResponse = EmptyKeymasterResponse;
 
+/**
+ * Forks operation \p op_handle: a new operation is begun in the state the operation is in now,
+ * with the same key and parameters and a copy of the input it has processed, so that messages
+ * sharing a prefix need process it only once.  The fork counts as a use of the key, and \p
+ * additional_params are authorized as for a begin.  Both operations continue independently.
+ */
+struct ForkOperationRequest : public KeymasterMessage {
+    explicit ForkOperationRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override {
+        return sizeof(uint64_t) + additional_params.SerializedSize();
+    }
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
+        buf = append_uint64_to_buf(buf, end, op_handle);
+        return additional_params.Serialize(buf, end);
+    }
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint64_from_buf(buf_ptr, end, &op_handle) &&
+               additional_params.Deserialize(buf_ptr, end);
+    }
+
+    keymaster_operation_handle_t op_handle = 0;
+    AuthorizationSet additional_params;
+};
+
+struct ForkOperationResponse : public KeymasterResponse {
+    explicit ForkOperationResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override { return sizeof(uint64_t); }
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override {
+        return append_uint64_to_buf(buf, end, op_handle);
+    }
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
+        return copy_uint64_from_buf(buf_ptr, end, &op_handle);
+    }
+
+    // The handle of the fork.
+    keymaster_operation_handle_t op_handle = 0;
+};
+
 struct AddEntropyRequest : public KeymasterMessage {
     explicit AddEntropyRequest(int32_t ver) : KeymasterMessage(ver) {}
 
@@ -626,6 +1115,7 @@ struct ImportKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
 
     KeymasterKeyBlob key_blob;
     AuthorizationSet enforced;
@@ -666,6 +1156,7 @@ struct ExportKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
 
     uint8_t* key_data;
     size_t key_data_length;
@@ -718,6 +1209,10 @@ struct GetVersionResponse : public KeymasterResponse {
     uint8_t major_ver;
     uint8_t minor_ver;
     uint8_t subminor_ver;
+
+    using Fields = FieldList<Field<uint8_t, &GetVersionResponse::major_ver>,
+                             Field<uint8_t, &GetVersionResponse::minor_ver>,
+                             Field<uint8_t, &GetVersionResponse::subminor_ver>>;
 };
 
 struct AttestKeyRequest : public KeymasterMessage {
@@ -746,6 +1241,7 @@ struct AttestKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
 
     CertificateChain certificate_chain;
 };
@@ -776,25 +1272,202 @@ struct UpgradeKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
 
     keymaster_key_blob_t upgraded_key;
 };
 
+struct UpgradeKeysRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxKeys = 256;
+
+    explicit UpgradeKeysRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the keys with |count| empty ones.  Returns false on allocation failure.
+    bool SetKeyCount(size_t count);
+
+    // All keys are upgraded with the same |upgrade_params|, so they must share application ID and
+    // data.
+    size_t key_count = 0;
+    UniquePtr<KeymasterKeyBlob[]> key_blobs;
+    AuthorizationSet upgrade_params;
+};
+
+struct UpgradeKeysResponse : public KeymasterResponse {
+    explicit UpgradeKeysResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    bool SetKeyCount(size_t count);
+
+    // The result of each key, as UpgradeKeyResponse would report it, in request order.  An empty
+    // upgraded key with KM_ERROR_OK means the key needed no upgrade.
+    size_t key_count = 0;
+    UniquePtr<keymaster_error_t[]> key_errors;
+    UniquePtr<KeymasterKeyBlob[]> upgraded_keys;
+};
+
+struct GenerateKeysRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxKeys = 256;
+
+    explicit GenerateKeysRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the keys with |count| empty ones.  Returns false on allocation failure.
+    bool SetKeyCount(size_t count);
+
+    // Keys are generated without attestation, so the batch is meant for symmetric keys.
+    size_t key_count = 0;
+    UniquePtr<AuthorizationSet[]> key_descriptions;
+};
+
+struct GenerateKeysResponse : public KeymasterResponse {
+    explicit GenerateKeysResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    bool SetKeyCount(size_t count);
+
+    // The result of each key, as GenerateKeyResponse would report it, in request order.
+    size_t key_count = 0;
+    UniquePtr<keymaster_error_t[]> key_errors;
+    UniquePtr<KeymasterKeyBlob[]> key_blobs;
+    UniquePtr<AuthorizationSet[]> enforced;
+    UniquePtr<AuthorizationSet[]> unenforced;
+};
+
+struct ImportKeysRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxKeys = 256;
+
+    explicit ImportKeysRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the keys with |count| empty ones.  Returns false on allocation failure.
+    bool SetKeyCount(size_t count);
+
+    // Keys are imported without attestation, so the batch is meant for symmetric keys.
+    size_t key_count = 0;
+    UniquePtr<AuthorizationSet[]> key_descriptions;
+    UniquePtr<keymaster_key_format_t[]> key_formats;
+    UniquePtr<KeymasterKeyBlob[]> key_data;
+};
+
+struct ImportKeysResponse : public KeymasterResponse {
+    explicit ImportKeysResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    bool SetKeyCount(size_t count);
+
+    // The result of each key, as ImportKeyResponse would report it, in request order.
+    size_t key_count = 0;
+    UniquePtr<keymaster_error_t[]> key_errors;
+    UniquePtr<KeymasterKeyBlob[]> key_blobs;
+    UniquePtr<AuthorizationSet[]> enforced;
+    UniquePtr<AuthorizationSet[]> unenforced;
+};
+
+struct DeleteKeysRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxKeys = 256;
+
+    explicit DeleteKeysRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the keys with |count| empty ones.  Returns false on allocation failure.
+    bool SetKeyCount(size_t count);
+
+    size_t key_count = 0;
+    UniquePtr<KeymasterKeyBlob[]> key_blobs;
+};
+
+struct DeleteKeysResponse : public KeymasterResponse {
+    explicit DeleteKeysResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    bool SetKeyCount(size_t count);
+
+    // The result of each key, as DeleteKeyResponse would report it, in request order.
+    size_t key_count = 0;
+    UniquePtr<keymaster_error_t[]> key_errors;
+};
+
+struct GetKeysCharacteristicsRequest : public KeymasterMessage {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxKeys = 256;
+
+    explicit GetKeysCharacteristicsRequest(int32_t ver) : KeymasterMessage(ver) {}
+
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Replaces the keys with |count| empty ones.  Returns false on allocation failure.
+    bool SetKeyCount(size_t count);
+
+    // Each key has its own additional parameters, since keys in one namespace may have different
+    // application IDs and data.
+    size_t key_count = 0;
+    UniquePtr<KeymasterKeyBlob[]> key_blobs;
+    UniquePtr<AuthorizationSet[]> additional_params;
+};
+
+struct GetKeysCharacteristicsResponse : public KeymasterResponse {
+    explicit GetKeysCharacteristicsResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    bool SetKeyCount(size_t count);
+
+    // The result of each key, as GetKeyCharacteristicsResponse would report it, in request order.
+    size_t key_count = 0;
+    UniquePtr<keymaster_error_t[]> key_errors;
+    UniquePtr<AuthorizationSet[]> enforced;
+    UniquePtr<AuthorizationSet[]> unenforced;
+};
+
 struct ConfigureRequest : public KeymasterMessage {
     explicit ConfigureRequest(int32_t ver) : KeymasterMessage(ver) {}
 
-    size_t SerializedSize() const override { return sizeof(os_version) + sizeof(os_patchlevel); }
+    size_t SerializedSize() const override { return Fields::kSize; }
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
-        buf = append_uint32_to_buf(buf, end, os_version);
-        return append_uint32_to_buf(buf, end, os_patchlevel);
+        return Fields::Append(buf, end, *this);
     }
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
-        return copy_uint32_from_buf(buf_ptr, end, &os_version) &&
-               copy_uint32_from_buf(buf_ptr, end, &os_patchlevel);
+        return Fields::Copy(buf_ptr, end, this);
     }
 
     uint32_t os_version;
     uint32_t os_patchlevel;  // YYYYMM
+
+    using Fields = FieldList<Field<uint32_t, &ConfigureRequest::os_version>,
+                             Field<uint32_t, &ConfigureRequest::os_patchlevel>>;
 };
 
 using ConfigureResponse = EmptyKeymasterResponse;
@@ -907,6 +1580,9 @@ struct ImportWrappedKeyRequest : public KeymasterMessage {
     AuthorizationSet additional_params;
     uint64_t password_sid;
     uint64_t biometric_sid;
+
+    using Sids = FieldList<Field<uint64_t, &ImportWrappedKeyRequest::password_sid>,
+                           Field<uint64_t, &ImportWrappedKeyRequest::biometric_sid>>;
 };
 
 struct ImportWrappedKeyResponse : public KeymasterResponse {
@@ -920,6 +1596,7 @@ struct ImportWrappedKeyResponse : public KeymasterResponse {
     size_t NonErrorSerializedSize() const override;
     uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
     bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+    bool NonErrorSerializeTo(SerializationSink* sink) const override;
 
     KeymasterKeyBlob key_blob;
     AuthorizationSet enforced;
@@ -948,6 +1625,12 @@ struct HardwareAuthToken : public Serializable {
     hw_authenticator_type_t authenticator_type{};
     uint64_t timestamp{};
     KeymasterBlob mac;
+
+    using Prefix = FieldList<Field<uint64_t, &HardwareAuthToken::challenge>,
+                             Field<uint64_t, &HardwareAuthToken::user_id>,
+                             Field<uint64_t, &HardwareAuthToken::authenticator_id>,
+                             Field<uint32_t, &HardwareAuthToken::authenticator_type>,
+                             Field<uint64_t, &HardwareAuthToken::timestamp>>;
 };
 
 struct VerificationToken : public Serializable {
@@ -969,6 +1652,9 @@ struct VerificationToken : public Serializable {
     AuthorizationSet parameters_verified{};
     keymaster_security_level_t security_level{};
     KeymasterBlob mac{};
+
+    using Prefix = FieldList<Field<uint64_t, &VerificationToken::challenge>,
+                             Field<uint64_t, &VerificationToken::timestamp>>;
 };
 
 struct VerifyAuthorizationRequest : public KeymasterMessage {
@@ -1085,6 +1771,62 @@ struct GetVersion2Response : public KeymasterResponse {
     uint32_t max_message_version;
     KmVersion km_version;
     uint32_t km_date;
+
+    using Fields = FieldList<Field<uint32_t, &GetVersion2Response::max_message_version>,
+                             Field<uint32_t, &GetVersion2Response::km_version>,
+                             Field<uint32_t, &GetVersion2Response::km_date>>;
+};
+
+/**
+ * Requests AndroidKeymaster's always-on counters (see KeymasterCounters), so that HALs can be
+ * polled fleet-wide without attaching a tracer.
+ */
+struct GetDebugCountersRequest : public EmptyKeymasterRequest {
+    explicit GetDebugCountersRequest(int32_t ver) : EmptyKeymasterRequest(ver) {}
+};
+
+/**
+ * The counters of every command and operation phase that has been called, and the hit counts of
+ * each cache the context has.
+ */
+struct GetDebugCountersResponse : public KeymasterResponse {
+    // Bounds the allocation a malformed message can cause.
+    static constexpr size_t kMaxCounters = 256;
+
+    // Calls, failed calls and cumulative nanoseconds of the command or phase |id|.
+    struct Counter {
+        uint32_t id;
+        uint64_t calls;
+        uint64_t errors;
+        uint64_t total_ns;
+
+        using Fields = FieldList<Field<uint32_t, &Counter::id>, Field<uint64_t, &Counter::calls>,
+                                 Field<uint64_t, &Counter::errors>,
+                                 Field<uint64_t, &Counter::total_ns>>;
+    };
+
+    // Lookups the cache |id|, a KeymasterCache, has served and failed to serve.
+    struct CacheCounter {
+        uint32_t id;
+        uint64_t hits;
+        uint64_t misses;
+
+        using Fields =
+            FieldList<Field<uint32_t, &CacheCounter::id>, Field<uint64_t, &CacheCounter::hits>,
+                      Field<uint64_t, &CacheCounter::misses>>;
+    };
+
+    explicit GetDebugCountersResponse(int32_t ver) : KeymasterResponse(ver) {}
+
+    size_t NonErrorSerializedSize() const override;
+    uint8_t* NonErrorSerialize(uint8_t* buf, const uint8_t* end) const override;
+    bool NonErrorDeserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    // Identified by AndroidKeymasterCommand.
+    std::vector<Counter> commands;
+    // Identified by OperationPhase.
+    std::vector<Counter> phases;
+    std::vector<CacheCounter> caches;
 };
 
 struct TimestampToken : public Serializable {
@@ -1095,25 +1837,22 @@ struct TimestampToken : public Serializable {
         security_level = other.security_level;
         mac = std::move(other.mac);
     }
-    size_t SerializedSize() const override {
-        return sizeof(challenge) + sizeof(timestamp) + sizeof(security_level) +
-               mac.SerializedSize();
-    }
+    size_t SerializedSize() const override { return Prefix::kSize + mac.SerializedSize(); }
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override {
-        buf = append_uint64_to_buf(buf, end, challenge);
-        buf = append_uint64_to_buf(buf, end, timestamp);
-        buf = append_uint32_to_buf(buf, end, security_level);
+        buf = Prefix::Append(buf, end, *this);
         return mac.Serialize(buf, end);
     }
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override {
-        return copy_uint64_from_buf(buf_ptr, end, &challenge) &&
-               copy_uint64_from_buf(buf_ptr, end, &timestamp) &&
-               copy_uint32_from_buf(buf_ptr, end, &security_level) && mac.Deserialize(buf_ptr, end);
+        return Prefix::Copy(buf_ptr, end, this) && mac.Deserialize(buf_ptr, end);
     }
     uint64_t challenge{};
     uint64_t timestamp{};
     keymaster_security_level_t security_level{};
     KeymasterBlob mac{};
+
+    using Prefix = FieldList<Field<uint64_t, &TimestampToken::challenge>,
+                             Field<uint64_t, &TimestampToken::timestamp>,
+                             Field<uint32_t, &TimestampToken::security_level>>;
 };
 
 struct GenerateTimestampTokenRequest : public KeymasterMessage {
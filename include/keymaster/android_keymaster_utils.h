@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <type_traits>
 #include <utility>
 
 #include <stdint.h>
@@ -25,6 +26,7 @@
 
 #include <keymaster/UniquePtr.h>
 #include <keymaster/mem.h>
+#include <keymaster/secret_arena.h>
 #include <keymaster/serializable.h>
 
 #ifndef __has_cpp_attribute
@@ -112,8 +114,15 @@ inline size_t& accessBlobSize(keymaster_blob_t* blob) {
  * TKeymasterBlob is a very simple extension of the C structs keymaster_blob_t and
  * keymaster_key_blob_t.  It manages its own memory, which makes avoiding memory leaks
  * much easier.
+ *
+ * Payloads of up to kInlineCapacity bytes, such as IVs, MACs and symmetric keys, are stored in the
+ * object itself rather than in a separate heap allocation, so moving a blob can change its data
+ * pointer.  Either way the contents are zeroed when the blob is cleared.  Larger key blobs, which
+ * may hold key material, are kept in the SecretArena when it has room.
  */
 template <typename BlobType> struct TKeymasterBlob : public BlobType {
+    static constexpr size_t kInlineCapacity = 32;
+
     TKeymasterBlob() {
         accessBlobData(this) = nullptr;
         accessBlobSize(this) = 0;
@@ -121,46 +130,45 @@ template <typename BlobType> struct TKeymasterBlob : public BlobType {
 
     TKeymasterBlob(const uint8_t* data, size_t size) {
         accessBlobSize(this) = 0;
-        accessBlobData(this) = dup_buffer(data, size);
+        accessBlobData(this) = Duplicate(data, size);
         if (accessBlobData(this)) accessBlobSize(this) = size;
     }
 
     explicit TKeymasterBlob(size_t size) {
         accessBlobSize(this) = 0;
-        accessBlobData(this) = new (std::nothrow) uint8_t[size];
+        accessBlobData(this) = Allocate(size);
         if (accessBlobData(this)) accessBlobSize(this) = size;
     }
 
     explicit TKeymasterBlob(const BlobType& blob) {
         accessBlobSize(this) = 0;
-        accessBlobData(this) = dup_buffer(accessBlobData(&blob), accessBlobSize(&blob));
+        accessBlobData(this) = Duplicate(accessBlobData(&blob), accessBlobSize(&blob));
         if (accessBlobData(this)) accessBlobSize(this) = accessBlobSize(&blob);
     }
 
     template <size_t N> explicit TKeymasterBlob(const uint8_t (&data)[N]) {
         accessBlobSize(this) = 0;
-        accessBlobData(this) = dup_buffer(data, N);
+        accessBlobData(this) = Duplicate(data, N);
         if (accessBlobData(this)) accessBlobSize(this) = N;
     }
 
     TKeymasterBlob(const TKeymasterBlob& blob) {
         accessBlobSize(this) = 0;
-        accessBlobData(this) = dup_buffer(accessBlobData(&blob), accessBlobSize(&blob));
+        accessBlobData(this) = Duplicate(accessBlobData(&blob), accessBlobSize(&blob));
         if (accessBlobData(this)) accessBlobSize(this) = accessBlobSize(&blob);
     }
 
     TKeymasterBlob(TKeymasterBlob&& rhs) {
-        accessBlobSize(this) = accessBlobSize(&rhs);
-        accessBlobData(this) = accessBlobData(&rhs);
-        accessBlobSize(&rhs) = 0;
-        accessBlobData(&rhs) = nullptr;
+        accessBlobData(this) = nullptr;
+        accessBlobSize(this) = 0;
+        TakeFrom(&rhs);
     }
 
     TKeymasterBlob& operator=(const TKeymasterBlob& blob) {
         if (this != &blob) {
             Clear();
-            accessBlobData(this) = dup_buffer(accessBlobData(&blob), accessBlobSize(&blob));
-            accessBlobSize(this) = accessBlobSize(&blob);
+            accessBlobData(this) = Duplicate(accessBlobData(&blob), accessBlobSize(&blob));
+            if (accessBlobData(this)) accessBlobSize(this) = accessBlobSize(&blob);
         }
         return *this;
     }
@@ -168,10 +176,7 @@ template <typename BlobType> struct TKeymasterBlob : public BlobType {
     TKeymasterBlob& operator=(TKeymasterBlob&& rhs) {
         if (this != &rhs) {
             Clear();
-            accessBlobSize(this) = accessBlobSize(&rhs);
-            accessBlobData(this) = accessBlobData(&rhs);
-            accessBlobSize(&rhs) = 0;
-            accessBlobData(&rhs) = nullptr;
+            TakeFrom(&rhs);
         }
         return *this;
     }
@@ -184,17 +189,22 @@ template <typename BlobType> struct TKeymasterBlob : public BlobType {
     size_t size() const { return accessBlobSize(this); }
 
     void Clear() {
-        if (accessBlobSize(this)) {
-            memset_s(const_cast<uint8_t*>(accessBlobData(this)), 0, accessBlobSize(this));
+        uint8_t* data = const_cast<uint8_t*>(accessBlobData(this));
+        if (is_inline()) {
+            memset_s(data, 0, accessBlobSize(this));
+        } else if (kSecret) {
+            DeleteSecretArray(data, accessBlobSize(this));
+        } else {
+            memset_s(data, 0, accessBlobSize(this));
+            delete[] data;
         }
-        delete[] accessBlobData(this);
         accessBlobData(this) = nullptr;
         accessBlobSize(this) = 0;
     }
 
     const uint8_t* Reset(size_t new_size) {
         Clear();
-        accessBlobData(this) = new (std::nothrow) uint8_t[new_size];
+        accessBlobData(this) = Allocate(new_size);
         if (accessBlobData(this)) accessBlobSize(this) = new_size;
         return accessBlobData(this);
     }
@@ -204,8 +214,19 @@ template <typename BlobType> struct TKeymasterBlob : public BlobType {
     // version of the pointer.  Use sparingly.
     uint8_t* writable_data() { return const_cast<uint8_t*>(accessBlobData(this)); }
 
+    // Whether the payload is stored in the object rather than on the heap.
+    bool is_inline() const { return accessBlobData(this) == inline_data_; }
+
+    // Hands the data to the caller, who must free it with delete[].  Inline and SecretArena data is
+    // copied to the heap first, so on allocation failure the result is empty.
     BlobType release() {
         BlobType tmp = {accessBlobData(this), accessBlobSize(this)};
+        if (is_inline() || (kSecret && IsSecretArray(accessBlobData(this)))) {
+            accessBlobData(&tmp) = dup_buffer(accessBlobData(this), accessBlobSize(this));
+            if (!accessBlobData(&tmp)) accessBlobSize(&tmp) = 0;
+            Clear();
+            return tmp;
+        }
         accessBlobData(this) = nullptr;
         accessBlobSize(this) = 0;
         return tmp;
@@ -218,15 +239,56 @@ template <typename BlobType> struct TKeymasterBlob : public BlobType {
 
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) {
         Clear();
-        UniquePtr<uint8_t[]> tmp;
-        if (!copy_size_and_data_from_buf(buf_ptr, end, &accessBlobSize(this), &tmp)) {
-            accessBlobData(this) = nullptr;
-            accessBlobSize(this) = 0;
+        size_t size;
+        if (!copy_uint32_from_buf(buf_ptr, end, &size)) return false;
+        if (size == 0) return true;
+        if (!__buffer_bound_check(*buf_ptr, end, size)) return false;
+        uint8_t* data = Allocate(size);
+        if (!data || !copy_from_buf(buf_ptr, end, data, size)) {
+            Clear();
             return false;
         }
-        accessBlobData(this) = tmp.release();
+        accessBlobData(this) = data;
+        accessBlobSize(this) = size;
         return true;
     }
+
+  private:
+    static constexpr bool kSecret = std::is_same<BlobType, keymaster_key_blob_t>::value;
+
+    // Returns storage for |size| bytes, inline if they fit, or null on allocation failure.
+    uint8_t* Allocate(size_t size) {
+        if (size <= kInlineCapacity) return inline_data_;
+        if (kSecret) return NewSecretArray(size);
+        return new (std::nothrow) uint8_t[size];
+    }
+
+    uint8_t* Duplicate(const uint8_t* data, size_t size) {
+        if (size > kInlineCapacity && kSecret) {
+            uint8_t* dup = NewSecretArray(size);
+            if (dup) memcpy(dup, data, size);
+            return dup;
+        }
+        if (size > kInlineCapacity) return dup_buffer(data, size);
+        if (size) memcpy(inline_data_, data, size);
+        return inline_data_;
+    }
+
+    // Moves the contents of |rhs|, which is left empty, into this blob, which must be empty.
+    void TakeFrom(TKeymasterBlob* rhs) {
+        if (rhs->is_inline()) {
+            accessBlobData(this) = Duplicate(accessBlobData(rhs), accessBlobSize(rhs));
+            accessBlobSize(this) = accessBlobSize(rhs);
+            rhs->Clear();
+            return;
+        }
+        accessBlobData(this) = accessBlobData(rhs);
+        accessBlobSize(this) = accessBlobSize(rhs);
+        accessBlobData(rhs) = nullptr;
+        accessBlobSize(rhs) = 0;
+    }
+
+    uint8_t inline_data_[kInlineCapacity];
 };
 
 typedef TKeymasterBlob<keymaster_blob_t> KeymasterBlob;
@@ -291,9 +353,31 @@ struct CertificateChain : public keymaster_cert_chain_t {
         Clear();
         (keymaster_cert_chain_t&)(*this) = (keymaster_cert_chain_t&)(other);
         (keymaster_cert_chain_t&)(other) = {};
+        borrowed_count_ = other.borrowed_count_;
+        other.borrowed_count_ = 0;
         return *this;
     }
 
+    /**
+     * Create a chain of `head`, whose data the chain takes ownership of, followed by the entries of
+     * `tail`, which are referenced rather than copied.  `tail` must outlive the chain.  If
+     * allocation fails, `entries` will be null and `head` is not freed.
+     */
+    static CertificateChain WithBorrowedTail(const keymaster_blob_t& head,
+                                             const keymaster_cert_chain_t& tail) {
+        CertificateChain retval(tail.entry_count + 1);
+        if (!retval.entries) return {};
+        retval.entries[0] = head;
+        for (size_t i = 0; i < tail.entry_count; ++i) {
+            retval.entries[i + 1] = tail.entries[i];
+        }
+        retval.borrowed_count_ = tail.entry_count;
+        return retval;
+    }
+
+    // Number of entries, at the end of the chain, that are referenced rather than owned.
+    size_t borrowed_count() const { return borrowed_count_; }
+
     /**
      * Clone `other`.  If anything fails, `entries` will be null.
      */
@@ -343,7 +427,18 @@ struct CertificateChain : public keymaster_cert_chain_t {
         return true;
     }
 
+    // Hands the chain to the caller, who must free every entry.  Borrowed entries are copied
+    // first, so on allocation failure the result is empty.
     keymaster_cert_chain_t release() {
+        for (size_t i = entry_count - borrowed_count_; i < entry_count; ++i) {
+            const uint8_t* copy = dup_buffer(entries[i].data, entries[i].data_length);
+            if (!copy) {
+                Clear();
+                return {};
+            }
+            entries[i].data = copy;
+            --borrowed_count_;
+        }
         keymaster_cert_chain_t retval = *this;
         entries = nullptr;
         entry_count = 0;
@@ -352,14 +447,18 @@ struct CertificateChain : public keymaster_cert_chain_t {
 
     void Clear() {
         if (entries) {
-            for (size_t i = 0; i < entry_count; ++i) {
+            for (size_t i = 0; i < entry_count - borrowed_count_; ++i) {
                 delete[] entries[i].data;
             }
             delete[] entries;
         }
         entry_count = 0;
         entries = nullptr;
+        borrowed_count_ = 0;
     }
+
+  private:
+    size_t borrowed_count_ = 0;
 };
 
 // Per RFC 5280 4.1.2.5, an undefined expiration (not-after) field should be set to GeneralizedTime
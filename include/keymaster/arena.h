@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+#include <type_traits>
+
+#ifdef KEYMASTER_STATIC_HEAP
+#include <keymaster/static_block_pool.h>
+#endif
+
+namespace keymaster {
+
+/**
+ * Arena is a bump allocator for storage that lives exactly as long as one HAL call, such as the
+ * AuthorizationSets and Buffers in request and response messages.  Allocations are carved out of
+ * chunks that are only released, and zeroed, by Reset() or destruction; freeing an individual
+ * allocation is a no-op.
+ *
+ * Objects opt in with set_arena().  An object bound to an arena never lets arena memory escape:
+ * moving from it into an object that isn't bound to the same arena copies the data instead.  An
+ * arena that is Reset() between calls keeps its first chunk, so steady-state calls need no heap
+ * allocations at all for their messages.  Arena is not thread-safe; use one per thread or per call.
+ */
+class Arena {
+  public:
+    static constexpr size_t kDefaultChunkSize = 4096;
+
+    explicit Arena(size_t chunk_size = kDefaultChunkSize) : chunk_size_(chunk_size) {}
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    void operator=(const Arena&) = delete;
+
+    // Returns |size| bytes aligned for any fundamental type, or nullptr if allocation fails.
+    void* Allocate(size_t size);
+
+    template <typename T> T* AllocateArray(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "Arena memory is never destroyed element by element");
+        if (count > SIZE_MAX / sizeof(T)) return nullptr;
+        return static_cast<T*>(Allocate(count * sizeof(T)));
+    }
+
+    // Returns true if |ptr| points into memory handed out by this arena.
+    bool Owns(const void* ptr) const;
+
+    // Zeroes and releases everything allocated so far, keeping the first chunk for reuse.
+    void Reset();
+
+    size_t bytes_allocated() const { return bytes_allocated_; }
+
+  private:
+    struct alignas(alignof(max_align_t)) Chunk {
+        Chunk* next;
+        size_t size;
+        size_t used;
+        uint8_t* data() { return reinterpret_cast<uint8_t*>(this + 1); }
+        const uint8_t* data() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+    };
+
+    Chunk* NewChunk(size_t min_size);
+    static void FreeChunk(Chunk* chunk);
+
+    // Most recently allocated first, so the chunk being filled is always at the head.
+    Chunk* chunks_ = nullptr;
+    size_t chunk_size_;
+    size_t bytes_allocated_ = 0;
+};
+
+/**
+ * Allocates an array of |count| trivial objects from |arena|, or from the heap if |arena| is null.
+ * Builds with KEYMASTER_STATIC_HEAP take the latter from static_block_pool() instead.
+ */
+template <typename T> T* NewArray(Arena* arena, size_t count) {
+    if (arena) return arena->AllocateArray<T>(count);
+#ifdef KEYMASTER_STATIC_HEAP
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Pool blocks are never destroyed element by element");
+    if (count > SIZE_MAX / sizeof(T)) return nullptr;
+    return static_cast<T*>(static_block_pool()->Allocate(count * sizeof(T)));
+#else
+    return new (std::nothrow) T[count];
+#endif
+}
+
+/**
+ * Frees an array allocated by NewArray().  |ptr| may also be a heap array that was moved into an
+ * object bound to |arena|.
+ */
+template <typename T> void DeleteArray(Arena* arena, T* ptr) {
+    if (arena && arena->Owns(ptr)) return;
+#ifdef KEYMASTER_STATIC_HEAP
+    StaticBlockPool* pool = static_block_pool();
+    if (pool->Owns(ptr)) return pool->Free(ptr);
+#endif
+    delete[] ptr;
+}
+
+/**
+ * Deleter for UniquePtr<T[]> whose storage may come from an arena.
+ */
+template <typename T> struct ArenaArrayDelete {
+    void operator()(T* ptr) const { DeleteArray(arena, ptr); }
+    Arena* arena = nullptr;
+};
+
+}  // namespace keymaster
@@ -34,6 +34,11 @@ class AsymmetricKeyFactory : public KeyFactory {
                               AuthorizationSet&& hw_enforced,  //
                               AuthorizationSet&& sw_enforced,  //
                               UniquePtr<Key>* key) const override;
+    keymaster_error_t LoadAuthenticatedKey(KeymasterKeyBlob&& key_material,
+                                           const AuthorizationSet& additional_params,
+                                           AuthorizationSet&& hw_enforced,  //
+                                           AuthorizationSet&& sw_enforced,  //
+                                           UniquePtr<Key>* key) const override;
 
     virtual keymaster_error_t CreateEmptyKey(AuthorizationSet&& hw_enforced,
                                              AuthorizationSet&& sw_enforced,
@@ -47,6 +52,12 @@ class AsymmetricKeyFactory : public KeyFactory {
     SupportedExportFormats(size_t* format_count) const override;
 
   protected:
+    // Parses |key_material| with the full RSA and EC consistency checks unless |authenticated|.
+    keymaster_error_t LoadKeyMaterial(KeymasterKeyBlob&& key_material,
+                                      AuthorizationSet&& hw_enforced,
+                                      AuthorizationSet&& sw_enforced, bool authenticated,
+                                      UniquePtr<Key>* key) const;
+
     const KeymasterContext& context_;
 };
 
@@ -16,6 +16,9 @@
 
 #pragma once
 
+#include <memory>
+#include <vector>
+
 #include <keymaster/authorization_set.h>
 #include <keymaster/km_version.h>
 
@@ -84,6 +87,29 @@ class AttestationContext {
         return nullptr;
     }
 
+    /**
+     * Encodings of the root of trust, which only change when the verified boot parameters or the
+     * boot patchlevel are configured.
+     */
+    struct RootOfTrustEncodings {
+        // Incremented each time the context's boot parameters change.
+        uint64_t generation;
+        // The RootOfTrust SEQUENCE of the ASN.1 attestation extension.
+        std::vector<uint8_t> der;
+        // The tagged CBOR RootOfTrust that GetRootOfTrust MACs; empty if the boot patchlevel is
+        // not known.
+        std::vector<uint8_t> cbor;
+    };
+
+    /**
+     * Returns the root of trust encodings for the current verified boot parameters, or null if the
+     * context doesn't cache them, in which case callers encode GetVerifiedBootParams() themselves.
+     * Returned encodings are never modified; changed parameters get new ones.
+     */
+    virtual std::shared_ptr<const RootOfTrustEncodings> GetRootOfTrustEncodings() const {
+        return nullptr;
+    }
+
     /**
      * Return the factory attestation signing key.  If not available, set `error` to
      * KM_ERROR_UNIMPLEMENTED.
@@ -98,6 +124,27 @@ class AttestationContext {
     virtual CertificateChain GetAttestationChain(keymaster_algorithm_t algorithm,
                                                  keymaster_error_t* error) const = 0;
 
+    /**
+     * Return the factory attestation signing key without copying it, or null if the context does
+     * not hold it in memory, in which case GetAttestationKey() is used.  The AttestationContext
+     * retains ownership of the key, which must not change for the lifetime of the context.
+     * Contexts that override GetAttestationKey() must override this too.
+     */
+    virtual const keymaster_key_blob_t*
+    GetAttestationKeyRef(keymaster_algorithm_t /* algorithm */) const {
+        return nullptr;
+    }
+
+    /**
+     * Return the factory attestation certificate chain without copying it, or null if the context
+     * does not hold it in memory, in which case GetAttestationChain() is used.  Ownership and
+     * lifetime are as for GetAttestationKeyRef().
+     */
+    virtual const keymaster_cert_chain_t*
+    GetAttestationChainRef(keymaster_algorithm_t /* algorithm */) const {
+        return nullptr;
+    }
+
   protected:
     KmVersion version_;
 };
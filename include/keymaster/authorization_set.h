@@ -16,12 +16,14 @@
 
 #pragma once
 
+#include <initializer_list>
 #include <utility>
 
 #include <keymaster/UniquePtr.h>
 
 #include <hardware/keymaster_defs.h>
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/arena.h>
 #include <keymaster/keymaster_tags.h>
 #include <keymaster/serializable.h>
 
@@ -92,6 +94,10 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
         elems_ = nullptr;
         error_ = set.error_;
         if (error_ != OK) return;
+        if (set.shared_) {
+            AttachShared(set.shared_);
+            return;
+        }
         Reinitialize(set.elems_, set.elems_size_);
     }
 
@@ -101,6 +107,11 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     // Copy assignment.
     AuthorizationSet& operator=(const AuthorizationSet& set) {
         if (&set == this) return *this;
+        if (set.shared_) {
+            FreeData();
+            AttachShared(set.shared_);
+            return *this;
+        }
         Reinitialize(set.elems_, set.elems_size_);
         error_ = set.error_;
         return *this;
@@ -165,21 +176,35 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     const keymaster_key_param_t* data() const { return elems_; }
 
     /**
-     * Sorts the set
+     * Sorts the set by tag, then by value.
      */
     void Sort();
 
     /**
      * Sorts the set and removes duplicates (inadvertently duplicating tags is easy to do with the
-     * AuthorizationSetBuilder).
+     * AuthorizationSetBuilder) and KM_TAG_INVALID entries.
      */
     void Deduplicate();
 
     /**
-     * Removes all elements in \p set from this AuthorizationSet.
+     * Deduplicates this AuthorizationSet, then removes all elements in \p set from it.  Like
+     * Intersection() and Union(), this takes O((n + m) log(n + m)) time for sets of n and m
+     * elements, and leaves the result sorted.
      */
     void Difference(const keymaster_key_param_set_t& set);
 
+    /**
+     * Deduplicates this AuthorizationSet, then removes the elements that aren't in \p set.
+     * Returns false if memory can't be allocated, leaving the set invalid.
+     */
+    bool Intersection(const keymaster_key_param_set_t& set);
+
+    /**
+     * Adds the elements of \p set, which must not be this set, and deduplicates the result.
+     * Returns false if memory can't be allocated.
+     */
+    bool Union(const keymaster_key_param_set_t& set);
+
     /**
      * Returns the data in a keymaster_key_param_set_t, suitable for returning to C code.  For C
      * compatibility, the contents are malloced, not new'ed, and so must be freed with free(), or
@@ -193,6 +218,18 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
      */
     int find(keymaster_tag_t tag, int begin = -1) const;
 
+    /**
+     * Builds a tag index so that \p find (and everything built on it) runs in logarithmic rather
+     * than linear time.  Meant for sets that are read many times after they are built, and called
+     * automatically by \p Deserialize.  Any modification through the AuthorizationSet API,
+     * including the non-const \p operator[], discards the index; modifying the elements through
+     * the public keymaster_key_param_set_t fields does not, so callers that do that must not build
+     * one.  Returns false if the set is too small to benefit or the index can't be allocated, in
+     * which case lookups fall back to a linear scan.
+     */
+    bool BuildIndex();
+    bool has_index() const;
+
     /**
      * Removes the entry at the specified index. Returns true if successful, false if the index was
      * out of bounds.
@@ -378,8 +415,21 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
      */
     bool reserve_indirect(size_t length);
 
+    /**
+     * Makes room for \p more_elems more entries holding \p more_indirect_bytes more bytes of
+     * KM_BYTES and KM_BIGNUM data, so that appending them doesn't reallocate.  Appends otherwise
+     * grow the set geometrically.
+     */
+    bool Reserve(size_t more_elems, size_t more_indirect_bytes);
+
     bool push_back(const keymaster_key_param_set_t& set);
 
+    /**
+     * Appends \p count params, which must not point into this set, allocating at most once for
+     * the entries and once for their data.
+     */
+    bool push_back(const keymaster_key_param_t* params, size_t count);
+
     /**
      * Append the tag and enumerated value to the set.
      */
@@ -436,20 +486,101 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     size_t SerializedSize() const;
     uint8_t* Serialize(uint8_t* serialized_set, const uint8_t* end) const;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end);
+    bool SerializeTo(SerializationSink* sink) const;
+
+    /**
+     * Like \p Deserialize, but KM_BYTES and KM_BIGNUM entries point into the serialized buffer
+     * rather than into a copy of it, which is what makes deserializing cheap for sets that are only
+     * read.  The buffer must outlive the set, or the set must be detached from it with \p
+     * Materialize first.  Adding entries that need indirect data materializes the set
+     * automatically, and copies of the set never borrow.
+     */
+    bool DeserializeView(const uint8_t** buf_ptr, const uint8_t* end);
+
+    /**
+     * A denser encoding than \p Serialize, for storage formats where size matters.  Each tag is a
+     * zigzag varint of its difference from the previous element's tag, integers and dates are
+     * varints, bools take one byte and blobs are a varint length followed by the data.  Element
+     * order is kept, and each set has exactly one encoding.  The two encodings are not
+     * interchangeable.
+     */
+    size_t CompactSerializedSize() const;
+    uint8_t* CompactSerialize(uint8_t* buf, const uint8_t* end) const;
+    bool CompactDeserialize(const uint8_t** buf_ptr, const uint8_t* end);
+
+    /**
+     * A columnar encoding, for consumers such as keystore's database that store the tags, values
+     * and blobs of a set as columns rather than converting it an element at a time.  A 32-bit
+     * element count is followed by a column of 32-bit tags, a column of 64-bit values and a
+     * 32-bit-length-prefixed arena holding the data of every KM_BYTES and KM_BIGNUM element in
+     * order.  Integers, enums, dates and bools are zero-extended into their value; a blob's value
+     * is its offset into the arena in the high half and its length in the low half.  All fields
+     * are in host byte order, like \p Serialize.
+     */
+    size_t ColumnarSerializedSize() const;
+    uint8_t* ColumnarSerialize(uint8_t* buf, const uint8_t* end) const;
+    bool ColumnarDeserialize(const uint8_t** buf_ptr, const uint8_t* end);
+
+    /**
+     * Copies borrowed indirect data into storage owned by the set.  A no-op for sets that aren't
+     * views.  Returns false if allocation fails.
+     */
+    bool Materialize();
+    bool is_view() const { return indirect_data_borrowed_; }
+
+    /**
+     * Moves the set's storage into an immutable, reference-counted block, indexed once.  Copies of
+     * a shared set refer to that block instead of duplicating the elements, and the first
+     * modification made through any of them copies the elements out again.  Returns false, leaving
+     * the set as it was, if allocation fails.
+     */
+    bool Share();
+    bool is_shared() const { return shared_ != nullptr; }
+
+    /**
+     * Makes the set allocate its storage from \p arena (or the heap, if null) from now on.  Any
+     * current contents are discarded.  The binding stays with this object: copying or moving the
+     * set elsewhere copies the data out of the arena.
+     */
+    void set_arena(Arena* arena);
+    Arena* arena() const { return arena_; }
 
     size_t SerializedSizeOfElements() const;
 
+    /**
+     * Returns a 64-bit keyed hash of the set's contents, for use as a cache key or to find
+     * duplicate sets.  The set is hashed as a multiset: sets holding the same elements, in any
+     * order, hash equal, with elements equal exactly when keymaster_param_compare() says so.  The
+     * key is chosen at random once per process, so hashes must not be stored or sent anywhere.
+     *
+     * The hash is kept up to date by push_back() and erase(), and survives Sort(), copying a
+     * shared set and Share(), so in the common cases it costs nothing.  After any other change it
+     * is recomputed on the next call, which hashes every element but serializes nothing.  Equal
+     * hashes don't prove equal sets; compare the contents to be sure.
+     */
+    uint64_t ContentHash() const;
+
   private:
+    struct SharedData;
+
     void FreeData();
     void MoveFrom(AuthorizationSet& set);
 
+    void AttachShared(SharedData* shared);
+    // Empties the set and returns its shared block, whose reference the caller takes over.
+    SharedData* DetachShared();
+    static void Unref(SharedData* shared);
+    // Copy-on-write: gives the set storage of its own before it is modified.
+    bool Unshare();
+
     void set_invalid(Error err);
 
     static size_t ComputeIndirectDataSize(const keymaster_key_param_t* elems, size_t count);
     void CopyIndirectData();
     bool CheckIndirectData();
 
-    bool DeserializeIndirectData(const uint8_t** buf_ptr, const uint8_t* end);
+    bool DeserializeImpl(const uint8_t** buf_ptr, const uint8_t* end, bool borrow);
+    bool DeserializeIndirectData(const uint8_t** buf_ptr, const uint8_t* end, bool borrow);
     bool DeserializeElementsData(const uint8_t** buf_ptr, const uint8_t* end);
 
     bool GetTagValueEnum(keymaster_tag_t tag, uint32_t* val) const;
@@ -465,6 +596,25 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     bool ContainsEnumValue(keymaster_tag_t tag, uint32_t val) const;
     bool ContainsIntValue(keymaster_tag_t tag, uint32_t val) const;
 
+    // Drops the tag index and the memoized serialized size: anything derived from the elements.
+    void InvalidateCaches();
+
+    // Like reserve_elems() and reserve_indirect(), but at least doubling the capacity when it must
+    // grow, so that a run of appends reallocates a logarithmic number of times.
+    bool grow_elems(size_t count);
+    bool grow_indirect(size_t length);
+
+    // Compacts this sorted, deduplicated set to the elements that are (\p keep_matches) or aren't
+    // in \p set.  Returns false, leaving the set invalid, if memory can't be allocated.
+    bool MergeSorted(const keymaster_key_param_set_t& set, bool keep_matches);
+    int IndexedFind(keymaster_tag_t tag, int begin) const;
+
+    // First position of each distinct tag, sorted by tag.
+    struct TagIndexEntry {
+        keymaster_tag_t tag;
+        uint32_t first;
+    };
+
     // Define elems_ and elems_size_ as aliases to params and length, respectively.  This is to
     // avoid using the variables without the trailing underscore in the implementation.
     keymaster_key_param_t*& elems_ = keymaster_key_param_set_t::params;
@@ -475,6 +625,28 @@ class AuthorizationSet : public Serializable, public keymaster_key_param_set_t {
     size_t indirect_data_size_;
     size_t indirect_data_capacity_;
     Error error_;
+    // Set when indirect_data_ points into a buffer passed to DeserializeView().
+    bool indirect_data_borrowed_ = false;
+    Arena* arena_ = nullptr;
+    // Set when elems_ and indirect_data_ point into storage shared with other sets.
+    SharedData* shared_ = nullptr;
+
+    // The index arrays come from NewArray(), so that static-heap builds draw them from the pool.
+    UniquePtr<TagIndexEntry[], ArenaArrayDelete<TagIndexEntry>> tag_index_;
+    size_t tag_index_size_ = 0;
+    // For each element, the position of the next element with the same tag, or kNoNextTag.
+    UniquePtr<uint32_t[], ArenaArrayDelete<uint32_t>> next_same_tag_;
+    // The elements' tags, packed together so that scans that can't use the index touch a sixth
+    // of the memory the elements take and compare several tags per instruction.
+    UniquePtr<uint32_t[], ArenaArrayDelete<uint32_t>> dense_tags_;
+    // SerializedSizeOfElements(), or kUnknownSize.  Computing it walks every element, and
+    // serializing a set needs it at least twice.
+    static constexpr size_t kUnknownSize = SIZE_MAX;
+    mutable size_t serialized_elements_size_ = kUnknownSize;
+    // ContentHash(), when content_hash_known_.  The hash is the sum of the elements' hashes, so an
+    // element can be added or removed without rehashing the rest.
+    mutable uint64_t content_hash_ = 0;
+    mutable bool content_hash_known_ = true;  // Empty sets hash to 0.
 };
 
 class AuthorizationSetBuilder {
@@ -512,6 +684,23 @@ class AuthorizationSetBuilder {
         return Authorization(tag, reinterpret_cast<const uint8_t*>(data), data_length);
     }
 
+    /**
+     * Appends all of \p params, growing the set at most once:
+     *
+     *   Authorizations({Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN),
+     *                   Authorization(TAG_KEY_SIZE, 256)})
+     */
+    AuthorizationSetBuilder& Authorizations(std::initializer_list<keymaster_key_param_t> params) {
+        set.push_back(params.begin(), params.size());
+        return *this;
+    }
+
+    // Makes room for that many more authorizations; see AuthorizationSet::Reserve().
+    AuthorizationSetBuilder& Reserve(size_t more_elems, size_t more_indirect_bytes = 0) {
+        set.Reserve(more_elems, more_indirect_bytes);
+        return *this;
+    }
+
     AuthorizationSetBuilder& RsaKey(uint32_t key_size, uint64_t public_exponent);
     AuthorizationSetBuilder& EcdsaKey(uint32_t key_size);
     AuthorizationSetBuilder& AesKey(uint32_t key_size);
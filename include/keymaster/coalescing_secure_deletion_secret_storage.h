@@ -0,0 +1,157 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <keymaster/secure_deletion_secret_storage.h>
+
+namespace keymaster {
+
+/**
+ * SecureDeletionSlotStore is the persistent storage behind CoalescingSecureDeletionSecretStorage,
+ * e.g. a file in RPMB: a factory reset secret and a fixed number of key slots, numbered from 1,
+ * each of which is empty or holds a secure deletion secret.
+ *
+ * Commit() is called from the storage's flush thread and may run concurrently with ReadSlot() for
+ * other slots.  The other methods are never called concurrently with each other.
+ */
+class SecureDeletionSlotStore {
+  public:
+    struct SlotWrite {
+        uint32_t key_slot;
+        // The secret to store in the slot, or an empty buffer to erase it.
+        const Buffer* secret;
+    };
+
+    virtual ~SecureDeletionSlotStore() {}
+
+    // Number of key slots.  The last upgrade_only_slot_count() of them are only used for upgrades.
+    virtual uint32_t slot_count() const = 0;
+    virtual uint32_t upgrade_only_slot_count() const = 0;
+
+    /**
+     * Reads the factory reset secret and which slots are in use, `occupied[i]` being slot i + 1.
+     * Returns false if secure storage is not yet available, and blocks if it was available
+     * before.  If the store hasn't been created, returns true with an empty factory reset secret.
+     */
+    virtual bool Load(Buffer* factory_reset_secret, std::vector<bool>* occupied) = 0;
+
+    // Reads the secret in `key_slot`, blocking until secure storage can be read.
+    virtual bool ReadSlot(uint32_t key_slot, Buffer* secret) = 0;
+
+    /**
+     * Durably applies `writes` and, if it isn't null, a new `factory_reset_secret` as a single
+     * transaction.  Returns true only once all of them would survive a power loss; if it returns
+     * false none of them may have been applied.
+     */
+    virtual bool Commit(const Buffer* factory_reset_secret, const SlotWrite* writes,
+                        size_t count) = 0;
+
+    // Erases the factory reset secret and every slot.
+    virtual void Erase() = 0;
+};
+
+/**
+ * CoalescingSecureDeletionSecretStorage keeps the slot map of a SecureDeletionSlotStore in memory
+ * and hands every slot write to a flush thread, which commits all the writes queued while the
+ * previous commit was in progress as one transaction.  Concurrent key generations therefore share
+ * a single storage write instead of each paying for their own.
+ *
+ * CreateDataForNewKey() doesn't return until its slot write has been committed, so no key blob is
+ * ever returned whose secure deletion secret could be lost.  Deletions can be queued without
+ * waiting with DeleteKeyAsync(); a deleted slot isn't reused until its erasure is durable.
+ */
+class CoalescingSecureDeletionSecretStorage : public SecureDeletionSecretStorage {
+  public:
+    static constexpr size_t kFactoryResetSecretSize = 32;
+    static constexpr size_t kSecureDeletionSecretSize = 16;
+
+    // Starts the flush thread.  `store` must outlive the storage.
+    CoalescingSecureDeletionSecretStorage(const RandomSource& random,
+                                          SecureDeletionSlotStore& store);
+    // Commits any queued writes, then stops the flush thread.
+    ~CoalescingSecureDeletionSecretStorage() override;
+
+    CoalescingSecureDeletionSecretStorage(const CoalescingSecureDeletionSecretStorage&) = delete;
+    void operator=(const CoalescingSecureDeletionSecretStorage&) = delete;
+
+    std::optional<SecureDeletionData> CreateDataForNewKey(bool secure_deletion,
+                                                          bool is_upgrade) const override;
+    SecureDeletionData GetDataForKey(uint32_t key_slot) const override;
+    // Queues the erasure of `key_slot` and waits for it to be committed.
+    void DeleteKey(uint32_t key_slot) const override;
+    // Queues the erasure of every slot at once, so that they share a commit, and waits for it.
+    void DeleteKeys(const uint32_t* key_slots, size_t count) const override;
+    void DeleteAllKeys() const override;
+    bool is_thread_safe() const override { return true; }
+
+    // Queues the erasure of `key_slot` and returns without waiting for it.
+    void DeleteKeyAsync(uint32_t key_slot) const;
+
+    // Waits until every write queued so far has been committed, or has failed to be.
+    void Flush() const;
+
+    // Number of writes waiting for the next commit.
+    size_t queued_writes() const;
+
+  private:
+    enum SlotState : uint8_t { SLOT_FREE, SLOT_WRITING, SLOT_IN_USE, SLOT_ERASING };
+
+    struct PendingWrite {
+        uint32_t key_slot;
+        Buffer secret;
+        bool done = false;
+        bool committed = false;
+    };
+
+    void Run();
+    // Loads the slot map on first use, creating and committing the factory reset secret if the
+    // store is new.  Returns false if secure storage isn't available yet.  Requires `mutex_`.
+    bool EnsureLoaded() const;
+    // Reserves a free slot, or returns 0 if none is left.  Requires `mutex_`.
+    uint32_t AllocateSlot(bool is_upgrade) const;
+    // Adds a write to the next batch and returns it, or null on allocation failure.  Requires
+    // `mutex_`.
+    std::shared_ptr<PendingWrite> QueueWrite(uint32_t key_slot, Buffer secret) const;
+    // Queues the erasure of `key_slot` if it's in use, returning the write or null.  Requires
+    // `mutex_`.
+    std::shared_ptr<PendingWrite> QueueErase(uint32_t key_slot) const;
+
+    SecureDeletionSlotStore& store_;
+
+    mutable std::mutex mutex_;
+    mutable std::condition_variable wake_;
+    mutable std::condition_variable committed_;
+    mutable bool loaded_ = false;
+    mutable Buffer factory_reset_secret_;
+    mutable std::vector<SlotState> slots_;
+    mutable uint32_t next_slot_hint_ = 0;
+    mutable std::vector<std::shared_ptr<PendingWrite>> queued_;
+    // Batches are numbered from 1 in commit order; queued_ becomes batch next_batch_.
+    mutable uint64_t next_batch_ = 1;
+    mutable uint64_t committed_batch_ = 0;
+    mutable bool committing_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <keymaster/secure_key_storage.h>
+
+namespace keymaster {
+
+/**
+ * CoalescingSecureKeyStorage wraps a SecureKeyStorage and hands every key deletion to a flush
+ * thread, which passes all the deletions queued while the previous one was in progress to a single
+ * DeleteKeys() call.  Single-use keys (TAG_USAGE_COUNT_LIMIT of 1) are consumed by deleting them
+ * after their operation finishes, so under load concurrent finishes share one storage write
+ * instead of each paying for their own.
+ *
+ * A key reads as absent from the moment its deletion is queued, so it can't be used again while
+ * the write is pending.  DeleteKey() doesn't return until the deletion is durable, so no result
+ * from a single-use key reaches its caller before the use is recorded, and a crash can't make a
+ * use count twice.  A key whose deletion fails still reads as absent, until it is written again.
+ *
+ * `store` must outlive the storage, which is its only user from then on.  Unlike most storage,
+ * this one is thread-safe.
+ */
+class CoalescingSecureKeyStorage : public SecureKeyStorage {
+  public:
+    // Deletions beyond this many wait for the next DeleteKeys() call, bounding its size.
+    static constexpr size_t kDefaultMaxBatch = 64;
+
+    // Starts the flush thread.
+    explicit CoalescingSecureKeyStorage(SecureKeyStorage& store,
+                                        size_t max_batch = kDefaultMaxBatch);
+    // Commits any queued deletions, then stops the flush thread.
+    ~CoalescingSecureKeyStorage() override;
+
+    CoalescingSecureKeyStorage(const CoalescingSecureKeyStorage&) = delete;
+    void operator=(const CoalescingSecureKeyStorage&) = delete;
+
+    keymaster_error_t WriteKey(const km_id_t keyid, const KeymasterKeyBlob& blob) override;
+    keymaster_error_t KeyExists(const km_id_t keyid, bool* exists) override;
+    // Queues the deletion of `keyid` and waits for it to be committed.
+    keymaster_error_t DeleteKey(const km_id_t keyid) override;
+    // Queues the deletion of every key at once, so that they share a commit, and waits for it.
+    keymaster_error_t DeleteKeys(const km_id_t* keyids, size_t count) override;
+    keymaster_error_t DeleteAllKeys() override;
+    keymaster_error_t HasSlot(bool* has_slot) override;
+    bool is_thread_safe() const override { return true; }
+
+    // Queues the deletion of `keyid` and returns without waiting for it.
+    keymaster_error_t DeleteKeyAsync(km_id_t keyid);
+
+    // Waits until every deletion queued so far has been committed, or has failed to be.
+    void Flush();
+
+    // Number of deletions waiting for the next commit.
+    size_t queued_deletes() const;
+
+  private:
+    struct PendingDelete {
+        km_id_t keyid;
+        bool done = false;
+        keymaster_error_t error = KM_ERROR_OK;
+    };
+
+    void Run();
+    // Adds a deletion to the queue and returns it, or null on allocation failure.  Requires
+    // `mutex_`.
+    std::shared_ptr<PendingDelete> QueueDelete(km_id_t keyid);
+
+    SecureKeyStorage& store_;
+    const size_t max_batch_;
+
+    // Serializes calls into store_, which needn't be thread-safe.  Taken after mutex_, never
+    // before it.
+    std::mutex store_mutex_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable committed_;
+    std::vector<std::shared_ptr<PendingDelete>> queued_;
+    // Keys whose deletion is queued, in progress or failed.  They read as absent.
+    std::unordered_set<km_id_t> retired_;
+    bool committing_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+
+namespace keymaster {
+
+/**
+ * AndroidKeymaster that may be called from several threads at once.
+ *
+ * Operations live in a ShardedOperationTable, so update, finish and abort calls on different
+ * operations run in parallel; calls on the same operation are serialized.  Everything that touches
+ * the shared context is serialized by a single mutex.
+ *
+ * GenerateKey, ImportKey, UpgradeKeys and PrepareKey can also be run asynchronously, on the
+ * context's worker pool or, if it has none, on a few threads of their own started by the first
+ * asynchronous call.  Either way at most |async_workers| calls run at once.  Each call returns a
+ * ticket at once; the response is delivered to a callback on the worker thread or, without a
+ * callback, held until it is polled.
+ */
+class ConcurrentAndroidKeymaster : public AndroidKeymaster {
+  public:
+    // Identifies an asynchronous call.  Valid tickets are never zero.
+    using AsyncTicket = uint64_t;
+
+    enum class AsyncStatus {
+        PENDING,   // Queued or running.
+        COMPLETE,  // The response has been collected and the ticket retired.
+        UNKNOWN,   // Never issued, already collected, or delivered to a callback.
+    };
+
+    template <typename Response>
+    using AsyncCallback = std::function<void(AsyncTicket, std::unique_ptr<Response>)>;
+
+    static constexpr size_t kDefaultAsyncWorkers = 2;
+
+    ConcurrentAndroidKeymaster(KeymasterContext* context, size_t operation_table_size,
+                               int32_t message_version = kDefaultMessageVersion,
+                               size_t async_workers = kDefaultAsyncWorkers);
+    // Waits for all queued asynchronous calls to complete.
+    ~ConcurrentAndroidKeymaster() override;
+
+    // Queue GenerateKey(), ImportKey() or UpgradeKeys() for a worker thread.  |callback|, if set,
+    // is called on the worker thread with the response; otherwise the response is kept for
+    // Poll*().  Returns zero if |request| is null.
+    AsyncTicket GenerateKeyAsync(std::unique_ptr<GenerateKeyRequest> request,
+                                 AsyncCallback<GenerateKeyResponse> callback = nullptr);
+    AsyncTicket ImportKeyAsync(std::unique_ptr<ImportKeyRequest> request,
+                               AsyncCallback<ImportKeyResponse> callback = nullptr);
+    // A large upgrade, such as the one after an OTA, is best queued as several requests so that
+    // other calls get the context lock between them.
+    AsyncTicket UpgradeKeysAsync(std::unique_ptr<UpgradeKeysRequest> request,
+                                 AsyncCallback<UpgradeKeysResponse> callback = nullptr);
+
+    // Queue PrepareKey() for a worker thread, so the key is cached by the time the begin that
+    // will use it arrives.  Without a |callback| the response is dropped rather than kept for
+    // polling; the begin reports any error again.
+    AsyncTicket PrepareKeyAsync(std::unique_ptr<PrepareKeyRequest> request,
+                                AsyncCallback<PrepareKeyResponse> callback = nullptr);
+
+    // Moves the response of a completed call without a callback into |response|.
+    AsyncStatus PollGenerateKey(AsyncTicket ticket, std::unique_ptr<GenerateKeyResponse>* response);
+    AsyncStatus PollImportKey(AsyncTicket ticket, std::unique_ptr<ImportKeyResponse>* response);
+    AsyncStatus PollUpgradeKeys(AsyncTicket ticket, std::unique_ptr<UpgradeKeysResponse>* response);
+
+  protected:
+    void LockContext() override { context_mutex_.lock(); }
+    void UnlockContext() override { context_mutex_.unlock(); }
+    size_t ParallelWorkerCount() const override;
+
+  private:
+    // Responses of calls without a callback, by ticket.  Null while the call is pending.
+    template <typename Response>
+    using AsyncResults = std::map<AsyncTicket, std::unique_ptr<Response>>;
+
+    template <typename Request, typename Response>
+    AsyncTicket SubmitAsync(std::unique_ptr<Request> request,
+                            void (AndroidKeymaster::*method)(const Request&, Response*),
+                            AsyncCallback<Response> callback, AsyncResults<Response>* results);
+    template <typename Response>
+    AsyncStatus PollAsync(AsyncTicket ticket, AsyncResults<Response>* results,
+                          std::unique_ptr<Response>* response);
+    void RunAsyncWorker();
+    // Runs queued calls on a worker pool thread until there are none left.
+    void DrainAsyncJobs();
+
+    // Recursive because some entry points are implemented in terms of others.
+    std::recursive_mutex context_mutex_;
+
+    // Guards everything below.
+    std::mutex async_mutex_;
+    std::condition_variable async_wake_;
+    // Signalled when the last DrainAsyncJobs() task returns.
+    std::condition_variable async_idle_;
+    std::deque<std::function<void()>> async_jobs_;
+    std::vector<std::thread> async_workers_;
+    const size_t async_worker_count_;
+    // DrainAsyncJobs() tasks queued or running on the worker pool.
+    size_t async_drainers_ = 0;
+    AsyncTicket next_ticket_ = 1;
+    AsyncResults<GenerateKeyResponse> generate_key_results_;
+    AsyncResults<ImportKeyResponse> import_key_results_;
+    AsyncResults<UpgradeKeysResponse> upgrade_keys_results_;
+    bool stopping_ = false;
+};
+
+}  // namespace keymaster
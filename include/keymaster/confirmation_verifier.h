@@ -0,0 +1,72 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+
+/**
+ * Checks the input of an operation bound to TAG_TRUSTED_CONFIRMATION_REQUIRED against the
+ * confirmation token supplied to finish.  The token is an HMAC-SHA256, under the key shared with
+ * the ConfirmationUI TA, of kConfirmationTokenMessageTag followed by the operation's input.  Each
+ * piece of input is appended once as it arrives, so a verifier that hashes as it goes holds the
+ * same memory however long the message is.
+ */
+class ConfirmationVerifier {
+  public:
+    ConfirmationVerifier() {}
+    virtual ~ConfirmationVerifier() {}
+
+    ConfirmationVerifier(const ConfirmationVerifier&) = delete;
+    void operator=(const ConfirmationVerifier&) = delete;
+
+    /**
+     * Appends |data| to the confirmed message.  Returns KM_ERROR_INVALID_ARGUMENT if the message
+     * would grow beyond kConfirmationMessageMaxSize.
+     */
+    keymaster_error_t Append(const uint8_t* data, size_t data_length) {
+        if (data_length > kConfirmationMessageMaxSize - message_size_) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        message_size_ += data_length;
+        return Update(data, data_length);
+    }
+
+    /**
+     * Returns KM_ERROR_OK if |confirmation_token| matches the message appended so far and
+     * KM_ERROR_NO_USER_CONFIRMATION if it doesn't.  Call at most once.
+     */
+    virtual keymaster_error_t Verify(const uint8_t confirmation_token[kConfirmationTokenSize]) = 0;
+
+    // Bytes held on behalf of the message, for Operation::MemoryFootprint().
+    virtual size_t MemoryFootprint() const { return 0; }
+
+  protected:
+    virtual keymaster_error_t Update(const uint8_t* data, size_t data_length) = 0;
+
+  private:
+    size_t message_size_ = 0;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,38 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace keymaster {
+
+/**
+ * Returns true if the |length| bytes at |a| and |b| are equal.  The time taken depends only on
+ * |length|, never on the data or on where the first difference is, so it is safe for comparing
+ * MACs, tags and tokens against expected values.
+ *
+ * The bytes are compared 16 at a time with SSE2 or NEON where the build targets them, and a
+ * machine word at a time otherwise; the selection is made at compile time, like the OCB code's.
+ */
+bool ConstantTimeEquals(const void* a, const void* b, size_t length);
+
+// The kernel ConstantTimeEquals() was built with: "sse2", "neon" or "generic".
+const char* ConstantTimeEqualsKernel();
+
+}  // namespace keymaster
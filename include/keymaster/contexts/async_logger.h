@@ -0,0 +1,113 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+struct AsyncLoggerOptions {
+    // Number of messages the ring holds, rounded up to a power of two.  Messages logged while the
+    // ring is full are dropped and counted.
+    size_t capacity = 256;
+    // How often the background thread drains the ring.
+    uint32_t drain_interval_ms = 20;
+    // At most this many messages with the same format string are logged per window; the rest are
+    // counted and reported once the window ends.  Zero disables rate limiting.
+    uint32_t max_repeats = 20;
+    uint32_t rate_window_ms = 1000;
+};
+
+/**
+ * AsyncLogger installs itself as the Logger instance and hands messages to |sink| on a background
+ * thread, so that a caller provoking a flood of errors doesn't pay for writing them out.  Logging
+ * threads format into a fixed-size slot of a lock-free ring and never block; only the drain takes
+ * a lock.  Messages longer than a slot are truncated.
+ *
+ * |sink| is not owned and must outlive the AsyncLogger.  It is only called from one thread at a
+ * time.
+ */
+class AsyncLogger : public Logger {
+  public:
+    explicit AsyncLogger(Logger* sink, const AsyncLoggerOptions& options = AsyncLoggerOptions());
+    // Stops the background thread, drains whatever is left and reinstalls the Logger that was the
+    // instance before this one.
+    ~AsyncLogger() override;
+
+    int log_msg(LogLevel level, const char* fmt, va_list args) const override;
+    bool is_loggable(LogLevel level) const override { return sink_->is_loggable(level); }
+
+    // Passes everything logged so far to the sink before returning.
+    void Flush();
+
+    uint64_t dropped_count() const { return dropped_count_; }
+    uint64_t suppressed_count() const { return suppressed_count_; }
+
+  private:
+    static constexpr size_t kMaxMessageLength = 240;
+    static constexpr size_t kRateSlots = 64;
+
+    struct Record {
+        std::atomic<size_t> sequence;
+        LogLevel level;
+        char text[kMaxMessageLength];
+    };
+
+    struct RateSlot {
+        std::atomic<const char*> fmt{nullptr};
+        std::atomic<uint64_t> window_start_ms{0};
+        std::atomic<uint32_t> count{0};
+        std::atomic<uint32_t> suppressed{0};
+    };
+
+    // Decides whether a message with |fmt| may be logged.  If it may and earlier ones were
+    // suppressed, their number is stored in |*suppressed|.
+    bool Admit(const char* fmt, uint32_t* suppressed) const;
+    bool Push(LogLevel level, const char* fmt, ...) const;
+    bool PushV(LogLevel level, const char* fmt, va_list args) const;
+    // Requires |drain_mutex_|.
+    void Drain();
+    void Run();
+
+    Logger* sink_;
+    const AsyncLoggerOptions options_;
+    Logger* previous_instance_;
+    size_t mask_ = 0;
+    Record* records_ = nullptr;
+    mutable std::atomic<size_t> enqueue_pos_{0};
+    size_t dequeue_pos_ = 0;  // Guarded by |drain_mutex_|.
+    mutable RateSlot rate_slots_[kRateSlots];
+    mutable std::atomic<uint64_t> dropped_count_{0};
+    mutable std::atomic<uint64_t> suppressed_count_{0};
+    uint64_t reported_dropped_ = 0;  // Guarded by |drain_mutex_|.
+
+    std::mutex drain_mutex_;
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;  // Guarded by |wake_mutex_|.
+    std::thread thread_;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <keymaster/km_openssl/nist_curve_key_exchange.h>
+
+namespace keymaster {
+
+/**
+ * BackgroundEcKeyPool keeps up to |depth| ephemeral EC key pairs ready for each of a fixed set of
+ * NIST curves, generating them on a low-priority background thread.  Taking a key wakes the thread
+ * to replace it.  Requests for any other curve always miss, and so does a request that finds the
+ * pool empty, leaving the caller to generate synchronously.
+ *
+ * Pre-generated keys live in process memory until taken, so the pool is only meant for software
+ * contexts.
+ */
+class BackgroundEcKeyPool : public EcKeyPool {
+  public:
+    // P-256 and P-384.
+    static std::vector<keymaster_ec_curve_t> DefaultCurves();
+
+    // Starts the background thread.  A |depth| of zero makes a pool that never has any keys.
+    explicit BackgroundEcKeyPool(size_t depth,
+                                 std::vector<keymaster_ec_curve_t> curves = DefaultCurves());
+    // Stops the background thread, waiting for any key generation in progress.
+    ~BackgroundEcKeyPool() override;
+
+    BackgroundEcKeyPool(const BackgroundEcKeyPool&) = delete;
+    void operator=(const BackgroundEcKeyPool&) = delete;
+
+    EC_KEY_Ptr TakeKey(keymaster_ec_curve_t curve) override;
+
+    // Number of keys ready for the given curve.
+    size_t available(keymaster_ec_curve_t curve) const;
+
+    size_t depth() const { return depth_; }
+
+  private:
+    struct Slot {
+        keymaster_ec_curve_t curve;
+        std::vector<EC_KEY_Ptr> keys;
+    };
+
+    void Run();
+    // Returns the slot least full, or null if every slot holds |depth_| keys.  Requires |mutex_|.
+    Slot* NextSlotToFill();
+    // Returns the index of the slot for the given curve, or slots_.size() if none.
+    size_t FindSlot(keymaster_ec_curve_t curve) const;
+
+    const size_t depth_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<Slot> slots_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <keymaster/km_openssl/rsa_key_factory.h>
+
+namespace keymaster {
+
+/**
+ * BackgroundRsaKeyPool keeps up to |depth| RSA key pairs ready for each of a fixed set of key sizes
+ * and public exponents, generating them on a low-priority background thread.  Taking a key wakes
+ * the thread to replace it.  Requests for any other size or exponent always miss, and so does a
+ * request that finds the pool empty, leaving the caller to generate synchronously.
+ *
+ * Pre-generated keys live in process memory until taken, so the pool is only meant for software
+ * contexts.
+ */
+class BackgroundRsaKeyPool : public RsaKeyPool {
+  public:
+    struct KeySpec {
+        uint32_t key_size;
+        uint64_t public_exponent;
+    };
+
+    // 2048, 3072 and 4096-bit keys with exponent 65537.
+    static std::vector<KeySpec> DefaultKeySpecs();
+
+    // Starts the background thread.  A |depth| of zero makes a pool that never has any keys.
+    explicit BackgroundRsaKeyPool(size_t depth, std::vector<KeySpec> specs = DefaultKeySpecs());
+    // Stops the background thread, waiting for any key generation in progress.
+    ~BackgroundRsaKeyPool() override;
+
+    BackgroundRsaKeyPool(const BackgroundRsaKeyPool&) = delete;
+    void operator=(const BackgroundRsaKeyPool&) = delete;
+
+    RSA_Ptr TakeKey(uint32_t key_size, uint64_t public_exponent) override;
+
+    // Number of keys ready for the given size and exponent.
+    size_t available(uint32_t key_size, uint64_t public_exponent) const;
+
+    size_t depth() const { return depth_; }
+
+  private:
+    struct Slot {
+        KeySpec spec;
+        std::vector<RSA_Ptr> keys;
+    };
+
+    void Run();
+    // Returns the slot least full, or null if every slot holds |depth_| keys.  Requires |mutex_|.
+    Slot* NextSlotToFill();
+    // Returns the index of the slot for the given size and exponent, or slots_.size() if none.
+    size_t FindSlot(uint32_t key_size, uint64_t public_exponent) const;
+
+    const size_t depth_;
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    std::vector<Slot> slots_;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+}  // namespace keymaster
@@ -34,6 +34,13 @@ class Keymaster2PassthroughContext : public KeymasterContext {
   public:
     explicit Keymaster2PassthroughContext(KmVersion version, keymaster2_device_t* dev);
 
+    /**
+     * Dispatches operations across |session_count| sessions opened on the same device.  Calls that
+     * aren't operations go to the first session.
+     */
+    Keymaster2PassthroughContext(KmVersion version, keymaster2_device_t* const* sessions,
+                                 size_t session_count);
+
     KmVersion GetKmVersion() const override { return version_; }
 
     /**
@@ -17,27 +17,53 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <string_view>
+#include <vector>
 
 #include <keymaster/attestation_context.h>
 #include <keymaster/contexts/pure_soft_remote_provisioning_context.h>
 #include <keymaster/contexts/soft_attestation_context.h>
+#include <keymaster/key_blob_utils/hidden_authorizations_cache.h>
+#include <keymaster/key_blob_utils/software_keyblobs.h>
 #include <keymaster/keymaster_context.h>
 #include <keymaster/km_openssl/attestation_record.h>
 #include <keymaster/km_openssl/soft_keymaster_enforcement.h>
 #include <keymaster/km_openssl/software_random_source.h>
+#include <keymaster/parsed_key_cache.h>
 #include <keymaster/pure_soft_secure_key_storage.h>
 #include <keymaster/random_source.h>
 #include <keymaster/soft_key_factory.h>
+#include <keymaster/worker_pool.h>
 
 namespace keymaster {
 
+class BackgroundRsaKeyPool;
 class SoftKeymasterKeyRegistrations;
 class Keymaster0Engine;
 class Keymaster1Engine;
 class Key;
 
+/**
+ * Capacities of the tables a PureSoftKeymasterContext keeps.  The defaults suit a device with a
+ * handful of auth-bound keys; emulated-hardware deployments with many keys can raise them into the
+ * tens of thousands, as every table is hashed and lookups don't slow down as they grow.
+ */
+struct PureSoftKeymasterContextConfig {
+    // Keys with TAG_MIN_SECONDS_BETWEEN_OPS whose last use is being tracked.
+    uint32_t max_access_time_entries = 64;
+    // Keys with TAG_MAX_USES_PER_BOOT whose uses are being counted.
+    uint32_t max_access_count_entries = 64;
+    // Rollback-resistant keys, when emulating secure hardware.
+    uint32_t max_secure_storage_keys = 64;
+    // Concurrent operations.  The context doesn't own the operation table; this is for whoever
+    // creates the AndroidKeymaster around it.
+    size_t operation_table_size = 16;
+    // Whether SnapshotWarmState() includes the shared HMAC key.
+    bool snapshot_shared_hmac_key = true;
+};
+
 /**
  * SoftKeymasterContext provides the context for a non-secure implementation of AndroidKeymaster.
  */
@@ -48,11 +74,24 @@ class PureSoftKeymasterContext : public KeymasterContext,
   public:
     // Security level must only be used for testing.
     explicit PureSoftKeymasterContext(
-        KmVersion version, keymaster_security_level_t security_level = KM_SECURITY_LEVEL_SOFTWARE);
+        KmVersion version, keymaster_security_level_t security_level = KM_SECURITY_LEVEL_SOFTWARE,
+        const PureSoftKeymasterContextConfig& config = PureSoftKeymasterContextConfig());
     ~PureSoftKeymasterContext() override;
 
+    const PureSoftKeymasterContextConfig& config() const { return config_; }
+
     KmVersion GetKmVersion() const override { return AttestationContext::GetKmVersion(); }
 
+    // Keeps up to |depth| RSA key pairs of each common size pre-generated on a background thread,
+    // for GenerateKey() to use instead of generating one while the caller waits.  Zero, the
+    // default, turns the pool off.  Must not be called while requests are being handled.
+    void SetRsaKeyPoolDepth(size_t depth);
+
+    // Schedules parallel work on |pool|, which must outlive the context, instead of
+    // DefaultWorkerPool().  Null does all work on the calling thread.  Must not be called while
+    // requests are being handled.
+    void SetWorkerPool(WorkerPool* pool) { worker_pool_ = pool; }
+
     /*********************************************************************************************
      * Implement KeymasterContext
      */
@@ -66,12 +105,49 @@ class PureSoftKeymasterContext : public KeymasterContext,
     keymaster_error_t UpgradeKeyBlob(const KeymasterKeyBlob& key_to_upgrade,
                                      const AuthorizationSet& upgrade_params,
                                      KeymasterKeyBlob* upgraded_key) const override;
+    void UpgradeKeyBlobs(const KeymasterKeyBlob* keys_to_upgrade, size_t count,
+                         const AuthorizationSet& upgrade_params, KeymasterKeyBlob* upgraded_keys,
+                         keymaster_error_t* errors, size_t thread_count) const override;
     keymaster_error_t ParseKeyBlob(const KeymasterKeyBlob& blob,
                                    const AuthorizationSet& additional_params,
                                    UniquePtr<Key>* key) const override;
+    keymaster_error_t ParseKeyCharacteristics(const KeymasterKeyBlob& blob,
+                                              const AuthorizationSet& additional_params,
+                                              AuthorizationSet* hw_enforced,
+                                              AuthorizationSet* sw_enforced) const override;
+    // Characteristics come from the parsed-key cache, or are cached by parsing them.
+    bool has_cheap_key_characteristics() const override { return true; }
+    void ParseKeysCharacteristics(const KeymasterKeyBlob* blobs,
+                                  const AuthorizationSet* additional_params, size_t count,
+                                  AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced,
+                                  keymaster_error_t* errors, size_t thread_count) const override;
     keymaster_error_t DeleteKey(const KeymasterKeyBlob& blob) const override;
+    void DeleteKeys(const KeymasterKeyBlob* blobs, size_t count,
+                    keymaster_error_t* errors) const override;
     keymaster_error_t DeleteAllKeys() const override;
     keymaster_error_t AddRngEntropy(const uint8_t* buf, size_t length) const override;
+    WorkerPool* worker_pool() const override { return worker_pool_; }
+    bool GetCacheCounters(KeymasterCache cache, uint64_t* hits, uint64_t* misses) const override;
+
+    /**
+     * Writes an encrypted, authenticated snapshot of state that is slow to rebuild and survives
+     * nothing but this process: the shared HMAC negotiation (if the config allows) and the
+     * emulated secure key storage.  A restarted HAL that passes the snapshot to RestoreWarmState()
+     * can serve requests without waiting for Keystore to renegotiate.
+     */
+    keymaster_error_t SnapshotWarmState(std::vector<uint8_t>* snapshot) const;
+
+    /**
+     * Restores state from a snapshot written by SnapshotWarmState().  Fails with
+     * KM_ERROR_INVALID_ARGUMENT, changing nothing, if the snapshot is malformed, has been altered,
+     * or holds more stored keys than this context has room for.
+     */
+    keymaster_error_t RestoreWarmState(const uint8_t* snapshot, size_t size);
+
+    // Formats of the blobs ParseKeyBlob() has had to parse; blobs found in the parsed key cache
+    // aren't counted.  Non-zero counts of legacy formats mean some keys still await an upgrade.
+    const KeyBlobFormatCounter& key_blob_format_counts() const { return key_blob_formats_; }
+
     CertificateChain GenerateAttestation(const Key& key, const AuthorizationSet& attest_params,
                                          UniquePtr<Key> attest_key,
                                          const KeymasterBlob& issuer_subject,
@@ -90,9 +166,8 @@ class PureSoftKeymasterContext : public KeymasterContext,
 
     SecureKeyStorage* secure_key_storage() override { return pure_soft_secure_key_storage_.get(); }
 
-    RemoteProvisioningContext* GetRemoteProvisioningContext() const override {
-        return pure_soft_remote_provisioning_context_.get();
-    }
+    // Created on first use, for KeyMint versions only.
+    RemoteProvisioningContext* GetRemoteProvisioningContext() const override;
 
     keymaster_error_t SetVerifiedBootInfo(std::string_view boot_state,
                                           std::string_view bootloader_state,
@@ -125,26 +200,80 @@ class PureSoftKeymasterContext : public KeymasterContext,
      */
 
     const VerifiedBootParams* GetVerifiedBootParams(keymaster_error_t* error) const override;
+    std::shared_ptr<const RootOfTrustEncodings> GetRootOfTrustEncodings() const override;
 
     keymaster_security_level_t GetSecurityLevel() const override { return security_level_; }
 
   protected:
-    std::unique_ptr<KeyFactory> rsa_factory_;
-    std::unique_ptr<KeyFactory> ec_factory_;
-    std::unique_ptr<KeyFactory> aes_factory_;
-    std::unique_ptr<KeyFactory> tdes_factory_;
-    std::unique_ptr<KeyFactory> hmac_factory_;
+    // ParseKeyBlob(), bypassing the parsed key cache unless |use_cache| is set.  Without that
+    // cache, parsing may be done from several threads at once; the key factories lock their own
+    // caches.
+    keymaster_error_t ParseKeyBlob(const KeymasterKeyBlob& blob,
+                                   const AuthorizationSet& additional_params, UniquePtr<Key>* key,
+                                   bool use_cache) const;
+
+    // Verifies |blob|, whatever its format, and extracts its contents.  |serialized_hidden| is
+    // |hidden| serialized, as HiddenAuthorizationsCache::Get() returns it.
+    keymaster_error_t ParseUncachedKeyBlob(const KeymasterKeyBlob& blob,
+                                           const AuthorizationSet& hidden,
+                                           const KeymasterBlob& serialized_hidden,
+                                           KeymasterKeyBlob* key_material,
+                                           AuthorizationSet* hw_enforced,
+                                           AuthorizationSet* sw_enforced) const;
+
+    // Checks that a parsed key has an algorithm, returned in |*algorithm|, and that it is still in
+    // secure storage if it has to be.
+    keymaster_error_t CheckParsedKeyBlob(const KeymasterKeyBlob& blob,
+                                         const AuthorizationSet& hw_enforced,
+                                         const AuthorizationSet& sw_enforced,
+                                         keymaster_algorithm_t* algorithm) const;
+
+    // Encrypt and decrypt warm state snapshots.  |hidden| binds the encryption to the kind.
+    keymaster_error_t SealSnapshot(const KeymasterKeyBlob& plaintext,
+                                   const AuthorizationSet& hidden,
+                                   std::vector<uint8_t>* sealed) const;
+    keymaster_error_t OpenSnapshot(const uint8_t* sealed, size_t size,
+                                   const AuthorizationSet& hidden,
+                                   KeymasterKeyBlob* plaintext) const;
+
+    // Each factory is created by the first GetKeyFactory() call for its algorithm.
+    mutable std::once_flag rsa_factory_once_;
+    mutable std::once_flag ec_factory_once_;
+    mutable std::once_flag aes_factory_once_;
+    mutable std::once_flag tdes_factory_once_;
+    mutable std::once_flag hmac_factory_once_;
+    mutable std::unique_ptr<KeyFactory> rsa_factory_;
+    mutable std::unique_ptr<KeyFactory> ec_factory_;
+    mutable std::unique_ptr<KeyFactory> aes_factory_;
+    mutable std::unique_ptr<KeyFactory> tdes_factory_;
+    mutable std::unique_ptr<KeyFactory> hmac_factory_;
+    std::unique_ptr<BackgroundRsaKeyPool> rsa_key_pool_;
+    WorkerPool* worker_pool_;
     uint32_t os_version_;
     uint32_t os_patchlevel_;
+    bool system_version_set_ = false;
     std::optional<std::string> bootloader_state_;
     std::optional<std::string> verified_boot_state_;
     std::optional<std::vector<uint8_t>> vbmeta_digest_;
     std::optional<uint32_t> vendor_patchlevel_;
     std::optional<uint32_t> boot_patchlevel_;
+    const PureSoftKeymasterContextConfig config_;
     SoftKeymasterEnforcement soft_keymaster_enforcement_;
     const keymaster_security_level_t security_level_;
     std::unique_ptr<SecureKeyStorage> pure_soft_secure_key_storage_;
-    std::unique_ptr<PureSoftRemoteProvisioningContext> pure_soft_remote_provisioning_context_;
+    // Guards the system and boot info above against GetRemoteProvisioningContext() creating the
+    // remote provisioning context, which copies them, concurrently.
+    mutable std::mutex rkp_mutex_;
+    mutable std::unique_ptr<PureSoftRemoteProvisioningContext>
+        pure_soft_remote_provisioning_context_;
+    // Decrypted contents of recently parsed key blobs.
+    mutable ParsedKeyCache parsed_key_cache_;
+    // Hidden authorizations, and their serialization, for recent APPLICATION_ID/APPLICATION_DATA.
+    mutable HiddenAuthorizationsCache hidden_authorizations_cache_;
+    mutable KeyBlobFormatCounter key_blob_formats_;
+    mutable UniqueIdGenerator unique_id_generator_;
+    // Encodings of the root of trust, re-made when the boot info or boot patchlevel is set.
+    mutable RootOfTrustCache root_of_trust_cache_;
 };
 
 }  // namespace keymaster
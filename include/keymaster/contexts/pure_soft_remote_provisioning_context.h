@@ -17,11 +17,13 @@
 #pragma once
 
 #include <hardware/keymaster_defs.h>
+#include <keymaster/android_keymaster_utils.h>
 #include <keymaster/remote_provisioning_context.h>
 
 #include <cppbor.h>
 
 #include <cstdint>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <string_view>
@@ -39,6 +41,7 @@ class PureSoftRemoteProvisioningContext : public RemoteProvisioningContext {
     std::vector<uint8_t> DeriveBytesFromHbk(const std::string& context,
                                             size_t numBytes) const override;
     std::unique_ptr<cppbor::Map> CreateDeviceInfo(uint32_t csrVersion) const override;
+    std::vector<uint8_t> CreateEncodedDeviceInfo(uint32_t csrVersion) const override;
     cppcose::ErrMsgOr<std::vector<uint8_t>>
     BuildProtectedDataPayload(bool isTestMode,                     //
                               const std::vector<uint8_t>& macKey,  //
@@ -56,11 +59,42 @@ class PureSoftRemoteProvisioningContext : public RemoteProvisioningContext {
                              const std::vector<uint8_t>& vbmeta_digest);
 
   private:
+    struct HbkDerivation {
+        std::string context;
+        KeymasterKeyBlob bytes;  // Zeroed when dropped.  Longer outputs live in the secret arena.
+    };
+
+    // Callers derive from a handful of fixed context strings, so this many outputs cover them all.
+    // Later derivations are computed each time rather than evicting earlier ones.
+    static constexpr size_t kMaxHbkDerivations = 16;
+
+    struct CachedDeviceInfo {
+        uint32_t csrVersion;
+        std::unique_ptr<cppbor::Map> map;
+        std::vector<uint8_t> encoded;
+    };
+
     // Initialize the BCC if it has not yet happened.
     void LazyInitProdBcc() const;
+    // Initialize the test-mode BCC if it has not yet happened.
+    void LazyInitTestBcc() const;
+
+    std::unique_ptr<cppbor::Map> BuildDeviceInfo(uint32_t csrVersion) const;
+    // Returns the cached DeviceInfo for |csrVersion|, building it if needed.  deviceInfoMutex_ must
+    // be held.
+    const CachedDeviceInfo& GetCachedDeviceInfo(uint32_t csrVersion) const;
 
     std::pair<std::vector<uint8_t>, cppbor::Array> GenerateBcc(bool testMode) const;
 
+    struct ProdBcc {
+        std::vector<uint8_t> devicePrivKey;
+        cppbor::Array bcc;
+    };
+
+    // Returns the production BCC held by any other live context in the process, or else generates
+    // one.  It is freed with the last context holding it.
+    std::shared_ptr<const ProdBcc> AttachProdBcc() const;
+
     keymaster_security_level_t security_level_;
     std::optional<uint32_t> os_version_;
     std::optional<uint32_t> os_patchlevel_;
@@ -72,10 +106,26 @@ class PureSoftRemoteProvisioningContext : public RemoteProvisioningContext {
 
     mutable std::once_flag bccInitFlag_;
 
-    // Always call LazyInitProdBcc before accessing these values, as they are
-    // lazy-initialized.
-    mutable std::vector<uint8_t> devicePrivKey_;
-    mutable cppbor::Array bcc_;
+    // Always call LazyInitProdBcc before accessing this, as it is lazy-initialized.  The production
+    // device key is derived from the fake hardware-bound key, which is fixed for the process, so
+    // every context in the process attaches to the same immutable copy; see AttachProdBcc().
+    mutable std::shared_ptr<const ProdBcc> prodBcc_;
+
+    // A test-mode BCC has a random key.  One is generated per context, on first use, rather than
+    // one per request.
+    mutable std::once_flag testBccInitFlag_;
+    mutable std::vector<uint8_t> testDevicePrivKey_;
+    mutable cppbor::Array testBcc_;
+
+    // DeviceInfo only changes when the values above are set, so it is built and encoded once per
+    // CSR version and dropped by the setters.  Guards the values above, too.
+    mutable std::mutex deviceInfoMutex_;
+    mutable std::vector<CachedDeviceInfo> deviceInfoCache_;
+
+    // The outputs of DeriveBytesFromHbk(), by context string and length, so that repeated
+    // derivations don't rerun the HKDF.
+    mutable std::mutex hbkDerivationMutex_;
+    mutable std::vector<HbkDerivation> hbkDerivations_;
 };
 
 }  // namespace keymaster
@@ -27,5 +27,8 @@ const keymaster_key_blob_t* getAttestationKey(keymaster_algorithm_t algorithm,
                                               keymaster_error_t* error);
 CertificateChain getAttestationChain(keymaster_algorithm_t algorithm, keymaster_error_t* error);
 
+// Returns the statically allocated chain for |algorithm|, or null if it has none.
+const keymaster_cert_chain_t* getAttestationChainRef(keymaster_algorithm_t algorithm);
+
 }  // namespace keymaster
 #endif  // SOFTWARE_CONTEXT_SOFT_ATTESTATION_CERT_H_
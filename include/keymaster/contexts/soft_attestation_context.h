@@ -41,6 +41,16 @@ class SoftAttestationContext : public AttestationContext {
                                          keymaster_error_t* error) const override {
         return getAttestationChain(algorithm, error);
     }
+
+    const keymaster_key_blob_t*
+    GetAttestationKeyRef(keymaster_algorithm_t algorithm) const override {
+        return getAttestationKey(algorithm, nullptr /* error */);
+    }
+
+    const keymaster_cert_chain_t*
+    GetAttestationChainRef(keymaster_algorithm_t algorithm) const override {
+        return getAttestationChainRef(algorithm);
+    }
 };
 
 }  // namespace keymaster
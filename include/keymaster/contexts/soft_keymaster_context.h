@@ -25,6 +25,7 @@
 
 #include <keymaster/attestation_context.h>
 #include <keymaster/contexts/soft_attestation_context.h>
+#include <keymaster/key_blob_utils/software_keyblobs.h>
 #include <keymaster/keymaster_context.h>
 #include <keymaster/km_openssl/software_random_source.h>
 #include <keymaster/random_source.h>
@@ -78,6 +79,9 @@ class SoftKeymasterContext : public KeymasterContext,
     keymaster_error_t DeleteAllKeys() const override;
     keymaster_error_t AddRngEntropy(const uint8_t* buf, size_t length) const override;
 
+    // Formats of the blobs ParseKeyBlob() has parsed.  Hardware blobs count as KEY_BLOB_UNKNOWN.
+    const KeyBlobFormatCounter& key_blob_format_counts() const { return key_blob_formats_; }
+
     CertificateChain GenerateAttestation(const Key& key, const AuthorizationSet& attest_params,
                                          UniquePtr<Key> attest_key,
                                          const KeymasterBlob& issuer_subject,
@@ -124,6 +128,7 @@ class SoftKeymasterContext : public KeymasterContext,
     const KeymasterBlob root_of_trust_;
     uint32_t os_version_;
     uint32_t os_patchlevel_;
+    mutable KeyBlobFormatCounter key_blob_formats_;
 };
 
 }  // namespace keymaster
@@ -45,6 +45,26 @@ using BN_CTX_Ptr = bssl::UniquePtr<BN_CTX>;
 
 template <typename T> class ErrMsgOr;
 using bytevec = std::vector<uint8_t>;
+
+// A view of bytes held elsewhere, so that parts of larger buffers can be passed without copying.
+class bytespan {
+  public:
+    bytespan() {}
+    bytespan(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+    bytespan(const bytevec& bytes)  // NOLINT(google-explicit-constructor)
+        : data_(bytes.data()), size_(bytes.size()) {}
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const uint8_t* begin() const { return data_; }
+    const uint8_t* end() const { return data_ + size_; }
+
+  private:
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+};
+
 using HmacSha256 = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 using HmacSha256Function = std::function<ErrMsgOr<HmacSha256>(const bytevec&)>;
 
@@ -283,12 +303,42 @@ class CoseKey {
 // data. Returns std::nullopt on error
 ErrMsgOr<HmacSha256> generateHmacSha256(const bytevec& key, const bytevec& data);
 
+// An HMAC-SHA256 key whose key schedule is computed once, by create().  Each MAC starts from a
+// copy of the keyed state, so one key can MAC any number of messages, from several threads at once.
+class HmacSha256Key {
+  public:
+    HmacSha256Key(const HmacSha256Key&) = delete;
+    HmacSha256Key(HmacSha256Key&&) = default;
+
+    static ErrMsgOr<HmacSha256Key> create(const bytevec& key);
+
+    ErrMsgOr<HmacSha256> mac(const uint8_t* data, size_t dataSize) const;
+    ErrMsgOr<HmacSha256> mac(const bytevec& data) const { return mac(data.data(), data.size()); }
+
+    // The tag of a COSE_Mac0 over |payload|.  The MAC_structure is encoded straight into the HMAC,
+    // without being built or buffered.
+    ErrMsgOr<HmacSha256> coseMac0Mac(const bytevec& externalAad, const uint8_t* payload,
+                                     size_t payloadSize) const;
+
+    // For generateCoseMac0Mac() and constructCoseMac0().  The function refers to this key, which
+    // must outlive it.
+    HmacSha256Function macFunction() const;
+
+  private:
+    explicit HmacSha256Key(bssl::UniquePtr<HMAC_CTX> keyed) : keyed_(std::move(keyed)) {}
+
+    bssl::UniquePtr<HMAC_CTX> keyed_;
+};
+
 ErrMsgOr<HmacSha256> generateCoseMac0Mac(HmacSha256Function macFunction, const bytevec& externalAad,
                                          const bytevec& payload);
 ErrMsgOr<cppbor::Array> constructCoseMac0(HmacSha256Function macFunction,
                                           const bytevec& externalAad, const bytevec& payload);
 ErrMsgOr<bytevec /* payload */> verifyAndParseCoseMac0(const cppbor::Item* macItem,
                                                        const bytevec& macKey);
+// As above, for checking many COSE_Mac0s under the same key.
+ErrMsgOr<bytevec /* payload */> verifyAndParseCoseMac0(const cppbor::Item* macItem,
+                                                       const HmacSha256Key& macKey);
 
 ErrMsgOr<bytevec> createCoseSign1Signature(const bytevec& key, const bytevec& protectedParams,
                                            const bytevec& payload, const bytevec& aad);
@@ -300,6 +350,33 @@ ErrMsgOr<cppbor::Array> constructECDSACoseSign1(const bytevec& key,
                                                 cppbor::Map extraProtectedFields,
                                                 const bytevec& payload, const bytevec& aad);
 
+// A P-256 signing key, parsed and checked once by create(), for signing many COSE_Sign1s.  Signing
+// doesn't modify the key, so one key can sign from several threads at once.
+class EcdsaP256Key {
+  public:
+    EcdsaP256Key(const EcdsaP256Key&) = delete;
+    EcdsaP256Key(EcdsaP256Key&&) = default;
+
+    // |privateKey| is the big-endian private scalar.
+    static ErrMsgOr<EcdsaP256Key> create(const bytevec& privateKey);
+
+    // Signs the SHA-256 |digest|, returning r and s, each padded to 32 bytes, as COSE encodes them.
+    ErrMsgOr<bytevec> signDigest(const bytevec& digest) const;
+
+  private:
+    explicit EcdsaP256Key(bssl::UniquePtr<EC_KEY> key) : key_(std::move(key)) {}
+
+    bssl::UniquePtr<EC_KEY> key_;
+};
+
+// COSE_Sign1 construction with a key that is already parsed.
+ErrMsgOr<bytevec> createECDSACoseSign1Signature(const EcdsaP256Key& key,
+                                                const bytevec& protectedParams,
+                                                const bytevec& payload, const bytevec& aad);
+ErrMsgOr<cppbor::Array> constructECDSACoseSign1(const EcdsaP256Key& key,
+                                                cppbor::Map extraProtectedFields,
+                                                const bytevec& payload, const bytevec& aad);
+
 /**
  * Verify and parse a COSE_Sign1 message, returning the payload.
  *
@@ -314,10 +391,22 @@ ErrMsgOr<bytevec /* payload */> verifyAndParseCoseSign1(const cppbor::Array* cos
                                                         const bytevec& aad);
 
 ErrMsgOr<bytevec> createCoseEncryptCiphertext(const bytevec& key, const bytevec& nonce,
-                                              const bytevec& protectedParams, const bytevec& aad);
+                                              const bytevec& protectedParams,
+                                              const bytevec& plaintextPayload, const bytevec& aad);
 ErrMsgOr<cppbor::Array> constructCoseEncrypt(const bytevec& key, const bytevec& nonce,
                                              const bytevec& plaintextPayload, const bytevec& aad,
                                              cppbor::Array recipients);
+
+// The size of the COSE_Encrypt that encodeCoseEncrypt() writes for a plaintext of |plaintextSize|
+// bytes.
+size_t coseEncryptEncodedSize(size_t plaintextSize, const cppbor::Array& recipients);
+
+// Writes the same bytes as constructCoseEncrypt(...)->encode() into |out|, which must hold
+// coseEncryptEncodedSize() bytes, and returns their number.  The payload is encrypted straight into
+// its bstr, so neither the plaintext nor the ciphertext is copied.
+ErrMsgOr<size_t> encodeCoseEncrypt(bytespan key, bytespan nonce, bytespan plaintextPayload,
+                                   bytespan aad, const cppbor::Array& recipients, uint8_t* out,
+                                   size_t outSize);
 ErrMsgOr<std::pair<bytevec /* pubkey */, bytevec /* key ID */>>
 getSenderPubKeyFromCoseEncrypt(const cppbor::Item* encryptItem);
 inline ErrMsgOr<std::pair<bytevec /* pubkey */, bytevec /* key ID */>>
@@ -341,4 +430,12 @@ ErrMsgOr<bytevec /* plaintext */> aesGcmDecrypt(const bytevec& key, const byteve
                                                 const bytevec& aad,
                                                 const bytevec& ciphertextWithTag);
 
+// As above, but into caller buffers.  |ciphertextWithTag| must hold plaintext.size() +
+// kAesGcmTagSize bytes and |plaintext| ciphertextWithTag.size() - kAesGcmTagSize bytes.  Both
+// return the number of bytes written.
+ErrMsgOr<size_t> aesGcmEncrypt(bytespan key, bytespan nonce, bytespan aad, bytespan plaintext,
+                               uint8_t* ciphertextWithTag);
+ErrMsgOr<size_t> aesGcmDecrypt(bytespan key, bytespan nonce, bytespan aad,
+                               bytespan ciphertextWithTag, uint8_t* plaintext);
+
 }  // namespace cppcose
@@ -17,6 +17,8 @@
 #ifndef SYSTEM_KEYMASTER_KEY_H_
 #define SYSTEM_KEYMASTER_KEY_H_
 
+#include <memory>
+#include <mutex>
 #include <utility>
 
 #include <assert.h>
@@ -25,11 +27,40 @@
 #include <keymaster/UniquePtr.h>
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/key_policy.h>
 
 namespace keymaster {
 
 class KeyFactory;
 
+/**
+ * DerivedKeyData holds values computed from a key's material that are costly to recompute, such as
+ * its encoded public key.  A context that caches parsed key blobs (see ParsedKeyCache) hands the
+ * same instance to every Key it loads from one blob, so each value is computed once per blob rather
+ * than once per load.  Thread-safe.
+ */
+class DerivedKeyData {
+  public:
+    // Copies the DER SubjectPublicKeyInfo into |der|.  Returns false if none has been stored or
+    // the copy cannot be allocated.
+    bool GetPublicKeyDer(UniquePtr<uint8_t[]>* der, size_t* size) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!public_key_der_.size()) return false;
+        der->reset(dup_buffer(public_key_der_.begin(), public_key_der_.size()));
+        *size = public_key_der_.size();
+        return der->get() != nullptr;
+    }
+
+    void SetPublicKeyDer(const uint8_t* der, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        public_key_der_ = KeymasterBlob(der, size);
+    }
+
+  private:
+    mutable std::mutex mutex_;
+    KeymasterBlob public_key_der_;
+};
+
 class Key {
   public:
     virtual ~Key() {}
@@ -65,6 +96,33 @@ class Key {
     void set_secure_deletion_slot(uint32_t slot) { secure_deletion_slot_ = slot; }
     uint32_t secure_deletion_slot() const { return secure_deletion_slot_; }
 
+    // Begin-time enforcement rules compiled from authorizations(), if the context has them cached.
+    void set_policy(const KeyPolicy& policy) { policy_ = policy; }
+    const KeyPolicy& policy() const { return policy_; }
+    // policy(), if it was compiled from authorizations() as they are now, or null.
+    const KeyPolicy* compiled_policy() const {
+        bool usable = policy_.compiled && policy_.auth_set_size == authorizations().size();
+        return usable ? &policy_ : nullptr;
+    }
+
+    // Values derived from the key material, shared with other loads of the same blob, if the
+    // context has them cached.  May be null.
+    void set_derived_data(std::shared_ptr<DerivedKeyData> derived_data) {
+        derived_data_ = std::move(derived_data);
+    }
+    DerivedKeyData* derived_data() const { return derived_data_.get(); }
+
+    // The enforcement policy's CreateKeyId() for the blob the key was loaded from, if the context
+    // had it to hand, so that it needn't be computed again.
+    void set_key_id(uint64_t key_id) {
+        key_id_ = key_id;
+        has_key_id_ = true;
+    }
+    bool key_id(uint64_t* key_id) const {
+        if (has_key_id_) *key_id = key_id_;
+        return has_key_id_;
+    }
+
   protected:
     Key(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
         const KeyFactory* key_factory)
@@ -77,6 +135,10 @@ class Key {
     KeymasterKeyBlob key_material_;
     const KeyFactory* key_factory_;
     uint32_t secure_deletion_slot_ = 0;
+    KeyPolicy policy_;
+    std::shared_ptr<DerivedKeyData> derived_data_;
+    uint64_t key_id_ = 0;
+    bool has_key_id_ = false;
 };
 
 }  // namespace keymaster
@@ -36,6 +36,11 @@ enum AuthEncryptedBlobFormat : uint8_t {
     AES_GCM_WITH_SECURE_DELETION = 2,
     AES_GCM_WITH_SW_ENFORCED_VERSIONED = 3,
     AES_GCM_WITH_SECURE_DELETION_VERSIONED = 4,
+    // Versioned formats whose authorization lists, lengths and integers are stored with
+    // AuthorizationSet::CompactSerialize and varints, which makes a typical blob about a quarter
+    // smaller.
+    AES_GCM_WITH_SW_ENFORCED_COMPACT = 5,
+    AES_GCM_WITH_SECURE_DELETION_COMPACT = 6,
 };
 
 /**
@@ -82,6 +87,27 @@ struct DeserializedKey {
     uint32_t key_slot;
 };
 
+/**
+ * MasterKeyContext holds a master key together with the HKDF pseudo-random key extracted from it,
+ * so that AES-GCM key encryption key derivation only has to run the HKDF expand step.  Callers
+ * that encrypt or decrypt many blobs with the same master key should keep one around rather than
+ * passing the raw master key, which redoes the extraction on every call.  Both keys are zeroed on
+ * destruction.
+ */
+class MasterKeyContext {
+  public:
+    MasterKeyContext() {}
+
+    keymaster_error_t Initialize(const KeymasterKeyBlob& master_key);
+
+    const KeymasterKeyBlob& master_key() const { return master_key_; }
+    const KeymasterKeyBlob& prk() const { return prk_; }
+
+  private:
+    KeymasterKeyBlob master_key_;
+    KeymasterKeyBlob prk_;
+};
+
 /**
  * Encrypt the provided plaintext with format `format`, using the provided authorization lists and
  * master_key to derive the key encryption key.
@@ -95,6 +121,11 @@ EncryptKey(const KeymasterKeyBlob& plaintext, AuthEncryptedBlobFormat format,
            const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
            const AuthorizationSet& hidden, const SecureDeletionData& secure_deletion_data,
            const KeymasterKeyBlob& master_key, const RandomSource& random);
+KmErrorOr<EncryptedKey>
+EncryptKey(const KeymasterKeyBlob& plaintext, AuthEncryptedBlobFormat format,
+           const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
+           const AuthorizationSet& hidden, const SecureDeletionData& secure_deletion_data,
+           const MasterKeyContext& master_key, const RandomSource& random);
 
 /**
  * Serialize `encrypted_key` (which contains necessary nonce & tag information), along with the
@@ -115,15 +146,28 @@ KmErrorOr<KeymasterKeyBlob> SerializeAuthEncryptedBlob(const EncryptedKey& encry
  */
 KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlob(const KeymasterKeyBlob& key_blob);
 
+/**
+ * Like DeserializeAuthEncryptedBlob(), but except in the compact formats the authorization lists
+ * are views into \p key_blob (see AuthorizationSet::DeserializeView), which saves copying them
+ * for blobs that fail to decrypt.  Only for callers that keep \p key_blob alive, and unchanged,
+ * until they have materialized the lists or are done with them.
+ */
+KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlobView(const KeymasterKeyBlob& key_blob);
+
 /**
  * Decrypt key material from the Deserialized data in `key'.
  */
 KmErrorOr<KeymasterKeyBlob> DecryptKey(const DeserializedKey& key, const AuthorizationSet& hidden,
                                        const SecureDeletionData& secure_deletion_data,
                                        const KeymasterKeyBlob& master_key);
+KmErrorOr<KeymasterKeyBlob> DecryptKey(const DeserializedKey& key, const AuthorizationSet& hidden,
+                                       const SecureDeletionData& secure_deletion_data,
+                                       const MasterKeyContext& master_key);
 
 bool requiresSecureDeletion(const AuthEncryptedBlobFormat& fmt);
 
 bool isVersionedFormat(const AuthEncryptedBlobFormat& fmt);
 
+bool isCompactFormat(const AuthEncryptedBlobFormat& fmt);
+
 }  // namespace keymaster
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+
+namespace keymaster {
+
+/**
+ * HiddenAuthorizationsCache keeps the hidden authorizations BuildHiddenAuthorizations() makes for
+ * the last few (APPLICATION_ID, APPLICATION_DATA, root of trust) combinations, along with their
+ * serialization, which is what blob HMACs and parsed key cache lookups consume.  Apps load their
+ * keys with the same client ID and app data over and over, so most lookups are hits.
+ *
+ * Entries are found by a hash of the inputs and confirmed by comparing the inputs themselves, so
+ * a collision never returns another app's hidden set.  The least recently used entry is evicted
+ * when the cache is full.  HiddenAuthorizationsCache is thread-safe.
+ */
+class HiddenAuthorizationsCache {
+  public:
+    static constexpr size_t kDefaultMaxEntries = 8;
+
+    explicit HiddenAuthorizationsCache(size_t max_entries = kDefaultMaxEntries)
+        : max_entries_(max_entries) {}
+
+    // Puts the hidden authorizations for |input_set| and |root_of_trust| in |*hidden|, which
+    // shares the cached set's storage (see AuthorizationSet::Share()), and, if |serialized| is
+    // non-null, their serialization in |*serialized|.  Builds and caches them on a miss.
+    keymaster_error_t Get(const AuthorizationSet& input_set, const KeymasterBlob& root_of_trust,
+                          AuthorizationSet* hidden,
+                          std::shared_ptr<const KeymasterBlob>* serialized = nullptr);
+
+    void Clear();
+
+    size_t size() const;
+    uint64_t hits() const;
+    uint64_t misses() const;
+
+  private:
+    struct Entry {
+        uint64_t hash;
+        bool has_app_id;
+        bool has_app_data;
+        KeymasterBlob app_id;
+        KeymasterBlob app_data;
+        KeymasterBlob root_of_trust;
+        AuthorizationSet hidden;
+        std::shared_ptr<const KeymasterBlob> serialized;
+    };
+
+    const size_t max_entries_;
+    mutable std::mutex mutex_;
+    // Most recently used first.
+    std::list<Entry> entries_;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+}  // namespace keymaster
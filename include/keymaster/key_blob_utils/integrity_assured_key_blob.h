@@ -24,6 +24,7 @@ class AuthorizationSet;
 class Buffer;
 template <typename BlobType> struct TKeymasterBlob;
 typedef TKeymasterBlob<keymaster_key_blob_t> KeymasterKeyBlob;
+typedef TKeymasterBlob<keymaster_blob_t> KeymasterBlob;
 
 keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
                                                 const AuthorizationSet& hidden,
@@ -37,9 +38,40 @@ keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_bl
                                                   AuthorizationSet* hw_enforced,
                                                   AuthorizationSet* sw_enforced);
 
+/**
+ * As above, taking the hidden authorizations already serialized, as HiddenAuthorizationsCache
+ * keeps them, rather than serializing them for each blob.
+ */
+keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
+                                                const KeymasterBlob& serialized_hidden,
+                                                const AuthorizationSet& hw_enforced,
+                                                const AuthorizationSet& sw_enforced,
+                                                KeymasterKeyBlob* key_blob);
+
+keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob,
+                                                  const KeymasterBlob& serialized_hidden,
+                                                  KeymasterKeyBlob* key_material,
+                                                  AuthorizationSet* hw_enforced,
+                                                  AuthorizationSet* sw_enforced);
+
 keymaster_error_t DeserializeIntegrityAssuredBlob_NoHmacCheck(const KeymasterKeyBlob& key_blob,
                                                               KeymasterKeyBlob* key_material,
                                                               AuthorizationSet* hw_enforced,
                                                               AuthorizationSet* sw_enforced);
 
+/**
+ * Checks the HMAC of each of |count| blobs against the same |hidden| authorizations, which are
+ * serialized only once, putting KM_ERROR_OK or KM_ERROR_INVALID_KEY_BLOB in |errors| at the
+ * blob's index.  Nothing is deserialized.  Returns an error only if no blob could be checked.
+ */
+keymaster_error_t VerifyIntegrityAssuredBlobs(const KeymasterKeyBlob* key_blobs, size_t count,
+                                              const AuthorizationSet& hidden,
+                                              keymaster_error_t* errors);
+
+/**
+ * Returns true if |key_blob| is laid out exactly as SerializeIntegrityAssuredBlob() writes blobs,
+ * without computing the HMAC or copying anything.
+ */
+bool HasIntegrityAssuredBlobLayout(const KeymasterKeyBlob& key_blob);
+
 }  // namespace keymaster
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/key_blob_utils/software_keyblobs.h>
+#include <keymaster/worker_pool.h>
+
+namespace keymaster {
+
+class AuthorizationSet;
+
+/**
+ * KeyBlobCorpus maps a collection of key blob files read-only, for tools that audit or migrate
+ * keystore databases.  Blobs are classified and parsed where they are mapped, so a large corpus
+ * costs address space rather than a heap copy of every blob.
+ *
+ * A corpus is not thread-safe while files are being added; Parse() may be called concurrently.
+ */
+class KeyBlobCorpus {
+  public:
+    struct Failure {
+        size_t index;
+        SoftwareKeyBlobFormat format;
+        keymaster_error_t error;
+    };
+
+    struct ParseStats {
+        size_t blob_count = 0;
+        // Blobs classified as each format, and how many of those parsed successfully.
+        size_t format_counts[kSoftwareKeyBlobFormatCount] = {};
+        size_t parsed_counts[kSoftwareKeyBlobFormatCount] = {};
+        // Blobs that didn't parse, in index order.
+        std::vector<Failure> failures;
+    };
+
+    KeyBlobCorpus() = default;
+    ~KeyBlobCorpus();
+    KeyBlobCorpus(const KeyBlobCorpus&) = delete;
+    KeyBlobCorpus& operator=(const KeyBlobCorpus&) = delete;
+
+    // Maps the file at |path|.  Empty files are skipped, since they can't be mapped or parsed.
+    keymaster_error_t AddFile(const std::string& path);
+
+    // Maps every regular file directly in |directory|, in name order.  Files that can't be mapped
+    // are skipped and the first such error is returned once the rest have been added.
+    keymaster_error_t AddDirectory(const std::string& directory);
+
+    size_t size() const { return files_.size(); }
+    const std::string& path(size_t index) const { return files_[index].path; }
+    // The mapped contents of blob |index|, valid as long as the corpus.
+    keymaster_key_blob_t blob(size_t index) const;
+
+    // Parses every blob with the software key blob parsers on up to |thread_count| threads,
+    // checking integrity and decrypting with the hidden authorizations of |additional_params|.
+    // Blobs of unknown format, which may be hardware blobs, are reported as failures.
+    ParseStats Parse(const AuthorizationSet& additional_params, size_t thread_count,
+                     WorkerPool* pool = DefaultWorkerPool()) const;
+
+  private:
+    struct MappedFile {
+        std::string path;
+        const uint8_t* data;
+        size_t size;
+    };
+
+    std::vector<MappedFile> files_;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <hardware/keymaster_defs.h>
+#include <keymaster/key_blob_utils/software_keyblobs.h>
+
+namespace keymaster {
+
+/**
+ * Support for the software key blob formats only older keymasters created: keymaster1 OCB and GCM
+ * blobs and old softkeymaster PKCS#8 blobs.  Nothing here is set up until a blob that
+ * ClassifyKeyBlob() puts in one of these formats is parsed, so processes that only see
+ * integrity-assured blobs never touch it.  Builds for devices that have upgraded all their keys
+ * define KEYMASTER_DISABLE_LEGACY_KEY_BLOBS to leave it out.
+ */
+#ifndef KEYMASTER_DISABLE_LEGACY_KEY_BLOBS
+constexpr bool kLegacyKeyBlobsIncluded = true;
+#else
+constexpr bool kLegacyKeyBlobsIncluded = false;
+#endif
+
+inline bool IsLegacyKeyBlobFormat(SoftwareKeyBlobFormat format) {
+    return format == KEY_BLOB_AUTH_ENCRYPTED_OCB || format == KEY_BLOB_AUTH_ENCRYPTED_GCM ||
+           format == KEY_BLOB_OLD_SOFTKEYMASTER;
+}
+
+/**
+ * Parses |blob|, which ClassifyKeyBlob() found to be in the legacy |format|.  Returns
+ * KM_ERROR_INVALID_KEY_BLOB for non-legacy formats, and for every blob when legacy support is left
+ * out of the build.
+ */
+keymaster_error_t ParseLegacyKeyBlob(const KeymasterKeyBlob& blob, SoftwareKeyBlobFormat format,
+                                     const AuthorizationSet& hidden,
+                                     KeymasterKeyBlob* key_material,
+                                     AuthorizationSet* hw_enforced,
+                                     AuthorizationSet* sw_enforced);
+
+// The parsers ParseLegacyKeyBlob() dispatches to.  Not defined when legacy support is left out.
+keymaster_error_t ParseOldSoftkeymasterBlob(const KeymasterKeyBlob& blob,
+                                            KeymasterKeyBlob* key_material,
+                                            AuthorizationSet* hw_enforced,
+                                            AuthorizationSet* sw_enforced);
+
+keymaster_error_t ParseAuthEncryptedBlob(const KeymasterKeyBlob& blob,
+                                         const AuthorizationSet& hidden,
+                                         KeymasterKeyBlob* key_material,
+                                         AuthorizationSet* hw_enforced,
+                                         AuthorizationSet* sw_enforced);
+
+}  // namespace keymaster
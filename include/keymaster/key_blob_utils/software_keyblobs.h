@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <atomic>
 #include <optional>
 
 #include <hardware/keymaster_defs.h>
@@ -40,16 +41,54 @@ keymaster_error_t BuildHiddenAuthorizations(const AuthorizationSet& input_set,
 keymaster_error_t FakeKeyAuthorizations(EVP_PKEY* pubkey, AuthorizationSet* hw_enforced,
                                         AuthorizationSet* sw_enforced);
 
-keymaster_error_t ParseOldSoftkeymasterBlob(const KeymasterKeyBlob& blob,
-                                            KeymasterKeyBlob* key_material,
-                                            AuthorizationSet* hw_enforced,
-                                            AuthorizationSet* sw_enforced);
+/**
+ * The software key blob formats ParseKeyBlob() implementations accept.  Only integrity-assured
+ * blobs are still created; the others exist on devices that haven't upgraded all their keys, and
+ * are parsed by ParseLegacyKeyBlob().
+ */
+enum SoftwareKeyBlobFormat : uint8_t {
+    KEY_BLOB_UNKNOWN = 0,  // Possibly a hardware blob.
+    KEY_BLOB_INTEGRITY_ASSURED = 1,
+    KEY_BLOB_AUTH_ENCRYPTED_OCB = 2,
+    KEY_BLOB_AUTH_ENCRYPTED_GCM = 3,
+    KEY_BLOB_OLD_SOFTKEYMASTER = 4,
+};
 
-keymaster_error_t ParseAuthEncryptedBlob(const KeymasterKeyBlob& blob,
-                                         const AuthorizationSet& hidden,
-                                         KeymasterKeyBlob* key_material,
-                                         AuthorizationSet* hw_enforced,
-                                         AuthorizationSet* sw_enforced);
+constexpr size_t kSoftwareKeyBlobFormatCount = 5;
+
+/**
+ * Decides which parser |blob| is meant for from its version byte, magic header and field lengths,
+ * without any cryptography.  The parser may still reject the blob.
+ */
+SoftwareKeyBlobFormat ClassifyKeyBlob(const KeymasterKeyBlob& blob);
+
+/**
+ * Whether blobs of |format| authenticate their key material.  Old softkeymaster blobs are raw key
+ * material behind a header, so nothing vouches for it.
+ */
+inline bool IsAuthenticatedKeyBlobFormat(SoftwareKeyBlobFormat format) {
+    return format == KEY_BLOB_INTEGRITY_ASSURED || format == KEY_BLOB_AUTH_ENCRYPTED_OCB ||
+           format == KEY_BLOB_AUTH_ENCRYPTED_GCM;
+}
+
+/**
+ * Counts the key blobs a context has parsed, by format.  Safe to use from several threads.
+ */
+class KeyBlobFormatCounter {
+  public:
+    void Count(SoftwareKeyBlobFormat format) {
+        if (format < kSoftwareKeyBlobFormatCount) {
+            counts_[format].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    uint64_t count(SoftwareKeyBlobFormat format) const {
+        if (format >= kSoftwareKeyBlobFormatCount) return 0;
+        return counts_[format].load(std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<uint64_t> counts_[kSoftwareKeyBlobFormatCount] = {};
+};
 
 keymaster_error_t SetKeyBlobAuthorizations(const AuthorizationSet& key_description,
                                            keymaster_key_origin_t origin, uint32_t os_version,
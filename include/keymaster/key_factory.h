@@ -17,15 +17,14 @@
 #pragma once
 
 #include <hardware/keymaster_defs.h>
+#include <keymaster/android_keymaster_utils.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/key.h>
 
 namespace keymaster {
 
-class Key;
 class KeymasterContext;
 class OperationFactory;
-template <typename BlobType> struct TKeymasterBlob;
-typedef TKeymasterBlob<keymaster_key_blob_t> KeymasterKeyBlob;
 
 /**
  * KeyFactory is a abstraction that encapsulats the knowledge of how to build and parse a specifiec
@@ -44,6 +43,22 @@ class KeyFactory {
                                           AuthorizationSet* sw_enforced,
                                           CertificateChain* cert_chain) const = 0;
 
+    /**
+     * GenerateKeys generates |count| keys without attestation, as GenerateKey() would, putting each
+     * result at the index of its description.  Factories that can draw the material for a whole
+     * batch at once should override it; the default generates the keys one at a time.
+     */
+    virtual void GenerateKeys(const AuthorizationSet* key_descriptions, size_t count,
+                              KeymasterKeyBlob* key_blobs, AuthorizationSet* hw_enforced,
+                              AuthorizationSet* sw_enforced, keymaster_error_t* errors) const {
+        for (size_t i = 0; i < count; ++i) {
+            CertificateChain cert_chain;
+            errors[i] = GenerateKey(key_descriptions[i], {} /* attestation_signing_key */,
+                                    {} /* issuer_subject */, &key_blobs[i], &hw_enforced[i],
+                                    &sw_enforced[i], &cert_chain);
+        }
+    }
+
     virtual keymaster_error_t ImportKey(const AuthorizationSet& key_description,  //
                                         keymaster_key_format_t input_key_material_format,
                                         const KeymasterKeyBlob& input_key_material,
@@ -60,6 +75,20 @@ class KeyFactory {
                                       AuthorizationSet&& sw_enforced,
                                       UniquePtr<Key>* key) const = 0;
 
+    /**
+     * LoadAuthenticatedKey loads |key_material| as LoadKey() does, for a blob whose authentication
+     * covers the key material.  Such material was checked when the key was generated or imported,
+     * so factories may skip checks LoadKey() has to make.  The default is LoadKey().
+     */
+    virtual keymaster_error_t LoadAuthenticatedKey(KeymasterKeyBlob&& key_material,
+                                                   const AuthorizationSet& additional_params,
+                                                   AuthorizationSet&& hw_enforced,
+                                                   AuthorizationSet&& sw_enforced,
+                                                   UniquePtr<Key>* key) const {
+        return LoadKey(std::move(key_material), additional_params, std::move(hw_enforced),
+                       std::move(sw_enforced), key);
+    }
+
     virtual OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const = 0;
 
     // Informational methods.
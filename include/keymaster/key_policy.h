@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <keymaster/authorization_set.h>
+
+namespace keymaster {
+
+/**
+ * KeyPolicy holds the begin-time enforcement rules of a key, extracted from its authorizations once
+ * so that KeymasterEnforcement::AuthorizeBegin() can check them without walking the authorization
+ * set.
+ *
+ * Only well-formed keys are compiled.  If the authorizations contain anything AuthorizeBegin()
+ * would reject, or a tag that may only appear once appears repeatedly, |compiled| stays false and
+ * enforcement falls back to walking the set, so the error reported is unchanged.
+ */
+struct KeyPolicy {
+    enum Flags : uint32_t {
+        PUBLIC_KEY_ALGORITHM = 1 << 0,
+        ACTIVE_DATETIME = 1 << 1,
+        ORIGINATION_EXPIRE_DATETIME = 1 << 2,
+        USAGE_EXPIRE_DATETIME = 1 << 3,
+        MIN_SECONDS_BETWEEN_OPS = 1 << 4,
+        MAX_USES_PER_BOOT = 1 << 5,
+        TIMED_USER_AUTH = 1 << 6,
+        UNLOCKED_DEVICE_REQUIRED = 1 << 7,
+        CALLER_NONCE = 1 << 8,
+        EARLY_BOOT_ONLY = 1 << 9,
+        MIN_MAC_LENGTH = 1 << 10,
+    };
+
+    bool compiled = false;
+    uint32_t flags = 0;
+    // Size of the AuthProxy compiled from; a mismatch means the policy doesn't describe the set.
+    size_t auth_set_size = 0;
+    // Bit (1 << purpose) is set for each KM_TAG_PURPOSE.
+    uint32_t purposes = 0;
+    // Bit (1 << mode) is set for each KM_TAG_BLOCK_MODE.  KM_MODE_GCM is 32, hence 64 bits.
+    uint64_t block_modes = 0;
+    // Bit padding_bit(padding) is set for each KM_TAG_PADDING, old or new.
+    uint64_t paddings = 0;
+
+    uint64_t active_datetime = 0;
+    uint64_t origination_expire_datetime = 0;
+    uint64_t usage_expire_datetime = 0;
+    uint32_t min_seconds_between_ops = 0;
+    uint32_t max_uses_per_boot = 0;
+    uint32_t min_mac_length = 0;
+
+    // Positions in the AuthProxy the policy was compiled from, for auth token matching.
+    int auth_type_index = -1;
+    int auth_timeout_index = -1;
+
+    bool has(Flags flag) const { return (flags & flag) != 0; }
+    bool has_purpose(keymaster_purpose_t purpose) const {
+        return purpose < 32 && (purposes & (1u << purpose)) != 0;
+    }
+    bool has_block_mode(keymaster_block_mode_t mode) const {
+        return mode < 64 && (block_modes & (uint64_t(1) << mode)) != 0;
+    }
+    bool has_padding(keymaster_padding_t padding) const {
+        int bit = padding_bit(padding);
+        return bit >= 0 && (paddings & (uint64_t(1) << bit)) != 0;
+    }
+
+    // Padding values are below 64 apart from KM_PAD_PKCS7, which is 64 and takes bit 0, unused by
+    // any other mode.  Returns -1 for values without a bit.
+    static int padding_bit(keymaster_padding_t padding) {
+        if (padding == KM_PAD_PKCS7) return 0;
+        return padding > 0 && padding < 64 ? static_cast<int>(padding) : -1;
+    }
+};
+
+/**
+ * Compiles |auth_set| into |policy|.  On return policy->compiled says whether the fast path may be
+ * used.
+ */
+void CompileKeyPolicy(const AuthProxy& auth_set, KeyPolicy* policy);
+
+}  // namespace keymaster
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+typedef uint64_t km_id_t;
+
+/**
+ * What KeyUsageStats knows of one key.  Counts are estimates: each sampled call stands for
+ * sample_interval() calls.
+ */
+struct KeyUsage {
+    km_id_t key_id;
+    // Begins, and all operation calls (begin, update, finish and abort), made with the key.
+    uint64_t begins;
+    uint64_t calls;
+    // Calls that failed.
+    uint64_t errors;
+    // Time spent handling the calls, other than those counted in |overcount|.
+    uint64_t total_ns;
+    // How much |calls| may overstate the key's share, because the key took the slot of a colder
+    // one and inherited its count.  Zero for keys tracked since they were first seen.
+    uint64_t overcount;
+};
+
+/**
+ * KeyUsageStats keeps operation counts and latency per key for the keys that AndroidKeymaster
+ * operations use the most, once set with AndroidKeymaster::set_key_usage_stats(), so that hot
+ * keys and clients hammering one key with begins can be found.
+ *
+ * Memory is bounded: at most |capacity| keys are tracked, and when a call names a key that isn't
+ * one of them, it takes the slot of the least-called key (the Space-Saving algorithm), so that the
+ * heaviest keys are always kept.  Only every |sample_interval|th call is timed and recorded.
+ * Calls may be recorded concurrently from several threads.
+ */
+class KeyUsageStats {
+  public:
+    static constexpr size_t kDefaultCapacity = 64;
+
+    explicit KeyUsageStats(size_t capacity = kDefaultCapacity, uint32_t sample_interval = 1);
+    virtual ~KeyUsageStats() {}
+
+    KeyUsageStats(const KeyUsageStats&) = delete;
+    void operator=(const KeyUsageStats&) = delete;
+
+    // The clock calls are timed with, in nanoseconds from any fixed point.
+    virtual uint64_t now_ns() const;
+
+    // Returns true if the call about to be made should be timed and recorded.
+    bool ShouldSample() {
+        return sample_count_.fetch_add(1, std::memory_order_relaxed) % sample_interval_ == 0;
+    }
+
+    void Record(km_id_t key_id, bool is_begin, keymaster_error_t error, uint64_t duration_ns);
+
+    // Replaces |keys| with up to |max_keys| of the tracked keys, most called first.
+    void GetHotKeys(size_t max_keys, std::vector<KeyUsage>* keys) const;
+
+    // Logs the |max_keys| most called keys at INFO level.
+    void LogSummary(size_t max_keys) const;
+
+    void Reset();
+
+    size_t capacity() const { return capacity_; }
+    uint32_t sample_interval() const { return sample_interval_; }
+
+  private:
+    const size_t capacity_;
+    const uint32_t sample_interval_;
+    std::atomic<uint64_t> sample_count_{0};
+
+    mutable std::mutex mutex_;
+    // Unscaled.  Small enough to search linearly.
+    std::vector<KeyUsage> keys_;
+};
+
+}  // namespace keymaster
@@ -43,7 +43,8 @@ uint32_t GetOsVersion(const char* version_string);
 
 /**
  * Retrieves and parses OS version information from build properties. Returns 0 if the string
- * doesn't contain a numeric version number.
+ * doesn't contain a numeric version number.  The properties are read once per process, together
+ * with the OS patch level.
  */
 uint32_t GetOsVersion();
 
@@ -56,14 +57,15 @@ uint32_t GetOsPatchlevel(const char* patchlevel_string);
 
 /**
  * Retrieves and parses OS patch level from build properties. Returns 0 if the string doesn't
- * contain a date in the form YYYY-MM-DD; returns YYYYMM on success.
+ * contain a date in the form YYYY-MM-DD; returns YYYYMM on success.  The properties are read once
+ * per process, together with the OS version.
  */
 uint32_t GetOsPatchlevel();
 
 /**
  * Retrieves and parses vendor patch level from build properties (which may require SELinux
  * permission). Returns 0 if the string doesn't contain a date in the form YYYY-MM-DD; returns
- * YYYYMMDD on success.
+ * YYYYMMDD on success.  The property is read once per process.
  */
 uint32_t GetVendorPatchlevel();
 
@@ -19,6 +19,7 @@
 
 #include <optional>
 #include <string_view>
+#include <vector>
 
 #include <assert.h>
 
@@ -26,6 +27,8 @@
 
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/key.h>
+#include <keymaster/keymaster_counters.h>
 #include <keymaster/keymaster_enforcement.h>
 #include <keymaster/km_version.h>
 #include <keymaster/remote_provisioning_context.h>
@@ -35,12 +38,14 @@ namespace keymaster {
 
 class AuthorizationSet;
 class AttestationContext;
+class ConfirmationVerifier;
 class KeyFactory;
 class OperationFactory;
+class WorkerPool;
+class OperationMetricsSink;
 class SecureDeletionSecretStorage;
 template <typename BlobType> struct TKeymasterBlob;
 typedef TKeymasterBlob<keymaster_key_blob_t> KeymasterKeyBlob;
-class Key;
 
 /**
  * KeymasterContext provides a singleton abstract interface that encapsulates various
@@ -115,6 +120,22 @@ class KeymasterContext {
                                              const AuthorizationSet& upgrade_params,
                                              KeymasterKeyBlob* upgraded_key) const = 0;
 
+    /**
+     * UpgradeKeyBlobs upgrades |count| blobs with the same |upgrade_params|, putting each result
+     * in |upgraded_keys| and |errors| at the index of its blob.  It is called with the context
+     * lock held, and implementations whose parsing and upgrade paths are safe to run concurrently
+     * may spread the work across up to |thread_count| threads.  The default upgrades the blobs one
+     * at a time with UpgradeKeyBlob().
+     */
+    virtual void UpgradeKeyBlobs(const KeymasterKeyBlob* keys_to_upgrade, size_t count,
+                                 const AuthorizationSet& upgrade_params,
+                                 KeymasterKeyBlob* upgraded_keys, keymaster_error_t* errors,
+                                 size_t /* thread_count */) const {
+        for (size_t i = 0; i < count; ++i) {
+            errors[i] = UpgradeKeyBlob(keys_to_upgrade[i], upgrade_params, &upgraded_keys[i]);
+        }
+    }
+
     /**
      * ParseKeyBlob takes a blob and extracts authorization sets and key material, returning an
      * error if the blob fails integrity checking or decryption.  Note that the returned key
@@ -126,6 +147,50 @@ class KeymasterContext {
                                            const AuthorizationSet& additional_params,
                                            UniquePtr<Key>* key) const = 0;
 
+    /**
+     * ParseKeyCharacteristics verifies a key blob as ParseKeyBlob does, but only extracts its
+     * authorization sets, so that contexts able to check a blob without decrypting its key
+     * material or instantiating the key can avoid doing so.  The default implementation parses
+     * the whole key.
+     */
+    virtual keymaster_error_t ParseKeyCharacteristics(const KeymasterKeyBlob& blob,
+                                                      const AuthorizationSet& additional_params,
+                                                      AuthorizationSet* hw_enforced,
+                                                      AuthorizationSet* sw_enforced) const {
+        UniquePtr<Key> key;
+        keymaster_error_t error = ParseKeyBlob(blob, additional_params, &key);
+        if (error != KM_ERROR_OK) return error;
+        *hw_enforced = std::move(key->hw_enforced());
+        *sw_enforced = std::move(key->sw_enforced());
+        return KM_ERROR_OK;
+    }
+
+    /**
+     * Returns true if ParseKeyCharacteristics() is much cheaper than ParseKeyBlob() and leaves the
+     * blob ready for a following ParseKeyBlob() to use.  AndroidKeymaster then checks begin
+     * requests against the key's characteristics before loading the key, so that requests bound
+     * to be refused don't pay for instantiating it.
+     */
+    virtual bool has_cheap_key_characteristics() const { return false; }
+
+    /**
+     * ParseKeysCharacteristics runs ParseKeyCharacteristics() on |count| blobs, each with its own
+     * |additional_params|, putting each result in |hw_enforced|, |sw_enforced| and |errors| at
+     * the index of its blob.  As with UpgradeKeyBlobs(), it is called with the context lock held
+     * and implementations may spread the work across up to |thread_count| threads.  The default
+     * parses the blobs one at a time.
+     */
+    virtual void ParseKeysCharacteristics(const KeymasterKeyBlob* blobs,
+                                          const AuthorizationSet* additional_params, size_t count,
+                                          AuthorizationSet* hw_enforced,
+                                          AuthorizationSet* sw_enforced, keymaster_error_t* errors,
+                                          size_t /* thread_count */) const {
+        for (size_t i = 0; i < count; ++i) {
+            errors[i] = ParseKeyCharacteristics(blobs[i], additional_params[i], &hw_enforced[i],
+                                                &sw_enforced[i]);
+        }
+    }
+
     /**
      * Take whatever environment-specific action is appropriate (if any) to delete the specified
      * key.
@@ -134,6 +199,19 @@ class KeymasterContext {
         return KM_ERROR_OK;
     }
 
+    /**
+     * DeleteKeys deletes |count| keys as DeleteKey() would, putting each result in |errors| at the
+     * index of its blob.  Contexts backed by secure storage should gather the key IDs and secure
+     * deletion slots of all the blobs and remove them in a single storage transaction.  The
+     * default deletes the keys one at a time with DeleteKey().
+     */
+    virtual void DeleteKeys(const KeymasterKeyBlob* blobs, size_t count,
+                            keymaster_error_t* errors) const {
+        for (size_t i = 0; i < count; ++i) {
+            errors[i] = DeleteKey(blobs[i]);
+        }
+    }
+
     /**
      * Take whatever environment-specific action is appropriate to delete all keys.
      */
@@ -158,6 +236,61 @@ class KeymasterContext {
      */
     virtual AttestationContext* attestation_context() { return nullptr; }
 
+    /**
+     * Return the sink that AndroidKeymaster reports the duration of each operation phase to, or
+     * null, the default, to skip timing altogether.
+     */
+    virtual OperationMetricsSink* operation_metrics() { return nullptr; }
+
+    /**
+     * Return the pool that parallel and asynchronous work, such as UpgradeKeyBlobs() spread over
+     * several threads or ConcurrentAndroidKeymaster's asynchronous calls, is scheduled on.  Null,
+     * the default, does all work on the calling thread, which suits environments without threads;
+     * those with a scheduler of their own can return a WorkerPool that uses it.
+     */
+    virtual WorkerPool* worker_pool() const { return nullptr; }
+
+    /**
+     * Sets \p hits and \p misses to the lookups \p cache has served and failed to serve, for
+     * GetDebugCountersRequest.  Returns false, the default, if the context has no such cache.
+     */
+    virtual bool GetCacheCounters(KeymasterCache /* cache */, uint64_t* /* hits */,
+                                  uint64_t* /* misses */) const {
+        return false;
+    }
+
+    /**
+     * Return the most input one UpdateOperation message can carry on the way to this context,
+     * which bounds the chunk sizes BeginOperation advertises.  The default is the most keystore
+     * passes in one update; contexts behind a smaller TA message buffer should return its size.
+     */
+    virtual size_t max_update_chunk_size() const { return 32 * 1024; }
+
+    /**
+     * Encrypts and authenticates \p plaintext, the operation state AndroidKeymaster hands from one
+     * process to the next, with a key that only this context and its successors can use: one
+     * derived from the device's key-derivation secret, never a constant.  Returns
+     * KM_ERROR_UNIMPLEMENTED, the default, if the context can't protect handoff state, in which
+     * case operations can't be handed off.  Contexts without such a secret, or without the
+     * storage OpenHandoffState() needs, must not implement this.
+     */
+    virtual keymaster_error_t SealHandoffState(const KeymasterKeyBlob& /* plaintext */,
+                                               std::vector<uint8_t>* /* sealed */) const {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    /**
+     * Reverses SealHandoffState().  Fails with KM_ERROR_INVALID_ARGUMENT if \p sealed was altered
+     * or wasn't sealed by a compatible context.  Each sealed state must open only once, and fail
+     * the same way after that, even in a later process: restoring operations twice would reuse
+     * their keystreams.  The record of it, a monotonic counter or the consumed nonces for
+     * instance, must be kept in secure storage that survives a restart; memory doesn't.
+     */
+    virtual keymaster_error_t OpenHandoffState(const uint8_t* /* sealed */, size_t /* size */,
+                                               KeymasterKeyBlob* /* plaintext */) const {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
     /**
      * Generate an attestation certificate, with chain.
      *
@@ -227,6 +360,20 @@ class KeymasterContext {
         return KM_ERROR_UNIMPLEMENTED;
     }
 
+    /**
+     * Creates a verifier for the input of an operation bound to
+     * TAG_TRUSTED_CONFIRMATION_REQUIRED.  Contexts holding the key shared with the ConfirmationUI
+     * TA should implement this, typically with ConfirmationHmacKey, so the message is hashed as
+     * it arrives rather than buffered for CheckConfirmationToken().
+     *
+     * If not implemented then KM_ERROR_UNIMPLEMENTED is returned and the input is buffered and
+     * checked with CheckConfirmationToken() instead.
+     */
+    virtual keymaster_error_t
+    CreateConfirmationVerifier(UniquePtr<ConfirmationVerifier>* /* verifier */) const {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
     /**
      * Return the remote provisioning context object, or null if remote provisioning is not
      * supported.
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include <hardware/keymaster_defs.h>
+#include <keymaster/operation_metrics.h>
+
+namespace keymaster {
+
+/**
+ * The caches whose hit rates are reported alongside KeymasterCounters, through
+ * KeymasterContext::GetCacheCounters().
+ */
+enum class KeymasterCache : uint8_t {
+    PARSED_KEY = 0,  // ParsedKeyCache.
+};
+
+constexpr size_t kKeymasterCacheCount = 1;
+
+/**
+ * KeymasterCounters is the block of aggregate counters AndroidKeymaster always keeps: calls,
+ * errors and cumulative nanoseconds for each command and each operation phase.  Counting a call
+ * costs two reads of a monotonic clock and a few relaxed atomic adds, so unlike a RequestRecorder
+ * or OperationMetricsSink nothing has to be attached, and production HALs can be polled with
+ * GetDebugCountersRequest.  Calls may be counted concurrently from several threads; a snapshot
+ * taken meanwhile may be slightly out of step between counters.
+ */
+class KeymasterCounters {
+  public:
+    // Commands are counted by their AndroidKeymasterCommand value; any at or above this share the
+    // last slot.
+    static constexpr size_t kCommandCount = 64;
+
+    struct Totals {
+        uint64_t calls = 0;
+        uint64_t errors = 0;
+        uint64_t total_ns = 0;
+    };
+
+    KeymasterCounters() {}
+    KeymasterCounters(const KeymasterCounters&) = delete;
+    void operator=(const KeymasterCounters&) = delete;
+
+    // The clock calls and phases are timed with, in nanoseconds from any fixed point.
+    static uint64_t now_ns();
+
+    void RecordCommand(uint32_t command, keymaster_error_t error, uint64_t duration_ns) {
+        commands_[command < kCommandCount ? command : kCommandCount - 1].Record(error,
+                                                                                duration_ns);
+    }
+    void RecordPhase(OperationPhase phase, keymaster_error_t error, uint64_t duration_ns) {
+        size_t index = static_cast<size_t>(phase);
+        if (index < kOperationPhaseCount) phases_[index].Record(error, duration_ns);
+    }
+
+    Totals command(uint32_t command) const;
+    Totals phase(OperationPhase phase) const;
+
+    void Reset();
+
+  private:
+    struct Counter {
+        void Record(keymaster_error_t error, uint64_t duration_ns) {
+            calls.fetch_add(1, std::memory_order_relaxed);
+            if (error != KM_ERROR_OK) errors.fetch_add(1, std::memory_order_relaxed);
+            total_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+        }
+        Totals Read() const;
+        void Reset();
+
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> total_ns{0};
+    };
+
+    Counter commands_[kCommandCount];
+    Counter phases_[kOperationPhaseCount];
+};
+
+}  // namespace keymaster
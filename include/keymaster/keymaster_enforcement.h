@@ -18,17 +18,22 @@
 #define ANDROID_LIBRARY_KEYMASTER_ENFORCEMENT_H
 
 #include <array>
+#include <atomic>
 
 #include <stdio.h>
 
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/key_policy.h>
 #include <keymaster/keymaster_utils.h>
 
 namespace keymaster {
 
 typedef uint64_t km_id_t;
 
+// Timestamp token MACs are HMAC-SHA256.
+constexpr size_t kTimestampTokenMacSize = 32;
+
 class KeymasterEnforcementContext {
   public:
     virtual ~KeymasterEnforcementContext() {}
@@ -54,12 +59,26 @@ class KeymasterEnforcement {
      * Iterates through the authorization set and returns the corresponding keymaster error. Will
      * return KM_ERROR_OK if all criteria is met for the given purpose in the authorization set with
      * the given operation params and handle. Used for encrypt, decrypt sign, and verify.
+     *
+     * If |policy| is provided it must have been compiled from |auth_set|; begin-time checks then
+     * use it instead of walking the authorization set.
      */
     keymaster_error_t AuthorizeOperation(const keymaster_purpose_t purpose, const km_id_t keyid,
                                          const AuthProxy& auth_set,
                                          const AuthorizationSet& operation_params,
                                          keymaster_operation_handle_t op_handle,
-                                         bool is_begin_operation);
+                                         bool is_begin_operation,
+                                         const KeyPolicy* policy = nullptr);
+
+    /**
+     * Runs the begin-time checks that need only the key's authorizations and can't be passed
+     * later: the purpose, the validity dates and, for keys needing a timed auth token, that one
+     * was provided.  Records no access, so AuthorizeOperation() must still be called; this just
+     * lets a begin that is bound to fail be refused before the key is loaded.
+     */
+    keymaster_error_t PreAuthorizeBegin(const keymaster_purpose_t purpose,
+                                        const AuthProxy& auth_set,
+                                        const AuthorizationSet& operation_params) const;
 
     /**
      * Iterates through the authorization set and returns the corresponding keymaster error. Will
@@ -70,6 +89,14 @@ class KeymasterEnforcement {
                                      const AuthProxy& auth_set,
                                      const AuthorizationSet& operation_params);
 
+    /**
+     * As above, but checks the rules in |policy|, which must have been compiled from |auth_set|.
+     * Falls back to walking |auth_set| if the policy isn't compiled.
+     */
+    keymaster_error_t AuthorizeBegin(const keymaster_purpose_t purpose, const km_id_t keyid,
+                                     const KeyPolicy& policy, const AuthProxy& auth_set,
+                                     const AuthorizationSet& operation_params);
+
     /**
      * Iterates through the authorization set and returns the corresponding keymaster error. Will
      * return KM_ERROR_OK if all criteria is met for the given purpose in the authorization set with
@@ -138,7 +165,7 @@ class KeymasterEnforcement {
     /*
      * Get whether or not we're in early boot.  See early_boot_ended() below.
      */
-    bool in_early_boot() const { return in_early_boot_; }
+    bool in_early_boot() const { return in_early_boot_.load(std::memory_order_acquire); }
 
     /*
      * Get current time in seconds from some starting point.  This value is used to compute relative
@@ -183,6 +210,14 @@ class KeymasterEnforcement {
      */
     virtual keymaster_error_t GenerateTimestampToken(TimestampToken* token);
 
+    /**
+     * Generate a TimestampToken for |challenge| straight into |timestamp| and |mac|, which receives
+     * kTimestampTokenMacSize bytes.  The security level is SecurityLevel().  Implementations can
+     * override this to avoid allocating; by default it calls the method above.
+     */
+    virtual keymaster_error_t GenerateTimestampToken(uint64_t challenge, uint64_t* timestamp,
+                                                     uint8_t* mac);
+
     /**
      * Compute an HMAC using the auth token HMAC key.
      *
@@ -205,28 +240,42 @@ class KeymasterEnforcement {
     /*
      * Inform the KeymasterEnforcement object that early boot stage has ended.
      */
-    void early_boot_ended() { in_early_boot_ = false; }
+    void early_boot_ended() { in_early_boot_.store(false, std::memory_order_release); }
 
     /*
      * Inform the KeymasterEnforcement object that the device is locked, so it knows not to permit
      * UNLOCKED_DEVICE_REQUIRED keys to be used until a fresh (later than "now") auth token is
      * provided.  If password_only is true, the fresh auth token must additionally be a password
      * auth token.
+     *
+     * This and early_boot_ended() may be called without the lock that serializes
+     * AuthorizeOperation(): the state they set is atomic, so a begin() never waits on them.
      */
     void device_locked(bool password_only) {
-        device_locked_at_ = get_current_time_ms();
-        password_unlock_only_ = password_only;
+        device_lock_state_.store(get_current_time_ms() << 1 | (password_only ? 1 : 0),
+                                 std::memory_order_release);
     }
 
+  protected:
+    /*
+     * Drops every remembered token signature verification.  Must be called whenever the key used
+     * by ValidateTokenSignature() changes.
+     */
+    void ForgetValidatedAuthTokens() const { validated_auth_tokens_ = {}; }
+
   private:
     keymaster_error_t AuthorizeUpdateOrFinish(const AuthProxy& auth_set,
                                               const AuthorizationSet& operation_params,
                                               keymaster_operation_handle_t op_handle);
 
+    keymaster_error_t RecordKeyAccess(const km_id_t keyid, uint32_t min_ops_timeout,
+                                      bool update_access_count);
+    bool DeviceUnlockedFor(const AuthorizationSet& operation_params) const;
     bool MinTimeBetweenOpsPassed(uint32_t min_time_between, const km_id_t keyid);
     bool MaxUsesPerBootNotExceeded(const km_id_t keyid, uint32_t max_uses);
     bool GetAndValidateAuthToken(const AuthorizationSet& operation_params,
                                  const hw_auth_token_t** token, uint32_t* token_auth_type) const;
+    bool TokenSignatureValid(const hw_auth_token_t& token) const;
     bool AuthTokenMatches(const AuthProxy& auth_set, const AuthorizationSet& operation_params,
                           const uint64_t user_secure_id, const int auth_type_index,
                           const int auth_timeout_index,
@@ -235,9 +284,21 @@ class KeymasterEnforcement {
 
     AccessTimeMap* access_time_map_;
     AccessCountMap* access_count_map_;
-    bool in_early_boot_ = true;
-    uint64_t device_locked_at_ = 0;
-    bool password_unlock_only_ = false;
+    std::atomic<bool> in_early_boot_{true};
+    // The time device_locked() was last called, shifted left by one, with its password_only flag
+    // in the low bit, so that the two are always read together.  Zero if it never was.
+    std::atomic<uint64_t> device_lock_state_{0};
+
+    // Recently verified tokens, so that a token presented again (by every update() of a per-op
+    // key, or by every begin() within an auth timeout) isn't re-MACed.  Only touched by
+    // AuthorizeOperation(), which runs under the context lock.
+    struct ValidatedAuthToken {
+        bool valid = false;
+        hw_auth_token_t token = {};
+    };
+    static constexpr size_t kValidatedAuthTokenCacheSize = 8;
+    mutable std::array<ValidatedAuthToken, kValidatedAuthTokenCacheSize> validated_auth_tokens_;
+    mutable size_t next_validated_auth_token_ = 0;
 };
 
 }; /* namespace keymaster */
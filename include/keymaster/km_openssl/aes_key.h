@@ -16,9 +16,12 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <utility>
 
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 
 #include "symmetric_key.h"
 
@@ -27,6 +30,30 @@ namespace keymaster {
 const size_t kMinGcmTagLength = 12 * 8;
 const size_t kMaxGcmTagLength = 16 * 8;
 
+/**
+ * An AES-GCM EVP_CIPHER_CTX that has been given a key but no nonce.  Setting the key expands the
+ * AES round keys and precomputes the GHASH tables, so GCM operations copy this context and only
+ * set their nonce, instead of repeating that setup for every operation.  The context is never
+ * used for data, so concurrent copies are safe.
+ */
+class KeyedGcmContext {
+  public:
+    KeyedGcmContext() { EVP_CIPHER_CTX_init(&ctx_); }
+    ~KeyedGcmContext() { EVP_CIPHER_CTX_cleanup(&ctx_); }
+    KeyedGcmContext(const KeyedGcmContext&) = delete;
+    void operator=(const KeyedGcmContext&) = delete;
+
+    bool Init(const KeymasterKeyBlob& key_material, const EVP_CIPHER* cipher);
+
+    const EVP_CIPHER* cipher() const { return cipher_; }
+    // Replaces the contents of \p ctx, which must have been initialized, with a copy.
+    bool CopyTo(EVP_CIPHER_CTX* ctx) const { return EVP_CIPHER_CTX_copy(ctx, &ctx_); }
+
+  private:
+    EVP_CIPHER_CTX ctx_;
+    const EVP_CIPHER* cipher_ = nullptr;
+};
+
 class AesKeyFactory : public SymmetricKeyFactory {
   public:
     explicit AesKeyFactory(const SoftwareKeyBlobMaker& blob_maker,
@@ -43,6 +70,25 @@ class AesKeyFactory : public SymmetricKeyFactory {
     OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
 
   private:
+    /**
+     * The keyed GCM contexts of recently loaded GCM keys, so that loading the same key again, e.g.
+     * for every operation on it, doesn't redo the key setup.  Keys are loaded concurrently, e.g.
+     * by UpgradeKeyBlobs(), so the cache has its own mutex.
+     */
+    struct CachedGcmKey {
+        KeymasterKeyBlob key_material;
+        std::shared_ptr<const KeyedGcmContext> context;
+        uint64_t last_used = 0;
+    };
+    static constexpr size_t kGcmKeyCacheSize = 8;
+
+    std::shared_ptr<const KeyedGcmContext>
+    GetKeyedGcmContext(const KeymasterKeyBlob& key_material) const;
+
+    mutable std::mutex gcm_key_cache_mutex_;
+    mutable CachedGcmKey gcm_key_cache_[kGcmKeyCacheSize];
+    mutable uint64_t gcm_key_cache_clock_ = 0;
+
     bool key_size_supported(size_t key_size_bits) const override {
         return key_size_bits == 128 || key_size_bits == 192 || key_size_bits == 256;
     }
@@ -56,6 +102,17 @@ class AesKey : public SymmetricKey {
            AuthorizationSet&& sw_enforced, const KeyFactory* key_factory)
         : SymmetricKey(std::move(key_material), std::move(hw_enforced), std::move(sw_enforced),
                        key_factory) {}
+
+    // The keyed GCM context for this key, or null if it isn't a GCM key or none could be built.
+    const std::shared_ptr<const KeyedGcmContext>& keyed_gcm_context() const {
+        return keyed_gcm_context_;
+    }
+    void set_keyed_gcm_context(std::shared_ptr<const KeyedGcmContext> context) {
+        keyed_gcm_context_ = std::move(context);
+    }
+
+  private:
+    std::shared_ptr<const KeyedGcmContext> keyed_gcm_context_;
 };
 
 }  // namespace keymaster
@@ -18,20 +18,23 @@
 
 #include <hardware/keymaster_defs.h>
 
+#include <keymaster/attestation_context.h>
 #include <keymaster/authorization_set.h>
 #include <keymaster/km_version.h>
 
 #include <cppbor.h>
 #include <openssl/asn1t.h>
+#include <openssl/hmac.h>
 
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <vector>
 
 #define remove_type_mask(tag) ((tag)&0x0FFFFFFF)
 
 namespace keymaster {
 
-class AttestationContext;
-
 constexpr KmVersion kCurrentKmVersion = KmVersion::KEYMASTER_4_1;
 
 // Size (in bytes) of generated UNIQUE_ID values.
@@ -359,6 +362,73 @@ keymaster_error_t generate_unique_id(const std::vector<uint8_t>& hbk, uint64_t c
                                      const keymaster_blob_t& application_id,
                                      bool reset_since_rotation, Buffer* unique_id);
 
+/**
+ * UniqueIdGenerator produces the same IDs as generate_unique_id() for a fixed HBK.  The HMAC key is
+ * set up once, and the IDs for the last few (rotation period, application ID, reset) inputs are
+ * remembered, so repeated attestations for the same application don't recompute them.  Safe to
+ * call from multiple threads.
+ */
+class UniqueIdGenerator {
+  public:
+    explicit UniqueIdGenerator(const std::vector<uint8_t>& hbk);
+
+    keymaster_error_t Generate(uint64_t creation_date_time, const keymaster_blob_t& application_id,
+                               bool reset_since_rotation, Buffer* unique_id);
+
+  private:
+    static constexpr size_t kCacheEntries = 8;
+
+    struct Entry {
+        uint64_t rounded_date = 0;
+        bool reset_since_rotation = false;
+        std::vector<uint8_t> application_id;
+        uint8_t unique_id[UNIQUE_ID_SIZE];
+        uint64_t last_used = 0;  // Zero for an empty entry.
+    };
+
+    // Looks up or computes the ID into |unique_id|.  Requires |mutex_|.
+    keymaster_error_t Lookup(uint64_t rounded_date, const keymaster_blob_t& application_id,
+                             bool reset_since_rotation, uint8_t* unique_id);
+
+    std::mutex mutex_;
+    bssl::ScopedHMAC_CTX hmac_;
+    bool keyed_ = false;
+    Entry entries_[kCacheEntries];
+    uint64_t use_counter_ = 0;
+};
+
+// Encodes the root of trust for |vb_params|.  The CBOR encoding is left empty if
+// |boot_patchlevel| is not known.
+keymaster_error_t encode_root_of_trust(const AttestationContext::VerifiedBootParams& vb_params,
+                                       std::optional<uint32_t> boot_patchlevel,
+                                       AttestationContext::RootOfTrustEncodings* encodings);
+
+// Encodes the tagged CBOR RootOfTrust that GetRootOfTrust MACs.
+std::vector<uint8_t>
+encode_root_of_trust_cbor(const AttestationContext::VerifiedBootParams& vb_params,
+                          uint32_t boot_patchlevel);
+
+/**
+ * RootOfTrustCache keeps a context's root of trust encodings.  The context calls Invalidate()
+ * whenever its verified boot info or boot patchlevel is configured, and Get() re-encodes at most
+ * once per such change.  Safe to call from multiple threads.
+ */
+class RootOfTrustCache {
+  public:
+    void Invalidate();
+
+    // Returns the encodings of |vb_params| and |boot_patchlevel|, which must be the values the
+    // context currently holds, or null if they could not be encoded.
+    std::shared_ptr<const AttestationContext::RootOfTrustEncodings>
+    Get(const AttestationContext::VerifiedBootParams& vb_params,
+        std::optional<uint32_t> boot_patchlevel);
+
+  private:
+    std::mutex mutex_;
+    uint64_t generation_ = 0;
+    std::shared_ptr<const AttestationContext::RootOfTrustEncodings> encodings_;
+};
+
 /**
  * Helper functions for attestation record tests. Caller takes ownership of
  * |attestation_challenge->data| and |unique_id->data|, deallocate using delete[].
@@ -401,6 +471,15 @@ keymaster_error_t parse_eat_submod(const cppbor::Map* submod_values,
 
 keymaster_error_t extract_auth_list(const KM_AUTH_LIST* record, AuthorizationSet* auth_list);
 
+/**
+ * Decodes the DER-encoded KM_AUTH_LIST in |der| into |auth_list|, with the same result as decoding
+ * it with d2i_KM_AUTH_LIST() and passing it to the overload above, but without creating any ASN.1
+ * objects.  Integers that don't fit their tag's type are rejected rather than truncated.
+ * |auth_list| is grown once, to its final size, before anything is added.
+ */
+keymaster_error_t extract_auth_list(const uint8_t* der, size_t der_len,
+                                    AuthorizationSet* auth_list);
+
 /**
  * Convert a KeymasterContext::Version to the keymaster version number used in attestations.
  */
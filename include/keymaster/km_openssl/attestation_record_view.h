@@ -0,0 +1,121 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/authorization_set.h>
+#include <keymaster/worker_pool.h>
+
+namespace keymaster {
+
+/**
+ * AttestationRecordView reads a DER-encoded KeyDescription, the contents of the attestation
+ * extension, without decoding it into ASN.1 objects.  Init() checks the structure and records
+ * where each top-level field and each authorization list entry lies; accessors decode only the
+ * field asked for.  Blobs returned point into the record, which must outlive the view.
+ *
+ * This suits verifiers that check a few fields of many records.  parse_attestation_record() is
+ * still the way to get complete AuthorizationSets; GetAuthorizations() is equivalent to it.
+ */
+class AttestationRecordView {
+  public:
+    enum AuthList {
+        SOFTWARE_ENFORCED = 0,
+        TEE_ENFORCED = 1,
+    };
+
+    // Authorization list entries beyond this are rejected; the schema defines fewer than 50.
+    static constexpr size_t kMaxAuthListEntries = 64;
+
+    AttestationRecordView() {}
+
+    keymaster_error_t Init(const uint8_t* asn1_key_desc, size_t asn1_key_desc_len);
+
+    uint32_t attestation_version() const { return attestation_version_; }
+    keymaster_security_level_t attestation_security_level() const {
+        return attestation_security_level_;
+    }
+    uint32_t keymaster_version() const { return keymaster_version_; }
+    keymaster_security_level_t keymaster_security_level() const {
+        return keymaster_security_level_;
+    }
+    const keymaster_blob_t& attestation_challenge() const { return attestation_challenge_; }
+    const keymaster_blob_t& unique_id() const { return unique_id_; }
+
+    // Finds the root of trust in whichever list holds it.  |verified_boot_hash| may be null.
+    keymaster_error_t GetRootOfTrust(keymaster_blob_t* verified_boot_key,
+                                     keymaster_verified_boot_t* verified_boot_state,
+                                     bool* device_locked,
+                                     keymaster_blob_t* verified_boot_hash = nullptr) const;
+
+    bool Contains(AuthList list, keymaster_tag_t tag) const {
+        return FindEntry(list, tag) != nullptr;
+    }
+
+    // For repeatable enum and integer tags, returns true if |value| is one of the values.
+    bool Contains(AuthList list, keymaster_tag_t tag, uint64_t value) const;
+
+    // For non-repeatable integer, enum and date tags.
+    bool GetTagValue(AuthList list, keymaster_tag_t tag, uint64_t* value) const;
+
+    // For byte string tags.  The blob points into the record.
+    bool GetTagValue(AuthList list, keymaster_tag_t tag, keymaster_blob_t* value) const;
+
+    // Fully decodes both authorization lists, as parse_attestation_record() does.
+    keymaster_error_t GetAuthorizations(AuthorizationSet* software_enforced,
+                                        AuthorizationSet* tee_enforced) const;
+
+  private:
+    struct Entry {
+        uint32_t tag_number;
+        // The DER element inside the explicit tag.
+        keymaster_blob_t value;
+    };
+
+    struct IndexedList {
+        // The whole SEQUENCE, including its header.
+        keymaster_blob_t der;
+        Entry entries[kMaxAuthListEntries];
+        size_t entry_count;
+    };
+
+    keymaster_error_t IndexAuthList(const uint8_t* der, size_t der_len, IndexedList* list);
+    const Entry* FindEntry(AuthList list, keymaster_tag_t tag) const;
+
+    uint32_t attestation_version_ = 0;
+    keymaster_security_level_t attestation_security_level_ = KM_SECURITY_LEVEL_SOFTWARE;
+    uint32_t keymaster_version_ = 0;
+    keymaster_security_level_t keymaster_security_level_ = KM_SECURITY_LEVEL_SOFTWARE;
+    keymaster_blob_t attestation_challenge_ = {};
+    keymaster_blob_t unique_id_ = {};
+    IndexedList lists_[2] = {};
+};
+
+/**
+ * Indexes |count| records into |views|, storing each record's result in |errors|, with up to
+ * |thread_count| threads taken from |pool|.  Views are independent once initialized, so callers can
+ * then check them from any thread.
+ */
+void ParseAttestationRecords(const keymaster_blob_t* records, size_t count,
+                             AttestationRecordView* views, keymaster_error_t* errors,
+                             size_t thread_count, WorkerPool* pool = DefaultWorkerPool());
+
+}  // namespace keymaster
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <atomic>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/worker_pool.h>
+
+namespace keymaster {
+
+/**
+ * Runs the body of an Operation::VerifyBatch() on the calling thread and |pool|.  Each thread
+ * that takes part calls |new_verifier|(keymaster_error_t*) once, to set up whatever state it
+ * can't share with the others, such as an EVP_PKEY_CTX, and gets back a callable that verifies
+ * item i and returns KM_ERROR_OK, KM_ERROR_VERIFICATION_FAILED or an error that ends the batch.
+ *
+ * Threads claim eight items at a time, so each byte of |verified| is written by one thread.
+ */
+template <typename NewVerifier>
+keymaster_error_t VerifyInParallel(WorkerPool* pool, size_t count, uint8_t* verified,
+                                   const NewVerifier& new_verifier) {
+    const size_t byte_count = (count + 7) / 8;
+    std::atomic<size_t> next_byte{0};
+    std::atomic<bool> failed{false};
+    std::atomic<keymaster_error_t> error{KM_ERROR_OK};
+    auto fail = [&](keymaster_error_t e) {
+        keymaster_error_t expected = KM_ERROR_OK;
+        error.compare_exchange_strong(expected, e);
+        failed = true;
+    };
+
+    RunInParallel(pool, byte_count, [&] {
+        keymaster_error_t setup_error = KM_ERROR_OK;
+        auto verify = new_verifier(&setup_error);
+        if (setup_error != KM_ERROR_OK) return fail(setup_error);
+
+        for (size_t b; !failed && (b = next_byte.fetch_add(1)) < byte_count;) {
+            uint8_t bits = 0;
+            const size_t end = count < b * 8 + 8 ? count : b * 8 + 8;
+            for (size_t i = b * 8; i < end; ++i) {
+                keymaster_error_t result = verify(i);
+                if (result == KM_ERROR_OK) {
+                    bits |= 1 << (i % 8);
+                } else if (result != KM_ERROR_VERIFICATION_FAILED) {
+                    return fail(result);
+                }
+            }
+            verified[b] = bits;
+        }
+    });
+    return error;
+}
+
+}  // namespace keymaster
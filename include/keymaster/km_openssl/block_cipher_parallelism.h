@@ -0,0 +1,49 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+namespace keymaster {
+
+class WorkerPool;
+
+/**
+ * Controls how CTR and unpadded ECB operations split very large updates across threads.  Those
+ * modes encrypt each block independently, so an update of at least two chunks is cut into chunks
+ * that run concurrently, each on its own copy of the operation's cipher context with the counter
+ * advanced to the chunk's offset.  The output is byte-for-byte the same as a serial update.
+ */
+struct BlockCipherParallelism {
+    // Each thread gets at least this many bytes, rounded down to whole blocks.  Updates shorter
+    // than two chunks run serially.  Zero disables parallel updates.  Until the first call to
+    // SetBlockCipherParallelism() the value in use is CryptoDispatch's, which is smaller when AES
+    // runs in software.
+    size_t min_chunk_bytes = 4 * 1024 * 1024;
+    // The most threads, including the calling thread, one update may use.
+    size_t max_threads = 4;
+    // Where the chunks beyond the calling thread's run.  Null uses DefaultWorkerPool().
+    WorkerPool* pool = nullptr;
+};
+
+/**
+ * Sets the parallelism of updates that start after the call.  Safe to call at any time.
+ */
+void SetBlockCipherParallelism(const BlockCipherParallelism& parallelism);
+BlockCipherParallelism GetBlockCipherParallelism();
+
+}  // namespace keymaster
@@ -34,16 +34,24 @@ keymaster_error_t make_name_from_der(const keymaster_blob_t& name, X509_NAME_Ptr
 
 keymaster_error_t get_common_name(X509_NAME* name, UniquePtr<const char[]>* name_out);
 
+// Points |subject_der| at the DER-encoded subject name within |cert_der|, by walking the
+// certificate's outer structure rather than parsing all of it.  The result borrows |cert_der|'s
+// storage.  Only the structure up to the subject is checked.
+keymaster_error_t get_subject_der(const keymaster_blob_t& cert_der, keymaster_blob_t* subject_der);
+
 // CertificateParams encapsulates a set of certificate parameters that may be provided by the
 // caller, or may be defaulted.
 struct CertificateCallerParams {
     BIGNUM_Ptr serial;
-    X509_NAME_Ptr subject_name;
-    int64_t active_date_time;  // Time since epoch in ms
-    int64_t expire_date_time;  // Time since epoch in ms
+    X509_NAME_Ptr subject_name;  // Null for the default subject, which is built once and shared.
+    int64_t active_date_time;    // Time since epoch in ms
+    int64_t expire_date_time;    // Time since epoch in ms
     bool is_signing_key = false;
     bool is_encryption_key = false;
     bool is_agreement_key = false;
+
+    // subject_name, or the default subject if it's null.
+    const X509_NAME* subject() const;
 };
 
 keymaster_error_t get_certificate_params(const AuthorizationSet& caller_params,
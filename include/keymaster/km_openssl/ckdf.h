@@ -17,10 +17,35 @@
 #ifndef SYSTEM_KEYMASTER_CKDF_H_
 #define SYSTEM_KEYMASTER_CKDF_H_
 
+#include <openssl/cmac.h>
+
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/km_openssl/openssl_utils.h>
 
 namespace keymaster {
 
+DEFINE_OPENSSL_OBJECT_POINTER(CMAC_CTX)
+
+/**
+ * CKDF with the key set up once.  Init() keys a CMAC context, and each Derive() starts from a copy
+ * of it, so deriving several values from one key, under different labels or contexts, does the
+ * AES key schedule and CMAC subkey generation only once.  Derive() doesn't change the object, so
+ * it may be called from several threads at once.
+ */
+class Ckdf {
+  public:
+    keymaster_error_t Init(const KeymasterKeyBlob& key);
+
+    // Same as ckdf() with the key passed to Init().
+    keymaster_error_t Derive(const KeymasterBlob& label, const keymaster_blob_t* context_chunks,
+                             size_t num_chunks, KeymasterKeyBlob* output) const;
+
+    bool initialized() const { return keyed_ctx_.get() != nullptr; }
+
+  private:
+    CMAC_CTX_Ptr keyed_ctx_;
+};
+
 /**
  * Implementation of CKDF, aka AES-CMAC KDF, from NIST SP 800-108.  Uses 32-bit i and L, and
  * prefixes with i.  This version takes the context in an array of keymaster_blob_ts.
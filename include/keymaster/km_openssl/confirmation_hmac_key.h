@@ -0,0 +1,53 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#pragma once
+
+#include <openssl/hmac.h>
+
+#include <keymaster/UniquePtr.h>
+#include <keymaster/confirmation_verifier.h>
+
+namespace keymaster {
+
+/**
+ * The key shared with the ConfirmationUI TA, held as the HMAC-SHA256 state after absorbing the
+ * padded key and kConfirmationTokenMessageTag.  Each verifier starts from a copy of that state and
+ * hashes the operation's input as it is appended, so verifying neither re-derives the key pads nor
+ * buffers the message.  The keyed state is never updated after Init(), so CreateVerifier() may be
+ * called concurrently.
+ */
+class ConfirmationHmacKey {
+  public:
+    ConfirmationHmacKey();
+    ~ConfirmationHmacKey();
+
+    ConfirmationHmacKey(const ConfirmationHmacKey&) = delete;
+    void operator=(const ConfirmationHmacKey&) = delete;
+
+    keymaster_error_t Init(const uint8_t* key, size_t key_length);
+
+    // Creates a verifier for one operation.  Returns KM_ERROR_UNKNOWN_ERROR if Init() hasn't
+    // succeeded.
+    keymaster_error_t CreateVerifier(UniquePtr<ConfirmationVerifier>* verifier) const;
+
+  private:
+    HMAC_CTX ctx_;
+    bool initialized_ = false;
+};
+
+}  // namespace keymaster
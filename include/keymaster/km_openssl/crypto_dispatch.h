@@ -0,0 +1,71 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+namespace keymaster {
+
+/**
+ * The CPU's crypto extensions, as far as they can be probed from userspace.  Architectures and
+ * environments that can't be probed report none.
+ */
+struct CpuCryptoFeatures {
+    bool aes = false;                 // AES-NI or ARMv8 AES.
+    bool carryless_multiply = false;  // PCLMULQDQ or ARMv8 PMULL, used for GHASH.
+    bool sha1 = false;
+    bool sha256 = false;
+    bool sha512 = false;
+    bool vector_permute = false;  // SSSE3 or NEON, used for constant-time software AES and GHASH.
+};
+
+/**
+ * CryptoDispatch records which implementation each primitive keymaster uses runs on, and the
+ * choices keymaster makes from that.  BoringSSL selects its own kernels at run time from the same
+ * CPU features, so the entries for its primitives say what it will pick; the key blob OCB code is
+ * selected when keymaster is built.
+ */
+struct CryptoDispatch {
+    CpuCryptoFeatures features;
+    // BoringSSL's own answer: whether AES and GHASH both run in hardware.
+    bool boringssl_aes_hardware = false;
+
+    const char* aes_kernel = "";     // "hardware", "vector" or "generic".
+    const char* ghash_kernel = "";   // "hardware", "vector" or "generic".
+    const char* sha256_kernel = "";  // "hardware" or "generic".
+    const char* ocb_kernel = "";     // "sse2", "neon" or "generic".  Its AES is aes_kernel.
+    const char* des_kernel = "";     // Always "generic"; 3DES is never accelerated.
+
+    // The default smallest per-thread chunk of a parallel CTR or ECB update.  Software AES is
+    // several times slower than hardware, so splitting pays off on much smaller updates.
+    size_t block_cipher_min_chunk_bytes = 0;
+};
+
+/**
+ * Returns the dispatch for this process, probed on first use.  Safe to call from any thread,
+ * including during static initialization.
+ */
+const CryptoDispatch& GetCryptoDispatch();
+
+// Writes |dispatch| to the Logger as one INFO line.
+void LogCryptoDispatch(const CryptoDispatch& dispatch);
+
+// Logs GetCryptoDispatch() the first time it is called in the process, and does nothing after.
+// Software contexts call it on construction.
+void LogCryptoDispatchOnce();
+
+}  // namespace keymaster
@@ -47,6 +47,12 @@ class Curve25519Key : public AsymmetricKey {
 
     EVP_PKEY_Ptr InternalToEvp() const override;
     bool EvpToInternal(const EVP_PKEY* pkey) override;
+
+    // Copies the raw 32-byte private key (for Ed25519, the seed) out of the PKCS#8 key material,
+    // so that operations can call the curve25519.h functions directly instead of going through an
+    // EVP_PKEY.  Key material in the RFC 8410 encoding, which is what EvpToInternal() stores, is
+    // read in place; anything else is decoded by OpenSSL.
+    bool InternalToRaw(uint8_t raw_key[ED25519_SEED_LEN]) const;
 };
 
 class Ed25519Key : public Curve25519Key {
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <openssl/evp.h>
+
+namespace keymaster {
+
+/**
+ * A digest context taken from a per-thread pool of contexts already initialized for their digest,
+ * so that digesting operations don't allocate digest state on every Begin().  The context goes
+ * back to the pool of the thread that releases it, which needn't be the one that took it.
+ *
+ * Pooled contexts are plain digest contexts: they never have a key attached.
+ */
+class PooledDigestContext {
+  public:
+    PooledDigestContext() {}
+    ~PooledDigestContext() { Release(); }
+
+    PooledDigestContext(const PooledDigestContext&) = delete;
+    PooledDigestContext& operator=(const PooledDigestContext&) = delete;
+
+    /**
+     * Takes a context ready to digest with |md|, releasing any context already held.  Returns
+     * false if one could not be allocated.
+     */
+    bool Init(const EVP_MD* md);
+
+    /**
+     * Takes a context, releasing any already held, and copies the state of |other| into it, so
+     * that the two continue independently from the data |other| has digested so far.  Copying a
+     * context that holds none releases this one.  Returns false on allocation failure.
+     */
+    bool CopyFrom(const PooledDigestContext& other);
+
+    /**
+     * Resets the context and returns it to the calling thread's pool.  A no-op if none is held.
+     */
+    void Release();
+
+    EVP_MD_CTX* get() const { return ctx_; }
+
+  private:
+    EVP_MD_CTX* ctx_ = nullptr;
+    const EVP_MD* md_ = nullptr;
+};
+
+}  // namespace keymaster
@@ -19,6 +19,7 @@
 
 #include <utility>
 
+#include <openssl/curve25519.h>
 #include <openssl/ec.h>
 #include <openssl/evp.h>
 
@@ -46,6 +47,8 @@ class EcdhOperation : public Operation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+    keymaster_error_t AgreeBatch(const Buffer* peer_keys, size_t peer_key_count,
+                                 Buffer* shared_secrets) override;
 
   protected:
     EVP_PKEY_Ptr ecdh_key_;
@@ -53,12 +56,20 @@ class EcdhOperation : public Operation {
 
 class X25519Operation : public EcdhOperation {
   public:
-    X25519Operation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced, EVP_PKEY* key)
-        : EcdhOperation(std::move(hw_enforced), std::move(sw_enforced), key) {}
+    // Agrees with X25519() rather than through an EVP_PKEY.  |private_key| is the raw key, from
+    // Curve25519Key::InternalToRaw().
+    X25519Operation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                    const uint8_t private_key[X25519_PRIVATE_KEY_LEN]);
+    ~X25519Operation();
 
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+    keymaster_error_t AgreeBatch(const Buffer* peer_keys, size_t peer_key_count,
+                                 Buffer* shared_secrets) override;
+
+  private:
+    uint8_t private_key_[X25519_PRIVATE_KEY_LEN];
 };
 
 class EcdhOperationFactory : public OperationFactory {
@@ -19,6 +19,7 @@
 
 #include <utility>
 
+#include <openssl/curve25519.h>
 #include <openssl/ec.h>
 #include <openssl/evp.h>
 
@@ -26,6 +27,7 @@
 
 #include <keymaster/key.h>
 #include <keymaster/km_openssl/curve25519_key.h>
+#include <keymaster/km_openssl/digest_context_pool.h>
 #include <keymaster/operation.h>
 
 namespace keymaster {
@@ -35,21 +37,32 @@ class EcdsaOperation : public Operation {
     EcdsaOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
                    keymaster_purpose_t purpose, keymaster_digest_t digest, EVP_PKEY* key)
         : Operation(purpose, std::move(hw_enforced), std::move(sw_enforced)), digest_(digest),
-          digest_algorithm_(nullptr), ecdsa_key_(key) {
-        EVP_MD_CTX_init(&digest_ctx_);
-    }
+          digest_algorithm_(nullptr), ecdsa_key_(key) {}
     ~EcdsaOperation();
 
     keymaster_error_t Abort() override { return KM_ERROR_OK; }
+    OperationPtr Fork(keymaster_error_t* error) const override;
+
+    size_t MemoryFootprint() const override {
+        return Operation::MemoryFootprint() + data_.buffer_size();
+    }
+
+    // Undigested input is only used as far as the key is long.
+    size_t RecommendedChunkSize() const override;
 
   protected:
+    // Returns a new, unbegun operation of the same class holding |key|, for Fork() to copy state
+    // into.
+    virtual EcdsaOperation* NewFork(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                                    EVP_PKEY* key) const = 0;
+
     keymaster_error_t StoreData(const Buffer& input, size_t* input_consumed);
     keymaster_error_t InitDigest();
 
     keymaster_digest_t digest_;
     const EVP_MD* digest_algorithm_;
     EVP_PKEY* ecdsa_key_;
-    EVP_MD_CTX digest_ctx_;
+    PooledDigestContext digest_ctx_;
     Buffer data_;
 };
 
@@ -67,6 +80,15 @@ class EcdsaSignOperation : public EcdsaOperation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+    keymaster_error_t SignBatch(const Buffer* messages, size_t message_count,
+                                Buffer* signatures) override;
+
+  private:
+    EcdsaOperation* NewFork(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                            EVP_PKEY* key) const override {
+        return new (std::nothrow)
+            EcdsaSignOperation(std::move(hw_enforced), std::move(sw_enforced), digest_, key);
+    }
 };
 
 class EcdsaVerifyOperation : public EcdsaOperation {
@@ -83,13 +105,25 @@ class EcdsaVerifyOperation : public EcdsaOperation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+    keymaster_error_t VerifyBatch(const Buffer* messages, const Buffer* signatures, size_t count,
+                                  WorkerPool* pool, uint8_t* verified) override;
+
+  private:
+    EcdsaOperation* NewFork(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                            EVP_PKEY* key) const override {
+        return new (std::nothrow)
+            EcdsaVerifyOperation(std::move(hw_enforced), std::move(sw_enforced), digest_, key);
+    }
 };
 
 class Ed25519SignOperation : public EcdsaSignOperation {
   public:
+    // Signs with ED25519_sign() rather than through an EVP_PKEY.  |seed| is the raw private key,
+    // from Curve25519Key::InternalToRaw(); it is expanded once here rather than for every message.
     Ed25519SignOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
-                         keymaster_digest_t digest, EVP_PKEY* key)
-        : EcdsaSignOperation(std::move(hw_enforced), std::move(sw_enforced), digest, key) {}
+                         keymaster_digest_t digest, const uint8_t seed[ED25519_SEED_LEN]);
+    ~Ed25519SignOperation();
+
     keymaster_error_t Begin(const AuthorizationSet& input_params,
                             AuthorizationSet* output_params) override;
     keymaster_error_t Update(const AuthorizationSet& additional_params, const Buffer& input,
@@ -98,9 +132,23 @@ class Ed25519SignOperation : public EcdsaSignOperation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+    keymaster_error_t SignBatch(const Buffer* messages, size_t message_count,
+                                Buffer* signatures) override;
+    // Ed25519 hashes the whole message when it signs, so there is no digest state to share.
+    OperationPtr Fork(keymaster_error_t* error) const override {
+        *error = KM_ERROR_UNIMPLEMENTED;
+        return nullptr;
+    }
+
+    // The whole message is buffered, up to a fixed limit, so it is best sent in one chunk.
+    size_t RecommendedChunkSize() const override;
+    size_t MaxChunkSize() const override { return RecommendedChunkSize(); }
 
   protected:
     keymaster_error_t StoreAllData(const Buffer& input, size_t* input_consumed);
+
+  private:
+    uint8_t private_key_[ED25519_PRIVATE_KEY_LEN];
 };
 
 class EcdsaOperationFactory : public OperationFactory {
@@ -121,13 +169,8 @@ class EcdsaSignOperationFactory : public EcdsaOperationFactory {
     keymaster_purpose_t purpose() const override { return KM_PURPOSE_SIGN; }
     Operation* InstantiateOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
                                     keymaster_digest_t digest, EVP_PKEY* key) override {
-        if (IsEd25519Key(hw_enforced, sw_enforced)) {
-            return new (std::nothrow)
-                Ed25519SignOperation(std::move(hw_enforced), std::move(sw_enforced), digest, key);
-        } else {
-            return new (std::nothrow)
-                EcdsaSignOperation(std::move(hw_enforced), std::move(sw_enforced), digest, key);
-        }
+        return new (std::nothrow)
+            EcdsaSignOperation(std::move(hw_enforced), std::move(sw_enforced), digest, key);
     }
 };
 
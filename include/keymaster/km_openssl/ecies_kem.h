@@ -26,6 +26,7 @@
 
 #include "hkdf.h"
 #include "key_exchange.h"
+#include "nist_curve_key_exchange.h"
 
 namespace keymaster {
 
@@ -48,12 +49,18 @@ class EciesKem : public Kem {
     bool Decrypt(EC_KEY* private_key, const uint8_t* encrypted_key, size_t encrypted_key_len,
                  Buffer* output_key) override;
 
+    // Makes Encrypt() take its ephemeral key pairs from |key_pool| when it has one ready, leaving
+    // only the multiplication by the peer's point on the critical path.  |key_pool| must outlive
+    // the KEM, or be replaced first; null disables pooling.
+    void set_ephemeral_key_pool(EcKeyPool* key_pool) { ephemeral_key_pool_ = key_pool; }
+
   private:
     UniquePtr<KeyExchange> key_exchange_;
     UniquePtr<Rfc5869Sha256Kdf> kdf_;
     bool single_hash_mode_;
     uint32_t key_bytes_to_generate_;
     keymaster_ec_curve_t curve_;
+    EcKeyPool* ephemeral_key_pool_ = nullptr;
 };
 
 }  // namespace keymaster
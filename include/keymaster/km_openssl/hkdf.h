@@ -17,6 +17,8 @@
 #ifndef SYSTEM_KEYMASTER_HKDF_H_
 #define SYSTEM_KEYMASTER_HKDF_H_
 
+#include <openssl/hmac.h>
+
 #include "kdf.h"
 
 #include <keymaster/serializable.h>
@@ -28,10 +30,17 @@ namespace keymaster {
 /**
  * Rfc5869Sha256Kdf implements the key derivation function specified in RFC 5869 (using SHA256) and
  * outputs key material, as needed by ECIES. See https://tools.ietf.org/html/rfc5869 for details.
+ *
+ * The extract step runs once per Init(), on the first GenerateKey(), and leaves an HMAC context
+ * keyed with the pseudorandom key that every expand afterwards starts from.
  */
 class Rfc5869Sha256Kdf : public Kdf {
   public:
-    ~Rfc5869Sha256Kdf() {}
+    Rfc5869Sha256Kdf() { HMAC_CTX_init(&prk_ctx_); }
+    ~Rfc5869Sha256Kdf() { HMAC_CTX_cleanup(&prk_ctx_); }
+    Rfc5869Sha256Kdf(const Rfc5869Sha256Kdf&) = delete;
+    void operator=(const Rfc5869Sha256Kdf&) = delete;
+
     bool Init(Buffer& secret, Buffer& salt) {
         return Init(secret.peek_read(), secret.available_read(), salt.peek_read(),
                     salt.available_read());
@@ -43,6 +52,15 @@ class Rfc5869Sha256Kdf : public Kdf {
 
     bool GenerateKey(const uint8_t* info, size_t info_len, uint8_t* output,
                      size_t output_len) override;
+
+  protected:
+    void ResetSecretState() override { extracted_ = false; }
+
+  private:
+    bool Extract();
+
+    HMAC_CTX prk_ctx_;
+    bool extracted_ = false;
 };
 
 }  // namespace keymaster
@@ -16,8 +16,12 @@
 
 #pragma once
 
+#include <memory>
+#include <mutex>
 #include <utility>
 
+#include <openssl/hmac.h>
+
 #include "symmetric_key.h"
 
 namespace keymaster {
@@ -26,6 +30,29 @@ const size_t kMinHmacLengthBits = 64;
 const size_t kMinHmacKeyLengthBits = 64;
 const size_t kMaxHmacKeyLengthBits = 2048;  // Some RFC test cases require >1024-bit keys
 
+/**
+ * An HMAC_CTX keyed with an HMAC key's material and digest.  HMAC_Init_ex() hashes the key into the
+ * inner and outer pads, so operations copy this context instead of repeating that for every
+ * operation.  The context is never updated after Init(), so concurrent copies are safe.
+ */
+class KeyedHmacContext {
+  public:
+    KeyedHmacContext() { HMAC_CTX_init(&ctx_); }
+    ~KeyedHmacContext() { HMAC_CTX_cleanup(&ctx_); }
+    KeyedHmacContext(const KeyedHmacContext&) = delete;
+    void operator=(const KeyedHmacContext&) = delete;
+
+    bool Init(const KeymasterKeyBlob& key_material, const EVP_MD* md);
+
+    const EVP_MD* md() const { return md_; }
+    // Replaces the contents of \p ctx, which must have been initialized, with a copy.
+    bool CopyTo(HMAC_CTX* ctx) const { return HMAC_CTX_copy_ex(ctx, &ctx_); }
+
+  private:
+    HMAC_CTX ctx_;
+    const EVP_MD* md_ = nullptr;
+};
+
 class HmacKeyFactory : public SymmetricKeyFactory {
   public:
     explicit HmacKeyFactory(const SoftwareKeyBlobMaker& blob_maker,
@@ -40,6 +67,25 @@ class HmacKeyFactory : public SymmetricKeyFactory {
     OperationFactory* GetOperationFactory(keymaster_purpose_t purpose) const override;
 
   private:
+    /**
+     * The keyed contexts of recently loaded keys, so that loading the same key again, e.g. for
+     * every operation on it, doesn't redo the HMAC key schedule.  Keys are loaded concurrently,
+     * e.g. by UpgradeKeyBlobs(), so the cache has its own mutex.
+     */
+    struct CachedHmacKey {
+        KeymasterKeyBlob key_material;
+        std::shared_ptr<const KeyedHmacContext> context;
+        uint64_t last_used = 0;
+    };
+    static constexpr size_t kHmacKeyCacheSize = 8;
+
+    std::shared_ptr<const KeyedHmacContext> GetKeyedContext(const KeymasterKeyBlob& key_material,
+                                                            const EVP_MD* md) const;
+
+    mutable std::mutex hmac_key_cache_mutex_;
+    mutable CachedHmacKey hmac_key_cache_[kHmacKeyCacheSize];
+    mutable uint64_t hmac_key_cache_clock_ = 0;
+
     bool key_size_supported(size_t key_size_bits) const override {
         return key_size_bits > 0 && key_size_bits % 8 == 00 &&
                key_size_bits >= kMinHmacKeyLengthBits && key_size_bits <= kMaxHmacKeyLengthBits;
@@ -54,6 +100,15 @@ class HmacKey : public SymmetricKey {
             AuthorizationSet&& sw_enforced, const KeyFactory* key_factory)
         : SymmetricKey(std::move(key_material), std::move(hw_enforced), std::move(sw_enforced),
                        key_factory) {}
+
+    // The keyed HMAC context for this key, or null if none could be built.
+    const std::shared_ptr<const KeyedHmacContext>& keyed_context() const { return keyed_context_; }
+    void set_keyed_context(std::shared_ptr<const KeyedHmacContext> context) {
+        keyed_context_ = std::move(context);
+    }
+
+  private:
+    std::shared_ptr<const KeyedHmacContext> keyed_context_;
 };
 
 }  // namespace keymaster
@@ -18,6 +18,8 @@
 
 #include <keymaster/km_openssl/kdf.h>
 
+#include <openssl/evp.h>
+
 #include <hardware/keymaster_defs.h>
 
 #include <keymaster/UniquePtr.h>
@@ -31,7 +33,9 @@ namespace keymaster {
  */
 class Iso18033Kdf : public Kdf {
   public:
-    ~Iso18033Kdf() {}
+    ~Iso18033Kdf() { EVP_MD_CTX_cleanup(&secret_ctx_); }
+    Iso18033Kdf(const Iso18033Kdf&) = delete;
+    void operator=(const Iso18033Kdf&) = delete;
 
     bool Init(keymaster_digest_t digest_type, const uint8_t* secret, size_t secret_len) {
         return Kdf::Init(digest_type, secret, secret_len, nullptr /* salt */, 0 /* salt_len */);
@@ -55,10 +59,19 @@ class Iso18033Kdf : public Kdf {
                      size_t output_len) override;
 
   protected:
-    explicit Iso18033Kdf(uint32_t start_counter) : start_counter_(start_counter) {}
+    explicit Iso18033Kdf(uint32_t start_counter) : start_counter_(start_counter) {
+        EVP_MD_CTX_init(&secret_ctx_);
+    }
+
+    void ResetSecretState() override { secret_absorbed_ = false; }
 
   private:
+    // Hashes the secret into |secret_ctx_|, which every block's digest then starts from.
+    bool AbsorbSecret();
+
     uint32_t start_counter_;
+    EVP_MD_CTX secret_ctx_;
+    bool secret_absorbed_ = false;
 };
 
 }  // namespace keymaster
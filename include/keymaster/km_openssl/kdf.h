@@ -37,7 +37,22 @@ class Kdf {
     virtual bool GenerateKey(const uint8_t* info, size_t info_len, uint8_t* output,
                              size_t output_len) = 0;
 
+    // One key for GenerateKeys() to derive.
+    struct Output {
+        const uint8_t* info;
+        size_t info_len;
+        uint8_t* output;
+        size_t output_len;
+    };
+
+    // Derives |count| keys from the secret, each as GenerateKey() would.  The work that depends
+    // only on the secret is done once per Init(), not once per key.
+    bool GenerateKeys(const Output* outputs, size_t count);
+
   protected:
+    // Called by Init() to discard anything a subclass derived from the previous secret.
+    virtual void ResetSecretState() {}
+
     bool Uint32ToBigEndianByteArray(uint32_t number, uint8_t* output);
     UniquePtr<uint8_t[]> secret_key_;
     size_t secret_key_len_;
@@ -27,6 +27,18 @@
 
 namespace keymaster {
 
+/**
+ * A source of ready-made EC key pairs, so that ephemeral keys needn't be generated on the critical
+ * path.  Implementations must hand out each key pair at most once.
+ */
+class EcKeyPool {
+  public:
+    virtual ~EcKeyPool() {}
+
+    // Returns a key pair on the given NIST curve, or null if none is ready.
+    virtual EC_KEY_Ptr TakeKey(keymaster_ec_curve_t curve) = 0;
+};
+
 /**
  * NistCurveKeyExchange implements a KeyExchange using elliptic-curve
  * Diffie-Hellman on NIST curves: P-224, P-256, P-384 and P-521.
@@ -42,9 +54,17 @@ class NistCurveKeyExchange : public KeyExchange {
 
     /**
      * GenerateKeyExchange generates a new public/private key pair on a NIST curve and returns
-     * a new key exchange object.
+     * a new key exchange object.  If \p key_pool is given and has a key pair on the curve ready,
+     * that is used instead.
+     */
+    static NistCurveKeyExchange* GenerateKeyExchange(keymaster_ec_curve_t curve,
+                                                     EcKeyPool* key_pool = nullptr);
+
+    /**
+     * Generates a key pair on a NIST curve, using the process-wide group for the curve so that its
+     * precomputed generator multiples are shared.
      */
-    static NistCurveKeyExchange* GenerateKeyExchange(keymaster_ec_curve_t curve);
+    static keymaster_error_t GenerateKey(keymaster_ec_curve_t curve, EC_KEY_Ptr* key);
 
     /**
      * KeyExchange interface.
@@ -23,7 +23,10 @@
 namespace keymaster {
 
 /**
- * Translate the last OpenSSL error to a keymaster error.  Does not remove the error from the queue.
+ * Translate the last OpenSSL error to a keymaster error, and clear the thread's error queue so
+ * that repeated failures don't pile up in it.  If \p log_message is set the error is logged at
+ * debug level, but it is only formatted when a debug message would actually be written, and at
+ * most a few errors a second are logged.
  */
 keymaster_error_t TranslateLastOpenSslError(bool log_message = true);
 
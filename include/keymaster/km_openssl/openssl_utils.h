@@ -57,6 +57,7 @@ DEFINE_OPENSSL_OBJECT_POINTER(ASN1_OBJECT)
 DEFINE_OPENSSL_OBJECT_POINTER(ASN1_OCTET_STRING)
 DEFINE_OPENSSL_OBJECT_POINTER(ASN1_TIME)
 DEFINE_OPENSSL_OBJECT_POINTER(BN_CTX)
+DEFINE_OPENSSL_OBJECT_POINTER(BN_GENCB)
 DEFINE_OPENSSL_OBJECT_POINTER(EC_GROUP)
 DEFINE_OPENSSL_OBJECT_POINTER(EC_KEY)
 DEFINE_OPENSSL_OBJECT_POINTER(EC_POINT)
@@ -76,6 +77,13 @@ typedef UniquePtr<BIGNUM, BIGNUM_Delete> BIGNUM_Ptr;
 keymaster_error_t ec_get_group_size(const EC_GROUP* group, size_t* key_size_bits);
 EC_GROUP* ec_get_group(keymaster_ec_curve_t curve);
 
+/**
+ * Returns a process-wide group for one of the NIST curves, or nullptr for any other curve.  The
+ * group is owned by the library and must not be freed or modified; keys set to use it with
+ * EC_KEY_set_group() share its precomputed state instead of rebuilding it.
+ */
+const EC_GROUP* ec_get_shared_group(keymaster_ec_curve_t curve);
+
 /**
  * Many OpenSSL APIs take ownership of an argument on success but don't free the argument on
  * failure. This means we need to tell our scoped pointers when we've transferred ownership, without
@@ -97,6 +105,18 @@ keymaster_error_t KeyMaterialToEvpKey(keymaster_key_format_t key_format,
 
 keymaster_error_t EvpKeyToKeyMaterial(const EVP_PKEY* evp_pkey, KeymasterKeyBlob* key_blob);
 
+/**
+ * Parses |key_material|, the private key of a key blob as written by EvpKeyToKeyMaterial(), into
+ * a key of |evp_key_type|.  Unlike d2i_PrivateKey(), this skips the consistency checks on RSA and
+ * EC keys, RSA_check_key() and the public key recomputation of EC_KEY_check_key(), which cost as
+ * much as an operation.  Only use it for material from a blob format whose authentication covers
+ * the key material (see IsAuthenticatedKeyBlobFormat()); that material was checked when the key
+ * was generated or imported.  Unauthenticated material, such as an old softkeymaster blob's, must
+ * go through d2i_PrivateKey() or KeyMaterialToEvpKey().
+ */
+keymaster_error_t ParseValidatedPrivateKey(int evp_key_type, const KeymasterKeyBlob& key_material,
+                                           EVP_PKEY_Ptr* pkey);
+
 keymaster_error_t GetEcdsa256KeyFromCert(const keymaster_blob_t* km_cert, uint8_t* x_coord,
                                          size_t x_length, uint8_t* y_coord, size_t y_length);
 
@@ -16,14 +16,31 @@
 
 #pragma once
 
+#include <mutex>
+
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 
 #include <keymaster/asymmetric_key_factory.h>
+#include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/soft_key_factory.h>
 
 namespace keymaster {
 
+class WorkerPool;
+
+/**
+ * A source of pre-generated RSA key pairs for RsaKeyFactory::GenerateKey().  Implementations must
+ * hand out each key pair at most once.
+ */
+class RsaKeyPool {
+  public:
+    virtual ~RsaKeyPool() {}
+
+    // Returns a key pair with the given size and public exponent, or null if none is ready.
+    virtual RSA_Ptr TakeKey(uint32_t key_size, uint64_t public_exponent) = 0;
+};
+
 class RsaKeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
   public:
     explicit RsaKeyFactory(const SoftwareKeyBlobMaker& blob_maker, const KeymasterContext& context)
@@ -46,6 +63,18 @@ class RsaKeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
                                 AuthorizationSet* sw_enforced,
                                 CertificateChain* cert_chain) const override;
 
+    // Loads the key, reusing the parsed RSA object if the same key material was loaded recently.
+    keymaster_error_t LoadKey(KeymasterKeyBlob&& key_material,
+                              const AuthorizationSet& additional_params,
+                              AuthorizationSet&& hw_enforced,  //
+                              AuthorizationSet&& sw_enforced,  //
+                              UniquePtr<Key>* key) const override;
+    keymaster_error_t LoadAuthenticatedKey(KeymasterKeyBlob&& key_material,
+                                           const AuthorizationSet& additional_params,
+                                           AuthorizationSet&& hw_enforced,  //
+                                           AuthorizationSet&& sw_enforced,  //
+                                           UniquePtr<Key>* key) const override;
+
     keymaster_error_t CreateEmptyKey(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
                                      UniquePtr<AsymmetricKey>* key) const override;
 
@@ -53,6 +82,21 @@ class RsaKeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
 
     keymaster_algorithm_t keymaster_key_type() const override { return KM_ALGORITHM_RSA; }
 
+    // Makes GenerateKey() take key pairs from |key_pool| when it has one of the requested size and
+    // exponent, generating them synchronously otherwise.  |key_pool| must outlive the factory, or
+    // be replaced first; null disables pooling.
+    void set_key_pool(RsaKeyPool* key_pool) { key_pool_ = key_pool; }
+
+    // Generates a key pair synchronously.  Validation of the size and exponent is up to the caller.
+    static keymaster_error_t GenerateRsaKey(uint32_t key_size, uint64_t public_exponent,
+                                            RSA_Ptr* rsa_key);
+
+    // Generates a key pair like GenerateRsaKey(), but searches for the two primes concurrently on
+    // |pool|, abandoning one search as soon as the other fails.  With a null or busy pool the
+    // searches run one after the other on the calling thread.
+    static keymaster_error_t GenerateRsaKeyInParallel(uint32_t key_size, uint64_t public_exponent,
+                                                      WorkerPool* pool, RSA_Ptr* rsa_key);
+
   protected:
     keymaster_error_t UpdateImportKeyDescription(const AuthorizationSet& key_description,
                                                  keymaster_key_format_t import_key_format,
@@ -60,6 +104,35 @@ class RsaKeyFactory : public AsymmetricKeyFactory, public SoftKeyFactoryMixin {
                                                  AuthorizationSet* updated_description,
                                                  uint64_t* public_exponent,
                                                  uint32_t* key_size) const;
+
+  private:
+    /**
+     * A recently loaded RSA key.  The RSA object computes its Montgomery contexts and blinding
+     * factors on first use and keeps them, so sharing it between the keys loaded from the same
+     * material saves that setup on every operation after the first.  RSA objects are safe to use
+     * from concurrent operations, and keys are loaded concurrently, e.g. by UpgradeKeyBlobs(), so
+     * the cache has its own mutex.  A hit skips the consistency checks, but the same material
+     * passed them, or came from an authenticated blob, when it was cached.
+     */
+    struct CachedRsaKey {
+        KeymasterKeyBlob key_material;
+        RSA_Ptr rsa;
+        uint64_t last_used = 0;
+    };
+    static constexpr size_t kRsaKeyCacheSize = 8;
+
+    keymaster_error_t LoadRsaKey(KeymasterKeyBlob&& key_material,
+                                 const AuthorizationSet& additional_params,
+                                 AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                                 bool authenticated, UniquePtr<Key>* key) const;
+    // Returns a new reference to the cached key, so eviction can't free it under the caller.
+    RSA_Ptr FindCachedRsaKey(const KeymasterKeyBlob& key_material) const;
+    void CacheRsaKey(const KeymasterKeyBlob& key_material, RSA* rsa) const;
+
+    mutable std::mutex rsa_key_cache_mutex_;
+    mutable CachedRsaKey rsa_key_cache_[kRsaKeyCacheSize];
+    mutable uint64_t rsa_key_cache_clock_ = 0;
+    RsaKeyPool* key_pool_ = nullptr;
 };
 
 }  // namespace keymaster
@@ -17,6 +17,7 @@
 #ifndef SYSTEM_KEYMASTER_RSA_OPERATION_H_
 #define SYSTEM_KEYMASTER_RSA_OPERATION_H_
 
+#include <memory>
 #include <utility>
 
 #include <keymaster/UniquePtr.h>
@@ -24,6 +25,8 @@
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 
+#include <keymaster/km_openssl/digest_context_pool.h>
+#include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/operation.h>
 
 namespace keymaster {
@@ -52,6 +55,14 @@ class RsaOperation : public Operation {
     keymaster_padding_t padding() const { return padding_; }
     keymaster_digest_t digest() const { return digest_; }
 
+    size_t MemoryFootprint() const override {
+        return Operation::MemoryFootprint() + data_.buffer_size();
+    }
+
+    // Undigested input is buffered, and can't be longer than the key.
+    size_t RecommendedChunkSize() const override;
+    size_t MaxChunkSize() const override { return RsaOperation::RecommendedChunkSize(); }
+
   protected:
     virtual int GetOpensslPadding(keymaster_error_t* error) = 0;
     virtual bool require_digest() const = 0;
@@ -80,10 +91,28 @@ class RsaDigestingOperation : public RsaOperation {
                           keymaster_padding_t padding, EVP_PKEY* key);
     ~RsaDigestingOperation();
 
+    OperationPtr Fork(keymaster_error_t* error) const override;
+
+    size_t RecommendedChunkSize() const override;
+    size_t MaxChunkSize() const override;
+
   protected:
+    // Returns a new, unbegun operation of the same class holding |key|, for Fork() to copy state
+    // into.
+    virtual RsaDigestingOperation* NewFork(AuthorizationSet&& hw_enforced,
+                                           AuthorizationSet&& sw_enforced,
+                                           EVP_PKEY* key) const = 0;
+
     int GetOpensslPadding(keymaster_error_t* error) override;
     bool require_digest() const override { return padding_ == KM_PAD_RSA_PSS; }
-    EVP_MD_CTX digest_ctx_;
+    keymaster_error_t InitDigestedContexts(bool signing);
+    keymaster_error_t NewPkeyContext(bool signing, EVP_PKEY_CTX_Ptr* pkey_ctx);
+    keymaster_error_t FinishDigest(uint8_t* digest, unsigned int* digest_length);
+
+    // The message is digested in a pooled context and the digest signed or verified with
+    // |pkey_ctx_|, which carries the key, padding and digest type.
+    PooledDigestContext digest_ctx_;
+    EVP_PKEY_CTX_Ptr pkey_ctx_;
 };
 
 /**
@@ -106,6 +135,12 @@ class RsaSignOperation : public RsaDigestingOperation {
                              Buffer* output) override;
 
   private:
+    RsaDigestingOperation* NewFork(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                                   EVP_PKEY* key) const override {
+        return new (std::nothrow) RsaSignOperation(std::move(hw_enforced), std::move(sw_enforced),
+                                                   digest_, padding_, key);
+    }
+
     keymaster_error_t SignUndigested(Buffer* output);
     keymaster_error_t SignDigested(Buffer* output);
 };
@@ -128,10 +163,34 @@ class RsaVerifyOperation : public RsaDigestingOperation {
     keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                              const Buffer& signature, AuthorizationSet* output_params,
                              Buffer* output) override;
+    keymaster_error_t VerifyBatch(const Buffer* messages, const Buffer* signatures, size_t count,
+                                  WorkerPool* pool, uint8_t* verified) override;
+
+    // Digested PKCS#1 v1.5 and PSS verification recovers the encoded message from the signature,
+    // the public key operation, while the message is digested, leaving Finish() to check the
+    // digest against it.
+    keymaster_error_t SetEarlySignature(const Buffer& signature, WorkerPool* pool) override;
 
   private:
-    keymaster_error_t VerifyUndigested(const Buffer& signature);
+    struct EarlySignature;
+
+    RsaDigestingOperation* NewFork(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                                   EVP_PKEY* key) const override {
+        return new (std::nothrow) RsaVerifyOperation(
+            std::move(hw_enforced), std::move(sw_enforced), digest_, padding_, key);
+    }
+
+    keymaster_error_t VerifyUndigested(RSA* rsa, const uint8_t* message, size_t message_length,
+                                       const Buffer& signature);
     keymaster_error_t VerifyDigested(const Buffer& signature);
+    static keymaster_error_t VerifyDigest(EVP_PKEY_CTX* pkey_ctx, const uint8_t* digest,
+                                          size_t digest_length, const Buffer& signature);
+    keymaster_error_t VerifyEarly(EarlySignature* early);
+    bool CheckPkcs1Encoding(RSA* rsa, const uint8_t* encoded, const uint8_t* digest,
+                            size_t digest_length);
+
+    // Shared with the task recovering the encoded message, which may outlive the operation.
+    std::shared_ptr<EarlySignature> early_signature_;
 };
 
 /**
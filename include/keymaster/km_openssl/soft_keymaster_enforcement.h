@@ -18,8 +18,14 @@
 #ifndef INCLUDE_KEYMASTER_SOFT_KEYMASTER_ENFORCEMENT_H_
 #define INCLUDE_KEYMASTER_SOFT_KEYMASTER_ENFORCEMENT_H_
 
+#include <vector>
+
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+
 #include <keymaster/android_keymaster_messages.h>
 #include <keymaster/keymaster_enforcement.h>
+#include <keymaster/km_openssl/ckdf.h>
 
 namespace keymaster {
 
@@ -45,11 +51,46 @@ class SoftKeymasterEnforcement : public KeymasterEnforcement {
     VerifyAuthorizationResponse
     VerifyAuthorization(const VerifyAuthorizationRequest& request) override;
     keymaster_error_t GenerateTimestampToken(TimestampToken* token) override;
+    keymaster_error_t GenerateTimestampToken(uint64_t challenge, uint64_t* timestamp,
+                                             uint8_t* mac) override;
+
+    /**
+     * Serializes this instance's HMAC sharing parameters and the shared HMAC key and sharing check
+     * last computed from them, so that a restarted HAL can carry on with RestoreSharedHmacState()
+     * rather than wait for Keystore to renegotiate.  The output contains the shared key.
+     */
+    keymaster_error_t SerializeSharedHmacState(std::vector<uint8_t>* state) const;
+
+    /**
+     * Replaces the shared HMAC state with that serialized by SerializeSharedHmacState().  Fails
+     * with KM_ERROR_INVALID_ARGUMENT, leaving the state unchanged, if |state| is malformed.
+     */
+    keymaster_error_t RestoreSharedHmacState(const uint8_t* state, size_t size);
 
   private:
+    // (Re)keys |shared_hmac_| with |hmac_key_|.
+    keymaster_error_t KeySharedHmac();
+    // Writes the kTimestampTokenMacSize-byte HMAC-SHA256 of |data| under |hmac_key_| to |mac|.
+    keymaster_error_t SharedHmac(const uint8_t* data, size_t data_length, uint8_t* mac);
+    // MACs a verification token with no verified parameters, which is also a timestamp token.
+    keymaster_error_t MacVerificationToken(uint64_t challenge, uint64_t timestamp,
+                                           keymaster_security_level_t security_level,
+                                           uint8_t* mac);
+
     bool have_saved_params_ = false;
     HmacSharingParameters saved_params_;
     KeymasterKeyBlob hmac_key_;
+    // Keyed with the fixed key agreement key the first time a shared HMAC key is computed.
+    Ckdf shared_hmac_kdf_;
+    // Digest of the parameters |hmac_key_| was derived from, and the sharing check it produced,
+    // so that repeating a negotiation doesn't rerun the KDF.
+    bool have_shared_hmac_ = false;
+    uint8_t shared_hmac_params_digest_[SHA256_DIGEST_LENGTH] = {};
+    KeymasterBlob shared_hmac_check_;
+    // Keyed with |hmac_key_| when ComputeSharedHmac() derives it, and restarted from that key for
+    // every sharing check, verification token and timestamp token.
+    bssl::ScopedHMAC_CTX shared_hmac_;
+    bool shared_hmac_keyed_ = false;
 };
 
 }  // namespace keymaster
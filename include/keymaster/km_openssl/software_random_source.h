@@ -21,12 +21,24 @@
 
 namespace keymaster {
 
+/**
+ * Random source backed by a per-thread CTR-DRBG, so that concurrent operations don't all contend
+ * on the global RAND_bytes() state.  Each thread's DRBG is seeded from RAND_bytes() and reseeded
+ * after a fixed number of bytes or amount of time, and small requests (operation handles, nonces,
+ * IVs) are served from a pre-generated pool.
+ */
 class SoftwareRandomSource : public RandomSource {
   public:
     /**
      * Generates \p length random bytes, placing them in \p buf.
      */
     keymaster_error_t GenerateRandom(uint8_t* buffer, size_t length) const override;
+
+    /**
+     * Mixes \p length bytes from \p buf into the calling thread's DRBG and makes every other
+     * thread's DRBG reseed before its next use.
+     */
+    keymaster_error_t AddEntropy(const uint8_t* buf, size_t length) const;
 };
 
 }  // namespace keymaster
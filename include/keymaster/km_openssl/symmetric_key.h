@@ -39,6 +39,10 @@ class SymmetricKeyFactory : public KeyFactory, public SoftKeyFactoryMixin {
                                   AuthorizationSet* hw_enforced,  //
                                   AuthorizationSet* sw_enforced,
                                   CertificateChain* cert_chain) const override;
+    // Draws the material for all the keys from one GenerateRandom() call.
+    void GenerateKeys(const AuthorizationSet* key_descriptions, size_t count,
+                      KeymasterKeyBlob* key_blobs, AuthorizationSet* hw_enforced,
+                      AuthorizationSet* sw_enforced, keymaster_error_t* errors) const override;
     keymaster_error_t ImportKey(const AuthorizationSet& key_description,
                                 keymaster_key_format_t input_key_material_format,
                                 const KeymasterKeyBlob& input_key_material,
@@ -55,6 +59,10 @@ class SymmetricKeyFactory : public KeyFactory, public SoftKeyFactoryMixin {
     };
 
   private:
+    // Checks |key_description| for a new key and returns the size of the key material it needs.
+    keymaster_error_t CheckNewKeyParams(const AuthorizationSet& key_description,
+                                        size_t* key_data_size) const;
+
     virtual bool key_size_supported(size_t key_size_bits) const = 0;
 
     // These methods translate between key size in bits and bytes.  Normally it's just 8 bits to the
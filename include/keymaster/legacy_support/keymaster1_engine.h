@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <array>
 #include <memory>
 
 #include <openssl/ec.h>
@@ -93,6 +94,12 @@ class Keymaster1Engine {
     keymaster_error_t Keymaster1Finish(const KeyData* key_data, const keymaster_blob_t& input,
                                        keymaster_blob_t* output);
 
+    EVP_PKEY* FindCachedPublicKey(const KeymasterKeyBlob& blob, const keymaster_blob_t* client_id,
+                                  const keymaster_blob_t* app_data) const;
+    void CachePublicKey(const KeymasterKeyBlob& blob, const keymaster_blob_t* client_id,
+                        const keymaster_blob_t* app_data, EVP_PKEY* key) const;
+    void ForgetPublicKeys() const;
+
     static int duplicate_key_data(CRYPTO_EX_DATA* to, const CRYPTO_EX_DATA* from, void** from_d,
                                   // NOLINTNEXTLINE(google-runtime-int)
                                   int index, long argl, void* argp);
@@ -115,6 +122,21 @@ class Keymaster1Engine {
     const RSA_METHOD rsa_method_;
     const ECDSA_METHOD ecdsa_method_;
 
+    // Public keys exported from the device, so that building an engine key for a blob that was
+    // used recently doesn't need another export_key() round trip.  Only touched by key loading and
+    // deletion, which run under the context lock.
+    struct CachedPublicKey {
+        KeymasterKeyBlob blob;
+        bool has_client_id = false;
+        KeymasterBlob client_id;
+        bool has_app_data = false;
+        KeymasterBlob app_data;
+        EVP_PKEY_Ptr public_key;
+    };
+    static constexpr size_t kPublicKeyCacheSize = 8;
+    mutable std::array<CachedPublicKey, kPublicKeyCacheSize> public_keys_;
+    mutable size_t next_public_key_ = 0;
+
     static Keymaster1Engine* instance_;
 };
 
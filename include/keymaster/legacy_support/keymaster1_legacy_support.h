@@ -49,6 +49,13 @@ class Keymaster1LegacySupport {
     bool RequiresSoftwareDigesting(const keymaster_digest_t digest,
                                    const AuthProxy& key_description) const;
 
+    // Returns true if an operation the device could digest itself should be digested in software
+    // instead, because the key's hardware-enforced authorizations let the device sign the bare
+    // digest.
+    static bool PrefersSoftwareDigesting(const keymaster_digest_t digest,
+                                         const AuthorizationSet& begin_params,
+                                         const AuthorizationSet& hw_enforced);
+
   private:
     DigestMap device_digests_;
     bool supports_all_;
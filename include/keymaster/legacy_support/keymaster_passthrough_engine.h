@@ -17,6 +17,8 @@
 
 #pragma once
 
+#include <stddef.h>
+
 #include <memory>
 
 #include <hardware/keymaster_defs.h>
@@ -62,6 +64,14 @@ class KeymasterPassthroughEngine {
     static UniquePtr<KeymasterPassthroughEngine> createInstance(const keymaster1_device_t* dev);
     static UniquePtr<KeymasterPassthroughEngine> createInstance(const keymaster2_device_t* dev);
 
+    /**
+     * Creates an engine over several sessions opened on the same keymaster2 device, for TAs that
+     * run sessions concurrently.  Each operation stays on the session it began on.  The engine
+     * takes ownership of all the sessions.
+     */
+    static UniquePtr<KeymasterPassthroughEngine>
+    createInstance(const keymaster2_device_t* const* devs, size_t count);
+
   protected:
     KeymasterPassthroughEngine() {}
 };
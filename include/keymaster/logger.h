@@ -36,6 +36,15 @@ class Logger {
 
     virtual int log_msg(LogLevel level, const char* fmt, va_list args) const = 0;
 
+    /**
+     * Returns whether a message at \p level would be written anywhere, so that callers can skip
+     * work done only to build the message.  The default is to write everything.
+     */
+    virtual bool is_loggable(LogLevel /* level */) const { return true; }
+
+    // False if no logger is installed.
+    static bool IsLoggable(LogLevel level);
+
     static int Log(LogLevel level, const char* fmt, va_list args);
     static int Log(LogLevel level, const char* fmt, ...);
     static int Debug(const char* fmt, ...);
@@ -46,6 +55,7 @@ class Logger {
 
   protected:
     static void set_instance(Logger* logger) { instance_ = logger; }
+    static Logger* instance() { return instance_; }
 
   private:
     // Disallow copying.
@@ -90,25 +90,23 @@ template <typename T, size_t N> inline bool array_contains(const T (&a)[N], T va
 }
 
 /**
- * Variant of memset() that uses GCC-specific pragmas to disable optimizations, so effect is not
- * optimized away.  This is important because we often need to wipe blocks of sensitive data from
- * memory.  As an additional convenience, this implementation avoids writing to NULL pointers.
+ * Variant of memset() whose effect is not optimized away, even when the memory is never read
+ * again.  This is important because we often need to wipe blocks of sensitive data from memory.
+ * The empty asm statement tells the compiler the memory may be read, which keeps the store while
+ * leaving it free to inline the memset() as word-wide or vector stores.  As an additional
+ * convenience, this implementation avoids writing to NULL pointers.
  */
-#ifdef __clang__
-#define OPTNONE __attribute__((optnone))
-#else  // not __clang__
-#define OPTNONE __attribute__((optimize("O0")))
-#endif  // not __clang__
-inline OPTNONE void* memset_s(void* s, int c, size_t n) {
+inline void* memset_s(void* s, int c, size_t n) {
     if (!s) return s;
-    return memset(s, c, n);
+    memset(s, c, n);
+    __asm__ __volatile__("" : : "r"(s) : "memory");
+    return s;
 }
-#undef OPTNONE
 
 /**
  * Variant of memcmp that has the same runtime regardless of whether the data matches (i.e. doesn't
  * short-circuit).  Not an exact equivalent to memcmp because it doesn't return <0 if p1 < p2, just
- * 0 for match and non-zero for non-match.
+ * 0 for match and non-zero for non-match.  See ConstantTimeEquals().
  */
 int memcmp_s(const void* p1, const void* p2, size_t length);
 
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <keymaster/UniquePtr.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/serializable.h>
+
+namespace keymaster {
+
+/**
+ * MessageBufferPool recycles the buffers transport glue serializes messages into and receives them
+ * from, one buffer per command, so that a session issuing the same begin/update/finish calls over
+ * and over stops allocating once each buffer has grown to its command's high-water mark.  Buffers
+ * are sized by the message's exact SerializedSize() and only ever grow.  Contents are zeroed before
+ * a buffer is reused or freed, since messages carry key material.
+ *
+ * A pool holds kMaxSlots commands; past that, the most recently claimed slot is handed over to the
+ * new command, buffer and all.  MessageBufferPool is not thread-safe; use one per session.
+ */
+class MessageBufferPool {
+  public:
+    static constexpr size_t kMaxSlots = 8;
+
+    MessageBufferPool() = default;
+    ~MessageBufferPool();
+
+    MessageBufferPool(const MessageBufferPool&) = delete;
+    void operator=(const MessageBufferPool&) = delete;
+
+    /**
+     * Serializes |message| into |command|'s buffer.  On success |*data| and |*size| describe the
+     * serialized message, which remains valid until the next call to this pool for |command|.
+     */
+    keymaster_error_t Serialize(AndroidKeymasterCommand command, const Serializable& message,
+                                const uint8_t** data, size_t* size);
+
+    /**
+     * Returns |command|'s buffer, holding at least |size| zeroed bytes, to receive a serialized
+     * message into; or nullptr if allocation fails.  The buffer remains valid until the next call
+     * to this pool for |command|.
+     */
+    uint8_t* Acquire(AndroidKeymasterCommand command, size_t size);
+
+    // Returns the largest message |command|'s buffer has held, or 0 if it has no buffer.
+    size_t high_water_mark(AndroidKeymasterCommand command) const;
+
+    // Returns how many times any buffer has had to be allocated or grown.
+    size_t allocations() const { return allocations_; }
+
+  private:
+    struct Slot {
+        AndroidKeymasterCommand command;
+        UniquePtr<uint8_t[]> buffer;
+        size_t capacity = 0;
+        size_t used = 0;
+    };
+
+    // Returns |command|'s slot with room for |size| bytes and its old contents zeroed.
+    Slot* Reserve(AndroidKeymasterCommand command, size_t size);
+    const Slot* Find(AndroidKeymasterCommand command) const;
+
+    Slot slots_[kMaxSlots];
+    size_t slot_count_ = 0;
+    size_t allocations_ = 0;
+};
+
+}  // namespace keymaster
@@ -26,6 +26,7 @@
 #include <hardware/keymaster_defs.h>
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/confirmation_verifier.h>
 #include <keymaster/logger.h>
 
 namespace keymaster {
@@ -33,6 +34,7 @@ namespace keymaster {
 class AuthorizationSet;
 class Key;
 class Operation;
+class WorkerPool;
 using OperationPtr = UniquePtr<Operation>;
 
 class OperationFactory {
@@ -93,6 +95,10 @@ class OperationFactory {
  */
 class Operation {
   public:
+    // A multiple of every cipher and digest block size, and large enough that the fixed cost of
+    // an Update() is small beside the work on its input.
+    static constexpr size_t kDefaultRecommendedChunkSize = 16 * 1024;
+
     explicit Operation(keymaster_purpose_t purpose, AuthorizationSet&& hw_enforced,
                        AuthorizationSet&& sw_enforced)
         : purpose_(purpose), hw_enforced_(std::move(hw_enforced)),
@@ -110,31 +116,44 @@ class Operation {
         secure_deletion_slot_ = secure_deletion_slot;
     }
     uint32_t secure_deletion_slot() const { return secure_deletion_slot_; }
+    // The caller the operation was begun for, which OperationTable charges it to.
+    void set_owner(uint32_t owner) { owner_ = owner; }
+    uint32_t owner() const { return owner_; }
     virtual keymaster_operation_handle_t operation_handle() const { return operation_handle_; }
 
-    AuthProxy authorizations() const { return AuthProxy(hw_enforced_, sw_enforced_); }
-    AuthorizationSet hw_enforced() const { return hw_enforced_; }
-    AuthorizationSet sw_enforced() const { return sw_enforced_; }
-
-    // Creates and initializes |confirmation_verifier_buffer_| that can be retrieved with
-    // get_confirmation_verifier_buffer().
-    //
-    // Returns false on allocation failure.
-    bool create_confirmation_verifier_buffer() {
-        if (!confirmation_verifier_buffer_) {
-            Buffer* buffer = new (std::nothrow)
-                Buffer(kConfirmationTokenMessageTag, kConfirmationTokenMessageTagSize);
-            if (buffer == nullptr) {
-                return false;
-            }
-            confirmation_verifier_buffer_.reset(buffer);
-        }
+    // Sets the operation handle.  OperationTable uses this to assign handles and to encode the
+    // slot an operation lives in into its handle.  Returns false if the handle is owned by an
+    // underlying device and cannot be changed.
+    virtual bool set_operation_handle(keymaster_operation_handle_t op_handle) {
+        operation_handle_ = op_handle;
         return true;
     }
 
-    // If a Buffer for ConfirmationUI verification was created with
-    // create_confirmation_verifier_buffer(), returns it. If not, returns |nullptr|.
-    Buffer* get_confirmation_verifier_buffer() { return confirmation_verifier_buffer_.get(); }
+    AuthProxy authorizations() const { return AuthProxy(hw_enforced_, sw_enforced_); }
+    const AuthorizationSet& hw_enforced() const { return hw_enforced_; }
+    const AuthorizationSet& sw_enforced() const { return sw_enforced_; }
+
+    // Gives the operation the verifier that checks its input against the confirmation token.
+    // Only operations bound to TAG_TRUSTED_CONFIRMATION_REQUIRED have one.
+    void set_confirmation_verifier(UniquePtr<ConfirmationVerifier> verifier) {
+        confirmation_verifier_ = std::move(verifier);
+    }
+
+    // Returns the verifier set with set_confirmation_verifier(), or |nullptr|.
+    ConfirmationVerifier* confirmation_verifier() { return confirmation_verifier_.get(); }
+
+    // Bytes of input and intermediate data the operation is holding on to, which is what varies
+    // between operations and grows with their input.  Operations that buffer data add theirs.
+    virtual size_t MemoryFootprint() const {
+        return confirmation_verifier_ ? confirmation_verifier_->MemoryFootprint() : 0;
+    }
+
+    // The Update() input length the operation processes most efficiently.  Update() consumes at
+    // least this much of any input it is given, or all of shorter input.
+    virtual size_t RecommendedChunkSize() const { return kDefaultRecommendedChunkSize; }
+
+    // The most input one Update() accepts, or SIZE_MAX if the operation sets no limit of its own.
+    virtual size_t MaxChunkSize() const { return SIZE_MAX; }
 
     virtual keymaster_error_t Begin(const AuthorizationSet& input_params,
                                     AuthorizationSet* output_params) = 0;
@@ -146,19 +165,99 @@ class Operation {
                                      Buffer* output) = 0;
     virtual keymaster_error_t Abort() = 0;
 
+    // Signs each of the |message_count| |messages| independently, exactly as if each had been
+    // signed by an operation of its own, and stores the signatures in the corresponding entries of
+    // |signatures|.  Called after Begin() instead of Update() and Finish().  Operations that can't
+    // sign in batches return KM_ERROR_UNIMPLEMENTED.
+    virtual keymaster_error_t SignBatch(const Buffer* /* messages */, size_t /* message_count */,
+                                        Buffer* /* signatures */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    // Agrees a shared secret with each of the |peer_key_count| DER-encoded |peer_keys|, exactly as
+    // if each had been passed to Finish() of an operation of its own, and stores the secrets in the
+    // corresponding entries of |shared_secrets|.  Called after Begin() instead of Update() and
+    // Finish().  Operations that can't agree in batches return KM_ERROR_UNIMPLEMENTED.
+    virtual keymaster_error_t AgreeBatch(const Buffer* /* peer_keys */,
+                                         size_t /* peer_key_count */,
+                                         Buffer* /* shared_secrets */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    // Verifies each of the |count| |signatures| over the corresponding entry of |messages|, exactly
+    // as if each pair had been passed to Finish() of an operation of its own, and sets bit i % 8 of
+    // |verified|[i / 8], which the caller has zeroed, if signature i verifies.  A signature that
+    // doesn't verify only leaves its bit clear; any other error fails the whole batch.  Called
+    // after Begin() instead of Update() and Finish().  The work may be spread over |pool|, which
+    // may be null.  Operations that can't verify in batches return KM_ERROR_UNIMPLEMENTED.
+    virtual keymaster_error_t VerifyBatch(const Buffer* /* messages */,
+                                          const Buffer* /* signatures */, size_t /* count */,
+                                          WorkerPool* /* pool */, uint8_t* /* verified */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    // Gives a begun verify operation the |signature| its Finish() is expected to be called with,
+    // so that work depending only on the signature can start, on |pool| if it isn't null, while
+    // the message is still being passed to Update().  Finish() still takes the signature and uses
+    // the early work only if the two match.  Operations with no such work return
+    // KM_ERROR_UNIMPLEMENTED.
+    virtual keymaster_error_t SetEarlySignature(const Buffer& /* signature */,
+                                                WorkerPool* /* pool */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    // Writes what RestoreState() needs to put a new operation, created by the same factory from the
+    // same key and begin parameters, into this begun operation's state.  The state may hold secret
+    // intermediate values, so the caller must protect it.  Operations whose state can't be written
+    // return KM_ERROR_UNIMPLEMENTED.
+    virtual keymaster_error_t SaveState(Buffer* /* state */) const {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    // Puts this new operation into the state SaveState() wrote.  Called instead of Begin().
+    virtual keymaster_error_t RestoreState(const Buffer& /* state */) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    // The key blob and begin parameters the operation was created from, kept only when
+    // AndroidKeymaster may have to hand the operation off to another process (see
+    // AndroidKeymaster::SnapshotOperations()).
+    struct Origin {
+        KeymasterKeyBlob key_blob;
+        AuthorizationSet begin_params;
+    };
+    void set_origin(UniquePtr<Origin> origin) { origin_ = std::move(origin); }
+    const Origin* origin() const { return origin_.get(); }
+
+    // Returns a new operation in the same state as this begun one, with copies of its
+    // authorizations and of whatever input it has digested or buffered, so that messages sharing
+    // a prefix can process it once and fork for each suffix.  The fork has no handle, key ID,
+    // owner or confirmation verifier; the caller sets those.  Operations whose state can't be
+    // copied set |error| to KM_ERROR_UNIMPLEMENTED and return null.
+    virtual OperationPtr Fork(keymaster_error_t* error) const {
+        *error = KM_ERROR_UNIMPLEMENTED;
+        return nullptr;
+    }
+
   protected:
     // Helper function for implementing Finish() methods that need to call Update() to process
     // input, but don't expect any output.
     keymaster_error_t UpdateForFinish(const AuthorizationSet& input_params, const Buffer& input);
-    keymaster_operation_handle_t operation_handle_;
+    // Copies this operation's authorizations, for the constructor of a fork.  Returns false on
+    // allocation failure.
+    bool CopyAuthorizations(AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced) const;
+    // Zero until OperationTable assigns a handle, unless the operation's device supplies one.
+    keymaster_operation_handle_t operation_handle_ = 0;
 
   private:
     const keymaster_purpose_t purpose_;
     AuthorizationSet hw_enforced_;
     AuthorizationSet sw_enforced_;
-    uint64_t key_id_;
+    uint64_t key_id_ = 0;
     uint32_t secure_deletion_slot_ = 0;
-    UniquePtr<Buffer> confirmation_verifier_buffer_;
+    uint32_t owner_ = 0;
+    UniquePtr<ConfirmationVerifier> confirmation_verifier_;
+    UniquePtr<Origin> origin_;
 };
 
 }  // namespace keymaster
@@ -0,0 +1,150 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include <hardware/keymaster_defs.h>
+
+namespace keymaster {
+
+/**
+ * The phases AndroidKeymaster times for each operation.  The first four make up begin().
+ */
+enum class OperationPhase : uint8_t {
+    LOAD_KEY = 0,
+    CREATE_OPERATION = 1,
+    AUTHORIZE = 2,
+    BEGIN = 3,
+    UPDATE = 4,
+    FINISH = 5,
+};
+
+constexpr size_t kOperationPhaseCount = 6;
+
+const char* OperationPhaseName(OperationPhase phase);
+
+struct OperationSpan {
+    OperationPhase phase;
+    // KM_ALGORITHM_* of the key, or zero if the key could not be loaded.
+    keymaster_algorithm_t algorithm;
+    keymaster_purpose_t purpose;
+    int32_t message_version;
+    keymaster_error_t error;
+    uint64_t duration_ns;
+    // Bytes of input handled by UPDATE and FINISH spans, zero for the others.
+    size_t input_length;
+};
+
+/**
+ * OperationMetricsSink receives a span for each phase of each operation, from
+ * KeymasterContext::operation_metrics().  Spans may be recorded concurrently from several threads.
+ *
+ * Instrumentation costs nothing unless a context returns a sink, and is compiled out altogether
+ * when KEYMASTER_DISABLE_OPERATION_METRICS is defined.
+ */
+class OperationMetricsSink {
+  public:
+    virtual ~OperationMetricsSink() {}
+
+    // The clock spans are measured with, in nanoseconds from any fixed point.
+    virtual uint64_t now_ns() const = 0;
+
+    virtual void Record(const OperationSpan& span) = 0;
+};
+
+/**
+ * A lock-free histogram of durations in power-of-two buckets: bucket 0 counts durations below 2ns
+ * and bucket i those in [2^i, 2^(i+1)) ns, except that the last also counts everything longer.
+ */
+class LatencyHistogram {
+  public:
+    static constexpr size_t kBucketCount = 36;  // The last bucket starts at about 34 seconds.
+
+    struct Snapshot {
+        uint64_t buckets[kBucketCount] = {};
+        uint64_t count = 0;
+        uint64_t total_ns = 0;
+        uint64_t total_bytes = 0;
+
+        // Returns the upper bound of the bucket holding the |percentile|th duration, or zero if
+        // the histogram is empty.
+        uint64_t PercentileNs(unsigned percentile) const;
+        uint64_t MeanNs() const { return count ? total_ns / count : 0; }
+    };
+
+    void Record(uint64_t duration_ns, size_t bytes);
+    void Read(Snapshot* snapshot) const;
+    void Reset();
+
+    static size_t BucketFor(uint64_t duration_ns);
+
+  private:
+    std::atomic<uint64_t> buckets_[kBucketCount] = {};
+    std::atomic<uint64_t> total_ns_{0};
+    std::atomic<uint64_t> total_bytes_{0};
+};
+
+/**
+ * HistogramMetricsSink keeps a LatencyHistogram per phase, algorithm and purpose, timed with a
+ * monotonic clock.  Message versions are not distinguished.  Results can be pulled with
+ * GetHistogram() or written to the Logger with LogSummary().
+ *
+ * It also counts bulk 3DES calls, i.e. updates and finishes that handle at least
+ * \p triple_des_bulk_bytes of input, and logs a warning on the first and then at every power of
+ * two, so that clients still pushing bulk data through 3DES can be found and migrated.
+ */
+class HistogramMetricsSink : public OperationMetricsSink {
+  public:
+    static constexpr size_t kDefaultTripleDesBulkBytes = 64 * 1024;
+
+    explicit HistogramMetricsSink(size_t triple_des_bulk_bytes = kDefaultTripleDesBulkBytes)
+        : triple_des_bulk_bytes_(triple_des_bulk_bytes) {}
+
+    uint64_t now_ns() const override;
+    void Record(const OperationSpan& span) override;
+
+    // Returns false if |algorithm| or |purpose| isn't one the sink tracks.
+    bool GetHistogram(OperationPhase phase, keymaster_algorithm_t algorithm,
+                      keymaster_purpose_t purpose, LatencyHistogram::Snapshot* snapshot) const;
+
+    // Logs the CryptoDispatch in use, then count, mean, p50 and p99 of every non-empty histogram,
+    // at INFO level.
+    void LogSummary() const;
+
+    uint64_t triple_des_bulk_calls() const {
+        return triple_des_bulk_calls_.load(std::memory_order_relaxed);
+    }
+
+    void Reset();
+
+  private:
+    // Index zero collects spans whose algorithm is unknown.
+    static constexpr size_t kAlgorithmCount = 6;
+    static constexpr size_t kPurposeCount = KM_PURPOSE_ATTEST_KEY + 1;
+
+    static size_t AlgorithmIndex(keymaster_algorithm_t algorithm);
+
+    LatencyHistogram histograms_[kOperationPhaseCount][kAlgorithmCount][kPurposeCount];
+    const size_t triple_des_bulk_bytes_;
+    std::atomic<uint64_t> triple_des_bulk_calls_{0};
+};
+
+}  // namespace keymaster
@@ -16,6 +16,12 @@
 
 #pragma once
 
+#include <stdint.h>
+
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
 #include <keymaster/UniquePtr.h>
 
 #include <hardware/keymaster_defs.h>
@@ -26,17 +32,248 @@ namespace keymaster {
 class Operation;
 using OperationPtr = UniquePtr<Operation>;
 
+/**
+ * OperationHandleSequence produces the high halves of operation handles by running a counter
+ * through Speck32/64, keyed from the RNG when the sequence is created.  Values are distinct until
+ * the 32-bit counter wraps and can't be predicted without the key, and producing one takes no RNG
+ * call.
+ */
+class OperationHandleSequence {
+  public:
+    OperationHandleSequence();
+
+    // Returns the next value, which is never zero.  Thread-safe.
+    uint32_t Next();
+
+  private:
+    static constexpr size_t kRounds = 22;
+
+    uint32_t Permute(uint32_t value) const;
+
+    uint16_t round_keys_[kRounds];
+    std::atomic<uint32_t> counter_{0};
+};
+
+/**
+ * OperationTable holds the in-flight operations of an AndroidKeymaster instance.
+ *
+ * Operations don't pick their own handles.  When an operation is added with a zero high half, the
+ * table fills it in from its OperationHandleSequence; a non-zero high half is kept.  The table
+ * then replaces the low 32 bits with the index of the slot the operation was stored in and a
+ * per-slot generation counter, so handles of live operations never collide.
+ * Find() and Delete() can then go straight to the slot and compare the full handle, so they run in
+ * constant time and reject handles that refer to an earlier occupant of the slot.
+ *
+ * Operations whose handles are owned by an underlying device (see
+ * Operation::set_operation_handle()) keep their handles and fall back to a linear scan.
+ *
+ * By default Add() fails with KM_ERROR_TOO_MANY_OPERATIONS when every slot is in use.  With LRU
+ * eviction enabled it instead aborts and removes the operation that was least recently added or
+ * touched, and records how long that operation had been idle.
+ *
+ * Operations are also counted per owner (see Operation::set_owner()), so that one caller can't
+ * crowd out the rest.  A caller at the hard quota can't add operations.  When the table is full
+ * and the caller holding the most operations holds more than the soft quota, its least recently
+ * used operation is evicted first, whoever is adding, and whether or not LRU eviction is enabled.
+ *
+ * The table also adds up the memory its operations report (see Operation::MemoryFootprint()).
+ * With a memory budget set, Add() refuses operations while the table is over budget, and
+ * UpdateFootprint() tells the caller when an operation's buffering has taken it over.
+ *
+ * ReapIdle() aborts and removes operations that have sat idle for too long, which frees the slots
+ * and buffered data of operations whose clients went away without aborting them.
+ *
+ * The table has a fixed number of slots unless adaptive sizing is set up with set_adaptive_size().
+ * It then starts at the minimum size and grows a segment at a time when it fills, before anything
+ * is evicted, up to the maximum.  Once per window it shrinks by a segment if the most operations
+ * it held at once during the window would still have left room, and the last segment is empty.
+ */
 class OperationTable {
   public:
-    explicit OperationTable(size_t table_size) : table_size_(table_size) {}
+    struct EvictionStats {
+        uint64_t evicted_count = 0;
+        // Idle time of evicted operations, in the units of the |now_ms| values passed to Add() and
+        // Touch().
+        uint64_t total_evicted_age_ms = 0;
+        uint64_t max_evicted_age_ms = 0;
+        // Add() calls refused because the owner was at its hard quota.
+        uint64_t quota_rejected_count = 0;
+    };
+
+    struct SizingStats {
+        uint64_t grow_count = 0;
+        uint64_t shrink_count = 0;
+        // Most operations the table has held at once.
+        size_t high_water = 0;
+    };
 
-    keymaster_error_t Add(OperationPtr&& operation);
-    Operation* Find(keymaster_operation_handle_t op_handle);
-    bool Delete(keymaster_operation_handle_t);
+    struct MemoryStats {
+        size_t footprint = 0;
+        size_t peak_footprint = 0;
+        // Operations refused or dropped because the table was over its memory budget.
+        uint64_t over_budget_count = 0;
+    };
+
+    // Opaque per-call state for Checkout() and Checkin().
+    struct Lease {
+        void* token = nullptr;
+    };
+
+    explicit OperationTable(size_t table_size);
+    virtual ~OperationTable();
+
+    virtual keymaster_error_t Add(OperationPtr&& operation, uint64_t now_ms);
+    virtual Operation* Find(keymaster_operation_handle_t op_handle);
+    virtual bool Delete(keymaster_operation_handle_t);
+
+    // Marks the operation as most recently used.  Returns false if |op_handle| is not in the
+    // table.
+    virtual bool Touch(keymaster_operation_handle_t op_handle, uint64_t now_ms);
+
+    // Aborts and removes every operation that has not been added or touched for more than
+    // |max_idle_ms|, and returns how many there were.
+    virtual size_t ReapIdle(uint64_t now_ms, uint64_t max_idle_ms);
+
+    // Appends the handles of the operations in the table to |handles|, in no particular order.
+    virtual void GetHandles(std::vector<keymaster_operation_handle_t>* handles) const;
+
+    // Sets |*last_used_ms| to the time the operation was last added or touched.  Returns false if
+    // |op_handle| is not in the table.
+    bool LastUsed(keymaster_operation_handle_t op_handle, uint64_t* last_used_ms) const;
+
+    // Re-reads the memory footprint of the operation, which should be done after each update.
+    // Returns false if the table is now over its memory budget, in which case the caller should
+    // delete the operation.
+    virtual bool UpdateFootprint(keymaster_operation_handle_t op_handle);
+
+    // Finds an operation for the duration of an update, finish or abort call.  Tables that allow
+    // concurrent access give the caller exclusive use of the operation until Checkin() is called
+    // with the same |lease|.  The caller may Delete() the operation while it is checked out, but
+    // must still call Checkin().  This table is not thread-safe and Checkout() is just Find().
+    virtual Operation* Checkout(keymaster_operation_handle_t op_handle, Lease* /* lease */) {
+        return Find(op_handle);
+    }
+    virtual void Checkin(Lease* /* lease */) {}
+    // Like Checkout(), but doesn't wait for another caller to check the operation in.  Returns
+    // null, setting |*busy|, if the operation is checked out.
+    virtual Operation* TryCheckout(keymaster_operation_handle_t op_handle, Lease* lease,
+                                   bool* busy) {
+        *busy = false;
+        return Checkout(op_handle, lease);
+    }
+
+    void set_evict_lru(bool evict_lru) { evict_lru_ = evict_lru; }
+    bool evict_lru() const { return evict_lru_; }
+    const EvictionStats& eviction_stats() const { return eviction_stats_; }
+
+    // Per-owner operation limits.  Zero, the default, means no limit.
+    void set_quotas(size_t soft_quota, size_t hard_quota) {
+        soft_quota_ = soft_quota;
+        hard_quota_ = hard_quota;
+    }
+    size_t soft_quota() const { return soft_quota_; }
+    size_t hard_quota() const { return hard_quota_; }
+    // Number of operations in the table that belong to |owner|.
+    virtual size_t owner_count(uint32_t owner) const;
+
+    // Limit on the total memory footprint of the table's operations.  Zero, the default, means no
+    // limit.
+    void set_memory_budget(size_t bytes) { memory_budget_ = bytes; }
+    size_t memory_budget() const { return memory_budget_; }
+    MemoryStats memory_stats() const;
+    // Operations removed by ReapIdle() over the table's lifetime.
+    uint64_t reaped_count() const { return reaped_count_; }
+
+    // Lets the table grow from |min_size| slots to |max_size|, |segment_size| slots at a time, and
+    // shrink back when a whole |window_ms| passes in which it held at most all but a segment's
+    // worth of operations at once.  |window_ms| is in the units of the |now_ms| values passed to
+    // Add().  Takes effect at the first Add() if called before it; a table already in use is
+    // brought into range as it resizes.  Returns KM_ERROR_INVALID_ARGUMENT, changing nothing, if
+    // |min_size|, |segment_size| or |window_ms| is zero or |max_size| is below |min_size|, and
+    // KM_ERROR_UNIMPLEMENTED if the table can't be resized.
+    virtual keymaster_error_t set_adaptive_size(size_t min_size, size_t max_size,
+                                                size_t segment_size, uint64_t window_ms);
+    bool adaptive_size() const { return segment_size_ != 0; }
+    const SizingStats& sizing_stats() const { return sizing_stats_; }
+
+    // The number of slots, which only changes with adaptive sizing.
+    size_t table_size() const { return table_size_; }
+    // The most operations the table can ever hold.
+    size_t max_table_size() const { return adaptive_size() ? max_size_ : table_size_; }
+
+    // Gives |operation| a high handle half from this table's sequence, unless it already has one.
+    // Add() does this itself; operations that never enter the table, such as one-shot ones, need
+    // it so that per-operation auth tokens are checked against an unpredictable, non-zero handle.
+    void AssignHandleHighHalf(Operation* operation);
+
+  protected:
+    void CountReaped(size_t count) { reaped_count_ += count; }
+    // Records a change in the total footprint from |removed| bytes to |added| bytes.
+    void AdjustFootprint(size_t removed, size_t added);
+    bool over_budget() const { return memory_budget_ && footprint_ > memory_budget_; }
+    void CountOverBudget() { ++over_budget_count_; }
+    void CountQuotaRejected() { ++eviction_stats_.quota_rejected_count; }
 
   private:
-    UniquePtr<OperationPtr[]> table_;
+    static constexpr uint32_t kNil = UINT32_MAX;
+
+    struct Slot {
+        OperationPtr operation;
+        uint64_t last_used_ms = 0;
+        // Links in the recency list, least recently used first.
+        uint32_t prev = kNil;
+        uint32_t next = kNil;
+        uint32_t owner = 0;
+        size_t footprint = 0;
+        uint16_t generation = 0;
+        bool tagged = false;
+    };
+
+    bool Initialize();
+    // Adds a segment of slots, if the maximum size allows.  Returns false if it doesn't, or on
+    // allocation failure.
+    bool Grow();
+    // Ends the sizing window if |window_ms_| has passed, removing a segment if the window showed
+    // it isn't needed.
+    void MaybeShrink(uint64_t now_ms);
+    // Moves the slots and free list into arrays of |new_size| slots, which must not cut off any
+    // occupied slot.
+    bool Resize(size_t new_size);
+    size_t FindSlot(keymaster_operation_handle_t op_handle) const;
+    void Release(size_t slot);
+    // Evicts an operation if the quotas or LRU eviction allow it.
+    void MakeRoom(uint64_t now_ms);
+    void Evict(size_t slot, uint64_t now_ms);
+    void LinkMostRecent(size_t slot);
+    void Unlink(size_t slot);
+
+    UniquePtr<Slot[]> table_;
+    UniquePtr<uint16_t[]> free_slots_;
+    size_t free_count_ = 0;
+    size_t untagged_count_ = 0;
     size_t table_size_;
+    size_t min_size_ = 0;
+    size_t max_size_ = 0;
+    size_t segment_size_ = 0;
+    uint64_t window_ms_ = 0;
+    uint64_t window_start_ms_ = 0;
+    bool window_started_ = false;
+    // Most operations held at once in the current sizing window.
+    size_t window_high_water_ = 0;
+    SizingStats sizing_stats_;
+    uint32_t lru_head_ = kNil;
+    uint32_t lru_tail_ = kNil;
+    bool evict_lru_ = false;
+    size_t soft_quota_ = 0;
+    size_t hard_quota_ = 0;
+    std::unordered_map<uint32_t, size_t> owner_counts_;
+    EvictionStats eviction_stats_;
+    std::atomic<uint64_t> reaped_count_{0};
+    size_t memory_budget_ = 0;
+    std::atomic<size_t> footprint_{0};
+    std::atomic<size_t> peak_footprint_{0};
+    std::atomic<uint64_t> over_budget_count_{0};
+    OperationHandleSequence handle_sequence_;
 };
 
 }  // namespace keymaster
@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/key.h>
+#include <keymaster/key_policy.h>
+#include <keymaster/keymaster_enforcement.h>
+
+namespace keymaster {
+
+/**
+ * ParsedKeyCache holds the decrypted contents of recently parsed key blobs, so that a context can
+ * skip key-encryption-key derivation, decryption and deserialization when the same blob is loaded
+ * again.
+ *
+ * Entries are keyed by the key ID of the blob (see KeymasterEnforcement::CreateKeyId()), but a hit
+ * also requires the full blob and the hidden authorizations it was parsed with to match, so a
+ * truncated-hash collision or a different APPLICATION_ID/APPLICATION_DATA never returns the wrong
+ * key.  The cache is bounded both in entries and in bytes, and evicts the least recently used entry
+ * when either limit is exceeded.  Key material is zeroed when an entry is evicted or invalidated.
+ *
+ * Entries are also indexed by a fingerprint of the blob's length and ends, so that FindKeyId() can
+ * recover a cached blob's key ID without hashing all of it.
+ *
+ * Optionally, entries evicted for space move to a larger second, sealed level instead of being
+ * dropped.  A sealed entry keeps the parsed authorizations, policy and derived data, but only a
+ * SHA-256 digest of the blob, and its key material is encrypted with AES-256-GCM under a random key
+ * generated when the cache first seals anything, and never stored.  A sealed hit costs one GCM open
+ * instead of key-encryption-key derivation and a full parse, and moves the entry back to the first
+ * level.
+ *
+ * ParsedKeyCache is not thread-safe.
+ */
+class ParsedKeyCache {
+  public:
+    // The sealed level is bounded by |max_sealed_entries| and |max_sealed_bytes|, and is disabled
+    // if either is zero.
+    ParsedKeyCache(size_t max_entries, size_t max_bytes, size_t max_sealed_entries = 0,
+                   size_t max_sealed_bytes = 0)
+        : max_entries_(max_entries), max_bytes_(max_bytes),
+          max_sealed_entries_(max_sealed_bytes ? max_sealed_entries : 0),
+          max_sealed_bytes_(max_sealed_bytes) {}
+
+    // Returns true and copies out the cached contents if |blob| was cached with the same |hidden|
+    // authorizations.  If |policy| is non-null it receives the key's policy, compiled from the
+    // cached authorizations when the entry was inserted.  If |derived_data| is non-null it
+    // receives the entry's DerivedKeyData, for Key::set_derived_data().  The authorization sets
+    // returned share the cached ones' storage (see AuthorizationSet::Share()) until they are
+    // modified.
+    bool Find(km_id_t key_id, const KeymasterKeyBlob& blob, const AuthorizationSet& hidden,
+              KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced,
+              AuthorizationSet* sw_enforced, KeyPolicy* policy = nullptr,
+              std::shared_ptr<DerivedKeyData>* derived_data = nullptr);
+
+    // As above, with the hidden authorizations already serialized (see HiddenAuthorizationsCache).
+    bool Find(km_id_t key_id, const KeymasterKeyBlob& blob, const KeymasterBlob& serialized_hidden,
+              KeymasterKeyBlob* key_material, AuthorizationSet* hw_enforced,
+              AuthorizationSet* sw_enforced, KeyPolicy* policy = nullptr,
+              std::shared_ptr<DerivedKeyData>* derived_data = nullptr);
+
+    // Caches the parsed contents of |blob|, replacing any entry with the same |key_id|, and
+    // compiles its policy.  Fails silently if the entry does not fit or cannot be allocated.  If
+    // |derived_data| is non-null it receives the new entry's DerivedKeyData, or null on failure.
+    // Derived data fills in later and isn't counted against the byte limit; it's public and small.
+    void Insert(km_id_t key_id, const KeymasterKeyBlob& blob, const AuthorizationSet& hidden,
+                const KeymasterKeyBlob& key_material, const AuthorizationSet& hw_enforced,
+                const AuthorizationSet& sw_enforced,
+                std::shared_ptr<DerivedKeyData>* derived_data = nullptr);
+
+    // As above, with the hidden authorizations already serialized.
+    void Insert(km_id_t key_id, const KeymasterKeyBlob& blob,
+                const KeymasterBlob& serialized_hidden, const KeymasterKeyBlob& key_material,
+                const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
+                std::shared_ptr<DerivedKeyData>* derived_data = nullptr);
+
+    // Returns true and sets |key_id| to the ID |blob| was cached under, if it is cached.  Costs a
+    // comparison of the blob rather than the hash CreateKeyId() computes.
+    bool FindKeyId(const KeymasterKeyBlob& blob, km_id_t* key_id) const;
+
+    void Invalidate(km_id_t key_id);
+    void Clear();
+
+    size_t size() const { return index_.size(); }
+    size_t bytes() const { return bytes_; }
+    size_t sealed_size() const { return sealed_index_.size(); }
+    size_t sealed_bytes() const { return sealed_bytes_; }
+    // Find() calls that did and didn't return an entry, and the hits served from the sealed level.
+    uint64_t hits() const { return hits_; }
+    uint64_t misses() const { return misses_; }
+    uint64_t sealed_hits() const { return sealed_hits_; }
+
+  private:
+    struct Entry {
+        km_id_t key_id;
+        KeymasterKeyBlob blob;
+        KeymasterBlob hidden;
+        KeymasterKeyBlob key_material;
+        AuthorizationSet hw_enforced;
+        AuthorizationSet sw_enforced;
+        KeyPolicy policy;
+        size_t bytes;
+        std::shared_ptr<DerivedKeyData> derived_data;
+        uint64_t fingerprint;
+    };
+    using EntryList = std::list<Entry>;
+
+    static constexpr size_t kBlobDigestLength = 32;
+    using BlobDigest = uint8_t[kBlobDigestLength];
+
+    struct SealedEntry {
+        km_id_t key_id;
+        BlobDigest blob_digest;
+        KeymasterBlob hidden;
+        // Key material ciphertext followed by the GCM tag, sealed with nonce |nonce|.
+        KeymasterBlob sealed_material;
+        uint64_t nonce;
+        AuthorizationSet hw_enforced;
+        AuthorizationSet sw_enforced;
+        KeyPolicy policy;
+        size_t bytes;
+        std::shared_ptr<DerivedKeyData> derived_data;
+        uint64_t fingerprint;
+    };
+    using SealedEntryList = std::list<SealedEntry>;
+
+    // Both blob formats start with a per-key nonce or key material and end with a tag or the
+    // authorizations, so their first and last bytes tell keys apart without reading the middle.
+    static uint64_t Fingerprint(const KeymasterKeyBlob& blob);
+    // The bytes |entry| counts against the first level's limit.
+    static size_t EntryBytes(const Entry& entry);
+
+    bool FindEntry(km_id_t key_id, const KeymasterKeyBlob& blob,
+                   const KeymasterBlob& serialized_hidden, KeymasterKeyBlob* key_material,
+                   AuthorizationSet* hw_enforced, AuthorizationSet* sw_enforced, KeyPolicy* policy,
+                   std::shared_ptr<DerivedKeyData>* derived_data);
+    void Erase(EntryList::iterator entry);
+    // Makes room for and adds |entry| to the first level, sealing the entries it evicts.
+    void Admit(Entry&& entry);
+
+    // Moves |entry| from the first level to the sealed one, or just drops it if it can't be
+    // sealed.
+    void Seal(EntryList::iterator entry);
+    // If |key_id| is sealed with the same |blob| and |serialized_hidden|, opens it and moves it
+    // back to the first level.  Returns false otherwise.
+    bool Unseal(km_id_t key_id, const KeymasterKeyBlob& blob,
+                const KeymasterBlob& serialized_hidden);
+    void EraseSealed(SealedEntryList::iterator entry);
+    bool InitSealingKey();
+
+    const size_t max_entries_;
+    const size_t max_bytes_;
+    const size_t max_sealed_entries_;
+    const size_t max_sealed_bytes_;
+    size_t bytes_ = 0;
+    size_t sealed_bytes_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t sealed_hits_ = 0;
+    // Most recently used first.
+    EntryList entries_;
+    std::unordered_map<km_id_t, EntryList::iterator> index_;
+    // The most recently inserted entry with each fingerprint.
+    std::unordered_map<uint64_t, EntryList::iterator> fingerprint_index_;
+
+    // Most recently sealed first.
+    SealedEntryList sealed_entries_;
+    std::unordered_map<km_id_t, SealedEntryList::iterator> sealed_index_;
+    std::unordered_map<uint64_t, SealedEntryList::iterator> sealed_fingerprint_index_;
+    // Empty until the first entry is sealed.  Nonces count up from zero under it.
+    KeymasterKeyBlob sealing_key_;
+    uint64_t next_nonce_ = 0;
+};
+
+}  // namespace keymaster
@@ -16,6 +16,8 @@
 
 #pragma once
 
+#include <vector>
+
 #include <keymaster/secure_key_storage.h>
 
 namespace keymaster {
@@ -46,6 +48,11 @@ class PureSoftSecureKeyStorage : public SecureKeyStorage {
      */
     keymaster_error_t DeleteKey(const km_id_t keyid) override;
 
+    /**
+     * Deletes the key blobs with the given key ids from pure software secure key storage.
+     */
+    keymaster_error_t DeleteKeys(const km_id_t* keyids, size_t count) override;
+
     /**
      * Deletes all the key blob from pure software secure key storage.
      */
@@ -56,6 +63,19 @@ class PureSoftSecureKeyStorage : public SecureKeyStorage {
      */
     keymaster_error_t HasSlot(bool* has_slot) override;
 
+    /**
+     * Writes a compact snapshot of the stored key IDs to `snapshot`, so that the emulated
+     * storage can be persisted and restored with LoadSnapshot().
+     */
+    keymaster_error_t Snapshot(std::vector<uint8_t>* snapshot) const;
+
+    /**
+     * Replaces the stored key IDs with those in a snapshot produced by Snapshot().  Fails with
+     * KM_ERROR_INVALID_ARGUMENT, leaving the storage unchanged, if the snapshot is malformed or
+     * holds more keys than the storage has slots.
+     */
+    keymaster_error_t LoadSnapshot(const uint8_t* snapshot, size_t size);
+
   private:
     PureSoftSecureStorageMap* pure_soft_secure_storage_map_;
 };
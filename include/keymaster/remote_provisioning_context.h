@@ -35,6 +35,11 @@ class RemoteProvisioningContext {
     virtual std::vector<uint8_t> DeriveBytesFromHbk(const std::string& context,
                                                     size_t numBytes) const = 0;
     virtual std::unique_ptr<cppbor::Map> CreateDeviceInfo(uint32_t csrVersion) const = 0;
+    // The encoding of CreateDeviceInfo(csrVersion).  Contexts that cache DeviceInfo can override
+    // this to skip building and encoding the map.
+    virtual std::vector<uint8_t> CreateEncodedDeviceInfo(uint32_t csrVersion) const {
+        return CreateDeviceInfo(csrVersion)->encode();
+    }
     virtual cppcose::ErrMsgOr<std::vector<uint8_t>>
     BuildProtectedDataPayload(bool testMode,                       //
                               const std::vector<uint8_t>& macKey,  //
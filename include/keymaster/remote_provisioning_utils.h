@@ -21,6 +21,7 @@
 
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/cppcose/cppcose.h>
+#include <keymaster/worker_pool.h>
 
 namespace keymaster {
 
@@ -69,9 +70,16 @@ template <typename T> class StatusOr {
 StatusOr<std::pair<std::vector<uint8_t> /* EEK pub */, std::vector<uint8_t> /* EEK ID */>>
 validateAndExtractEekPubAndId(bool testMode, const KeymasterBlob& endpointEncryptionCertChain);
 
+/**
+ * Checks the MAC and contents of each of the |numKeys| COSE_Mac0 MACed public keys in |keysToSign|
+ * and returns the array of their COSE_Keys.  With |threadCount| greater than one the keys are
+ * checked in parallel on |pool|, so |macFunction| must be safe to call from several threads at
+ * once.  If several keys are bad, the error for the first of them is returned.
+ */
 StatusOr<cppbor::Array /* pubkeys */>
 validateAndExtractPubkeys(bool testMode, uint32_t numKeys, KeymasterBlob* keysToSign,
-                          const cppcose::HmacSha256Function& macFunction);
+                          const cppcose::HmacSha256Function& macFunction, size_t threadCount = 1,
+                          WorkerPool* pool = DefaultWorkerPool());
 
 cppbor::Array buildCertReqRecipients(const std::vector<uint8_t>& pubkey,
                                      const std::vector<uint8_t>& kid);
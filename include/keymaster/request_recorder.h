@@ -0,0 +1,79 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hardware/keymaster_defs.h>
+
+#include <keymaster/android_keymaster_messages.h>
+
+namespace keymaster {
+
+class AuthorizationSet;
+
+/**
+ * What AndroidKeymaster saw of one request, handed to a RequestRecorder once it has been handled.
+ * Pointers are only valid for the duration of RequestRecorder::Record() and are null when they
+ * don't apply.  Nothing here is redacted; that is the recorder's job.
+ */
+struct RecordedRequest {
+    AndroidKeymasterCommand command;
+    int32_t message_version;
+    // When the request arrived, on the recorder's clock, and how long it took to handle.
+    uint64_t arrival_ns;
+    uint64_t duration_ns;
+    keymaster_error_t error;
+
+    // The key blob the request names, and that key's characteristics if they were loaded.
+    const keymaster_key_blob_t* key_blob;
+    const AuthorizationSet* key_hw_enforced;
+    const AuthorizationSet* key_sw_enforced;
+    // The key blob a generate, import or upgrade produced.
+    const keymaster_key_blob_t* created_key_blob;
+
+    // The operation a begin started, or an update, finish or abort continued.
+    keymaster_operation_handle_t op_handle;
+    keymaster_purpose_t purpose;
+    keymaster_key_format_t key_format;
+    // Key description, begin, update, finish, attestation or upgrade parameters.
+    const AuthorizationSet* params;
+    // Bytes of input data or imported key material.
+    size_t input_length;
+};
+
+/**
+ * RequestRecorder receives a RecordedRequest for each key and operation request an
+ * AndroidKeymaster handles, once set with AndroidKeymaster::set_request_recorder().  Requests may
+ * be recorded concurrently from several threads, in the order they complete rather than arrive.
+ *
+ * Recording costs nothing unless a recorder is set, and is compiled out altogether when
+ * KEYMASTER_DISABLE_REQUEST_RECORDING is defined.
+ */
+class RequestRecorder {
+  public:
+    virtual ~RequestRecorder() {}
+
+    // The clock arrival times and durations are measured with, in nanoseconds from any fixed
+    // point.
+    virtual uint64_t now_ns() const = 0;
+
+    virtual void Record(const RecordedRequest& request) = 0;
+};
+
+}  // namespace keymaster
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/request_recorder.h>
+#include <keymaster/serializable.h>
+
+namespace keymaster {
+
+/**
+ * One request of a trace written by RequestTraceWriter, with nothing secret left in it.  Key blobs
+ * and operation handles are replaced by small ids, assigned in the order they are first seen, and
+ * the value of every bytes and bignum parameter by as many zeros, except for the certificate
+ * subject and serial.  Input data and imported key material are reduced to their lengths.
+ */
+struct TraceRecord : public Serializable {
+    size_t SerializedSize() const override;
+    uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const override;
+    bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) override;
+
+    AndroidKeymasterCommand command = GENERATE_KEY;
+    int32_t message_version = 0;
+    // Microseconds from the start of the trace to the request's arrival, and taken to handle it.
+    uint64_t arrival_us = 0;
+    uint64_t duration_us = 0;
+    keymaster_error_t error = KM_ERROR_OK;
+    // The key the request names and the key it created, or zero.
+    uint32_t key_id = 0;
+    uint32_t created_key_id = 0;
+    // The operation the request started or continued, or zero.
+    uint32_t op_id = 0;
+    keymaster_purpose_t purpose = KM_PURPOSE_ENCRYPT;
+    keymaster_key_format_t key_format = KM_KEY_FORMAT_X509;
+    uint64_t input_length = 0;
+    AuthorizationSet params;
+    // The characteristics of key |key_id|, in the first record that names a key the trace didn't
+    // create and whose characteristics were loaded.  Empty otherwise.
+    AuthorizationSet key_characteristics;
+};
+
+/**
+ * RequestTraceWriter is a RequestRecorder that redacts each request into a TraceRecord and appends
+ * it to a file.  The file starts with a header and then holds each record, prefixed with its
+ * length as a varint, in the order the requests completed.  Arrival times are measured from the
+ * writer's construction.
+ *
+ * Ids are assigned by digest, so the writer keeps nothing secret itself.  It is thread-safe.
+ */
+class RequestTraceWriter : public RequestRecorder {
+  public:
+    // |file| must outlive the writer, which neither flushes nor closes it.
+    explicit RequestTraceWriter(FILE* file);
+
+    uint64_t now_ns() const override;
+    void Record(const RecordedRequest& request) override;
+
+    // Records lost to write or allocation failures.
+    size_t dropped() const;
+
+  private:
+    // Returns the id of |key_blob|, assigning a new one if it hasn't been seen.
+    uint32_t KeyId(const keymaster_key_blob_t& key_blob);
+
+    // Guards everything below.
+    mutable std::mutex mutex_;
+    FILE* file_;
+    const uint64_t start_ns_;
+    bool header_written_ = false;
+    size_t dropped_ = 0;
+    // By SHA-256 digest of the blob.
+    std::map<std::string, uint32_t> key_ids_;
+    // Keys created in the trace or whose characteristics have been recorded.
+    std::vector<bool> key_described_;
+    std::map<keymaster_operation_handle_t, uint32_t> op_ids_;
+    uint32_t next_op_id_ = 1;
+};
+
+// The header of a trace file: a magic number and a format version, each a little-endian uint32.
+constexpr uint32_t kRequestTraceMagic = 0x54524d4b;  // "KMRT"
+constexpr uint32_t kRequestTraceVersion = 1;
+constexpr size_t kRequestTraceHeaderSize = 8;
+
+/**
+ * Parses the trace file contents in |data| into |records|, sorted by arrival time.  Returns false
+ * if the header is wrong or a record is malformed; records before it are kept.  A record cut short
+ * at the end of the file, as left by a recorder that was killed, ends the trace without error.
+ */
+bool ReadRequestTrace(const uint8_t* data, size_t size, std::vector<TraceRecord>* records);
+
+}  // namespace keymaster
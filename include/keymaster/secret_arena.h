@@ -0,0 +1,123 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+
+namespace keymaster {
+
+/**
+ * SecretArena holds secrets, such as decrypted key material, apart from the general heap.  Its
+ * memory comes in chunks mapped between inaccessible guard pages, locked into RAM where the
+ * process's RLIMIT_MEMLOCK allows and excluded from core dumps.  Each chunk is cut into equal
+ * slots of one size class, from kMinAllocation to kMaxAllocation bytes, and freed slots are zeroed
+ * and reused, so after warm-up a key load neither faults in fresh pages nor touches the heap.
+ *
+ * Chunks are never unmapped before the arena is destroyed, which is what lets Owns() run without
+ * the lock.  SecretArena is thread-safe.  It is only available on Linux; elsewhere Allocate()
+ * always fails and callers fall back to the heap.
+ */
+class SecretArena {
+  public:
+    static constexpr size_t kMinAllocation = 64;
+    static constexpr size_t kMaxAllocation = 4096;
+    static constexpr size_t kChunkSize = 64 * 1024;
+    static constexpr size_t kMaxChunks = 64;
+
+    struct Stats {
+        size_t bytes_in_use = 0;     // In whole slots.
+        size_t high_water_mark = 0;  // Largest bytes_in_use so far.
+        size_t chunks = 0;           // Each kChunkSize bytes.
+        size_t locked_chunks = 0;    // Chunks that mlock() succeeded on.
+    };
+
+    SecretArena() = default;
+    // Unmaps all chunks.  Nothing allocated from the arena may be used afterwards.
+    ~SecretArena();
+
+    SecretArena(const SecretArena&) = delete;
+    void operator=(const SecretArena&) = delete;
+
+    // Returns a slot of at least |size| bytes, or null if |size| exceeds kMaxAllocation or the
+    // arena is out of chunks.
+    void* Allocate(size_t size);
+
+    // Zeroes the first |size| bytes of |ptr|, which must have come from Allocate(), and returns
+    // its slot to the arena.
+    void Free(void* ptr, size_t size);
+
+    // Returns true if |ptr| points into one of the arena's chunks.
+    bool Owns(const void* ptr) const;
+
+    Stats stats() const;
+
+  private:
+    static constexpr size_t kClassCount = 7;  // kMinAllocation << i for i < kClassCount.
+
+    struct Chunk {
+        uint8_t* data = nullptr;
+        size_t slot_size = 0;
+        bool locked = false;
+    };
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    // Maps a chunk for size class |size_class| and puts its slots on the free list.
+    bool AddChunk(size_t size_class);
+    const Chunk* FindChunk(const void* ptr) const;
+
+    // Written under |mutex_| before |chunk_count_| is advanced past them, and then never again.
+    Chunk chunks_[kMaxChunks];
+    std::atomic<size_t> chunk_count_{0};
+
+    // Guards everything below.
+    mutable std::mutex mutex_;
+    FreeSlot* free_slots_[kClassCount] = {};
+    Stats stats_;
+};
+
+/**
+ * Returns the process-wide SecretArena, created on first use and never destroyed, or null where
+ * none is available.
+ */
+SecretArena* DefaultSecretArena();
+
+/**
+ * Allocates |size| bytes for a secret from the default SecretArena, or from the heap if it
+ * can't.  Returns null on failure.
+ */
+uint8_t* NewSecretArray(size_t size);
+
+/**
+ * Zeroes the |size| bytes at |ptr| and frees them, to the default SecretArena if they came from
+ * it and with delete[] otherwise.
+ */
+void DeleteSecretArray(uint8_t* ptr, size_t size);
+
+/**
+ * Returns true if |ptr| is in the default SecretArena, which means it must not be freed with
+ * delete[].
+ */
+bool IsSecretArray(const void* ptr);
+
+}  // namespace keymaster
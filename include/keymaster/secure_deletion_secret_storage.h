@@ -85,6 +85,22 @@ class SecureDeletionSecretStorage {
      */
     virtual void DeleteKey(uint32_t key_slot) const = 0;
 
+    /**
+     * Delete the secure deletion data in `count` key slots.  Implementations should erase them
+     * all in a single storage write; the default deletes them one at a time.
+     */
+    virtual void DeleteKeys(const uint32_t* key_slots, size_t count) const {
+        for (size_t i = 0; i < count; ++i) {
+            DeleteKey(key_slots[i]);
+        }
+    }
+
+    /**
+     * Returns true if the storage may be called concurrently, without the keymaster's context
+     * lock.  Concurrent single-use key deletions can then share a storage write.
+     */
+    virtual bool is_thread_safe() const { return false; }
+
     /**
      * Deletes the secure deletion data file, deleting all secure deletion secrets and the factory
      * reset secret.
@@ -53,6 +53,20 @@ class SecureKeyStorage {
      */
     virtual keymaster_error_t DeleteKey(const km_id_t keyid) = 0;
 
+    /**
+     * Deletes the key blobs with the |count| key ids in |keyids|.  Storage that supports
+     * transactions should override this to remove them all in a single one.  The default deletes
+     * them one at a time, carrying on past failures, and returns the first error.
+     */
+    virtual keymaster_error_t DeleteKeys(const km_id_t* keyids, size_t count) {
+        keymaster_error_t first_error = KM_ERROR_OK;
+        for (size_t i = 0; i < count; ++i) {
+            keymaster_error_t error = DeleteKey(keyids[i]);
+            if (first_error == KM_ERROR_OK) first_error = error;
+        }
+        return first_error;
+    }
+
     /**
      * Deletes all the key blob from secure key storage.
      */
@@ -62,6 +76,12 @@ class SecureKeyStorage {
      * Checks if the secure key storage still has available slot. On success, writes to has_slot.
      */
     virtual keymaster_error_t HasSlot(bool* has_slot) = 0;
+
+    /**
+     * Returns true if the storage may be called concurrently, without the keymaster's context
+     * lock.  Concurrent single-use key deletions can then share a storage write.
+     */
+    virtual bool is_thread_safe() const { return false; }
 };
 
 }  // namespace keymaster
@@ -16,20 +16,25 @@
 
 #pragma once
 
+#include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <iterator>
+#include <type_traits>
 #include <utility>
 
 #include <keymaster/UniquePtr.h>
+#include <keymaster/arena.h>
 #include <keymaster/logger.h>
 #include <keymaster/mem.h>
 
 namespace keymaster {
 
+class SerializationSink;
+
 class Serializable {
   public:
     Serializable() {}
@@ -53,6 +58,14 @@ class Serializable {
      */
     virtual bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end) = 0;
 
+    /**
+     * Serialize this object into \p sink, producing the same bytes as Serialize().  Large payloads
+     * may be referenced rather than copied, so they must stay unmodified until the sink's segments
+     * have been consumed.  The default implementation copies the output of Serialize().  Returns
+     * false on allocation failure.
+     */
+    virtual bool SerializeTo(SerializationSink* sink) const;
+
     // Disallow copying and assignment.
     Serializable(const Serializable&) = delete;
     Serializable& operator=(const Serializable&) = delete;
@@ -62,6 +75,85 @@ class Serializable {
     Serializable& operator=(Serializable&&) = default;
 };
 
+/**
+ * SerializationSink collects a serialized representation as a list of (pointer, length) segments,
+ * for transports that can gather their output from several buffers.  Small fields are copied into
+ * scratch storage, and runs of copied bytes are coalesced into a single segment.  Payloads of at
+ * least the reference threshold are referenced in place, which saves copying multi-kilobyte
+ * certificate chains and operation outputs.
+ *
+ * All storage comes from \p arena, if one is given, or from an arena owned by the sink.  Once an
+ * allocation fails every further write fails, so callers may check ok() just once at the end.
+ */
+class SerializationSink {
+  public:
+    struct Segment {
+        const uint8_t* data;
+        size_t length;
+    };
+
+    static constexpr size_t kDefaultReferenceThreshold = 256;
+
+    explicit SerializationSink(Arena* arena = nullptr,
+                               size_t reference_threshold = kDefaultReferenceThreshold)
+        : arena_(arena ? arena : &own_arena_), reference_threshold_(reference_threshold) {}
+
+    SerializationSink(const SerializationSink&) = delete;
+    void operator=(const SerializationSink&) = delete;
+
+    // Copies \p data_len bytes from \p data.
+    bool Write(const void* data, size_t data_len);
+
+    template <typename T> bool WriteUint32(T value) {
+        uint32_t val = static_cast<uint32_t>(value);
+        return Write(&val, sizeof(val));
+    }
+
+    // References \p data, or copies it if it is shorter than the reference threshold.
+    bool WriteReference(const void* data, size_t data_len);
+
+    // The sink equivalent of append_size_and_data_to_buf().
+    bool WriteSizeAndData(const void* data, size_t data_len) {
+        return WriteUint32(data_len) && WriteReference(data, data_len);
+    }
+
+    /**
+     * Appends \p len bytes of scratch storage, which the caller must fill before the segments are
+     * consumed, and returns a pointer to them.  Returns nullptr if \p len is zero or on allocation
+     * failure.
+     */
+    uint8_t* Reserve(size_t len);
+
+    const Segment* segments() const { return segments_; }
+    size_t segment_count() const { return segment_count_; }
+    // Total number of bytes in all segments.
+    size_t size() const { return size_; }
+    bool ok() const { return ok_; }
+
+    /**
+     * Copies the segments into the provided buffer.  Returns a pointer to the byte after the last
+     * written, or \p buf if the segments don't fit.
+     */
+    uint8_t* Flatten(uint8_t* buf, const uint8_t* end) const;
+
+  private:
+    static constexpr size_t kScratchChunkSize = 512;
+
+    bool AddSegment(const uint8_t* data, size_t length);
+
+    Arena own_arena_;
+    Arena* arena_;
+    size_t reference_threshold_;
+    Segment* segments_ = nullptr;
+    size_t segment_count_ = 0;
+    size_t segment_capacity_ = 0;
+    uint8_t* scratch_ = nullptr;
+    size_t scratch_used_ = 0;
+    size_t scratch_capacity_ = 0;
+    size_t size_ = 0;
+    bool ok_ = true;
+};
+
 /*
  * Utility functions for writing Serialize() methods
  */
@@ -78,7 +170,11 @@ template <typename T> inline uintptr_t __pval(const T* p) {
  * Performs an overflow-checked bounds check. Returns true iff \p buf + \p len is less than
  * \p end.
  */
-bool __buffer_bound_check(const uint8_t* buf, const uint8_t* end, size_t len);
+inline bool __buffer_bound_check(const uint8_t* buf, const uint8_t* end, size_t len) {
+    uintptr_t buf_next;
+    bool overflow_occurred = __builtin_add_overflow(__pval(buf), len, &buf_next);
+    return (!overflow_occurred) && (buf_next <= __pval(end));
+}
 
 /**
  * Append a byte array to a buffer.  Note that by itself this function isn't very useful, because it
@@ -108,6 +204,19 @@ inline uint8_t* append_uint64_to_buf(uint8_t* buf, const uint8_t* end, uint64_t
     return append_to_buf(buf, end, &value, sizeof(value));
 }
 
+/**
+ * Number of bytes \p append_varint_to_buf() takes to write \p value.
+ */
+size_t varint_size(uint64_t value);
+
+/**
+ * Append \p value as an unsigned LEB128 varint: seven bits per byte, least significant first, with
+ * the high bit set on every byte but the last.  Nothing is written if the varint doesn't fit.
+ *
+ * Returns a pointer to the first byte after the data written.
+ */
+uint8_t* append_varint_to_buf(uint8_t* buf, const uint8_t* end, uint64_t value);
+
 /**
  * Appends a byte array to a buffer, prefixing it with a 32-bit size field.  Returns a pointer to
  * the first byte after the data written.
@@ -173,6 +282,13 @@ bool copy_from_buf(const uint8_t** buf_ptr, const uint8_t* end, void* dest, size
 bool copy_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end, size_t* size,
                                  UniquePtr<uint8_t[]>* dest);
 
+/**
+ * Like copy_size_and_data_from_buf(), but points \p *data at the bytes in *buf_ptr rather than
+ * copying them.
+ */
+bool view_size_and_data_from_buf(const uint8_t** buf_ptr, const uint8_t* end,
+                                 const uint8_t** data, size_t* size);
+
 /**
  * Copies a value convertible from uint32_t from \p *buf_ptr.  Returns false if there are less than
  * four bytes remaining in \p *buf_ptr.  Advances \p *buf_ptr to the next byte to be read.
@@ -193,6 +309,13 @@ inline bool copy_uint64_from_buf(const uint8_t** buf_ptr, const uint8_t* end, ui
     return copy_from_buf(buf_ptr, end, value, sizeof(*value));
 }
 
+/**
+ * Copies a varint written by \p append_varint_to_buf() from \p *buf_ptr.  Returns false if it runs
+ * past \p end, overflows 64 bits or is padded with trailing zero bytes, so that each value has
+ * exactly one encoding.  Advances \p *buf_ptr to the next byte to be read.
+ */
+bool copy_varint_from_buf(const uint8_t** buf_ptr, const uint8_t* end, uint64_t* value);
+
 /**
  * Copies an array of values convertible to uint32_t from \p *buf_ptr, first reading a count of
  * values to read. The count is returned in \p *count and the values returned in newly-allocated
@@ -244,6 +367,155 @@ bool copy_collection_from_buf(const uint8_t** buf_ptr, const uint8_t* end, T* va
     return true;
 }
 
+/**
+ * ByteReader walks a serialized representation front to back.  The checked Read*() calls behave
+ * like the copy_*_from_buf() helpers, but are inline.  Where a run of fixed-size fields follows,
+ * Require() checks the whole run once and the *Unchecked() reads then take the fields one after
+ * another with no further checks.  Debug builds assert that unchecked reads stay within what was
+ * required.
+ */
+class ByteReader {
+  public:
+    ByteReader(const uint8_t* buf, const uint8_t* end) : pos_(buf), end_(end), required_end_(buf) {}
+
+    // Returns true iff at least \p len more bytes can be read.
+    bool Require(size_t len) {
+        if (!__buffer_bound_check(pos_, end_, len)) return false;
+        if (pos_ + len > required_end_) required_end_ = pos_ + len;
+        return true;
+    }
+
+    const uint8_t* position() const { return pos_; }
+    size_t remaining() const { return end_ - pos_; }
+
+    uint8_t ReadUint8Unchecked() { return ReadUnchecked<uint8_t>(); }
+    uint32_t ReadUint32Unchecked() { return ReadUnchecked<uint32_t>(); }
+    uint64_t ReadUint64Unchecked() { return ReadUnchecked<uint64_t>(); }
+
+    template <typename T> bool ReadUint32(T* value) {
+        if (!Require(sizeof(uint32_t))) return false;
+        *value = static_cast<T>(ReadUint32Unchecked());
+        return true;
+    }
+    bool ReadUint64(uint64_t* value) {
+        if (!Require(sizeof(*value))) return false;
+        *value = ReadUint64Unchecked();
+        return true;
+    }
+
+  private:
+    template <typename T> T ReadUnchecked() {
+        assert(pos_ + sizeof(T) <= required_end_);
+        T value;
+        memcpy(&value, pos_, sizeof(value));
+        pos_ += sizeof(value);
+        return value;
+    }
+
+    const uint8_t* pos_;
+    const uint8_t* end_;
+    const uint8_t* required_end_;
+};
+
+/**
+ * ByteWriter is the writing counterpart of ByteReader: Require() checks that a run of fixed-size
+ * fields fits, and the *Unchecked() writes then fill it in.
+ */
+class ByteWriter {
+  public:
+    ByteWriter(uint8_t* buf, const uint8_t* end) : pos_(buf), end_(end), required_end_(buf) {}
+
+    // Returns true iff at least \p len more bytes can be written.
+    bool Require(size_t len) {
+        if (!__buffer_bound_check(pos_, end_, len)) return false;
+        if (pos_ + len > required_end_) required_end_ = pos_ + len;
+        return true;
+    }
+
+    uint8_t* position() const { return pos_; }
+    size_t remaining() const { return end_ - pos_; }
+
+    void WriteUint8Unchecked(uint8_t value) { WriteUnchecked(value); }
+    template <typename T> void WriteUint32Unchecked(T value) {
+        WriteUnchecked(static_cast<uint32_t>(value));
+    }
+    void WriteUint64Unchecked(uint64_t value) { WriteUnchecked(value); }
+
+  private:
+    template <typename T> void WriteUnchecked(T value) {
+        assert(pos_ + sizeof(T) <= required_end_);
+        memcpy(pos_, &value, sizeof(value));
+        pos_ += sizeof(value);
+    }
+
+    uint8_t* pos_;
+    const uint8_t* end_;
+    const uint8_t* required_end_;
+};
+
+/**
+ * One fixed-size field of a message: the member \p Member, carried on the wire as a \p Wire.  The
+ * wire type is spelled out rather than deduced because size_t and enum members are written as
+ * uint32_t, whatever their in-memory size.  Use through FieldList.
+ */
+template <typename Wire, auto Member> struct Field {
+    static constexpr size_t kSize = sizeof(Wire);
+
+    template <typename Message> static uint8_t* Write(uint8_t* buf, const Message& message) {
+        Wire value = static_cast<Wire>(message.*Member);
+        memcpy(buf, &value, sizeof(value));
+        return buf + sizeof(value);
+    }
+
+    template <typename Message> static const uint8_t* Read(const uint8_t* buf, Message* message) {
+        using Value = std::remove_reference_t<decltype(message->*Member)>;
+        Wire value;
+        memcpy(&value, buf, sizeof(value));
+        message->*Member = static_cast<Value>(value);
+        return buf + sizeof(value);
+    }
+};
+
+/**
+ * A compile-time description of a run of fixed-size fields, laid out back to back exactly as the
+ * per-field append_*_to_buf() and copy_*_from_buf() helpers would lay them out.  The whole run is
+ * bounds-checked once and then each field is copied without further checks, so messages describe
+ * their scalar prefix (or suffix) once and use it for sizing, serializing and deserializing:
+ *
+ *     using Fields = FieldList<Field<uint64_t, &Token::challenge>,
+ *                              Field<uint32_t, &Token::security_level>>;
+ *
+ * Fields that only exist from some message_version on belong in a separate FieldList, so that each
+ * version keeps its own layout.
+ */
+template <typename... Fields> struct FieldList {
+    static constexpr size_t kSize = (Fields::kSize + ... + 0);
+
+    // Writes nothing, and returns \p buf, if the run doesn't fit.
+    template <typename Message>
+    static uint8_t* Append(uint8_t* buf, const uint8_t* end, const Message& message) {
+        if (!__buffer_bound_check(buf, end, kSize)) return buf;
+        ((buf = Fields::Write(buf, message)), ...);
+        return buf;
+    }
+
+    // Reads nothing, and returns false, if the run isn't all there.
+    template <typename Message>
+    static bool Copy(const uint8_t** buf_ptr, const uint8_t* end, Message* message) {
+        if (!__buffer_bound_check(*buf_ptr, end, kSize)) return false;
+        const uint8_t* buf = *buf_ptr;
+        ((buf = Fields::Read(buf, message)), ...);
+        *buf_ptr = buf;
+        return true;
+    }
+
+    template <typename Message>
+    static bool WriteTo(SerializationSink* sink, const Message& message) {
+        uint8_t* buf = sink->Reserve(kSize);
+        return buf && Append(buf, buf + kSize, message) == buf + kSize;
+    }
+};
+
 /**
  * A simple buffer that supports reading and writing.  Manages its own memory.
  */
@@ -252,14 +524,24 @@ class Buffer : public Serializable {
     Buffer() : buffer_(nullptr), buffer_size_(0), read_position_(0), write_position_(0) {}
     explicit Buffer(size_t size) : buffer_(nullptr) { Reinitialize(size); }
     Buffer(const void* buf, size_t size) : buffer_(nullptr) { Reinitialize(buf, size); }
-    Buffer(Buffer&& b) { *this = std::move(b); }
+    Buffer(Buffer&& b) : buffer_(nullptr), buffer_size_(0), read_position_(0), write_position_(0) {
+        *this = std::move(b);
+    }
     Buffer(const Buffer&) = delete;
 
     ~Buffer() { Clear(); }
 
     Buffer& operator=(Buffer&& other) {
         if (this == &other) return *this;
-        buffer_ = std::move(other.buffer_);
+        if (other.external_ || (other.arena() && other.arena() != arena())) {
+            // Neither external nor arena storage may outlive its owner, so take a copy instead.
+            Reinitialize(other.peek_read(), other.available_read());
+            other.Clear();
+            return *this;
+        }
+        // Only the pointer moves; each Buffer keeps its own arena binding.
+        Clear();
+        buffer_.reset(other.buffer_.release());
         buffer_size_ = other.buffer_size_;
         other.buffer_size_ = 0;
         read_position_ = other.read_position_;
@@ -271,9 +553,19 @@ class Buffer : public Serializable {
 
     void operator=(const Buffer& other) = delete;
 
-    // Grow the buffer so that at least \p size bytes can be written.
+    /**
+     * Grow the buffer so that at least \p size bytes can be written.  Growth is geometric (with a
+     * cap) once the buffer holds data, so repeated small reserve() and write() calls don't copy
+     * the contents every time.  The old storage is zeroed before it's freed.
+     */
     bool reserve(size_t size);
 
+    /**
+     * Tells the buffer that it's expected to end up holding about \p size readable bytes, so that
+     * the first reserve() that has to grow it allocates that much at once.  Doesn't allocate.
+     */
+    void set_size_hint(size_t size) { size_hint_ = size; }
+
     bool Reinitialize(size_t size);
     bool Reinitialize(const void* buf, size_t size);
 
@@ -298,15 +590,36 @@ class Buffer : public Serializable {
     const uint8_t* peek_read() const { return buffer_.get() + read_position_; }
     uint8_t* peek_write() { return buffer_.get() + write_position_; }
     bool advance_write(int distance);
+
+    /**
+     * Makes the buffer allocate from \p arena (or the heap, if null) from now on, discarding its
+     * current contents.  See AuthorizationSet::set_arena().
+     */
+    void set_arena(Arena* arena);
+    Arena* arena() const { return buffer_.get_deleter().arena; }
+
+    /**
+     * Makes the buffer read and write \p storage, which the caller owns and must keep alive while
+     * the buffer uses it, discarding the current contents.  This lets an operation write its
+     * output straight into the caller's memory.  If a write needs more than \p size bytes the
+     * contents move to storage owned by the buffer, so callers must check
+     * uses_external_storage() before assuming the output is in \p storage.
+     */
+    void UseExternalStorage(uint8_t* storage, size_t size);
+    bool uses_external_storage() const { return external_; }
+
     size_t SerializedSize() const;
     uint8_t* Serialize(uint8_t* buf, const uint8_t* end) const;
     bool Deserialize(const uint8_t** buf_ptr, const uint8_t* end);
+    bool SerializeTo(SerializationSink* sink) const;
 
   private:
-    UniquePtr<uint8_t[]> buffer_;
+    UniquePtr<uint8_t[], ArenaArrayDelete<uint8_t>> buffer_;
     size_t buffer_size_;
     size_t read_position_;
     size_t write_position_;
+    size_t size_hint_ = 0;
+    bool external_ = false;
 };
 
 }  // namespace keymaster
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <keymaster/operation_table.h>
+
+namespace keymaster {
+
+/**
+ * Thread-safe OperationTable for HALs that dispatch calls from several threads.
+ *
+ * Operations are spread over independently locked shards by the pseudorandom high half of their
+ * handles, and each operation has its own mutex that Checkout() holds until Checkin().  Calls on
+ * different operations therefore only contend on the short shard critical sections, never on each
+ * other's crypto work.
+ *
+ * ReapIdle() skips operations that are checked out, or that a caller is waiting to check out, since
+ * those are in use however long ago they were last touched.  The memory budget applies to the
+ * table as a whole; the shards only track the footprints of their own operations.
+ *
+ * The hard per-owner quota is enforced across all shards.  LRU eviction, and with it the soft
+ * quota, is not supported: evicting an operation that another thread has checked out would pull
+ * it out from under that thread.  Adaptive sizing isn't supported either, and set_adaptive_size()
+ * fails.
+ */
+class ShardedOperationTable : public OperationTable {
+  public:
+    ShardedOperationTable(size_t table_size, size_t shard_count);
+    ~ShardedOperationTable() override;
+
+    keymaster_error_t Add(OperationPtr&& operation, uint64_t now_ms) override;
+    Operation* Find(keymaster_operation_handle_t op_handle) override;
+    bool Delete(keymaster_operation_handle_t op_handle) override;
+    bool Touch(keymaster_operation_handle_t op_handle, uint64_t now_ms) override;
+    size_t ReapIdle(uint64_t now_ms, uint64_t max_idle_ms) override;
+    void GetHandles(std::vector<keymaster_operation_handle_t>* handles) const override;
+    bool UpdateFootprint(keymaster_operation_handle_t op_handle) override;
+    size_t owner_count(uint32_t owner) const override;
+    // The shards' slots can't be resized while other threads use them.
+    keymaster_error_t set_adaptive_size(size_t /* min_size */, size_t /* max_size */,
+                                        size_t /* segment_size */,
+                                        uint64_t /* window_ms */) override {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    Operation* Checkout(keymaster_operation_handle_t op_handle, Lease* lease) override;
+    void Checkin(Lease* lease) override;
+    Operation* TryCheckout(keymaster_operation_handle_t op_handle, Lease* lease,
+                           bool* busy) override;
+
+    size_t shard_count() const { return shard_count_; }
+
+  private:
+    struct Shard;
+
+    struct OperationLock {
+        explicit OperationLock(Shard* owner) : shard(owner) {}
+
+        Shard* const shard;
+        std::mutex mutex;
+        // Number of leases on this lock.  Protected by the shard mutex.
+        size_t users = 0;
+        // Cleared when the operation is deleted.  Protected by the shard mutex.
+        bool live = true;
+    };
+
+    struct Shard {
+        explicit Shard(size_t table_size) : table(table_size) {}
+
+        std::mutex mutex;
+        OperationTable table;
+        std::unordered_map<keymaster_operation_handle_t, OperationLock*> locks;
+    };
+
+    Shard* ShardFor(keymaster_operation_handle_t op_handle);
+    // Drops one user of |lock|, freeing it once it has no users and its operation is gone.  The
+    // shard mutex must be held.
+    static void Unref(OperationLock* lock);
+    // Counts an operation for |owner|.  Returns false, counting nothing, if the owner is already
+    // at the hard quota.
+    bool AddOwnerOperation(uint32_t owner);
+    void RemoveOwnerOperation(uint32_t owner);
+
+    std::vector<UniquePtr<Shard>> shards_;
+    size_t shard_count_;
+    // Operations in all shards.  Each shard can hold table_size() operations on its own, so the
+    // overall limit is enforced here.
+    std::atomic<size_t> in_use_{0};
+    // Operations in all shards by owner.  Taken after a shard mutex, never before one.
+    mutable std::mutex owners_mutex_;
+    std::unordered_map<uint32_t, size_t> owner_operations_;
+};
+
+}  // namespace keymaster
@@ -76,8 +76,24 @@ class SoftKeymasterDevice {
     typedef std::pair<keymaster_algorithm_t, keymaster_purpose_t> AlgPurposePair;
     typedef std::map<AlgPurposePair, std::vector<keymaster_digest_t>> DigestMap;
 
+    /**
+     * The software implementation's answers to the get_supported_* queries, collected once at
+     * construction.  They never change afterwards, so they're read without locking.  A missing
+     * entry means the query failed and is answered by asking impl_ again.
+     */
+    struct SupportedCapabilities {
+        std::vector<keymaster_algorithm_t> algorithms;
+        std::map<AlgPurposePair, std::vector<keymaster_block_mode_t>> block_modes;
+        std::map<AlgPurposePair, std::vector<keymaster_padding_t>> padding_modes;
+        DigestMap digests;
+        std::map<keymaster_algorithm_t, std::vector<keymaster_key_format_t>> import_formats;
+        std::map<keymaster_algorithm_t, std::vector<keymaster_key_format_t>> export_formats;
+        bool algorithms_valid = false;
+    };
+
   private:
     void initialize_device_struct(uint32_t flags);
+    void collect_supported_capabilities();
     bool FindUnsupportedDigest(keymaster_algorithm_t algorithm, keymaster_purpose_t purpose,
                                const AuthorizationSet& params,
                                keymaster_digest_t* unsupported) const;
@@ -239,6 +255,7 @@ class SoftKeymasterDevice {
     hw_module_t updated_module_;
     bool configured_;
     bool supports_all_digests_;
+    SupportedCapabilities capabilities_;
 };
 
 }  // namespace keymaster
@@ -25,6 +25,7 @@ class SoftKeymasterLogger : public Logger {
     SoftKeymasterLogger() { set_instance(this); }
 
     virtual int log_msg(LogLevel level, const char* fmt, va_list args) const;
+    bool is_loggable(LogLevel level) const override;
 };
 
 }  // namespace keymaster
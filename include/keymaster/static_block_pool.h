@@ -0,0 +1,124 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+
+namespace keymaster {
+
+/**
+ * StaticBlockPool hands out blocks of a few fixed sizes from storage the integrator sets aside at
+ * build time, for TA builds that must not touch the heap once running.  Each size class keeps its
+ * free blocks on a list threaded through the blocks themselves, so allocating and freeing take
+ * constant time whatever the uptime, and the pool never fragments.  A request goes to the
+ * smallest class it fits, or the next larger one if that class is exhausted, and fails once no
+ * class can take it.  Freed blocks are zeroed.  StaticBlockPool is thread-safe.
+ *
+ * Builds with KEYMASTER_STATIC_HEAP defined route every NewArray() and DeleteArray() call without
+ * an arena, and so the storage of unbound AuthorizationSets and Buffers and the chunks of every
+ * Arena, through the pool returned by static_block_pool(), which the integrator must define:
+ *
+ *   keymaster::StaticBlockPool* keymaster::static_block_pool() {
+ *       static keymaster::StaticBlocks<64, 512> small;
+ *       static keymaster::StaticBlocks<4096, 32> large;
+ *       static keymaster::StaticBlockPool::SizeClass classes[] = {small.size_class(),
+ *                                                                 large.size_class()};
+ *       static keymaster::StaticBlockPool pool(classes, 2);
+ *       return &pool;
+ *   }
+ */
+class StaticBlockPool {
+  public:
+    static constexpr size_t kMaxSizeClasses = 8;
+
+    struct SizeClass {
+        // A multiple of alignof(max_align_t).
+        size_t block_size;
+        size_t block_count;
+        // block_size * block_count bytes, aligned to alignof(max_align_t).
+        uint8_t* storage;
+    };
+
+    struct Stats {
+        size_t in_use[kMaxSizeClasses] = {};
+        size_t high_water_mark[kMaxSizeClasses] = {};
+        // Allocations no class could satisfy.
+        size_t failures = 0;
+    };
+
+    // |classes| must be in increasing order of block size.  Classes beyond kMaxSizeClasses, and
+    // any with a misaligned block size or storage, are ignored.
+    StaticBlockPool(const SizeClass* classes, size_t class_count);
+
+    StaticBlockPool(const StaticBlockPool&) = delete;
+    void operator=(const StaticBlockPool&) = delete;
+
+    // Returns a block of at least |size| bytes, aligned for any fundamental type, or nullptr.
+    void* Allocate(size_t size);
+    // |ptr| must be null or have come from Allocate().
+    void Free(void* ptr);
+
+    bool Owns(const void* ptr) const;
+    // The largest allocation the pool can ever satisfy.
+    size_t max_allocation() const;
+    void GetStats(Stats* stats) const;
+
+  private:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct Class {
+        SizeClass config;
+        FreeBlock* free_list;
+        size_t in_use;
+        size_t high_water_mark;
+    };
+
+    // Returns the class whose storage holds |ptr|, or nullptr.
+    const Class* ClassOf(const void* ptr) const;
+
+    Class classes_[kMaxSizeClasses];
+    size_t class_count_ = 0;
+
+    // Guards the free lists and counters.
+    mutable std::mutex mutex_;
+    size_t failures_ = 0;
+};
+
+/**
+ * Storage for one size class of a StaticBlockPool, normally declared static.
+ */
+template <size_t BlockSize, size_t BlockCount> struct StaticBlocks {
+    static_assert(BlockSize % alignof(max_align_t) == 0,
+                  "Block sizes must keep every block aligned");
+    static_assert(BlockCount > 0, "An empty class is pointless");
+
+    StaticBlockPool::SizeClass size_class() { return {BlockSize, BlockCount, storage}; }
+
+    alignas(max_align_t) uint8_t storage[BlockSize * BlockCount];
+};
+
+#ifdef KEYMASTER_STATIC_HEAP
+// Defined by the integrator; see StaticBlockPool.
+StaticBlockPool* static_block_pool();
+#endif
+
+}  // namespace keymaster
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifdef KEYMASTER_ENABLE_ATRACE
+#include <cutils/trace.h>
+#endif
+
+namespace keymaster {
+
+#ifdef KEYMASTER_ENABLE_ATRACE
+
+/**
+ * ScopedTrace marks a span, visible in Perfetto and systrace, from its construction to its
+ * destruction.  Use it through KEYMASTER_TRACE().
+ */
+class ScopedTrace {
+  public:
+    explicit ScopedTrace(const char* name) { atrace_begin(ATRACE_TAG_HAL, name); }
+    ~ScopedTrace() { atrace_end(ATRACE_TAG_HAL); }
+
+    ScopedTrace(const ScopedTrace&) = delete;
+    void operator=(const ScopedTrace&) = delete;
+};
+
+#define KEYMASTER_TRACE_CONCAT_(a, b) a##b
+#define KEYMASTER_TRACE_VAR_(line) KEYMASTER_TRACE_CONCAT_(keymaster_trace_, line)
+
+// Traces the rest of the enclosing scope as |name|, which must outlive the scope.
+#define KEYMASTER_TRACE(name) ::keymaster::ScopedTrace KEYMASTER_TRACE_VAR_(__LINE__)(name)
+
+#else  // KEYMASTER_ENABLE_ATRACE
+
+// Only Android userspace builds define KEYMASTER_ENABLE_ATRACE, so TA builds carry no tracing.
+#define KEYMASTER_TRACE(name) static_cast<void>(0)
+
+#endif  // KEYMASTER_ENABLE_ATRACE
+
+}  // namespace keymaster
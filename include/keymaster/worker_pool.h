@@ -0,0 +1,106 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace keymaster {
+
+/**
+ * WorkerPool runs tasks in the background.  The library's parallel and asynchronous work, such as
+ * bulk key upgrades, CSR key checks, large CTR updates and asynchronous key generation, is
+ * scheduled through one, normally the pool returned by KeymasterContext::worker_pool(), so that
+ * environments with their own scheduler can supply it and those without threads can do without.
+ */
+class WorkerPool {
+  public:
+    virtual ~WorkerPool() = default;
+
+    /**
+     * Queues |task| to run on some other thread.  Returns false if the task can't be queued, in
+     * which case it will never run.
+     */
+    virtual bool Submit(std::function<void()> task) = 0;
+
+    // Returns the number of tasks the pool may run at once.
+    virtual size_t thread_count() const = 0;
+};
+
+/**
+ * Runs |work| on the calling thread and on up to |copies| - 1 pool threads at once, returning when
+ * all have returned.  |work| must split the job itself, typically by taking items from a shared
+ * atomic index until none are left.  Copies that haven't started by the time the calling thread's
+ * copy returns are skipped, so a busy pool, or a call from one of the pool's own tasks, only costs
+ * parallelism.  With a null |pool| |work| runs once, on the calling thread.
+ */
+void RunInParallel(WorkerPool* pool, size_t copies, const std::function<void()>& work);
+
+/**
+ * ThreadWorkerPool runs tasks on a fixed set of threads, started by the first Submit(), that take
+ * tasks in submission order from a shared queue.  The destructor runs any tasks still queued.
+ */
+class ThreadWorkerPool : public WorkerPool {
+  public:
+    struct Config {
+        // Zero means one thread per core.
+        size_t thread_count = 0;
+        // Bit n allows the threads to run on CPU n; zero allows any.  Confining the pool to the
+        // cores of one cluster or NUMA node keeps it off cores reserved for other work.
+        uint64_t cpu_mask = 0;
+        // Nice value of the threads, as for setpriority().
+        int nice = 0;
+    };
+
+    ThreadWorkerPool() : ThreadWorkerPool(Config()) {}
+    explicit ThreadWorkerPool(const Config& config);
+    ~ThreadWorkerPool() override;
+
+    ThreadWorkerPool(const ThreadWorkerPool&) = delete;
+    void operator=(const ThreadWorkerPool&) = delete;
+
+    bool Submit(std::function<void()> task) override;
+    size_t thread_count() const override { return thread_count_; }
+
+  private:
+    void Run();
+
+    const Config config_;
+    const size_t thread_count_;
+
+    // Guards everything below.
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::function<void()>> tasks_;
+    std::vector<std::thread> threads_;
+    bool stopping_ = false;
+};
+
+/**
+ * Returns a process-wide ThreadWorkerPool with the default Config, created on first use and never
+ * destroyed.
+ */
+WorkerPool* DefaultWorkerPool();
+
+}  // namespace keymaster
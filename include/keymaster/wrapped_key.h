@@ -60,6 +60,29 @@ keymaster_error_t build_wrapped_key(const KeymasterKeyBlob& encrypted_ephemeral_
                                     const AuthorizationSet& authorization_list,
                                     KeymasterKeyBlob* der_wrapped_key);
 
+// The fields of a DER-encoded wrapped key, as views into the encoding they were parsed from, which
+// must outlive them.
+struct WrappedKeyView {
+    keymaster_blob_t transit_key;
+    keymaster_blob_t iv;
+    // The complete DER encoding of the KeyDescription, which is the GCM additional data.
+    keymaster_blob_t wrapped_key_description;
+    keymaster_key_format_t key_format;
+    // The DER encoding of the AuthorizationList within the KeyDescription.
+    keymaster_blob_t auth_list;
+    keymaster_blob_t secure_key;
+    keymaster_blob_t tag;
+};
+
+// Slices |wrapped_key| into its fields without allocating or copying.  The authorization list is
+// left encoded; parse_wrapped_key_auth_list() decodes it.
+keymaster_error_t parse_wrapped_key(const keymaster_key_blob_t& wrapped_key, WrappedKeyView* view);
+
+// Decodes the authorization list of a parsed wrapped key.
+keymaster_error_t parse_wrapped_key_auth_list(const WrappedKeyView& view,
+                                              AuthorizationSet* auth_list);
+
+// Parses |wrapped_key| into copies of its fields.
 keymaster_error_t parse_wrapped_key(const KeymasterKeyBlob& wrapped_key, KeymasterBlob* iv,
                                     KeymasterKeyBlob* transit_key, KeymasterKeyBlob* secure_key,
                                     KeymasterBlob* tag, AuthorizationSet* auth_list,
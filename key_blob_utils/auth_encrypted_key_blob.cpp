@@ -18,6 +18,7 @@
 
 #include <utility>
 
+#include <openssl/aead.h>
 #include <openssl/digest.h>
 #include <openssl/evp.h>
 #include <openssl/hkdf.h>
@@ -35,6 +36,13 @@ namespace {
 
 constexpr uint8_t kAesGcmDescriptor1[] = "AES-256-GCM-HKDF-SHA-256, version 1";
 constexpr uint8_t kAesGcmDescriptor2[] = "AES-256-GCM-HKDF-SHA-256, version 2";
+// The compact formats hash the compact encoding of the authorization lists, under descriptors of
+// their own so that it can never be mistaken for the original encoding.
+constexpr uint8_t kAesGcmDescriptor3[] = "AES-256-GCM-HKDF-SHA-256, version 3";
+constexpr uint8_t kAesGcmDescriptor4[] = "AES-256-GCM-HKDF-SHA-256, version 4";
+static_assert(sizeof(kAesGcmDescriptor1) == sizeof(kAesGcmDescriptor2) &&
+              sizeof(kAesGcmDescriptor1) == sizeof(kAesGcmDescriptor3) &&
+              sizeof(kAesGcmDescriptor1) == sizeof(kAesGcmDescriptor4));
 constexpr size_t kAesGcmNonceLength = 12;
 constexpr size_t kAesGcmTagLength = 16;
 constexpr size_t kAes256KeyLength = 256 / 8;
@@ -54,25 +62,39 @@ KmErrorOr<Buffer> BuildDerivationInfo(const AuthEncryptedBlobFormat format,  //
                                       const AuthorizationSet& hidden,
                                       const SecureDeletionData& secure_deletion_data) {
     bool use_sdd = requiresSecureDeletion(format);
+    bool compact = isCompactFormat(format);
 
-    size_t info_len =
-        hidden.SerializedSize() + hw_enforced.SerializedSize() + sw_enforced.SerializedSize();
+    size_t info_len = sizeof(kAesGcmDescriptor1) + hidden.SerializedSize();
+    if (compact) {
+        info_len += hw_enforced.CompactSerializedSize() + sw_enforced.CompactSerializedSize();
+    } else {
+        info_len += hw_enforced.SerializedSize() + sw_enforced.SerializedSize();
+    }
     if (use_sdd) {
-        info_len += sizeof(kAesGcmDescriptor2) +
-                    secure_deletion_data.factory_reset_secret.SerializedSize() +
+        info_len += secure_deletion_data.factory_reset_secret.SerializedSize() +
                     secure_deletion_data.secure_deletion_secret.SerializedSize() +
                     sizeof(secure_deletion_data.key_slot);
+    }
+
+    const uint8_t* descriptor;
+    if (compact) {
+        descriptor = use_sdd ? kAesGcmDescriptor4 : kAesGcmDescriptor3;
     } else {
-        info_len += sizeof(kAesGcmDescriptor1);
+        descriptor = use_sdd ? kAesGcmDescriptor2 : kAesGcmDescriptor1;
     }
 
     Buffer info(info_len);
-    info.write(use_sdd ? kAesGcmDescriptor2 : kAesGcmDescriptor1);
+    info.write(descriptor, sizeof(kAesGcmDescriptor1));
     uint8_t* buf = info.peek_write();
     const uint8_t* end = info.peek_write() + info.available_write();
     buf = hidden.Serialize(buf, end);
-    buf = hw_enforced.Serialize(buf, end);
-    buf = sw_enforced.Serialize(buf, end);
+    if (compact) {
+        buf = hw_enforced.CompactSerialize(buf, end);
+        buf = sw_enforced.CompactSerialize(buf, end);
+    } else {
+        buf = hw_enforced.Serialize(buf, end);
+        buf = sw_enforced.Serialize(buf, end);
+    }
 
     if (use_sdd) {
         buf = secure_deletion_data.factory_reset_secret.Serialize(buf, end);
@@ -94,26 +116,18 @@ KmErrorOr<Buffer> DeriveAesGcmKeyEncryptionKey(const AuthEncryptedBlobFormat for
                                                const AuthorizationSet& sw_enforced,             //
                                                const AuthorizationSet& hidden,                  //
                                                const SecureDeletionData& secure_deletion_data,  //
-                                               const KeymasterKeyBlob& master_key) {
-    Buffer prk(EVP_MAX_MD_SIZE);
-    size_t out_len = EVP_MAX_MD_SIZE;
-    if (!HKDF_extract(prk.peek_write(), &out_len, EVP_sha256(), master_key.key_material,
-                      master_key.key_material_size, nullptr /* salt */, 0 /* salt_len */)) {
-        return TranslateLastOpenSslError();
-    }
-
+                                               const MasterKeyContext& master_key) {
     KmErrorOr<Buffer> info =
         BuildDerivationInfo(format, hw_enforced, sw_enforced, hidden, secure_deletion_data);
     if (!info) return info.error();
 
-    if (!prk.advance_write(out_len) || !prk.available_read() || !info->available_read()) {
-        return KM_ERROR_UNKNOWN_ERROR;
-    }
+    const KeymasterKeyBlob& prk = master_key.prk();
+    if (!prk.size() || !info->available_read()) return KM_ERROR_UNKNOWN_ERROR;
 
     Buffer keyEncryptionKey(kAes256KeyLength);
     if (!HKDF_expand(keyEncryptionKey.peek_write(), keyEncryptionKey.available_write(),  //
                      EVP_sha256(),                                                       //
-                     prk.peek_read(), prk.available_read(),                              //
+                     prk.begin(), prk.size(),                                            //
                      info->peek_read(), info->available_read())) {
         return TranslateLastOpenSslError();
     }
@@ -121,11 +135,21 @@ KmErrorOr<Buffer> DeriveAesGcmKeyEncryptionKey(const AuthEncryptedBlobFormat for
     return keyEncryptionKey;
 }
 
+// Keys an AES-256-GCM context with |kek|.  The context holds the expanded key schedule, and a
+// single seal or open call does all of the work with it.
+keymaster_error_t InitAesGcmContext(const Buffer& kek, EVP_AEAD_CTX* ctx) {
+    if (!EVP_AEAD_CTX_init(ctx, EVP_aead_aes_256_gcm(), kek.peek_read(), kek.available_read(),
+                           kAesGcmTagLength, nullptr /* engine */)) {
+        return TranslateLastOpenSslError();
+    }
+    return KM_ERROR_OK;
+}
+
 KmErrorOr<EncryptedKey> AesGcmEncryptKey(const AuthorizationSet& hw_enforced,             //
                                          const AuthorizationSet& sw_enforced,             //
                                          const AuthorizationSet& hidden,                  //
                                          const SecureDeletionData& secure_deletion_data,  //
-                                         const KeymasterKeyBlob& master_key,              //
+                                         const MasterKeyContext& master_key,              //
                                          const KeymasterKeyBlob& plaintext,               //
                                          const AuthEncryptedBlobFormat format,            //
                                          Buffer nonce) {
@@ -133,30 +157,30 @@ KmErrorOr<EncryptedKey> AesGcmEncryptKey(const AuthorizationSet& hw_enforced,
                                                          secure_deletion_data, master_key);
     if (!kek) return kek.error();
 
-    bssl::UniquePtr<EVP_CIPHER_CTX> ctx(EVP_CIPHER_CTX_new());
-    if (!ctx) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    bssl::ScopedEVP_AEAD_CTX ctx;
+    keymaster_error_t error = InitAesGcmContext(*kek, ctx.get());
+    if (error != KM_ERROR_OK) return error;
 
-    int ciphertext_len = plaintext.size();
-    int unused_len = 0;
     EncryptedKey retval;
     retval.format = format;
-    retval.ciphertext = KeymasterKeyBlob(ciphertext_len);
+    retval.ciphertext = KeymasterKeyBlob(plaintext.size());
     retval.nonce = std::move(nonce);
     retval.tag = Buffer(kAesGcmTagLength);
+    if (plaintext.size() && !retval.ciphertext.key_material) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
 
-    if (!(EVP_EncryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr /* engine */, kek->peek_read(),
-                             retval.nonce.peek_read()) &&
-          EVP_EncryptUpdate(ctx.get(), retval.ciphertext.writable_data(), &ciphertext_len,
-                            plaintext.key_material, plaintext.size()) &&
-          EVP_EncryptFinal_ex(ctx.get(), retval.ciphertext.writable_data() /* not written to */,
-                              &unused_len) &&
-          EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_GET_TAG, kAesGcmTagLength,
-                              retval.tag.peek_write()))) {
+    size_t tag_len = 0;
+    if (!EVP_AEAD_CTX_seal_scatter(ctx.get(), retval.ciphertext.writable_data(),
+                                   retval.tag.peek_write(), &tag_len, kAesGcmTagLength,
+                                   retval.nonce.peek_read(), retval.nonce.available_read(),
+                                   plaintext.key_material, plaintext.size(),
+                                   nullptr /* extra_in */, 0 /* extra_in_len */,
+                                   nullptr /* ad */, 0 /* ad_len */)) {
         return TranslateLastOpenSslError();
     }
 
-    if (plaintext.size() != static_cast<size_t>(ciphertext_len) || 0 != unused_len ||
-        !retval.tag.advance_write(kAesGcmTagLength)) {
+    if (tag_len != kAesGcmTagLength || !retval.tag.advance_write(kAesGcmTagLength)) {
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
@@ -166,46 +190,157 @@ KmErrorOr<EncryptedKey> AesGcmEncryptKey(const AuthorizationSet& hw_enforced,
 KmErrorOr<KeymasterKeyBlob> AesGcmDecryptKey(const DeserializedKey& key,
                                              const AuthorizationSet& hidden,
                                              const SecureDeletionData& secure_deletion_data,
-                                             const KeymasterKeyBlob& master_key) {
+                                             const MasterKeyContext& master_key) {
     KmErrorOr<Buffer> kek =
         DeriveAesGcmKeyEncryptionKey(key.encrypted_key.format, key.hw_enforced, key.sw_enforced,
                                      hidden, secure_deletion_data, master_key);
     if (!kek) return kek.error();
 
-    bssl::UniquePtr<EVP_CIPHER_CTX> ctx(EVP_CIPHER_CTX_new());
-    if (!ctx) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    int plaintext_len = key.encrypted_key.ciphertext.size();
-    int unused_len = 0;
-    KeymasterKeyBlob plaintext(plaintext_len);
-    if (!(EVP_DecryptInit_ex(ctx.get(), EVP_aes_256_gcm(), nullptr /* engine */, kek->peek_read(),
-                             key.encrypted_key.nonce.peek_read()) &&
-          EVP_DecryptUpdate(ctx.get(), plaintext.writable_data(), &plaintext_len,
-                            key.encrypted_key.ciphertext.key_material,
-                            key.encrypted_key.ciphertext.size()) &&
-          EVP_CIPHER_CTX_ctrl(ctx.get(), EVP_CTRL_GCM_SET_TAG, kAesGcmTagLength,
-                              const_cast<uint8_t*>(key.encrypted_key.tag.peek_read())))) {
-        return TranslateLastOpenSslError();
+    bssl::ScopedEVP_AEAD_CTX ctx;
+    keymaster_error_t error = InitAesGcmContext(*kek, ctx.get());
+    if (error != KM_ERROR_OK) return error;
+
+    const EncryptedKey& encrypted_key = key.encrypted_key;
+    KeymasterKeyBlob plaintext(encrypted_key.ciphertext.size());
+    if (encrypted_key.ciphertext.size() && !plaintext.key_material) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
 
-    if (!EVP_DecryptFinal_ex(ctx.get(), plaintext.writable_data() /* not written to */,
-                             &unused_len)) {
+    // The nonce and tag lengths were checked when the blob was parsed, so failing to open means the
+    // blob doesn't authenticate.
+    if (!EVP_AEAD_CTX_open_gather(ctx.get(), plaintext.writable_data(),
+                                  encrypted_key.nonce.peek_read(),
+                                  encrypted_key.nonce.available_read(),
+                                  encrypted_key.ciphertext.key_material,
+                                  encrypted_key.ciphertext.size(), encrypted_key.tag.peek_read(),
+                                  encrypted_key.tag.available_read(), nullptr /* ad */,
+                                  0 /* ad_len */)) {
         return KM_ERROR_INVALID_KEY_BLOB;
     }
 
-    if (key.encrypted_key.ciphertext.size() != plaintext.size() || 0 != unused_len) {
-        return KM_ERROR_UNKNOWN_ERROR;
+    return plaintext;
+}
+
+size_t CompactBytesSize(size_t length) {
+    return varint_size(length) + length;
+}
+
+uint8_t* AppendCompactBytes(uint8_t* buf, const uint8_t* end, const uint8_t* data, size_t length) {
+    buf = append_varint_to_buf(buf, end, length);
+    return append_to_buf(buf, end, data, length);
+}
+
+bool CopyCompactBytes(const uint8_t** buf_ptr, const uint8_t* end, const uint8_t** data,
+                      size_t* length) {
+    uint64_t value;
+    if (!copy_varint_from_buf(buf_ptr, end, &value) ||
+        !__buffer_bound_check(*buf_ptr, end, value)) {
+        return false;
     }
+    *data = *buf_ptr;
+    *length = static_cast<size_t>(value);
+    *buf_ptr += value;
+    return true;
+}
 
-    return plaintext;
+bool CopyCompactUint32(const uint8_t** buf_ptr, const uint8_t* end, uint32_t* value) {
+    uint64_t tmp;
+    if (!copy_varint_from_buf(buf_ptr, end, &tmp) || tmp > UINT32_MAX) return false;
+    *value = static_cast<uint32_t>(tmp);
+    return true;
+}
+
+KmErrorOr<KeymasterKeyBlob> SerializeCompactAuthEncryptedBlob(const EncryptedKey& encrypted_key,
+                                                              const AuthorizationSet& hw_enforced,
+                                                              const AuthorizationSet& sw_enforced,
+                                                              uint32_t key_slot) {
+    bool use_key_slot = requiresSecureDeletion(encrypted_key.format);
+    uint32_t addl_info = static_cast<uint32_t>(encrypted_key.addl_info);
+
+    size_t size = 1 /* version byte */ + CompactBytesSize(encrypted_key.nonce.available_read()) +
+                  CompactBytesSize(encrypted_key.ciphertext.size()) +
+                  CompactBytesSize(encrypted_key.tag.available_read()) +
+                  varint_size(encrypted_key.kdf_version) + varint_size(addl_info) +
+                  hw_enforced.CompactSerializedSize() + sw_enforced.CompactSerializedSize();
+    if (use_key_slot) size += varint_size(key_slot);
+    KeymasterKeyBlob retval;
+    if (!retval.Reset(size)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    uint8_t* buf = retval.writable_data();
+    const uint8_t* end = retval.end();
+
+    *buf++ = encrypted_key.format;
+    buf = AppendCompactBytes(buf, end, encrypted_key.nonce.peek_read(),
+                             encrypted_key.nonce.available_read());
+    buf = AppendCompactBytes(buf, end, encrypted_key.ciphertext.begin(),
+                             encrypted_key.ciphertext.size());
+    buf = AppendCompactBytes(buf, end, encrypted_key.tag.peek_read(),
+                             encrypted_key.tag.available_read());
+    buf = append_varint_to_buf(buf, end, encrypted_key.kdf_version);
+    buf = append_varint_to_buf(buf, end, addl_info);
+    buf = hw_enforced.CompactSerialize(buf, end);
+    buf = sw_enforced.CompactSerialize(buf, end);
+    if (use_key_slot) buf = append_varint_to_buf(buf, end, key_slot);
+
+    if (buf != retval.end()) return KM_ERROR_UNKNOWN_ERROR;
+
+    return retval;
+}
+
+// Reads the fields after the format byte of a compact blob into |key|.
+bool DeserializeCompactFields(const uint8_t** buf_ptr, const uint8_t* end, DeserializedKey* key) {
+    EncryptedKey& encrypted_key = key->encrypted_key;
+    const uint8_t* data;
+    size_t length;
+    uint32_t addl_info;
+    if (!CopyCompactBytes(buf_ptr, end, &data, &length) ||
+        !encrypted_key.nonce.Reinitialize(data, length) ||
+        !CopyCompactBytes(buf_ptr, end, &data, &length)) {
+        return false;
+    }
+    encrypted_key.ciphertext = KeymasterKeyBlob(data, length);
+    if (length && !encrypted_key.ciphertext.key_material) return false;
+    if (!CopyCompactBytes(buf_ptr, end, &data, &length) ||
+        !encrypted_key.tag.Reinitialize(data, length) ||
+        !CopyCompactUint32(buf_ptr, end, &encrypted_key.kdf_version) ||
+        !CopyCompactUint32(buf_ptr, end, &addl_info) ||
+        !key->hw_enforced.CompactDeserialize(buf_ptr, end) ||
+        !key->sw_enforced.CompactDeserialize(buf_ptr, end)) {
+        return false;
+    }
+    encrypted_key.addl_info = static_cast<int32_t>(addl_info);
+    if (requiresSecureDeletion(encrypted_key.format)) {
+        return CopyCompactUint32(buf_ptr, end, &key->key_slot);
+    }
+    return true;
 }
 
 }  // namespace
 
+keymaster_error_t MasterKeyContext::Initialize(const KeymasterKeyBlob& master_key) {
+    master_key_ = master_key;
+    if (master_key.size() && !master_key_.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    uint8_t prk[EVP_MAX_MD_SIZE];
+    size_t out_len = sizeof(prk);
+    if (!HKDF_extract(prk, &out_len, EVP_sha256(), master_key.key_material,
+                      master_key.key_material_size, nullptr /* salt */, 0 /* salt_len */)) {
+        return TranslateLastOpenSslError();
+    }
+    prk_ = KeymasterKeyBlob(prk, out_len);
+    memset_s(prk, 0, sizeof(prk));
+    if (!prk_.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return KM_ERROR_OK;
+}
+
 KmErrorOr<KeymasterKeyBlob> SerializeAuthEncryptedBlob(const EncryptedKey& encrypted_key,
                                                        const AuthorizationSet& hw_enforced,
                                                        const AuthorizationSet& sw_enforced,
                                                        uint32_t key_slot) {
+    if (isCompactFormat(encrypted_key.format)) {
+        return SerializeCompactAuthEncryptedBlob(encrypted_key, hw_enforced, sw_enforced, key_slot);
+    }
+
     bool use_key_slot = requiresSecureDeletion(encrypted_key.format);
 
     size_t size = 1 /* version byte */ + encrypted_key.nonce.SerializedSize() +
@@ -239,7 +374,10 @@ KmErrorOr<KeymasterKeyBlob> SerializeAuthEncryptedBlob(const EncryptedKey& encry
     return retval;
 }
 
-KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlob(const KeymasterKeyBlob& key_blob) {
+namespace {
+
+KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlob(const KeymasterKeyBlob& key_blob,
+                                                        bool view) {
     if (!key_blob.key_material || key_blob.key_material_size == 0) return KM_ERROR_INVALID_KEY_BLOB;
 
     const uint8_t* tmp = key_blob.key_material;
@@ -250,27 +388,32 @@ KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlob(const KeymasterKeyBlob&
 
     DeserializedKey retval{};
     retval.encrypted_key.format = static_cast<AuthEncryptedBlobFormat>(*(*buf_ptr)++);
-    if (!retval.encrypted_key.nonce.Deserialize(buf_ptr, end) ||       //
-        !retval.encrypted_key.ciphertext.Deserialize(buf_ptr, end) ||  //
-        !retval.encrypted_key.tag.Deserialize(buf_ptr, end)) {
-        return KM_ERROR_INVALID_KEY_BLOB;
-    }
-
-    if (isVersionedFormat(retval.encrypted_key.format)) {
-        if (!copy_uint32_from_buf(buf_ptr, end, &retval.encrypted_key.kdf_version) ||
-            !copy_uint32_from_buf(buf_ptr, end, &retval.encrypted_key.addl_info)) {
+    if (isCompactFormat(retval.encrypted_key.format)) {
+        if (!DeserializeCompactFields(buf_ptr, end, &retval)) return KM_ERROR_INVALID_KEY_BLOB;
+    } else {
+        if (!retval.encrypted_key.nonce.Deserialize(buf_ptr, end) ||       //
+            !retval.encrypted_key.ciphertext.Deserialize(buf_ptr, end) ||  //
+            !retval.encrypted_key.tag.Deserialize(buf_ptr, end)) {
             return KM_ERROR_INVALID_KEY_BLOB;
         }
-    }
 
-    if (!retval.hw_enforced.Deserialize(buf_ptr, end) ||  //
-        !retval.sw_enforced.Deserialize(buf_ptr, end)) {
-        return KM_ERROR_INVALID_KEY_BLOB;
-    }
+        if (isVersionedFormat(retval.encrypted_key.format)) {
+            if (!copy_uint32_from_buf(buf_ptr, end, &retval.encrypted_key.kdf_version) ||
+                !copy_uint32_from_buf(buf_ptr, end, &retval.encrypted_key.addl_info)) {
+                return KM_ERROR_INVALID_KEY_BLOB;
+            }
+        }
 
-    if (requiresSecureDeletion(retval.encrypted_key.format)) {
-        if (!copy_uint32_from_buf(buf_ptr, end, &retval.key_slot)) {
-            return KM_ERROR_INVALID_KEY_BLOB;
+        bool deserialized = view ? retval.hw_enforced.DeserializeView(buf_ptr, end) &&
+                                       retval.sw_enforced.DeserializeView(buf_ptr, end)
+                                 : retval.hw_enforced.Deserialize(buf_ptr, end) &&
+                                       retval.sw_enforced.Deserialize(buf_ptr, end);
+        if (!deserialized) return KM_ERROR_INVALID_KEY_BLOB;
+
+        if (requiresSecureDeletion(retval.encrypted_key.format)) {
+            if (!copy_uint32_from_buf(buf_ptr, end, &retval.key_slot)) {
+                return KM_ERROR_INVALID_KEY_BLOB;
+            }
         }
     }
 
@@ -288,6 +431,8 @@ KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlob(const KeymasterKeyBlob&
     case AES_GCM_WITH_SECURE_DELETION:
     case AES_GCM_WITH_SW_ENFORCED_VERSIONED:
     case AES_GCM_WITH_SECURE_DELETION_VERSIONED:
+    case AES_GCM_WITH_SW_ENFORCED_COMPACT:
+    case AES_GCM_WITH_SECURE_DELETION_COMPACT:
         if (retval.encrypted_key.nonce.available_read() != kAesGcmNonceLength ||
             retval.encrypted_key.tag.available_read() != kAesGcmTagLength) {
             return KM_ERROR_INVALID_KEY_BLOB;
@@ -299,11 +444,33 @@ KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlob(const KeymasterKeyBlob&
     return KM_ERROR_INVALID_KEY_BLOB;
 }
 
+}  // namespace
+
+KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlob(const KeymasterKeyBlob& key_blob) {
+    return DeserializeAuthEncryptedBlob(key_blob, false /* view */);
+}
+
+KmErrorOr<DeserializedKey> DeserializeAuthEncryptedBlobView(const KeymasterKeyBlob& key_blob) {
+    return DeserializeAuthEncryptedBlob(key_blob, true /* view */);
+}
+
 KmErrorOr<EncryptedKey>
 EncryptKey(const KeymasterKeyBlob& plaintext, AuthEncryptedBlobFormat format,
            const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
            const AuthorizationSet& hidden, const SecureDeletionData& secure_deletion_data,
            const KeymasterKeyBlob& master_key, const RandomSource& random) {
+    MasterKeyContext master_key_context;
+    keymaster_error_t error = master_key_context.Initialize(master_key);
+    if (error != KM_ERROR_OK) return error;
+    return EncryptKey(plaintext, format, hw_enforced, sw_enforced, hidden, secure_deletion_data,
+                      master_key_context, random);
+}
+
+KmErrorOr<EncryptedKey>
+EncryptKey(const KeymasterKeyBlob& plaintext, AuthEncryptedBlobFormat format,
+           const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced,
+           const AuthorizationSet& hidden, const SecureDeletionData& secure_deletion_data,
+           const MasterKeyContext& master_key, const RandomSource& random) {
     switch (format) {
     case AES_OCB: {
         EncryptedKey retval;
@@ -313,8 +480,8 @@ EncryptKey(const KeymasterKeyBlob& plaintext, AuthEncryptedBlobFormat format,
         retval.nonce = std::move(*nonce);
         retval.tag.Reinitialize(OCB_TAG_LENGTH);
         keymaster_error_t error =
-            OcbEncryptKey(hw_enforced, sw_enforced, hidden, master_key, plaintext, retval.nonce,
-                          &retval.ciphertext, &retval.tag);
+            OcbEncryptKey(hw_enforced, sw_enforced, hidden, master_key.master_key(), plaintext,
+                          retval.nonce, &retval.ciphertext, &retval.tag);
         if (error != KM_ERROR_OK) return error;
         return retval;
     }
@@ -322,7 +489,9 @@ EncryptKey(const KeymasterKeyBlob& plaintext, AuthEncryptedBlobFormat format,
     case AES_GCM_WITH_SW_ENFORCED:
     case AES_GCM_WITH_SECURE_DELETION:
     case AES_GCM_WITH_SW_ENFORCED_VERSIONED:
-    case AES_GCM_WITH_SECURE_DELETION_VERSIONED: {
+    case AES_GCM_WITH_SECURE_DELETION_VERSIONED:
+    case AES_GCM_WITH_SW_ENFORCED_COMPACT:
+    case AES_GCM_WITH_SECURE_DELETION_COMPACT: {
         auto nonce = generate_nonce(random, kAesGcmNonceLength);
         if (!nonce) return nonce.error();
         return AesGcmEncryptKey(hw_enforced, sw_enforced, hidden, secure_deletion_data, master_key,
@@ -337,12 +506,21 @@ EncryptKey(const KeymasterKeyBlob& plaintext, AuthEncryptedBlobFormat format,
 KmErrorOr<KeymasterKeyBlob> DecryptKey(const DeserializedKey& key, const AuthorizationSet& hidden,
                                        const SecureDeletionData& secure_deletion_data,
                                        const KeymasterKeyBlob& master_key) {
+    MasterKeyContext master_key_context;
+    keymaster_error_t error = master_key_context.Initialize(master_key);
+    if (error != KM_ERROR_OK) return error;
+    return DecryptKey(key, hidden, secure_deletion_data, master_key_context);
+}
+
+KmErrorOr<KeymasterKeyBlob> DecryptKey(const DeserializedKey& key, const AuthorizationSet& hidden,
+                                       const SecureDeletionData& secure_deletion_data,
+                                       const MasterKeyContext& master_key) {
     KeymasterKeyBlob retval;
     switch (key.encrypted_key.format) {
     case AES_OCB: {
         keymaster_error_t error = OcbDecryptKey(
-            key.hw_enforced, key.sw_enforced, hidden, master_key, key.encrypted_key.ciphertext,
-            key.encrypted_key.nonce, key.encrypted_key.tag, &retval);
+            key.hw_enforced, key.sw_enforced, hidden, master_key.master_key(),
+            key.encrypted_key.ciphertext, key.encrypted_key.nonce, key.encrypted_key.tag, &retval);
         if (error != KM_ERROR_OK) return error;
         return retval;
     }
@@ -351,6 +529,8 @@ KmErrorOr<KeymasterKeyBlob> DecryptKey(const DeserializedKey& key, const Authori
     case AES_GCM_WITH_SECURE_DELETION:
     case AES_GCM_WITH_SW_ENFORCED_VERSIONED:
     case AES_GCM_WITH_SECURE_DELETION_VERSIONED:
+    case AES_GCM_WITH_SW_ENFORCED_COMPACT:
+    case AES_GCM_WITH_SECURE_DELETION_COMPACT:
         return AesGcmDecryptKey(key, hidden, secure_deletion_data, master_key);
     }
 
@@ -359,12 +539,17 @@ KmErrorOr<KeymasterKeyBlob> DecryptKey(const DeserializedKey& key, const Authori
 }
 
 bool requiresSecureDeletion(const AuthEncryptedBlobFormat& fmt) {
-    return fmt == AES_GCM_WITH_SECURE_DELETION || fmt == AES_GCM_WITH_SECURE_DELETION_VERSIONED;
+    return fmt == AES_GCM_WITH_SECURE_DELETION || fmt == AES_GCM_WITH_SECURE_DELETION_VERSIONED ||
+           fmt == AES_GCM_WITH_SECURE_DELETION_COMPACT;
 }
 
 bool isVersionedFormat(const AuthEncryptedBlobFormat& fmt) {
     return fmt == AES_GCM_WITH_SW_ENFORCED_VERSIONED ||
-           fmt == AES_GCM_WITH_SECURE_DELETION_VERSIONED;
+           fmt == AES_GCM_WITH_SECURE_DELETION_VERSIONED || isCompactFormat(fmt);
+}
+
+bool isCompactFormat(const AuthEncryptedBlobFormat& fmt) {
+    return fmt == AES_GCM_WITH_SW_ENFORCED_COMPACT || fmt == AES_GCM_WITH_SECURE_DELETION_COMPACT;
 }
 
 }  // namespace keymaster
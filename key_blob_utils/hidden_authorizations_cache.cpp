@@ -0,0 +1,149 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/key_blob_utils/hidden_authorizations_cache.h>
+
+#include <utility>
+
+#include <keymaster/key_blob_utils/software_keyblobs.h>
+
+namespace keymaster {
+
+namespace {
+
+constexpr uint64_t kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+constexpr uint64_t kFnvPrime = 0x100000001b3ULL;
+
+uint64_t HashBytes(uint64_t hash, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= data[i];
+        hash *= kFnvPrime;
+    }
+    return hash;
+}
+
+// Hashes presence and length as well as the bytes, so (id, no data) and (no id, data) differ.
+uint64_t HashField(uint64_t hash, bool present, const uint8_t* data, size_t size) {
+    uint8_t header[1 + sizeof(uint64_t)] = {static_cast<uint8_t>(present)};
+    uint64_t size64 = size;
+    memcpy(header + 1, &size64, sizeof(size64));
+    return HashBytes(HashBytes(hash, header, sizeof(header)), data, size);
+}
+
+bool BlobEquals(const KeymasterBlob& blob, const uint8_t* data, size_t size) {
+    return blob.data_length == size && (size == 0 || memcmp(blob.data, data, size) == 0);
+}
+
+}  // namespace
+
+keymaster_error_t HiddenAuthorizationsCache::Get(const AuthorizationSet& input_set,
+                                                 const KeymasterBlob& root_of_trust,
+                                                 AuthorizationSet* hidden,
+                                                 std::shared_ptr<const KeymasterBlob>* serialized) {
+    keymaster_blob_t app_id = {};
+    keymaster_blob_t app_data = {};
+    bool has_app_id = input_set.GetTagValue(TAG_APPLICATION_ID, &app_id);
+    bool has_app_data = input_set.GetTagValue(TAG_APPLICATION_DATA, &app_data);
+
+    uint64_t hash = HashField(kFnvOffsetBasis, has_app_id, app_id.data, app_id.data_length);
+    hash = HashField(hash, has_app_data, app_data.data, app_data.data_length);
+    hash = HashField(hash, true, root_of_trust.data, root_of_trust.data_length);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto entry = entries_.begin(); entry != entries_.end(); ++entry) {
+            if (entry->hash != hash || entry->has_app_id != has_app_id ||
+                entry->has_app_data != has_app_data ||
+                !BlobEquals(entry->app_id, app_id.data, app_id.data_length) ||
+                !BlobEquals(entry->app_data, app_data.data, app_data.data_length) ||
+                !BlobEquals(entry->root_of_trust, root_of_trust.data,
+                            root_of_trust.data_length)) {
+                continue;
+            }
+            // The cached set is shared, so this only takes a reference to it.
+            *hidden = entry->hidden;
+            if (hidden->is_valid() != AuthorizationSet::OK) {
+                return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            }
+            if (serialized) *serialized = entry->serialized;
+            entries_.splice(entries_.begin(), entries_, entry);
+            ++hits_;
+            return KM_ERROR_OK;
+        }
+        ++misses_;
+    }
+
+    // Built outside the lock; two threads missing on the same inputs just both insert, and the
+    // older duplicate ages out.
+    Entry entry{hash,
+                has_app_id,
+                has_app_data,
+                KeymasterBlob(app_id.data, app_id.data_length),
+                KeymasterBlob(app_data.data, app_data.data_length),
+                KeymasterBlob(root_of_trust.data, root_of_trust.data_length),
+                AuthorizationSet(),
+                nullptr};
+    keymaster_error_t error = BuildHiddenAuthorizations(input_set, &entry.hidden, root_of_trust);
+    if (error != KM_ERROR_OK) return error;
+
+    size_t size = entry.hidden.SerializedSize();
+    std::shared_ptr<KeymasterBlob> bytes(new (std::nothrow) KeymasterBlob);
+    if (!bytes || !bytes->Reset(size)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    entry.hidden.Serialize(bytes->writable_data(), bytes->writable_data() + size);
+    entry.serialized = std::move(bytes);
+
+    if ((app_id.data_length && !entry.app_id.data) ||
+        (app_data.data_length && !entry.app_data.data) ||
+        (root_of_trust.data_length && !entry.root_of_trust.data) || !entry.hidden.Share()) {
+        // Can't cache it, but the caller can still have it.
+        *hidden = std::move(entry.hidden);
+        if (serialized) *serialized = std::move(entry.serialized);
+        return KM_ERROR_OK;
+    }
+
+    *hidden = entry.hidden;
+    if (hidden->is_valid() != AuthorizationSet::OK) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (serialized) *serialized = entry.serialized;
+    if (max_entries_ == 0) return KM_ERROR_OK;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (entries_.size() >= max_entries_) entries_.pop_back();
+    entries_.push_front(std::move(entry));
+    return KM_ERROR_OK;
+}
+
+void HiddenAuthorizationsCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+}
+
+size_t HiddenAuthorizationsCache::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+uint64_t HiddenAuthorizationsCache::hits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+uint64_t HiddenAuthorizationsCache::misses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
+
+}  // namespace keymaster
@@ -23,6 +23,7 @@
 
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/authorization_set.h>
+#include <keymaster/constant_time.h>
 #include <keymaster/km_openssl/openssl_err.h>
 
 namespace keymaster {
@@ -45,24 +46,53 @@ class HmacCleanup {
     HMAC_CTX* ctx_;
 };
 
-static keymaster_error_t ComputeHmac(const uint8_t* serialized_data, size_t serialized_data_size,
-                                     const AuthorizationSet& hidden, uint8_t hmac[HMAC_SIZE]) {
-    size_t hidden_bytes_size = hidden.SerializedSize();
-    UniquePtr<uint8_t[]> hidden_bytes(new (std::nothrow) uint8_t[hidden_bytes_size]);
-    if (!hidden_bytes.get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    hidden.Serialize(hidden_bytes.get(), hidden_bytes.get() + hidden_bytes_size);
+// The HMAC key is a constant, so the state after absorbing the padded key is computed once and
+// copied for each blob, saving the two key-pad compressions per HMAC.
+class KeyedHmacState {
+  public:
+    static const KeyedHmacState& Instance() {
+        static KeyedHmacState state;
+        return state;
+    }
+
+    ~KeyedHmacState() { HMAC_CTX_cleanup(&ctx_); }
+
+    // Initializes |ctx| to the keyed state.  On success, |ctx| must be cleaned up by the caller.
+    bool CopyTo(HMAC_CTX* ctx) const { return initialized_ && HMAC_CTX_copy_ex(ctx, &ctx_); }
+
+  private:
+    KeyedHmacState() {
+        HMAC_CTX_init(&ctx_);
+        initialized_ = HMAC_Init_ex(&ctx_, HMAC_KEY, sizeof(HMAC_KEY), EVP_sha256(),
+                                    nullptr /* engine */);
+    }
+
+    HMAC_CTX ctx_;
+    bool initialized_;
+};
 
+static keymaster_error_t SerializeHidden(const AuthorizationSet& hidden,
+                                         UniquePtr<uint8_t[]>* hidden_bytes,
+                                         size_t* hidden_bytes_size) {
+    *hidden_bytes_size = hidden.SerializedSize();
+    hidden_bytes->reset(new (std::nothrow) uint8_t[*hidden_bytes_size]);
+    if (!hidden_bytes->get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    hidden.Serialize(hidden_bytes->get(), hidden_bytes->get() + *hidden_bytes_size);
+    return KM_ERROR_OK;
+}
+
+static keymaster_error_t ComputeHmac(const uint8_t* serialized_data, size_t serialized_data_size,
+                                     const uint8_t* hidden_bytes, size_t hidden_bytes_size,
+                                     uint8_t hmac[HMAC_SIZE]) {
     HMAC_CTX ctx;
     HMAC_CTX_init(&ctx);
-    const EVP_MD* md = EVP_sha256();
-    if (!HMAC_Init_ex(&ctx, HMAC_KEY, sizeof(HMAC_KEY), md, nullptr /* engine */))
-        return TranslateLastOpenSslError();
     HmacCleanup cleanup(&ctx);
+    if (!KeyedHmacState::Instance().CopyTo(&ctx)) return KM_ERROR_UNKNOWN_ERROR;
 
     uint8_t tmp[EVP_MAX_MD_SIZE];
     unsigned tmp_len;
     if (!HMAC_Update(&ctx, serialized_data, serialized_data_size) ||
-        !HMAC_Update(&ctx, hidden_bytes.get(), hidden_bytes_size) ||  //
+        !HMAC_Update(&ctx, hidden_bytes, hidden_bytes_size) ||  //
         !HMAC_Final(&ctx, tmp, &tmp_len))
         return TranslateLastOpenSslError();
 
@@ -72,11 +102,28 @@ static keymaster_error_t ComputeHmac(const uint8_t* serialized_data, size_t seri
     return KM_ERROR_OK;
 }
 
-keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
-                                                const AuthorizationSet& hidden,
-                                                const AuthorizationSet& hw_enforced,
-                                                const AuthorizationSet& sw_enforced,
-                                                KeymasterKeyBlob* key_blob) {
+static keymaster_error_t VerifyHmac(const KeymasterKeyBlob& key_blob, const uint8_t* hidden_bytes,
+                                    size_t hidden_bytes_size) {
+    const uint8_t* p = key_blob.begin();
+    const uint8_t* end = key_blob.end();
+
+    if (p > end || p + HMAC_SIZE > end) return KM_ERROR_INVALID_KEY_BLOB;
+
+    uint8_t computed_hmac[HMAC_SIZE];
+    keymaster_error_t error = ComputeHmac(key_blob.begin(), key_blob.key_material_size - HMAC_SIZE,
+                                          hidden_bytes, hidden_bytes_size, computed_hmac);
+    if (error != KM_ERROR_OK) return error;
+
+    if (!ConstantTimeEquals(key_blob.end() - HMAC_SIZE, computed_hmac, HMAC_SIZE))
+        return KM_ERROR_INVALID_KEY_BLOB;
+    return KM_ERROR_OK;
+}
+
+static keymaster_error_t SerializeBlob(const KeymasterKeyBlob& key_material,
+                                       const uint8_t* hidden_bytes, size_t hidden_bytes_size,
+                                       const AuthorizationSet& hw_enforced,
+                                       const AuthorizationSet& sw_enforced,
+                                       KeymasterKeyBlob* key_blob) {
     size_t size = 1 /* version */ +                //
                   key_material.SerializedSize() +  //
                   hw_enforced.SerializedSize() +   //
@@ -91,7 +138,30 @@ keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_mate
     p = hw_enforced.Serialize(p, key_blob->end());
     p = sw_enforced.Serialize(p, key_blob->end());
 
-    return ComputeHmac(key_blob->key_material, p - key_blob->key_material, hidden, p);
+    return ComputeHmac(key_blob->key_material, p - key_blob->key_material, hidden_bytes,
+                       hidden_bytes_size, p);
+}
+
+keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
+                                                const AuthorizationSet& hidden,
+                                                const AuthorizationSet& hw_enforced,
+                                                const AuthorizationSet& sw_enforced,
+                                                KeymasterKeyBlob* key_blob) {
+    size_t hidden_bytes_size;
+    UniquePtr<uint8_t[]> hidden_bytes;
+    keymaster_error_t error = SerializeHidden(hidden, &hidden_bytes, &hidden_bytes_size);
+    if (error != KM_ERROR_OK) return error;
+    return SerializeBlob(key_material, hidden_bytes.get(), hidden_bytes_size, hw_enforced,
+                         sw_enforced, key_blob);
+}
+
+keymaster_error_t SerializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_material,
+                                                const KeymasterBlob& serialized_hidden,
+                                                const AuthorizationSet& hw_enforced,
+                                                const AuthorizationSet& sw_enforced,
+                                                KeymasterKeyBlob* key_blob) {
+    return SerializeBlob(key_material, serialized_hidden.begin(), serialized_hidden.size(),
+                         hw_enforced, sw_enforced, key_blob);
 }
 
 keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob,
@@ -99,23 +169,72 @@ keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_bl
                                                   KeymasterKeyBlob* key_material,
                                                   AuthorizationSet* hw_enforced,
                                                   AuthorizationSet* sw_enforced) {
-    const uint8_t* p = key_blob.begin();
-    const uint8_t* end = key_blob.end();
-
-    if (p > end || p + HMAC_SIZE > end) return KM_ERROR_INVALID_KEY_BLOB;
+    size_t hidden_bytes_size;
+    UniquePtr<uint8_t[]> hidden_bytes;
+    keymaster_error_t error = SerializeHidden(hidden, &hidden_bytes, &hidden_bytes_size);
+    if (error != KM_ERROR_OK) return error;
 
-    uint8_t computed_hmac[HMAC_SIZE];
-    keymaster_error_t error = ComputeHmac(key_blob.begin(), key_blob.key_material_size - HMAC_SIZE,
-                                          hidden, computed_hmac);
+    error = VerifyHmac(key_blob, hidden_bytes.get(), hidden_bytes_size);
     if (error != KM_ERROR_OK) return error;
 
-    if (CRYPTO_memcmp(key_blob.end() - HMAC_SIZE, computed_hmac, HMAC_SIZE) != 0)
-        return KM_ERROR_INVALID_KEY_BLOB;
+    return DeserializeIntegrityAssuredBlob_NoHmacCheck(key_blob, key_material, hw_enforced,
+                                                       sw_enforced);
+}
+
+keymaster_error_t DeserializeIntegrityAssuredBlob(const KeymasterKeyBlob& key_blob,
+                                                  const KeymasterBlob& serialized_hidden,
+                                                  KeymasterKeyBlob* key_material,
+                                                  AuthorizationSet* hw_enforced,
+                                                  AuthorizationSet* sw_enforced) {
+    keymaster_error_t error =
+        VerifyHmac(key_blob, serialized_hidden.begin(), serialized_hidden.size());
+    if (error != KM_ERROR_OK) return error;
 
     return DeserializeIntegrityAssuredBlob_NoHmacCheck(key_blob, key_material, hw_enforced,
                                                        sw_enforced);
 }
 
+keymaster_error_t VerifyIntegrityAssuredBlobs(const KeymasterKeyBlob* key_blobs, size_t count,
+                                              const AuthorizationSet& hidden,
+                                              keymaster_error_t* errors) {
+    size_t hidden_bytes_size;
+    UniquePtr<uint8_t[]> hidden_bytes;
+    keymaster_error_t error = SerializeHidden(hidden, &hidden_bytes, &hidden_bytes_size);
+    if (error != KM_ERROR_OK) return error;
+
+    for (size_t i = 0; i < count; ++i) {
+        errors[i] = VerifyHmac(key_blobs[i], hidden_bytes.get(), hidden_bytes_size);
+    }
+    return KM_ERROR_OK;
+}
+
+// Steps over a length-prefixed field without copying it.
+static bool SkipSizedField(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t size;
+    if (!copy_uint32_from_buf(buf_ptr, end, &size) || !__buffer_bound_check(*buf_ptr, end, size)) {
+        return false;
+    }
+    *buf_ptr += size;
+    return true;
+}
+
+// Steps over a serialized AuthorizationSet: its indirect data, element count and element data.
+static bool SkipAuthorizationSet(const uint8_t** buf_ptr, const uint8_t* end) {
+    uint32_t elements_count;
+    return SkipSizedField(buf_ptr, end) && copy_uint32_from_buf(buf_ptr, end, &elements_count) &&
+           SkipSizedField(buf_ptr, end);
+}
+
+bool HasIntegrityAssuredBlobLayout(const KeymasterKeyBlob& key_blob) {
+    if (!key_blob.key_material || key_blob.key_material_size < 1 + HMAC_SIZE) return false;
+    const uint8_t* p = key_blob.begin();
+    const uint8_t* end = key_blob.end() - HMAC_SIZE;
+
+    if (*p++ != BLOB_VERSION) return false;
+    return SkipSizedField(&p, end) && SkipAuthorizationSet(&p, end) &&
+           SkipAuthorizationSet(&p, end) && p == end;
+}
+
 keymaster_error_t DeserializeIntegrityAssuredBlob_NoHmacCheck(const KeymasterKeyBlob& key_blob,
                                                               KeymasterKeyBlob* key_material,
                                                               AuthorizationSet* hw_enforced,
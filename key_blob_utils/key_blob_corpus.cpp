@@ -0,0 +1,178 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/key_blob_utils/key_blob_corpus.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/key_blob_utils/integrity_assured_key_blob.h>
+#include <keymaster/key_blob_utils/legacy_keyblobs.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+// Lends mapped memory to the parsers, which take a KeymasterKeyBlob, without copying it.  The
+// memory is released rather than cleared on destruction, because it is read-only and not ours.
+class MappedKeyBlob {
+  public:
+    MappedKeyBlob(const uint8_t* data, size_t size) {
+        blob_.key_material = data;
+        blob_.key_material_size = size;
+    }
+    ~MappedKeyBlob() { blob_.release(); }
+
+    const KeymasterKeyBlob& get() const { return blob_; }
+
+  private:
+    KeymasterKeyBlob blob_;
+};
+
+keymaster_error_t ParseBlob(const KeymasterKeyBlob& blob, SoftwareKeyBlobFormat format,
+                            const AuthorizationSet& hidden) {
+    KeymasterKeyBlob key_material;
+    AuthorizationSet hw_enforced;
+    AuthorizationSet sw_enforced;
+    switch (format) {
+    case KEY_BLOB_INTEGRITY_ASSURED:
+        return DeserializeIntegrityAssuredBlob(blob, hidden, &key_material, &hw_enforced,
+                                               &sw_enforced);
+    case KEY_BLOB_AUTH_ENCRYPTED_OCB:
+    case KEY_BLOB_AUTH_ENCRYPTED_GCM:
+    case KEY_BLOB_OLD_SOFTKEYMASTER:
+        return ParseLegacyKeyBlob(blob, format, hidden, &key_material, &hw_enforced,
+                                  &sw_enforced);
+    case KEY_BLOB_UNKNOWN:
+        break;
+    }
+    return KM_ERROR_INVALID_KEY_BLOB;
+}
+
+}  // namespace
+
+KeyBlobCorpus::~KeyBlobCorpus() {
+    for (auto& file : files_) {
+        munmap(const_cast<uint8_t*>(file.data), file.size);
+    }
+}
+
+keymaster_error_t KeyBlobCorpus::AddFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_E("Failed to open key blob %s: %s", path.c_str(), strerror(errno));
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return KM_ERROR_OK;
+    }
+
+    size_t size = static_cast<size_t>(st.st_size);
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        LOG_E("Failed to map key blob %s: %s", path.c_str(), strerror(errno));
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    files_.push_back({path, static_cast<const uint8_t*>(data), size});
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t KeyBlobCorpus::AddDirectory(const std::string& directory) {
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) {
+        LOG_E("Failed to open key blob directory %s: %s", directory.c_str(), strerror(errno));
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    keymaster_error_t first_error = KM_ERROR_OK;
+    for (const auto& name : names) {
+        std::string path = directory + "/" + name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        keymaster_error_t error = AddFile(path);
+        if (error != KM_ERROR_OK && first_error == KM_ERROR_OK) first_error = error;
+    }
+    return first_error;
+}
+
+keymaster_key_blob_t KeyBlobCorpus::blob(size_t index) const {
+    return {files_[index].data, files_[index].size};
+}
+
+KeyBlobCorpus::ParseStats KeyBlobCorpus::Parse(const AuthorizationSet& additional_params,
+                                               size_t thread_count, WorkerPool* pool) const {
+    ParseStats stats;
+    size_t count = files_.size();
+    stats.blob_count = count;
+
+    AuthorizationSet hidden;
+    keymaster_error_t hidden_error =
+        BuildHiddenAuthorizations(additional_params, &hidden, softwareRootOfTrust);
+    // The workers share |hidden|; sizing it once here fills its memoized size before they start.
+    hidden.SerializedSize();
+
+    std::vector<SoftwareKeyBlobFormat> formats(count, KEY_BLOB_UNKNOWN);
+    std::vector<keymaster_error_t> errors(count, hidden_error);
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < count;) {
+            MappedKeyBlob view(files_[i].data, files_[i].size);
+            formats[i] = ClassifyKeyBlob(view.get());
+            if (hidden_error == KM_ERROR_OK) errors[i] = ParseBlob(view.get(), formats[i], hidden);
+        }
+    };
+
+    RunInParallel(pool, std::min(thread_count, count), worker);
+
+    for (size_t i = 0; i < count; ++i) {
+        ++stats.format_counts[formats[i]];
+        if (errors[i] == KM_ERROR_OK) {
+            ++stats.parsed_counts[formats[i]];
+        } else {
+            stats.failures.push_back({i, formats[i], errors[i]});
+        }
+    }
+    return stats;
+}
+
+}  // namespace keymaster
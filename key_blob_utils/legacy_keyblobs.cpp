@@ -0,0 +1,188 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/key_blob_utils/legacy_keyblobs.h>
+
+#ifndef KEYMASTER_DISABLE_LEGACY_KEY_BLOBS
+
+#include <string.h>
+
+#include <keymaster/authorization_set.h>
+#include <keymaster/key_blob_utils/auth_encrypted_key_blob.h>
+#include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/logger.h>
+
+#include <openssl/aes.h>
+#include <openssl/evp.h>
+
+#endif  // KEYMASTER_DISABLE_LEGACY_KEY_BLOBS
+
+namespace keymaster {
+
+#ifndef KEYMASTER_DISABLE_LEGACY_KEY_BLOBS
+
+namespace {
+
+// Matches the magic ClassifyKeyBlob() looks for.
+const uint8_t SOFT_KEY_MAGIC[] = {'P', 'K', '#', '8'};
+
+// The all-zero master key keymaster1 software blobs were encrypted with.  Its HKDF extraction is
+// done once, on first use, so processes that never parse such a blob don't pay for it.
+keymaster_error_t GetLegacyMasterKey(const MasterKeyContext** master_key) {
+    static MasterKeyContext context;
+    static keymaster_error_t error = [] {
+        uint8_t master_key_bytes[AES_BLOCK_SIZE] = {};
+        return context.Initialize(KeymasterKeyBlob(master_key_bytes, sizeof(master_key_bytes)));
+    }();
+    *master_key = &context;
+    return error;
+}
+
+}  // namespace
+
+// Note: This parsing code in below is from system/security/softkeymaster/keymaster_openssl.cpp's
+// unwrap_key function, modified for the preferred function signature and formatting.  It does some
+// odd things, but they have been left unchanged to avoid breaking compatibility.
+keymaster_error_t ParseOldSoftkeymasterBlob(const KeymasterKeyBlob& blob,
+                                            KeymasterKeyBlob* key_material,
+                                            AuthorizationSet* hw_enforced,
+                                            AuthorizationSet* sw_enforced) {
+    long publicLen = 0;   // NOLINT(google-runtime-int)
+    long privateLen = 0;  // NOLINT(google-runtime-int)
+    const uint8_t* p = blob.key_material;
+    const uint8_t* end = blob.key_material + blob.key_material_size;
+
+    int type = 0;
+    ptrdiff_t min_size =
+        sizeof(SOFT_KEY_MAGIC) + sizeof(type) + sizeof(publicLen) + 1 + sizeof(privateLen) + 1;
+    if (end - p < min_size) {
+        LOG_W("key blob appears to be truncated (if an old SW key)", 0);
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+
+    if (memcmp(p, SOFT_KEY_MAGIC, sizeof(SOFT_KEY_MAGIC)) != 0) return KM_ERROR_INVALID_KEY_BLOB;
+    p += sizeof(SOFT_KEY_MAGIC);
+
+    for (size_t i = 0; i < sizeof(type); i++) {
+        type = (type << 8) | *p++;
+    }
+
+    for (size_t i = 0; i < sizeof(type); i++) {
+        publicLen = (publicLen << 8) | *p++;
+    }
+
+    if (p + publicLen > end) {
+        LOG_W("public key length encoding error: size=%ld, end=%td", publicLen, end - p);
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+    p += publicLen;
+
+    if (end - p < sizeof(type)) {
+        LOG_W("key blob appears to be truncated (if an old SW key)", 0);
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+
+    for (size_t i = 0; i < sizeof(type); i++)
+        privateLen = (privateLen << 8) | *p++;
+
+    if (p + privateLen > end) {
+        LOG_W("private key length encoding error: size=%ld, end=%td", privateLen, end - p);
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+
+    // Just to be sure, make sure that the ASN.1 structure parses correctly.  We don't actually use
+    // the EVP_PKEY here.
+    const uint8_t* key_start = p;
+    EVP_PKEY_Ptr pkey(d2i_PrivateKey(type, nullptr, &p, privateLen));
+    if (pkey.get() == nullptr) {
+        LOG_W("Failed to parse PKCS#8 key material (if old SW key)", 0);
+        return KM_ERROR_INVALID_KEY_BLOB;
+    }
+
+    // All auths go into sw_enforced, including those that would be HW-enforced if we were faking
+    // auths for a HW-backed key.
+    hw_enforced->Clear();
+    keymaster_error_t error = FakeKeyAuthorizations(pkey.get(), sw_enforced, sw_enforced);
+    if (error != KM_ERROR_OK) return error;
+
+    if (!key_material->Reset(privateLen)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    memcpy(key_material->writable_data(), key_start, privateLen);
+
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t ParseAuthEncryptedBlob(const KeymasterKeyBlob& blob,
+                                         const AuthorizationSet& hidden,
+                                         KeymasterKeyBlob* key_material,
+                                         AuthorizationSet* hw_enforced,
+                                         AuthorizationSet* sw_enforced) {
+    KmErrorOr<DeserializedKey> key = DeserializeAuthEncryptedBlobView(blob);
+    if (!key) return key.error();
+
+    const MasterKeyContext* master_key;
+    keymaster_error_t error = GetLegacyMasterKey(&master_key);
+    if (error != KM_ERROR_OK) return error;
+
+    KmErrorOr<KeymasterKeyBlob> decrypted =
+        DecryptKey(*key, hidden, SecureDeletionData(), *master_key);
+    if (!decrypted) return decrypted.error();
+
+    // The authorizations borrow from |blob|, which the caller may free before the key.  Only
+    // copying them once the blob has authenticated keeps forged blobs cheap to reject.
+    if (!key->hw_enforced.Materialize() || !key->sw_enforced.Materialize()) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    *key_material = std::move(*decrypted);
+    *hw_enforced = std::move(key->hw_enforced);
+    *sw_enforced = std::move(key->sw_enforced);
+
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t ParseLegacyKeyBlob(const KeymasterKeyBlob& blob, SoftwareKeyBlobFormat format,
+                                     const AuthorizationSet& hidden,
+                                     KeymasterKeyBlob* key_material,
+                                     AuthorizationSet* hw_enforced,
+                                     AuthorizationSet* sw_enforced) {
+    switch (format) {
+    case KEY_BLOB_AUTH_ENCRYPTED_OCB:
+    case KEY_BLOB_AUTH_ENCRYPTED_GCM:
+        return ParseAuthEncryptedBlob(blob, hidden, key_material, hw_enforced, sw_enforced);
+    case KEY_BLOB_OLD_SOFTKEYMASTER:
+        return ParseOldSoftkeymasterBlob(blob, key_material, hw_enforced, sw_enforced);
+    case KEY_BLOB_INTEGRITY_ASSURED:
+    case KEY_BLOB_UNKNOWN:
+        break;
+    }
+    return KM_ERROR_INVALID_KEY_BLOB;
+}
+
+#else  // KEYMASTER_DISABLE_LEGACY_KEY_BLOBS
+
+keymaster_error_t ParseLegacyKeyBlob(const KeymasterKeyBlob& /* blob */,
+                                     SoftwareKeyBlobFormat /* format */,
+                                     const AuthorizationSet& /* hidden */,
+                                     KeymasterKeyBlob* /* key_material */,
+                                     AuthorizationSet* /* hw_enforced */,
+                                     AuthorizationSet* /* sw_enforced */) {
+    return KM_ERROR_INVALID_KEY_BLOB;
+}
+
+#endif  // KEYMASTER_DISABLE_LEGACY_KEY_BLOBS
+
+}  // namespace keymaster
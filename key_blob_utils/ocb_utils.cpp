@@ -18,6 +18,8 @@
 
 #include <assert.h>
 
+#include <mutex>
+
 #include <openssl/aes.h>
 #include <openssl/sha.h>
 
@@ -29,14 +31,54 @@
 
 namespace keymaster {
 
-class AeCtx {
+// Devices with many old keymaster1 blobs decrypt them in bursts, such as during a bulk upgrade,
+// so a few idle contexts are kept for reuse instead of being freed after every blob.  Contexts are
+// zeroed before they go back into the pool; every use starts with ae_init().
+class AeCtxPool {
   public:
-    AeCtx() : ctx_(ae_allocate(nullptr)) {}
-    ~AeCtx() {
-        ae_clear(ctx_);
-        ae_free(ctx_);
+    static AeCtxPool& Instance() {
+        static AeCtxPool pool;
+        return pool;
+    }
+
+    ~AeCtxPool() {
+        for (size_t i = 0; i < idle_count_; ++i) ae_free(idle_[i]);
+    }
+
+    ae_ctx* Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (idle_count_ > 0) return idle_[--idle_count_];
+        }
+        return ae_allocate(nullptr);
+    }
+
+    void Release(ae_ctx* ctx) {
+        if (!ctx) return;
+        ae_clear(ctx);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (idle_count_ < kMaxIdle) {
+                idle_[idle_count_++] = ctx;
+                return;
+            }
+        }
+        ae_free(ctx);
     }
 
+  private:
+    static constexpr size_t kMaxIdle = 8;
+
+    std::mutex mutex_;
+    ae_ctx* idle_[kMaxIdle];
+    size_t idle_count_ = 0;
+};
+
+class AeCtx {
+  public:
+    AeCtx() : ctx_(AeCtxPool::Instance().Acquire()) {}
+    ~AeCtx() { AeCtxPool::Instance().Release(ctx_); }
+
     ae_ctx* get() { return ctx_; }
 
   private:
@@ -92,7 +134,7 @@ static keymaster_error_t InitializeKeyWrappingContext(const AuthorizationSet& hw
 
     // Encrypt hash with master key to build derived key.
     AES_KEY aes_key;
-    Eraser aes_key_eraser(AES_KEY);
+    Eraser aes_key_eraser(aes_key);
     if (0 !=
         AES_set_encrypt_key(master_key.key_material, master_key.key_material_size * 8, &aes_key))
         return TranslateLastOpenSslError();
@@ -27,13 +27,10 @@
 #include <keymaster/key.h>
 #include <keymaster/key_blob_utils/auth_encrypted_key_blob.h>
 #include <keymaster/key_blob_utils/integrity_assured_key_blob.h>
-#include <keymaster/key_blob_utils/ocb_utils.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/logger.h>
 
-#include <openssl/aes.h>
-
 namespace keymaster {
 
 static uint8_t SWROT[2] = {'S', 'W'};
@@ -158,98 +155,30 @@ keymaster_error_t FakeKeyAuthorizations(EVP_PKEY* pubkey, AuthorizationSet* hw_e
     return KM_ERROR_OK;
 }
 
-// Note: This parsing code in below is from system/security/softkeymaster/keymaster_openssl.cpp's
-// unwrap_key function, modified for the preferred function signature and formatting.  It does some
-// odd things, but they have been left unchanged to avoid breaking compatibility.
+// The magic at the start of old softkeymaster blobs (see ParseOldSoftkeymasterBlob()).
 static const uint8_t SOFT_KEY_MAGIC[] = {'P', 'K', '#', '8'};
-keymaster_error_t ParseOldSoftkeymasterBlob(const KeymasterKeyBlob& blob,
-                                            KeymasterKeyBlob* key_material,
-                                            AuthorizationSet* hw_enforced,
-                                            AuthorizationSet* sw_enforced) {
-    long publicLen = 0;   // NOLINT(google-runtime-int)
-    long privateLen = 0;  // NOLINT(google-runtime-int)
-    const uint8_t* p = blob.key_material;
-    const uint8_t* end = blob.key_material + blob.key_material_size;
-
-    int type = 0;
-    ptrdiff_t min_size =
-        sizeof(SOFT_KEY_MAGIC) + sizeof(type) + sizeof(publicLen) + 1 + sizeof(privateLen) + 1;
-    if (end - p < min_size) {
-        LOG_W("key blob appears to be truncated (if an old SW key)", 0);
-        return KM_ERROR_INVALID_KEY_BLOB;
-    }
-
-    if (memcmp(p, SOFT_KEY_MAGIC, sizeof(SOFT_KEY_MAGIC)) != 0) return KM_ERROR_INVALID_KEY_BLOB;
-    p += sizeof(SOFT_KEY_MAGIC);
-
-    for (size_t i = 0; i < sizeof(type); i++) {
-        type = (type << 8) | *p++;
-    }
-
-    for (size_t i = 0; i < sizeof(type); i++) {
-        publicLen = (publicLen << 8) | *p++;
-    }
+SoftwareKeyBlobFormat ClassifyKeyBlob(const KeymasterKeyBlob& blob) {
+    if (!blob.key_material || blob.key_material_size == 0) return KEY_BLOB_UNKNOWN;
 
-    if (p + publicLen > end) {
-        LOG_W("public key length encoding error: size=%ld, end=%td", publicLen, end - p);
-        return KM_ERROR_INVALID_KEY_BLOB;
+    if (blob.key_material_size >= sizeof(SOFT_KEY_MAGIC) &&
+        memcmp(blob.key_material, SOFT_KEY_MAGIC, sizeof(SOFT_KEY_MAGIC)) == 0) {
+        return KEY_BLOB_OLD_SOFTKEYMASTER;
     }
-    p += publicLen;
 
-    if (end - p < sizeof(type)) {
-        LOG_W("key blob appears to be truncated (if an old SW key)", 0);
-        return KM_ERROR_INVALID_KEY_BLOB;
+    // Integrity-assured and OCB blobs share a leading zero byte, so the layout decides.
+    switch (blob.key_material[0]) {
+    case AES_OCB:
+        return HasIntegrityAssuredBlobLayout(blob) ? KEY_BLOB_INTEGRITY_ASSURED
+                                                   : KEY_BLOB_AUTH_ENCRYPTED_OCB;
+    case AES_GCM_WITH_SW_ENFORCED:
+    case AES_GCM_WITH_SECURE_DELETION:
+    case AES_GCM_WITH_SW_ENFORCED_VERSIONED:
+    case AES_GCM_WITH_SECURE_DELETION_VERSIONED:
+    case AES_GCM_WITH_SW_ENFORCED_COMPACT:
+    case AES_GCM_WITH_SECURE_DELETION_COMPACT:
+        return KEY_BLOB_AUTH_ENCRYPTED_GCM;
     }
-
-    for (size_t i = 0; i < sizeof(type); i++)
-        privateLen = (privateLen << 8) | *p++;
-
-    if (p + privateLen > end) {
-        LOG_W("private key length encoding error: size=%ld, end=%td", privateLen, end - p);
-        return KM_ERROR_INVALID_KEY_BLOB;
-    }
-
-    // Just to be sure, make sure that the ASN.1 structure parses correctly.  We don't actually use
-    // the EVP_PKEY here.
-    const uint8_t* key_start = p;
-    EVP_PKEY_Ptr pkey(d2i_PrivateKey(type, nullptr, &p, privateLen));
-    if (pkey.get() == nullptr) {
-        LOG_W("Failed to parse PKCS#8 key material (if old SW key)", 0);
-        return KM_ERROR_INVALID_KEY_BLOB;
-    }
-
-    // All auths go into sw_enforced, including those that would be HW-enforced if we were faking
-    // auths for a HW-backed key.
-    hw_enforced->Clear();
-    keymaster_error_t error = FakeKeyAuthorizations(pkey.get(), sw_enforced, sw_enforced);
-    if (error != KM_ERROR_OK) return error;
-
-    if (!key_material->Reset(privateLen)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    memcpy(key_material->writable_data(), key_start, privateLen);
-
-    return KM_ERROR_OK;
-}
-
-static uint8_t master_key_bytes[AES_BLOCK_SIZE] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
-const KeymasterKeyBlob MASTER_KEY(master_key_bytes, array_length(master_key_bytes));
-
-keymaster_error_t ParseAuthEncryptedBlob(const KeymasterKeyBlob& blob,
-                                         const AuthorizationSet& hidden,
-                                         KeymasterKeyBlob* key_material,
-                                         AuthorizationSet* hw_enforced,
-                                         AuthorizationSet* sw_enforced) {
-    KmErrorOr<DeserializedKey> key = DeserializeAuthEncryptedBlob(blob);
-    if (!key) return key.error();
-
-    KmErrorOr<KeymasterKeyBlob> decrypted =
-        DecryptKey(*key, hidden, SecureDeletionData(), MASTER_KEY);
-    if (!decrypted) return decrypted.error();
-
-    *key_material = std::move(*decrypted);
-    *hw_enforced = std::move(key->hw_enforced);
-    *sw_enforced = std::move(key->sw_enforced);
-
-    return KM_ERROR_OK;
+    return KEY_BLOB_UNKNOWN;
 }
 
 keymaster_error_t SetKeyBlobAuthorizations(const AuthorizationSet& key_description,
@@ -257,6 +186,8 @@ keymaster_error_t SetKeyBlobAuthorizations(const AuthorizationSet& key_descripti
                                            uint32_t os_patchlevel, AuthorizationSet* hw_enforced,
                                            AuthorizationSet* sw_enforced, KmVersion version) {
     sw_enforced->Clear();
+    // At most every description entry, plus origin, OS version and patchlevel and creation time.
+    sw_enforced->Reserve(key_description.size() + 4, key_description.indirect_size());
 
     for (auto& entry : key_description) {
         switch (entry.tag) {
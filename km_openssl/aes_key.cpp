@@ -49,8 +49,9 @@ keymaster_error_t AesKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
     if (!key) return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
     uint32_t min_mac_length = 0;
-    if (hw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_GCM) ||
-        sw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_GCM)) {
+    bool gcm = hw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_GCM) ||
+               sw_enforced.Contains(TAG_BLOCK_MODE, KM_MODE_GCM);
+    if (gcm) {
 
         if (!hw_enforced.GetTagValue(TAG_MIN_MAC_LENGTH, &min_mac_length) &&
             !sw_enforced.GetTagValue(TAG_MIN_MAC_LENGTH, &min_mac_length)) {
@@ -60,12 +61,64 @@ keymaster_error_t AesKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
         }
     }
 
-    keymaster_error_t error = KM_ERROR_OK;
-    key->reset(new (std::nothrow)
-                   AesKey(std::move(key_material), std::move(hw_enforced), std::move(sw_enforced),
-                          this));
-    if (!key->get()) error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    return error;
+    UniquePtr<AesKey> aes_key(new (std::nothrow) AesKey(
+        std::move(key_material), std::move(hw_enforced), std::move(sw_enforced), this));
+    if (!aes_key) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (gcm) aes_key->set_keyed_gcm_context(GetKeyedGcmContext(aes_key->key_material()));
+    *key = std::move(aes_key);
+    return KM_ERROR_OK;
+}
+
+std::shared_ptr<const KeyedGcmContext>
+AesKeyFactory::GetKeyedGcmContext(const KeymasterKeyBlob& key_material) const {
+    const EVP_CIPHER* cipher;
+    switch (key_material.size()) {
+    case 16:
+        cipher = EVP_aes_128_gcm();
+        break;
+    case 24:
+        cipher = EVP_aes_192_gcm();
+        break;
+    case 32:
+        cipher = EVP_aes_256_gcm();
+        break;
+    default:
+        // Operations reject the key size.
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(gcm_key_cache_mutex_);
+    CachedGcmKey* victim = &gcm_key_cache_[0];
+    for (auto& entry : gcm_key_cache_) {
+        if (entry.context && entry.key_material.size() == key_material.size() &&
+            memcmp_s(entry.key_material.begin(), key_material.begin(), key_material.size()) == 0) {
+            entry.last_used = ++gcm_key_cache_clock_;
+            return entry.context;
+        }
+        if (!victim->context) continue;
+        if (!entry.context || entry.last_used < victim->last_used) victim = &entry;
+    }
+
+    std::shared_ptr<KeyedGcmContext> context(new (std::nothrow) KeyedGcmContext);
+    if (!context || !context->Init(key_material, cipher)) return nullptr;
+
+    if (!victim->key_material.Reset(key_material.size())) {
+        victim->context.reset();
+        return context;
+    }
+    memcpy(victim->key_material.writable_data(), key_material.begin(), key_material.size());
+    victim->context = context;
+    victim->last_used = ++gcm_key_cache_clock_;
+    return context;
+}
+
+bool KeyedGcmContext::Init(const KeymasterKeyBlob& key_material, const EVP_CIPHER* cipher) {
+    if (!EVP_CipherInit_ex(&ctx_, cipher, nullptr /* engine */, key_material.key_material,
+                           nullptr /* iv */, 1 /* encrypt */)) {
+        return false;
+    }
+    cipher_ = cipher;
+    return true;
 }
 
 keymaster_error_t AesKeyFactory::validate_algorithm_specific_new_key_params(
@@ -40,6 +40,12 @@ class AesOperationFactory : public BlockCipherOperationFactory {
     explicit AesOperationFactory(keymaster_purpose_t purpose)
         : BlockCipherOperationFactory(purpose) {}
     const EvpCipherDescription& GetCipherDescription() const override;
+
+  protected:
+    std::shared_ptr<const KeyedGcmContext> GetKeyedGcmContext(const Key& key) const override {
+        // Only AesKeyFactory makes keys for this factory.
+        return static_cast<const AesKey&>(key).keyed_gcm_context();
+    }
 };
 
 }  // namespace keymaster
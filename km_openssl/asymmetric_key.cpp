@@ -17,6 +17,7 @@
 #include <keymaster/km_openssl/asymmetric_key.h>
 
 #include <openssl/asn1.h>
+#include <openssl/mem.h>
 #include <openssl/stack.h>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
@@ -35,21 +36,21 @@ keymaster_error_t AsymmetricKey::formatted_key_material(keymaster_key_format_t f
 
     if (material == nullptr || size == nullptr) return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
+    if (derived_data() && derived_data()->GetPublicKeyDer(material, size)) return KM_ERROR_OK;
+
     EVP_PKEY_Ptr pkey(InternalToEvp());
     if (pkey.get() == nullptr) return TranslateLastOpenSslError();
 
-    int key_data_length = i2d_PUBKEY(pkey.get(), nullptr);
+    // Encode once, into a buffer OpenSSL allocates, rather than measuring and then encoding.
+    uint8_t* der = nullptr;
+    int key_data_length = i2d_PUBKEY(pkey.get(), &der);
     if (key_data_length <= 0) return TranslateLastOpenSslError();
 
-    material->reset(new (std::nothrow) uint8_t[key_data_length]);
+    material->reset(dup_buffer(der, key_data_length));
+    if (material->get() && derived_data()) derived_data()->SetPublicKeyDer(der, key_data_length);
+    OPENSSL_free(der);
     if (material->get() == nullptr) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    uint8_t* tmp = material->get();
-    if (i2d_PUBKEY(pkey.get(), &tmp) != key_data_length) {
-        material->reset();
-        return TranslateLastOpenSslError();
-    }
-
     *size = key_data_length;
     return KM_ERROR_OK;
 }
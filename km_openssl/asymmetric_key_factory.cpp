@@ -45,20 +45,46 @@ keymaster_error_t AsymmetricKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
                                                 AuthorizationSet&& hw_enforced,
                                                 AuthorizationSet&& sw_enforced,
                                                 UniquePtr<Key>* key) const {
+    return LoadKeyMaterial(std::move(key_material), std::move(hw_enforced),
+                           std::move(sw_enforced), false /* authenticated */, key);
+}
+
+keymaster_error_t
+AsymmetricKeyFactory::LoadAuthenticatedKey(KeymasterKeyBlob&& key_material,
+                                           const AuthorizationSet& /* additional_params */,
+                                           AuthorizationSet&& hw_enforced,
+                                           AuthorizationSet&& sw_enforced,
+                                           UniquePtr<Key>* key) const {
+    return LoadKeyMaterial(std::move(key_material), std::move(hw_enforced),
+                           std::move(sw_enforced), true /* authenticated */, key);
+}
+
+keymaster_error_t AsymmetricKeyFactory::LoadKeyMaterial(KeymasterKeyBlob&& key_material,
+                                                        AuthorizationSet&& hw_enforced,
+                                                        AuthorizationSet&& sw_enforced,
+                                                        bool authenticated,
+                                                        UniquePtr<Key>* key) const {
     UniquePtr<AsymmetricKey> asym_key;
     keymaster_error_t error = CreateEmptyKey(std::move(hw_enforced), std::move(sw_enforced),
                                              &asym_key);
     if (error != KM_ERROR_OK) return error;
 
-    const uint8_t* tmp = key_material.key_material;
     asym_key->key_material() = std::move(key_material);
 
-    EVP_PKEY* pkey = d2i_PrivateKey(asym_key->evp_key_type(), nullptr /* pkey */, &tmp,
-                                    asym_key->key_material().key_material_size);
-    if (!pkey) return TranslateLastOpenSslError();
-    UniquePtr<EVP_PKEY, EVP_PKEY_Delete> pkey_deleter(pkey);
+    // Material under the blob's authentication was checked when the key was created.  Anything
+    // else, such as the unauthenticated old softkeymaster blobs, gets d2i_PrivateKey()'s checks.
+    EVP_PKEY_Ptr pkey;
+    if (authenticated) {
+        error = ParseValidatedPrivateKey(asym_key->evp_key_type(), asym_key->key_material(), &pkey);
+        if (error != KM_ERROR_OK) return error;
+    } else {
+        const uint8_t* tmp = asym_key->key_material().key_material;
+        pkey.reset(d2i_PrivateKey(asym_key->evp_key_type(), nullptr /* pkey */, &tmp,
+                                  asym_key->key_material().key_material_size));
+        if (!pkey) return TranslateLastOpenSslError();
+    }
 
-    if (!asym_key->EvpToInternal(pkey)) {
+    if (!asym_key->EvpToInternal(pkey.get())) {
         error = TranslateLastOpenSslError();
     } else {
         *key = std::move(asym_key);
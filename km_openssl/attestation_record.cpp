@@ -19,10 +19,12 @@
 #include <assert.h>
 #include <math.h>
 
-#include <unordered_map>
+#include <algorithm>
+#include <vector>
 
 #include <cppbor_parse.h>
 #include <openssl/asn1t.h>
+#include <openssl/bytestring.h>
 
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/attestation_context.h>
@@ -131,54 +133,17 @@ static keymaster_error_t insert_integer(ASN1_INTEGER* value, ASN1_INTEGER** dest
     ASSERT_OR_RETURN_ERROR(false, KM_ERROR_UNKNOWN_ERROR);  // Should never get here.
 }
 
-// Add a repeating enum to a map going mapping its key to list of values.
-static void add_repeating_enum(EatClaim key, uint32_t value,
-                               std::unordered_map<EatClaim, cppbor::Array>* fields_map) {
-    auto field = fields_map->find(key);
-    if (field != fields_map->end()) {
-        field->second.add(value);
-    } else {
-        fields_map->insert({key, cppbor::Array().add(value)});
-    }
-}
-
-static keymaster_error_t
-insert_unknown_tag(const keymaster_key_param_t& param, cppbor::Map* dest_map,
-                   std::unordered_map<EatClaim, cppbor::Array>* fields_map) {
-    EatClaim private_eat_tag = static_cast<EatClaim>(convert_to_eat_claim(param.tag));
-    switch (keymaster_tag_get_type(param.tag)) {
-    case KM_ENUM:
-        dest_map->add(private_eat_tag, param.enumerated);
-        break;
-    case KM_ENUM_REP:
-        add_repeating_enum(private_eat_tag, param.enumerated, fields_map);
-        break;
-    case KM_UINT:
-        dest_map->add(private_eat_tag, param.integer);
-        break;
-    case KM_UINT_REP:
-        add_repeating_enum(private_eat_tag, param.integer, fields_map);
-        break;
-    case KM_ULONG:
-        dest_map->add(private_eat_tag, param.long_integer);
-        break;
-    case KM_ULONG_REP:
-        add_repeating_enum(private_eat_tag, param.long_integer, fields_map);
-        break;
-    case KM_DATE:
-        dest_map->add(private_eat_tag, param.date_time);
-        break;
-    case KM_BOOL:
-        dest_map->add(private_eat_tag, true);
-        break;
-    case KM_BIGNUM:
-    case KM_BYTES:
-        dest_map->add(private_eat_tag, blob_to_bstr(param.blob));
-        break;
-    default:
-        ASSERT_OR_RETURN_ERROR(false, KM_ERROR_INVALID_TAG);
+// Add a repeating enum to a list mapping its key to list of values, keeping keys in the order they
+// first appear.
+static void add_repeating_enum(EatClaim key, uint64_t value,
+                               std::vector<std::pair<EatClaim, cppbor::Array>>* fields) {
+    for (auto& field : *fields) {
+        if (field.first == key) {
+            field.second.add(value);
+            return;
+        }
     }
-    return KM_ERROR_OK;
+    fields->emplace_back(key, cppbor::Array().add(value));
 }
 
 /**
@@ -189,10 +154,10 @@ insert_unknown_tag(const keymaster_key_param_t& param, cppbor::Map* dest_map,
  * - IMEI (without check digit), encoded as byte string of length 14 with each byte as the digit's
  *   value. The IMEI value encoded SHALL NOT include Luhn checksum or SVN information.
  */
-keymaster_error_t imei_to_ueid(const keymaster_blob_t& imei_blob, cppbor::Bstr* out) {
+static keymaster_error_t imei_to_ueid_bytes(const keymaster_blob_t& imei_blob,
+                                            uint8_t ueid[kUeidLength]) {
     ASSERT_OR_RETURN_ERROR(imei_blob.data_length == kImeiBlobLength, KM_ERROR_INVALID_TAG);
 
-    uint8_t ueid[kUeidLength];
     ueid[0] = kImeiTypeByte;
     // imei_blob corresponds to android.telephony.TelephonyManager#getDeviceId(), which is the
     // 15-digit IMEI (including the check digit), encoded as a string.
@@ -200,6 +165,13 @@ keymaster_error_t imei_to_ueid(const keymaster_blob_t& imei_blob, cppbor::Bstr*
         // Convert each character to its numeric value.
         ueid[i] = imei_blob.data[i - 1] - '0';  // Intentionally skip check digit at last position.
     }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t imei_to_ueid(const keymaster_blob_t& imei_blob, cppbor::Bstr* out) {
+    uint8_t ueid[kUeidLength];
+    keymaster_error_t error = imei_to_ueid_bytes(imei_blob, ueid);
+    if (error != KM_ERROR_OK) return error;
 
     *out = cppbor::Bstr(std::pair(ueid, sizeof(ueid)));
     return KM_ERROR_OK;
@@ -257,6 +229,277 @@ bool is_valid_attestation_challenge(const keymaster_blob_t& attestation_challeng
     return (attestation_challenge.data_length <= kMaximumAttestationChallengeLength);
 }
 
+// How one authorization is represented in an EAT submod.
+struct EatField {
+    enum Kind {
+        SKIPPED,
+        UINT,
+        BOOL,  // Always true; absent booleans are omitted.
+        BSTR,
+        UEID,      // |blob| holds an IMEI, encoded with imei_to_ueid_bytes().
+        REPEATED,  // One element of an array of unsigned integers.
+    };
+
+    static EatField Skipped() { return {SKIPPED, EatClaim::IAT, 0, {}}; }
+    static EatField Uint(EatClaim claim, uint64_t value) { return {UINT, claim, value, {}}; }
+    static EatField Bool(EatClaim claim) { return {BOOL, claim, 0, {}}; }
+    static EatField Bstr(EatClaim claim, const keymaster_blob_t& blob) {
+        return {BSTR, claim, 0, blob};
+    }
+    static EatField Ueid(const keymaster_blob_t& imei) { return {UEID, EatClaim::UEID, 0, imei}; }
+    static EatField Repeated(EatClaim claim, uint64_t value) {
+        return {REPEATED, claim, value, {}};
+    }
+
+    Kind kind;
+    EatClaim claim;
+    uint64_t value;
+    keymaster_blob_t blob;
+};
+
+static keymaster_error_t eat_field_for_unknown_tag(const keymaster_key_param_t& param,
+                                                   EatField* field) {
+    EatClaim private_eat_tag = static_cast<EatClaim>(convert_to_eat_claim(param.tag));
+    switch (keymaster_tag_get_type(param.tag)) {
+    case KM_ENUM:
+        *field = EatField::Uint(private_eat_tag, param.enumerated);
+        break;
+    case KM_ENUM_REP:
+        *field = EatField::Repeated(private_eat_tag, param.enumerated);
+        break;
+    case KM_UINT:
+        *field = EatField::Uint(private_eat_tag, param.integer);
+        break;
+    case KM_UINT_REP:
+        *field = EatField::Repeated(private_eat_tag, param.integer);
+        break;
+    case KM_ULONG:
+        *field = EatField::Uint(private_eat_tag, param.long_integer);
+        break;
+    case KM_ULONG_REP:
+        *field = EatField::Repeated(private_eat_tag, param.long_integer);
+        break;
+    case KM_DATE:
+        *field = EatField::Uint(private_eat_tag, param.date_time);
+        break;
+    case KM_BOOL:
+        *field = EatField::Bool(private_eat_tag);
+        break;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        *field = EatField::Bstr(private_eat_tag, param.blob);
+        break;
+    default:
+        ASSERT_OR_RETURN_ERROR(false, KM_ERROR_INVALID_TAG);
+    }
+    return KM_ERROR_OK;
+}
+
+// Work out how |entry| goes into an EAT submod at |security_level|.
+static keymaster_error_t eat_field(const keymaster_key_param_t& entry,
+                                   const EatSecurityLevel security_level, EatField* field) {
+    *field = EatField::Skipped();
+
+    switch (entry.tag) {
+
+    default:
+        // Unknown tags should only be included if they're software-enforced.
+        if (security_level == EatSecurityLevel::UNRESTRICTED) {
+            return eat_field_for_unknown_tag(entry, field);
+        }
+        break;
+
+    /* Tags ignored because they should never exist */
+    case KM_TAG_INVALID:
+
+    /* Tags ignored because they're not used. */
+    case KM_TAG_ALL_USERS:
+    case KM_TAG_EXPORTABLE:
+    case KM_TAG_ECIES_SINGLE_HASH_MODE:
+    case KM_TAG_KDF:
+
+    /* Tags ignored because they're used only to provide information to operations */
+    case KM_TAG_ASSOCIATED_DATA:
+    case KM_TAG_NONCE:
+    case KM_TAG_AUTH_TOKEN:
+    case KM_TAG_MAC_LENGTH:
+    case KM_TAG_ATTESTATION_CHALLENGE:
+    case KM_TAG_RESET_SINCE_ID_ROTATION:
+
+    /* Tags ignored because they have no meaning off-device */
+    case KM_TAG_USER_ID:
+    case KM_TAG_USER_SECURE_ID:
+    case KM_TAG_BLOB_USAGE_REQUIREMENTS:
+
+    /* Tags ignored because they're not usable by app keys */
+    case KM_TAG_BOOTLOADER_ONLY:
+    case KM_TAG_INCLUDE_UNIQUE_ID:
+    case KM_TAG_MAX_USES_PER_BOOT:
+    case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
+    case KM_TAG_UNIQUE_ID:
+
+    /* Tags ignored because they contain data that should not be exported */
+    case KM_TAG_APPLICATION_DATA:
+    case KM_TAG_APPLICATION_ID:
+    case KM_TAG_ROOT_OF_TRUST:
+        break;
+
+    /* Non-repeating enumerations */
+    case KM_TAG_ALGORITHM:
+        *field = EatField::Uint(EatClaim::ALGORITHM, get_uint32_value(entry));
+        break;
+    case KM_TAG_EC_CURVE:
+        *field = EatField::Uint(EatClaim::EC_CURVE, get_uint32_value(entry));
+        break;
+    case KM_TAG_USER_AUTH_TYPE:
+        *field = EatField::Uint(EatClaim::USER_AUTH_TYPE, get_uint32_value(entry));
+        break;
+    case KM_TAG_ORIGIN:
+        *field = EatField::Uint(EatClaim::ORIGIN, get_uint32_value(entry));
+        break;
+
+    /* Repeating enumerations */
+    case KM_TAG_PURPOSE:
+        *field = EatField::Repeated(EatClaim::PURPOSE, get_uint32_value(entry));
+        break;
+    case KM_TAG_PADDING:
+        *field = EatField::Repeated(EatClaim::PADDING, get_uint32_value(entry));
+        break;
+    case KM_TAG_DIGEST:
+        *field = EatField::Repeated(EatClaim::DIGEST, get_uint32_value(entry));
+        break;
+    case KM_TAG_BLOCK_MODE:
+        *field = EatField::Repeated(EatClaim::BLOCK_MODE, get_uint32_value(entry));
+        break;
+
+    /* Non-repeating unsigned integers */
+    case KM_TAG_KEY_SIZE:
+        *field = EatField::Uint(EatClaim::KEY_SIZE, get_uint32_value(entry));
+        break;
+    case KM_TAG_AUTH_TIMEOUT:
+        *field = EatField::Uint(EatClaim::AUTH_TIMEOUT, get_uint32_value(entry));
+        break;
+    case KM_TAG_OS_VERSION:
+        *field = EatField::Uint(EatClaim::OS_VERSION, get_uint32_value(entry));
+        break;
+    case KM_TAG_OS_PATCHLEVEL:
+        *field = EatField::Uint(EatClaim::OS_PATCHLEVEL, get_uint32_value(entry));
+        break;
+    case KM_TAG_VENDOR_PATCHLEVEL:
+        *field = EatField::Uint(EatClaim::VENDOR_PATCHLEVEL, get_uint32_value(entry));
+        break;
+    case KM_TAG_BOOT_PATCHLEVEL:
+        *field = EatField::Uint(EatClaim::BOOT_PATCHLEVEL, get_uint32_value(entry));
+        break;
+    case KM_TAG_MIN_MAC_LENGTH:
+        *field = EatField::Uint(EatClaim::MIN_MAC_LENGTH, get_uint32_value(entry));
+        break;
+
+    /* Non-repeating long unsigned integers */
+    case KM_TAG_RSA_PUBLIC_EXPONENT:
+        *field = EatField::Uint(EatClaim::RSA_PUBLIC_EXPONENT, entry.long_integer);
+        break;
+
+    /* Dates */
+    case KM_TAG_ACTIVE_DATETIME:
+        *field = EatField::Uint(EatClaim::ACTIVE_DATETIME, entry.date_time);
+        break;
+    case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
+        *field = EatField::Uint(EatClaim::ORIGINATION_EXPIRE_DATETIME, entry.date_time);
+        break;
+    case KM_TAG_USAGE_EXPIRE_DATETIME:
+        *field = EatField::Uint(EatClaim::USAGE_EXPIRE_DATETIME, entry.date_time);
+        break;
+    case KM_TAG_CREATION_DATETIME:
+        *field = EatField::Uint(EatClaim::IAT, entry.date_time);
+        break;
+
+    /* Booleans */
+    case KM_TAG_NO_AUTH_REQUIRED:
+        *field = EatField::Bool(EatClaim::NO_AUTH_REQUIRED);
+        break;
+    case KM_TAG_ALL_APPLICATIONS:
+        *field = EatField::Bool(EatClaim::ALL_APPLICATIONS);
+        break;
+    case KM_TAG_ROLLBACK_RESISTANT:
+        *field = EatField::Bool(EatClaim::ROLLBACK_RESISTANT);
+        break;
+    case KM_TAG_ALLOW_WHILE_ON_BODY:
+        *field = EatField::Bool(EatClaim::ALLOW_WHILE_ON_BODY);
+        break;
+    case KM_TAG_UNLOCKED_DEVICE_REQUIRED:
+        *field = EatField::Bool(EatClaim::UNLOCKED_DEVICE_REQUIRED);
+        break;
+    case KM_TAG_CALLER_NONCE:
+        *field = EatField::Bool(EatClaim::CALLER_NONCE);
+        break;
+    case KM_TAG_TRUSTED_CONFIRMATION_REQUIRED:
+        *field = EatField::Bool(EatClaim::TRUSTED_CONFIRMATION_REQUIRED);
+        break;
+    case KM_TAG_EARLY_BOOT_ONLY:
+        *field = EatField::Bool(EatClaim::EARLY_BOOT_ONLY);
+        break;
+    case KM_TAG_DEVICE_UNIQUE_ATTESTATION:
+        *field = EatField::Bool(EatClaim::DEVICE_UNIQUE_ATTESTATION);
+        break;
+    case KM_TAG_IDENTITY_CREDENTIAL_KEY:
+        *field = EatField::Bool(EatClaim::IDENTITY_CREDENTIAL_KEY);
+        break;
+    case KM_TAG_TRUSTED_USER_PRESENCE_REQUIRED:
+        *field = EatField::Bool(EatClaim::TRUSTED_USER_PRESENCE_REQUIRED);
+        break;
+    case KM_TAG_STORAGE_KEY:
+        *field = EatField::Bool(EatClaim::STORAGE_KEY);
+        break;
+
+    /* Byte arrays*/
+    case KM_TAG_ATTESTATION_APPLICATION_ID:
+        *field = EatField::Bstr(EatClaim::ATTESTATION_APPLICATION_ID, entry.blob);
+        break;
+    case KM_TAG_ATTESTATION_ID_BRAND:
+        *field = EatField::Bstr(EatClaim::ATTESTATION_ID_BRAND, entry.blob);
+        break;
+    case KM_TAG_ATTESTATION_ID_DEVICE:
+        *field = EatField::Bstr(EatClaim::ATTESTATION_ID_DEVICE, entry.blob);
+        break;
+    case KM_TAG_ATTESTATION_ID_PRODUCT:
+        *field = EatField::Bstr(EatClaim::ATTESTATION_ID_PRODUCT, entry.blob);
+        break;
+    case KM_TAG_ATTESTATION_ID_SERIAL:
+        *field = EatField::Bstr(EatClaim::ATTESTATION_ID_SERIAL, entry.blob);
+        break;
+    case KM_TAG_ATTESTATION_ID_IMEI:
+        ASSERT_OR_RETURN_ERROR(entry.blob.data_length == kImeiBlobLength, KM_ERROR_INVALID_TAG);
+        *field = EatField::Ueid(entry.blob);
+        break;
+    case KM_TAG_ATTESTATION_ID_MEID:
+        *field = EatField::Bstr(EatClaim::ATTESTATION_ID_MEID, entry.blob);
+        break;
+    case KM_TAG_ATTESTATION_ID_MANUFACTURER:
+        *field = EatField::Bstr(EatClaim::ATTESTATION_ID_MANUFACTURER, entry.blob);
+        break;
+    case KM_TAG_ATTESTATION_ID_MODEL:
+        *field = EatField::Bstr(EatClaim::ATTESTATION_ID_MODEL, entry.blob);
+        break;
+    case KM_TAG_CONFIRMATION_TOKEN:
+        *field = EatField::Bstr(EatClaim::CONFIRMATION_TOKEN, entry.blob);
+        break;
+    }
+
+    return KM_ERROR_OK;
+}
+
+// Keymaster1 EC keys have no curve.  Sets |*implied| if |auth_list| describes one, and |*curve|
+// to the curve its key size implies.
+static keymaster_error_t get_implied_ec_curve(const AuthorizationSet& auth_list, bool* implied,
+                                              int* curve) {
+    uint32_t key_size;
+    *implied = auth_list.Contains(TAG_ALGORITHM, KM_ALGORITHM_EC) &&
+               !auth_list.Contains(TAG_EC_CURVE) && auth_list.GetTagValue(TAG_KEY_SIZE, &key_size);
+    if (!*implied) return KM_ERROR_OK;
+    return ec_key_size_to_eat_curve(key_size, curve);
+}
+
 // Put the contents of the keymaster AuthorizationSet auth_list into the EAT record structure.
 keymaster_error_t build_eat_submod(const AuthorizationSet& auth_list,
                                    const EatSecurityLevel security_level, cppbor::Map* submod) {
@@ -266,227 +509,316 @@ keymaster_error_t build_eat_submod(const AuthorizationSet& auth_list,
 
     submod->add(EatClaim::SECURITY_LEVEL, get_uint32_value(security_level));
 
-    // Keep repeating fields in a separate map for easy lookup.
+    // Keep repeating fields in a separate list for easy lookup.
     // Add them to submod map in postprocessing.
-    std::unordered_map<EatClaim, cppbor::Array> repeating_fields =
-        std::unordered_map<EatClaim, cppbor::Array>();
+    std::vector<std::pair<EatClaim, cppbor::Array>> repeating_fields;
 
     for (auto entry : auth_list) {
+        EatField field;
+        keymaster_error_t error = eat_field(entry, security_level, &field);
+        if (error != KM_ERROR_OK) return error;
 
-        switch (entry.tag) {
-
-        default:
-            // Unknown tags should only be included if they're software-enforced.
-            if (security_level == EatSecurityLevel::UNRESTRICTED) {
-                keymaster_error_t error = insert_unknown_tag(entry, submod, &repeating_fields);
-                if (error != KM_ERROR_OK) {
-                    return error;
-                }
-            }
-            break;
-
-        /* Tags ignored because they should never exist */
-        case KM_TAG_INVALID:
-
-        /* Tags ignored because they're not used. */
-        case KM_TAG_ALL_USERS:
-        case KM_TAG_EXPORTABLE:
-        case KM_TAG_ECIES_SINGLE_HASH_MODE:
-        case KM_TAG_KDF:
-
-        /* Tags ignored because they're used only to provide information to operations */
-        case KM_TAG_ASSOCIATED_DATA:
-        case KM_TAG_NONCE:
-        case KM_TAG_AUTH_TOKEN:
-        case KM_TAG_MAC_LENGTH:
-        case KM_TAG_ATTESTATION_CHALLENGE:
-        case KM_TAG_RESET_SINCE_ID_ROTATION:
-
-        /* Tags ignored because they have no meaning off-device */
-        case KM_TAG_USER_ID:
-        case KM_TAG_USER_SECURE_ID:
-        case KM_TAG_BLOB_USAGE_REQUIREMENTS:
-
-        /* Tags ignored because they're not usable by app keys */
-        case KM_TAG_BOOTLOADER_ONLY:
-        case KM_TAG_INCLUDE_UNIQUE_ID:
-        case KM_TAG_MAX_USES_PER_BOOT:
-        case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
-        case KM_TAG_UNIQUE_ID:
-
-        /* Tags ignored because they contain data that should not be exported */
-        case KM_TAG_APPLICATION_DATA:
-        case KM_TAG_APPLICATION_ID:
-        case KM_TAG_ROOT_OF_TRUST:
-            continue;
-
-        /* Non-repeating enumerations */
-        case KM_TAG_ALGORITHM:
-            submod->add(EatClaim::ALGORITHM, get_uint32_value(entry));
+        switch (field.kind) {
+        case EatField::SKIPPED:
             break;
-        case KM_TAG_EC_CURVE:
-            submod->add(EatClaim::EC_CURVE, get_uint32_value(entry));
+        case EatField::UINT:
+            submod->add(field.claim, field.value);
             break;
-        case KM_TAG_USER_AUTH_TYPE:
-            submod->add(EatClaim::USER_AUTH_TYPE, get_uint32_value(entry));
-            break;
-        case KM_TAG_ORIGIN:
-            submod->add(EatClaim::ORIGIN, get_uint32_value(entry));
-            break;
-
-        /* Repeating enumerations */
-        case KM_TAG_PURPOSE:
-            add_repeating_enum(EatClaim::PURPOSE, get_uint32_value(entry), &repeating_fields);
+        case EatField::BOOL:
+            submod->add(field.claim, true);
             break;
-        case KM_TAG_PADDING:
-            add_repeating_enum(EatClaim::PADDING, get_uint32_value(entry), &repeating_fields);
+        case EatField::BSTR:
+            submod->add(field.claim, blob_to_bstr(field.blob));
             break;
-        case KM_TAG_DIGEST:
-            add_repeating_enum(EatClaim::DIGEST, get_uint32_value(entry), &repeating_fields);
+        case EatField::UEID: {
+            cppbor::Bstr ueid("");
+            error = imei_to_ueid(field.blob, &ueid);
+            if (error != KM_ERROR_OK) return error;
+            submod->add(field.claim, ueid);
             break;
-        case KM_TAG_BLOCK_MODE:
-            add_repeating_enum(EatClaim::BLOCK_MODE, get_uint32_value(entry), &repeating_fields);
+        }
+        case EatField::REPEATED:
+            add_repeating_enum(field.claim, field.value, &repeating_fields);
             break;
+        }
+    }
 
-        /* Non-repeating unsigned integers */
-        case KM_TAG_KEY_SIZE:
-            submod->add(EatClaim::KEY_SIZE, get_uint32_value(entry));
-            break;
-        case KM_TAG_AUTH_TIMEOUT:
-            submod->add(EatClaim::AUTH_TIMEOUT, get_uint32_value(entry));
-            break;
-        case KM_TAG_OS_VERSION:
-            submod->add(EatClaim::OS_VERSION, get_uint32_value(entry));
-            break;
-        case KM_TAG_OS_PATCHLEVEL:
-            submod->add(EatClaim::OS_PATCHLEVEL, get_uint32_value(entry));
-            break;
-        case KM_TAG_VENDOR_PATCHLEVEL:
-            submod->add(EatClaim::VENDOR_PATCHLEVEL, get_uint32_value(entry));
-            break;
-        case KM_TAG_BOOT_PATCHLEVEL:
-            submod->add(EatClaim::BOOT_PATCHLEVEL, get_uint32_value(entry));
-            break;
-        case KM_TAG_MIN_MAC_LENGTH:
-            submod->add(EatClaim::MIN_MAC_LENGTH, get_uint32_value(entry));
-            break;
+    // Move values from repeating enums into the submod map.
+    for (auto& repeating_field : repeating_fields) {
+        submod->add(repeating_field.first, std::move(repeating_field.second));
+    }
 
-        /* Non-repeating long unsigned integers */
-        case KM_TAG_RSA_PUBLIC_EXPONENT:
-            submod->add(EatClaim::RSA_PUBLIC_EXPONENT, entry.long_integer);
-            break;
+    bool implied_curve;
+    int ec_curve;
+    keymaster_error_t error = get_implied_ec_curve(auth_list, &implied_curve, &ec_curve);
+    if (error != KM_ERROR_OK) return error;
+    if (implied_curve) submod->add(EatClaim::EC_CURVE, ec_curve);
 
-        /* Dates */
-        case KM_TAG_ACTIVE_DATETIME:
-            submod->add(EatClaim::ACTIVE_DATETIME, entry.date_time);
-            break;
-        case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
-            submod->add(EatClaim::ORIGINATION_EXPIRE_DATETIME, entry.date_time);
-            break;
-        case KM_TAG_USAGE_EXPIRE_DATETIME:
-            submod->add(EatClaim::USAGE_EXPIRE_DATETIME, entry.date_time);
-            break;
-        case KM_TAG_CREATION_DATETIME:
-            submod->add(EatClaim::IAT, entry.date_time);
-            break;
+    return KM_ERROR_OK;
+}
 
-        /* Booleans */
-        case KM_TAG_NO_AUTH_REQUIRED:
-            submod->add(EatClaim::NO_AUTH_REQUIRED, true);
-            break;
-        case KM_TAG_ALL_APPLICATIONS:
-            submod->add(EatClaim::ALL_APPLICATIONS, true);
-            break;
-        case KM_TAG_ROLLBACK_RESISTANT:
-            submod->add(EatClaim::ROLLBACK_RESISTANT, true);
-            break;
-        case KM_TAG_ALLOW_WHILE_ON_BODY:
-            submod->add(EatClaim::ALLOW_WHILE_ON_BODY, true);
-            break;
-        case KM_TAG_UNLOCKED_DEVICE_REQUIRED:
-            submod->add(EatClaim::UNLOCKED_DEVICE_REQUIRED, true);
-            break;
-        case KM_TAG_CALLER_NONCE:
-            submod->add(EatClaim::CALLER_NONCE, true);
-            break;
-        case KM_TAG_TRUSTED_CONFIRMATION_REQUIRED:
-            submod->add(EatClaim::TRUSTED_CONFIRMATION_REQUIRED, true);
-            break;
-        case KM_TAG_EARLY_BOOT_ONLY:
-            submod->add(EatClaim::EARLY_BOOT_ONLY, true);
-            break;
-        case KM_TAG_DEVICE_UNIQUE_ATTESTATION:
-            submod->add(EatClaim::DEVICE_UNIQUE_ATTESTATION, true);
-            break;
-        case KM_TAG_IDENTITY_CREDENTIAL_KEY:
-            submod->add(EatClaim::IDENTITY_CREDENTIAL_KEY, true);
-            break;
-        case KM_TAG_TRUSTED_USER_PRESENCE_REQUIRED:
-            submod->add(EatClaim::TRUSTED_USER_PRESENCE_REQUIRED, true);
-            break;
-        case KM_TAG_STORAGE_KEY:
-            submod->add(EatClaim::STORAGE_KEY, true);
-            break;
+/**
+ * CborWriter encodes CBOR front to back into a caller-provided buffer, always choosing the
+ * shortest form of each header as deterministic encoding requires.  Map and array headers carry an
+ * element count, so callers work those out before writing the elements.  A writer without a buffer
+ * only measures, which lets an encoding be sized exactly before it is written; writes that don't
+ * fit are dropped and make ok() return false.
+ */
+class CborWriter {
+  public:
+    static constexpr uint8_t kUnsigned = 0;
+    static constexpr uint8_t kNegative = 1;
+    static constexpr uint8_t kByteString = 2;
+    static constexpr uint8_t kTextString = 3;
+    static constexpr uint8_t kArray = 4;
+    static constexpr uint8_t kMap = 5;
+
+    CborWriter() {}
+    CborWriter(uint8_t* buf, size_t buf_size) : buf_(buf), buf_size_(buf_size) {}
+
+    bool ok() const { return ok_; }
+    size_t size() const { return size_; }
+
+    void WriteBytes(const uint8_t* data, size_t len) {
+        if (buf_) {
+            if (!ok_ || buf_size_ - size_ < len) {
+                ok_ = false;
+                return;
+            }
+            if (len) memcpy(buf_ + size_, data, len);
+        }
+        size_ += len;
+    }
+
+    // Writes the initial byte of a data item of |major_type| and its argument |value|.  Map
+    // arguments count entries, not items.
+    void WriteHeader(uint8_t major_type, uint64_t value) {
+        uint8_t header[9];
+        size_t arg_len;
+        if (value < 24) {
+            header[0] = (major_type << 5) | value;
+            arg_len = 0;
+        } else if (value <= 0xFF) {
+            header[0] = (major_type << 5) | 24;
+            arg_len = 1;
+        } else if (value <= 0xFFFF) {
+            header[0] = (major_type << 5) | 25;
+            arg_len = 2;
+        } else if (value <= 0xFFFFFFFF) {
+            header[0] = (major_type << 5) | 26;
+            arg_len = 4;
+        } else {
+            header[0] = (major_type << 5) | 27;
+            arg_len = 8;
+        }
+        for (size_t i = 0; i < arg_len; ++i) {
+            header[arg_len - i] = (value >> (8 * i)) & 0xFF;
+        }
+        WriteBytes(header, arg_len + 1);
+    }
 
-        /* Byte arrays*/
-        case KM_TAG_ATTESTATION_APPLICATION_ID:
-            submod->add(EatClaim::ATTESTATION_APPLICATION_ID, blob_to_bstr(entry.blob));
-            break;
-        case KM_TAG_ATTESTATION_ID_BRAND:
-            submod->add(EatClaim::ATTESTATION_ID_BRAND, blob_to_bstr(entry.blob));
-            break;
-        case KM_TAG_ATTESTATION_ID_DEVICE:
-            submod->add(EatClaim::ATTESTATION_ID_DEVICE, blob_to_bstr(entry.blob));
+    void WriteInt(int64_t value) {
+        if (value < 0) {
+            WriteHeader(kNegative, static_cast<uint64_t>(-(value + 1)));
+        } else {
+            WriteHeader(kUnsigned, value);
+        }
+    }
+
+    void WriteBool(bool value) {
+        uint8_t simple = value ? 0xF5 : 0xF4;
+        WriteBytes(&simple, 1);
+    }
+
+    void WriteByteString(const uint8_t* data, size_t len) {
+        WriteHeader(kByteString, len);
+        WriteBytes(data, len);
+    }
+
+    void WriteTextString(const char* str) {
+        size_t len = strlen(str);
+        WriteHeader(kTextString, len);
+        WriteBytes(reinterpret_cast<const uint8_t*>(str), len);
+    }
+
+    void WriteClaim(EatClaim claim) { WriteInt(static_cast<int64_t>(claim)); }
+
+  private:
+    uint8_t* buf_ = nullptr;
+    size_t buf_size_ = 0;
+    size_t size_ = 0;
+    bool ok_ = true;
+};
+
+// Returns the number of values in the array for the repeated field at |index|, or zero if an
+// earlier authorization already started that array.  |auth_list| must have been validated by
+// count_eat_submod_entries().
+static size_t repeated_field_count(const AuthorizationSet& auth_list,
+                                   const EatSecurityLevel security_level, size_t index,
+                                   EatClaim claim) {
+    EatField field;
+    for (size_t i = 0; i < index; ++i) {
+        eat_field(auth_list[i], security_level, &field);
+        if (field.kind == EatField::REPEATED && field.claim == claim) return 0;
+    }
+    size_t count = 0;
+    for (size_t i = index; i < auth_list.size(); ++i) {
+        eat_field(auth_list[i], security_level, &field);
+        if (field.kind == EatField::REPEATED && field.claim == claim) ++count;
+    }
+    return count;
+}
+
+// Counts the entries of the submod build_eat_submod() would build from |auth_list|, so that it can
+// be written straight to a CborWriter.  Fails if build_eat_submod() would.
+static keymaster_error_t count_eat_submod_entries(const AuthorizationSet& auth_list,
+                                                  const EatSecurityLevel security_level,
+                                                  size_t* count) {
+    *count = 0;
+    if (auth_list.empty()) return KM_ERROR_OK;
+
+    *count = 1;  // SECURITY_LEVEL
+    for (size_t i = 0; i < auth_list.size(); ++i) {
+        EatField field;
+        keymaster_error_t error = eat_field(auth_list[i], security_level, &field);
+        if (error != KM_ERROR_OK) return error;
+        if (field.kind == EatField::SKIPPED) continue;
+        if (field.kind != EatField::REPEATED ||
+            repeated_field_count(auth_list, security_level, i, field.claim) > 0) {
+            ++*count;
+        }
+    }
+
+    bool implied_curve;
+    int ec_curve;
+    keymaster_error_t error = get_implied_ec_curve(auth_list, &implied_curve, &ec_curve);
+    if (error != KM_ERROR_OK) return error;
+    if (implied_curve) ++*count;
+    return KM_ERROR_OK;
+}
+
+// Writes the same encoding as build_eat_submod() followed by cppbor::Map::encode().  |entry_count|
+// comes from count_eat_submod_entries().
+static keymaster_error_t write_eat_submod(const AuthorizationSet& auth_list,
+                                          const EatSecurityLevel security_level,
+                                          size_t entry_count, CborWriter* writer) {
+    writer->WriteHeader(CborWriter::kMap, entry_count);
+    writer->WriteClaim(EatClaim::SECURITY_LEVEL);
+    writer->WriteInt(get_uint32_value(security_level));
+
+    EatField field;
+    for (size_t i = 0; i < auth_list.size(); ++i) {
+        keymaster_error_t error = eat_field(auth_list[i], security_level, &field);
+        if (error != KM_ERROR_OK) return error;
+
+        switch (field.kind) {
+        case EatField::SKIPPED:
+        case EatField::REPEATED:
+            continue;
+        case EatField::UINT:
+            writer->WriteClaim(field.claim);
+            writer->WriteHeader(CborWriter::kUnsigned, field.value);
             break;
-        case KM_TAG_ATTESTATION_ID_PRODUCT:
-            submod->add(EatClaim::ATTESTATION_ID_PRODUCT, blob_to_bstr(entry.blob));
+        case EatField::BOOL:
+            writer->WriteClaim(field.claim);
+            writer->WriteBool(true);
             break;
-        case KM_TAG_ATTESTATION_ID_SERIAL:
-            submod->add(EatClaim::ATTESTATION_ID_SERIAL, blob_to_bstr(entry.blob));
+        case EatField::BSTR:
+            writer->WriteClaim(field.claim);
+            writer->WriteByteString(field.blob.data, field.blob.data_length);
             break;
-        case KM_TAG_ATTESTATION_ID_IMEI: {
-            cppbor::Bstr ueid("");
-            keymaster_error_t error = imei_to_ueid(entry.blob, &ueid);
+        case EatField::UEID: {
+            uint8_t ueid[kUeidLength];
+            error = imei_to_ueid_bytes(field.blob, ueid);
             if (error != KM_ERROR_OK) return error;
-            submod->add(EatClaim::UEID, ueid);
+            writer->WriteClaim(field.claim);
+            writer->WriteByteString(ueid, sizeof(ueid));
             break;
         }
-        case KM_TAG_ATTESTATION_ID_MEID:
-            submod->add(EatClaim::ATTESTATION_ID_MEID, blob_to_bstr(entry.blob));
-            break;
-        case KM_TAG_ATTESTATION_ID_MANUFACTURER:
-            submod->add(EatClaim::ATTESTATION_ID_MANUFACTURER, blob_to_bstr(entry.blob));
-            break;
-        case KM_TAG_ATTESTATION_ID_MODEL:
-            submod->add(EatClaim::ATTESTATION_ID_MODEL, blob_to_bstr(entry.blob));
-            break;
-        case KM_TAG_CONFIRMATION_TOKEN:
-            submod->add(EatClaim::CONFIRMATION_TOKEN, blob_to_bstr(entry.blob));
-            break;
         }
     }
 
-    // Move values from repeating enums into the submod map.
-    for (auto const& repeating_field : repeating_fields) {
-        EatClaim key = static_cast<EatClaim>(repeating_field.first);
-        submod->add(key, std::move(repeating_fields.at(key)));
+    // Repeated fields follow, in the order their first values appear.
+    for (size_t i = 0; i < auth_list.size(); ++i) {
+        eat_field(auth_list[i], security_level, &field);
+        if (field.kind != EatField::REPEATED) continue;
+        size_t count = repeated_field_count(auth_list, security_level, i, field.claim);
+        if (count == 0) continue;
+
+        writer->WriteClaim(field.claim);
+        writer->WriteHeader(CborWriter::kArray, count);
+        EatClaim claim = field.claim;
+        for (size_t j = i; count; ++j) {
+            eat_field(auth_list[j], security_level, &field);
+            if (field.kind != EatField::REPEATED || field.claim != claim) continue;
+            writer->WriteHeader(CborWriter::kUnsigned, field.value);
+            --count;
+        }
     }
 
+    bool implied_curve;
     int ec_curve;
-    uint32_t key_size;
-    if (auth_list.Contains(TAG_ALGORITHM, KM_ALGORITHM_EC) && !auth_list.Contains(TAG_EC_CURVE) &&
-        auth_list.GetTagValue(TAG_KEY_SIZE, &key_size)) {
-        // This must be a keymaster1 key. It's an EC key with no curve.  Insert the curve.
-
-        keymaster_error_t error = ec_key_size_to_eat_curve(key_size, &ec_curve);
-        if (error != KM_ERROR_OK) return error;
-
-        submod->add(EatClaim::EC_CURVE, ec_curve);
+    keymaster_error_t error = get_implied_ec_curve(auth_list, &implied_curve, &ec_curve);
+    if (error != KM_ERROR_OK) return error;
+    if (implied_curve) {
+        writer->WriteClaim(EatClaim::EC_CURVE);
+        writer->WriteInt(ec_curve);
     }
 
     return KM_ERROR_OK;
 }
 
+// Returns true for tags that are never included in an attested authorization list.
+static bool excluded_from_auth_list(keymaster_tag_t tag) {
+    switch (tag) {
+    /* Tags ignored because they should never exist */
+    case KM_TAG_INVALID:
+
+    /* Tags ignored because they're not used. */
+    case KM_TAG_ALL_USERS:
+    case KM_TAG_EXPORTABLE:
+    case KM_TAG_ECIES_SINGLE_HASH_MODE:
+
+    /* Tags ignored because they're used only to provide information to operations */
+    case KM_TAG_ASSOCIATED_DATA:
+    case KM_TAG_NONCE:
+    case KM_TAG_AUTH_TOKEN:
+    case KM_TAG_MAC_LENGTH:
+    case KM_TAG_ATTESTATION_CHALLENGE:
+    case KM_TAG_KDF:
+
+    /* Tags ignored because they're used only to provide for certificate generation */
+    case KM_TAG_CERTIFICATE_SERIAL:
+    case KM_TAG_CERTIFICATE_SUBJECT:
+    case KM_TAG_CERTIFICATE_NOT_BEFORE:
+    case KM_TAG_CERTIFICATE_NOT_AFTER:
+    case KM_TAG_INCLUDE_UNIQUE_ID:
+    case KM_TAG_RESET_SINCE_ID_ROTATION:
+
+    /* Tags ignored because they have no meaning off-device */
+    case KM_TAG_USER_ID:
+    case KM_TAG_USER_SECURE_ID:
+    case KM_TAG_BLOB_USAGE_REQUIREMENTS:
+
+    /* Tags ignored because they're not usable by app keys */
+    case KM_TAG_BOOTLOADER_ONLY:
+    case KM_TAG_MAX_BOOT_LEVEL:
+    case KM_TAG_MAX_USES_PER_BOOT:
+    case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
+    case KM_TAG_STORAGE_KEY:
+    case KM_TAG_UNIQUE_ID:
+
+    /* Tags ignored because they contain data that should not be exported */
+    case KM_TAG_APPLICATION_DATA:
+    case KM_TAG_APPLICATION_ID:
+    case KM_TAG_CONFIRMATION_TOKEN:
+    case KM_TAG_ROOT_OF_TRUST:
+        return true;
+    default:
+        return false;
+    }
+}
+
 // Put the contents of the keymaster AuthorizationSet auth_list into the ASN.1 record structure,
 // record.
 keymaster_error_t build_auth_list(const AuthorizationSet& auth_list, KM_AUTH_LIST* record) {
@@ -501,52 +833,9 @@ keymaster_error_t build_auth_list(const AuthorizationSet& auth_list, KM_AUTH_LIS
         ASN1_OCTET_STRING** string_ptr = nullptr;
         ASN1_NULL** bool_ptr = nullptr;
 
-        switch (entry.tag) {
-
-        /* Tags ignored because they should never exist */
-        case KM_TAG_INVALID:
-
-        /* Tags ignored because they're not used. */
-        case KM_TAG_ALL_USERS:
-        case KM_TAG_EXPORTABLE:
-        case KM_TAG_ECIES_SINGLE_HASH_MODE:
-
-        /* Tags ignored because they're used only to provide information to operations */
-        case KM_TAG_ASSOCIATED_DATA:
-        case KM_TAG_NONCE:
-        case KM_TAG_AUTH_TOKEN:
-        case KM_TAG_MAC_LENGTH:
-        case KM_TAG_ATTESTATION_CHALLENGE:
-        case KM_TAG_KDF:
-
-        /* Tags ignored because they're used only to provide for certificate generation */
-        case KM_TAG_CERTIFICATE_SERIAL:
-        case KM_TAG_CERTIFICATE_SUBJECT:
-        case KM_TAG_CERTIFICATE_NOT_BEFORE:
-        case KM_TAG_CERTIFICATE_NOT_AFTER:
-        case KM_TAG_INCLUDE_UNIQUE_ID:
-        case KM_TAG_RESET_SINCE_ID_ROTATION:
-
-        /* Tags ignored because they have no meaning off-device */
-        case KM_TAG_USER_ID:
-        case KM_TAG_USER_SECURE_ID:
-        case KM_TAG_BLOB_USAGE_REQUIREMENTS:
-
-        /* Tags ignored because they're not usable by app keys */
-        case KM_TAG_BOOTLOADER_ONLY:
-        case KM_TAG_MAX_BOOT_LEVEL:
-        case KM_TAG_MAX_USES_PER_BOOT:
-        case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
-        case KM_TAG_STORAGE_KEY:
-        case KM_TAG_UNIQUE_ID:
-
-        /* Tags ignored because they contain data that should not be exported */
-        case KM_TAG_APPLICATION_DATA:
-        case KM_TAG_APPLICATION_ID:
-        case KM_TAG_CONFIRMATION_TOKEN:
-        case KM_TAG_ROOT_OF_TRUST:
-            continue;
+        if (excluded_from_auth_list(entry.tag)) continue;
 
+        switch (entry.tag) {
         /* Non-repeating enumerations */
         case KM_TAG_ALGORITHM:
             integer_ptr = &record->algorithm;
@@ -692,6 +981,9 @@ keymaster_error_t build_auth_list(const AuthorizationSet& auth_list, KM_AUTH_LIS
         case KM_TAG_ATTESTATION_ID_MODEL:
             string_ptr = &record->attestation_id_model;
             break;
+
+        default:
+            break;
         }
 
         keymaster_tag_type_t type = keymaster_tag_get_type(entry.tag);
@@ -799,60 +1091,135 @@ keymaster_error_t build_auth_list(const AuthorizationSet& auth_list, KM_AUTH_LIS
     return KM_ERROR_OK;
 }
 
+// Everything that goes into an EAT record, gathered and validated by build_eat_record().
+struct EatRecordFields {
+    EatSecurityLevel security_level;
+    const AttestationContext::VerifiedBootParams* vb_params;
+    KmVersion km_version;
+    keymaster_blob_t attestation_challenge;
+    bool device_unique_attestation;
+    const AuthorizationSet* sw_enforced;
+    size_t sw_entry_count;
+    const AuthorizationSet* tee_enforced;
+    size_t tee_entry_count;
+    const Buffer* unique_id;  // Null if the record has none.
+};
+
+static keymaster_error_t write_eat_record(const EatRecordFields& fields, CborWriter* writer) {
+    const AttestationContext::VerifiedBootParams& vb_params = *fields.vb_params;
+    size_t submod_count = (fields.sw_entry_count ? 1 : 0) + (fields.tee_entry_count ? 1 : 0);
+
+    // SECURITY_LEVEL, BOOT_STATE, OFFICIAL_BUILD, ATTESTATION_VERSION, KEYMASTER_VERSION and NONCE
+    // are always present.
+    size_t entry_count = 6;
+    if (vb_params.verified_boot_key.data_length) ++entry_count;
+    if (vb_params.verified_boot_hash.data_length) ++entry_count;
+    if (vb_params.device_locked) ++entry_count;
+    if (fields.device_unique_attestation) ++entry_count;
+    if (submod_count) ++entry_count;
+    if (fields.unique_id) ++entry_count;
+    writer->WriteHeader(CborWriter::kMap, entry_count);
+
+    writer->WriteClaim(EatClaim::SECURITY_LEVEL);
+    writer->WriteInt(get_uint32_value(fields.security_level));
+
+    if (vb_params.verified_boot_key.data_length) {
+        writer->WriteClaim(EatClaim::VERIFIED_BOOT_KEY);
+        writer->WriteByteString(vb_params.verified_boot_key.data,
+                                vb_params.verified_boot_key.data_length);
+    }
+    if (vb_params.verified_boot_hash.data_length) {
+        writer->WriteClaim(EatClaim::VERIFIED_BOOT_HASH);
+        writer->WriteByteString(vb_params.verified_boot_hash.data,
+                                vb_params.verified_boot_hash.data_length);
+    }
+    if (vb_params.device_locked) {
+        writer->WriteClaim(EatClaim::DEVICE_LOCKED);
+        writer->WriteBool(true);
+    }
+
+    bool verified_or_self_signed = (vb_params.verified_boot_state == KM_VERIFIED_BOOT_VERIFIED ||
+                                    vb_params.verified_boot_state == KM_VERIFIED_BOOT_SELF_SIGNED);
+    writer->WriteClaim(EatClaim::BOOT_STATE);
+    writer->WriteHeader(CborWriter::kArray, 5);
+    writer->WriteBool(verified_or_self_signed);  // secure-boot-enabled
+    writer->WriteBool(verified_or_self_signed);  // debug-disabled
+    writer->WriteBool(verified_or_self_signed);  // debug-disabled-since-boot
+    writer->WriteBool(verified_or_self_signed);  // debug-permanent-disable
+    writer->WriteBool(false);  // debug-full-permanent-disable (no way to verify)
+    writer->WriteClaim(EatClaim::OFFICIAL_BUILD);
+    writer->WriteBool(vb_params.verified_boot_state == KM_VERIFIED_BOOT_VERIFIED);
+
+    writer->WriteClaim(EatClaim::ATTESTATION_VERSION);
+    writer->WriteHeader(CborWriter::kUnsigned, version_to_attestation_version(fields.km_version));
+    writer->WriteClaim(EatClaim::KEYMASTER_VERSION);
+    writer->WriteHeader(CborWriter::kUnsigned,
+                        version_to_attestation_km_version(fields.km_version));
+
+    writer->WriteClaim(EatClaim::NONCE);
+    writer->WriteByteString(fields.attestation_challenge.data,
+                            fields.attestation_challenge.data_length);
+
+    if (fields.device_unique_attestation) {
+        writer->WriteClaim(EatClaim::DEVICE_UNIQUE_ATTESTATION);
+        writer->WriteBool(true);
+    }
+
+    if (submod_count) {
+        writer->WriteClaim(EatClaim::SUBMODS);
+        writer->WriteHeader(CborWriter::kMap, submod_count);
+        if (fields.sw_entry_count) {
+            writer->WriteTextString(kEatSubmodNameSoftware);
+            keymaster_error_t error =
+                write_eat_submod(*fields.sw_enforced, EatSecurityLevel::UNRESTRICTED,
+                                 fields.sw_entry_count, writer);
+            if (error != KM_ERROR_OK) return error;
+        }
+        if (fields.tee_entry_count) {
+            writer->WriteTextString(kEatSubmodNameTee);
+            keymaster_error_t error =
+                write_eat_submod(*fields.tee_enforced, EatSecurityLevel::SECURE_RESTRICTED,
+                                 fields.tee_entry_count, writer);
+            if (error != KM_ERROR_OK) return error;
+        }
+    }
+
+    if (fields.unique_id) {
+        writer->WriteClaim(EatClaim::CTI);
+        writer->WriteByteString(fields.unique_id->begin(), fields.unique_id->available_read());
+    }
+
+    return writer->ok() ? KM_ERROR_OK : KM_ERROR_UNKNOWN_ERROR;
+}
+
 // Construct a CBOR-encoded attestation record containing the values from sw_enforced
-// and tee_enforced.
+// and tee_enforced.  The record is encoded straight from the authorization sets: a measuring pass
+// sizes |eat_token| exactly, then a second pass writes into it.
 keymaster_error_t build_eat_record(const AuthorizationSet& attestation_params,
                                    AuthorizationSet sw_enforced, AuthorizationSet tee_enforced,
                                    const AttestationContext& context,
                                    std::vector<uint8_t>* eat_token) {
     ASSERT_OR_RETURN_ERROR(eat_token, KM_ERROR_UNEXPECTED_NULL_POINTER);
 
-    cppbor::Map eat_record;
+    EatRecordFields fields = {};
     switch (context.GetSecurityLevel()) {
     case KM_SECURITY_LEVEL_SOFTWARE:
-        eat_record.add(EatClaim::SECURITY_LEVEL, get_uint32_value(EatSecurityLevel::UNRESTRICTED));
+        fields.security_level = EatSecurityLevel::UNRESTRICTED;
         break;
     case KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT:
-        eat_record.add(EatClaim::SECURITY_LEVEL,
-                       get_uint32_value(EatSecurityLevel::SECURE_RESTRICTED));
+        fields.security_level = EatSecurityLevel::SECURE_RESTRICTED;
         break;
     case KM_SECURITY_LEVEL_STRONGBOX:
-        eat_record.add(EatClaim::SECURITY_LEVEL, get_uint32_value(EatSecurityLevel::HARDWARE));
+        fields.security_level = EatSecurityLevel::HARDWARE;
         break;
     default:
         return KM_ERROR_UNKNOWN_ERROR;
     }
 
     keymaster_error_t error;
-    const AttestationContext::VerifiedBootParams* vb_params = context.GetVerifiedBootParams(&error);
+    fields.vb_params = context.GetVerifiedBootParams(&error);
     if (error != KM_ERROR_OK) return error;
-
-    if (vb_params->verified_boot_key.data_length) {
-        eat_record.add(EatClaim::VERIFIED_BOOT_KEY, blob_to_bstr(vb_params->verified_boot_key));
-    }
-    if (vb_params->verified_boot_hash.data_length) {
-        eat_record.add(EatClaim::VERIFIED_BOOT_HASH, blob_to_bstr(vb_params->verified_boot_hash));
-    }
-    if (vb_params->device_locked) {
-        eat_record.add(EatClaim::DEVICE_LOCKED, vb_params->device_locked);
-    }
-
-    bool verified_or_self_signed = (vb_params->verified_boot_state == KM_VERIFIED_BOOT_VERIFIED ||
-                                    vb_params->verified_boot_state == KM_VERIFIED_BOOT_SELF_SIGNED);
-    auto eat_boot_state = cppbor::Array()
-                              .add(verified_or_self_signed)  // secure-boot-enabled
-                              .add(verified_or_self_signed)  // debug-disabled
-                              .add(verified_or_self_signed)  // debug-disabled-since-boot
-                              .add(verified_or_self_signed)  // debug-permanent-disable
-                              .add(false);  // debug-full-permanent-disable (no way to verify)
-    eat_record.add(EatClaim::BOOT_STATE, std::move(eat_boot_state));
-    eat_record.add(EatClaim::OFFICIAL_BUILD,
-                   vb_params->verified_boot_state == KM_VERIFIED_BOOT_VERIFIED);
-
-    eat_record.add(EatClaim::ATTESTATION_VERSION,
-                   version_to_attestation_version(context.GetKmVersion()));
-    eat_record.add(EatClaim::KEYMASTER_VERSION,
-                   version_to_attestation_km_version(context.GetKmVersion()));
+    fields.km_version = context.GetKmVersion();
 
     keymaster_blob_t attestation_challenge = {nullptr, 0};
     if (!attestation_params.GetTagValue(TAG_ATTESTATION_CHALLENGE, &attestation_challenge)) {
@@ -862,8 +1229,7 @@ keymaster_error_t build_eat_record(const AuthorizationSet& attestation_params,
     if (!is_valid_attestation_challenge(attestation_challenge)) {
         return KM_ERROR_INVALID_INPUT_LENGTH;
     }
-
-    eat_record.add(EatClaim::NONCE, blob_to_bstr(attestation_challenge));
+    fields.attestation_challenge = attestation_challenge;
 
     keymaster_blob_t attestation_app_id;
     if (!attestation_params.GetTagValue(TAG_ATTESTATION_APPLICATION_ID, &attestation_app_id)) {
@@ -892,31 +1258,20 @@ keymaster_error_t build_eat_record(const AuthorizationSet& attestation_params,
         return error;
     }
 
-    if (attestation_params.Contains(TAG_DEVICE_UNIQUE_ATTESTATION) &&
-        context.GetSecurityLevel() == KM_SECURITY_LEVEL_STRONGBOX) {
-        eat_record.add(EatClaim::DEVICE_UNIQUE_ATTESTATION, true);
-    }
+    fields.device_unique_attestation = attestation_params.Contains(TAG_DEVICE_UNIQUE_ATTESTATION) &&
+                                       context.GetSecurityLevel() == KM_SECURITY_LEVEL_STRONGBOX;
 
-    cppbor::Map software_submod;
-    error = build_eat_submod(sw_enforced, EatSecurityLevel::UNRESTRICTED, &software_submod);
+    error = count_eat_submod_entries(sw_enforced, EatSecurityLevel::UNRESTRICTED,
+                                     &fields.sw_entry_count);
     if (error != KM_ERROR_OK) return error;
+    fields.sw_enforced = &sw_enforced;
 
-    cppbor::Map tee_submod;
-    error = build_eat_submod(tee_enforced, EatSecurityLevel::SECURE_RESTRICTED, &tee_submod);
+    error = count_eat_submod_entries(tee_enforced, EatSecurityLevel::SECURE_RESTRICTED,
+                                     &fields.tee_entry_count);
     if (error != KM_ERROR_OK) return error;
+    fields.tee_enforced = &tee_enforced;
 
-    if (software_submod.size() + tee_submod.size() > 0) {
-        cppbor::Map submods;
-        if (software_submod.size() > 0) {
-            submods.add(kEatSubmodNameSoftware, std::move(software_submod));
-        }
-        if (tee_submod.size() > 0) {
-            submods.add(kEatSubmodNameTee, std::move(tee_submod));
-        }
-
-        eat_record.add(EatClaim::SUBMODS, std::move(submods));
-    }
-
+    Buffer unique_id;
     if (attestation_params.GetTagValue(TAG_INCLUDE_UNIQUE_ID)) {
         uint64_t creation_datetime;
         // Only check sw_enforced for TAG_CREATION_DATETIME, since it shouldn't be in tee_enforced,
@@ -926,27 +1281,32 @@ keymaster_error_t build_eat_record(const AuthorizationSet& attestation_params,
             return KM_ERROR_INVALID_KEY_BLOB;
         }
 
-        Buffer unique_id = context.GenerateUniqueId(
+        unique_id = context.GenerateUniqueId(
             creation_datetime, attestation_app_id,
             attestation_params.GetTagValue(TAG_RESET_SINCE_ID_ROTATION), &error);
         if (error != KM_ERROR_OK) return error;
-
-        eat_record.add(EatClaim::CTI,
-                       cppbor::Bstr(std::pair(unique_id.begin(), unique_id.available_read())));
+        fields.unique_id = &unique_id;
     }
 
-    *eat_token = eat_record.encode();
+    CborWriter measure;
+    error = write_eat_record(fields, &measure);
+    if (error != KM_ERROR_OK) return error;
 
-    return KM_ERROR_OK;
+    eat_token->resize(measure.size());
+    CborWriter writer(eat_token->data(), eat_token->size());
+    return write_eat_record(fields, &writer);
 }
 
+// Unique IDs rotate every 30 days.
+constexpr uint64_t kUniqueIdRotationPeriodMs = 2592000000LLU;
+
 keymaster_error_t build_unique_id_input(uint64_t creation_date_time,
                                         const keymaster_blob_t& application_id,
                                         bool reset_since_rotation, Buffer* input_data) {
     if (input_data == nullptr) {
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
     }
-    uint64_t rounded_date = creation_date_time / 2592000000LLU;
+    uint64_t rounded_date = creation_date_time / kUniqueIdRotationPeriodMs;
     uint8_t* serialized_date = reinterpret_cast<uint8_t*>(&rounded_date);
     uint8_t reset_byte = (reset_since_rotation ? 1 : 0);
 
@@ -983,6 +1343,474 @@ keymaster_error_t generate_unique_id(const std::vector<uint8_t>& hbk, uint64_t c
     return KM_ERROR_OK;
 }
 
+UniqueIdGenerator::UniqueIdGenerator(const std::vector<uint8_t>& hbk) {
+    keyed_ = HMAC_Init_ex(hmac_.get(), hbk.data(), hbk.size(), EVP_sha256(), nullptr /* engine */);
+}
+
+keymaster_error_t UniqueIdGenerator::Generate(uint64_t creation_date_time,
+                                              const keymaster_blob_t& application_id,
+                                              bool reset_since_rotation, Buffer* unique_id) {
+    if (unique_id == nullptr) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    if (!unique_id->Reinitialize(UNIQUE_ID_SIZE)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    keymaster_error_t error = Lookup(creation_date_time / kUniqueIdRotationPeriodMs,
+                                     application_id, reset_since_rotation, unique_id->peek_write());
+    if (error != KM_ERROR_OK) return error;
+    unique_id->advance_write(UNIQUE_ID_SIZE);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t UniqueIdGenerator::Lookup(uint64_t rounded_date,
+                                            const keymaster_blob_t& application_id,
+                                            bool reset_since_rotation, uint8_t* unique_id) {
+    Entry* victim = &entries_[0];
+    for (auto& entry : entries_) {
+        if (entry.last_used != 0 && entry.rounded_date == rounded_date &&
+            entry.reset_since_rotation == reset_since_rotation &&
+            entry.application_id.size() == application_id.data_length &&
+            std::equal(entry.application_id.begin(), entry.application_id.end(),
+                       application_id.data)) {
+            entry.last_used = ++use_counter_;
+            memcpy(unique_id, entry.unique_id, UNIQUE_ID_SIZE);
+            return KM_ERROR_OK;
+        }
+        if (entry.last_used < victim->last_used) victim = &entry;
+    }
+
+    // Same input as build_unique_id_input(), fed to the HMAC piecewise.  Re-initializing without a
+    // key restarts from the key schedule computed in the constructor.
+    if (!keyed_) return KM_ERROR_UNKNOWN_ERROR;
+    uint8_t reset_byte = (reset_since_rotation ? 1 : 0);
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length;
+    if (!HMAC_Init_ex(hmac_.get(), nullptr /* key */, 0, nullptr /* md */, nullptr /* engine */) ||
+        !HMAC_Update(hmac_.get(), reinterpret_cast<const uint8_t*>(&rounded_date),
+                     sizeof(rounded_date)) ||
+        !HMAC_Update(hmac_.get(), application_id.data, application_id.data_length) ||
+        !HMAC_Update(hmac_.get(), &reset_byte, 1) ||
+        !HMAC_Final(hmac_.get(), digest, &digest_length)) {
+        return TranslateLastOpenSslError();
+    }
+    memcpy(unique_id, digest, UNIQUE_ID_SIZE);
+
+    victim->rounded_date = rounded_date;
+    victim->reset_since_rotation = reset_since_rotation;
+    victim->application_id.assign(application_id.data,
+                                  application_id.data + application_id.data_length);
+    memcpy(victim->unique_id, digest, UNIQUE_ID_SIZE);
+    victim->last_used = ++use_counter_;
+    return KM_ERROR_OK;
+}
+
+/**
+ * DerReverseWriter encodes DER from the last byte to the first, so the length of each constructed
+ * value is known by the time its header is written and no intermediate objects are needed.  The
+ * caller provides a buffer large enough for the whole encoding; writes that don't fit are dropped
+ * and make ok() return false.
+ */
+class DerReverseWriter {
+  public:
+    static constexpr uint8_t kBoolean = 0x01;
+    static constexpr uint8_t kInteger = 0x02;
+    static constexpr uint8_t kOctetString = 0x04;
+    static constexpr uint8_t kNull = 0x05;
+    static constexpr uint8_t kEnumerated = 0x0A;
+    static constexpr uint8_t kSequence = 0x30;
+    static constexpr uint8_t kSet = 0x31;
+    static constexpr uint8_t kContextConstructed = 0xA0;
+
+    DerReverseWriter(uint8_t* buf, size_t buf_size)
+        : begin_(buf), pos_(buf + buf_size), end_(buf + buf_size) {}
+
+    bool ok() const { return ok_; }
+    const uint8_t* data() const { return pos_; }
+    size_t size() const { return end_ - pos_; }
+
+    void WriteBytes(const uint8_t* data, size_t len) {
+        if (!ok_ || static_cast<size_t>(pos_ - begin_) < len) {
+            ok_ = false;
+            return;
+        }
+        pos_ -= len;
+        if (len) memcpy(pos_, data, len);
+    }
+
+    void WriteByte(uint8_t value) { WriteBytes(&value, 1); }
+
+    // Prepends identifier and length octets for everything written since size() returned |mark|.
+    void WriteHeader(uint8_t identifier, size_t mark) {
+        WriteLength(size() - mark);
+        WriteByte(identifier);
+    }
+
+    // Like WriteHeader(), for an EXPLICIT context-specific tag, which is in the high tag number
+    // form for all but the first 31 tag numbers.
+    void WriteExplicitHeader(uint32_t tag_number, size_t mark) {
+        WriteLength(size() - mark);
+        if (tag_number < 0x1F) {
+            WriteByte(kContextConstructed | tag_number);
+            return;
+        }
+        WriteByte(tag_number & 0x7F);
+        for (tag_number >>= 7; tag_number; tag_number >>= 7) {
+            WriteByte(0x80 | (tag_number & 0x7F));
+        }
+        WriteByte(kContextConstructed | 0x1F);
+    }
+
+    // Writes a non-negative INTEGER or ENUMERATED in minimal two's complement form.
+    void WriteUnsigned(uint8_t identifier, uint64_t value) {
+        size_t mark = size();
+        do {
+            WriteByte(value & 0xFF);
+            value >>= 8;
+        } while (value);
+        if (ok_ && (*pos_ & 0x80)) WriteByte(0);
+        WriteHeader(identifier, mark);
+    }
+
+    void WriteOctetString(const uint8_t* data, size_t len) {
+        size_t mark = size();
+        WriteBytes(data, len);
+        WriteHeader(kOctetString, mark);
+    }
+
+    // Moves the encoding to the start of the buffer and returns its length.
+    size_t MoveToFront() {
+        size_t len = size();
+        memmove(begin_, pos_, len);
+        pos_ = begin_;
+        end_ = begin_ + len;
+        return len;
+    }
+
+  private:
+    void WriteLength(size_t len) {
+        if (len < 0x80) {
+            WriteByte(static_cast<uint8_t>(len));
+            return;
+        }
+        uint8_t count = 0;
+        for (; len; len >>= 8, ++count) {
+            WriteByte(len & 0xFF);
+        }
+        WriteByte(0x80 | count);
+    }
+
+    uint8_t* begin_;
+    uint8_t* pos_;
+    uint8_t* end_;
+    bool ok_ = true;
+};
+
+// The tags of KM_AUTH_LIST, in the order they're encoded.  KM_TAG_KDF and KM_TAG_APPLICATION_ID
+// are part of the schema but are excluded from attested lists, so they're left out.
+static constexpr keymaster_tag_t kAuthListTags[] = {
+    KM_TAG_PURPOSE,
+    KM_TAG_ALGORITHM,
+    KM_TAG_KEY_SIZE,
+    KM_TAG_BLOCK_MODE,
+    KM_TAG_DIGEST,
+    KM_TAG_PADDING,
+    KM_TAG_CALLER_NONCE,
+    KM_TAG_MIN_MAC_LENGTH,
+    KM_TAG_EC_CURVE,
+    KM_TAG_RSA_PUBLIC_EXPONENT,
+    KM_TAG_RSA_OAEP_MGF_DIGEST,
+    KM_TAG_ROLLBACK_RESISTANCE,
+    KM_TAG_EARLY_BOOT_ONLY,
+    KM_TAG_ACTIVE_DATETIME,
+    KM_TAG_ORIGINATION_EXPIRE_DATETIME,
+    KM_TAG_USAGE_EXPIRE_DATETIME,
+    KM_TAG_USAGE_COUNT_LIMIT,
+    KM_TAG_NO_AUTH_REQUIRED,
+    KM_TAG_USER_AUTH_TYPE,
+    KM_TAG_AUTH_TIMEOUT,
+    KM_TAG_ALLOW_WHILE_ON_BODY,
+    KM_TAG_TRUSTED_USER_PRESENCE_REQUIRED,
+    KM_TAG_TRUSTED_CONFIRMATION_REQUIRED,
+    KM_TAG_UNLOCKED_DEVICE_REQUIRED,
+    KM_TAG_ALL_APPLICATIONS,
+    KM_TAG_CREATION_DATETIME,
+    KM_TAG_ORIGIN,
+    KM_TAG_ROLLBACK_RESISTANT,
+    KM_TAG_ROOT_OF_TRUST,
+    KM_TAG_OS_VERSION,
+    KM_TAG_OS_PATCHLEVEL,
+    KM_TAG_ATTESTATION_APPLICATION_ID,
+    KM_TAG_ATTESTATION_ID_BRAND,
+    KM_TAG_ATTESTATION_ID_DEVICE,
+    KM_TAG_ATTESTATION_ID_PRODUCT,
+    KM_TAG_ATTESTATION_ID_SERIAL,
+    KM_TAG_ATTESTATION_ID_IMEI,
+    KM_TAG_ATTESTATION_ID_MEID,
+    KM_TAG_ATTESTATION_ID_MANUFACTURER,
+    KM_TAG_ATTESTATION_ID_MODEL,
+    KM_TAG_VENDOR_PATCHLEVEL,
+    KM_TAG_BOOT_PATCHLEVEL,
+    KM_TAG_DEVICE_UNIQUE_ATTESTATION,
+    KM_TAG_IDENTITY_CREDENTIAL_KEY,
+    KM_TAG_ATTESTATION_ID_SECOND_IMEI,
+};
+
+// Upper bound on the encoding of a single auth list entry, excluding the contents of blobs:
+// explicit tag and length, SET tag and length, and an INTEGER of up to 64 bits.
+constexpr size_t kMaxAuthListEntryOverhead = 32;
+
+// Upper bound on the encoding of a KM_KEY_DESCRIPTION and its root of trust, excluding the
+// contents of blobs and of the authorization lists.
+constexpr size_t kMaxKeyDescriptionOverhead = 128;
+
+// All schema tag numbers (tags without their type bits) are below this.
+constexpr uint32_t kAuthListTagNumberLimit = 1024;
+
+constexpr uint32_t auth_list_tag_number(keymaster_tag_t tag) {
+    return static_cast<uint32_t>(tag) & 0x0FFFFFFF;
+}
+
+// kAuthListTags indexed by tag number, so that in_auth_list_schema() is a lookup rather than a scan
+// of the schema for every entry.  Unused slots hold KM_TAG_INVALID.
+struct AuthListSchemaTable {
+    keymaster_tag_t tags[kAuthListTagNumberLimit];
+};
+
+constexpr AuthListSchemaTable build_auth_list_schema_table() {
+    AuthListSchemaTable table = {};
+    for (keymaster_tag_t tag : kAuthListTags) {
+        if (tag == KM_TAG_ROOT_OF_TRUST) continue;
+        table.tags[auth_list_tag_number(tag)] = tag;
+    }
+    return table;
+}
+
+constexpr bool auth_list_tag_numbers_in_range() {
+    for (keymaster_tag_t tag : kAuthListTags) {
+        if (auth_list_tag_number(tag) >= kAuthListTagNumberLimit) return false;
+    }
+    return true;
+}
+static_assert(auth_list_tag_numbers_in_range(), "kAuthListTagNumberLimit is too small");
+
+static constexpr AuthListSchemaTable kAuthListSchema = build_auth_list_schema_table();
+
+static bool in_auth_list_schema(keymaster_tag_t tag) {
+    uint32_t number = auth_list_tag_number(tag);
+    if (number >= kAuthListTagNumberLimit) return false;
+    return tag != KM_TAG_INVALID && kAuthListSchema.tags[number] == tag;
+}
+
+// Checks that build_auth_list() would accept auth_list, and returns the EC curve to add for EC
+// keys that lack one, or -1 if none is needed.
+static keymaster_error_t check_auth_list(const AuthorizationSet& auth_list, int* implied_curve) {
+    *implied_curve = -1;
+    for (auto& entry : auth_list) {
+        if (excluded_from_auth_list(entry.tag) || in_auth_list_schema(entry.tag)) continue;
+        switch (keymaster_tag_get_type(entry.tag)) {
+        case KM_ENUM:
+        case KM_ENUM_REP:
+        case KM_UINT:
+        case KM_UINT_REP:
+        case KM_ULONG:
+        case KM_ULONG_REP:
+        case KM_DATE:
+        case KM_BOOL:
+        case KM_BYTES:
+            return KM_ERROR_INVALID_TAG;
+        default:
+            return KM_ERROR_UNIMPLEMENTED;
+        }
+    }
+
+    keymaster_ec_curve_t ec_curve;
+    uint32_t key_size;
+    if (auth_list.Contains(TAG_ALGORITHM, KM_ALGORITHM_EC) &&  //
+        !auth_list.Contains(TAG_EC_CURVE) &&                   //
+        auth_list.GetTagValue(TAG_KEY_SIZE, &key_size)) {
+        // This must be a keymaster1 key; see build_auth_list().
+        keymaster_error_t error = EcKeySizeToCurve(key_size, &ec_curve);
+        if (error != KM_ERROR_OK) return error;
+        *implied_curve = ec_curve;
+    }
+    return KM_ERROR_OK;
+}
+
+static size_t max_auth_list_size(const AuthorizationSet& auth_list) {
+    size_t size = kMaxAuthListEntryOverhead * (auth_list.size() + 2);
+    for (auto& entry : auth_list) {
+        if (keymaster_tag_get_type(entry.tag) == KM_BYTES) size += entry.blob.data_length;
+    }
+    return size;
+}
+
+static void write_root_of_trust(const AttestationContext::VerifiedBootParams& vb_params,
+                                DerReverseWriter* writer) {
+    size_t mark = writer->size();
+    writer->WriteOctetString(vb_params.verified_boot_hash.data,
+                             vb_params.verified_boot_hash.data_length);
+    writer->WriteUnsigned(DerReverseWriter::kEnumerated, vb_params.verified_boot_state);
+    writer->WriteByte(vb_params.device_locked ? 0xFF : 0x00);
+    writer->WriteByte(1 /* length */);
+    writer->WriteByte(DerReverseWriter::kBoolean);
+    writer->WriteOctetString(vb_params.verified_boot_key.data,
+                             vb_params.verified_boot_key.data_length);
+    writer->WriteHeader(DerReverseWriter::kSequence, mark);
+}
+
+// Upper bound on the encoding of a RootOfTrust, excluding the contents of its blobs.
+constexpr size_t kMaxRootOfTrustOverhead = 32;
+
+// CBOR tag of the RootOfTrust returned by GetRootOfTrust.
+constexpr int kRoTVersion1 = 40001;
+
+keymaster_error_t encode_root_of_trust(const AttestationContext::VerifiedBootParams& vb_params,
+                                       std::optional<uint32_t> boot_patchlevel,
+                                       AttestationContext::RootOfTrustEncodings* encodings) {
+    size_t max_size = kMaxRootOfTrustOverhead + vb_params.verified_boot_key.data_length +
+                      vb_params.verified_boot_hash.data_length;
+    encodings->der.resize(max_size);
+    DerReverseWriter writer(encodings->der.data(), max_size);
+    write_root_of_trust(vb_params, &writer);
+    if (!writer.ok()) return KM_ERROR_UNKNOWN_ERROR;
+    encodings->der.resize(writer.MoveToFront());
+
+    encodings->cbor.clear();
+    if (boot_patchlevel) {
+        encodings->cbor = encode_root_of_trust_cbor(vb_params, *boot_patchlevel);
+    }
+    return KM_ERROR_OK;
+}
+
+std::vector<uint8_t>
+encode_root_of_trust_cbor(const AttestationContext::VerifiedBootParams& vb_params,
+                          uint32_t boot_patchlevel) {
+    const keymaster_blob_t& key = vb_params.verified_boot_key;
+    const keymaster_blob_t& hash = vb_params.verified_boot_hash;
+    return cppbor::SemanticTag(kRoTVersion1, cppbor::Array(std::pair(key.data, key.data_length),
+                                                           vb_params.device_locked,
+                                                           vb_params.verified_boot_state,
+                                                           std::pair(hash.data, hash.data_length),
+                                                           boot_patchlevel))
+        .encode();
+}
+
+void RootOfTrustCache::Invalidate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++generation_;
+}
+
+std::shared_ptr<const AttestationContext::RootOfTrustEncodings>
+RootOfTrustCache::Get(const AttestationContext::VerifiedBootParams& vb_params,
+                      std::optional<uint32_t> boot_patchlevel) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (encodings_ && encodings_->generation == generation_) return encodings_;
+
+    std::shared_ptr<AttestationContext::RootOfTrustEncodings> encodings(
+        new (std::nothrow) AttestationContext::RootOfTrustEncodings);
+    if (!encodings) return nullptr;
+    encodings->generation = generation_;
+    if (encode_root_of_trust(vb_params, boot_patchlevel, encodings.get()) != KM_ERROR_OK) {
+        return nullptr;
+    }
+    encodings_ = std::move(encodings);
+    return encodings_;
+}
+
+// Writes the SET OF INTEGER for a repeated tag.  DER orders the elements by their encodings, which
+// for non-negative integers is numeric order, so they're written from the largest down.
+static void write_integer_set(const AuthorizationSet& auth_list, keymaster_tag_t tag,
+                              DerReverseWriter* writer) {
+    size_t mark = writer->size();
+    bool have_bound = false;
+    uint32_t bound = 0;
+    while (true) {
+        bool found = false;
+        uint32_t largest = 0;
+        size_t count = 0;
+        for (auto& entry : auth_list) {
+            if (entry.tag != tag) continue;
+            uint32_t value = get_uint32_value(entry);
+            if (have_bound && value >= bound) continue;
+            if (!found || value > largest) {
+                found = true;
+                largest = value;
+                count = 0;
+            }
+            if (value == largest) ++count;
+        }
+        if (!found) break;
+        while (count--) writer->WriteUnsigned(DerReverseWriter::kInteger, largest);
+        have_bound = true;
+        bound = largest;
+    }
+    writer->WriteHeader(DerReverseWriter::kSet, mark);
+}
+
+// Writes auth_list as a KM_AUTH_LIST SEQUENCE.  Non-repeated tags that occur more than once take
+// their last value, as in build_auth_list().  |root_of_trust| is an encoded RootOfTrust, or null.
+static void write_auth_list(const AuthorizationSet& auth_list, int implied_curve,
+                            const std::vector<uint8_t>* root_of_trust, DerReverseWriter* writer) {
+    size_t list_mark = writer->size();
+    for (size_t i = sizeof(kAuthListTags) / sizeof(kAuthListTags[0]); i-- > 0;) {
+        keymaster_tag_t tag = kAuthListTags[i];
+        size_t mark = writer->size();
+
+        if (tag == KM_TAG_ROOT_OF_TRUST) {
+            if (!root_of_trust) continue;
+            writer->WriteBytes(root_of_trust->data(), root_of_trust->size());
+            writer->WriteExplicitHeader(keymaster_tag_mask_type(tag), mark);
+            continue;
+        }
+
+        keymaster_tag_type_t type = keymaster_tag_get_type(tag);
+        if (keymaster_tag_repeatable(tag)) {
+            if (auth_list.find(tag) == -1) continue;
+            write_integer_set(auth_list, tag, writer);
+            writer->WriteExplicitHeader(keymaster_tag_mask_type(tag), mark);
+            continue;
+        }
+
+        const keymaster_key_param_t* last = nullptr;
+        for (auto& entry : auth_list) {
+            if (entry.tag == tag) last = &entry;
+        }
+
+        switch (type) {
+        case KM_ENUM:
+        case KM_UINT:
+            if (last) {
+                writer->WriteUnsigned(DerReverseWriter::kInteger, get_uint32_value(*last));
+            } else if (tag == KM_TAG_EC_CURVE && implied_curve >= 0) {
+                writer->WriteUnsigned(DerReverseWriter::kInteger, implied_curve);
+            } else {
+                continue;
+            }
+            break;
+        case KM_ULONG:
+            if (!last) continue;
+            writer->WriteUnsigned(DerReverseWriter::kInteger, last->long_integer);
+            break;
+        case KM_DATE:
+            if (!last) continue;
+            writer->WriteUnsigned(DerReverseWriter::kInteger, last->date_time);
+            break;
+        case KM_BOOL:
+            if (!last) continue;
+            writer->WriteByte(0 /* length */);
+            writer->WriteByte(DerReverseWriter::kNull);
+            break;
+        case KM_BYTES:
+            if (!last) continue;
+            writer->WriteOctetString(last->blob.data, last->blob.data_length);
+            break;
+        default:
+            continue;
+        }
+        writer->WriteExplicitHeader(keymaster_tag_mask_type(tag), mark);
+    }
+    writer->WriteHeader(DerReverseWriter::kSequence, list_mark);
+}
+
 // Construct an ASN1.1 DER-encoded attestation record containing the values from sw_enforced and
 // tee_enforced.
 keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_params,  //
@@ -993,46 +1821,9 @@ keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_p
                                            size_t* asn1_key_desc_len) {
     ASSERT_OR_RETURN_ERROR(asn1_key_desc && asn1_key_desc_len, KM_ERROR_UNEXPECTED_NULL_POINTER);
 
-    UniquePtr<KM_KEY_DESCRIPTION, KM_KEY_DESCRIPTION_Delete> key_desc(KM_KEY_DESCRIPTION_new());
-    if (!key_desc.get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    KM_ROOT_OF_TRUST* root_of_trust = nullptr;
-    if (context.GetSecurityLevel() == KM_SECURITY_LEVEL_SOFTWARE) {
-        key_desc->software_enforced->root_of_trust = KM_ROOT_OF_TRUST_new();
-        root_of_trust = key_desc->software_enforced->root_of_trust;
-    } else {
-        key_desc->tee_enforced->root_of_trust = KM_ROOT_OF_TRUST_new();
-        root_of_trust = key_desc->tee_enforced->root_of_trust;
-    }
-
     keymaster_error_t error;
     auto vb_params = context.GetVerifiedBootParams(&error);
     if (error != KM_ERROR_OK) return error;
-    if (vb_params->verified_boot_key.data_length &&
-        !ASN1_OCTET_STRING_set(root_of_trust->verified_boot_key, vb_params->verified_boot_key.data,
-                               vb_params->verified_boot_key.data_length)) {
-        return TranslateLastOpenSslError();
-    }
-    if (vb_params->verified_boot_hash.data_length &&
-        !ASN1_OCTET_STRING_set(root_of_trust->verified_boot_hash,
-                               vb_params->verified_boot_hash.data,
-                               vb_params->verified_boot_hash.data_length)) {
-        return TranslateLastOpenSslError();
-    }
-
-    root_of_trust->device_locked = vb_params->device_locked ? 0xFF : 0x00;
-    if (!ASN1_ENUMERATED_set(root_of_trust->verified_boot_state, vb_params->verified_boot_state)) {
-        return TranslateLastOpenSslError();
-    }
-
-    if (!ASN1_INTEGER_set(key_desc->attestation_version,
-                          version_to_attestation_version(context.GetKmVersion())) ||
-        !ASN1_ENUMERATED_set(key_desc->attestation_security_level, context.GetSecurityLevel()) ||
-        !ASN1_INTEGER_set(key_desc->keymaster_version,
-                          version_to_attestation_km_version(context.GetKmVersion())) ||
-        !ASN1_ENUMERATED_set(key_desc->keymaster_security_level, context.GetSecurityLevel())) {
-        return TranslateLastOpenSslError();
-    }
 
     keymaster_blob_t attestation_challenge = {nullptr, 0};
     if (!attestation_params.GetTagValue(TAG_ATTESTATION_CHALLENGE, &attestation_challenge)) {
@@ -1043,11 +1834,6 @@ keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_p
         return KM_ERROR_INVALID_INPUT_LENGTH;
     }
 
-    if (!ASN1_OCTET_STRING_set(key_desc->attestation_challenge, attestation_challenge.data,
-                               attestation_challenge.data_length)) {
-        return TranslateLastOpenSslError();
-    }
-
     keymaster_blob_t attestation_app_id;
     if (!attestation_params.GetTagValue(TAG_ATTESTATION_APPLICATION_ID, &attestation_app_id)) {
         return KM_ERROR_ATTESTATION_APPLICATION_ID_MISSING;
@@ -1074,12 +1860,15 @@ keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_p
         tee_enforced.push_back(TAG_DEVICE_UNIQUE_ATTESTATION);
     };
 
-    error = build_auth_list(sw_enforced, key_desc->software_enforced);
+    int sw_implied_curve;
+    error = check_auth_list(sw_enforced, &sw_implied_curve);
     if (error != KM_ERROR_OK) return error;
 
-    error = build_auth_list(tee_enforced, key_desc->tee_enforced);
+    int tee_implied_curve;
+    error = check_auth_list(tee_enforced, &tee_implied_curve);
     if (error != KM_ERROR_OK) return error;
 
+    Buffer unique_id;
     if (attestation_params.GetTagValue(TAG_INCLUDE_UNIQUE_ID)) {
         uint64_t creation_datetime;
         // Only check sw_enforced for TAG_CREATION_DATETIME, since it shouldn't be in tee_enforced,
@@ -1089,27 +1878,237 @@ keymaster_error_t build_attestation_record(const AuthorizationSet& attestation_p
             return KM_ERROR_INVALID_KEY_BLOB;
         }
 
-        Buffer unique_id = context.GenerateUniqueId(
+        unique_id = context.GenerateUniqueId(
             creation_datetime, attestation_app_id,
             attestation_params.GetTagValue(TAG_RESET_SINCE_ID_ROTATION), &error);
         if (error != KM_ERROR_OK) return error;
-
-        key_desc->unique_id = ASN1_OCTET_STRING_new();
-        if (!key_desc->unique_id ||
-            !ASN1_OCTET_STRING_set(key_desc->unique_id, unique_id.peek_read(),
-                                   unique_id.available_read()))
-            return TranslateLastOpenSslError();
     }
 
-    int len = i2d_KM_KEY_DESCRIPTION(key_desc.get(), nullptr);
-    if (len < 0) return TranslateLastOpenSslError();
-    *asn1_key_desc_len = len;
-    asn1_key_desc->reset(new (std::nothrow) uint8_t[*asn1_key_desc_len]);
+    // Encode straight into a buffer sized for the worst case, rather than building an ASN.1
+    // object tree with an allocation per value and encoding that.
+    size_t max_size = kMaxKeyDescriptionOverhead + attestation_challenge.data_length +
+                      unique_id.available_read() + vb_params->verified_boot_key.data_length +
+                      vb_params->verified_boot_hash.data_length + max_auth_list_size(sw_enforced) +
+                      max_auth_list_size(tee_enforced);
+    asn1_key_desc->reset(new (std::nothrow) uint8_t[max_size]);
     if (!asn1_key_desc->get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    uint8_t* p = asn1_key_desc->get();
-    len = i2d_KM_KEY_DESCRIPTION(key_desc.get(), &p);
-    if (len < 0) return TranslateLastOpenSslError();
 
+    // Contexts that cache the root of trust encoding save re-encoding it for every record.
+    std::shared_ptr<const AttestationContext::RootOfTrustEncodings> root_of_trust =
+        context.GetRootOfTrustEncodings();
+    AttestationContext::RootOfTrustEncodings local_root_of_trust;
+    if (!root_of_trust) {
+        error = encode_root_of_trust(*vb_params, std::nullopt /* boot_patchlevel */,
+                                     &local_root_of_trust);
+        if (error != KM_ERROR_OK) return error;
+    }
+    const std::vector<uint8_t>* root_of_trust_der =
+        root_of_trust ? &root_of_trust->der : &local_root_of_trust.der;
+
+    // The root of trust goes in the list for the context's own security level.
+    bool software = context.GetSecurityLevel() == KM_SECURITY_LEVEL_SOFTWARE;
+    DerReverseWriter writer(asn1_key_desc->get(), max_size);
+    write_auth_list(tee_enforced, tee_implied_curve, software ? nullptr : root_of_trust_der,
+                    &writer);
+    write_auth_list(sw_enforced, sw_implied_curve, software ? root_of_trust_der : nullptr,
+                    &writer);
+    writer.WriteOctetString(unique_id.peek_read(), unique_id.available_read());
+    writer.WriteOctetString(attestation_challenge.data, attestation_challenge.data_length);
+    writer.WriteUnsigned(DerReverseWriter::kEnumerated, context.GetSecurityLevel());
+    writer.WriteUnsigned(DerReverseWriter::kInteger,
+                         version_to_attestation_km_version(context.GetKmVersion()));
+    writer.WriteUnsigned(DerReverseWriter::kEnumerated, context.GetSecurityLevel());
+    writer.WriteUnsigned(DerReverseWriter::kInteger,
+                         version_to_attestation_version(context.GetKmVersion()));
+    writer.WriteHeader(DerReverseWriter::kSequence, 0 /* mark */);
+    if (!writer.ok()) return KM_ERROR_UNKNOWN_ERROR;
+
+    *asn1_key_desc_len = writer.MoveToFront();
+    return KM_ERROR_OK;
+}
+
+constexpr unsigned kExplicitFieldClass = CBS_ASN1_CONSTRUCTED | CBS_ASN1_CONTEXT_SPECIFIC;
+
+// Reads a non-negative, minimally encoded INTEGER or ENUMERATED, per |tag|, of up to 32 bits.
+static bool get_asn1_uint32(CBS* cbs, unsigned tag, uint32_t* value) {
+    CBS contents;
+    if (!CBS_get_asn1(cbs, &contents, tag) || CBS_len(&contents) == 0 ||
+        CBS_len(&contents) > sizeof(uint32_t) + 1) {
+        return false;
+    }
+    const uint8_t* data = CBS_data(&contents);
+    size_t len = CBS_len(&contents);
+    if ((data[0] & 0x80) || (len > 1 && data[0] == 0 && !(data[1] & 0x80))) return false;
+
+    uint64_t wide = 0;
+    for (size_t i = 0; i < len; ++i) {
+        wide = (wide << 8) | data[i];
+    }
+    if (wide > UINT32_MAX) return false;
+    *value = static_cast<uint32_t>(wide);
+    return true;
+}
+
+// Returns the tag of the KM_AUTH_LIST field with tag number |number|, or KM_TAG_INVALID if there is
+// none.  Unlike in_auth_list_schema(), this accepts every field of the schema, including those
+// never written to attested lists.
+static keymaster_tag_t auth_list_field_tag(uint32_t number) {
+    if (number < kAuthListTagNumberLimit && kAuthListSchema.tags[number] != KM_TAG_INVALID) {
+        return kAuthListSchema.tags[number];
+    }
+    for (keymaster_tag_t tag : {KM_TAG_KDF, KM_TAG_APPLICATION_ID, KM_TAG_ROOT_OF_TRUST}) {
+        if (auth_list_tag_number(tag) == number) return tag;
+    }
+    return KM_TAG_INVALID;
+}
+
+// Reads the next explicitly tagged field of an encoded KM_AUTH_LIST, checking that fields come in
+// schema order, which is tag number order.  |value| receives the element inside the explicit tag.
+static bool next_auth_list_field(CBS* fields, uint32_t* last_number, keymaster_tag_t* tag,
+                                 CBS* value) {
+    CBS field;
+    unsigned field_tag;
+    if (!CBS_get_any_asn1(fields, &field, &field_tag) ||
+        (field_tag & ~CBS_ASN1_TAG_NUMBER_MASK) != kExplicitFieldClass) {
+        return false;
+    }
+    uint32_t number = field_tag & CBS_ASN1_TAG_NUMBER_MASK;
+    *tag = auth_list_field_tag(number);
+    if (*tag == KM_TAG_INVALID || (*last_number && number <= *last_number)) return false;
+    *last_number = number;
+
+    // An explicit tag wraps exactly one element.
+    unsigned value_tag;
+    size_t header_length;
+    return CBS_get_any_asn1_element(&field, value, &value_tag, &header_length) &&
+           CBS_len(&field) == 0;
+}
+
+// Decodes one field of an encoded KM_AUTH_LIST into auth_list.
+static keymaster_error_t decode_auth_list_field(keymaster_tag_t tag, CBS* value,
+                                                AuthorizationSet* auth_list) {
+    CBS contents;
+    uint64_t integer;
+    bool pushed = true;
+    switch (tag) {
+    case KM_TAG_KDF:
+        // Part of the schema, but never extracted.
+        if (!CBS_get_asn1(value, &contents, CBS_ASN1_SET)) return KM_ERROR_INVALID_ARGUMENT;
+        while (CBS_len(&contents)) {
+            if (!CBS_get_asn1_uint64(&contents, &integer)) return KM_ERROR_INVALID_ARGUMENT;
+        }
+        break;
+
+    case KM_TAG_ROOT_OF_TRUST: {
+        // Checked, but not mapped to auth set entries.
+        CBS verified_boot_key, verified_boot_hash;
+        int device_locked;
+        if (!CBS_get_asn1(value, &contents, CBS_ASN1_SEQUENCE) ||
+            !CBS_get_asn1(&contents, &verified_boot_key, CBS_ASN1_OCTETSTRING) ||
+            !CBS_get_asn1_bool(&contents, &device_locked) ||
+            !CBS_get_asn1(&contents, nullptr /* out */, CBS_ASN1_ENUMERATED) ||
+            !CBS_get_asn1(&contents, &verified_boot_hash, CBS_ASN1_OCTETSTRING) ||
+            CBS_len(&contents) != 0) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        break;
+    }
+
+    default:
+        switch (keymaster_tag_get_type(tag)) {
+        case KM_ENUM_REP:
+            if (!CBS_get_asn1(value, &contents, CBS_ASN1_SET)) return KM_ERROR_INVALID_ARGUMENT;
+            while (CBS_len(&contents) && pushed) {
+                if (!CBS_get_asn1_uint64(&contents, &integer) || integer > UINT32_MAX) {
+                    return KM_ERROR_INVALID_ARGUMENT;
+                }
+                pushed = auth_list->push_back(
+                    keymaster_param_enum(tag, static_cast<uint32_t>(integer)));
+            }
+            break;
+        case KM_ENUM:
+            if (!CBS_get_asn1_uint64(value, &integer) || integer > UINT32_MAX) {
+                return KM_ERROR_INVALID_ARGUMENT;
+            }
+            pushed =
+                auth_list->push_back(keymaster_param_enum(tag, static_cast<uint32_t>(integer)));
+            break;
+        case KM_UINT:
+            if (!CBS_get_asn1_uint64(value, &integer) || integer > UINT32_MAX) {
+                return KM_ERROR_INVALID_ARGUMENT;
+            }
+            pushed = auth_list->push_back(keymaster_param_int(tag, static_cast<uint32_t>(integer)));
+            break;
+        case KM_ULONG:
+        case KM_DATE:
+            if (!CBS_get_asn1_uint64(value, &integer)) return KM_ERROR_INVALID_ARGUMENT;
+            pushed = auth_list->push_back(keymaster_param_long(tag, integer));
+            break;
+        case KM_BOOL:
+            if (!CBS_get_asn1(value, &contents, CBS_ASN1_NULL) || CBS_len(&contents) != 0) {
+                return KM_ERROR_INVALID_ARGUMENT;
+            }
+            pushed = auth_list->push_back(keymaster_param_bool(tag));
+            break;
+        case KM_BYTES:
+            if (!CBS_get_asn1(value, &contents, CBS_ASN1_OCTETSTRING)) {
+                return KM_ERROR_INVALID_ARGUMENT;
+            }
+            pushed = auth_list->push_back(
+                keymaster_param_blob(tag, CBS_data(&contents), CBS_len(&contents)));
+            break;
+        default:
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+    }
+    if (!pushed) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return CBS_len(value) == 0 ? KM_ERROR_OK : KM_ERROR_INVALID_ARGUMENT;
+}
+
+keymaster_error_t extract_auth_list(const uint8_t* der, size_t der_len,
+                                    AuthorizationSet* auth_list) {
+    CBS input, fields;
+    CBS_init(&input, der, der_len);
+    if (!CBS_get_asn1(&input, &fields, CBS_ASN1_SEQUENCE) || CBS_len(&input) != 0) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    // Size the set first, so that decoding appends without reallocating.  Only the shape of each
+    // field is looked at here; decoding checks the values.
+    size_t elems = 0;
+    size_t indirect = 0;
+    uint32_t last_number = 0;
+    for (CBS scan = fields; CBS_len(&scan);) {
+        keymaster_tag_t tag;
+        CBS value, contents;
+        if (!next_auth_list_field(&scan, &last_number, &tag, &value)) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        if (keymaster_tag_get_type(tag) == KM_ENUM_REP) {
+            if (!CBS_get_asn1(&value, &contents, CBS_ASN1_SET)) return KM_ERROR_INVALID_ARGUMENT;
+            while (CBS_len(&contents)) {
+                if (!CBS_get_any_asn1_element(&contents, nullptr, nullptr, nullptr)) {
+                    return KM_ERROR_INVALID_ARGUMENT;
+                }
+                ++elems;
+            }
+        } else if (tag != KM_TAG_ROOT_OF_TRUST) {
+            ++elems;
+            if (keymaster_tag_get_type(tag) == KM_BYTES) indirect += CBS_len(&value);
+        }
+    }
+    if (!auth_list->Reserve(elems, indirect)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    last_number = 0;
+    while (CBS_len(&fields)) {
+        keymaster_tag_t tag;
+        CBS value;
+        if (!next_auth_list_field(&fields, &last_number, &tag, &value)) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        keymaster_error_t error = decode_auth_list_field(tag, &value, auth_list);
+        if (error != KM_ERROR_OK) return error;
+    }
     return KM_ERROR_OK;
 }
 
@@ -1430,29 +2429,35 @@ keymaster_error_t parse_attestation_record(const uint8_t* asn1_key_desc, size_t
                                            AuthorizationSet* software_enforced,
                                            AuthorizationSet* tee_enforced,
                                            keymaster_blob_t* unique_id) {
-    const uint8_t* p = asn1_key_desc;
-    UniquePtr<KM_KEY_DESCRIPTION, KM_KEY_DESCRIPTION_Delete> record(
-        d2i_KM_KEY_DESCRIPTION(nullptr, &p, asn1_key_desc_len));
-    if (!record.get()) return TranslateLastOpenSslError();
-
-    *attestation_version = ASN1_INTEGER_get(record->attestation_version);
-    *attestation_security_level = static_cast<keymaster_security_level_t>(
-        ASN1_ENUMERATED_get(record->attestation_security_level));
-    *keymaster_version = ASN1_INTEGER_get(record->keymaster_version);
-    *keymaster_security_level = static_cast<keymaster_security_level_t>(
-        ASN1_ENUMERATED_get(record->keymaster_security_level));
+    // Like the templated decoder, this ignores anything after the record.
+    CBS input, record, challenge, id, software_list, tee_list;
+    uint32_t attestation_level, keymaster_level;
+    CBS_init(&input, asn1_key_desc, asn1_key_desc_len);
+    if (!CBS_get_asn1(&input, &record, CBS_ASN1_SEQUENCE) ||
+        !get_asn1_uint32(&record, CBS_ASN1_INTEGER, attestation_version) ||
+        !get_asn1_uint32(&record, CBS_ASN1_ENUMERATED, &attestation_level) ||
+        !get_asn1_uint32(&record, CBS_ASN1_INTEGER, keymaster_version) ||
+        !get_asn1_uint32(&record, CBS_ASN1_ENUMERATED, &keymaster_level) ||
+        !CBS_get_asn1(&record, &challenge, CBS_ASN1_OCTETSTRING) ||
+        !CBS_get_asn1(&record, &id, CBS_ASN1_OCTETSTRING) ||
+        !CBS_get_asn1_element(&record, &software_list, CBS_ASN1_SEQUENCE) ||
+        !CBS_get_asn1_element(&record, &tee_list, CBS_ASN1_SEQUENCE) || CBS_len(&record) != 0) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    *attestation_security_level = static_cast<keymaster_security_level_t>(attestation_level);
+    *keymaster_security_level = static_cast<keymaster_security_level_t>(keymaster_level);
 
-    attestation_challenge->data =
-        dup_buffer(record->attestation_challenge->data, record->attestation_challenge->length);
-    attestation_challenge->data_length = record->attestation_challenge->length;
+    attestation_challenge->data = dup_buffer(CBS_data(&challenge), CBS_len(&challenge));
+    attestation_challenge->data_length = CBS_len(&challenge);
 
-    unique_id->data = dup_buffer(record->unique_id->data, record->unique_id->length);
-    unique_id->data_length = record->unique_id->length;
+    unique_id->data = dup_buffer(CBS_data(&id), CBS_len(&id));
+    unique_id->data_length = CBS_len(&id);
 
-    keymaster_error_t error = extract_auth_list(record->software_enforced, software_enforced);
+    keymaster_error_t error =
+        extract_auth_list(CBS_data(&software_list), CBS_len(&software_list), software_enforced);
     if (error != KM_ERROR_OK) return error;
 
-    return extract_auth_list(record->tee_enforced, tee_enforced);
+    return extract_auth_list(CBS_data(&tee_list), CBS_len(&tee_list), tee_enforced);
 }
 
 keymaster_error_t parse_root_of_trust(const uint8_t* asn1_key_desc, size_t asn1_key_desc_len,
@@ -0,0 +1,318 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/attestation_record_view.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include <keymaster/km_openssl/attestation_record.h>
+
+namespace keymaster {
+
+namespace {
+
+constexpr uint8_t kBoolean = 0x01;
+constexpr uint8_t kInteger = 0x02;
+constexpr uint8_t kOctetString = 0x04;
+constexpr uint8_t kEnumerated = 0x0A;
+constexpr uint8_t kSequence = 0x30;
+constexpr uint8_t kSet = 0x31;
+constexpr uint8_t kContextConstructed = 0xA0;
+constexpr uint8_t kClassAndConstructedMask = 0xE0;
+
+// Records handed to a batch worker at a time.
+constexpr size_t kBatchChunk = 64;
+
+struct DerInput {
+    const uint8_t* data;
+    size_t len;
+};
+
+// Reads one definite-length element from |in|.  |identifier| receives the first identifier octet
+// and |tag_number| the tag number, decoded from the high tag number form where used.
+bool read_element(DerInput* in, uint8_t* identifier, uint32_t* tag_number, DerInput* contents,
+                  DerInput* element = nullptr) {
+    const uint8_t* p = in->data;
+    size_t len = in->len;
+    size_t i = 0;
+
+    if (len < 2) return false;
+    *identifier = p[i++];
+    uint32_t number = *identifier & 0x1F;
+    if (number == 0x1F) {
+        number = 0;
+        uint8_t byte;
+        do {
+            if (i >= len || number > (UINT32_MAX >> 7)) return false;
+            byte = p[i++];
+            number = (number << 7) | (byte & 0x7F);
+        } while (byte & 0x80);
+    }
+    *tag_number = number;
+
+    if (i >= len) return false;
+    size_t length = p[i++];
+    if (length & 0x80) {
+        size_t length_octets = length & 0x7F;
+        if (length_octets == 0 || length_octets > 4) return false;
+        length = 0;
+        while (length_octets--) {
+            if (i >= len) return false;
+            length = (length << 8) | p[i++];
+        }
+    }
+    if (length > len - i) return false;
+
+    *contents = {p + i, length};
+    if (element) *element = {p, i + length};
+    in->data += i + length;
+    in->len -= i + length;
+    return true;
+}
+
+// Reads an element that must have the single-octet |expected| identifier.
+bool read_element(DerInput* in, uint8_t expected, DerInput* contents,
+                  DerInput* element = nullptr) {
+    uint8_t identifier;
+    uint32_t tag_number;
+    return read_element(in, &identifier, &tag_number, contents, element) &&
+           identifier == expected;
+}
+
+// Decodes the contents of a non-negative INTEGER or ENUMERATED of up to 64 bits.
+bool decode_unsigned(const DerInput& contents, uint64_t* value) {
+    const uint8_t* p = contents.data;
+    size_t len = contents.len;
+    if (len == 0 || (p[0] & 0x80)) return false;
+    if (len > 1 && p[0] == 0) {
+        ++p;
+        --len;
+    }
+    if (len > sizeof(*value)) return false;
+
+    *value = 0;
+    for (size_t i = 0; i < len; ++i) {
+        *value = (*value << 8) | p[i];
+    }
+    return true;
+}
+
+bool read_unsigned(DerInput* in, uint8_t expected, uint64_t* value) {
+    DerInput contents;
+    return read_element(in, expected, &contents) && decode_unsigned(contents, value);
+}
+
+bool read_uint32(DerInput* in, uint8_t expected, uint32_t* value) {
+    uint64_t wide;
+    if (!read_unsigned(in, expected, &wide) || wide > UINT32_MAX) return false;
+    *value = static_cast<uint32_t>(wide);
+    return true;
+}
+
+bool read_octet_string(DerInput* in, keymaster_blob_t* value) {
+    DerInput contents;
+    if (!read_element(in, kOctetString, &contents)) return false;
+    *value = {contents.data, contents.len};
+    return true;
+}
+
+DerInput as_input(const keymaster_blob_t& blob) {
+    return {blob.data, blob.data_length};
+}
+
+}  // namespace
+
+keymaster_error_t AttestationRecordView::Init(const uint8_t* asn1_key_desc,
+                                              size_t asn1_key_desc_len) {
+    if (!asn1_key_desc) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+    *this = AttestationRecordView();
+
+    DerInput in = {asn1_key_desc, asn1_key_desc_len};
+    DerInput key_desc;
+    if (!read_element(&in, kSequence, &key_desc)) return KM_ERROR_INVALID_ARGUMENT;
+
+    uint32_t attestation_security_level;
+    uint32_t keymaster_security_level;
+    if (!read_uint32(&key_desc, kInteger, &attestation_version_) ||
+        !read_uint32(&key_desc, kEnumerated, &attestation_security_level) ||
+        !read_uint32(&key_desc, kInteger, &keymaster_version_) ||
+        !read_uint32(&key_desc, kEnumerated, &keymaster_security_level) ||
+        !read_octet_string(&key_desc, &attestation_challenge_) ||
+        !read_octet_string(&key_desc, &unique_id_)) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    attestation_security_level_ =
+        static_cast<keymaster_security_level_t>(attestation_security_level);
+    keymaster_security_level_ = static_cast<keymaster_security_level_t>(keymaster_security_level);
+
+    for (auto& list : lists_) {
+        DerInput contents;
+        DerInput element;
+        if (!read_element(&key_desc, kSequence, &contents, &element)) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+        list.der = {element.data, element.len};
+        keymaster_error_t error = IndexAuthList(contents.data, contents.len, &list);
+        if (error != KM_ERROR_OK) return error;
+    }
+
+    if (key_desc.len != 0) return KM_ERROR_INVALID_ARGUMENT;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AttestationRecordView::IndexAuthList(const uint8_t* der, size_t der_len,
+                                                       IndexedList* list) {
+    DerInput in = {der, der_len};
+    list->entry_count = 0;
+    while (in.len) {
+        if (list->entry_count == kMaxAuthListEntries) return KM_ERROR_INVALID_ARGUMENT;
+
+        uint8_t identifier;
+        uint32_t tag_number;
+        DerInput contents;
+        if (!read_element(&in, &identifier, &tag_number, &contents) ||
+            (identifier & kClassAndConstructedMask) != kContextConstructed) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+
+        // Fields of a SEQUENCE are in schema order, which is tag order.
+        if (list->entry_count && tag_number <= list->entries[list->entry_count - 1].tag_number) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+
+        // An explicit tag wraps exactly one element.
+        uint8_t inner_identifier;
+        uint32_t inner_tag_number;
+        DerInput inner_contents;
+        DerInput inner;
+        if (!read_element(&contents, &inner_identifier, &inner_tag_number, &inner_contents,
+                          &inner) ||
+            contents.len != 0) {
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+
+        Entry& entry = list->entries[list->entry_count++];
+        entry.tag_number = tag_number;
+        entry.value = {inner.data, inner.len};
+    }
+    return KM_ERROR_OK;
+}
+
+const AttestationRecordView::Entry* AttestationRecordView::FindEntry(AuthList list,
+                                                                     keymaster_tag_t tag) const {
+    const IndexedList& indexed = lists_[list];
+    uint32_t tag_number = keymaster_tag_mask_type(tag);
+    for (size_t i = 0; i < indexed.entry_count; ++i) {
+        if (indexed.entries[i].tag_number == tag_number) return &indexed.entries[i];
+        if (indexed.entries[i].tag_number > tag_number) break;
+    }
+    return nullptr;
+}
+
+bool AttestationRecordView::Contains(AuthList list, keymaster_tag_t tag, uint64_t value) const {
+    const Entry* entry = FindEntry(list, tag);
+    if (!entry) return false;
+
+    DerInput in = as_input(entry->value);
+    DerInput set;
+    if (!read_element(&in, kSet, &set)) return false;
+    while (set.len) {
+        uint64_t element;
+        if (!read_unsigned(&set, kInteger, &element)) return false;
+        if (element == value) return true;
+    }
+    return false;
+}
+
+bool AttestationRecordView::GetTagValue(AuthList list, keymaster_tag_t tag,
+                                        uint64_t* value) const {
+    const Entry* entry = FindEntry(list, tag);
+    if (!entry) return false;
+    DerInput in = as_input(entry->value);
+    return read_unsigned(&in, kInteger, value);
+}
+
+bool AttestationRecordView::GetTagValue(AuthList list, keymaster_tag_t tag,
+                                        keymaster_blob_t* value) const {
+    const Entry* entry = FindEntry(list, tag);
+    if (!entry) return false;
+    DerInput in = as_input(entry->value);
+    return read_octet_string(&in, value);
+}
+
+keymaster_error_t
+AttestationRecordView::GetRootOfTrust(keymaster_blob_t* verified_boot_key,
+                                      keymaster_verified_boot_t* verified_boot_state,
+                                      bool* device_locked,
+                                      keymaster_blob_t* verified_boot_hash) const {
+    const Entry* entry = FindEntry(TEE_ENFORCED, TAG_ROOT_OF_TRUST);
+    if (!entry) entry = FindEntry(SOFTWARE_ENFORCED, TAG_ROOT_OF_TRUST);
+    if (!entry) return KM_ERROR_INVALID_ARGUMENT;
+
+    DerInput in = as_input(entry->value);
+    DerInput root_of_trust;
+    DerInput locked;
+    uint32_t state;
+    if (!read_element(&in, kSequence, &root_of_trust) ||
+        !read_octet_string(&root_of_trust, verified_boot_key) ||
+        !read_element(&root_of_trust, kBoolean, &locked) || locked.len != 1 ||
+        !read_uint32(&root_of_trust, kEnumerated, &state)) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    *device_locked = locked.data[0] != 0;
+    *verified_boot_state = static_cast<keymaster_verified_boot_t>(state);
+
+    // Attestation versions before 3 have no verified boot hash.
+    keymaster_blob_t hash = {};
+    if (root_of_trust.len && !read_octet_string(&root_of_trust, &hash)) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    if (verified_boot_hash) *verified_boot_hash = hash;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t AttestationRecordView::GetAuthorizations(AuthorizationSet* software_enforced,
+                                                           AuthorizationSet* tee_enforced) const {
+    AuthorizationSet* sets[] = {software_enforced, tee_enforced};
+    for (size_t i = 0; i < 2; ++i) {
+        if (!lists_[i].der.data) return KM_ERROR_INVALID_ARGUMENT;
+        keymaster_error_t error =
+            extract_auth_list(lists_[i].der.data, lists_[i].der.data_length, sets[i]);
+        if (error != KM_ERROR_OK) return error;
+    }
+    return KM_ERROR_OK;
+}
+
+void ParseAttestationRecords(const keymaster_blob_t* records, size_t count,
+                             AttestationRecordView* views, keymaster_error_t* errors,
+                             size_t thread_count, WorkerPool* pool) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t begin; (begin = next.fetch_add(kBatchChunk)) < count;) {
+            size_t end = count - begin < kBatchChunk ? count : begin + kBatchChunk;
+            for (size_t i = begin; i < end; ++i) {
+                errors[i] = views[i].Init(records[i].data, records[i].data_length);
+            }
+        }
+    };
+
+    size_t chunks = (count + kBatchChunk - 1) / kBatchChunk;
+    RunInParallel(pool, std::min(thread_count, chunks), worker);
+}
+
+}  // namespace keymaster
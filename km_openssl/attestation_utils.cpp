@@ -15,6 +15,7 @@
 ** limitations under the License.
 */
 
+#include <mutex>
 #include <utility>
 
 #include <openssl/evp.h>
@@ -29,6 +30,7 @@
 #include <keymaster/km_openssl/certificate_utils.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/trace.h>
 
 namespace keymaster {
 
@@ -47,6 +49,23 @@ CertificateChain make_cert_chain(X509* certificate, CertificateChain chain,
     return chain;
 }
 
+// Builds the returned chain from a chain owned by the AttestationContext, which the result
+// references rather than copies; the context's chain outlives any response built from it.
+CertificateChain make_cert_chain(X509* certificate, const keymaster_cert_chain_t& chain,
+                                 keymaster_error_t* error) {
+    keymaster_blob_t blob{};
+    *error = encode_certificate(certificate, &blob);
+    if (*error != KM_ERROR_OK) return {};
+
+    CertificateChain retval = CertificateChain::WithBorrowedTail(blob, chain);
+    if (!retval.entries) {
+        delete[] blob.data;
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return {};
+    }
+    return retval;
+}
+
 keymaster_error_t build_attestation_extension(const AuthorizationSet& attest_params,
                                               const AuthorizationSet& tee_enforced,
                                               const AuthorizationSet& sw_enforced,
@@ -165,40 +184,123 @@ X509_NAME_Ptr get_issuer_subject(const AttestKeyInfo& attest_key, keymaster_erro
     return retval;
 }
 
-X509_NAME_Ptr get_issuer_subject(const keymaster_blob_t& signing_cert_der,
-                                 keymaster_error_t* error) {
-    const uint8_t* p = signing_cert_der.data;
-    if (!p) {
-        *error = KM_ERROR_UNEXPECTED_NULL_POINTER;
-        return {};
+// Only the subject is needed from the signing certificate, so it is sliced out of the DER rather
+// than parsing the whole certificate.
+X509_NAME_Ptr parse_issuer_subject(const keymaster_blob_t& signing_cert_der,
+                                   keymaster_error_t* error) {
+    keymaster_blob_t subject_der;
+    *error = get_subject_der(signing_cert_der, &subject_der);
+    if (*error != KM_ERROR_OK) return {};
+
+    X509_NAME_Ptr retval;
+    *error = make_name_from_der(subject_der, &retval);
+    return retval;
+}
+
+// The attestation signing key and certificate for an algorithm only change when the device is
+// re-provisioned, so the most recently used ones are kept in parsed form.  Entries are matched
+// on the full DER encoding, so a changed chain or key is simply parsed again.
+class AttestationSignerCache {
+  public:
+    static AttestationSignerCache& Instance() {
+        static AttestationSignerCache cache;
+        return cache;
     }
-    X509_Ptr signing_cert(d2i_X509(nullptr /* Allocate X509 */, &p, signing_cert_der.data_length));
-    if (!signing_cert) {
-        *error = TranslateLastOpenSslError();
-        return {};
+
+    X509_NAME_Ptr GetIssuerSubject(keymaster_algorithm_t algorithm,
+                                   const keymaster_blob_t& signing_cert_der,
+                                   keymaster_error_t* error) {
+        Entry* entry = FindEntry(algorithm);
+        if (!entry) return parse_issuer_subject(signing_cert_der, error);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!entry->issuer_subject ||
+            !Matches<keymaster_blob_t>(entry->signing_cert, signing_cert_der)) {
+            X509_NAME_Ptr issuer_subject = parse_issuer_subject(signing_cert_der, error);
+            if (!issuer_subject) return {};
+            entry->issuer_subject.reset();
+            entry->signing_cert = KeymasterBlob(signing_cert_der);
+            if (!entry->signing_cert.data) return issuer_subject;
+            entry->issuer_subject = std::move(issuer_subject);
+        }
+
+        X509_NAME_Ptr retval(X509_NAME_dup(entry->issuer_subject.get()));
+        if (!retval) *error = TranslateLastOpenSslError();
+        return retval;
     }
 
-    X509_NAME* issuer_subject = X509_get_subject_name(signing_cert.get());
-    if (!issuer_subject) {
-        *error = TranslateLastOpenSslError();
-        return {};
+    EVP_PKEY_Ptr GetSigningKey(keymaster_algorithm_t algorithm,
+                               const keymaster_key_blob_t& signing_key_blob,
+                               keymaster_error_t* error) {
+        Entry* entry = FindEntry(algorithm);
+        if (!entry) return parse_signing_key(signing_key_blob, error);
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!entry->signing_key ||
+            !Matches<keymaster_key_blob_t>(entry->signing_key_blob, signing_key_blob)) {
+            EVP_PKEY_Ptr signing_key = parse_signing_key(signing_key_blob, error);
+            if (!signing_key) return {};
+            entry->signing_key.reset();
+            entry->signing_key_blob = KeymasterKeyBlob(signing_key_blob);
+            if (!entry->signing_key_blob.key_material) return signing_key;
+            entry->signing_key = std::move(signing_key);
+        }
+
+        EVP_PKEY_up_ref(entry->signing_key.get());
+        return EVP_PKEY_Ptr(entry->signing_key.get());
     }
 
-    X509_NAME_Ptr retval(X509_NAME_dup(issuer_subject));
-    if (!retval) *error = TranslateLastOpenSslError();
+  private:
+    struct Entry {
+        KeymasterBlob signing_cert;
+        X509_NAME_Ptr issuer_subject;
+        KeymasterKeyBlob signing_key_blob;
+        EVP_PKEY_Ptr signing_key;
+    };
+
+    static EVP_PKEY_Ptr parse_signing_key(const keymaster_key_blob_t& signing_key_blob,
+                                          keymaster_error_t* error) {
+        const uint8_t* p = signing_key_blob.key_material;
+        EVP_PKEY_Ptr retval(
+            d2i_AutoPrivateKey(nullptr /* Allocate key */, &p, signing_key_blob.key_material_size));
+        if (!retval) *error = TranslateLastOpenSslError();
+        return retval;
+    }
 
-    return retval;
-}
+    template <typename Blob> static bool Matches(const Blob& cached, const Blob& blob) {
+        size_t size = accessBlobSize(&cached);
+        if (size != accessBlobSize(&blob)) return false;
+        return memcmp_s(accessBlobData(&cached), accessBlobData(&blob), size) == 0;
+    }
+
+    Entry* FindEntry(keymaster_algorithm_t algorithm) {
+        switch (algorithm) {
+        case KM_ALGORITHM_RSA:
+            return &entries_[0];
+        case KM_ALGORITHM_EC:
+            return &entries_[1];
+        default:
+            return nullptr;
+        }
+    }
+
+    std::mutex mutex_;
+    Entry entries_[2];
+};
 
 // Return subject from attest_key, if non-null, otherwise extract from cert_chain.
 X509_NAME_Ptr get_issuer_subject(const AttestKeyInfo& attest_key,
-                                 const CertificateChain& cert_chain, keymaster_error_t* error) {
+                                 const keymaster_cert_chain_t& cert_chain,
+                                 keymaster_algorithm_t algorithm, keymaster_error_t* error) {
     if (attest_key) {
         return get_issuer_subject(attest_key, error);
     }
 
     // Need to extract issuer from cert chain.  First cert in the chain is the signing key cert.
-    if (cert_chain.entry_count >= 1) return get_issuer_subject(cert_chain.entries[0], error);
+    if (cert_chain.entry_count >= 1) {
+        return AttestationSignerCache::Instance().GetIssuerSubject(
+            algorithm, cert_chain.entries[0], error);
+    }
 
     *error = KM_ERROR_UNKNOWN_ERROR;
     return {};
@@ -219,14 +321,15 @@ keymaster_error_t check_attest_key_auths(const Key& key) {
 
 EVP_PKEY_Ptr get_attestation_key(keymaster_algorithm_t algorithm, const AttestationContext& context,
                                  keymaster_error_t* error) {
+    const keymaster_key_blob_t* shared_key_blob = context.GetAttestationKeyRef(algorithm);
+    if (shared_key_blob) {
+        return AttestationSignerCache::Instance().GetSigningKey(algorithm, *shared_key_blob, error);
+    }
+
     KeymasterKeyBlob signing_key_blob = context.GetAttestationKey(algorithm, error);
     if (*error != KM_ERROR_OK) return {};
 
-    const uint8_t* p = signing_key_blob.key_material;
-    EVP_PKEY_Ptr retval(
-        d2i_AutoPrivateKey(nullptr /* Allocate key */, &p, signing_key_blob.key_material_size));
-    if (!retval) *error = TranslateLastOpenSslError();
-    return retval;
+    return AttestationSignerCache::Instance().GetSigningKey(algorithm, signing_key_blob, error);
 }
 
 }  // namespace
@@ -278,6 +381,7 @@ CertificateChain generate_attestation(const EVP_PKEY* evp_key,              //
                                       AttestKeyInfo attest_key,
                                       const AttestationContext& context,  //
                                       keymaster_error_t* error) {
+    KEYMASTER_TRACE("GenerateAttestation");
     if (!error) return {};
 
     CertificateCallerParams cert_params{};
@@ -296,11 +400,17 @@ CertificateChain generate_attestation(const EVP_PKEY* evp_key,              //
         return {};
     }
 
-    CertificateChain cert_chain =
-        attest_key ? CertificateChain() : context.GetAttestationChain(algorithm, error);
-    if (*error != KM_ERROR_OK) return {};
+    // Prefer the context's own copy of the chain, which the returned chain references.
+    const keymaster_cert_chain_t* shared_chain =
+        attest_key ? nullptr : context.GetAttestationChainRef(algorithm);
+    CertificateChain cert_chain;
+    if (!attest_key && !shared_chain) {
+        cert_chain = context.GetAttestationChain(algorithm, error);
+        if (*error != KM_ERROR_OK) return {};
+    }
 
-    X509_NAME_Ptr issuer_subject = get_issuer_subject(attest_key, cert_chain, error);
+    X509_NAME_Ptr issuer_subject = get_issuer_subject(
+        attest_key, shared_chain ? *shared_chain : cert_chain, algorithm, error);
     if (*error != KM_ERROR_OK) return {};
 
     X509_Ptr certificate;
@@ -319,6 +429,7 @@ CertificateChain generate_attestation(const EVP_PKEY* evp_key,              //
     *error = sign_cert(certificate.get(), signing_key_ptr);
     if (*error != KM_ERROR_OK) return {};
 
+    if (shared_chain) return make_cert_chain(certificate.get(), *shared_chain, error);
     return make_cert_chain(certificate.get(), std::move(cert_chain), error);
 }
 
@@ -16,7 +16,9 @@
 
 #include "block_cipher_operation.h"
 
+#include <atomic>
 #include <utility>
+#include <vector>
 
 #include <stdio.h>
 
@@ -29,13 +31,45 @@
 #include <keymaster/logger.h>
 
 #include <keymaster/km_openssl/aes_key.h>
+#include <keymaster/km_openssl/block_cipher_parallelism.h>
+#include <keymaster/km_openssl/crypto_dispatch.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/worker_pool.h>
 
 namespace keymaster {
 
 static const size_t GCM_NONCE_SIZE = 12;
 
+static std::atomic<size_t> parallel_min_chunk_bytes(
+    GetCryptoDispatch().block_cipher_min_chunk_bytes);
+static std::atomic<size_t> parallel_max_threads(BlockCipherParallelism().max_threads);
+static std::atomic<WorkerPool*> parallel_pool(BlockCipherParallelism().pool);
+
+void SetBlockCipherParallelism(const BlockCipherParallelism& parallelism) {
+    parallel_min_chunk_bytes = parallelism.min_chunk_bytes;
+    parallel_max_threads = parallelism.max_threads;
+    parallel_pool = parallelism.pool;
+}
+
+BlockCipherParallelism GetBlockCipherParallelism() {
+    BlockCipherParallelism parallelism;
+    parallelism.min_chunk_bytes = parallel_min_chunk_bytes;
+    parallelism.max_threads = parallel_max_threads;
+    parallelism.pool = parallel_pool;
+    return parallelism;
+}
+
+// Sets |counter| to the big-endian sum of |iv| and |blocks|, wrapping like the cipher's counter.
+static void AdvanceCounter(const uint8_t* iv, size_t length, uint64_t blocks, uint8_t* counter) {
+    memcpy(counter, iv, length);
+    for (size_t i = length; i > 0 && blocks > 0; --i) {
+        uint64_t sum = counter[i - 1] + (blocks & 0xff);
+        counter[i - 1] = static_cast<uint8_t>(sum);
+        blocks = (blocks >> 8) + (sum >> 8);
+    }
+}
+
 inline bool allows_padding(keymaster_block_mode_t block_mode) {
     switch (block_mode) {
     case KM_MODE_CTR:
@@ -50,18 +84,22 @@ inline bool allows_padding(keymaster_block_mode_t block_mode) {
 }
 
 static keymaster_error_t GetAndValidateGcmTagLength(const AuthorizationSet& begin_params,
-                                                    const AuthProxy& key_params,
-                                                    size_t* tag_length) {
+                                                    const Key& key, size_t* tag_length) {
     uint32_t tag_length_bits;
     if (!begin_params.GetTagValue(TAG_MAC_LENGTH, &tag_length_bits)) {
         return KM_ERROR_MISSING_MAC_LENGTH;
     }
 
     uint32_t min_tag_length_bits;
-    if (!key_params.GetTagValue(TAG_MIN_MAC_LENGTH, &min_tag_length_bits)) {
+    const KeyPolicy* policy = key.compiled_policy();
+    bool has_min_tag_length =
+        policy ? policy->has(KeyPolicy::MIN_MAC_LENGTH)
+               : key.authorizations().GetTagValue(TAG_MIN_MAC_LENGTH, &min_tag_length_bits);
+    if (!has_min_tag_length) {
         LOG_E("AES GCM key must have KM_TAG_MIN_MAC_LENGTH", 0);
         return KM_ERROR_INVALID_KEY_BLOB;
     }
+    if (policy) min_tag_length_bits = policy->min_mac_length;
 
     if (tag_length_bits % 8 != 0 || tag_length_bits > kMaxGcmTagLength ||
         tag_length_bits < kMinGcmTagLength) {
@@ -80,6 +118,9 @@ OperationPtr BlockCipherOperationFactory::CreateOperation(Key&& key,
                                                           const AuthorizationSet& begin_params,
                                                           keymaster_error_t* error) {
     *error = KM_ERROR_OK;
+    // For keys with a compiled policy, the key side of each check below is a field or bit test
+    // rather than a walk of the authorizations.
+    const KeyPolicy* policy = key.compiled_policy();
     keymaster_block_mode_t block_mode;
     if (!begin_params.GetTagValue(TAG_BLOCK_MODE, &block_mode)) {
         LOG_E("%d block modes specified in begin params", begin_params.GetTagCount(TAG_BLOCK_MODE));
@@ -89,7 +130,8 @@ OperationPtr BlockCipherOperationFactory::CreateOperation(Key&& key,
         LOG_E("Block mode %d not supported", block_mode);
         *error = KM_ERROR_UNSUPPORTED_BLOCK_MODE;
         return nullptr;
-    } else if (!key.authorizations().Contains(TAG_BLOCK_MODE, block_mode)) {
+    } else if (policy ? !policy->has_block_mode(block_mode)
+                      : !key.authorizations().Contains(TAG_BLOCK_MODE, block_mode)) {
         LOG_E("Block mode %d was specified, but not authorized by key", block_mode);
         *error = KM_ERROR_INCOMPATIBLE_BLOCK_MODE;
         return nullptr;
@@ -97,7 +139,7 @@ OperationPtr BlockCipherOperationFactory::CreateOperation(Key&& key,
 
     size_t tag_length = 0;
     if (block_mode == KM_MODE_GCM) {
-        *error = GetAndValidateGcmTagLength(begin_params, key.authorizations(), &tag_length);
+        *error = GetAndValidateGcmTagLength(begin_params, key, &tag_length);
         if (*error != KM_ERROR_OK) {
             return nullptr;
         }
@@ -113,7 +155,10 @@ OperationPtr BlockCipherOperationFactory::CreateOperation(Key&& key,
         return nullptr;
     }
 
-    bool caller_nonce = key.authorizations().GetTagValue(TAG_CALLER_NONCE);
+    bool caller_nonce = policy ? policy->has(KeyPolicy::CALLER_NONCE)
+                               : key.authorizations().GetTagValue(TAG_CALLER_NONCE);
+    std::shared_ptr<const KeyedGcmContext> keyed_gcm_context;
+    if (block_mode == KM_MODE_GCM) keyed_gcm_context = GetKeyedGcmContext(key);
 
     OperationPtr op;
     switch (purpose_) {
@@ -131,7 +176,13 @@ OperationPtr BlockCipherOperationFactory::CreateOperation(Key&& key,
         return nullptr;
     }
 
-    if (!op) *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!op) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+    if (block_mode == KM_MODE_GCM) {
+        static_cast<BlockCipherEvpOperation*>(op.get())->set_keyed_gcm_context(keyed_gcm_context);
+    }
     return op;
 }
 
@@ -159,10 +210,6 @@ BlockCipherEvpOperation::~BlockCipherEvpOperation() {
 
 keymaster_error_t BlockCipherEvpOperation::Begin(const AuthorizationSet& /* input_params */,
                                                  AuthorizationSet* /* output_params */) {
-    auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
-                             (size_t)sizeof(operation_handle_));
-    if (rc != KM_ERROR_OK) return rc;
-
     auto retval = InitializeCipher(key_);
     key_ = {};
     return retval;
@@ -200,10 +247,11 @@ keymaster_error_t BlockCipherEvpOperation::Finish(const AuthorizationSet& additi
 
     int output_written = -1;
     if (!EVP_CipherFinal_ex(&ctx_, output->peek_write(), &output_written)) {
-        if (tag_length_ > 0) return KM_ERROR_VERIFICATION_FAILED;
-        char buf[128];
-        ERR_error_string_n(ERR_peek_last_error(), buf, sizeof(buf));
-        LOG_E("Error encrypting final block: %s", buf);
+        if (tag_length_ > 0) {
+            ERR_clear_error();
+            return KM_ERROR_VERIFICATION_FAILED;
+        }
+        // Bad padding lands here, so the error is left to TranslateLastOpenSslError() to log.
         return TranslateLastOpenSslError();
     }
 
@@ -213,6 +261,57 @@ keymaster_error_t BlockCipherEvpOperation::Finish(const AuthorizationSet& additi
     return KM_ERROR_OK;
 }
 
+keymaster_error_t BlockCipherEvpOperation::SaveState(Buffer* state) const {
+    if (block_mode_ != KM_MODE_CTR) return KM_ERROR_UNIMPLEMENTED;
+
+    uint8_t serialized[sizeof(uint32_t) + EVP_MAX_IV_LENGTH + sizeof(uint64_t)];
+    const uint8_t* end = serialized + sizeof(serialized);
+    uint8_t* buf = append_size_and_data_to_buf(serialized, end, iv_.data, iv_.data_length);
+    buf = append_uint64_to_buf(buf, end, data_processed_);
+    if (!buf) return KM_ERROR_UNKNOWN_ERROR;
+    if (!state->Reinitialize(serialized, buf - serialized)) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t BlockCipherEvpOperation::RestoreState(const Buffer& state) {
+    if (block_mode_ != KM_MODE_CTR) return KM_ERROR_UNIMPLEMENTED;
+
+    const size_t block_size = block_size_bytes();
+    const uint8_t* pos = state.peek_read();
+    const uint8_t* end = pos + state.available_read();
+    const uint8_t* iv;
+    size_t iv_length;
+    uint64_t processed;
+    if (!view_size_and_data_from_buf(&pos, end, &iv, &iv_length) || iv_length != block_size ||
+        !copy_uint64_from_buf(&pos, end, &processed) || pos != end) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    iv_ = KeymasterBlob(iv, iv_length);
+    if (!iv_.data) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+
+    keymaster_error_t error = InitializeCipher(key_);
+    key_ = {};
+    if (error != KM_ERROR_OK) return error;
+
+    // Set the counter to the block the position is in, then run the keystream on to the position.
+    uint8_t counter[EVP_MAX_IV_LENGTH];
+    AdvanceCounter(iv_.data, iv_.data_length, processed / block_size, counter);
+    if (!EVP_CipherInit_ex(&ctx_, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                           counter, -1 /* keep direction */)) {
+        return TranslateLastOpenSslError();
+    }
+    uint8_t skipped[EVP_MAX_BLOCK_LENGTH] = {};
+    int written = -1;
+    if (processed % block_size &&
+        !EVP_CipherUpdate(&ctx_, skipped, &written, skipped, processed % block_size)) {
+        return TranslateLastOpenSslError();
+    }
+    data_processed_ = processed;
+    return KM_ERROR_OK;
+}
+
 bool BlockCipherEvpOperation::need_iv() const {
     switch (block_mode_) {
     case KM_MODE_CBC:
@@ -234,8 +333,16 @@ keymaster_error_t BlockCipherEvpOperation::InitializeCipher(const KeymasterKeyBl
         cipher_description_.GetCipherInstance(key.key_material_size, block_mode_, &error);
     if (error) return error;
 
-    if (!EVP_CipherInit_ex(&ctx_, cipher, nullptr /* engine */, key.key_material, iv_.data,
-                           evp_encrypt_mode())) {
+    if (keyed_gcm_context_ && keyed_gcm_context_->cipher() == cipher) {
+        // The copy already has the key schedule and GHASH tables; only the nonce is new.
+        if (!keyed_gcm_context_->CopyTo(&ctx_) ||
+            !EVP_CipherInit_ex(&ctx_, nullptr /* cipher */, nullptr /* engine */,
+                               nullptr /* key */, iv_.data, evp_encrypt_mode())) {
+            return TranslateLastOpenSslError();
+        }
+        keyed_gcm_context_.reset();
+    } else if (!EVP_CipherInit_ex(&ctx_, cipher, nullptr /* engine */, key.key_material, iv_.data,
+                                  evp_encrypt_mode())) {
         return TranslateLastOpenSslError();
     }
 
@@ -251,8 +358,10 @@ keymaster_error_t BlockCipherEvpOperation::InitializeCipher(const KeymasterKeyBl
     }
 
     if (block_mode_ == KM_MODE_GCM) {
+#if !defined(OPENSSL_IS_BORINGSSL)
         aad_block_buf_.reset(new (std::nothrow) uint8_t[block_size_bytes()]);
         if (!aad_block_buf_) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+#endif
         aad_block_buf_len_ = 0;
     }
 
@@ -286,9 +395,10 @@ keymaster_error_t BlockCipherEvpOperation::GetIv(const AuthorizationSet& input_p
 /*
  * Process Incoming Associated Authentication Data.
  *
- * This method is more complex than might be expected, because the underlying library silently does
- * the wrong thing when given partial AAD blocks, so we have to take care to process AAD in block
- * size increments, buffering (in aad_block_buf_) when given smaller amounts of data.
+ * BoringSSL carries a partial AAD block over from one EVP_CipherUpdate() call to the next, so with
+ * BoringSSL each piece of AAD goes straight to the cipher.  Other libraries may silently do the
+ * wrong thing when given partial AAD blocks, so for them we have to take care to process AAD in
+ * block size increments, buffering (in aad_block_buf_) when given smaller amounts of data.
  */
 bool BlockCipherEvpOperation::HandleAad(const AuthorizationSet& input_params, const Buffer& input,
                                         keymaster_error_t* error) {
@@ -302,6 +412,9 @@ bool BlockCipherEvpOperation::HandleAad(const AuthorizationSet& input_params, co
             return false;
         }
 
+#if defined(OPENSSL_IS_BORINGSSL)
+        if (aad.data_length && !ProcessAad(aad.data, aad.data_length, error)) return false;
+#else
         if (aad_block_buf_len_ > 0) {
             FillBufferedAadBlock(&aad);
             if (aad_block_buf_len_ == block_size_bytes() && !ProcessBufferedAadBlock(error))
@@ -317,6 +430,7 @@ bool BlockCipherEvpOperation::HandleAad(const AuthorizationSet& input_params, co
 
         FillBufferedAadBlock(&aad);
         assert(aad.data_length == 0);
+#endif
     }
 
     if (input.available_read()) {
@@ -341,11 +455,13 @@ bool BlockCipherEvpOperation::ProcessBufferedAadBlock(keymaster_error_t* error)
 
 bool BlockCipherEvpOperation::ProcessAadBlocks(const uint8_t* data, size_t blocks,
                                                keymaster_error_t* error) {
+    return ProcessAad(data, blocks * block_size_bytes(), error);
+}
+
+bool BlockCipherEvpOperation::ProcessAad(const uint8_t* data, size_t length,
+                                         keymaster_error_t* error) {
     int output_written;
-    if (EVP_CipherUpdate(&ctx_, nullptr /* out */, &output_written, data,
-                         blocks * block_size_bytes())) {
-        return true;
-    }
+    if (EVP_CipherUpdate(&ctx_, nullptr /* out */, &output_written, data, length)) return true;
     *error = TranslateLastOpenSslError();
     return false;
 }
@@ -374,14 +490,116 @@ bool BlockCipherEvpOperation::InternalUpdate(const uint8_t* input, size_t input_
         return false;
     }
 
+    // Unpadded ECB and CTR carry no state from one block to the next beyond the counter.
+    if ((block_mode_ == KM_MODE_CTR || (block_mode_ == KM_MODE_ECB && padding_ == KM_PAD_NONE)) &&
+        ParallelUpdate(input, input_length, output, error)) {
+        return true;
+    }
+    if (*error != KM_ERROR_OK) return false;
+
+    return SerialUpdate(input, input_length, output, error);
+}
+
+bool BlockCipherEvpOperation::SerialUpdate(const uint8_t* input, size_t input_length,
+                                           Buffer* output, keymaster_error_t* error) {
     int output_written = -1;
     if (!EVP_CipherUpdate(&ctx_, output->peek_write(), &output_written, input, input_length)) {
         *error = TranslateLastOpenSslError();
         return false;
     }
+    data_processed_ += input_length;
     return output->advance_write(output_written);
 }
 
+/*
+ * Processes a large CTR or unpadded ECB update on several threads.  Returns false without touching
+ * anything if the update is too small to be worth splitting, and false with |*error| set if it
+ * fails.
+ *
+ * The bytes that complete a block partly processed by an earlier update go through ctx_ first.
+ * The whole blocks after them are cut into chunks, each encrypted by a copy of ctx_ whose counter
+ * is set to the chunk's offset, and ctx_'s counter is then moved past them.  Any final partial
+ * block goes through ctx_ so that the next update carries on from it.
+ */
+bool BlockCipherEvpOperation::ParallelUpdate(const uint8_t* input, size_t input_length,
+                                             Buffer* output, keymaster_error_t* error) {
+    *error = KM_ERROR_OK;
+    const size_t block_size = block_size_bytes();
+    const size_t min_chunk = parallel_min_chunk_bytes / block_size * block_size;
+    const size_t max_threads = parallel_max_threads;
+    if (min_chunk == 0 || max_threads < 2 || input_length < 2 * min_chunk + block_size) {
+        return false;
+    }
+
+    const size_t head = (block_size - data_processed_ % block_size) % block_size;
+    if (head && !SerialUpdate(input, head, output, error)) return false;
+    input += head;
+    input_length -= head;
+
+    const size_t body = input_length - input_length % block_size;
+    const size_t chunk_count = body / min_chunk;
+    if (chunk_count < 2) return SerialUpdate(input, input_length, output, error);
+    const size_t thread_count = min(max_threads, chunk_count);
+
+    uint8_t* out = output->peek_write();
+    const uint64_t first_block = data_processed_ / block_size;
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        EVP_CIPHER_CTX ctx;
+        EVP_CIPHER_CTX_init(&ctx);
+        if (!EVP_CIPHER_CTX_copy(&ctx, &ctx_)) failed = true;
+        uint8_t counter[EVP_MAX_IV_LENGTH];
+        for (size_t i; !failed && (i = next.fetch_add(1)) < chunk_count;) {
+            // The last chunk also takes the blocks left over from dividing the body up.
+            const size_t offset = i * min_chunk;
+            const size_t length = (i == chunk_count - 1) ? body - offset : min_chunk;
+            if (block_mode_ == KM_MODE_CTR) {
+                AdvanceCounter(iv_.data, iv_.data_length, first_block + offset / block_size,
+                               counter);
+                if (!EVP_CipherInit_ex(&ctx, nullptr /* cipher */, nullptr /* engine */,
+                                       nullptr /* key */, counter, -1 /* keep direction */)) {
+                    failed = true;
+                    break;
+                }
+            }
+            int written = -1;
+            if (!EVP_CipherUpdate(&ctx, out + offset, &written, input + offset, length) ||
+                static_cast<size_t>(written) != length) {
+                failed = true;
+            }
+        }
+        EVP_CIPHER_CTX_cleanup(&ctx);
+    };
+
+    WorkerPool* pool = parallel_pool;
+    RunInParallel(pool ? pool : DefaultWorkerPool(), thread_count, worker);
+    if (failed) {
+        *error = KM_ERROR_UNKNOWN_ERROR;
+        return false;
+    }
+    data_processed_ += body;
+    if (!output->advance_write(body)) {
+        *error = KM_ERROR_UNKNOWN_ERROR;
+        return false;
+    }
+
+    if (block_mode_ == KM_MODE_CTR) {
+        uint8_t counter[EVP_MAX_IV_LENGTH];
+        AdvanceCounter(iv_.data, iv_.data_length, data_processed_ / block_size, counter);
+        if (!EVP_CipherInit_ex(&ctx_, nullptr /* cipher */, nullptr /* engine */, nullptr /* key */,
+                               counter, -1 /* keep direction */)) {
+            *error = TranslateLastOpenSslError();
+            return false;
+        }
+    }
+
+    if (body < input_length && !SerialUpdate(input + body, input_length - body, output, error)) {
+        return false;
+    }
+    return true;
+}
+
 bool BlockCipherEvpOperation::UpdateForFinish(const AuthorizationSet& additional_params,
                                               const Buffer& input, AuthorizationSet* output_params,
                                               Buffer* output, keymaster_error_t* error) {
@@ -457,11 +675,8 @@ keymaster_error_t BlockCipherEvpDecryptOperation::Begin(const AuthorizationSet&
         if (error != KM_ERROR_OK) return error;
     }
 
-    if (tag_length_ > 0) {
-        tag_buf_.reset(new (std::nothrow) uint8_t[tag_length_]);
-        if (!tag_buf_) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        tag_buf_len_ = 0;
-    }
+    tag_buf_start_ = 0;
+    tag_buf_len_ = 0;
 
     return BlockCipherEvpOperation::Begin(input_params, output_params);
 }
@@ -515,10 +730,13 @@ keymaster_error_t BlockCipherEvpDecryptOperation::ProcessAllButTagLengthBytes(co
 bool BlockCipherEvpDecryptOperation::ProcessTagBufContentsAsData(size_t to_process, Buffer* output,
                                                                  keymaster_error_t* error) {
     assert(to_process <= tag_buf_len_);
-    if (!InternalUpdate(tag_buf_.get(), to_process, output, error)) return false;
-    if (to_process < tag_buf_len_) {
-        memmove(tag_buf_.get(), tag_buf_.get() + to_process, tag_buf_len_ - to_process);
+    // The bytes may wrap around the end of the ring.
+    const size_t first = min(to_process, tag_length_ - tag_buf_start_);
+    if (!InternalUpdate(tag_buf_ + tag_buf_start_, first, output, error) ||
+        !InternalUpdate(tag_buf_, to_process - first, output, error)) {
+        return false;
     }
+    tag_buf_start_ = (tag_buf_start_ + to_process) % tag_length_;
     tag_buf_len_ -= to_process;
     return true;
 }
@@ -526,7 +744,10 @@ bool BlockCipherEvpDecryptOperation::ProcessTagBufContentsAsData(size_t to_proce
 void BlockCipherEvpDecryptOperation::BufferCandidateTagData(const uint8_t* data,
                                                             size_t data_length) {
     assert(data_length <= tag_length_ - tag_buf_len_);
-    memcpy(tag_buf_.get() + tag_buf_len_, data, data_length);
+    const size_t end = (tag_buf_start_ + tag_buf_len_) % tag_length_;
+    const size_t first = min(data_length, tag_length_ - end);
+    memcpy(tag_buf_ + end, data, first);
+    memcpy(tag_buf_, data + first, data_length - first);
     tag_buf_len_ += data_length;
 }
 
@@ -540,9 +761,13 @@ keymaster_error_t BlockCipherEvpDecryptOperation::Finish(const AuthorizationSet&
 
     if (tag_buf_len_ < tag_length_) {
         return KM_ERROR_INVALID_INPUT_LENGTH;
-    } else if (tag_length_ > 0 &&
-               !EVP_CIPHER_CTX_ctrl(&ctx_, EVP_CTRL_GCM_SET_TAG, tag_length_, tag_buf_.get())) {
-        return TranslateLastOpenSslError();
+    } else if (tag_length_ > 0) {
+        uint8_t tag[sizeof(tag_buf_)];
+        memcpy(tag, tag_buf_ + tag_buf_start_, tag_length_ - tag_buf_start_);
+        memcpy(tag + tag_length_ - tag_buf_start_, tag_buf_, tag_buf_start_);
+        if (!EVP_CIPHER_CTX_ctrl(&ctx_, EVP_CTRL_GCM_SET_TAG, tag_length_, tag)) {
+            return TranslateLastOpenSslError();
+        }
     }
 
     AuthorizationSet empty_params;
@@ -17,10 +17,12 @@
 #ifndef SYSTEM_KEYMASTER_BLOCK_CIPHER_OPERATION_H_
 #define SYSTEM_KEYMASTER_BLOCK_CIPHER_OPERATION_H_
 
+#include <memory>
 #include <utility>
 
 #include <openssl/evp.h>
 
+#include <keymaster/km_openssl/aes_key.h>
 #include <keymaster/operation.h>
 
 namespace keymaster {
@@ -64,6 +66,12 @@ class BlockCipherOperationFactory : public OperationFactory {
 
     virtual const EvpCipherDescription& GetCipherDescription() const = 0;
 
+  protected:
+    // Returns the pre-keyed GCM context of \p key, if it has one.
+    virtual std::shared_ptr<const KeyedGcmContext> GetKeyedGcmContext(const Key& /* key */) const {
+        return nullptr;
+    }
+
   private:
     const keymaster_purpose_t purpose_;
 };
@@ -85,6 +93,20 @@ class BlockCipherEvpOperation : public Operation {
                              Buffer* output) override;
     keymaster_error_t Abort() override;
 
+    // Only CTR mode's state is entirely in the IV and the position; the other modes keep partial
+    // blocks, and GCM its GHASH state, inside ctx_.
+    keymaster_error_t SaveState(Buffer* state) const override;
+    keymaster_error_t RestoreState(const Buffer& state) override;
+
+    size_t MemoryFootprint() const override {
+        return Operation::MemoryFootprint() + (aad_block_buf_ ? block_size_bytes() : 0);
+    }
+
+    // If set, GCM operations start from a copy of this instead of keying ctx_ themselves.
+    void set_keyed_gcm_context(std::shared_ptr<const KeyedGcmContext> context) {
+        keyed_gcm_context_ = std::move(context);
+    }
+
   protected:
     virtual int evp_encrypt_mode() = 0;
 
@@ -94,10 +116,15 @@ class BlockCipherEvpOperation : public Operation {
     bool HandleAad(const AuthorizationSet& input_params, const Buffer& input,
                    keymaster_error_t* error);
     bool ProcessAadBlocks(const uint8_t* data, size_t blocks, keymaster_error_t* error);
+    bool ProcessAad(const uint8_t* data, size_t length, keymaster_error_t* error);
     void FillBufferedAadBlock(keymaster_blob_t* aad);
     bool ProcessBufferedAadBlock(keymaster_error_t* error);
     bool InternalUpdate(const uint8_t* input, size_t input_length, Buffer* output,
                         keymaster_error_t* error);
+    bool SerialUpdate(const uint8_t* input, size_t input_length, Buffer* output,
+                      keymaster_error_t* error);
+    bool ParallelUpdate(const uint8_t* input, size_t input_length, Buffer* output,
+                        keymaster_error_t* error);
     bool UpdateForFinish(const AuthorizationSet& additional_params, const Buffer& input,
                          AuthorizationSet* output_params, Buffer* output, keymaster_error_t* error);
     size_t block_size_bytes() const { return cipher_description_.block_size_bytes(); }
@@ -112,8 +139,11 @@ class BlockCipherEvpOperation : public Operation {
     UniquePtr<uint8_t[]> aad_block_buf_;
     size_t aad_block_buf_len_;
     bool data_started_;
+    // Bytes of data (not AAD) passed through the cipher so far.
+    uint64_t data_processed_ = 0;
     const keymaster_padding_t padding_;
     KeymasterKeyBlob key_;
+    std::shared_ptr<const KeyedGcmContext> keyed_gcm_context_;
     const EvpCipherDescription& cipher_description_;
 };
 
@@ -164,8 +194,12 @@ class BlockCipherEvpDecryptOperation : public BlockCipherEvpOperation {
     bool ProcessTagBufContentsAsData(size_t to_process, Buffer* output, keymaster_error_t* error);
     void BufferCandidateTagData(const uint8_t* data, size_t data_length);
 
-    UniquePtr<uint8_t[]> tag_buf_;
-    size_t tag_buf_len_;
+    // The last tag_length_ bytes seen, which may turn out to be the tag, held back from decryption.
+    // It's a ring of tag_length_ bytes starting at tag_buf_start_, so that releasing held-back
+    // bytes as data never has to shift the rest.
+    uint8_t tag_buf_[kMaxGcmTagLength / 8];
+    size_t tag_buf_start_ = 0;
+    size_t tag_buf_len_ = 0;
 };
 
 }  // namespace keymaster
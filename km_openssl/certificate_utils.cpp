@@ -18,6 +18,7 @@
 #include <utility>
 
 #include <openssl/asn1.h>
+#include <openssl/bytestring.h>
 #include <openssl/evp.h>
 #include <openssl/x509v3.h>
 
@@ -61,8 +62,53 @@ keymaster_error_t fake_sign_cert(X509* cert) {
     return KM_ERROR_OK;
 }
 
+// The default subject, CN=Android Keystore Key, built once.  Null if building it failed.
+const X509_NAME* default_subject_name() {
+    static const X509_NAME* name = [] {
+        X509_NAME_Ptr built;
+        // Encoding caches the DER in the name, so later copies, from any thread, only read it.
+        if (make_name_from_str(kDefaultSubject, &built) != KM_ERROR_OK ||
+            i2d_X509_NAME(built.get(), nullptr) < 0) {
+            built.reset();
+        }
+        return built.release();
+    }();
+    return name;
+}
+
+// The default serial number, one, built once.  Null if building it failed.
+const ASN1_INTEGER* default_serial_number() {
+    static const ASN1_INTEGER* serial = [] {
+        ASN1_INTEGER_Ptr one(ASN1_INTEGER_new());
+        if (one && !ASN1_INTEGER_set(one.get(), 1)) one.reset();
+        return one.release();
+    }();
+    return serial;
+}
+
+// Returns |date_time|, in ms since the epoch, as an ASN1_TIME held in |storage|.  The epoch and
+// kUndefinedExpirationDateTime, the validity bounds that most certificates get, are built once and
+// shared instead.  Null on failure.
+const ASN1_TIME* make_cert_time(int64_t date_time, ASN1_TIME_Ptr* storage) {
+    static const ASN1_TIME* epoch = ASN1_TIME_set(nullptr, 0);
+    static const ASN1_TIME* undefined_expiration =
+        ASN1_TIME_set(nullptr, static_cast<time_t>(kUndefinedExpirationDateTime / 1000));
+
+    time_t seconds = static_cast<time_t>(date_time / 1000);
+    if (seconds == 0 && epoch) return epoch;
+    if (date_time / 1000 == kUndefinedExpirationDateTime / 1000 && undefined_expiration) {
+        return undefined_expiration;
+    }
+    storage->reset(ASN1_TIME_set(nullptr, seconds));
+    return storage->get();
+}
+
 }  // namespace
 
+const X509_NAME* CertificateCallerParams::subject() const {
+    return subject_name ? subject_name.get() : default_subject_name();
+}
+
 keymaster_error_t make_name_from_str(const char name[], X509_NAME_Ptr* name_out) {
     if (name_out == nullptr) return KM_ERROR_UNEXPECTED_NULL_POINTER;
     X509_NAME_Ptr x509_name(X509_NAME_new());
@@ -94,6 +140,29 @@ keymaster_error_t make_name_from_der(const keymaster_blob_t& name, X509_NAME_Ptr
     return KM_ERROR_OK;
 }
 
+keymaster_error_t get_subject_der(const keymaster_blob_t& cert_der, keymaster_blob_t* subject_der) {
+    if (!cert_der.data || !subject_der) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    // Certificate ::= SEQUENCE { tbsCertificate, signatureAlgorithm, signature }
+    // TBSCertificate ::= SEQUENCE { [0] version OPTIONAL, serialNumber, signature, issuer,
+    //                               validity, subject, ... }
+    constexpr unsigned kVersionTag = CBS_ASN1_CONSTRUCTED | CBS_ASN1_CONTEXT_SPECIFIC | 0;
+    CBS cbs, certificate, tbs, subject;
+    CBS_init(&cbs, cert_der.data, cert_der.data_length);
+    if (!CBS_get_asn1(&cbs, &certificate, CBS_ASN1_SEQUENCE) || CBS_len(&cbs) != 0 ||
+        !CBS_get_asn1(&certificate, &tbs, CBS_ASN1_SEQUENCE) ||
+        !CBS_get_optional_asn1(&tbs, nullptr /* out */, nullptr /* out_present */, kVersionTag) ||
+        !CBS_skip_asn1(&tbs, CBS_ASN1_INTEGER) || !CBS_skip_asn1(&tbs, CBS_ASN1_SEQUENCE) ||
+        !CBS_skip_asn1(&tbs, CBS_ASN1_SEQUENCE) || !CBS_skip_asn1(&tbs, CBS_ASN1_SEQUENCE) ||
+        !CBS_get_asn1_element(&tbs, &subject, CBS_ASN1_SEQUENCE)) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    subject_der->data = CBS_data(&subject);
+    subject_der->data_length = CBS_len(&subject);
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t get_common_name(X509_NAME* name, UniquePtr<const char[]>* name_out) {
     if (name == nullptr || name_out == nullptr) return KM_ERROR_UNEXPECTED_NULL_POINTER;
     int len = X509_NAME_get_text_by_NID(name, NID_commonName, nullptr, 0);
@@ -162,7 +231,8 @@ keymaster_error_t get_certificate_params(const AuthorizationSet& caller_params,
         return make_name_from_der(subject, &cert_params->subject_name);
     }
 
-    return make_name_from_str(kDefaultSubject, &cert_params->subject_name);
+    cert_params->subject_name.reset();
+    return default_subject_name() ? KM_ERROR_OK : KM_ERROR_MEMORY_ALLOCATION_FAILED;
 }
 
 keymaster_error_t make_key_usage_extension(bool is_signing_key, bool is_encryption_key,
@@ -249,17 +319,20 @@ keymaster_error_t make_cert_rump(const X509_NAME* issuer,
     // Set the X509 version.
     if (!X509_set_version(certificate.get(), 2 /* version 3 */)) return TranslateLastOpenSslError();
 
-    // Set the certificate serialNumber
-    ASN1_INTEGER_Ptr serial_number(ASN1_INTEGER_new());
-    if (!serial_number.get() ||  //
-        !BN_to_ASN1_INTEGER(cert_params.serial.get(), serial_number.get()) ||
-        !X509_set_serialNumber(certificate.get(),
-                               serial_number.get() /* Don't release; copied */)) {
+    // Set the certificate serialNumber.  The default, one, is shared rather than built.
+    ASN1_INTEGER_Ptr serial_number;
+    const ASN1_INTEGER* serial = nullptr;
+    if (BN_is_one(cert_params.serial.get())) serial = default_serial_number();
+    if (!serial) {
+        serial_number.reset(BN_to_ASN1_INTEGER(cert_params.serial.get(), nullptr));
+        serial = serial_number.get();
+    }
+    if (!serial || !X509_set_serialNumber(certificate.get(), serial /* Don't release; copied */)) {
         return TranslateLastOpenSslError();
     }
 
-    if (!X509_set_subject_name(certificate.get(),
-                               const_cast<X509_NAME*>(cert_params.subject_name.get()))) {
+    const X509_NAME* subject = cert_params.subject();
+    if (!subject || !X509_set_subject_name(certificate.get(), const_cast<X509_NAME*>(subject))) {
         return TranslateLastOpenSslError();
     }
 
@@ -268,21 +341,20 @@ keymaster_error_t make_cert_rump(const X509_NAME* issuer,
     }
 
     // Set activation date.
-    ASN1_TIME_Ptr notBefore(ASN1_TIME_new());
+    ASN1_TIME_Ptr notBefore;
     LOG_D("Setting notBefore to %ld: ", cert_params.active_date_time / 1000);
-    time_t notBeforeTime = static_cast<time_t>(cert_params.active_date_time / 1000);
-    if (!notBefore.get() || !ASN1_TIME_set(notBefore.get(), notBeforeTime) ||
-        !X509_set_notBefore(certificate.get(), notBefore.get() /* Don't release; copied */)) {
+    const ASN1_TIME* notBeforeTime = make_cert_time(cert_params.active_date_time, &notBefore);
+    if (!notBeforeTime ||
+        !X509_set_notBefore(certificate.get(), notBeforeTime /* Don't release; copied */)) {
         return TranslateLastOpenSslError();
     }
 
     // Set expiration date.
-    ASN1_TIME_Ptr notAfter(ASN1_TIME_new());
+    ASN1_TIME_Ptr notAfter;
     LOG_D("Setting notAfter to %ld: ", cert_params.expire_date_time / 1000);
-    time_t notAfterTime = static_cast<time_t>(cert_params.expire_date_time / 1000);
-
-    if (!notAfter.get() || !ASN1_TIME_set(notAfter.get(), notAfterTime) ||
-        !X509_set_notAfter(certificate.get(), notAfter.get() /* Don't release; copied */)) {
+    const ASN1_TIME* notAfterTime = make_cert_time(cert_params.expire_date_time, &notAfter);
+    if (!notAfterTime ||
+        !X509_set_notAfter(certificate.get(), notAfterTime /* Don't release; copied */)) {
         return TranslateLastOpenSslError();
     }
 
@@ -362,7 +434,7 @@ CertificateChain generate_self_signed_cert(const AsymmetricKey& key, const Autho
     cert_params.is_agreement_key = key.authorizations().Contains(TAG_PURPOSE, KM_PURPOSE_AGREE_KEY);
 
     X509_Ptr cert;
-    *error = make_cert(pkey.get(), cert_params.subject_name.get() /* issuer */, cert_params, &cert);
+    *error = make_cert(pkey.get(), cert_params.subject() /* issuer */, cert_params, &cert);
     if (*error != KM_ERROR_OK) return {};
 
     if (fake_signature) {
@@ -385,14 +457,16 @@ CertificateChain generate_self_signed_cert(const AsymmetricKey& key, const Autho
 }
 
 keymaster_error_t encode_certificate(X509* certificate, keymaster_blob_t* blob) {
-    int len = i2d_X509(certificate, nullptr /* ppout */);
-    if (len < 0) return TranslateLastOpenSslError();
-
-    blob->data = new (std::nothrow) uint8_t[len];
+    // Encode once, into a buffer OpenSSL allocates, rather than measuring and then encoding.  The
+    // chain frees its entries with delete[], so the DER is copied into a buffer of its own.
+    uint8_t* der = nullptr;
+    int len = i2d_X509(certificate, &der);
+    if (len <= 0) return TranslateLastOpenSslError();
+
+    blob->data = dup_buffer(der, len);
+    OPENSSL_free(der);
     if (!blob->data) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    uint8_t* p = const_cast<uint8_t*>(blob->data);
-    blob->data_length = i2d_X509(certificate, &p);
+    blob->data_length = len;
     return KM_ERROR_OK;
 }
 
@@ -18,6 +18,8 @@
 
 #include <assert.h>
 
+#include <utility>
+
 #include <openssl/aes.h>
 #include <openssl/cmac.h>
 
@@ -35,21 +37,7 @@ size_t min(size_t a, size_t b) {
     return a < b ? a : b;
 }
 
-DEFINE_OPENSSL_OBJECT_POINTER(CMAC_CTX)
-
-keymaster_error_t ckdf(const KeymasterKeyBlob& key, const KeymasterBlob& label,
-                       const keymaster_blob_t* context_chunks, size_t num_chunks,
-                       KeymasterKeyBlob* output) {
-    // Note: the variables i and L correspond to i and L in the standard.  See page 12 of
-    // http://nvlpubs.nist.gov/nistpubs/Legacy/SP/nistspecialpublication800-108.pdf.
-
-    const uint32_t blocks = div_round_up(output->key_material_size, AES_BLOCK_SIZE);
-    const uint32_t L = output->key_material_size * 8;  // bits
-    const uint32_t net_order_L = hton(L);
-
-    CMAC_CTX_Ptr ctx(CMAC_CTX_new());
-    if (!ctx.get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
+keymaster_error_t Ckdf::Init(const KeymasterKeyBlob& key) {
     auto algo = EVP_aes_128_cbc();
     switch (key.key_material_size) {
     case AES_BLOCK_SIZE:
@@ -62,10 +50,31 @@ keymaster_error_t ckdf(const KeymasterKeyBlob& key, const KeymasterBlob& label,
         return KM_ERROR_UNSUPPORTED_KEY_SIZE;
     }
 
+    CMAC_CTX_Ptr ctx(CMAC_CTX_new());
+    if (!ctx.get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     if (!CMAC_Init(ctx.get(), key.key_material, key.key_material_size, algo,
                    nullptr /* engine */)) {
         return TranslateLastOpenSslError();
     }
+    keyed_ctx_ = std::move(ctx);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Ckdf::Derive(const KeymasterBlob& label, const keymaster_blob_t* context_chunks,
+                               size_t num_chunks, KeymasterKeyBlob* output) const {
+    // Note: the variables i and L correspond to i and L in the standard.  See page 12 of
+    // http://nvlpubs.nist.gov/nistpubs/Legacy/SP/nistspecialpublication800-108.pdf.
+
+    if (!keyed_ctx_.get()) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    const uint32_t blocks = div_round_up(output->key_material_size, AES_BLOCK_SIZE);
+    const uint32_t L = output->key_material_size * 8;  // bits
+    const uint32_t net_order_L = hton(L);
+
+    // The copy is already keyed, and CMAC_Reset() below keeps the key for the next block.
+    CMAC_CTX_Ptr ctx(CMAC_CTX_new());
+    if (!ctx.get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!CMAC_CTX_copy(ctx.get(), keyed_ctx_.get())) return TranslateLastOpenSslError();
 
     auto output_pos = const_cast<uint8_t*>(output->begin());
     memset(output_pos, 0, output->key_material_size);
@@ -100,7 +109,7 @@ keymaster_error_t ckdf(const KeymasterKeyBlob& key, const KeymasterBlob& label,
         // L
         uint8_t buf[4];
         memcpy(buf, &net_order_L, 4);
-        if (!CMAC_Update(ctx.get(), buf, sizeof(buf))) TranslateLastOpenSslError();
+        if (!CMAC_Update(ctx.get(), buf, sizeof(buf))) return TranslateLastOpenSslError();
 
         size_t out_len;
         if (output_pos <= output->end() - AES_BLOCK_SIZE) {
@@ -121,4 +130,13 @@ keymaster_error_t ckdf(const KeymasterKeyBlob& key, const KeymasterBlob& label,
     return KM_ERROR_OK;
 }
 
+keymaster_error_t ckdf(const KeymasterKeyBlob& key, const KeymasterBlob& label,
+                       const keymaster_blob_t* context_chunks, size_t num_chunks,
+                       KeymasterKeyBlob* output) {
+    Ckdf keyed;
+    keymaster_error_t error = keyed.Init(key);
+    if (error != KM_ERROR_OK) return error;
+    return keyed.Derive(label, context_chunks, num_chunks, output);
+}
+
 }  // namespace keymaster
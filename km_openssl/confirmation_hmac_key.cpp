@@ -0,0 +1,98 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/km_openssl/confirmation_hmac_key.h>
+
+#include <openssl/evp.h>
+#include <openssl/mem.h>
+#include <openssl/sha.h>
+
+#include <keymaster/constant_time.h>
+#include <keymaster/km_openssl/openssl_err.h>
+
+namespace keymaster {
+
+namespace {
+
+static_assert(SHA256_DIGEST_LENGTH == kConfirmationTokenSize,
+              "Confirmation tokens are HMAC-SHA256 digests");
+
+class HmacConfirmationVerifier : public ConfirmationVerifier {
+  public:
+    HmacConfirmationVerifier() { HMAC_CTX_init(&ctx_); }
+    ~HmacConfirmationVerifier() override { HMAC_CTX_cleanup(&ctx_); }
+
+    keymaster_error_t Init(const HMAC_CTX* keyed) {
+        if (!HMAC_CTX_copy_ex(&ctx_, keyed)) return TranslateLastOpenSslError();
+        return KM_ERROR_OK;
+    }
+
+    keymaster_error_t Verify(const uint8_t confirmation_token[kConfirmationTokenSize]) override {
+        uint8_t digest[SHA256_DIGEST_LENGTH];
+        unsigned digest_length;
+        if (!HMAC_Final(&ctx_, digest, &digest_length)) return TranslateLastOpenSslError();
+        if (digest_length != kConfirmationTokenSize ||
+            !ConstantTimeEquals(digest, confirmation_token, kConfirmationTokenSize)) {
+            return KM_ERROR_NO_USER_CONFIRMATION;
+        }
+        return KM_ERROR_OK;
+    }
+
+  protected:
+    keymaster_error_t Update(const uint8_t* data, size_t data_length) override {
+        if (!HMAC_Update(&ctx_, data, data_length)) return TranslateLastOpenSslError();
+        return KM_ERROR_OK;
+    }
+
+  private:
+    HMAC_CTX ctx_;
+};
+
+}  // namespace
+
+ConfirmationHmacKey::ConfirmationHmacKey() {
+    HMAC_CTX_init(&ctx_);
+}
+
+ConfirmationHmacKey::~ConfirmationHmacKey() {
+    HMAC_CTX_cleanup(&ctx_);
+}
+
+keymaster_error_t ConfirmationHmacKey::Init(const uint8_t* key, size_t key_length) {
+    initialized_ = false;
+    if (!HMAC_Init_ex(&ctx_, key, key_length, EVP_sha256(), nullptr /* engine */) ||
+        !HMAC_Update(&ctx_, reinterpret_cast<const uint8_t*>(kConfirmationTokenMessageTag),
+                     kConfirmationTokenMessageTagSize)) {
+        return TranslateLastOpenSslError();
+    }
+    initialized_ = true;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t
+ConfirmationHmacKey::CreateVerifier(UniquePtr<ConfirmationVerifier>* verifier) const {
+    if (!initialized_) return KM_ERROR_UNKNOWN_ERROR;
+    UniquePtr<HmacConfirmationVerifier> hmac_verifier(new (std::nothrow)
+                                                          HmacConfirmationVerifier);
+    if (!hmac_verifier) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    keymaster_error_t error = hmac_verifier->Init(&ctx_);
+    if (error != KM_ERROR_OK) return error;
+    verifier->reset(hmac_verifier.release());
+    return KM_ERROR_OK;
+}
+
+}  // namespace keymaster
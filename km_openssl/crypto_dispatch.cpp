@@ -0,0 +1,113 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/crypto_dispatch.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include <mutex>
+
+#include <openssl/aead.h>
+
+#include <keymaster/logger.h>
+
+namespace keymaster {
+
+namespace {
+
+constexpr size_t kHardwareAesMinChunkBytes = 4 * 1024 * 1024;
+constexpr size_t kSoftwareAesMinChunkBytes = 1024 * 1024;
+
+CpuCryptoFeatures ProbeCpuCryptoFeatures() {
+    CpuCryptoFeatures features;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        features.aes = ecx & bit_AES;
+        features.carryless_multiply = ecx & bit_PCLMUL;
+        features.vector_permute = ecx & bit_SSSE3;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        // The SHA extensions cover SHA-1 and SHA-256 only.
+        features.sha1 = features.sha256 = ebx & bit_SHA;
+    }
+#elif defined(__aarch64__) && defined(__linux__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    features.aes = hwcap & HWCAP_AES;
+    features.carryless_multiply = hwcap & HWCAP_PMULL;
+    features.sha1 = hwcap & HWCAP_SHA1;
+    features.sha256 = hwcap & HWCAP_SHA2;
+    features.sha512 = hwcap & HWCAP_SHA512;
+    features.vector_permute = hwcap & HWCAP_ASIMD;
+#endif
+    return features;
+}
+
+CryptoDispatch SelectKernels() {
+    CryptoDispatch dispatch;
+    dispatch.features = ProbeCpuCryptoFeatures();
+    const CpuCryptoFeatures& features = dispatch.features;
+    dispatch.boringssl_aes_hardware = EVP_has_aes_hardware();
+
+    dispatch.aes_kernel = features.aes              ? "hardware"
+                          : features.vector_permute ? "vector"
+                                                    : "generic";
+    dispatch.ghash_kernel = features.carryless_multiply ? "hardware"
+                            : features.vector_permute   ? "vector"
+                                                        : "generic";
+    dispatch.sha256_kernel = features.sha256 ? "hardware" : "generic";
+    // Mirrors the selection in ocb.c.
+#if defined(__SSE2__)
+    dispatch.ocb_kernel = "sse2";
+#elif defined(__ARM_NEON__)
+    dispatch.ocb_kernel = "neon";
+#else
+    dispatch.ocb_kernel = "generic";
+#endif
+    dispatch.des_kernel = "generic";
+
+    dispatch.block_cipher_min_chunk_bytes =
+        features.aes ? kHardwareAesMinChunkBytes : kSoftwareAesMinChunkBytes;
+    return dispatch;
+}
+
+}  // namespace
+
+const CryptoDispatch& GetCryptoDispatch() {
+    static const CryptoDispatch dispatch = SelectKernels();
+    return dispatch;
+}
+
+void LogCryptoDispatch(const CryptoDispatch& dispatch) {
+    LOG_I("Crypto kernels: aes %s (BoringSSL AES hardware %s), ghash %s, sha256 %s, ocb %s, "
+          "3des %s; sha1 %s, sha512 %s; parallel block cipher chunks of %zu bytes",
+          dispatch.aes_kernel, dispatch.boringssl_aes_hardware ? "yes" : "no",
+          dispatch.ghash_kernel, dispatch.sha256_kernel, dispatch.ocb_kernel, dispatch.des_kernel,
+          dispatch.features.sha1 ? "hardware" : "generic",
+          dispatch.features.sha512 ? "hardware" : "generic", dispatch.block_cipher_min_chunk_bytes);
+}
+
+void LogCryptoDispatchOnce() {
+    static std::once_flag logged;
+    std::call_once(logged, [] { LogCryptoDispatch(GetCryptoDispatch()); });
+}
+
+}  // namespace keymaster
@@ -15,11 +15,26 @@
  */
 
 #include <keymaster/km_openssl/curve25519_key.h>
+
+#include <string.h>
+
 #include <openssl/curve25519.h>
 #include <openssl/evp.h>
 
 namespace keymaster {
 
+namespace {
+
+// RFC 8410 PrivateKeyInfo for a Curve25519 key, up to the raw key.  The byte at
+// kPkcs8OidTypeOffset, the end of the algorithm OID, distinguishes Ed25519 from X25519.
+constexpr uint8_t kPkcs8Prefix[] = {0x30, 0x2e, 0x02, 0x01, 0x00, 0x30, 0x05, 0x06,
+                                    0x03, 0x2b, 0x65, 0x00, 0x04, 0x22, 0x04, 0x20};
+constexpr size_t kPkcs8OidTypeOffset = 11;
+constexpr uint8_t kEd25519OidType = 0x70;
+constexpr uint8_t kX25519OidType = 0x6e;
+
+}  // namespace
+
 bool IsEd25519Key(const AuthorizationSet& hw_enforced, const AuthorizationSet& sw_enforced) {
     AuthProxy proxy(hw_enforced, sw_enforced);
     return (proxy.Contains(TAG_ALGORITHM, KM_ALGORITHM_EC) &&
@@ -45,4 +60,23 @@ EVP_PKEY_Ptr Curve25519Key::InternalToEvp() const {
         d2i_PrivateKey(evp_key_type(), nullptr /* pkey */, &tmp, key_material().key_material_size));
 }
 
+bool Curve25519Key::InternalToRaw(uint8_t raw_key[ED25519_SEED_LEN]) const {
+    const uint8_t* material = key_material().key_material;
+    size_t material_size = key_material().key_material_size;
+    uint8_t oid_type = evp_key_type() == EVP_PKEY_ED25519 ? kEd25519OidType : kX25519OidType;
+    if (material_size == sizeof(kPkcs8Prefix) + ED25519_SEED_LEN &&
+        memcmp(material, kPkcs8Prefix, kPkcs8OidTypeOffset) == 0 &&
+        material[kPkcs8OidTypeOffset] == oid_type &&
+        memcmp(material + kPkcs8OidTypeOffset + 1, kPkcs8Prefix + kPkcs8OidTypeOffset + 1,
+               sizeof(kPkcs8Prefix) - kPkcs8OidTypeOffset - 1) == 0) {
+        memcpy(raw_key, material + sizeof(kPkcs8Prefix), ED25519_SEED_LEN);
+        return true;
+    }
+
+    EVP_PKEY_Ptr pkey(InternalToEvp());
+    size_t raw_key_len = ED25519_SEED_LEN;
+    return pkey && EVP_PKEY_get_raw_private_key(pkey.get(), raw_key, &raw_key_len) &&
+           raw_key_len == ED25519_SEED_LEN;
+}
+
 }  // namespace keymaster
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/digest_context_pool.h>
+
+#include <stddef.h>
+
+#include <openssl/nid.h>
+
+namespace keymaster {
+
+namespace {
+
+// One free list per digest below, each holding at most this many idle contexts.
+constexpr size_t kDigestCount = 6;
+constexpr size_t kContextsPerDigest = 4;
+
+int PoolIndex(const EVP_MD* md) {
+    switch (EVP_MD_type(md)) {
+    case NID_md5:
+        return 0;
+    case NID_sha1:
+        return 1;
+    case NID_sha224:
+        return 2;
+    case NID_sha256:
+        return 3;
+    case NID_sha384:
+        return 4;
+    case NID_sha512:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+class DigestContextPool {
+  public:
+    ~DigestContextPool() {
+        for (size_t i = 0; i < kDigestCount; ++i)
+            for (size_t j = 0; j < counts_[i]; ++j)
+                EVP_MD_CTX_free(contexts_[i][j]);
+    }
+
+    EVP_MD_CTX* Take(int index) {
+        if (index < 0 || counts_[index] == 0) return nullptr;
+        return contexts_[index][--counts_[index]];
+    }
+
+    bool Give(int index, EVP_MD_CTX* ctx) {
+        if (index < 0 || counts_[index] == kContextsPerDigest) return false;
+        contexts_[index][counts_[index]++] = ctx;
+        return true;
+    }
+
+  private:
+    EVP_MD_CTX* contexts_[kDigestCount][kContextsPerDigest] = {};
+    size_t counts_[kDigestCount] = {};
+};
+
+DigestContextPool& ThreadPool() {
+    thread_local DigestContextPool pool;
+    return pool;
+}
+
+}  // namespace
+
+bool PooledDigestContext::Init(const EVP_MD* md) {
+    Release();
+
+    ctx_ = ThreadPool().Take(PoolIndex(md));
+    if (!ctx_) {
+        ctx_ = EVP_MD_CTX_new();
+        if (!ctx_) return false;
+        if (!EVP_DigestInit_ex(ctx_, md, nullptr /* engine */)) {
+            EVP_MD_CTX_free(ctx_);
+            ctx_ = nullptr;
+            return false;
+        }
+    }
+    md_ = md;
+    return true;
+}
+
+bool PooledDigestContext::CopyFrom(const PooledDigestContext& other) {
+    if (!other.ctx_) {
+        Release();
+        return true;
+    }
+    if (!Init(other.md_)) return false;
+    if (!EVP_MD_CTX_copy_ex(ctx_, other.ctx_)) {
+        Release();
+        return false;
+    }
+    return true;
+}
+
+void PooledDigestContext::Release() {
+    if (!ctx_) return;
+
+    // Re-initializing with the same digest resets the state without reallocating it.
+    if (!EVP_DigestInit_ex(ctx_, md_, nullptr /* engine */) ||
+        !ThreadPool().Give(PoolIndex(md_), ctx_))
+        EVP_MD_CTX_free(ctx_);
+    ctx_ = nullptr;
+    md_ = nullptr;
+}
+
+}  // namespace keymaster
@@ -143,19 +143,14 @@ keymaster_error_t EcKeyFactory::GenerateKey(const AuthorizationSet& key_descript
         if (ec_key.get() == nullptr || pkey.get() == nullptr)
             return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-        UniquePtr<EC_GROUP, EC_GROUP_Delete> group(ChooseGroup(ec_curve));
-        if (group.get() == nullptr) {
+        const EC_GROUP* group = ec_get_shared_group(ec_curve);
+        if (group == nullptr) {
             LOG_E("Unable to get EC group for curve %d", ec_curve);
             return KM_ERROR_UNSUPPORTED_KEY_SIZE;
         }
 
-#if !defined(OPENSSL_IS_BORINGSSL)
-        EC_GROUP_set_point_conversion_form(group.get(), POINT_CONVERSION_UNCOMPRESSED);
-        EC_GROUP_set_asn1_flag(group.get(), OPENSSL_EC_NAMED_CURVE);
-#endif
-
-        if (EC_KEY_set_group(ec_key.get(), group.get()) != 1 ||
-            EC_KEY_generate_key(ec_key.get()) != 1 || EC_KEY_check_key(ec_key.get()) < 0) {
+        if (EC_KEY_set_group(ec_key.get(), group) != 1 ||
+            EC_KEY_generate_key(ec_key.get()) != 1 || EC_KEY_check_key(ec_key.get()) != 1) {
             return TranslateLastOpenSslError();
         }
 
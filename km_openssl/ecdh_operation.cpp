@@ -16,25 +16,78 @@
 
 #include <keymaster/km_openssl/ecdh_operation.h>
 
+#include <string.h>
+
 #include <utility>
 #include <vector>
 
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/km_openssl/curve25519_key.h>
 #include <keymaster/km_openssl/ec_key.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/logger.h>
 #include <openssl/curve25519.h>
+#include <openssl/ecdh.h>
 #include <openssl/err.h>
 
 namespace keymaster {
 
+namespace {
+
+// Decodes a peer public key from its ASN.1 SubjectPublicKeyInfo.
+keymaster_error_t DecodePeerKey(const Buffer& input, EVP_PKEY_Ptr* peer_key) {
+    const unsigned char* encodedPublicKey = input.begin();
+    EVP_PKEY* pkeyRaw = d2i_PUBKEY(nullptr, &encodedPublicKey, input.available_read());
+    if (pkeyRaw == nullptr) {
+        LOG_E("Error decoding key", 0);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    peer_key->reset(pkeyRaw);
+    return KM_ERROR_OK;
+}
+
+// SubjectPublicKeyInfo of an X25519 public key, up to the raw key (RFC 8410).
+constexpr uint8_t kX25519SpkiPrefix[] = {0x30, 0x2a, 0x30, 0x05, 0x06, 0x03,
+                                         0x2b, 0x65, 0x6e, 0x03, 0x21, 0x00};
+
+// Retrieves the raw peer X25519 key from within the ASN.1 SubjectPublicKeyInfo.  The usual
+// encoding is recognized and copied directly; anything else is left to OpenSSL to decode or
+// reject.
+keymaster_error_t DecodeX25519PeerKey(const Buffer& input,
+                                      uint8_t pub_key[X25519_PUBLIC_VALUE_LEN]) {
+    if (input.available_read() == sizeof(kX25519SpkiPrefix) + X25519_PUBLIC_VALUE_LEN &&
+        memcmp(input.peek_read(), kX25519SpkiPrefix, sizeof(kX25519SpkiPrefix)) == 0) {
+        memcpy(pub_key, input.peek_read() + sizeof(kX25519SpkiPrefix), X25519_PUBLIC_VALUE_LEN);
+        return KM_ERROR_OK;
+    }
+
+    EVP_PKEY_Ptr pkey;
+    keymaster_error_t error = DecodePeerKey(input, &pkey);
+    if (error != KM_ERROR_OK) return error;
+
+    int pkey_type = EVP_PKEY_id(pkey.get());
+    if (pkey_type != EVP_PKEY_X25519) {
+        LOG_E("Unexpected peer public key type %d", pkey_type);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    size_t pub_key_len = X25519_PUBLIC_VALUE_LEN;
+    if (EVP_PKEY_get_raw_public_key(pkey.get(), pub_key, &pub_key_len) == 0) {
+        LOG_E("Error extracting key", 0);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    if (pub_key_len != X25519_PUBLIC_VALUE_LEN) {
+        LOG_E("Invalid length %d of peer key", pub_key_len);
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+    return KM_ERROR_OK;
+}
+
+}  // namespace
+
 keymaster_error_t EcdhOperation::Begin(const AuthorizationSet& /*input_params*/,
                                        AuthorizationSet* /*output_params*/) {
-    auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
-                             (size_t)sizeof(operation_handle_));
-    if (rc != KM_ERROR_OK) {
-        return rc;
-    }
     return KM_ERROR_OK;
 }
 
@@ -48,13 +101,9 @@ keymaster_error_t EcdhOperation::Update(const AuthorizationSet& /*additional_par
 keymaster_error_t EcdhOperation::Finish(const AuthorizationSet& /*additional_params*/,
                                         const Buffer& input, const Buffer& /*signature*/,
                                         AuthorizationSet* /*output_params*/, Buffer* output) {
-    const unsigned char* encodedPublicKey = input.begin();
-    EVP_PKEY* pkeyRaw = d2i_PUBKEY(nullptr, &encodedPublicKey, input.available_read());
-    if (pkeyRaw == nullptr) {
-        LOG_E("Error decoding key", 0);
-        return KM_ERROR_INVALID_ARGUMENT;
-    }
-    auto pkey = EVP_PKEY_Ptr(pkeyRaw);
+    EVP_PKEY_Ptr pkey;
+    keymaster_error_t error = DecodePeerKey(input, &pkey);
+    if (error != KM_ERROR_OK) return error;
 
     auto ctx = EVP_PKEY_CTX_Ptr(EVP_PKEY_CTX_new(ecdh_key_.get(), nullptr));
     if (ctx.get() == nullptr) {
@@ -87,48 +136,65 @@ keymaster_error_t EcdhOperation::Finish(const AuthorizationSet& /*additional_par
     return KM_ERROR_OK;
 }
 
-keymaster_error_t X25519Operation::Finish(const AuthorizationSet& /*additional_params*/,
-                                          const Buffer& input, const Buffer& /*signature*/,
-                                          AuthorizationSet* /*output_params*/, Buffer* output) {
-    // Retrieve the peer X25519 key from within the ASN.1 SubjectPublicKeyInfo.
-    const unsigned char* encodedPublicKey = input.begin();
-    EVP_PKEY* pkeyRaw = d2i_PUBKEY(nullptr, &encodedPublicKey, input.available_read());
-    if (pkeyRaw == nullptr) {
-        LOG_E("Error decoding key", 0);
-        return KM_ERROR_INVALID_ARGUMENT;
-    }
-    auto pkey = EVP_PKEY_Ptr(pkeyRaw);
+keymaster_error_t EcdhOperation::AgreeBatch(const Buffer* peer_keys, size_t peer_key_count,
+                                            Buffer* shared_secrets) {
+    // The private key and its group are looked up once, and each secret is computed directly
+    // instead of through a derivation context per peer.  This produces the same secrets as
+    // Finish().
+    const EC_KEY* ec_key = EVP_PKEY_get0_EC_KEY(ecdh_key_.get());
+    if (ec_key == nullptr) return TranslateLastOpenSslError();
+    const EC_GROUP* group = EC_KEY_get0_group(ec_key);
+    const size_t secret_length = (EC_GROUP_get_degree(group) + 7) / 8;
 
-    int pkey_type = EVP_PKEY_id(pkey.get());
-    if (pkey_type != EVP_PKEY_X25519) {
-        LOG_E("Unexpected peer public key type %d", pkey_type);
-        return KM_ERROR_INVALID_ARGUMENT;
+    for (size_t i = 0; i < peer_key_count; ++i) {
+        EVP_PKEY_Ptr pkey;
+        keymaster_error_t error = DecodePeerKey(peer_keys[i], &pkey);
+        if (error != KM_ERROR_OK) return error;
+        const EC_KEY* peer_ec_key = EVP_PKEY_get0_EC_KEY(pkey.get());
+        if (peer_ec_key == nullptr ||
+            EC_GROUP_cmp(group, EC_KEY_get0_group(peer_ec_key), nullptr /* ctx */) != 0) {
+            LOG_E("Error setting peer key", 0);
+            return KM_ERROR_INVALID_ARGUMENT;
+        }
+
+        if (!shared_secrets[i].Reinitialize(secret_length)) {
+            LOG_E("Error reserving data in output buffer", 0);
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        int written = ECDH_compute_key(shared_secrets[i].peek_write(), secret_length,
+                                       EC_KEY_get0_public_key(peer_ec_key), ec_key,
+                                       nullptr /* kdf */);
+        if (written < 0 || static_cast<size_t>(written) != secret_length) {
+            LOG_E("Error deriving key", 0);
+            return TranslateLastOpenSslError();
+        }
+        shared_secrets[i].advance_write(secret_length);
     }
+    return KM_ERROR_OK;
+}
 
-    size_t pub_key_len = X25519_PUBLIC_VALUE_LEN;
+X25519Operation::X25519Operation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                                 const uint8_t private_key[X25519_PRIVATE_KEY_LEN])
+    : EcdhOperation(std::move(hw_enforced), std::move(sw_enforced), nullptr /* key */) {
+    memcpy(private_key_, private_key, sizeof(private_key_));
+}
+
+X25519Operation::~X25519Operation() {
+    memset_s(private_key_, 0, sizeof(private_key_));
+}
+
+keymaster_error_t X25519Operation::Finish(const AuthorizationSet& /*additional_params*/,
+                                          const Buffer& input, const Buffer& /*signature*/,
+                                          AuthorizationSet* /*output_params*/, Buffer* output) {
     uint8_t pub_key[X25519_PUBLIC_VALUE_LEN];
-    if (EVP_PKEY_get_raw_public_key(pkey.get(), pub_key, &pub_key_len) == 0) {
-        LOG_E("Error extracting key", 0);
-        return KM_ERROR_INVALID_ARGUMENT;
-    }
-    if (pub_key_len != X25519_PUBLIC_VALUE_LEN) {
-        LOG_E("Invalid length %d of peer key", pub_key_len);
-        return KM_ERROR_INVALID_ARGUMENT;
-    }
+    keymaster_error_t error = DecodeX25519PeerKey(input, pub_key);
+    if (error != KM_ERROR_OK) return error;
 
-    size_t key_len = X25519_PRIVATE_KEY_LEN;
-    uint8_t priv_key[X25519_PRIVATE_KEY_LEN];
-    if (EVP_PKEY_get_raw_private_key(ecdh_key_.get(), priv_key, &key_len) == 0) {
-        return TranslateLastOpenSslError();
-    }
-    if (key_len != X25519_PRIVATE_KEY_LEN) {
-        return KM_ERROR_UNKNOWN_ERROR;
-    }
     if (!output->reserve(X25519_SHARED_KEY_LEN)) {
         LOG_E("Error reserving data in output buffer", 0);
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
-    if (X25519(output->peek_write(), priv_key, pub_key) != 1) {
+    if (X25519(output->peek_write(), private_key_, pub_key) != 1) {
         LOG_E("Error deriving key", 0);
         return TranslateLastOpenSslError();
     }
@@ -137,11 +203,45 @@ keymaster_error_t X25519Operation::Finish(const AuthorizationSet& /*additional_p
     return KM_ERROR_OK;
 }
 
+keymaster_error_t X25519Operation::AgreeBatch(const Buffer* peer_keys, size_t peer_key_count,
+                                              Buffer* shared_secrets) {
+    for (size_t i = 0; i < peer_key_count; ++i) {
+        uint8_t pub_key[X25519_PUBLIC_VALUE_LEN];
+        keymaster_error_t error = DecodeX25519PeerKey(peer_keys[i], pub_key);
+        if (error != KM_ERROR_OK) return error;
+        if (!shared_secrets[i].Reinitialize(X25519_SHARED_KEY_LEN)) {
+            LOG_E("Error reserving data in output buffer", 0);
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        if (X25519(shared_secrets[i].peek_write(), private_key_, pub_key) != 1) {
+            LOG_E("Error deriving key", 0);
+            return TranslateLastOpenSslError();
+        }
+        shared_secrets[i].advance_write(X25519_SHARED_KEY_LEN);
+    }
+    return KM_ERROR_OK;
+}
+
 OperationPtr EcdhOperationFactory::CreateOperation(Key&& key,
                                                    const AuthorizationSet& /*begin_params*/,
                                                    keymaster_error_t* error) {
     const AsymmetricKey& ecdh_key = static_cast<AsymmetricKey&>(key);
 
+    if (ecdh_key.evp_key_type() == EVP_PKEY_X25519) {
+        // X25519 agrees with the raw key, so no EVP_PKEY is built.
+        uint8_t private_key[X25519_PRIVATE_KEY_LEN];
+        Eraser private_key_eraser(private_key, sizeof(private_key));
+        if (!static_cast<const Curve25519Key&>(ecdh_key).InternalToRaw(private_key)) {
+            *error = KM_ERROR_UNKNOWN_ERROR;
+            return nullptr;
+        }
+        *error = KM_ERROR_OK;
+        auto op = OperationPtr(new (std::nothrow) X25519Operation(
+            key.hw_enforced_move(), key.sw_enforced_move(), private_key));
+        if (!op) *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return op;
+    }
+
     EVP_PKEY_Ptr pkey(ecdh_key.InternalToEvp());
     if (pkey.get() == nullptr) {
         *error = KM_ERROR_UNKNOWN_ERROR;
@@ -152,10 +252,6 @@ OperationPtr EcdhOperationFactory::CreateOperation(Key&& key,
 
     EcdhOperation* op = nullptr;
     switch (EVP_PKEY_id(pkey.get())) {
-    case EVP_PKEY_X25519:
-        op = new (std::nothrow) X25519Operation(std::move(key.hw_enforced_move()),
-                                                std::move(key.sw_enforced_move()), pkey.release());
-        break;
     case EVP_PKEY_EC:
         op = new (std::nothrow) EcdhOperation(std::move(key.hw_enforced_move()),
                                               std::move(key.sw_enforced_move()), pkey.release());
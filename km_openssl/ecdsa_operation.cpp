@@ -18,7 +18,9 @@
 
 #include <openssl/curve25519.h>
 #include <openssl/ecdsa.h>
+#include <openssl/err.h>
 
+#include <keymaster/km_openssl/batch_verify.h>
 #include <keymaster/km_openssl/ec_key.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
@@ -36,6 +38,25 @@ OperationPtr EcdsaOperationFactory::CreateOperation(Key&& key, const Authorizati
                                                     keymaster_error_t* error) {
     const AsymmetricKey& ecdsa_key = static_cast<AsymmetricKey&>(key);
 
+    if (purpose() == KM_PURPOSE_SIGN && ecdsa_key.evp_key_type() == EVP_PKEY_ED25519) {
+        // Ed25519 signs with the raw key, so no EVP_PKEY is built.
+        uint8_t seed[ED25519_SEED_LEN];
+        Eraser seed_eraser(seed, sizeof(seed));
+        if (!static_cast<const Curve25519Key&>(ecdsa_key).InternalToRaw(seed)) {
+            *error = KM_ERROR_UNKNOWN_ERROR;
+            return nullptr;
+        }
+        keymaster_digest_t digest;
+        if (!GetAndValidateDigest(begin_params, ecdsa_key, &digest, error, true)) {
+            return nullptr;
+        }
+        *error = KM_ERROR_OK;
+        auto op = OperationPtr(new (std::nothrow) Ed25519SignOperation(
+            key.hw_enforced_move(), key.sw_enforced_move(), digest, seed));
+        if (!op) *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return op;
+    }
+
     EVP_PKEY_Ptr pkey(ecdsa_key.InternalToEvp());
     if (pkey.get() == nullptr) {
         *error = KM_ERROR_UNKNOWN_ERROR;
@@ -61,7 +82,36 @@ const keymaster_digest_t* EcdsaOperationFactory::SupportedDigests(size_t* digest
 
 EcdsaOperation::~EcdsaOperation() {
     if (ecdsa_key_ != nullptr) EVP_PKEY_free(ecdsa_key_);
-    EVP_MD_CTX_cleanup(&digest_ctx_);
+}
+
+OperationPtr EcdsaOperation::Fork(keymaster_error_t* error) const {
+    AuthorizationSet hw_enforced, sw_enforced;
+    if (!CopyAuthorizations(&hw_enforced, &sw_enforced)) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+
+    // The fork holds a reference to the key of its own.
+    EVP_PKEY_up_ref(ecdsa_key_);
+    UniquePtr<EcdsaOperation> fork(
+        NewFork(std::move(hw_enforced), std::move(sw_enforced), ecdsa_key_));
+    if (!fork) {
+        EVP_PKEY_free(ecdsa_key_);
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+
+    fork->digest_algorithm_ = digest_algorithm_;
+    fork->data_.set_size_hint(data_.buffer_size());
+    if (!fork->data_.reserve(data_.available_read()) ||
+        !fork->data_.write(data_.peek_read(), data_.available_read()) ||
+        !fork->digest_ctx_.CopyFrom(digest_ctx_)) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+
+    *error = KM_ERROR_OK;
+    return std::move(fork);
 }
 
 keymaster_error_t EcdsaOperation::InitDigest() {
@@ -94,12 +144,21 @@ inline size_t min(size_t a, size_t b) {
     return (a < b) ? a : b;
 }
 
+size_t EcdsaOperation::RecommendedChunkSize() const {
+    if (digest_ != KM_DIGEST_NONE) return Operation::RecommendedChunkSize();
+    return (EVP_PKEY_bits(ecdsa_key_) + 7) / 8;
+}
+
 keymaster_error_t EcdsaOperation::StoreData(const Buffer& input, size_t* input_consumed) {
-    if (!data_.reserve((EVP_PKEY_bits(ecdsa_key_) + 7) / 8))
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    // ECDSA only uses as many bytes of an undigested message as the key has, so silently drop the
+    // rest rather than buffering it.
+    const size_t max_length = (EVP_PKEY_bits(ecdsa_key_) + 7) / 8;
+    size_t to_store = 0;
+    if (data_.available_read() < max_length)
+        to_store = min(max_length - data_.available_read(), input.available_read());
 
-    if (!data_.write(input.peek_read(), min(data_.available_write(), input.available_read())))
-        return KM_ERROR_UNKNOWN_ERROR;
+    if (!data_.reserve(to_store)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (!data_.write(input.peek_read(), to_store)) return KM_ERROR_UNKNOWN_ERROR;
 
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
@@ -107,19 +166,17 @@ keymaster_error_t EcdsaOperation::StoreData(const Buffer& input, size_t* input_c
 
 keymaster_error_t EcdsaSignOperation::Begin(const AuthorizationSet& /* input_params */,
                                             AuthorizationSet* /* output_params */) {
-    auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
-                             (size_t)sizeof(operation_handle_));
-    if (rc != KM_ERROR_OK) return rc;
-
     keymaster_error_t error = InitDigest();
     if (error != KM_ERROR_OK) return error;
 
-    if (digest_ == KM_DIGEST_NONE) return KM_ERROR_OK;
+    if (digest_ == KM_DIGEST_NONE) {
+        data_.set_size_hint((EVP_PKEY_bits(ecdsa_key_) + 7) / 8);
+        return KM_ERROR_OK;
+    }
 
-    EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestSignInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
-                           ecdsa_key_) != 1)
-        return TranslateLastOpenSslError();
+    // The message is digested separately and the digest signed in Finish(), so the digest context
+    // can come from the pool rather than being set up with the key.
+    if (!digest_ctx_.Init(digest_algorithm_)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     return KM_ERROR_OK;
 }
 
@@ -129,7 +186,7 @@ keymaster_error_t EcdsaSignOperation::Update(const AuthorizationSet& /* addition
                                              Buffer* /* output */, size_t* input_consumed) {
     if (digest_ == KM_DIGEST_NONE) return StoreData(input, input_consumed);
 
-    if (EVP_DigestSignUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
+    if (EVP_DigestUpdate(digest_ctx_.get(), input.peek_read(), input.available_read()) != 1)
         return TranslateLastOpenSslError();
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
@@ -144,36 +201,86 @@ keymaster_error_t EcdsaSignOperation::Finish(const AuthorizationSet& additional_
     keymaster_error_t error = UpdateForFinish(additional_params, input);
     if (error != KM_ERROR_OK) return error;
 
-    size_t siglen;
-    if (digest_ == KM_DIGEST_NONE) {
-        UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
-        if (!ecdsa.get()) return TranslateLastOpenSslError();
-
-        output->Reinitialize(ECDSA_size(ecdsa.get()));
-        unsigned int siglen_tmp;
-        if (!ECDSA_sign(0 /* type -- ignored */, data_.peek_read(), data_.available_read(),
-                        output->peek_write(), &siglen_tmp, ecdsa.get()))
-            return TranslateLastOpenSslError();
-        siglen = siglen_tmp;
-    } else {
-        if (EVP_DigestSignFinal(&digest_ctx_, nullptr /* signature */, &siglen) != 1)
-            return TranslateLastOpenSslError();
-        if (!output->Reinitialize(siglen)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-        if (EVP_DigestSignFinal(&digest_ctx_, output->peek_write(), &siglen) <= 0)
+    const uint8_t* to_sign = data_.peek_read();
+    size_t to_sign_length = data_.available_read();
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    if (digest_ != KM_DIGEST_NONE) {
+        unsigned int digest_length;
+        if (!EVP_DigestFinal_ex(digest_ctx_.get(), digest, &digest_length))
             return TranslateLastOpenSslError();
+        digest_ctx_.Release();
+        to_sign = digest;
+        to_sign_length = digest_length;
     }
+
+    UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
+    if (!ecdsa.get()) return TranslateLastOpenSslError();
+
+    if (!output->Reinitialize(ECDSA_size(ecdsa.get()))) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    unsigned int siglen;
+    if (!ECDSA_sign(0 /* type -- ignored */, to_sign, to_sign_length, output->peek_write(), &siglen,
+                    ecdsa.get()))
+        return TranslateLastOpenSslError();
     if (!output->advance_write(siglen)) return KM_ERROR_UNKNOWN_ERROR;
     return KM_ERROR_OK;
 }
 
+keymaster_error_t EcdsaSignOperation::SignBatch(const Buffer* messages, size_t message_count,
+                                                Buffer* signatures) {
+    // The EC key is extracted once and each message is digested in one shot, rather than setting
+    // up a digest context per message.  This produces the same signatures as Finish().
+    UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
+    if (!ecdsa.get()) return TranslateLastOpenSslError();
+    const size_t max_undigested_length = (EVP_PKEY_bits(ecdsa_key_) + 7) / 8;
+    const size_t signature_size = ECDSA_size(ecdsa.get());
+
+    for (size_t i = 0; i < message_count; ++i) {
+        const uint8_t* to_sign = messages[i].peek_read();
+        size_t to_sign_length = messages[i].available_read();
+        uint8_t digest[EVP_MAX_MD_SIZE];
+        if (digest_ == KM_DIGEST_NONE) {
+            // Like StoreData(), silently truncate to the key size.
+            to_sign_length = min(to_sign_length, max_undigested_length);
+        } else {
+            unsigned int digest_length;
+            if (!EVP_Digest(to_sign, to_sign_length, digest, &digest_length, digest_algorithm_,
+                            nullptr /* engine */))
+                return TranslateLastOpenSslError();
+            to_sign = digest;
+            to_sign_length = digest_length;
+        }
+
+        if (!signatures[i].Reinitialize(signature_size)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        unsigned int siglen;
+        if (!ECDSA_sign(0 /* type -- ignored */, to_sign, to_sign_length,
+                        signatures[i].peek_write(), &siglen, ecdsa.get()))
+            return TranslateLastOpenSslError();
+        if (!signatures[i].advance_write(siglen)) return KM_ERROR_UNKNOWN_ERROR;
+    }
+    return KM_ERROR_OK;
+}
+
+Ed25519SignOperation::Ed25519SignOperation(AuthorizationSet&& hw_enforced,
+                                           AuthorizationSet&& sw_enforced,
+                                           keymaster_digest_t digest,
+                                           const uint8_t seed[ED25519_SEED_LEN])
+    : EcdsaSignOperation(std::move(hw_enforced), std::move(sw_enforced), digest,
+                         nullptr /* key */) {
+    uint8_t public_key[ED25519_PUBLIC_KEY_LEN];
+    ED25519_keypair_from_seed(public_key, private_key_, seed);
+}
+
+Ed25519SignOperation::~Ed25519SignOperation() {
+    memset_s(private_key_, 0, sizeof(private_key_));
+}
+
 keymaster_error_t Ed25519SignOperation::Begin(const AuthorizationSet& /* input_params */,
                                               AuthorizationSet* /* output_params */) {
     if (digest_ != KM_DIGEST_NONE) {
         // Ed25519 includes an internal digest, so no pre-digesting is supported.
         return KM_ERROR_UNSUPPORTED_DIGEST;
     }
-    return GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
-                          (size_t)sizeof(operation_handle_));
+    return KM_ERROR_OK;
 }
 
 keymaster_error_t Ed25519SignOperation::Update(const AuthorizationSet& /* additional_params */,
@@ -189,31 +296,49 @@ keymaster_error_t Ed25519SignOperation::Finish(const AuthorizationSet& additiona
                                                Buffer* output) {
     if (!output) return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    keymaster_error_t error = UpdateForFinish(additional_params, input);
-    if (error != KM_ERROR_OK) return error;
+    // A message passed whole to Finish() is signed where it is, rather than copied into data_.
+    const Buffer* message = &data_;
+    if (data_.available_read() == 0) {
+        if (input.available_read() > MAX_ED25519_MSG_SIZE) return KM_ERROR_INVALID_INPUT_LENGTH;
+        message = &input;
+    } else {
+        keymaster_error_t error = UpdateForFinish(additional_params, input);
+        if (error != KM_ERROR_OK) return error;
+    }
 
     if (!output->Reinitialize(ED25519_SIGNATURE_LEN)) {
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
-
-    EVP_MD_CTX ctx;
-    EVP_MD_CTX_init(&ctx);
-    if (!EVP_DigestSignInit(&ctx, /* pctx */ nullptr, /* digest */ nullptr, /* engine */ nullptr,
-                            ecdsa_key_)) {
-        EVP_MD_CTX_cleanup(&ctx);
+    if (!ED25519_sign(output->peek_write(), message->peek_read(), message->available_read(),
+                      private_key_)) {
         return TranslateLastOpenSslError();
     }
-    size_t out_len = ED25519_SIGNATURE_LEN;
-    if (!EVP_DigestSign(&ctx, output->peek_write(), &out_len, data_.peek_read(),
-                        data_.available_read())) {
-        EVP_MD_CTX_cleanup(&ctx);
-        return TranslateLastOpenSslError();
+    output->advance_write(ED25519_SIGNATURE_LEN);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t Ed25519SignOperation::SignBatch(const Buffer* messages, size_t message_count,
+                                                  Buffer* signatures) {
+    for (size_t i = 0; i < message_count; ++i) {
+        if (messages[i].available_read() > MAX_ED25519_MSG_SIZE) {
+            return KM_ERROR_INVALID_INPUT_LENGTH;
+        }
+        if (!signatures[i].Reinitialize(ED25519_SIGNATURE_LEN)) {
+            return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        }
+        if (!ED25519_sign(signatures[i].peek_write(), messages[i].peek_read(),
+                          messages[i].available_read(), private_key_)) {
+            return TranslateLastOpenSslError();
+        }
+        signatures[i].advance_write(ED25519_SIGNATURE_LEN);
     }
-    EVP_MD_CTX_cleanup(&ctx);
-    output->advance_write(out_len);
     return KM_ERROR_OK;
 }
 
+size_t Ed25519SignOperation::RecommendedChunkSize() const {
+    return MAX_ED25519_MSG_SIZE;
+}
+
 keymaster_error_t Ed25519SignOperation::StoreAllData(const Buffer& input, size_t* input_consumed) {
     if ((data_.available_read() + input.available_read()) > MAX_ED25519_MSG_SIZE) {
         return KM_ERROR_INVALID_INPUT_LENGTH;
@@ -231,19 +356,15 @@ keymaster_error_t Ed25519SignOperation::StoreAllData(const Buffer& input, size_t
 
 keymaster_error_t EcdsaVerifyOperation::Begin(const AuthorizationSet& /* input_params */,
                                               AuthorizationSet* /* output_params */) {
-    auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
-                             (size_t)sizeof(operation_handle_));
-    if (rc != KM_ERROR_OK) return rc;
-
     keymaster_error_t error = InitDigest();
     if (error != KM_ERROR_OK) return error;
 
-    if (digest_ == KM_DIGEST_NONE) return KM_ERROR_OK;
+    if (digest_ == KM_DIGEST_NONE) {
+        data_.set_size_hint((EVP_PKEY_bits(ecdsa_key_) + 7) / 8);
+        return KM_ERROR_OK;
+    }
 
-    EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestVerifyInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
-                             ecdsa_key_) != 1)
-        return TranslateLastOpenSslError();
+    if (!digest_ctx_.Init(digest_algorithm_)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     return KM_ERROR_OK;
 }
 
@@ -253,7 +374,7 @@ keymaster_error_t EcdsaVerifyOperation::Update(const AuthorizationSet& /* additi
                                                Buffer* /* output */, size_t* input_consumed) {
     if (digest_ == KM_DIGEST_NONE) return StoreData(input, input_consumed);
 
-    if (EVP_DigestVerifyUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
+    if (EVP_DigestUpdate(digest_ctx_.get(), input.peek_read(), input.available_read()) != 1)
         return TranslateLastOpenSslError();
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
@@ -266,22 +387,71 @@ keymaster_error_t EcdsaVerifyOperation::Finish(const AuthorizationSet& additiona
     keymaster_error_t error = UpdateForFinish(additional_params, input);
     if (error != KM_ERROR_OK) return error;
 
-    if (digest_ == KM_DIGEST_NONE) {
-        UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
-        if (!ecdsa.get()) return TranslateLastOpenSslError();
-
-        int result =
-            ECDSA_verify(0 /* type -- ignored */, data_.peek_read(), data_.available_read(),
-                         signature.peek_read(), signature.available_read(), ecdsa.get());
-        if (result < 0)
+    const uint8_t* to_verify = data_.peek_read();
+    size_t to_verify_length = data_.available_read();
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    if (digest_ != KM_DIGEST_NONE) {
+        unsigned int digest_length;
+        if (!EVP_DigestFinal_ex(digest_ctx_.get(), digest, &digest_length))
             return TranslateLastOpenSslError();
-        else if (result == 0)
-            return KM_ERROR_VERIFICATION_FAILED;
-    } else if (!EVP_DigestVerifyFinal(&digest_ctx_, signature.peek_read(),
-                                      signature.available_read()))
+        digest_ctx_.Release();
+        to_verify = digest;
+        to_verify_length = digest_length;
+    }
+
+    UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
+    if (!ecdsa.get()) return TranslateLastOpenSslError();
+
+    int result = ECDSA_verify(0 /* type -- ignored */, to_verify, to_verify_length,
+                              signature.peek_read(), signature.available_read(), ecdsa.get());
+    if (result < 0) return TranslateLastOpenSslError();
+    if (result == 0) {
+        ERR_clear_error();
         return KM_ERROR_VERIFICATION_FAILED;
+    }
 
     return KM_ERROR_OK;
 }
 
+keymaster_error_t EcdsaVerifyOperation::VerifyBatch(const Buffer* messages,
+                                                    const Buffer* signatures, size_t count,
+                                                    WorkerPool* pool, uint8_t* verified) {
+    // As in EcdsaSignOperation::SignBatch(), the EC key is extracted once, here to be shared by
+    // every thread, and each message is digested in one shot.  The results are the same as
+    // Finish()'s.
+    UniquePtr<EC_KEY, EC_KEY_Delete> ecdsa(EVP_PKEY_get1_EC_KEY(ecdsa_key_));
+    if (!ecdsa.get()) return TranslateLastOpenSslError();
+    const size_t max_undigested_length = (EVP_PKEY_bits(ecdsa_key_) + 7) / 8;
+
+    return VerifyInParallel(pool, count, verified, [&](keymaster_error_t* /* error */) {
+        return [&](size_t i) {
+            const uint8_t* to_verify = messages[i].peek_read();
+            size_t to_verify_length = messages[i].available_read();
+            uint8_t digest[EVP_MAX_MD_SIZE];
+            if (digest_ == KM_DIGEST_NONE) {
+                // Like StoreData(), silently truncate to the key size.
+                to_verify_length = min(to_verify_length, max_undigested_length);
+            } else {
+                unsigned int digest_length;
+                if (!EVP_Digest(to_verify, to_verify_length, digest, &digest_length,
+                                digest_algorithm_, nullptr /* engine */)) {
+                    return TranslateLastOpenSslError();
+                }
+                to_verify = digest;
+                to_verify_length = digest_length;
+            }
+
+            int result = ECDSA_verify(0 /* type -- ignored */, to_verify, to_verify_length,
+                                      signatures[i].peek_read(), signatures[i].available_read(),
+                                      ecdsa.get());
+            if (result < 0) return TranslateLastOpenSslError();
+            if (result == 0) {
+                ERR_clear_error();
+                return KM_ERROR_VERIFICATION_FAILED;
+            }
+            return KM_ERROR_OK;
+        };
+    });
+}
+
 }  // namespace keymaster
@@ -82,7 +82,7 @@ bool EciesKem::Encrypt(const Buffer& peer_public_value, Buffer* output_clear_key
 bool EciesKem::Encrypt(const uint8_t* peer_public_value, size_t peer_public_value_len,
                        Buffer* output_clear_key, Buffer* output_encrypted_key) {
 
-    key_exchange_.reset(NistCurveKeyExchange::GenerateKeyExchange(curve_));
+    key_exchange_.reset(NistCurveKeyExchange::GenerateKeyExchange(curve_, ephemeral_key_pool_));
     if (!key_exchange_.get()) {
         return false;
     }
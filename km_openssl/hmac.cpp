@@ -24,6 +24,7 @@
 #include <openssl/sha.h>
 
 #include <keymaster/android_keymaster_utils.h>
+#include <keymaster/constant_time.h>
 
 namespace keymaster {
 
@@ -78,7 +79,7 @@ bool HmacSha256::Verify(const uint8_t* data, size_t data_len, const uint8_t* dig
     uint8_t computed_digest[SHA256_DIGEST_LENGTH];
     if (!Sign(data, data_len, computed_digest, sizeof(computed_digest))) return false;
 
-    return 0 == CRYPTO_memcmp(digest, computed_digest, SHA256_DIGEST_LENGTH);
+    return ConstantTimeEquals(digest, computed_digest, SHA256_DIGEST_LENGTH);
 }
 
 }  // namespace keymaster
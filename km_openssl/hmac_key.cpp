@@ -21,6 +21,8 @@
 #include <openssl/err.h>
 #include <openssl/rand.h>
 
+#include <keymaster/km_openssl/openssl_utils.h>
+
 #include "hmac_operation.h"
 
 namespace keymaster {
@@ -53,13 +55,60 @@ keymaster_error_t HmacKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
         return KM_ERROR_INVALID_KEY_BLOB;
     }
 
-    key->reset(new (std::nothrow)
-                   HmacKey(std::move(key_material), std::move(hw_enforced), std::move(sw_enforced),
-                           this));
-    if (!key->get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    // Keys with an unusable digest still load; creating an operation rejects them.
+    keymaster_digest_t digest;
+    const EVP_MD* md = nullptr;
+    if ((hw_enforced.GetTagValue(TAG_DIGEST, &digest) ||
+         sw_enforced.GetTagValue(TAG_DIGEST, &digest)) &&
+        digest != KM_DIGEST_MD5) {
+        md = KmDigestToEvpDigest(digest);
+    }
+
+    UniquePtr<HmacKey> hmac_key(new (std::nothrow) HmacKey(
+        std::move(key_material), std::move(hw_enforced), std::move(sw_enforced), this));
+    if (!hmac_key) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (md) hmac_key->set_keyed_context(GetKeyedContext(hmac_key->key_material(), md));
+    *key = std::move(hmac_key);
     return KM_ERROR_OK;
 }
 
+std::shared_ptr<const KeyedHmacContext>
+HmacKeyFactory::GetKeyedContext(const KeymasterKeyBlob& key_material, const EVP_MD* md) const {
+    std::lock_guard<std::mutex> lock(hmac_key_cache_mutex_);
+    CachedHmacKey* victim = &hmac_key_cache_[0];
+    for (auto& entry : hmac_key_cache_) {
+        if (entry.context && entry.context->md() == md &&
+            entry.key_material.size() == key_material.size() &&
+            memcmp_s(entry.key_material.begin(), key_material.begin(), key_material.size()) == 0) {
+            entry.last_used = ++hmac_key_cache_clock_;
+            return entry.context;
+        }
+        if (!victim->context) continue;
+        if (!entry.context || entry.last_used < victim->last_used) victim = &entry;
+    }
+
+    std::shared_ptr<KeyedHmacContext> context(new (std::nothrow) KeyedHmacContext);
+    if (!context || !context->Init(key_material, md)) return nullptr;
+
+    if (!victim->key_material.Reset(key_material.size())) {
+        victim->context.reset();
+        return context;
+    }
+    memcpy(victim->key_material.writable_data(), key_material.begin(), key_material.size());
+    victim->context = context;
+    victim->last_used = ++hmac_key_cache_clock_;
+    return context;
+}
+
+bool KeyedHmacContext::Init(const KeymasterKeyBlob& key_material, const EVP_MD* md) {
+    if (!HMAC_Init_ex(&ctx_, key_material.key_material, key_material.key_material_size, md,
+                      nullptr /* engine */)) {
+        return false;
+    }
+    md_ = md;
+    return true;
+}
+
 keymaster_error_t HmacKeyFactory::validate_algorithm_specific_new_key_params(
     const AuthorizationSet& key_description) const {
     uint32_t min_mac_length_bits;
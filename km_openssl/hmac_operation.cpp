@@ -21,6 +21,7 @@
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 
+#include <keymaster/constant_time.h>
 #include <keymaster/km_openssl/hmac_key.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
@@ -70,8 +71,12 @@ OperationPtr HmacOperationFactory::CreateOperation(Key&& key, const Authorizatio
         return nullptr;
     }
 
+    // Only HmacKeyFactory makes keys for this factory.
+    std::shared_ptr<const KeyedHmacContext> keyed_context =
+        static_cast<const HmacKey&>(key).keyed_context();
     UniquePtr<HmacOperation> op(new (std::nothrow) HmacOperation(
-        std::move(key), purpose(), digest, mac_length_bits / 8, min_mac_length_bits / 8));
+        std::move(key), purpose(), digest, mac_length_bits / 8, min_mac_length_bits / 8,
+        keyed_context.get()));
     if (!op.get())
         *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
     else
@@ -91,7 +96,8 @@ const keymaster_digest_t* HmacOperationFactory::SupportedDigests(size_t* digest_
 }
 
 HmacOperation::HmacOperation(Key&& key, keymaster_purpose_t purpose, keymaster_digest_t digest,
-                             size_t mac_length, size_t min_mac_length)
+                             size_t mac_length, size_t min_mac_length,
+                             const KeyedHmacContext* keyed_context)
     : Operation(purpose, key.hw_enforced_move(), key.sw_enforced_move()), error_(KM_ERROR_OK),
       mac_length_(mac_length), min_mac_length_(min_mac_length) {
     // Initialize CTX first, so dtor won't crash even if we error out later.
@@ -136,20 +142,32 @@ HmacOperation::HmacOperation(Key&& key, keymaster_purpose_t purpose, keymaster_d
         }
     }
 
+    // Copying the pre-keyed context skips hashing the key into the pads.
+    if (keyed_context && keyed_context->md() == md) {
+        if (!keyed_context->CopyTo(&ctx_)) error_ = TranslateLastOpenSslError();
+        return;
+    }
+
     KeymasterKeyBlob blob = key.key_material_move();
     HMAC_Init_ex(&ctx_, blob.key_material, blob.key_material_size, md, nullptr /* engine */);
 }
 
+HmacOperation::HmacOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                             const HmacOperation& parent)
+    : Operation(parent.purpose(), std::move(hw_enforced), std::move(sw_enforced)),
+      error_(parent.error_), mac_length_(parent.mac_length_),
+      min_mac_length_(parent.min_mac_length_) {
+    HMAC_CTX_init(&ctx_);
+    if (error_ == KM_ERROR_OK && !HMAC_CTX_copy_ex(&ctx_, &parent.ctx_))
+        error_ = TranslateLastOpenSslError();
+}
+
 HmacOperation::~HmacOperation() {
     HMAC_CTX_cleanup(&ctx_);
 }
 
 keymaster_error_t HmacOperation::Begin(const AuthorizationSet& /* input_params */,
                                        AuthorizationSet* /* output_params */) {
-    auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
-                             (size_t)sizeof(operation_handle_));
-    if (rc != KM_ERROR_OK) return rc;
-
     return error_;
 }
 
@@ -166,6 +184,23 @@ keymaster_error_t HmacOperation::Abort() {
     return KM_ERROR_OK;
 }
 
+OperationPtr HmacOperation::Fork(keymaster_error_t* error) const {
+    AuthorizationSet hw_enforced, sw_enforced;
+    if (!CopyAuthorizations(&hw_enforced, &sw_enforced)) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+    UniquePtr<HmacOperation> fork(new (std::nothrow) HmacOperation(
+        std::move(hw_enforced), std::move(sw_enforced), *this));
+    if (!fork) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+    *error = fork->error();
+    if (*error != KM_ERROR_OK) return nullptr;
+    return std::move(fork);
+}
+
 keymaster_error_t HmacOperation::Finish(const AuthorizationSet& additional_params,
                                         const Buffer& input, const Buffer& signature,
                                         AuthorizationSet* /* output_params */, Buffer* output) {
@@ -187,7 +222,7 @@ keymaster_error_t HmacOperation::Finish(const AuthorizationSet& additional_param
         if (siglen > digest_len || siglen < kMinHmacLengthBits / 8)
             return KM_ERROR_UNSUPPORTED_MAC_LENGTH;
         if (siglen < min_mac_length_) return KM_ERROR_INVALID_MAC_LENGTH;
-        if (CRYPTO_memcmp(signature.peek_read(), digest, siglen) != 0)
+        if (!ConstantTimeEquals(signature.peek_read(), digest, siglen))
             return KM_ERROR_VERIFICATION_FAILED;
         return KM_ERROR_OK;
     }
@@ -17,6 +17,7 @@
 #ifndef SYSTEM_KEYMASTER_HMAC_OPERATION_H_
 #define SYSTEM_KEYMASTER_HMAC_OPERATION_H_
 
+#include <keymaster/km_openssl/hmac_key.h>
 #include <keymaster/operation.h>
 #include <openssl/hmac.h>
 
@@ -24,8 +25,13 @@ namespace keymaster {
 
 class HmacOperation : public Operation {
   public:
+    /**
+     * If \p keyed_context is non-null and uses \p digest, the operation starts from a copy of it
+     * instead of keying a new HMAC context with the key material.
+     */
     HmacOperation(Key&& key, keymaster_purpose_t purpose, keymaster_digest_t digest,
-                  size_t mac_length, size_t min_mac_length);
+                  size_t mac_length, size_t min_mac_length,
+                  const KeyedHmacContext* keyed_context = nullptr);
     ~HmacOperation();
 
     virtual keymaster_error_t Begin(const AuthorizationSet& input_params,
@@ -37,10 +43,15 @@ class HmacOperation : public Operation {
     virtual keymaster_error_t Finish(const AuthorizationSet& additional_params, const Buffer& input,
                                      const Buffer& signature, AuthorizationSet* output_params,
                                      Buffer* output);
+    virtual OperationPtr Fork(keymaster_error_t* error) const;
 
     keymaster_error_t error() { return error_; }
 
   private:
+    // Constructs a fork of \p parent, with the given copies of its authorizations.
+    HmacOperation(AuthorizationSet&& hw_enforced, AuthorizationSet&& sw_enforced,
+                  const HmacOperation& parent);
+
     HMAC_CTX ctx_;
     keymaster_error_t error_;
     const size_t mac_length_;
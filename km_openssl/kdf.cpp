@@ -23,6 +23,7 @@ Kdf::Kdf() : is_initialized_(false) {}
 bool Kdf::Init(keymaster_digest_t digest_type, const uint8_t* secret, size_t secret_len,
                const uint8_t* salt, size_t salt_len) {
     is_initialized_ = false;
+    ResetSecretState();
 
     switch (digest_type) {
     case KM_DIGEST_SHA1:
@@ -55,6 +56,16 @@ bool Kdf::Init(keymaster_digest_t digest_type, const uint8_t* secret, size_t sec
     return true;
 }
 
+bool Kdf::GenerateKeys(const Output* outputs, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!GenerateKey(outputs[i].info, outputs[i].info_len, outputs[i].output,
+                         outputs[i].output_len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool Kdf::Uint32ToBigEndianByteArray(uint32_t number, uint8_t* output) {
     if (!output) return false;
 
@@ -19,6 +19,9 @@
 #include <openssl/err.h>
 #include <openssl/evp.h>
 
+#include <atomic>
+#include <chrono>
+
 #if defined(OPENSSL_IS_BORINGSSL)
 #include <openssl/asn1.h>
 #include <openssl/cipher.h>
@@ -40,14 +43,52 @@ static keymaster_error_t TranslateX509v3Error(int reason);
 static keymaster_error_t TranslateRsaError(int reason);
 #endif
 
-keymaster_error_t TranslateLastOpenSslError(bool log_message) {
-    uint32_t error = ERR_peek_last_error();
+// Verifying forged signatures or decrypting bad padding fails every operation, so at most this
+// many OpenSSL errors are logged per window.
+static constexpr uint32_t kMaxLoggedErrorsPerWindow = 10;
+static constexpr int64_t kLogWindowMs = 1000;
+
+static std::atomic<int64_t> log_window_start_ms{0};
+static std::atomic<uint32_t> logged_in_window{0};
+static std::atomic<uint32_t> unlogged_errors{0};
+
+// Decides whether an error may be logged.  If it may, the number of errors that weren't since the
+// last one was is stored in |*unlogged|.
+static bool AdmitErrorLog(uint32_t* unlogged) {
+    int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                         std::chrono::steady_clock::now().time_since_epoch())
+                         .count();
+    int64_t start_ms = log_window_start_ms.load(std::memory_order_relaxed);
+    if (now_ms - start_ms >= kLogWindowMs &&
+        log_window_start_ms.compare_exchange_strong(start_ms, now_ms, std::memory_order_relaxed)) {
+        logged_in_window.store(0, std::memory_order_relaxed);
+    }
+    if (logged_in_window.fetch_add(1, std::memory_order_relaxed) >= kMaxLoggedErrorsPerWindow) {
+        unlogged_errors.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    *unlogged = unlogged_errors.exchange(0, std::memory_order_relaxed);
+    return true;
+}
 
-    if (log_message) {
-        char buf[128];
-        ERR_error_string_n(error, buf, sizeof(buf));
+static void LogOpenSslError(uint32_t error) {
+    uint32_t unlogged;
+    if (!Logger::IsLoggable(Logger::DEBUG_LVL) || !AdmitErrorLog(&unlogged)) return;
+
+    char buf[128];
+    ERR_error_string_n(error, buf, sizeof(buf));
+    if (unlogged) {
+        LOG_D("%s (%u earlier OpenSSL errors not logged)", buf, unlogged);
+    } else {
         LOG_D("%s", buf);
     }
+}
+
+keymaster_error_t TranslateLastOpenSslError(bool log_message) {
+    uint32_t error = ERR_peek_last_error();
+    ERR_clear_error();
+
+    if (log_message) LogOpenSslError(error);
 
     int reason = ERR_GET_REASON(error);
 
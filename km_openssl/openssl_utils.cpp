@@ -17,6 +17,9 @@
 #include <keymaster/km_openssl/openssl_utils.h>
 
 #include <keymaster/android_keymaster_utils.h>
+#include <openssl/bytestring.h>
+#include <openssl/ec_key.h>
+#include <openssl/err.h>
 #include <openssl/mem.h>
 #include <openssl/rand.h>
 
@@ -66,6 +69,48 @@ EC_GROUP* ec_get_group(keymaster_ec_curve_t curve) {
     }
 }
 
+namespace {
+
+EC_GROUP* NewSharedGroup(int nid) {
+    EC_GROUP* group = EC_GROUP_new_by_curve_name(nid);
+#if !defined(OPENSSL_IS_BORINGSSL)
+    // BoringSSL's built-in groups are static and come with their generator tables.  OpenSSL builds
+    // them on request, so do it once here rather than in every signing operation.
+    if (group != nullptr) {
+        EC_GROUP_set_point_conversion_form(group, POINT_CONVERSION_UNCOMPRESSED);
+        EC_GROUP_set_asn1_flag(group, OPENSSL_EC_NAMED_CURVE);
+        EC_GROUP_precompute_mult(group, nullptr /* ctx */);
+    }
+#endif
+    return group;
+}
+
+}  // namespace
+
+const EC_GROUP* ec_get_shared_group(keymaster_ec_curve_t curve) {
+    // Each group is created the first time it's needed and intentionally never freed.
+    switch (curve) {
+    case KM_EC_CURVE_P_224: {
+        static const EC_GROUP* const group = NewSharedGroup(NID_secp224r1);
+        return group;
+    }
+    case KM_EC_CURVE_P_256: {
+        static const EC_GROUP* const group = NewSharedGroup(NID_X9_62_prime256v1);
+        return group;
+    }
+    case KM_EC_CURVE_P_384: {
+        static const EC_GROUP* const group = NewSharedGroup(NID_secp384r1);
+        return group;
+    }
+    case KM_EC_CURVE_P_521: {
+        static const EC_GROUP* const group = NewSharedGroup(NID_secp521r1);
+        return group;
+    }
+    default:
+        return nullptr;
+    }
+}
+
 keymaster_error_t convert_pkcs8_blob_to_evp(const uint8_t* key_data, size_t key_length,
                                             keymaster_algorithm_t expected_algorithm,
                                             UniquePtr<EVP_PKEY, EVP_PKEY_Delete>* pkey) {
@@ -152,6 +197,127 @@ keymaster_error_t EvpKeyToKeyMaterial(const EVP_PKEY* pkey, KeymasterKeyBlob* ke
     return KM_ERROR_OK;
 }
 
+namespace {
+
+typedef UniquePtr<BIGNUM, OpenSslObjectDeleter<BIGNUM, void, BN_clear_free>> SecretBIGNUM_Ptr;
+
+// Parses the next INTEGER of |cbs| as a non-negative BIGNUM.
+BIGNUM* ParseUnsigned(CBS* cbs) {
+    BIGNUM_Ptr bn(BN_new());
+    if (!bn || !BN_parse_asn1_unsigned(cbs, bn.get())) return nullptr;
+    return bn.release();
+}
+
+// Parses a two-prime RSAPrivateKey (RFC 8017, A.1.2) as it is, without RSA_check_key().  Returns
+// null for anything else.
+RSA_Ptr ParseRsaPrivateKey(CBS* cbs) {
+    CBS seq;
+    uint64_t version;
+    if (!CBS_get_asn1(cbs, &seq, CBS_ASN1_SEQUENCE) || !CBS_get_asn1_uint64(&seq, &version) ||
+        version != 0) {
+        return RSA_Ptr();
+    }
+    BIGNUM_Ptr n(ParseUnsigned(&seq));
+    BIGNUM_Ptr e(ParseUnsigned(&seq));
+    SecretBIGNUM_Ptr d(ParseUnsigned(&seq));
+    SecretBIGNUM_Ptr p(ParseUnsigned(&seq));
+    SecretBIGNUM_Ptr q(ParseUnsigned(&seq));
+    SecretBIGNUM_Ptr dmp1(ParseUnsigned(&seq));
+    SecretBIGNUM_Ptr dmq1(ParseUnsigned(&seq));
+    SecretBIGNUM_Ptr iqmp(ParseUnsigned(&seq));
+    if (!n || !e || !d || !p || !q || !dmp1 || !dmq1 || !iqmp || CBS_len(&seq) != 0) {
+        return RSA_Ptr();
+    }
+
+    RSA_Ptr rsa(RSA_new());
+    if (!rsa || !RSA_set0_key(rsa.get(), n.get(), e.get(), d.get())) return RSA_Ptr();
+    release_because_ownership_transferred(n);
+    release_because_ownership_transferred(e);
+    release_because_ownership_transferred(d);
+    if (!RSA_set0_factors(rsa.get(), p.get(), q.get())) return RSA_Ptr();
+    release_because_ownership_transferred(p);
+    release_because_ownership_transferred(q);
+    if (!RSA_set0_crt_params(rsa.get(), dmp1.get(), dmq1.get(), iqmp.get())) return RSA_Ptr();
+    release_because_ownership_transferred(dmp1);
+    release_because_ownership_transferred(dmq1);
+    release_because_ownership_transferred(iqmp);
+    return rsa;
+}
+
+// Parses an ECPrivateKey (RFC 5915) that carries its curve and uncompressed public key, taking the
+// public key as it is rather than recomputing it from the private key.  Returns null for anything
+// else.
+EC_KEY_Ptr ParseEcPrivateKey(CBS* cbs) {
+    constexpr unsigned kParametersTag = CBS_ASN1_CONSTRUCTED | CBS_ASN1_CONTEXT_SPECIFIC | 0;
+    constexpr unsigned kPublicKeyTag = CBS_ASN1_CONSTRUCTED | CBS_ASN1_CONTEXT_SPECIFIC | 1;
+    CBS seq, private_key, parameters, public_key_wrapper, public_key;
+    uint64_t version;
+    uint8_t unused_bits;
+    if (!CBS_get_asn1(cbs, &seq, CBS_ASN1_SEQUENCE) || !CBS_get_asn1_uint64(&seq, &version) ||
+        version != 1 || !CBS_get_asn1(&seq, &private_key, CBS_ASN1_OCTETSTRING) ||
+        !CBS_get_asn1(&seq, &parameters, kParametersTag) ||
+        !CBS_get_asn1(&seq, &public_key_wrapper, kPublicKeyTag) || CBS_len(&seq) != 0 ||
+        !CBS_get_asn1(&public_key_wrapper, &public_key, CBS_ASN1_BITSTRING) ||
+        CBS_len(&public_key_wrapper) != 0 || !CBS_get_u8(&public_key, &unused_bits) ||
+        unused_bits != 0 || CBS_len(&public_key) == 0 ||
+        CBS_data(&public_key)[0] != POINT_CONVERSION_UNCOMPRESSED) {
+        return EC_KEY_Ptr();
+    }
+
+    EC_GROUP_Ptr group(EC_KEY_parse_parameters(&parameters));
+    if (!group || CBS_len(&parameters) != 0) return EC_KEY_Ptr();
+
+    EC_KEY_Ptr ec_key(EC_KEY_new());
+    SecretBIGNUM_Ptr private_scalar(
+        BN_bin2bn(CBS_data(&private_key), CBS_len(&private_key), nullptr /* ret */));
+    EC_POINT_Ptr public_point(EC_POINT_new(group.get()));
+    if (!ec_key || !private_scalar || !public_point ||
+        !EC_KEY_set_group(ec_key.get(), group.get()) ||
+        !EC_POINT_oct2point(group.get(), public_point.get(), CBS_data(&public_key),
+                            CBS_len(&public_key), nullptr /* ctx */) ||
+        !EC_KEY_set_private_key(ec_key.get(), private_scalar.get()) ||
+        !EC_KEY_set_public_key(ec_key.get(), public_point.get())) {
+        return EC_KEY_Ptr();
+    }
+    return ec_key;
+}
+
+}  // namespace
+
+keymaster_error_t ParseValidatedPrivateKey(int evp_key_type, const KeymasterKeyBlob& key_material,
+                                           EVP_PKEY_Ptr* pkey) {
+    CBS cbs;
+    CBS_init(&cbs, key_material.key_material, key_material.key_material_size);
+    int assigned = 0;
+    switch (evp_key_type) {
+    case EVP_PKEY_RSA: {
+        RSA_Ptr rsa = ParseRsaPrivateKey(&cbs);
+        if (rsa && CBS_len(&cbs) == 0) {
+            pkey->reset(EVP_PKEY_new());
+            assigned = *pkey && EVP_PKEY_set1_RSA(pkey->get(), rsa.get());
+        }
+        break;
+    }
+    case EVP_PKEY_EC: {
+        EC_KEY_Ptr ec_key = ParseEcPrivateKey(&cbs);
+        if (ec_key && CBS_len(&cbs) == 0) {
+            pkey->reset(EVP_PKEY_new());
+            assigned = *pkey && EVP_PKEY_set1_EC_KEY(pkey->get(), ec_key.get());
+        }
+        break;
+    }
+    }
+    if (assigned) return KM_ERROR_OK;
+
+    // Anything the parsers above don't take is parsed, and checked, in full.
+    ERR_clear_error();
+    const uint8_t* p = key_material.key_material;
+    pkey->reset(d2i_PrivateKey(evp_key_type, nullptr /* pkey */, &p,
+                               key_material.key_material_size));
+    if (!*pkey) return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
 // Remote provisioning helper function
 keymaster_error_t GetEcdsa256KeyFromCert(const keymaster_blob_t* km_cert, uint8_t* x_coord,
                                          size_t x_length, uint8_t* y_coord, size_t y_length) {
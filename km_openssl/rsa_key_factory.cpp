@@ -16,25 +16,191 @@
 
 #include <keymaster/km_openssl/rsa_key_factory.h>
 
+#include <atomic>
+#include <mutex>
 #include <utility>
 
+#include <openssl/err.h>
+
 #include <keymaster/keymaster_context.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/km_openssl/rsa_key.h>
 #include <keymaster/km_openssl/rsa_operation.h>
+#include <keymaster/worker_pool.h>
 
 namespace keymaster {
 
 const int kMaximumRsaKeySize = 4096;  // OpenSSL fails above 4096.
 const int kMinimumRsaKeySize = 16;    // OpenSSL goes into an infinite loop if key size < 10
 const int kMinimumRsaExponent = 3;
+// Below this size a single-threaded search is quick enough not to be worth occupying the pool.
+const uint32_t kParallelRsaKeySize = 3072;
 
 static RsaSigningOperationFactory sign_factory;
 static RsaVerificationOperationFactory verify_factory;
 static RsaEncryptionOperationFactory encrypt_factory;
 static RsaDecryptionOperationFactory decrypt_factory;
 
+/* static */
+keymaster_error_t RsaKeyFactory::GenerateRsaKey(uint32_t key_size, uint64_t public_exponent,
+                                                RSA_Ptr* rsa_key) {
+    BIGNUM_Ptr exponent(BN_new());
+    rsa_key->reset(RSA_new());
+    if (exponent.get() == nullptr || rsa_key->get() == nullptr) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    if (!BN_set_word(exponent.get(), public_exponent) ||
+        !RSA_generate_key_ex(rsa_key->get(), key_size, exponent.get(), nullptr /* callback */))
+        return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+namespace {
+
+int ContinueUnlessCancelled(int /* event */, int /* n */, BN_GENCB* callback) {
+    auto cancelled = static_cast<const std::atomic<bool>*>(BN_GENCB_get_arg(callback));
+    return !cancelled->load(std::memory_order_relaxed);
+}
+
+// Finds a |bits|-bit prime p with p - 1 coprime to |exponent|, giving up once |*cancelled| is set.
+keymaster_error_t GenerateRsaPrime(int bits, const BIGNUM* exponent, std::atomic<bool>* cancelled,
+                                   BIGNUM* prime) {
+    BN_GENCB_Ptr callback(BN_GENCB_new());
+    BN_CTX_Ptr ctx(BN_CTX_new());
+    BIGNUM_Ptr prime_minus_1(BN_new());
+    BIGNUM_Ptr gcd(BN_new());
+    if (!callback || !ctx || !prime_minus_1 || !gcd) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    BN_GENCB_set(callback.get(), ContinueUnlessCancelled, cancelled);
+
+    while (!cancelled->load(std::memory_order_relaxed)) {
+        if (!BN_generate_prime_ex(prime, bits, 0 /* safe */, nullptr /* add */, nullptr /* rem */,
+                                  callback.get())) {
+            break;
+        }
+        if (!BN_sub(prime_minus_1.get(), prime, BN_value_one()) ||
+            !BN_gcd(gcd.get(), prime_minus_1.get(), exponent, ctx.get())) {
+            break;
+        }
+        if (BN_is_one(gcd.get())) return KM_ERROR_OK;
+    }
+
+    if (cancelled->load()) {
+        // The search that failed first reports the error; this one's is only a consequence.
+        ERR_clear_error();
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+    return TranslateLastOpenSslError();
+}
+
+// Returns true if |p| and |q| are at least 2^(bits - 100) apart, as FIPS 186-4 requires, or merely
+// distinct for primes too small for that bound.
+bool PrimesFarEnoughApart(const BIGNUM* p, const BIGNUM* q, int bits, BIGNUM* scratch) {
+    if (!BN_sub(scratch, p, q)) return false;
+    return BN_num_bits(scratch) > (bits > 100 ? bits - 100 : 0);
+}
+
+// Completes an RSA key from its primes, with the private exponent reduced modulo lcm(p - 1, q - 1)
+// as RSA_generate_key_ex does.
+keymaster_error_t AssembleRsaKey(BIGNUM_Ptr p, BIGNUM_Ptr q, BIGNUM_Ptr e, RSA_Ptr* rsa_key) {
+    if (BN_cmp(p.get(), q.get()) < 0) std::swap(p, q);
+
+    BN_CTX_Ptr ctx(BN_CTX_new());
+    BIGNUM_Ptr n(BN_new());
+    BIGNUM_Ptr d(BN_new());
+    BIGNUM_Ptr dmp1(BN_new());
+    BIGNUM_Ptr dmq1(BN_new());
+    BIGNUM_Ptr iqmp(BN_new());
+    BIGNUM_Ptr p_minus_1(BN_new());
+    BIGNUM_Ptr q_minus_1(BN_new());
+    BIGNUM_Ptr p_minus_2(BN_new());
+    BIGNUM_Ptr lcm(BN_new());
+    BIGNUM_Ptr gcd(BN_new());
+    rsa_key->reset(RSA_new());
+    if (!ctx || !n || !d || !dmp1 || !dmq1 || !iqmp || !p_minus_1 || !q_minus_1 || !p_minus_2 ||
+        !lcm || !gcd || !rsa_key->get()) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    BN_set_flags(p_minus_1.get(), BN_FLG_CONSTTIME);
+    BN_set_flags(q_minus_1.get(), BN_FLG_CONSTTIME);
+    BN_set_flags(lcm.get(), BN_FLG_CONSTTIME);
+
+    // iqmp is q^(p - 2) mod p, which is q^-1 mod p since p is prime.
+    if (!BN_mul(n.get(), p.get(), q.get(), ctx.get()) ||
+        !BN_sub(p_minus_1.get(), p.get(), BN_value_one()) ||
+        !BN_sub(q_minus_1.get(), q.get(), BN_value_one()) ||
+        !BN_gcd(gcd.get(), p_minus_1.get(), q_minus_1.get(), ctx.get()) ||
+        !BN_mul(lcm.get(), p_minus_1.get(), q_minus_1.get(), ctx.get()) ||
+        !BN_div(lcm.get(), nullptr, lcm.get(), gcd.get(), ctx.get()) ||
+        !BN_mod_inverse(d.get(), e.get(), lcm.get(), ctx.get()) ||
+        !BN_mod(dmp1.get(), d.get(), p_minus_1.get(), ctx.get()) ||
+        !BN_mod(dmq1.get(), d.get(), q_minus_1.get(), ctx.get()) ||
+        !BN_sub(p_minus_2.get(), p_minus_1.get(), BN_value_one()) ||
+        !BN_mod_exp_mont_consttime(iqmp.get(), q.get(), p_minus_2.get(), p.get(), ctx.get(),
+                                   nullptr /* mont */)) {
+        return TranslateLastOpenSslError();
+    }
+
+    RSA* rsa = rsa_key->get();
+    if (!RSA_set0_key(rsa, n.get(), e.get(), d.get())) return TranslateLastOpenSslError();
+    n.release();
+    e.release();
+    d.release();
+    if (!RSA_set0_factors(rsa, p.get(), q.get())) return TranslateLastOpenSslError();
+    p.release();
+    q.release();
+    if (!RSA_set0_crt_params(rsa, dmp1.get(), dmq1.get(), iqmp.get())) {
+        return TranslateLastOpenSslError();
+    }
+    dmp1.release();
+    dmq1.release();
+    iqmp.release();
+
+    if (RSA_check_key(rsa) != 1) return TranslateLastOpenSslError();
+    return KM_ERROR_OK;
+}
+
+}  // namespace
+
+/* static */
+keymaster_error_t RsaKeyFactory::GenerateRsaKeyInParallel(uint32_t key_size,
+                                                          uint64_t public_exponent,
+                                                          WorkerPool* pool, RSA_Ptr* rsa_key) {
+    // Both primes have their top two bits set, so the modulus has exactly key_size bits.
+    const int prime_bits = key_size / 2;
+    BIGNUM_Ptr exponent(BN_new());
+    BIGNUM_Ptr primes[2] = {BIGNUM_Ptr(BN_new()), BIGNUM_Ptr(BN_new())};
+    BIGNUM_Ptr scratch(BN_new());
+    if (!exponent || !primes[0] || !primes[1] || !scratch) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+    if (!BN_set_word(exponent.get(), public_exponent)) return TranslateLastOpenSslError();
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool> cancelled(false);
+    keymaster_error_t error = KM_ERROR_OK;  // Written only by the search that sets |cancelled|.
+    auto worker = [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < 2;) {
+            keymaster_error_t search_error =
+                GenerateRsaPrime(prime_bits, exponent.get(), &cancelled, primes[i].get());
+            if (search_error != KM_ERROR_OK && !cancelled.exchange(true)) error = search_error;
+        }
+    };
+    RunInParallel(pool, 2, worker);
+    if (error != KM_ERROR_OK) return error;
+
+    // Two independent random primes this large essentially never land close together, so the
+    // rare retry runs on this thread.
+    while (!PrimesFarEnoughApart(primes[0].get(), primes[1].get(), prime_bits, scratch.get())) {
+        error = GenerateRsaPrime(prime_bits, exponent.get(), &cancelled, primes[1].get());
+        if (error != KM_ERROR_OK) return error;
+    }
+
+    return AssembleRsaKey(std::move(primes[0]), std::move(primes[1]), std::move(exponent),
+                          rsa_key);
+}
+
 OperationFactory* RsaKeyFactory::GetOperationFactory(keymaster_purpose_t purpose) const {
     switch (purpose) {
     case KM_PURPOSE_SIGN:
@@ -79,16 +245,19 @@ keymaster_error_t RsaKeyFactory::GenerateKey(const AuthorizationSet& key_descrip
         return KM_ERROR_UNSUPPORTED_KEY_SIZE;
     }
 
-    BIGNUM_Ptr exponent(BN_new());
-    RSA_Ptr rsa_key(RSA_new());
-    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
-    if (exponent.get() == nullptr || rsa_key.get() == nullptr || pkey.get() == nullptr) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    RSA_Ptr rsa_key;
+    if (key_pool_) rsa_key = key_pool_->TakeKey(key_size, public_exponent);
+    if (!rsa_key) {
+        keymaster_error_t error =
+            key_size >= kParallelRsaKeySize
+                ? GenerateRsaKeyInParallel(key_size, public_exponent, context_.worker_pool(),
+                                           &rsa_key)
+                : GenerateRsaKey(key_size, public_exponent, &rsa_key);
+        if (error != KM_ERROR_OK) return error;
     }
 
-    if (!BN_set_word(exponent.get(), public_exponent) ||
-        !RSA_generate_key_ex(rsa_key.get(), key_size, exponent.get(), nullptr /* callback */))
-        return TranslateLastOpenSslError();
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    if (pkey.get() == nullptr) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
     if (EVP_PKEY_set1_RSA(pkey.get(), rsa_key.get()) != 1) return TranslateLastOpenSslError();
 
@@ -219,4 +388,83 @@ keymaster_error_t RsaKeyFactory::CreateEmptyKey(AuthorizationSet&& hw_enforced,
     return KM_ERROR_OK;
 }
 
+keymaster_error_t RsaKeyFactory::LoadKey(KeymasterKeyBlob&& key_material,
+                                         const AuthorizationSet& additional_params,
+                                         AuthorizationSet&& hw_enforced,
+                                         AuthorizationSet&& sw_enforced,
+                                         UniquePtr<Key>* key) const {
+    return LoadRsaKey(std::move(key_material), additional_params, std::move(hw_enforced),
+                      std::move(sw_enforced), false /* authenticated */, key);
+}
+
+keymaster_error_t RsaKeyFactory::LoadAuthenticatedKey(KeymasterKeyBlob&& key_material,
+                                                      const AuthorizationSet& additional_params,
+                                                      AuthorizationSet&& hw_enforced,
+                                                      AuthorizationSet&& sw_enforced,
+                                                      UniquePtr<Key>* key) const {
+    return LoadRsaKey(std::move(key_material), additional_params, std::move(hw_enforced),
+                      std::move(sw_enforced), true /* authenticated */, key);
+}
+
+keymaster_error_t RsaKeyFactory::LoadRsaKey(KeymasterKeyBlob&& key_material,
+                                            const AuthorizationSet& /* additional_params */,
+                                            AuthorizationSet&& hw_enforced,
+                                            AuthorizationSet&& sw_enforced, bool authenticated,
+                                            UniquePtr<Key>* key) const {
+    RSA_Ptr rsa = FindCachedRsaKey(key_material);
+    if (!rsa) {
+        keymaster_error_t error =
+            LoadKeyMaterial(std::move(key_material), std::move(hw_enforced),
+                            std::move(sw_enforced), authenticated, key);
+        if (error == KM_ERROR_OK) {
+            CacheRsaKey((*key)->key_material(), static_cast<const RsaKey&>(**key).key());
+        }
+        return error;
+    }
+
+    UniquePtr<RsaKey> rsa_key(new (std::nothrow) RsaKey(std::move(hw_enforced),
+                                                        std::move(sw_enforced), this,
+                                                        std::move(rsa)));
+    if (!rsa_key) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    rsa_key->key_material() = std::move(key_material);
+    *key = std::move(rsa_key);
+    return KM_ERROR_OK;
+}
+
+RSA_Ptr RsaKeyFactory::FindCachedRsaKey(const KeymasterKeyBlob& key_material) const {
+    std::lock_guard<std::mutex> lock(rsa_key_cache_mutex_);
+    for (auto& entry : rsa_key_cache_) {
+        if (entry.rsa && entry.key_material.size() == key_material.size() &&
+            memcmp_s(entry.key_material.begin(), key_material.begin(), key_material.size()) == 0) {
+            entry.last_used = ++rsa_key_cache_clock_;
+            RSA_up_ref(entry.rsa.get());
+            return RSA_Ptr(entry.rsa.get());
+        }
+    }
+    return nullptr;
+}
+
+void RsaKeyFactory::CacheRsaKey(const KeymasterKeyBlob& key_material, RSA* rsa) const {
+    if (!rsa) return;
+
+    std::lock_guard<std::mutex> lock(rsa_key_cache_mutex_);
+    CachedRsaKey* victim = &rsa_key_cache_[0];
+    for (auto& entry : rsa_key_cache_) {
+        if (!entry.rsa) {
+            victim = &entry;
+            break;
+        }
+        if (entry.last_used < victim->last_used) victim = &entry;
+    }
+
+    if (!victim->key_material.Reset(key_material.size())) {
+        victim->rsa.reset();
+        return;
+    }
+    memcpy(victim->key_material.writable_data(), key_material.begin(), key_material.size());
+    RSA_up_ref(rsa);
+    victim->rsa.reset(rsa);
+    victim->last_used = ++rsa_key_cache_clock_;
+}
+
 }  // namespace keymaster
@@ -16,16 +16,20 @@
 
 #include <keymaster/km_openssl/rsa_operation.h>
 
+#include <condition_variable>
+#include <mutex>
 #include <utility>
 
 #include <limits.h>
 
 #include <openssl/err.h>
 
+#include <keymaster/km_openssl/batch_verify.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
 #include <keymaster/km_openssl/rsa_key.h>
 #include <keymaster/logger.h>
+#include <keymaster/worker_pool.h>
 
 namespace keymaster {
 
@@ -170,10 +174,8 @@ RsaOperation::~RsaOperation() {
 
 keymaster_error_t RsaOperation::Begin(const AuthorizationSet& /* input_params */,
                                       AuthorizationSet* /* output_params */) {
-    auto rc = GenerateRandom(reinterpret_cast<uint8_t*>(&operation_handle_),
-                             (size_t)sizeof(operation_handle_));
-    if (rc != KM_ERROR_OK) return rc;
-
+    // Undigested input can't be longer than the key, so that's all data_ will ever need.
+    data_.set_size_hint(EVP_PKEY_size(rsa_key_));
     return InitDigest();
 }
 
@@ -192,16 +194,26 @@ keymaster_error_t RsaOperation::Update(const AuthorizationSet& /* additional_par
     }
 }
 
+size_t RsaOperation::RecommendedChunkSize() const {
+    return EVP_PKEY_size(rsa_key_);
+}
+
 keymaster_error_t RsaOperation::StoreData(const Buffer& input, size_t* input_consumed) {
     assert(input_consumed);
 
-    if (!data_.reserve(EVP_PKEY_size(rsa_key_))) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    // If the write fails, it's because input length exceeds key size.
-    if (!data_.write(input.peek_read(), input.available_read())) {
-        LOG_E("Input too long: cannot operate on %u bytes of data with %u-byte RSA key",
-              input.available_read() + data_.available_read(), EVP_PKEY_size(rsa_key_));
+    // Every mode rejects undigested input longer than the key in Finish(), so there's no point
+    // buffering more.  Checking the total here also means data_ never grows past the size hint set
+    // in Begin(), so it is allocated once.
+    size_t key_len = EVP_PKEY_size(rsa_key_);
+    if (input.available_read() > key_len - data_.available_read()) {
+        LOG_E("Input too long: cannot operate on %zu bytes of data with %zu-byte RSA key",
+              input.available_read() + data_.available_read(), key_len);
         return KM_ERROR_INVALID_INPUT_LENGTH;
     }
+    if (!data_.reserve(input.available_read()) ||
+        !data_.write(input.peek_read(), input.available_read())) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
 
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
@@ -242,11 +254,79 @@ RsaDigestingOperation::RsaDigestingOperation(AuthorizationSet&& hw_enforced,
                                              AuthorizationSet&& sw_enforced,
                                              keymaster_purpose_t purpose, keymaster_digest_t digest,
                                              keymaster_padding_t padding, EVP_PKEY* key)
-    : RsaOperation(std::move(hw_enforced), std::move(sw_enforced), purpose, digest, padding, key) {
-    EVP_MD_CTX_init(&digest_ctx_);
+    : RsaOperation(std::move(hw_enforced), std::move(sw_enforced), purpose, digest, padding, key) {}
+RsaDigestingOperation::~RsaDigestingOperation() {}
+
+size_t RsaDigestingOperation::RecommendedChunkSize() const {
+    if (digest_ == KM_DIGEST_NONE) return RsaOperation::RecommendedChunkSize();
+    return Operation::RecommendedChunkSize();
 }
-RsaDigestingOperation::~RsaDigestingOperation() {
-    EVP_MD_CTX_cleanup(&digest_ctx_);
+
+size_t RsaDigestingOperation::MaxChunkSize() const {
+    if (digest_ == KM_DIGEST_NONE) return RsaOperation::MaxChunkSize();
+    return Operation::MaxChunkSize();
+}
+
+OperationPtr RsaDigestingOperation::Fork(keymaster_error_t* error) const {
+    AuthorizationSet hw_enforced, sw_enforced;
+    if (!CopyAuthorizations(&hw_enforced, &sw_enforced)) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+
+    // The fork holds a reference to the key of its own.
+    EVP_PKEY_up_ref(rsa_key_);
+    UniquePtr<RsaDigestingOperation> fork(
+        NewFork(std::move(hw_enforced), std::move(sw_enforced), rsa_key_));
+    if (!fork) {
+        EVP_PKEY_free(rsa_key_);
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+
+    fork->digest_algorithm_ = digest_algorithm_;
+    fork->data_.set_size_hint(data_.buffer_size());
+    if (!fork->data_.reserve(data_.available_read()) ||
+        !fork->data_.write(data_.peek_read(), data_.available_read())) {
+        *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return nullptr;
+    }
+    if (digest_ != KM_DIGEST_NONE) {
+        if (!fork->digest_ctx_.CopyFrom(digest_ctx_)) {
+            *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            return nullptr;
+        }
+        // The key context holds no message state, so a new one is as good as a copy.
+        *error = fork->NewPkeyContext(purpose() == KM_PURPOSE_SIGN, &fork->pkey_ctx_);
+        if (*error != KM_ERROR_OK) return nullptr;
+    }
+
+    *error = KM_ERROR_OK;
+    return std::move(fork);
+}
+
+keymaster_error_t RsaDigestingOperation::InitDigestedContexts(bool signing) {
+    if (!digest_ctx_.Init(digest_algorithm_)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return NewPkeyContext(signing, &pkey_ctx_);
+}
+
+keymaster_error_t RsaDigestingOperation::NewPkeyContext(bool signing,
+                                                        EVP_PKEY_CTX_Ptr* pkey_ctx) {
+    pkey_ctx->reset(EVP_PKEY_CTX_new(rsa_key_, nullptr /* engine */));
+    if (!*pkey_ctx) return TranslateLastOpenSslError();
+    int result =
+        signing ? EVP_PKEY_sign_init(pkey_ctx->get()) : EVP_PKEY_verify_init(pkey_ctx->get());
+    if (result != 1 || EVP_PKEY_CTX_set_signature_md(pkey_ctx->get(), digest_algorithm_) != 1)
+        return TranslateLastOpenSslError();
+    return SetRsaPaddingInEvpContext(pkey_ctx->get(), signing);
+}
+
+keymaster_error_t RsaDigestingOperation::FinishDigest(uint8_t* digest,
+                                                      unsigned int* digest_length) {
+    if (!EVP_DigestFinal_ex(digest_ctx_.get(), digest, digest_length))
+        return TranslateLastOpenSslError();
+    digest_ctx_.Release();
+    return KM_ERROR_OK;
 }
 
 int RsaDigestingOperation::GetOpensslPadding(keymaster_error_t* error) {
@@ -281,11 +361,7 @@ keymaster_error_t RsaSignOperation::Begin(const AuthorizationSet& input_params,
 
     if (digest_ == KM_DIGEST_NONE) return KM_ERROR_OK;
 
-    EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestSignInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr /* engine */,
-                           rsa_key_) != 1)
-        return TranslateLastOpenSslError();
-    return SetRsaPaddingInEvpContext(pkey_ctx, true /* signing */);
+    return InitDigestedContexts(true /* signing */);
 }
 
 keymaster_error_t RsaSignOperation::Update(const AuthorizationSet& additional_params,
@@ -296,7 +372,7 @@ keymaster_error_t RsaSignOperation::Update(const AuthorizationSet& additional_pa
         return RsaOperation::Update(additional_params, input, output_params, output,
                                     input_consumed);
 
-    if (EVP_DigestSignUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
+    if (EVP_DigestUpdate(digest_ctx_.get(), input.peek_read(), input.available_read()) != 1)
         return TranslateLastOpenSslError();
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
@@ -373,19 +449,61 @@ keymaster_error_t RsaSignOperation::SignUndigested(Buffer* output) {
 }
 
 keymaster_error_t RsaSignOperation::SignDigested(Buffer* output) {
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length;
+    keymaster_error_t error = FinishDigest(digest, &digest_length);
+    if (error != KM_ERROR_OK) return error;
+
     size_t siglen;
-    if (EVP_DigestSignFinal(&digest_ctx_, nullptr /* signature */, &siglen) != 1)
+    if (EVP_PKEY_sign(pkey_ctx_.get(), nullptr /* signature */, &siglen, digest, digest_length) !=
+        1)
         return TranslateLastOpenSslError();
 
     if (!output->Reinitialize(siglen)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    if (EVP_DigestSignFinal(&digest_ctx_, output->peek_write(), &siglen) <= 0)
+    if (EVP_PKEY_sign(pkey_ctx_.get(), output->peek_write(), &siglen, digest, digest_length) <= 0)
         return TranslateLastOpenSslError();
     if (!output->advance_write(siglen)) return KM_ERROR_UNKNOWN_ERROR;
 
     return KM_ERROR_OK;
 }
 
+struct RsaVerifyOperation::EarlySignature {
+    // Recovers the encoded message from |signature|.  Runs once, on any thread.
+    void Recover() {
+        size_t key_len = RSA_size(rsa.get());
+        UniquePtr<uint8_t[]> recovered(new (std::nothrow) uint8_t[key_len]);
+        bool ok = recovered.get() &&
+                  RSA_public_decrypt(signature.available_read(), signature.peek_read(),
+                                     recovered.get(), rsa.get(), RSA_NO_PADDING) ==
+                      static_cast<int>(key_len);
+        if (!ok) ERR_clear_error();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ok) encoded = std::move(recovered);
+        done = true;
+        done_cv.notify_all();
+    }
+
+    // Returns the encoded message once Recover() has run, or null if the signature isn't valid
+    // RSA output for the key.
+    const uint8_t* Wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        done_cv.wait(lock, [this] { return done; });
+        return encoded.get();
+    }
+
+    // Set before Recover() is queued and not changed after.
+    Buffer signature;
+    UniquePtr<RSA, RSA_Delete> rsa;
+
+    // Guards everything below.
+    std::mutex mutex;
+    std::condition_variable done_cv;
+    bool done = false;
+    UniquePtr<uint8_t[]> encoded;
+};
+
 keymaster_error_t RsaVerifyOperation::Begin(const AuthorizationSet& input_params,
                                             AuthorizationSet* output_params) {
     keymaster_error_t error = RsaDigestingOperation::Begin(input_params, output_params);
@@ -393,10 +511,7 @@ keymaster_error_t RsaVerifyOperation::Begin(const AuthorizationSet& input_params
 
     if (digest_ == KM_DIGEST_NONE) return KM_ERROR_OK;
 
-    EVP_PKEY_CTX* pkey_ctx;
-    if (EVP_DigestVerifyInit(&digest_ctx_, &pkey_ctx, digest_algorithm_, nullptr, rsa_key_) != 1)
-        return TranslateLastOpenSslError();
-    return SetRsaPaddingInEvpContext(pkey_ctx, false /* signing */);
+    return InitDigestedContexts(false /* signing */);
 }
 
 keymaster_error_t RsaVerifyOperation::Update(const AuthorizationSet& additional_params,
@@ -407,7 +522,7 @@ keymaster_error_t RsaVerifyOperation::Update(const AuthorizationSet& additional_
         return RsaOperation::Update(additional_params, input, output_params, output,
                                     input_consumed);
 
-    if (EVP_DigestVerifyUpdate(&digest_ctx_, input.peek_read(), input.available_read()) != 1)
+    if (EVP_DigestUpdate(digest_ctx_.get(), input.peek_read(), input.available_read()) != 1)
         return TranslateLastOpenSslError();
     *input_consumed = input.available_read();
     return KM_ERROR_OK;
@@ -420,28 +535,88 @@ keymaster_error_t RsaVerifyOperation::Finish(const AuthorizationSet& additional_
     keymaster_error_t error = UpdateForFinish(additional_params, input);
     if (error != KM_ERROR_OK) return error;
 
-    if (digest_ == KM_DIGEST_NONE)
-        return VerifyUndigested(signature);
-    else
+    if (digest_ != KM_DIGEST_NONE) {
+        std::shared_ptr<EarlySignature> early = std::move(early_signature_);
+        if (early && early->signature.available_read() == signature.available_read() &&
+            memcmp(early->signature.peek_read(), signature.peek_read(),
+                   signature.available_read()) == 0) {
+            return VerifyEarly(early.get());
+        }
         return VerifyDigested(signature);
-}
+    }
 
-keymaster_error_t RsaVerifyOperation::VerifyUndigested(const Buffer& signature) {
     UniquePtr<RSA, RSA_Delete> rsa(EVP_PKEY_get1_RSA(const_cast<EVP_PKEY*>(rsa_key_)));
     if (!rsa.get()) return KM_ERROR_UNKNOWN_ERROR;
+    return VerifyUndigested(rsa.get(), data_.peek_read(), data_.available_read(), signature);
+}
+
+keymaster_error_t RsaVerifyOperation::SetEarlySignature(const Buffer& signature,
+                                                        WorkerPool* pool) {
+    if (digest_ == KM_DIGEST_NONE ||
+        (padding_ != KM_PAD_RSA_PKCS1_1_5_SIGN && padding_ != KM_PAD_RSA_PSS)) {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+    std::shared_ptr<EarlySignature> early(new (std::nothrow) EarlySignature);
+    if (!early) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    early->rsa.reset(EVP_PKEY_get1_RSA(rsa_key_));
+    if (!early->rsa.get()) return KM_ERROR_UNKNOWN_ERROR;
+    // A signature of the wrong length can't verify; leave Finish() to say so.
+    if (signature.available_read() != RSA_size(early->rsa.get())) return KM_ERROR_OK;
+    if (!early->signature.Reinitialize(signature)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    size_t key_len = RSA_size(rsa.get());
+    if (!pool || !pool->Submit([early] { early->Recover(); })) early->Recover();
+    early_signature_ = std::move(early);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t RsaVerifyOperation::VerifyBatch(const Buffer* messages, const Buffer* signatures,
+                                                  size_t count, WorkerPool* pool,
+                                                  uint8_t* verified) {
+    // Verifying needs only the public key, which is extracted once and shared by every thread.
+    // EVP_PKEY_CTXs can't be shared, so each thread sets one up for all the messages it takes,
+    // and digests each of them in one shot.  The results are the same as Finish()'s.
+    if (digest_ == KM_DIGEST_NONE) {
+        UniquePtr<RSA, RSA_Delete> rsa(EVP_PKEY_get1_RSA(rsa_key_));
+        if (!rsa.get()) return KM_ERROR_UNKNOWN_ERROR;
+        return VerifyInParallel(pool, count, verified, [&](keymaster_error_t* /* error */) {
+            return [&](size_t i) {
+                return VerifyUndigested(rsa.get(), messages[i].peek_read(),
+                                        messages[i].available_read(), signatures[i]);
+            };
+        });
+    }
+
+    return VerifyInParallel(pool, count, verified, [&](keymaster_error_t* error) {
+        EVP_PKEY_CTX_Ptr pkey_ctx;
+        *error = NewPkeyContext(false /* signing */, &pkey_ctx);
+        return [&, pkey_ctx = std::move(pkey_ctx)](size_t i) {
+            uint8_t digest[EVP_MAX_MD_SIZE];
+            unsigned int digest_length;
+            if (!EVP_Digest(messages[i].peek_read(), messages[i].available_read(), digest,
+                            &digest_length, digest_algorithm_, nullptr /* engine */)) {
+                return TranslateLastOpenSslError();
+            }
+            return VerifyDigest(pkey_ctx.get(), digest, digest_length, signatures[i]);
+        };
+    });
+}
+
+keymaster_error_t RsaVerifyOperation::VerifyUndigested(RSA* rsa, const uint8_t* message,
+                                                       size_t message_length,
+                                                       const Buffer& signature) {
+    size_t key_len = RSA_size(rsa);
     int openssl_padding;
     switch (padding_) {
     case KM_PAD_NONE:
-        if (data_.available_read() > key_len) return KM_ERROR_INVALID_INPUT_LENGTH;
+        if (message_length > key_len) return KM_ERROR_INVALID_INPUT_LENGTH;
         if (key_len != signature.available_read()) return KM_ERROR_VERIFICATION_FAILED;
         openssl_padding = RSA_NO_PADDING;
         break;
     case KM_PAD_RSA_PKCS1_1_5_SIGN:
-        if (data_.available_read() + kPkcs1UndigestedSignaturePaddingOverhead > key_len) {
+        if (message_length + kPkcs1UndigestedSignaturePaddingOverhead > key_len) {
             LOG_E("Input too long: cannot verify %u-byte message with PKCS1 padding && %u-bit key",
-                  data_.available_read(), key_len * 8);
+                  message_length, key_len * 8);
             return KM_ERROR_INVALID_INPUT_LENGTH;
         }
         openssl_padding = RSA_PKCS1_PADDING;
@@ -453,29 +628,99 @@ keymaster_error_t RsaVerifyOperation::VerifyUndigested(const Buffer& signature)
     UniquePtr<uint8_t[]> decrypted_data(new (std::nothrow) uint8_t[key_len]);
     if (!decrypted_data.get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     int bytes_decrypted = RSA_public_decrypt(signature.available_read(), signature.peek_read(),
-                                             decrypted_data.get(), rsa.get(), openssl_padding);
-    if (bytes_decrypted < 0) return KM_ERROR_VERIFICATION_FAILED;
+                                             decrypted_data.get(), rsa, openssl_padding);
+    if (bytes_decrypted < 0) {
+        ERR_clear_error();
+        return KM_ERROR_VERIFICATION_FAILED;
+    }
 
     const uint8_t* compare_pos = decrypted_data.get();
     size_t bytes_to_compare = bytes_decrypted;
     uint8_t zero_check_result = 0;
-    if (padding_ == KM_PAD_NONE && data_.available_read() < bytes_to_compare) {
+    if (padding_ == KM_PAD_NONE && message_length < bytes_to_compare) {
         // If the data is short, for "unpadded" signing we zero-pad to the left.  So during
         // verification we should have zeros on the left of the decrypted data.  Do a constant-time
         // check.
-        const uint8_t* zero_end = compare_pos + bytes_to_compare - data_.available_read();
+        const uint8_t* zero_end = compare_pos + bytes_to_compare - message_length;
         while (compare_pos < zero_end)
             zero_check_result |= *compare_pos++;
-        bytes_to_compare = data_.available_read();
+        bytes_to_compare = message_length;
     }
-    if (memcmp_s(compare_pos, data_.peek_read(), bytes_to_compare) != 0 || zero_check_result != 0)
+    if (memcmp_s(compare_pos, message, bytes_to_compare) != 0 || zero_check_result != 0)
         return KM_ERROR_VERIFICATION_FAILED;
     return KM_ERROR_OK;
 }
 
 keymaster_error_t RsaVerifyOperation::VerifyDigested(const Buffer& signature) {
-    if (!EVP_DigestVerifyFinal(&digest_ctx_, signature.peek_read(), signature.available_read()))
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length;
+    keymaster_error_t error = FinishDigest(digest, &digest_length);
+    if (error != KM_ERROR_OK) return error;
+
+    return VerifyDigest(pkey_ctx_.get(), digest, digest_length, signature);
+}
+
+keymaster_error_t RsaVerifyOperation::VerifyEarly(EarlySignature* early) {
+    // The checks are the ones EVP_PKEY_verify() makes after its own public key operation.
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length;
+    keymaster_error_t error = FinishDigest(digest, &digest_length);
+    if (error != KM_ERROR_OK) return error;
+
+    const uint8_t* encoded = early->Wait();
+    if (!encoded) return KM_ERROR_VERIFICATION_FAILED;
+
+    RSA* rsa = early->rsa.get();
+    bool verified;
+    if (padding_ == KM_PAD_RSA_PSS) {
+        // -2 recovers the salt length from the encoding, as EVP_PKEY_verify() does by default.
+        verified = RSA_verify_PKCS1_PSS_mgf1(rsa, digest, digest_algorithm_,
+                                             nullptr /* Mgf1Hash */, encoded, -2 /* sLen */) == 1;
+    } else {
+        verified = CheckPkcs1Encoding(rsa, encoded, digest, digest_length);
+    }
+    if (!verified) {
+        ERR_clear_error();
+        return KM_ERROR_VERIFICATION_FAILED;
+    }
+    return KM_ERROR_OK;
+}
+
+bool RsaVerifyOperation::CheckPkcs1Encoding(RSA* rsa, const uint8_t* encoded,
+                                            const uint8_t* digest, size_t digest_length) {
+    uint8_t* prefixed;
+    size_t prefixed_length;
+    int is_alloced;
+    if (!RSA_add_pkcs1_prefix(&prefixed, &prefixed_length, &is_alloced,
+                              EVP_MD_type(digest_algorithm_), digest, digest_length)) {
+        return false;
+    }
+
+    // EMSA-PKCS1-v1_5: 0x00 0x01 0xFF...0xFF 0x00 DigestInfo, with at least eight 0xFF bytes.
+    size_t key_len = RSA_size(rsa);
+    bool matches = false;
+    UniquePtr<uint8_t[]> expected(new (std::nothrow) uint8_t[key_len]);
+    if (expected.get() && prefixed_length + kPkcs1UndigestedSignaturePaddingOverhead <= key_len) {
+        size_t padding_end = key_len - prefixed_length - 1;
+        expected[0] = 0x00;
+        expected[1] = 0x01;
+        memset(expected.get() + 2, 0xFF, padding_end - 2);
+        expected[padding_end] = 0x00;
+        memcpy(expected.get() + padding_end + 1, prefixed, prefixed_length);
+        matches = memcmp_s(expected.get(), encoded, key_len) == 0;
+    }
+    if (is_alloced) OPENSSL_free(prefixed);
+    return matches;
+}
+
+keymaster_error_t RsaVerifyOperation::VerifyDigest(EVP_PKEY_CTX* pkey_ctx, const uint8_t* digest,
+                                                   size_t digest_length,
+                                                   const Buffer& signature) {
+    if (EVP_PKEY_verify(pkey_ctx, signature.peek_read(), signature.available_read(), digest,
+                        digest_length) != 1) {
+        ERR_clear_error();
         return KM_ERROR_VERIFICATION_FAILED;
+    }
     return KM_ERROR_OK;
 }
 
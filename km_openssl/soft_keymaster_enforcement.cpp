@@ -23,11 +23,15 @@
 #include <openssl/cmac.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/mem.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
 
+#include <keymaster/constant_time.h>
 #include <keymaster/km_openssl/ckdf.h>
 #include <keymaster/km_openssl/openssl_err.h>
 #include <keymaster/km_openssl/openssl_utils.h>
+#include <keymaster/serializable.h>
 
 #ifdef _WIN32
 #include <sysinfoapi.h>
@@ -40,7 +44,7 @@ namespace {
 constexpr uint8_t kFakeKeyAgreementKey[32] = {};
 constexpr const char* kSharedHmacLabel = "KeymasterSharedMac";
 constexpr const char* kMacVerificationString = "Keymaster HMAC Verification";
-constexpr const char* kAuthVerificationLabel = "Auth Verification";
+constexpr char kAuthVerificationLabel[] = "Auth Verification";
 
 class EvpMdCtx {
   public:
@@ -98,89 +102,164 @@ SoftKeymasterEnforcement::GetHmacSharingParameters(HmacSharingParameters* params
 
 namespace {
 
-DEFINE_OPENSSL_OBJECT_POINTER(HMAC_CTX);
-
-keymaster_error_t hmacSha256(const keymaster_key_blob_t& key, const keymaster_blob_t data_chunks[],
-                             size_t data_chunk_count, KeymasterBlob* output) {
-    if (!output) return KM_ERROR_UNEXPECTED_NULL_POINTER;
-
-    unsigned digest_len = SHA256_DIGEST_LENGTH;
-    if (!output->Reset(digest_len)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-
-    HMAC_CTX_Ptr ctx(HMAC_CTX_new());
-    if (!HMAC_Init_ex(ctx.get(), key.key_material, key.key_material_size, EVP_sha256(),
-                      nullptr /* engine*/)) {
-        return TranslateLastOpenSslError();
-    }
-
-    for (size_t i = 0; i < data_chunk_count; i++) {
-        auto& chunk = data_chunks[i];
-        if (!HMAC_Update(ctx.get(), chunk.data, chunk.data_length)) {
-            return TranslateLastOpenSslError();
-        }
-    }
-
-    if (!HMAC_Final(ctx.get(), output->writable_data(), &digest_len)) {
-        return TranslateLastOpenSslError();
-    }
-
-    if (digest_len != output->data_length) return KM_ERROR_UNKNOWN_ERROR;
-
-    return KM_ERROR_OK;
-}
-
-// Helpers for converting types to keymaster_blob_t, for easy feeding of hmacSha256.
-template <typename T> inline keymaster_blob_t toBlob(const T& t) {
-    return {reinterpret_cast<const uint8_t*>(&t), sizeof(t)};
-}
-inline keymaster_blob_t toBlob(const char* str) {
-    return {reinterpret_cast<const uint8_t*>(str), strlen(str)};
-}
-
 // Perhaps these shoud be in utils, but the impact of that needs to be considered carefully.  For
 // now, just define it here.
 inline bool operator==(const keymaster_blob_t& a, const keymaster_blob_t& b) {
     if (!a.data_length && !b.data_length) return true;
     if (!(a.data && b.data)) return a.data == b.data;
-    return (a.data_length == b.data_length && !memcmp(a.data, b.data, a.data_length));
+    return (a.data_length == b.data_length && ConstantTimeEquals(a.data, b.data, a.data_length));
 }
 
 bool operator==(const HmacSharingParameters& a, const HmacSharingParameters& b) {
-    return a.seed == b.seed && !memcmp(a.nonce, b.nonce, sizeof(a.nonce));
+    return a.seed == b.seed && ConstantTimeEquals(a.nonce, b.nonce, sizeof(a.nonce));
 }
 
 }  // namespace
 
+namespace {
+
+// Shared HMAC state layout: magic, version, flags, then the saved seed, the saved nonce, the HMAC
+// key, the parameter digest and the sharing check.  The seed, key and check are size-prefixed.
+constexpr uint32_t kSharedHmacStateMagic = 0x53484d53;  // "SMHS", little-endian.
+constexpr uint32_t kSharedHmacStateVersion = 1;
+constexpr uint32_t kHaveSavedParams = 1 << 0;
+constexpr uint32_t kHaveSharedHmac = 1 << 1;
+
+}  // namespace
+
+keymaster_error_t
+SoftKeymasterEnforcement::SerializeSharedHmacState(std::vector<uint8_t>* state) const {
+    const KeymasterBlob& seed = saved_params_.seed;
+    state->resize(4 * sizeof(uint32_t) + seed.data_length + sizeof(saved_params_.nonce) +
+                  sizeof(uint32_t) + hmac_key_.key_material_size +
+                  sizeof(shared_hmac_params_digest_) + sizeof(uint32_t) +
+                  shared_hmac_check_.data_length);
+    uint8_t* buf = state->data();
+    const uint8_t* end = buf + state->size();
+    uint32_t flags = (have_saved_params_ ? kHaveSavedParams : 0) |
+                     (have_shared_hmac_ ? kHaveSharedHmac : 0);
+    buf = append_uint32_to_buf(buf, end, kSharedHmacStateMagic);
+    buf = append_uint32_to_buf(buf, end, kSharedHmacStateVersion);
+    buf = append_uint32_to_buf(buf, end, flags);
+    buf = append_size_and_data_to_buf(buf, end, seed.data, seed.data_length);
+    buf = append_to_buf(buf, end, saved_params_.nonce, sizeof(saved_params_.nonce));
+    buf = append_size_and_data_to_buf(buf, end, hmac_key_.key_material,
+                                      hmac_key_.key_material_size);
+    buf = append_to_buf(buf, end, shared_hmac_params_digest_, sizeof(shared_hmac_params_digest_));
+    buf = append_size_and_data_to_buf(buf, end, shared_hmac_check_.data,
+                                      shared_hmac_check_.data_length);
+    return buf == end ? KM_ERROR_OK : KM_ERROR_UNKNOWN_ERROR;
+}
+
+keymaster_error_t SoftKeymasterEnforcement::RestoreSharedHmacState(const uint8_t* state,
+                                                                   size_t size) {
+    const uint8_t* end = state + size;
+    uint32_t magic, version, flags;
+    const uint8_t *seed, *key, *check;
+    size_t seed_size, key_size, check_size;
+    uint8_t nonce[sizeof(saved_params_.nonce)];
+    uint8_t params_digest[sizeof(shared_hmac_params_digest_)];
+    if (!copy_uint32_from_buf(&state, end, &magic) ||
+        !copy_uint32_from_buf(&state, end, &version) ||
+        !copy_uint32_from_buf(&state, end, &flags) || magic != kSharedHmacStateMagic ||
+        version != kSharedHmacStateVersion ||
+        !view_size_and_data_from_buf(&state, end, &seed, &seed_size) ||
+        !copy_from_buf(&state, end, nonce, sizeof(nonce)) ||
+        !view_size_and_data_from_buf(&state, end, &key, &key_size) ||
+        !copy_from_buf(&state, end, params_digest, sizeof(params_digest)) ||
+        !view_size_and_data_from_buf(&state, end, &check, &check_size) || state != end) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    KeymasterBlob new_seed(seed, seed_size);
+    KeymasterKeyBlob new_key(key, key_size);
+    KeymasterBlob new_check(check, check_size);
+    if ((seed_size && !new_seed.data) || (key_size && !new_key.key_material) ||
+        (check_size && !new_check.data)) {
+        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
+    have_saved_params_ = flags & kHaveSavedParams;
+    saved_params_.seed = std::move(new_seed);
+    memcpy(saved_params_.nonce, nonce, sizeof(nonce));
+    hmac_key_ = std::move(new_key);
+    have_shared_hmac_ = flags & kHaveSharedHmac;
+    memcpy(shared_hmac_params_digest_, params_digest, sizeof(params_digest));
+    shared_hmac_check_ = std::move(new_check);
+    shared_hmac_keyed_ = false;
+    ForgetValidatedAuthTokens();
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t
 SoftKeymasterEnforcement::ComputeSharedHmac(const HmacSharingParametersArray& params_array,
                                             KeymasterBlob* sharingCheck) {
+    if (!sharingCheck) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    // Keystore renegotiates with the same parameters whenever a HAL restarts.  The derived key
+    // depends only on the parameters, in order, so a digest of them identifies it.
+    bool found_mine = false;
+    SHA256_CTX params_ctx;
+    SHA256_Init(&params_ctx);
+    for (auto& params : array_range(params_array.params_array, params_array.num_params)) {
+        uint64_t seed_length = params.seed.data_length;
+        SHA256_Update(&params_ctx, &seed_length, sizeof(seed_length));
+        SHA256_Update(&params_ctx, params.seed.data, params.seed.data_length);
+        SHA256_Update(&params_ctx, params.nonce, sizeof(params.nonce));
+        found_mine = found_mine || params == saved_params_;
+    }
+    uint8_t params_digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(params_digest, &params_ctx);
+
+    if (!found_mine) return KM_ERROR_INVALID_ARGUMENT;
+
+    if (have_shared_hmac_ &&
+        ConstantTimeEquals(params_digest, shared_hmac_params_digest_, sizeof(params_digest))) {
+        *sharingCheck = shared_hmac_check_;
+        return sharingCheck->data ? KM_ERROR_OK : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    }
+
     size_t num_chunks = params_array.num_params * 2;
     UniquePtr<keymaster_blob_t[]> context_chunks(new (std::nothrow) keymaster_blob_t[num_chunks]);
     if (!context_chunks.get()) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
-    bool found_mine = false;
     auto context_chunks_pos = context_chunks.get();
     for (auto& params : array_range(params_array.params_array, params_array.num_params)) {
         *context_chunks_pos++ = params.seed;
         *context_chunks_pos++ = {params.nonce, sizeof(params.nonce)};
-        found_mine = found_mine || params == saved_params_;
     }
     assert(context_chunks_pos - num_chunks == context_chunks.get());
 
-    if (!found_mine) return KM_ERROR_INVALID_ARGUMENT;
+    keymaster_error_t error;
+    if (!shared_hmac_kdf_.initialized()) {
+        error = shared_hmac_kdf_.Init(
+            KeymasterKeyBlob(kFakeKeyAgreementKey, sizeof(kFakeKeyAgreementKey)));
+        if (error != KM_ERROR_OK) return error;
+    }
 
+    have_shared_hmac_ = false;
+    shared_hmac_keyed_ = false;
     if (!hmac_key_.Reset(SHA256_DIGEST_LENGTH)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    keymaster_error_t error = ckdf(
-        KeymasterKeyBlob(kFakeKeyAgreementKey, sizeof(kFakeKeyAgreementKey)),
+    error = shared_hmac_kdf_.Derive(
         KeymasterBlob(reinterpret_cast<const uint8_t*>(kSharedHmacLabel), strlen(kSharedHmacLabel)),
         context_chunks.get(), num_chunks,  //
         &hmac_key_);
     if (error != KM_ERROR_OK) return error;
+    ForgetValidatedAuthTokens();
+    error = KeySharedHmac();
+    if (error != KM_ERROR_OK) return error;
+
+    if (!sharingCheck->Reset(kTimestampTokenMacSize)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    error = SharedHmac(reinterpret_cast<const uint8_t*>(kMacVerificationString),
+                       strlen(kMacVerificationString), sharingCheck->writable_data());
+    if (error != KM_ERROR_OK) return error;
 
-    keymaster_blob_t data = {reinterpret_cast<const uint8_t*>(kMacVerificationString),
-                             strlen(kMacVerificationString)};
-    keymaster_blob_t data_chunks[] = {data};
-    return hmacSha256(hmac_key_, data_chunks, 1, sharingCheck);
+    shared_hmac_check_ = *sharingCheck;
+    if (shared_hmac_check_.data) {
+        memcpy(shared_hmac_params_digest_, params_digest, sizeof(params_digest));
+        have_shared_hmac_ = true;
+    }
+    return KM_ERROR_OK;
 }
 
 VerifyAuthorizationResponse
@@ -193,28 +272,81 @@ SoftKeymasterEnforcement::VerifyAuthorization(const VerifyAuthorizationRequest&
     response.token.challenge = request.challenge;
     response.token.timestamp = get_current_time_ms();
     response.token.security_level = SecurityLevel();
-    keymaster_blob_t data_chunks[] = {
-        toBlob(kAuthVerificationLabel),
-        toBlob(response.token.challenge),
-        toBlob(response.token.timestamp),
-        toBlob(response.token.security_level),
-        {},  // parametersVerified
-    };
-    response.error = hmacSha256(hmac_key_, data_chunks, 5, &response.token.mac);
+    if (!response.token.mac.Reset(kTimestampTokenMacSize)) {
+        response.error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return response;
+    }
+    response.error = MacVerificationToken(response.token.challenge, response.token.timestamp,
+                                          response.token.security_level,
+                                          response.token.mac.writable_data());
 
     return response;
 }
 
 keymaster_error_t SoftKeymasterEnforcement::GenerateTimestampToken(TimestampToken* token) {
-    token->timestamp = get_current_time_ms();
     token->security_level = SecurityLevel();
-    keymaster_blob_t data_chunks[] = {
-        toBlob(kAuthVerificationLabel),
-        toBlob(token->challenge),
-        toBlob(token->timestamp),
-        toBlob(token->security_level),
-    };
-    return hmacSha256(hmac_key_, data_chunks, 4, &token->mac);
+    if (!token->mac.Reset(kTimestampTokenMacSize)) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    return GenerateTimestampToken(token->challenge, &token->timestamp, token->mac.writable_data());
+}
+
+keymaster_error_t SoftKeymasterEnforcement::GenerateTimestampToken(uint64_t challenge,
+                                                                   uint64_t* timestamp,
+                                                                   uint8_t* mac) {
+    *timestamp = get_current_time_ms();
+    return MacVerificationToken(challenge, *timestamp, SecurityLevel(), mac);
+}
+
+keymaster_error_t SoftKeymasterEnforcement::KeySharedHmac() {
+    if (!HMAC_Init_ex(shared_hmac_.get(), hmac_key_.key_material, hmac_key_.key_material_size,
+                      EVP_sha256(), nullptr /* engine */)) {
+        shared_hmac_keyed_ = false;
+        return TranslateLastOpenSslError();
+    }
+    shared_hmac_keyed_ = true;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t SoftKeymasterEnforcement::SharedHmac(const uint8_t* data, size_t data_length,
+                                                       uint8_t* mac) {
+    // Restarting from the stored key schedule saves rehashing the key for every MAC.
+    if (shared_hmac_keyed_) {
+        if (!HMAC_Init_ex(shared_hmac_.get(), nullptr /* key */, 0, nullptr /* md */,
+                          nullptr /* engine */)) {
+            return TranslateLastOpenSslError();
+        }
+    } else {
+        keymaster_error_t error = KeySharedHmac();
+        if (error != KM_ERROR_OK) return error;
+    }
+
+    unsigned mac_len = kTimestampTokenMacSize;
+    if (!HMAC_Update(shared_hmac_.get(), data, data_length) ||
+        !HMAC_Final(shared_hmac_.get(), mac, &mac_len)) {
+        return TranslateLastOpenSslError();
+    }
+    if (mac_len != kTimestampTokenMacSize) return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t
+SoftKeymasterEnforcement::MacVerificationToken(uint64_t challenge, uint64_t timestamp,
+                                               keymaster_security_level_t security_level,
+                                               uint8_t* mac) {
+    // The label, challenge, timestamp and security level in host byte order, as they have always
+    // been MACed, gathered so that a single update covers the whole token.  No parameters are
+    // ever verified, so nothing follows them.
+    uint8_t data[sizeof(kAuthVerificationLabel) - 1 + sizeof(challenge) + sizeof(timestamp) +
+                 sizeof(security_level)];
+    uint8_t* pos = data;
+    memcpy(pos, kAuthVerificationLabel, sizeof(kAuthVerificationLabel) - 1);
+    pos += sizeof(kAuthVerificationLabel) - 1;
+    memcpy(pos, &challenge, sizeof(challenge));
+    pos += sizeof(challenge);
+    memcpy(pos, &timestamp, sizeof(timestamp));
+    pos += sizeof(timestamp);
+    memcpy(pos, &security_level, sizeof(security_level));
+
+    return SharedHmac(data, sizeof(data), mac);
 }
 
 }  // namespace keymaster
@@ -16,12 +16,146 @@
 */
 
 #include <keymaster/km_openssl/software_random_source.h>
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+
+#include <openssl/ctrdrbg.h>
 #include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include <keymaster/android_keymaster_utils.h>
 
 namespace keymaster {
 
+namespace {
+
+// Requests up to this size are served from a per-thread pool of pre-generated bytes.
+constexpr size_t kMaxPooledRequest = 64;
+constexpr size_t kPoolSize = 512;
+
+// A thread's DRBG is reseeded from RAND_bytes() after it has produced this many bytes, or after
+// this much time, whichever comes first.
+constexpr uint64_t kReseedByteBudget = 1024 * 1024;
+constexpr std::chrono::seconds kReseedInterval(60);
+
+// Bumped by AddEntropy(), so that every thread's DRBG reseeds before its next use.
+std::atomic<uint64_t> reseed_generation(0);
+
+class ThreadDrbg {
+  public:
+    ~ThreadDrbg() {
+        if (drbg_) CTR_DRBG_free(drbg_);
+        memset_s(pool_, 0, sizeof(pool_));
+    }
+
+    bool Generate(uint8_t* buffer, size_t length) {
+        if (!MaybeReseed()) return false;
+
+        if (length > kMaxPooledRequest) return Fill(buffer, length);
+
+        if (pool_available_ < length) {
+            if (!Fill(pool_, sizeof(pool_))) return false;
+            pool_available_ = sizeof(pool_);
+        }
+        // Hand out bytes from the end of the pool and wipe them, so they can't be handed out
+        // again or recovered later.
+        uint8_t* bytes = pool_ + pool_available_ - length;
+        memcpy(buffer, bytes, length);
+        memset_s(bytes, 0, length);
+        pool_available_ -= length;
+        return true;
+    }
+
+    /**
+     * Reseeds from RAND_bytes(), mixing in a digest of \p additional as additional input.
+     */
+    bool Reseed(const uint8_t* additional, size_t additional_length) {
+        uint8_t entropy[CTR_DRBG_ENTROPY_LEN];
+        Eraser entropy_eraser(entropy, sizeof(entropy));
+        if (RAND_bytes(entropy, sizeof(entropy)) != 1) return false;
+
+        uint8_t digest[SHA384_DIGEST_LENGTH];
+        static_assert(sizeof(digest) <= CTR_DRBG_ENTROPY_LEN, "Additional input too long");
+        Eraser digest_eraser(digest, sizeof(digest));
+        size_t digest_length = 0;
+        if (additional_length > 0) {
+            SHA384(additional, additional_length, digest);
+            digest_length = sizeof(digest);
+        }
+
+        if (drbg_) {
+            if (!CTR_DRBG_reseed(drbg_, entropy, digest, digest_length)) return false;
+        } else {
+            drbg_ = CTR_DRBG_new(entropy, digest, digest_length);
+            if (!drbg_) return false;
+        }
+
+        // Anything pooled came from the old state.
+        memset_s(pool_, 0, sizeof(pool_));
+        pool_available_ = 0;
+        bytes_since_reseed_ = 0;
+        last_reseed_ = std::chrono::steady_clock::now();
+        generation_ = reseed_generation.load(std::memory_order_acquire);
+        pid_ = getpid();
+        return true;
+    }
+
+  private:
+    bool MaybeReseed() {
+        if (drbg_ && bytes_since_reseed_ < kReseedByteBudget &&
+            generation_ == reseed_generation.load(std::memory_order_acquire) &&
+            std::chrono::steady_clock::now() - last_reseed_ < kReseedInterval &&
+            // A forked child must not repeat its parent's output.
+            pid_ == getpid()) {
+            return true;
+        }
+        return Reseed(nullptr /* additional */, 0);
+    }
+
+    bool Fill(uint8_t* buffer, size_t length) {
+        while (length > 0) {
+            size_t chunk = length < CTR_DRBG_MAX_GENERATE_LENGTH ? length
+                                                                 : CTR_DRBG_MAX_GENERATE_LENGTH;
+            if (!CTR_DRBG_generate(drbg_, buffer, chunk, nullptr /* additional_data */, 0)) {
+                return false;
+            }
+            buffer += chunk;
+            length -= chunk;
+            bytes_since_reseed_ += chunk;
+        }
+        return true;
+    }
+
+    CTR_DRBG_STATE* drbg_ = nullptr;
+    uint8_t pool_[kPoolSize];
+    size_t pool_available_ = 0;
+    uint64_t bytes_since_reseed_ = 0;
+    std::chrono::steady_clock::time_point last_reseed_;
+    uint64_t generation_ = 0;
+    pid_t pid_ = 0;
+};
+
+ThreadDrbg& thread_drbg() {
+    thread_local ThreadDrbg drbg;
+    return drbg;
+}
+
+}  // namespace
+
 keymaster_error_t SoftwareRandomSource::GenerateRandom(uint8_t* buffer, size_t length) const {
-    if (RAND_bytes(buffer, length) != 1) return KM_ERROR_UNKNOWN_ERROR;
+    if (!thread_drbg().Generate(buffer, length)) return KM_ERROR_UNKNOWN_ERROR;
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t SoftwareRandomSource::AddEntropy(const uint8_t* buf, size_t length) const {
+    RAND_add(buf, length, 0 /* Don't assume any entropy is added to the pool. */);
+    reseed_generation.fetch_add(1, std::memory_order_acq_rel);
+    // The calling thread mixes the caller's bytes into its own state; other threads reseed from
+    // RAND_bytes() before their next request.
+    if (!thread_drbg().Reseed(buf, length)) return KM_ERROR_UNKNOWN_ERROR;
     return KM_ERROR_OK;
 }
 
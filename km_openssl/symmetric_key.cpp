@@ -41,21 +41,16 @@ keymaster_error_t SymmetricKeyFactory::GenerateKey(const AuthorizationSet& key_d
                                                    CertificateChain* /* cert_chain */) const {
     if (!key_blob || !hw_enforced || !sw_enforced) return KM_ERROR_OUTPUT_PARAMETER_NULL;
 
-    uint32_t key_size_bits;
-    if (!key_description.GetTagValue(TAG_KEY_SIZE, &key_size_bits) ||
-        !key_size_supported(key_size_bits))
-        return KM_ERROR_UNSUPPORTED_KEY_SIZE;
-
-    keymaster_error_t error = validate_algorithm_specific_new_key_params(key_description);
+    size_t key_data_size;
+    keymaster_error_t error = CheckNewKeyParams(key_description, &key_data_size);
     if (error != KM_ERROR_OK) return error;
 
-    size_t key_data_size = key_size_bytes(key_size_bits);
     KeymasterKeyBlob key_material(key_data_size);
     if (!key_material.key_material) return KM_ERROR_MEMORY_ALLOCATION_FAILED;
 
     error = random_source_.GenerateRandom(key_material.writable_data(), key_data_size);
     if (error != KM_ERROR_OK) {
-        LOG_E("Error generating %d bit symmetric key", key_size_bits);
+        LOG_E("Error generating %zu bit symmetric key", key_size_bits(key_data_size));
         return error;
     }
 
@@ -63,6 +58,64 @@ keymaster_error_t SymmetricKeyFactory::GenerateKey(const AuthorizationSet& key_d
                                      hw_enforced, sw_enforced);
 }
 
+void SymmetricKeyFactory::GenerateKeys(const AuthorizationSet* key_descriptions, size_t count,
+                                       KeymasterKeyBlob* key_blobs, AuthorizationSet* hw_enforced,
+                                       AuthorizationSet* sw_enforced,
+                                       keymaster_error_t* errors) const {
+    UniquePtr<size_t[]> key_data_sizes(new (std::nothrow) size_t[count]);
+    if (!key_data_sizes) {
+        for (size_t i = 0; i < count; ++i) errors[i] = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+        return;
+    }
+    size_t total_size = 0;
+    for (size_t i = 0; i < count; ++i) {
+        errors[i] = CheckNewKeyParams(key_descriptions[i], &key_data_sizes[i]);
+        if (errors[i] == KM_ERROR_OK) total_size += key_data_sizes[i];
+    }
+    if (total_size == 0) return;
+
+    // One draw for the whole batch, carved into keys in request order.
+    KeymasterKeyBlob all_key_material(total_size);
+    keymaster_error_t error = all_key_material.key_material ? KM_ERROR_OK
+                                                            : KM_ERROR_MEMORY_ALLOCATION_FAILED;
+    if (error == KM_ERROR_OK) {
+        error = random_source_.GenerateRandom(all_key_material.writable_data(), total_size);
+        if (error != KM_ERROR_OK) LOG_E("Error generating %zu bytes of symmetric keys", total_size);
+    }
+
+    const uint8_t* next_key_data = all_key_material.key_material;
+    for (size_t i = 0; i < count; ++i) {
+        if (errors[i] != KM_ERROR_OK) continue;
+        if (error != KM_ERROR_OK) {
+            errors[i] = error;
+            continue;
+        }
+        KeymasterKeyBlob key_material(next_key_data, key_data_sizes[i]);
+        next_key_data += key_data_sizes[i];
+        if (!key_material.key_material) {
+            errors[i] = KM_ERROR_MEMORY_ALLOCATION_FAILED;
+            continue;
+        }
+        errors[i] = blob_maker_.CreateKeyBlob(key_descriptions[i], KM_ORIGIN_GENERATED,
+                                              key_material, &key_blobs[i], &hw_enforced[i],
+                                              &sw_enforced[i]);
+    }
+}
+
+keymaster_error_t SymmetricKeyFactory::CheckNewKeyParams(const AuthorizationSet& key_description,
+                                                         size_t* key_data_size) const {
+    uint32_t key_size_bits;
+    if (!key_description.GetTagValue(TAG_KEY_SIZE, &key_size_bits) ||
+        !key_size_supported(key_size_bits))
+        return KM_ERROR_UNSUPPORTED_KEY_SIZE;
+
+    keymaster_error_t error = validate_algorithm_specific_new_key_params(key_description);
+    if (error != KM_ERROR_OK) return error;
+
+    *key_data_size = key_size_bytes(key_size_bits);
+    return KM_ERROR_OK;
+}
+
 keymaster_error_t SymmetricKeyFactory::ImportKey(const AuthorizationSet& key_description,  //
                                                  keymaster_key_format_t input_key_material_format,
                                                  const KeymasterKeyBlob& input_key_material,  //
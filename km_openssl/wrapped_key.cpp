@@ -18,6 +18,7 @@
 #include <keymaster/wrapped_key.h>
 
 #include <openssl/asn1t.h>
+#include <openssl/bytestring.h>
 
 #include <keymaster/android_keymaster_utils.h>
 #include <keymaster/km_openssl/openssl_err.h>
@@ -77,7 +78,55 @@ keymaster_error_t build_wrapped_key(const KeymasterKeyBlob& transit_key, const K
     return KM_ERROR_OK;
 }
 
-// Parse the DER-encoded wrapped key format
+static keymaster_blob_t ToBlob(const CBS& cbs) {
+    return {CBS_data(&cbs), CBS_len(&cbs)};
+}
+
+// Parse the DER-encoded wrapped key format.  The structure is walked in place with CBS, which
+// enforces DER lengths, so the cost depends only on the input length and nothing is allocated.
+keymaster_error_t parse_wrapped_key(const keymaster_key_blob_t& wrapped_key, WrappedKeyView* view) {
+    if (!view) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    CBS input, record, transit_key, iv, description, description_copy, description_contents,
+        auth_list, secure_key, tag;
+    uint64_t version, key_format;
+    CBS_init(&input, wrapped_key.key_material, wrapped_key.key_material_size);
+    // Like the templated decoder, this ignores anything after the record.
+    if (!CBS_get_asn1(&input, &record, CBS_ASN1_SEQUENCE) ||
+        !CBS_get_asn1_uint64(&record, &version) ||
+        !CBS_get_asn1(&record, &transit_key, CBS_ASN1_OCTETSTRING) ||
+        !CBS_get_asn1(&record, &iv, CBS_ASN1_OCTETSTRING) ||
+        !CBS_get_asn1_element(&record, &description, CBS_ASN1_SEQUENCE) ||
+        !CBS_get_asn1(&record, &secure_key, CBS_ASN1_OCTETSTRING) ||
+        !CBS_get_asn1(&record, &tag, CBS_ASN1_OCTETSTRING) || CBS_len(&record) != 0) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    description_copy = description;
+    if (!CBS_get_asn1(&description_copy, &description_contents, CBS_ASN1_SEQUENCE) ||
+        !CBS_get_asn1_uint64(&description_contents, &key_format) ||
+        !CBS_get_asn1_element(&description_contents, &auth_list, CBS_ASN1_SEQUENCE) ||
+        CBS_len(&description_contents) != 0 || key_format > UINT32_MAX) {
+        return KM_ERROR_INVALID_ARGUMENT;
+    }
+
+    view->transit_key = ToBlob(transit_key);
+    view->iv = ToBlob(iv);
+    view->wrapped_key_description = ToBlob(description);
+    view->key_format = static_cast<keymaster_key_format_t>(key_format);
+    view->auth_list = ToBlob(auth_list);
+    view->secure_key = ToBlob(secure_key);
+    view->tag = ToBlob(tag);
+    return KM_ERROR_OK;
+}
+
+keymaster_error_t parse_wrapped_key_auth_list(const WrappedKeyView& view,
+                                              AuthorizationSet* auth_list) {
+    if (!auth_list) return KM_ERROR_UNEXPECTED_NULL_POINTER;
+
+    return extract_auth_list(view.auth_list.data, view.auth_list.data_length, auth_list);
+}
+
 keymaster_error_t parse_wrapped_key(const KeymasterKeyBlob& wrapped_key, KeymasterBlob* iv,
                                     KeymasterKeyBlob* transit_key, KeymasterKeyBlob* secure_key,
                                     KeymasterBlob* tag, AuthorizationSet* auth_list,
@@ -88,47 +137,26 @@ keymaster_error_t parse_wrapped_key(const KeymasterKeyBlob& wrapped_key, Keymast
         return KM_ERROR_UNEXPECTED_NULL_POINTER;
     }
 
-    const uint8_t* tmp = wrapped_key.key_material;
-    UniquePtr<KM_WRAPPED_KEY, KM_WRAPPED_KEY_Delete> record(
-        d2i_KM_WRAPPED_KEY(nullptr, &tmp, wrapped_key.key_material_size));
-    if (!record.get()) return TranslateLastOpenSslError();
-
-    *iv = KeymasterBlob(record->iv->data, record->iv->length);
-    if (record->iv->data && !iv->data) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
-    *transit_key = KeymasterKeyBlob(record->transit_key->data, record->transit_key->length);
-    if (record->transit_key->data && !transit_key->key_material) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
-    *secure_key = KeymasterKeyBlob(record->secure_key->data, record->secure_key->length);
-    if (record->secure_key->data && !secure_key->key_material) {
+    WrappedKeyView view;
+    keymaster_error_t error = parse_wrapped_key(wrapped_key, &view);
+    if (error != KM_ERROR_OK) return error;
+
+    *iv = KeymasterBlob(view.iv.data, view.iv.data_length);
+    *transit_key = KeymasterKeyBlob(view.transit_key.data, view.transit_key.data_length);
+    *secure_key = KeymasterKeyBlob(view.secure_key.data, view.secure_key.data_length);
+    *tag = KeymasterBlob(view.tag.data, view.tag.data_length);
+    *wrapped_key_description = KeymasterBlob(view.wrapped_key_description.data,
+                                             view.wrapped_key_description.data_length);
+    if ((view.iv.data_length && !iv->data) ||
+        (view.transit_key.data_length && !transit_key->key_material) ||
+        (view.secure_key.data_length && !secure_key->key_material) ||
+        (view.tag.data_length && !tag->data) ||
+        (view.wrapped_key_description.data_length && !wrapped_key_description->data)) {
         return KM_ERROR_MEMORY_ALLOCATION_FAILED;
     }
 
-    *tag = KeymasterBlob(record->tag->data, record->tag->length);
-    if (record->tag->data && !tag->data) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-
-    // Re-serialize the wrapped key description
-    int len = i2d_KM_WRAPPED_KEY_DESCRIPTION(record->wrapped_key_description, nullptr);
-    if (len < 0) {
-        return TranslateLastOpenSslError();
-    }
-    if (!wrapped_key_description->Reset(len)) {
-        return KM_ERROR_MEMORY_ALLOCATION_FAILED;
-    }
-    uint8_t* p = wrapped_key_description->writable_data();
-    if (i2d_KM_WRAPPED_KEY_DESCRIPTION(record->wrapped_key_description, &p) < 0) {
-        return TranslateLastOpenSslError();
-    }
-
-    *key_format = static_cast<keymaster_key_format_t>(
-        ASN1_INTEGER_get(record->wrapped_key_description->key_format));
-    return extract_auth_list(record->wrapped_key_description->auth_list, auth_list);
+    *key_format = view.key_format;
+    return parse_wrapped_key_auth_list(view, auth_list);
 }
 
 }  // namespace keymaster
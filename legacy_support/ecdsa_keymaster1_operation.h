@@ -92,6 +92,7 @@ template <typename BaseOperation> class EcdsaKeymaster1Operation : public BaseOp
     keymaster_operation_handle_t operation_handle() const override {
         return wrapped_operation_.GetOperationHandle();
     }
+    bool set_operation_handle(keymaster_operation_handle_t) override { return false; }
 
   private:
     EcdsaKeymaster1WrappedOperation wrapped_operation_;
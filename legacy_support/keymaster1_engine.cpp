@@ -116,11 +116,18 @@ keymaster_error_t Keymaster1Engine::ImportKey(const AuthorizationSet& key_descri
 }
 
 keymaster_error_t Keymaster1Engine::DeleteKey(const KeymasterKeyBlob& blob) const {
+    for (auto& entry : public_keys_) {
+        if (entry.public_key && entry.blob.size() == blob.size() &&
+            memcmp_s(entry.blob.begin(), blob.begin(), blob.size()) == 0) {
+            entry = CachedPublicKey();
+        }
+    }
     if (!keymaster1_device_->delete_key) return KM_ERROR_OK;
     return keymaster1_device_->delete_key(keymaster1_device_, &blob);
 }
 
 keymaster_error_t Keymaster1Engine::DeleteAllKeys() const {
+    ForgetPublicKeys();
     if (!keymaster1_device_->delete_all_keys) return KM_ERROR_OK;
     return keymaster1_device_->delete_all_keys(keymaster1_device_);
 }
@@ -344,6 +351,12 @@ EVP_PKEY* Keymaster1Engine::GetKeymaster1PublicKey(const KeymasterKeyBlob& blob,
     if (additional_params.GetTagValue(TAG_APPLICATION_ID, &client_id)) client_id_ptr = &client_id;
     if (additional_params.GetTagValue(TAG_APPLICATION_DATA, &app_data)) app_data_ptr = &app_data;
 
+    EVP_PKEY* cached = FindCachedPublicKey(blob, client_id_ptr, app_data_ptr);
+    if (cached) {
+        *error = KM_ERROR_OK;
+        return cached;
+    }
+
     keymaster_blob_t export_data = {nullptr, 0};
     *error = keymaster1_device_->export_key(keymaster1_device_, KM_KEY_FORMAT_X509, &blob,
                                             client_id_ptr, app_data_ptr, &export_data);
@@ -355,10 +368,63 @@ EVP_PKEY* Keymaster1Engine::GetKeymaster1PublicKey(const KeymasterKeyBlob& blob,
     auto result = d2i_PUBKEY(nullptr /* allocate new struct */, &p, export_data.data_length);
     if (!result) {
         *error = TranslateLastOpenSslError();
+        return nullptr;
     }
+    CachePublicKey(blob, client_id_ptr, app_data_ptr, result);
     return result;
 }
 
+static bool OptionalBlobMatches(bool has_cached, const KeymasterBlob& cached,
+                                const keymaster_blob_t* blob) {
+    if (!blob) return !has_cached;
+    return has_cached && cached.data_length == blob->data_length &&
+           memcmp_s(cached.data, blob->data, blob->data_length) == 0;
+}
+
+EVP_PKEY* Keymaster1Engine::FindCachedPublicKey(const KeymasterKeyBlob& blob,
+                                                const keymaster_blob_t* client_id,
+                                                const keymaster_blob_t* app_data) const {
+    // The device checks APPLICATION_ID and APPLICATION_DATA on export, so a hit requires the same
+    // ones it was exported with.
+    for (auto& entry : public_keys_) {
+        if (entry.public_key && entry.blob.size() == blob.size() &&
+            memcmp_s(entry.blob.begin(), blob.begin(), blob.size()) == 0 &&
+            OptionalBlobMatches(entry.has_client_id, entry.client_id, client_id) &&
+            OptionalBlobMatches(entry.has_app_data, entry.app_data, app_data)) {
+            EVP_PKEY_up_ref(entry.public_key.get());
+            return entry.public_key.get();
+        }
+    }
+    return nullptr;
+}
+
+void Keymaster1Engine::CachePublicKey(const KeymasterKeyBlob& blob,
+                                      const keymaster_blob_t* client_id,
+                                      const keymaster_blob_t* app_data, EVP_PKEY* key) const {
+    CachedPublicKey& entry = public_keys_[next_public_key_];
+    next_public_key_ = (next_public_key_ + 1) % kPublicKeyCacheSize;
+
+    entry = CachedPublicKey();
+    entry.blob = KeymasterKeyBlob(blob.begin(), blob.size());
+    entry.has_client_id = client_id != nullptr;
+    if (client_id) entry.client_id = KeymasterBlob(client_id->data, client_id->data_length);
+    entry.has_app_data = app_data != nullptr;
+    if (app_data) entry.app_data = KeymasterBlob(app_data->data, app_data->data_length);
+    bool allocated = entry.blob.key_material &&
+                     (!client_id || !client_id->data_length || entry.client_id.data) &&
+                     (!app_data || !app_data->data_length || entry.app_data.data);
+    if (!allocated) {
+        entry = CachedPublicKey();
+        return;
+    }
+    EVP_PKEY_up_ref(key);
+    entry.public_key.reset(key);
+}
+
+void Keymaster1Engine::ForgetPublicKeys() const {
+    for (auto& entry : public_keys_) entry = CachedPublicKey();
+}
+
 RSA_METHOD Keymaster1Engine::BuildRsaMethod() {
     RSA_METHOD method = {};
 
@@ -185,6 +185,42 @@ bool Keymaster1LegacySupport::RequiresSoftwareDigesting(
     return !has_purpose;
 }
 
+/* static */
+bool Keymaster1LegacySupport::PrefersSoftwareDigesting(const keymaster_digest_t digest,
+                                                       const AuthorizationSet& begin_params,
+                                                       const AuthorizationSet& hw_enforced) {
+    // Keymaster1 devices that digest in hardware buffer the whole message until finish.  Hashing in
+    // software as update() arrives and handing the device only the digest keeps memory use
+    // constant, but the device must then be allowed to sign with KM_DIGEST_NONE, and for RSA with
+    // whatever padding the wrapped operation will ask for.
+    if (digest == KM_DIGEST_NONE) return false;
+    if (!hw_enforced.Contains(TAG_DIGEST, KM_DIGEST_NONE)) return false;
+
+    keymaster_algorithm_t algorithm;
+    if (!hw_enforced.GetTagValue(TAG_ALGORITHM, &algorithm)) return false;
+    switch (algorithm) {
+    case KM_ALGORITHM_EC:
+        return true;
+    case KM_ALGORITHM_RSA: {
+        keymaster_padding_t padding;
+        if (!begin_params.GetTagValue(TAG_PADDING, &padding)) return false;
+        switch (padding) {
+        case KM_PAD_RSA_PKCS1_1_5_SIGN:
+        case KM_PAD_RSA_PKCS1_1_5_ENCRYPT:
+            return true;
+        case KM_PAD_NONE:
+        case KM_PAD_RSA_PSS:
+        case KM_PAD_RSA_OAEP:
+            return hw_enforced.Contains(TAG_PADDING, KM_PAD_NONE);
+        default:
+            return false;
+        }
+    }
+    default:
+        return false;
+    }
+}
+
 bool Keymaster1LegacySupport::RequiresSoftwareDigesting(const keymaster_digest_t digest,
                                                         const AuthProxy& key_description) const {
 
@@ -268,7 +304,8 @@ keymaster_error_t Keymaster1ArbitrationFactory<EcdsaKeymaster1KeyFactory>::LoadK
         digest = KM_DIGEST_NONE;
     }
     bool requires_software_digesting =
-        legacy_support_.RequiresSoftwareDigesting(digest, AuthProxy(hw_enforced, sw_enforced));
+        legacy_support_.RequiresSoftwareDigesting(digest, AuthProxy(hw_enforced, sw_enforced)) ||
+        Keymaster1LegacySupport::PrefersSoftwareDigesting(digest, additional_params, hw_enforced);
     auto rc = software_digest_factory_.LoadKey(std::move(key_material), additional_params,
                                                std::move(hw_enforced), std::move(sw_enforced), key);
     if (rc != KM_ERROR_OK) return rc;
@@ -287,7 +324,8 @@ keymaster_error_t Keymaster1ArbitrationFactory<RsaKeymaster1KeyFactory>::LoadKey
         digest = KM_DIGEST_NONE;
     }
     bool requires_software_digesting =
-        legacy_support_.RequiresSoftwareDigesting(digest, AuthProxy(hw_enforced, sw_enforced));
+        legacy_support_.RequiresSoftwareDigesting(digest, AuthProxy(hw_enforced, sw_enforced)) ||
+        Keymaster1LegacySupport::PrefersSoftwareDigesting(digest, additional_params, hw_enforced);
     auto rc = software_digest_factory_.LoadKey(std::move(key_material), additional_params,
                                                std::move(hw_enforced), std::move(sw_enforced), key);
     if (rc != KM_ERROR_OK) return rc;
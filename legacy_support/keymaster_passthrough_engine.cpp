@@ -40,47 +40,51 @@ class TKeymasterPassthroughEngine : public KeymasterPassthroughEngine {
 
   public:
     /**
-     * The engine takes ownership of the device, and will close it during destruction.
+     * The engine takes ownership of the devices, and will close them during destruction.  Key
+     * management goes to the first device; operations are spread across all of them.
      */
-    explicit TKeymasterPassthroughEngine(const KeymasterDeviceType* km_device)
-        : km_device_(km_device) {
+    TKeymasterPassthroughEngine(const KeymasterDeviceType* const* km_devices, size_t count)
+        : sessions_(km_devices, count), km_device_(sessions_.primary()) {
         rsa_encrypt_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_RSA, KM_PURPOSE_ENCRYPT, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_RSA, KM_PURPOSE_ENCRYPT, &sessions_));
         rsa_decrypt_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_RSA, KM_PURPOSE_DECRYPT, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_RSA, KM_PURPOSE_DECRYPT, &sessions_));
         rsa_sign_op_factory_.reset(new (std::nothrow)
-                                       opfactory_t(KM_ALGORITHM_RSA, KM_PURPOSE_SIGN, km_device_));
+                                       opfactory_t(KM_ALGORITHM_RSA, KM_PURPOSE_SIGN, &sessions_));
         rsa_verify_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_RSA, KM_PURPOSE_VERIFY, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_RSA, KM_PURPOSE_VERIFY, &sessions_));
         ec_encrypt_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_ENCRYPT, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_ENCRYPT, &sessions_));
         ec_decrypt_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_DECRYPT, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_DECRYPT, &sessions_));
         ec_sign_op_factory_.reset(new (std::nothrow)
-                                      opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_SIGN, km_device_));
+                                      opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_SIGN, &sessions_));
         ec_verify_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_VERIFY, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_VERIFY, &sessions_));
         ec_derive_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_DERIVE_KEY, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_EC, KM_PURPOSE_DERIVE_KEY, &sessions_));
         aes_encrypt_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT, &sessions_));
         aes_decrypt_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_AES, KM_PURPOSE_DECRYPT, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_AES, KM_PURPOSE_DECRYPT, &sessions_));
         triple_des_encrypt_op_factory_.reset(new (std::nothrow) opfactory_t(
-            KM_ALGORITHM_TRIPLE_DES, KM_PURPOSE_ENCRYPT, km_device_));
+            KM_ALGORITHM_TRIPLE_DES, KM_PURPOSE_ENCRYPT, &sessions_));
         triple_des_decrypt_op_factory_.reset(new (std::nothrow) opfactory_t(
-            KM_ALGORITHM_TRIPLE_DES, KM_PURPOSE_DECRYPT, km_device_));
+            KM_ALGORITHM_TRIPLE_DES, KM_PURPOSE_DECRYPT, &sessions_));
         hmac_sign_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_HMAC, KM_PURPOSE_SIGN, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_HMAC, KM_PURPOSE_SIGN, &sessions_));
         hmac_verify_op_factory_.reset(
-            new (std::nothrow) opfactory_t(KM_ALGORITHM_HMAC, KM_PURPOSE_VERIFY, km_device_));
+            new (std::nothrow) opfactory_t(KM_ALGORITHM_HMAC, KM_PURPOSE_VERIFY, &sessions_));
     }
     virtual ~TKeymasterPassthroughEngine() {
         // QUIRK: we only take ownership if this is a KM2 device.
         //        For KM1 the Keymaster1Engine takes ownership
-        if (std::is_same<KeymasterDeviceType, keymaster2_device_t>::value)
-            km_device_->common.close(
-                reinterpret_cast<hw_device_t*>(const_cast<KeymasterDeviceType*>(km_device_)));
+        if (std::is_same<KeymasterDeviceType, keymaster2_device_t>::value) {
+            for (auto device : sessions_.devices()) {
+                device->common.close(
+                    reinterpret_cast<hw_device_t*>(const_cast<KeymasterDeviceType*>(device)));
+            }
+        }
     }
 
     keymaster_error_t GenerateKey(const AuthorizationSet& key_description,
@@ -179,6 +183,7 @@ class TKeymasterPassthroughEngine : public KeymasterPassthroughEngine {
     TKeymasterPassthroughEngine(const KeymasterPassthroughEngine&) = delete;  // Uncopyable
     void operator=(const KeymasterPassthroughEngine&) = delete;               // Unassignable
 
+    const KeymasterPassthroughSessions<KeymasterDeviceType> sessions_;
     const KeymasterDeviceType* const km_device_;
     std::unique_ptr<opfactory_t> rsa_encrypt_op_factory_;
     std::unique_ptr<opfactory_t> rsa_decrypt_op_factory_;
@@ -296,10 +301,17 @@ keymaster_error_t TKeymasterPassthroughEngine<keymaster2_device_t>::ImportKey(
 typedef UniquePtr<KeymasterPassthroughEngine> engine_ptr_t;
 
 engine_ptr_t KeymasterPassthroughEngine::createInstance(const keymaster1_device_t* dev) {
-    return engine_ptr_t(new (std::nothrow) TKeymasterPassthroughEngine<keymaster1_device_t>(dev));
+    return engine_ptr_t(new (std::nothrow)
+                            TKeymasterPassthroughEngine<keymaster1_device_t>(&dev, 1));
 }
 engine_ptr_t KeymasterPassthroughEngine::createInstance(const keymaster2_device_t* dev) {
-    return engine_ptr_t(new (std::nothrow) TKeymasterPassthroughEngine<keymaster2_device_t>(dev));
+    return createInstance(&dev, 1);
+}
+engine_ptr_t KeymasterPassthroughEngine::createInstance(const keymaster2_device_t* const* devs,
+                                                        size_t count) {
+    if (!devs || count == 0) return {};
+    return engine_ptr_t(new (std::nothrow)
+                            TKeymasterPassthroughEngine<keymaster2_device_t>(devs, count));
 }
 
 }  // namespace keymaster
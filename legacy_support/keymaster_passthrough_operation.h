@@ -18,6 +18,9 @@
 #ifndef SYSTEM_KEYMASTER_KEYMASTER_PASSTHROUGH_OPERATION_H_
 #define SYSTEM_KEYMASTER_KEYMASTER_PASSTHROUGH_OPERATION_H_
 
+#include <atomic>
+#include <vector>
+
 #include <hardware/keymaster1.h>
 #include <hardware/keymaster2.h>
 
@@ -30,6 +33,30 @@ class AuthorizationSet;
 class Key;
 class Operation;
 
+/**
+ * The device sessions a passthrough engine dispatches operations to.  Each new operation is bound,
+ * round-robin, to one session and stays there until it completes, since a device only recognizes
+ * the handles it issued.  Clients see the device's handle, so sessions must issue handles that are
+ * unique across the pool.
+ */
+template <typename KeymasterDeviceType> class KeymasterPassthroughSessions {
+  public:
+    KeymasterPassthroughSessions(const KeymasterDeviceType* const* devices, size_t count)
+        : devices_(devices, devices + count) {}
+
+    const KeymasterDeviceType* primary() const { return devices_[0]; }
+    const std::vector<const KeymasterDeviceType*>& devices() const { return devices_; }
+
+    const KeymasterDeviceType* Next() const {
+        if (devices_.size() == 1) return devices_[0];
+        return devices_[next_.fetch_add(1, std::memory_order_relaxed) % devices_.size()];
+    }
+
+  private:
+    std::vector<const KeymasterDeviceType*> devices_;
+    mutable std::atomic<size_t> next_{0};
+};
+
 /**
  * Template implementation for KM1 and KM2 operations
  */
@@ -75,6 +102,9 @@ template <typename KeymasterDeviceType> class KeymasterPassthroughOperation : pu
                              Buffer* output) override;
     keymaster_error_t Abort() { return km_device_->abort(km_device_, operation_handle_); }
 
+    // The handle belongs to the wrapped device, which must keep seeing the one it issued.
+    bool set_operation_handle(keymaster_operation_handle_t) override { return false; }
+
   private:
     KeymasterKeyBlob key_blob_;
     const KeymasterDeviceType* km_device_;
@@ -92,10 +122,10 @@ keymaster_error_t KeymasterPassthroughOperation<keymaster2_device_t>::Finish(
 template <typename KeymasterDeviceType>
 class KeymasterPassthroughOperationFactory : public OperationFactory {
   public:
-    KeymasterPassthroughOperationFactory(keymaster_algorithm_t algorithm,
-                                         keymaster_purpose_t purpose,
-                                         const KeymasterDeviceType* km_device)
-        : key_type_(algorithm, purpose), km_device_(km_device) {}
+    KeymasterPassthroughOperationFactory(
+        keymaster_algorithm_t algorithm, keymaster_purpose_t purpose,
+        const KeymasterPassthroughSessions<KeymasterDeviceType>* sessions)
+        : key_type_(algorithm, purpose), sessions_(sessions) {}
     virtual ~KeymasterPassthroughOperationFactory() {}
 
     KeyType registry_key() const override { return key_type_; }
@@ -106,7 +136,7 @@ class KeymasterPassthroughOperationFactory : public OperationFactory {
         if (!error) return nullptr;
         *error = KM_ERROR_OK;
         OperationPtr op(new (std::nothrow) KeymasterPassthroughOperation<KeymasterDeviceType>(
-            key_type_.purpose, km_device_, std::move(key)));
+            key_type_.purpose, sessions_->Next(), std::move(key)));
         if (!op) {
             *error = KM_ERROR_MEMORY_ALLOCATION_FAILED;
         }
@@ -130,7 +160,7 @@ class KeymasterPassthroughOperationFactory : public OperationFactory {
 
   private:
     KeyType key_type_;
-    const KeymasterDeviceType* km_device_;
+    const KeymasterPassthroughSessions<KeymasterDeviceType>* sessions_;
 };
 
 }  // namespace keymaster
@@ -91,6 +91,7 @@ template <typename BaseOperation> class RsaKeymaster1Operation : public BaseOper
     keymaster_operation_handle_t operation_handle() const override {
         return wrapped_operation_.GetOperationHandle();
     }
+    bool set_operation_handle(keymaster_operation_handle_t) override { return false; }
 
   private:
     RsaKeymaster1WrappedOperation wrapped_operation_;
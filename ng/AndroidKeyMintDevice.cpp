@@ -20,10 +20,12 @@
 #include "AndroidKeyMintDevice.h"
 
 #include <aidl/android/hardware/security/keymint/ErrorCode.h>
+#include <android/binder_ibinder.h>
 
-#include <keymaster/android_keymaster.h>
+#include <keymaster/concurrent_android_keymaster.h>
 #include <keymaster/contexts/pure_soft_keymaster_context.h>
 #include <keymaster/keymaster_configuration.h>
+#include <keymaster/trace.h>
 
 #include "AndroidKeyMintOperation.h"
 #include "KeyMintUtils.h"
@@ -32,10 +34,11 @@ namespace aidl::android::hardware::security::keymint {
 
 using namespace keymaster;  // NOLINT(google-build-using-namespace)
 
-using km_utils::authToken2AidlVec;
 using km_utils::kmBlob2vector;
+using km_utils::kmBuffer2vector;
 using km_utils::kmError2ScopedAStatus;
 using km_utils::kmParam2Aidl;
+using km_utils::KmAuthToken;
 using km_utils::KmParamSet;
 using km_utils::kmParamSet2Aidl;
 using km_utils::legacy_enum_conversion;
@@ -43,11 +46,121 @@ using secureclock::TimeStampToken;
 
 namespace {
 
+enum class Enforcement { NONE, KEYMINT, KEYSTORE };
+
+// Where a pure software KeyMint reports the software-enforced |entry|, given the parameters the
+// key was generated or imported with.
+Enforcement softwareEnforcement(const keymaster_key_param_t& entry,
+                                const AuthorizationSet& requestParams) {
+    switch (entry.tag) {
+    /* Invalid and unused */
+    case KM_TAG_ECIES_SINGLE_HASH_MODE:
+    case KM_TAG_INVALID:
+    case KM_TAG_KDF:
+    case KM_TAG_ROLLBACK_RESISTANCE:
+        CHECK(false) << "We shouldn't see tag " << entry.tag;
+        break;
+
+    /* Unimplemented */
+    case KM_TAG_ALLOW_WHILE_ON_BODY:
+    case KM_TAG_BOOTLOADER_ONLY:
+    case KM_TAG_ROLLBACK_RESISTANT:
+    case KM_TAG_STORAGE_KEY:
+        break;
+
+    /* Keystore-enforced if not locally generated. */
+    case KM_TAG_CREATION_DATETIME:
+        // A KeyMaster implementation is required to add this tag to generated/imported keys.
+        // A KeyMint implementation is not required to create this tag, only to echo it back if
+        // it was included in the key generation/import request.
+        return requestParams.Contains(KM_TAG_CREATION_DATETIME) ? Enforcement::KEYSTORE
+                                                                 : Enforcement::NONE;
+
+    /* Disallowed in KeyCharacteristics */
+    case KM_TAG_APPLICATION_DATA:
+    case KM_TAG_ATTESTATION_APPLICATION_ID:
+        break;
+
+    /* Not key characteristics */
+    case KM_TAG_ASSOCIATED_DATA:
+    case KM_TAG_ATTESTATION_CHALLENGE:
+    case KM_TAG_ATTESTATION_ID_BRAND:
+    case KM_TAG_ATTESTATION_ID_DEVICE:
+    case KM_TAG_ATTESTATION_ID_IMEI:
+    case KM_TAG_ATTESTATION_ID_SECOND_IMEI:
+    case KM_TAG_ATTESTATION_ID_MANUFACTURER:
+    case KM_TAG_ATTESTATION_ID_MEID:
+    case KM_TAG_ATTESTATION_ID_MODEL:
+    case KM_TAG_ATTESTATION_ID_PRODUCT:
+    case KM_TAG_ATTESTATION_ID_SERIAL:
+    case KM_TAG_AUTH_TOKEN:
+    case KM_TAG_CERTIFICATE_SERIAL:
+    case KM_TAG_CERTIFICATE_SUBJECT:
+    case KM_TAG_CERTIFICATE_NOT_AFTER:
+    case KM_TAG_CERTIFICATE_NOT_BEFORE:
+    case KM_TAG_CONFIRMATION_TOKEN:
+    case KM_TAG_DEVICE_UNIQUE_ATTESTATION:
+    case KM_TAG_IDENTITY_CREDENTIAL_KEY:
+    case KM_TAG_INCLUDE_UNIQUE_ID:
+    case KM_TAG_MAC_LENGTH:
+    case KM_TAG_NONCE:
+    case KM_TAG_RESET_SINCE_ID_ROTATION:
+    case KM_TAG_ROOT_OF_TRUST:
+    case KM_TAG_UNIQUE_ID:
+        break;
+
+    /* KeyMint-enforced */
+    case KM_TAG_ALGORITHM:
+    case KM_TAG_APPLICATION_ID:
+    case KM_TAG_AUTH_TIMEOUT:
+    case KM_TAG_BLOB_USAGE_REQUIREMENTS:
+    case KM_TAG_BLOCK_MODE:
+    case KM_TAG_BOOT_PATCHLEVEL:
+    case KM_TAG_CALLER_NONCE:
+    case KM_TAG_DIGEST:
+    case KM_TAG_EARLY_BOOT_ONLY:
+    case KM_TAG_EC_CURVE:
+    case KM_TAG_EXPORTABLE:
+    case KM_TAG_KEY_SIZE:
+    case KM_TAG_MAX_USES_PER_BOOT:
+    case KM_TAG_MIN_MAC_LENGTH:
+    case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
+    case KM_TAG_NO_AUTH_REQUIRED:
+    case KM_TAG_ORIGIN:
+    case KM_TAG_OS_PATCHLEVEL:
+    case KM_TAG_OS_VERSION:
+    case KM_TAG_PADDING:
+    case KM_TAG_PURPOSE:
+    case KM_TAG_RSA_OAEP_MGF_DIGEST:
+    case KM_TAG_RSA_PUBLIC_EXPONENT:
+    case KM_TAG_TRUSTED_CONFIRMATION_REQUIRED:
+    case KM_TAG_TRUSTED_USER_PRESENCE_REQUIRED:
+    case KM_TAG_UNLOCKED_DEVICE_REQUIRED:
+    case KM_TAG_USER_AUTH_TYPE:
+    case KM_TAG_USER_SECURE_ID:
+    case KM_TAG_VENDOR_PATCHLEVEL:
+        return Enforcement::KEYMINT;
+
+    /* Keystore-enforced */
+    case KM_TAG_ACTIVE_DATETIME:
+    case KM_TAG_ALL_APPLICATIONS:
+    case KM_TAG_ALL_USERS:
+    case KM_TAG_MAX_BOOT_LEVEL:
+    case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
+    case KM_TAG_USAGE_EXPIRE_DATETIME:
+    case KM_TAG_USER_ID:
+    case KM_TAG_USAGE_COUNT_LIMIT:
+        return Enforcement::KEYSTORE;
+    }
+    return Enforcement::NONE;
+}
+
 vector<KeyCharacteristics> convertKeyCharacteristics(SecurityLevel keyMintSecurityLevel,
                                                      const AuthorizationSet& requestParams,
                                                      const AuthorizationSet& sw_enforced,
                                                      const AuthorizationSet& hw_enforced,
                                                      bool include_keystore_enforced = true) {
+    KEYMASTER_TRACE("convertKeyCharacteristics");
     KeyCharacteristics keyMintEnforced{keyMintSecurityLevel, {}};
 
     if (keyMintSecurityLevel != SecurityLevel::SOFTWARE) {
@@ -69,109 +182,18 @@ vector<KeyCharacteristics> convertKeyCharacteristics(SecurityLevel keyMintSecuri
     // This is a pure software implementation, so all tags are in sw_enforced.
     // We need to walk through the SW-enforced list and figure out which tags to
     // return in the software list and which in the keystore list.
+    // Reserve for the worst case so that neither list reallocates during the walk.
+    keyMintEnforced.authorizations.reserve(sw_enforced.size());
+    keystoreEnforced.authorizations.reserve(sw_enforced.size());
 
     for (auto& entry : sw_enforced) {
-        switch (entry.tag) {
-        /* Invalid and unused */
-        case KM_TAG_ECIES_SINGLE_HASH_MODE:
-        case KM_TAG_INVALID:
-        case KM_TAG_KDF:
-        case KM_TAG_ROLLBACK_RESISTANCE:
-            CHECK(false) << "We shouldn't see tag " << entry.tag;
-            break;
-
-        /* Unimplemented */
-        case KM_TAG_ALLOW_WHILE_ON_BODY:
-        case KM_TAG_BOOTLOADER_ONLY:
-        case KM_TAG_ROLLBACK_RESISTANT:
-        case KM_TAG_STORAGE_KEY:
-            break;
-
-        /* Keystore-enforced if not locally generated. */
-        case KM_TAG_CREATION_DATETIME:
-            // A KeyMaster implementation is required to add this tag to generated/imported keys.
-            // A KeyMint implementation is not required to create this tag, only to echo it back if
-            // it was included in the key generation/import request.
-            if (requestParams.Contains(KM_TAG_CREATION_DATETIME)) {
-                keystoreEnforced.authorizations.push_back(kmParam2Aidl(entry));
-            }
+        switch (softwareEnforcement(entry, requestParams)) {
+        case Enforcement::NONE:
             break;
-
-        /* Disallowed in KeyCharacteristics */
-        case KM_TAG_APPLICATION_DATA:
-        case KM_TAG_ATTESTATION_APPLICATION_ID:
-            break;
-
-        /* Not key characteristics */
-        case KM_TAG_ASSOCIATED_DATA:
-        case KM_TAG_ATTESTATION_CHALLENGE:
-        case KM_TAG_ATTESTATION_ID_BRAND:
-        case KM_TAG_ATTESTATION_ID_DEVICE:
-        case KM_TAG_ATTESTATION_ID_IMEI:
-        case KM_TAG_ATTESTATION_ID_SECOND_IMEI:
-        case KM_TAG_ATTESTATION_ID_MANUFACTURER:
-        case KM_TAG_ATTESTATION_ID_MEID:
-        case KM_TAG_ATTESTATION_ID_MODEL:
-        case KM_TAG_ATTESTATION_ID_PRODUCT:
-        case KM_TAG_ATTESTATION_ID_SERIAL:
-        case KM_TAG_AUTH_TOKEN:
-        case KM_TAG_CERTIFICATE_SERIAL:
-        case KM_TAG_CERTIFICATE_SUBJECT:
-        case KM_TAG_CERTIFICATE_NOT_AFTER:
-        case KM_TAG_CERTIFICATE_NOT_BEFORE:
-        case KM_TAG_CONFIRMATION_TOKEN:
-        case KM_TAG_DEVICE_UNIQUE_ATTESTATION:
-        case KM_TAG_IDENTITY_CREDENTIAL_KEY:
-        case KM_TAG_INCLUDE_UNIQUE_ID:
-        case KM_TAG_MAC_LENGTH:
-        case KM_TAG_NONCE:
-        case KM_TAG_RESET_SINCE_ID_ROTATION:
-        case KM_TAG_ROOT_OF_TRUST:
-        case KM_TAG_UNIQUE_ID:
-            break;
-
-        /* KeyMint-enforced */
-        case KM_TAG_ALGORITHM:
-        case KM_TAG_APPLICATION_ID:
-        case KM_TAG_AUTH_TIMEOUT:
-        case KM_TAG_BLOB_USAGE_REQUIREMENTS:
-        case KM_TAG_BLOCK_MODE:
-        case KM_TAG_BOOT_PATCHLEVEL:
-        case KM_TAG_CALLER_NONCE:
-        case KM_TAG_DIGEST:
-        case KM_TAG_EARLY_BOOT_ONLY:
-        case KM_TAG_EC_CURVE:
-        case KM_TAG_EXPORTABLE:
-        case KM_TAG_KEY_SIZE:
-        case KM_TAG_MAX_USES_PER_BOOT:
-        case KM_TAG_MIN_MAC_LENGTH:
-        case KM_TAG_MIN_SECONDS_BETWEEN_OPS:
-        case KM_TAG_NO_AUTH_REQUIRED:
-        case KM_TAG_ORIGIN:
-        case KM_TAG_OS_PATCHLEVEL:
-        case KM_TAG_OS_VERSION:
-        case KM_TAG_PADDING:
-        case KM_TAG_PURPOSE:
-        case KM_TAG_RSA_OAEP_MGF_DIGEST:
-        case KM_TAG_RSA_PUBLIC_EXPONENT:
-        case KM_TAG_TRUSTED_CONFIRMATION_REQUIRED:
-        case KM_TAG_TRUSTED_USER_PRESENCE_REQUIRED:
-        case KM_TAG_UNLOCKED_DEVICE_REQUIRED:
-        case KM_TAG_USER_AUTH_TYPE:
-        case KM_TAG_USER_SECURE_ID:
-        case KM_TAG_VENDOR_PATCHLEVEL:
+        case Enforcement::KEYMINT:
             keyMintEnforced.authorizations.push_back(kmParam2Aidl(entry));
             break;
-
-        /* Keystore-enforced */
-        case KM_TAG_ACTIVE_DATETIME:
-        case KM_TAG_ALL_APPLICATIONS:
-        case KM_TAG_ALL_USERS:
-        case KM_TAG_MAX_BOOT_LEVEL:
-        case KM_TAG_ORIGINATION_EXPIRE_DATETIME:
-        case KM_TAG_USAGE_EXPIRE_DATETIME:
-        case KM_TAG_USER_ID:
-        case KM_TAG_USAGE_COUNT_LIMIT:
+        case Enforcement::KEYSTORE:
             keystoreEnforced.authorizations.push_back(kmParam2Aidl(entry));
             break;
         }
@@ -187,6 +209,71 @@ vector<KeyCharacteristics> convertKeyCharacteristics(SecurityLevel keyMintSecuri
     return retval;
 }
 
+// Encodes the lists convertKeyCharacteristics() would return as a 32-bit count of lists, each a
+// 32-bit SecurityLevel followed by the list's AuthorizationSet::ColumnarSerialize() encoding.
+// Returns false if allocation fails.
+bool encodeColumnarCharacteristics(SecurityLevel keyMintSecurityLevel,
+                                   const AuthorizationSet& requestParams,
+                                   const AuthorizationSet& sw_enforced,
+                                   const AuthorizationSet& hw_enforced,
+                                   bool include_keystore_enforced, vector<uint8_t>* record) {
+    KEYMASTER_TRACE("encodeColumnarCharacteristics");
+    // The split lists' storage only has to last for this call.
+    Arena arena;
+    AuthorizationSet keyMintSplit;
+    AuthorizationSet keystoreSplit;
+    keyMintSplit.set_arena(&arena);
+    keystoreSplit.set_arena(&arena);
+
+    const AuthorizationSet* keyMintEnforced = &hw_enforced;
+    const AuthorizationSet* keystoreEnforced = &sw_enforced;
+    if (keyMintSecurityLevel == SecurityLevel::SOFTWARE) {
+        CHECK(hw_enforced.empty()) << "Hardware-enforced list is non-empty for pure SW KeyMint";
+        if (!keyMintSplit.reserve_elems(sw_enforced.size()) ||
+            !keystoreSplit.reserve_elems(sw_enforced.size())) {
+            return false;
+        }
+        for (auto& entry : sw_enforced) {
+            switch (softwareEnforcement(entry, requestParams)) {
+            case Enforcement::NONE:
+                break;
+            case Enforcement::KEYMINT:
+                if (!keyMintSplit.push_back(entry)) return false;
+                break;
+            case Enforcement::KEYSTORE:
+                if (!keystoreSplit.push_back(entry)) return false;
+                break;
+            }
+        }
+        keyMintEnforced = &keyMintSplit;
+        keystoreEnforced = &keystoreSplit;
+    }
+
+    std::pair<SecurityLevel, const AuthorizationSet*> lists[2];
+    uint32_t listCount = 0;
+    // Outside pure software, the KeyMint list is returned even when it is empty.
+    if (keyMintSecurityLevel != SecurityLevel::SOFTWARE || !keyMintEnforced->empty()) {
+        lists[listCount++] = {keyMintSecurityLevel, keyMintEnforced};
+    }
+    if (include_keystore_enforced && !keystoreEnforced->empty()) {
+        lists[listCount++] = {SecurityLevel::KEYSTORE, keystoreEnforced};
+    }
+
+    size_t size = sizeof(listCount);
+    for (uint32_t i = 0; i < listCount; ++i) {
+        size += sizeof(uint32_t) + lists[i].second->ColumnarSerializedSize();
+    }
+    record->resize(size);
+    uint8_t* buf = record->data();
+    const uint8_t* end = buf + size;
+    buf = append_uint32_to_buf(buf, end, listCount);
+    for (uint32_t i = 0; i < listCount; ++i) {
+        buf = append_uint32_to_buf(buf, end, static_cast<uint32_t>(lists[i].first));
+        buf = lists[i].second->ColumnarSerialize(buf, end);
+    }
+    return buf == end;
+}
+
 Certificate convertCertificate(const keymaster_blob_t& cert) {
     return {std::vector<uint8_t>(cert.data, cert.data + cert.data_length)};
 }
@@ -211,13 +298,14 @@ void addClientAndAppData(const std::vector<uint8_t>& appId, const std::vector<ui
 
 }  // namespace
 
-constexpr size_t kOperationTableSize = 16;
+const PureSoftKeymasterContextConfig kContextConfig;
 
 AndroidKeyMintDevice::AndroidKeyMintDevice(SecurityLevel securityLevel)
-    : impl_(new(std::nothrow)::keymaster::AndroidKeymaster(
+    : impl_(new(std::nothrow)::keymaster::ConcurrentAndroidKeymaster(
           [&]() -> auto{
               auto context = new (std::nothrow) PureSoftKeymasterContext(
-                  KmVersion::KEYMINT_3, static_cast<keymaster_security_level_t>(securityLevel));
+                  KmVersion::KEYMINT_3, static_cast<keymaster_security_level_t>(securityLevel),
+                  kContextConfig);
               context->SetSystemVersion(::keymaster::GetOsVersion(),
                                         ::keymaster::GetOsPatchlevel());
               context->SetVendorPatchlevel(::keymaster::GetVendorPatchlevel());
@@ -236,7 +324,7 @@ AndroidKeyMintDevice::AndroidKeyMintDevice(SecurityLevel securityLevel)
               }
               return context;
           }(),
-          kOperationTableSize)),
+          kContextConfig.operation_table_size)),
       securityLevel_(securityLevel) {}
 
 AndroidKeyMintDevice::~AndroidKeyMintDevice() {}
@@ -251,6 +339,7 @@ ScopedAStatus AndroidKeyMintDevice::getHardwareInfo(KeyMintHardwareInfo* info) {
 }
 
 ScopedAStatus AndroidKeyMintDevice::addRngEntropy(const vector<uint8_t>& data) {
+    KEYMASTER_TRACE("IKeyMintDevice::addRngEntropy");
     if (data.size() == 0) {
         return ScopedAStatus::ok();
     }
@@ -267,8 +356,12 @@ ScopedAStatus AndroidKeyMintDevice::addRngEntropy(const vector<uint8_t>& data) {
 ScopedAStatus AndroidKeyMintDevice::generateKey(const vector<KeyParameter>& keyParams,
                                                 const optional<AttestationKey>& attestationKey,
                                                 KeyCreationResult* creationResult) {
-
+    KEYMASTER_TRACE("IKeyMintDevice::generateKey");
+    // The messages' storage only has to last for this call.
+    Arena arena;
     GenerateKeyRequest request(impl_->message_version());
+    request.key_description.set_arena(&arena);
+    request.attest_key_params.set_arena(&arena);
     request.key_description.Reinitialize(KmParamSet(keyParams));
     if (attestationKey) {
         request.attestation_signing_key_blob =
@@ -279,6 +372,8 @@ ScopedAStatus AndroidKeyMintDevice::generateKey(const vector<KeyParameter>& keyP
     }
 
     GenerateKeyResponse response(impl_->message_version());
+    response.enforced.set_arena(&arena);
+    response.unenforced.set_arena(&arena);
     impl_->GenerateKey(request, &response);
 
     if (response.error != KM_ERROR_OK) {
@@ -305,8 +400,11 @@ ScopedAStatus AndroidKeyMintDevice::importKey(const vector<KeyParameter>& keyPar
                                               KeyFormat keyFormat, const vector<uint8_t>& keyData,
                                               const optional<AttestationKey>& attestationKey,
                                               KeyCreationResult* creationResult) {
-
+    KEYMASTER_TRACE("IKeyMintDevice::importKey");
+    Arena arena;
     ImportKeyRequest request(impl_->message_version());
+    request.key_description.set_arena(&arena);
+    request.attest_key_params.set_arena(&arena);
     request.key_description.Reinitialize(KmParamSet(keyParams));
     request.key_format = legacy_enum_conversion(keyFormat);
     request.key_data = KeymasterKeyBlob(keyData.data(), keyData.size());
@@ -319,6 +417,8 @@ ScopedAStatus AndroidKeyMintDevice::importKey(const vector<KeyParameter>& keyPar
     }
 
     ImportKeyResponse response(impl_->message_version());
+    response.enforced.set_arena(&arena);
+    response.unenforced.set_arena(&arena);
     impl_->ImportKey(request, &response);
 
     if (response.error != KM_ERROR_OK) {
@@ -340,7 +440,7 @@ AndroidKeyMintDevice::importWrappedKey(const vector<uint8_t>& wrappedKeyData,
                                        const vector<KeyParameter>& unwrappingParams,  //
                                        int64_t passwordSid, int64_t biometricSid,     //
                                        KeyCreationResult* creationResult) {
-
+    KEYMASTER_TRACE("IKeyMintDevice::importWrappedKey");
     ImportWrappedKeyRequest request(impl_->message_version());
     request.SetWrappedMaterial(wrappedKeyData.data(), wrappedKeyData.size());
     request.SetWrappingMaterial(wrappingKeyBlob.data(), wrappingKeyBlob.size());
@@ -367,7 +467,7 @@ AndroidKeyMintDevice::importWrappedKey(const vector<uint8_t>& wrappedKeyData,
 ScopedAStatus AndroidKeyMintDevice::upgradeKey(const vector<uint8_t>& keyBlobToUpgrade,
                                                const vector<KeyParameter>& upgradeParams,
                                                vector<uint8_t>* keyBlob) {
-
+    KEYMASTER_TRACE("IKeyMintDevice::upgradeKey");
     UpgradeKeyRequest request(impl_->message_version());
     request.SetKeyMaterial(keyBlobToUpgrade.data(), keyBlobToUpgrade.size());
     request.upgrade_params.Reinitialize(KmParamSet(upgradeParams));
@@ -384,6 +484,7 @@ ScopedAStatus AndroidKeyMintDevice::upgradeKey(const vector<uint8_t>& keyBlobToU
 }
 
 ScopedAStatus AndroidKeyMintDevice::deleteKey(const vector<uint8_t>& keyBlob) {
+    KEYMASTER_TRACE("IKeyMintDevice::deleteKey");
     DeleteKeyRequest request(impl_->message_version());
     request.SetKeyMaterial(keyBlob.data(), keyBlob.size());
 
@@ -394,6 +495,7 @@ ScopedAStatus AndroidKeyMintDevice::deleteKey(const vector<uint8_t>& keyBlob) {
 }
 
 ScopedAStatus AndroidKeyMintDevice::deleteAllKeys() {
+    KEYMASTER_TRACE("IKeyMintDevice::deleteAllKeys");
     // There's nothing to be done to delete software key blobs.
     DeleteAllKeysRequest request(impl_->message_version());
     DeleteAllKeysResponse response(impl_->message_version());
@@ -410,18 +512,20 @@ ScopedAStatus AndroidKeyMintDevice::begin(KeyPurpose purpose, const vector<uint8
                                           const vector<KeyParameter>& params,
                                           const optional<HardwareAuthToken>& authToken,
                                           BeginResult* result) {
-
+    KEYMASTER_TRACE("IKeyMintDevice::begin");
+    Arena arena;
     BeginOperationRequest request(impl_->message_version());
+    request.additional_params.set_arena(&arena);
     request.purpose = legacy_enum_conversion(purpose);
     request.SetKeyMaterial(keyBlob.data(), keyBlob.size());
     request.additional_params.Reinitialize(KmParamSet(params));
 
-    vector<uint8_t> vector_token = authToken2AidlVec(authToken);
-    request.additional_params.push_back(
-        TAG_AUTH_TOKEN, reinterpret_cast<uint8_t*>(vector_token.data()), vector_token.size());
+    KmAuthToken token(authToken);
+    request.additional_params.push_back(TAG_AUTH_TOKEN, token.data(), token.size());
 
     BeginOperationResponse response(impl_->message_version());
-    impl_->BeginOperation(request, &response);
+    response.output_params.set_arena(&arena);
+    impl_->BeginOperation(request, &response, static_cast<uint32_t>(AIBinder_getCallingUid()));
 
     if (response.error != KM_ERROR_OK) {
         return kmError2ScopedAStatus(response.error);
@@ -429,13 +533,49 @@ ScopedAStatus AndroidKeyMintDevice::begin(KeyPurpose purpose, const vector<uint8
 
     result->params = kmParamSet2Aidl(response.output_params);
     result->challenge = response.op_handle;
-    result->operation =
-        ndk::SharedRefBase::make<AndroidKeyMintOperation>(impl_, response.op_handle);
+    auto operation = ndk::SharedRefBase::make<AndroidKeyMintOperation>(impl_, response.op_handle);
+    if (operationPipelineDepth_) operation->enablePipelining(operationPipelineDepth_);
+    result->operation = std::move(operation);
+    return ScopedAStatus::ok();
+}
+
+ScopedAStatus AndroidKeyMintDevice::oneShotOperation(
+    KeyPurpose purpose, const vector<uint8_t>& keyBlob, const vector<KeyParameter>& params,
+    const optional<HardwareAuthToken>& authToken, const vector<uint8_t>& input,
+    const optional<vector<uint8_t>>& signature, vector<KeyParameter>* outParams,
+    vector<uint8_t>* output) {
+    KEYMASTER_TRACE("IKeyMintDevice::oneShotOperation");
+    if (!outParams || !output) return kmError2ScopedAStatus(KM_ERROR_OUTPUT_PARAMETER_NULL);
+
+    Arena arena;
+    OneShotOperationRequest request(impl_->message_version());
+    request.additional_params.set_arena(&arena);
+    request.input.set_arena(&arena);
+    request.signature.set_arena(&arena);
+    request.purpose = legacy_enum_conversion(purpose);
+    request.SetKeyMaterial(keyBlob.data(), keyBlob.size());
+    request.additional_params.Reinitialize(KmParamSet(params));
+    request.input.Reinitialize(input.data(), input.size());
+    if (signature) request.signature.Reinitialize(signature->data(), signature->size());
+
+    KmAuthToken token(authToken);
+    request.additional_params.push_back(TAG_AUTH_TOKEN, token.data(), token.size());
+
+    OneShotOperationResponse response(impl_->message_version());
+    response.output_params.set_arena(&arena);
+    response.output.set_arena(&arena);
+    impl_->OneShotOperation(request, &response);
+
+    if (response.error != KM_ERROR_OK) return kmError2ScopedAStatus(response.error);
+
+    *outParams = kmParamSet2Aidl(response.output_params);
+    *output = kmBuffer2vector(response.output);
     return ScopedAStatus::ok();
 }
 
 ScopedAStatus AndroidKeyMintDevice::deviceLocked(
     bool passwordOnly, const std::optional<secureclock::TimeStampToken>& timestampToken) {
+    KEYMASTER_TRACE("IKeyMintDevice::deviceLocked");
     DeviceLockedRequest request(impl_->message_version());
     request.passwordOnly = passwordOnly;
     if (timestampToken.has_value()) {
@@ -448,6 +588,7 @@ ScopedAStatus AndroidKeyMintDevice::deviceLocked(
 }
 
 ScopedAStatus AndroidKeyMintDevice::earlyBootEnded() {
+    KEYMASTER_TRACE("IKeyMintDevice::earlyBootEnded");
     EarlyBootEndedResponse response = impl_->EarlyBootEnded();
     return kmError2ScopedAStatus(response.error);
 }
@@ -461,6 +602,7 @@ AndroidKeyMintDevice::convertStorageKeyToEphemeral(const std::vector<uint8_t>& /
 ScopedAStatus AndroidKeyMintDevice::getKeyCharacteristics(
     const std::vector<uint8_t>& keyBlob, const std::vector<uint8_t>& appId,
     const std::vector<uint8_t>& appData, std::vector<KeyCharacteristics>* keyCharacteristics) {
+    KEYMASTER_TRACE("IKeyMintDevice::getKeyCharacteristics");
     GetKeyCharacteristicsRequest request(impl_->message_version());
     request.SetKeyMaterial(keyBlob.data(), keyBlob.size());
     addClientAndAppData(appId, appData, &request.additional_params);
@@ -480,6 +622,31 @@ ScopedAStatus AndroidKeyMintDevice::getKeyCharacteristics(
     return ScopedAStatus::ok();
 }
 
+ScopedAStatus AndroidKeyMintDevice::getKeyCharacteristicsColumnar(
+    const std::vector<uint8_t>& keyBlob, const std::vector<uint8_t>& appId,
+    const std::vector<uint8_t>& appData, std::vector<uint8_t>* record) {
+    KEYMASTER_TRACE("AndroidKeyMintDevice::getKeyCharacteristicsColumnar");
+    GetKeyCharacteristicsRequest request(impl_->message_version());
+    request.SetKeyMaterial(keyBlob.data(), keyBlob.size());
+    addClientAndAppData(appId, appData, &request.additional_params);
+
+    GetKeyCharacteristicsResponse response(impl_->message_version());
+    impl_->GetKeyCharacteristics(request, &response);
+
+    if (response.error != KM_ERROR_OK) {
+        return kmError2ScopedAStatus(response.error);
+    }
+
+    AuthorizationSet emptySet;
+    if (!encodeColumnarCharacteristics(securityLevel_, emptySet, response.unenforced,
+                                       response.enforced,
+                                       /* include_keystore_enforced = */ false, record)) {
+        return kmError2ScopedAStatus(KM_ERROR_MEMORY_ALLOCATION_FAILED);
+    }
+
+    return ScopedAStatus::ok();
+}
+
 ScopedAStatus AndroidKeyMintDevice::getRootOfTrustChallenge(array<uint8_t, 16>* /* challenge */) {
     return kmError2ScopedAStatus(KM_ERROR_UNIMPLEMENTED);
 }
@@ -23,6 +23,7 @@
 #include <aidl/android/hardware/security/secureclock/ISecureClock.h>
 
 #include <keymaster/android_keymaster.h>
+#include <keymaster/trace.h>
 
 #include "KeyMintUtils.h"
 
@@ -38,6 +39,14 @@ using ::keymaster::UpdateOperationResponse;
 using secureclock::TimeStampToken;
 using namespace km_utils;  // NOLINT(google-build-using-namespace)
 
+namespace {
+
+// Block ciphers emit at most one block more than they are given in an update, so an output vector
+// this much larger than the input can take the output directly.
+constexpr size_t kMaxUpdateOutputOverhead = 16;
+
+}  // namespace
+
 AndroidKeyMintOperation::AndroidKeyMintOperation(
     shared_ptr<::keymaster::AndroidKeymaster> implementation, keymaster_operation_handle_t opHandle)
     : impl_(std::move(implementation)), opHandle_(opHandle) {}
@@ -46,19 +55,29 @@ AndroidKeyMintOperation::~AndroidKeyMintOperation() {
     if (opHandle_ != 0) {
         abort();
     }
+    stopPipeline();
+}
+
+void AndroidKeyMintOperation::enablePipelining(size_t depth) {
+    pipelineDepth_ = depth;
 }
 
 ScopedAStatus
 AndroidKeyMintOperation::updateAad(const vector<uint8_t>& input,
                                    const optional<HardwareAuthToken>& authToken,
                                    const optional<TimeStampToken>& /* timestampToken */) {
+    KEYMASTER_TRACE("IKeyMintOperation::updateAad");
+    if (pipelineDepth_) {
+        keymaster_error_t error = drainPipeline(nullptr /* output */);
+        if (error != KM_ERROR_OK) return kmError2ScopedAStatus(error);
+    }
+
     UpdateOperationRequest request(impl_->message_version());
     request.op_handle = opHandle_;
     request.additional_params.push_back(TAG_ASSOCIATED_DATA, input.data(), input.size());
     if (authToken) {
-        auto tokenAsVec(authToken2AidlVec(*authToken));
-        request.additional_params.push_back(keymaster::TAG_AUTH_TOKEN, tokenAsVec.data(),
-                                            tokenAsVec.size());
+        KmAuthToken token(*authToken);
+        request.additional_params.push_back(keymaster::TAG_AUTH_TOKEN, token.data(), token.size());
     }
 
     UpdateOperationResponse response(impl_->message_version());
@@ -72,29 +91,123 @@ ScopedAStatus AndroidKeyMintOperation::update(const vector<uint8_t>& input,
                                               const optional<TimeStampToken>&
                                               /* timestampToken */,
                                               vector<uint8_t>* output) {
+    KEYMASTER_TRACE("IKeyMintOperation::update");
     if (!output) return kmError2ScopedAStatus(KM_ERROR_OUTPUT_PARAMETER_NULL);
+    if (pipelineDepth_) return queueUpdate(input, authToken, output);
+    return kmError2ScopedAStatus(updateNow(input, authToken, output));
+}
 
+keymaster_error_t AndroidKeyMintOperation::updateNow(const vector<uint8_t>& input,
+                                                     const optional<HardwareAuthToken>& authToken,
+                                                     vector<uint8_t>* output) {
+    // The messages' storage only has to last for this call.
+    ::keymaster::Arena arena;
     UpdateOperationRequest request(impl_->message_version());
+    request.input.set_arena(&arena);
+    request.additional_params.set_arena(&arena);
     request.op_handle = opHandle_;
     request.input.Reinitialize(input.data(), input.size());
     if (authToken) {
-        auto tokenAsVec(authToken2AidlVec(*authToken));
-        request.additional_params.push_back(keymaster::TAG_AUTH_TOKEN, tokenAsVec.data(),
-                                            tokenAsVec.size());
+        KmAuthToken token(*authToken);
+        request.additional_params.push_back(keymaster::TAG_AUTH_TOKEN, token.data(), token.size());
     }
 
     UpdateOperationResponse response(impl_->message_version());
+    response.output_params.set_arena(&arena);
+    output->resize(input.size() + kMaxUpdateOutputOverhead);
+    response.output.UseExternalStorage(output->data(), output->size());
     impl_->UpdateOperation(request, &response);
 
-    if (response.error != KM_ERROR_OK) return kmError2ScopedAStatus(response.error);
+    if (response.error != KM_ERROR_OK) {
+        output->clear();
+        return response.error;
+    }
     if (response.input_consumed != request.input.buffer_size()) {
-        return kmError2ScopedAStatus(KM_ERROR_UNKNOWN_ERROR);
+        output->clear();
+        return KM_ERROR_UNKNOWN_ERROR;
+    }
+
+    if (!response.output.uses_external_storage()) {
+        // The operation produced more than expected and the output moved to its own storage.
+        *output = kmBuffer2vector(response.output);
+        return KM_ERROR_OK;
+    }
+    size_t output_length = response.output.available_read();
+    if (response.output.peek_read() != output->data()) {
+        memmove(output->data(), response.output.peek_read(), output_length);
+    }
+    output->resize(output_length);
+    return KM_ERROR_OK;
+}
+
+ScopedAStatus AndroidKeyMintOperation::queueUpdate(const vector<uint8_t>& input,
+                                                   const optional<HardwareAuthToken>& authToken,
+                                                   vector<uint8_t>* output) {
+    std::unique_lock<std::mutex> lock(pipelineMutex_);
+    if (stopping_) return kmError2ScopedAStatus(KM_ERROR_INVALID_OPERATION_HANDLE);  // Aborted.
+    if (!pipelineWorker_.joinable()) pipelineWorker_ = std::thread([this] { runPipeline(); });
+    pipelineCv_.wait(lock, [&] {
+        return pendingChunks_.size() < pipelineDepth_ || pipelineError_ != KM_ERROR_OK;
+    });
+    if (pipelineError_ != KM_ERROR_OK) {
+        output->clear();
+        return kmError2ScopedAStatus(pipelineError_);
     }
 
-    *output = kmBuffer2vector(response.output);
+    pendingChunks_.push_back({input, authToken});
+    *output = std::move(pipelinedOutput_);
+    pipelinedOutput_.clear();
+    lock.unlock();
+    pipelineCv_.notify_all();
     return ScopedAStatus::ok();
 }
 
+void AndroidKeyMintOperation::runPipeline() {
+    std::unique_lock<std::mutex> lock(pipelineMutex_);
+    for (;;) {
+        pipelineCv_.wait(lock, [&] { return stopping_ || !pendingChunks_.empty(); });
+        if (stopping_) return;
+
+        PipelinedChunk chunk = std::move(pendingChunks_.front());
+        pendingChunks_.pop_front();
+        chunkInFlight_ = true;
+        lock.unlock();
+        vector<uint8_t> chunkOutput;
+        keymaster_error_t error = updateNow(chunk.input, chunk.authToken, &chunkOutput);
+        lock.lock();
+        chunkInFlight_ = false;
+
+        if (error != KM_ERROR_OK) {
+            // A failed update ends the operation, so the rest of the queue can't be processed.
+            if (pipelineError_ == KM_ERROR_OK) pipelineError_ = error;
+            pendingChunks_.clear();
+        } else {
+            pipelinedOutput_.insert(pipelinedOutput_.end(), chunkOutput.begin(), chunkOutput.end());
+        }
+        pipelineCv_.notify_all();
+    }
+}
+
+keymaster_error_t AndroidKeyMintOperation::drainPipeline(vector<uint8_t>* output) {
+    std::unique_lock<std::mutex> lock(pipelineMutex_);
+    pipelineCv_.wait(lock, [&] { return pendingChunks_.empty() && !chunkInFlight_; });
+    if (output) {
+        *output = std::move(pipelinedOutput_);
+        pipelinedOutput_.clear();
+    }
+    return pipelineError_;
+}
+
+void AndroidKeyMintOperation::stopPipeline() {
+    {
+        std::lock_guard<std::mutex> lock(pipelineMutex_);
+        stopping_ = true;
+        pendingChunks_.clear();
+    }
+    pipelineCv_.notify_all();
+    if (pipelineWorker_.joinable()) pipelineWorker_.join();
+}
+
 ScopedAStatus
 AndroidKeyMintOperation::finish(const optional<vector<uint8_t>>& input,      //
                                 const optional<vector<uint8_t>>& signature,  //
@@ -102,33 +215,54 @@ AndroidKeyMintOperation::finish(const optional<vector<uint8_t>>& input,      //
                                 const optional<TimeStampToken>& /* timestampToken */,
                                 const optional<vector<uint8_t>>& /* confirmationToken */,
                                 vector<uint8_t>* output) {
-
+    KEYMASTER_TRACE("IKeyMintOperation::finish");
     if (!output) {
         return ScopedAStatus(AStatus_fromServiceSpecificError(
             static_cast<int32_t>(ErrorCode::OUTPUT_PARAMETER_NULL)));
     }
+    vector<uint8_t> pipelinedOutput;
+    if (pipelineDepth_) {
+        keymaster_error_t error = drainPipeline(&pipelinedOutput);
+        if (error != KM_ERROR_OK) {
+            opHandle_ = 0;
+            return kmError2ScopedAStatus(error);
+        }
+    }
 
+    ::keymaster::Arena arena;
     FinishOperationRequest request(impl_->message_version());
+    request.input.set_arena(&arena);
+    request.signature.set_arena(&arena);
+    request.additional_params.set_arena(&arena);
     request.op_handle = opHandle_;
     if (input) request.input.Reinitialize(input->data(), input->size());
     if (signature) request.signature.Reinitialize(signature->data(), signature->size());
     if (authToken) {
-        auto tokenAsVec(authToken2AidlVec(*authToken));
-        request.additional_params.push_back(keymaster::TAG_AUTH_TOKEN, tokenAsVec.data(),
-                                            tokenAsVec.size());
+        KmAuthToken token(*authToken);
+        request.additional_params.push_back(keymaster::TAG_AUTH_TOKEN, token.data(), token.size());
     }
 
     FinishOperationResponse response(impl_->message_version());
+    response.output.set_arena(&arena);
+    response.output_params.set_arena(&arena);
     impl_->FinishOperation(request, &response);
     opHandle_ = 0;
 
     if (response.error != KM_ERROR_OK) return kmError2ScopedAStatus(response.error);
 
-    *output = kmBuffer2vector(response.output);
+    if (pipelinedOutput.empty()) {
+        *output = kmBuffer2vector(response.output);
+    } else {
+        pipelinedOutput.insert(pipelinedOutput.end(), response.output.begin(),
+                               response.output.end());
+        *output = std::move(pipelinedOutput);
+    }
     return ScopedAStatus::ok();
 }
 
 ScopedAStatus AndroidKeyMintOperation::abort() {
+    KEYMASTER_TRACE("IKeyMintOperation::abort");
+    stopPipeline();
     AbortOperationRequest request(impl_->message_version());
     request.op_handle = opHandle_;
 
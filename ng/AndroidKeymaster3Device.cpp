@@ -82,46 +82,60 @@ inline keymaster_tag_type_t typeFromTag(const keymaster_tag_t tag) {
     return keymaster_tag_get_type(tag);
 }
 
+inline keymaster_key_param_t hidlKeyParam2Km(const KeyParameter& param) {
+    auto tag = legacy_enum_conversion(param.tag);
+    switch (typeFromTag(tag)) {
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        return keymaster_param_enum(tag, param.f.integer);
+    case KM_UINT:
+    case KM_UINT_REP:
+        return keymaster_param_int(tag, param.f.integer);
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        return keymaster_param_long(tag, param.f.longInteger);
+    case KM_DATE:
+        return keymaster_param_date(tag, param.f.dateTime);
+    case KM_BOOL:
+        if (param.f.boolValue) return keymaster_param_bool(tag);
+        break;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        return keymaster_param_blob(tag, param.blob.data(), param.blob.size());
+    case KM_INVALID:
+    default:
+        /* just skip */
+        break;
+    }
+    keymaster_key_param_t invalid;
+    invalid.tag = KM_TAG_INVALID;
+    return invalid;
+}
+
+// Converts |keyParams| straight into |set|, replacing its contents, and reserves room for
+// |more_elems| further entries with |more_indirect_bytes| of blob data.  Unlike Reinitialize() from
+// a KmParamSet, this builds no intermediate array and the set allocates once.
+void hidlKeyParams2AuthSet(const hidl_vec<KeyParameter>& keyParams, size_t more_elems,
+                           size_t more_indirect_bytes, ::keymaster::AuthorizationSet* set) {
+    size_t indirect_bytes = more_indirect_bytes;
+    for (const auto& param : keyParams) {
+        auto type = typeFromTag(legacy_enum_conversion(param.tag));
+        if (type == KM_BYTES || type == KM_BIGNUM) indirect_bytes += param.blob.size();
+    }
+    set->Clear();
+    set->Reserve(keyParams.size() + more_elems, indirect_bytes);
+    for (const auto& param : keyParams) {
+        set->push_back(hidlKeyParam2Km(param));
+    }
+}
+
 class KmParamSet : public keymaster_key_param_set_t {
   public:
     explicit KmParamSet(const hidl_vec<KeyParameter>& keyParams) {
         params = new (std::nothrow) keymaster_key_param_t[keyParams.size()];
-        length = keyParams.size();
-        for (size_t i = 0; i < keyParams.size(); ++i) {
-            auto tag = legacy_enum_conversion(keyParams[i].tag);
-            switch (typeFromTag(tag)) {
-            case KM_ENUM:
-            case KM_ENUM_REP:
-                params[i] = keymaster_param_enum(tag, keyParams[i].f.integer);
-                break;
-            case KM_UINT:
-            case KM_UINT_REP:
-                params[i] = keymaster_param_int(tag, keyParams[i].f.integer);
-                break;
-            case KM_ULONG:
-            case KM_ULONG_REP:
-                params[i] = keymaster_param_long(tag, keyParams[i].f.longInteger);
-                break;
-            case KM_DATE:
-                params[i] = keymaster_param_date(tag, keyParams[i].f.dateTime);
-                break;
-            case KM_BOOL:
-                if (keyParams[i].f.boolValue)
-                    params[i] = keymaster_param_bool(tag);
-                else
-                    params[i].tag = KM_TAG_INVALID;
-                break;
-            case KM_BIGNUM:
-            case KM_BYTES:
-                params[i] =
-                    keymaster_param_blob(tag, &keyParams[i].blob[0], keyParams[i].blob.size());
-                break;
-            case KM_INVALID:
-            default:
-                params[i].tag = KM_TAG_INVALID;
-                /* just skip */
-                break;
-            }
+        length = params ? keyParams.size() : 0;
+        for (size_t i = 0; i < length; ++i) {
+            params[i] = hidlKeyParam2Km(keyParams[i]);
         }
     }
     KmParamSet(KmParamSet&& other) : keymaster_key_param_set_t{other.params, other.length} {
@@ -433,7 +447,8 @@ Return<void> AndroidKeymaster3Device::begin(KeyPurpose purpose, const hidl_vec<u
     BeginOperationRequest request(impl_->message_version());
     request.purpose = legacy_enum_conversion(purpose);
     request.SetKeyMaterial(key.data(), key.size());
-    request.additional_params.Reinitialize(KmParamSet(inParams));
+    hidlKeyParams2AuthSet(inParams, 0 /* more_elems */, 0 /* more_indirect_bytes */,
+                          &request.additional_params);
 
     BeginOperationResponse response(impl_->message_version());
     impl_->BeginOperation(request, &response);
@@ -18,6 +18,8 @@
 #define LOG_TAG "android.hardware.keymaster@4.0-impl"
 #include <log/log.h>
 
+#include <algorithm>
+
 #include "include/AndroidKeymaster4Device.h"
 
 #include <keymasterV4_0/authorization_set.h>
@@ -73,6 +75,53 @@ inline keymaster_tag_type_t typeFromTag(const keymaster_tag_t tag) {
     return keymaster_tag_get_type(tag);
 }
 
+inline keymaster_key_param_t hidlKeyParam2Km(const KeyParameter& param) {
+    auto tag = legacy_enum_conversion(param.tag);
+    switch (typeFromTag(tag)) {
+    case KM_ENUM:
+    case KM_ENUM_REP:
+        return keymaster_param_enum(tag, param.f.integer);
+    case KM_UINT:
+    case KM_UINT_REP:
+        return keymaster_param_int(tag, param.f.integer);
+    case KM_ULONG:
+    case KM_ULONG_REP:
+        return keymaster_param_long(tag, param.f.longInteger);
+    case KM_DATE:
+        return keymaster_param_date(tag, param.f.dateTime);
+    case KM_BOOL:
+        if (param.f.boolValue) return keymaster_param_bool(tag);
+        break;
+    case KM_BIGNUM:
+    case KM_BYTES:
+        return keymaster_param_blob(tag, param.blob.data(), param.blob.size());
+    case KM_INVALID:
+    default:
+        /* just skip */
+        break;
+    }
+    keymaster_key_param_t invalid;
+    invalid.tag = KM_TAG_INVALID;
+    return invalid;
+}
+
+// Converts |keyParams| straight into |set|, replacing its contents, and reserves room for
+// |more_elems| further entries with |more_indirect_bytes| of blob data.  Unlike Reinitialize() from
+// a KmParamSet, this builds no intermediate array and the set allocates once.
+void hidlKeyParams2AuthSet(const hidl_vec<KeyParameter>& keyParams, size_t more_elems,
+                           size_t more_indirect_bytes, ::keymaster::AuthorizationSet* set) {
+    size_t indirect_bytes = more_indirect_bytes;
+    for (const auto& param : keyParams) {
+        auto type = typeFromTag(legacy_enum_conversion(param.tag));
+        if (type == KM_BYTES || type == KM_BIGNUM) indirect_bytes += param.blob.size();
+    }
+    set->Clear();
+    set->Reserve(keyParams.size() + more_elems, indirect_bytes);
+    for (const auto& param : keyParams) {
+        set->push_back(hidlKeyParam2Km(param));
+    }
+}
+
 class KmParamSet : public keymaster_key_param_set_t {
   public:
     explicit KmParamSet(const hidl_vec<KeyParameter>& keyParams)
@@ -176,43 +225,9 @@ keymaster_key_param_set_t hidlKeyParams2Km(const hidl_vec<KeyParameter>& keyPara
     keymaster_key_param_set_t set;
 
     set.params = new (std::nothrow) keymaster_key_param_t[keyParams.size()];
-    set.length = keyParams.size();
-
-    for (size_t i = 0; i < keyParams.size(); ++i) {
-        auto tag = legacy_enum_conversion(keyParams[i].tag);
-        switch (typeFromTag(tag)) {
-        case KM_ENUM:
-        case KM_ENUM_REP:
-            set.params[i] = keymaster_param_enum(tag, keyParams[i].f.integer);
-            break;
-        case KM_UINT:
-        case KM_UINT_REP:
-            set.params[i] = keymaster_param_int(tag, keyParams[i].f.integer);
-            break;
-        case KM_ULONG:
-        case KM_ULONG_REP:
-            set.params[i] = keymaster_param_long(tag, keyParams[i].f.longInteger);
-            break;
-        case KM_DATE:
-            set.params[i] = keymaster_param_date(tag, keyParams[i].f.dateTime);
-            break;
-        case KM_BOOL:
-            if (keyParams[i].f.boolValue)
-                set.params[i] = keymaster_param_bool(tag);
-            else
-                set.params[i].tag = KM_TAG_INVALID;
-            break;
-        case KM_BIGNUM:
-        case KM_BYTES:
-            set.params[i] =
-                keymaster_param_blob(tag, &keyParams[i].blob[0], keyParams[i].blob.size());
-            break;
-        case KM_INVALID:
-        default:
-            set.params[i].tag = KM_TAG_INVALID;
-            /* just skip */
-            break;
-        }
+    set.length = set.params ? keyParams.size() : 0;
+    for (size_t i = 0; i < set.length; ++i) {
+        set.params[i] = hidlKeyParam2Km(keyParams[i]);
     }
 
     return set;
@@ -261,14 +276,22 @@ Return<void> AndroidKeymaster4Device::computeSharedHmac(
     ComputeSharedHmacRequest request(impl_->message_version());
     request.params_array.params_array =
         new (std::nothrow) keymaster::HmacSharingParameters[params.size()];
+    if (request.params_array.params_array == nullptr) {
+        _hidl_cb(ErrorCode::MEMORY_ALLOCATION_FAILED, {});
+        return Void();
+    }
     request.params_array.num_params = params.size();
     for (size_t i = 0; i < params.size(); ++i) {
-        request.params_array.params_array[i].seed = {params[i].seed.data(), params[i].seed.size()};
-        static_assert(sizeof(request.params_array.params_array[i].nonce) ==
-                          decltype(params[i].nonce)::size(),
+        // Written in place; seeds are short enough to be held inline.
+        auto& param = request.params_array.params_array[i];
+        if (!param.seed.Reset(params[i].seed.size()) && params[i].seed.size()) {
+            _hidl_cb(ErrorCode::MEMORY_ALLOCATION_FAILED, {});
+            return Void();
+        }
+        std::copy(params[i].seed.begin(), params[i].seed.end(), param.seed.writable_data());
+        static_assert(sizeof(param.nonce) == decltype(params[i].nonce)::size(),
                       "Nonce sizes don't match");
-        memcpy(request.params_array.params_array[i].nonce, params[i].nonce.data(),
-               params[i].nonce.size());
+        memcpy(param.nonce, params[i].nonce.data(), params[i].nonce.size());
     }
 
     auto response = impl_->ComputeSharedHmac(request);
@@ -499,9 +522,10 @@ Return<void> AndroidKeymaster4Device::begin(KeyPurpose purpose, const hidl_vec<u
     BeginOperationRequest request(impl_->message_version());
     request.purpose = legacy_enum_conversion(purpose);
     request.SetKeyMaterial(key.data(), key.size());
-    request.additional_params.Reinitialize(KmParamSet(inParams));
 
     hidl_vec<uint8_t> hidl_vec_token = authToken2HidlVec(authToken);
+    hidlKeyParams2AuthSet(inParams, 1 /* more_elems */, hidl_vec_token.size(),
+                          &request.additional_params);
     request.additional_params.push_back(
         TAG_AUTH_TOKEN, reinterpret_cast<uint8_t*>(hidl_vec_token.data()), hidl_vec_token.size());
 
@@ -23,13 +23,11 @@
 
 #include "KeyMintUtils.h"
 #include <keymaster/android_keymaster.h>
+#include <keymaster/keymaster_enforcement.h>
 #include <keymaster/keymaster_configuration.h>
 
 namespace aidl::android::hardware::security::secureclock {
 
-using keymaster::GenerateTimestampTokenRequest;
-using keymaster::GenerateTimestampTokenResponse;
-using keymint::km_utils::kmBlob2vector;
 using keymint::km_utils::kmError2ScopedAStatus;
 
 AndroidSecureClock::AndroidSecureClock(
@@ -39,16 +37,15 @@ AndroidSecureClock::AndroidSecureClock(
 AndroidSecureClock::~AndroidSecureClock() {}
 
 ScopedAStatus AndroidSecureClock::generateTimeStamp(int64_t challenge, TimeStampToken* token) {
-    GenerateTimestampTokenRequest request(impl_->message_version());
-    request.challenge = challenge;
-    GenerateTimestampTokenResponse response(request.message_version);
-    impl_->GenerateTimestampToken(request, &response);
-    if (response.error != KM_ERROR_OK) {
-        return kmError2ScopedAStatus(response.error);
+    uint64_t timestamp;
+    token->mac.resize(keymaster::kTimestampTokenMacSize);
+    keymaster_error_t error =
+        impl_->GenerateTimestampToken(challenge, &timestamp, token->mac.data());
+    if (error != KM_ERROR_OK) {
+        return kmError2ScopedAStatus(error);
     }
-    token->challenge = response.token.challenge;
-    token->timestamp.milliSeconds = static_cast<int64_t>(response.token.timestamp);
-    token->mac = kmBlob2vector(response.token.mac);
+    token->challenge = challenge;
+    token->timestamp.milliSeconds = static_cast<int64_t>(timestamp);
     return ScopedAStatus::ok();
 }
 
@@ -17,6 +17,8 @@
 #define LOG_TAG "android.hardware.security.sharedsecret-impl"
 #include <log/log.h>
 
+#include <algorithm>
+
 #include "AndroidSharedSecret.h"
 #include "KeyMintUtils.h"
 #include <aidl/android/hardware/security/keymint/ErrorCode.h>
@@ -43,6 +45,14 @@ ScopedAStatus AndroidSharedSecret::getSharedSecretParameters(SharedSecretParamet
 
 ScopedAStatus AndroidSharedSecret::computeSharedSecret(const vector<SharedSecretParameters>& params,
                                                        vector<uint8_t>* sharingCheck) {
+    for (const auto& param : params) {
+        if (param.nonce.size() != sizeof(keymaster::HmacSharingParameters::nonce)) {
+            return kmError2ScopedAStatus(KM_ERROR_INVALID_ARGUMENT);
+        }
+    }
+
+    // The entries are written in place.  Seeds are short enough to be held inline, so the array is
+    // the only allocation; the enforcement recognizes a repeated negotiation from a digest of it.
     ComputeSharedHmacRequest request(impl_->message_version());
     request.params_array.params_array =
         new (std::nothrow) keymaster::HmacSharingParameters[params.size()];
@@ -51,12 +61,12 @@ ScopedAStatus AndroidSharedSecret::computeSharedSecret(const vector<SharedSecret
     }
     request.params_array.num_params = params.size();
     for (size_t i = 0; i < params.size(); ++i) {
-        request.params_array.params_array[i].seed = {params[i].seed.data(), params[i].seed.size()};
-        if (sizeof(request.params_array.params_array[i].nonce) != params[i].nonce.size()) {
-            return kmError2ScopedAStatus(KM_ERROR_INVALID_ARGUMENT);
+        auto& param = request.params_array.params_array[i];
+        if (!param.seed.Reset(params[i].seed.size()) && !params[i].seed.empty()) {
+            return kmError2ScopedAStatus(KM_ERROR_MEMORY_ALLOCATION_FAILED);
         }
-        memcpy(request.params_array.params_array[i].nonce, params[i].nonce.data(),
-               params[i].nonce.size());
+        std::copy(params[i].seed.begin(), params[i].seed.end(), param.seed.writable_data());
+        memcpy(param.nonce, params[i].nonce.data(), sizeof(param.nonce));
     }
     auto response = impl_->ComputeSharedHmac(request);
     if (response.error == KM_ERROR_OK) *sharingCheck = kmBlob2vector(response.sharing_check);
@@ -17,6 +17,8 @@
 #define LOG_TAG "android.hardware.security.keymint-impl"
 #include <android-base/logging.h>
 
+#include <keymaster/trace.h>
+
 #include "KeyMintUtils.h"
 
 namespace aidl::android::hardware::security::keymint::km_utils {
@@ -113,20 +115,17 @@ keymaster_key_param_t aidlEnumParam2Km(const KeyParameter& param) {
 
 }  // namespace
 
-vector<uint8_t> authToken2AidlVec(const std::optional<HardwareAuthToken>& token) {
+KmAuthToken::KmAuthToken(const std::optional<HardwareAuthToken>& token) {
     static_assert(1 /* version size */ + sizeof(token->challenge) + sizeof(token->userId) +
                           sizeof(token->authenticatorId) + sizeof(token->authenticatorType) +
                           sizeof(token->timestamp) + 32 /* HMAC size */
                       == sizeof(hw_auth_token_t),
                   "HardwareAuthToken content size does not match hw_auth_token_t size");
 
-    vector<uint8_t> result;
+    if (!token.has_value()) return;
+    if (token->mac.size() != 32) return;
 
-    if (!token.has_value()) return result;
-    if (token->mac.size() != 32) return result;
-
-    result.resize(sizeof(hw_auth_token_t));
-    auto pos = result.begin();
+    auto pos = data_;
     *pos++ = 0;  // Version byte
     pos = copy_bytes_to_iterator(token->challenge, pos);
     pos = copy_bytes_to_iterator(token->userId, pos);
@@ -134,8 +133,12 @@ vector<uint8_t> authToken2AidlVec(const std::optional<HardwareAuthToken>& token)
     pos = copy_bytes_to_iterator(hton(static_cast<uint32_t>(token->authenticatorType)), pos);
     pos = copy_bytes_to_iterator(hton(token->timestamp.milliSeconds), pos);
     pos = std::copy(token->mac.data(), token->mac.data() + token->mac.size(), pos);
+    size_ = pos - data_;
+}
 
-    return result;
+vector<uint8_t> authToken2AidlVec(const std::optional<HardwareAuthToken>& token) {
+    KmAuthToken encoded(token);
+    return vector<uint8_t>(encoded.data(), encoded.data() + encoded.size());
 }
 
 KeyParameter kmParam2Aidl(const keymaster_key_param_t& param) {
@@ -176,16 +179,22 @@ KeyParameter kmParam2Aidl(const keymaster_key_param_t& param) {
 
 vector<KeyParameter> kmParamSet2Aidl(const keymaster_key_param_set_t& set) {
     vector<KeyParameter> result;
-    if (set.length == 0 || set.params == nullptr) return result;
+    kmParamSet2Aidl(set, &result);
+    return result;
+}
+
+void kmParamSet2Aidl(const keymaster_key_param_set_t& set, vector<KeyParameter>* result) {
+    KEYMASTER_TRACE("KeyMintUtils::kmParamSet2Aidl");
+    if (set.length == 0 || set.params == nullptr) return;
 
-    result.reserve(set.length);
+    result->reserve(result->size() + set.length);
     for (size_t i = 0; i < set.length; ++i) {
-        result.push_back(kmParam2Aidl(set.params[i]));
+        result->push_back(kmParam2Aidl(set.params[i]));
     }
-    return result;
 }
 
-keymaster_key_param_set_t aidlKeyParams2Km(const vector<KeyParameter>& keyParams) {
+keymaster_key_param_set_t aidlKeyParams2KmView(const vector<KeyParameter>& keyParams) {
+    KEYMASTER_TRACE("KeyMintUtils::aidlKeyParams2Km");
     keymaster_key_param_set_t set;
 
     set.params = static_cast<keymaster_key_param_t*>(
@@ -233,9 +242,7 @@ keymaster_key_param_set_t aidlKeyParams2Km(const vector<KeyParameter>& keyParams
         case KM_BYTES:
             if (param.value.getTag() == KeyParameterValue::blob) {
                 const auto& value = param.value.get<KeyParameterValue::blob>();
-                uint8_t* copy = static_cast<uint8_t*>(malloc(value.size()));
-                std::copy(value.begin(), value.end(), copy);
-                set.params[i] = keymaster_param_blob(tag, copy, value.size());
+                set.params[i] = keymaster_param_blob(tag, value.data(), value.size());
             } else {
                 set.params[i] = kInvalidTag;
             }
@@ -253,4 +260,26 @@ keymaster_key_param_set_t aidlKeyParams2Km(const vector<KeyParameter>& keyParams
     return set;
 }
 
+keymaster_key_param_set_t aidlKeyParams2Km(const vector<KeyParameter>& keyParams) {
+    keymaster_key_param_set_t set = aidlKeyParams2KmView(keyParams);
+
+    // The caller owns the result, so give it its own copy of each blob.
+    for (size_t i = 0; i < set.length; ++i) {
+        switch (typeFromTag(set.params[i].tag)) {
+        case KM_BIGNUM:
+        case KM_BYTES: {
+            keymaster_blob_t& blob = set.params[i].blob;
+            uint8_t* copy = static_cast<uint8_t*>(malloc(blob.data_length));
+            std::copy(blob.data, blob.data + blob.data_length, copy);
+            blob.data = copy;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    return set;
+}
+
 }  // namespace aidl::android::hardware::security::keymint::km_utils
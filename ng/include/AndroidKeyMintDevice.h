@@ -70,6 +70,16 @@ class AndroidKeyMintDevice : public BnKeyMintDevice {
                         const vector<KeyParameter>& params,
                         const optional<HardwareAuthToken>& authToken, BeginResult* result) override;
 
+    // Not part of IKeyMintDevice: runs a whole operation in one call for in-process clients with
+    // small inputs, without creating an IKeyMintOperation or using an operation table slot.  Keys
+    // that require authentication for each operation can't be used this way.
+    ScopedAStatus oneShotOperation(KeyPurpose purpose, const vector<uint8_t>& keyBlob,
+                                   const vector<KeyParameter>& params,
+                                   const optional<HardwareAuthToken>& authToken,
+                                   const vector<uint8_t>& input,
+                                   const optional<vector<uint8_t>>& signature,
+                                   vector<KeyParameter>* outParams, vector<uint8_t>* output);
+
     ScopedAStatus deviceLocked(bool passwordOnly,
                                const optional<TimeStampToken>& timestampToken) override;
     ScopedAStatus earlyBootEnded() override;
@@ -82,6 +92,16 @@ class AndroidKeyMintDevice : public BnKeyMintDevice {
                                         const vector<uint8_t>& appData,
                                         vector<KeyCharacteristics>* keyCharacteristics) override;
 
+    // Not part of IKeyMintDevice: getKeyCharacteristics() for in-process clients that store
+    // characteristics column-wise, such as keystore's database.  |record| holds a 32-bit count of
+    // lists, each a 32-bit SecurityLevel followed by the list in the encoding of
+    // ::keymaster::AuthorizationSet::ColumnarSerialize(), written straight from the core's sets
+    // without building a KeyParameter per entry.
+    ScopedAStatus getKeyCharacteristicsColumnar(const vector<uint8_t>& keyBlob,
+                                                const vector<uint8_t>& appId,
+                                                const vector<uint8_t>& appData,
+                                                vector<uint8_t>* record);
+
     ScopedAStatus getRootOfTrustChallenge(array<uint8_t, 16>* challenge) override;
     ScopedAStatus getRootOfTrust(const array<uint8_t, 16>& challenge,
                                  vector<uint8_t>* rootOfTrust) override;
@@ -89,9 +109,23 @@ class AndroidKeyMintDevice : public BnKeyMintDevice {
 
     shared_ptr<::keymaster::AndroidKeymaster>& getKeymasterImpl() { return impl_; }
 
+    // Makes the operations begin() returns pipeline up to |depth| update() chunks; see
+    // AndroidKeyMintOperation::enablePipelining().  Zero, the default, keeps updates synchronous.
+    //
+    // This departs from the IKeyMintOperation contract, which has update() report the errors of
+    // the input it was given.  A pipelined update() returns ok() as soon as its input is queued.
+    // If a queued chunk later fails, the operation is over and its error code (for instance
+    // INVALID_INPUT_LENGTH or KEY_USER_NOT_AUTHENTICATED) is returned instead by the next
+    // update() or updateAad(), or by finish(), along with no output; abort() returns its own
+    // result.  Output of the chunks before the failed one that wasn't yet returned is dropped.
+    // Only enable pipelining for clients that treat an update() error as applying to any earlier
+    // input of the operation.
+    void setOperationPipelineDepth(size_t depth) { operationPipelineDepth_ = depth; }
+
   protected:
     std::shared_ptr<::keymaster::AndroidKeymaster> impl_;
     SecurityLevel securityLevel_;
+    size_t operationPipelineDepth_ = 0;
 };
 
 std::shared_ptr<IKeyMintDevice> CreateKeyMintDevice(SecurityLevel securityLevel);
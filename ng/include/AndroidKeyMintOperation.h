@@ -16,6 +16,11 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
 #include <aidl/android/hardware/security/keymint/BnKeyMintOperation.h>
 #include <aidl/android/hardware/security/secureclock/ISecureClock.h>
 
@@ -57,9 +62,46 @@ class AndroidKeyMintOperation : public BnKeyMintOperation {
 
     ScopedAStatus abort() override;
 
+    // Pipelines update(): each call queues its input for a worker thread and returns whatever
+    // output earlier chunks have produced, so the client's next round trip overlaps the crypto
+    // work.  At most |depth| chunks wait at once.  Output, and any error, therefore surface one or
+    // more calls late; updateAad(), finish() and abort() wait for the queue to drain first.  Must
+    // be called before the first update().
+    void enablePipelining(size_t depth);
+
   protected:
     std::shared_ptr<::keymaster::AndroidKeymaster> impl_;
     keymaster_operation_handle_t opHandle_;
+
+  private:
+    struct PipelinedChunk {
+        vector<uint8_t> input;
+        optional<HardwareAuthToken> authToken;
+    };
+
+    // Runs one update synchronously, replacing |*output| with its output.
+    keymaster_error_t updateNow(const vector<uint8_t>& input,
+                                const optional<HardwareAuthToken>& authToken,
+                                vector<uint8_t>* output);
+
+    ScopedAStatus queueUpdate(const vector<uint8_t>& input,
+                              const optional<HardwareAuthToken>& authToken,
+                              vector<uint8_t>* output);
+    void runPipeline();
+    // Waits for every queued chunk to be processed, then returns the first error any of them hit
+    // and moves their unclaimed output to |*output|, if given.
+    keymaster_error_t drainPipeline(vector<uint8_t>* output);
+    void stopPipeline();
+
+    size_t pipelineDepth_ = 0;
+    std::mutex pipelineMutex_;
+    std::condition_variable pipelineCv_;
+    std::deque<PipelinedChunk> pendingChunks_;
+    bool chunkInFlight_ = false;
+    bool stopping_ = false;
+    vector<uint8_t> pipelinedOutput_;
+    keymaster_error_t pipelineError_ = KM_ERROR_OK;
+    std::thread pipelineWorker_;
 };
 
 }  // namespace aidl::android::hardware::security::keymint
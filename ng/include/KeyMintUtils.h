@@ -68,12 +68,23 @@ inline keymaster_tag_type_t typeFromTag(const keymaster_tag_t tag) {
 
 KeyParameter kmParam2Aidl(const keymaster_key_param_t& param);
 vector<KeyParameter> kmParamSet2Aidl(const keymaster_key_param_set_t& set);
+// Appends the converted parameters of |set| to |result|, growing it at most once.
+void kmParamSet2Aidl(const keymaster_key_param_set_t& set, vector<KeyParameter>* result);
 keymaster_key_param_set_t aidlKeyParams2Km(const vector<KeyParameter>& keyParams);
 
+// Like aidlKeyParams2Km(), except that blob parameters point into |keyParams| instead of into
+// copies.  Only the params array is allocated, and it must be released with free().
+keymaster_key_param_set_t aidlKeyParams2KmView(const vector<KeyParameter>& keyParams);
+
+/**
+ * A keymaster_key_param_set_t view of AIDL parameters, for passing them straight to
+ * AuthorizationSet::Reinitialize(), which makes the only copy of their blobs.  It borrows the blob
+ * storage of the AIDL parameters, so it must not outlive them.
+ */
 class KmParamSet : public keymaster_key_param_set_t {
   public:
     explicit KmParamSet(const vector<KeyParameter>& keyParams)
-        : keymaster_key_param_set_t(aidlKeyParams2Km(keyParams)) {}
+        : keymaster_key_param_set_t(aidlKeyParams2KmView(keyParams)) {}
 
     KmParamSet(KmParamSet&& other) : keymaster_key_param_set_t{other.params, other.length} {
         other.length = 0;
@@ -81,7 +92,7 @@ class KmParamSet : public keymaster_key_param_set_t {
     }
 
     KmParamSet(const KmParamSet&) = delete;
-    ~KmParamSet() { keymaster_free_param_set(this); }
+    ~KmParamSet() { free(params); }
 };
 
 inline vector<uint8_t> kmBlob2vector(const keymaster_key_blob_t& blob) {
@@ -119,6 +130,23 @@ inline OutIter copy_bytes_to_iterator(const T& value, OutIter dest) {
 
 vector<uint8_t> authToken2AidlVec(const std::optional<HardwareAuthToken>& token);
 
+/**
+ * The hw_auth_token_t encoding of a HardwareAuthToken, held inline so that passing a token to the
+ * core as TAG_AUTH_TOKEN doesn't need a heap allocation of its own.  Empty if there's no token or
+ * its MAC has the wrong length, as with authToken2AidlVec().
+ */
+class KmAuthToken {
+  public:
+    explicit KmAuthToken(const std::optional<HardwareAuthToken>& token);
+
+    const uint8_t* data() const { return data_; }
+    size_t size() const { return size_; }
+
+  private:
+    uint8_t data_[sizeof(hw_auth_token_t)];
+    size_t size_ = 0;
+};
+
 inline void addClientAndAppData(const vector<uint8_t>& clientId, const vector<uint8_t>& appData,
                                 ::keymaster::AuthorizationSet* params) {
     params->Clear();
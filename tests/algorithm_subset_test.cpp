@@ -0,0 +1,72 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/algorithm_subset.h>
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+
+constexpr keymaster_algorithm_t kAllAlgorithms[] = {KM_ALGORITHM_RSA, KM_ALGORITHM_EC,
+                                                    KM_ALGORITHM_AES, KM_ALGORITHM_TRIPLE_DES,
+                                                    KM_ALGORITHM_HMAC};
+
+TEST(AlgorithmSubsetTest, FactoriesMatchBuild) {
+    PureSoftKeymasterContext context(kKmVersion);
+    for (keymaster_algorithm_t algorithm : kAllAlgorithms) {
+        EXPECT_EQ(AlgorithmIncluded(algorithm), context.GetKeyFactory(algorithm) != nullptr)
+            << "algorithm " << algorithm;
+    }
+}
+
+TEST(AlgorithmSubsetTest, SupportedAlgorithmsAreIncluded) {
+    PureSoftKeymasterContext context(kKmVersion);
+    size_t count;
+    const keymaster_algorithm_t* algorithms = context.GetSupportedAlgorithms(&count);
+    ASSERT_GT(count, 0U);
+    for (size_t i = 0; i < count; ++i) {
+        EXPECT_TRUE(AlgorithmIncluded(algorithms[i])) << "algorithm " << algorithms[i];
+        EXPECT_NE(nullptr, context.GetKeyFactory(algorithms[i])) << "algorithm " << algorithms[i];
+    }
+}
+
+TEST(AlgorithmSubsetTest, LeftOutAlgorithmIsUnsupported) {
+    if (kRsaIncluded) GTEST_SKIP() << "RSA is included in this build";
+
+    PureSoftKeymasterContext* context = new PureSoftKeymasterContext(kKmVersion);
+    AndroidKeymaster keymaster(context, 16 /* operation_table_size */,
+                               MessageVersion(kKmVersion));
+    GenerateKeyRequest request(keymaster.message_version());
+    request.key_description.Reinitialize(
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .RsaSigningKey(2048, 65537)
+                             .Digest(KM_DIGEST_SHA_2_256)
+                             .Authorization(TAG_NO_AUTH_REQUIRED)));
+    GenerateKeyResponse response(keymaster.message_version());
+    keymaster.GenerateKey(request, &response);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, response.error);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,179 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+#include <gtest/gtest.h>
+
+#include "allocation_counter.h"
+
+namespace keymaster {
+namespace test {
+
+TEST(AllocationCounterTest, CountsNothrowAllocations) {
+    AllocationCounter counter;
+    delete[] new (std::nothrow) uint8_t[100];
+    delete new (std::nothrow) uint64_t;
+    EXPECT_EQ(2U, counter.count());
+    EXPECT_EQ(100U + sizeof(uint64_t), counter.bytes());
+}
+
+TEST(AllocationCounterTest, CountersNest) {
+    AllocationCounter outer;
+    delete new (std::nothrow) uint32_t;
+    {
+        AllocationCounter inner;
+        delete new (std::nothrow) uint32_t;
+        EXPECT_EQ(1U, inner.count());
+    }
+    EXPECT_EQ(2U, outer.count());
+}
+
+/**
+ * The most allocations each phase of a warm operation may make.  These pin the hot paths so that
+ * work removing allocations from them can't quietly regress; lower them as allocations go away,
+ * and never raise them without understanding why.
+ */
+struct AllocationBudget {
+    size_t begin;
+    size_t update;
+    size_t finish;
+};
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+constexpr size_t kInputSize = 1024;
+
+class OperationAllocationTest : public ::testing::Test {
+  protected:
+    OperationAllocationTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)),
+          input_(kInputSize, 0xA5) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    void GenerateKey(const AuthorizationSet& description) {
+        GenerateKeyRequest request(keymaster_.message_version());
+        request.key_description.Reinitialize(description);
+        request.key_description.push_back(TAG_NO_AUTH_REQUIRED);
+        request.key_description.push_back(TAG_CERTIFICATE_NOT_BEFORE, 0);
+        request.key_description.push_back(TAG_CERTIFICATE_NOT_AFTER, kUndefinedExpirationDateTime);
+        GenerateKeyResponse response(keymaster_.message_version());
+        keymaster_.GenerateKey(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+        key_blob_ = std::move(response.key_blob);
+    }
+
+    // Runs one operation, counting only the allocations made inside the keymaster calls.
+    void RunOperation(keymaster_purpose_t purpose, const AuthorizationSet& begin_params,
+                      AllocationBudget* counts) {
+        BeginOperationRequest begin_request(keymaster_.message_version());
+        begin_request.purpose = purpose;
+        begin_request.SetKeyMaterial(key_blob_);
+        begin_request.additional_params.Reinitialize(begin_params);
+        BeginOperationResponse begin_response(keymaster_.message_version());
+        {
+            AllocationCounter counter;
+            keymaster_.BeginOperation(begin_request, &begin_response);
+            counts->begin = counter.count();
+        }
+        ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+
+        UpdateOperationRequest update_request(keymaster_.message_version());
+        update_request.op_handle = begin_response.op_handle;
+        update_request.input.Reinitialize(input_.data(), input_.size());
+        UpdateOperationResponse update_response(keymaster_.message_version());
+        {
+            AllocationCounter counter;
+            keymaster_.UpdateOperation(update_request, &update_response);
+            counts->update = counter.count();
+        }
+        ASSERT_EQ(KM_ERROR_OK, update_response.error);
+
+        FinishOperationRequest finish_request(keymaster_.message_version());
+        finish_request.op_handle = begin_response.op_handle;
+        FinishOperationResponse finish_response(keymaster_.message_version());
+        {
+            AllocationCounter counter;
+            keymaster_.FinishOperation(finish_request, &finish_response);
+            counts->finish = counter.count();
+        }
+        ASSERT_EQ(KM_ERROR_OK, finish_response.error);
+    }
+
+    // Runs the operation once to warm caches and lazily built state, then again to measure it.
+    void ExpectWithinBudget(keymaster_purpose_t purpose, const AuthorizationSet& begin_params,
+                            const AllocationBudget& budget) {
+        AllocationBudget counts;
+        ASSERT_NO_FATAL_FAILURE(RunOperation(purpose, begin_params, &counts));
+        ASSERT_NO_FATAL_FAILURE(RunOperation(purpose, begin_params, &counts));
+        EXPECT_LE(counts.begin, budget.begin);
+        EXPECT_LE(counts.update, budget.update);
+        EXPECT_LE(counts.finish, budget.finish);
+    }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+    KeymasterKeyBlob key_blob_;
+    std::vector<uint8_t> input_;
+};
+
+TEST_F(OperationAllocationTest, AesGcmEncrypt) {
+    AuthorizationSet description(AuthorizationSetBuilder()
+                                     .AesEncryptionKey(256)
+                                     .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                     .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                     .Authorization(TAG_MIN_MAC_LENGTH, 128));
+    ASSERT_NO_FATAL_FAILURE(GenerateKey(description));
+    ExpectWithinBudget(KM_PURPOSE_ENCRYPT,
+                       AuthorizationSet(AuthorizationSetBuilder()
+                                            .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                            .Authorization(TAG_PADDING, KM_PAD_NONE)
+                                            .Authorization(TAG_MAC_LENGTH, 128)),
+                       {64 /* begin */, 8 /* update */, 16 /* finish */});
+}
+
+TEST_F(OperationAllocationTest, HmacSign) {
+    AuthorizationSet description(AuthorizationSetBuilder()
+                                     .HmacKey(256)
+                                     .Digest(KM_DIGEST_SHA_2_256)
+                                     .Authorization(TAG_MIN_MAC_LENGTH, 256));
+    ASSERT_NO_FATAL_FAILURE(GenerateKey(description));
+    ExpectWithinBudget(KM_PURPOSE_SIGN,
+                       AuthorizationSet(AuthorizationSetBuilder()
+                                            .Digest(KM_DIGEST_SHA_2_256)
+                                            .Authorization(TAG_MAC_LENGTH, 256)),
+                       {64 /* begin */, 8 /* update */, 16 /* finish */});
+}
+
+TEST_F(OperationAllocationTest, EcdsaSign) {
+    AuthorizationSet description(
+        AuthorizationSetBuilder().EcdsaSigningKey(256).Digest(KM_DIGEST_SHA_2_256));
+    ASSERT_NO_FATAL_FAILURE(GenerateKey(description));
+    ExpectWithinBudget(KM_PURPOSE_SIGN,
+                       AuthorizationSet(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256)),
+                       {64 /* begin */, 8 /* update */, 16 /* finish */});
+}
+
+}  // namespace test
+}  // namespace keymaster
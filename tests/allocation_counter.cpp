@@ -0,0 +1,82 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "allocation_counter.h"
+
+#include <stdlib.h>
+
+#include <new>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+thread_local AllocationCounter* innermost_counter = nullptr;
+
+void* CountedAllocate(size_t size) {
+    AllocationCounter::Record(size);
+    return malloc(size ? size : 1);
+}
+
+}  // namespace
+
+AllocationCounter::AllocationCounter() : outer_(innermost_counter) {
+    innermost_counter = this;
+}
+
+AllocationCounter::~AllocationCounter() {
+    innermost_counter = outer_;
+}
+
+void AllocationCounter::Record(size_t size) {
+    for (AllocationCounter* counter = innermost_counter; counter; counter = counter->outer_) {
+        ++counter->count_;
+        counter->bytes_ += size;
+    }
+}
+
+}  // namespace test
+}  // namespace keymaster
+
+using keymaster::test::CountedAllocate;
+
+void* operator new(size_t size) {
+    void* p = CountedAllocate(size);
+    if (!p) abort();  // Built without exceptions.
+    return p;
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size);
+}
+void operator delete(void* p) noexcept {
+    free(p);
+}
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+namespace keymaster {
+namespace test {
+
+/**
+ * AllocationCounter counts the heap allocations, and the bytes they request, made through any
+ * form of operator new -- including the new (std::nothrow) the library uses -- on the
+ * constructing thread for as long as it is alive.  Counters nest, each seeing everything
+ * allocated within its lifetime.  Allocations made with malloc() directly, such as OpenSSL's,
+ * are not counted.
+ *
+ * Linking allocation_counter.cpp replaces the global operator new and delete for the whole test
+ * binary; they behave as usual when no counter is alive.
+ */
+class AllocationCounter {
+  public:
+    AllocationCounter();
+    ~AllocationCounter();
+
+    AllocationCounter(const AllocationCounter&) = delete;
+    void operator=(const AllocationCounter&) = delete;
+
+    size_t count() const { return count_; }
+    size_t bytes() const { return bytes_; }
+
+    // Adds an allocation of |size| bytes to every counter alive on this thread.
+    static void Record(size_t size);
+
+  private:
+    AllocationCounter* outer_;
+    size_t count_ = 0;
+    size_t bytes_ = 0;
+};
+
+}  // namespace test
+}  // namespace keymaster
@@ -39,6 +39,14 @@ Message* round_trip(int32_t ver, const Message& message, size_t expected_size) {
     UniquePtr<uint8_t[]> buf(new uint8_t[size]);
     EXPECT_EQ(buf.get() + size, message.Serialize(buf.get(), buf.get() + size));
 
+    // Gathering the message from a sink must produce exactly the same bytes.
+    SerializationSink sink;
+    EXPECT_TRUE(message.SerializeTo(&sink));
+    EXPECT_EQ(size, sink.size());
+    UniquePtr<uint8_t[]> gathered(new uint8_t[size]);
+    EXPECT_EQ(gathered.get() + size, sink.Flatten(gathered.get(), gathered.get() + size));
+    EXPECT_EQ(0, memcmp(buf.get(), gathered.get(), size));
+
     Message* deserialized = new Message(ver);
     const uint8_t* p = buf.get();
     EXPECT_TRUE(deserialized->Deserialize(&p, p + size));
@@ -140,6 +148,70 @@ TEST(RoundTrip, GenerateKeyResponse) {
     }
 }
 
+TEST(SerializationSink, ReferencesLargePayloads) {
+    uint8_t cert[1024];
+    memset(cert, 0xA5, sizeof(cert));
+    uint8_t output[SerializationSink::kDefaultReferenceThreshold];
+    memset(output, 0x5A, sizeof(output));
+
+    GenerateKeyResponse rsp(kMaxMessageVersion);
+    rsp.error = KM_ERROR_OK;
+    rsp.key_blob.key_material = dup_array(TEST_DATA);
+    rsp.key_blob.key_material_size = array_length(TEST_DATA);
+    rsp.enforced.Reinitialize(params, array_length(params));
+    rsp.certificate_chain = CertificateChain(2);
+    rsp.certificate_chain.entries[0] = {dup_buffer(cert, sizeof(cert)), sizeof(cert)};
+    rsp.certificate_chain.entries[1] = {dup_buffer("bar", 3), 3};
+
+    SerializationSink sink;
+    ASSERT_TRUE(rsp.SerializeTo(&sink));
+    EXPECT_EQ(rsp.SerializedSize(), sink.size());
+
+    // Everything up to the large certificate is coalesced into one copied segment; the certificate
+    // is referenced, and the small one after it is copied again.
+    ASSERT_EQ(3U, sink.segment_count());
+    EXPECT_EQ(rsp.certificate_chain.entries[0].data, sink.segments()[1].data);
+    EXPECT_EQ(sizeof(cert), sink.segments()[1].length);
+    EXPECT_EQ(sizeof(uint32_t) + 3, sink.segments()[2].length);
+
+    FinishOperationResponse finish(kMaxMessageVersion);
+    finish.error = KM_ERROR_OK;
+    finish.output.Reinitialize(output, sizeof(output));
+    SerializationSink finish_sink;
+    ASSERT_TRUE(finish.SerializeTo(&finish_sink));
+    bool referenced = false;
+    for (size_t i = 0; i < finish_sink.segment_count(); ++i) {
+        if (finish_sink.segments()[i].data == finish.output.peek_read()) referenced = true;
+    }
+    EXPECT_TRUE(referenced);
+}
+
+TEST(CertificateChain, BorrowedTail) {
+    static const uint8_t kIntermediate[] = {1, 2, 3};
+    static const uint8_t kRoot[] = {4, 5};
+    keymaster_blob_t tail_entries[] = {{kIntermediate, sizeof(kIntermediate)},
+                                       {kRoot, sizeof(kRoot)}};
+    const keymaster_cert_chain_t tail = {tail_entries, 2};
+
+    CertificateChain chain = CertificateChain::WithBorrowedTail({dup_buffer("leaf", 4), 4}, tail);
+    ASSERT_TRUE(chain);
+    ASSERT_EQ(3U, chain.entry_count);
+    EXPECT_EQ(2U, chain.borrowed_count());
+    EXPECT_EQ(kIntermediate, chain.entries[1].data);
+    EXPECT_EQ(kRoot, chain.entries[2].data);
+
+    // Moving keeps the tail borrowed; releasing copies it, so the caller can free every entry.
+    CertificateChain moved(std::move(chain));
+    EXPECT_EQ(2U, moved.borrowed_count());
+    keymaster_cert_chain_t released = moved.release();
+    ASSERT_EQ(3U, released.entry_count);
+    EXPECT_NE(kRoot, released.entries[2].data);
+    EXPECT_EQ(0, memcmp(kRoot, released.entries[2].data, sizeof(kRoot)));
+    CertificateChain owned;
+    static_cast<keymaster_cert_chain_t&>(owned) = released;
+    EXPECT_EQ(0U, owned.borrowed_count());
+}
+
 TEST(RoundTrip, GenerateKeyResponseTestError) {
     for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
         GenerateKeyResponse rsp(ver);
@@ -188,6 +260,39 @@ TEST(RoundTrip, GenerateRkpKeyResponse) {
     }
 }
 
+TEST(RoundTrip, GenerateRkpKeyBatchRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        GenerateRkpKeyBatchRequest req(ver);
+        req.test_mode = true;
+        req.key_count = 20;
+
+        UniquePtr<GenerateRkpKeyBatchRequest> deserialized(round_trip(ver, req, 5));
+        EXPECT_EQ(deserialized->test_mode, req.test_mode);
+        EXPECT_EQ(20U, deserialized->key_count);
+    }
+}
+
+TEST(RoundTrip, GenerateRkpKeyBatchResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        GenerateRkpKeyBatchResponse rsp(ver);
+        rsp.error = KM_ERROR_OK;
+        ASSERT_TRUE(rsp.SetKeyCount(2));
+        rsp.key_blobs[0] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        rsp.maced_public_keys[0] = KeymasterBlob(reinterpret_cast<const uint8_t*>("bar"), 3);
+        rsp.key_blobs[1] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("baz"), 3);
+        rsp.maced_public_keys[1] = KeymasterBlob(reinterpret_cast<const uint8_t*>("quux"), 4);
+
+        UniquePtr<GenerateRkpKeyBatchResponse> deserialized(round_trip(ver, rsp, 37));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blobs[0].key_material, 3));
+        EXPECT_EQ(0, memcmp("bar", deserialized->maced_public_keys[0].data, 3));
+        EXPECT_EQ(0, memcmp("baz", deserialized->key_blobs[1].key_material, 3));
+        EXPECT_EQ(4U, deserialized->maced_public_keys[1].data_length);
+        EXPECT_EQ(0, memcmp("quux", deserialized->maced_public_keys[1].data, 4));
+    }
+}
+
 TEST(RoundTrip, GenerateCsrRequest) {
     for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
         GenerateCsrRequest req(ver);
@@ -302,6 +407,19 @@ TEST(RoundTrip, GetKeyCharacteristicsRequest) {
     }
 }
 
+TEST(RoundTrip, PrepareKeyRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        PrepareKeyRequest req(ver);
+        req.additional_params.Reinitialize(params, array_length(params));
+        req.SetKeyMaterial("foo", 3);
+
+        UniquePtr<PrepareKeyRequest> deserialized(round_trip(ver, req, 85));
+        EXPECT_EQ(req.additional_params, deserialized->additional_params);
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp(deserialized->key_blob.key_material, "foo", 3));
+    }
+}
+
 TEST(RoundTrip, GetKeyCharacteristicsResponse) {
     for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
         GetKeyCharacteristicsResponse msg(ver);
@@ -321,12 +439,19 @@ TEST(RoundTrip, BeginOperationRequest) {
         msg.purpose = KM_PURPOSE_SIGN;
         msg.SetKeyMaterial("foo", 3);
         msg.additional_params.Reinitialize(params, array_length(params));
+        msg.signature.Reinitialize("sig", 3);
 
-        UniquePtr<BeginOperationRequest> deserialized(round_trip(ver, msg, 89));
+        UniquePtr<BeginOperationRequest> deserialized(round_trip(ver, msg, ver < 5 ? 89 : 96));
         EXPECT_EQ(KM_PURPOSE_SIGN, deserialized->purpose);
         EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
         EXPECT_EQ(0, memcmp(deserialized->key_blob.key_material, "foo", 3));
         EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        if (ver < 5) {
+            EXPECT_EQ(0U, deserialized->signature.available_read());
+        } else {
+            EXPECT_EQ(3U, deserialized->signature.available_read());
+            EXPECT_EQ(0, memcmp(deserialized->signature.begin(), "sig", 3));
+        }
     }
 }
 
@@ -336,6 +461,8 @@ TEST(RoundTrip, BeginOperationResponse) {
         msg.error = KM_ERROR_OK;
         msg.op_handle = 0xDEADBEEF;
         msg.output_params.push_back(Authorization(TAG_NONCE, "foo", 3));
+        msg.recommended_chunk_size = 16384;
+        msg.max_chunk_size = 32768;
 
         UniquePtr<BeginOperationResponse> deserialized;
         switch (ver) {
@@ -348,6 +475,9 @@ TEST(RoundTrip, BeginOperationResponse) {
         case 4:
             deserialized.reset(round_trip(ver, msg, 39));
             break;
+        case 5:
+            deserialized.reset(round_trip(ver, msg, 47));
+            break;
         default:
             FAIL();
         }
@@ -364,6 +494,13 @@ TEST(RoundTrip, BeginOperationResponse) {
         case 3:
         case 4:
             EXPECT_EQ(msg.output_params, deserialized->output_params);
+            EXPECT_EQ(0U, deserialized->recommended_chunk_size);
+            EXPECT_EQ(0U, deserialized->max_chunk_size);
+            break;
+        case 5:
+            EXPECT_EQ(msg.output_params, deserialized->output_params);
+            EXPECT_EQ(16384U, deserialized->recommended_chunk_size);
+            EXPECT_EQ(32768U, deserialized->max_chunk_size);
             break;
         default:
             FAIL();
@@ -399,6 +536,9 @@ TEST(RoundTrip, UpdateOperationRequest) {
         case 4:
             deserialized.reset(round_trip(ver, msg, 27));
             break;
+        case 5:
+            deserialized.reset(round_trip(ver, msg, 16));
+            break;
         default:
             FAIL();
         }
@@ -428,6 +568,9 @@ TEST(RoundTrip, UpdateOperationResponse) {
         case 4:
             deserialized.reset(round_trip(ver, msg, 42));
             break;
+        case 5:
+            deserialized.reset(round_trip(ver, msg, 40));
+            break;
         default:
             FAIL();
         }
@@ -445,6 +588,7 @@ TEST(RoundTrip, UpdateOperationResponse) {
         case 2:
         case 3:
         case 4:
+        case 5:
             EXPECT_EQ(99U, deserialized->input_consumed);
             EXPECT_EQ(1U, deserialized->output_params.size());
             break;
@@ -454,6 +598,105 @@ TEST(RoundTrip, UpdateOperationResponse) {
     }
 }
 
+TEST(RoundTrip, EmptyUpdateOperationIsCompact) {
+    for (int ver = 1; ver <= kMaxMessageVersion; ++ver) {
+        UpdateOperationRequest request(ver);
+        request.op_handle = 0xDEADBEEF;
+        request.additional_params.push_back(TAG_NONCE, "foo", 3);
+        UniquePtr<UpdateOperationRequest> deserialized_request(
+            round_trip(ver, request, ver < 5 ? 39 : 36));
+        // The parameters from a previous message must not survive one that omits them.
+        request.additional_params.Clear();
+        const uint8_t* data = nullptr;
+        UniquePtr<uint8_t[]> buf(new uint8_t[request.SerializedSize()]);
+        EXPECT_EQ(ver < 5 ? 24U : 9U, request.SerializedSize());
+        request.Serialize(buf.get(), buf.get() + request.SerializedSize());
+        data = buf.get();
+        EXPECT_TRUE(deserialized_request->Deserialize(&data, data + request.SerializedSize()));
+        EXPECT_EQ(0U, deserialized_request->additional_params.size());
+        EXPECT_EQ(0U, deserialized_request->input.available_read());
+
+        UpdateOperationResponse response(ver);
+        response.error = KM_ERROR_OK;
+        response.input_consumed = 300;
+        UniquePtr<UpdateOperationResponse> deserialized_response;
+        switch (ver) {
+        case 1:
+            deserialized_response.reset(round_trip(ver, response, 12));
+            break;
+        case 2:
+        case 3:
+        case 4:
+            deserialized_response.reset(round_trip(ver, response, 24));
+            break;
+        case 5:
+            deserialized_response.reset(round_trip(ver, response, 7));
+            break;
+        default:
+            FAIL();
+        }
+        EXPECT_EQ(300U, deserialized_response->input_consumed);
+        EXPECT_EQ(0U, deserialized_response->output.available_read());
+    }
+}
+
+TEST(RoundTrip, CompactUpdateRejectsUnknownPresenceBits) {
+    const uint8_t bytes[] = {0xEF, 0xBE, 0xAD, 0xDE, 0, 0, 0, 0, 0x04};
+    UpdateOperationRequest request(5);
+    const uint8_t* p = bytes;
+    EXPECT_FALSE(request.Deserialize(&p, bytes + sizeof(bytes)));
+}
+
+TEST(RoundTrip, BatchUpdateOperationRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        BatchUpdateOperationRequest msg(ver);
+        msg.op_handle = 0xDEADBEEF;
+        ASSERT_TRUE(msg.SetInputCount(3));
+        msg.inputs[0].Reinitialize("foo", 3);
+        msg.inputs[2].Reinitialize("barbaz", 6);
+        msg.additional_params.push_back(TAG_ASSOCIATED_DATA, "aad", 3);
+
+        UniquePtr<BatchUpdateOperationRequest> deserialized(round_trip(ver, msg, 60));
+        EXPECT_EQ(0xDEADBEEF, deserialized->op_handle);
+        ASSERT_EQ(3U, deserialized->input_count);
+        EXPECT_EQ(3U, deserialized->inputs[0].available_read());
+        EXPECT_EQ(0, memcmp(deserialized->inputs[0].peek_read(), "foo", 3));
+        EXPECT_EQ(0U, deserialized->inputs[1].available_read());
+        EXPECT_EQ(6U, deserialized->inputs[2].available_read());
+        EXPECT_EQ(0, memcmp(deserialized->inputs[2].peek_read(), "barbaz", 6));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+    }
+}
+
+TEST(RoundTrip, BatchUpdateOperationResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        BatchUpdateOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetOutputCount(2));
+        msg.outputs[0].Reinitialize("foo", 3);
+        msg.outputs[1].Reinitialize("bar", 3);
+
+        UniquePtr<BatchUpdateOperationResponse> deserialized(round_trip(ver, msg, 34));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->output_count);
+        EXPECT_EQ(0, memcmp(deserialized->outputs[0].peek_read(), "foo", 3));
+        EXPECT_EQ(0, memcmp(deserialized->outputs[1].peek_read(), "bar", 3));
+        EXPECT_EQ(0U, deserialized->output_params.size());
+    }
+}
+
+TEST(RoundTrip, BatchUpdateOperationRequestTooManyInputs) {
+    BatchUpdateOperationRequest msg(kMaxMessageVersion);
+    ASSERT_TRUE(msg.SetInputCount(BatchUpdateOperationRequest::kMaxInputs + 1));
+    size_t size = msg.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, msg.Serialize(buf.get(), buf.get() + size));
+
+    BatchUpdateOperationRequest deserialized(kMaxMessageVersion);
+    const uint8_t* p = buf.get();
+    EXPECT_FALSE(deserialized.Deserialize(&p, p + size));
+}
+
 TEST(RoundTrip, FinishOperationRequest) {
     for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
         FinishOperationRequest msg(ver);
@@ -472,6 +715,7 @@ TEST(RoundTrip, FinishOperationRequest) {
             break;
         case 3:
         case 4:
+        case 5:
             deserialized.reset(round_trip(ver, msg, 34));
             break;
         default:
@@ -498,6 +742,7 @@ TEST(Round_Trip, FinishOperationResponse) {
         case 2:
         case 3:
         case 4:
+        case 5:
             deserialized.reset(round_trip(ver, msg, 23));
             break;
         default:
@@ -584,6 +829,277 @@ TEST(RoundTrip, ImportKeyResponse) {
     }
 }
 
+TEST(RoundTrip, OneShotOperationRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        OneShotOperationRequest msg(ver);
+        msg.purpose = KM_PURPOSE_SIGN;
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.Reinitialize(params, array_length(params));
+        msg.input.Reinitialize("bar", 3);
+        msg.signature.Reinitialize("bazz", 4);
+
+        UniquePtr<OneShotOperationRequest> deserialized(round_trip(ver, msg, 104));
+        EXPECT_EQ(KM_PURPOSE_SIGN, deserialized->purpose);
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blob.key_material, 3));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        EXPECT_EQ(0, memcmp("bar", deserialized->input.peek_read(), 3));
+        EXPECT_EQ(4U, deserialized->signature.available_read());
+        EXPECT_EQ(0, memcmp("bazz", deserialized->signature.peek_read(), 4));
+    }
+}
+
+TEST(RoundTrip, OneShotOperationResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        OneShotOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        msg.output_params.push_back(TAG_NONCE, "nonce", 5);
+        msg.output.Reinitialize("foo", 3);
+
+        UniquePtr<OneShotOperationResponse> deserialized(round_trip(ver, msg, 40));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        EXPECT_EQ(msg.output_params, deserialized->output_params);
+        EXPECT_EQ(3U, deserialized->output.available_read());
+        EXPECT_EQ(0, memcmp("foo", deserialized->output.peek_read(), 3));
+    }
+}
+
+TEST(RoundTrip, SharedMemoryOperationRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        SharedMemoryOperationRequest msg(ver);
+        msg.op_handle = 0xDEADBEEF;
+        msg.finish = true;
+        msg.region_id = 7;
+        msg.input = {0x100000000, 4096};
+        msg.output = {8192, 4112};
+        msg.signature.Reinitialize("sig", 3);
+        msg.additional_params.push_back(TAG_NONCE, "nonce", 5);
+
+        UniquePtr<SharedMemoryOperationRequest> deserialized(round_trip(ver, msg, 76));
+        EXPECT_EQ(0xDEADBEEF, deserialized->op_handle);
+        EXPECT_TRUE(deserialized->finish);
+        EXPECT_EQ(7U, deserialized->region_id);
+        EXPECT_EQ(0x100000000U, deserialized->input.offset);
+        EXPECT_EQ(4096U, deserialized->input.length);
+        EXPECT_EQ(8192U, deserialized->output.offset);
+        EXPECT_EQ(4112U, deserialized->output.length);
+        EXPECT_EQ(3U, deserialized->signature.available_read());
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+    }
+}
+
+TEST(RoundTrip, SharedMemoryOperationResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        SharedMemoryOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        msg.input_consumed = 4096;
+        msg.output_length = 4080;
+
+        UniquePtr<SharedMemoryOperationResponse> deserialized(round_trip(ver, msg, 24));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        EXPECT_EQ(4096U, deserialized->input_consumed);
+        EXPECT_EQ(4080U, deserialized->output_length);
+    }
+}
+
+TEST(RoundTrip, BatchSignRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        BatchSignRequest msg(ver);
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.push_back(TAG_DIGEST, KM_DIGEST_SHA_2_256);
+        ASSERT_TRUE(msg.SetMessageCount(2));
+        msg.messages[0].Reinitialize("bar", 3);
+        msg.messages[1].Reinitialize("bazqux", 6);
+
+        UniquePtr<BatchSignRequest> deserialized(round_trip(ver, msg, 48));
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blob.key_material, 3));
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        ASSERT_EQ(2U, deserialized->message_count);
+        EXPECT_EQ(0, memcmp("bar", deserialized->messages[0].peek_read(), 3));
+        EXPECT_EQ(6U, deserialized->messages[1].available_read());
+        EXPECT_EQ(0, memcmp("bazqux", deserialized->messages[1].peek_read(), 6));
+    }
+}
+
+TEST(RoundTrip, BatchSignResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        BatchSignResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetSignatureCount(2));
+        msg.signatures[0].Reinitialize("foo", 3);
+        msg.signatures[1].Reinitialize("bar", 3);
+
+        UniquePtr<BatchSignResponse> deserialized(round_trip(ver, msg, 22));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->signature_count);
+        EXPECT_EQ(0, memcmp("foo", deserialized->signatures[0].peek_read(), 3));
+        EXPECT_EQ(0, memcmp("bar", deserialized->signatures[1].peek_read(), 3));
+    }
+}
+
+TEST(RoundTrip, BatchSignRequestTooManyMessages) {
+    BatchSignRequest msg(kMaxMessageVersion);
+    ASSERT_TRUE(msg.SetMessageCount(BatchSignRequest::kMaxMessages + 1));
+    size_t size = msg.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, msg.Serialize(buf.get(), buf.get() + size));
+
+    BatchSignRequest deserialized(kMaxMessageVersion);
+    const uint8_t* p = buf.get();
+    EXPECT_FALSE(deserialized.Deserialize(&p, p + size));
+}
+
+TEST(RoundTrip, BatchVerifyRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        BatchVerifyRequest msg(ver);
+        msg.SetKeyMaterial("foo", 3);
+        msg.additional_params.push_back(TAG_DIGEST, KM_DIGEST_SHA_2_256);
+        ASSERT_TRUE(msg.SetMessageCount(2));
+        msg.messages[0].Reinitialize("bar", 3);
+        msg.signatures[0].Reinitialize("s1", 2);
+        msg.messages[1].Reinitialize("bazqux", 6);
+        msg.signatures[1].Reinitialize("sig2", 4);
+
+        UniquePtr<BatchVerifyRequest> deserialized(round_trip(ver, msg, 62));
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+        ASSERT_EQ(2U, deserialized->message_count);
+        EXPECT_EQ(0, memcmp("bar", deserialized->messages[0].peek_read(), 3));
+        EXPECT_EQ(0, memcmp("s1", deserialized->signatures[0].peek_read(), 2));
+        EXPECT_EQ(0, memcmp("bazqux", deserialized->messages[1].peek_read(), 6));
+        EXPECT_EQ(4U, deserialized->signatures[1].available_read());
+        EXPECT_EQ(0, memcmp("sig2", deserialized->signatures[1].peek_read(), 4));
+    }
+}
+
+TEST(RoundTrip, BatchVerifyResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        BatchVerifyResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        const uint8_t bitmap[] = {0x05, 0x01};
+        msg.verified.Reinitialize(bitmap, sizeof(bitmap));
+
+        UniquePtr<BatchVerifyResponse> deserialized(round_trip(ver, msg, 10));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        EXPECT_TRUE(deserialized->IsVerified(0));
+        EXPECT_FALSE(deserialized->IsVerified(1));
+        EXPECT_TRUE(deserialized->IsVerified(2));
+        EXPECT_TRUE(deserialized->IsVerified(8));
+        EXPECT_FALSE(deserialized->IsVerified(9));
+        EXPECT_FALSE(deserialized->IsVerified(16));
+    }
+}
+
+TEST(RoundTrip, BatchVerifyRequestTooManyMessages) {
+    BatchVerifyRequest msg(kMaxMessageVersion);
+    ASSERT_TRUE(msg.SetMessageCount(BatchVerifyRequest::kMaxMessages + 1));
+    size_t size = msg.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, msg.Serialize(buf.get(), buf.get() + size));
+
+    BatchVerifyRequest deserialized(kMaxMessageVersion);
+    const uint8_t* p = buf.get();
+    EXPECT_FALSE(deserialized.Deserialize(&p, p + size));
+}
+
+TEST(RoundTrip, ExecuteBatchRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        ExecuteBatchRequest msg(ver);
+        ASSERT_TRUE(msg.SetEntryCount(2));
+        AbortOperationRequest abort(ver);
+        abort.op_handle = 0xFEDCBA9876543210;
+        ASSERT_TRUE(msg.SetEntry(0, ABORT_OPERATION, abort));
+        abort.op_handle = 7;
+        ASSERT_TRUE(msg.SetEntry(1, ABORT_OPERATION, abort));
+        EXPECT_FALSE(msg.SetEntry(2, ABORT_OPERATION, abort));
+
+        UniquePtr<ExecuteBatchRequest> deserialized(round_trip(ver, msg, 36));
+        ASSERT_EQ(2U, deserialized->entry_count);
+        for (size_t i = 0; i < 2; ++i) {
+            EXPECT_EQ(static_cast<uint32_t>(ABORT_OPERATION), deserialized->commands[i]);
+        }
+        AbortOperationRequest entry(ver);
+        const uint8_t* p = deserialized->requests[1].peek_read();
+        ASSERT_TRUE(entry.Deserialize(&p, p + deserialized->requests[1].available_read()));
+        EXPECT_EQ(7U, entry.op_handle);
+    }
+}
+
+TEST(RoundTrip, ExecuteBatchResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        ExecuteBatchResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetEntryCount(2));
+        const uint8_t ok[] = {0, 0, 0, 0};
+        msg.responses[0].Reinitialize(ok, sizeof(ok));
+        AbortOperationResponse failed(ver);
+        failed.error = KM_ERROR_INVALID_OPERATION_HANDLE;
+        msg.responses[1].Reinitialize(failed.SerializedSize());
+        failed.Serialize(msg.responses[1].peek_write(),
+                         msg.responses[1].peek_write() + failed.SerializedSize());
+        msg.responses[1].advance_write(failed.SerializedSize());
+
+        UniquePtr<ExecuteBatchResponse> deserialized(round_trip(ver, msg, 24));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->entry_count);
+        AbortOperationResponse entry(ver);
+        ASSERT_TRUE(deserialized->GetEntry(0, &entry));
+        EXPECT_EQ(KM_ERROR_OK, entry.error);
+        // An error-only entry deserializes into any response type.
+        GenerateKeyResponse generate(ver);
+        ASSERT_TRUE(deserialized->GetEntry(1, &generate));
+        EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, generate.error);
+        EXPECT_FALSE(deserialized->GetEntry(2, &entry));
+    }
+}
+
+TEST(RoundTrip, ExecuteBatchRequestTooManyEntries) {
+    ExecuteBatchRequest msg(kMaxMessageVersion);
+    ASSERT_TRUE(msg.SetEntryCount(ExecuteBatchRequest::kMaxEntries + 1));
+    size_t size = msg.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, msg.Serialize(buf.get(), buf.get() + size));
+
+    ExecuteBatchRequest deserialized(kMaxMessageVersion);
+    const uint8_t* p = buf.get();
+    EXPECT_FALSE(deserialized.Deserialize(&p, p + size));
+}
+
+TEST(RoundTrip, BatchAgreeKeyRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        BatchAgreeKeyRequest msg(ver);
+        msg.SetKeyMaterial("foo", 3);
+        ASSERT_TRUE(msg.SetPeerKeyCount(2));
+        msg.peer_keys[0].Reinitialize("bar", 3);
+        msg.peer_keys[1].Reinitialize("bazqux", 6);
+
+        UniquePtr<BatchAgreeKeyRequest> deserialized(round_trip(ver, msg, 40));
+        EXPECT_EQ(3U, deserialized->key_blob.key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blob.key_material, 3));
+        ASSERT_EQ(2U, deserialized->peer_key_count);
+        EXPECT_EQ(0, memcmp("bar", deserialized->peer_keys[0].peek_read(), 3));
+        EXPECT_EQ(6U, deserialized->peer_keys[1].available_read());
+        EXPECT_EQ(0, memcmp("bazqux", deserialized->peer_keys[1].peek_read(), 6));
+    }
+}
+
+TEST(RoundTrip, BatchAgreeKeyResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        BatchAgreeKeyResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        ASSERT_TRUE(msg.SetSharedSecretCount(2));
+        msg.shared_secrets[0].Reinitialize("foo", 3);
+        msg.shared_secrets[1].Reinitialize("bar", 3);
+
+        UniquePtr<BatchAgreeKeyResponse> deserialized(round_trip(ver, msg, 22));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->shared_secret_count);
+        EXPECT_EQ(0, memcmp("foo", deserialized->shared_secrets[0].peek_read(), 3));
+        EXPECT_EQ(0, memcmp("bar", deserialized->shared_secrets[1].peek_read(), 3));
+    }
+}
+
 TEST(RoundTrip, ExportKeyRequest) {
     for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
         ExportKeyRequest msg(ver);
@@ -703,6 +1219,86 @@ TEST(RoundTrip, GetVersion2Response) {
     EXPECT_EQ(20121900U, msg.km_date);
 }
 
+TEST(RoundTrip, GetDebugCountersResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        GetDebugCountersResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        msg.commands.push_back({BEGIN_OPERATION, 10, 2, 123456789012});
+        msg.phases.push_back({static_cast<uint32_t>(OperationPhase::LOAD_KEY), 10, 0, 42});
+        msg.caches.push_back({static_cast<uint32_t>(KeymasterCache::PARSED_KEY), 7, 3});
+
+        UniquePtr<GetDebugCountersResponse> deserialized(round_trip(ver, msg, 92));
+        ASSERT_EQ(1U, deserialized->commands.size());
+        EXPECT_EQ(static_cast<uint32_t>(BEGIN_OPERATION), deserialized->commands[0].id);
+        EXPECT_EQ(10U, deserialized->commands[0].calls);
+        EXPECT_EQ(2U, deserialized->commands[0].errors);
+        EXPECT_EQ(123456789012U, deserialized->commands[0].total_ns);
+        ASSERT_EQ(1U, deserialized->phases.size());
+        EXPECT_EQ(42U, deserialized->phases[0].total_ns);
+        ASSERT_EQ(1U, deserialized->caches.size());
+        EXPECT_EQ(7U, deserialized->caches[0].hits);
+        EXPECT_EQ(3U, deserialized->caches[0].misses);
+    }
+}
+
+TEST(FieldList, MatchesPerFieldHelpers) {
+    HardwareAuthToken token;
+    token.challenge = 0x0102030405060708;
+    token.user_id = 0x1112131415161718;
+    token.authenticator_id = 0x2122232425262728;
+    token.authenticator_type = HW_AUTH_FINGERPRINT;
+    token.timestamp = 0x4142434445464748;
+
+    constexpr size_t kPrefixSize = 4 * sizeof(uint64_t) + sizeof(uint32_t);
+    static_assert(HardwareAuthToken::Prefix::kSize == kPrefixSize);
+    uint8_t expected[kPrefixSize];
+    uint8_t* p = expected;
+    const uint8_t* end = expected + sizeof(expected);
+    p = append_uint64_to_buf(p, end, token.challenge);
+    p = append_uint64_to_buf(p, end, token.user_id);
+    p = append_uint64_to_buf(p, end, token.authenticator_id);
+    p = append_uint32_to_buf(p, end, token.authenticator_type);
+    p = append_uint64_to_buf(p, end, token.timestamp);
+    ASSERT_EQ(end, p);
+
+    uint8_t actual[kPrefixSize];
+    EXPECT_EQ(actual + kPrefixSize,
+              HardwareAuthToken::Prefix::Append(actual, actual + kPrefixSize, token));
+    EXPECT_EQ(0, memcmp(expected, actual, kPrefixSize));
+
+    // A run that doesn't fit is neither written nor read, in part or in whole.
+    EXPECT_EQ(actual, HardwareAuthToken::Prefix::Append(actual, actual + kPrefixSize - 1, token));
+    HardwareAuthToken deserialized;
+    const uint8_t* read = expected;
+    EXPECT_FALSE(HardwareAuthToken::Prefix::Copy(&read, expected + kPrefixSize - 1, &deserialized));
+    EXPECT_EQ(expected, read);
+    EXPECT_EQ(0U, deserialized.challenge);
+
+    EXPECT_TRUE(HardwareAuthToken::Prefix::Copy(&read, end, &deserialized));
+    EXPECT_EQ(end, read);
+    EXPECT_EQ(token.challenge, deserialized.challenge);
+    EXPECT_EQ(token.user_id, deserialized.user_id);
+    EXPECT_EQ(token.authenticator_id, deserialized.authenticator_id);
+    EXPECT_EQ(token.authenticator_type, deserialized.authenticator_type);
+    EXPECT_EQ(token.timestamp, deserialized.timestamp);
+}
+
+TEST(RoundTrip, HardwareAuthTokenRejectsTruncation) {
+    HardwareAuthToken token;
+    token.challenge = 1;
+    token.timestamp = 2;
+    token.mac = KeymasterBlob(reinterpret_cast<const uint8_t*>("mac"), 3);
+
+    size_t size = token.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    ASSERT_EQ(buf.get() + size, token.Serialize(buf.get(), buf.get() + size));
+    for (size_t len = 0; len < size; ++len) {
+        HardwareAuthToken deserialized;
+        const uint8_t* p = buf.get();
+        EXPECT_FALSE(deserialized.Deserialize(&p, buf.get() + len)) << len;
+    }
+}
+
 TEST(RoundTrip, ConfigureRequest) {
     for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
         ConfigureRequest req(ver);
@@ -793,6 +1389,30 @@ TEST(RoundTrip, AbortOperationRequest) {
     }
 }
 
+TEST(RoundTrip, ForkOperationRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        ForkOperationRequest msg(ver);
+        msg.op_handle = 0xDEADBEEF;
+        msg.additional_params.push_back(Authorization(TAG_NONCE, "foo", 3));
+
+        UniquePtr<ForkOperationRequest> deserialized(round_trip(ver, msg, 35));
+        EXPECT_EQ(0xDEADBEEF, deserialized->op_handle);
+        EXPECT_EQ(msg.additional_params, deserialized->additional_params);
+    }
+}
+
+TEST(RoundTrip, ForkOperationResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        ForkOperationResponse msg(ver);
+        msg.error = KM_ERROR_OK;
+        msg.op_handle = 0xDEADBEEF;
+
+        UniquePtr<ForkOperationResponse> deserialized(round_trip(ver, msg, 12));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        EXPECT_EQ(0xDEADBEEF, deserialized->op_handle);
+    }
+}
+
 TEST(RoundTrip, AttestKeyRequest) {
     for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
         AttestKeyRequest msg(ver);
@@ -858,6 +1478,182 @@ TEST(RoundTrip, UpgradeKeyResponse) {
     }
 }
 
+TEST(RoundTrip, UpgradeKeysRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        UpgradeKeysRequest msg(ver);
+        ASSERT_TRUE(msg.SetKeyCount(2));
+        msg.key_blobs[0] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        msg.key_blobs[1] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("bar"), 3);
+        msg.upgrade_params.Reinitialize(params, array_length(params));
+
+        UniquePtr<UpgradeKeysRequest> deserialized(round_trip(ver, msg, 96));
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blobs[0].key_material, 3));
+        EXPECT_EQ(0, memcmp("bar", deserialized->key_blobs[1].key_material, 3));
+        EXPECT_EQ(msg.upgrade_params, deserialized->upgrade_params);
+    }
+}
+
+TEST(RoundTrip, UpgradeKeysResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        UpgradeKeysResponse rsp(ver);
+        rsp.error = KM_ERROR_OK;
+        ASSERT_TRUE(rsp.SetKeyCount(2));
+        rsp.upgraded_keys[0] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        rsp.key_errors[1] = KM_ERROR_INVALID_KEY_BLOB;
+
+        UniquePtr<UpgradeKeysResponse> deserialized(round_trip(ver, rsp, 27));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->key_errors[0]);
+        EXPECT_EQ(3U, deserialized->upgraded_keys[0].key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->upgraded_keys[0].key_material, 3));
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, deserialized->key_errors[1]);
+        EXPECT_EQ(0U, deserialized->upgraded_keys[1].key_material_size);
+    }
+}
+
+TEST(RoundTrip, GenerateKeysRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        GenerateKeysRequest msg(ver);
+        ASSERT_TRUE(msg.SetKeyCount(2));
+        msg.key_descriptions[0].Reinitialize(params, array_length(params));
+
+        UniquePtr<GenerateKeysRequest> deserialized(round_trip(ver, msg, 94));
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(msg.key_descriptions[0], deserialized->key_descriptions[0]);
+        EXPECT_EQ(0U, deserialized->key_descriptions[1].size());
+    }
+}
+
+TEST(RoundTrip, GenerateKeysResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        GenerateKeysResponse rsp(ver);
+        rsp.error = KM_ERROR_OK;
+        ASSERT_TRUE(rsp.SetKeyCount(2));
+        rsp.key_blobs[0] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        rsp.enforced[0].Reinitialize(params, array_length(params));
+        rsp.key_errors[1] = KM_ERROR_UNSUPPORTED_KEY_SIZE;
+
+        UniquePtr<GenerateKeysResponse> deserialized(round_trip(ver, rsp, 141));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->key_errors[0]);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blobs[0].key_material, 3));
+        EXPECT_EQ(rsp.enforced[0], deserialized->enforced[0]);
+        EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_SIZE, deserialized->key_errors[1]);
+        EXPECT_EQ(0U, deserialized->key_blobs[1].key_material_size);
+    }
+}
+
+TEST(RoundTrip, ImportKeysRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        ImportKeysRequest msg(ver);
+        ASSERT_TRUE(msg.SetKeyCount(2));
+        msg.key_descriptions[0].Reinitialize(params, array_length(params));
+        msg.key_descriptions[1].Reinitialize(params, array_length(params));
+        msg.key_formats[1] = KM_KEY_FORMAT_PKCS8;
+        msg.key_data[0] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        msg.key_data[1] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("bar"), 3);
+
+        UniquePtr<ImportKeysRequest> deserialized(round_trip(ver, msg, 182));
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(msg.key_descriptions[0], deserialized->key_descriptions[0]);
+        EXPECT_EQ(msg.key_descriptions[1], deserialized->key_descriptions[1]);
+        EXPECT_EQ(KM_KEY_FORMAT_RAW, deserialized->key_formats[0]);
+        EXPECT_EQ(KM_KEY_FORMAT_PKCS8, deserialized->key_formats[1]);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_data[0].key_material, 3));
+        EXPECT_EQ(0, memcmp("bar", deserialized->key_data[1].key_material, 3));
+    }
+}
+
+TEST(RoundTrip, ImportKeysResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        ImportKeysResponse rsp(ver);
+        rsp.error = KM_ERROR_OK;
+        ASSERT_TRUE(rsp.SetKeyCount(2));
+        rsp.key_blobs[0] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        rsp.enforced[0].Reinitialize(params, array_length(params));
+        rsp.key_errors[1] = KM_ERROR_UNSUPPORTED_ALGORITHM;
+
+        UniquePtr<ImportKeysResponse> deserialized(round_trip(ver, rsp, 141));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->key_errors[0]);
+        EXPECT_EQ(3U, deserialized->key_blobs[0].key_material_size);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blobs[0].key_material, 3));
+        EXPECT_EQ(rsp.enforced[0], deserialized->enforced[0]);
+        EXPECT_EQ(0U, deserialized->unenforced[0].size());
+        EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, deserialized->key_errors[1]);
+        EXPECT_EQ(0U, deserialized->key_blobs[1].key_material_size);
+    }
+}
+
+TEST(RoundTrip, DeleteKeysRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        DeleteKeysRequest msg(ver);
+        ASSERT_TRUE(msg.SetKeyCount(2));
+        msg.key_blobs[0] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        msg.key_blobs[1] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("bar"), 3);
+
+        UniquePtr<DeleteKeysRequest> deserialized(round_trip(ver, msg, 18));
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blobs[0].key_material, 3));
+        EXPECT_EQ(0, memcmp("bar", deserialized->key_blobs[1].key_material, 3));
+    }
+}
+
+TEST(RoundTrip, DeleteKeysResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        DeleteKeysResponse rsp(ver);
+        rsp.error = KM_ERROR_OK;
+        ASSERT_TRUE(rsp.SetKeyCount(2));
+        rsp.key_errors[1] = KM_ERROR_INVALID_KEY_BLOB;
+
+        UniquePtr<DeleteKeysResponse> deserialized(round_trip(ver, rsp, 16));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->key_errors[0]);
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, deserialized->key_errors[1]);
+    }
+}
+
+TEST(RoundTrip, GetKeysCharacteristicsRequest) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        GetKeysCharacteristicsRequest msg(ver);
+        ASSERT_TRUE(msg.SetKeyCount(2));
+        msg.key_blobs[0] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("foo"), 3);
+        msg.key_blobs[1] = KeymasterKeyBlob(reinterpret_cast<const uint8_t*>("bar"), 3);
+        msg.additional_params[0].Reinitialize(params, array_length(params));
+
+        UniquePtr<GetKeysCharacteristicsRequest> deserialized(round_trip(ver, msg, 108));
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(0, memcmp("foo", deserialized->key_blobs[0].key_material, 3));
+        EXPECT_EQ(0, memcmp("bar", deserialized->key_blobs[1].key_material, 3));
+        EXPECT_EQ(msg.additional_params[0], deserialized->additional_params[0]);
+        EXPECT_EQ(0U, deserialized->additional_params[1].size());
+    }
+}
+
+TEST(RoundTrip, GetKeysCharacteristicsResponse) {
+    for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
+        GetKeysCharacteristicsResponse rsp(ver);
+        rsp.error = KM_ERROR_OK;
+        ASSERT_TRUE(rsp.SetKeyCount(2));
+        rsp.enforced[0].Reinitialize(params, array_length(params));
+        rsp.key_errors[1] = KM_ERROR_INVALID_KEY_BLOB;
+
+        UniquePtr<GetKeysCharacteristicsResponse> deserialized(round_trip(ver, rsp, 130));
+        EXPECT_EQ(KM_ERROR_OK, deserialized->error);
+        ASSERT_EQ(2U, deserialized->key_count);
+        EXPECT_EQ(KM_ERROR_OK, deserialized->key_errors[0]);
+        EXPECT_EQ(rsp.enforced[0], deserialized->enforced[0]);
+        EXPECT_EQ(0U, deserialized->unenforced[0].size());
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, deserialized->key_errors[1]);
+        EXPECT_EQ(0U, deserialized->enforced[1].size());
+    }
+}
+
 TEST(RoundTrip, GenerateTimestampTokenRequest) {
     for (int ver = 0; ver <= kMaxMessageVersion; ++ver) {
         GenerateTimestampTokenRequest msg(ver);
@@ -1058,10 +1854,28 @@ template <typename Message> void parse_garbage() {
     }
 
 GARBAGE_TEST(AbortOperationRequest);
+GARBAGE_TEST(ForkOperationRequest);
+GARBAGE_TEST(ForkOperationResponse);
 GARBAGE_TEST(EmptyKeymasterResponse);
 GARBAGE_TEST(AddEntropyRequest);
+GARBAGE_TEST(PrepareKeyRequest);
+GARBAGE_TEST(GetDebugCountersResponse);
 GARBAGE_TEST(BeginOperationRequest);
 GARBAGE_TEST(BeginOperationResponse);
+GARBAGE_TEST(BatchUpdateOperationRequest);
+GARBAGE_TEST(BatchUpdateOperationResponse);
+GARBAGE_TEST(OneShotOperationRequest);
+GARBAGE_TEST(OneShotOperationResponse);
+GARBAGE_TEST(BatchSignRequest);
+GARBAGE_TEST(BatchSignResponse);
+GARBAGE_TEST(BatchAgreeKeyRequest);
+GARBAGE_TEST(BatchAgreeKeyResponse);
+GARBAGE_TEST(BatchVerifyRequest);
+GARBAGE_TEST(BatchVerifyResponse);
+GARBAGE_TEST(ExecuteBatchRequest);
+GARBAGE_TEST(ExecuteBatchResponse);
+GARBAGE_TEST(GenerateRkpKeyBatchRequest);
+GARBAGE_TEST(GenerateRkpKeyBatchResponse);
 GARBAGE_TEST(DeleteAllKeysRequest);
 GARBAGE_TEST(DeleteKeyRequest);
 GARBAGE_TEST(ExportKeyRequest);
@@ -1080,6 +1894,16 @@ GARBAGE_TEST(AttestKeyRequest);
 GARBAGE_TEST(AttestKeyResponse);
 GARBAGE_TEST(UpgradeKeyRequest);
 GARBAGE_TEST(UpgradeKeyResponse);
+GARBAGE_TEST(UpgradeKeysRequest);
+GARBAGE_TEST(UpgradeKeysResponse);
+GARBAGE_TEST(GenerateKeysRequest);
+GARBAGE_TEST(GenerateKeysResponse);
+GARBAGE_TEST(ImportKeysRequest);
+GARBAGE_TEST(ImportKeysResponse);
+GARBAGE_TEST(DeleteKeysRequest);
+GARBAGE_TEST(DeleteKeysResponse);
+GARBAGE_TEST(GetKeysCharacteristicsRequest);
+GARBAGE_TEST(GetKeysCharacteristicsResponse);
 GARBAGE_TEST(GenerateTimestampTokenRequest);
 GARBAGE_TEST(GenerateTimestampTokenResponse);
 GARBAGE_TEST(SetAttestationIdsRequest);
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/arena.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/serializable.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+TEST(ArenaTest, AllocateAligned) {
+    Arena arena(256);
+    for (size_t size = 1; size < 100; size += 7) {
+        void* p = arena.Allocate(size);
+        ASSERT_TRUE(p != nullptr);
+        EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(p) % alignof(max_align_t));
+        EXPECT_TRUE(arena.Owns(p));
+        memset(p, 0xAA, size);
+    }
+    int on_heap;
+    EXPECT_FALSE(arena.Owns(&on_heap));
+    EXPECT_FALSE(arena.Owns(nullptr));
+}
+
+TEST(ArenaTest, OversizedAllocation) {
+    Arena arena(64);
+    void* small = arena.Allocate(16);
+    void* large = arena.Allocate(1000);
+    void* small2 = arena.Allocate(16);
+    ASSERT_TRUE(small && large && small2);
+    EXPECT_TRUE(arena.Owns(large));
+    // The large allocation didn't use up the chunk being filled.
+    EXPECT_EQ(static_cast<uint8_t*>(small) + 16, static_cast<uint8_t*>(small2));
+}
+
+TEST(ArenaTest, ResetReusesFirstChunk) {
+    Arena arena(128);
+    void* first = arena.Allocate(32);
+    for (size_t i = 0; i < 20; ++i) ASSERT_TRUE(arena.Allocate(64) != nullptr);
+    EXPECT_LT(0U, arena.bytes_allocated());
+
+    arena.Reset();
+    EXPECT_EQ(0U, arena.bytes_allocated());
+    EXPECT_EQ(first, arena.Allocate(32));
+    EXPECT_EQ(0, static_cast<uint8_t*>(first)[0]);
+}
+
+TEST(ArenaTest, AuthorizationSet) {
+    Arena arena;
+    AuthorizationSet set;
+    set.set_arena(&arena);
+    for (uint32_t i = 0; i < 20; ++i) {
+        ASSERT_TRUE(set.push_back(TAG_USER_SECURE_ID, i));
+        ASSERT_TRUE(set.push_back(TAG_APPLICATION_DATA, "data", 4));
+    }
+    EXPECT_TRUE(arena.Owns(set.data()));
+    int pos = set.find(TAG_APPLICATION_DATA);
+    ASSERT_NE(-1, pos);
+    EXPECT_TRUE(arena.Owns(set[pos].blob.data));
+
+    // Moving out of the arena copies.
+    AuthorizationSet moved(std::move(set));
+    EXPECT_EQ(0U, set.size());
+    EXPECT_FALSE(arena.Owns(moved.data()));
+    arena.Reset();
+    EXPECT_EQ(40U, moved.size());
+    EXPECT_EQ(20U, moved.GetTagCount(TAG_USER_SECURE_ID));
+    keymaster_blob_t blob;
+    ASSERT_TRUE(moved.GetTagValue(TAG_APPLICATION_DATA, &blob));
+    EXPECT_EQ(0, memcmp("data", blob.data, 4));
+
+    // Heap storage moved into a bound set is still freed normally.
+    AuthorizationSet bound;
+    bound.set_arena(&arena);
+    bound = std::move(moved);
+    EXPECT_EQ(40U, bound.size());
+    EXPECT_FALSE(arena.Owns(bound.data()));
+}
+
+TEST(ArenaTest, AuthorizationSetDeserialize) {
+    AuthorizationSet set(AuthorizationSetBuilder()
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                             .Authorization(TAG_APPLICATION_ID, "app", 3));
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    set.Serialize(buf.get(), buf.get() + size);
+
+    Arena arena;
+    AuthorizationSet deserialized;
+    deserialized.set_arena(&arena);
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(deserialized.Deserialize(&p, p + size));
+    EXPECT_TRUE(arena.Owns(deserialized.data()));
+    keymaster_blob_t blob;
+    ASSERT_TRUE(deserialized.GetTagValue(TAG_APPLICATION_ID, &blob));
+    EXPECT_TRUE(arena.Owns(blob.data));
+    EXPECT_EQ(0, memcmp("app", blob.data, 3));
+}
+
+TEST(ArenaTest, Buffer) {
+    Arena arena;
+    Buffer buffer;
+    buffer.set_arena(&arena);
+    ASSERT_TRUE(buffer.Reinitialize("abc", 3));
+    EXPECT_TRUE(arena.Owns(buffer.peek_read()));
+    ASSERT_TRUE(buffer.reserve(100));
+    ASSERT_TRUE(buffer.write(reinterpret_cast<const uint8_t*>("def"), 3));
+    EXPECT_TRUE(arena.Owns(buffer.peek_read()));
+
+    Buffer moved(std::move(buffer));
+    EXPECT_EQ(0U, buffer.available_read());
+    EXPECT_FALSE(arena.Owns(moved.peek_read()));
+    arena.Reset();
+    ASSERT_EQ(6U, moved.available_read());
+    EXPECT_EQ(0, memcmp("abcdef", moved.peek_read(), 6));
+
+    size_t size = moved.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    moved.Serialize(buf.get(), buf.get() + size);
+    Buffer deserialized;
+    deserialized.set_arena(&arena);
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(deserialized.Deserialize(&p, p + size));
+    EXPECT_TRUE(arena.Owns(deserialized.peek_read()));
+    EXPECT_EQ(0, memcmp("abcdef", deserialized.peek_read(), 6));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/contexts/async_logger.h>
+
+#include <stdio.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+class CapturingLogger : public Logger {
+  public:
+    int log_msg(LogLevel /* level */, const char* fmt, va_list args) const override {
+        char buf[512];
+        vsnprintf(buf, sizeof(buf), fmt, args);
+        std::lock_guard<std::mutex> lock(mutex_);
+        messages_.push_back(buf);
+        return 1;
+    }
+
+    std::vector<std::string> messages() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return messages_;
+    }
+
+  private:
+    mutable std::mutex mutex_;
+    mutable std::vector<std::string> messages_;
+};
+
+}  // namespace
+
+TEST(AsyncLoggerTest, FormatsOffThread) {
+    CapturingLogger sink;
+    AsyncLoggerOptions options;
+    options.drain_interval_ms = 60 * 1000;
+    AsyncLogger logger(&sink, options);
+
+    Logger::Error("error %d: %s", 42, "bad");
+    EXPECT_TRUE(sink.messages().empty());
+
+    logger.Flush();
+    ASSERT_EQ(1U, sink.messages().size());
+    EXPECT_EQ("error 42: bad", sink.messages()[0]);
+}
+
+TEST(AsyncLoggerTest, RateLimitsRepeatedFormat) {
+    CapturingLogger sink;
+    AsyncLoggerOptions options;
+    options.drain_interval_ms = 60 * 1000;
+    options.max_repeats = 3;
+    options.rate_window_ms = 60 * 1000;
+    AsyncLogger logger(&sink, options);
+
+    for (int i = 0; i < 10; ++i) Logger::Error("repeated %d", i);
+    logger.Flush();
+    EXPECT_EQ(7U, logger.suppressed_count());
+    std::vector<std::string> messages = sink.messages();
+    ASSERT_EQ(3U, messages.size());
+    EXPECT_EQ("repeated 2", messages[2]);
+}
+
+TEST(AsyncLoggerTest, ReportsSuppressedAfterWindow) {
+    CapturingLogger sink;
+    AsyncLoggerOptions options;
+    options.drain_interval_ms = 60 * 1000;
+    options.max_repeats = 1;
+    options.rate_window_ms = 10;
+    AsyncLogger logger(&sink, options);
+
+    for (int i = 0; i < 4; ++i) {
+        // The last message starts a new window.
+        if (i == 3) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        Logger::Error("repeated %d", i);
+    }
+    logger.Flush();
+
+    std::vector<std::string> messages = sink.messages();
+    ASSERT_EQ(3U, messages.size());
+    EXPECT_EQ("repeated 0", messages[0]);
+    EXPECT_EQ("(2 similar messages suppressed)", messages[1]);
+    EXPECT_EQ("repeated 3", messages[2]);
+}
+
+TEST(AsyncLoggerTest, DropsWhenFull) {
+    CapturingLogger sink;
+    AsyncLoggerOptions options;
+    options.capacity = 4;
+    options.drain_interval_ms = 60 * 1000;
+    options.max_repeats = 0;
+    AsyncLogger logger(&sink, options);
+
+    for (int i = 0; i < 6; ++i) Logger::Error("message %d", i);
+    EXPECT_EQ(2U, logger.dropped_count());
+    logger.Flush();
+
+    std::vector<std::string> messages = sink.messages();
+    ASSERT_EQ(5U, messages.size());
+    EXPECT_EQ("(2 log messages dropped)", messages[0]);
+    EXPECT_EQ("message 3", messages[4]);
+}
+
+TEST(AsyncLoggerTest, ConcurrentProducers) {
+    CapturingLogger sink;
+    AsyncLoggerOptions options;
+    options.capacity = 64;
+    options.drain_interval_ms = 1;
+    options.max_repeats = 0;
+    AsyncLogger logger(&sink, options);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([t] {
+            for (int i = 0; i < 100; ++i) Logger::Error("thread %d message %d", t, i);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    logger.Flush();
+
+    size_t logged = 0;
+    for (const auto& message : sink.messages()) {
+        if (message.compare(0, 7, "thread ") == 0) ++logged;
+    }
+    EXPECT_EQ(400U, logged + logger.dropped_count());
+}
+
+}  // namespace test
+}  // namespace keymaster
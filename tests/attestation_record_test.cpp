@@ -22,6 +22,7 @@
 #include <keymaster/contexts/soft_attestation_context.h>
 #include <keymaster/keymaster_context.h>
 #include <keymaster/km_openssl/attestation_record.h>
+#include <keymaster/km_openssl/attestation_record_view.h>
 
 #include "android_keymaster_test_utils.h"
 
@@ -82,6 +83,21 @@ class KeymasterTestContext : public TestContext {
     KeymasterTestContext() : TestContext(KmVersion::KEYMASTER_4_1) {}  // Last Keymaster version
 };
 
+class CachingTestContext : public KeymasterTestContext {
+  public:
+    std::shared_ptr<const RootOfTrustEncodings> GetRootOfTrustEncodings() const override {
+        keymaster_error_t error;
+        const VerifiedBootParams* params = GetVerifiedBootParams(&error);
+        if (error != KM_ERROR_OK) return nullptr;
+        return cache_.Get(*params, 201512 /* boot_patchlevel */);
+    }
+
+    void SetBootInfo() { cache_.Invalidate(); }
+
+  private:
+    mutable RootOfTrustCache cache_;
+};
+
 TEST(AttestAsn1Test, Simple) {
     const char* fake_app_id = "fake_app_id";
     const char* fake_app_data = "fake_app_data";
@@ -172,6 +188,250 @@ TEST(AttestAsn1Test, Simple) {
     delete[] verified_boot_key.data;
 }
 
+TEST(AttestAsn1Test, CanonicalEncoding) {
+    const char* fake_challenge = "fake_challenge";
+    const char* fake_attest_app_id = "fake_attest_app_id";
+    KeymasterTestContext context;
+    AuthorizationSet hw_set(AuthorizationSetBuilder()
+                                .RsaSigningKey(2048, 65537)
+                                .Digest(KM_DIGEST_SHA_2_512)
+                                .Digest(KM_DIGEST_NONE)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                                .Authorization(TAG_OS_VERSION, 0xFFFFFFFF)
+                                .Authorization(TAG_USAGE_EXPIRE_DATETIME, UINT64_MAX));
+    AuthorizationSet sw_set(AuthorizationSetBuilder()
+                                .Authorization(TAG_CREATION_DATETIME, 10)
+                                .Authorization(TAG_ALL_APPLICATIONS));
+    AuthorizationSet attest_params(
+        AuthorizationSetBuilder()
+            .Authorization(TAG_INCLUDE_UNIQUE_ID)
+            .Authorization(TAG_ATTESTATION_CHALLENGE, fake_challenge, strlen(fake_challenge))
+            .Authorization(TAG_ATTESTATION_APPLICATION_ID, fake_attest_app_id,
+                           strlen(fake_attest_app_id)));
+
+    UniquePtr<uint8_t[]> asn1;
+    size_t asn1_len = 0;
+    ASSERT_EQ(KM_ERROR_OK,
+              build_attestation_record(attest_params, sw_set, hw_set, context, &asn1, &asn1_len));
+
+    // The record is written directly rather than through the ASN.1 templates, so check that the
+    // templates parse it and encode it back to exactly the same DER.
+    const uint8_t* p = asn1.get();
+    KM_KEY_DESCRIPTION* key_desc = d2i_KM_KEY_DESCRIPTION(nullptr, &p, asn1_len);
+    ASSERT_TRUE(key_desc != nullptr);
+    EXPECT_EQ(asn1.get() + asn1_len, p);
+
+    uint8_t* reencoded = nullptr;
+    int reencoded_len = i2d_KM_KEY_DESCRIPTION(key_desc, &reencoded);
+    KM_KEY_DESCRIPTION_free(key_desc);
+    ASSERT_EQ(static_cast<int>(asn1_len), reencoded_len);
+    EXPECT_EQ(0, memcmp(asn1.get(), reencoded, asn1_len));
+    OPENSSL_free(reencoded);
+}
+
+TEST(AttestAsn1Test, ExtractAuthListMatchesTemplates) {
+    const char* fake_challenge = "fake_challenge";
+    KeymasterTestContext context;
+    AuthorizationSet hw_set(AuthorizationSetBuilder()
+                                .RsaSigningKey(2048, 65537)
+                                .Digest(KM_DIGEST_SHA_2_512)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Padding(KM_PAD_RSA_PSS)
+                                .Authorization(TAG_NO_AUTH_REQUIRED)
+                                .Authorization(TAG_OS_VERSION, 0xFFFFFFFF)
+                                .Authorization(TAG_USAGE_EXPIRE_DATETIME, UINT64_MAX)
+                                .Authorization(TAG_VENDOR_PATCHLEVEL, 20231001));
+    AuthorizationSet sw_set(AuthorizationSetBuilder()
+                                .Authorization(TAG_CREATION_DATETIME, 1700000000000)
+                                .Authorization(TAG_ALL_APPLICATIONS));
+    AuthorizationSet attest_params(AuthorizationSetBuilder().Authorization(
+        TAG_ATTESTATION_CHALLENGE, fake_challenge, strlen(fake_challenge)));
+
+    UniquePtr<uint8_t[]> asn1;
+    size_t asn1_len = 0;
+    ASSERT_EQ(KM_ERROR_OK,
+              build_attestation_record(attest_params, sw_set, hw_set, context, &asn1, &asn1_len));
+    const uint8_t* p = asn1.get();
+    KM_KEY_DESCRIPTION* key_desc = d2i_KM_KEY_DESCRIPTION(nullptr, &p, asn1_len);
+    ASSERT_TRUE(key_desc != nullptr);
+
+    // Both lists, including the root of trust in the TEE-enforced one, decode to the same sets
+    // in the same order either way.
+    for (KM_AUTH_LIST* list : {key_desc->software_enforced, key_desc->tee_enforced}) {
+        uint8_t* der = nullptr;
+        int der_len = i2d_KM_AUTH_LIST(list, &der);
+        ASSERT_GT(der_len, 0);
+
+        AuthorizationSet from_record, from_der;
+        EXPECT_EQ(KM_ERROR_OK, extract_auth_list(list, &from_record));
+        EXPECT_EQ(KM_ERROR_OK, extract_auth_list(der, der_len, &from_der));
+        EXPECT_EQ(from_record, from_der);
+
+        for (int len = 0; len < der_len; ++len) {
+            AuthorizationSet truncated;
+            EXPECT_NE(KM_ERROR_OK, extract_auth_list(der, len, &truncated)) << len;
+        }
+        OPENSSL_free(der);
+    }
+    KM_KEY_DESCRIPTION_free(key_desc);
+
+    // Fields out of tag order, negative integers and unknown fields are rejected.
+    AuthorizationSet rejected;
+    const std::string out_of_order = hex2str("300BA30402020800A203020101");
+    const std::string negative = hex2str("3005A3030201FF");
+    const std::string unknown = hex2str("3006BF6403020101");
+    for (const std::string& der : {out_of_order, negative, unknown}) {
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+                  extract_auth_list(reinterpret_cast<const uint8_t*>(der.data()), der.size(),
+                                    &rejected));
+    }
+}
+
+TEST(AttestAsn1Test, RecordView) {
+    const char* fake_challenge = "fake_challenge";
+    const char* fake_attest_app_id = "fake_attest_app_id";
+    KeymasterTestContext context;
+    AuthorizationSet hw_set(AuthorizationSetBuilder()
+                                .RsaSigningKey(2048, 65537)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Authorization(TAG_OS_VERSION, 60000));
+    AuthorizationSet sw_set(AuthorizationSetBuilder().Authorization(TAG_CREATION_DATETIME, 10));
+    AuthorizationSet attest_params(
+        AuthorizationSetBuilder()
+            .Authorization(TAG_ATTESTATION_CHALLENGE, fake_challenge, strlen(fake_challenge))
+            .Authorization(TAG_ATTESTATION_APPLICATION_ID, fake_attest_app_id,
+                           strlen(fake_attest_app_id)));
+
+    UniquePtr<uint8_t[]> asn1;
+    size_t asn1_len = 0;
+    ASSERT_EQ(KM_ERROR_OK,
+              build_attestation_record(attest_params, sw_set, hw_set, context, &asn1, &asn1_len));
+
+    AttestationRecordView view;
+    ASSERT_EQ(KM_ERROR_OK, view.Init(asn1.get(), asn1_len));
+    EXPECT_EQ(version_to_attestation_version(KmVersion::KEYMASTER_4_1),
+              view.attestation_version());
+    EXPECT_EQ(KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT, view.attestation_security_level());
+    EXPECT_EQ(std::string(fake_challenge),
+              std::string(reinterpret_cast<const char*>(view.attestation_challenge().data),
+                          view.attestation_challenge().data_length));
+    EXPECT_EQ(0U, view.unique_id().data_length);
+
+    uint64_t key_size;
+    EXPECT_TRUE(view.GetTagValue(AttestationRecordView::TEE_ENFORCED, TAG_KEY_SIZE, &key_size));
+    EXPECT_EQ(2048U, key_size);
+    EXPECT_TRUE(view.Contains(AttestationRecordView::TEE_ENFORCED, TAG_PURPOSE, KM_PURPOSE_SIGN));
+    EXPECT_FALSE(view.Contains(AttestationRecordView::SOFTWARE_ENFORCED, TAG_PURPOSE));
+    keymaster_blob_t app_id;
+    EXPECT_TRUE(view.GetTagValue(AttestationRecordView::SOFTWARE_ENFORCED,
+                                 TAG_ATTESTATION_APPLICATION_ID, &app_id));
+    EXPECT_EQ(strlen(fake_attest_app_id), app_id.data_length);
+
+    keymaster_blob_t verified_boot_key;
+    keymaster_verified_boot_t verified_boot_state;
+    bool device_locked;
+    EXPECT_EQ(KM_ERROR_OK,
+              view.GetRootOfTrust(&verified_boot_key, &verified_boot_state, &device_locked));
+    context.VerifyRootOfTrust(verified_boot_key, verified_boot_state, device_locked);
+
+    AuthorizationSet view_sw_set, view_hw_set, parsed_sw_set, parsed_hw_set;
+    uint32_t attestation_version, keymaster_version;
+    keymaster_security_level_t attestation_security_level, keymaster_security_level;
+    keymaster_blob_t attestation_challenge = {}, unique_id = {};
+    ASSERT_EQ(KM_ERROR_OK,
+              parse_attestation_record(asn1.get(), asn1_len, &attestation_version,
+                                       &attestation_security_level, &keymaster_version,
+                                       &keymaster_security_level, &attestation_challenge,
+                                       &parsed_sw_set, &parsed_hw_set, &unique_id));
+    delete[] attestation_challenge.data;
+    delete[] unique_id.data;
+    EXPECT_EQ(KM_ERROR_OK, view.GetAuthorizations(&view_sw_set, &view_hw_set));
+    EXPECT_EQ(parsed_sw_set, view_sw_set);
+    EXPECT_EQ(parsed_hw_set, view_hw_set);
+
+    // Every truncation of the record must be rejected.
+    for (size_t len = 0; len < asn1_len; ++len) {
+        AttestationRecordView truncated;
+        EXPECT_NE(KM_ERROR_OK, truncated.Init(asn1.get(), len)) << len;
+    }
+}
+
+TEST(AttestAsn1Test, RecordViewBatch) {
+    const char* fake_challenge = "fake_challenge";
+    const char* fake_attest_app_id = "fake_attest_app_id";
+    KeymasterTestContext context;
+    AuthorizationSet hw_set(AuthorizationSetBuilder().EcdsaSigningKey(256));
+    AuthorizationSet attest_params(
+        AuthorizationSetBuilder()
+            .Authorization(TAG_ATTESTATION_CHALLENGE, fake_challenge, strlen(fake_challenge))
+            .Authorization(TAG_ATTESTATION_APPLICATION_ID, fake_attest_app_id,
+                           strlen(fake_attest_app_id)));
+
+    UniquePtr<uint8_t[]> asn1;
+    size_t asn1_len = 0;
+    ASSERT_EQ(KM_ERROR_OK, build_attestation_record(attest_params, AuthorizationSet(), hw_set,
+                                                    context, &asn1, &asn1_len));
+
+    constexpr size_t kRecordCount = 1000;
+    constexpr size_t kCorruptRecord = 517;
+    std::vector<keymaster_blob_t> records(kRecordCount, {asn1.get(), asn1_len});
+    records[kCorruptRecord].data_length = asn1_len / 2;
+    std::vector<AttestationRecordView> views(kRecordCount);
+    std::vector<keymaster_error_t> errors(kRecordCount);
+
+    ParseAttestationRecords(records.data(), kRecordCount, views.data(), errors.data(),
+                            4 /* thread_count */);
+    for (size_t i = 0; i < kRecordCount; ++i) {
+        if (i == kCorruptRecord) {
+            EXPECT_NE(KM_ERROR_OK, errors[i]);
+        } else {
+            ASSERT_EQ(KM_ERROR_OK, errors[i]) << i;
+            EXPECT_TRUE(views[i].Contains(AttestationRecordView::TEE_ENFORCED, TAG_ALGORITHM));
+        }
+    }
+}
+
+TEST(AttestAsn1Test, CachedRootOfTrust) {
+    const char* fake_challenge = "fake_challenge";
+    const char* fake_attest_app_id = "fake_attest_app_id";
+    KeymasterTestContext context;
+    CachingTestContext caching_context;
+    AuthorizationSet hw_set(AuthorizationSetBuilder().EcdsaSigningKey(256));
+    AuthorizationSet attest_params(
+        AuthorizationSetBuilder()
+            .Authorization(TAG_ATTESTATION_CHALLENGE, fake_challenge, strlen(fake_challenge))
+            .Authorization(TAG_ATTESTATION_APPLICATION_ID, fake_attest_app_id,
+                           strlen(fake_attest_app_id)));
+
+    UniquePtr<uint8_t[]> asn1;
+    size_t asn1_len = 0;
+    ASSERT_EQ(KM_ERROR_OK, build_attestation_record(attest_params, AuthorizationSet(), hw_set,
+                                                    context, &asn1, &asn1_len));
+    UniquePtr<uint8_t[]> cached_asn1;
+    size_t cached_asn1_len = 0;
+    ASSERT_EQ(KM_ERROR_OK, build_attestation_record(attest_params, AuthorizationSet(), hw_set,
+                                                    caching_context, &cached_asn1,
+                                                    &cached_asn1_len));
+    ASSERT_EQ(asn1_len, cached_asn1_len);
+    EXPECT_EQ(0, memcmp(asn1.get(), cached_asn1.get(), asn1_len));
+
+    // The encodings are kept until the boot info changes.
+    auto encodings = caching_context.GetRootOfTrustEncodings();
+    ASSERT_TRUE(encodings);
+    EXPECT_EQ(encodings, caching_context.GetRootOfTrustEncodings());
+    keymaster_error_t error;
+    EXPECT_EQ(encode_root_of_trust_cbor(*context.GetVerifiedBootParams(&error), 201512),
+              encodings->cbor);
+
+    caching_context.SetBootInfo();
+    auto new_encodings = caching_context.GetRootOfTrustEncodings();
+    ASSERT_TRUE(new_encodings);
+    EXPECT_NE(encodings, new_encodings);
+    EXPECT_EQ(encodings->generation + 1, new_encodings->generation);
+    EXPECT_EQ(encodings->der, new_encodings->der);
+}
+
 TEST(EatTest, Simple) {
     const char* fake_imei = "490154203237518";
     const char* fake_app_id = "fake_app_id";
@@ -266,6 +526,67 @@ TEST(EatTest, Simple) {
     delete[] verified_boot_key.data;
 }
 
+TEST(EatTest, MatchesCppborEncoding) {
+    const char* fake_imei = "490154203237518";
+    const char* fake_challenge = "fake_challenge";
+    const char* fake_attest_app_id = "fake_attest_app_id";
+    KeymintTestContext context;
+    AuthorizationSet hw_set(
+        AuthorizationSetBuilder()
+            .Authorization(TAG_ALGORITHM, KM_ALGORITHM_EC)
+            .Authorization(TAG_KEY_SIZE, 256)
+            .Digest(KM_DIGEST_SHA_2_256)
+            .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+            .Digest(KM_DIGEST_SHA_2_384)
+            .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+            .Authorization(TAG_RSA_PUBLIC_EXPONENT, 0x100000001)
+            .Authorization(TAG_OS_PATCHLEVEL, 201512)
+            .Authorization(TAG_NO_AUTH_REQUIRED)
+            .Authorization(TAG_ATTESTATION_ID_IMEI, fake_imei, strlen(fake_imei)));
+    AuthorizationSet sw_set(AuthorizationSetBuilder()
+                                .Authorization(TAG_CREATION_DATETIME, 10)
+                                .Authorization(UNKNOWN_TAG_T, 7)
+                                .Authorization(UNKNOWN_TAG_T, 0x123456789)
+                                .Authorization(TAG_ALLOW_WHILE_ON_BODY));
+    AuthorizationSet attest_params(
+        AuthorizationSetBuilder()
+            .Authorization(TAG_INCLUDE_UNIQUE_ID)
+            .Authorization(TAG_ATTESTATION_CHALLENGE, fake_challenge, strlen(fake_challenge))
+            .Authorization(TAG_ATTESTATION_APPLICATION_ID, fake_attest_app_id,
+                           strlen(fake_attest_app_id)));
+
+    std::vector<uint8_t> eat;
+    ASSERT_EQ(KM_ERROR_OK, build_eat_record(attest_params, sw_set, hw_set, context, &eat));
+
+    // Re-encoding what was parsed gives the same bytes, so every header has its shortest form.
+    auto [item, next_pos, message] = cppbor::parse(eat);
+    ASSERT_TRUE(item) << message;
+    EXPECT_EQ(eat, item->encode());
+
+    // The submods match the ones built with cppbor, byte for byte.
+    sw_set.push_back(TAG_ATTESTATION_APPLICATION_ID, fake_attest_app_id,
+                     strlen(fake_attest_app_id));
+    cppbor::Map expected_sw;
+    ASSERT_EQ(KM_ERROR_OK, build_eat_submod(sw_set, EatSecurityLevel::UNRESTRICTED, &expected_sw));
+    cppbor::Map expected_tee;
+    ASSERT_EQ(KM_ERROR_OK,
+              build_eat_submod(hw_set, EatSecurityLevel::SECURE_RESTRICTED, &expected_tee));
+
+    const cppbor::Map* eat_map = item->asMap();
+    ASSERT_TRUE(eat_map);
+    const cppbor::Map* submods = nullptr;
+    for (size_t i = 0; i < eat_map->size(); ++i) {
+        auto& [key, value] = (*eat_map)[i];
+        if (key->asInt() && key->asInt()->value() == static_cast<int64_t>(EatClaim::SUBMODS)) {
+            submods = value->asMap();
+        }
+    }
+    ASSERT_TRUE(submods);
+    ASSERT_EQ(2U, submods->size());
+    EXPECT_EQ(expected_sw.encode(), (*submods)[0].second->encode());
+    EXPECT_EQ(expected_tee.encode(), (*submods)[1].second->encode());
+}
+
 TEST(BadImeiTest, Simple) {
     const char* fake_challenge = "fake_challenge";
     const char* fake_attest_app_id = "fake_attest_app_id";
@@ -376,5 +697,30 @@ TEST(UnknownTagTest, Simple) {
     EXPECT_TRUE(found_in_software_submod);
 }
 
+TEST(UniqueIdTest, GeneratorMatchesOneShot) {
+    const std::vector<uint8_t> hbk(16, 0x5a);
+    UniqueIdGenerator generator(hbk);
+    const uint8_t app_a[] = {'a', 'p', 'p', 'A'};
+    const uint8_t app_b[] = {'a', 'p', 'p', 'B', '2'};
+    const keymaster_blob_t app_ids[] = {{app_a, sizeof(app_a)}, {app_b, sizeof(app_b)}};
+    const uint64_t dates[] = {0, 1000, 2592000000LLU * 3 + 5};
+
+    // Twice around, with more inputs than the generator caches.
+    for (int pass = 0; pass < 2; ++pass) {
+        for (const auto& app_id : app_ids) {
+            for (uint64_t date : dates) {
+                for (bool reset : {false, true}) {
+                    Buffer expected;
+                    ASSERT_EQ(KM_ERROR_OK, generate_unique_id(hbk, date, app_id, reset, &expected));
+                    Buffer actual;
+                    ASSERT_EQ(KM_ERROR_OK, generator.Generate(date, app_id, reset, &actual));
+                    ASSERT_EQ(static_cast<size_t>(UNIQUE_ID_SIZE), actual.available_read());
+                    EXPECT_EQ(0, memcmp(expected.peek_read(), actual.peek_read(), UNIQUE_ID_SIZE));
+                }
+            }
+        }
+    }
+}
+
 }  // namespace test
 }  // namespace keymaster
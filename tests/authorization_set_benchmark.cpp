@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times the repeated-tag queries factory validation makes, on sets the size of real key
+// characteristics, with and without an index.
+
+#include <benchmark/benchmark.h>
+
+#include <keymaster/authorization_set.h>
+
+namespace keymaster {
+namespace {
+
+// A key's characteristics: mostly single-valued tags, with the repeated purposes and digests that
+// factories look through after them.
+void FillCharacteristics(AuthorizationSet* set, size_t count) {
+    static const uint8_t kData[32] = {};
+    set->push_back(TAG_ALGORITHM, KM_ALGORITHM_RSA);
+    set->push_back(TAG_KEY_SIZE, 2048);
+    set->push_back(TAG_APPLICATION_ID, kData, sizeof(kData));
+    for (size_t i = set->size(); i + 4 < count; ++i) {
+        set->push_back(TAG_USER_SECURE_ID, i);
+    }
+    set->push_back(TAG_PURPOSE, KM_PURPOSE_VERIFY);
+    set->push_back(TAG_PURPOSE, KM_PURPOSE_SIGN);
+    set->push_back(TAG_DIGEST, KM_DIGEST_SHA_2_256);
+    set->push_back(TAG_DIGEST, KM_DIGEST_SHA_2_512);
+}
+
+void ContainsEnum(benchmark::State& state, bool indexed) {
+    AuthorizationSet set;
+    FillCharacteristics(&set, state.range(0));
+    if (indexed) set.BuildIndex();
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(set.Contains(TAG_PURPOSE, KM_PURPOSE_SIGN));
+        benchmark::DoNotOptimize(set.Contains(TAG_DIGEST, KM_DIGEST_SHA_2_512));
+        // A miss scans the whole set, or the whole chain of the tag's entries.
+        benchmark::DoNotOptimize(set.Contains(TAG_DIGEST, KM_DIGEST_MD5));
+    }
+}
+
+void BM_ContainsEnum(benchmark::State& state) {
+    ContainsEnum(state, false /* indexed */);
+}
+BENCHMARK(BM_ContainsEnum)->Arg(10)->Arg(20)->Arg(40)->Arg(60);
+
+void BM_ContainsEnumIndexed(benchmark::State& state) {
+    ContainsEnum(state, true /* indexed */);
+}
+BENCHMARK(BM_ContainsEnumIndexed)->Arg(10)->Arg(20)->Arg(40)->Arg(60);
+
+void BM_FindMissingTag(benchmark::State& state) {
+    AuthorizationSet set;
+    FillCharacteristics(&set, state.range(0));
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(set.find(TAG_MAC_LENGTH));
+        benchmark::DoNotOptimize(set.Contains(TAG_KEY_SIZE, 4096));
+    }
+}
+BENCHMARK(BM_FindMissingTag)->Arg(10)->Arg(20)->Arg(40)->Arg(60);
+
+}  // namespace
+}  // namespace keymaster
+
+BENCHMARK_MAIN();
@@ -131,6 +131,33 @@ TEST(Lookup, Repeated) {
     EXPECT_EQ(47727U, set[pos].long_integer);
 }
 
+TEST(Lookup, RepeatedAcrossVectorWidths) {
+    // Sizes that leave every possible partial vector at the end of an unindexed scan.
+    for (uint32_t size = 1; size <= 13; ++size) {
+        AuthorizationSet set;
+        for (uint32_t i = 0; i < size; ++i) {
+            if (i % 3 == 2) {
+                set.push_back(TAG_DIGEST, static_cast<keymaster_digest_t>(i % 7));
+            } else {
+                set.push_back(TAG_USER_ID, i);
+            }
+        }
+        ASSERT_FALSE(set.has_index());
+
+        for (int begin = -1; begin < static_cast<int>(size); ++begin) {
+            int expected = begin + 1;
+            while (expected < static_cast<int>(size) && set[expected].tag != KM_TAG_DIGEST) {
+                ++expected;
+            }
+            if (expected == static_cast<int>(size)) expected = -1;
+            EXPECT_EQ(expected, set.find(TAG_DIGEST, begin)) << size << " from " << begin;
+        }
+        EXPECT_EQ(size > 2, set.Contains(TAG_DIGEST, static_cast<keymaster_digest_t>(2)));
+        EXPECT_TRUE(set.Contains(TAG_USER_ID, size - 1 - (size % 3 == 0)));
+        EXPECT_FALSE(set.Contains(TAG_PURPOSE, KM_PURPOSE_SIGN));
+    }
+}
+
 TEST(Lookup, Indexed) {
     AuthorizationSet set(AuthorizationSetBuilder()
                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
@@ -697,5 +724,504 @@ TEST(Difference, NullSet) {
     EXPECT_EQ(expected, set1);
 }
 
+TEST(Difference, UnsortedWithDuplicates) {
+    AuthorizationSet set1(AuthorizationSetBuilder()
+                              .Authorization(TAG_APPLICATION_DATA, "data", 4)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                              .Authorization(TAG_APPLICATION_DATA, "dat", 3)
+                              .Authorization(TAG_ACTIVE_DATETIME, 10));
+
+    AuthorizationSet set2(AuthorizationSetBuilder()
+                              .Authorization(TAG_APPLICATION_DATA, "data", 4)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                              .Authorization(TAG_APPLICATION_DATA, "data", 4)
+                              .Authorization(TAG_USER_ID, 7));
+
+    AuthorizationSet expected(AuthorizationSetBuilder()
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                                  .Authorization(TAG_ACTIVE_DATETIME, 10)
+                                  .Authorization(TAG_APPLICATION_DATA, "dat", 3));
+
+    set1.Difference(set2);
+    EXPECT_EQ(expected, set1);
+}
+
+TEST(Intersection, Overlap) {
+    AuthorizationSet set1(AuthorizationSetBuilder()
+                              .Authorization(TAG_APPLICATION_DATA, "data", 4)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                              .Authorization(TAG_ACTIVE_DATETIME, 10));
+
+    AuthorizationSet set2(AuthorizationSetBuilder()
+                              .Authorization(TAG_USER_ID, 7)
+                              .Authorization(TAG_APPLICATION_DATA, "data", 4)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                              .Authorization(TAG_ACTIVE_DATETIME, 11));
+
+    AuthorizationSet expected(AuthorizationSetBuilder()
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                                  .Authorization(TAG_APPLICATION_DATA, "data", 4));
+
+    EXPECT_TRUE(set1.Intersection(set2));
+    EXPECT_EQ(expected, set1);
+}
+
+TEST(Intersection, NullSet) {
+    AuthorizationSet set1(AuthorizationSetBuilder()
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                              .Authorization(TAG_ACTIVE_DATETIME, 10));
+    AuthorizationSet set2;
+
+    EXPECT_TRUE(set1.Intersection(set2));
+    EXPECT_EQ(0U, set1.size());
+}
+
+TEST(Union, Overlap) {
+    AuthorizationSet set1(AuthorizationSetBuilder()
+                              .Authorization(TAG_ACTIVE_DATETIME, 10)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN));
+
+    AuthorizationSet set2(AuthorizationSetBuilder()
+                              .Authorization(TAG_APPLICATION_DATA, "data", 4)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY));
+
+    AuthorizationSet expected(AuthorizationSetBuilder()
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                                  .Authorization(TAG_ACTIVE_DATETIME, 10)
+                                  .Authorization(TAG_APPLICATION_DATA, "data", 4));
+
+    EXPECT_TRUE(set1.Union(set2));
+    EXPECT_EQ(expected, set1);
+}
+
+TEST(Append, BulkMatchesOneAtATime) {
+    keymaster_key_param_t params[] = {
+        Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN),
+        Authorization(TAG_APPLICATION_ID, "my_app", 6),
+        Authorization(TAG_KEY_SIZE, 256),
+        Authorization(TAG_APPLICATION_DATA, "data", 4),
+    };
+    AuthorizationSet one_at_a_time(AuthorizationSetBuilder().Authorization(TAG_USER_ID, 7));
+    for (const auto& param : params) one_at_a_time.push_back(param);
+
+    AuthorizationSet bulk(AuthorizationSetBuilder().Authorization(TAG_USER_ID, 7));
+    EXPECT_TRUE(bulk.push_back(params, array_length(params)));
+    EXPECT_EQ(one_at_a_time, bulk);
+
+    AuthorizationSet built(AuthorizationSetBuilder()
+                               .Authorization(TAG_USER_ID, 7)
+                               .Authorizations({params[0], params[1], params[2], params[3]}));
+    EXPECT_EQ(one_at_a_time, built);
+}
+
+TEST(Append, ReserveAvoidsReallocation) {
+    AuthorizationSet set;
+    ASSERT_TRUE(set.Reserve(3, 10));
+    const keymaster_key_param_t* elems = set.data();
+
+    set.push_back(TAG_APPLICATION_ID, "my_app", 6);
+    keymaster_blob_t app_id;
+    ASSERT_TRUE(set.GetTagValue(TAG_APPLICATION_ID, &app_id));
+    set.push_back(TAG_KEY_SIZE, 256);
+    set.push_back(TAG_APPLICATION_DATA, "data", 4);
+
+    EXPECT_EQ(elems, set.data());
+    keymaster_blob_t app_id_after;
+    ASSERT_TRUE(set.GetTagValue(TAG_APPLICATION_ID, &app_id_after));
+    EXPECT_EQ(app_id.data, app_id_after.data);
+    EXPECT_EQ(3U, set.size());
+}
+
+TEST(Append, GrowthIsGeometric) {
+    AuthorizationSet set;
+    const keymaster_key_param_t* elems = set.data();
+    size_t reallocations = 0;
+    for (uint32_t i = 0; i < 1000; ++i) {
+        set.push_back(TAG_USER_SECURE_ID, i);
+        if (set.data() != elems) {
+            ++reallocations;
+            elems = set.data();
+        }
+    }
+    EXPECT_EQ(1000U, set.size());
+    EXPECT_LE(reallocations, 10U);
+}
+
+AuthorizationSet BuildIndexableSet() {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                                .Authorization(TAG_KEY_SIZE, 256)
+                                .Authorization(TAG_PURPOSE, KM_PURPOSE_VERIFY)
+                                .Authorization(TAG_USER_ID, 7)
+                                .Authorization(TAG_DIGEST, KM_DIGEST_SHA_2_256)
+                                .Authorization(TAG_APPLICATION_ID, "my_app", 6)
+                                .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                                .Authorization(TAG_DIGEST, KM_DIGEST_NONE)
+                                .Authorization(TAG_ACTIVE_DATETIME, 10));
+}
+
+TEST(Index, FindMatchesLinearScan) {
+    AuthorizationSet linear = BuildIndexableSet();
+    AuthorizationSet indexed = BuildIndexableSet();
+    EXPECT_FALSE(linear.has_index());
+    ASSERT_TRUE(indexed.BuildIndex());
+    EXPECT_TRUE(indexed.has_index());
+
+    keymaster_tag_t tags[] = {TAG_PURPOSE,        TAG_ALGORITHM, TAG_KEY_SIZE,
+                              TAG_USER_ID,        TAG_DIGEST,    TAG_APPLICATION_ID,
+                              TAG_ACTIVE_DATETIME, TAG_MAC_LENGTH, TAG_PADDING};
+    for (auto tag : tags) {
+        EXPECT_EQ(linear.find(tag), indexed.find(tag));
+        for (int i = 0; i < static_cast<int>(linear.size()); ++i) {
+            EXPECT_EQ(linear.find(tag, i), indexed.find(tag, i));
+        }
+    }
+    EXPECT_EQ(linear.GetTagCount(TAG_PURPOSE), indexed.GetTagCount(TAG_PURPOSE));
+    EXPECT_TRUE(indexed.Contains(TAG_PURPOSE, KM_PURPOSE_ENCRYPT));
+    EXPECT_FALSE(indexed.Contains(TAG_PURPOSE, KM_PURPOSE_DECRYPT));
+}
+
+TEST(Index, ScansMatchLinearScanAcrossVectorWidths) {
+    // Enough elements that scans from every position end in each possible partial vector.
+    AuthorizationSet linear;
+    for (uint32_t i = 0; i < 23; ++i) {
+        linear.push_back(TAG_USER_ID, i);
+        if (i % 5 == 0) linear.push_back(TAG_KEY_SIZE, i);
+        if (i % 7 == 3) linear.push_back(TAG_PURPOSE, static_cast<keymaster_purpose_t>(i % 4));
+    }
+    AuthorizationSet indexed(linear);
+    ASSERT_TRUE(indexed.BuildIndex());
+
+    keymaster_tag_t tags[] = {TAG_USER_ID, TAG_KEY_SIZE, TAG_PURPOSE, TAG_MAC_LENGTH};
+    for (auto tag : tags) {
+        for (int i = -1; i < static_cast<int>(linear.size()); ++i) {
+            EXPECT_EQ(linear.find(tag, i), indexed.find(tag, i)) << tag << " from " << i;
+        }
+    }
+    EXPECT_TRUE(indexed.Contains(TAG_KEY_SIZE, 20));
+    EXPECT_FALSE(indexed.Contains(TAG_KEY_SIZE, 21));
+    EXPECT_TRUE(indexed.Contains(TAG_PURPOSE, KM_PURPOSE_SIGN));
+}
+
+TEST(Index, SmallSetNotIndexed) {
+    AuthorizationSet set(AuthorizationSetBuilder().Authorization(TAG_KEY_SIZE, 256));
+    EXPECT_FALSE(set.BuildIndex());
+    EXPECT_EQ(0, set.find(TAG_KEY_SIZE));
+}
+
+TEST(Index, InvalidatedByModification) {
+    AuthorizationSet set = BuildIndexableSet();
+    ASSERT_TRUE(set.BuildIndex());
+    EXPECT_EQ(-1, set.find(TAG_MAC_LENGTH));
+    set.push_back(TAG_MAC_LENGTH, 128);
+    EXPECT_FALSE(set.has_index());
+    EXPECT_EQ(static_cast<int>(set.size()) - 1, set.find(TAG_MAC_LENGTH));
+
+    ASSERT_TRUE(set.BuildIndex());
+    EXPECT_TRUE(set.erase(set.find(TAG_ALGORITHM)));
+    EXPECT_FALSE(set.has_index());
+    EXPECT_EQ(-1, set.find(TAG_ALGORITHM));
+    EXPECT_EQ(1, set.find(TAG_KEY_SIZE));
+
+    ASSERT_TRUE(set.BuildIndex());
+    set.Sort();
+    EXPECT_FALSE(set.has_index());
+}
+
+TEST(Index, BuiltOnDeserialize) {
+    AuthorizationSet set = BuildIndexableSet();
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    set.Serialize(buf.get(), buf.get() + size);
+
+    AuthorizationSet deserialized;
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(deserialized.Deserialize(&p, p + size));
+    EXPECT_TRUE(deserialized.has_index());
+    EXPECT_EQ(set, deserialized);
+    EXPECT_EQ(set.find(TAG_DIGEST, set.find(TAG_DIGEST)),
+              deserialized.find(TAG_DIGEST, deserialized.find(TAG_DIGEST)));
+}
+
+TEST(View, BorrowsIndirectData) {
+    AuthorizationSet set = BuildIndexableSet();
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    set.Serialize(buf.get(), buf.get() + size);
+
+    AuthorizationSet view;
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(view.DeserializeView(&p, p + size));
+    EXPECT_EQ(buf.get() + size, p);
+    EXPECT_TRUE(view.is_view());
+    EXPECT_EQ(set, view);
+
+    int pos = view.find(TAG_APPLICATION_ID);
+    ASSERT_NE(-1, pos);
+    EXPECT_TRUE(view[pos].blob.data >= buf.get() && view[pos].blob.data < buf.get() + size);
+
+    // Copies own their data.
+    AuthorizationSet copy(view);
+    EXPECT_FALSE(copy.is_view());
+    EXPECT_EQ(set, copy);
+
+    ASSERT_TRUE(view.Materialize());
+    EXPECT_FALSE(view.is_view());
+    memset(buf.get(), 0, size);
+    EXPECT_EQ(set, view);
+    EXPECT_EQ(set, copy);
+}
+
+TEST(View, MaterializedByPushBack) {
+    AuthorizationSet set = BuildIndexableSet();
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    set.Serialize(buf.get(), buf.get() + size);
+
+    AuthorizationSet view;
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(view.DeserializeView(&p, p + size));
+    ASSERT_TRUE(view.push_back(TAG_APPLICATION_DATA, "data", 4));
+    EXPECT_FALSE(view.is_view());
+
+    memset(buf.get(), 0, size);
+    set.push_back(TAG_APPLICATION_DATA, "data", 4);
+    EXPECT_EQ(set, view);
+}
+
+TEST(View, Malformed) {
+    AuthorizationSet set = BuildIndexableSet();
+    size_t size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    set.Serialize(buf.get(), buf.get() + size);
+
+    for (size_t len = 0; len < size; ++len) {
+        AuthorizationSet view;
+        const uint8_t* p = buf.get();
+        EXPECT_FALSE(view.DeserializeView(&p, p + len));
+        EXPECT_FALSE(view.is_view());
+    }
+}
+
+TEST(Shared, CopyOnWrite) {
+    AuthorizationSet set = BuildIndexableSet();
+    AuthorizationSet expected(set);
+    ASSERT_TRUE(set.Share());
+    EXPECT_TRUE(set.is_shared());
+    EXPECT_TRUE(set.has_index());
+
+    AuthorizationSet copy(set);
+    EXPECT_TRUE(copy.is_shared());
+    EXPECT_EQ(set.data(), copy.data());
+    EXPECT_EQ(expected, copy);
+
+    ASSERT_TRUE(copy.push_back(TAG_APPLICATION_DATA, "data", 4));
+    EXPECT_FALSE(copy.is_shared());
+    EXPECT_NE(set.data(), copy.data());
+    EXPECT_EQ(expected, set);
+    expected.push_back(TAG_APPLICATION_DATA, "data", 4);
+    EXPECT_EQ(expected, copy);
+
+    // The block outlives the set it was made from.
+    AuthorizationSet moved(std::move(copy));
+    copy = set;
+    set.Clear();
+    EXPECT_TRUE(copy.is_shared());
+    EXPECT_EQ(BuildIndexableSet(), copy);
+}
+
+// The hash a set would have if it were recomputed from scratch.
+uint64_t FreshContentHash(const AuthorizationSet& set) {
+    return AuthorizationSet(set.data(), set.size()).ContentHash();
+}
+
+TEST(ContentHash, IgnoresOrder) {
+    AuthorizationSet set = BuildIndexableSet();
+    AuthorizationSet reversed;
+    for (size_t i = set.size(); i > 0; --i) reversed.push_back(set.data()[i - 1]);
+    EXPECT_EQ(set.ContentHash(), reversed.ContentHash());
+
+    reversed.Sort();
+    EXPECT_EQ(set.ContentHash(), reversed.ContentHash());
+    EXPECT_EQ(FreshContentHash(set), set.ContentHash());
+}
+
+TEST(ContentHash, DistinguishesContents) {
+    AuthorizationSet set = BuildIndexableSet();
+    uint64_t hash = set.ContentHash();
+
+    AuthorizationSet other_value = BuildIndexableSet();
+    other_value[other_value.find(TAG_USER_ID)].integer = 8;
+    EXPECT_NE(hash, other_value.ContentHash());
+
+    AuthorizationSet other_blob = BuildIndexableSet();
+    other_blob.erase(other_blob.find(TAG_APPLICATION_ID));
+    other_blob.push_back(TAG_APPLICATION_ID, "my_apq", 6);
+    EXPECT_NE(hash, other_blob.ContentHash());
+
+    // Duplicates count.
+    AuthorizationSet duplicated = BuildIndexableSet();
+    duplicated.push_back(TAG_PURPOSE, KM_PURPOSE_SIGN);
+    EXPECT_NE(hash, duplicated.ContentHash());
+    duplicated.Deduplicate();
+    EXPECT_EQ(hash, duplicated.ContentHash());
+
+    EXPECT_EQ(0U, AuthorizationSet().ContentHash());
+}
+
+TEST(ContentHash, TracksModification) {
+    AuthorizationSet set = BuildIndexableSet();
+    set.ContentHash();
+
+    set.push_back(TAG_MAC_LENGTH, 128);
+    EXPECT_EQ(FreshContentHash(set), set.ContentHash());
+    set.push_back(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_DATA, "data", 4).build());
+    EXPECT_EQ(FreshContentHash(set), set.ContentHash());
+    EXPECT_TRUE(set.erase(set.find(TAG_KEY_SIZE)));
+    EXPECT_EQ(FreshContentHash(set), set.ContentHash());
+    set[set.find(TAG_MAC_LENGTH)].integer = 256;
+    EXPECT_EQ(FreshContentHash(set), set.ContentHash());
+
+    set.Difference(AuthorizationSetBuilder().Authorization(TAG_USER_ID, 7).build());
+    EXPECT_EQ(FreshContentHash(set), set.ContentHash());
+    set.Union(AuthorizationSetBuilder().Authorization(TAG_NO_AUTH_REQUIRED).build());
+    EXPECT_EQ(FreshContentHash(set), set.ContentHash());
+    set.Intersection(BuildIndexableSet());
+    EXPECT_EQ(FreshContentHash(set), set.ContentHash());
+
+    // Shared copies carry the hash, and keep it up to date once they are written to.
+    ASSERT_TRUE(set.Share());
+    AuthorizationSet copy(set);
+    EXPECT_EQ(set.ContentHash(), copy.ContentHash());
+    copy.push_back(TAG_MIN_MAC_LENGTH, 128);
+    EXPECT_FALSE(copy.is_shared());
+    EXPECT_EQ(FreshContentHash(copy), copy.ContentHash());
+    EXPECT_NE(set.ContentHash(), copy.ContentHash());
+
+    AuthorizationSet moved(std::move(copy));
+    EXPECT_EQ(FreshContentHash(moved), moved.ContentHash());
+    EXPECT_EQ(0U, copy.ContentHash());
+}
+
+TEST(Serialization, SizeTracksModification) {
+    AuthorizationSet set = BuildIndexableSet();
+    size_t size = set.SerializedSize();
+    set.push_back(TAG_MAC_LENGTH, 128);
+    EXPECT_EQ(size + 2 * sizeof(uint32_t), set.SerializedSize());
+
+    // Writable access may change the element type.
+    set[set.find(TAG_MAC_LENGTH)].tag = KM_TAG_ACTIVE_DATETIME;
+    EXPECT_EQ(size + sizeof(uint32_t) + sizeof(uint64_t), set.SerializedSize());
+
+    size = set.SerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, set.Serialize(buf.get(), buf.get() + size));
+
+    AuthorizationSet deserialized;
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(deserialized.Deserialize(&p, p + size));
+    EXPECT_EQ(size, deserialized.SerializedSize());
+    EXPECT_TRUE(deserialized.erase(0));
+    EXPECT_EQ(size - 2 * sizeof(uint32_t), deserialized.SerializedSize());
+}
+
+TEST(Varint, RoundTrip) {
+    uint64_t values[] = {0, 1, 127, 128, 300, UINT32_MAX, UINT64_MAX};
+    for (auto value : values) {
+        uint8_t buf[10];
+        uint8_t* end = append_varint_to_buf(buf, buf + sizeof(buf), value);
+        EXPECT_EQ(varint_size(value), static_cast<size_t>(end - buf));
+
+        const uint8_t* p = buf;
+        uint64_t read;
+        ASSERT_TRUE(copy_varint_from_buf(&p, end, &read));
+        EXPECT_EQ(value, read);
+        EXPECT_EQ(end, p);
+
+        // Truncated.
+        p = buf;
+        EXPECT_FALSE(copy_varint_from_buf(&p, end - 1, &read));
+    }
+
+    // Padded with a trailing zero group.
+    const uint8_t padded[] = {0x81, 0x00};
+    const uint8_t* p = padded;
+    uint64_t read;
+    EXPECT_FALSE(copy_varint_from_buf(&p, padded + sizeof(padded), &read));
+}
+
+TEST(Compact, RoundTrip) {
+    AuthorizationSet set = BuildIndexableSet();
+    set.push_back(TAG_NO_AUTH_REQUIRED);
+    set.push_back(TAG_ORIGINATION_EXPIRE_DATETIME, UINT64_MAX);
+
+    size_t size = set.CompactSerializedSize();
+    EXPECT_LT(size, set.SerializedSize());
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, set.CompactSerialize(buf.get(), buf.get() + size));
+
+    AuthorizationSet deserialized;
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(deserialized.CompactDeserialize(&p, p + size));
+    EXPECT_EQ(buf.get() + size, p);
+    EXPECT_EQ(set, deserialized);
+    EXPECT_TRUE(deserialized.has_index());
+
+    // Every truncation is rejected.
+    for (size_t i = 0; i < size; ++i) {
+        AuthorizationSet truncated;
+        p = buf.get();
+        EXPECT_FALSE(truncated.CompactDeserialize(&p, p + i)) << "Length " << i;
+    }
+}
+
+TEST(Columnar, RoundTrip) {
+    AuthorizationSet set = BuildIndexableSet();
+    set.push_back(TAG_NO_AUTH_REQUIRED);
+    set.push_back(TAG_ORIGINATION_EXPIRE_DATETIME, UINT64_MAX);
+    set.push_back(TAG_APPLICATION_ID, "app", 3);
+    set.push_back(TAG_APPLICATION_DATA, "data", 4);
+
+    size_t size = set.ColumnarSerializedSize();
+    EXPECT_EQ(sizeof(uint32_t) * 2 + set.size() * 12 + 6 + 3 + 4 /* blobs */, size);
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    EXPECT_EQ(buf.get() + size, set.ColumnarSerialize(buf.get(), buf.get() + size));
+
+    AuthorizationSet deserialized;
+    const uint8_t* p = buf.get();
+    ASSERT_TRUE(deserialized.ColumnarDeserialize(&p, p + size));
+    EXPECT_EQ(buf.get() + size, p);
+    EXPECT_EQ(set, deserialized);
+    EXPECT_TRUE(deserialized.has_index());
+
+    // Every truncation is rejected.
+    for (size_t i = 0; i < size; ++i) {
+        AuthorizationSet truncated;
+        p = buf.get();
+        EXPECT_FALSE(truncated.ColumnarDeserialize(&p, p + i)) << "Length " << i;
+    }
+}
+
+TEST(Columnar, RejectsBlobsOutsideArena) {
+    AuthorizationSet set;
+    set.push_back(TAG_APPLICATION_ID, "app", 3);
+    size_t size = set.ColumnarSerializedSize();
+    UniquePtr<uint8_t[]> buf(new uint8_t[size]);
+    set.ColumnarSerialize(buf.get(), buf.get() + size);
+
+    // The blob's length is the low half of its value, after the count and the tag.
+    uint64_t value = 4;
+    memcpy(buf.get() + 2 * sizeof(uint32_t), &value, sizeof(value));
+    AuthorizationSet deserialized;
+    const uint8_t* p = buf.get();
+    EXPECT_FALSE(deserialized.ColumnarDeserialize(&p, p + size));
+}
+
 }  // namespace test
 }  // namespace keymaster
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/contexts/background_ec_key_pool.h>
+
+#include <chrono>
+#include <thread>
+
+#include <openssl/ec.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+// Waits up to a minute for the pool to hold |count| P-256 keys.
+bool WaitForKeys(const BackgroundEcKeyPool& pool, size_t count) {
+    for (int i = 0; i < 600; ++i) {
+        if (pool.available(KM_EC_CURVE_P_256) == count) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return false;
+}
+
+}  // namespace
+
+TEST(BackgroundEcKeyPoolTest, FillsToDepthAndRefills) {
+    BackgroundEcKeyPool pool(2, {KM_EC_CURVE_P_256});
+    ASSERT_TRUE(WaitForKeys(pool, 2));
+
+    EC_KEY_Ptr key = pool.TakeKey(KM_EC_CURVE_P_256);
+    ASSERT_TRUE(key);
+    EXPECT_EQ(ec_get_shared_group(KM_EC_CURVE_P_256), EC_KEY_get0_group(key.get()));
+    EXPECT_EQ(1, EC_KEY_check_key(key.get()));
+
+    EC_KEY_Ptr other = pool.TakeKey(KM_EC_CURVE_P_256);
+    ASSERT_TRUE(other);
+    EXPECT_NE(0, BN_cmp(EC_KEY_get0_private_key(key.get()),
+                        EC_KEY_get0_private_key(other.get())));
+
+    EXPECT_TRUE(WaitForKeys(pool, 2));
+}
+
+TEST(BackgroundEcKeyPoolTest, OtherCurvesMiss) {
+    BackgroundEcKeyPool pool(1, {KM_EC_CURVE_P_256});
+    ASSERT_TRUE(WaitForKeys(pool, 1));
+
+    EXPECT_FALSE(pool.TakeKey(KM_EC_CURVE_P_384));
+    EXPECT_EQ(1U, pool.available(KM_EC_CURVE_P_256));
+}
+
+TEST(BackgroundEcKeyPoolTest, KeyExchangeUsesPooledKey) {
+    BackgroundEcKeyPool pool(1, {KM_EC_CURVE_P_256});
+    ASSERT_TRUE(WaitForKeys(pool, 1));
+
+    UniquePtr<NistCurveKeyExchange> key_exchange(
+        NistCurveKeyExchange::GenerateKeyExchange(KM_EC_CURVE_P_256, &pool));
+    ASSERT_TRUE(key_exchange);
+    EXPECT_EQ(0U, pool.available(KM_EC_CURVE_P_256));
+
+    // Curves the pool doesn't hold are generated on the spot.
+    key_exchange.reset(NistCurveKeyExchange::GenerateKeyExchange(KM_EC_CURVE_P_384, &pool));
+    EXPECT_TRUE(key_exchange);
+}
+
+TEST(BackgroundEcKeyPoolTest, ZeroDepthIsEmpty) {
+    BackgroundEcKeyPool pool(0, {KM_EC_CURVE_P_256});
+    EXPECT_FALSE(pool.TakeKey(KM_EC_CURVE_P_256));
+    EXPECT_EQ(0U, pool.available(KM_EC_CURVE_P_256));
+}
+
+}  // namespace test
+}  // namespace keymaster
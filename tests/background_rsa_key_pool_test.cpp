@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/contexts/background_rsa_key_pool.h>
+
+#include <chrono>
+#include <thread>
+
+#include <openssl/rsa.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+constexpr uint32_t kKeySize = 1024;
+constexpr uint64_t kExponent = 65537;
+
+// Waits up to a minute for the pool to hold |count| keys of the test size.
+bool WaitForKeys(const BackgroundRsaKeyPool& pool, size_t count) {
+    for (int i = 0; i < 600; ++i) {
+        if (pool.available(kKeySize, kExponent) == count) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    return false;
+}
+
+}  // namespace
+
+TEST(BackgroundRsaKeyPoolTest, FillsToDepthAndRefills) {
+    BackgroundRsaKeyPool pool(2, {{kKeySize, kExponent}});
+    ASSERT_TRUE(WaitForKeys(pool, 2));
+
+    RSA_Ptr key = pool.TakeKey(kKeySize, kExponent);
+    ASSERT_TRUE(key);
+    EXPECT_EQ(kKeySize, static_cast<uint32_t>(RSA_bits(key.get())));
+    EXPECT_EQ(kExponent, BN_get_word(RSA_get0_e(key.get())));
+    EXPECT_EQ(1, RSA_check_key(key.get()));
+
+    RSA_Ptr other = pool.TakeKey(kKeySize, kExponent);
+    ASSERT_TRUE(other);
+    EXPECT_NE(0, BN_cmp(RSA_get0_n(key.get()), RSA_get0_n(other.get())));
+
+    EXPECT_TRUE(WaitForKeys(pool, 2));
+}
+
+TEST(BackgroundRsaKeyPoolTest, OtherSpecsMiss) {
+    BackgroundRsaKeyPool pool(1, {{kKeySize, kExponent}});
+    ASSERT_TRUE(WaitForKeys(pool, 1));
+
+    EXPECT_FALSE(pool.TakeKey(2048, kExponent));
+    EXPECT_FALSE(pool.TakeKey(kKeySize, 3));
+    EXPECT_EQ(1U, pool.available(kKeySize, kExponent));
+}
+
+TEST(BackgroundRsaKeyPoolTest, ZeroDepthIsEmpty) {
+    BackgroundRsaKeyPool pool(0, {{kKeySize, kExponent}});
+    EXPECT_FALSE(pool.TakeKey(kKeySize, kExponent));
+    EXPECT_EQ(0U, pool.available(kKeySize, kExponent));
+}
+
+}  // namespace test
+}  // namespace keymaster
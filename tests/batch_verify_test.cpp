@@ -0,0 +1,159 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+
+#include <string>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+// More than one byte of the bitmap, ending part way through the last.
+constexpr size_t kMessageCount = 21;
+
+class BatchVerifyTest : public ::testing::Test {
+  protected:
+    BatchVerifyTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    void GenerateKey(AuthorizationSetBuilder builder) {
+        GenerateKeyRequest request(keymaster_.message_version());
+        request.key_description.Reinitialize(
+            AuthorizationSet(builder.Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse response(keymaster_.message_version());
+        keymaster_.GenerateKey(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+        key_blob_ = std::move(response.key_blob);
+    }
+
+    // Signs kMessageCount distinct messages into a verify request.
+    void SignMessages(const AuthorizationSet& params, BatchVerifyRequest* verify_request) {
+        BatchSignRequest request(keymaster_.message_version());
+        request.SetKeyMaterial(key_blob_);
+        request.additional_params.Reinitialize(params);
+        ASSERT_TRUE(request.SetMessageCount(kMessageCount));
+        ASSERT_TRUE(verify_request->SetMessageCount(kMessageCount));
+        for (size_t i = 0; i < kMessageCount; ++i) {
+            std::string message = "message " + std::to_string(i);
+            request.messages[i].Reinitialize(message.data(), message.size());
+            verify_request->messages[i].Reinitialize(message.data(), message.size());
+        }
+        BatchSignResponse response(keymaster_.message_version());
+        keymaster_.BatchSign(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+
+        verify_request->SetKeyMaterial(key_blob_);
+        verify_request->additional_params.Reinitialize(params);
+        for (size_t i = 0; i < kMessageCount; ++i) {
+            verify_request->signatures[i].Reinitialize(response.signatures[i]);
+        }
+    }
+
+    // Corrupts a few of the signatures and checks that exactly those fail.
+    void VerifyWithBadSignatures(BatchVerifyRequest* request) {
+        const size_t bad[] = {0, 9, kMessageCount - 1};
+        for (size_t i : bad) {
+            Buffer* signature = &request->signatures[i];
+            UniquePtr<uint8_t[]> copy(new uint8_t[signature->available_read()]);
+            memcpy(copy.get(), signature->peek_read(), signature->available_read());
+            copy[signature->available_read() / 2] ^= 0x10;
+            signature->Reinitialize(copy.get(), signature->available_read());
+        }
+
+        BatchVerifyResponse response(keymaster_.message_version());
+        keymaster_.BatchVerify(*request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+        ASSERT_EQ((kMessageCount + 7) / 8, response.verified.available_read());
+        for (size_t i = 0; i < kMessageCount; ++i) {
+            bool is_bad = i == bad[0] || i == bad[1] || i == bad[2];
+            EXPECT_EQ(!is_bad, response.IsVerified(i)) << "message " << i;
+        }
+        EXPECT_FALSE(response.IsVerified(kMessageCount));
+    }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+    KeymasterKeyBlob key_blob_;
+};
+
+TEST_F(BatchVerifyTest, Ecdsa) {
+    GenerateKey(AuthorizationSetBuilder().EcdsaSigningKey(256).Digest(KM_DIGEST_SHA_2_256));
+    AuthorizationSet params(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+    BatchVerifyRequest request(keymaster_.message_version());
+    SignMessages(params, &request);
+    VerifyWithBadSignatures(&request);
+}
+
+TEST_F(BatchVerifyTest, RsaDigested) {
+    GenerateKey(AuthorizationSetBuilder()
+                    .RsaSigningKey(2048, 65537)
+                    .Digest(KM_DIGEST_SHA_2_256)
+                    .Padding(KM_PAD_RSA_PSS));
+    AuthorizationSet params(
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Padding(KM_PAD_RSA_PSS));
+    BatchVerifyRequest request(keymaster_.message_version());
+    SignMessages(params, &request);
+    VerifyWithBadSignatures(&request);
+}
+
+TEST_F(BatchVerifyTest, RsaUndigested) {
+    GenerateKey(AuthorizationSetBuilder()
+                    .RsaSigningKey(2048, 65537)
+                    .Digest(KM_DIGEST_NONE)
+                    .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Digest(KM_DIGEST_NONE)
+                                .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+    BatchVerifyRequest request(keymaster_.message_version());
+    SignMessages(params, &request);
+    VerifyWithBadSignatures(&request);
+}
+
+TEST_F(BatchVerifyTest, OverlongMessageFailsBatch) {
+    GenerateKey(AuthorizationSetBuilder()
+                    .RsaSigningKey(2048, 65537)
+                    .Digest(KM_DIGEST_NONE)
+                    .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Digest(KM_DIGEST_NONE)
+                                .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+    BatchVerifyRequest request(keymaster_.message_version());
+    SignMessages(params, &request);
+    request.messages[5].Reinitialize(std::string(256, 'x').data(), 256);
+
+    // As when verifying it alone, a message too long for the key is an error, not a mismatch.
+    BatchVerifyResponse response(keymaster_.message_version());
+    keymaster_.BatchVerify(request, &response);
+    EXPECT_EQ(KM_ERROR_INVALID_INPUT_LENGTH, response.error);
+    EXPECT_EQ(0U, response.verified.available_read());
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/block_cipher_parallelism.h>
+
+#include <vector>
+
+#include <keymaster/km_openssl/aes_key.h>
+#include <keymaster/km_openssl/software_random_source.h>
+#include <keymaster/operation.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+class NullBlobMaker : public SoftwareKeyBlobMaker {
+  public:
+    keymaster_error_t CreateKeyBlob(const AuthorizationSet&, keymaster_key_origin_t,
+                                    const KeymasterKeyBlob&, KeymasterKeyBlob*, AuthorizationSet*,
+                                    AuthorizationSet*) const override {
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+};
+
+class BlockCipherParallelismTest : public ::testing::Test {
+  protected:
+    void TearDown() override { SetBlockCipherParallelism(saved_); }
+
+    // Encrypts |input| with a fixed key and nonce, split into an update of |first_update| bytes, an
+    // update of the rest and an empty finish.
+    std::vector<uint8_t> Encrypt(keymaster_block_mode_t mode, const std::vector<uint8_t>& input,
+                                 size_t first_update) {
+        const uint8_t key_bytes[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+        // A nonce near the top of the counter range makes the chunk counters carry.
+        const uint8_t nonce[16] = {0,    0,    0,    0,    0,    0,    0,    0,
+                                   0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xf0};
+        AesKeyFactory factory(blob_maker_, random_);
+        AuthorizationSet hw_enforced(AuthorizationSetBuilder()
+                                         .AesEncryptionKey(128)
+                                         .BlockMode(mode)
+                                         .Padding(KM_PAD_NONE)
+                                         .Authorization(TAG_CALLER_NONCE));
+        UniquePtr<Key> key;
+        EXPECT_EQ(KM_ERROR_OK, factory.LoadKey(KeymasterKeyBlob(key_bytes, sizeof(key_bytes)),
+                                               AuthorizationSet(), std::move(hw_enforced),
+                                               AuthorizationSet(), &key));
+        if (!key) return {};
+
+        AuthorizationSetBuilder begin_builder;
+        begin_builder.BlockMode(mode).Padding(KM_PAD_NONE);
+        if (mode == KM_MODE_CTR) begin_builder.Authorization(TAG_NONCE, nonce, sizeof(nonce));
+        AuthorizationSet begin_params(begin_builder);
+        keymaster_error_t error;
+        OperationPtr op = factory.GetOperationFactory(KM_PURPOSE_ENCRYPT)
+                              ->CreateOperation(std::move(*key), begin_params, &error);
+        EXPECT_EQ(KM_ERROR_OK, error);
+        if (!op) return {};
+        AuthorizationSet output_params;
+        EXPECT_EQ(KM_ERROR_OK, op->Begin(begin_params, &output_params));
+
+        Buffer output;
+        size_t consumed;
+        Buffer first(input.data(), first_update);
+        EXPECT_EQ(KM_ERROR_OK,
+                  op->Update(AuthorizationSet(), first, nullptr, &output, &consumed));
+        Buffer rest(input.data() + first_update, input.size() - first_update);
+        EXPECT_EQ(KM_ERROR_OK, op->Update(AuthorizationSet(), rest, nullptr, &output, &consumed));
+        EXPECT_EQ(KM_ERROR_OK,
+                  op->Finish(AuthorizationSet(), Buffer(), Buffer(), nullptr, &output));
+        return std::vector<uint8_t>(output.begin(), output.end());
+    }
+
+    void ExpectSameOutput(keymaster_block_mode_t mode, size_t length, size_t first_update) {
+        std::vector<uint8_t> input(length);
+        for (size_t i = 0; i < input.size(); ++i) input[i] = static_cast<uint8_t>(i * 7);
+
+        BlockCipherParallelism serial;
+        serial.min_chunk_bytes = 0;
+        SetBlockCipherParallelism(serial);
+        std::vector<uint8_t> expected = Encrypt(mode, input, first_update);
+        ASSERT_EQ(input.size(), expected.size());
+
+        BlockCipherParallelism parallel;
+        parallel.min_chunk_bytes = 4096;
+        parallel.max_threads = 3;
+        SetBlockCipherParallelism(parallel);
+        EXPECT_EQ(expected, Encrypt(mode, input, first_update));
+    }
+
+    NullBlobMaker blob_maker_;
+    SoftwareRandomSource random_;
+    const BlockCipherParallelism saved_ = GetBlockCipherParallelism();
+};
+
+}  // namespace
+
+TEST_F(BlockCipherParallelismTest, CtrMatchesSerial) {
+    // The first update leaves a partial block, and the second a partial final block.
+    ExpectSameOutput(KM_MODE_CTR, 10 * 4096 + 21, 5);
+}
+
+TEST_F(BlockCipherParallelismTest, EcbMatchesSerial) {
+    ExpectSameOutput(KM_MODE_ECB, 10 * 4096, 16);
+}
+
+}  // namespace test
+}  // namespace keymaster
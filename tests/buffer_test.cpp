@@ -0,0 +1,172 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/serializable.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+TEST(BufferTest, ExternalStorage) {
+    uint8_t storage[8] = {};
+    Buffer buffer;
+    buffer.UseExternalStorage(storage, sizeof(storage));
+    EXPECT_TRUE(buffer.uses_external_storage());
+    EXPECT_EQ(sizeof(storage), buffer.available_write());
+
+    ASSERT_TRUE(buffer.reserve(6));
+    ASSERT_TRUE(buffer.write(reinterpret_cast<const uint8_t*>("abcdef"), 6));
+    EXPECT_EQ(storage, buffer.peek_read());
+    EXPECT_EQ(0, memcmp("abcdef", storage, 6));
+
+    buffer.Clear();
+    EXPECT_FALSE(buffer.uses_external_storage());
+    EXPECT_EQ(0U, buffer.buffer_size());
+    // Clearing lets go of the storage without touching it.
+    EXPECT_EQ(0, memcmp("abcdef", storage, 6));
+}
+
+TEST(BufferTest, ExternalStorageGrowth) {
+    uint8_t storage[4] = {};
+    Buffer buffer;
+    buffer.UseExternalStorage(storage, sizeof(storage));
+    ASSERT_TRUE(buffer.write(reinterpret_cast<const uint8_t*>("abc"), 3));
+
+    ASSERT_TRUE(buffer.reserve(5));
+    EXPECT_FALSE(buffer.uses_external_storage());
+    EXPECT_NE(storage, buffer.peek_read());
+    ASSERT_TRUE(buffer.write(reinterpret_cast<const uint8_t*>("defgh"), 5));
+    ASSERT_EQ(8U, buffer.available_read());
+    EXPECT_EQ(0, memcmp("abcdefgh", buffer.peek_read(), 8));
+}
+
+TEST(BufferTest, MoveFromExternalStorageCopies) {
+    uint8_t storage[4] = {};
+    Buffer buffer;
+    buffer.UseExternalStorage(storage, sizeof(storage));
+    ASSERT_TRUE(buffer.write(reinterpret_cast<const uint8_t*>("abc"), 3));
+
+    Buffer moved(std::move(buffer));
+    EXPECT_FALSE(moved.uses_external_storage());
+    EXPECT_NE(storage, moved.peek_read());
+    ASSERT_EQ(3U, moved.available_read());
+    EXPECT_EQ(0, memcmp("abc", moved.peek_read(), 3));
+    EXPECT_FALSE(buffer.uses_external_storage());
+    EXPECT_EQ(0U, buffer.available_read());
+
+    // Moving into a buffer that uses external storage releases that storage.
+    Buffer target;
+    target.UseExternalStorage(storage, sizeof(storage));
+    target = std::move(moved);
+    EXPECT_FALSE(target.uses_external_storage());
+    ASSERT_EQ(3U, target.available_read());
+    EXPECT_EQ(0, memcmp("abc", target.peek_read(), 3));
+}
+
+TEST(BufferTest, GeometricGrowth) {
+    Buffer buffer;
+    uint8_t chunk[16] = {};
+    size_t reallocations = 0;
+    const uint8_t* storage = nullptr;
+    for (size_t i = 0; i < 1024; ++i) {
+        ASSERT_TRUE(buffer.reserve(sizeof(chunk)));
+        if (buffer.peek_read() != storage) ++reallocations;
+        storage = buffer.peek_read();
+        ASSERT_TRUE(buffer.write(chunk));
+    }
+    EXPECT_EQ(1024 * sizeof(chunk), buffer.available_read());
+    EXPECT_GE(11U, reallocations);
+}
+
+TEST(BufferTest, SizeHint) {
+    Buffer buffer;
+    buffer.set_size_hint(256);
+    EXPECT_EQ(0U, buffer.buffer_size());
+
+    ASSERT_TRUE(buffer.reserve(10));
+    EXPECT_EQ(256U, buffer.buffer_size());
+    const uint8_t* storage = buffer.peek_read();
+    for (size_t i = 0; i < 25; ++i) {
+        ASSERT_TRUE(buffer.reserve(10));
+        ASSERT_TRUE(buffer.write(reinterpret_cast<const uint8_t*>("0123456789"), 10));
+    }
+    EXPECT_EQ(storage, buffer.peek_read());
+}
+
+TEST(KeymasterBlobTest, SmallPayloadsInline) {
+    const uint8_t small[16] = {1, 2, 3};
+    KeymasterKeyBlob blob(small, sizeof(small));
+    EXPECT_TRUE(blob.is_inline());
+    ASSERT_EQ(sizeof(small), blob.size());
+    EXPECT_EQ(0, memcmp(small, blob.key_material, sizeof(small)));
+
+    uint8_t large[KeymasterKeyBlob::kInlineCapacity + 1] = {4, 5, 6};
+    KeymasterKeyBlob heap(large, sizeof(large));
+    EXPECT_FALSE(heap.is_inline());
+
+    // Moving an inline blob copies its payload and empties the source.
+    KeymasterKeyBlob moved(std::move(blob));
+    EXPECT_TRUE(moved.is_inline());
+    ASSERT_EQ(sizeof(small), moved.size());
+    EXPECT_EQ(0, memcmp(small, moved.key_material, sizeof(small)));
+    EXPECT_EQ(0U, blob.size());
+    EXPECT_EQ(nullptr, blob.key_material);
+
+    // Moving a heap blob hands over its allocation.
+    const uint8_t* heap_data = heap.key_material;
+    moved = std::move(heap);
+    EXPECT_EQ(heap_data, moved.key_material);
+    EXPECT_EQ(sizeof(large), moved.size());
+
+    KeymasterBlob copy(moved.key_material, 8);
+    KeymasterBlob assigned;
+    assigned = copy;
+    EXPECT_TRUE(assigned.is_inline());
+    EXPECT_NE(copy.data, assigned.data);
+    EXPECT_EQ(0, memcmp(large, assigned.data, 8));
+}
+
+TEST(KeymasterBlobTest, ReleaseInlineCopiesToHeap) {
+    KeymasterBlob blob(reinterpret_cast<const uint8_t*>("nonce"), 5);
+    ASSERT_TRUE(blob.is_inline());
+    keymaster_blob_t released = blob.release();
+    ASSERT_EQ(5U, released.data_length);
+    EXPECT_EQ(0, memcmp("nonce", released.data, 5));
+    EXPECT_EQ(nullptr, blob.data);
+    delete[] released.data;  // Must be a heap allocation.
+}
+
+TEST(KeymasterBlobTest, DeserializeInline) {
+    KeymasterBlob blob(reinterpret_cast<const uint8_t*>("tag"), 3);
+    uint8_t buf[16];
+    ASSERT_EQ(buf + blob.SerializedSize(), blob.Serialize(buf, buf + sizeof(buf)));
+
+    KeymasterBlob deserialized;
+    const uint8_t* p = buf;
+    ASSERT_TRUE(deserialized.Deserialize(&p, buf + blob.SerializedSize()));
+    EXPECT_TRUE(deserialized.is_inline());
+    ASSERT_EQ(3U, deserialized.size());
+    EXPECT_EQ(0, memcmp("tag", deserialized.data, 3));
+
+    p = buf;
+    EXPECT_FALSE(deserialized.Deserialize(&p, buf + blob.SerializedSize() - 1));
+    EXPECT_EQ(0U, deserialized.size());
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/mem.h>
+#include <openssl/x509.h>
+
+#include <keymaster/km_openssl/certificate_utils.h>
+#include <keymaster/km_openssl/openssl_utils.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+// Returns the DER encoding of a self-signed certificate of |version| (0 for v1, 2 for v3) with
+// distinct issuer and subject names.
+std::vector<uint8_t> MakeCertificate(long version) {
+    EC_KEY_Ptr ec_key(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    X509_Ptr cert(X509_new());
+    X509_NAME_Ptr issuer, subject;
+    if (!ec_key || !EC_KEY_generate_key(ec_key.get()) || !pkey ||
+        !EVP_PKEY_assign_EC_KEY(pkey.get(), ec_key.release()) || !cert ||
+        make_name_from_str("Issuer", &issuer) != KM_ERROR_OK ||
+        make_name_from_str("Subject", &subject) != KM_ERROR_OK ||
+        !X509_set_version(cert.get(), version) ||
+        !ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1234) ||
+        !X509_set_issuer_name(cert.get(), issuer.get()) ||
+        !X509_set_subject_name(cert.get(), subject.get()) ||
+        !X509_gmtime_adj(X509_get_notBefore(cert.get()), 0) ||
+        !X509_gmtime_adj(X509_get_notAfter(cert.get()), 3600) ||
+        !X509_set_pubkey(cert.get(), pkey.get()) ||
+        !X509_sign(cert.get(), pkey.get(), EVP_sha256())) {
+        return {};
+    }
+
+    int length = i2d_X509(cert.get(), nullptr);
+    if (length <= 0) return {};
+    std::vector<uint8_t> der(length);
+    uint8_t* p = der.data();
+    i2d_X509(cert.get(), &p);
+    return der;
+}
+
+// The subject of |der| as a full parse finds it, re-encoded.
+std::vector<uint8_t> ParsedSubject(const std::vector<uint8_t>& der) {
+    const uint8_t* p = der.data();
+    X509_Ptr cert(d2i_X509(nullptr, &p, der.size()));
+    if (!cert) return {};
+    uint8_t* subject = nullptr;
+    int length = i2d_X509_NAME(X509_get_subject_name(cert.get()), &subject);
+    if (length <= 0) return {};
+    std::vector<uint8_t> retval(subject, subject + length);
+    OPENSSL_free(subject);
+    return retval;
+}
+
+}  // namespace
+
+TEST(CertificateUtilsTest, GetSubjectDerMatchesFullParse) {
+    for (long version : {0, 2}) {
+        std::vector<uint8_t> der = MakeCertificate(version);
+        ASSERT_FALSE(der.empty());
+
+        keymaster_blob_t subject{};
+        ASSERT_EQ(KM_ERROR_OK, get_subject_der({der.data(), der.size()}, &subject));
+        EXPECT_EQ(ParsedSubject(der), std::vector<uint8_t>(subject.data,
+                                                           subject.data + subject.data_length))
+            << "version " << version;
+    }
+}
+
+TEST(CertificateUtilsTest, GetSubjectDerRejectsMalformedCertificates) {
+    std::vector<uint8_t> der = MakeCertificate(2);
+    ASSERT_FALSE(der.empty());
+
+    keymaster_blob_t subject{};
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, get_subject_der({der.data(), der.size() - 1}, &subject));
+    der.push_back(0);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, get_subject_der({der.data(), der.size()}, &subject));
+    const uint8_t garbage[] = {0x30, 0x03, 0x02, 0x01, 0x00};
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, get_subject_der({garbage, sizeof(garbage)}, &subject));
+}
+
+}  // namespace test
+}  // namespace keymaster
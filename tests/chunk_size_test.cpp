@@ -0,0 +1,118 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+#include <keymaster/operation.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+
+class ChunkSizeTest : public ::testing::Test {
+  protected:
+    ChunkSizeTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    int32_t ver() const { return keymaster_.message_version(); }
+
+    KeymasterKeyBlob GenerateKey(AuthorizationSetBuilder builder) {
+        GenerateKeyRequest request(ver());
+        request.key_description.Reinitialize(
+            AuthorizationSet(builder.Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse response(ver());
+        keymaster_.GenerateKey(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        return std::move(response.key_blob);
+    }
+
+    void Begin(const KeymasterKeyBlob& key, keymaster_purpose_t purpose,
+               AuthorizationSetBuilder params, BeginOperationResponse* response) {
+        BeginOperationRequest request(ver());
+        request.purpose = purpose;
+        request.SetKeyMaterial(key);
+        request.additional_params.Reinitialize(AuthorizationSet(params));
+        keymaster_.BeginOperation(request, response);
+    }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+};
+
+TEST_F(ChunkSizeTest, UpdateConsumesRecommendedChunk) {
+    KeymasterKeyBlob key = GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .Authorization(TAG_BLOCK_MODE, KM_MODE_CTR)
+                                           .Padding(KM_PAD_NONE));
+    BeginOperationResponse begin(ver());
+    Begin(key, KM_PURPOSE_ENCRYPT,
+          AuthorizationSetBuilder().Authorization(TAG_BLOCK_MODE, KM_MODE_CTR).Padding(KM_PAD_NONE),
+          &begin);
+    ASSERT_EQ(KM_ERROR_OK, begin.error);
+    EXPECT_EQ(Operation::kDefaultRecommendedChunkSize, begin.recommended_chunk_size);
+    EXPECT_EQ(context_->max_update_chunk_size(), begin.max_chunk_size);
+
+    UpdateOperationRequest update(ver());
+    update.op_handle = begin.op_handle;
+    ASSERT_TRUE(update.input.Reinitialize(std::string(begin.recommended_chunk_size, 'a').data(),
+                                          begin.recommended_chunk_size));
+    UpdateOperationResponse response(ver());
+    keymaster_.UpdateOperation(update, &response);
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+    EXPECT_EQ(begin.recommended_chunk_size, response.input_consumed);
+    EXPECT_EQ(begin.recommended_chunk_size, response.output.available_read());
+}
+
+TEST_F(ChunkSizeTest, UndigestedRsaIsLimitedToKeySize) {
+    KeymasterKeyBlob key = GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(2048, 65537)
+                                           .Digest(KM_DIGEST_NONE)
+                                           .Padding(KM_PAD_NONE));
+    BeginOperationResponse begin(ver());
+    Begin(key, KM_PURPOSE_SIGN,
+          AuthorizationSetBuilder().Digest(KM_DIGEST_NONE).Padding(KM_PAD_NONE), &begin);
+    ASSERT_EQ(KM_ERROR_OK, begin.error);
+    EXPECT_EQ(256U, begin.recommended_chunk_size);
+    EXPECT_EQ(256U, begin.max_chunk_size);
+}
+
+TEST_F(ChunkSizeTest, DigestedRsaUsesDefault) {
+    KeymasterKeyBlob key = GenerateKey(AuthorizationSetBuilder()
+                                           .RsaSigningKey(2048, 65537)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Padding(KM_PAD_RSA_PSS));
+    BeginOperationResponse begin(ver());
+    Begin(key, KM_PURPOSE_SIGN,
+          AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Padding(KM_PAD_RSA_PSS), &begin);
+    ASSERT_EQ(KM_ERROR_OK, begin.error);
+    EXPECT_EQ(Operation::kDefaultRecommendedChunkSize, begin.recommended_chunk_size);
+    EXPECT_EQ(context_->max_update_chunk_size(), begin.max_chunk_size);
+}
+
+}  // namespace test
+}  // namespace keymaster
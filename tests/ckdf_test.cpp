@@ -17,6 +17,7 @@
 #include <keymaster/km_openssl/ckdf.h>
 
 #include <gtest/gtest.h>
+#include <openssl/aes.h>
 #include <string.h>
 
 #include "android_keymaster_test_utils.h"
@@ -99,5 +100,37 @@ TEST(CkdfTest, Ckdf) {
     }
 }
 
+TEST(CkdfTest, KeyedCkdfMatchesOneShot) {
+    for (auto& test : kCkdfTests) {
+        auto key = hex2key(test.key);
+        auto label = hex2blob(test.label);
+        auto context = hex2blob(test.context);
+        auto expected = hex2blob(test.output);
+
+        Ckdf keyed;
+        ASSERT_EQ(KM_ERROR_OK, keyed.Init(key));
+        // Each derivation starts from the keyed state, whatever came before.
+        for (int i = 0; i < 2; ++i) {
+            KeymasterKeyBlob output;
+            output.Reset(expected.data_length);
+            ASSERT_EQ(KM_ERROR_OK, keyed.Derive(label, &context, 1 /* num_chunks */, &output));
+            EXPECT_TRUE(std::equal(output.begin(), output.end(), expected.begin()));
+
+            KeymasterKeyBlob other(AES_BLOCK_SIZE);
+            ASSERT_EQ(KM_ERROR_OK, keyed.Derive(KeymasterBlob(), &context, 1, &other));
+        }
+    }
+}
+
+TEST(CkdfTest, UninitializedOrBadKey) {
+    Ckdf keyed;
+    KeymasterKeyBlob output(AES_BLOCK_SIZE);
+    EXPECT_EQ(KM_ERROR_UNEXPECTED_NULL_POINTER,
+              keyed.Derive(KeymasterBlob(), nullptr /* context_chunks */, 0, &output));
+    uint8_t key[24] = {};
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_SIZE, keyed.Init(KeymasterKeyBlob(key, sizeof(key))));
+    EXPECT_FALSE(keyed.initialized());
+}
+
 }  // namespace test
 }  // namespace keymaster
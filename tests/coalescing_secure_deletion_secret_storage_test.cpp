@@ -0,0 +1,282 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/coalescing_secure_deletion_secret_storage.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <thread>
+
+#include <keymaster/km_openssl/software_random_source.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+// An in-memory slot store whose commits can be held back, to let writes pile up behind them.
+class FakeSlotStore : public SecureDeletionSlotStore {
+  public:
+    FakeSlotStore(uint32_t slot_count, uint32_t upgrade_only_slot_count)
+        : upgrade_only_slot_count_(upgrade_only_slot_count), slots_(slot_count) {}
+
+    uint32_t slot_count() const override { return static_cast<uint32_t>(slots_.size()); }
+    uint32_t upgrade_only_slot_count() const override { return upgrade_only_slot_count_; }
+
+    bool Load(Buffer* factory_reset_secret, std::vector<bool>* occupied) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        factory_reset_secret->Reinitialize(factory_reset_secret_.data(),
+                                           factory_reset_secret_.size());
+        occupied->clear();
+        for (const auto& slot : slots_) occupied->push_back(!slot.empty());
+        return true;
+    }
+
+    bool ReadSlot(uint32_t key_slot, Buffer* secret) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto& slot = slots_[key_slot - 1];
+        return secret->Reinitialize(slot.data(), slot.size());
+    }
+
+    bool Commit(const Buffer* factory_reset_secret, const SlotWrite* writes,
+                size_t count) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++commits_;
+        released_.wait(lock, [this] { return !held_; });
+        if (fail_) return false;
+        if (factory_reset_secret) {
+            factory_reset_secret_.assign(factory_reset_secret->begin(),
+                                         factory_reset_secret->end());
+        }
+        for (size_t i = 0; i < count; ++i) {
+            slots_[writes[i].key_slot - 1].assign(writes[i].secret->begin(),
+                                                  writes[i].secret->end());
+        }
+        batch_sizes_.push_back(count);
+        return true;
+    }
+
+    void Erase() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        factory_reset_secret_.clear();
+        for (auto& slot : slots_) slot.clear();
+    }
+
+    void Hold() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        held_ = true;
+    }
+    void Release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            held_ = false;
+        }
+        released_.notify_all();
+    }
+    void set_fail(bool fail) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fail_ = fail;
+    }
+
+    size_t commits() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return commits_;
+    }
+    // Sizes of the slot write batches committed so far.
+    std::vector<size_t> batch_sizes() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return batch_sizes_;
+    }
+    bool slot_empty(uint32_t key_slot) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return slots_[key_slot - 1].empty();
+    }
+
+  private:
+    const uint32_t upgrade_only_slot_count_;
+    std::mutex mutex_;
+    std::condition_variable released_;
+    bool held_ = false;
+    bool fail_ = false;
+    size_t commits_ = 0;
+    std::vector<size_t> batch_sizes_;
+    std::vector<uint8_t> factory_reset_secret_;
+    std::vector<std::vector<uint8_t>> slots_;
+};
+
+bool SameContents(const Buffer& a, const Buffer& b) {
+    return a.available_read() == b.available_read() &&
+           std::equal(a.begin(), a.end(), b.begin());
+}
+
+// Waits up to ten seconds for `storage` to have `count` writes queued.
+bool WaitForQueued(const CoalescingSecureDeletionSecretStorage& storage, size_t count) {
+    for (int i = 0; i < 1000; ++i) {
+        if (storage.queued_writes() == count) return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return false;
+}
+
+}  // namespace
+
+TEST(CoalescingSecureDeletionSecretStorageTest, CreateGetDelete) {
+    SoftwareRandomSource random;
+    FakeSlotStore store(4, 1);
+    CoalescingSecureDeletionSecretStorage storage(random, store);
+
+    auto data = storage.CreateDataForNewKey(false /* secure_deletion */, false /* is_upgrade */);
+    ASSERT_TRUE(data);
+    EXPECT_EQ(CoalescingSecureDeletionSecretStorage::kFactoryResetSecretSize,
+              data->factory_reset_secret.available_read());
+    EXPECT_EQ(0U, data->key_slot);
+    EXPECT_EQ(0U, data->secure_deletion_secret.available_read());
+
+    auto key = storage.CreateDataForNewKey(true /* secure_deletion */, false /* is_upgrade */);
+    ASSERT_TRUE(key);
+    ASSERT_NE(0U, key->key_slot);
+    EXPECT_TRUE(SameContents(data->factory_reset_secret, key->factory_reset_secret));
+    EXPECT_EQ(CoalescingSecureDeletionSecretStorage::kSecureDeletionSecretSize,
+              key->secure_deletion_secret.available_read());
+    EXPECT_FALSE(store.slot_empty(key->key_slot));
+
+    SecureDeletionData read = storage.GetDataForKey(key->key_slot);
+    EXPECT_EQ(key->key_slot, read.key_slot);
+    EXPECT_TRUE(SameContents(key->factory_reset_secret, read.factory_reset_secret));
+    EXPECT_TRUE(SameContents(key->secure_deletion_secret, read.secure_deletion_secret));
+
+    storage.DeleteKey(key->key_slot);
+    EXPECT_TRUE(store.slot_empty(key->key_slot));
+
+    // A second storage over the same store sees the same factory reset secret.
+    CoalescingSecureDeletionSecretStorage reloaded(random, store);
+    read = reloaded.GetDataForKey(0);
+    EXPECT_TRUE(SameContents(key->factory_reset_secret, read.factory_reset_secret));
+}
+
+TEST(CoalescingSecureDeletionSecretStorageTest, UpgradeOnlySlots) {
+    SoftwareRandomSource random;
+    FakeSlotStore store(2, 1);
+    CoalescingSecureDeletionSecretStorage storage(random, store);
+
+    auto first = storage.CreateDataForNewKey(true /* secure_deletion */, false /* is_upgrade */);
+    ASSERT_TRUE(first);
+    EXPECT_EQ(1U, first->key_slot);
+
+    // The only slot left is reserved for upgrades.
+    auto second = storage.CreateDataForNewKey(true /* secure_deletion */, false /* is_upgrade */);
+    ASSERT_TRUE(second);
+    EXPECT_EQ(0U, second->key_slot);
+
+    auto upgrade = storage.CreateDataForNewKey(true /* secure_deletion */, true /* is_upgrade */);
+    ASSERT_TRUE(upgrade);
+    EXPECT_EQ(2U, upgrade->key_slot);
+
+    auto full = storage.CreateDataForNewKey(true /* secure_deletion */, true /* is_upgrade */);
+    ASSERT_TRUE(full);
+    EXPECT_EQ(0U, full->key_slot);
+}
+
+TEST(CoalescingSecureDeletionSecretStorageTest, CoalescesConcurrentWrites) {
+    constexpr size_t kThreads = 8;
+    SoftwareRandomSource random;
+    FakeSlotStore store(32, 0);
+    CoalescingSecureDeletionSecretStorage storage(random, store);
+    ASSERT_TRUE(storage.CreateDataForNewKey(false /* secure_deletion */, false /* is_upgrade */));
+    size_t commits = store.commits();
+
+    // Hold the first commit so the other writes queue up behind it.
+    store.Hold();
+    std::vector<uint32_t> key_slots(kThreads + 1);
+    std::vector<std::thread> threads;
+    threads.emplace_back(
+        [&] { key_slots[0] = storage.CreateDataForNewKey(true, false)->key_slot; });
+    while (store.commits() == commits) std::this_thread::yield();
+    for (size_t i = 1; i <= kThreads; ++i) {
+        threads.emplace_back(
+            [&, i] { key_slots[i] = storage.CreateDataForNewKey(true, false)->key_slot; });
+    }
+    ASSERT_TRUE(WaitForQueued(storage, kThreads));
+    store.Release();
+    for (auto& thread : threads) thread.join();
+
+    EXPECT_EQ(commits + 2, store.commits());
+    // The first commit created the factory reset secret.
+    EXPECT_EQ((std::vector<size_t>{0, 1, kThreads}), store.batch_sizes());
+    std::set<uint32_t> distinct(key_slots.begin(), key_slots.end());
+    EXPECT_EQ(kThreads + 1, distinct.size());
+    EXPECT_EQ(0U, distinct.count(0));
+
+    // Asynchronous deletions coalesce too, and are durable after Flush().
+    store.Hold();
+    for (uint32_t key_slot : key_slots) storage.DeleteKeyAsync(key_slot);
+    store.Release();
+    storage.Flush();
+    for (uint32_t key_slot : key_slots) EXPECT_TRUE(store.slot_empty(key_slot));
+    EXPECT_LE(store.commits(), commits + 4);
+}
+
+TEST(CoalescingSecureDeletionSecretStorageTest, DeleteKeysSharesOneCommit) {
+    SoftwareRandomSource random;
+    FakeSlotStore store(8, 0);
+    CoalescingSecureDeletionSecretStorage storage(random, store);
+    std::vector<uint32_t> key_slots;
+    for (int i = 0; i < 4; ++i) {
+        auto data = storage.CreateDataForNewKey(true /* secure_deletion */, false /* is_upgrade */);
+        ASSERT_TRUE(data);
+        key_slots.push_back(data->key_slot);
+    }
+    // Slot 0 and slots not in use are skipped.
+    key_slots.push_back(0);
+    key_slots.push_back(8);
+
+    size_t commits = store.commits();
+    storage.DeleteKeys(key_slots.data(), key_slots.size());
+    EXPECT_EQ(commits + 1, store.commits());
+    EXPECT_EQ(4U, store.batch_sizes().back());
+    for (int i = 0; i < 4; ++i) EXPECT_TRUE(store.slot_empty(key_slots[i]));
+}
+
+TEST(CoalescingSecureDeletionSecretStorageTest, FailedCommit) {
+    SoftwareRandomSource random;
+    FakeSlotStore store(1, 0);
+    CoalescingSecureDeletionSecretStorage storage(random, store);
+    ASSERT_TRUE(storage.CreateDataForNewKey(false /* secure_deletion */, false /* is_upgrade */));
+
+    store.set_fail(true);
+    auto data = storage.CreateDataForNewKey(true /* secure_deletion */, false /* is_upgrade */);
+    ASSERT_TRUE(data);
+    EXPECT_EQ(0U, data->key_slot);
+    EXPECT_EQ(0U, data->secure_deletion_secret.available_read());
+
+    // The slot was released when the write failed.
+    store.set_fail(false);
+    data = storage.CreateDataForNewKey(true /* secure_deletion */, false /* is_upgrade */);
+    ASSERT_TRUE(data);
+    EXPECT_EQ(1U, data->key_slot);
+
+    storage.DeleteAllKeys();
+    EXPECT_TRUE(store.slot_empty(1));
+    auto fresh = storage.CreateDataForNewKey(false /* secure_deletion */, false /* is_upgrade */);
+    ASSERT_TRUE(fresh);
+    EXPECT_FALSE(SameContents(data->factory_reset_secret, fresh->factory_reset_secret));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/coalescing_secure_key_storage.h>
+
+#include <chrono>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <keymaster/android_keymaster_utils.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+// An in-memory key store whose deletions can be held back, to let more pile up behind them.
+class FakeKeyStore : public SecureKeyStorage {
+  public:
+    keymaster_error_t WriteKey(const km_id_t keyid, const KeymasterKeyBlob&) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        keys_.insert(keyid);
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t KeyExists(const km_id_t keyid, bool* exists) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        *exists = keys_.count(keyid) != 0;
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t DeleteKey(const km_id_t keyid) override { return DeleteKeys(&keyid, 1); }
+    keymaster_error_t DeleteKeys(const km_id_t* keyids, size_t count) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ++commits_;
+        released_.wait(lock, [this] { return !held_; });
+        if (fail_) return KM_ERROR_UNKNOWN_ERROR;
+        for (size_t i = 0; i < count; ++i) keys_.erase(keyids[i]);
+        batch_sizes_.push_back(count);
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t DeleteAllKeys() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        keys_.clear();
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t HasSlot(bool* has_slot) override {
+        *has_slot = true;
+        return KM_ERROR_OK;
+    }
+
+    void Hold() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        held_ = true;
+    }
+    void Release() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            held_ = false;
+        }
+        released_.notify_all();
+    }
+    void set_fail(bool fail) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fail_ = fail;
+    }
+
+    size_t commits() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return commits_;
+    }
+    // Sizes of the deletion batches committed so far.
+    std::vector<size_t> batch_sizes() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return batch_sizes_;
+    }
+    bool stored(km_id_t keyid) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return keys_.count(keyid) != 0;
+    }
+
+  private:
+    std::mutex mutex_;
+    std::condition_variable released_;
+    bool held_ = false;
+    bool fail_ = false;
+    size_t commits_ = 0;
+    std::vector<size_t> batch_sizes_;
+    std::set<km_id_t> keys_;
+};
+
+// Waits for |condition|, giving up after a few seconds so a broken build fails instead of hanging.
+template <typename Condition> bool WaitFor(Condition condition) {
+    for (int i = 0; i < 5000 && !condition(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return condition();
+}
+
+// FakeKeyStore only keeps key ids, so every key is written with the same blob.
+const KeymasterKeyBlob kBlob;
+
+}  // namespace
+
+TEST(CoalescingSecureKeyStorageTest, DeleteIsDurableOnReturn) {
+    FakeKeyStore store;
+    CoalescingSecureKeyStorage storage(store);
+    ASSERT_EQ(KM_ERROR_OK, storage.WriteKey(1, kBlob));
+    bool exists = false;
+    ASSERT_EQ(KM_ERROR_OK, storage.KeyExists(1, &exists));
+    EXPECT_TRUE(exists);
+
+    EXPECT_EQ(KM_ERROR_OK, storage.DeleteKey(1));
+    EXPECT_FALSE(store.stored(1));
+    ASSERT_EQ(KM_ERROR_OK, storage.KeyExists(1, &exists));
+    EXPECT_FALSE(exists);
+}
+
+TEST(CoalescingSecureKeyStorageTest, ConcurrentDeletesShareACommit) {
+    constexpr km_id_t kKeyCount = 8;
+    FakeKeyStore store;
+    CoalescingSecureKeyStorage storage(store);
+    for (km_id_t keyid = 0; keyid <= kKeyCount; ++keyid) storage.WriteKey(keyid, kBlob);
+
+    // Hold the first deletion in storage while the others queue up behind it.
+    store.Hold();
+    std::thread first([&] { EXPECT_EQ(KM_ERROR_OK, storage.DeleteKey(0)); });
+    ASSERT_TRUE(WaitFor([&] { return store.commits() == 1; }));
+
+    std::vector<std::thread> threads;
+    for (km_id_t keyid = 1; keyid <= kKeyCount; ++keyid) {
+        threads.emplace_back(
+            [&storage, keyid] { EXPECT_EQ(KM_ERROR_OK, storage.DeleteKey(keyid)); });
+    }
+    ASSERT_TRUE(WaitFor([&] { return storage.queued_deletes() == kKeyCount; }));
+
+    // Queued keys read as absent before their deletion is durable.
+    bool exists = true;
+    ASSERT_EQ(KM_ERROR_OK, storage.KeyExists(kKeyCount, &exists));
+    EXPECT_FALSE(exists);
+    EXPECT_TRUE(store.stored(kKeyCount));
+
+    store.Release();
+    first.join();
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ((std::vector<size_t>{1, kKeyCount}), store.batch_sizes());
+    for (km_id_t keyid = 0; keyid <= kKeyCount; ++keyid) EXPECT_FALSE(store.stored(keyid));
+}
+
+TEST(CoalescingSecureKeyStorageTest, BatchesAreBounded) {
+    FakeKeyStore store;
+    CoalescingSecureKeyStorage storage(store, 3 /* max_batch */);
+    store.Hold();
+    for (km_id_t keyid = 0; keyid < 7; ++keyid) storage.DeleteKeyAsync(keyid);
+    ASSERT_TRUE(WaitFor([&] { return store.commits() == 1; }));
+    store.Release();
+    storage.Flush();
+    EXPECT_EQ((std::vector<size_t>{3, 3, 1}), store.batch_sizes());
+}
+
+TEST(CoalescingSecureKeyStorageTest, FailedDeleteKeepsKeyRetired) {
+    FakeKeyStore store;
+    CoalescingSecureKeyStorage storage(store);
+    storage.WriteKey(5, kBlob);
+    store.set_fail(true);
+    EXPECT_EQ(KM_ERROR_UNKNOWN_ERROR, storage.DeleteKey(5));
+    EXPECT_TRUE(store.stored(5));
+
+    // The key is still in storage, but must not be usable again.
+    bool exists = true;
+    ASSERT_EQ(KM_ERROR_OK, storage.KeyExists(5, &exists));
+    EXPECT_FALSE(exists);
+
+    // Writing it again brings it back.
+    store.set_fail(false);
+    ASSERT_EQ(KM_ERROR_OK, storage.WriteKey(5, kBlob));
+    ASSERT_EQ(KM_ERROR_OK, storage.KeyExists(5, &exists));
+    EXPECT_TRUE(exists);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <thread>
+
+#include <keymaster/concurrent_android_keymaster.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+// These tests exercise only the asynchronous plumbing.  Requests without TAG_ALGORITHM fail with
+// KM_ERROR_UNSUPPORTED_ALGORITHM before the context is used, so no context is needed.
+using Status = ConcurrentAndroidKeymaster::AsyncStatus;
+
+TEST(ConcurrentAndroidKeymasterTest, PollCollectsGenerateKeyResponse) {
+    ConcurrentAndroidKeymaster keymaster(nullptr /* context */, 4);
+    auto ticket = keymaster.GenerateKeyAsync(
+        std::make_unique<GenerateKeyRequest>(keymaster.message_version()));
+    ASSERT_NE(0U, ticket);
+
+    std::unique_ptr<GenerateKeyResponse> response;
+    Status status;
+    while ((status = keymaster.PollGenerateKey(ticket, &response)) == Status::PENDING) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(Status::COMPLETE, status);
+    ASSERT_TRUE(response);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, response->error);
+
+    EXPECT_EQ(Status::UNKNOWN, keymaster.PollGenerateKey(ticket, &response));
+}
+
+TEST(ConcurrentAndroidKeymasterTest, CallbackReceivesImportKeyResponse) {
+    ConcurrentAndroidKeymaster keymaster(nullptr /* context */, 4);
+    std::promise<keymaster_error_t> result;
+    auto ticket = keymaster.ImportKeyAsync(
+        std::make_unique<ImportKeyRequest>(keymaster.message_version()),
+        [&](ConcurrentAndroidKeymaster::AsyncTicket, std::unique_ptr<ImportKeyResponse> response) {
+            result.set_value(response->error);
+        });
+    ASSERT_NE(0U, ticket);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, result.get_future().get());
+
+    std::unique_ptr<ImportKeyResponse> response;
+    EXPECT_EQ(Status::UNKNOWN, keymaster.PollImportKey(ticket, &response));
+}
+
+TEST(ConcurrentAndroidKeymasterTest, NullRequestIsRejected) {
+    ConcurrentAndroidKeymaster keymaster(nullptr /* context */, 4);
+    EXPECT_EQ(0U, keymaster.GenerateKeyAsync(nullptr));
+}
+
+TEST(ConcurrentAndroidKeymasterTest, DestructionCompletesQueuedCalls) {
+    constexpr size_t kCalls = 32;
+    std::atomic<size_t> completed{0};
+    {
+        ConcurrentAndroidKeymaster keymaster(nullptr /* context */, 4, kDefaultMessageVersion,
+                                             1 /* async_workers */);
+        for (size_t i = 0; i < kCalls; ++i) {
+            keymaster.GenerateKeyAsync(
+                std::make_unique<GenerateKeyRequest>(keymaster.message_version()),
+                [&](ConcurrentAndroidKeymaster::AsyncTicket,
+                    std::unique_ptr<GenerateKeyResponse>) { ++completed; });
+        }
+    }
+    EXPECT_EQ(kCalls, completed.load());
+}
+
+}  // namespace test
+}  // namespace keymaster
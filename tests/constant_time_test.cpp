@@ -0,0 +1,63 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/constant_time.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/mem.h>
+
+namespace keymaster {
+namespace test {
+
+// Lengths around every kernel boundary, at every alignment, with a difference at every position.
+TEST(ConstantTimeEqualsTest, FindsEveryDifference) {
+    for (size_t offset = 0; offset < 16; ++offset) {
+        for (size_t length = 0; length <= 70; ++length) {
+            std::vector<uint8_t> a(offset + length);
+            std::vector<uint8_t> b(offset + length);
+            for (size_t i = 0; i < a.size(); ++i) a[i] = b[i] = static_cast<uint8_t>(i * 7 + 1);
+            EXPECT_TRUE(ConstantTimeEquals(a.data() + offset, b.data() + offset, length));
+
+            for (size_t i = offset; i < a.size(); ++i) {
+                b[i] ^= 0x80;
+                EXPECT_FALSE(ConstantTimeEquals(a.data() + offset, b.data() + offset, length))
+                    << "offset " << offset << " length " << length << " byte " << i;
+                b[i] ^= 0x80;
+            }
+        }
+    }
+}
+
+TEST(ConstantTimeEqualsTest, MatchesMemcmpS) {
+    const uint8_t a[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17};
+    const uint8_t b[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 18};
+    EXPECT_EQ(0, memcmp_s(a, a, sizeof(a)));
+    EXPECT_NE(0, memcmp_s(a, b, sizeof(a)));
+    EXPECT_EQ(0, memcmp_s(a, b, sizeof(a) - 1));
+}
+
+TEST(ConstantTimeEqualsTest, ReportsKernel) {
+    std::string kernel = ConstantTimeEqualsKernel();
+    EXPECT_TRUE(kernel == "sse2" || kernel == "neon" || kernel == "generic") << kernel;
+}
+
+}  // namespace test
+}  // namespace keymaster
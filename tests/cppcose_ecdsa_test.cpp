@@ -0,0 +1,89 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/cppcose/cppcose.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+using cppcose::bytevec;
+
+// A fresh P-256 key pair: its private scalar and the COSE_Key of its public half.
+void GenerateP256Key(bytevec* privateKey, bytevec* coseKey) {
+    bssl::UniquePtr<EC_KEY> ecKey(EC_KEY_new_by_curve_name(NID_X9_62_prime256v1));
+    ASSERT_TRUE(ecKey);
+    ASSERT_EQ(1, EC_KEY_generate_key(ecKey.get()));
+
+    privateKey->resize(32);
+    ASSERT_EQ(1, BN_bn2bin_padded(privateKey->data(), privateKey->size(),
+                                  EC_KEY_get0_private_key(ecKey.get())));
+    const EC_GROUP* group = EC_KEY_get0_group(ecKey.get());
+    uint8_t point[65];
+    ASSERT_EQ(sizeof(point),
+              EC_POINT_point2oct(group, EC_KEY_get0_public_key(ecKey.get()),
+                                 POINT_CONVERSION_UNCOMPRESSED, point, sizeof(point), nullptr));
+    *coseKey = cppbor::Map()
+                   .add(cppcose::CoseKey::KEY_TYPE, cppcose::EC2)
+                   .add(cppcose::CoseKey::ALGORITHM, cppcose::ES256)
+                   .add(cppcose::CoseKey::CURVE, cppcose::P256)
+                   .add(cppcose::CoseKey::PUBKEY_X, bytevec(point + 1, point + 33))
+                   .add(cppcose::CoseKey::PUBKEY_Y, bytevec(point + 33, point + 65))
+                   .canonicalize()
+                   .encode();
+}
+
+TEST(CppCoseEcdsaTest, ParsedKeySignsVerifiableCoseSign1s) {
+    bytevec privateKey, coseKey;
+    ASSERT_NO_FATAL_FAILURE(GenerateP256Key(&privateKey, &coseKey));
+    auto key = cppcose::EcdsaP256Key::create(privateKey);
+    ASSERT_TRUE(key) << key.message();
+
+    const bytevec aad = {1, 2, 3};
+    for (uint8_t i = 0; i < 16; ++i) {
+        bytevec payload(i, i);
+        auto sign1 = cppcose::constructECDSACoseSign1(*key, {} /* protectedParams */, payload, aad);
+        ASSERT_TRUE(sign1) << sign1.message();
+        // Signatures are r and s, fixed-width, however short the DER INTEGERs were.
+        ASSERT_EQ(64U, sign1->get(cppcose::kCoseSign1Signature)->asBstr()->value().size());
+
+        auto verified = cppcose::verifyAndParseCoseSign1(&*sign1, coseKey, aad);
+        ASSERT_TRUE(verified) << verified.message();
+        EXPECT_EQ(payload, *verified);
+    }
+}
+
+TEST(CppCoseEcdsaTest, RawKeyMatchesParsedKey) {
+    bytevec privateKey, coseKey;
+    ASSERT_NO_FATAL_FAILURE(GenerateP256Key(&privateKey, &coseKey));
+
+    const bytevec payload = {4, 5, 6};
+    auto sign1 = cppcose::constructECDSACoseSign1(privateKey, {} /* protectedParams */, payload,
+                                                  {} /* aad */);
+    ASSERT_TRUE(sign1) << sign1.message();
+    auto verified = cppcose::verifyAndParseCoseSign1(&*sign1, coseKey, {} /* aad */);
+    ASSERT_TRUE(verified) << verified.message();
+    EXPECT_EQ(payload, *verified);
+}
+
+TEST(CppCoseEcdsaTest, RejectsInvalidPrivateKey) {
+    EXPECT_FALSE(cppcose::EcdsaP256Key::create(bytevec(32, 0)));
+    EXPECT_FALSE(cppcose::EcdsaP256Key::create(bytevec(32, 0xFF)));
+}
+
+}  // namespace test
+}  // namespace keymaster
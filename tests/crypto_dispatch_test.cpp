@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/crypto_dispatch.h>
+
+#include <string>
+
+#include <keymaster/km_openssl/block_cipher_parallelism.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+TEST(CryptoDispatchTest, ProbedOnce) {
+    EXPECT_EQ(&GetCryptoDispatch(), &GetCryptoDispatch());
+}
+
+TEST(CryptoDispatchTest, KernelsFollowFeatures) {
+    const CryptoDispatch& dispatch = GetCryptoDispatch();
+    const CpuCryptoFeatures& features = dispatch.features;
+
+    EXPECT_EQ(features.aes, std::string(dispatch.aes_kernel) == "hardware");
+    EXPECT_EQ(features.carryless_multiply, std::string(dispatch.ghash_kernel) == "hardware");
+    EXPECT_EQ(features.sha256, std::string(dispatch.sha256_kernel) == "hardware");
+    EXPECT_STREQ("generic", dispatch.des_kernel);
+    EXPECT_NE(std::string(), dispatch.ocb_kernel);
+    EXPECT_GT(dispatch.block_cipher_min_chunk_bytes, 0U);
+}
+
+#if defined(__x86_64__) || (defined(__aarch64__) && defined(__linux__))
+TEST(CryptoDispatchTest, AgreesWithBoringSsl) {
+    // BoringSSL only reports AES hardware if GHASH has it too, and not at all if it was built
+    // without assembly.
+    const CryptoDispatch& dispatch = GetCryptoDispatch();
+    if (dispatch.boringssl_aes_hardware) {
+        EXPECT_TRUE(dispatch.features.aes);
+        EXPECT_TRUE(dispatch.features.carryless_multiply);
+    }
+}
+#endif
+
+TEST(CryptoDispatchTest, SoftwareAesGetsSmallerChunks) {
+    const CryptoDispatch& dispatch = GetCryptoDispatch();
+    if (dispatch.features.aes) {
+        EXPECT_EQ(BlockCipherParallelism().min_chunk_bytes, dispatch.block_cipher_min_chunk_bytes);
+    } else {
+        EXPECT_LT(dispatch.block_cipher_min_chunk_bytes, BlockCipherParallelism().min_chunk_bytes);
+    }
+}
+
+}  // namespace test
+}  // namespace keymaster
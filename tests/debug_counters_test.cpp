@@ -0,0 +1,131 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+#include <keymaster/keymaster_counters.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+
+class DebugCountersTest : public ::testing::Test {
+  protected:
+    DebugCountersTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    int32_t ver() const { return keymaster_.message_version(); }
+
+    KeymasterKeyBlob GenerateHmacKey() {
+        GenerateKeyRequest request(ver());
+        request.key_description.Reinitialize(
+            AuthorizationSet(AuthorizationSetBuilder()
+                                 .HmacKey(128)
+                                 .Digest(KM_DIGEST_SHA_2_256)
+                                 .Authorization(TAG_MIN_MAC_LENGTH, 256)
+                                 .Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse response(ver());
+        keymaster_.GenerateKey(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        return std::move(response.key_blob);
+    }
+
+    keymaster_error_t BeginAndAbort(const KeymasterKeyBlob& key) {
+        BeginOperationRequest request(ver());
+        request.purpose = KM_PURPOSE_SIGN;
+        request.SetKeyMaterial(key);
+        request.additional_params.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH,
+                                                                                256)));
+        BeginOperationResponse response(ver());
+        keymaster_.BeginOperation(request, &response);
+        if (response.error == KM_ERROR_OK) {
+            AbortOperationRequest abort(ver());
+            abort.op_handle = response.op_handle;
+            AbortOperationResponse abort_response(ver());
+            keymaster_.AbortOperation(abort, &abort_response);
+        }
+        return response.error;
+    }
+
+    GetDebugCountersResponse GetDebugCounters() {
+        return keymaster_.GetDebugCounters(GetDebugCountersRequest(ver()));
+    }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+};
+
+template <typename Counter>
+const Counter* FindCounter(const std::vector<Counter>& counters, uint32_t id) {
+    for (const auto& counter : counters) {
+        if (counter.id == id) return &counter;
+    }
+    return nullptr;
+}
+
+TEST_F(DebugCountersTest, CountsCommandsPhasesAndCacheLookups) {
+    KeymasterKeyBlob key = GenerateHmacKey();
+    ASSERT_EQ(KM_ERROR_OK, BeginAndAbort(key));
+    ASSERT_EQ(KM_ERROR_OK, BeginAndAbort(key));
+
+    GetDebugCountersResponse response = GetDebugCounters();
+    ASSERT_EQ(KM_ERROR_OK, response.error);
+
+    auto begin = FindCounter(response.commands, BEGIN_OPERATION);
+    ASSERT_NE(nullptr, begin);
+    EXPECT_EQ(2U, begin->calls);
+    EXPECT_EQ(0U, begin->errors);
+    auto generate = FindCounter(response.commands, GENERATE_KEY);
+    ASSERT_NE(nullptr, generate);
+    EXPECT_EQ(1U, generate->calls);
+
+    auto load_key =
+        FindCounter(response.phases, static_cast<uint32_t>(OperationPhase::LOAD_KEY));
+    ASSERT_NE(nullptr, load_key);
+    EXPECT_EQ(2U, load_key->calls);
+
+    auto parsed_keys =
+        FindCounter(response.caches, static_cast<uint32_t>(KeymasterCache::PARSED_KEY));
+    ASSERT_NE(nullptr, parsed_keys);
+    EXPECT_EQ(2U, parsed_keys->hits + parsed_keys->misses);
+    EXPECT_LE(1U, parsed_keys->hits);
+}
+
+TEST_F(DebugCountersTest, CountsFailedCalls) {
+    KeymasterKeyBlob key = GenerateHmacKey();
+    key.writable_data()[key.key_material_size / 2] ^= 1;
+    EXPECT_NE(KM_ERROR_OK, BeginAndAbort(key));
+
+    GetDebugCountersResponse response = GetDebugCounters();
+    auto begin = FindCounter(response.commands, BEGIN_OPERATION);
+    ASSERT_NE(nullptr, begin);
+    EXPECT_EQ(1U, begin->calls);
+    EXPECT_EQ(1U, begin->errors);
+}
+
+}  // namespace test
+}  // namespace keymaster
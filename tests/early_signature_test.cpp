@@ -0,0 +1,155 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+
+// Runs each test with PKCS#1 v1.5 and PSS padding, the modes that use an early signature.
+class EarlySignatureTest : public ::testing::TestWithParam<keymaster_padding_t> {
+  protected:
+    EarlySignatureTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    void SetUp() override {
+        GenerateKeyRequest request(ver());
+        request.key_description.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder()
+                .RsaSigningKey(2048, 65537)
+                .Digest(KM_DIGEST_SHA_2_256)
+                .Padding(GetParam())
+                .Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse response(ver());
+        keymaster_.GenerateKey(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+        key_ = std::move(response.key_blob);
+    }
+
+    // Begins an operation on |message|, giving the early |early_signature| if it isn't empty, and
+    // finishes it with |signature|.  Returns the error, and the output in |output| if not null.
+    keymaster_error_t Process(keymaster_purpose_t purpose, const std::string& message,
+                              const std::string& early_signature, const std::string& signature,
+                              std::string* output = nullptr) {
+        BeginOperationRequest begin(ver());
+        begin.purpose = purpose;
+        begin.SetKeyMaterial(key_);
+        begin.additional_params.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Padding(GetParam())));
+        begin.signature.Reinitialize(early_signature.data(), early_signature.size());
+        BeginOperationResponse begun(ver());
+        keymaster_.BeginOperation(begin, &begun);
+        if (begun.error != KM_ERROR_OK) return begun.error;
+
+        UpdateOperationRequest update(ver());
+        update.op_handle = begun.op_handle;
+        update.input.Reinitialize(message.data(), message.size());
+        UpdateOperationResponse updated(ver());
+        keymaster_.UpdateOperation(update, &updated);
+        if (updated.error != KM_ERROR_OK) return updated.error;
+        EXPECT_EQ(message.size(), updated.input_consumed);
+
+        FinishOperationRequest finish(ver());
+        finish.op_handle = begun.op_handle;
+        finish.signature.Reinitialize(signature.data(), signature.size());
+        FinishOperationResponse finished(ver());
+        keymaster_.FinishOperation(finish, &finished);
+        if (output) {
+            output->assign(reinterpret_cast<const char*>(finished.output.peek_read()),
+                           finished.output.available_read());
+        }
+        return finished.error;
+    }
+
+    std::string Sign(const std::string& message) {
+        std::string signature;
+        EXPECT_EQ(KM_ERROR_OK, Process(KM_PURPOSE_SIGN, message, "", "", &signature));
+        return signature;
+    }
+
+    keymaster_error_t Verify(const std::string& message, const std::string& early_signature,
+                             const std::string& signature) {
+        return Process(KM_PURPOSE_VERIFY, message, early_signature, signature);
+    }
+
+    int32_t ver() { return keymaster_.message_version(); }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+    KeymasterKeyBlob key_;
+};
+
+INSTANTIATE_TEST_SUITE_P(Padding, EarlySignatureTest,
+                         ::testing::Values(KM_PAD_RSA_PKCS1_1_5_SIGN, KM_PAD_RSA_PSS));
+
+TEST_P(EarlySignatureTest, Verifies) {
+    std::string message(100000, 'm');
+    std::string signature = Sign(message);
+    EXPECT_EQ(KM_ERROR_OK, Verify(message, signature, signature));
+}
+
+TEST_P(EarlySignatureTest, RejectsWrongMessage) {
+    std::string signature = Sign("the message");
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, Verify("another message", signature, signature));
+}
+
+TEST_P(EarlySignatureTest, RejectsCorruptSignature) {
+    std::string message = "the message";
+    std::string signature = Sign(message);
+    signature[signature.size() / 2] ^= 1;
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, Verify(message, signature, signature));
+}
+
+TEST_P(EarlySignatureTest, FinishSignatureWins) {
+    std::string message = "the message";
+    std::string signature = Sign(message);
+    std::string corrupt = signature;
+    corrupt[0] ^= 1;
+    EXPECT_EQ(KM_ERROR_OK, Verify(message, corrupt, signature));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, Verify(message, signature, corrupt));
+}
+
+TEST_P(EarlySignatureTest, IgnoresWrongLength) {
+    std::string message = "the message";
+    std::string signature = Sign(message);
+    EXPECT_EQ(KM_ERROR_OK, Verify(message, "short", signature));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, Verify(message, "short", "short"));
+}
+
+TEST_P(EarlySignatureTest, IgnoredBySign) {
+    std::string signature;
+    EXPECT_EQ(KM_ERROR_OK,
+              Process(KM_PURPOSE_SIGN, "the message", std::string(256, 's'), "", &signature));
+    EXPECT_EQ(KM_ERROR_OK, Verify("the message", signature, signature));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,151 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/ecdh_operation.h>
+
+#include <keymaster/km_openssl/curve25519_key.h>
+
+#include <gtest/gtest.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/nid.h>
+
+namespace keymaster {
+namespace test {
+
+static EVP_PKEY* GenerateEcKey(int nid) {
+    EC_KEY_Ptr ec_key(EC_KEY_new_by_curve_name(nid));
+    if (!ec_key || !EC_KEY_generate_key(ec_key.get())) return nullptr;
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    if (!pkey || !EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get())) return nullptr;
+    return pkey.release();
+}
+
+static EVP_PKEY* GenerateX25519Key() {
+    EVP_PKEY_CTX_Ptr ctx(EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr /* engine */));
+    EVP_PKEY* pkey = nullptr;
+    if (!ctx || !EVP_PKEY_keygen_init(ctx.get()) || !EVP_PKEY_keygen(ctx.get(), &pkey)) {
+        return nullptr;
+    }
+    return pkey;
+}
+
+// Encodes the public half of |pkey| as a SubjectPublicKeyInfo.
+static void EncodePublicKey(EVP_PKEY* pkey, Buffer* encoded) {
+    int length = i2d_PUBKEY(pkey, nullptr);
+    ASSERT_GT(length, 0);
+    ASSERT_TRUE(encoded->Reinitialize(length));
+    uint8_t* p = encoded->peek_write();
+    ASSERT_EQ(length, i2d_PUBKEY(pkey, &p));
+    encoded->advance_write(length);
+}
+
+// Checks that AgreeBatch() gives the same secrets as a Finish() per peer key.
+static void ExpectBatchMatchesFinish(EcdhOperation* op, const Buffer* peer_keys, size_t count) {
+    Buffer secrets[4];
+    ASSERT_LE(count, 4U);
+    ASSERT_EQ(KM_ERROR_OK, op->AgreeBatch(peer_keys, count, secrets));
+    for (size_t i = 0; i < count; ++i) {
+        Buffer secret;
+        ASSERT_EQ(KM_ERROR_OK,
+                  op->Finish(AuthorizationSet(), peer_keys[i], Buffer(), nullptr, &secret));
+        ASSERT_EQ(secret.available_read(), secrets[i].available_read());
+        EXPECT_EQ(0, memcmp(secret.peek_read(), secrets[i].peek_read(), secret.available_read()));
+    }
+}
+
+TEST(EcdhOperationTest, AgreeBatchMatchesFinish) {
+    for (int nid : {NID_X9_62_prime256v1, NID_secp384r1, NID_secp521r1}) {
+        EVP_PKEY* key = GenerateEcKey(nid);
+        ASSERT_NE(nullptr, key);
+        EcdhOperation op(AuthorizationSet(), AuthorizationSet(), key);
+
+        Buffer peer_keys[3];
+        for (auto& peer_key : peer_keys) {
+            EVP_PKEY_Ptr peer(GenerateEcKey(nid));
+            ASSERT_NE(nullptr, peer.get());
+            EncodePublicKey(peer.get(), &peer_key);
+        }
+        ExpectBatchMatchesFinish(&op, peer_keys, 3);
+    }
+}
+
+TEST(EcdhOperationTest, AgreeBatchRejectsPeerOnOtherCurve) {
+    EcdhOperation op(AuthorizationSet(), AuthorizationSet(), GenerateEcKey(NID_X9_62_prime256v1));
+
+    Buffer peer_keys[2];
+    EVP_PKEY_Ptr peer(GenerateEcKey(NID_X9_62_prime256v1));
+    EncodePublicKey(peer.get(), &peer_keys[0]);
+    peer.reset(GenerateEcKey(NID_secp384r1));
+    EncodePublicKey(peer.get(), &peer_keys[1]);
+
+    Buffer secrets[2];
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, op.AgreeBatch(peer_keys, 2, secrets));
+}
+
+TEST(EcdhOperationTest, X25519AgreeBatchMatchesFinish) {
+    EVP_PKEY_Ptr key(GenerateX25519Key());
+    ASSERT_NE(nullptr, key.get());
+    uint8_t private_key[X25519_PRIVATE_KEY_LEN];
+    size_t private_key_len = sizeof(private_key);
+    ASSERT_TRUE(EVP_PKEY_get_raw_private_key(key.get(), private_key, &private_key_len));
+    X25519Operation op(AuthorizationSet(), AuthorizationSet(), private_key);
+
+    Buffer peer_keys[3];
+    for (auto& peer_key : peer_keys) {
+        EVP_PKEY_Ptr peer(GenerateX25519Key());
+        ASSERT_NE(nullptr, peer.get());
+        EncodePublicKey(peer.get(), &peer_key);
+    }
+    ExpectBatchMatchesFinish(&op, peer_keys, 3);
+
+    // An EC peer key can't be used with an X25519 private key.
+    EVP_PKEY_Ptr ec_peer(GenerateEcKey(NID_X9_62_prime256v1));
+    EncodePublicKey(ec_peer.get(), &peer_keys[1]);
+    Buffer secrets[3];
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, op.AgreeBatch(peer_keys, 3, secrets));
+}
+
+TEST(EcdhOperationTest, X25519RawKeyMatchesEvp) {
+    EVP_PKEY_Ptr key(GenerateX25519Key());
+    ASSERT_NE(nullptr, key.get());
+    KeymasterKeyBlob key_material;
+    ASSERT_EQ(KM_ERROR_OK, EvpKeyToKeyMaterial(key.get(), &key_material));
+    X25519Key x25519_key(AuthorizationSet(), AuthorizationSet(), nullptr /* factory */,
+                         key_material);
+    uint8_t private_key[X25519_PRIVATE_KEY_LEN];
+    ASSERT_TRUE(x25519_key.InternalToRaw(private_key));
+
+    EVP_PKEY_Ptr peer(GenerateX25519Key());
+    Buffer peer_key;
+    EncodePublicKey(peer.get(), &peer_key);
+    X25519Operation op(AuthorizationSet(), AuthorizationSet(), private_key);
+    Buffer secret;
+    ASSERT_EQ(KM_ERROR_OK, op.Finish(AuthorizationSet(), peer_key, Buffer(), nullptr, &secret));
+
+    // The same secret as OpenSSL derives from the EVP_PKEYs.
+    EVP_PKEY_CTX_Ptr ctx(EVP_PKEY_CTX_new(key.get(), nullptr /* engine */));
+    ASSERT_TRUE(ctx && EVP_PKEY_derive_init(ctx.get()) &&
+                EVP_PKEY_derive_set_peer(ctx.get(), peer.get()));
+    uint8_t expected[X25519_SHARED_KEY_LEN];
+    size_t expected_len = sizeof(expected);
+    ASSERT_TRUE(EVP_PKEY_derive(ctx.get(), expected, &expected_len));
+    ASSERT_EQ(expected_len, secret.available_read());
+    EXPECT_EQ(0, memcmp(expected, secret.peek_read(), expected_len));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,155 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+
+class ExecuteBatchTest : public ::testing::Test {
+  protected:
+    ExecuteBatchTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    void SetUp() override {
+        GenerateKeyRequest request(keymaster_.message_version());
+        request.key_description.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder()
+                .EcdsaSigningKey(256)
+                .Digest(KM_DIGEST_SHA_2_256)
+                .Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse response(keymaster_.message_version());
+        keymaster_.GenerateKey(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+        key_blob_ = std::move(response.key_blob);
+    }
+
+    void Execute(const ExecuteBatchRequest& request, ExecuteBatchResponse* response) {
+        keymaster_.ExecuteBatch(request, response);
+        ASSERT_EQ(KM_ERROR_OK, response->error);
+        ASSERT_EQ(request.entry_count, response->entry_count);
+    }
+
+    int32_t ver() { return keymaster_.message_version(); }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+    KeymasterKeyBlob key_blob_;
+};
+
+TEST_F(ExecuteBatchTest, BeginAndFinishAcrossBatches) {
+    GetKeyCharacteristicsRequest characteristics(ver());
+    characteristics.SetKeyMaterial(key_blob_);
+    BeginOperationRequest begin(ver());
+    begin.purpose = KM_PURPOSE_SIGN;
+    begin.SetKeyMaterial(key_blob_);
+    begin.additional_params.push_back(TAG_DIGEST, KM_DIGEST_SHA_2_256);
+
+    ExecuteBatchRequest request(ver());
+    ASSERT_TRUE(request.SetEntryCount(3));
+    ASSERT_TRUE(request.SetEntry(0, GET_KEY_CHARACTERISTICS, characteristics));
+    ASSERT_TRUE(request.SetEntry(1, BEGIN_OPERATION, begin));
+    ASSERT_TRUE(request.SetEntry(2, BEGIN_OPERATION, begin));
+    ExecuteBatchResponse response(ver());
+    Execute(request, &response);
+
+    GetKeyCharacteristicsResponse characteristics_response(ver());
+    ASSERT_TRUE(response.GetEntry(0, &characteristics_response));
+    EXPECT_EQ(KM_ERROR_OK, characteristics_response.error);
+    EXPECT_TRUE(characteristics_response.enforced.Contains(TAG_ALGORITHM, KM_ALGORITHM_EC) ||
+                characteristics_response.unenforced.Contains(TAG_ALGORITHM, KM_ALGORITHM_EC));
+
+    // Finish both operations in a second batch.
+    ExecuteBatchRequest finish_request(ver());
+    ASSERT_TRUE(finish_request.SetEntryCount(2));
+    for (size_t i = 0; i < 2; ++i) {
+        BeginOperationResponse begin_response(ver());
+        ASSERT_TRUE(response.GetEntry(i + 1, &begin_response));
+        ASSERT_EQ(KM_ERROR_OK, begin_response.error);
+        FinishOperationRequest finish(ver());
+        finish.op_handle = begin_response.op_handle;
+        finish.input.Reinitialize("message", 7);
+        ASSERT_TRUE(finish_request.SetEntry(i, FINISH_OPERATION, finish));
+    }
+    ExecuteBatchResponse finish_response(ver());
+    Execute(finish_request, &finish_response);
+    for (size_t i = 0; i < 2; ++i) {
+        FinishOperationResponse finish(ver());
+        ASSERT_TRUE(finish_response.GetEntry(i, &finish));
+        EXPECT_EQ(KM_ERROR_OK, finish.error);
+        EXPECT_GT(finish.output.available_read(), 0U);
+    }
+}
+
+TEST_F(ExecuteBatchTest, FailedEntriesDontStopOthers) {
+    AbortOperationRequest abort(ver());
+    abort.op_handle = 0x1234;
+    GetKeyCharacteristicsRequest characteristics(ver());
+    characteristics.SetKeyMaterial(key_blob_);
+    ExecuteBatchRequest nested(ver());
+    ASSERT_TRUE(nested.SetEntryCount(1));
+    ASSERT_TRUE(nested.SetEntry(0, GET_KEY_CHARACTERISTICS, characteristics));
+
+    ExecuteBatchRequest request(ver());
+    ASSERT_TRUE(request.SetEntryCount(5));
+    ASSERT_TRUE(request.SetEntry(0, ABORT_OPERATION, abort));
+    ASSERT_TRUE(request.SetEntry(1, EXECUTE_BATCH, nested));
+    // An abort request with a truncated handle.
+    request.commands[2] = ABORT_OPERATION;
+    request.requests[2].Reinitialize("abc", 3);
+    ASSERT_TRUE(request.SetEntry(3, DELETE_ALL_KEYS, abort));
+    ASSERT_TRUE(request.SetEntry(4, GET_KEY_CHARACTERISTICS, characteristics));
+    ExecuteBatchResponse response(ver());
+    Execute(request, &response);
+
+    const keymaster_error_t expected[] = {
+        KM_ERROR_INVALID_OPERATION_HANDLE,
+        KM_ERROR_UNIMPLEMENTED,
+        KM_ERROR_INVALID_ARGUMENT,
+        KM_ERROR_UNIMPLEMENTED,
+    };
+    for (size_t i = 0; i < 4; ++i) {
+        AbortOperationResponse entry(ver());
+        ASSERT_TRUE(response.GetEntry(i, &entry));
+        EXPECT_EQ(expected[i], entry.error) << "entry " << i;
+    }
+    GetKeyCharacteristicsResponse characteristics_response(ver());
+    ASSERT_TRUE(response.GetEntry(4, &characteristics_response));
+    EXPECT_EQ(KM_ERROR_OK, characteristics_response.error);
+}
+
+TEST_F(ExecuteBatchTest, EmptyBatch) {
+    ExecuteBatchRequest request(ver());
+    ExecuteBatchResponse response(ver());
+    keymaster_.ExecuteBatch(request, &response);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, response.error);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/FixedVector.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+struct Counted {
+    explicit Counted(int v) : value(v) { ++live; }
+    Counted(const Counted& other) : value(other.value) { ++live; }
+    Counted& operator=(const Counted& other) = default;
+    ~Counted() { --live; }
+
+    int value;
+    static int live;
+};
+
+int Counted::live = 0;
+
+}  // namespace
+
+TEST(FixedVectorTest, FillsToCapacity) {
+    FixedVector<int> vector(3);
+    ASSERT_TRUE(vector.is_valid());
+    EXPECT_TRUE(vector.empty());
+    EXPECT_TRUE(vector.push_back(1));
+    EXPECT_TRUE(vector.push_back(2));
+    EXPECT_TRUE(vector.push_back(3));
+    EXPECT_TRUE(vector.full());
+    EXPECT_FALSE(vector.push_back(4));
+
+    ASSERT_EQ(3U, vector.size());
+    int expected = 1;
+    for (int value : vector) EXPECT_EQ(expected++, value);
+    EXPECT_EQ(vector.begin() + 3, vector.end());
+}
+
+TEST(FixedVectorTest, EraseKeepsOrder) {
+    FixedVector<int> vector(4);
+    for (int i = 0; i < 4; ++i) vector.push_back(i);
+
+    auto next = vector.erase(vector.begin() + 1);
+    EXPECT_EQ(2, *next);
+    ASSERT_EQ(3U, vector.size());
+    EXPECT_EQ(0, vector[0]);
+    EXPECT_EQ(2, vector[1]);
+    EXPECT_EQ(3, vector.back());
+
+    next = vector.erase(vector.end() - 1);
+    EXPECT_EQ(vector.end(), next);
+    EXPECT_TRUE(vector.push_back(9));
+    EXPECT_EQ(9, vector.back());
+}
+
+TEST(FixedVectorTest, DestroysElements) {
+    {
+        FixedVector<Counted> vector(4);
+        vector.emplace_back(1);
+        vector.emplace_back(2);
+        vector.emplace_back(3);
+        EXPECT_EQ(3, Counted::live);
+        vector.erase(vector.begin());
+        EXPECT_EQ(2, Counted::live);
+        EXPECT_EQ(2, vector.front().value);
+    }
+    EXPECT_EQ(0, Counted::live);
+}
+
+TEST(FixedVectorTest, ArenaBacked) {
+    Arena arena;
+    FixedVector<uint32_t> vector(8, &arena);
+    ASSERT_TRUE(vector.is_valid());
+    EXPECT_TRUE(arena.Owns(vector.data()));
+    for (uint32_t i = 0; i < 8; ++i) EXPECT_TRUE(vector.push_back(i));
+    EXPECT_FALSE(vector.push_back(8));
+    EXPECT_EQ(7U, vector.back());
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+
+class ForkOperationTest : public ::testing::Test {
+  protected:
+    ForkOperationTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    KeymasterKeyBlob GenerateKey(const AuthorizationSetBuilder& description) {
+        GenerateKeyRequest request(ver());
+        request.key_description.Reinitialize(AuthorizationSet(description));
+        GenerateKeyResponse response(ver());
+        keymaster_.GenerateKey(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        return std::move(response.key_blob);
+    }
+
+    // Generates an HMAC key, limited to |max_uses_per_boot| uses if that's non-zero.
+    KeymasterKeyBlob GenerateHmacKey(uint32_t max_uses_per_boot = 0) {
+        AuthorizationSetBuilder description;
+        description.HmacKey(128)
+            .Digest(KM_DIGEST_SHA_2_256)
+            .Authorization(TAG_MIN_MAC_LENGTH, 256)
+            .Authorization(TAG_NO_AUTH_REQUIRED);
+        if (max_uses_per_boot) description.Authorization(TAG_MAX_USES_PER_BOOT, max_uses_per_boot);
+        return GenerateKey(description);
+    }
+
+    keymaster_operation_handle_t Begin(const KeymasterKeyBlob& key, keymaster_purpose_t purpose,
+                                       const AuthorizationSet& params) {
+        BeginOperationRequest request(ver());
+        request.purpose = purpose;
+        request.SetKeyMaterial(key);
+        request.additional_params.Reinitialize(params);
+        BeginOperationResponse response(ver());
+        keymaster_.BeginOperation(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        return response.op_handle;
+    }
+
+    void Update(keymaster_operation_handle_t op_handle, const std::string& input) {
+        UpdateOperationRequest request(ver());
+        request.op_handle = op_handle;
+        request.input.Reinitialize(input.data(), input.size());
+        UpdateOperationResponse response(ver());
+        keymaster_.UpdateOperation(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        EXPECT_EQ(input.size(), response.input_consumed);
+    }
+
+    keymaster_error_t Fork(keymaster_operation_handle_t op_handle,
+                           keymaster_operation_handle_t* fork_handle) {
+        ForkOperationRequest request(ver());
+        request.op_handle = op_handle;
+        ForkOperationResponse response(ver());
+        keymaster_.ForkOperation(request, &response);
+        *fork_handle = response.op_handle;
+        return response.error;
+    }
+
+    keymaster_error_t Finish(keymaster_operation_handle_t op_handle, const std::string& input,
+                             std::string* output, const std::string& signature = "") {
+        FinishOperationRequest request(ver());
+        request.op_handle = op_handle;
+        request.input.Reinitialize(input.data(), input.size());
+        request.signature.Reinitialize(signature.data(), signature.size());
+        FinishOperationResponse response(ver());
+        keymaster_.FinishOperation(request, &response);
+        if (output) {
+            output->assign(reinterpret_cast<const char*>(response.output.peek_read()),
+                           response.output.available_read());
+        }
+        return response.error;
+    }
+
+    std::string Process(const KeymasterKeyBlob& key, keymaster_purpose_t purpose,
+                        const AuthorizationSet& params, const std::string& message) {
+        std::string output;
+        EXPECT_EQ(KM_ERROR_OK, Finish(Begin(key, purpose, params), message, &output));
+        return output;
+    }
+
+    int32_t ver() { return keymaster_.message_version(); }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+};
+
+TEST_F(ForkOperationTest, HmacForksMatchUnforkedMacs) {
+    KeymasterKeyBlob key = GenerateHmacKey();
+    AuthorizationSet params(AuthorizationSetBuilder().Authorization(TAG_MAC_LENGTH, 256));
+
+    keymaster_operation_handle_t op_handle = Begin(key, KM_PURPOSE_SIGN, params);
+    Update(op_handle, "a shared prefix, ");
+    keymaster_operation_handle_t fork_handle;
+    ASSERT_EQ(KM_ERROR_OK, Fork(op_handle, &fork_handle));
+    EXPECT_NE(op_handle, fork_handle);
+
+    std::string mac, fork_mac;
+    ASSERT_EQ(KM_ERROR_OK, Finish(op_handle, "then one suffix", &mac));
+    ASSERT_EQ(KM_ERROR_OK, Finish(fork_handle, "then another", &fork_mac));
+    EXPECT_EQ(Process(key, KM_PURPOSE_SIGN, params, "a shared prefix, then one suffix"), mac);
+    EXPECT_EQ(Process(key, KM_PURPOSE_SIGN, params, "a shared prefix, then another"), fork_mac);
+}
+
+TEST_F(ForkOperationTest, EcdsaForkSignaturesVerify) {
+    KeymasterKeyBlob key = GenerateKey(AuthorizationSetBuilder()
+                                           .EcdsaSigningKey(256)
+                                           .Digest(KM_DIGEST_SHA_2_256)
+                                           .Authorization(TAG_NO_AUTH_REQUIRED));
+    AuthorizationSet params(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+
+    keymaster_operation_handle_t op_handle = Begin(key, KM_PURPOSE_SIGN, params);
+    Update(op_handle, "prefix ");
+    keymaster_operation_handle_t fork_handle;
+    ASSERT_EQ(KM_ERROR_OK, Fork(op_handle, &fork_handle));
+
+    std::string signature, fork_signature;
+    ASSERT_EQ(KM_ERROR_OK, Finish(op_handle, "one", &signature));
+    ASSERT_EQ(KM_ERROR_OK, Finish(fork_handle, "two", &fork_signature));
+
+    EXPECT_EQ(KM_ERROR_OK,
+              Finish(Begin(key, KM_PURPOSE_VERIFY, params), "prefix one", nullptr, signature));
+    EXPECT_EQ(KM_ERROR_OK, Finish(Begin(key, KM_PURPOSE_VERIFY, params), "prefix two", nullptr,
+                                  fork_signature));
+    EXPECT_EQ(KM_ERROR_VERIFICATION_FAILED, Finish(Begin(key, KM_PURPOSE_VERIFY, params),
+                                                   "prefix one", nullptr, fork_signature));
+}
+
+TEST_F(ForkOperationTest, ForksCountAsUses) {
+    KeymasterKeyBlob key = GenerateHmacKey(2 /* max_uses_per_boot */);
+    AuthorizationSet params(AuthorizationSetBuilder().Authorization(TAG_MAC_LENGTH, 256));
+
+    keymaster_operation_handle_t op_handle = Begin(key, KM_PURPOSE_SIGN, params);
+    keymaster_operation_handle_t fork_handle;
+    ASSERT_EQ(KM_ERROR_OK, Fork(op_handle, &fork_handle));
+    EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED, Fork(op_handle, &fork_handle));
+    EXPECT_EQ(0U, fork_handle);
+}
+
+TEST_F(ForkOperationTest, UnforkableOperations) {
+    keymaster_operation_handle_t fork_handle;
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, Fork(0x1234, &fork_handle));
+
+    KeymasterKeyBlob key = GenerateKey(AuthorizationSetBuilder()
+                                           .AesEncryptionKey(128)
+                                           .EcbMode()
+                                           .Padding(KM_PAD_NONE)
+                                           .Authorization(TAG_NO_AUTH_REQUIRED));
+    AuthorizationSet params(
+        AuthorizationSetBuilder().BlockMode(KM_MODE_ECB).Padding(KM_PAD_NONE));
+    keymaster_operation_handle_t op_handle = Begin(key, KM_PURPOSE_ENCRYPT, params);
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, Fork(op_handle, &fork_handle));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Checks that the single-check ByteReader and ByteWriter fast paths in serializable.h hold the
+// same safety properties as the per-field helpers they replace:
+//
+//  - A ByteReader run over any input reads exactly what copy_*_from_buf() reads, fails exactly
+//    where they fail, and never reads past the end.
+//  - An AuthorizationSet that deserializes re-serializes to the same size and contents, and
+//    serializing into a buffer that's too short never writes past it or claims success.
+//
+// Inputs are copied into exactly-sized heap buffers so that ASan flags any overrun.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <memory>
+#include <vector>
+
+#include <keymaster/authorization_set.h>
+#include <keymaster/serializable.h>
+
+#include "fuzzer/FuzzedDataProvider.h"
+
+namespace {
+
+using keymaster::AuthorizationSet;
+using keymaster::ByteReader;
+
+void Check(bool condition) {
+    if (!condition) abort();
+}
+
+std::unique_ptr<uint8_t[]> Copy(const std::vector<uint8_t>& bytes) {
+    std::unique_ptr<uint8_t[]> copy(new uint8_t[bytes.size()]);
+    if (!bytes.empty()) memcpy(copy.get(), bytes.data(), bytes.size());
+    return copy;
+}
+
+// Replays a script of reads through a ByteReader and through the legacy helpers side by side.
+void CompareReads(FuzzedDataProvider* fdp) {
+    size_t script_length = fdp->ConsumeIntegralInRange<size_t>(0, 64);
+    std::vector<uint8_t> script = fdp->ConsumeBytes<uint8_t>(script_length);
+    std::vector<uint8_t> bytes = fdp->ConsumeBytes<uint8_t>(fdp->ConsumeIntegralInRange(0, 256));
+    std::unique_ptr<uint8_t[]> input = Copy(bytes);
+    const uint8_t* end = input.get() + bytes.size();
+
+    ByteReader reader(input.get(), end);
+    const uint8_t* legacy = input.get();
+    for (uint8_t op : script) {
+        switch (op % 3) {
+        case 0: {
+            uint32_t value = 0, expected = 0;
+            bool ok = reader.ReadUint32(&value);
+            Check(ok == keymaster::copy_uint32_from_buf(&legacy, end, &expected));
+            Check(!ok || value == expected);
+            break;
+        }
+        case 1: {
+            uint64_t value = 0, expected = 0;
+            bool ok = reader.ReadUint64(&value);
+            Check(ok == keymaster::copy_uint64_from_buf(&legacy, end, &expected));
+            Check(!ok || value == expected);
+            break;
+        }
+        case 2: {
+            // A run of fixed-size fields, checked once and then read unchecked.
+            size_t run = (op / 3 % 4 + 1) * sizeof(uint32_t);
+            bool ok = reader.Require(run);
+            Check(ok == keymaster::__buffer_bound_check(legacy, end, run));
+            for (size_t i = 0; ok && i < run / sizeof(uint32_t); ++i) {
+                uint32_t expected = 0;
+                Check(keymaster::copy_uint32_from_buf(&legacy, end, &expected));
+                Check(reader.ReadUint32Unchecked() == expected);
+            }
+            break;
+        }
+        }
+        Check(reader.position() == legacy);
+        Check(reader.position() <= end);
+    }
+}
+
+void CheckAuthorizationSet(FuzzedDataProvider* fdp) {
+    std::vector<uint8_t> bytes = fdp->ConsumeRemainingBytes<uint8_t>();
+    std::unique_ptr<uint8_t[]> input = Copy(bytes);
+    const uint8_t* p = input.get();
+    AuthorizationSet set;
+    if (!set.Deserialize(&p, input.get() + bytes.size())) return;
+
+    size_t consumed = p - input.get();
+    size_t size = set.SerializedSize();
+    Check(size == consumed);
+
+    std::unique_ptr<uint8_t[]> output(new uint8_t[size]);
+    Check(set.Serialize(output.get(), output.get() + size) == output.get() + size);
+    Check(memcmp(input.get(), output.get(), size) == 0);
+
+    if (size > 0) {
+        std::unique_ptr<uint8_t[]> short_output(new uint8_t[size - 1]);
+        uint8_t* short_end = short_output.get() + size - 1;
+        uint8_t* written = set.Serialize(short_output.get(), short_end);
+        Check(written <= short_end);
+    }
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    FuzzedDataProvider fdp(data, size);
+    CompareReads(&fdp);
+    CheckAuthorizationSet(&fdp);
+    return 0;
+}
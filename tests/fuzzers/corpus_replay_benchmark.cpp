@@ -0,0 +1,231 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays fuzz corpora through the Deserialize() of every message type the serializable fuzzer
+// knows, reporting bytes per second and heap allocations per message for each type:
+//
+//   keymaster_fuzz_corpus_replay [benchmark flags] CORPUS_FILE_OR_DIR...
+//
+// Every input is fed whole to every type, so most are rejected part way; that is the work a
+// transport does with a malformed message.  Without a corpus, each type's default-constructed
+// message is serialized and replayed instead.
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "serializable_types.h"
+
+namespace {
+
+std::atomic<uint64_t> allocation_count{0};
+
+void* CountedAllocate(size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+}  // namespace
+
+// Counts every heap allocation made through new, which is how the messages allocate.
+void* operator new(size_t size) {
+    void* p = CountedAllocate(size);
+    if (!p) abort();  // Built without exceptions.
+    return p;
+}
+void* operator new[](size_t size) {
+    return operator new(size);
+}
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size);
+}
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return CountedAllocate(size);
+}
+void operator delete(void* p) noexcept {
+    free(p);
+}
+void operator delete[](void* p) noexcept {
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    free(p);
+}
+
+namespace keymaster {
+namespace {
+
+constexpr size_t kTypeCount = static_cast<size_t>(SerializableType::kMaxValue) + 1;
+
+// In SerializableType order.
+const char* const kTypeNames[] = {
+    "SupportedImportFormatsRequest",
+    "SupportedExportFormatsRequest",
+    "SupportedBlockModesRequest",
+    "SupportedPaddingModesRequest",
+    "SupportedDigestsRequest",
+    "SupportedAlgorithmsResponse",
+    "SupportedBlockModesResponse",
+    "SupportedPaddingModesResponse",
+    "SupportedDigestsResponse",
+    "SupportedImportFormatsResponse",
+    "SupportedExportFormatsResponse",
+    "GenerateKeyRequest",
+    "GenerateKeyResponse",
+    "GetKeyCharacteristicsRequest",
+    "GetKeyCharacteristicsResponse",
+    "BeginOperationRequest",
+    "BeginOperationResponse",
+    "UpdateOperationRequest",
+    "UpdateOperationResponse",
+    "FinishOperationRequest",
+    "FinishOperationResponse",
+    "AbortOperationRequest",
+    "AbortOperationResponse",
+    "AddEntropyRequest",
+    "AddEntropyResponse",
+    "ImportKeyRequest",
+    "ImportKeyResponse",
+    "ExportKeyRequest",
+    "ExportKeyResponse",
+    "DeleteKeyRequest",
+    "DeleteKeyResponse",
+    "DeleteAllKeysRequest",
+    "DeleteAllKeysResponse",
+    "GetVersionRequest",
+    "GetVersionResponse",
+    "GetVersion2Request",
+    "GetVersion2Response",
+    "AttestKeyRequest",
+    "AttestKeyResponse",
+    "UpgradeKeyRequest",
+    "UpgradeKeyResponse",
+    "ConfigureRequest",
+    "ConfigureResponse",
+    "HmacSharingParameters",
+    "HmacSharingParametersArray",
+    "GetHmacSharingParametersResponse",
+    "ComputeSharedHmacRequest",
+    "ComputeSharedHmacResponse",
+    "ImportWrappedKeyRequest",
+    "ImportWrappedKeyResponse",
+    "HardwareAuthToken",
+    "VerificationToken",
+    "VerifyAuthorizationRequest",
+    "VerifyAuthorizationResponse",
+    "DeviceLockedRequest",
+    "Buffer",
+};
+static_assert(sizeof(kTypeNames) / sizeof(kTypeNames[0]) == kTypeCount,
+              "kTypeNames must name every SerializableType");
+
+using Input = std::vector<uint8_t>;
+
+void AddFile(const std::string& path, std::vector<Input>* inputs) {
+    std::ifstream file(path, std::ios::binary);
+    Input input((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (!input.empty()) inputs->push_back(std::move(input));
+}
+
+void AddPath(const std::string& path, std::vector<Input>* inputs) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        fprintf(stderr, "Can't read %s\n", path.c_str());
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) return AddFile(path, inputs);
+
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return;
+    while (dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') continue;
+        AddPath(path + "/" + entry->d_name, inputs);
+    }
+    closedir(dir);
+}
+
+// Each default-constructed message, serialized.
+std::vector<Input> DefaultInputs() {
+    std::vector<Input> inputs;
+    for (size_t type = 0; type < kTypeCount; ++type) {
+        auto message = getSerializable(static_cast<SerializableType>(type));
+        Input input(message->SerializedSize());
+        message->Serialize(input.data(), input.data() + input.size());
+        if (!input.empty()) inputs.push_back(std::move(input));
+    }
+    return inputs;
+}
+
+void ReplayCorpus(benchmark::State& state, SerializableType type,
+                  const std::vector<Input>* inputs) {
+    size_t bytes = 0;
+    for (const auto& input : *inputs) bytes += input.size();
+
+    uint64_t allocations = 0;
+    uint64_t accepted = 0;
+    for (auto _ : state) {
+        for (const auto& input : *inputs) {
+            auto message = getSerializable(type);
+            uint64_t before = allocation_count.load(std::memory_order_relaxed);
+            const uint8_t* p = input.data();
+            bool ok = message->Deserialize(&p, input.data() + input.size());
+            allocations += allocation_count.load(std::memory_order_relaxed) - before;
+            if (ok) ++accepted;
+            benchmark::DoNotOptimize(message);
+        }
+    }
+
+    double messages = static_cast<double>(state.iterations()) * inputs->size();
+    state.SetBytesProcessed(state.iterations() * bytes);
+    state.counters["allocs_per_msg"] = messages ? allocations / messages : 0;
+    state.counters["accepted"] = messages ? accepted / messages : 0;
+}
+
+}  // namespace
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    using namespace keymaster;  // NOLINT(google-build-using-namespace)
+
+    benchmark::Initialize(&argc, argv);
+    static std::vector<Input> inputs;
+    for (int i = 1; i < argc; ++i) AddPath(argv[i], &inputs);
+    if (inputs.empty()) {
+        fprintf(stderr, "No corpus given; replaying default-constructed messages.\n");
+        inputs = DefaultInputs();
+    }
+
+    for (size_t type = 0; type < kTypeCount; ++type) {
+        benchmark::RegisterBenchmark(kTypeNames[type], ReplayCorpus,
+                                     static_cast<SerializableType>(type), &inputs);
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
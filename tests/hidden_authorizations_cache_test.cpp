@@ -0,0 +1,125 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <keymaster/key_blob_utils/hidden_authorizations_cache.h>
+
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/key_blob_utils/software_keyblobs.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+const uint8_t kRootOfTrust[] = {'R', 'o', 'T'};
+
+std::vector<uint8_t> Serialize(const AuthorizationSet& set) {
+    std::vector<uint8_t> bytes(set.SerializedSize());
+    set.Serialize(bytes.data(), bytes.data() + bytes.size());
+    return bytes;
+}
+
+std::vector<uint8_t> Bytes(const KeymasterBlob& blob) {
+    return std::vector<uint8_t>(blob.begin(), blob.end());
+}
+
+AuthorizationSet AppParams(const char* app_id, const char* app_data) {
+    AuthorizationSet params;
+    if (app_id) params.push_back(TAG_APPLICATION_ID, app_id, strlen(app_id));
+    if (app_data) params.push_back(TAG_APPLICATION_DATA, app_data, strlen(app_data));
+    params.push_back(TAG_ALGORITHM, KM_ALGORITHM_AES);
+    return params;
+}
+
+}  // namespace
+
+TEST(HiddenAuthorizationsCacheTest, MatchesBuildHiddenAuthorizations) {
+    HiddenAuthorizationsCache cache;
+    KeymasterBlob root_of_trust(kRootOfTrust);
+    for (auto params : {AppParams("app", "data"), AppParams("app", nullptr),
+                        AppParams(nullptr, "data"), AppParams(nullptr, nullptr)}) {
+        AuthorizationSet expected;
+        ASSERT_EQ(KM_ERROR_OK, BuildHiddenAuthorizations(params, &expected, root_of_trust));
+
+        for (int pass = 0; pass < 2; ++pass) {
+            AuthorizationSet hidden;
+            std::shared_ptr<const KeymasterBlob> serialized;
+            ASSERT_EQ(KM_ERROR_OK, cache.Get(params, root_of_trust, &hidden, &serialized));
+            EXPECT_EQ(Serialize(expected), Serialize(hidden));
+            ASSERT_NE(nullptr, serialized);
+            EXPECT_EQ(Serialize(expected), Bytes(*serialized));
+        }
+    }
+    EXPECT_EQ(4U, cache.misses());
+    EXPECT_EQ(4U, cache.hits());
+}
+
+TEST(HiddenAuthorizationsCacheTest, HitsShareTheSerialization) {
+    HiddenAuthorizationsCache cache;
+    KeymasterBlob root_of_trust(kRootOfTrust);
+    AuthorizationSet hidden;
+    std::shared_ptr<const KeymasterBlob> first;
+    std::shared_ptr<const KeymasterBlob> second;
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("app", "data"), root_of_trust, &hidden, &first));
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("app", "data"), root_of_trust, &hidden, &second));
+    EXPECT_EQ(first, second);
+    EXPECT_TRUE(hidden.is_shared());
+}
+
+TEST(HiddenAuthorizationsCacheTest, DistinguishesInputs) {
+    HiddenAuthorizationsCache cache;
+    KeymasterBlob root_of_trust(kRootOfTrust);
+    KeymasterBlob other_root_of_trust(reinterpret_cast<const uint8_t*>("other"), 5);
+    std::shared_ptr<const KeymasterBlob> a, b, c, d;
+    AuthorizationSet hidden;
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("ab", nullptr), root_of_trust, &hidden, &a));
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams(nullptr, "ab"), root_of_trust, &hidden, &b));
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("a", "b"), root_of_trust, &hidden, &c));
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("ab", nullptr), other_root_of_trust, &hidden, &d));
+    EXPECT_EQ(4U, cache.misses());
+    EXPECT_EQ(0U, cache.hits());
+    EXPECT_NE(Bytes(*a), Bytes(*b));
+    EXPECT_NE(Bytes(*a), Bytes(*c));
+    EXPECT_NE(Bytes(*a), Bytes(*d));
+}
+
+TEST(HiddenAuthorizationsCacheTest, EvictsLeastRecentlyUsed) {
+    HiddenAuthorizationsCache cache(2);
+    KeymasterBlob root_of_trust(kRootOfTrust);
+    AuthorizationSet hidden;
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("a", nullptr), root_of_trust, &hidden));
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("b", nullptr), root_of_trust, &hidden));
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("a", nullptr), root_of_trust, &hidden));
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("c", nullptr), root_of_trust, &hidden));
+    EXPECT_EQ(2U, cache.size());
+    EXPECT_EQ(1U, cache.hits());
+
+    // "b" was evicted, "a" was not.
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("a", nullptr), root_of_trust, &hidden));
+    EXPECT_EQ(2U, cache.hits());
+    ASSERT_EQ(KM_ERROR_OK, cache.Get(AppParams("b", nullptr), root_of_trust, &hidden));
+    EXPECT_EQ(2U, cache.hits());
+    EXPECT_EQ(4U, cache.misses());
+}
+
+}  // namespace test
+}  // namespace keymaster
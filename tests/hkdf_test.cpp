@@ -77,5 +77,46 @@ TEST(HkdfTest, Hkdf) {
     }
 }
 
+TEST(HkdfTest, ReinitDiscardsExtractedKey) {
+    Rfc5869Sha256Kdf hkdf;
+    for (auto& test : kHkdfTests) {
+        const string key = hex2str(test.key_hex);
+        const string salt = hex2str(test.salt_hex);
+        const string info = hex2str(test.info_hex);
+        const string expected = hex2str(test.output_hex);
+        string output(expected.size(), '\0');
+        ASSERT_TRUE(hkdf.Init(reinterpret_cast<const uint8_t*>(key.data()), key.size(),
+                              reinterpret_cast<const uint8_t*>(salt.data()), salt.size()));
+        ASSERT_TRUE(hkdf.GenerateKey(reinterpret_cast<const uint8_t*>(info.data()), info.size(),
+                                     reinterpret_cast<uint8_t*>(&output[0]), output.size()));
+        EXPECT_EQ(expected, output);
+    }
+}
+
+TEST(HkdfTest, GenerateKeysMatchesGenerateKey) {
+    const string key = hex2str(kHkdfTests[1].key_hex);
+    const string salt = hex2str(kHkdfTests[1].salt_hex);
+    const uint8_t info_a[] = "encryption";
+    const uint8_t info_b[] = "authentication";
+    uint8_t output_a[32], output_b[80];
+    Rfc5869Sha256Kdf hkdf;
+    ASSERT_TRUE(hkdf.Init(reinterpret_cast<const uint8_t*>(key.data()), key.size(),
+                          reinterpret_cast<const uint8_t*>(salt.data()), salt.size()));
+    const Kdf::Output outputs[] = {
+        {info_a, sizeof(info_a), output_a, sizeof(output_a)},
+        {info_b, sizeof(info_b), output_b, sizeof(output_b)},
+    };
+    ASSERT_TRUE(hkdf.GenerateKeys(outputs, 2));
+
+    for (const auto& output : outputs) {
+        uint8_t expected[80];
+        Rfc5869Sha256Kdf single;
+        ASSERT_TRUE(single.Init(reinterpret_cast<const uint8_t*>(key.data()), key.size(),
+                                reinterpret_cast<const uint8_t*>(salt.data()), salt.size()));
+        ASSERT_TRUE(single.GenerateKey(output.info, output.info_len, expected, output.output_len));
+        EXPECT_EQ(0, memcmp(expected, output.output, output.output_len));
+    }
+}
+
 }  // namespace test
 }  // namespace keymaster
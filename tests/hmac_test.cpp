@@ -14,7 +14,9 @@
  * limitations under the License.
  */
 
+#include <keymaster/km_openssl/confirmation_hmac_key.h>
 #include <keymaster/km_openssl/hmac.h>
+#include <keymaster/km_openssl/hmac_key.h>
 
 #include <gtest/gtest.h>
 #include <string.h>
@@ -80,5 +82,81 @@ TEST(HmacTest, SHA256) {
     }
 }
 
+TEST(KeyedHmacContextTest, CopiesMatchFreshContexts) {
+    for (auto& test : kHmacTests) {
+        const string key = hex2str(test.key);
+        KeymasterKeyBlob key_material(reinterpret_cast<const uint8_t*>(key.data()), key.size());
+        KeyedHmacContext keyed;
+        ASSERT_TRUE(keyed.Init(key_material, EVP_sha256()));
+        EXPECT_EQ(EVP_sha256(), keyed.md());
+
+        // Each copy starts from the keyed state, so finishing one doesn't affect the next.
+        for (int i = 0; i < 2; ++i) {
+            HMAC_CTX ctx;
+            HMAC_CTX_init(&ctx);
+            ASSERT_TRUE(keyed.CopyTo(&ctx));
+            ASSERT_TRUE(HMAC_Update(&ctx, reinterpret_cast<const uint8_t*>(test.data),
+                                    strlen(test.data)));
+            uint8_t digest[EVP_MAX_MD_SIZE];
+            unsigned int digest_len;
+            ASSERT_TRUE(HMAC_Final(&ctx, digest, &digest_len));
+            HMAC_CTX_cleanup(&ctx);
+            ASSERT_EQ(sizeof(test.digest), digest_len);
+            EXPECT_EQ(0, memcmp(test.digest, digest, digest_len));
+        }
+    }
+}
+
+TEST(ConfirmationHmacKeyTest, StreamedMatchesOneShot) {
+    const uint8_t key[] = "confirmation ui shared key";
+    const string message = "The quick brown fox jumps over the lazy dog";
+    const string tagged = kConfirmationTokenMessageTag + message;
+
+    HmacSha256 hmac;
+    ASSERT_TRUE(hmac.Init(key, sizeof(key)));
+    uint8_t token[kConfirmationTokenSize];
+    ASSERT_TRUE(hmac.Sign(reinterpret_cast<const uint8_t*>(tagged.data()), tagged.size(), token,
+                          sizeof(token)));
+
+    ConfirmationHmacKey confirmation_key;
+    ASSERT_EQ(KM_ERROR_OK, confirmation_key.Init(key, sizeof(key)));
+
+    // The message may arrive in any split, including empty pieces.
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(message.data());
+    for (size_t split = 0; split <= message.size(); split += 7) {
+        UniquePtr<ConfirmationVerifier> verifier;
+        ASSERT_EQ(KM_ERROR_OK, confirmation_key.CreateVerifier(&verifier));
+        ASSERT_EQ(KM_ERROR_OK, verifier->Append(data, split));
+        ASSERT_EQ(KM_ERROR_OK, verifier->Append(data + split, message.size() - split));
+        EXPECT_EQ(KM_ERROR_OK, verifier->Verify(token));
+    }
+
+    UniquePtr<ConfirmationVerifier> verifier;
+    ASSERT_EQ(KM_ERROR_OK, confirmation_key.CreateVerifier(&verifier));
+    ASSERT_EQ(KM_ERROR_OK, verifier->Append(data, message.size()));
+    token[0] ^= 1;
+    EXPECT_EQ(KM_ERROR_NO_USER_CONFIRMATION, verifier->Verify(token));
+}
+
+TEST(ConfirmationHmacKeyTest, RejectsOversizedMessage) {
+    const uint8_t key[] = "confirmation ui shared key";
+    ConfirmationHmacKey confirmation_key;
+    ASSERT_EQ(KM_ERROR_OK, confirmation_key.Init(key, sizeof(key)));
+    UniquePtr<ConfirmationVerifier> verifier;
+    ASSERT_EQ(KM_ERROR_OK, confirmation_key.CreateVerifier(&verifier));
+
+    UniquePtr<uint8_t[]> message(new uint8_t[kConfirmationMessageMaxSize + 1]());
+    ASSERT_EQ(KM_ERROR_OK, verifier->Append(message.get(), kConfirmationMessageMaxSize - 1));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, verifier->Append(message.get(), 2));
+    EXPECT_EQ(KM_ERROR_OK, verifier->Append(message.get(), 1));
+}
+
+TEST(ConfirmationHmacKeyTest, UninitializedKeyCreatesNoVerifier) {
+    ConfirmationHmacKey confirmation_key;
+    UniquePtr<ConfirmationVerifier> verifier;
+    EXPECT_EQ(KM_ERROR_UNKNOWN_ERROR, confirmation_key.CreateVerifier(&verifier));
+    EXPECT_FALSE(verifier);
+}
+
 }  // namespace test
 }  // namespace keymaster
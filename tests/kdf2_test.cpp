@@ -81,6 +81,32 @@ TEST(Kdf2Test, Kdf2) {
     }
 }
 
+TEST(Kdf2Test, GenerateKeysReusesSecretAcrossInfos) {
+    const Kdf2Test& with_info = kKdf2Tests[4];
+    const string key = hex2str(with_info.key_hex);
+    const string info = hex2str(with_info.info_hex);
+    const string expected_output = hex2str(with_info.expected_output_hex);
+    uint8_t output[20];
+    uint8_t no_info_output[20];
+    uint8_t no_info_expected[20];
+
+    Kdf2 kdf2;
+    ASSERT_TRUE(
+        kdf2.Init(with_info.digest_type, reinterpret_cast<const uint8_t*>(key.data()), key.size()));
+    const Kdf::Output outputs[] = {
+        {nullptr, 0, no_info_output, sizeof(no_info_output)},
+        {reinterpret_cast<const uint8_t*>(info.data()), info.size(), output, sizeof(output)},
+    };
+    ASSERT_TRUE(kdf2.GenerateKeys(outputs, 2));
+    EXPECT_EQ(0, memcmp(output, expected_output.data(), sizeof(output)));
+
+    Kdf2 single;
+    ASSERT_TRUE(single.Init(with_info.digest_type, reinterpret_cast<const uint8_t*>(key.data()),
+                            key.size()));
+    ASSERT_TRUE(single.GenerateKey(nullptr, 0, no_info_expected, sizeof(no_info_expected)));
+    EXPECT_EQ(0, memcmp(no_info_expected, no_info_output, sizeof(no_info_output)));
+}
+
 }  // namespace test
 
 }  // namespace keymaster
@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <sys/stat.h>
+
 #include <algorithm>
 #include <utility>
 
@@ -28,6 +30,9 @@
 #include <keymaster/authorization_set.h>
 #include <keymaster/key_blob_utils/auth_encrypted_key_blob.h>
 #include <keymaster/key_blob_utils/integrity_assured_key_blob.h>
+#include <keymaster/key_blob_utils/key_blob_corpus.h>
+#include <keymaster/key_blob_utils/legacy_keyblobs.h>
+#include <keymaster/key_blob_utils/software_keyblobs.h>
 #include <keymaster/keymaster_tags.h>
 #include <keymaster/km_openssl/software_random_source.h>
 
@@ -139,8 +144,7 @@ TEST_P(KeyBlobTest, EncryptDecrypt) {
     ASSERT_TRUE(deserialized.isOk());
     EXPECT_EQ(hw_enforced_, deserialized->hw_enforced);
     EXPECT_EQ(sw_enforced_, deserialized->sw_enforced);
-    if (GetParam() == AES_GCM_WITH_SECURE_DELETION ||
-        GetParam() == AES_GCM_WITH_SECURE_DELETION_VERSIONED) {
+    if (requiresSecureDeletion(GetParam())) {
         EXPECT_EQ(key_slot, deserialized->key_slot);
     } else {
         EXPECT_EQ(0U, deserialized->key_slot);
@@ -153,6 +157,53 @@ TEST_P(KeyBlobTest, EncryptDecrypt) {
                            plaintext->begin(), plaintext->end()));
 }
 
+TEST_P(KeyBlobTest, DeserializeCopiesUnlessView) {
+    // Only KM_BYTES data can be borrowed.
+    sw_enforced_.push_back(TAG_ATTESTATION_ID_BRAND, "brand", 5);
+    ASSERT_EQ(KM_ERROR_OK, Encrypt(GetParam()));
+    ASSERT_EQ(KM_ERROR_OK, Serialize());
+
+    KmErrorOr<DeserializedKey> view = DeserializeAuthEncryptedBlobView(serialized_blob_);
+    ASSERT_TRUE(view.isOk());
+    EXPECT_EQ(hw_enforced_, view->hw_enforced);
+    EXPECT_EQ(sw_enforced_, view->sw_enforced);
+    EXPECT_EQ(!isCompactFormat(GetParam()), view->sw_enforced.is_view());
+
+    // The copying variant's authorizations survive the blob.
+    KmErrorOr<DeserializedKey> copy = DeserializeAuthEncryptedBlob(serialized_blob_);
+    ASSERT_TRUE(copy.isOk());
+    EXPECT_FALSE(copy->hw_enforced.is_view());
+    EXPECT_FALSE(copy->sw_enforced.is_view());
+    serialized_blob_.Clear();
+    EXPECT_EQ(hw_enforced_, copy->hw_enforced);
+    EXPECT_EQ(sw_enforced_, copy->sw_enforced);
+}
+
+TEST_P(KeyBlobTest, MasterKeyContext) {
+    MasterKeyContext master_key_context;
+    ASSERT_EQ(KM_ERROR_OK, master_key_context.Initialize(master_key_));
+
+    // Blobs encrypted with the raw master key decrypt with the context, and vice versa.
+    ASSERT_EQ(KM_ERROR_OK, Encrypt(GetParam()));
+    ASSERT_EQ(KM_ERROR_OK, Serialize());
+    ASSERT_EQ(KM_ERROR_OK, Deserialize());
+    KmErrorOr<KeymasterKeyBlob> plaintext =
+        DecryptKey(deserialized_key_, hidden_, secure_deletion_data_, master_key_context);
+    ASSERT_TRUE(plaintext.isOk());
+    EXPECT_TRUE(std::equal(key_material_.begin(), key_material_.end(),  //
+                           plaintext->begin(), plaintext->end()));
+
+    auto encrypted = EncryptKey(key_material_, GetParam(), hw_enforced_, sw_enforced_, hidden_,
+                                secure_deletion_data_, master_key_context, *this);
+    ASSERT_TRUE(encrypted.isOk());
+    encrypted_key_ = std::move(*encrypted);
+    ASSERT_EQ(KM_ERROR_OK, Serialize());
+    ASSERT_EQ(KM_ERROR_OK, Deserialize());
+    ASSERT_EQ(KM_ERROR_OK, Decrypt());
+    EXPECT_TRUE(std::equal(key_material_.begin(), key_material_.end(),  //
+                           decrypted_plaintext_.begin(), decrypted_plaintext_.end()));
+}
+
 TEST_P(KeyBlobTest, WrongKeyLength) {
     ASSERT_EQ(KM_ERROR_OK, Encrypt(GetParam()));
     ASSERT_EQ(KM_ERROR_OK, Serialize());
@@ -379,11 +430,95 @@ TEST_P(KeyBlobTest, DupBufferToolarge) {
     EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, deserialized.error());
 }
 
+TEST_P(KeyBlobTest, Classify) {
+    ASSERT_EQ(KM_ERROR_OK, Encrypt(GetParam()));
+    ASSERT_EQ(KM_ERROR_OK, Serialize());
+    EXPECT_EQ(GetParam() == AES_OCB ? KEY_BLOB_AUTH_ENCRYPTED_OCB : KEY_BLOB_AUTH_ENCRYPTED_GCM,
+              ClassifyKeyBlob(serialized_blob_));
+    EXPECT_FALSE(HasIntegrityAssuredBlobLayout(serialized_blob_));
+
+    KeymasterKeyBlob integrity_assured;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, &integrity_assured));
+    EXPECT_TRUE(HasIntegrityAssuredBlobLayout(integrity_assured));
+    EXPECT_EQ(KEY_BLOB_INTEGRITY_ASSURED, ClassifyKeyBlob(integrity_assured));
+
+    // Any change to the layout makes it something else.
+    KeymasterKeyBlob truncated(integrity_assured.key_material,
+                               integrity_assured.key_material_size - 1);
+    EXPECT_FALSE(HasIntegrityAssuredBlobLayout(truncated));
+    EXPECT_EQ(KEY_BLOB_AUTH_ENCRYPTED_OCB, ClassifyKeyBlob(truncated));
+
+    const uint8_t old_softkeymaster[] = {'P', 'K', '#', '8', 0, 0, 0, 1};
+    EXPECT_EQ(KEY_BLOB_OLD_SOFTKEYMASTER,
+              ClassifyKeyBlob(KeymasterKeyBlob(old_softkeymaster, sizeof(old_softkeymaster))));
+
+    const uint8_t unknown[] = {0x30, 0x82, 0x01, 0x00};
+    EXPECT_EQ(KEY_BLOB_UNKNOWN, ClassifyKeyBlob(KeymasterKeyBlob(unknown, sizeof(unknown))));
+    EXPECT_EQ(KEY_BLOB_UNKNOWN, ClassifyKeyBlob(KeymasterKeyBlob()));
+
+    // Only the old softkeymaster blobs leave their key material unauthenticated.
+    EXPECT_TRUE(IsAuthenticatedKeyBlobFormat(KEY_BLOB_INTEGRITY_ASSURED));
+    EXPECT_TRUE(IsAuthenticatedKeyBlobFormat(KEY_BLOB_AUTH_ENCRYPTED_OCB));
+    EXPECT_TRUE(IsAuthenticatedKeyBlobFormat(KEY_BLOB_AUTH_ENCRYPTED_GCM));
+    EXPECT_FALSE(IsAuthenticatedKeyBlobFormat(KEY_BLOB_OLD_SOFTKEYMASTER));
+    EXPECT_FALSE(IsAuthenticatedKeyBlobFormat(KEY_BLOB_UNKNOWN));
+}
+
+TEST_P(KeyBlobTest, ParseLegacy) {
+    // The legacy parsers use the all-zero master key and no secure deletion data.
+    if (!kLegacyKeyBlobsIncluded || requiresSecureDeletion(GetParam())) return;
+    ASSERT_EQ(KM_ERROR_OK, Encrypt(GetParam()));
+    ASSERT_EQ(KM_ERROR_OK, Serialize());
+
+    KeymasterKeyBlob parsed_material;
+    AuthorizationSet parsed_hw_enforced;
+    AuthorizationSet parsed_sw_enforced;
+    ASSERT_EQ(KM_ERROR_OK,
+              ParseLegacyKeyBlob(serialized_blob_, ClassifyKeyBlob(serialized_blob_), hidden_,
+                                 &parsed_material, &parsed_hw_enforced, &parsed_sw_enforced));
+    EXPECT_TRUE(std::equal(key_material_.begin(), key_material_.end(),  //
+                           parsed_material.begin(), parsed_material.end()));
+    EXPECT_EQ(hw_enforced_, parsed_hw_enforced);
+    EXPECT_EQ(sw_enforced_, parsed_sw_enforced);
+
+    // Blobs in current formats are left to their own parsers.
+    KeymasterKeyBlob integrity_assured;
+    ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                         sw_enforced_, &integrity_assured));
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              ParseLegacyKeyBlob(integrity_assured, KEY_BLOB_INTEGRITY_ASSURED, hidden_,
+                                 &parsed_material, &parsed_hw_enforced, &parsed_sw_enforced));
+}
+
+TEST_P(KeyBlobTest, VerifyIntegrityAssuredBatch) {
+    KeymasterKeyBlob blobs[3];
+    for (auto& blob : blobs) {
+        ASSERT_EQ(KM_ERROR_OK, SerializeIntegrityAssuredBlob(key_material_, hidden_, hw_enforced_,
+                                                             sw_enforced_, &blob));
+    }
+    blobs[1].writable_data()[blobs[1].key_material_size / 2] ^= 1;
+    blobs[2] = KeymasterKeyBlob(blobs[2].key_material, 4);
+
+    keymaster_error_t errors[3];
+    ASSERT_EQ(KM_ERROR_OK, VerifyIntegrityAssuredBlobs(blobs, 3, hidden_, errors));
+    EXPECT_EQ(KM_ERROR_OK, errors[0]);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, errors[1]);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, errors[2]);
+
+    AuthorizationSet wrong_hidden(hidden_);
+    wrong_hidden.push_back(TAG_APPLICATION_DATA, "bar", 3);
+    ASSERT_EQ(KM_ERROR_OK, VerifyIntegrityAssuredBlobs(blobs, 1, wrong_hidden, errors));
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, errors[0]);
+}
+
 INSTANTIATE_TEST_SUITE_P(AllFormats, KeyBlobTest,
                          ::testing::Values(AES_OCB, AES_GCM_WITH_SW_ENFORCED,
                                            AES_GCM_WITH_SECURE_DELETION,
                                            AES_GCM_WITH_SW_ENFORCED_VERSIONED,
-                                           AES_GCM_WITH_SECURE_DELETION_VERSIONED),
+                                           AES_GCM_WITH_SECURE_DELETION_VERSIONED,
+                                           AES_GCM_WITH_SW_ENFORCED_COMPACT,
+                                           AES_GCM_WITH_SECURE_DELETION_COMPACT),
                          [](const ::testing::TestParamInfo<KeyBlobTest::ParamType>& info) {
                              switch (info.param) {
                              case AES_OCB:
@@ -396,6 +531,10 @@ INSTANTIATE_TEST_SUITE_P(AllFormats, KeyBlobTest,
                                  return "AES_GCM_WITH_SW_ENFORCED_VERSIONED";
                              case AES_GCM_WITH_SECURE_DELETION_VERSIONED:
                                  return "AES_GCM_WITH_SECURE_DELETION_VERSIONED";
+                             case AES_GCM_WITH_SW_ENFORCED_COMPACT:
+                                 return "AES_GCM_WITH_SW_ENFORCED_COMPACT";
+                             case AES_GCM_WITH_SECURE_DELETION_COMPACT:
+                                 return "AES_GCM_WITH_SECURE_DELETION_COMPACT";
                              }
                              CHECK(false) << "Shouldn't be able to get here";
                              return "Unexpected";
@@ -405,7 +544,8 @@ using SecureDeletionTest = KeyBlobTest;
 
 INSTANTIATE_TEST_SUITE_P(SecureDeletionFormats, SecureDeletionTest,
                          ::testing::Values(AES_GCM_WITH_SECURE_DELETION,
-                                           AES_GCM_WITH_SECURE_DELETION_VERSIONED),
+                                           AES_GCM_WITH_SECURE_DELETION_VERSIONED,
+                                           AES_GCM_WITH_SECURE_DELETION_COMPACT),
                          [](const ::testing::TestParamInfo<KeyBlobTest::ParamType>& info) {
                              switch (info.param) {
                              case AES_OCB:
@@ -418,6 +558,10 @@ INSTANTIATE_TEST_SUITE_P(SecureDeletionFormats, SecureDeletionTest,
                                  return "AES_GCM_WITH_SW_ENFORCED_VERSIONED";
                              case AES_GCM_WITH_SECURE_DELETION_VERSIONED:
                                  return "AES_GCM_WITH_SECURE_DELETION_VERSIONED";
+                             case AES_GCM_WITH_SW_ENFORCED_COMPACT:
+                                 return "AES_GCM_WITH_SW_ENFORCED_COMPACT";
+                             case AES_GCM_WITH_SECURE_DELETION_COMPACT:
+                                 return "AES_GCM_WITH_SECURE_DELETION_COMPACT";
                              }
                              CHECK(false) << "Shouldn't be able to get here";
                              return "Unexpected";
@@ -465,6 +609,59 @@ TEST_P(SecureDeletionTest, WrongSecureDeletionKeySlot) {
     EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, result.error());
 }
 
+TEST(KeyBlobCorpusTest, ParseDirectory) {
+    std::string dir = ::testing::TempDir() + "/key_blob_corpus";
+    mkdir(dir.c_str(), 0700);
+
+    AuthorizationSet hidden;
+    ASSERT_EQ(KM_ERROR_OK,
+              BuildHiddenAuthorizations(AuthorizationSet(), &hidden, softwareRootOfTrust));
+    AuthorizationSet hw_enforced(AuthorizationSetBuilder().Authorization(TAG_ALGORITHM,
+                                                                         KM_ALGORITHM_AES));
+    KeymasterKeyBlob good;
+    ASSERT_EQ(KM_ERROR_OK,
+              SerializeIntegrityAssuredBlob(KeymasterKeyBlob(key_data, sizeof(key_data)), hidden,
+                                            hw_enforced, AuthorizationSet(), &good));
+    KeymasterKeyBlob tampered(good);
+    tampered.writable_data()[tampered.key_material_size - 1] ^= 1;
+    const uint8_t unknown[] = {0x30, 0x82, 0x01, 0x00};
+
+    auto write_file = [&](const char* name, const uint8_t* data, size_t size) {
+        std::string path = dir + "/" + name;
+        FILE* file = fopen(path.c_str(), "wb");
+        ASSERT_NE(nullptr, file);
+        if (size) ASSERT_EQ(size, fwrite(data, 1, size, file));
+        fclose(file);
+    };
+    write_file("a_good", good.key_material, good.key_material_size);
+    write_file("b_tampered", tampered.key_material, tampered.key_material_size);
+    write_file("c_unknown", unknown, sizeof(unknown));
+    write_file("d_empty", nullptr, 0);
+
+    KeyBlobCorpus corpus;
+    ASSERT_EQ(KM_ERROR_OK, corpus.AddDirectory(dir));
+    ASSERT_EQ(3U, corpus.size());
+    EXPECT_EQ(dir + "/a_good", corpus.path(0));
+    EXPECT_EQ(good.key_material_size, corpus.blob(0).key_material_size);
+    EXPECT_EQ(0, memcmp(good.key_material, corpus.blob(0).key_material, good.key_material_size));
+
+    for (size_t threads : {1, 4}) {
+        auto stats = corpus.Parse(AuthorizationSet(), threads);
+        EXPECT_EQ(3U, stats.blob_count);
+        EXPECT_EQ(2U, stats.format_counts[KEY_BLOB_INTEGRITY_ASSURED]);
+        EXPECT_EQ(1U, stats.parsed_counts[KEY_BLOB_INTEGRITY_ASSURED]);
+        EXPECT_EQ(1U, stats.format_counts[KEY_BLOB_UNKNOWN]);
+        ASSERT_EQ(2U, stats.failures.size());
+        EXPECT_EQ(1U, stats.failures[0].index);
+        EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, stats.failures[0].error);
+        EXPECT_EQ(2U, stats.failures[1].index);
+        EXPECT_EQ(KEY_BLOB_UNKNOWN, stats.failures[1].format);
+    }
+
+    EXPECT_NE(KM_ERROR_OK, corpus.AddFile(dir + "/missing"));
+    EXPECT_EQ(3U, corpus.size());
+}
+
 TEST(KmErrorOrDeathTest, UncheckedError) {
     ASSERT_DEATH({ KmErrorOr<int> kmError(KM_ERROR_UNKNOWN_ERROR); }, "");
 }
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/key_usage_stats.h>
+
+#include <vector>
+
+#include <keymaster/android_keymaster.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+TEST(KeyUsageStatsTest, CountsCallsPerKey) {
+    KeyUsageStats stats;
+    stats.Record(1, true /* is_begin */, KM_ERROR_OK, 100);
+    stats.Record(1, false /* is_begin */, KM_ERROR_OK, 200);
+    stats.Record(2, true /* is_begin */, KM_ERROR_KEY_RATE_LIMIT_EXCEEDED, 50);
+    stats.Record(1, false /* is_begin */, KM_ERROR_INVALID_TAG, 300);
+
+    std::vector<KeyUsage> keys;
+    stats.GetHotKeys(10, &keys);
+    ASSERT_EQ(2U, keys.size());
+    EXPECT_EQ(1U, keys[0].key_id);
+    EXPECT_EQ(1U, keys[0].begins);
+    EXPECT_EQ(3U, keys[0].calls);
+    EXPECT_EQ(1U, keys[0].errors);
+    EXPECT_EQ(600U, keys[0].total_ns);
+    EXPECT_EQ(0U, keys[0].overcount);
+    EXPECT_EQ(2U, keys[1].key_id);
+    EXPECT_EQ(1U, keys[1].errors);
+
+    stats.GetHotKeys(1, &keys);
+    ASSERT_EQ(1U, keys.size());
+    EXPECT_EQ(1U, keys[0].key_id);
+
+    stats.Reset();
+    stats.GetHotKeys(10, &keys);
+    EXPECT_TRUE(keys.empty());
+}
+
+TEST(KeyUsageStatsTest, NewKeysDisplaceTheColdest) {
+    KeyUsageStats stats(2 /* capacity */);
+    for (int i = 0; i < 5; ++i) stats.Record(1, true /* is_begin */, KM_ERROR_OK, 10);
+    for (int i = 0; i < 2; ++i) stats.Record(2, true /* is_begin */, KM_ERROR_OK, 10);
+    stats.Record(3, true /* is_begin */, KM_ERROR_OK, 10);
+
+    std::vector<KeyUsage> keys;
+    stats.GetHotKeys(10, &keys);
+    ASSERT_EQ(2U, keys.size());
+    EXPECT_EQ(1U, keys[0].key_id);
+    EXPECT_EQ(5U, keys[0].calls);
+    // Key 3 took key 2's slot, and its count.
+    EXPECT_EQ(3U, keys[1].key_id);
+    EXPECT_EQ(3U, keys[1].calls);
+    EXPECT_EQ(2U, keys[1].overcount);
+    EXPECT_EQ(1U, keys[1].begins);
+    EXPECT_EQ(10U, keys[1].total_ns);
+}
+
+TEST(KeyUsageStatsTest, SamplesAndScales) {
+    KeyUsageStats stats(KeyUsageStats::kDefaultCapacity, 4 /* sample_interval */);
+    size_t sampled = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (!stats.ShouldSample()) continue;
+        ++sampled;
+        stats.Record(7, true /* is_begin */, KM_ERROR_OK, 25);
+    }
+    EXPECT_EQ(4U, sampled);
+
+    std::vector<KeyUsage> keys;
+    stats.GetHotKeys(10, &keys);
+    ASSERT_EQ(1U, keys.size());
+    EXPECT_EQ(16U, keys[0].begins);
+    EXPECT_EQ(16U, keys[0].calls);
+    EXPECT_EQ(400U, keys[0].total_ns);
+}
+
+TEST(KeyUsageStatsTest, AndroidKeymasterSkipsUnidentifiedKeys) {
+    AndroidKeymaster keymaster(nullptr /* context */, 4);
+    KeyUsageStats stats;
+    keymaster.set_key_usage_stats(&stats);
+    EXPECT_EQ(&stats, keymaster.key_usage_stats());
+
+    // No operation, so no key to count the call against.
+    AbortOperationRequest request(keymaster.message_version());
+    request.op_handle = 1;
+    AbortOperationResponse response(keymaster.message_version());
+    keymaster.AbortOperation(request, &response);
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, response.error);
+
+    std::vector<KeyUsage> keys;
+    stats.GetHotKeys(10, &keys);
+    EXPECT_TRUE(keys.empty());
+}
+
+}  // namespace test
+}  // namespace keymaster
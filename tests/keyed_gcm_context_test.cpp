@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/aes_key.h>
+
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+// Encrypts |plaintext| with |ctx|, which must already have its key and nonce, and appends the tag.
+static void GcmEncrypt(EVP_CIPHER_CTX* ctx, const uint8_t* plaintext, size_t length,
+                       uint8_t* out) {
+    int written;
+    ASSERT_TRUE(EVP_CipherUpdate(ctx, out, &written, plaintext, length));
+    ASSERT_EQ(static_cast<int>(length), written);
+    ASSERT_TRUE(EVP_CipherFinal_ex(ctx, out + written, &written));
+    ASSERT_EQ(0, written);
+    ASSERT_TRUE(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, out + length));
+}
+
+TEST(KeyedGcmContextTest, CopiesMatchFreshContexts) {
+    const uint8_t key[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    const uint8_t plaintext[] = "keyed gcm context";
+    KeymasterKeyBlob key_material(key, sizeof(key));
+    KeyedGcmContext keyed;
+    ASSERT_TRUE(keyed.Init(key_material, EVP_aes_128_gcm()));
+    EXPECT_EQ(EVP_aes_128_gcm(), keyed.cipher());
+
+    for (uint8_t i = 0; i < 2; ++i) {
+        const uint8_t nonce[12] = {i};
+
+        EVP_CIPHER_CTX fresh;
+        EVP_CIPHER_CTX_init(&fresh);
+        ASSERT_TRUE(EVP_CipherInit_ex(&fresh, EVP_aes_128_gcm(), nullptr, key, nonce, 1));
+        uint8_t expected[sizeof(plaintext) + 16];
+        GcmEncrypt(&fresh, plaintext, sizeof(plaintext), expected);
+        EVP_CIPHER_CTX_cleanup(&fresh);
+
+        // Each copy starts from the keyed state, so using one doesn't affect the next.
+        EVP_CIPHER_CTX copy;
+        EVP_CIPHER_CTX_init(&copy);
+        ASSERT_TRUE(keyed.CopyTo(&copy));
+        ASSERT_TRUE(EVP_CipherInit_ex(&copy, nullptr, nullptr, nullptr, nonce, 1));
+        uint8_t actual[sizeof(plaintext) + 16];
+        GcmEncrypt(&copy, plaintext, sizeof(plaintext), actual);
+        EVP_CIPHER_CTX_cleanup(&copy);
+
+        EXPECT_EQ(0, memcmp(expected, actual, sizeof(expected)));
+    }
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,623 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <openssl/mem.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/concurrent_android_keymaster.h>
+#include <keymaster/constant_time.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+#include <keymaster/key.h>
+#include <keymaster/key_blob_utils/auth_encrypted_key_blob.h>
+#include <keymaster/km_openssl/hkdf.h>
+#include <keymaster/km_openssl/kdf2.h>
+#include <keymaster/km_openssl/software_random_source.h>
+
+// End-to-end benchmarks of the paths a software KeyMint spends its time in, all run against a
+// PureSoftKeymasterContext so results are comparable across devices and builds.
+
+namespace keymaster {
+namespace {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+constexpr size_t kOperationTableSize = 16;
+constexpr uint32_t kOsVersion = 140000;
+constexpr uint32_t kOsPatchlevel = 202310;
+
+class Keymaster {
+  public:
+    Keymaster()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, kOperationTableSize, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(kOsVersion, kOsPatchlevel);
+        context_->SetVendorPatchlevel(kOsPatchlevel * 100 + 1);
+        context_->SetBootPatchlevel(kOsPatchlevel * 100 + 1);
+    }
+
+    int32_t message_version() const { return keymaster_.message_version(); }
+    AndroidKeymaster* keymaster() { return &keymaster_; }
+    const KeymasterContext& context() const { return *context_; }
+
+    keymaster_error_t GenerateKey(const AuthorizationSet& params, KeymasterKeyBlob* key_blob) {
+        GenerateKeyRequest request(message_version());
+        request.key_description.Reinitialize(params);
+        request.key_description.push_back(TAG_NO_AUTH_REQUIRED);
+        request.key_description.push_back(TAG_CERTIFICATE_NOT_BEFORE, 0);
+        request.key_description.push_back(TAG_CERTIFICATE_NOT_AFTER, kUndefinedExpirationDateTime);
+        GenerateKeyResponse response(message_version());
+        keymaster_.GenerateKey(request, &response);
+        if (response.error == KM_ERROR_OK) *key_blob = std::move(response.key_blob);
+        return response.error;
+    }
+
+    // Runs one complete operation, feeding |input| to a single Update() and nothing to Finish().
+    keymaster_error_t RunOperation(const KeymasterKeyBlob& key_blob, keymaster_purpose_t purpose,
+                                   const AuthorizationSet& begin_params, const Buffer& input) {
+        BeginOperationRequest begin_request(message_version());
+        begin_request.purpose = purpose;
+        begin_request.SetKeyMaterial(key_blob);
+        begin_request.additional_params.Reinitialize(begin_params);
+        BeginOperationResponse begin_response(message_version());
+        keymaster_.BeginOperation(begin_request, &begin_response);
+        if (begin_response.error != KM_ERROR_OK) return begin_response.error;
+
+        UpdateOperationRequest update_request(message_version());
+        update_request.op_handle = begin_response.op_handle;
+        update_request.input.Reinitialize(input.peek_read(), input.available_read());
+        UpdateOperationResponse update_response(message_version());
+        keymaster_.UpdateOperation(update_request, &update_response);
+        if (update_response.error != KM_ERROR_OK) return update_response.error;
+
+        FinishOperationRequest finish_request(message_version());
+        finish_request.op_handle = begin_response.op_handle;
+        FinishOperationResponse finish_response(message_version());
+        keymaster_.FinishOperation(finish_request, &finish_response);
+        return finish_response.error;
+    }
+
+    // Runs one complete operation, feeding |input| to Update() in |chunk_size| pieces.  The
+    // operation's output goes to |output| and Begin()'s output parameters to |begin_output|.
+    keymaster_error_t RunChunkedOperation(const KeymasterKeyBlob& key_blob,
+                                          keymaster_purpose_t purpose,
+                                          const AuthorizationSet& begin_params,
+                                          const std::vector<uint8_t>& input, size_t chunk_size,
+                                          AuthorizationSet* begin_output,
+                                          std::vector<uint8_t>* output) {
+        BeginOperationRequest begin_request(message_version());
+        begin_request.purpose = purpose;
+        begin_request.SetKeyMaterial(key_blob);
+        begin_request.additional_params.Reinitialize(begin_params);
+        BeginOperationResponse begin_response(message_version());
+        keymaster_.BeginOperation(begin_request, &begin_response);
+        if (begin_response.error != KM_ERROR_OK) return begin_response.error;
+        begin_output->Reinitialize(begin_response.output_params);
+
+        output->clear();
+        for (size_t offset = 0; offset < input.size(); offset += chunk_size) {
+            UpdateOperationRequest update_request(message_version());
+            update_request.op_handle = begin_response.op_handle;
+            update_request.input.Reinitialize(input.data() + offset,
+                                              std::min(chunk_size, input.size() - offset));
+            UpdateOperationResponse update_response(message_version());
+            keymaster_.UpdateOperation(update_request, &update_response);
+            if (update_response.error != KM_ERROR_OK) return update_response.error;
+            output->insert(output->end(), update_response.output.begin(),
+                           update_response.output.end());
+        }
+
+        FinishOperationRequest finish_request(message_version());
+        finish_request.op_handle = begin_response.op_handle;
+        FinishOperationResponse finish_response(message_version());
+        keymaster_.FinishOperation(finish_request, &finish_response);
+        if (finish_response.error != KM_ERROR_OK) return finish_response.error;
+        output->insert(output->end(), finish_response.output.begin(), finish_response.output.end());
+        return KM_ERROR_OK;
+    }
+
+  private:
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+};
+
+Keymaster& GetKeymaster() {
+    static Keymaster* keymaster = new Keymaster;
+    return *keymaster;
+}
+
+AuthorizationSet AesParams(keymaster_block_mode_t mode) {
+    AuthorizationSet params(
+        AuthorizationSetBuilder().AesEncryptionKey(256).BlockMode(mode).Padding(KM_PAD_NONE));
+    if (mode == KM_MODE_GCM) params.push_back(TAG_MIN_MAC_LENGTH, 128);
+    return params;
+}
+
+AuthorizationSet HmacParams() {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .HmacKey(256)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Authorization(TAG_MIN_MAC_LENGTH, 256));
+}
+
+AuthorizationSet RsaParams() {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .RsaSigningKey(2048, 65537)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+}
+
+AuthorizationSet EcdsaParams() {
+    return AuthorizationSet(
+        AuthorizationSetBuilder().EcdsaSigningKey(256).Digest(KM_DIGEST_SHA_2_256));
+}
+
+void FillSets(AuthorizationSet* set, size_t count) {
+    static const uint8_t kData[64] = {};
+    for (size_t i = 0; i < count / 4; ++i) {
+        set->push_back(TAG_PURPOSE, KM_PURPOSE_SIGN);
+        set->push_back(TAG_USER_SECURE_ID, i);
+        set->push_back(TAG_APPLICATION_DATA, kData, sizeof(kData));
+        set->push_back(TAG_NO_AUTH_REQUIRED);
+    }
+}
+
+void BM_AuthorizationSetSerialize(benchmark::State& state) {
+    AuthorizationSet set;
+    FillSets(&set, state.range(0));
+    std::vector<uint8_t> buf(set.SerializedSize());
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(set.Serialize(buf.data(), buf.data() + buf.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_AuthorizationSetSerialize)->Arg(8)->Arg(32)->Arg(128);
+
+void BM_AuthorizationSetDeserialize(benchmark::State& state) {
+    AuthorizationSet set;
+    FillSets(&set, state.range(0));
+    std::vector<uint8_t> buf(set.SerializedSize());
+    set.Serialize(buf.data(), buf.data() + buf.size());
+
+    for (auto _ : state) {
+        AuthorizationSet deserialized;
+        const uint8_t* p = buf.data();
+        benchmark::DoNotOptimize(deserialized.Deserialize(&p, buf.data() + buf.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_AuthorizationSetDeserialize)->Arg(8)->Arg(32)->Arg(128);
+
+// Deserializes and decrypts a blob of each AuthEncryptedBlobFormat, the work behind every
+// ParseKeyBlob() call for software keys.
+void BM_DecryptKeyBlob(benchmark::State& state) {
+    auto format = static_cast<AuthEncryptedBlobFormat>(state.range(0));
+    static const uint8_t kKeyMaterial[32] = {1, 2, 3};
+    static const uint8_t kMasterKey[16] = {};
+    KeymasterKeyBlob key_material(kKeyMaterial, sizeof(kKeyMaterial));
+    KeymasterKeyBlob master_key(kMasterKey, sizeof(kMasterKey));
+
+    AuthorizationSet hw_enforced = AesParams(KM_MODE_GCM);
+    AuthorizationSet sw_enforced;
+    sw_enforced.push_back(TAG_CREATION_DATETIME, 10);
+    AuthorizationSet hidden;
+    hidden.push_back(TAG_APPLICATION_ID, "app", 3);
+    SecureDeletionData secure_deletion_data;
+    secure_deletion_data.factory_reset_secret.Reinitialize("Factory reset secret", 20);
+    secure_deletion_data.secure_deletion_secret.Reinitialize("Secure deletion secret", 22);
+    SoftwareRandomSource random;
+
+    auto encrypted = EncryptKey(key_material, format, hw_enforced, sw_enforced, hidden,
+                                secure_deletion_data, master_key, random);
+    if (!encrypted) return state.SkipWithError("EncryptKey failed");
+    auto blob = SerializeAuthEncryptedBlob(*encrypted, hw_enforced, sw_enforced, 1 /* slot */);
+    if (!blob) return state.SkipWithError("SerializeAuthEncryptedBlob failed");
+
+    for (auto _ : state) {
+        auto deserialized = DeserializeAuthEncryptedBlob(*blob);
+        if (!deserialized) return state.SkipWithError("DeserializeAuthEncryptedBlob failed");
+        auto decrypted =
+            DecryptKey(std::move(*deserialized), hidden, secure_deletion_data, master_key);
+        if (!decrypted) return state.SkipWithError("DecryptKey failed");
+        benchmark::DoNotOptimize(decrypted->key_material);
+    }
+}
+BENCHMARK(BM_DecryptKeyBlob)
+    ->Arg(AES_OCB)
+    ->Arg(AES_GCM_WITH_SW_ENFORCED)
+    ->Arg(AES_GCM_WITH_SECURE_DELETION)
+    ->Arg(AES_GCM_WITH_SW_ENFORCED_VERSIONED)
+    ->Arg(AES_GCM_WITH_SECURE_DELETION_VERSIONED);
+
+// Parses a freshly generated blob through the context, in whichever format it writes.
+void ParseKeyBlob(benchmark::State& state, const AuthorizationSet& params) {
+    Keymaster& km = GetKeymaster();
+    KeymasterKeyBlob key_blob;
+    if (km.GenerateKey(params, &key_blob) != KM_ERROR_OK) {
+        return state.SkipWithError("GenerateKey failed");
+    }
+    AuthorizationSet additional_params;
+
+    for (auto _ : state) {
+        UniquePtr<Key> key;
+        if (km.context().ParseKeyBlob(key_blob, additional_params, &key) != KM_ERROR_OK) {
+            return state.SkipWithError("ParseKeyBlob failed");
+        }
+        benchmark::DoNotOptimize(key.get());
+    }
+}
+
+void BM_ParseAesKeyBlob(benchmark::State& state) {
+    ParseKeyBlob(state, AesParams(KM_MODE_GCM));
+}
+BENCHMARK(BM_ParseAesKeyBlob);
+
+void BM_ParseEcKeyBlob(benchmark::State& state) {
+    ParseKeyBlob(state, EcdsaParams());
+}
+BENCHMARK(BM_ParseEcKeyBlob);
+
+void BM_ParseRsaKeyBlob(benchmark::State& state) {
+    ParseKeyBlob(state, RsaParams());
+}
+BENCHMARK(BM_ParseRsaKeyBlob);
+
+// Times a complete Begin/Update/Finish over state.range(0) bytes of input.
+void RunOperations(benchmark::State& state, const AuthorizationSet& key_params,
+                   keymaster_purpose_t purpose, AuthorizationSetBuilder& begin_params) {
+    Keymaster& km = GetKeymaster();
+    KeymasterKeyBlob key_blob;
+    if (km.GenerateKey(key_params, &key_blob) != KM_ERROR_OK) {
+        return state.SkipWithError("GenerateKey failed");
+    }
+    AuthorizationSet begin_set(begin_params);
+    std::vector<uint8_t> data(state.range(0), 'a');
+    Buffer input(data.data(), data.size());
+
+    for (auto _ : state) {
+        if (km.RunOperation(key_blob, purpose, begin_set, input) != KM_ERROR_OK) {
+            return state.SkipWithError("operation failed");
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+void BM_AesGcmEncrypt(benchmark::State& state) {
+    RunOperations(state, AesParams(KM_MODE_GCM), KM_PURPOSE_ENCRYPT,
+                  AuthorizationSetBuilder()
+                      .BlockMode(KM_MODE_GCM)
+                      .Padding(KM_PAD_NONE)
+                      .Authorization(TAG_MAC_LENGTH, 128));
+}
+BENCHMARK(BM_AesGcmEncrypt)->Arg(64)->Arg(1024)->Arg(16384);
+
+// Decrypts state.range(0) bytes fed in 64 KiB updates, the way a streaming client sends a large
+// ciphertext.  Every update after the first also releases the candidate tag bytes held back by the
+// previous one.
+void BM_AesGcmDecrypt(benchmark::State& state) {
+    constexpr size_t kChunkSize = 64 * 1024;
+    Keymaster& km = GetKeymaster();
+    KeymasterKeyBlob key_blob;
+    if (km.GenerateKey(AesParams(KM_MODE_GCM), &key_blob) != KM_ERROR_OK) {
+        return state.SkipWithError("GenerateKey failed");
+    }
+    AuthorizationSet encrypt_params(AuthorizationSetBuilder()
+                                        .BlockMode(KM_MODE_GCM)
+                                        .Padding(KM_PAD_NONE)
+                                        .Authorization(TAG_MAC_LENGTH, 128));
+    std::vector<uint8_t> plaintext(state.range(0), 'a');
+    AuthorizationSet begin_output;
+    std::vector<uint8_t> ciphertext;
+    if (km.RunChunkedOperation(key_blob, KM_PURPOSE_ENCRYPT, encrypt_params, plaintext, kChunkSize,
+                               &begin_output, &ciphertext) != KM_ERROR_OK) {
+        return state.SkipWithError("encryption failed");
+    }
+
+    keymaster_blob_t nonce;
+    if (!begin_output.GetTagValue(TAG_NONCE, &nonce)) return state.SkipWithError("no nonce");
+    AuthorizationSet decrypt_params(encrypt_params);
+    decrypt_params.push_back(TAG_NONCE, nonce);
+    std::vector<uint8_t> output;
+    for (auto _ : state) {
+        if (km.RunChunkedOperation(key_blob, KM_PURPOSE_DECRYPT, decrypt_params, ciphertext,
+                                   kChunkSize, &begin_output, &output) != KM_ERROR_OK) {
+            return state.SkipWithError("decryption failed");
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * plaintext.size());
+}
+BENCHMARK(BM_AesGcmDecrypt)->Arg(1 << 20)->Arg(8 << 20);
+
+void BM_AesCbcEncrypt(benchmark::State& state) {
+    RunOperations(state, AesParams(KM_MODE_CBC), KM_PURPOSE_ENCRYPT,
+                  AuthorizationSetBuilder().BlockMode(KM_MODE_CBC).Padding(KM_PAD_NONE));
+}
+BENCHMARK(BM_AesCbcEncrypt)->Arg(64)->Arg(1024)->Arg(16384);
+
+void BM_AesCtrEncrypt(benchmark::State& state) {
+    RunOperations(state, AesParams(KM_MODE_CTR), KM_PURPOSE_ENCRYPT,
+                  AuthorizationSetBuilder().BlockMode(KM_MODE_CTR).Padding(KM_PAD_NONE));
+}
+BENCHMARK(BM_AesCtrEncrypt)->Arg(64)->Arg(1024)->Arg(16384)->Arg(64 << 20);
+
+AuthorizationSet TripleDesParams(keymaster_block_mode_t mode) {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .TripleDesEncryptionKey(168)
+                                .BlockMode(mode)
+                                .Padding(KM_PAD_NONE));
+}
+
+// Legacy bulk 3DES, to compare against the AES numbers above.
+void BM_TripleDesEcbEncrypt(benchmark::State& state) {
+    RunOperations(state, TripleDesParams(KM_MODE_ECB), KM_PURPOSE_ENCRYPT,
+                  AuthorizationSetBuilder().BlockMode(KM_MODE_ECB).Padding(KM_PAD_NONE));
+}
+BENCHMARK(BM_TripleDesEcbEncrypt)->Arg(64)->Arg(16384)->Arg(1 << 20);
+
+void BM_TripleDesCbcEncrypt(benchmark::State& state) {
+    RunOperations(state, TripleDesParams(KM_MODE_CBC), KM_PURPOSE_ENCRYPT,
+                  AuthorizationSetBuilder().BlockMode(KM_MODE_CBC).Padding(KM_PAD_NONE));
+}
+BENCHMARK(BM_TripleDesCbcEncrypt)->Arg(64)->Arg(16384)->Arg(1 << 20);
+
+void BM_HmacSign(benchmark::State& state) {
+    RunOperations(
+        state, HmacParams(), KM_PURPOSE_SIGN,
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256));
+}
+BENCHMARK(BM_HmacSign)->Arg(64)->Arg(1024)->Arg(16384);
+
+void BM_RsaSign(benchmark::State& state) {
+    RunOperations(
+        state, RsaParams(), KM_PURPOSE_SIGN,
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Padding(KM_PAD_RSA_PKCS1_1_5_SIGN));
+}
+BENCHMARK(BM_RsaSign)->Arg(64)->Arg(16384);
+
+void BM_EcdsaSign(benchmark::State& state) {
+    RunOperations(state, EcdsaParams(), KM_PURPOSE_SIGN,
+                  AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256));
+}
+BENCHMARK(BM_EcdsaSign)->Arg(64)->Arg(16384);
+
+// Comparing two equal |state.range(0)|-byte buffers, the worst case for a MAC check, with
+// ConstantTimeEquals() and with the alternatives it replaces.
+void CompareEqual(benchmark::State& state, int (*compare)(const void*, const void*, size_t)) {
+    std::vector<uint8_t> a(state.range(0), 0x5a);
+    std::vector<uint8_t> b(a);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(compare(a.data(), b.data(), a.size()));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * a.size());
+}
+
+void BM_ConstantTimeEquals(benchmark::State& state) {
+    state.SetLabel(ConstantTimeEqualsKernel());
+    CompareEqual(state, [](const void* a, const void* b, size_t n) {
+        return ConstantTimeEquals(a, b, n) ? 0 : 1;
+    });
+}
+BENCHMARK(BM_ConstantTimeEquals)->Arg(8)->Arg(32)->Arg(64)->Arg(1024)->Arg(16384);
+
+void BM_CryptoMemcmp(benchmark::State& state) {
+    CompareEqual(state, CRYPTO_memcmp);
+}
+BENCHMARK(BM_CryptoMemcmp)->Arg(8)->Arg(32)->Arg(64)->Arg(1024)->Arg(16384);
+
+// memcmp_s() before it used ConstantTimeEquals().
+void BM_ByteLoopCompare(benchmark::State& state) {
+    CompareEqual(state, [](const void* a, const void* b, size_t n) {
+        const uint8_t* s1 = static_cast<const uint8_t*>(a);
+        const uint8_t* s2 = static_cast<const uint8_t*>(b);
+        uint8_t result = 0;
+        for (; n > 0; n--)
+            result |= *s1++ ^ *s2++;
+        return result == 0 ? 0 : 1;
+    });
+}
+BENCHMARK(BM_ByteLoopCompare)->Arg(8)->Arg(32)->Arg(64)->Arg(1024)->Arg(16384);
+
+// KDF2 with a 256-byte secret producing |state.range(0)| bytes.  Each counter block starts from the
+// hashed secret rather than rehashing it, so long outputs cost one compression per block.
+void BM_Kdf2(benchmark::State& state) {
+    static const uint8_t kSecret[256] = {1, 2, 3};
+    std::vector<uint8_t> output(state.range(0));
+    Kdf2 kdf;
+    if (!kdf.Init(KM_DIGEST_SHA_2_256, kSecret, sizeof(kSecret))) {
+        return state.SkipWithError("Init failed");
+    }
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(kdf.GenerateKey(nullptr, 0, output.data(), output.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * output.size());
+}
+BENCHMARK(BM_Kdf2)->Arg(32)->Arg(1024)->Arg(16384);
+
+// HKDF deriving |state.range(0)| 32-byte keys from one secret, extracting only once.
+void BM_HkdfGenerateKeys(benchmark::State& state) {
+    static const uint8_t kSecret[32] = {1, 2, 3};
+    size_t count = state.range(0);
+    std::vector<uint8_t> keys(count * 32);
+    std::vector<uint8_t> infos(count);
+    std::vector<Kdf::Output> outputs(count);
+    for (size_t i = 0; i < count; ++i) {
+        infos[i] = i;
+        outputs[i] = {&infos[i], 1, &keys[i * 32], 32};
+    }
+
+    for (auto _ : state) {
+        Rfc5869Sha256Kdf kdf;
+        benchmark::DoNotOptimize(kdf.Init(kSecret, sizeof(kSecret), nullptr, 0) &&
+                                 kdf.GenerateKeys(outputs.data(), count));
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(BM_HkdfGenerateKeys)->Arg(1)->Arg(4)->Arg(16);
+
+void BM_AttestEcKey(benchmark::State& state) {
+    Keymaster& km = GetKeymaster();
+    KeymasterKeyBlob key_blob;
+    if (km.GenerateKey(EcdsaParams(), &key_blob) != KM_ERROR_OK) {
+        return state.SkipWithError("GenerateKey failed");
+    }
+    AttestKeyRequest request(km.message_version());
+    request.SetKeyMaterial(key_blob);
+    request.attest_params.push_back(TAG_ATTESTATION_CHALLENGE, "challenge", 9);
+    request.attest_params.push_back(TAG_ATTESTATION_APPLICATION_ID, "app_id", 6);
+
+    for (auto _ : state) {
+        AttestKeyResponse response(km.message_version());
+        km.keymaster()->AttestKey(request, &response);
+        if (response.error != KM_ERROR_OK) return state.SkipWithError("AttestKey failed");
+    }
+}
+BENCHMARK(BM_AttestEcKey);
+
+// End-to-end latency of generating an attested EC key, including key generation itself.
+void BM_GenerateAttestedEcKey(benchmark::State& state) {
+    Keymaster& km = GetKeymaster();
+    AuthorizationSet params = EcdsaParams();
+    params.push_back(TAG_ATTESTATION_CHALLENGE, "challenge", 9);
+    params.push_back(TAG_ATTESTATION_APPLICATION_ID, "app_id", 6);
+
+    for (auto _ : state) {
+        KeymasterKeyBlob key_blob;
+        if (km.GenerateKey(params, &key_blob) != KM_ERROR_OK) {
+            return state.SkipWithError("GenerateKey failed");
+        }
+    }
+}
+BENCHMARK(BM_GenerateAttestedEcKey);
+
+// Builds a CSR over state.range(0) freshly generated production-mode RKP keys.
+void BM_GenerateCsrV2(benchmark::State& state) {
+    Keymaster& km = GetKeymaster();
+    GenerateCsrV2Request request(km.message_version());
+    if (!request.InitKeysToSign(state.range(0))) return state.SkipWithError("InitKeysToSign");
+    for (uint32_t i = 0; i < request.num_keys; ++i) {
+        GenerateRkpKeyRequest key_request(km.message_version());
+        GenerateRkpKeyResponse key_response(km.message_version());
+        km.keymaster()->GenerateRkpKey(key_request, &key_response);
+        if (key_response.error != KM_ERROR_OK) return state.SkipWithError("GenerateRkpKey");
+        request.SetKeyToSign(i, key_response.maced_public_key.data,
+                             key_response.maced_public_key.data_length);
+    }
+    static const uint8_t kChallenge[32] = {};
+    request.SetChallenge(kChallenge, sizeof(kChallenge));
+
+    for (auto _ : state) {
+        GenerateCsrV2Response response(km.message_version());
+        km.keymaster()->GenerateCsrV2(request, &response);
+        if (response.error != KM_ERROR_OK) return state.SkipWithError("GenerateCsrV2 failed");
+    }
+}
+BENCHMARK(BM_GenerateCsrV2)->Arg(1)->Arg(8)->Arg(32);
+
+// Generates state.range(0) production-mode RKP keys with one GenerateRkpKeyBatch call.
+void BM_GenerateRkpKeyBatch(benchmark::State& state) {
+    Keymaster& km = GetKeymaster();
+    GenerateRkpKeyBatchRequest request(km.message_version());
+    request.key_count = state.range(0);
+
+    for (auto _ : state) {
+        GenerateRkpKeyBatchResponse response(km.message_version());
+        km.keymaster()->GenerateRkpKeyBatch(request, &response);
+        if (response.error != KM_ERROR_OK) return state.SkipWithError("GenerateRkpKeyBatch");
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_GenerateRkpKeyBatch)->Arg(1)->Arg(8)->Arg(32);
+
+// Repeats a shared HMAC negotiation between this keymaster and a second participant, as keystore
+// does after a restart.  Each iteration builds the request, as the HAL does from its parameters.
+void BM_RenegotiateSharedHmac(benchmark::State& state) {
+    // Not GetKeymaster(), whose shared key this would change.
+    static Keymaster* km = new Keymaster;
+    auto own = km->keymaster()->GetHmacSharingParameters();
+    if (own.error != KM_ERROR_OK) return state.SkipWithError("GetHmacSharingParameters");
+    static const uint8_t kOtherSeed[32] = {1};
+
+    for (auto _ : state) {
+        ComputeSharedHmacRequest request(km->message_version());
+        request.params_array.params_array = new (std::nothrow) HmacSharingParameters[2];
+        if (!request.params_array.params_array) return state.SkipWithError("Allocation failed");
+        request.params_array.num_params = 2;
+        request.params_array.params_array[0].seed = own.params.seed;
+        memcpy(request.params_array.params_array[0].nonce, own.params.nonce,
+               sizeof(own.params.nonce));
+        request.params_array.params_array[1].seed = KeymasterBlob(kOtherSeed);
+        auto response = km->keymaster()->ComputeSharedHmac(request);
+        if (response.error != KM_ERROR_OK) return state.SkipWithError("ComputeSharedHmac");
+    }
+}
+BENCHMARK(BM_RenegotiateSharedHmac);
+
+// Begin/abort on every thread while thread 0 also reports the device locked on each iteration.
+// The lock state is atomic, so begin() throughput should not drop as lock calls are added.
+void BM_BeginWhileDeviceLocking(benchmark::State& state) {
+    static ConcurrentAndroidKeymaster* keymaster = [] {
+        auto context = new PureSoftKeymasterContext(kKmVersion);
+        context->SetSystemVersion(kOsVersion, kOsPatchlevel);
+        context->SetVendorPatchlevel(kOsPatchlevel * 100 + 1);
+        context->SetBootPatchlevel(kOsPatchlevel * 100 + 1);
+        return new ConcurrentAndroidKeymaster(context, kOperationTableSize,
+                                              MessageVersion(kKmVersion));
+    }();
+    static KeymasterKeyBlob* key_blob = [] {
+        GenerateKeyRequest request(keymaster->message_version());
+        request.key_description.Reinitialize(AesParams(KM_MODE_ECB));
+        request.key_description.push_back(TAG_NO_AUTH_REQUIRED);
+        GenerateKeyResponse response(keymaster->message_version());
+        keymaster->GenerateKey(request, &response);
+        return new KeymasterKeyBlob(std::move(response.key_blob));
+    }();
+    if (!key_blob->key_material_size) return state.SkipWithError("GenerateKey failed");
+
+    int32_t message_version = keymaster->message_version();
+    BeginOperationRequest begin_request(message_version);
+    begin_request.purpose = KM_PURPOSE_ENCRYPT;
+    begin_request.SetKeyMaterial(*key_blob);
+    begin_request.additional_params.Reinitialize(
+        AuthorizationSetBuilder().BlockMode(KM_MODE_ECB).Padding(KM_PAD_NONE));
+    DeviceLockedRequest lock_request(message_version);
+
+    for (auto _ : state) {
+        if (state.thread_index() == 0) keymaster->DeviceLocked(lock_request);
+        BeginOperationResponse begin_response(message_version);
+        keymaster->BeginOperation(begin_request, &begin_response);
+        if (begin_response.error != KM_ERROR_OK) return state.SkipWithError("begin failed");
+        AbortOperationRequest abort_request(message_version);
+        abort_request.op_handle = begin_response.op_handle;
+        AbortOperationResponse abort_response(message_version);
+        keymaster->AbortOperation(abort_request, &abort_response);
+    }
+}
+BENCHMARK(BM_BeginWhileDeviceLocking)->Threads(1)->Threads(2)->Threads(4)->UseRealTime();
+
+}  // namespace
+}  // namespace keymaster
+
+BENCHMARK_MAIN();
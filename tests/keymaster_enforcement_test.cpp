@@ -39,6 +39,7 @@ class EnforcementTestKeymasterEnforcement : public SoftKeymasterEnforcement {
             purpose, keyid, auth_set, empty_set, 0 /* op_handle */, true /* is_begin_operation */);
     }
     using KeymasterEnforcement::AuthorizeOperation;
+    using KeymasterEnforcement::ForgetValidatedAuthTokens;
 
     uint64_t get_current_time_ms() const override { return current_time_ * 1000; }
     bool activation_date_valid(uint64_t activation_date) const override {
@@ -631,6 +632,50 @@ TEST_F(KeymasterBaseTest, TestAuthPerOpInvalidTokenSignature) {
                                       op_params, token.challenge, false /* is_begin_operation */));
 }
 
+TEST_F(KeymasterBaseTest, TestAuthPerOpTokenValidatedOncePerOperation) {
+    hw_auth_token_t token;
+    memset(&token, 0, sizeof(token));
+    token.version = HW_AUTH_TOKEN_VERSION;
+    token.challenge = 99;
+    token.user_id = 9;
+    token.authenticator_id = 0;
+    token.authenticator_type = hton(static_cast<uint32_t>(HW_AUTH_PASSWORD));
+    token.timestamp = 0;
+
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_USER_SECURE_ID, token.user_id)
+                                  .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN));
+
+    AuthorizationSet op_params;
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty),
+                                      op_params, token.challenge, false /* is_begin_operation */));
+
+    // The same token for the same operation isn't re-verified.
+    kmen.set_report_token_valid(false);
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty),
+                                      op_params, token.challenge, false /* is_begin_operation */));
+
+    // Any change to the token bytes forces verification.
+    token.timestamp = hton(static_cast<uint64_t>(1));
+    AuthorizationSet changed_params;
+    changed_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty),
+                                      changed_params, token.challenge,
+                                      false /* is_begin_operation */));
+
+    // As does dropping the remembered verifications.
+    kmen.ForgetValidatedAuthTokens();
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty),
+                                      op_params, token.challenge, false /* is_begin_operation */));
+}
+
 TEST_F(KeymasterBaseTest, TestAuthPerOpWrongChallenge) {
     hw_auth_token_t token;
     memset(&token, 0, sizeof(token));
@@ -841,6 +886,88 @@ TEST_F(KeymasterBaseTest, TestTimedAuthSuccess) {
                                0 /* irrelevant */, false /* is_begin_operation */));
 }
 
+TEST_F(KeymasterBaseTest, TestPreAuthorizeBegin) {
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                                  .Authorization(TAG_USAGE_EXPIRE_DATETIME, past_time)
+                                  .Authorization(TAG_USER_SECURE_ID, 9)
+                                  .Authorization(TAG_AUTH_TIMEOUT, 1)
+                                  .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY));
+
+    EXPECT_EQ(KM_ERROR_INCOMPATIBLE_PURPOSE,
+              kmen.PreAuthorizeBegin(KM_PURPOSE_SIGN, AuthProxy(auth_set, empty), empty));
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.PreAuthorizeBegin(KM_PURPOSE_ENCRYPT, AuthProxy(auth_set, empty), empty));
+
+    // A token is only looked for, not checked; AuthorizeOperation() does that.
+    hw_auth_token_t token;
+    memset(&token, 0, sizeof(token));
+    AuthorizationSet op_params;
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.PreAuthorizeBegin(KM_PURPOSE_ENCRYPT, AuthProxy(auth_set, empty), op_params));
+
+    // Usage expiry applies to decryption only.
+    auth_set.push_back(TAG_PURPOSE, KM_PURPOSE_DECRYPT);
+    EXPECT_EQ(KM_ERROR_KEY_EXPIRED,
+              kmen.PreAuthorizeBegin(KM_PURPOSE_DECRYPT, AuthProxy(auth_set, empty), op_params));
+
+    // Nothing is recorded against a key's permitted uses.
+    AuthorizationSet single_use(AuthorizationSetBuilder()
+                                    .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                                    .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                                    .Authorization(TAG_MAX_USES_PER_BOOT, 1));
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.PreAuthorizeBegin(KM_PURPOSE_ENCRYPT, AuthProxy(single_use, empty), empty));
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.PreAuthorizeBegin(KM_PURPOSE_ENCRYPT, AuthProxy(single_use, empty), empty));
+    EXPECT_EQ(KM_ERROR_OK,
+              kmen.AuthorizeOperation(KM_PURPOSE_ENCRYPT, key_id, AuthProxy(single_use, empty)));
+    EXPECT_EQ(KM_ERROR_KEY_MAX_OPS_EXCEEDED,
+              kmen.AuthorizeOperation(KM_PURPOSE_ENCRYPT, key_id, AuthProxy(single_use, empty)));
+}
+
+TEST_F(KeymasterBaseTest, TestTimedAuthTokenValidatedOnce) {
+    hw_auth_token_t token;
+    memset(&token, 0, sizeof(token));
+    token.version = HW_AUTH_TOKEN_VERSION;
+    token.challenge = 99;
+    token.user_id = 9;
+    token.authenticator_id = 0;
+    token.authenticator_type = hton(static_cast<uint32_t>(HW_AUTH_PASSWORD));
+    token.timestamp = hton(kmen.current_time());
+
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                                  .Authorization(TAG_USER_SECURE_ID, token.user_id)
+                                  .Authorization(TAG_AUTH_TIMEOUT, 1)
+                                  .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN));
+
+    AuthorizationSet op_params;
+    op_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+
+    EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeOperation(
+                               KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty), op_params,
+                               0 /* irrelevant */, false /* is_begin_operation */));
+
+    // A later operation presenting the same token doesn't pay for another MAC check.
+    kmen.set_report_token_valid(false);
+    EXPECT_EQ(KM_ERROR_OK, kmen.AuthorizeOperation(
+                               KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty), op_params,
+                               0 /* irrelevant */, false /* is_begin_operation */));
+
+    // Same challenge, user ID and timestamp but a different MAC is verified afresh.
+    token.hmac[0] ^= 1;
+    AuthorizationSet forged_params;
+    forged_params.push_back(Authorization(TAG_AUTH_TOKEN, &token, sizeof(token)));
+    EXPECT_EQ(KM_ERROR_KEY_USER_NOT_AUTHENTICATED,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(auth_set, empty),
+                                      forged_params, 0 /* irrelevant */,
+                                      false /* is_begin_operation */));
+}
+
 TEST_F(KeymasterBaseTest, TestTimedAuthTimedOut) {
     hw_auth_token_t token;
     memset(&token, 0, sizeof(token));
@@ -926,6 +1053,109 @@ TEST_F(KeymasterBaseTest, TestTimedAuthMissingToken) {
                                       op_params, token.challenge, true /* is_begin_operation */));
 }
 
+TEST_F(KeymasterBaseTest, TestCompiledPolicyMatchesWalk) {
+    AuthorizationSet auth_sets[] = {
+        AuthorizationSet(AuthorizationSetBuilder().Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)),
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_RSA)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_NO_AUTH_REQUIRED)
+                             .Authorization(TAG_ACTIVE_DATETIME, future_time)),
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_DECRYPT)
+                             .Authorization(TAG_ORIGINATION_EXPIRE_DATETIME, past_time)
+                             .Authorization(TAG_USAGE_EXPIRE_DATETIME, future_time)),
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                             .Authorization(TAG_MIN_SECONDS_BETWEEN_OPS, 10)
+                             .Authorization(TAG_MAX_USES_PER_BOOT, 2)),
+        AuthorizationSet(AuthorizationSetBuilder()
+                             .Authorization(TAG_ALGORITHM, KM_ALGORITHM_HMAC)
+                             .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                             .Authorization(TAG_USER_SECURE_ID, 9)
+                             .Authorization(TAG_AUTH_TIMEOUT, 1)
+                             .Authorization(TAG_USER_AUTH_TYPE, HW_AUTH_ANY)),
+    };
+    keymaster_purpose_t purposes[] = {KM_PURPOSE_SIGN, KM_PURPOSE_VERIFY, KM_PURPOSE_ENCRYPT,
+                                      KM_PURPOSE_DECRYPT};
+
+    for (auto& auth_set : auth_sets) {
+        KeyPolicy policy;
+        CompileKeyPolicy(AuthProxy(auth_set, empty), &policy);
+        EXPECT_TRUE(policy.compiled);
+
+        for (auto purpose : purposes) {
+            // Rate limits and use counts are recorded per instance, so each path gets its own.
+            EnforcementTestKeymasterEnforcement walked;
+            EnforcementTestKeymasterEnforcement compiled;
+            for (int i = 0; i < 3; ++i) {
+                EXPECT_EQ(walked.AuthorizeOperation(purpose, key_id, AuthProxy(auth_set, empty),
+                                                    empty, 0 /* op_handle */,
+                                                    true /* is_begin_operation */),
+                          compiled.AuthorizeOperation(purpose, key_id, AuthProxy(auth_set, empty),
+                                                      empty, 0 /* op_handle */,
+                                                      true /* is_begin_operation */, &policy));
+            }
+        }
+    }
+}
+
+TEST_F(KeymasterBaseTest, TestMalformedKeysNotCompiled) {
+    KeyPolicy policy;
+
+    AuthorizationSet both_auth(AuthorizationSetBuilder()
+                                   .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                   .Authorization(TAG_USER_SECURE_ID, 9)
+                                   .Authorization(TAG_NO_AUTH_REQUIRED));
+    CompileKeyPolicy(AuthProxy(both_auth, empty), &policy);
+    EXPECT_FALSE(policy.compiled);
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(both_auth, empty), empty,
+                                      0 /* op_handle */, true /* is_begin_operation */, &policy));
+
+    AuthorizationSet repeated(AuthorizationSetBuilder()
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                  .Authorization(TAG_ACTIVE_DATETIME, past_time)
+                                  .Authorization(TAG_ACTIVE_DATETIME, future_time));
+    CompileKeyPolicy(AuthProxy(repeated, empty), &policy);
+    EXPECT_FALSE(policy.compiled);
+    EXPECT_EQ(KM_ERROR_KEY_NOT_YET_VALID,
+              kmen.AuthorizeOperation(KM_PURPOSE_SIGN, key_id, AuthProxy(repeated, empty), empty,
+                                      0 /* op_handle */, true /* is_begin_operation */, &policy));
+}
+
+TEST_F(KeymasterBaseTest, TestCompiledCipherConstraints) {
+    AuthorizationSet auth_set(AuthorizationSetBuilder()
+                                  .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                                  .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                                  .Authorization(TAG_BLOCK_MODE, KM_MODE_GCM)
+                                  .Authorization(TAG_BLOCK_MODE, KM_MODE_CBC)
+                                  .Authorization(TAG_PADDING, KM_PAD_PKCS7)
+                                  .Authorization(TAG_PADDING_OLD, KM_PAD_NONE)
+                                  .Authorization(TAG_MIN_MAC_LENGTH, 96));
+    KeyPolicy policy;
+    CompileKeyPolicy(AuthProxy(auth_set, empty), &policy);
+    ASSERT_TRUE(policy.compiled);
+    EXPECT_TRUE(policy.has_block_mode(KM_MODE_GCM));
+    EXPECT_TRUE(policy.has_block_mode(KM_MODE_CBC));
+    EXPECT_FALSE(policy.has_block_mode(KM_MODE_ECB));
+    EXPECT_FALSE(policy.has_block_mode(KM_MODE_CTR));
+    EXPECT_TRUE(policy.has_padding(KM_PAD_PKCS7));
+    EXPECT_TRUE(policy.has_padding(KM_PAD_NONE));
+    EXPECT_FALSE(policy.has_padding(KM_PAD_RSA_OAEP));
+    EXPECT_TRUE(policy.has(KeyPolicy::MIN_MAC_LENGTH));
+    EXPECT_EQ(96U, policy.min_mac_length);
+    EXPECT_FALSE(policy.has(KeyPolicy::CALLER_NONCE));
+
+    // A repeated minimum MAC length is left to the authorization set walk.
+    auth_set.push_back(TAG_MIN_MAC_LENGTH, 128);
+    CompileKeyPolicy(AuthProxy(auth_set, empty), &policy);
+    EXPECT_FALSE(policy.compiled);
+}
+
 TEST_F(KeymasterBaseTest, TestCreateKeyId) {
     keymaster_key_blob_t blob = {reinterpret_cast<const uint8_t*>("foobar"), 6};
 
@@ -934,5 +1164,120 @@ TEST_F(KeymasterBaseTest, TestCreateKeyId) {
     EXPECT_NE(0U, key_id);
 }
 
+TEST_F(KeymasterBaseTest, TestTimestampToken) {
+    // A timestamp token MACs the same data as a verification token with no parameters.
+    VerifyAuthorizationRequest request(kDefaultMessageVersion);
+    request.challenge = 0x1234;
+    VerifyAuthorizationResponse expected = kmen.VerifyAuthorization(request);
+    ASSERT_EQ(KM_ERROR_OK, expected.error);
+
+    for (int i = 0; i < 2; ++i) {
+        uint64_t timestamp = 0;
+        uint8_t mac[kTimestampTokenMacSize];
+        ASSERT_EQ(KM_ERROR_OK, kmen.GenerateTimestampToken(0x1234, &timestamp, mac));
+        EXPECT_EQ(expected.token.timestamp, timestamp);
+        ASSERT_EQ(kTimestampTokenMacSize, expected.token.mac.data_length);
+        EXPECT_EQ(0, memcmp(expected.token.mac.data, mac, sizeof(mac)));
+    }
+
+    TimestampToken token;
+    token.challenge = 0x1234;
+    ASSERT_EQ(KM_ERROR_OK, kmen.GenerateTimestampToken(&token));
+    EXPECT_EQ(KM_SECURITY_LEVEL_SOFTWARE, token.security_level);
+    ASSERT_EQ(kTimestampTokenMacSize, token.mac.data_length);
+    EXPECT_EQ(0, memcmp(expected.token.mac.data, token.mac.data, kTimestampTokenMacSize));
+}
+
+TEST_F(KeymasterBaseTest, TestRepeatedSharedHmacNegotiation) {
+    HmacSharingParametersArray params_array;
+    params_array.params_array = new HmacSharingParameters[2];
+    params_array.num_params = 2;
+    ASSERT_EQ(KM_ERROR_OK, kmen.GetHmacSharingParameters(&params_array.params_array[0]));
+    memset(params_array.params_array[1].nonce, 0xAA, sizeof(params_array.params_array[1].nonce));
+
+    KeymasterBlob first_check;
+    ASSERT_EQ(KM_ERROR_OK, kmen.ComputeSharedHmac(params_array, &first_check));
+    VerifyAuthorizationRequest request(kDefaultMessageVersion);
+    VerifyAuthorizationResponse first_token = kmen.VerifyAuthorization(request);
+    ASSERT_EQ(KM_ERROR_OK, first_token.error);
+
+    // The same parameters yield the same key and sharing check.
+    KeymasterBlob second_check;
+    ASSERT_EQ(KM_ERROR_OK, kmen.ComputeSharedHmac(params_array, &second_check));
+    ASSERT_EQ(first_check.data_length, second_check.data_length);
+    EXPECT_EQ(0, memcmp(first_check.data, second_check.data, first_check.data_length));
+    VerifyAuthorizationResponse second_token = kmen.VerifyAuthorization(request);
+    ASSERT_EQ(KM_ERROR_OK, second_token.error);
+    EXPECT_EQ(0, memcmp(first_token.token.mac.data, second_token.token.mac.data,
+                        first_token.token.mac.data_length));
+
+    // Different parameters don't hit the cache.
+    params_array.params_array[1].nonce[0] ^= 1;
+    KeymasterBlob third_check;
+    ASSERT_EQ(KM_ERROR_OK, kmen.ComputeSharedHmac(params_array, &third_check));
+    ASSERT_EQ(first_check.data_length, third_check.data_length);
+    EXPECT_NE(0, memcmp(first_check.data, third_check.data, first_check.data_length));
+}
+
+TEST_F(KeymasterBaseTest, TestSharedHmacAgreement) {
+    EnforcementTestKeymasterEnforcement other;
+    HmacSharingParametersArray params_array;
+    params_array.params_array = new HmacSharingParameters[2];
+    params_array.num_params = 2;
+    ASSERT_EQ(KM_ERROR_OK, kmen.GetHmacSharingParameters(&params_array.params_array[0]));
+    ASSERT_EQ(KM_ERROR_OK, other.GetHmacSharingParameters(&params_array.params_array[1]));
+
+    KeymasterBlob check, other_check;
+    ASSERT_EQ(KM_ERROR_OK, kmen.ComputeSharedHmac(params_array, &check));
+    ASSERT_EQ(KM_ERROR_OK, other.ComputeSharedHmac(params_array, &other_check));
+    ASSERT_EQ(check.data_length, other_check.data_length);
+    EXPECT_EQ(0, memcmp(check.data, other_check.data, check.data_length));
+
+    // Both sides produce the same tokens from the same key, however often it's restarted.
+    VerifyAuthorizationRequest request(kDefaultMessageVersion);
+    request.challenge = 99;
+    for (int i = 0; i < 2; ++i) {
+        VerifyAuthorizationResponse token = kmen.VerifyAuthorization(request);
+        VerifyAuthorizationResponse other_token = other.VerifyAuthorization(request);
+        ASSERT_EQ(KM_ERROR_OK, token.error);
+        ASSERT_EQ(KM_ERROR_OK, other_token.error);
+        ASSERT_EQ(kTimestampTokenMacSize, token.token.mac.data_length);
+        EXPECT_EQ(0, memcmp(token.token.mac.data, other_token.token.mac.data,
+                            kTimestampTokenMacSize));
+    }
+}
+
+TEST_F(KeymasterBaseTest, TestRestoreSharedHmacState) {
+    HmacSharingParametersArray params_array;
+    params_array.params_array = new HmacSharingParameters[1];
+    params_array.num_params = 1;
+    ASSERT_EQ(KM_ERROR_OK, kmen.GetHmacSharingParameters(&params_array.params_array[0]));
+    KeymasterBlob check;
+    ASSERT_EQ(KM_ERROR_OK, kmen.ComputeSharedHmac(params_array, &check));
+
+    std::vector<uint8_t> state;
+    ASSERT_EQ(KM_ERROR_OK, kmen.SerializeSharedHmacState(&state));
+    EnforcementTestKeymasterEnforcement restored;
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, restored.RestoreSharedHmacState(state.data(), 8));
+    ASSERT_EQ(KM_ERROR_OK, restored.RestoreSharedHmacState(state.data(), state.size()));
+
+    // The restored instance has the same parameters and key.
+    HmacSharingParameters params;
+    ASSERT_EQ(KM_ERROR_OK, restored.GetHmacSharingParameters(&params));
+    EXPECT_EQ(0, memcmp(params_array.params_array[0].nonce, params.nonce, sizeof(params.nonce)));
+    VerifyAuthorizationRequest request(kDefaultMessageVersion);
+    VerifyAuthorizationResponse token = kmen.VerifyAuthorization(request);
+    VerifyAuthorizationResponse restored_token = restored.VerifyAuthorization(request);
+    ASSERT_EQ(KM_ERROR_OK, token.error);
+    ASSERT_EQ(KM_ERROR_OK, restored_token.error);
+    EXPECT_EQ(0, memcmp(token.token.mac.data, restored_token.token.mac.data,
+                        token.token.mac.data_length));
+
+    KeymasterBlob restored_check;
+    ASSERT_EQ(KM_ERROR_OK, restored.ComputeSharedHmac(params_array, &restored_check));
+    ASSERT_EQ(check.data_length, restored_check.data_length);
+    EXPECT_EQ(0, memcmp(check.data, restored_check.data, check.data_length));
+}
+
 }; /* namespace test */
 }; /* namespace keymaster */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <aidl/android/hardware/security/keymint/IKeyMintOperation.h>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+
+#include "AndroidKeyMintDevice.h"
+#include "KeyMintUtils.h"
+
+// Drives AndroidKeyMintDevice in-process, as keystore would through a local binder, and the
+// AndroidKeymaster behind it directly with the same requests.  Each benchmark's time is the
+// KeyMint call's; its direct_ns and overhead_ns counters split that into the core's work and what
+// the AIDL layer adds in parameter and blob conversions, operation objects and status mapping.
+
+namespace keymaster {
+namespace {
+
+using ::aidl::android::hardware::security::keymint::AndroidKeyMintDevice;
+using ::aidl::android::hardware::security::keymint::BeginResult;
+using ::aidl::android::hardware::security::keymint::KeyCharacteristics;
+using ::aidl::android::hardware::security::keymint::KeyCreationResult;
+using ::aidl::android::hardware::security::keymint::KeyParameter;
+using ::aidl::android::hardware::security::keymint::KeyPurpose;
+using ::aidl::android::hardware::security::keymint::SecurityLevel;
+using ::aidl::android::hardware::security::keymint::km_utils::kmParamSet2Aidl;
+using Clock = std::chrono::steady_clock;
+
+class KeyMint {
+  public:
+    KeyMint()
+        : device_(ndk::SharedRefBase::make<AndroidKeyMintDevice>(SecurityLevel::SOFTWARE)),
+          keymaster_(device_->getKeymasterImpl().get()) {}
+
+    int32_t message_version() const { return keymaster_->message_version(); }
+
+    bool GenerateKey(const AuthorizationSet& params, std::vector<uint8_t>* key_blob) {
+        KeyCreationResult result;
+        if (!device_->generateKey(kmParamSet2Aidl(params), std::nullopt, &result).isOk()) {
+            return false;
+        }
+        *key_blob = std::move(result.keyBlob);
+        return true;
+    }
+
+    bool DirectGenerateKey(const AuthorizationSet& params) {
+        GenerateKeyRequest request(message_version());
+        request.key_description.Reinitialize(params);
+        GenerateKeyResponse response(message_version());
+        keymaster_->GenerateKey(request, &response);
+        return response.error == KM_ERROR_OK;
+    }
+
+    bool GetKeyCharacteristics(const std::vector<uint8_t>& key_blob) {
+        std::vector<KeyCharacteristics> characteristics;
+        return device_->getKeyCharacteristics(key_blob, {}, {}, &characteristics).isOk();
+    }
+
+    bool DirectGetKeyCharacteristics(const std::vector<uint8_t>& key_blob) {
+        GetKeyCharacteristicsRequest request(message_version());
+        request.SetKeyMaterial(key_blob.data(), key_blob.size());
+        GetKeyCharacteristicsResponse response(message_version());
+        keymaster_->GetKeyCharacteristics(request, &response);
+        return response.error == KM_ERROR_OK;
+    }
+
+    // Runs one complete operation, feeding |input| to a single update() and nothing to finish().
+    bool RunOperation(KeyPurpose purpose, const std::vector<uint8_t>& key_blob,
+                      const std::vector<KeyParameter>& params, const std::vector<uint8_t>& input) {
+        BeginResult begin;
+        if (!device_->begin(purpose, key_blob, params, std::nullopt, &begin).isOk()) return false;
+        std::vector<uint8_t> output;
+        if (!begin.operation->update(input, std::nullopt, std::nullopt, &output).isOk()) {
+            return false;
+        }
+        return begin.operation
+            ->finish(std::nullopt, std::nullopt, std::nullopt, std::nullopt, std::nullopt, &output)
+            .isOk();
+    }
+
+    bool DirectRunOperation(keymaster_purpose_t purpose, const std::vector<uint8_t>& key_blob,
+                            const AuthorizationSet& params, const std::vector<uint8_t>& input) {
+        BeginOperationRequest begin_request(message_version());
+        begin_request.purpose = purpose;
+        begin_request.SetKeyMaterial(key_blob.data(), key_blob.size());
+        begin_request.additional_params.Reinitialize(params);
+        BeginOperationResponse begin_response(message_version());
+        keymaster_->BeginOperation(begin_request, &begin_response);
+        if (begin_response.error != KM_ERROR_OK) return false;
+
+        UpdateOperationRequest update_request(message_version());
+        update_request.op_handle = begin_response.op_handle;
+        update_request.input.Reinitialize(input.data(), input.size());
+        UpdateOperationResponse update_response(message_version());
+        keymaster_->UpdateOperation(update_request, &update_response);
+        if (update_response.error != KM_ERROR_OK) return false;
+
+        FinishOperationRequest finish_request(message_version());
+        finish_request.op_handle = begin_response.op_handle;
+        FinishOperationResponse finish_response(message_version());
+        keymaster_->FinishOperation(finish_request, &finish_response);
+        return finish_response.error == KM_ERROR_OK;
+    }
+
+  private:
+    std::shared_ptr<AndroidKeyMintDevice> device_;
+    AndroidKeymaster* keymaster_;  // Owned by device_.
+};
+
+KeyMint& GetKeyMint() {
+    static KeyMint* keymint = new KeyMint;
+    return *keymint;
+}
+
+// Times |keymint| and |direct|, which must do the same work through the two paths, once per
+// iteration each.  The benchmark's manual time is the KeyMint call's.
+template <typename KeyMintCall, typename DirectCall>
+void Compare(benchmark::State& state, KeyMintCall keymint, DirectCall direct) {
+    double keymint_ns = 0;
+    double direct_ns = 0;
+    for (auto _ : state) {
+        auto start = Clock::now();
+        if (!keymint()) return state.SkipWithError("KeyMint call failed");
+        auto middle = Clock::now();
+        if (!direct()) return state.SkipWithError("direct call failed");
+        auto end = Clock::now();
+
+        std::chrono::duration<double, std::nano> keymint_time = middle - start;
+        keymint_ns += keymint_time.count();
+        direct_ns += std::chrono::duration<double, std::nano>(end - middle).count();
+        state.SetIterationTime(keymint_time.count() / 1e9);
+    }
+    state.counters["direct_ns"] = benchmark::Counter(direct_ns, benchmark::Counter::kAvgIterations);
+    state.counters["overhead_ns"] =
+        benchmark::Counter(keymint_ns - direct_ns, benchmark::Counter::kAvgIterations);
+    if (direct_ns > 0) state.counters["overhead_pct"] = 100 * (keymint_ns - direct_ns) / direct_ns;
+}
+
+AuthorizationSet AesGcmKeyParams() {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .AesEncryptionKey(256)
+                                .BlockMode(KM_MODE_GCM)
+                                .Padding(KM_PAD_NONE)
+                                .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                .Authorization(TAG_NO_AUTH_REQUIRED));
+}
+
+AuthorizationSet HmacKeyParams() {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .HmacKey(256)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Authorization(TAG_MIN_MAC_LENGTH, 256)
+                                .Authorization(TAG_NO_AUTH_REQUIRED));
+}
+
+AuthorizationSet EcdsaKeyParams() {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .EcdsaSigningKey(256)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Authorization(TAG_NO_AUTH_REQUIRED)
+                                .Authorization(TAG_CERTIFICATE_NOT_BEFORE, 0)
+                                .Authorization(TAG_CERTIFICATE_NOT_AFTER,
+                                               kUndefinedExpirationDateTime));
+}
+
+void GenerateKey(benchmark::State& state, const AuthorizationSet& params) {
+    KeyMint& km = GetKeyMint();
+    std::vector<uint8_t> key_blob;
+    Compare(
+        state, [&] { return km.GenerateKey(params, &key_blob); },
+        [&] { return km.DirectGenerateKey(params); });
+}
+
+void BM_GenerateAesKey(benchmark::State& state) {
+    GenerateKey(state, AesGcmKeyParams());
+}
+BENCHMARK(BM_GenerateAesKey)->UseManualTime();
+
+void BM_GenerateEcKey(benchmark::State& state) {
+    GenerateKey(state, EcdsaKeyParams());
+}
+BENCHMARK(BM_GenerateEcKey)->UseManualTime();
+
+void BM_GetKeyCharacteristics(benchmark::State& state) {
+    KeyMint& km = GetKeyMint();
+    std::vector<uint8_t> key_blob;
+    if (!km.GenerateKey(AesGcmKeyParams(), &key_blob)) {
+        return state.SkipWithError("GenerateKey failed");
+    }
+    Compare(
+        state, [&] { return km.GetKeyCharacteristics(key_blob); },
+        [&] { return km.DirectGetKeyCharacteristics(key_blob); });
+}
+BENCHMARK(BM_GetKeyCharacteristics)->UseManualTime();
+
+// Times a complete begin/update/finish over state.range(0) bytes of input.
+void RunOperations(benchmark::State& state, const AuthorizationSet& key_params,
+                   keymaster_purpose_t purpose, const AuthorizationSet& begin_params) {
+    KeyMint& km = GetKeyMint();
+    std::vector<uint8_t> key_blob;
+    if (!km.GenerateKey(key_params, &key_blob)) return state.SkipWithError("GenerateKey failed");
+    std::vector<KeyParameter> aidl_params = kmParamSet2Aidl(begin_params);
+    std::vector<uint8_t> input(state.range(0), 'a');
+
+    Compare(
+        state,
+        [&] {
+            return km.RunOperation(static_cast<KeyPurpose>(purpose), key_blob, aidl_params, input);
+        },
+        [&] { return km.DirectRunOperation(purpose, key_blob, begin_params, input); });
+    state.SetBytesProcessed(state.iterations() * input.size());
+}
+
+void BM_AesGcmEncrypt(benchmark::State& state) {
+    RunOperations(state, AesGcmKeyParams(), KM_PURPOSE_ENCRYPT,
+                  AuthorizationSet(AuthorizationSetBuilder()
+                                       .BlockMode(KM_MODE_GCM)
+                                       .Padding(KM_PAD_NONE)
+                                       .Authorization(TAG_MAC_LENGTH, 128)));
+}
+BENCHMARK(BM_AesGcmEncrypt)->Arg(64)->Arg(1024)->Arg(16384)->UseManualTime();
+
+void BM_HmacSign(benchmark::State& state) {
+    RunOperations(state, HmacKeyParams(), KM_PURPOSE_SIGN,
+                  AuthorizationSet(AuthorizationSetBuilder()
+                                       .Digest(KM_DIGEST_SHA_2_256)
+                                       .Authorization(TAG_MAC_LENGTH, 256)));
+}
+BENCHMARK(BM_HmacSign)->Arg(64)->Arg(1024)->UseManualTime();
+
+void BM_EcdsaSign(benchmark::State& state) {
+    RunOperations(state, EcdsaKeyParams(), KM_PURPOSE_SIGN,
+                  AuthorizationSet(AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256)));
+}
+BENCHMARK(BM_EcdsaSign)->Arg(64)->UseManualTime();
+
+}  // namespace
+}  // namespace keymaster
+
+BENCHMARK_MAIN();
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/message_buffer_pool.h>
+
+#include <vector>
+
+#include <keymaster/android_keymaster_messages.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+// Serializes an update carrying |input_size| bytes, and a finish, as one round of an operation.
+void SerializeRound(MessageBufferPool* pool, size_t input_size) {
+    std::vector<uint8_t> input(input_size);
+    UpdateOperationRequest update(kDefaultMessageVersion);
+    update.input.Reinitialize(input.data(), input.size());
+    FinishOperationRequest finish(kDefaultMessageVersion);
+
+    const uint8_t* data;
+    size_t size;
+    ASSERT_EQ(KM_ERROR_OK, pool->Serialize(UPDATE_OPERATION, update, &data, &size));
+    EXPECT_EQ(update.SerializedSize(), size);
+    ASSERT_EQ(KM_ERROR_OK, pool->Serialize(FINISH_OPERATION, finish, &data, &size));
+    EXPECT_EQ(finish.SerializedSize(), size);
+}
+
+TEST(MessageBufferPoolTest, SerializesExactly) {
+    MessageBufferPool pool;
+    UpdateOperationRequest request(kDefaultMessageVersion);
+    request.op_handle = 0x1234;
+    request.input.Reinitialize("hello", 5);
+
+    const uint8_t* data;
+    size_t size;
+    ASSERT_EQ(KM_ERROR_OK, pool.Serialize(UPDATE_OPERATION, request, &data, &size));
+    EXPECT_EQ(request.SerializedSize(), size);
+    EXPECT_EQ(size, pool.high_water_mark(UPDATE_OPERATION));
+
+    UpdateOperationRequest deserialized(kDefaultMessageVersion);
+    ASSERT_TRUE(deserialized.Deserialize(&data, data + size));
+    EXPECT_EQ(0x1234U, deserialized.op_handle);
+    EXPECT_EQ(5U, deserialized.input.available_read());
+}
+
+TEST(MessageBufferPoolTest, SteadyStateReusesBuffers) {
+    MessageBufferPool pool;
+    ASSERT_NO_FATAL_FAILURE(SerializeRound(&pool, 1024));
+    EXPECT_EQ(2U, pool.allocations());
+
+    for (size_t input_size = 1024; input_size > 0; input_size /= 2) {
+        ASSERT_NO_FATAL_FAILURE(SerializeRound(&pool, input_size));
+    }
+    EXPECT_EQ(2U, pool.allocations());
+
+    size_t high_water_mark = pool.high_water_mark(UPDATE_OPERATION);
+    ASSERT_NO_FATAL_FAILURE(SerializeRound(&pool, 2048));
+    EXPECT_EQ(3U, pool.allocations());
+    EXPECT_LT(high_water_mark, pool.high_water_mark(UPDATE_OPERATION));
+}
+
+TEST(MessageBufferPoolTest, AcquireZeroesReusedBuffer) {
+    MessageBufferPool pool;
+    uint8_t* buffer = pool.Acquire(BEGIN_OPERATION, 64);
+    ASSERT_TRUE(buffer);
+    memset(buffer, 0xAA, 64);
+
+    uint8_t* reused = pool.Acquire(BEGIN_OPERATION, 32);
+    ASSERT_EQ(buffer, reused);
+    for (size_t i = 0; i < 64; ++i) EXPECT_EQ(0, reused[i]) << i;
+    EXPECT_EQ(1U, pool.allocations());
+
+    EXPECT_TRUE(pool.Acquire(ABORT_OPERATION, 0));
+}
+
+TEST(MessageBufferPoolTest, FullPoolHandsOverLastSlot) {
+    MessageBufferPool pool;
+    for (uint32_t command = 0; command < MessageBufferPool::kMaxSlots + 2; ++command) {
+        ASSERT_TRUE(pool.Acquire(static_cast<AndroidKeymasterCommand>(command), 16));
+    }
+    EXPECT_EQ(MessageBufferPool::kMaxSlots, pool.allocations());
+    EXPECT_EQ(16U, pool.high_water_mark(static_cast<AndroidKeymasterCommand>(0)));
+    EXPECT_EQ(0U, pool.high_water_mark(
+                      static_cast<AndroidKeymasterCommand>(MessageBufferPool::kMaxSlots - 1)));
+    EXPECT_EQ(16U, pool.high_water_mark(
+                       static_cast<AndroidKeymasterCommand>(MessageBufferPool::kMaxSlots + 1)));
+}
+
+}  // namespace test
+}  // namespace keymaster
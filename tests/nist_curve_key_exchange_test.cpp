@@ -125,6 +125,21 @@ TEST(NistCurveKeyExchange, TestInfinity) {
     }
 }
 
+/**
+ * Test that shared groups are created once per curve and match the groups made on request.
+ */
+TEST(NistCurveKeyExchange, SharedGroups) {
+    for (auto& curve : kEcCurves) {
+        const EC_GROUP* shared = ec_get_shared_group(curve);
+        ASSERT_TRUE(shared != nullptr);
+        EXPECT_EQ(shared, ec_get_shared_group(curve));
+
+        UniquePtr<EC_GROUP, EC_GROUP_Delete> group(ec_get_group(curve));
+        EXPECT_EQ(0, EC_GROUP_cmp(shared, group.get(), nullptr /* ctx */));
+    }
+    EXPECT_EQ(nullptr, ec_get_shared_group(KM_EC_CURVE_CURVE_25519));
+}
+
 /* Test vectors for P-256, downloaded from NIST. */
 struct NistCurveTest {
     const keymaster_ec_curve_t curve;
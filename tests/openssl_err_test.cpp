@@ -0,0 +1,90 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <stdarg.h>
+
+#include <atomic>
+
+#include <gtest/gtest.h>
+
+#include <openssl/cipher.h>
+#include <openssl/err.h>
+
+#include <keymaster/km_openssl/openssl_err.h>
+#include <keymaster/logger.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+// Installs itself as the logger for its lifetime, counting messages and loggability queries.
+class CountingLogger : public Logger {
+  public:
+    explicit CountingLogger(bool loggable) : loggable_(loggable), previous_(instance()) {
+        set_instance(this);
+    }
+    ~CountingLogger() override { set_instance(previous_); }
+
+    int log_msg(LogLevel, const char*, va_list) const override {
+        ++messages_;
+        return 1;
+    }
+    bool is_loggable(LogLevel) const override { return loggable_; }
+
+    int messages() const { return messages_; }
+
+  private:
+    const bool loggable_;
+    Logger* previous_;
+    mutable std::atomic<int> messages_{0};
+};
+
+void PushBadDecrypt() {
+    ERR_put_error(ERR_LIB_CIPHER, 0, CIPHER_R_BAD_DECRYPT, __FILE__, __LINE__);
+}
+
+}  // namespace
+
+TEST(OpenSslErrTest, TranslationClearsQueue) {
+    for (int i = 0; i < 3; ++i) PushBadDecrypt();
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, TranslateLastOpenSslError(false /* log_message */));
+    EXPECT_EQ(0U, ERR_peek_error());
+}
+
+TEST(OpenSslErrTest, SkipsFormattingWhenNotLoggable) {
+    CountingLogger logger(false /* loggable */);
+    for (int i = 0; i < 5; ++i) {
+        PushBadDecrypt();
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, TranslateLastOpenSslError());
+    }
+    EXPECT_EQ(0, logger.messages());
+}
+
+TEST(OpenSslErrTest, RateLimitsLogging) {
+    CountingLogger logger(true /* loggable */);
+    for (int i = 0; i < 200; ++i) {
+        PushBadDecrypt();
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, TranslateLastOpenSslError());
+    }
+    // At most one window's worth, or two if a window ended during the loop.
+    EXPECT_LE(logger.messages(), 20);
+    EXPECT_EQ(0U, ERR_peek_error());
+}
+
+}  // namespace test
+}  // namespace keymaster
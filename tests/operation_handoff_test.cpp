@@ -0,0 +1,291 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+
+using HandleMap =
+    std::vector<std::pair<keymaster_operation_handle_t, keymaster_operation_handle_t>>;
+
+// Stands in for the secure storage a context that can hand operations off keeps its handoff
+// states in.  It outlives the instances, as that storage would outlive a process.
+struct HandoffStore {
+    std::map<uint64_t, KeymasterKeyBlob> states;
+    uint64_t next_id = 0;
+};
+
+// The pure software context can't seal handoff state, having neither a device-bound key nor
+// storage that survives a restart, so the tests give it the store above.  A state is sealed as its
+// index in the store and removed from it when opened.
+class HandoffTestContext : public PureSoftKeymasterContext {
+  public:
+    explicit HandoffTestContext(HandoffStore* store)
+        : PureSoftKeymasterContext(kKmVersion), store_(store) {}
+
+    keymaster_error_t SealHandoffState(const KeymasterKeyBlob& plaintext,
+                                       std::vector<uint8_t>* sealed) const override {
+        uint64_t id = store_->next_id++;
+        store_->states[id] = KeymasterKeyBlob(plaintext);
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&id);
+        sealed->assign(bytes, bytes + sizeof(id));
+        return KM_ERROR_OK;
+    }
+
+    keymaster_error_t OpenHandoffState(const uint8_t* sealed, size_t size,
+                                       KeymasterKeyBlob* plaintext) const override {
+        uint64_t id;
+        if (size != sizeof(id)) return KM_ERROR_INVALID_ARGUMENT;
+        memcpy(&id, sealed, sizeof(id));
+        auto state = store_->states.find(id);
+        if (state == store_->states.end()) return KM_ERROR_INVALID_ARGUMENT;
+        *plaintext = std::move(state->second);
+        store_->states.erase(state);
+        return KM_ERROR_OK;
+    }
+
+  private:
+    HandoffStore* store_;
+};
+
+// A software keymaster with operation handoff enabled.  Two of them stand in for the old and the
+// new process.  Without a store, the context can't seal handoff state.
+struct Instance {
+    explicit Instance(HandoffStore* store)
+        : context(store ? new HandoffTestContext(store) : new PureSoftKeymasterContext(kKmVersion)),
+          keymaster(context, 16 /* operation_table_size */, MessageVersion(kKmVersion)) {
+        context->SetSystemVersion(140000, 202310);
+        context->SetVendorPatchlevel(20231001);
+        context->SetBootPatchlevel(20231001);
+        keymaster.set_operation_handoff(true);
+    }
+
+    int32_t ver() { return keymaster.message_version(); }
+
+    PureSoftKeymasterContext* context;  // Owned by keymaster.
+    AndroidKeymaster keymaster;
+};
+
+class OperationHandoffTest : public ::testing::Test {
+  protected:
+    KeymasterKeyBlob GenerateAesKey(keymaster_block_mode_t block_mode) {
+        AuthorizationSetBuilder description;
+        description.AesEncryptionKey(128)
+            .Authorization(TAG_BLOCK_MODE, block_mode)
+            .Padding(KM_PAD_NONE)
+            .Authorization(TAG_CALLER_NONCE)
+            .Authorization(TAG_NO_AUTH_REQUIRED);
+        GenerateKeyRequest request(old_.ver());
+        request.key_description.Reinitialize(AuthorizationSet(description));
+        GenerateKeyResponse response(old_.ver());
+        old_.keymaster.GenerateKey(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        return std::move(response.key_blob);
+    }
+
+    static AuthorizationSet CipherParams(keymaster_block_mode_t block_mode) {
+        return AuthorizationSet(AuthorizationSetBuilder()
+                                    .Authorization(TAG_BLOCK_MODE, block_mode)
+                                    .Padding(KM_PAD_NONE)
+                                    .Authorization(TAG_NONCE, kNonce, sizeof(kNonce)));
+    }
+
+    static keymaster_operation_handle_t Begin(Instance* instance, const KeymasterKeyBlob& key,
+                                              const AuthorizationSet& params) {
+        BeginOperationRequest request(instance->ver());
+        request.purpose = KM_PURPOSE_ENCRYPT;
+        request.SetKeyMaterial(key);
+        request.additional_params.Reinitialize(params);
+        BeginOperationResponse response(instance->ver());
+        instance->keymaster.BeginOperation(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        return response.op_handle;
+    }
+
+    static std::string Update(Instance* instance, keymaster_operation_handle_t op_handle,
+                              const std::string& input) {
+        UpdateOperationRequest request(instance->ver());
+        request.op_handle = op_handle;
+        request.input.Reinitialize(input.data(), input.size());
+        UpdateOperationResponse response(instance->ver());
+        instance->keymaster.UpdateOperation(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        EXPECT_EQ(input.size(), response.input_consumed);
+        return std::string(reinterpret_cast<const char*>(response.output.peek_read()),
+                           response.output.available_read());
+    }
+
+    static keymaster_error_t Finish(Instance* instance, keymaster_operation_handle_t op_handle,
+                                    const std::string& input, std::string* output) {
+        FinishOperationRequest request(instance->ver());
+        request.op_handle = op_handle;
+        request.input.Reinitialize(input.data(), input.size());
+        FinishOperationResponse response(instance->ver());
+        instance->keymaster.FinishOperation(request, &response);
+        output->assign(reinterpret_cast<const char*>(response.output.peek_read()),
+                       response.output.available_read());
+        return response.error;
+    }
+
+    static constexpr uint8_t kNonce[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+
+    HandoffStore store_;
+    Instance old_{&store_};
+    Instance new_{&store_};
+};
+
+constexpr uint8_t OperationHandoffTest::kNonce[];
+
+TEST_F(OperationHandoffTest, CtrContinuesInNewInstance) {
+    KeymasterKeyBlob key = GenerateAesKey(KM_MODE_CTR);
+    // The split falls inside a block, so the new instance has to resume mid-keystream.
+    const std::string head(37, 'h');
+    const std::string tail(70, 't');
+
+    std::string expected;
+    keymaster_operation_handle_t op_handle = Begin(&old_, key, CipherParams(KM_MODE_CTR));
+    expected = Update(&old_, op_handle, head);
+    std::string last;
+    ASSERT_EQ(KM_ERROR_OK, Finish(&old_, op_handle, tail, &last));
+    expected += last;
+    ASSERT_EQ(head.size() + tail.size(), expected.size());
+
+    op_handle = Begin(&old_, key, CipherParams(KM_MODE_CTR));
+    std::string output = Update(&old_, op_handle, head);
+
+    std::vector<uint8_t> snapshot;
+    size_t handed_off = 0;
+    ASSERT_EQ(KM_ERROR_OK, old_.keymaster.SnapshotOperations(&snapshot, &handed_off));
+    EXPECT_EQ(1U, handed_off);
+
+    HandleMap handles;
+    ASSERT_EQ(KM_ERROR_OK,
+              new_.keymaster.RestoreOperations(snapshot.data(), snapshot.size(), &handles));
+    ASSERT_EQ(1U, handles.size());
+    EXPECT_EQ(op_handle, handles[0].first);
+
+    ASSERT_EQ(KM_ERROR_OK, Finish(&new_, handles[0].second, tail, &last));
+    output += last;
+    EXPECT_EQ(expected, output);
+}
+
+TEST_F(OperationHandoffTest, SnapshotRemovesOperation) {
+    KeymasterKeyBlob key = GenerateAesKey(KM_MODE_CTR);
+    keymaster_operation_handle_t op_handle = Begin(&old_, key, CipherParams(KM_MODE_CTR));
+    Update(&old_, op_handle, std::string(16, 'x'));
+
+    std::vector<uint8_t> snapshot;
+    size_t handed_off = 0;
+    ASSERT_EQ(KM_ERROR_OK, old_.keymaster.SnapshotOperations(&snapshot, &handed_off));
+    EXPECT_EQ(1U, handed_off);
+
+    std::string output;
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, Finish(&old_, op_handle, "", &output));
+}
+
+TEST_F(OperationHandoffTest, TamperedSnapshotRejected) {
+    KeymasterKeyBlob key = GenerateAesKey(KM_MODE_CTR);
+    Begin(&old_, key, CipherParams(KM_MODE_CTR));
+
+    std::vector<uint8_t> snapshot;
+    size_t handed_off = 0;
+    ASSERT_EQ(KM_ERROR_OK, old_.keymaster.SnapshotOperations(&snapshot, &handed_off));
+    ASSERT_FALSE(snapshot.empty());
+    snapshot[snapshot.size() / 2] ^= 1;
+
+    HandleMap handles;
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              new_.keymaster.RestoreOperations(snapshot.data(), snapshot.size(), &handles));
+    EXPECT_TRUE(handles.empty());
+}
+
+TEST_F(OperationHandoffTest, SnapshotRestoredOnce) {
+    KeymasterKeyBlob key = GenerateAesKey(KM_MODE_CTR);
+    Begin(&old_, key, CipherParams(KM_MODE_CTR));
+
+    std::vector<uint8_t> snapshot;
+    size_t handed_off = 0;
+    ASSERT_EQ(KM_ERROR_OK, old_.keymaster.SnapshotOperations(&snapshot, &handed_off));
+    ASSERT_EQ(1U, handed_off);
+
+    HandleMap handles;
+    ASSERT_EQ(KM_ERROR_OK,
+              new_.keymaster.RestoreOperations(snapshot.data(), snapshot.size(), &handles));
+    EXPECT_EQ(1U, handles.size());
+    handles.clear();
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              new_.keymaster.RestoreOperations(snapshot.data(), snapshot.size(), &handles));
+    EXPECT_TRUE(handles.empty());
+
+    // Nor in a process started after that.
+    Instance restarted(&store_);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              restarted.keymaster.RestoreOperations(snapshot.data(), snapshot.size(), &handles));
+    EXPECT_TRUE(handles.empty());
+}
+
+TEST_F(OperationHandoffTest, PureSoftContextKeepsOperations) {
+    Instance soft(nullptr /* store */);
+    KeymasterKeyBlob key = GenerateAesKey(KM_MODE_CTR);
+    keymaster_operation_handle_t op_handle = Begin(&soft, key, CipherParams(KM_MODE_CTR));
+
+    std::vector<uint8_t> snapshot;
+    size_t handed_off = 1;
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED, soft.keymaster.SnapshotOperations(&snapshot, &handed_off));
+    EXPECT_EQ(0U, handed_off);
+
+    std::string output;
+    EXPECT_EQ(KM_ERROR_OK, Finish(&soft, op_handle, std::string(16, 'x'), &output));
+    EXPECT_EQ(16U, output.size());
+}
+
+TEST_F(OperationHandoffTest, CbcStaysBehind) {
+    KeymasterKeyBlob key = GenerateAesKey(KM_MODE_CBC);
+    keymaster_operation_handle_t op_handle = Begin(&old_, key, CipherParams(KM_MODE_CBC));
+
+    std::vector<uint8_t> snapshot;
+    size_t handed_off = 1;
+    ASSERT_EQ(KM_ERROR_OK, old_.keymaster.SnapshotOperations(&snapshot, &handed_off));
+    EXPECT_EQ(0U, handed_off);
+
+    HandleMap handles;
+    ASSERT_EQ(KM_ERROR_OK,
+              new_.keymaster.RestoreOperations(snapshot.data(), snapshot.size(), &handles));
+    EXPECT_TRUE(handles.empty());
+
+    // The operation is still usable where it was begun.
+    std::string output;
+    EXPECT_EQ(KM_ERROR_OK, Finish(&old_, op_handle, std::string(16, 'x'), &output));
+    EXPECT_EQ(16U, output.size());
+}
+
+}  // namespace test
+}  // namespace keymaster
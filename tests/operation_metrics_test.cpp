@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/operation_metrics.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+TEST(LatencyHistogramTest, Buckets) {
+    EXPECT_EQ(0U, LatencyHistogram::BucketFor(0));
+    EXPECT_EQ(0U, LatencyHistogram::BucketFor(1));
+    EXPECT_EQ(1U, LatencyHistogram::BucketFor(2));
+    EXPECT_EQ(1U, LatencyHistogram::BucketFor(3));
+    EXPECT_EQ(10U, LatencyHistogram::BucketFor(1024));
+    EXPECT_EQ(LatencyHistogram::kBucketCount - 1, LatencyHistogram::BucketFor(UINT64_MAX));
+}
+
+TEST(LatencyHistogramTest, Percentiles) {
+    LatencyHistogram histogram;
+    LatencyHistogram::Snapshot snapshot;
+    histogram.Read(&snapshot);
+    EXPECT_EQ(0U, snapshot.count);
+    EXPECT_EQ(0U, snapshot.PercentileNs(50));
+
+    for (int i = 0; i < 98; ++i) histogram.Record(1000, 16);
+    histogram.Record(100000, 16);
+    histogram.Record(100000, 16);
+    histogram.Read(&snapshot);
+    EXPECT_EQ(100U, snapshot.count);
+    EXPECT_EQ(1600U, snapshot.total_bytes);
+    EXPECT_EQ((98 * 1000U + 2 * 100000U) / 100, snapshot.MeanNs());
+    EXPECT_EQ(1023U, snapshot.PercentileNs(50));
+    EXPECT_EQ(1023U, snapshot.PercentileNs(98));
+    EXPECT_EQ(131071U, snapshot.PercentileNs(99));
+
+    histogram.Reset();
+    histogram.Read(&snapshot);
+    EXPECT_EQ(0U, snapshot.count);
+    EXPECT_EQ(0U, snapshot.total_ns);
+}
+
+TEST(HistogramMetricsSinkTest, SeparatesPhasesAlgorithmsAndPurposes) {
+    HistogramMetricsSink sink;
+    sink.Record({OperationPhase::UPDATE, KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT, 4, KM_ERROR_OK, 500,
+                 64});
+    sink.Record({OperationPhase::UPDATE, KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT, 4, KM_ERROR_OK, 700,
+                 64});
+    sink.Record({OperationPhase::FINISH, KM_ALGORITHM_EC, KM_PURPOSE_SIGN, 4, KM_ERROR_OK, 9000,
+                 0});
+    sink.Record({OperationPhase::LOAD_KEY, static_cast<keymaster_algorithm_t>(0),
+                 KM_PURPOSE_SIGN, 4, KM_ERROR_INVALID_KEY_BLOB, 100, 0});
+
+    LatencyHistogram::Snapshot snapshot;
+    ASSERT_TRUE(sink.GetHistogram(OperationPhase::UPDATE, KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT,
+                                  &snapshot));
+    EXPECT_EQ(2U, snapshot.count);
+    EXPECT_EQ(1200U, snapshot.total_ns);
+    EXPECT_EQ(128U, snapshot.total_bytes);
+
+    ASSERT_TRUE(sink.GetHistogram(OperationPhase::UPDATE, KM_ALGORITHM_AES, KM_PURPOSE_DECRYPT,
+                                  &snapshot));
+    EXPECT_EQ(0U, snapshot.count);
+
+    ASSERT_TRUE(
+        sink.GetHistogram(OperationPhase::FINISH, KM_ALGORITHM_EC, KM_PURPOSE_SIGN, &snapshot));
+    EXPECT_EQ(1U, snapshot.count);
+
+    ASSERT_TRUE(sink.GetHistogram(OperationPhase::LOAD_KEY, static_cast<keymaster_algorithm_t>(0),
+                                  KM_PURPOSE_SIGN, &snapshot));
+    EXPECT_EQ(1U, snapshot.count);
+
+    EXPECT_FALSE(sink.GetHistogram(OperationPhase::FINISH, static_cast<keymaster_algorithm_t>(2),
+                                   KM_PURPOSE_SIGN, &snapshot));
+
+    sink.Reset();
+    ASSERT_TRUE(sink.GetHistogram(OperationPhase::UPDATE, KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT,
+                                  &snapshot));
+    EXPECT_EQ(0U, snapshot.count);
+}
+
+TEST(HistogramMetricsSinkTest, CountsBulkTripleDesCalls) {
+    HistogramMetricsSink sink(1024);
+    sink.Record({OperationPhase::UPDATE, KM_ALGORITHM_TRIPLE_DES, KM_PURPOSE_ENCRYPT, 4,
+                 KM_ERROR_OK, 500, 1023});
+    sink.Record({OperationPhase::UPDATE, KM_ALGORITHM_TRIPLE_DES, KM_PURPOSE_ENCRYPT, 4,
+                 KM_ERROR_OK, 500, 1024});
+    sink.Record({OperationPhase::FINISH, KM_ALGORITHM_TRIPLE_DES, KM_PURPOSE_DECRYPT, 4,
+                 KM_ERROR_OK, 500, 4096});
+    // Bulk AES is fine.
+    sink.Record({OperationPhase::UPDATE, KM_ALGORITHM_AES, KM_PURPOSE_ENCRYPT, 4, KM_ERROR_OK,
+                 500, 4096});
+    EXPECT_EQ(2U, sink.triple_des_bulk_calls());
+
+    sink.Reset();
+    EXPECT_EQ(0U, sink.triple_des_bulk_calls());
+}
+
+}  // namespace test
+}  // namespace keymaster
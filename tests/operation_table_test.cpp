@@ -0,0 +1,510 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <thread>
+#include <vector>
+
+#include <keymaster/operation.h>
+#include <keymaster/operation_table.h>
+#include <keymaster/sharded_operation_table.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+class TestOperation : public Operation {
+  public:
+    explicit TestOperation(keymaster_operation_handle_t op_handle, bool fixed_handle = false)
+        : Operation(KM_PURPOSE_SIGN, {}, {}), fixed_handle_(fixed_handle) {
+        operation_handle_ = op_handle;
+    }
+
+    bool set_operation_handle(keymaster_operation_handle_t op_handle) override {
+        if (fixed_handle_) return false;
+        return Operation::set_operation_handle(op_handle);
+    }
+
+    keymaster_error_t Begin(const AuthorizationSet&, AuthorizationSet*) override {
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t Update(const AuthorizationSet&, const Buffer&, AuthorizationSet*, Buffer*,
+                             size_t*) override {
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t Finish(const AuthorizationSet&, const Buffer&, const Buffer&,
+                             AuthorizationSet*, Buffer*) override {
+        return KM_ERROR_OK;
+    }
+    keymaster_error_t Abort() override {
+        ++abort_count;
+        return KM_ERROR_OK;
+    }
+    size_t MemoryFootprint() const override { return footprint; }
+
+    static int abort_count;
+    size_t footprint = 0;
+
+  private:
+    bool fixed_handle_;
+};
+
+int TestOperation::abort_count = 0;
+
+keymaster_operation_handle_t AddOperation(OperationTable* table,
+                                          keymaster_operation_handle_t op_handle,
+                                          bool fixed_handle = false) {
+    OperationPtr op(new TestOperation(op_handle, fixed_handle));
+    Operation* added = op.get();
+    if (table->Add(std::move(op), 0 /* now_ms */) != KM_ERROR_OK) return 0;
+    return added->operation_handle();
+}
+
+TEST(OperationTableTest, AddFindDelete) {
+    OperationTable table(4);
+    keymaster_operation_handle_t handle = AddOperation(&table, 0xAAAABBBBCCCCDDDD);
+    ASSERT_NE(0U, handle);
+    // The random high half of the handle is preserved.
+    EXPECT_EQ(0xAAAABBBB00000000ULL, handle & 0xFFFFFFFF00000000ULL);
+
+    Operation* op = table.Find(handle);
+    ASSERT_TRUE(op != nullptr);
+    EXPECT_EQ(handle, op->operation_handle());
+
+    EXPECT_TRUE(table.Delete(handle));
+    EXPECT_TRUE(table.Find(handle) == nullptr);
+    EXPECT_FALSE(table.Delete(handle));
+}
+
+TEST(OperationTableTest, TooManyOperations) {
+    OperationTable table(2);
+    EXPECT_NE(0U, AddOperation(&table, 1));
+    EXPECT_NE(0U, AddOperation(&table, 2));
+
+    OperationPtr op(new TestOperation(3));
+    EXPECT_EQ(KM_ERROR_TOO_MANY_OPERATIONS, table.Add(std::move(op), 0 /* now_ms */));
+}
+
+TEST(OperationTableTest, AssignsHandleHighHalf) {
+    OperationTable table(4);
+    keymaster_operation_handle_t first = AddOperation(&table, 0);
+    keymaster_operation_handle_t second = AddOperation(&table, 0);
+    EXPECT_NE(0U, first >> 32);
+    EXPECT_NE(0U, second >> 32);
+    EXPECT_NE(first >> 32, second >> 32);
+    EXPECT_TRUE(table.Find(first) != nullptr);
+    EXPECT_TRUE(table.Find(second) != nullptr);
+}
+
+TEST(OperationTableTest, StaleHandleRejected) {
+    OperationTable table(1);
+    keymaster_operation_handle_t first = AddOperation(&table, 0x1234);
+    ASSERT_NE(0U, first);
+    EXPECT_TRUE(table.Delete(first));
+
+    // Same random bits, same slot; only the generation differs.
+    keymaster_operation_handle_t second = AddOperation(&table, 0x1234);
+    ASSERT_NE(0U, second);
+    EXPECT_NE(first, second);
+    EXPECT_TRUE(table.Find(first) == nullptr);
+    EXPECT_FALSE(table.Delete(first));
+    EXPECT_TRUE(table.Find(second) != nullptr);
+}
+
+TEST(OperationTableTest, FixedHandleOperations) {
+    OperationTable table(4);
+    keymaster_operation_handle_t tagged = AddOperation(&table, 0x1000);
+    keymaster_operation_handle_t fixed = AddOperation(&table, 0x5555000000000001ULL, true);
+    EXPECT_EQ(0x5555000000000001ULL, fixed);
+
+    EXPECT_TRUE(table.Find(tagged) != nullptr);
+    Operation* op = table.Find(fixed);
+    ASSERT_TRUE(op != nullptr);
+    EXPECT_EQ(fixed, op->operation_handle());
+
+    EXPECT_TRUE(table.Delete(fixed));
+    EXPECT_TRUE(table.Find(fixed) == nullptr);
+    EXPECT_TRUE(table.Find(tagged) != nullptr);
+}
+
+TEST(OperationTableTest, ZeroHandleNotFound) {
+    OperationTable table(4);
+    EXPECT_TRUE(table.Find(0) == nullptr);
+    EXPECT_FALSE(table.Delete(0));
+}
+
+keymaster_operation_handle_t AddOperationAt(OperationTable* table,
+                                            keymaster_operation_handle_t op_handle,
+                                            uint64_t now_ms) {
+    OperationPtr op(new TestOperation(op_handle));
+    Operation* added = op.get();
+    if (table->Add(std::move(op), now_ms) != KM_ERROR_OK) return 0;
+    return added->operation_handle();
+}
+
+TEST(OperationTableTest, EvictLeastRecentlyUsed) {
+    OperationTable table(2);
+    table.set_evict_lru(true);
+    TestOperation::abort_count = 0;
+
+    keymaster_operation_handle_t first = AddOperationAt(&table, 1, 100);
+    keymaster_operation_handle_t second = AddOperationAt(&table, 2, 200);
+    ASSERT_NE(0U, first);
+    ASSERT_NE(0U, second);
+
+    // Touching the first operation makes the second the eviction candidate.
+    EXPECT_TRUE(table.Touch(first, 300));
+
+    keymaster_operation_handle_t third = AddOperationAt(&table, 3, 1000);
+    ASSERT_NE(0U, third);
+    EXPECT_EQ(1, TestOperation::abort_count);
+    EXPECT_TRUE(table.Find(first) != nullptr);
+    EXPECT_TRUE(table.Find(second) == nullptr);
+    EXPECT_TRUE(table.Find(third) != nullptr);
+
+    EXPECT_EQ(1U, table.eviction_stats().evicted_count);
+    EXPECT_EQ(800U, table.eviction_stats().total_evicted_age_ms);
+    EXPECT_EQ(800U, table.eviction_stats().max_evicted_age_ms);
+
+    keymaster_operation_handle_t fourth = AddOperationAt(&table, 4, 1500);
+    ASSERT_NE(0U, fourth);
+    EXPECT_EQ(2, TestOperation::abort_count);
+    EXPECT_TRUE(table.Find(first) == nullptr);
+    EXPECT_EQ(2U, table.eviction_stats().evicted_count);
+    EXPECT_EQ(2000U, table.eviction_stats().total_evicted_age_ms);
+    EXPECT_EQ(1200U, table.eviction_stats().max_evicted_age_ms);
+}
+
+TEST(OperationTableTest, NoEvictionByDefault) {
+    OperationTable table(1);
+    TestOperation::abort_count = 0;
+    keymaster_operation_handle_t first = AddOperationAt(&table, 1, 100);
+    ASSERT_NE(0U, first);
+    EXPECT_EQ(0U, AddOperationAt(&table, 2, 200));
+    EXPECT_EQ(0, TestOperation::abort_count);
+    EXPECT_TRUE(table.Find(first) != nullptr);
+    EXPECT_EQ(0U, table.eviction_stats().evicted_count);
+}
+
+TEST(OperationTableTest, ReapIdle) {
+    OperationTable table(4);
+    TestOperation::abort_count = 0;
+    keymaster_operation_handle_t first = AddOperationAt(&table, 1, 100);
+    keymaster_operation_handle_t second = AddOperationAt(&table, 2, 200);
+    keymaster_operation_handle_t third = AddOperationAt(&table, 3, 300);
+    ASSERT_NE(0U, first);
+    ASSERT_NE(0U, second);
+    ASSERT_NE(0U, third);
+    EXPECT_TRUE(table.Touch(first, 900));
+
+    EXPECT_EQ(0U, table.ReapIdle(1000, 800));
+    EXPECT_EQ(2U, table.ReapIdle(1000, 500));
+    EXPECT_EQ(2, TestOperation::abort_count);
+    EXPECT_TRUE(table.Find(first) != nullptr);
+    EXPECT_TRUE(table.Find(second) == nullptr);
+    EXPECT_TRUE(table.Find(third) == nullptr);
+    EXPECT_EQ(2U, table.reaped_count());
+
+    // The freed slots can be reused.
+    EXPECT_NE(0U, AddOperationAt(&table, 4, 1000));
+    EXPECT_NE(0U, AddOperationAt(&table, 5, 1000));
+    EXPECT_NE(0U, AddOperationAt(&table, 6, 1000));
+}
+
+TEST(ShardedOperationTableTest, ReapIdleSkipsCheckedOut) {
+    ShardedOperationTable table(4, 2);
+    TestOperation::abort_count = 0;
+    keymaster_operation_handle_t busy = AddOperationAt(&table, 0x100001234ULL, 100);
+    keymaster_operation_handle_t idle = AddOperationAt(&table, 0x200001234ULL, 100);
+    ASSERT_NE(0U, busy);
+    ASSERT_NE(0U, idle);
+
+    OperationTable::Lease lease;
+    ASSERT_TRUE(table.Checkout(busy, &lease) != nullptr);
+    EXPECT_EQ(1U, table.ReapIdle(1000, 500));
+    EXPECT_EQ(1, TestOperation::abort_count);
+    EXPECT_TRUE(table.Find(idle) == nullptr);
+    table.Checkin(&lease);
+
+    EXPECT_TRUE(table.Find(busy) != nullptr);
+    EXPECT_EQ(1U, table.ReapIdle(1000, 500));
+    EXPECT_TRUE(table.Find(busy) == nullptr);
+    EXPECT_EQ(2U, table.reaped_count());
+}
+
+keymaster_operation_handle_t AddOwnedOperation(OperationTable* table, uint32_t owner,
+                                               uint64_t now_ms) {
+    OperationPtr op(new TestOperation(0));
+    op->set_owner(owner);
+    Operation* added = op.get();
+    if (table->Add(std::move(op), now_ms) != KM_ERROR_OK) return 0;
+    return added->operation_handle();
+}
+
+TEST(OperationTableTest, HardQuota) {
+    OperationTable table(4);
+    table.set_quotas(0, 2);
+    ASSERT_NE(0U, AddOwnedOperation(&table, 1000, 100));
+    ASSERT_NE(0U, AddOwnedOperation(&table, 1000, 100));
+    EXPECT_EQ(0U, AddOwnedOperation(&table, 1000, 100));
+    EXPECT_EQ(1U, table.eviction_stats().quota_rejected_count);
+    EXPECT_NE(0U, AddOwnedOperation(&table, 2000, 100));
+    EXPECT_EQ(2U, table.owner_count(1000));
+    EXPECT_EQ(1U, table.owner_count(2000));
+}
+
+TEST(OperationTableTest, SoftQuotaEvictsHeaviestOwner) {
+    OperationTable table(4);
+    table.set_quotas(1, 0);
+    TestOperation::abort_count = 0;
+    keymaster_operation_handle_t light = AddOwnedOperation(&table, 1000, 100);
+    keymaster_operation_handle_t heavy_old = AddOwnedOperation(&table, 2000, 200);
+    keymaster_operation_handle_t heavy_new = AddOwnedOperation(&table, 2000, 300);
+    keymaster_operation_handle_t other = AddOwnedOperation(&table, 3000, 400);
+    ASSERT_NE(0U, light);
+    ASSERT_NE(0U, heavy_old);
+    ASSERT_NE(0U, heavy_new);
+    ASSERT_NE(0U, other);
+
+    // The table is full, and the light caller's operation is the least recently used, but the
+    // heavy caller is the one over quota.
+    EXPECT_NE(0U, AddOwnedOperation(&table, 1000, 500));
+    EXPECT_EQ(1, TestOperation::abort_count);
+    EXPECT_TRUE(table.Find(light) != nullptr);
+    EXPECT_TRUE(table.Find(heavy_old) == nullptr);
+    EXPECT_TRUE(table.Find(heavy_new) != nullptr);
+    EXPECT_EQ(1U, table.eviction_stats().evicted_count);
+
+    // Now the first caller holds the most, so its oldest operation goes next.
+    EXPECT_EQ(2U, table.owner_count(1000));
+    EXPECT_NE(0U, AddOwnedOperation(&table, 4000, 600));
+    EXPECT_EQ(2, TestOperation::abort_count);
+    EXPECT_TRUE(table.Find(light) == nullptr);
+
+    // Nobody is over quota, and without LRU eviction a full table refuses.
+    EXPECT_EQ(0U, AddOwnedOperation(&table, 5000, 700));
+    EXPECT_EQ(2, TestOperation::abort_count);
+}
+
+TEST(OperationTableTest, MemoryBudget) {
+    OperationTable table(4);
+    table.set_memory_budget(1000);
+    TestOperation* op = new TestOperation(0);
+    op->footprint = 600;
+    ASSERT_EQ(KM_ERROR_OK, table.Add(OperationPtr(op), 0));
+    keymaster_operation_handle_t first = op->operation_handle();
+    keymaster_operation_handle_t second = AddOperation(&table, 0);
+    ASSERT_NE(0U, second);
+    EXPECT_EQ(600U, table.memory_stats().footprint);
+
+    op->footprint = 1200;
+    EXPECT_FALSE(table.UpdateFootprint(first));
+    EXPECT_EQ(1200U, table.memory_stats().footprint);
+    EXPECT_EQ(KM_ERROR_MEMORY_ALLOCATION_FAILED, table.Add(OperationPtr(new TestOperation(0)), 0));
+    EXPECT_EQ(2U, table.memory_stats().over_budget_count);
+
+    EXPECT_TRUE(table.Delete(first));
+    EXPECT_EQ(0U, table.memory_stats().footprint);
+    EXPECT_EQ(1200U, table.memory_stats().peak_footprint);
+    EXPECT_NE(0U, AddOperation(&table, 0));
+}
+
+keymaster_operation_handle_t AddOperationAt(OperationTable* table, uint64_t now_ms) {
+    OperationPtr op(new TestOperation(0));
+    Operation* added = op.get();
+    if (table->Add(std::move(op), now_ms) != KM_ERROR_OK) return 0;
+    return added->operation_handle();
+}
+
+TEST(OperationTableTest, AdaptiveSizeGrows) {
+    OperationTable table(16);
+    ASSERT_EQ(KM_ERROR_OK, table.set_adaptive_size(2 /* min_size */, 5 /* max_size */,
+                                                   2 /* segment_size */, 1000 /* window_ms */));
+    EXPECT_EQ(2U, table.table_size());
+    EXPECT_EQ(5U, table.max_table_size());
+
+    std::vector<keymaster_operation_handle_t> handles;
+    for (size_t i = 0; i < 5; ++i) {
+        handles.push_back(AddOperationAt(&table, 0));
+        ASSERT_NE(0U, handles.back());
+    }
+    EXPECT_EQ(5U, table.table_size());
+    EXPECT_EQ(2U, table.sizing_stats().grow_count);
+    EXPECT_EQ(5U, table.sizing_stats().high_water);
+    EXPECT_EQ(0U, AddOperationAt(&table, 0));
+
+    // Growing keeps the slots, and so the handles, of operations already in the table.
+    for (auto handle : handles) EXPECT_TRUE(table.Find(handle) != nullptr);
+}
+
+TEST(OperationTableTest, AdaptiveSizeRejectsBadArguments) {
+    OperationTable table(4);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              table.set_adaptive_size(2 /* min_size */, 8 /* max_size */, 0 /* segment_size */,
+                                      1000 /* window_ms */));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              table.set_adaptive_size(2 /* min_size */, 8 /* max_size */, 2 /* segment_size */,
+                                      0 /* window_ms */));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              table.set_adaptive_size(0 /* min_size */, 8 /* max_size */, 2 /* segment_size */,
+                                      1000 /* window_ms */));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              table.set_adaptive_size(4 /* min_size */, 2 /* max_size */, 2 /* segment_size */,
+                                      1000 /* window_ms */));
+    EXPECT_FALSE(table.adaptive_size());
+    EXPECT_EQ(4U, table.table_size());
+}
+
+TEST(OperationTableTest, AdaptiveSizeShrinks) {
+    OperationTable table(16);
+    ASSERT_EQ(KM_ERROR_OK, table.set_adaptive_size(2 /* min_size */, 6 /* max_size */,
+                                                   2 /* segment_size */, 100 /* window_ms */));
+    std::vector<keymaster_operation_handle_t> handles;
+    for (size_t i = 0; i < 6; ++i) handles.push_back(AddOperationAt(&table, 0));
+    EXPECT_EQ(6U, table.table_size());
+    for (size_t i = 2; i < 6; ++i) EXPECT_TRUE(table.Delete(handles[i]));
+
+    // The first window held six operations, so nothing is removed when it ends.
+    keymaster_operation_handle_t handle = AddOperationAt(&table, 100);
+    EXPECT_EQ(6U, table.table_size());
+    EXPECT_TRUE(table.Delete(handle));
+
+    // The second held at most three, which leaves a segment unused.
+    handle = AddOperationAt(&table, 200);
+    ASSERT_NE(0U, handle);
+    EXPECT_EQ(4U, table.table_size());
+    EXPECT_EQ(1U, table.sizing_stats().shrink_count);
+    EXPECT_TRUE(table.Find(handles[0]) != nullptr);
+    EXPECT_TRUE(table.Find(handles[1]) != nullptr);
+    EXPECT_TRUE(table.Find(handle) != nullptr);
+
+    // Three of four slots were in use, so the table now stays this size.
+    EXPECT_NE(0U, AddOperationAt(&table, 300));
+    EXPECT_EQ(4U, table.table_size());
+    EXPECT_EQ(1U, table.sizing_stats().shrink_count);
+}
+
+TEST(ShardedOperationTableTest, AddFindDelete) {
+    ShardedOperationTable table(4, 3);
+    keymaster_operation_handle_t handles[4];
+    for (size_t i = 0; i < 4; ++i) {
+        handles[i] = AddOperation(&table, (static_cast<uint64_t>(i + 1) << 32) | 0x1234);
+        ASSERT_NE(0U, handles[i]);
+    }
+    // The limit applies to the table as a whole, not to each shard.
+    EXPECT_EQ(0U, AddOperation(&table, 0x500001234ULL));
+
+    for (auto handle : handles) EXPECT_TRUE(table.Find(handle) != nullptr);
+    EXPECT_TRUE(table.Delete(handles[1]));
+    EXPECT_TRUE(table.Find(handles[1]) == nullptr);
+    EXPECT_FALSE(table.Delete(handles[1]));
+    EXPECT_NE(0U, AddOperation(&table, 0x600001234ULL));
+}
+
+TEST(ShardedOperationTableTest, DeleteWhileCheckedOut) {
+    ShardedOperationTable table(4, 2);
+    keymaster_operation_handle_t handle = AddOperation(&table, 0x1234);
+    ASSERT_NE(0U, handle);
+
+    OperationTable::Lease lease;
+    Operation* op = table.Checkout(handle, &lease);
+    ASSERT_TRUE(op != nullptr);
+    EXPECT_TRUE(table.Delete(handle));
+    table.Checkin(&lease);
+
+    OperationTable::Lease second;
+    EXPECT_TRUE(table.Checkout(handle, &second) == nullptr);
+    table.Checkin(&second);
+}
+
+TEST(ShardedOperationTableTest, TryCheckoutDoesNotWait) {
+    ShardedOperationTable table(4, 2);
+    keymaster_operation_handle_t handle = AddOperation(&table, 0x1234);
+    ASSERT_NE(0U, handle);
+
+    OperationTable::Lease lease;
+    ASSERT_TRUE(table.Checkout(handle, &lease) != nullptr);
+    OperationTable::Lease second;
+    bool busy = false;
+    EXPECT_TRUE(table.TryCheckout(handle, &second, &busy) == nullptr);
+    EXPECT_TRUE(busy);
+    table.Checkin(&second);
+    table.Checkin(&lease);
+
+    EXPECT_TRUE(table.TryCheckout(handle, &second, &busy) != nullptr);
+    EXPECT_FALSE(busy);
+    EXPECT_TRUE(table.Delete(handle));
+    table.Checkin(&second);
+    EXPECT_TRUE(table.TryCheckout(handle, &second, &busy) == nullptr);
+    EXPECT_FALSE(busy);
+}
+
+TEST(ShardedOperationTableTest, HardQuota) {
+    ShardedOperationTable table(8, 4);
+    table.set_quotas(0, 2);
+    TestOperation::abort_count = 0;
+    keymaster_operation_handle_t first = AddOwnedOperation(&table, 1000, 100);
+    ASSERT_NE(0U, first);
+    ASSERT_NE(0U, AddOwnedOperation(&table, 1000, 100));
+    // The owner's operations are counted across shards.
+    EXPECT_EQ(0U, AddOwnedOperation(&table, 1000, 100));
+    EXPECT_EQ(1U, table.eviction_stats().quota_rejected_count);
+    EXPECT_NE(0U, AddOwnedOperation(&table, 2000, 100));
+    EXPECT_EQ(2U, table.owner_count(1000));
+    EXPECT_EQ(1U, table.owner_count(2000));
+
+    // Deleted and reaped operations free their owners' quota.
+    EXPECT_TRUE(table.Delete(first));
+    EXPECT_EQ(1U, table.owner_count(1000));
+    EXPECT_NE(0U, AddOwnedOperation(&table, 1000, 200));
+    EXPECT_EQ(2U, table.ReapIdle(650, 500));
+    EXPECT_EQ(1U, table.owner_count(1000));
+    EXPECT_EQ(0U, table.owner_count(2000));
+}
+
+TEST(ShardedOperationTableTest, AdaptiveSizeUnsupported) {
+    ShardedOperationTable table(4, 2);
+    EXPECT_EQ(KM_ERROR_UNIMPLEMENTED,
+              table.set_adaptive_size(2 /* min_size */, 8 /* max_size */, 2 /* segment_size */,
+                                      1000 /* window_ms */));
+    EXPECT_FALSE(table.adaptive_size());
+    EXPECT_EQ(4U, table.table_size());
+}
+
+TEST(ShardedOperationTableTest, ConcurrentCheckout) {
+    constexpr size_t kThreads = 4;
+    constexpr size_t kIterations = 1000;
+    ShardedOperationTable table(kThreads, kThreads);
+    keymaster_operation_handle_t shared = AddOperation(&table, 0x1234);
+    ASSERT_NE(0U, shared);
+
+    size_t counter = 0;
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&] {
+            for (size_t i = 0; i < kIterations; ++i) {
+                OperationTable::Lease lease;
+                if (table.Checkout(shared, &lease)) ++counter;  // Serialized by the lease.
+                table.Checkin(&lease);
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ(kThreads * kIterations, counter);
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/parsed_key_cache.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+class ParsedKeyCacheTest : public testing::Test {
+  protected:
+    ParsedKeyCacheTest() : blob_(kBlob, sizeof(kBlob)), material_(kMaterial, sizeof(kMaterial)) {
+        hidden_.push_back(TAG_APPLICATION_ID, "app", 3);
+        hw_enforced_.push_back(TAG_ALGORITHM, KM_ALGORITHM_AES);
+        sw_enforced_.push_back(TAG_KEY_SIZE, 128);
+    }
+
+    bool Find(ParsedKeyCache* cache, km_id_t key_id, const KeymasterKeyBlob& blob,
+              const AuthorizationSet& hidden) {
+        KeymasterKeyBlob material;
+        AuthorizationSet hw_enforced;
+        AuthorizationSet sw_enforced;
+        if (!cache->Find(key_id, blob, hidden, &material, &hw_enforced, &sw_enforced)) {
+            return false;
+        }
+        EXPECT_EQ(material_.size(), material.size());
+        EXPECT_EQ(0, memcmp(material_.begin(), material.begin(), material.size()));
+        EXPECT_TRUE(hw_enforced.Contains(TAG_ALGORITHM, KM_ALGORITHM_AES));
+        EXPECT_TRUE(sw_enforced.Contains(TAG_KEY_SIZE, 128));
+        return true;
+    }
+
+    void Insert(ParsedKeyCache* cache, km_id_t key_id, const KeymasterKeyBlob& blob) {
+        cache->Insert(key_id, blob, hidden_, material_, hw_enforced_, sw_enforced_);
+    }
+
+    static constexpr uint8_t kBlob[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    static constexpr uint8_t kMaterial[] = {9, 10, 11, 12};
+
+    KeymasterKeyBlob blob_;
+    KeymasterKeyBlob material_;
+    AuthorizationSet hidden_;
+    AuthorizationSet hw_enforced_;
+    AuthorizationSet sw_enforced_;
+};
+
+TEST_F(ParsedKeyCacheTest, HitAndInvalidate) {
+    ParsedKeyCache cache(4, 4096);
+    EXPECT_FALSE(Find(&cache, 1, blob_, hidden_));
+
+    Insert(&cache, 1, blob_);
+    EXPECT_EQ(1U, cache.size());
+    EXPECT_TRUE(Find(&cache, 1, blob_, hidden_));
+
+    cache.Invalidate(1);
+    EXPECT_FALSE(Find(&cache, 1, blob_, hidden_));
+    EXPECT_EQ(0U, cache.size());
+    EXPECT_EQ(0U, cache.bytes());
+}
+
+TEST_F(ParsedKeyCacheTest, MismatchMisses) {
+    ParsedKeyCache cache(4, 4096);
+    Insert(&cache, 1, blob_);
+
+    // Same key ID, different blob.
+    uint8_t other[] = {8, 7, 6, 5, 4, 3, 2, 1};
+    EXPECT_FALSE(Find(&cache, 1, KeymasterKeyBlob(other, sizeof(other)), hidden_));
+
+    // Same blob, different application ID.
+    AuthorizationSet hidden;
+    hidden.push_back(TAG_APPLICATION_ID, "other", 5);
+    EXPECT_FALSE(Find(&cache, 1, blob_, hidden));
+
+    EXPECT_TRUE(Find(&cache, 1, blob_, hidden_));
+}
+
+TEST_F(ParsedKeyCacheTest, EvictsLeastRecentlyUsed) {
+    ParsedKeyCache cache(2, 4096);
+    Insert(&cache, 1, blob_);
+    Insert(&cache, 2, blob_);
+    EXPECT_TRUE(Find(&cache, 1, blob_, hidden_));
+
+    Insert(&cache, 3, blob_);
+    EXPECT_EQ(2U, cache.size());
+    EXPECT_TRUE(Find(&cache, 1, blob_, hidden_));
+    EXPECT_FALSE(Find(&cache, 2, blob_, hidden_));
+    EXPECT_TRUE(Find(&cache, 3, blob_, hidden_));
+
+    cache.Clear();
+    EXPECT_EQ(0U, cache.size());
+    EXPECT_FALSE(Find(&cache, 1, blob_, hidden_));
+}
+
+TEST_F(ParsedKeyCacheTest, PolicyCompiledOnInsert) {
+    ParsedKeyCache cache(4, 4096);
+    sw_enforced_.push_back(TAG_PURPOSE, KM_PURPOSE_ENCRYPT);
+    Insert(&cache, 1, blob_);
+
+    KeymasterKeyBlob material;
+    AuthorizationSet hw_enforced;
+    AuthorizationSet sw_enforced;
+    KeyPolicy policy;
+    ASSERT_TRUE(
+        cache.Find(1, blob_, hidden_, &material, &hw_enforced, &sw_enforced, &policy));
+    EXPECT_TRUE(policy.compiled);
+    EXPECT_TRUE(policy.has_purpose(KM_PURPOSE_ENCRYPT));
+    EXPECT_FALSE(policy.has_purpose(KM_PURPOSE_DECRYPT));
+    EXPECT_EQ(hw_enforced.size() + sw_enforced.size(), policy.auth_set_size);
+}
+
+TEST_F(ParsedKeyCacheTest, DerivedDataShared) {
+    ParsedKeyCache cache(4, 4096);
+    std::shared_ptr<DerivedKeyData> inserted;
+    cache.Insert(1, blob_, hidden_, material_, hw_enforced_, sw_enforced_, &inserted);
+    ASSERT_TRUE(inserted);
+    const uint8_t der[] = {0x30, 0x03, 0x02, 0x01, 0x01};
+    inserted->SetPublicKeyDer(der, sizeof(der));
+
+    KeymasterKeyBlob material;
+    AuthorizationSet hw_enforced;
+    AuthorizationSet sw_enforced;
+    std::shared_ptr<DerivedKeyData> found;
+    ASSERT_TRUE(cache.Find(1, blob_, hidden_, &material, &hw_enforced, &sw_enforced,
+                           nullptr /* policy */, &found));
+    EXPECT_EQ(inserted.get(), found.get());
+    UniquePtr<uint8_t[]> copy;
+    size_t size;
+    ASSERT_TRUE(found->GetPublicKeyDer(&copy, &size));
+    ASSERT_EQ(sizeof(der), size);
+    EXPECT_EQ(0, memcmp(der, copy.get(), size));
+
+    // A replaced entry starts over.
+    cache.Insert(1, blob_, hidden_, material_, hw_enforced_, sw_enforced_, &inserted);
+    ASSERT_TRUE(inserted);
+    EXPECT_NE(found.get(), inserted.get());
+    EXPECT_FALSE(inserted->GetPublicKeyDer(&copy, &size));
+}
+
+TEST_F(ParsedKeyCacheTest, FindKeyId) {
+    ParsedKeyCache cache(4, 4096);
+    km_id_t key_id = 0;
+    EXPECT_FALSE(cache.FindKeyId(blob_, &key_id));
+
+    Insert(&cache, 5, blob_);
+    ASSERT_TRUE(cache.FindKeyId(blob_, &key_id));
+    EXPECT_EQ(5U, key_id);
+
+    // Blobs that differ only in the middle share a fingerprint, but must not share an ID.
+    uint8_t long_blob[128] = {};
+    Insert(&cache, 6, KeymasterKeyBlob(long_blob, sizeof(long_blob)));
+    long_blob[64] = 1;
+    EXPECT_FALSE(cache.FindKeyId(KeymasterKeyBlob(long_blob, sizeof(long_blob)), &key_id));
+    long_blob[64] = 0;
+    ASSERT_TRUE(cache.FindKeyId(KeymasterKeyBlob(long_blob, sizeof(long_blob)), &key_id));
+    EXPECT_EQ(6U, key_id);
+
+    cache.Invalidate(5);
+    EXPECT_FALSE(cache.FindKeyId(blob_, &key_id));
+}
+
+TEST_F(ParsedKeyCacheTest, ByteLimit) {
+    ParsedKeyCache cache(16, 1);
+    Insert(&cache, 1, blob_);
+    EXPECT_EQ(0U, cache.size());
+    EXPECT_FALSE(Find(&cache, 1, blob_, hidden_));
+}
+
+TEST_F(ParsedKeyCacheTest, EvictedEntriesAreSealed) {
+    ParsedKeyCache cache(1, 4096, 4, 4096);
+    sw_enforced_.push_back(TAG_PURPOSE, KM_PURPOSE_ENCRYPT);
+    std::shared_ptr<DerivedKeyData> inserted;
+    cache.Insert(1, blob_, hidden_, material_, hw_enforced_, sw_enforced_, &inserted);
+    Insert(&cache, 2, blob_);
+    EXPECT_EQ(1U, cache.size());
+    EXPECT_EQ(1U, cache.sealed_size());
+    EXPECT_LT(0U, cache.sealed_bytes());
+
+    km_id_t key_id = 0;
+    ASSERT_TRUE(cache.FindKeyId(blob_, &key_id));
+    EXPECT_EQ(2U, key_id);
+
+    // A sealed hit opens the entry, with its policy and derived data, and moves it back to the
+    // first level, sealing the entry it displaces.
+    KeymasterKeyBlob material;
+    AuthorizationSet hw_enforced;
+    AuthorizationSet sw_enforced;
+    KeyPolicy policy;
+    std::shared_ptr<DerivedKeyData> found;
+    ASSERT_TRUE(
+        cache.Find(1, blob_, hidden_, &material, &hw_enforced, &sw_enforced, &policy, &found));
+    ASSERT_EQ(material_.size(), material.size());
+    EXPECT_EQ(0, memcmp(material_.begin(), material.begin(), material.size()));
+    EXPECT_TRUE(sw_enforced.Contains(TAG_PURPOSE, KM_PURPOSE_ENCRYPT));
+    EXPECT_TRUE(policy.compiled);
+    EXPECT_EQ(inserted.get(), found.get());
+    EXPECT_EQ(1U, cache.sealed_hits());
+    EXPECT_EQ(1U, cache.size());
+    EXPECT_EQ(1U, cache.sealed_size());
+
+    EXPECT_TRUE(Find(&cache, 2, blob_, hidden_));
+    EXPECT_EQ(2U, cache.sealed_hits());
+}
+
+TEST_F(ParsedKeyCacheTest, SealedMismatchMisses) {
+    ParsedKeyCache cache(1, 4096, 4, 4096);
+    Insert(&cache, 1, blob_);
+    Insert(&cache, 2, blob_);
+    ASSERT_EQ(1U, cache.sealed_size());
+
+    uint8_t other[] = {8, 7, 6, 5, 4, 3, 2, 1};
+    EXPECT_FALSE(Find(&cache, 1, KeymasterKeyBlob(other, sizeof(other)), hidden_));
+    AuthorizationSet hidden;
+    hidden.push_back(TAG_APPLICATION_ID, "other", 5);
+    EXPECT_FALSE(Find(&cache, 1, blob_, hidden));
+    EXPECT_EQ(1U, cache.sealed_size());
+    EXPECT_EQ(0U, cache.sealed_hits());
+
+    cache.Invalidate(1);
+    EXPECT_EQ(0U, cache.sealed_size());
+    EXPECT_EQ(0U, cache.sealed_bytes());
+    EXPECT_FALSE(Find(&cache, 1, blob_, hidden_));
+}
+
+TEST_F(ParsedKeyCacheTest, SealedLevelEvictsLeastRecentlySealed) {
+    ParsedKeyCache cache(1, 4096, 2, 4096);
+    for (km_id_t key_id = 1; key_id <= 4; ++key_id) {
+        Insert(&cache, key_id, blob_);
+    }
+    EXPECT_EQ(1U, cache.size());
+    EXPECT_EQ(2U, cache.sealed_size());
+    EXPECT_FALSE(Find(&cache, 1, blob_, hidden_));
+    EXPECT_TRUE(Find(&cache, 2, blob_, hidden_));
+    EXPECT_TRUE(Find(&cache, 3, blob_, hidden_));
+    EXPECT_TRUE(Find(&cache, 4, blob_, hidden_));
+
+    cache.Clear();
+    EXPECT_EQ(0U, cache.sealed_size());
+    EXPECT_FALSE(Find(&cache, 3, blob_, hidden_));
+}
+
+}  // namespace test
+}  // namespace keymaster
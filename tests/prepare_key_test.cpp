@@ -0,0 +1,116 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+#include <keymaster/key_blob_utils/software_keyblobs.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+
+class PrepareKeyTest : public ::testing::Test {
+  protected:
+    PrepareKeyTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    int32_t ver() const { return keymaster_.message_version(); }
+
+    KeymasterKeyBlob GenerateHmacKey() {
+        GenerateKeyRequest request(ver());
+        request.key_description.Reinitialize(AuthorizationSet(
+            AuthorizationSetBuilder()
+                .HmacKey(128)
+                .Digest(KM_DIGEST_SHA_2_256)
+                .Authorization(TAG_MIN_MAC_LENGTH, 256)
+                .Authorization(TAG_APPLICATION_ID, "app", 3)
+                .Authorization(TAG_NO_AUTH_REQUIRED)));
+        GenerateKeyResponse response(ver());
+        keymaster_.GenerateKey(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        return std::move(response.key_blob);
+    }
+
+    keymaster_error_t Prepare(const KeymasterKeyBlob& key, const AuthorizationSet& params) {
+        PrepareKeyRequest request(ver());
+        request.SetKeyMaterial(key);
+        request.additional_params.Reinitialize(params);
+        PrepareKeyResponse response(ver());
+        keymaster_.PrepareKey(request, &response);
+        return response.error;
+    }
+
+    keymaster_error_t Begin(const KeymasterKeyBlob& key, const AuthorizationSet& params) {
+        BeginOperationRequest request(ver());
+        request.purpose = KM_PURPOSE_SIGN;
+        request.SetKeyMaterial(key);
+        request.additional_params.Reinitialize(params);
+        BeginOperationResponse response(ver());
+        keymaster_.BeginOperation(request, &response);
+        if (response.error == KM_ERROR_OK) {
+            AbortOperationRequest abort(ver());
+            abort.op_handle = response.op_handle;
+            AbortOperationResponse abort_response(ver());
+            keymaster_.AbortOperation(abort, &abort_response);
+        }
+        return response.error;
+    }
+
+    // Blobs the context has had to parse because they weren't in its parsed key cache.
+    uint64_t UncachedParses() const {
+        uint64_t parses = 0;
+        for (size_t format = 0; format < kSoftwareKeyBlobFormatCount; ++format) {
+            parses += context_->key_blob_format_counts().count(
+                static_cast<SoftwareKeyBlobFormat>(format));
+        }
+        return parses;
+    }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+};
+
+TEST_F(PrepareKeyTest, BeginUsesPreparedKey) {
+    KeymasterKeyBlob key = GenerateHmacKey();
+    AuthorizationSet params(AuthorizationSetBuilder()
+                                .Authorization(TAG_APPLICATION_ID, "app", 3)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Authorization(TAG_MAC_LENGTH, 256));
+
+    ASSERT_EQ(KM_ERROR_OK, Prepare(key, params));
+    uint64_t parses = UncachedParses();
+    EXPECT_EQ(KM_ERROR_OK, Begin(key, params));
+    EXPECT_EQ(parses, UncachedParses());
+}
+
+TEST_F(PrepareKeyTest, ReportsLoadErrors) {
+    KeymasterKeyBlob key = GenerateHmacKey();
+    AuthorizationSet wrong_app(AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID, "x", 1));
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, Prepare(key, wrong_app));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/pure_soft_secure_key_storage.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+#include <keymaster/key_factory.h>
+
+#include <gtest/gtest.h>
+
+#include "android_keymaster_test_utils.h"
+
+namespace keymaster {
+namespace test {
+
+bool Exists(PureSoftSecureKeyStorage* storage, km_id_t keyid) {
+    bool exists = false;
+    EXPECT_EQ(KM_ERROR_OK, storage->KeyExists(keyid, &exists));
+    return exists;
+}
+
+TEST(PureSoftSecureKeyStorageTest, WriteExistsDelete) {
+    PureSoftSecureKeyStorage storage(2);
+    KeymasterKeyBlob blob;
+
+    EXPECT_EQ(KM_ERROR_OK, storage.WriteKey(1, blob));
+    EXPECT_EQ(KM_ERROR_OK, storage.WriteKey(2, blob));
+    // Rewriting a stored key doesn't use another slot.
+    EXPECT_EQ(KM_ERROR_OK, storage.WriteKey(2, blob));
+    EXPECT_EQ(KM_ERROR_UNKNOWN_ERROR, storage.WriteKey(3, blob));
+
+    bool has_slot = true;
+    EXPECT_EQ(KM_ERROR_OK, storage.HasSlot(&has_slot));
+    EXPECT_FALSE(has_slot);
+    EXPECT_TRUE(Exists(&storage, 1));
+    EXPECT_FALSE(Exists(&storage, 3));
+
+    EXPECT_EQ(KM_ERROR_OK, storage.DeleteKey(1));
+    EXPECT_FALSE(Exists(&storage, 1));
+    EXPECT_EQ(KM_ERROR_OK, storage.WriteKey(3, blob));
+
+    EXPECT_EQ(KM_ERROR_OK, storage.DeleteAllKeys());
+    EXPECT_FALSE(Exists(&storage, 2));
+    EXPECT_FALSE(Exists(&storage, 3));
+}
+
+TEST(PureSoftSecureKeyStorageTest, SnapshotRoundTrip) {
+    PureSoftSecureKeyStorage storage(4);
+    KeymasterKeyBlob blob;
+    EXPECT_EQ(KM_ERROR_OK, storage.WriteKey(0x1122334455667788ULL, blob));
+    EXPECT_EQ(KM_ERROR_OK, storage.WriteKey(7, blob));
+
+    std::vector<uint8_t> snapshot;
+    ASSERT_EQ(KM_ERROR_OK, storage.Snapshot(&snapshot));
+
+    PureSoftSecureKeyStorage restored(4);
+    EXPECT_EQ(KM_ERROR_OK, restored.WriteKey(9, blob));
+    ASSERT_EQ(KM_ERROR_OK, restored.LoadSnapshot(snapshot.data(), snapshot.size()));
+    EXPECT_TRUE(Exists(&restored, 0x1122334455667788ULL));
+    EXPECT_TRUE(Exists(&restored, 7));
+    EXPECT_FALSE(Exists(&restored, 9));
+
+    // Snapshots are canonical.
+    std::vector<uint8_t> second;
+    ASSERT_EQ(KM_ERROR_OK, restored.Snapshot(&second));
+    EXPECT_TRUE(snapshot == second);
+}
+
+TEST(PureSoftSecureKeyStorageTest, BadSnapshotRejected) {
+    PureSoftSecureKeyStorage storage(4);
+    KeymasterKeyBlob blob;
+    EXPECT_EQ(KM_ERROR_OK, storage.WriteKey(1, blob));
+    EXPECT_EQ(KM_ERROR_OK, storage.WriteKey(2, blob));
+    std::vector<uint8_t> snapshot;
+    ASSERT_EQ(KM_ERROR_OK, storage.Snapshot(&snapshot));
+
+    // Truncated.
+    PureSoftSecureKeyStorage restored(4);
+    EXPECT_EQ(KM_ERROR_OK, restored.WriteKey(9, blob));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              restored.LoadSnapshot(snapshot.data(), snapshot.size() - 1));
+    EXPECT_TRUE(Exists(&restored, 9));
+
+    // Bad magic.
+    std::vector<uint8_t> corrupt = snapshot;
+    corrupt[0] ^= 0xFF;
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, restored.LoadSnapshot(corrupt.data(), corrupt.size()));
+
+    // More keys than slots.
+    PureSoftSecureKeyStorage small(1);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, small.LoadSnapshot(snapshot.data(), snapshot.size()));
+}
+
+TEST(PureSoftSecureKeyStorageTest, ContextCapacityIsConfigurable) {
+    PureSoftKeymasterContextConfig config;
+    config.max_secure_storage_keys = 20000;
+    PureSoftKeymasterContext context(KmVersion::KEYMINT_3, KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT,
+                                     config);
+    EXPECT_EQ(20000U, context.config().max_secure_storage_keys);
+
+    SecureKeyStorage* storage = context.secure_key_storage();
+    ASSERT_NE(nullptr, storage);
+    KeymasterKeyBlob blob;
+    for (km_id_t keyid = 0; keyid < 20000; ++keyid) {
+        ASSERT_EQ(KM_ERROR_OK, storage->WriteKey(keyid, blob));
+    }
+    bool has_slot = true;
+    EXPECT_EQ(KM_ERROR_OK, storage->HasSlot(&has_slot));
+    EXPECT_FALSE(has_slot);
+}
+
+TEST(PureSoftSecureKeyStorageTest, WarmStateRoundTrip) {
+    PureSoftKeymasterContext context(KmVersion::KEYMINT_3, KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT);
+    KeymasterKeyBlob blob;
+    ASSERT_EQ(KM_ERROR_OK, context.secure_key_storage()->WriteKey(42, blob));
+
+    std::vector<uint8_t> snapshot;
+    ASSERT_EQ(KM_ERROR_OK, context.SnapshotWarmState(&snapshot));
+
+    PureSoftKeymasterContext restored(KmVersion::KEYMINT_3,
+                                      KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT);
+    ASSERT_EQ(KM_ERROR_OK, restored.RestoreWarmState(snapshot.data(), snapshot.size()));
+    bool exists = false;
+    EXPECT_EQ(KM_ERROR_OK, restored.secure_key_storage()->KeyExists(42, &exists));
+    EXPECT_TRUE(exists);
+
+    // Altered snapshots are rejected without touching the state.
+    snapshot[snapshot.size() / 2] ^= 1;
+    PureSoftKeymasterContext tampered(KmVersion::KEYMINT_3,
+                                      KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT);
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              tampered.RestoreWarmState(snapshot.data(), snapshot.size()));
+    EXPECT_EQ(KM_ERROR_OK, tampered.secure_key_storage()->KeyExists(42, &exists));
+    EXPECT_FALSE(exists);
+}
+
+TEST(PureSoftSecureKeyStorageTest, KeyCharacteristicsMatchParsedKey) {
+    PureSoftKeymasterContext context(KmVersion::KEYMINT_3, KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT);
+    AuthorizationSet description(AuthorizationSetBuilder()
+                                     .Authorization(TAG_ALGORITHM, KM_ALGORITHM_HMAC)
+                                     .Authorization(TAG_KEY_SIZE, 128)
+                                     .Authorization(TAG_DIGEST, KM_DIGEST_SHA_2_256)
+                                     .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                     .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                     .Authorization(TAG_APPLICATION_ID, "app", 3)
+                                     .Authorization(TAG_NO_AUTH_REQUIRED));
+    const KeyFactory* factory = context.GetKeyFactory(KM_ALGORITHM_HMAC);
+    ASSERT_NE(nullptr, factory);
+    KeymasterKeyBlob blob;
+    AuthorizationSet hw_enforced, sw_enforced;
+    CertificateChain cert_chain;
+    ASSERT_EQ(KM_ERROR_OK, factory->GenerateKey(description, {} /* attestation_signing_key */,
+                                                {} /* issuer_subject */, &blob, &hw_enforced,
+                                                &sw_enforced, &cert_chain));
+
+    AuthorizationSet app_params(
+        AuthorizationSetBuilder().Authorization(TAG_APPLICATION_ID, "app", 3));
+    UniquePtr<Key> key;
+    ASSERT_EQ(KM_ERROR_OK, context.ParseKeyBlob(blob, app_params, &key));
+    AuthorizationSet hw_chars, sw_chars;
+    ASSERT_EQ(KM_ERROR_OK,
+              context.ParseKeyCharacteristics(blob, app_params, &hw_chars, &sw_chars));
+    EXPECT_EQ(key->hw_enforced(), hw_chars);
+    EXPECT_EQ(key->sw_enforced(), sw_chars);
+
+    // The blob is still authenticated.
+    EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB,
+              context.ParseKeyCharacteristics(blob, AuthorizationSet(), &hw_chars, &sw_chars));
+
+    // In a batch, cache hits, misses and bad blobs each get their own result.
+    const size_t kCount = 6;
+    KeymasterKeyBlob blobs[kCount];
+    AuthorizationSet params[kCount], hw[kCount], sw[kCount];
+    keymaster_error_t errors[kCount];
+    for (size_t i = 0; i < kCount; ++i) {
+        blobs[i] = KeymasterKeyBlob(blob);
+        params[i] = app_params;
+    }
+    blobs[1].writable_data()[blobs[1].key_material_size - 1] ^= 1;  // Not cached, bad MAC
+    params[2].Clear();
+    context.ParseKeysCharacteristics(blobs, params, kCount, hw, sw, errors, 4 /* thread_count */);
+    for (size_t i = 0; i < kCount; ++i) {
+        if (i == 1 || i == 2) {
+            EXPECT_EQ(KM_ERROR_INVALID_KEY_BLOB, errors[i]);
+        } else {
+            EXPECT_EQ(KM_ERROR_OK, errors[i]);
+            EXPECT_EQ(key->hw_enforced(), hw[i]);
+        }
+    }
+}
+
+TEST(PureSoftSecureKeyStorageTest, GenerateKeysBatch) {
+    PureSoftKeymasterContext context(KmVersion::KEYMINT_3, KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT);
+    const KeyFactory* factory = context.GetKeyFactory(KM_ALGORITHM_AES);
+    ASSERT_NE(nullptr, factory);
+
+    const size_t kCount = 3;
+    AuthorizationSet descriptions[kCount];
+    for (size_t i = 0; i < kCount; ++i) {
+        descriptions[i] = AuthorizationSetBuilder()
+                              .Authorization(TAG_ALGORITHM, KM_ALGORITHM_AES)
+                              .Authorization(TAG_KEY_SIZE, i == 1 ? 100 : 128 + 64 * i)
+                              .Authorization(TAG_BLOCK_MODE, KM_MODE_ECB)
+                              .Authorization(TAG_PADDING, KM_PAD_NONE)
+                              .Authorization(TAG_PURPOSE, KM_PURPOSE_ENCRYPT)
+                              .Authorization(TAG_NO_AUTH_REQUIRED);
+    }
+    KeymasterKeyBlob blobs[kCount];
+    AuthorizationSet hw_enforced[kCount], sw_enforced[kCount];
+    keymaster_error_t errors[kCount];
+    factory->GenerateKeys(descriptions, kCount, blobs, hw_enforced, sw_enforced, errors);
+
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_KEY_SIZE, errors[1]);
+    UniquePtr<Key> keys[kCount];
+    for (size_t i : {0, 2}) {
+        ASSERT_EQ(KM_ERROR_OK, errors[i]);
+        ASSERT_EQ(KM_ERROR_OK, context.ParseKeyBlob(blobs[i], AuthorizationSet(), &keys[i]));
+        EXPECT_EQ(16U + 8 * i, keys[i]->key_material().key_material_size);
+    }
+    // Each key gets its own slice of the random draw.
+    EXPECT_NE(0, memcmp(keys[0]->key_material().key_material,
+                        keys[2]->key_material().key_material, 16));
+}
+
+TEST(PureSoftSecureKeyStorageTest, UpgradeKeyBlobsInParallel) {
+    PureSoftKeymasterContext context(KmVersion::KEYMINT_3, KM_SECURITY_LEVEL_TRUSTED_ENVIRONMENT);
+    const KeyFactory* factory = context.GetKeyFactory(KM_ALGORITHM_HMAC);
+    ASSERT_NE(nullptr, factory);
+
+    // More keys than the factory caches, each twice, so the workers hit and evict concurrently.
+    const size_t kKeys = 12;
+    const size_t kCount = 2 * kKeys;
+    KeymasterKeyBlob blobs[kCount];
+    for (size_t i = 0; i < kKeys; ++i) {
+        AuthorizationSet description(AuthorizationSetBuilder()
+                                         .Authorization(TAG_ALGORITHM, KM_ALGORITHM_HMAC)
+                                         .Authorization(TAG_KEY_SIZE, 128)
+                                         .Authorization(TAG_DIGEST, KM_DIGEST_SHA_2_256)
+                                         .Authorization(TAG_MIN_MAC_LENGTH, 128)
+                                         .Authorization(TAG_PURPOSE, KM_PURPOSE_SIGN)
+                                         .Authorization(TAG_NO_AUTH_REQUIRED));
+        AuthorizationSet hw_enforced, sw_enforced;
+        CertificateChain cert_chain;
+        ASSERT_EQ(KM_ERROR_OK, factory->GenerateKey(description, {} /* attestation_signing_key */,
+                                                    {} /* issuer_subject */, &blobs[i],
+                                                    &hw_enforced, &sw_enforced, &cert_chain));
+        blobs[kKeys + i] = KeymasterKeyBlob(blobs[i]);
+    }
+
+    KeymasterKeyBlob upgraded[kCount];
+    keymaster_error_t errors[kCount];
+    context.UpgradeKeyBlobs(blobs, kCount, AuthorizationSet(), upgraded, errors,
+                            4 /* thread_count */);
+    for (size_t i = 0; i < kCount; ++i) EXPECT_EQ(KM_ERROR_OK, errors[i]) << i;
+}
+
+}  // namespace test
+}  // namespace keymaster
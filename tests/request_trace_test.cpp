@@ -0,0 +1,205 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/request_trace.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include <keymaster/android_keymaster.h>
+
+#include <gtest/gtest.h>
+
+#include "android_keymaster_test_utils.h"
+
+namespace keymaster {
+namespace test {
+
+// Reads back everything written to |file|.
+std::vector<uint8_t> Contents(FILE* file) {
+    std::vector<uint8_t> contents(ftell(file));
+    rewind(file);
+    EXPECT_EQ(contents.size(), fread(contents.data(), 1, contents.size(), file));
+    return contents;
+}
+
+RecordedRequest Request(AndroidKeymasterCommand command, uint64_t arrival_ns) {
+    RecordedRequest request{};
+    request.command = command;
+    request.message_version = 4;
+    request.arrival_ns = arrival_ns;
+    request.duration_ns = 5000;
+    return request;
+}
+
+class CapturingRecorder : public RequestRecorder {
+  public:
+    uint64_t now_ns() const override { return 1000; }
+    void Record(const RecordedRequest& request) override { requests.push_back(request); }
+
+    std::vector<RecordedRequest> requests;
+};
+
+TEST(TraceRecordTest, RoundTrip) {
+    TraceRecord record;
+    record.command = FINISH_OPERATION;
+    record.message_version = 4;
+    record.arrival_us = 1ULL << 40;
+    record.duration_us = 1234;
+    record.error = KM_ERROR_INVALID_OPERATION_HANDLE;
+    record.key_id = 3;
+    record.op_id = 7;
+    record.purpose = KM_PURPOSE_SIGN;
+    record.input_length = 4096;
+    record.params.push_back(TAG_MAC_LENGTH, 256);
+
+    std::vector<uint8_t> buf(record.SerializedSize());
+    ASSERT_EQ(buf.data() + buf.size(), record.Serialize(buf.data(), buf.data() + buf.size()));
+
+    TraceRecord copy;
+    const uint8_t* p = buf.data();
+    ASSERT_TRUE(copy.Deserialize(&p, buf.data() + buf.size()));
+    EXPECT_EQ(FINISH_OPERATION, copy.command);
+    EXPECT_EQ(1ULL << 40, copy.arrival_us);
+    EXPECT_EQ(KM_ERROR_INVALID_OPERATION_HANDLE, copy.error);
+    EXPECT_EQ(3U, copy.key_id);
+    EXPECT_EQ(7U, copy.op_id);
+    EXPECT_EQ(KM_PURPOSE_SIGN, copy.purpose);
+    EXPECT_EQ(4096U, copy.input_length);
+    EXPECT_EQ(record.params, copy.params);
+    EXPECT_TRUE(copy.key_characteristics.empty());
+}
+
+TEST(RequestTraceWriterTest, RedactsAndAssignsIds) {
+    FILE* file = tmpfile();
+    ASSERT_NE(nullptr, file);
+    RequestTraceWriter writer(file);
+    uint64_t start_ns = writer.now_ns();
+
+    uint8_t blob_bytes[] = {1, 2, 3, 4};
+    keymaster_key_blob_t key_blob = {blob_bytes, sizeof(blob_bytes)};
+    AuthorizationSet hw_enforced(AuthorizationSetBuilder().HmacKey(256));
+    AuthorizationSet sw_enforced;
+    AuthorizationSet begin_params(AuthorizationSetBuilder()
+                                      .Authorization(TAG_APPLICATION_ID, "secret", 6)
+                                      .Authorization(TAG_MAC_LENGTH, 256));
+
+    RecordedRequest begin = Request(BEGIN_OPERATION, start_ns + 2000000);
+    begin.error = KM_ERROR_OK;
+    begin.key_blob = &key_blob;
+    begin.key_hw_enforced = &hw_enforced;
+    begin.key_sw_enforced = &sw_enforced;
+    begin.op_handle = 0x1234567890;
+    begin.purpose = KM_PURPOSE_SIGN;
+    begin.params = &begin_params;
+    writer.Record(begin);
+
+    // Recorded out of order: it arrived before the begin.
+    RecordedRequest update = Request(UPDATE_OPERATION, start_ns + 1000000);
+    update.error = KM_ERROR_OK;
+    update.op_handle = 0x1234567890;
+    update.input_length = 100;
+    writer.Record(update);
+
+    RecordedRequest second_begin = begin;
+    second_begin.arrival_ns = start_ns + 3000000;
+    writer.Record(second_begin);
+    EXPECT_EQ(0U, writer.dropped());
+
+    std::vector<uint8_t> contents = Contents(file);
+    fclose(file);
+    for (size_t i = 0; i + 6 <= contents.size(); ++i) {
+        EXPECT_NE(0, memcmp(contents.data() + i, "secret", 6)) << "at " << i;
+    }
+
+    std::vector<TraceRecord> records;
+    ASSERT_TRUE(ReadRequestTrace(contents.data(), contents.size(), &records));
+    ASSERT_EQ(3U, records.size());
+
+    EXPECT_EQ(UPDATE_OPERATION, records[0].command);
+    EXPECT_EQ(100U, records[0].input_length);
+
+    const TraceRecord& first = records[1];
+    EXPECT_EQ(BEGIN_OPERATION, first.command);
+    EXPECT_EQ(1U, first.key_id);
+    EXPECT_EQ(1U, first.op_id);
+    EXPECT_EQ(records[0].op_id, first.op_id);
+    EXPECT_EQ(5U, first.duration_us);
+    EXPECT_EQ(KM_PURPOSE_SIGN, first.purpose);
+    keymaster_blob_t app_id;
+    ASSERT_TRUE(first.params.GetTagValue(TAG_APPLICATION_ID, &app_id));
+    ASSERT_EQ(6U, app_id.data_length);
+    for (size_t i = 0; i < app_id.data_length; ++i) EXPECT_EQ(0, app_id.data[i]);
+    EXPECT_TRUE(first.params.Contains(TAG_MAC_LENGTH, 256));
+    EXPECT_TRUE(first.key_characteristics.Contains(TAG_ALGORITHM, KM_ALGORITHM_HMAC));
+
+    // The same key again, described only once, with a new operation.
+    EXPECT_EQ(1U, records[2].key_id);
+    EXPECT_EQ(2U, records[2].op_id);
+    EXPECT_TRUE(records[2].key_characteristics.empty());
+}
+
+TEST(RequestTraceWriterTest, TruncatedRecordEndsTrace) {
+    FILE* file = tmpfile();
+    ASSERT_NE(nullptr, file);
+    RequestTraceWriter writer(file);
+    for (int i = 0; i < 2; ++i) {
+        RecordedRequest request = Request(DELETE_KEY, writer.now_ns());
+        request.error = KM_ERROR_OK;
+        writer.Record(request);
+    }
+    std::vector<uint8_t> contents = Contents(file);
+    fclose(file);
+
+    std::vector<TraceRecord> records;
+    ASSERT_TRUE(ReadRequestTrace(contents.data(), contents.size() - 1, &records));
+    EXPECT_EQ(1U, records.size());
+
+    records.clear();
+    contents[0] ^= 1;
+    EXPECT_FALSE(ReadRequestTrace(contents.data(), contents.size(), &records));
+    EXPECT_TRUE(records.empty());
+}
+
+TEST(RequestRecorderTest, AndroidKeymasterRecordsRequests) {
+    // Requests without TAG_ALGORITHM fail before the context is used, so no context is needed.
+    AndroidKeymaster keymaster(nullptr /* context */, 4);
+    CapturingRecorder recorder;
+    keymaster.set_request_recorder(&recorder);
+
+    GenerateKeyRequest request(keymaster.message_version());
+    request.key_description.push_back(TAG_KEY_SIZE, 256);
+    GenerateKeyResponse response(keymaster.message_version());
+    keymaster.GenerateKey(request, &response);
+    ASSERT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, response.error);
+
+    ASSERT_EQ(1U, recorder.requests.size());
+    const RecordedRequest& recorded = recorder.requests[0];
+    EXPECT_EQ(GENERATE_KEY, recorded.command);
+    EXPECT_EQ(keymaster.message_version(), recorded.message_version);
+    EXPECT_EQ(KM_ERROR_UNSUPPORTED_ALGORITHM, recorded.error);
+    EXPECT_EQ(1000U, recorded.arrival_ns);
+    EXPECT_EQ(0U, recorded.duration_ns);
+
+    keymaster.set_request_recorder(nullptr);
+    keymaster.GenerateKey(request, &response);
+    EXPECT_EQ(1U, recorder.requests.size());
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,65 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/rsa_key_factory.h>
+
+#include <openssl/bn.h>
+#include <openssl/rsa.h>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/worker_pool.h>
+
+namespace keymaster {
+namespace test {
+
+namespace {
+
+void ExpectValidKey(const RSA_Ptr& key, uint32_t key_size, uint64_t public_exponent) {
+    ASSERT_TRUE(key);
+    EXPECT_EQ(key_size, static_cast<uint32_t>(RSA_bits(key.get())));
+    EXPECT_EQ(public_exponent, BN_get_word(RSA_get0_e(key.get())));
+    EXPECT_EQ(1, RSA_check_key(key.get()));
+}
+
+}  // namespace
+
+TEST(RsaKeyGenerationTest, ParallelGenerationMakesValidKeys) {
+    ThreadWorkerPool pool;
+    for (uint64_t exponent : {3, 65537}) {
+        RSA_Ptr key;
+        ASSERT_EQ(KM_ERROR_OK,
+                  RsaKeyFactory::GenerateRsaKeyInParallel(1024, exponent, &pool, &key));
+        ExpectValidKey(key, 1024, exponent);
+    }
+}
+
+TEST(RsaKeyGenerationTest, ParallelGenerationWithoutPool) {
+    RSA_Ptr key;
+    ASSERT_EQ(KM_ERROR_OK, RsaKeyFactory::GenerateRsaKeyInParallel(768, 65537, nullptr, &key));
+    ExpectValidKey(key, 768, 65537);
+}
+
+TEST(RsaKeyGenerationTest, ParallelGenerationMakesDistinctKeys) {
+    ThreadWorkerPool pool;
+    RSA_Ptr key, other;
+    ASSERT_EQ(KM_ERROR_OK, RsaKeyFactory::GenerateRsaKeyInParallel(1024, 65537, &pool, &key));
+    ASSERT_EQ(KM_ERROR_OK, RsaKeyFactory::GenerateRsaKeyInParallel(1024, 65537, &pool, &other));
+    EXPECT_NE(0, BN_cmp(RSA_get0_n(key.get()), RSA_get0_n(other.get())));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/secret_arena.h>
+
+#include <string.h>
+
+#include <gtest/gtest.h>
+
+#include <keymaster/android_keymaster_utils.h>
+
+namespace keymaster {
+namespace test {
+
+#ifdef __linux__
+
+TEST(SecretArenaTest, ReusesAndZeroesFreedSlots) {
+    SecretArena arena;
+    uint8_t* secret = static_cast<uint8_t*>(arena.Allocate(100));
+    ASSERT_NE(nullptr, secret);
+    EXPECT_TRUE(arena.Owns(secret));
+    memset(secret, 0xAA, 100);
+    arena.Free(secret, 100);
+
+    uint8_t* reused = static_cast<uint8_t*>(arena.Allocate(128));
+    EXPECT_EQ(secret, reused);
+    for (size_t i = sizeof(void*); i < 100; ++i) {
+        EXPECT_EQ(0, reused[i]) << "byte " << i;
+    }
+    arena.Free(reused, 128);
+}
+
+TEST(SecretArenaTest, RejectsOversizedAllocations) {
+    SecretArena arena;
+    EXPECT_EQ(nullptr, arena.Allocate(SecretArena::kMaxAllocation + 1));
+    EXPECT_EQ(0U, arena.stats().chunks);
+}
+
+TEST(SecretArenaTest, TracksHighWaterMark) {
+    SecretArena arena;
+    void* a = arena.Allocate(SecretArena::kMaxAllocation);
+    void* b = arena.Allocate(SecretArena::kMinAllocation);
+    ASSERT_NE(nullptr, a);
+    ASSERT_NE(nullptr, b);
+    size_t peak = SecretArena::kMaxAllocation + SecretArena::kMinAllocation;
+    EXPECT_EQ(peak, arena.stats().bytes_in_use);
+    EXPECT_EQ(2U, arena.stats().chunks);  // One per size class.
+
+    arena.Free(a, SecretArena::kMaxAllocation);
+    arena.Free(b, SecretArena::kMinAllocation);
+    EXPECT_EQ(0U, arena.stats().bytes_in_use);
+    EXPECT_EQ(peak, arena.stats().high_water_mark);
+}
+
+TEST(SecretArenaTest, DoesNotOwnHeapMemory) {
+    SecretArena arena;
+    UniquePtr<uint8_t[]> heap(new uint8_t[256]);
+    EXPECT_FALSE(arena.Owns(heap.get()));
+    EXPECT_FALSE(arena.Owns(nullptr));
+}
+
+TEST(SecretArenaTest, KeyBlobsLiveInDefaultArena) {
+    uint8_t material[200];
+    memset(material, 0x5C, sizeof(material));
+    KeymasterKeyBlob blob(material, sizeof(material));
+    ASSERT_EQ(sizeof(material), blob.size());
+    EXPECT_TRUE(IsSecretArray(blob.key_material));
+
+    KeymasterKeyBlob copy(blob);
+    EXPECT_TRUE(IsSecretArray(copy.key_material));
+    EXPECT_EQ(0, memcmp(material, copy.key_material, sizeof(material)));
+
+    // Released data must be freeable with delete[], so it moves to the heap.
+    keymaster_key_blob_t released = copy.release();
+    ASSERT_NE(nullptr, released.key_material);
+    EXPECT_FALSE(IsSecretArray(released.key_material));
+    EXPECT_EQ(0, memcmp(material, released.key_material, sizeof(material)));
+    delete[] released.key_material;
+}
+
+TEST(SecretArenaTest, OtherBlobsStayOnHeap) {
+    uint8_t data[200] = {};
+    KeymasterBlob blob(data, sizeof(data));
+    EXPECT_FALSE(IsSecretArray(blob.data));
+}
+
+#endif  // __linux__
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+
+namespace keymaster {
+namespace {
+
+void FillAuthorizations(AuthorizationSet* set, size_t count) {
+    static const uint8_t kData[64] = {};
+    for (size_t i = 0; i < count / 4; ++i) {
+        set->push_back(TAG_PURPOSE, KM_PURPOSE_SIGN);
+        set->push_back(TAG_USER_SECURE_ID, i);
+        set->push_back(TAG_APPLICATION_DATA, kData, sizeof(kData));
+        set->push_back(TAG_NO_AUTH_REQUIRED);
+    }
+}
+
+void FillResponse(GenerateKeyResponse* response, size_t authorization_count) {
+    static const uint8_t kCert[1024] = {};
+    response->error = KM_ERROR_OK;
+    response->key_blob = KeymasterKeyBlob(kCert, 256);
+    FillAuthorizations(&response->enforced, authorization_count);
+    FillAuthorizations(&response->unenforced, authorization_count);
+    response->certificate_chain = CertificateChain(3);
+    for (auto& entry : response->certificate_chain) {
+        entry = KeymasterBlob(kCert, sizeof(kCert)).release();
+    }
+}
+
+// Sizes and serializes the response the way a transport does.  With |invalidate| the sets are
+// touched first, so none of their sizes are memoized from a previous iteration.
+void SerializeResponse(benchmark::State& state, bool invalidate) {
+    GenerateKeyResponse response(kDefaultMessageVersion);
+    FillResponse(&response, state.range(0));
+    std::vector<uint8_t> buf;
+
+    for (auto _ : state) {
+        if (invalidate) {
+            response.enforced[0];
+            response.unenforced[0];
+        }
+        buf.resize(response.SerializedSize());
+        uint8_t* end = response.Serialize(buf.data(), buf.data() + buf.size());
+        benchmark::DoNotOptimize(end);
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+
+void BM_SerializeGenerateKeyResponse(benchmark::State& state) {
+    SerializeResponse(state, false /* invalidate */);
+}
+BENCHMARK(BM_SerializeGenerateKeyResponse)->Arg(8)->Arg(32)->Arg(128);
+
+void BM_SerializeModifiedGenerateKeyResponse(benchmark::State& state) {
+    SerializeResponse(state, true /* invalidate */);
+}
+BENCHMARK(BM_SerializeModifiedGenerateKeyResponse)->Arg(8)->Arg(32)->Arg(128);
+
+void BM_DeserializeGenerateKeyResponse(benchmark::State& state) {
+    GenerateKeyResponse response(kDefaultMessageVersion);
+    FillResponse(&response, state.range(0));
+    std::vector<uint8_t> buf(response.SerializedSize());
+    response.Serialize(buf.data(), buf.data() + buf.size());
+
+    for (auto _ : state) {
+        GenerateKeyResponse deserialized(kDefaultMessageVersion);
+        const uint8_t* p = buf.data();
+        benchmark::DoNotOptimize(deserialized.Deserialize(&p, buf.data() + buf.size()));
+    }
+    state.SetBytesProcessed(state.iterations() * buf.size());
+}
+BENCHMARK(BM_DeserializeGenerateKeyResponse)->Arg(8)->Arg(32)->Arg(128);
+
+}  // namespace
+}  // namespace keymaster
+
+BENCHMARK_MAIN();
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <keymaster/android_keymaster.h>
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+constexpr size_t kDataSize = 4096;
+// Block cipher operations want a block of room beyond their output.
+constexpr size_t kSlack = 16;
+
+class SharedMemoryOperationTest : public ::testing::Test {
+  protected:
+    SharedMemoryOperationTest()
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, 16 /* operation_table_size */, MessageVersion(kKmVersion)),
+          region_(4 * kDataSize) {
+        context_->SetSystemVersion(140000, 202310);
+        context_->SetVendorPatchlevel(20231001);
+        context_->SetBootPatchlevel(20231001);
+    }
+
+    void SetUp() override {
+        GenerateKeyRequest request(keymaster_.message_version());
+        AuthorizationSet description(AuthorizationSetBuilder()
+                                         .AesEncryptionKey(128)
+                                         .BlockMode(KM_MODE_CTR)
+                                         .Padding(KM_PAD_NONE)
+                                         .Authorization(TAG_NO_AUTH_REQUIRED));
+        request.key_description.Reinitialize(description);
+        GenerateKeyResponse response(keymaster_.message_version());
+        keymaster_.GenerateKey(request, &response);
+        ASSERT_EQ(KM_ERROR_OK, response.error);
+        key_blob_ = std::move(response.key_blob);
+
+        ASSERT_EQ(KM_ERROR_OK,
+                  keymaster_.RegisterSharedMemory(region_.data(), region_.size(), &region_id_));
+    }
+
+    keymaster_operation_handle_t Begin(keymaster_purpose_t purpose, AuthorizationSet* params) {
+        BeginOperationRequest request(keymaster_.message_version());
+        request.purpose = purpose;
+        request.SetKeyMaterial(key_blob_);
+        request.additional_params.Reinitialize(*params);
+        request.additional_params.push_back(TAG_BLOCK_MODE, KM_MODE_CTR);
+        request.additional_params.push_back(TAG_PADDING, KM_PAD_NONE);
+        BeginOperationResponse response(keymaster_.message_version());
+        keymaster_.BeginOperation(request, &response);
+        EXPECT_EQ(KM_ERROR_OK, response.error);
+        params->Reinitialize(response.output_params);
+        return response.op_handle;
+    }
+
+    keymaster_error_t Run(keymaster_operation_handle_t op_handle, bool finish,
+                          SharedMemorySpan input, SharedMemorySpan output,
+                          uint32_t* output_length = nullptr) {
+        SharedMemoryOperationRequest request(keymaster_.message_version());
+        request.op_handle = op_handle;
+        request.finish = finish;
+        request.region_id = region_id_;
+        request.input = input;
+        request.output = output;
+        SharedMemoryOperationResponse response(keymaster_.message_version());
+        keymaster_.SharedMemoryOperation(request, &response);
+        if (output_length) *output_length = response.output_length;
+        return response.error;
+    }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    AndroidKeymaster keymaster_;
+    KeymasterKeyBlob key_blob_;
+    std::vector<uint8_t> region_;
+    uint32_t region_id_;
+};
+
+TEST_F(SharedMemoryOperationTest, EncryptsAndDecryptsInRegion) {
+    for (size_t i = 0; i < kDataSize; ++i) region_[i] = static_cast<uint8_t>(i);
+
+    // Plaintext at the start of the region, ciphertext after it and decrypted text after that.
+    constexpr uint64_t kCiphertext = kDataSize;
+    constexpr uint64_t kDecrypted = 2 * kDataSize + kSlack;
+    constexpr uint32_t kHalf = kDataSize / 2;
+    AuthorizationSet params;
+    keymaster_operation_handle_t op_handle = Begin(KM_PURPOSE_ENCRYPT, &params);
+    uint32_t output_length;
+    ASSERT_EQ(KM_ERROR_OK,
+              Run(op_handle, false, {0, kHalf}, {kCiphertext, kHalf + kSlack}, &output_length));
+    ASSERT_EQ(kHalf, output_length);
+    ASSERT_EQ(KM_ERROR_OK, Run(op_handle, true, {kHalf, kHalf},
+                               {kCiphertext + kHalf, kHalf + kSlack}, &output_length));
+    ASSERT_EQ(kHalf, output_length);
+    EXPECT_NE(0, memcmp(region_.data(), region_.data() + kCiphertext, kDataSize));
+
+    op_handle = Begin(KM_PURPOSE_DECRYPT, &params);
+    ASSERT_EQ(KM_ERROR_OK, Run(op_handle, true, {kCiphertext, kDataSize},
+                               {kDecrypted, kDataSize + kSlack}, &output_length));
+    ASSERT_EQ(kDataSize, output_length);
+    EXPECT_EQ(0, memcmp(region_.data(), region_.data() + kDecrypted, kDataSize));
+}
+
+TEST_F(SharedMemoryOperationTest, RejectsBadSpans) {
+    AuthorizationSet params;
+    keymaster_operation_handle_t op_handle = Begin(KM_PURPOSE_ENCRYPT, &params);
+    // Past the end of the region.
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              Run(op_handle, false, {3 * kDataSize, 2 * kDataSize}, {0, kDataSize}));
+    // Overlapping.
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT,
+              Run(op_handle, false, {0, kDataSize}, {kDataSize / 2, kDataSize}));
+    EXPECT_TRUE(keymaster_.has_operation(op_handle));
+
+    ASSERT_EQ(KM_ERROR_OK, keymaster_.UnregisterSharedMemory(region_id_));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, Run(op_handle, false, {0, 16}, {kDataSize, 16}));
+    EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, keymaster_.UnregisterSharedMemory(region_id_));
+}
+
+TEST_F(SharedMemoryOperationTest, UnregisterWaitsForOperations) {
+    AuthorizationSet params;
+    keymaster_operation_handle_t op_handle = Begin(KM_PURPOSE_ENCRYPT, &params);
+    std::atomic<bool> unregistered(false);
+    std::atomic<size_t> runs(0);
+    std::thread worker([&] {
+        for (;;) {
+            bool after = unregistered.load();
+            keymaster_error_t error =
+                Run(op_handle, false, {0, kDataSize}, {kDataSize, kDataSize + kSlack});
+            ++runs;
+            if (after) {
+                // Nothing may use the region once UnregisterSharedMemory() has returned.
+                EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, error);
+                return;
+            }
+            if (error != KM_ERROR_OK) {
+                EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, error);
+                return;
+            }
+        }
+    });
+    while (runs.load() < 4) std::this_thread::yield();
+
+    ASSERT_EQ(KM_ERROR_OK, keymaster_.UnregisterSharedMemory(region_id_));
+    unregistered = true;
+    // The caller may unmap the region now; the worker must not touch it again.
+    region_.assign(region_.size(), 0xFF);
+    worker.join();
+}
+
+TEST_F(SharedMemoryOperationTest, ShortOutputAbortsOperation) {
+    AuthorizationSet params;
+    keymaster_operation_handle_t op_handle = Begin(KM_PURPOSE_ENCRYPT, &params);
+    EXPECT_EQ(KM_ERROR_INSUFFICIENT_BUFFER_SPACE,
+              Run(op_handle, false, {0, kDataSize}, {kDataSize, 16}));
+    EXPECT_FALSE(keymaster_.has_operation(op_handle));
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/km_openssl/software_random_source.h>
+
+#include <string.h>
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+TEST(SoftwareRandomSourceTest, SmallRequestsDiffer) {
+    SoftwareRandomSource random;
+    uint8_t first[12], second[12];
+    ASSERT_EQ(KM_ERROR_OK, random.GenerateRandom(first, sizeof(first)));
+    ASSERT_EQ(KM_ERROR_OK, random.GenerateRandom(second, sizeof(second)));
+    EXPECT_NE(0, memcmp(first, second, sizeof(first)));
+}
+
+TEST(SoftwareRandomSourceTest, LargeRequest) {
+    SoftwareRandomSource random;
+    // Bigger than a single CTR_DRBG_generate() call.
+    std::vector<uint8_t> bytes(100 * 1024);
+    ASSERT_EQ(KM_ERROR_OK, random.GenerateRandom(bytes.data(), bytes.size()));
+    std::vector<uint8_t> zeroes(64);
+    EXPECT_NE(0, memcmp(zeroes.data(), bytes.data() + bytes.size() - zeroes.size(), zeroes.size()));
+}
+
+TEST(SoftwareRandomSourceTest, ThreadsDiffer) {
+    SoftwareRandomSource random;
+    uint8_t here[16], there[16];
+    ASSERT_EQ(KM_ERROR_OK, random.GenerateRandom(here, sizeof(here)));
+    keymaster_error_t error = KM_ERROR_UNKNOWN_ERROR;
+    std::thread([&] { error = random.GenerateRandom(there, sizeof(there)); }).join();
+    ASSERT_EQ(KM_ERROR_OK, error);
+    EXPECT_NE(0, memcmp(here, there, sizeof(here)));
+}
+
+TEST(SoftwareRandomSourceTest, AddEntropy) {
+    SoftwareRandomSource random;
+    uint8_t before[8], after[8];
+    ASSERT_EQ(KM_ERROR_OK, random.GenerateRandom(before, sizeof(before)));
+    const uint8_t entropy[] = "caller-supplied entropy";
+    ASSERT_EQ(KM_ERROR_OK, random.AddEntropy(entropy, sizeof(entropy)));
+    ASSERT_EQ(KM_ERROR_OK, random.GenerateRandom(after, sizeof(after)));
+    EXPECT_NE(0, memcmp(before, after, sizeof(before)));
+}
+
+}  // namespace test
+}  // namespace keymaster
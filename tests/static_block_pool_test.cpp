@@ -0,0 +1,107 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/static_block_pool.h>
+
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+class StaticBlockPoolTest : public testing::Test {
+  protected:
+    StaticBlockPoolTest()
+        : classes_{small_.size_class(), large_.size_class()}, pool_(classes_, 2) {}
+
+    StaticBlocks<64, 4> small_;
+    StaticBlocks<1024, 2> large_;
+    StaticBlockPool::SizeClass classes_[2];
+    StaticBlockPool pool_;
+};
+
+TEST_F(StaticBlockPoolTest, SmallestClassThatFits) {
+    void* small = pool_.Allocate(10);
+    void* large = pool_.Allocate(65);
+    ASSERT_NE(nullptr, small);
+    ASSERT_NE(nullptr, large);
+    EXPECT_TRUE(small >= small_.storage && small < small_.storage + sizeof(small_.storage));
+    EXPECT_TRUE(large >= large_.storage && large < large_.storage + sizeof(large_.storage));
+    EXPECT_EQ(nullptr, pool_.Allocate(1025));
+    EXPECT_EQ(1024U, pool_.max_allocation());
+
+    StaticBlockPool::Stats stats;
+    pool_.GetStats(&stats);
+    EXPECT_EQ(1U, stats.in_use[0]);
+    EXPECT_EQ(1U, stats.in_use[1]);
+    EXPECT_EQ(1U, stats.failures);
+
+    pool_.Free(small);
+    pool_.Free(large);
+    pool_.GetStats(&stats);
+    EXPECT_EQ(0U, stats.in_use[0]);
+    EXPECT_EQ(1U, stats.high_water_mark[0]);
+}
+
+TEST_F(StaticBlockPoolTest, SpillsToLargerClassThenFails) {
+    std::vector<void*> blocks;
+    while (void* block = pool_.Allocate(8)) blocks.push_back(block);
+    EXPECT_EQ(6U, blocks.size());
+
+    StaticBlockPool::Stats stats;
+    pool_.GetStats(&stats);
+    EXPECT_EQ(4U, stats.in_use[0]);
+    EXPECT_EQ(2U, stats.in_use[1]);
+    EXPECT_EQ(1U, stats.failures);
+
+    // A freed block is reused, and comes back zeroed.
+    memset(blocks[0], 0xaa, 8);
+    pool_.Free(blocks[0]);
+    uint8_t* reused = static_cast<uint8_t*>(pool_.Allocate(8));
+    EXPECT_EQ(blocks[0], reused);
+    for (size_t i = sizeof(void*); i < 64; ++i) EXPECT_EQ(0, reused[i]);
+    blocks[0] = reused;
+
+    for (void* block : blocks) pool_.Free(block);
+    pool_.GetStats(&stats);
+    EXPECT_EQ(0U, stats.in_use[0]);
+    EXPECT_EQ(0U, stats.in_use[1]);
+}
+
+TEST_F(StaticBlockPoolTest, Owns) {
+    void* block = pool_.Allocate(100);
+    EXPECT_TRUE(pool_.Owns(block));
+    uint8_t elsewhere[64];
+    EXPECT_FALSE(pool_.Owns(elsewhere));
+    EXPECT_FALSE(pool_.Owns(nullptr));
+    // Blocks that aren't the pool's are ignored.
+    pool_.Free(elsewhere);
+    pool_.Free(block);
+}
+
+TEST(StaticBlockPoolConfigTest, IgnoresMisalignedClasses) {
+    static StaticBlocks<64, 2> blocks;
+    StaticBlockPool::SizeClass classes[] = {{40, 2, blocks.storage}, {64, 1, blocks.storage + 1}};
+    StaticBlockPool pool(classes, 2);
+    EXPECT_EQ(0U, pool.max_allocation());
+    EXPECT_EQ(nullptr, pool.Allocate(1));
+}
+
+}  // namespace test
+}  // namespace keymaster
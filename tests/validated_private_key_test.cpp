@@ -0,0 +1,108 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include <string.h>
+
+#include <keymaster/android_keymaster_utils.h>
+#include <keymaster/km_openssl/openssl_utils.h>
+
+#include <gtest/gtest.h>
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+#include <openssl/evp.h>
+#include <openssl/nid.h>
+#include <openssl/rsa.h>
+
+namespace keymaster {
+namespace test {
+
+static EVP_PKEY* GenerateRsaKey() {
+    RSA_Ptr rsa(RSA_new());
+    BIGNUM_Ptr exponent(BN_new());
+    if (!rsa || !exponent || !BN_set_word(exponent.get(), RSA_F4) ||
+        !RSA_generate_key_ex(rsa.get(), 2048, exponent.get(), nullptr /* callback */)) {
+        return nullptr;
+    }
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    if (!pkey || !EVP_PKEY_set1_RSA(pkey.get(), rsa.get())) return nullptr;
+    return pkey.release();
+}
+
+static EVP_PKEY* GenerateEcKey(int nid) {
+    EC_KEY_Ptr ec_key(EC_KEY_new_by_curve_name(nid));
+    if (!ec_key || !EC_KEY_generate_key(ec_key.get())) return nullptr;
+    EVP_PKEY_Ptr pkey(EVP_PKEY_new());
+    if (!pkey || !EVP_PKEY_set1_EC_KEY(pkey.get(), ec_key.get())) return nullptr;
+    return pkey.release();
+}
+
+// Parses |pkey|'s key material without checks and expects exactly the same key back.
+static void ExpectRoundTrip(EVP_PKEY* pkey) {
+    KeymasterKeyBlob material;
+    ASSERT_EQ(KM_ERROR_OK, EvpKeyToKeyMaterial(pkey, &material));
+
+    EVP_PKEY_Ptr parsed;
+    ASSERT_EQ(KM_ERROR_OK, ParseValidatedPrivateKey(EVP_PKEY_id(pkey), material, &parsed));
+    EXPECT_EQ(1, EVP_PKEY_cmp(pkey, parsed.get()));
+
+    KeymasterKeyBlob reencoded;
+    ASSERT_EQ(KM_ERROR_OK, EvpKeyToKeyMaterial(parsed.get(), &reencoded));
+    ASSERT_EQ(material.size(), reencoded.size());
+    EXPECT_EQ(0, memcmp(material.begin(), reencoded.begin(), material.size()));
+}
+
+TEST(ParseValidatedPrivateKeyTest, Rsa) {
+    EVP_PKEY_Ptr pkey(GenerateRsaKey());
+    ASSERT_TRUE(pkey);
+    ExpectRoundTrip(pkey.get());
+}
+
+TEST(ParseValidatedPrivateKeyTest, Ec) {
+    for (int nid : {NID_secp224r1, NID_X9_62_prime256v1, NID_secp384r1, NID_secp521r1}) {
+        EVP_PKEY_Ptr pkey(GenerateEcKey(nid));
+        ASSERT_TRUE(pkey);
+        ExpectRoundTrip(pkey.get());
+    }
+}
+
+TEST(ParseValidatedPrivateKeyTest, EcWithoutPublicKeyFallsBack) {
+    EVP_PKEY_Ptr pkey(GenerateEcKey(NID_X9_62_prime256v1));
+    ASSERT_TRUE(pkey);
+    EC_KEY* ec_key = EVP_PKEY_get0_EC_KEY(pkey.get());
+    EC_KEY_set_enc_flags(ec_key, EC_PKEY_NO_PUBKEY);
+    KeymasterKeyBlob material;
+    ASSERT_EQ(KM_ERROR_OK, EvpKeyToKeyMaterial(pkey.get(), &material));
+
+    // The full parse recomputes the public key.
+    EVP_PKEY_Ptr parsed;
+    ASSERT_EQ(KM_ERROR_OK, ParseValidatedPrivateKey(EVP_PKEY_EC, material, &parsed));
+    EXPECT_EQ(1, EVP_PKEY_cmp(pkey.get(), parsed.get()));
+}
+
+TEST(ParseValidatedPrivateKeyTest, RejectsTruncatedMaterial) {
+    EVP_PKEY_Ptr pkey(GenerateEcKey(NID_X9_62_prime256v1));
+    ASSERT_TRUE(pkey);
+    KeymasterKeyBlob material;
+    ASSERT_EQ(KM_ERROR_OK, EvpKeyToKeyMaterial(pkey.get(), &material));
+    material.key_material_size -= 1;
+
+    EVP_PKEY_Ptr parsed;
+    EXPECT_NE(KM_ERROR_OK, ParseValidatedPrivateKey(EVP_PKEY_EC, material, &parsed));
+}
+
+}  // namespace test
+}  // namespace keymaster
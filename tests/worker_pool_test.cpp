@@ -0,0 +1,101 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <keymaster/worker_pool.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace keymaster {
+namespace test {
+
+TEST(WorkerPoolTest, RunInParallelRunsEveryItemOnce) {
+    ThreadWorkerPool::Config config;
+    config.thread_count = 4;
+    ThreadWorkerPool pool(config);
+
+    constexpr size_t kItems = 1000;
+    std::vector<std::atomic<int>> visits(kItems);
+    std::atomic<size_t> next(0);
+    RunInParallel(&pool, 8, [&]() {
+        for (size_t i; (i = next.fetch_add(1)) < kItems;) ++visits[i];
+    });
+    for (size_t i = 0; i < kItems; ++i) EXPECT_EQ(1, visits[i].load()) << "item " << i;
+}
+
+TEST(WorkerPoolTest, NullPoolRunsOnCallingThread) {
+    size_t calls = 0;
+    std::thread::id caller;
+    RunInParallel(nullptr /* pool */, 4, [&]() {
+        ++calls;
+        caller = std::this_thread::get_id();
+    });
+    EXPECT_EQ(1U, calls);
+    EXPECT_EQ(std::this_thread::get_id(), caller);
+}
+
+TEST(WorkerPoolTest, RunInParallelFromPoolTaskCompletes) {
+    // With the pool's only thread busy running the outer task, the inner copies never start and
+    // the outer task does all the work itself.
+    ThreadWorkerPool::Config config;
+    config.thread_count = 1;
+    ThreadWorkerPool pool(config);
+
+    std::mutex mutex;
+    std::condition_variable done;
+    bool finished = false;
+    std::atomic<size_t> items(0);
+    ASSERT_TRUE(pool.Submit([&]() {
+        std::atomic<size_t> next(0);
+        RunInParallel(&pool, 4, [&]() {
+            while (next.fetch_add(1) < 100) ++items;
+        });
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        done.notify_all();
+    }));
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return finished; });
+    EXPECT_EQ(100U, items.load());
+}
+
+TEST(WorkerPoolTest, DestructionRunsQueuedTasks) {
+    std::atomic<int> runs(0);
+    {
+        ThreadWorkerPool::Config config;
+        config.thread_count = 1;
+        ThreadWorkerPool pool(config);
+        for (int i = 0; i < 10; ++i) {
+            ASSERT_TRUE(pool.Submit([&]() { ++runs; }));
+        }
+    }
+    EXPECT_EQ(10, runs.load());
+}
+
+TEST(WorkerPoolTest, ThreadCountDefaultsToCores) {
+    ThreadWorkerPool pool;
+    size_t cores = std::thread::hardware_concurrency();
+    EXPECT_EQ(cores ? cores : 1, pool.thread_count());
+}
+
+}  // namespace test
+}  // namespace keymaster
@@ -123,5 +123,45 @@ TEST(WrappedKeyTest, Unwrap) {
     EXPECT_EQ(keyblob2string(secure_key), test_secure_key);
 }
 
+TEST(WrappedKeyTest, ViewsPointIntoInput) {
+    KeymasterKeyBlob wrapped_key = {reinterpret_cast<const uint8_t*>(test_wrapped_key.c_str()),
+                                    test_wrapped_key.size()};
+    const uint8_t* begin = wrapped_key.begin();
+    const uint8_t* end = wrapped_key.end();
+
+    WrappedKeyView view;
+    ASSERT_EQ(KM_ERROR_OK, parse_wrapped_key(wrapped_key, &view));
+    for (const keymaster_blob_t& field :
+         {view.transit_key, view.iv, view.wrapped_key_description, view.auth_list,
+          view.secure_key, view.tag}) {
+        EXPECT_GE(field.data, begin);
+        EXPECT_LE(field.data + field.data_length, end);
+    }
+
+    EXPECT_EQ(blob2string(view.transit_key), test_transit_key);
+    EXPECT_EQ(blob2string(view.iv), test_iv);
+    EXPECT_EQ(blob2string(view.secure_key), test_secure_key);
+    EXPECT_EQ(blob2string(view.tag), test_tag);
+    EXPECT_EQ(KM_KEY_FORMAT_RAW, view.key_format);
+    // The description is passed through as it was encoded, since it's the GCM additional data.
+    EXPECT_EQ(blob2string(view.wrapped_key_description),
+              hex2str("3013020103300EA1023100A203020120A303020120"));
+
+    AuthorizationSet auth_list;
+    ASSERT_EQ(KM_ERROR_OK, parse_wrapped_key_auth_list(view, &auth_list));
+    keymaster_algorithm_t algorithm;
+    ASSERT_TRUE(auth_list.GetTagValue(TAG_ALGORITHM, &algorithm));
+    EXPECT_EQ(KM_ALGORITHM_AES, algorithm);
+}
+
+TEST(WrappedKeyTest, TruncatedRejected) {
+    WrappedKeyView view;
+    for (size_t length = 0; length < test_wrapped_key.size(); length += 7) {
+        KeymasterKeyBlob wrapped_key = {
+            reinterpret_cast<const uint8_t*>(test_wrapped_key.c_str()), length};
+        EXPECT_EQ(KM_ERROR_INVALID_ARGUMENT, parse_wrapped_key(wrapped_key, &view)) << length;
+    }
+}
+
 }  // namespace test
 }  // namespace keymaster
@@ -0,0 +1,343 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// keymaster_loadgen drives a ConcurrentAndroidKeymaster backed by a PureSoftKeymasterContext from
+// several threads at once, each picking operations at random from a weighted mix, and reports the
+// throughput and latency percentiles of each operation type.
+//
+//   keymaster_loadgen [--threads=N] [--seconds=S] [--input_bytes=B] [--mix=TYPE:WEIGHT,...]
+//
+// TYPE is one of hmac, aes_gcm and ecdsa, each a complete begin/update/finish over B bytes,
+// generate, which generates a P-256 key, and attest, which attests one.  Weights are relative.
+// The default mix is hmac:70,aes_gcm:20,ecdsa:10,generate:1,attest:1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/concurrent_android_keymaster.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+
+namespace keymaster {
+namespace {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+constexpr uint32_t kOsVersion = 140000;
+constexpr uint32_t kOsPatchlevel = 202310;
+
+enum OpType : size_t {
+    HMAC_SIGN,
+    AES_GCM_ENCRYPT,
+    ECDSA_SIGN,
+    GENERATE_KEY,
+    ATTEST_KEY,
+};
+
+constexpr size_t kOpTypeCount = ATTEST_KEY + 1;
+const char* const kOpTypeNames[kOpTypeCount] = {"hmac", "aes_gcm", "ecdsa", "generate", "attest"};
+constexpr char kDefaultMix[] = "hmac:70,aes_gcm:20,ecdsa:10,generate:1,attest:1";
+
+struct Options {
+    size_t threads = 4;
+    unsigned seconds = 10;
+    size_t input_bytes = 256;
+    unsigned weights[kOpTypeCount] = {};
+};
+
+// Parses "type:weight,..." into |weights|, which are zero for types not listed.
+bool ParseMix(const char* mix, unsigned* weights) {
+    std::fill(weights, weights + kOpTypeCount, 0);
+    unsigned total = 0;
+    std::string rest(mix);
+    while (!rest.empty()) {
+        size_t comma = rest.find(',');
+        std::string entry = rest.substr(0, comma);
+        rest = comma == std::string::npos ? "" : rest.substr(comma + 1);
+
+        size_t colon = entry.find(':');
+        if (colon == std::string::npos) return false;
+        std::string name = entry.substr(0, colon);
+        char* end;
+        unsigned long weight = strtoul(entry.c_str() + colon + 1, &end, 10);
+        if (*end || weight > 1000000) return false;
+
+        size_t type = 0;
+        while (type < kOpTypeCount && name != kOpTypeNames[type]) ++type;
+        if (type == kOpTypeCount) return false;
+        weights[type] = weight;
+        total += weight;
+    }
+    return total > 0;
+}
+
+bool ParseSize(const char* arg, const char* name, size_t* value) {
+    size_t name_length = strlen(name);
+    if (strncmp(arg, name, name_length) || arg[name_length] != '=') return false;
+    char* end;
+    *value = strtoull(arg + name_length + 1, &end, 10);
+    return !*end;
+}
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+    if (!ParseMix(kDefaultMix, options->weights)) return false;
+    for (int i = 1; i < argc; ++i) {
+        size_t value;
+        if (ParseSize(argv[i], "--threads", &value) && value > 0) {
+            options->threads = value;
+        } else if (ParseSize(argv[i], "--seconds", &value) && value > 0) {
+            options->seconds = value;
+        } else if (ParseSize(argv[i], "--input_bytes", &value)) {
+            options->input_bytes = value;
+        } else if (!strncmp(argv[i], "--mix=", 6)) {
+            if (!ParseMix(argv[i] + 6, options->weights)) return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+AuthorizationSet HmacKeyParams() {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .HmacKey(256)
+                                .Digest(KM_DIGEST_SHA_2_256)
+                                .Authorization(TAG_MIN_MAC_LENGTH, 256));
+}
+
+AuthorizationSet AesGcmKeyParams() {
+    return AuthorizationSet(AuthorizationSetBuilder()
+                                .AesEncryptionKey(256)
+                                .BlockMode(KM_MODE_GCM)
+                                .Padding(KM_PAD_NONE)
+                                .Authorization(TAG_MIN_MAC_LENGTH, 128));
+}
+
+AuthorizationSet EcdsaKeyParams() {
+    return AuthorizationSet(
+        AuthorizationSetBuilder().EcdsaSigningKey(256).Digest(KM_DIGEST_SHA_2_256));
+}
+
+class LoadTarget {
+  public:
+    explicit LoadTarget(size_t operation_table_size)
+        : context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, operation_table_size, MessageVersion(kKmVersion)) {
+        context_->SetSystemVersion(kOsVersion, kOsPatchlevel);
+        context_->SetVendorPatchlevel(kOsPatchlevel * 100 + 1);
+        context_->SetBootPatchlevel(kOsPatchlevel * 100 + 1);
+    }
+
+    // Generates the keys the operations use.
+    keymaster_error_t Init() {
+        keymaster_error_t error = GenerateKey(HmacKeyParams(), &hmac_key_);
+        if (error != KM_ERROR_OK) return error;
+        error = GenerateKey(AesGcmKeyParams(), &aes_key_);
+        if (error != KM_ERROR_OK) return error;
+        return GenerateKey(EcdsaKeyParams(), &ecdsa_key_);
+    }
+
+    keymaster_error_t Run(OpType type, const Buffer& input) {
+        switch (type) {
+        case HMAC_SIGN:
+            return RunOperation(hmac_key_, KM_PURPOSE_SIGN, hmac_begin_params_, input);
+        case AES_GCM_ENCRYPT:
+            return RunOperation(aes_key_, KM_PURPOSE_ENCRYPT, aes_begin_params_, input);
+        case ECDSA_SIGN:
+            return RunOperation(ecdsa_key_, KM_PURPOSE_SIGN, ecdsa_begin_params_, input);
+        case GENERATE_KEY: {
+            KeymasterKeyBlob key_blob;
+            return GenerateKey(EcdsaKeyParams(), &key_blob);
+        }
+        case ATTEST_KEY:
+            return AttestKey(ecdsa_key_);
+        }
+        return KM_ERROR_UNIMPLEMENTED;
+    }
+
+  private:
+    keymaster_error_t GenerateKey(const AuthorizationSet& params, KeymasterKeyBlob* key_blob) {
+        GenerateKeyRequest request(keymaster_.message_version());
+        request.key_description.Reinitialize(params);
+        request.key_description.push_back(TAG_NO_AUTH_REQUIRED);
+        request.key_description.push_back(TAG_CERTIFICATE_NOT_BEFORE, 0);
+        request.key_description.push_back(TAG_CERTIFICATE_NOT_AFTER, kUndefinedExpirationDateTime);
+        GenerateKeyResponse response(keymaster_.message_version());
+        keymaster_.GenerateKey(request, &response);
+        if (response.error == KM_ERROR_OK) *key_blob = std::move(response.key_blob);
+        return response.error;
+    }
+
+    keymaster_error_t AttestKey(const KeymasterKeyBlob& key_blob) {
+        AttestKeyRequest request(keymaster_.message_version());
+        request.SetKeyMaterial(key_blob);
+        request.attest_params.push_back(TAG_ATTESTATION_CHALLENGE, "challenge", 9);
+        request.attest_params.push_back(TAG_ATTESTATION_APPLICATION_ID, "loadgen", 7);
+        AttestKeyResponse response(keymaster_.message_version());
+        keymaster_.AttestKey(request, &response);
+        return response.error;
+    }
+
+    // Runs one complete operation, feeding |input| to a single Update() and nothing to Finish().
+    keymaster_error_t RunOperation(const KeymasterKeyBlob& key_blob, keymaster_purpose_t purpose,
+                                   const AuthorizationSet& begin_params, const Buffer& input) {
+        int32_t message_version = keymaster_.message_version();
+        BeginOperationRequest begin_request(message_version);
+        begin_request.purpose = purpose;
+        begin_request.SetKeyMaterial(key_blob);
+        begin_request.additional_params.Reinitialize(begin_params);
+        BeginOperationResponse begin_response(message_version);
+        keymaster_.BeginOperation(begin_request, &begin_response);
+        if (begin_response.error != KM_ERROR_OK) return begin_response.error;
+
+        UpdateOperationRequest update_request(message_version);
+        update_request.op_handle = begin_response.op_handle;
+        update_request.input.Reinitialize(input.peek_read(), input.available_read());
+        UpdateOperationResponse update_response(message_version);
+        keymaster_.UpdateOperation(update_request, &update_response);
+        if (update_response.error != KM_ERROR_OK) return update_response.error;
+
+        FinishOperationRequest finish_request(message_version);
+        finish_request.op_handle = begin_response.op_handle;
+        FinishOperationResponse finish_response(message_version);
+        keymaster_.FinishOperation(finish_request, &finish_response);
+        return finish_response.error;
+    }
+
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    ConcurrentAndroidKeymaster keymaster_;
+    KeymasterKeyBlob hmac_key_;
+    KeymasterKeyBlob aes_key_;
+    KeymasterKeyBlob ecdsa_key_;
+    const AuthorizationSet hmac_begin_params_{
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256).Authorization(TAG_MAC_LENGTH, 256)};
+    const AuthorizationSet aes_begin_params_{AuthorizationSetBuilder()
+                                                 .BlockMode(KM_MODE_GCM)
+                                                 .Padding(KM_PAD_NONE)
+                                                 .Authorization(TAG_MAC_LENGTH, 128)};
+    const AuthorizationSet ecdsa_begin_params_{
+        AuthorizationSetBuilder().Digest(KM_DIGEST_SHA_2_256)};
+};
+
+// What one thread saw of each operation type.
+struct ThreadResults {
+    std::vector<uint64_t> latencies_ns[kOpTypeCount];
+    size_t errors[kOpTypeCount] = {};
+};
+
+void RunThread(LoadTarget* target, const Options& options, size_t thread_index,
+               const std::atomic<bool>* stop, ThreadResults* results) {
+    std::vector<uint8_t> data(options.input_bytes, 'a');
+    Buffer input(data.data(), data.size());
+    std::mt19937 rng(thread_index + 1);
+    std::discrete_distribution<size_t> pick(options.weights, options.weights + kOpTypeCount);
+
+    while (!stop->load(std::memory_order_relaxed)) {
+        OpType type = static_cast<OpType>(pick(rng));
+        auto start = std::chrono::steady_clock::now();
+        keymaster_error_t error = target->Run(type, input);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        if (error != KM_ERROR_OK) {
+            ++results->errors[type];
+            continue;
+        }
+        results->latencies_ns[type].push_back(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+}
+
+double PercentileUs(const std::vector<uint64_t>& sorted, unsigned per_mille) {
+    if (sorted.empty()) return 0;
+    size_t index = std::min(sorted.size() - 1, sorted.size() * per_mille / 1000);
+    return sorted[index] / 1000.0;
+}
+
+void Report(const Options& options, std::vector<ThreadResults>* results, double elapsed_s) {
+    printf("%zu threads, %.1f s, %zu input bytes\n\n", options.threads, elapsed_s,
+           options.input_bytes);
+    printf("%-10s %10s %8s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/s", "p50_us",
+           "p99_us", "p999_us");
+
+    size_t total_count = 0;
+    for (size_t type = 0; type < kOpTypeCount; ++type) {
+        if (!options.weights[type]) continue;
+        std::vector<uint64_t> latencies;
+        size_t errors = 0;
+        for (auto& thread_results : *results) {
+            auto& thread_latencies = thread_results.latencies_ns[type];
+            latencies.insert(latencies.end(), thread_latencies.begin(), thread_latencies.end());
+            errors += thread_results.errors[type];
+        }
+        std::sort(latencies.begin(), latencies.end());
+        total_count += latencies.size();
+        printf("%-10s %10zu %8zu %10.1f %10.1f %10.1f %10.1f\n", kOpTypeNames[type],
+               latencies.size(), errors, latencies.size() / elapsed_s,
+               PercentileUs(latencies, 500), PercentileUs(latencies, 990),
+               PercentileUs(latencies, 999));
+    }
+    printf("%-10s %10zu %8s %10.1f\n", "total", total_count, "", total_count / elapsed_s);
+}
+
+int Main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, &options)) {
+        fprintf(stderr,
+                "usage: %s [--threads=N] [--seconds=S] [--input_bytes=B] "
+                "[--mix=TYPE:WEIGHT,...]\n  TYPE is hmac, aes_gcm, ecdsa, generate or attest; "
+                "default mix %s\n",
+                argv[0], kDefaultMix);
+        return 2;
+    }
+
+    // Room for every thread's operation, with some to spare.
+    LoadTarget target(options.threads * 2);
+    keymaster_error_t error = target.Init();
+    if (error != KM_ERROR_OK) {
+        fprintf(stderr, "Generating keys failed: %d\n", error);
+        return 1;
+    }
+
+    std::atomic<bool> stop{false};
+    std::vector<ThreadResults> results(options.threads);
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < options.threads; ++i) {
+        threads.emplace_back(RunThread, &target, std::cref(options), i, &stop, &results[i]);
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(options.seconds));
+    stop = true;
+    for (auto& thread : threads) thread.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    Report(options, &results, elapsed.count());
+    return 0;
+}
+
+}  // namespace
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    return keymaster::Main(argc, argv);
+}
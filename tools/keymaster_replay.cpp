@@ -0,0 +1,603 @@
+/*
+ * Copyright 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// keymaster_replay drives a ConcurrentAndroidKeymaster backed by a PureSoftKeymasterContext with a
+// trace written by RequestTraceWriter, sending each request at its recorded arrival time, and
+// reports per-command latency against the recorded latencies or those of an earlier replay:
+//
+//   keymaster_replay [--threads=N] [--speed=X] [--baseline=FILE] [--save=FILE] TRACE
+//
+// The trace's keys are replaced by synthetic ones, generated from the recorded key descriptions
+// or characteristics with user authentication and usage limits removed; imported raw symmetric
+// keys get random material and other imports are generated instead.  Input data is synthetic too,
+// so decryptions and verifications fail where the originals succeeded.  That costs about as much
+// as succeeding and is the same from one build to the next, which is what the comparison needs;
+// such requests are counted as diverged.
+//
+// Requests of one operation run in order on one of N threads (default 1).  --speed scales the
+// recorded inter-arrival times; 0 sends every request as soon as the last one on its thread is
+// done.  --save writes the replay's latencies in the format --baseline reads.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <keymaster/android_keymaster_messages.h>
+#include <keymaster/authorization_set.h>
+#include <keymaster/concurrent_android_keymaster.h>
+#include <keymaster/contexts/pure_soft_keymaster_context.h>
+#include <keymaster/request_trace.h>
+
+namespace keymaster {
+namespace {
+
+constexpr KmVersion kKmVersion = KmVersion::KEYMINT_3;
+constexpr uint32_t kOsVersion = 140000;
+constexpr uint32_t kOsPatchlevel = 202310;
+
+struct Options {
+    size_t threads = 1;
+    double speed = 1;
+    std::string baseline;
+    std::string save;
+    std::string trace;
+};
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        char* end = nullptr;
+        if (!strncmp(arg, "--threads=", 10)) {
+            options->threads = strtoull(arg + 10, &end, 10);
+            if (*end || options->threads == 0) return false;
+        } else if (!strncmp(arg, "--speed=", 8)) {
+            options->speed = strtod(arg + 8, &end);
+            if (*end || options->speed < 0) return false;
+        } else if (!strncmp(arg, "--baseline=", 11)) {
+            options->baseline = arg + 11;
+        } else if (!strncmp(arg, "--save=", 7)) {
+            options->save = arg + 7;
+        } else if (arg[0] == '-' || !options->trace.empty()) {
+            return false;
+        } else {
+            options->trace = arg;
+        }
+    }
+    return !options->trace.empty();
+}
+
+const char* CommandName(AndroidKeymasterCommand command) {
+    switch (command) {
+    case GENERATE_KEY:
+        return "generate";
+    case IMPORT_KEY:
+        return "import";
+    case BEGIN_OPERATION:
+        return "begin";
+    case UPDATE_OPERATION:
+        return "update";
+    case FINISH_OPERATION:
+        return "finish";
+    case ABORT_OPERATION:
+        return "abort";
+    case ATTEST_KEY:
+        return "attest";
+    case GET_KEY_CHARACTERISTICS:
+        return "get_chars";
+    case EXPORT_KEY:
+        return "export";
+    case UPGRADE_KEY:
+        return "upgrade";
+    case DELETE_KEY:
+        return "delete";
+    default:
+        return nullptr;
+    }
+}
+
+// Turns a recorded key description or set of characteristics into one the replay can generate
+// and then use without auth tokens, and as often as the trace does.
+AuthorizationSet SyntheticKeyDescription(const AuthorizationSet& recorded) {
+    static const keymaster_tag_t kDropped[] = {
+        // Added by the implementation.
+        KM_TAG_ORIGIN,
+        KM_TAG_OS_VERSION,
+        KM_TAG_OS_PATCHLEVEL,
+        KM_TAG_VENDOR_PATCHLEVEL,
+        KM_TAG_BOOT_PATCHLEVEL,
+        KM_TAG_CREATION_DATETIME,
+        KM_TAG_ROOT_OF_TRUST,
+        KM_TAG_UNIQUE_ID,
+        // Need tokens, user presence or device state the replay can't provide.
+        KM_TAG_USER_SECURE_ID,
+        KM_TAG_USER_AUTH_TYPE,
+        KM_TAG_AUTH_TIMEOUT,
+        KM_TAG_ALLOW_WHILE_ON_BODY,
+        KM_TAG_TRUSTED_USER_PRESENCE_REQUIRED,
+        KM_TAG_TRUSTED_CONFIRMATION_REQUIRED,
+        KM_TAG_UNLOCKED_DEVICE_REQUIRED,
+        KM_TAG_EARLY_BOOT_ONLY,
+        KM_TAG_ROLLBACK_RESISTANCE,
+        // Would stop the key being used as often, or as late, as the trace uses it.
+        KM_TAG_USAGE_COUNT_LIMIT,
+        KM_TAG_MAX_USES_PER_BOOT,
+        KM_TAG_MIN_SECONDS_BETWEEN_OPS,
+        KM_TAG_ACTIVE_DATETIME,
+        KM_TAG_ORIGINATION_EXPIRE_DATETIME,
+        KM_TAG_USAGE_EXPIRE_DATETIME,
+    };
+    AuthorizationSet description;
+    for (const auto& param : recorded) {
+        if (std::find(std::begin(kDropped), std::end(kDropped), param.tag) == std::end(kDropped)) {
+            description.push_back(param);
+        }
+    }
+    if (!description.Contains(TAG_NO_AUTH_REQUIRED)) description.push_back(TAG_NO_AUTH_REQUIRED);
+
+    keymaster_algorithm_t algorithm;
+    if (description.GetTagValue(TAG_ALGORITHM, &algorithm) &&
+        (algorithm == KM_ALGORITHM_RSA || algorithm == KM_ALGORITHM_EC)) {
+        if (!description.Contains(TAG_CERTIFICATE_NOT_BEFORE)) {
+            description.push_back(TAG_CERTIFICATE_NOT_BEFORE, 0);
+        }
+        if (!description.Contains(TAG_CERTIFICATE_NOT_AFTER)) {
+            description.push_back(TAG_CERTIFICATE_NOT_AFTER, kUndefinedExpirationDateTime);
+        }
+    }
+    return description;
+}
+
+// What became of one record.
+struct Result {
+    bool replayed = false;
+    keymaster_error_t error = KM_ERROR_OK;
+    uint64_t latency_ns = 0;
+};
+
+class Replayer {
+  public:
+    Replayer(const std::vector<TraceRecord>& records, int32_t message_version,
+             size_t operation_table_size)
+        : records_(records), context_(new PureSoftKeymasterContext(kKmVersion)),
+          keymaster_(context_, operation_table_size, message_version) {
+        context_->SetSystemVersion(kOsVersion, kOsPatchlevel);
+        context_->SetVendorPatchlevel(kOsPatchlevel * 100 + 1);
+        context_->SetBootPatchlevel(kOsPatchlevel * 100 + 1);
+
+        for (size_t i = 0; i < records_.size(); ++i) {
+            const TraceRecord& record = records_[i];
+            if (record.created_key_id) keys_.emplace(record.created_key_id, Key{i});
+            if (record.key_id && !record.key_characteristics.empty()) {
+                characteristics_.emplace(record.key_id, &record.key_characteristics);
+            }
+        }
+    }
+
+    // Replays record |index|.  |operations| maps the op ids of the calling thread's records to
+    // live handles.
+    Result Replay(size_t index, std::map<uint32_t, keymaster_operation_handle_t>* operations);
+
+  private:
+    struct Key {
+        explicit Key(size_t creator = SIZE_MAX) : creator(creator) {}
+        // The record that creates the key, or SIZE_MAX if the trace only uses it.
+        size_t creator;
+        bool done = false;
+        KeymasterKeyBlob blob;  // Empty if the key couldn't be had.
+    };
+
+    // Copies key |id|'s synthetic blob into |blob| for record |index|, waiting for the record
+    // that creates it or generating it from its characteristics.  Returns false if there is none.
+    bool GetKey(uint32_t id, size_t index, KeymasterKeyBlob* blob);
+    void SetKey(uint32_t id, const KeymasterKeyBlob& blob);
+
+    keymaster_error_t GenerateKey(const AuthorizationSet& description, KeymasterKeyBlob* blob);
+    keymaster_error_t ImportKey(const TraceRecord& record, KeymasterKeyBlob* blob);
+
+    template <typename Call> Result Timed(Call call) {
+        Result result;
+        auto start = std::chrono::steady_clock::now();
+        result.error = call();
+        result.latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - start)
+                                .count();
+        result.replayed = true;
+        return result;
+    }
+
+    const std::vector<TraceRecord>& records_;
+    PureSoftKeymasterContext* context_;  // Owned by keymaster_.
+    ConcurrentAndroidKeymaster keymaster_;
+
+    std::map<uint32_t, const AuthorizationSet*> characteristics_;
+    // Guards keys_.
+    std::mutex keys_mutex_;
+    std::condition_variable key_done_;
+    std::map<uint32_t, Key> keys_;
+};
+
+bool Replayer::GetKey(uint32_t id, size_t index, KeymasterKeyBlob* blob) {
+    std::unique_lock<std::mutex> lock(keys_mutex_);
+    Key& key = keys_[id];
+    if (key.creator < index) {
+        key_done_.wait(lock, [&] { return key.done; });
+    } else if (!key.done) {
+        // The trace uses the key before creating it, if it does at all.
+        auto found = characteristics_.find(id);
+        if (found != characteristics_.end()) {
+            GenerateKey(SyntheticKeyDescription(*found->second), &key.blob);
+        }
+        key.done = true;
+    }
+    if (!key.blob.key_material_size) return false;
+    *blob = key.blob;
+    return true;
+}
+
+void Replayer::SetKey(uint32_t id, const KeymasterKeyBlob& blob) {
+    std::lock_guard<std::mutex> lock(keys_mutex_);
+    Key& key = keys_[id];
+    key.blob = blob;
+    key.done = true;
+    key_done_.notify_all();
+}
+
+keymaster_error_t Replayer::GenerateKey(const AuthorizationSet& description,
+                                        KeymasterKeyBlob* blob) {
+    GenerateKeyRequest request(keymaster_.message_version());
+    request.key_description.Reinitialize(description);
+    GenerateKeyResponse response(keymaster_.message_version());
+    keymaster_.GenerateKey(request, &response);
+    if (response.error == KM_ERROR_OK) *blob = std::move(response.key_blob);
+    return response.error;
+}
+
+keymaster_error_t Replayer::ImportKey(const TraceRecord& record, KeymasterKeyBlob* blob) {
+    AuthorizationSet description = SyntheticKeyDescription(record.params);
+    keymaster_algorithm_t algorithm;
+    bool symmetric = description.GetTagValue(TAG_ALGORITHM, &algorithm) &&
+                     algorithm != KM_ALGORITHM_RSA && algorithm != KM_ALGORITHM_EC;
+    if (record.key_format != KM_KEY_FORMAT_RAW || !symmetric) {
+        return GenerateKey(description, blob);
+    }
+
+    std::vector<uint8_t> material(record.input_length);
+    for (auto& byte : material) byte = rand();
+    ImportKeyRequest request(keymaster_.message_version());
+    request.key_description.Reinitialize(description);
+    request.key_format = KM_KEY_FORMAT_RAW;
+    request.SetKeyMaterial(material.data(), material.size());
+    ImportKeyResponse response(keymaster_.message_version());
+    keymaster_.ImportKey(request, &response);
+    if (response.error == KM_ERROR_OK) *blob = std::move(response.key_blob);
+    return response.error;
+}
+
+Result Replayer::Replay(size_t index,
+                        std::map<uint32_t, keymaster_operation_handle_t>* operations) {
+    const TraceRecord& record = records_[index];
+    int32_t message_version = keymaster_.message_version();
+
+    KeymasterKeyBlob key_blob;
+    if (record.key_id && !GetKey(record.key_id, index, &key_blob)) {
+        // Whatever waits for the key this record would have created has to do without.
+        if (record.created_key_id) SetKey(record.created_key_id, KeymasterKeyBlob());
+        return {};
+    }
+    keymaster_operation_handle_t op_handle = 0;
+    if (record.command == UPDATE_OPERATION || record.command == FINISH_OPERATION ||
+        record.command == ABORT_OPERATION) {
+        auto found = operations->find(record.op_id);
+        if (found == operations->end()) return {};
+        op_handle = found->second;
+        if (record.command != UPDATE_OPERATION) operations->erase(found);
+    }
+    std::vector<uint8_t> input(record.input_length, 'a');
+
+    switch (record.command) {
+    case GENERATE_KEY:
+    case IMPORT_KEY: {
+        KeymasterKeyBlob created;
+        Result result = Timed([&] {
+            return record.command == GENERATE_KEY
+                       ? GenerateKey(SyntheticKeyDescription(record.params), &created)
+                       : ImportKey(record, &created);
+        });
+        if (record.created_key_id) SetKey(record.created_key_id, created);
+        return result;
+    }
+    case BEGIN_OPERATION: {
+        BeginOperationRequest request(message_version);
+        request.purpose = record.purpose;
+        request.SetKeyMaterial(key_blob);
+        request.additional_params.Reinitialize(record.params);
+        BeginOperationResponse response(message_version);
+        Result result = Timed([&] {
+            keymaster_.BeginOperation(request, &response);
+            return response.error;
+        });
+        if (response.error == KM_ERROR_OK) {
+            if (record.op_id) {
+                (*operations)[record.op_id] = response.op_handle;
+            } else {
+                AbortOperationRequest abort(message_version);
+                abort.op_handle = response.op_handle;
+                AbortOperationResponse abort_response(message_version);
+                keymaster_.AbortOperation(abort, &abort_response);
+            }
+        }
+        return result;
+    }
+    case UPDATE_OPERATION: {
+        UpdateOperationRequest request(message_version);
+        request.op_handle = op_handle;
+        request.additional_params.Reinitialize(record.params);
+        request.input.Reinitialize(input.data(), input.size());
+        UpdateOperationResponse response(message_version);
+        Result result = Timed([&] {
+            keymaster_.UpdateOperation(request, &response);
+            return response.error;
+        });
+        if (response.error != KM_ERROR_OK) operations->erase(record.op_id);
+        return result;
+    }
+    case FINISH_OPERATION: {
+        FinishOperationRequest request(message_version);
+        request.op_handle = op_handle;
+        request.additional_params.Reinitialize(record.params);
+        request.input.Reinitialize(input.data(), input.size());
+        FinishOperationResponse response(message_version);
+        return Timed([&] {
+            keymaster_.FinishOperation(request, &response);
+            return response.error;
+        });
+    }
+    case ABORT_OPERATION: {
+        AbortOperationRequest request(message_version);
+        request.op_handle = op_handle;
+        AbortOperationResponse response(message_version);
+        return Timed([&] {
+            keymaster_.AbortOperation(request, &response);
+            return response.error;
+        });
+    }
+    case ATTEST_KEY: {
+        AttestKeyRequest request(message_version);
+        request.SetKeyMaterial(key_blob);
+        request.attest_params.Reinitialize(record.params);
+        AttestKeyResponse response(message_version);
+        return Timed([&] {
+            keymaster_.AttestKey(request, &response);
+            return response.error;
+        });
+    }
+    case GET_KEY_CHARACTERISTICS: {
+        GetKeyCharacteristicsRequest request(message_version);
+        request.SetKeyMaterial(key_blob);
+        request.additional_params.Reinitialize(record.params);
+        GetKeyCharacteristicsResponse response(message_version);
+        return Timed([&] {
+            keymaster_.GetKeyCharacteristics(request, &response);
+            return response.error;
+        });
+    }
+    case EXPORT_KEY: {
+        ExportKeyRequest request(message_version);
+        request.SetKeyMaterial(key_blob);
+        request.key_format = record.key_format;
+        request.additional_params.Reinitialize(record.params);
+        ExportKeyResponse response(message_version);
+        return Timed([&] {
+            keymaster_.ExportKey(request, &response);
+            return response.error;
+        });
+    }
+    case UPGRADE_KEY: {
+        UpgradeKeyRequest request(message_version);
+        request.SetKeyMaterial(key_blob);
+        request.upgrade_params.Reinitialize(record.params);
+        UpgradeKeyResponse response(message_version);
+        Result result = Timed([&] {
+            keymaster_.UpgradeKey(request, &response);
+            return response.error;
+        });
+        if (record.created_key_id) {
+            // A key that needed no upgrade stands in for the upgraded one.
+            if (response.error == KM_ERROR_OK && response.upgraded_key.key_material_size) {
+                key_blob = KeymasterKeyBlob(response.upgraded_key);
+            }
+            SetKey(record.created_key_id, key_blob);
+        }
+        return result;
+    }
+    case DELETE_KEY: {
+        DeleteKeyRequest request(message_version);
+        request.SetKeyMaterial(key_blob);
+        DeleteKeyResponse response(message_version);
+        return Timed([&] {
+            keymaster_.DeleteKey(request, &response);
+            return response.error;
+        });
+    }
+    default:
+        return {};
+    }
+}
+
+void RunThread(Replayer* replayer, const std::vector<TraceRecord>& records,
+               const std::vector<size_t>& indices, double speed,
+               std::chrono::steady_clock::time_point start, std::vector<Result>* results) {
+    std::map<uint32_t, keymaster_operation_handle_t> operations;
+    for (size_t index : indices) {
+        if (speed > 0) {
+            std::this_thread::sleep_until(
+                start + std::chrono::microseconds(
+                            static_cast<uint64_t>(records[index].arrival_us / speed)));
+        }
+        (*results)[index] = replayer->Replay(index, &operations);
+    }
+}
+
+struct Summary {
+    size_t count = 0;
+    double p50_us = 0;
+    double p99_us = 0;
+};
+
+Summary Summarize(std::vector<uint64_t>* latencies_ns) {
+    Summary summary;
+    summary.count = latencies_ns->size();
+    if (latencies_ns->empty()) return summary;
+    std::sort(latencies_ns->begin(), latencies_ns->end());
+    auto percentile = [&](size_t per_cent) {
+        size_t index = std::min(latencies_ns->size() - 1, latencies_ns->size() * per_cent / 100);
+        return (*latencies_ns)[index] / 1000.0;
+    };
+    summary.p50_us = percentile(50);
+    summary.p99_us = percentile(99);
+    return summary;
+}
+
+// Reads what --save wrote: one "command count p50_us p99_us" line per command.
+bool ReadSummaries(const std::string& path, std::map<std::string, Summary>* summaries) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (!file) return false;
+    char name[32];
+    Summary summary;
+    while (fscanf(file, "%31s %zu %lf %lf", name, &summary.count, &summary.p50_us,
+                  &summary.p99_us) == 4) {
+        (*summaries)[name] = summary;
+    }
+    fclose(file);
+    return true;
+}
+
+double DeltaPercent(double value, double reference) {
+    return reference > 0 ? (value - reference) * 100 / reference : 0;
+}
+
+int Report(const Options& options, const std::vector<TraceRecord>& records,
+           const std::vector<Result>& results) {
+    std::map<std::string, Summary> baseline;
+    if (!options.baseline.empty() && !ReadSummaries(options.baseline, &baseline)) {
+        fprintf(stderr, "Can't read %s\n", options.baseline.c_str());
+        return 1;
+    }
+    FILE* save = nullptr;
+    if (!options.save.empty() && !(save = fopen(options.save.c_str(), "w"))) {
+        fprintf(stderr, "Can't write %s\n", options.save.c_str());
+        return 1;
+    }
+
+    const char* reference = options.baseline.empty() ? "recorded" : "baseline";
+    printf("%-10s %8s %8s %8s %10s %10s %10s %10s %8s\n", "command", "count", "skipped",
+           "diverged", "ref_p50_us", "ref_p99_us", "p50_us", "p99_us", "p50_delta");
+    for (uint32_t command = 0; command <= BATCH_VERIFY; ++command) {
+        const char* name = CommandName(static_cast<AndroidKeymasterCommand>(command));
+        if (!name) continue;
+        std::vector<uint64_t> recorded_ns, replayed_ns;
+        size_t skipped = 0, diverged = 0;
+        for (size_t i = 0; i < records.size(); ++i) {
+            if (records[i].command != command) continue;
+            recorded_ns.push_back(records[i].duration_us * 1000);
+            if (!results[i].replayed) {
+                ++skipped;
+                continue;
+            }
+            if (results[i].error != records[i].error) ++diverged;
+            replayed_ns.push_back(results[i].latency_ns);
+        }
+        if (recorded_ns.empty()) continue;
+
+        Summary replayed = Summarize(&replayed_ns);
+        Summary ref = Summarize(&recorded_ns);
+        if (!options.baseline.empty()) ref = baseline[name];
+        printf("%-10s %8zu %8zu %8zu %10.1f %10.1f %10.1f %10.1f %7.1f%%\n", name,
+               replayed.count, skipped, diverged, ref.p50_us, ref.p99_us, replayed.p50_us,
+               replayed.p99_us, DeltaPercent(replayed.p50_us, ref.p50_us));
+        if (save) {
+            fprintf(save, "%s %zu %.1f %.1f\n", name, replayed.count, replayed.p50_us,
+                    replayed.p99_us);
+        }
+    }
+    printf("\nDeltas are against the %s latencies.\n", reference);
+    if (save) fclose(save);
+    return 0;
+}
+
+int Main(int argc, char** argv) {
+    Options options;
+    if (!ParseOptions(argc, argv, &options)) {
+        fprintf(stderr,
+                "usage: %s [--threads=N] [--speed=X] [--baseline=FILE] [--save=FILE] TRACE\n",
+                argv[0]);
+        return 2;
+    }
+
+    std::ifstream file(options.trace, std::ios::binary);
+    std::vector<uint8_t> contents((std::istreambuf_iterator<char>(file)),
+                                  std::istreambuf_iterator<char>());
+    std::vector<TraceRecord> records;
+    if (!ReadRequestTrace(contents.data(), contents.size(), &records)) {
+        fprintf(stderr, "%s is not a complete trace; replaying the %zu records before the error\n",
+                options.trace.c_str(), records.size());
+    }
+    if (records.empty()) {
+        fprintf(stderr, "No records in %s\n", options.trace.c_str());
+        return 1;
+    }
+
+    // The operations of a thread stay on it, so their requests are replayed in order.
+    std::vector<std::vector<size_t>> indices(options.threads);
+    for (size_t i = 0; i < records.size(); ++i) {
+        size_t stream = records[i].op_id ? records[i].op_id : i;
+        indices[stream % options.threads].push_back(i);
+    }
+
+    // Generous, since operations the trace leaves open are never finished.
+    Replayer replayer(records, records[0].message_version, 64 * options.threads);
+    std::vector<Result> results(records.size());
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < options.threads; ++i) {
+        threads.emplace_back(RunThread, &replayer, std::cref(records), std::cref(indices[i]),
+                             options.speed, start, &results);
+    }
+    for (auto& thread : threads) thread.join();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    printf("%zu records, %zu threads, %.1f s (%.1f s recorded)\n\n", records.size(),
+           options.threads, elapsed.count(), records.back().arrival_us / 1e6);
+    return Report(options, records, results);
+}
+
+}  // namespace
+}  // namespace keymaster
+
+int main(int argc, char** argv) {
+    return keymaster::Main(argc, argv);
+}
@@ -0,0 +1,63 @@
+#!/bin/bash
+#
+# Copyright 2023 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Regenerates the PGO profile used by keymaster_pgo_defaults (see Android.bp):
+#
+#   tools/update_pgo_profile.sh [SECONDS_PER_MIX]
+#
+# Run from a lunched tree.  It builds keymaster_loadgen with the keymaster libraries instrumented,
+# runs each mix below, merges what they record and writes the result to
+# toolchain/pgo-profiles/keymaster/keymaster.profdata, to be uploaded in that project.  Change the
+# mixes when the real workload changes; the profile should follow it, not the other way round.
+
+set -euo pipefail
+
+: "${ANDROID_BUILD_TOP:?run source build/envsetup.sh and lunch first}"
+: "${ANDROID_HOST_OUT:?run source build/envsetup.sh and lunch first}"
+
+seconds="${1:-30}"
+mixes=(
+    # keymaster_loadgen's default, the representative operation mix.
+    "hmac:70,aes_gcm:20,ecdsa:10,generate:1,attest:1"
+    # Key creation, so GenerateKey and attestation are not left cold.
+    "generate:1,attest:1"
+)
+
+profile="${ANDROID_BUILD_TOP}/toolchain/pgo-profiles/keymaster/keymaster.profdata"
+soong_ui="${ANDROID_BUILD_TOP}/build/soong/soong_ui.bash"
+if [[ -z "${LLVM_PROFDATA:-}" ]]; then
+    llvm_base="$("${soong_ui}" --dumpvar-mode LLVM_PREBUILTS_BASE)"
+    llvm_version="$("${soong_ui}" --dumpvar-mode LLVM_PREBUILTS_VERSION)"
+    LLVM_PROFDATA="${ANDROID_BUILD_TOP}/${llvm_base}/linux-x86/${llvm_version}/bin/llvm-profdata"
+fi
+
+raw_dir="$(mktemp -d)"
+trap 'rm -rf "${raw_dir}"' EXIT
+
+ANDROID_PGO_INSTRUMENT=keymaster "${soong_ui}" --make-mode keymaster_loadgen
+
+for mix in "${mixes[@]}"; do
+    echo "Profiling ${mix} for ${seconds}s"
+    LLVM_PROFILE_FILE="${raw_dir}/keymaster-%p-%m.profraw" \
+        "${ANDROID_HOST_OUT}/bin/keymaster_loadgen" --seconds="${seconds}" --mix="${mix}"
+done
+
+mkdir -p "$(dirname "${profile}")"
+"${LLVM_PROFDATA}" merge --output="${profile}" "${raw_dir}"/*.profraw
+echo "Wrote ${profile}"
+
+# The instrumented objects are only good for profiling; rebuild so nothing ships them.
+"${soong_ui}" --make-mode keymaster_loadgen